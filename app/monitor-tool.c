@@ -16,16 +16,19 @@
 struct cmd {
     char *name;
     int (*handler) (int argc, char **argv);
+    int local;                  /* doesn't need the daemon */
 };
 
 static int add_server   (int, char **);
 static int del_server   (int, char **);
 static int list_servers (int, char **);
+static int process_stats (int, char **);
 
 static struct cmd cmdtab[] =  {
     { "add-server",     add_server  },
     { "del-server",     del_server  },
     { "list-servers",   list_servers  },
+    { "process-stats",  process_stats, 1 },
     { 0 },
 };
 
@@ -72,6 +75,7 @@ void usage()
 "  add-server       Add a chunk server\n"
 "  del-server       Delete a chunk server\n"
 "  list-servers     List current chunk servers\n"
+"  process-stats    Show CPU, memory, files and threads of server processes\n"
     ,stderr);
 }
 
@@ -129,11 +133,14 @@ int main (int argc, char *argv[])
     }
 
     c = getcmd (argv[1]);
-    if (c == NULL) {
+    if (c == NULL || c == (struct cmd *)-1) {
         usage();
         exit(1);
     }
 
+    if (c->local)
+        return c->handler (argc - 2, argv + 2) < 0 ? 1 : 0;
+
     client = ccnet_client_new ();
     if ( (ccnet_client_load_confdir(client, config_dir)) < 0 ) {
         fprintf (stderr, "Read config dir error\n");
@@ -222,3 +229,39 @@ static int list_servers (int argc, char **argv)
 
     return 0;
 }
+
+/*
+ * The stats seafile-controller writes on every process check, in the pids
+ * dir next to the ccnet config dir by default.
+ */
+static int process_stats (int argc, char **argv)
+{
+    char *path, *topdir, *contents = NULL;
+    GError *error = NULL;
+
+    if (argc > 1) {
+        fprintf (stderr, "monitor-tool process-stats [pids dir]\n");
+        return -1;
+    }
+
+    if (argc == 1) {
+        path = g_build_filename (argv[0], "process-stats.json", NULL);
+    } else {
+        topdir = g_path_get_dirname (config_dir);
+        path = g_build_filename (topdir, "pids", "process-stats.json", NULL);
+        g_free (topdir);
+    }
+
+    if (!g_file_get_contents (path, &contents, NULL, &error)) {
+        fprintf (stderr, "Failed to read %s: %s\n", path, error->message);
+        g_clear_error (&error);
+        g_free (path);
+        return -1;
+    }
+
+    printf ("%s", contents);
+
+    g_free (contents);
+    g_free (path);
+    return 0;
+}
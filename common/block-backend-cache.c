@@ -0,0 +1,1080 @@
+/* -*- Mode: C; tab-width: 4; indent-tabs-mode: nil; c-basic-offset: 4 -*- */
+
+#include "common.h"
+
+#include "utils.h"
+
+#include "log.h"
+
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <glib/gstdio.h>
+
+#include "block-backend.h"
+
+/*
+ * Block cache.
+ *
+ * Wraps the primary block backend and keeps copies of recently read
+ * blocks in a local directory, usually on a faster disk:
+ *
+ *   <cache_dir>/<store_id>/<block_id>
+ *
+ * Blocks are content addressed, so cached copies never change, but they
+ * may be removed from the primary backend by another process, e.g. GC,
+ * while they are cached. The in-memory index is only a hint: whether a
+ * block exists is always answered by the primary backend, and the
+ * cached copy of a block it doesn't have is dropped.
+ *
+ * Several processes (the server, sync workers, GC) may use the same
+ * cache dir. The byte budget is for the dir, whichever process cached
+ * the blocks: the bytes used are counted in USAGE_FILE, locked while
+ * it's updated. Each process evicts the least recently used blocks in
+ * its index, and rescans the dir every RESCAN_INTERVAL seconds to pick
+ * up the blocks the others added and removed. After a restart the
+ * cached blocks are reloaded oldest first.
+ *
+ * New blocks are either also written to the cache (write-through) or
+ * only cached once read (write-around).
+ */
+
+/* Larger blocks are always read from the primary backend. */
+#define MAX_CACHED_BLOCK_SIZE (64 * 1024 * 1024)
+
+#define USAGE_FILE ".usage"
+#define RESCAN_INTERVAL 60
+
+typedef struct CacheEntry {
+    char    *key;               /* <store_id>/<block_id> */
+    guint32  size;
+    GList   *lru_link;
+} CacheEntry;
+
+typedef struct {
+    BlockBackend    *primary;
+    char            *cache_dir;
+    gboolean         write_through;
+
+    GHashTable      *entries;
+    GQueue          *lru;       /* most recently used at the head */
+    guint64          bytes;     /* of the blocks in the index */
+    guint64          max_bytes;
+
+    int              usage_fd;
+    gint64           last_scan;
+
+    BlockCacheStats  stats;
+    pthread_mutex_t  lock;
+} CachePriv;
+
+struct _BHandle {
+    char    *store_id;
+    int     version;
+    char    block_id[41];
+    int     rw_type;
+
+    /* Handle of the primary backend, NULL if served from the cache. */
+    BHandle *inner;
+
+    /* Cached copy. */
+    int     fd;
+    guint32 size;
+
+    /* Content of a block being promoted or written through. */
+    GByteArray *buf;
+
+    guint64 bytes_read;
+};
+
+static char *
+entry_key (const char *store_id, const char *block_id)
+{
+    return g_strconcat (store_id, "/", block_id, NULL);
+}
+
+static void
+entry_free (CacheEntry *e)
+{
+    g_free (e->key);
+    g_free (e);
+}
+
+/*
+ * Lock USAGE_FILE and return the bytes used in the cache dir. Called
+ * with the lock held: fcntl locks don't exclude the threads of a process.
+ */
+static guint64
+usage_lock (CachePriv *priv)
+{
+    struct flock fl;
+    guint64 used = 0;
+
+    memset (&fl, 0, sizeof(fl));
+    fl.l_type = F_WRLCK;
+    fl.l_whence = SEEK_SET;
+    while (fcntl (priv->usage_fd, F_SETLKW, &fl) < 0 && errno == EINTR)
+        ;
+
+    if (pread (priv->usage_fd, &used, sizeof(used), 0) != sizeof(used))
+        used = 0;
+    return used;
+}
+
+static void
+usage_unlock (CachePriv *priv, guint64 used)
+{
+    struct flock fl;
+
+    if (pwrite (priv->usage_fd, &used, sizeof(used), 0) != sizeof(used))
+        seaf_warning ("[cache bend] Failed to update %s/%s: %s.\n",
+                      priv->cache_dir, USAGE_FILE, strerror(errno));
+
+    memset (&fl, 0, sizeof(fl));
+    fl.l_type = F_UNLCK;
+    fl.l_whence = SEEK_SET;
+    fcntl (priv->usage_fd, F_SETLK, &fl);
+}
+
+/*
+ * Remove the cached copy of @key and return @used less its size. Only
+ * the process whose unlink succeeds accounts for it. Called with the
+ * usage file locked.
+ */
+static guint64
+unlink_cached (CachePriv *priv, const char *key, guint64 used)
+{
+    char *path = g_build_filename (priv->cache_dir, key, NULL);
+    SeafStat st;
+
+    if (seaf_stat (path, &st) == 0 && g_unlink (path) == 0)
+        used = (used > (guint64)st.st_size) ? used - st.st_size : 0;
+    g_free (path);
+
+    return used;
+}
+
+/* Called with the lock held. */
+static void
+forget_entry (CachePriv *priv, CacheEntry *e)
+{
+    priv->bytes -= e->size;
+    g_queue_delete_link (priv->lru, e->lru_link);
+    g_hash_table_remove (priv->entries, e->key);
+}
+
+/*
+ * Make room for @need bytes in the cache dir, evicting the least
+ * recently used blocks, and account for them. Returns FALSE if there is
+ * no room, when the rest is used by blocks other processes cached after
+ * the last rescan. Called with the lock held.
+ */
+static gboolean
+reserve (CachePriv *priv, guint64 need)
+{
+    CacheEntry *e;
+    guint64 used;
+    gboolean ret = FALSE;
+
+    used = usage_lock (priv);
+
+    while (used + need > priv->max_bytes &&
+           (e = g_queue_peek_tail (priv->lru)) != NULL) {
+        used = unlink_cached (priv, e->key, used);
+        forget_entry (priv, e);
+        ++priv->stats.evictions;
+    }
+
+    if (used + need <= priv->max_bytes) {
+        used += need;
+        ret = TRUE;
+    }
+
+    usage_unlock (priv, used);
+    return ret;
+}
+
+/* Called with the lock held. */
+static void
+unreserve (CachePriv *priv, guint64 size)
+{
+    guint64 used = usage_lock (priv);
+
+    usage_unlock (priv, (used > size) ? used - size : 0);
+}
+
+/* Called with the lock held. Blocks found by a rescan are added as
+ * the least recently used ones.
+ */
+static void
+add_entry (CachePriv *priv, char *key, guint32 size, gboolean recent)
+{
+    CacheEntry *e = g_new0 (CacheEntry, 1);
+
+    e->key = key;
+    e->size = size;
+    if (recent) {
+        g_queue_push_head (priv->lru, e);
+        e->lru_link = g_queue_peek_head_link (priv->lru);
+    } else {
+        g_queue_push_tail (priv->lru, e);
+        e->lru_link = g_queue_peek_tail_link (priv->lru);
+    }
+    g_hash_table_insert (priv->entries, e->key, e);
+    priv->bytes += size;
+}
+
+/* Returns the size of the cached block and marks it recently used,
+ * or -1 if it's not cached.
+ */
+static gint64
+lookup_entry (CachePriv *priv, const char *store_id, const char *block_id)
+{
+    char *key = entry_key (store_id, block_id);
+    CacheEntry *e;
+    gint64 size = -1;
+
+    pthread_mutex_lock (&priv->lock);
+    e = g_hash_table_lookup (priv->entries, key);
+    if (e) {
+        g_queue_unlink (priv->lru, e->lru_link);
+        g_queue_push_head_link (priv->lru, e->lru_link);
+        size = e->size;
+    }
+    pthread_mutex_unlock (&priv->lock);
+
+    g_free (key);
+    return size;
+}
+
+/*
+ * Remove the cached copy of a block. Unless @force, only if it's in
+ * the index, so that checking blocks that were never cached is cheap.
+ * Blocks removed from the primary backend are dropped with @force, as
+ * another process may have cached them.
+ */
+static void
+drop_entry (CachePriv *priv, const char *store_id, const char *block_id,
+            gboolean force)
+{
+    char *key = entry_key (store_id, block_id);
+    CacheEntry *e;
+
+    pthread_mutex_lock (&priv->lock);
+    e = g_hash_table_lookup (priv->entries, key);
+    if (e || force) {
+        usage_unlock (priv, unlink_cached (priv, key, usage_lock (priv)));
+        if (e)
+            forget_entry (priv, e);
+    }
+    pthread_mutex_unlock (&priv->lock);
+
+    g_free (key);
+}
+
+typedef struct ScannedBlock {
+    char    *key;
+    guint32  size;
+    gint64   mtime;
+} ScannedBlock;
+
+static gint
+cmp_scanned (gconstpointer a, gconstpointer b)
+{
+    const ScannedBlock *sa = a, *sb = b;
+
+    return (sa->mtime > sb->mtime) - (sa->mtime < sb->mtime);
+}
+
+/* The blocks in the cache dir, oldest first. */
+static GList *
+scan_cache (CachePriv *priv)
+{
+    GDir *top, *dir;
+    const char *store_id, *dname;
+    char *dir_path, *path;
+    GList *blocks = NULL;
+    ScannedBlock *b;
+    SeafStat st;
+
+    top = g_dir_open (priv->cache_dir, 0, NULL);
+    if (!top)
+        return NULL;
+
+    while ((store_id = g_dir_read_name (top)) != NULL) {
+        if (store_id[0] == '.')
+            continue;
+
+        dir_path = g_build_filename (priv->cache_dir, store_id, NULL);
+        dir = g_dir_open (dir_path, 0, NULL);
+        if (!dir) {
+            g_free (dir_path);
+            continue;
+        }
+
+        while ((dname = g_dir_read_name (dir)) != NULL) {
+            if (dname[0] == '.' || strlen (dname) != 40)
+                continue;
+            path = g_build_filename (dir_path, dname, NULL);
+            if (seaf_stat (path, &st) == 0) {
+                b = g_new0 (ScannedBlock, 1);
+                b->key = entry_key (store_id, dname);
+                b->size = (guint32)st.st_size;
+                b->mtime = st.st_mtime;
+                blocks = g_list_prepend (blocks, b);
+            }
+            g_free (path);
+        }
+
+        g_dir_close (dir);
+        g_free (dir_path);
+    }
+    g_dir_close (top);
+
+    return g_list_sort (blocks, cmp_scanned);
+}
+
+/*
+ * Remove the temporary files left over by interrupted inserts. Recent
+ * ones may be inserts in progress in other processes.
+ */
+static void
+remove_tmp_files (CachePriv *priv)
+{
+    GDir *top, *dir;
+    const char *store_id, *dname;
+    char *dir_path, *path;
+    gint64 now = (gint64)time (NULL);
+    SeafStat st;
+
+    top = g_dir_open (priv->cache_dir, 0, NULL);
+    if (!top)
+        return;
+
+    while ((store_id = g_dir_read_name (top)) != NULL) {
+        if (store_id[0] == '.')
+            continue;
+
+        dir_path = g_build_filename (priv->cache_dir, store_id, NULL);
+        dir = g_dir_open (dir_path, 0, NULL);
+        if (!dir) {
+            g_free (dir_path);
+            continue;
+        }
+
+        while ((dname = g_dir_read_name (dir)) != NULL) {
+            if (dname[0] != '.')
+                continue;
+            path = g_build_filename (dir_path, dname, NULL);
+            if (seaf_stat (path, &st) == 0 && now - st.st_mtime > 3600)
+                g_unlink (path);
+            g_free (path);
+        }
+
+        g_dir_close (dir);
+        g_free (dir_path);
+    }
+    g_dir_close (top);
+}
+
+/*
+ * Bring the index in line with the cache dir: forget the blocks other
+ * processes removed and add the ones they cached. The usage is reset to
+ * what was found, which also corrects the count after a process died
+ * while caching a block.
+ */
+static void
+sync_index (CachePriv *priv)
+{
+    GList *blocks, *ptr, *next;
+    GHashTable *on_disk;
+    ScannedBlock *b;
+    CacheEntry *e;
+    guint64 total = 0;
+
+    blocks = scan_cache (priv);
+    on_disk = g_hash_table_new (g_str_hash, g_str_equal);
+    for (ptr = blocks; ptr; ptr = ptr->next) {
+        b = ptr->data;
+        g_hash_table_insert (on_disk, b->key, b);
+    }
+
+    pthread_mutex_lock (&priv->lock);
+
+    for (ptr = priv->lru->head; ptr; ptr = next) {
+        next = ptr->next;
+        e = ptr->data;
+        if (!g_hash_table_lookup (on_disk, e->key))
+            forget_entry (priv, e);
+    }
+
+    /* Newest first, so the oldest end up at the tail. */
+    for (ptr = g_list_last (blocks); ptr; ptr = ptr->prev) {
+        b = ptr->data;
+        total += b->size;
+        if (!g_hash_table_lookup (priv->entries, b->key)) {
+            add_entry (priv, b->key, b->size, FALSE);
+            b->key = NULL;
+        }
+    }
+
+    usage_lock (priv);
+    usage_unlock (priv, total);
+
+    /* Over budget if it was lowered since the blocks were cached. */
+    reserve (priv, 0);
+
+    priv->last_scan = (gint64)time (NULL);
+    pthread_mutex_unlock (&priv->lock);
+
+    g_hash_table_destroy (on_disk);
+    for (ptr = blocks; ptr; ptr = ptr->next) {
+        b = ptr->data;
+        g_free (b->key);
+        g_free (b);
+    }
+    g_list_free (blocks);
+}
+
+static void
+maybe_rescan (CachePriv *priv)
+{
+    gint64 now = (gint64)time (NULL);
+    gboolean due;
+
+    pthread_mutex_lock (&priv->lock);
+    due = (now - priv->last_scan >= RESCAN_INTERVAL);
+    if (due)
+        priv->last_scan = now;
+    pthread_mutex_unlock (&priv->lock);
+
+    if (due)
+        sync_index (priv);
+}
+
+/* The cache is only a copy, so nothing is synced to disk here. */
+static void
+insert_block (CachePriv *priv, const char *store_id, const char *block_id,
+              const guint8 *data, guint32 len)
+{
+    char *dir = NULL, *tmp_path = NULL, *path = NULL;
+    char *key;
+    int fd = -1;
+    int rc;
+
+    if (len > priv->max_bytes)
+        return;
+
+    maybe_rescan (priv);
+
+    key = entry_key (store_id, block_id);
+
+    pthread_mutex_lock (&priv->lock);
+    if (g_hash_table_lookup (priv->entries, key)) {
+        pthread_mutex_unlock (&priv->lock);
+        g_free (key);
+        return;
+    }
+    pthread_mutex_unlock (&priv->lock);
+
+    dir = g_build_filename (priv->cache_dir, store_id, NULL);
+    if (checkdir_with_mkdir (dir) < 0)
+        goto error;
+
+    tmp_path = g_strdup_printf ("%s/.%s.XXXXXX", dir, block_id);
+    fd = g_mkstemp (tmp_path);
+    if (fd < 0)
+        goto error;
+
+    if (writen (fd, data, len) != (ssize_t)len) {
+        close (fd);
+        g_unlink (tmp_path);
+        goto error;
+    }
+    close (fd);
+
+    path = g_build_filename (priv->cache_dir, key, NULL);
+
+    /*
+     * Linked rather than renamed into place, so a block another process
+     * cached meanwhile isn't replaced and counted twice.
+     */
+    pthread_mutex_lock (&priv->lock);
+    if (g_hash_table_lookup (priv->entries, key) || !reserve (priv, len)) {
+        /* Added by another thread meanwhile, or no room. */
+        pthread_mutex_unlock (&priv->lock);
+        g_unlink (tmp_path);
+        g_free (key);
+        goto out;
+    }
+
+    rc = link (tmp_path, path);
+    if (rc < 0 && errno == EEXIST) {
+        /* Cached by another process, with the same content. */
+        unreserve (priv, len);
+        rc = 0;
+    } else if (rc < 0) {
+        int saved_errno = errno;
+        unreserve (priv, len);
+        errno = saved_errno;
+    }
+    if (rc == 0) {
+        add_entry (priv, key, len, TRUE);
+        key = NULL;
+    }
+    pthread_mutex_unlock (&priv->lock);
+
+    if (rc < 0) {
+        int saved_errno = errno;
+        g_unlink (tmp_path);
+        errno = saved_errno;
+        goto error;
+    }
+    g_unlink (tmp_path);
+
+out:
+    g_free (dir);
+    g_free (tmp_path);
+    g_free (path);
+    return;
+
+error:
+    seaf_warning ("[cache bend] Failed to cache block %s: %s.\n",
+                  block_id, strerror(errno));
+    g_free (key);
+    g_free (dir);
+    g_free (tmp_path);
+    g_free (path);
+}
+
+static BHandle *
+block_backend_cache_open_block (BlockBackend *bend,
+                                const char *store_id,
+                                int version,
+                                const char *block_id,
+                                int rw_type)
+{
+    CachePriv *priv = bend->be_priv;
+    BHandle *handle, *inner = NULL;
+    BMetadata *md;
+    gint64 size = -1;
+    int fd = -1;
+
+    g_return_val_if_fail (block_id != NULL, NULL);
+    g_return_val_if_fail (strlen(block_id) == 40, NULL);
+    g_return_val_if_fail (rw_type == BLOCK_READ || rw_type == BLOCK_WRITE, NULL);
+
+    if (rw_type == BLOCK_READ) {
+        size = lookup_entry (priv, store_id, block_id);
+        if (size >= 0) {
+            char *path = g_build_filename (priv->cache_dir, store_id,
+                                           block_id, NULL);
+            fd = g_open (path, O_RDONLY | O_BINARY, 0);
+            g_free (path);
+
+            /* Removed behind our back, e.g. by another process. */
+            if (fd < 0)
+                drop_entry (priv, store_id, block_id, FALSE);
+        }
+    }
+
+    if (fd < 0) {
+        inner = priv->primary->open_block (priv->primary, store_id, version,
+                                           block_id, rw_type);
+        if (!inner)
+            return NULL;
+    }
+
+    handle = g_new0 (BHandle, 1);
+    memcpy (handle->block_id, block_id, 41);
+    handle->rw_type = rw_type;
+    if (store_id)
+        handle->store_id = g_strdup(store_id);
+    handle->version = version;
+    handle->inner = inner;
+    handle->fd = fd;
+
+    if (fd >= 0) {
+        handle->size = (guint32)size;
+        pthread_mutex_lock (&priv->lock);
+        ++priv->stats.hits;
+        pthread_mutex_unlock (&priv->lock);
+        return handle;
+    }
+
+    if (rw_type == BLOCK_READ) {
+        pthread_mutex_lock (&priv->lock);
+        ++priv->stats.misses;
+        pthread_mutex_unlock (&priv->lock);
+
+        /* Promote the block if it's read to the end. */
+        md = priv->primary->stat_block_by_handle (priv->primary, inner);
+        if (md && md->size <= MAX_CACHED_BLOCK_SIZE) {
+            handle->size = md->size;
+            handle->buf = g_byte_array_sized_new (md->size);
+        }
+        g_free (md);
+    } else if (priv->write_through) {
+        handle->buf = g_byte_array_new ();
+    }
+
+    return handle;
+}
+
+static int
+block_backend_cache_read_block (BlockBackend *bend,
+                                BHandle *handle,
+                                void *buf, int len)
+{
+    CachePriv *priv = bend->be_priv;
+    int n;
+
+    if (!handle->inner) {
+        n = readn (handle->fd, buf, len);
+        if (n > 0)
+            handle->bytes_read += n;
+        return n;
+    }
+
+    n = priv->primary->read_block (priv->primary, handle->inner, buf, len);
+    if (n > 0) {
+        handle->bytes_read += n;
+        if (handle->buf)
+            g_byte_array_append (handle->buf, buf, n);
+    } else if (n < 0 && handle->buf) {
+        g_byte_array_free (handle->buf, TRUE);
+        handle->buf = NULL;
+    }
+
+    return n;
+}
+
+static int
+block_backend_cache_write_block (BlockBackend *bend,
+                                 BHandle *handle,
+                                 const void *buf, int len)
+{
+    CachePriv *priv = bend->be_priv;
+    int n;
+
+    n = priv->primary->write_block (priv->primary, handle->inner, buf, len);
+    if (n > 0 && handle->buf)
+        g_byte_array_append (handle->buf, buf, n);
+
+    return n;
+}
+
+static int
+block_backend_cache_commit_block (BlockBackend *bend,
+                                  BHandle *handle)
+{
+    CachePriv *priv = bend->be_priv;
+    int ret;
+
+    ret = priv->primary->commit_block (priv->primary, handle->inner);
+
+    if (ret == 0 && handle->buf) {
+        insert_block (priv, handle->store_id, handle->block_id,
+                      handle->buf->data, handle->buf->len);
+        g_byte_array_free (handle->buf, TRUE);
+        handle->buf = NULL;
+    }
+
+    return ret;
+}
+
+static int
+block_backend_cache_close_block (BlockBackend *bend,
+                                 BHandle *handle)
+{
+    CachePriv *priv = bend->be_priv;
+    int ret = 0;
+
+    if (!handle->inner) {
+        if (handle->fd >= 0) {
+            ret = close (handle->fd);
+            handle->fd = -1;
+        }
+        return ret;
+    }
+
+    if (handle->rw_type == BLOCK_READ && handle->buf &&
+        handle->buf->len == handle->size) {
+        insert_block (priv, handle->store_id, handle->block_id,
+                      handle->buf->data, handle->buf->len);
+        g_byte_array_free (handle->buf, TRUE);
+        handle->buf = NULL;
+    }
+
+    return priv->primary->close_block (priv->primary, handle->inner);
+}
+
+static void
+block_backend_cache_block_handle_free (BlockBackend *bend,
+                                       BHandle *handle)
+{
+    CachePriv *priv = bend->be_priv;
+
+    if (handle->rw_type == BLOCK_READ) {
+        pthread_mutex_lock (&priv->lock);
+        if (handle->inner)
+            priv->stats.primary_bytes += handle->bytes_read;
+        else
+            priv->stats.cache_bytes += handle->bytes_read;
+        pthread_mutex_unlock (&priv->lock);
+    }
+
+    if (handle->fd >= 0)
+        close (handle->fd);
+    if (handle->inner)
+        priv->primary->block_handle_free (priv->primary, handle->inner);
+    if (handle->buf)
+        g_byte_array_free (handle->buf, TRUE);
+    g_free (handle->store_id);
+    g_free (handle);
+}
+
+/*
+ * Answered by the primary backend: a block may be cached by this process
+ * after another one removed it. Saying it exists when it doesn't would
+ * let clients skip uploading it.
+ */
+static gboolean
+block_backend_cache_block_exists (BlockBackend *bend,
+                                  const char *store_id,
+                                  int version,
+                                  const char *block_sha1)
+{
+    CachePriv *priv = bend->be_priv;
+
+    if (priv->primary->exists (priv->primary, store_id, version, block_sha1))
+        return TRUE;
+
+    drop_entry (priv, store_id, block_sha1, FALSE);
+    return FALSE;
+}
+
+static int
+block_backend_cache_exists_batch (BlockBackend *bend,
+                                  const char *store_id,
+                                  int version,
+                                  const char **block_ids,
+                                  int n,
+                                  gboolean *exists)
+{
+    CachePriv *priv = bend->be_priv;
+
+    return priv->primary->exists_batch (priv->primary, store_id, version,
+                                        block_ids, n, exists);
+}
+
+static int
+block_backend_cache_remove_block (BlockBackend *bend,
+                                  const char *store_id,
+                                  int version,
+                                  const char *block_id)
+{
+    CachePriv *priv = bend->be_priv;
+
+    drop_entry (priv, store_id, block_id, TRUE);
+
+    return priv->primary->remove_block (priv->primary, store_id, version,
+                                        block_id);
+}
+
+/* Answered by the primary backend, like block_backend_cache_block_exists(). */
+static BMetadata *
+block_backend_cache_stat_block (BlockBackend *bend,
+                                const char *store_id,
+                                int version,
+                                const char *block_id)
+{
+    CachePriv *priv = bend->be_priv;
+    BMetadata *block_md;
+
+    block_md = priv->primary->stat_block (priv->primary, store_id, version,
+                                          block_id);
+    if (!block_md)
+        drop_entry (priv, store_id, block_id, FALSE);
+
+    return block_md;
+}
+
+static BMetadata *
+block_backend_cache_stat_block_by_handle (BlockBackend *bend,
+                                          BHandle *handle)
+{
+    CachePriv *priv = bend->be_priv;
+    BMetadata *block_md;
+
+    if (handle->inner)
+        return priv->primary->stat_block_by_handle (priv->primary,
+                                                    handle->inner);
+
+    block_md = g_new0 (BMetadata, 1);
+    memcpy (block_md->id, handle->block_id, 40);
+    block_md->size = handle->size;
+
+    return block_md;
+}
+
+static int
+block_backend_cache_get_block_fd (BlockBackend *bend,
+                                  BHandle *handle,
+                                  guint32 *size)
+{
+    CachePriv *priv = bend->be_priv;
+    int fd;
+
+    if (handle->rw_type != BLOCK_READ)
+        return -1;
+
+    if (handle->inner) {
+        /* A block being promoted has to be read through us. */
+        if (handle->buf || !priv->primary->get_block_fd)
+            return -1;
+        return priv->primary->get_block_fd (priv->primary, handle->inner,
+                                            size);
+    }
+
+    fd = dup (handle->fd);
+    if (fd < 0)
+        return -1;
+
+    *size = handle->size;
+    return fd;
+}
+
+/*
+ * A cached block is read ahead from the cache dir. Others are read ahead
+ * by the primary backend if it can, or read from it and promoted, which
+ * is what a later read would do.
+ */
+static gint64
+block_backend_cache_prefetch (BlockBackend *bend,
+                              const char *store_id,
+                              int version,
+                              const char *block_id)
+{
+    CachePriv *priv = bend->be_priv;
+    BHandle *handle;
+    char buf[64 * 1024];
+    gint64 size;
+    int n;
+
+    size = lookup_entry (priv, store_id, block_id);
+    if (size >= 0) {
+#ifdef POSIX_FADV_WILLNEED
+        char *path = g_build_filename (priv->cache_dir, store_id, block_id, NULL);
+        int fd = g_open (path, O_RDONLY | O_BINARY, 0);
+        g_free (path);
+        if (fd >= 0) {
+            posix_fadvise (fd, 0, size, POSIX_FADV_WILLNEED);
+            close (fd);
+        }
+#endif
+        return size;
+    }
+
+    if (priv->primary->prefetch)
+        return priv->primary->prefetch (priv->primary, store_id, version, block_id);
+
+    handle = block_backend_cache_open_block (bend, store_id, version,
+                                             block_id, BLOCK_READ);
+    if (!handle)
+        return -1;
+
+    size = 0;
+    while ((n = block_backend_cache_read_block (bend, handle, buf, sizeof(buf))) > 0)
+        size += n;
+    block_backend_cache_close_block (bend, handle);
+    block_backend_cache_block_handle_free (bend, handle);
+
+    return (n < 0) ? -1 : size;
+}
+
+static int
+block_backend_cache_foreach_block (BlockBackend *bend,
+                                   const char *store_id,
+                                   int version,
+                                   SeafBlockFunc process,
+                                   void *user_data)
+{
+    CachePriv *priv = bend->be_priv;
+
+    return priv->primary->foreach_block (priv->primary, store_id, version,
+                                         process, user_data);
+}
+
+static int
+block_backend_cache_foreach_block_batch (BlockBackend *bend,
+                                         const char *store_id,
+                                         int version,
+                                         const char *start_prefix,
+                                         SeafBlockBatchFunc process,
+                                         void *user_data)
+{
+    CachePriv *priv = bend->be_priv;
+
+    return priv->primary->foreach_block_batch (priv->primary, store_id,
+                                               version, start_prefix,
+                                               process, user_data);
+}
+
+static int
+block_backend_cache_copy (BlockBackend *bend,
+                          const char *src_store_id,
+                          int src_version,
+                          const char *dst_store_id,
+                          int dst_version,
+                          const char *block_id)
+{
+    CachePriv *priv = bend->be_priv;
+
+    return priv->primary->copy (priv->primary, src_store_id, src_version,
+                                dst_store_id, dst_version, block_id);
+}
+
+static int
+block_backend_cache_remove_store (BlockBackend *bend, const char *store_id)
+{
+    CachePriv *priv = bend->be_priv;
+    char *prefix = g_strconcat (store_id, "/", NULL);
+    size_t prefix_len = strlen (prefix);
+    GList *ptr, *next;
+    CacheEntry *e;
+    char *dir, *key;
+    GDir *d;
+    const char *dname;
+    guint64 used;
+
+    dir = g_build_filename (priv->cache_dir, store_id, NULL);
+
+    pthread_mutex_lock (&priv->lock);
+    for (ptr = priv->lru->head; ptr; ptr = next) {
+        next = ptr->next;
+        e = ptr->data;
+        if (strncmp (e->key, prefix, prefix_len) == 0)
+            forget_entry (priv, e);
+    }
+
+    /* Including the blocks other processes cached. */
+    d = g_dir_open (dir, 0, NULL);
+    if (d) {
+        used = usage_lock (priv);
+        while ((dname = g_dir_read_name (d)) != NULL) {
+            if (dname[0] == '.')
+                continue;
+            key = entry_key (store_id, dname);
+            used = unlink_cached (priv, key, used);
+            g_free (key);
+        }
+        usage_unlock (priv, used);
+        g_dir_close (d);
+    }
+    pthread_mutex_unlock (&priv->lock);
+
+    g_rmdir (dir);
+    g_free (dir);
+    g_free (prefix);
+
+    return priv->primary->remove_store (priv->primary, store_id);
+}
+
+static int
+block_backend_cache_compact (BlockBackend *bend, const char *store_id)
+{
+    CachePriv *priv = bend->be_priv;
+
+    return priv->primary->compact (priv->primary, store_id);
+}
+
+void
+block_backend_cache_get_stats (BlockBackend *bend, BlockCacheStats *stats)
+{
+    CachePriv *priv = bend->be_priv;
+
+    pthread_mutex_lock (&priv->lock);
+    *stats = priv->stats;
+    stats->entries = g_hash_table_size (priv->entries);
+    stats->bytes = usage_lock (priv);
+    usage_unlock (priv, stats->bytes);
+    stats->max_bytes = priv->max_bytes;
+    pthread_mutex_unlock (&priv->lock);
+}
+
+BlockBackend *
+block_backend_cache_new (BlockBackend *primary,
+                         const char *cache_dir,
+                         guint64 max_bytes,
+                         gboolean write_through)
+{
+    BlockBackend *bend;
+    CachePriv *priv;
+    char *usage_path;
+
+    bend = g_new0(BlockBackend, 1);
+    priv = g_new0(CachePriv, 1);
+    bend->be_priv = priv;
+
+    priv->primary = primary;
+    priv->cache_dir = g_strdup (cache_dir);
+    priv->write_through = write_through;
+    priv->max_bytes = max_bytes;
+    priv->entries = g_hash_table_new_full (g_str_hash, g_str_equal,
+                                           NULL, (GDestroyNotify)entry_free);
+    priv->lru = g_queue_new ();
+    priv->usage_fd = -1;
+    pthread_mutex_init (&priv->lock, NULL);
+
+    if (g_mkdir_with_parents (priv->cache_dir, 0777) < 0) {
+        seaf_warning ("Block cache dir %s does not exist and"
+                      " is unable to create\n", priv->cache_dir);
+        goto onerror;
+    }
+
+    usage_path = g_build_filename (priv->cache_dir, USAGE_FILE, NULL);
+    priv->usage_fd = g_open (usage_path, O_RDWR | O_CREAT | O_BINARY, 0666);
+    if (priv->usage_fd < 0) {
+        seaf_warning ("Failed to open %s: %s.\n", usage_path, strerror(errno));
+        g_free (usage_path);
+        goto onerror;
+    }
+    g_free (usage_path);
+
+    remove_tmp_files (priv);
+    sync_index (priv);
+
+    bend->open_block = block_backend_cache_open_block;
+    bend->read_block = block_backend_cache_read_block;
+    bend->write_block = block_backend_cache_write_block;
+    bend->commit_block = block_backend_cache_commit_block;
+    bend->close_block = block_backend_cache_close_block;
+    bend->exists = block_backend_cache_block_exists;
+    if (primary->exists_batch)
+        bend->exists_batch = block_backend_cache_exists_batch;
+    bend->remove_block = block_backend_cache_remove_block;
+    bend->stat_block = block_backend_cache_stat_block;
+    bend->stat_block_by_handle = block_backend_cache_stat_block_by_handle;
+    bend->get_block_fd = block_backend_cache_get_block_fd;
+    bend->prefetch = block_backend_cache_prefetch;
+    bend->block_handle_free = block_backend_cache_block_handle_free;
+    bend->foreach_block = block_backend_cache_foreach_block;
+    if (primary->foreach_block_batch)
+        bend->foreach_block_batch = block_backend_cache_foreach_block_batch;
+    bend->remove_store = block_backend_cache_remove_store;
+    bend->copy = block_backend_cache_copy;
+    if (primary->compact)
+        bend->compact = block_backend_cache_compact;
+
+    return bend;
+
+onerror:
+    g_hash_table_destroy (priv->entries);
+    g_queue_free (priv->lru);
+    g_free (priv->cache_dir);
+    g_free (priv);
+    g_free (bend);
+
+    return NULL;
+}
@@ -13,9 +13,12 @@
 #include <sys/stat.h>
 #include <fcntl.h>
 #include <dirent.h>
+#include <zlib.h>
+#include <pthread.h>
 
 #include "block-backend.h"
 #include "obj-store.h"
+#include "seaf-sha1.h"
 
 
 struct _BHandle {
@@ -25,6 +28,23 @@ struct _BHandle {
     int     fd;
     int     rw_type;
     char    *tmp_file;
+
+    /* Write: the block is collected here and compressed on close. */
+    GByteArray *wbuf;
+
+    /* Read: set if the block is stored compressed. The content is
+     * decompressed on the first read.
+     */
+    gboolean compressed;
+    guint32  size;
+    char    *rbuf;
+    guint32  rbuf_off;
+
+    /* Write, with dedup: the hash of the content, which must match the
+     * block id for the block to go into the pool.
+     */
+    SeafSHA1Ctx *sha1_ctx;
+    gboolean     verified;
 };
 
 typedef struct {
@@ -34,8 +54,48 @@ typedef struct {
     int            block_dir_len;
     char          *tmp_dir;
     int            tmp_dir_len;
+    /* zlib level for new blocks, 0 to store them raw. */
+    int            compress_level;
+
+    /* Blocks shared by all stores, see block_backend_fs_set_dedup(). */
+    gboolean       dedup;
+    char          *pool_dir;
+    pthread_mutex_t stats_lock;
+    guint64        linked_blocks;
+    guint64        linked_bytes;
 } FsPriv;
 
+/*
+ * Compressed blocks.
+ *
+ * A compressed block starts with this header, followed by the compressed
+ * content. Blocks without it are raw, so both kinds can live in the same
+ * store, and turning compression on or off never requires rewriting blocks.
+ * The header carries the block id. A raw block can't be mistaken for a
+ * compressed one, since its content would have to contain its own SHA1.
+ */
+
+#define BLOCK_HEADER_MAGIC "SFZB"
+
+#define BLOCK_CODEC_ZLIB 1
+
+typedef struct BlockHeader {
+    char    magic[4];
+    guint8  codec;
+    guint8  reserved[3];
+    guint32 size;               /* logical size, little endian */
+    guint8  block_id[20];
+} __attribute__((gcc_struct, __packed__)) BlockHeader;
+
+/* Only compress a block if it gets at least this much smaller, so that
+ * incompressible blocks, e.g. of encrypted repos, don't pay for
+ * decompression on every read.
+ */
+#define MIN_COMPRESS_SAVING(len) ((len) / 8)
+
+/* Size of the sample compressed to decide whether a block is worth it. */
+#define COMPRESS_SAMPLE_SIZE (64 * 1024)
+
 static char *
 get_block_path (BlockBackend *bend,
                 const char *block_sha1,
@@ -48,6 +108,67 @@ open_tmp_file (BlockBackend *bend,
                const char *basename,
                char **path);
 
+static char *
+get_pool_path (FsPriv *priv, const char *block_id, char path[]);
+
+/* Check whether the block open at @fd is compressed. If it is, its logical
+ * size is returned in @size and @fd is left after the header. Otherwise
+ * @fd is rewound.
+ */
+static gboolean
+read_block_header (int fd, const char *block_id, guint32 *size)
+{
+    BlockHeader hdr;
+    guint8 id[20];
+
+    if (readn (fd, &hdr, sizeof(hdr)) == sizeof(hdr) &&
+        memcmp (hdr.magic, BLOCK_HEADER_MAGIC, 4) == 0 &&
+        hdr.codec == BLOCK_CODEC_ZLIB) {
+        hex_to_rawdata (block_id, id, 20);
+        if (memcmp (hdr.block_id, id, 20) == 0) {
+            *size = GUINT32_FROM_LE (hdr.size);
+            return TRUE;
+        }
+    }
+
+    lseek (fd, 0, SEEK_SET);
+    return FALSE;
+}
+
+/* Read and decompress the rest of a compressed block. */
+static int
+load_compressed_block (BHandle *handle)
+{
+    SeafStat st;
+    char *data;
+    int len;
+    uLongf out_len = handle->size;
+    int ret = 0;
+
+    if (seaf_fstat (handle->fd, &st) < 0)
+        return -1;
+    len = (int)(st.st_size - sizeof(BlockHeader));
+    if (len < 0)
+        return -1;
+
+    data = g_malloc (len);
+    handle->rbuf = g_malloc (handle->size + 1);
+
+    if (readn (handle->fd, data, len) != len ||
+        uncompress ((Bytef *)handle->rbuf, &out_len,
+                    (Bytef *)data, len) != Z_OK ||
+        out_len != handle->size) {
+        seaf_warning ("[block bend] failed to decompress block %s.\n",
+                      handle->block_id);
+        g_free (handle->rbuf);
+        handle->rbuf = NULL;
+        ret = -1;
+    }
+
+    g_free (data);
+    return ret;
+}
+
 static BHandle *
 block_backend_fs_open_block (BlockBackend *bend,
                              const char *store_id,
@@ -85,8 +206,17 @@ block_backend_fs_open_block (BlockBackend *bend,
     handle->fd = fd;
     memcpy (handle->block_id, block_id, 41);
     handle->rw_type = rw_type;
-    if (rw_type == BLOCK_WRITE)
+    if (rw_type == BLOCK_WRITE) {
         handle->tmp_file = tmp_file;
+        if (((FsPriv *)bend->be_priv)->compress_level > 0)
+            handle->wbuf = g_byte_array_new ();
+        if (((FsPriv *)bend->be_priv)->dedup && version > 0) {
+            handle->sha1_ctx = g_new (SeafSHA1Ctx, 1);
+            seaf_sha1_init (handle->sha1_ctx);
+        }
+    } else {
+        handle->compressed = read_block_header (fd, block_id, &handle->size);
+    }
     if (store_id)
         handle->store_id = g_strdup(store_id);
     handle->version = version;
@@ -99,7 +229,18 @@ block_backend_fs_read_block (BlockBackend *bend,
                              BHandle *handle,
                              void *buf, int len)
 {
-    return (readn (handle->fd, buf, len));
+    int n;
+
+    if (!handle->compressed)
+        return (readn (handle->fd, buf, len));
+
+    if (!handle->rbuf && load_compressed_block (handle) < 0)
+        return -1;
+
+    n = MIN ((guint32)len, handle->size - handle->rbuf_off);
+    memcpy (buf, handle->rbuf + handle->rbuf_off, n);
+    handle->rbuf_off += n;
+    return n;
 }
 
 static int
@@ -107,16 +248,99 @@ block_backend_fs_write_block (BlockBackend *bend,
                                 BHandle *handle,
                                 const void *buf, int len)
 {
+    if (handle->sha1_ctx)
+        seaf_sha1_update (handle->sha1_ctx, buf, len);
+
+    if (handle->wbuf) {
+        g_byte_array_append (handle->wbuf, buf, len);
+        return len;
+    }
+
     return (writen (handle->fd, buf, len));
 }
 
+/* Write the collected block, compressed if that pays off. */
+static int
+flush_block (BlockBackend *bend, BHandle *handle)
+{
+    FsPriv *priv = bend->be_priv;
+    GByteArray *wbuf = handle->wbuf;
+    BlockHeader *hdr;
+    guint8 *out = NULL;
+    uLongf out_len, sample_len;
+    guint32 sample;
+    int ret = 0;
+
+    if (wbuf->len == 0)
+        return 0;
+
+    /* Try a sample first, so that incompressible blocks are cheap. */
+    sample = MIN (wbuf->len, COMPRESS_SAMPLE_SIZE);
+    out_len = compressBound (wbuf->len);
+    out = g_malloc (sizeof(BlockHeader) + out_len);
+
+    sample_len = out_len;
+    if (compress2 (out + sizeof(BlockHeader), &sample_len,
+                   wbuf->data, sample, priv->compress_level) != Z_OK ||
+        sample_len > sample - MIN_COMPRESS_SAVING(sample))
+        goto raw;
+
+    if (sample < wbuf->len &&
+        compress2 (out + sizeof(BlockHeader), &out_len,
+                   wbuf->data, wbuf->len, priv->compress_level) != Z_OK)
+        goto raw;
+    if (sample == wbuf->len)
+        out_len = sample_len;
+    if (out_len > wbuf->len - MIN_COMPRESS_SAVING(wbuf->len))
+        goto raw;
+
+    hdr = (BlockHeader *)out;
+    memset (hdr, 0, sizeof(BlockHeader));
+    memcpy (hdr->magic, BLOCK_HEADER_MAGIC, 4);
+    hdr->codec = BLOCK_CODEC_ZLIB;
+    hdr->size = GUINT32_TO_LE (wbuf->len);
+    hex_to_rawdata (handle->block_id, hdr->block_id, 20);
+
+    out_len += sizeof(BlockHeader);
+    if (writen (handle->fd, out, out_len) != out_len)
+        ret = -1;
+    g_free (out);
+    return ret;
+
+raw:
+    g_free (out);
+    if (writen (handle->fd, wbuf->data, wbuf->len) != wbuf->len)
+        ret = -1;
+    return ret;
+}
+
 static int
 block_backend_fs_close_block (BlockBackend *bend,
                                 BHandle *handle)
 {
-    int ret;
+    unsigned char sha1[20], id[20];
+    int ret = 0;
 
-    ret = close (handle->fd);
+    if (handle->sha1_ctx) {
+        seaf_sha1_final (sha1, handle->sha1_ctx);
+        hex_to_rawdata (handle->block_id, id, 20);
+        handle->verified = (memcmp (sha1, id, 20) == 0);
+        g_free (handle->sha1_ctx);
+        handle->sha1_ctx = NULL;
+    }
+
+    if (handle->wbuf) {
+        if (flush_block (bend, handle) < 0) {
+            seaf_warning ("[block bend] failed to write block %s: %s.\n",
+                          handle->block_id, strerror(errno));
+            ret = -1;
+        }
+        g_byte_array_free (handle->wbuf, TRUE);
+        handle->wbuf = NULL;
+    }
+
+    if (close (handle->fd) < 0)
+        ret = -1;
 
     return ret;
 }
@@ -130,6 +354,10 @@ block_backend_fs_block_handle_free (BlockBackend *bend,
         g_unlink (handle->tmp_file);
         g_free (handle->tmp_file);
     }
+    if (handle->wbuf)
+        g_byte_array_free (handle->wbuf, TRUE);
+    g_free (handle->sha1_ctx);
+    g_free (handle->rbuf);
     g_free (handle->store_id);
     g_free (handle);
 }
@@ -156,6 +384,55 @@ create_parent_path (const char *path)
     return 0;
 }
 
+/*
+ * With dedup, a block already in the pool is only linked into the store,
+ * and a new one is linked into the pool once it's committed. The link
+ * count of a pool file is the number of stores with the block, plus one.
+ * Only blocks whose content matches their id go into the pool, so that
+ * an upload can't put bad content under an id other stores use.
+ */
+static int
+commit_shared_block (BlockBackend *bend, BHandle *handle, const char *path)
+{
+    FsPriv *priv = bend->be_priv;
+    char pool_path[SEAF_PATH_MAX];
+    SeafStat st;
+
+    get_pool_path (priv, handle->block_id, pool_path);
+
+    if (seaf_stat (pool_path, &st) == 0) {
+        if (link (pool_path, path) == 0) {
+            pthread_mutex_lock (&priv->stats_lock);
+            ++priv->linked_blocks;
+            priv->linked_bytes += st.st_size;
+            pthread_mutex_unlock (&priv->stats_lock);
+            return 0;
+        }
+        /* The store has its own copy already. */
+        if (errno == EEXIST)
+            return 0;
+        seaf_warning ("[block bend] Failed to link block %s from the pool: %s.\n",
+                      handle->block_id, strerror(errno));
+    }
+
+    if (g_rename (handle->tmp_file, path) < 0) {
+        seaf_warning ("[block bend] failed to commit block %s: %s\n",
+                   handle->block_id, strerror(errno));
+        return -1;
+    }
+
+    if (!handle->verified)
+        return 0;
+
+    /* The block is committed either way, it's only not shared. */
+    if (create_parent_path (pool_path) < 0 ||
+        (link (path, pool_path) < 0 && errno != EEXIST))
+        seaf_warning ("[block bend] Failed to add block %s to the pool: %s.\n",
+                      handle->block_id, strerror(errno));
+
+    return 0;
+}
+
 static int
 block_backend_fs_commit_block (BlockBackend *bend,
                                BHandle *handle)
@@ -171,6 +448,9 @@ block_backend_fs_commit_block (BlockBackend *bend,
         return -1;
     }
 
+    if (((FsPriv *)bend->be_priv)->dedup && handle->version > 0)
+        return commit_shared_block (bend, handle, path);
+
     if (g_rename (handle->tmp_file, path) < 0) {
         seaf_warning ("[block bend] failed to commit block %s: %s\n",
                    handle->block_id, strerror(errno));
@@ -195,17 +475,38 @@ block_backend_fs_block_exists (BlockBackend *bend,
         return FALSE;
 }
 
+/* Remove the pool entry of a block no store has any more. A store that
+ * links it at the same time keeps the content, it's only not shared.
+ */
+static void
+release_pool_block (FsPriv *priv, const char *block_id)
+{
+    char pool_path[SEAF_PATH_MAX];
+    SeafStat st;
+
+    get_pool_path (priv, block_id, pool_path);
+    if (seaf_stat (pool_path, &st) == 0 && st.st_nlink == 1)
+        g_unlink (pool_path);
+}
+
 static int
 block_backend_fs_remove_block (BlockBackend *bend,
                                const char *store_id,
                                int version,
                                const char *block_id)
 {
+    FsPriv *priv = bend->be_priv;
     char path[SEAF_PATH_MAX];
 
     get_block_path (bend, block_id, path, store_id, version);
 
-    return g_unlink (path);
+    if (g_unlink (path) < 0)
+        return -1;
+
+    if (priv->dedup && version > 0)
+        release_pool_block (priv, block_id);
+
+    return 0;
 }
 
 static BMetadata *
@@ -217,6 +518,8 @@ block_backend_fs_stat_block (BlockBackend *bend,
     char path[SEAF_PATH_MAX];
     SeafStat st;
     BMetadata *block_md;
+    guint32 size;
+    int fd;
 
     get_block_path (bend, block_id, path, store_id, version);
     if (seaf_stat (path, &st) < 0) {
@@ -228,6 +531,16 @@ block_backend_fs_stat_block (BlockBackend *bend,
     memcpy (block_md->id, block_id, 40);
     block_md->size = (uint32_t) st.st_size;
 
+    /* Report the logical size of compressed blocks. */
+    if (st.st_size > sizeof(BlockHeader)) {
+        fd = g_open (path, O_RDONLY | O_BINARY, 0);
+        if (fd >= 0) {
+            if (read_block_header (fd, block_id, &size))
+                block_md->size = size;
+            close (fd);
+        }
+    }
+
     return block_md;
 }
 
@@ -244,11 +557,66 @@ block_backend_fs_stat_block_by_handle (BlockBackend *bend,
     }
     block_md = g_new0(BMetadata, 1);
     memcpy (block_md->id, handle->block_id, 40);
-    block_md->size = (uint32_t) st.st_size;
+    if (handle->compressed)
+        block_md->size = handle->size;
+    else
+        block_md->size = (uint32_t) st.st_size;
 
     return block_md;
 }
 
+static int
+block_backend_fs_get_block_fd (BlockBackend *bend,
+                               BHandle *handle,
+                               guint32 *size)
+{
+    SeafStat st;
+    int fd;
+
+    /* Compressed blocks have to go through read_block(). */
+    if (handle->rw_type != BLOCK_READ || handle->compressed)
+        return -1;
+
+    if (seaf_fstat (handle->fd, &st) < 0)
+        return -1;
+
+    fd = dup (handle->fd);
+    if (fd < 0)
+        return -1;
+
+    *size = (guint32) st.st_size;
+    return fd;
+}
+
+#ifdef POSIX_FADV_WILLNEED
+static gint64
+block_backend_fs_prefetch (BlockBackend *bend,
+                           const char *store_id,
+                           int version,
+                           const char *block_id)
+{
+    char path[SEAF_PATH_MAX];
+    SeafStat st;
+    int fd;
+
+    get_block_path (bend, block_id, path, store_id, version);
+    fd = g_open (path, O_RDONLY | O_BINARY, 0);
+    if (fd < 0)
+        return -1;
+
+    if (seaf_fstat (fd, &st) < 0) {
+        close (fd);
+        return -1;
+    }
+
+    /* The kernel reads the file in the background. */
+    posix_fadvise (fd, 0, st.st_size, POSIX_FADV_WILLNEED);
+    close (fd);
+
+    return st.st_size;
+}
+#endif
+
 static int
 block_backend_fs_foreach_block (BlockBackend *bend,
                                 const char *store_id,
@@ -310,6 +678,183 @@ out:
     return ret;
 }
 
+/*
+ * Parallel enumeration.
+ *
+ * Each of the up to 256 prefix directories is read by a worker thread
+ * into a sorted batch. Batches are handed to the caller in prefix order.
+ * Only a window of directories ahead of the caller is read, to bound
+ * memory on stores with many blocks.
+ */
+
+#define SCAN_THREADS 8
+#define SCAN_WINDOW (SCAN_THREADS * 2)
+
+typedef struct ScanDir {
+    char        *path;
+    char        *prefix;
+    GPtrArray   *ids;
+    gboolean     done;
+} ScanDir;
+
+typedef struct ScanJob {
+    gboolean         cancel;
+    pthread_mutex_t  lock;
+    pthread_cond_t   cond;
+} ScanJob;
+
+static int
+cmp_str (gconstpointer a, gconstpointer b)
+{
+    return strcmp (*(char **)a, *(char **)b);
+}
+
+static void
+scan_dir_thread (gpointer data, gpointer user_data)
+{
+    ScanDir *sd = data;
+    ScanJob *job = user_data;
+    GDir *dir = NULL;
+    const char *dname;
+
+    sd->ids = g_ptr_array_new ();
+
+    if (!job->cancel)
+        dir = g_dir_open (sd->path, 0, NULL);
+    if (dir) {
+        while ((dname = g_dir_read_name (dir)) != NULL)
+            g_ptr_array_add (sd->ids, g_strconcat (sd->prefix, dname, NULL));
+        g_dir_close (dir);
+        g_ptr_array_sort (sd->ids, cmp_str);
+    } else if (!job->cancel) {
+        seaf_warning ("Failed to open block dir %s.\n", sd->path);
+    }
+
+    pthread_mutex_lock (&job->lock);
+    sd->done = TRUE;
+    pthread_cond_broadcast (&job->cond);
+    pthread_mutex_unlock (&job->lock);
+}
+
+static void
+free_scan_ids (ScanDir *sd)
+{
+    guint i;
+
+    if (!sd->ids)
+        return;
+    for (i = 0; i < sd->ids->len; ++i)
+        g_free (g_ptr_array_index (sd->ids, i));
+    g_ptr_array_free (sd->ids, TRUE);
+    sd->ids = NULL;
+}
+
+static int
+block_backend_fs_foreach_block_batch (BlockBackend *bend,
+                                      const char *store_id,
+                                      int version,
+                                      const char *start_prefix,
+                                      SeafBlockBatchFunc process,
+                                      void *user_data)
+{
+    FsPriv *priv = bend->be_priv;
+    char *block_dir = NULL;
+    GDir *dir1;
+    const char *dname1;
+    GPtrArray *prefixes;
+    ScanDir *dirs = NULL;
+    ScanJob job;
+    GThreadPool *pool = NULL;
+    int n_dirs, next = 0, i;
+    int ret = 0;
+
+#if defined MIGRATION
+    if (version > 0)
+        block_dir = g_build_filename (priv->block_dir, store_id, NULL);
+    else
+        block_dir = g_strdup(priv->v0_block_dir);
+#else
+    block_dir = g_build_filename (priv->block_dir, store_id, NULL);
+#endif
+
+    dir1 = g_dir_open (block_dir, 0, NULL);
+    if (!dir1) {
+        g_free (block_dir);
+        return 0;
+    }
+
+    prefixes = g_ptr_array_new ();
+    while ((dname1 = g_dir_read_name(dir1)) != NULL) {
+        if (start_prefix && strcmp (dname1, start_prefix) < 0)
+            continue;
+        g_ptr_array_add (prefixes, g_strdup (dname1));
+    }
+    g_dir_close (dir1);
+    g_ptr_array_sort (prefixes, cmp_str);
+
+    n_dirs = prefixes->len;
+    if (n_dirs == 0)
+        goto out;
+
+    dirs = g_new0 (ScanDir, n_dirs);
+    for (i = 0; i < n_dirs; ++i) {
+        dirs[i].prefix = g_ptr_array_index (prefixes, i);
+        dirs[i].path = g_build_filename (block_dir, dirs[i].prefix, NULL);
+    }
+
+    job.cancel = FALSE;
+    pthread_mutex_init (&job.lock, NULL);
+    pthread_cond_init (&job.cond, NULL);
+
+    pool = g_thread_pool_new (scan_dir_thread, &job, SCAN_THREADS, FALSE, NULL);
+    if (!pool) {
+        ret = -1;
+        goto destroy;
+    }
+
+    for (; next < n_dirs && next < SCAN_WINDOW; ++next)
+        g_thread_pool_push (pool, &dirs[next], NULL);
+
+    for (i = 0; i < n_dirs; ++i) {
+        pthread_mutex_lock (&job.lock);
+        while (!dirs[i].done)
+            pthread_cond_wait (&job.cond, &job.lock);
+        pthread_mutex_unlock (&job.lock);
+
+        if (next < n_dirs)
+            g_thread_pool_push (pool, &dirs[next++], NULL);
+
+        if (dirs[i].ids->len > 0 &&
+            !process (store_id, version, dirs[i].prefix,
+                      (char **)dirs[i].ids->pdata, dirs[i].ids->len,
+                      user_data)) {
+            job.cancel = TRUE;
+            break;
+        }
+        free_scan_ids (&dirs[i]);
+    }
+
+    /* Wait for the directories still being read. */
+    g_thread_pool_free (pool, FALSE, TRUE);
+
+destroy:
+    pthread_mutex_destroy (&job.lock);
+    pthread_cond_destroy (&job.cond);
+    for (i = 0; i < n_dirs; ++i) {
+        free_scan_ids (&dirs[i]);
+        g_free (dirs[i].path);
+    }
+    g_free (dirs);
+
+out:
+    for (i = 0; i < prefixes->len; ++i)
+        g_free (g_ptr_array_index (prefixes, i));
+    g_ptr_array_free (prefixes, TRUE);
+    g_free (block_dir);
+
+    return ret;
+}
+
 static int
 block_backend_fs_copy (BlockBackend *bend,
                        const char *src_store_id,
@@ -347,7 +892,8 @@ block_backend_fs_copy (BlockBackend *bend,
                       src_path, dst_path, strerror(errno));
         return -1;
     }
-    return ret;
+    /* Linked by someone else at the same time. */
+    return 0;
 #endif
 }
 
@@ -359,6 +905,7 @@ block_backend_fs_remove_store (BlockBackend *bend, const char *store_id)
     GDir *dir1, *dir2;
     const char *dname1, *dname2;
     char *path1, *path2;
+    char block_id[41];
 
     block_dir = g_build_filename (priv->block_dir, store_id, NULL);
 
@@ -381,7 +928,12 @@ block_backend_fs_remove_store (BlockBackend *bend, const char *store_id)
 
         while ((dname2 = g_dir_read_name(dir2)) != NULL) {
             path2 = g_build_filename (path1, dname2, NULL);
-            g_unlink (path2);
+            if (g_unlink (path2) == 0 && priv->dedup &&
+                strlen (dname1) == 2 && strlen (dname2) == 38) {
+                memcpy (block_id, dname1, 2);
+                memcpy (block_id + 2, dname2, 39);
+                release_pool_block (priv, block_id);
+            }
             g_free (path2);
         }
         g_dir_close (dir2);
@@ -431,6 +983,14 @@ get_block_path (BlockBackend *bend,
     return path;
 }
 
+static char *
+get_pool_path (FsPriv *priv, const char *block_id, char path[])
+{
+    snprintf (path, SEAF_PATH_MAX, "%s/%.2s/%s",
+              priv->pool_dir, block_id, block_id + 2);
+    return path;
+}
+
 static int
 open_tmp_file (BlockBackend *bend,
                const char *basename,
@@ -447,6 +1007,136 @@ open_tmp_file (BlockBackend *bend,
     return fd;
 }
 
+/* Compress blocks written from now on with zlib @level, 0 to store them
+ * raw. Existing blocks are read either way.
+ */
+void
+block_backend_fs_set_compression (BlockBackend *bend, int level)
+{
+    FsPriv *priv = bend->be_priv;
+
+    if (level < 0)
+        level = 0;
+    if (level > Z_BEST_COMPRESSION)
+        level = Z_BEST_COMPRESSION;
+    priv->compress_level = level;
+}
+
+/*
+ * Keep one copy of the blocks found in several stores. Blocks committed
+ * from now on are linked to a pool of all blocks in storage/block-pool,
+ * so an identical block in another store is a hard link to the same
+ * file. Blocks committed before are not shared.
+ */
+void
+block_backend_fs_set_dedup (BlockBackend *bend, gboolean dedup)
+{
+    FsPriv *priv = bend->be_priv;
+
+    if (dedup && g_mkdir_with_parents (priv->pool_dir, 0777) < 0) {
+        seaf_warning ("Failed to create block pool dir %s.\n", priv->pool_dir);
+        return;
+    }
+    priv->dedup = dedup;
+}
+
+/* Whether other stores have the same file for the block, so removing
+ * it doesn't free the space.
+ */
+gboolean
+block_backend_fs_block_is_shared (BlockBackend *bend,
+                                  const char *store_id,
+                                  int version,
+                                  const char *block_id)
+{
+    FsPriv *priv = bend->be_priv;
+    char path[SEAF_PATH_MAX], pool_path[SEAF_PATH_MAX];
+    SeafStat st, pool_st;
+    int links;
+
+    get_block_path (bend, block_id, path, store_id, version);
+    if (seaf_stat (path, &st) < 0 || st.st_nlink <= 1)
+        return FALSE;
+
+    links = st.st_nlink - 1;
+    get_pool_path (priv, block_id, pool_path);
+    if (seaf_stat (pool_path, &pool_st) == 0 && pool_st.st_ino == st.st_ino &&
+        pool_st.st_dev == st.st_dev)
+        --links;
+
+    return links > 0;
+}
+
+void
+block_backend_fs_get_dedup_stats (BlockBackend *bend, BlockDedupStats *stats)
+{
+    FsPriv *priv = bend->be_priv;
+
+    memset (stats, 0, sizeof(BlockDedupStats));
+    pthread_mutex_lock (&priv->stats_lock);
+    stats->linked_blocks = priv->linked_blocks;
+    stats->linked_bytes = priv->linked_bytes;
+    pthread_mutex_unlock (&priv->stats_lock);
+}
+
+/*
+ * Count the blocks of the pool and the space sharing saves. Entries no
+ * store links any more, left by a crash or by removals done with dedup
+ * turned off, are removed if @remove_orphans is set.
+ */
+int
+block_backend_fs_scan_pool (BlockBackend *bend, gboolean remove_orphans,
+                            BlockDedupStats *stats)
+{
+    FsPriv *priv = bend->be_priv;
+    GDir *dir1, *dir2;
+    const char *dname1, *dname2;
+    char *path1, *path2;
+    SeafStat st;
+
+    block_backend_fs_get_dedup_stats (bend, stats);
+
+    dir1 = g_dir_open (priv->pool_dir, 0, NULL);
+    if (!dir1)
+        return 0;
+
+    while ((dname1 = g_dir_read_name(dir1)) != NULL) {
+        path1 = g_build_filename (priv->pool_dir, dname1, NULL);
+
+        dir2 = g_dir_open (path1, 0, NULL);
+        if (!dir2) {
+            seaf_warning ("Failed to open block pool dir %s.\n", path1);
+            g_free (path1);
+            continue;
+        }
+
+        while ((dname2 = g_dir_read_name(dir2)) != NULL) {
+            path2 = g_build_filename (path1, dname2, NULL);
+            if (seaf_stat (path2, &st) < 0) {
+                g_free (path2);
+                continue;
+            }
+
+            if (st.st_nlink == 1) {
+                if (remove_orphans && g_unlink (path2) == 0)
+                    ++stats->orphans_removed;
+            } else {
+                ++stats->pool_blocks;
+                if (st.st_nlink > 2) {
+                    ++stats->shared_blocks;
+                    stats->saved_bytes += (guint64)(st.st_nlink - 2) * st.st_size;
+                }
+            }
+            g_free (path2);
+        }
+        g_dir_close (dir2);
+        g_free (path1);
+    }
+    g_dir_close (dir1);
+
+    return 0;
+}
+
 BlockBackend *
 block_backend_fs_new (const char *seaf_dir, const char *tmp_dir)
 {
@@ -463,6 +1153,9 @@ block_backend_fs_new (const char *seaf_dir, const char *tmp_dir)
     priv->block_dir = g_build_filename (seaf_dir, "storage", "blocks", NULL);
     priv->block_dir_len = strlen (priv->block_dir);
 
+    priv->pool_dir = g_build_filename (seaf_dir, "storage", "block-pool", NULL);
+    pthread_mutex_init (&priv->stats_lock, NULL);
+
     priv->tmp_dir = g_strdup (tmp_dir);
     priv->tmp_dir_len = strlen (tmp_dir);
 
@@ -487,8 +1180,13 @@ block_backend_fs_new (const char *seaf_dir, const char *tmp_dir)
     bend->remove_block = block_backend_fs_remove_block;
     bend->stat_block = block_backend_fs_stat_block;
     bend->stat_block_by_handle = block_backend_fs_stat_block_by_handle;
+    bend->get_block_fd = block_backend_fs_get_block_fd;
+#ifdef POSIX_FADV_WILLNEED
+    bend->prefetch = block_backend_fs_prefetch;
+#endif
     bend->block_handle_free = block_backend_fs_block_handle_free;
     bend->foreach_block = block_backend_fs_foreach_block;
+    bend->foreach_block_batch = block_backend_fs_foreach_block_batch;
     bend->remove_store = block_backend_fs_remove_store;
     bend->copy = block_backend_fs_copy;
 
@@ -0,0 +1,1188 @@
+/* -*- Mode: C; tab-width: 4; indent-tabs-mode: nil; c-basic-offset: 4 -*- */
+
+#include "common.h"
+
+#include "utils.h"
+
+#include "log.h"
+
+#include <sys/stat.h>
+#include <sys/file.h>
+#include <fcntl.h>
+#include <pthread.h>
+
+#include "block-backend.h"
+
+/*
+ * Pack file block backend.
+ *
+ * Instead of one file per block, the blocks of a store are appended to
+ * large pack files. This keeps inode counts and directory sizes down on
+ * big servers. Each store has its own directory:
+ *
+ *   storage/packs/<store_id>/pack-00000000  packed blocks
+ *   storage/packs/<store_id>/index          block id -> (pack, offset, len)
+ *   storage/packs/<store_id>/lock           serializes writers
+ *
+ * The index is an append-only log of PackIndexRecord. Later records win,
+ * and a removed block gets a record with PACK_RECORD_REMOVED set. Space
+ * used by removed blocks is reclaimed by compaction. Compaction moves the
+ * live blocks of mostly dead packs into a new pack and rewrites the index.
+ *
+ * The server, GC and fsck may work on the same store at once. Writers hold
+ * an flock on the lock file. Every process replays records appended by
+ * the others before using its in-memory index, and reloads the index when
+ * compaction has replaced it.
+ */
+
+#define PACK_RECORD_REMOVED 1
+
+typedef struct PackIndexRecord {
+    guint8  block_id[20];
+    guint32 flags;
+    guint32 pack;
+    guint32 len;
+    guint64 offset;             /* of the block content */
+} __attribute__((gcc_struct, __packed__)) PackIndexRecord;
+
+#define PACK_ENTRY_MAGIC "SFPK"
+
+/* Precedes every block in a pack, so that packs can be checked or
+ * reindexed without the index.
+ */
+typedef struct PackEntryHeader {
+    char    magic[4];
+    guint32 len;
+    guint8  block_id[20];
+} __attribute__((gcc_struct, __packed__)) PackEntryHeader;
+
+/* Start a new pack once the current one reaches this size. */
+#define PACK_MAX_SIZE ((guint64)1 << 30)
+
+/* Compact a pack once at least this share of it is dead. */
+#define PACK_COMPACT_RATIO 0.3
+
+/* Records are read and written in batches of this many. */
+#define INDEX_BATCH 1024
+
+typedef struct PackLoc {
+    guint32 pack;
+    guint32 len;
+    guint64 offset;
+} PackLoc;
+
+typedef struct PackStat {
+    guint64 size;
+    guint64 live;
+} PackStat;
+
+typedef struct PackStore {
+    char            *dir;
+    pthread_mutex_t  lock;
+    GHashTable      *blocks;    /* block id -> PackLoc */
+    GHashTable      *packs;     /* pack number -> PackStat */
+    guint32          max_pack;
+    gboolean         loaded;
+    guint64          index_ino;
+    guint64          index_off;
+    guint64          n_records;
+    int              lock_fd;
+    int              write_fd;  /* open on write_pack, or -1 */
+    guint32          write_pack;
+} PackStore;
+
+typedef struct {
+    char            *pack_dir;
+    GHashTable      *stores;
+    pthread_mutex_t  lock;
+} PackPriv;
+
+struct _BHandle {
+    char    *store_id;
+    int     version;
+    char    block_id[41];
+    int     rw_type;
+
+    /* Read */
+    int     fd;
+    guint32 len;
+    guint32 pos;
+
+    /* Write: a PackEntryHeader followed by the content. */
+    GByteArray *wbuf;
+};
+
+#define ENTRY_SIZE(len) ((guint64)(len) + sizeof(PackEntryHeader))
+
+static void
+pack_path (PackStore *st, guint32 pack, char path[])
+{
+    snprintf (path, SEAF_PATH_MAX, "%s/pack-%08u", st->dir, pack);
+}
+
+static PackStat *
+get_pack_stat (PackStore *st, guint32 pack)
+{
+    PackStat *ps;
+
+    ps = g_hash_table_lookup (st->packs, GUINT_TO_POINTER(pack));
+    if (!ps) {
+        ps = g_new0 (PackStat, 1);
+        g_hash_table_insert (st->packs, GUINT_TO_POINTER(pack), ps);
+    }
+    return ps;
+}
+
+static PackStore *
+get_store (BlockBackend *bend, const char *store_id)
+{
+    PackPriv *priv = bend->be_priv;
+    PackStore *st;
+
+    pthread_mutex_lock (&priv->lock);
+
+    st = g_hash_table_lookup (priv->stores, store_id);
+    if (!st) {
+        st = g_new0 (PackStore, 1);
+        st->dir = g_build_filename (priv->pack_dir, store_id, NULL);
+        pthread_mutex_init (&st->lock, NULL);
+        st->blocks = g_hash_table_new_full (g_str_hash, g_str_equal,
+                                            g_free, g_free);
+        st->packs = g_hash_table_new_full (g_direct_hash, g_direct_equal,
+                                           NULL, g_free);
+        st->lock_fd = -1;
+        st->write_fd = -1;
+        g_hash_table_insert (priv->stores, g_strdup(store_id), st);
+    }
+
+    pthread_mutex_unlock (&priv->lock);
+
+    return st;
+}
+
+/* Forget everything and pick up the packs that are on disk. */
+static void
+reset_store (PackStore *st)
+{
+    GDir *dir;
+    const char *dname;
+    char path[SEAF_PATH_MAX];
+    SeafStat sb;
+    guint32 pack;
+
+    g_hash_table_remove_all (st->blocks);
+    g_hash_table_remove_all (st->packs);
+    st->max_pack = 0;
+    st->index_ino = 0;
+    st->index_off = 0;
+    st->n_records = 0;
+    if (st->write_fd >= 0) {
+        close (st->write_fd);
+        st->write_fd = -1;
+    }
+
+    dir = g_dir_open (st->dir, 0, NULL);
+    if (!dir)
+        return;
+
+    while ((dname = g_dir_read_name (dir)) != NULL) {
+        if (sscanf (dname, "pack-%08u", &pack) != 1)
+            continue;
+        pack_path (st, pack, path);
+        if (seaf_stat (path, &sb) < 0)
+            continue;
+        get_pack_stat (st, pack)->size = (guint64)sb.st_size;
+        if (pack > st->max_pack)
+            st->max_pack = pack;
+    }
+
+    g_dir_close (dir);
+}
+
+static void
+apply_record (PackStore *st, const PackIndexRecord *rec)
+{
+    char block_id[41];
+    PackLoc *loc;
+
+    rawdata_to_hex (rec->block_id, block_id, 20);
+
+    loc = g_hash_table_lookup (st->blocks, block_id);
+    if (loc) {
+        get_pack_stat (st, loc->pack)->live -= ENTRY_SIZE(loc->len);
+        g_hash_table_remove (st->blocks, block_id);
+    }
+    ++st->n_records;
+
+    if (GUINT32_FROM_LE (rec->flags) & PACK_RECORD_REMOVED)
+        return;
+
+    loc = g_new0 (PackLoc, 1);
+    loc->pack = GUINT32_FROM_LE (rec->pack);
+    loc->len = GUINT32_FROM_LE (rec->len);
+    loc->offset = GUINT64_FROM_LE (rec->offset);
+    get_pack_stat (st, loc->pack)->live += ENTRY_SIZE(loc->len);
+    if (loc->pack > st->max_pack)
+        st->max_pack = loc->pack;
+
+    g_hash_table_insert (st->blocks, g_strdup(block_id), loc);
+}
+
+static void
+fill_record (PackIndexRecord *rec, const char *block_id,
+             const PackLoc *loc, guint32 flags)
+{
+    memset (rec, 0, sizeof(*rec));
+    hex_to_rawdata (block_id, rec->block_id, 20);
+    rec->flags = GUINT32_TO_LE (flags);
+    if (loc) {
+        rec->pack = GUINT32_TO_LE (loc->pack);
+        rec->len = GUINT32_TO_LE (loc->len);
+        rec->offset = GUINT64_TO_LE (loc->offset);
+    }
+}
+
+/* Apply the whole records in @fd after st->index_off. A partial record
+ * at the end is being written by another process, or left by a crash.
+ */
+static int
+replay_index (PackStore *st, int fd)
+{
+    PackIndexRecord recs[INDEX_BATCH];
+    ssize_t n;
+    int i;
+
+    if (lseek (fd, (off_t)st->index_off, SEEK_SET) < 0)
+        return -1;
+
+    while ((n = readn (fd, recs, sizeof(recs))) > 0) {
+        for (i = 0; i < n / (ssize_t)sizeof(PackIndexRecord); ++i)
+            apply_record (st, &recs[i]);
+        st->index_off += i * sizeof(PackIndexRecord);
+        if (n < (ssize_t)sizeof(recs))
+            break;
+    }
+
+    return (n < 0) ? -1 : 0;
+}
+
+/* Bring the in-memory index up to date with the index file.
+ * Called with st->lock held.
+ */
+static int
+sync_store (PackStore *st)
+{
+    char path[SEAF_PATH_MAX];
+    SeafStat sb;
+    int fd, ret;
+
+    snprintf (path, sizeof(path), "%s/index", st->dir);
+
+    if (seaf_stat (path, &sb) < 0) {
+        if (errno != ENOENT) {
+            seaf_warning ("[pack bend] Failed to stat %s: %s.\n",
+                          path, strerror(errno));
+            return -1;
+        }
+        /* No index, the store is empty or has been removed. */
+        if (!st->loaded || st->index_ino != 0)
+            reset_store (st);
+        st->loaded = TRUE;
+        return 0;
+    }
+
+    if (st->loaded && (guint64)sb.st_ino == st->index_ino &&
+        (guint64)sb.st_size < st->index_off + sizeof(PackIndexRecord))
+        return 0;
+
+    fd = g_open (path, O_RDONLY | O_BINARY, 0);
+    if (fd < 0 || seaf_fstat (fd, &sb) < 0) {
+        seaf_warning ("[pack bend] Failed to open %s: %s.\n",
+                      path, strerror(errno));
+        if (fd >= 0)
+            close (fd);
+        return -1;
+    }
+
+    /* The index was rewritten by compaction. */
+    if (!st->loaded || (guint64)sb.st_ino != st->index_ino) {
+        reset_store (st);
+        st->index_ino = (guint64)sb.st_ino;
+    }
+
+    ret = replay_index (st, fd);
+    close (fd);
+
+    if (ret < 0) {
+        seaf_warning ("[pack bend] Failed to read %s.\n", path);
+        st->loaded = FALSE;
+        return -1;
+    }
+    st->loaded = TRUE;
+
+    return 0;
+}
+
+/* Take the writer lock of @st and sync. Called with st->lock held. */
+static int
+lock_store (PackStore *st)
+{
+    char path[SEAF_PATH_MAX];
+
+    if (st->lock_fd < 0) {
+        if (g_mkdir_with_parents (st->dir, 0777) < 0) {
+            seaf_warning ("[pack bend] Failed to create %s.\n", st->dir);
+            return -1;
+        }
+        snprintf (path, sizeof(path), "%s/lock", st->dir);
+        st->lock_fd = g_open (path, O_RDWR | O_CREAT | O_BINARY, 0644);
+        if (st->lock_fd < 0) {
+            seaf_warning ("[pack bend] Failed to open %s: %s.\n",
+                          path, strerror(errno));
+            return -1;
+        }
+    }
+
+    while (flock (st->lock_fd, LOCK_EX) < 0) {
+        if (errno != EINTR) {
+            seaf_warning ("[pack bend] Failed to lock %s: %s.\n",
+                          st->dir, strerror(errno));
+            return -1;
+        }
+    }
+
+    if (sync_store (st) < 0) {
+        flock (st->lock_fd, LOCK_UN);
+        return -1;
+    }
+
+    return 0;
+}
+
+static void
+unlock_store (PackStore *st)
+{
+    flock (st->lock_fd, LOCK_UN);
+}
+
+/* Append and apply @n records. Called with the writer lock held. */
+static int
+append_records (PackStore *st, const PackIndexRecord *recs, int n)
+{
+    char path[SEAF_PATH_MAX];
+    SeafStat sb;
+    int fd, i;
+    size_t len = n * sizeof(PackIndexRecord);
+
+    snprintf (path, sizeof(path), "%s/index", st->dir);
+    fd = g_open (path, O_WRONLY | O_CREAT | O_APPEND | O_BINARY, 0644);
+    if (fd < 0 || seaf_fstat (fd, &sb) < 0) {
+        seaf_warning ("[pack bend] Failed to open %s: %s.\n",
+                      path, strerror(errno));
+        goto error;
+    }
+
+    /* Nobody else appends while we hold the lock, so a partial record
+     * is left over from a crash. Drop it to keep records aligned.
+     */
+    if ((guint64)sb.st_size != st->index_off &&
+        ftruncate (fd, (off_t)st->index_off) < 0) {
+        seaf_warning ("[pack bend] Failed to truncate %s: %s.\n",
+                      path, strerror(errno));
+        goto error;
+    }
+
+    if (writen (fd, recs, len) != len) {
+        seaf_warning ("[pack bend] Failed to write %s: %s.\n",
+                      path, strerror(errno));
+        if (ftruncate (fd, (off_t)st->index_off) < 0)
+            st->loaded = FALSE;
+        goto error;
+    }
+    close (fd);
+
+    st->index_ino = (guint64)sb.st_ino;
+    st->index_off += len;
+    for (i = 0; i < n; ++i)
+        apply_record (st, &recs[i]);
+
+    return 0;
+
+error:
+    if (fd >= 0)
+        close (fd);
+    return -1;
+}
+
+/* Return an fd for appending @need bytes to the current pack, and the
+ * offset the data will land at.
+ */
+static int
+get_write_pack (PackStore *st, guint64 need, guint64 *offset)
+{
+    char path[SEAF_PATH_MAX];
+    SeafStat sb;
+
+    while (1) {
+        /* Another process may have started a newer pack. */
+        if (st->write_fd >= 0 && st->write_pack != st->max_pack) {
+            close (st->write_fd);
+            st->write_fd = -1;
+        }
+
+        if (st->write_fd < 0) {
+            pack_path (st, st->max_pack, path);
+            st->write_fd = g_open (path,
+                                   O_WRONLY | O_CREAT | O_APPEND | O_BINARY,
+                                   0644);
+            if (st->write_fd < 0) {
+                seaf_warning ("[pack bend] Failed to open %s: %s.\n",
+                              path, strerror(errno));
+                return -1;
+            }
+            st->write_pack = st->max_pack;
+        }
+
+        if (seaf_fstat (st->write_fd, &sb) < 0)
+            return -1;
+
+        if (sb.st_nlink > 0 &&
+            (sb.st_size == 0 || (guint64)sb.st_size + need <= PACK_MAX_SIZE)) {
+            *offset = (guint64)sb.st_size;
+            return st->write_fd;
+        }
+
+        close (st->write_fd);
+        st->write_fd = -1;
+        if (sb.st_nlink > 0)
+            ++st->max_pack;
+    }
+}
+
+/* Append a pack entry (header and content) to the current pack. The
+ * location of the content is returned in @loc.
+ */
+static int
+append_entry (PackStore *st, const guint8 *entry, guint32 entry_len,
+              PackLoc *loc)
+{
+    guint64 offset;
+    int fd;
+
+    fd = get_write_pack (st, entry_len, &offset);
+    if (fd < 0)
+        return -1;
+
+    if (writen (fd, entry, entry_len) != entry_len) {
+        seaf_warning ("[pack bend] Failed to write pack %u in %s: %s.\n",
+                      st->write_pack, st->dir, strerror(errno));
+        /* Don't leave a torn entry for the next writer to append to. */
+        if (ftruncate (fd, (off_t)offset) < 0) {
+            close (st->write_fd);
+            st->write_fd = -1;
+            ++st->max_pack;
+        }
+        return -1;
+    }
+
+    loc->pack = st->write_pack;
+    loc->offset = offset + sizeof(PackEntryHeader);
+    loc->len = entry_len - sizeof(PackEntryHeader);
+    get_pack_stat (st, loc->pack)->size = offset + entry_len;
+
+    return 0;
+}
+
+/* Read a whole pack entry. Called with st->lock held. */
+static guint8 *
+read_entry (PackStore *st, const char *block_id, const PackLoc *loc)
+{
+    char path[SEAF_PATH_MAX];
+    PackEntryHeader *hdr;
+    guint8 id[20];
+    guint8 *entry;
+    guint64 len = ENTRY_SIZE(loc->len);
+    int fd;
+
+    pack_path (st, loc->pack, path);
+    fd = g_open (path, O_RDONLY | O_BINARY, 0);
+    if (fd < 0) {
+        seaf_warning ("[pack bend] Failed to open %s: %s.\n",
+                      path, strerror(errno));
+        return NULL;
+    }
+
+    entry = g_malloc (len);
+    if (lseek (fd, (off_t)(loc->offset - sizeof(PackEntryHeader)),
+               SEEK_SET) < 0 ||
+        readn (fd, entry, len) != len) {
+        seaf_warning ("[pack bend] Failed to read block %s from %s.\n",
+                      block_id, path);
+        goto error;
+    }
+
+    hdr = (PackEntryHeader *)entry;
+    hex_to_rawdata (block_id, id, 20);
+    if (memcmp (hdr->magic, PACK_ENTRY_MAGIC, 4) != 0 ||
+        GUINT32_FROM_LE (hdr->len) != loc->len ||
+        memcmp (hdr->block_id, id, 20) != 0) {
+        seaf_warning ("[pack bend] Bad entry for block %s in %s.\n",
+                      block_id, path);
+        goto error;
+    }
+
+    close (fd);
+    return entry;
+
+error:
+    close (fd);
+    g_free (entry);
+    return NULL;
+}
+
+static BHandle *
+block_backend_pack_open_block (BlockBackend *bend,
+                               const char *store_id,
+                               int version,
+                               const char *block_id,
+                               int rw_type)
+{
+    BHandle *handle;
+    PackStore *st;
+    PackLoc loc;
+    PackLoc *found = NULL;
+    char path[SEAF_PATH_MAX];
+    int fd = -1;
+
+    g_return_val_if_fail (block_id != NULL, NULL);
+    g_return_val_if_fail (strlen(block_id) == 40, NULL);
+    g_return_val_if_fail (rw_type == BLOCK_READ || rw_type == BLOCK_WRITE, NULL);
+
+    if (rw_type == BLOCK_READ) {
+        st = get_store (bend, store_id);
+
+        pthread_mutex_lock (&st->lock);
+        if (sync_store (st) == 0)
+            found = g_hash_table_lookup (st->blocks, block_id);
+        if (found) {
+            loc = *found;
+            pack_path (st, loc.pack, path);
+            /* Open before unlocking, so that compaction can't remove the
+             * pack in between.
+             */
+            fd = g_open (path, O_RDONLY | O_BINARY, 0);
+        }
+        pthread_mutex_unlock (&st->lock);
+
+        if (!found) {
+            seaf_warning ("[pack bend] Block %s is not in store %s.\n",
+                          block_id, store_id);
+            return NULL;
+        }
+        if (fd < 0 || lseek (fd, (off_t)loc.offset, SEEK_SET) < 0) {
+            seaf_warning ("[pack bend] failed to open block %s for read: %s\n",
+                          block_id, strerror(errno));
+            if (fd >= 0)
+                close (fd);
+            return NULL;
+        }
+    }
+
+    handle = g_new0 (BHandle, 1);
+    handle->fd = fd;
+    memcpy (handle->block_id, block_id, 41);
+    handle->rw_type = rw_type;
+    if (rw_type == BLOCK_READ) {
+        handle->len = loc.len;
+    } else {
+        handle->wbuf = g_byte_array_new ();
+        g_byte_array_set_size (handle->wbuf, sizeof(PackEntryHeader));
+    }
+    if (store_id)
+        handle->store_id = g_strdup(store_id);
+    handle->version = version;
+
+    return handle;
+}
+
+static int
+block_backend_pack_read_block (BlockBackend *bend,
+                               BHandle *handle,
+                               void *buf, int len)
+{
+    int n;
+
+    n = MIN ((guint32)len, handle->len - handle->pos);
+    if (n == 0)
+        return 0;
+
+    n = readn (handle->fd, buf, n);
+    if (n > 0)
+        handle->pos += n;
+    return n;
+}
+
+static int
+block_backend_pack_write_block (BlockBackend *bend,
+                                BHandle *handle,
+                                const void *buf, int len)
+{
+    g_byte_array_append (handle->wbuf, buf, len);
+    return len;
+}
+
+static int
+block_backend_pack_close_block (BlockBackend *bend,
+                                BHandle *handle)
+{
+    int ret = 0;
+
+    if (handle->fd >= 0) {
+        ret = close (handle->fd);
+        handle->fd = -1;
+    }
+
+    return ret;
+}
+
+static void
+block_backend_pack_block_handle_free (BlockBackend *bend,
+                                      BHandle *handle)
+{
+    if (handle->fd >= 0)
+        close (handle->fd);
+    if (handle->wbuf)
+        g_byte_array_free (handle->wbuf, TRUE);
+    g_free (handle->store_id);
+    g_free (handle);
+}
+
+static int
+block_backend_pack_commit_block (BlockBackend *bend,
+                                 BHandle *handle)
+{
+    PackStore *st;
+    PackEntryHeader *hdr;
+    PackIndexRecord rec;
+    PackLoc loc;
+    int ret = -1;
+
+    g_return_val_if_fail (handle->rw_type == BLOCK_WRITE, -1);
+
+    hdr = (PackEntryHeader *)handle->wbuf->data;
+    memcpy (hdr->magic, PACK_ENTRY_MAGIC, 4);
+    hdr->len = GUINT32_TO_LE (handle->wbuf->len - sizeof(PackEntryHeader));
+    hex_to_rawdata (handle->block_id, hdr->block_id, 20);
+
+    st = get_store (bend, handle->store_id);
+
+    pthread_mutex_lock (&st->lock);
+    if (lock_store (st) < 0)
+        goto out;
+
+    /* Blocks are content addressed, a second copy is of no use. */
+    if (g_hash_table_lookup (st->blocks, handle->block_id)) {
+        ret = 0;
+        goto unlock;
+    }
+
+    if (append_entry (st, handle->wbuf->data, handle->wbuf->len, &loc) < 0)
+        goto unlock;
+
+    fill_record (&rec, handle->block_id, &loc, 0);
+    if (append_records (st, &rec, 1) < 0)
+        goto unlock;
+
+    ret = 0;
+
+unlock:
+    unlock_store (st);
+out:
+    pthread_mutex_unlock (&st->lock);
+    if (ret < 0)
+        seaf_warning ("[pack bend] failed to commit block %s.\n",
+                      handle->block_id);
+    return ret;
+}
+
+static gboolean
+block_backend_pack_block_exists (BlockBackend *bend,
+                                 const char *store_id,
+                                 int version,
+                                 const char *block_sha1)
+{
+    PackStore *st = get_store (bend, store_id);
+    gboolean ret = FALSE;
+
+    pthread_mutex_lock (&st->lock);
+    if (sync_store (st) == 0)
+        ret = (g_hash_table_lookup (st->blocks, block_sha1) != NULL);
+    pthread_mutex_unlock (&st->lock);
+
+    return ret;
+}
+
+#ifdef POSIX_FADV_WILLNEED
+static gint64
+block_backend_pack_prefetch (BlockBackend *bend,
+                             const char *store_id,
+                             int version,
+                             const char *block_id)
+{
+    PackStore *st = get_store (bend, store_id);
+    PackLoc loc;
+    PackLoc *found = NULL;
+    char path[SEAF_PATH_MAX];
+    int fd = -1;
+
+    pthread_mutex_lock (&st->lock);
+    if (sync_store (st) == 0)
+        found = g_hash_table_lookup (st->blocks, block_id);
+    if (found) {
+        loc = *found;
+        pack_path (st, loc.pack, path);
+        fd = g_open (path, O_RDONLY | O_BINARY, 0);
+    }
+    pthread_mutex_unlock (&st->lock);
+
+    if (fd < 0)
+        return -1;
+
+    /* Only the range of the block, packs are large. */
+    posix_fadvise (fd, (off_t)loc.offset, (off_t)loc.len, POSIX_FADV_WILLNEED);
+    close (fd);
+
+    return loc.len;
+}
+#endif
+
+static int
+block_backend_pack_remove_block (BlockBackend *bend,
+                                 const char *store_id,
+                                 int version,
+                                 const char *block_id)
+{
+    PackStore *st = get_store (bend, store_id);
+    PackIndexRecord rec;
+    int ret = -1;
+
+    pthread_mutex_lock (&st->lock);
+    if (lock_store (st) < 0)
+        goto out;
+
+    if (g_hash_table_lookup (st->blocks, block_id)) {
+        fill_record (&rec, block_id, NULL, PACK_RECORD_REMOVED);
+        ret = append_records (st, &rec, 1);
+    }
+
+    unlock_store (st);
+out:
+    pthread_mutex_unlock (&st->lock);
+    return ret;
+}
+
+static BMetadata *
+block_backend_pack_stat_block (BlockBackend *bend,
+                               const char *store_id,
+                               int version,
+                               const char *block_id)
+{
+    PackStore *st = get_store (bend, store_id);
+    PackLoc *loc = NULL;
+    BMetadata *block_md = NULL;
+
+    pthread_mutex_lock (&st->lock);
+    if (sync_store (st) == 0)
+        loc = g_hash_table_lookup (st->blocks, block_id);
+    if (loc) {
+        block_md = g_new0 (BMetadata, 1);
+        memcpy (block_md->id, block_id, 40);
+        block_md->size = loc->len;
+    }
+    pthread_mutex_unlock (&st->lock);
+
+    if (!block_md)
+        seaf_warning ("[pack bend] Failed to stat block %s in store %s.\n",
+                      block_id, store_id);
+    return block_md;
+}
+
+static BMetadata *
+block_backend_pack_stat_block_by_handle (BlockBackend *bend,
+                                         BHandle *handle)
+{
+    BMetadata *block_md;
+
+    block_md = g_new0 (BMetadata, 1);
+    memcpy (block_md->id, handle->block_id, 40);
+    if (handle->rw_type == BLOCK_READ)
+        block_md->size = handle->len;
+    else
+        block_md->size = handle->wbuf->len - sizeof(PackEntryHeader);
+
+    return block_md;
+}
+
+static int
+block_backend_pack_foreach_block (BlockBackend *bend,
+                                  const char *store_id,
+                                  int version,
+                                  SeafBlockFunc process,
+                                  void *user_data)
+{
+    PackStore *st = get_store (bend, store_id);
+    GList *ids = NULL, *ptr;
+    GHashTableIter iter;
+    gpointer key, value;
+    int ret = 0;
+
+    /* Take a snapshot, so that @process may remove blocks. */
+    pthread_mutex_lock (&st->lock);
+    if (sync_store (st) < 0) {
+        ret = -1;
+    } else {
+        g_hash_table_iter_init (&iter, st->blocks);
+        while (g_hash_table_iter_next (&iter, &key, &value))
+            ids = g_list_prepend (ids, g_strdup((char *)key));
+    }
+    pthread_mutex_unlock (&st->lock);
+
+    for (ptr = ids; ptr; ptr = ptr->next) {
+        if (!process (store_id, version, ptr->data, user_data))
+            break;
+    }
+
+    string_list_free (ids);
+    return ret;
+}
+
+static int
+block_backend_pack_copy (BlockBackend *bend,
+                         const char *src_store_id,
+                         int src_version,
+                         const char *dst_store_id,
+                         int dst_version,
+                         const char *block_id)
+{
+    PackStore *src = get_store (bend, src_store_id);
+    PackStore *dst = get_store (bend, dst_store_id);
+    PackIndexRecord rec;
+    PackLoc *found = NULL;
+    PackLoc loc;
+    guint8 *entry = NULL;
+    int ret = -1;
+
+    if (src == dst)
+        return 0;
+
+    /* Read first, so that the two stores are never locked together. */
+    pthread_mutex_lock (&src->lock);
+    if (sync_store (src) == 0)
+        found = g_hash_table_lookup (src->blocks, block_id);
+    if (found) {
+        loc = *found;
+        entry = read_entry (src, block_id, &loc);
+    }
+    pthread_mutex_unlock (&src->lock);
+
+    if (!entry) {
+        seaf_warning ("[pack bend] Failed to read block %s from store %s.\n",
+                      block_id, src_store_id);
+        return -1;
+    }
+
+    pthread_mutex_lock (&dst->lock);
+    if (lock_store (dst) < 0)
+        goto out;
+
+    if (g_hash_table_lookup (dst->blocks, block_id)) {
+        ret = 0;
+    } else if (append_entry (dst, entry, ENTRY_SIZE(loc.len), &loc) == 0) {
+        fill_record (&rec, block_id, &loc, 0);
+        ret = append_records (dst, &rec, 1);
+    }
+
+    unlock_store (dst);
+out:
+    pthread_mutex_unlock (&dst->lock);
+    g_free (entry);
+    return ret;
+}
+
+static int
+block_backend_pack_remove_store (BlockBackend *bend, const char *store_id)
+{
+    PackStore *st = get_store (bend, store_id);
+    GDir *dir;
+    const char *dname;
+    char *path;
+
+    pthread_mutex_lock (&st->lock);
+
+    dir = g_dir_open (st->dir, 0, NULL);
+    if (!dir) {
+        pthread_mutex_unlock (&st->lock);
+        return 0;
+    }
+
+    if (lock_store (st) < 0) {
+        g_dir_close (dir);
+        pthread_mutex_unlock (&st->lock);
+        return -1;
+    }
+
+    while ((dname = g_dir_read_name (dir)) != NULL) {
+        path = g_build_filename (st->dir, dname, NULL);
+        g_unlink (path);
+        g_free (path);
+    }
+    g_dir_close (dir);
+    g_rmdir (st->dir);
+
+    reset_store (st);
+    st->loaded = TRUE;
+
+    unlock_store (st);
+    close (st->lock_fd);
+    st->lock_fd = -1;
+
+    pthread_mutex_unlock (&st->lock);
+
+    return 0;
+}
+
+/* Replace the index with one record per live block. */
+static int
+rewrite_index (PackStore *st)
+{
+    char path[SEAF_PATH_MAX], tmp_path[SEAF_PATH_MAX];
+    PackIndexRecord recs[INDEX_BATCH];
+    GHashTableIter iter;
+    gpointer key, value;
+    SeafStat sb;
+    guint64 n_records = 0;
+    int fd, n = 0;
+    size_t len;
+
+    snprintf (path, sizeof(path), "%s/index", st->dir);
+    snprintf (tmp_path, sizeof(tmp_path), "%s/index.tmp", st->dir);
+
+    fd = g_open (tmp_path, O_WRONLY | O_CREAT | O_TRUNC | O_BINARY, 0644);
+    if (fd < 0) {
+        seaf_warning ("[pack bend] Failed to open %s: %s.\n",
+                      tmp_path, strerror(errno));
+        return -1;
+    }
+
+    g_hash_table_iter_init (&iter, st->blocks);
+    while (1) {
+        gboolean more = g_hash_table_iter_next (&iter, &key, &value);
+
+        if (more)
+            fill_record (&recs[n++], key, value, 0);
+        if (n == INDEX_BATCH || (!more && n > 0)) {
+            len = n * sizeof(PackIndexRecord);
+            if (writen (fd, recs, len) != len)
+                goto error;
+            n_records += n;
+            n = 0;
+        }
+        if (!more)
+            break;
+    }
+
+    if (fsync (fd) < 0 || seaf_fstat (fd, &sb) < 0)
+        goto error;
+    close (fd);
+
+    if (g_rename (tmp_path, path) < 0) {
+        seaf_warning ("[pack bend] Failed to rename %s: %s.\n",
+                      tmp_path, strerror(errno));
+        g_unlink (tmp_path);
+        return -1;
+    }
+
+    st->index_ino = (guint64)sb.st_ino;
+    st->index_off = n_records * sizeof(PackIndexRecord);
+    st->n_records = n_records;
+
+    return 0;
+
+error:
+    seaf_warning ("[pack bend] Failed to write %s: %s.\n",
+                  tmp_path, strerror(errno));
+    close (fd);
+    g_unlink (tmp_path);
+    return -1;
+}
+
+/*
+ * Move the live blocks of packs that are mostly dead into a new pack,
+ * then drop those packs. The index is rewritten when packs are dropped,
+ * or when it is mostly records of removed blocks.
+ *
+ * The new pack is synced before the new index replaces the old one, and
+ * old packs are only removed after that. A crash at any point leaves a
+ * readable store. At worst there is an orphan pack tail that the next
+ * compaction treats as dead space.
+ */
+static int
+block_backend_pack_compact (BlockBackend *bend, const char *store_id)
+{
+    PackStore *st = get_store (bend, store_id);
+    GHashTableIter iter;
+    gpointer key, value;
+    GList *victims = NULL, *ptr;
+    PackStat *ps;
+    PackLoc *loc, new_loc;
+    guint8 *entry;
+    guint32 cur_pack;
+    guint64 moved = 0, freed = 0;
+    char path[SEAF_PATH_MAX];
+    int ret = -1;
+
+    pthread_mutex_lock (&st->lock);
+    if (lock_store (st) < 0)
+        goto out;
+
+    /* Pack sizes are only read on a full load. */
+    st->loaded = FALSE;
+    if (sync_store (st) < 0)
+        goto unlock;
+
+    /* The current pack is still being filled. */
+    cur_pack = st->max_pack;
+    g_hash_table_iter_init (&iter, st->packs);
+    while (g_hash_table_iter_next (&iter, &key, &value)) {
+        ps = value;
+        if (GPOINTER_TO_UINT(key) == cur_pack || ps->live > ps->size)
+            continue;
+        if (ps->size - ps->live >= (guint64)(ps->size * PACK_COMPACT_RATIO))
+            victims = g_list_prepend (victims, key);
+    }
+
+    if (!victims && st->n_records < 2 * g_hash_table_size (st->blocks) + INDEX_BATCH) {
+        ret = 0;
+        goto unlock;
+    }
+
+    if (victims) {
+        /* Move live blocks into a fresh pack, not next to new uploads. */
+        if (get_pack_stat (st, cur_pack)->size > 0) {
+            if (st->write_fd >= 0) {
+                close (st->write_fd);
+                st->write_fd = -1;
+            }
+            ++st->max_pack;
+        }
+
+        g_hash_table_iter_init (&iter, st->blocks);
+        while (g_hash_table_iter_next (&iter, &key, &value)) {
+            loc = value;
+            if (!g_list_find (victims, GUINT_TO_POINTER(loc->pack)))
+                continue;
+
+            entry = read_entry (st, key, loc);
+            if (!entry ||
+                append_entry (st, entry, ENTRY_SIZE(loc->len), &new_loc) < 0) {
+                g_free (entry);
+                goto fail;
+            }
+            g_free (entry);
+
+            get_pack_stat (st, loc->pack)->live -= ENTRY_SIZE(loc->len);
+            get_pack_stat (st, new_loc.pack)->live += ENTRY_SIZE(new_loc.len);
+            *loc = new_loc;
+            moved += ENTRY_SIZE(new_loc.len);
+        }
+
+        if (st->write_fd >= 0 && fsync (st->write_fd) < 0) {
+            seaf_warning ("[pack bend] Failed to sync pack %u in %s: %s.\n",
+                          st->write_pack, st->dir, strerror(errno));
+            goto fail;
+        }
+    }
+
+    if (rewrite_index (st) < 0)
+        goto fail;
+
+    for (ptr = victims; ptr; ptr = ptr->next) {
+        guint32 pack = GPOINTER_TO_UINT(ptr->data);
+
+        freed += get_pack_stat (st, pack)->size;
+        pack_path (st, pack, path);
+        if (g_unlink (path) < 0)
+            seaf_warning ("[pack bend] Failed to remove %s: %s.\n",
+                          path, strerror(errno));
+        g_hash_table_remove (st->packs, ptr->data);
+    }
+
+    if (victims)
+        seaf_message ("Compacted %d packs of store %s, "
+                      "%"G_GUINT64_FORMAT" bytes moved, "
+                      "%"G_GUINT64_FORMAT" bytes freed.\n",
+                      g_list_length (victims), store_id, moved, freed - moved);
+    ret = 0;
+    goto unlock;
+
+fail:
+    /* Drop the half moved state, the old index is still in place. */
+    seaf_warning ("[pack bend] Failed to compact store %s.\n", store_id);
+    st->loaded = FALSE;
+
+unlock:
+    unlock_store (st);
+out:
+    pthread_mutex_unlock (&st->lock);
+    g_list_free (victims);
+    return ret;
+}
+
+BlockBackend *
+block_backend_pack_new (const char *seaf_dir, const char *tmp_dir)
+{
+    BlockBackend *bend;
+    PackPriv *priv;
+
+    bend = g_new0(BlockBackend, 1);
+    priv = g_new0(PackPriv, 1);
+    bend->be_priv = priv;
+
+    priv->pack_dir = g_build_filename (seaf_dir, "storage", "packs", NULL);
+    priv->stores = g_hash_table_new (g_str_hash, g_str_equal);
+    pthread_mutex_init (&priv->lock, NULL);
+
+    if (g_mkdir_with_parents (priv->pack_dir, 0777) < 0) {
+        seaf_warning ("Pack dir %s does not exist and"
+                      " is unable to create\n", priv->pack_dir);
+        goto onerror;
+    }
+
+    bend->open_block = block_backend_pack_open_block;
+    bend->read_block = block_backend_pack_read_block;
+    bend->write_block = block_backend_pack_write_block;
+    bend->commit_block = block_backend_pack_commit_block;
+    bend->close_block = block_backend_pack_close_block;
+    bend->exists = block_backend_pack_block_exists;
+#ifdef POSIX_FADV_WILLNEED
+    bend->prefetch = block_backend_pack_prefetch;
+#endif
+    bend->remove_block = block_backend_pack_remove_block;
+    bend->stat_block = block_backend_pack_stat_block;
+    bend->stat_block_by_handle = block_backend_pack_stat_block_by_handle;
+    bend->block_handle_free = block_backend_pack_block_handle_free;
+    bend->foreach_block = block_backend_pack_foreach_block;
+    bend->remove_store = block_backend_pack_remove_store;
+    bend->copy = block_backend_pack_copy;
+    bend->compact = block_backend_pack_compact;
+
+    return bend;
+
+onerror:
+    g_hash_table_destroy (priv->stores);
+    g_free (priv->pack_dir);
+    g_free (priv);
+    g_free (bend);
+
+    return NULL;
+}
@@ -0,0 +1,804 @@
+/* -*- Mode: C; tab-width: 4; indent-tabs-mode: nil; c-basic-offset: 4 -*- */
+
+#include "common.h"
+
+#include "utils.h"
+
+#include "log.h"
+
+#include "block-backend.h"
+
+#ifdef S3_BACKEND
+
+#include "s3-client.h"
+
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <glib/gstdio.h>
+
+/*
+ * S3 block backend.
+ *
+ * Blocks are stored in the bucket as <store_id>/<block_id>.
+ *
+ * Committing a block doesn't wait for the upload. The block is first
+ * written and synced to a local staging directory,
+ *
+ *   <staging_dir>/<store_id>/<block_id>
+ *
+ * and a background thread uploads it and removes the staged copy. Reads
+ * look at the staging directory before going to S3. Blocks still staged
+ * when the server stops are uploaded at the next start.
+ */
+
+#define DEFAULT_UPLOAD_THREADS 4
+
+/* S3 requires parts of at least 5MB. */
+#define MIN_PART_SIZE (5 * 1024 * 1024)
+#define DEFAULT_PART_SIZE (8 * 1024 * 1024)
+#define MAX_PARALLEL_PARTS 4
+
+#define UPLOAD_RETRIES 5
+
+typedef struct {
+    SeafS3Config    *conf;
+
+    GQueue          *conn_pool;
+    pthread_mutex_t  lock;
+
+    char            *staging_dir;
+    GThreadPool     *uploaders;
+    gint64           part_size;
+} S3BlockPriv;
+
+struct _BHandle {
+    char    *store_id;
+    int     version;
+    char    block_id[41];
+    int     rw_type;
+
+    /* Read: the whole block. Write: the content so far. */
+    GByteArray *buf;
+    guint32 pos;
+};
+
+typedef struct UploadTask {
+    char    *store_id;
+    char    block_id[41];
+} UploadTask;
+
+static SeafS3Client *
+get_connection (S3BlockPriv *priv)
+{
+    SeafS3Client *connection;
+
+    pthread_mutex_lock (&priv->lock);
+
+    connection = g_queue_pop_head (priv->conn_pool);
+    if (!connection)
+        connection = seaf_s3_client_new (priv->conf);
+    pthread_mutex_unlock (&priv->lock);
+    return connection;
+}
+
+static void
+return_connection (S3BlockPriv *priv, SeafS3Client *connection)
+{
+    pthread_mutex_lock (&priv->lock);
+    g_queue_push_tail (priv->conn_pool, connection);
+    pthread_mutex_unlock (&priv->lock);
+}
+
+static char *
+block_key (const char *store_id, const char *block_id)
+{
+    return g_strconcat (store_id, "/", block_id, NULL);
+}
+
+static char *
+staged_path (S3BlockPriv *priv, const char *store_id, const char *block_id)
+{
+    return g_build_filename (priv->staging_dir, store_id, block_id, NULL);
+}
+
+static void
+queue_upload (S3BlockPriv *priv, const char *store_id, const char *block_id)
+{
+    UploadTask *task = g_new0 (UploadTask, 1);
+
+    task->store_id = g_strdup (store_id);
+    memcpy (task->block_id, block_id, 40);
+    g_thread_pool_push (priv->uploaders, task, NULL);
+}
+
+static int
+upload_block (S3BlockPriv *priv, const char *key,
+              const char *data, gint64 len)
+{
+    SeafS3Client *conn = get_connection (priv);
+    int ret;
+
+    if (!conn)
+        return -1;
+
+    if (len > priv->part_size)
+        ret = seaf_s3_client_put_multipart (conn, key, data, len,
+                                            priv->part_size,
+                                            MAX_PARALLEL_PARTS);
+    else
+        ret = seaf_s3_client_put (conn, key, data, (int)len);
+
+    return_connection (priv, conn);
+    return ret;
+}
+
+static void
+upload_thread (gpointer data, gpointer user_data)
+{
+    UploadTask *task = data;
+    S3BlockPriv *priv = user_data;
+    char *path = staged_path (priv, task->store_id, task->block_id);
+    char *key = block_key (task->store_id, task->block_id);
+    char *content = NULL;
+    gsize len;
+    GError *error = NULL;
+    int i;
+
+    /* Already uploaded by an earlier task, or removed. */
+    if (!g_file_get_contents (path, &content, &len, &error)) {
+        if (error->code != G_FILE_ERROR_NOENT)
+            seaf_warning ("[s3 bend] Failed to read staged block %s: %s.\n",
+                          path, error->message);
+        g_clear_error (&error);
+        goto out;
+    }
+
+    for (i = 0; i < UPLOAD_RETRIES; ++i) {
+        if (upload_block (priv, key, content, (gint64)len) == 0)
+            break;
+        /* 1, 2, 4, 8 seconds. */
+        if (i < UPLOAD_RETRIES - 1)
+            g_usleep ((1 << i) * G_USEC_PER_SEC);
+    }
+
+    if (i == UPLOAD_RETRIES) {
+        seaf_warning ("[s3 bend] Failed to upload block %s, "
+                      "will retry at next start.\n", key);
+        goto out;
+    }
+
+    /* Only drop the local copy once S3 has it, so that the block is
+     * always readable from one of the two places.
+     */
+    g_unlink (path);
+
+out:
+    g_free (content);
+    g_free (path);
+    g_free (key);
+    g_free (task->store_id);
+    g_free (task);
+}
+
+static int
+stage_block (S3BlockPriv *priv, const char *store_id, const char *block_id,
+             const void *data, gsize len)
+{
+    char *dir = g_build_filename (priv->staging_dir, store_id, NULL);
+    char *path = NULL, *tmp_path = NULL;
+    int fd = -1;
+    int ret = -1;
+
+    if (checkdir_with_mkdir (dir) < 0) {
+        seaf_warning ("[s3 bend] Failed to create staging dir %s.\n", dir);
+        goto out;
+    }
+
+    /* Temp files start with a dot, so they are never taken for blocks. */
+    tmp_path = g_strdup_printf ("%s/.%s.XXXXXX", dir, block_id);
+    fd = g_mkstemp (tmp_path);
+    if (fd < 0) {
+        seaf_warning ("[s3 bend] Failed to create %s: %s.\n",
+                      tmp_path, strerror(errno));
+        goto out;
+    }
+
+    if (writen (fd, data, len) != (ssize_t)len || fsync (fd) < 0) {
+        seaf_warning ("[s3 bend] Failed to write %s: %s.\n",
+                      tmp_path, strerror(errno));
+        goto out;
+    }
+    close (fd);
+    fd = -1;
+
+    path = staged_path (priv, store_id, block_id);
+    if (g_rename (tmp_path, path) < 0) {
+        seaf_warning ("[s3 bend] Failed to rename %s: %s.\n",
+                      tmp_path, strerror(errno));
+        goto out;
+    }
+
+    ret = 0;
+
+out:
+    if (fd >= 0)
+        close (fd);
+    if (ret < 0 && tmp_path)
+        g_unlink (tmp_path);
+    g_free (dir);
+    g_free (path);
+    g_free (tmp_path);
+    return ret;
+}
+
+/* Read a block from staging, or from S3 if it's not (or no longer) there. */
+static int
+fetch_block (S3BlockPriv *priv, const char *store_id, const char *block_id,
+             void **data, int *len)
+{
+    char *path = staged_path (priv, store_id, block_id);
+    char *key;
+    gsize size;
+    int ret;
+
+    if (g_file_get_contents (path, (char **)data, &size, NULL)) {
+        *len = (int)size;
+        g_free (path);
+        return 0;
+    }
+    g_free (path);
+
+    SeafS3Client *conn = get_connection (priv);
+    if (!conn)
+        return -1;
+
+    key = block_key (store_id, block_id);
+    ret = seaf_s3_client_get (conn, key, data, len);
+    g_free (key);
+
+    return_connection (priv, conn);
+    return ret;
+}
+
+static BHandle *
+block_backend_s3_open_block (BlockBackend *bend,
+                             const char *store_id,
+                             int version,
+                             const char *block_id,
+                             int rw_type)
+{
+    S3BlockPriv *priv = bend->be_priv;
+    BHandle *handle;
+    void *data = NULL;
+    int len = 0;
+
+    g_return_val_if_fail (block_id != NULL, NULL);
+    g_return_val_if_fail (strlen(block_id) == 40, NULL);
+    g_return_val_if_fail (rw_type == BLOCK_READ || rw_type == BLOCK_WRITE, NULL);
+
+    if (rw_type == BLOCK_READ &&
+        fetch_block (priv, store_id, block_id, &data, &len) < 0) {
+        seaf_warning ("[s3 bend] Failed to read block %s in store %s.\n",
+                      block_id, store_id);
+        return NULL;
+    }
+
+    handle = g_new0 (BHandle, 1);
+    memcpy (handle->block_id, block_id, 41);
+    handle->rw_type = rw_type;
+    handle->buf = g_byte_array_new ();
+    if (data) {
+        g_byte_array_append (handle->buf, data, len);
+        g_free (data);
+    }
+    if (store_id)
+        handle->store_id = g_strdup(store_id);
+    handle->version = version;
+
+    return handle;
+}
+
+static int
+block_backend_s3_read_block (BlockBackend *bend,
+                             BHandle *handle,
+                             void *buf, int len)
+{
+    int n;
+
+    n = MIN ((guint32)len, handle->buf->len - handle->pos);
+    memcpy (buf, handle->buf->data + handle->pos, n);
+    handle->pos += n;
+    return n;
+}
+
+static int
+block_backend_s3_write_block (BlockBackend *bend,
+                              BHandle *handle,
+                              const void *buf, int len)
+{
+    g_byte_array_append (handle->buf, buf, len);
+    return len;
+}
+
+static int
+block_backend_s3_close_block (BlockBackend *bend,
+                              BHandle *handle)
+{
+    return 0;
+}
+
+static void
+block_backend_s3_block_handle_free (BlockBackend *bend,
+                                    BHandle *handle)
+{
+    g_byte_array_free (handle->buf, TRUE);
+    g_free (handle->store_id);
+    g_free (handle);
+}
+
+static int
+block_backend_s3_commit_block (BlockBackend *bend,
+                               BHandle *handle)
+{
+    S3BlockPriv *priv = bend->be_priv;
+
+    g_return_val_if_fail (handle->rw_type == BLOCK_WRITE, -1);
+
+    if (stage_block (priv, handle->store_id, handle->block_id,
+                     handle->buf->data, handle->buf->len) < 0)
+        return -1;
+
+    queue_upload (priv, handle->store_id, handle->block_id);
+    return 0;
+}
+
+static gboolean
+block_backend_s3_block_exists (BlockBackend *bend,
+                               const char *store_id,
+                               int version,
+                               const char *block_sha1)
+{
+    S3BlockPriv *priv = bend->be_priv;
+    char *path = staged_path (priv, store_id, block_sha1);
+    char *key;
+    gboolean ret;
+
+    ret = g_file_test (path, G_FILE_TEST_EXISTS);
+    g_free (path);
+    if (ret)
+        return TRUE;
+
+    SeafS3Client *conn = get_connection (priv);
+    if (!conn)
+        return FALSE;
+
+    key = block_key (store_id, block_sha1);
+    ret = (seaf_s3_client_head (conn, key, NULL) == 1);
+    g_free (key);
+
+    return_connection (priv, conn);
+    return ret;
+}
+
+static int
+block_backend_s3_exists_batch (BlockBackend *bend,
+                               const char *store_id,
+                               int version,
+                               const char **block_ids,
+                               int n,
+                               gboolean *exists)
+{
+    S3BlockPriv *priv = bend->be_priv;
+    GPtrArray *keys = g_ptr_array_new_with_free_func (g_free);
+    int *idx = g_new (int, n);
+    gboolean *remote;
+    char *path;
+    int i, ret = 0;
+
+    for (i = 0; i < n; ++i) {
+        path = staged_path (priv, store_id, block_ids[i]);
+        exists[i] = g_file_test (path, G_FILE_TEST_EXISTS);
+        g_free (path);
+        if (!exists[i]) {
+            idx[keys->len] = i;
+            g_ptr_array_add (keys, block_key (store_id, block_ids[i]));
+        }
+    }
+
+    if (keys->len > 0) {
+        SeafS3Client *conn = get_connection (priv);
+        if (!conn) {
+            ret = -1;
+            goto out;
+        }
+
+        remote = g_new0 (gboolean, keys->len);
+        ret = seaf_s3_client_head_many (conn, (const char **)keys->pdata,
+                                        keys->len, remote);
+        for (i = 0; i < keys->len; ++i)
+            exists[idx[i]] = remote[i];
+        g_free (remote);
+
+        return_connection (priv, conn);
+    }
+
+out:
+    g_ptr_array_free (keys, TRUE);
+    g_free (idx);
+    return ret;
+}
+
+static int
+block_backend_s3_remove_block (BlockBackend *bend,
+                               const char *store_id,
+                               int version,
+                               const char *block_id)
+{
+    S3BlockPriv *priv = bend->be_priv;
+    char *path = staged_path (priv, store_id, block_id);
+    char *key;
+    int ret;
+
+    g_unlink (path);
+    g_free (path);
+
+    SeafS3Client *conn = get_connection (priv);
+    if (!conn)
+        return -1;
+
+    key = block_key (store_id, block_id);
+    ret = seaf_s3_client_delete (conn, key);
+    g_free (key);
+
+    return_connection (priv, conn);
+    return ret;
+}
+
+static BMetadata *
+block_backend_s3_stat_block (BlockBackend *bend,
+                             const char *store_id,
+                             int version,
+                             const char *block_id)
+{
+    S3BlockPriv *priv = bend->be_priv;
+    char *path = staged_path (priv, store_id, block_id);
+    SeafStat st;
+    gint64 size = -1;
+    BMetadata *block_md;
+
+    if (seaf_stat (path, &st) == 0) {
+        size = st.st_size;
+    } else {
+        SeafS3Client *conn = get_connection (priv);
+        if (conn) {
+            char *key = block_key (store_id, block_id);
+            if (seaf_s3_client_head (conn, key, &size) != 1)
+                size = -1;
+            g_free (key);
+            return_connection (priv, conn);
+        }
+    }
+    g_free (path);
+
+    if (size < 0) {
+        seaf_warning ("[s3 bend] Failed to stat block %s in store %s.\n",
+                      block_id, store_id);
+        return NULL;
+    }
+
+    block_md = g_new0 (BMetadata, 1);
+    memcpy (block_md->id, block_id, 40);
+    block_md->size = (uint32_t)size;
+
+    return block_md;
+}
+
+static BMetadata *
+block_backend_s3_stat_block_by_handle (BlockBackend *bend,
+                                       BHandle *handle)
+{
+    BMetadata *block_md;
+
+    block_md = g_new0 (BMetadata, 1);
+    memcpy (block_md->id, handle->block_id, 40);
+    block_md->size = handle->buf->len;
+
+    return block_md;
+}
+
+static GList *
+list_staged (S3BlockPriv *priv, const char *store_id)
+{
+    char *dir_path = g_build_filename (priv->staging_dir, store_id, NULL);
+    GDir *dir;
+    const char *dname;
+    GList *ids = NULL;
+
+    dir = g_dir_open (dir_path, 0, NULL);
+    if (dir) {
+        while ((dname = g_dir_read_name (dir)) != NULL) {
+            if (dname[0] != '.' && strlen (dname) == 40)
+                ids = g_list_prepend (ids, g_strdup (dname));
+        }
+        g_dir_close (dir);
+    }
+
+    g_free (dir_path);
+    return ids;
+}
+
+typedef struct ForeachData {
+    const char *store_id;
+    int version;
+    size_t prefix_len;
+    SeafBlockFunc process;
+    void *user_data;
+    GHashTable *seen;
+} ForeachData;
+
+static gboolean
+foreach_key (const char *key, void *user_data)
+{
+    ForeachData *data = user_data;
+    const char *block_id = key + data->prefix_len;
+
+    if (strlen (block_id) != 40 || g_hash_table_lookup (data->seen, block_id))
+        return TRUE;
+
+    return data->process (data->store_id, data->version, block_id,
+                          data->user_data);
+}
+
+static int
+block_backend_s3_foreach_block (BlockBackend *bend,
+                                const char *store_id,
+                                int version,
+                                SeafBlockFunc process,
+                                void *user_data)
+{
+    S3BlockPriv *priv = bend->be_priv;
+    GList *staged, *ptr;
+    ForeachData data;
+    char *prefix;
+    int ret = 0;
+
+    data.seen = g_hash_table_new (g_str_hash, g_str_equal);
+
+    /* A block may be both staged and uploaded, report it once. */
+    staged = list_staged (priv, store_id);
+    for (ptr = staged; ptr; ptr = ptr->next) {
+        g_hash_table_insert (data.seen, ptr->data, ptr->data);
+        if (!process (store_id, version, ptr->data, user_data))
+            goto out;
+    }
+
+    SeafS3Client *conn = get_connection (priv);
+    if (!conn) {
+        ret = -1;
+        goto out;
+    }
+
+    prefix = g_strconcat (store_id, "/", NULL);
+    data.store_id = store_id;
+    data.version = version;
+    data.prefix_len = strlen (prefix);
+    data.process = process;
+    data.user_data = user_data;
+
+    ret = seaf_s3_client_list (conn, prefix, foreach_key, &data);
+    g_free (prefix);
+
+    return_connection (priv, conn);
+
+out:
+    g_hash_table_destroy (data.seen);
+    string_list_free (staged);
+    return ret;
+}
+
+static int
+block_backend_s3_copy (BlockBackend *bend,
+                       const char *src_store_id,
+                       int src_version,
+                       const char *dst_store_id,
+                       int dst_version,
+                       const char *block_id)
+{
+    S3BlockPriv *priv = bend->be_priv;
+    char *path = staged_path (priv, src_store_id, block_id);
+    char *content = NULL;
+    gsize len;
+    char *src_key, *dst_key;
+    int ret;
+
+    /* Not uploaded yet, stage a copy instead. */
+    if (g_file_get_contents (path, &content, &len, NULL)) {
+        g_free (path);
+        ret = stage_block (priv, dst_store_id, block_id, content, len);
+        g_free (content);
+        if (ret == 0)
+            queue_upload (priv, dst_store_id, block_id);
+        return ret;
+    }
+    g_free (path);
+
+    SeafS3Client *conn = get_connection (priv);
+    if (!conn)
+        return -1;
+
+    src_key = block_key (src_store_id, block_id);
+    dst_key = block_key (dst_store_id, block_id);
+    ret = seaf_s3_client_copy (conn, src_key, dst_key);
+    g_free (src_key);
+    g_free (dst_key);
+
+    return_connection (priv, conn);
+    return ret;
+}
+
+static gboolean
+collect_key (const char *key, void *user_data)
+{
+    GList **keys = user_data;
+
+    *keys = g_list_prepend (*keys, g_strdup (key));
+    return TRUE;
+}
+
+static int
+block_backend_s3_remove_store (BlockBackend *bend, const char *store_id)
+{
+    S3BlockPriv *priv = bend->be_priv;
+    GList *staged, *keys = NULL, *ptr;
+    char *path, *prefix;
+    int ret = 0;
+
+    staged = list_staged (priv, store_id);
+    for (ptr = staged; ptr; ptr = ptr->next) {
+        path = staged_path (priv, store_id, ptr->data);
+        g_unlink (path);
+        g_free (path);
+    }
+    string_list_free (staged);
+
+    path = g_build_filename (priv->staging_dir, store_id, NULL);
+    g_rmdir (path);
+    g_free (path);
+
+    SeafS3Client *conn = get_connection (priv);
+    if (!conn)
+        return -1;
+
+    /* Don't delete while listing, that could skip keys. */
+    prefix = g_strconcat (store_id, "/", NULL);
+    if (seaf_s3_client_list (conn, prefix, collect_key, &keys) < 0)
+        ret = -1;
+    g_free (prefix);
+
+    for (ptr = keys; ptr; ptr = ptr->next) {
+        if (seaf_s3_client_delete (conn, ptr->data) < 0)
+            ret = -1;
+    }
+    string_list_free (keys);
+
+    return_connection (priv, conn);
+    return ret;
+}
+
+/* Queue the blocks left in staging by the last run. */
+static void
+recover_staged_blocks (S3BlockPriv *priv)
+{
+    GDir *dir;
+    const char *store_id;
+    GList *ids, *ptr;
+    int n = 0;
+
+    dir = g_dir_open (priv->staging_dir, 0, NULL);
+    if (!dir)
+        return;
+
+    while ((store_id = g_dir_read_name (dir)) != NULL) {
+        ids = list_staged (priv, store_id);
+        for (ptr = ids; ptr; ptr = ptr->next) {
+            queue_upload (priv, store_id, ptr->data);
+            ++n;
+        }
+        string_list_free (ids);
+    }
+    g_dir_close (dir);
+
+    if (n > 0)
+        seaf_message ("[s3 bend] Uploading %d blocks staged in last run.\n", n);
+}
+
+BlockBackend *
+block_backend_s3_new (GKeyFile *config, const char *seaf_dir)
+{
+    BlockBackend *bend;
+    S3BlockPriv *priv;
+    SeafS3Config *conf;
+    int threads, part_size;
+
+    conf = seaf_s3_config_load (config, "block_backend");
+    if (!conf)
+        return NULL;
+
+    bend = g_new0(BlockBackend, 1);
+    priv = g_new0(S3BlockPriv, 1);
+    bend->be_priv = priv;
+
+    priv->conf = conf;
+    priv->conn_pool = g_queue_new ();
+    pthread_mutex_init (&priv->lock, NULL);
+
+    /* [block_backend]
+     * staging_dir = <seaf_dir>/storage/s3-staging
+     * upload_threads = 4
+     * multipart_part_size = 8   (MB)
+     */
+    priv->staging_dir = g_key_file_get_string (config, "block_backend",
+                                               "staging_dir", NULL);
+    if (!priv->staging_dir)
+        priv->staging_dir = g_build_filename (seaf_dir, "storage",
+                                              "s3-staging", NULL);
+    if (g_mkdir_with_parents (priv->staging_dir, 0777) < 0) {
+        seaf_warning ("Staging dir %s does not exist and"
+                      " is unable to create\n", priv->staging_dir);
+        goto onerror;
+    }
+
+    threads = g_key_file_get_integer (config, "block_backend",
+                                      "upload_threads", NULL);
+    if (threads <= 0)
+        threads = DEFAULT_UPLOAD_THREADS;
+
+    part_size = g_key_file_get_integer (config, "block_backend",
+                                        "multipart_part_size", NULL);
+    priv->part_size = part_size > 0 ? (gint64)part_size << 20 : DEFAULT_PART_SIZE;
+    if (priv->part_size < MIN_PART_SIZE)
+        priv->part_size = MIN_PART_SIZE;
+
+    priv->uploaders = g_thread_pool_new (upload_thread, priv,
+                                         threads, FALSE, NULL);
+
+    bend->open_block = block_backend_s3_open_block;
+    bend->read_block = block_backend_s3_read_block;
+    bend->write_block = block_backend_s3_write_block;
+    bend->commit_block = block_backend_s3_commit_block;
+    bend->close_block = block_backend_s3_close_block;
+    bend->exists = block_backend_s3_block_exists;
+    bend->exists_batch = block_backend_s3_exists_batch;
+    bend->remove_block = block_backend_s3_remove_block;
+    bend->stat_block = block_backend_s3_stat_block;
+    bend->stat_block_by_handle = block_backend_s3_stat_block_by_handle;
+    bend->block_handle_free = block_backend_s3_block_handle_free;
+    bend->foreach_block = block_backend_s3_foreach_block;
+    bend->remove_store = block_backend_s3_remove_store;
+    bend->copy = block_backend_s3_copy;
+
+    recover_staged_blocks (priv);
+
+    return bend;
+
+onerror:
+    g_queue_free (priv->conn_pool);
+    seaf_s3_config_free (priv->conf);
+    g_free (priv->staging_dir);
+    g_free (priv);
+    g_free (bend);
+
+    return NULL;
+}
+
+#else
+
+BlockBackend *
+block_backend_s3_new (GKeyFile *config, const char *seaf_dir)
+{
+    seaf_warning ("S3 backend is not enabled.\n");
+    return NULL;
+}
+
+#endif  /* S3_BACKEND */
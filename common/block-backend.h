@@ -25,6 +25,12 @@ struct BlockBackend {
                         const char *store_id, int version,
                         const char *block_id);
 
+    /* Optional. Set @exists[i] for each of the @n blocks. */
+    int      (*exists_batch) (BlockBackend *bend,
+                              const char *store_id, int version,
+                              const char **block_ids, int n,
+                              gboolean *exists);
+
     int      (*remove_block) (BlockBackend *bend,
                               const char *store_id, int version,
                               const char *block_id);
@@ -35,6 +41,21 @@ struct BlockBackend {
     
     BMetadata* (*stat_block_by_handle) (BlockBackend *bend, BHandle *handle);
 
+    /* Optional. For a block opened for read and not read from yet,
+     * return a new fd holding its raw content from offset 0, and its
+     * @size. Returns -1 if the content isn't a plain file.
+     */
+    int      (*get_block_fd) (BlockBackend *bend, BHandle *handle,
+                              guint32 *size);
+
+    /* Optional. Start reading a block into memory, or into a faster
+     * tier, without waiting for it. Returns the bytes to be read, or -1
+     * if the block can't be found.
+     */
+    gint64   (*prefetch) (BlockBackend *bend,
+                          const char *store_id, int version,
+                          const char *block_id);
+
     void     (*block_handle_free) (BlockBackend *bend, BHandle *handle);
 
     int      (*foreach_block) (BlockBackend *bend,
@@ -43,6 +64,16 @@ struct BlockBackend {
                                SeafBlockFunc process,
                                void *user_data);
 
+    /* Optional. Enumerate blocks in sorted batches by prefix, starting
+     * at @start_prefix (NULL for all). See SeafBlockBatchFunc.
+     */
+    int      (*foreach_block_batch) (BlockBackend *bend,
+                                     const char *store_id,
+                                     int version,
+                                     const char *start_prefix,
+                                     SeafBlockBatchFunc process,
+                                     void *user_data);
+
     int         (*copy) (BlockBackend *bend,
                          const char *src_store_id,
                          int src_version,
@@ -54,6 +85,10 @@ struct BlockBackend {
     int      (*remove_store) (BlockBackend *bend,
                               const char *store_id);
 
+    /* Optional. Reclaim the space of removed blocks. */
+    int      (*compact) (BlockBackend *bend,
+                         const char *store_id);
+
     void*    be_priv;           /* backend private field */
 
 };
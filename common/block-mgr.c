@@ -6,6 +6,7 @@
 #include "utils.h"
 #include "seaf-utils.h"
 #include "block-mgr.h"
+#include "seaf-sha1.h"
 #include "log.h"
 
 #include <stdio.h>
@@ -16,24 +17,176 @@
 #include <sys/types.h>
 #include <dirent.h>
 #include <glib/gstdio.h>
+#include <pthread.h>
 
 #include "block-backend.h"
+#include "exists-filter.h"
+#include "io-stats.h"
 
 #define SEAF_BLOCK_DIR "blocks"
 
+/* Disks serve a few concurrent reads faster than one at a time. */
+#define ASYNC_READ_THREADS 8
+
+typedef struct WriteHandle {
+    char    *store_id;
+    char    block_id[41];
+} WriteHandle;
+
+struct SeafBlockManagerPriv {
+    ExistsFilter    *exists_filter;
+
+    /* Blocks opened for write, added to the filter once committed. */
+    GHashTable      *write_handles;     /* BlockHandle -> WriteHandle */
+
+    /* Created on first use of seaf_block_manager_read_block_async(). */
+    GThreadPool     *read_pool;
+
+    /* The block cache backend, if enabled. It wraps the primary one. */
+    BlockBackend    *cache;
+
+    /* The fs backend, if it shares blocks between stores. */
+    BlockBackend    *dedup;
+
+    BlockCommitHook  commit_hook;
+
+    int              io_source;     /* see io-stats.h */
+
+    pthread_mutex_t  lock;
+};
+
 
 extern BlockBackend *
 block_backend_fs_new (const char *block_dir, const char *tmp_dir);
 
+extern void
+block_backend_fs_set_compression (BlockBackend *bend, int level);
+
+extern void
+block_backend_fs_set_dedup (BlockBackend *bend, gboolean dedup);
+
+extern gboolean
+block_backend_fs_block_is_shared (BlockBackend *bend,
+                                  const char *store_id,
+                                  int version,
+                                  const char *block_id);
+
+extern void
+block_backend_fs_get_dedup_stats (BlockBackend *bend, BlockDedupStats *stats);
+
+extern int
+block_backend_fs_scan_pool (BlockBackend *bend, gboolean remove_orphans,
+                            BlockDedupStats *stats);
+
+#ifdef SEAFILE_SERVER
+extern BlockBackend *
+block_backend_pack_new (const char *seaf_dir, const char *tmp_dir);
+
+extern BlockBackend *
+block_backend_s3_new (GKeyFile *config, const char *seaf_dir);
+
+extern BlockBackend *
+block_backend_cache_new (BlockBackend *primary,
+                         const char *cache_dir,
+                         guint64 max_bytes,
+                         gboolean write_through);
+
+extern void
+block_backend_cache_get_stats (BlockBackend *bend, BlockCacheStats *stats);
+
+/* [block_cache]
+ * dir = /ssd/seafile-block-cache
+ * size = 10240            (MB)
+ * write_policy = write-around | write-through
+ */
+static int
+init_block_cache (SeafBlockManager *mgr, GKeyFile *config)
+{
+    BlockBackend *cache;
+    char *dir, *policy;
+    gint64 size;
+    gboolean write_through = FALSE;
+
+    dir = g_key_file_get_string (config, "block_cache", "dir", NULL);
+    if (!dir)
+        return 0;
+
+    size = g_key_file_get_int64 (config, "block_cache", "size", NULL);
+    if (size <= 0) {
+        g_warning ("[Block mgr] Block cache size is not set.\n");
+        g_free (dir);
+        return -1;
+    }
+
+    policy = g_key_file_get_string (config, "block_cache", "write_policy", NULL);
+    if (policy && strcmp (policy, "write-through") == 0)
+        write_through = TRUE;
+    else if (policy && strcmp (policy, "write-around") != 0)
+        g_warning ("[Block mgr] Unknown block cache write policy %s.\n", policy);
+
+    cache = block_backend_cache_new (mgr->backend, dir,
+                                     (guint64)size << 20, write_through);
+    g_free (dir);
+    g_free (policy);
+    if (!cache)
+        return -1;
+
+    mgr->priv->cache = cache;
+    mgr->backend = cache;
+    return 0;
+}
+#endif
+
 
 SeafBlockManager *
 seaf_block_manager_new (struct _SeafileSession *seaf,
                         const char *seaf_dir)
 {
     SeafBlockManager *mgr;
+    const char *backend_name = "fs";
+    char *label;
 
     mgr = g_new0 (SeafBlockManager, 1);
     mgr->seaf = seaf;
+    mgr->priv = g_new0 (struct SeafBlockManagerPriv, 1);
+    pthread_mutex_init (&mgr->priv->lock, NULL);
+
+#ifdef SEAFILE_SERVER
+    /* [block_backend]
+     * name = pack
+     *
+     * Stores blocks in pack files instead of one file per block.
+     */
+    char *name = g_key_file_get_string (seaf->config,
+                                        "block_backend", "name", NULL);
+    if (name && strcmp (name, "pack") == 0) {
+        g_free (name);
+        mgr->backend = block_backend_pack_new (seaf_dir, seaf->tmp_file_dir);
+        if (!mgr->backend) {
+            g_warning ("[Block mgr] Failed to load backend.\n");
+            goto onerror;
+        }
+        backend_name = "pack";
+        goto cache;
+    }
+
+    /* [block_backend]
+     * name = s3
+     *
+     * See s3-client.h and block-backend-s3.c for the other options.
+     */
+    if (name && strcmp (name, "s3") == 0) {
+        g_free (name);
+        mgr->backend = block_backend_s3_new (seaf->config, seaf_dir);
+        if (!mgr->backend) {
+            g_warning ("[Block mgr] Failed to load backend.\n");
+            goto onerror;
+        }
+        backend_name = "s3";
+        goto cache;
+    }
+    g_free (name);
+#endif
 
     mgr->backend = block_backend_fs_new (seaf_dir, seaf->tmp_file_dir);
     if (!mgr->backend) {
@@ -41,20 +194,172 @@ seaf_block_manager_new (struct _SeafileSession *seaf,
         goto onerror;
     }
 
+#ifdef SEAFILE_SERVER
+    /* [block_backend]
+     * compression = zlib
+     * compression_level = 1
+     */
+    char *compression = g_key_file_get_string (seaf->config,
+                                               "block_backend", "compression",
+                                               NULL);
+    if (compression && strcmp (compression, "zlib") == 0) {
+        int level = g_key_file_get_integer (seaf->config,
+                                            "block_backend", "compression_level",
+                                            NULL);
+        block_backend_fs_set_compression (mgr->backend, level > 0 ? level : 1);
+    } else if (compression && strcmp (compression, "none") != 0) {
+        g_warning ("[Block mgr] Unknown block compression %s.\n", compression);
+    }
+    g_free (compression);
+
+    /* [block_backend]
+     * dedup = true
+     *
+     * Identical blocks of different stores are kept once.
+     */
+    if (g_key_file_get_boolean (seaf->config, "block_backend", "dedup", NULL)) {
+        block_backend_fs_set_dedup (mgr->backend, TRUE);
+        mgr->priv->dedup = mgr->backend;
+    }
+
+cache:
+    if (init_block_cache (mgr, seaf->config) < 0) {
+        g_warning ("[Block mgr] Failed to load block cache.\n");
+        goto onerror;
+    }
+#endif
+
+    /* With a block cache, the ops timed are those of the cache. */
+    if (mgr->priv->cache)
+        label = g_strconcat (backend_name, "+cache", NULL);
+    else
+        label = g_strdup (backend_name);
+    mgr->priv->io_source = io_stats_register ("blocks", label);
+    g_free (label);
+
     return mgr;
 
 onerror:
+    g_free (mgr->priv);
     g_free (mgr);
 
     return NULL;
 }
 
+int
+seaf_block_manager_get_cache_stats (SeafBlockManager *mgr,
+                                    BlockCacheStats *stats)
+{
+#ifdef SEAFILE_SERVER
+    if (mgr->priv->cache) {
+        block_backend_cache_get_stats (mgr->priv->cache, stats);
+        return 0;
+    }
+#endif
+    return -1;
+}
+
+int
+seaf_block_manager_get_dedup_stats (SeafBlockManager *mgr,
+                                    BlockDedupStats *stats)
+{
+    if (!mgr->priv->dedup)
+        return -1;
+
+    block_backend_fs_get_dedup_stats (mgr->priv->dedup, stats);
+    return 0;
+}
+
+int
+seaf_block_manager_scan_dedup_pool (SeafBlockManager *mgr,
+                                    gboolean remove_orphans,
+                                    BlockDedupStats *stats)
+{
+    if (!mgr->priv->dedup)
+        return -1;
+
+    return block_backend_fs_scan_pool (mgr->priv->dedup, remove_orphans, stats);
+}
+
+gboolean
+seaf_block_manager_block_is_shared (SeafBlockManager *mgr,
+                                    const char *store_id,
+                                    int version,
+                                    const char *block_id)
+{
+    if (!mgr->priv->dedup)
+        return FALSE;
+
+    return block_backend_fs_block_is_shared (mgr->priv->dedup,
+                                             store_id, version, block_id);
+}
+
 int
 seaf_block_manager_init (SeafBlockManager *mgr)
 {
     return 0;
 }
 
+static int
+scan_blocks (void *data, const char *store_id, int version,
+             ExistsFilterAddFunc add, void *add_data)
+{
+    SeafBlockManager *mgr = data;
+
+    return mgr->backend->foreach_block (mgr->backend, store_id, version,
+                                        add, add_data);
+}
+
+static void
+write_handle_free (WriteHandle *wh)
+{
+    g_free (wh->store_id);
+    g_free (wh);
+}
+
+/* Written blocks are only tracked for the exists filter or the hook. */
+static inline gboolean
+tracks_writes (SeafBlockManager *mgr)
+{
+    return mgr->priv->write_handles != NULL;
+}
+
+static void
+track_writes (SeafBlockManager *mgr)
+{
+    struct SeafBlockManagerPriv *priv = mgr->priv;
+
+    if (priv->write_handles)
+        return;
+
+    priv->write_handles = g_hash_table_new_full (g_direct_hash,
+                                                 g_direct_equal,
+                                                 NULL,
+                                                 (GDestroyNotify)write_handle_free);
+}
+
+int
+seaf_block_manager_enable_exists_filter (SeafBlockManager *mgr)
+{
+    struct SeafBlockManagerPriv *priv = mgr->priv;
+
+    priv->exists_filter = exists_filter_new (scan_blocks, mgr);
+    if (!priv->exists_filter)
+        return -1;
+
+    track_writes (mgr);
+
+    return 0;
+}
+
+void
+seaf_block_manager_set_commit_hook (SeafBlockManager *mgr,
+                                    BlockCommitHook hook)
+{
+    mgr->priv->commit_hook = hook;
+    track_writes (mgr);
+}
+
 
 BlockHandle *
 seaf_block_manager_open_block (SeafBlockManager *mgr,
@@ -63,9 +368,27 @@ seaf_block_manager_open_block (SeafBlockManager *mgr,
                                const char *block_id,
                                int rw_type)
 {
-    return mgr->backend->open_block (mgr->backend,
-                                     store_id, version,
-                                     block_id, rw_type);
+    BlockHandle *handle;
+    WriteHandle *wh;
+    gint64 start = get_current_time ();
+
+    handle = mgr->backend->open_block (mgr->backend,
+                                       store_id, version,
+                                       block_id, rw_type);
+
+    io_stats_observe (mgr->priv->io_source, IO_OP_OPEN, start, 0, !handle);
+
+    if (handle && rw_type == BLOCK_WRITE && tracks_writes (mgr)) {
+        wh = g_new0 (WriteHandle, 1);
+        wh->store_id = g_strdup (store_id);
+        memcpy (wh->block_id, block_id, 40);
+
+        pthread_mutex_lock (&mgr->priv->lock);
+        g_hash_table_replace (mgr->priv->write_handles, handle, wh);
+        pthread_mutex_unlock (&mgr->priv->lock);
+    }
+
+    return handle;
 }
 
 int
@@ -73,7 +396,13 @@ seaf_block_manager_read_block (SeafBlockManager *mgr,
                                BlockHandle *handle,
                                void *buf, int len)
 {
-    return mgr->backend->read_block (mgr->backend, handle, buf, len);
+    gint64 start = get_current_time ();
+    int ret;
+
+    ret = mgr->backend->read_block (mgr->backend, handle, buf, len);
+
+    io_stats_observe (mgr->priv->io_source, IO_OP_READ, start, ret, ret < 0);
+    return ret;
 }
 
 int
@@ -81,7 +410,13 @@ seaf_block_manager_write_block (SeafBlockManager *mgr,
                                 BlockHandle *handle,
                                 const void *buf, int len)
 {
-    return mgr->backend->write_block (mgr->backend, handle, buf, len);
+    gint64 start = get_current_time ();
+    int ret;
+
+    ret = mgr->backend->write_block (mgr->backend, handle, buf, len);
+
+    io_stats_observe (mgr->priv->io_source, IO_OP_WRITE, start, ret, ret < 0);
+    return ret;
 }
 
 int
@@ -95,6 +430,12 @@ void
 seaf_block_manager_block_handle_free (SeafBlockManager *mgr,
                                       BlockHandle *handle)
 {
+    if (tracks_writes (mgr)) {
+        pthread_mutex_lock (&mgr->priv->lock);
+        g_hash_table_remove (mgr->priv->write_handles, handle);
+        pthread_mutex_unlock (&mgr->priv->lock);
+    }
+
     return mgr->backend->block_handle_free (mgr->backend, handle);
 }
 
@@ -102,7 +443,51 @@ int
 seaf_block_manager_commit_block (SeafBlockManager *mgr,
                                  BlockHandle *handle)
 {
-    return mgr->backend->commit_block (mgr->backend, handle);
+    WriteHandle *wh;
+    char *store_id = NULL;
+    char block_id[41];
+    gint64 start = get_current_time ();
+    int ret;
+
+    ret = mgr->backend->commit_block (mgr->backend, handle);
+
+    io_stats_observe (mgr->priv->io_source, IO_OP_COMMIT, start, 0, ret < 0);
+
+    if (ret == 0 && tracks_writes (mgr)) {
+        pthread_mutex_lock (&mgr->priv->lock);
+        wh = g_hash_table_lookup (mgr->priv->write_handles, handle);
+        if (wh && mgr->priv->exists_filter)
+            exists_filter_add (mgr->priv->exists_filter,
+                               wh->store_id, wh->block_id);
+        if (wh && mgr->priv->commit_hook) {
+            store_id = g_strdup (wh->store_id);
+            memcpy (block_id, wh->block_id, 40);
+            block_id[40] = 0;
+        }
+        pthread_mutex_unlock (&mgr->priv->lock);
+    }
+
+    if (store_id) {
+        if (mgr->priv->commit_hook (store_id, block_id) < 0) {
+            seaf_warning ("Commit hook failed for block %s of store %.8s.\n",
+                          block_id, store_id);
+            ret = -1;
+        }
+        g_free (store_id);
+    }
+
+    return ret;
+}
+
+int
+seaf_block_manager_reuse_block (SeafBlockManager *mgr,
+                                const char *store_id,
+                                const char *block_id)
+{
+    if (!mgr->priv->commit_hook)
+        return 0;
+
+    return mgr->priv->commit_hook (store_id, block_id);
 }
     
 gboolean seaf_block_manager_block_exists (SeafBlockManager *mgr,
@@ -110,7 +495,83 @@ gboolean seaf_block_manager_block_exists (SeafBlockManager *mgr,
                                           int version,
                                           const char *block_id)
 {
-    return mgr->backend->exists (mgr->backend, store_id, version, block_id);
+    gint64 start;
+    gboolean ret;
+
+    if (mgr->priv->exists_filter &&
+        !exists_filter_may_contain (mgr->priv->exists_filter,
+                                    store_id, version, block_id))
+        return FALSE;
+
+    start = get_current_time ();
+    ret = mgr->backend->exists (mgr->backend, store_id, version, block_id);
+
+    io_stats_observe (mgr->priv->io_source, IO_OP_EXISTS, start, 0, FALSE);
+    return ret;
+}
+
+int
+seaf_block_manager_export_exists_filter (SeafBlockManager *mgr,
+                                         const char *store_id,
+                                         int version,
+                                         unsigned char **bits,
+                                         guint64 *n_bits,
+                                         int *n_hashes)
+{
+    if (!mgr->priv->exists_filter)
+        return -1;
+
+    return exists_filter_export (mgr->priv->exists_filter, store_id, version,
+                                 bits, n_bits, n_hashes);
+}
+
+int
+seaf_block_manager_blocks_exist (SeafBlockManager *mgr,
+                                 const char *store_id,
+                                 int version,
+                                 const char **block_ids,
+                                 int n,
+                                 gboolean *exists)
+{
+    const char **check = g_new (const char *, n);
+    int *idx = g_new (int, n);
+    gboolean *found;
+    gint64 start;
+    int i, n_check = 0;
+    int ret = 0;
+
+    for (i = 0; i < n; ++i) {
+        exists[i] = FALSE;
+        if (mgr->priv->exists_filter &&
+            !exists_filter_may_contain (mgr->priv->exists_filter,
+                                        store_id, version, block_ids[i]))
+            continue;
+        idx[n_check] = i;
+        check[n_check++] = block_ids[i];
+    }
+
+    if (n_check == 0)
+        goto out;
+
+    found = g_new0 (gboolean, n_check);
+    start = get_current_time ();
+    if (mgr->backend->exists_batch) {
+        ret = mgr->backend->exists_batch (mgr->backend, store_id, version,
+                                          check, n_check, found);
+    } else {
+        for (i = 0; i < n_check; ++i)
+            found[i] = mgr->backend->exists (mgr->backend, store_id, version,
+                                             check[i]);
+    }
+    io_stats_observe (mgr->priv->io_source, IO_OP_EXISTS, start, 0, ret < 0);
+    for (i = 0; i < n_check; ++i)
+        exists[idx[i]] = found[i];
+    g_free (found);
+
+out:
+    g_free (check);
+    g_free (idx);
+    return ret;
 }
 
 int
@@ -119,7 +580,13 @@ seaf_block_manager_remove_block (SeafBlockManager *mgr,
                                  int version,
                                  const char *block_id)
 {
-    return mgr->backend->remove_block (mgr->backend, store_id, version, block_id);
+    gint64 start = get_current_time ();
+    int ret;
+
+    ret = mgr->backend->remove_block (mgr->backend, store_id, version, block_id);
+
+    io_stats_observe (mgr->priv->io_source, IO_OP_DELETE, start, 0, ret < 0);
+    return ret;
 }
 
 BlockMetadata *
@@ -128,14 +595,137 @@ seaf_block_manager_stat_block (SeafBlockManager *mgr,
                                int version,
                                const char *block_id)
 {
-    return mgr->backend->stat_block (mgr->backend, store_id, version, block_id);
+    gint64 start = get_current_time ();
+    BlockMetadata *bmd;
+
+    bmd = mgr->backend->stat_block (mgr->backend, store_id, version, block_id);
+
+    io_stats_observe (mgr->priv->io_source, IO_OP_STAT, start, 0, !bmd);
+    return bmd;
 }
 
 BlockMetadata *
 seaf_block_manager_stat_block_by_handle (SeafBlockManager *mgr,
                                          BlockHandle *handle)
 {
-    return mgr->backend->stat_block_by_handle (mgr->backend, handle);
+    gint64 start = get_current_time ();
+    BlockMetadata *bmd;
+
+    bmd = mgr->backend->stat_block_by_handle (mgr->backend, handle);
+
+    io_stats_observe (mgr->priv->io_source, IO_OP_STAT, start, 0, !bmd);
+    return bmd;
+}
+
+#define STAT_THREADS 8
+#define STAT_PARALLEL_MIN 16
+
+typedef struct StatJob {
+    SeafBlockManager *mgr;
+    const char *store_id;
+    int version;
+    const char **block_ids;
+    guint32 *sizes;
+    int n_blocks;
+
+    pthread_mutex_t lock;
+    int next;
+    gboolean failed;
+} StatJob;
+
+static void *
+stat_blocks_thread (void *vjob)
+{
+    StatJob *job = vjob;
+    BlockMetadata *bmd;
+    int i;
+
+    while (1) {
+        pthread_mutex_lock (&job->lock);
+        i = job->failed ? job->n_blocks : job->next++;
+        pthread_mutex_unlock (&job->lock);
+
+        if (i >= job->n_blocks)
+            break;
+
+        bmd = seaf_block_manager_stat_block (job->mgr, job->store_id,
+                                             job->version, job->block_ids[i]);
+        if (!bmd) {
+            seaf_warning ("Failed to stat block %.8s.\n", job->block_ids[i]);
+            pthread_mutex_lock (&job->lock);
+            job->failed = TRUE;
+            pthread_mutex_unlock (&job->lock);
+            break;
+        }
+        job->sizes[i] = bmd->size;
+        g_free (bmd);
+    }
+
+    return NULL;
+}
+
+int
+seaf_block_manager_stat_blocks (SeafBlockManager *mgr,
+                                const char *store_id,
+                                int version,
+                                const char **block_ids,
+                                int n_blocks,
+                                guint32 *sizes)
+{
+    StatJob job;
+    pthread_t threads[STAT_THREADS];
+    int n_threads = 0, i;
+
+    memset (&job, 0, sizeof(job));
+    job.mgr = mgr;
+    job.store_id = store_id;
+    job.version = version;
+    job.block_ids = block_ids;
+    job.sizes = sizes;
+    job.n_blocks = n_blocks;
+    pthread_mutex_init (&job.lock, NULL);
+
+    /* With few blocks, or if no thread can be started, stat them here. */
+    if (n_blocks >= STAT_PARALLEL_MIN) {
+        for (i = 0; i < STAT_THREADS; ++i) {
+            if (pthread_create (&threads[i], NULL, stat_blocks_thread, &job) != 0)
+                break;
+            ++n_threads;
+        }
+    }
+
+    if (n_threads == 0)
+        stat_blocks_thread (&job);
+
+    for (i = 0; i < n_threads; ++i)
+        pthread_join (threads[i], NULL);
+
+    pthread_mutex_destroy (&job.lock);
+
+    return job.failed ? -1 : 0;
+}
+
+int
+seaf_block_manager_get_block_fd (SeafBlockManager *mgr,
+                                 BlockHandle *handle,
+                                 guint32 *size)
+{
+    if (!mgr->backend->get_block_fd)
+        return -1;
+
+    return mgr->backend->get_block_fd (mgr->backend, handle, size);
+}
+
+gint64
+seaf_block_manager_prefetch_block (SeafBlockManager *mgr,
+                                   const char *store_id,
+                                   int version,
+                                   const char *block_id)
+{
+    if (!mgr->backend->prefetch)
+        return -1;
+
+    return mgr->backend->prefetch (mgr->backend, store_id, version, block_id);
 }
 
 int
@@ -150,6 +740,84 @@ seaf_block_manager_foreach_block (SeafBlockManager *mgr,
                                         process, user_data);
 }
 
+static gboolean
+collect_block_id (const char *store_id,
+                  int version,
+                  const char *block_id,
+                  void *data)
+{
+    g_ptr_array_add ((GPtrArray *)data, g_strdup (block_id));
+    return TRUE;
+}
+
+static int
+cmp_block_id (gconstpointer a, gconstpointer b)
+{
+    return strcmp (*(char **)a, *(char **)b);
+}
+
+/* For backends that can only enumerate blocks one by one. */
+static int
+foreach_block_batch_fallback (SeafBlockManager *mgr,
+                              const char *store_id,
+                              int version,
+                              const char *start_prefix,
+                              SeafBlockBatchFunc process,
+                              void *user_data)
+{
+    GPtrArray *ids = g_ptr_array_new ();
+    char **pdata;
+    char prefix[3];
+    guint i, start, end;
+    int ret;
+
+    ret = mgr->backend->foreach_block (mgr->backend, store_id, version,
+                                       collect_block_id, ids);
+    if (ret < 0)
+        goto out;
+
+    g_ptr_array_sort (ids, cmp_block_id);
+    pdata = (char **)ids->pdata;
+
+    for (start = 0; start < ids->len; start = end) {
+        memcpy (prefix, pdata[start], 2);
+        prefix[2] = 0;
+        for (end = start + 1;
+             end < ids->len && strncmp (pdata[end], prefix, 2) == 0;
+             ++end)
+            ;
+
+        if (start_prefix && strcmp (prefix, start_prefix) < 0)
+            continue;
+        if (!process (store_id, version, prefix,
+                      pdata + start, end - start, user_data))
+            break;
+    }
+
+out:
+    for (i = 0; i < ids->len; ++i)
+        g_free (g_ptr_array_index (ids, i));
+    g_ptr_array_free (ids, TRUE);
+    return ret;
+}
+
+int
+seaf_block_manager_foreach_block_batch (SeafBlockManager *mgr,
+                                        const char *store_id,
+                                        int version,
+                                        const char *start_prefix,
+                                        SeafBlockBatchFunc process,
+                                        void *user_data)
+{
+    if (!mgr->backend->foreach_block_batch)
+        return foreach_block_batch_fallback (mgr, store_id, version,
+                                             start_prefix, process, user_data);
+
+    return mgr->backend->foreach_block_batch (mgr->backend,
+                                              store_id, version, start_prefix,
+                                              process, user_data);
+}
+
 int
 seaf_block_manager_copy_block (SeafBlockManager *mgr,
                                const char *src_store_id,
@@ -158,26 +826,35 @@ seaf_block_manager_copy_block (SeafBlockManager *mgr,
                                int dst_version,
                                const char *block_id)
 {
+    int ret;
+
     if (strcmp (block_id, EMPTY_SHA1) == 0)
         return 0;
 
-    return mgr->backend->copy (mgr->backend,
-                               src_store_id,
-                               src_version,
-                               dst_store_id,
-                               dst_version,
-                               block_id);
+    ret = mgr->backend->copy (mgr->backend,
+                              src_store_id,
+                              src_version,
+                              dst_store_id,
+                              dst_version,
+                              block_id);
+
+    if (ret == 0 && mgr->priv->exists_filter)
+        exists_filter_add (mgr->priv->exists_filter, dst_store_id, block_id);
+
+    return ret;
 }
 
 static gboolean
 get_block_number (const char *store_id,
                   int version,
-                  const char *block_id,
+                  const char *prefix,
+                  char **block_ids,
+                  int n_blocks,
                   void *data)
 {
-    guint64 *n_blocks = data;
+    guint64 *total = data;
 
-    ++(*n_blocks);
+    *total += n_blocks;
 
     return TRUE;
 }
@@ -189,8 +866,8 @@ seaf_block_manager_get_block_number (SeafBlockManager *mgr,
 {
     guint64 n_blocks = 0;
 
-    seaf_block_manager_foreach_block (mgr, store_id, version,
-                                      get_block_number, &n_blocks);
+    seaf_block_manager_foreach_block_batch (mgr, store_id, version, NULL,
+                                            get_block_number, &n_blocks);
 
     return n_blocks;
 }
@@ -205,7 +882,7 @@ seaf_block_manager_verify_block (SeafBlockManager *mgr,
     BlockHandle *h;
     char buf[10240];
     int n;
-    SHA_CTX ctx;
+    SeafSHA1Ctx ctx;
     guint8 sha1[20];
     char check_id[41];
 
@@ -218,24 +895,26 @@ seaf_block_manager_verify_block (SeafBlockManager *mgr,
         return FALSE;
     }
 
-    SHA1_Init (&ctx);
+    seaf_sha1_init (&ctx);
     while (1) {
         n = seaf_block_manager_read_block (mgr, h, buf, sizeof(buf));
         if (n < 0) {
             seaf_warning ("Failed to read block %.8s.\n", block_id);
+            seaf_block_manager_close_block (mgr, h);
+            seaf_block_manager_block_handle_free (mgr, h);
             *io_error = TRUE;
             return FALSE;
         }
         if (n == 0)
             break;
 
-        SHA1_Update (&ctx, buf, n);
+        seaf_sha1_update (&ctx, buf, n);
     }
 
     seaf_block_manager_close_block (mgr, h);
     seaf_block_manager_block_handle_free (mgr, h);
 
-    SHA1_Final (sha1, &ctx);
+    seaf_sha1_final (sha1, &ctx);
     rawdata_to_hex (sha1, check_id, 20);
 
     if (strcmp (check_id, block_id) == 0)
@@ -244,9 +923,200 @@ seaf_block_manager_verify_block (SeafBlockManager *mgr,
         return FALSE;
 }
 
+int
+seaf_block_manager_read_block_content (SeafBlockManager *mgr,
+                                       const char *store_id,
+                                       int version,
+                                       const char *block_id,
+                                       char **content,
+                                       size_t *len)
+{
+    BlockHandle *h;
+    BlockMetadata *bmd;
+    char *buf = NULL;
+    size_t size, off = 0;
+    int n;
+    int ret = 0;
+
+    h = seaf_block_manager_open_block (mgr,
+                                       store_id, version,
+                                       block_id, BLOCK_READ);
+    if (!h) {
+        seaf_warning ("Failed to open block %.8s.\n", block_id);
+        return -1;
+    }
+
+    bmd = seaf_block_manager_stat_block_by_handle (mgr, h);
+    if (!bmd) {
+        seaf_warning ("Failed to stat block %.8s.\n", block_id);
+        ret = -1;
+        goto out;
+    }
+    size = bmd->size;
+    g_free (bmd);
+
+    /* One extra byte so that a block grown since stat is still noticed. */
+    buf = g_malloc (size + 1);
+    while (off <= size) {
+        n = seaf_block_manager_read_block (mgr, h, buf + off, size + 1 - off);
+        if (n < 0) {
+            seaf_warning ("Failed to read block %.8s.\n", block_id);
+            ret = -1;
+            goto out;
+        }
+        if (n == 0)
+            break;
+        off += n;
+    }
+
+    *content = buf;
+    *len = off;
+    buf = NULL;
+
+out:
+    g_free (buf);
+    seaf_block_manager_close_block (mgr, h);
+    seaf_block_manager_block_handle_free (mgr, h);
+    return ret;
+}
+
+#define VERIFY_BATCH_SIZE 8
+
+int
+seaf_block_manager_verify_blocks (SeafBlockManager *mgr,
+                                  const char *store_id,
+                                  int version,
+                                  const char **block_ids,
+                                  int n_blocks,
+                                  gboolean *valid)
+{
+    char *bufs[VERIFY_BATCH_SIZE];
+    size_t lens[VERIFY_BATCH_SIZE];
+    unsigned char sha1s[VERIFY_BATCH_SIZE * 20];
+    char check_id[41];
+    int i, j, n;
+    int ret = 0;
+
+    for (i = 0; i < n_blocks; i += VERIFY_BATCH_SIZE) {
+        n = MIN (VERIFY_BATCH_SIZE, n_blocks - i);
+
+        for (j = 0; j < n; ++j) {
+            if (seaf_block_manager_read_block_content (mgr, store_id, version,
+                                                       block_ids[i + j],
+                                                       &bufs[j], &lens[j]) < 0) {
+                n = j;
+                ret = -1;
+                break;
+            }
+        }
+
+        seaf_sha1_multi (n, (const void * const *)bufs, lens, sha1s);
+
+        for (j = 0; j < n; ++j) {
+            rawdata_to_hex (sha1s + j * 20, check_id, 20);
+            valid[i + j] = (strcmp (check_id, block_ids[i + j]) == 0);
+            g_free (bufs[j]);
+        }
+
+        if (ret < 0)
+            break;
+    }
+
+    return ret;
+}
+
+typedef struct AsyncReadTask {
+    char                *store_id;
+    int                  version;
+    char                 block_id[41];
+    BlockReadCallback    callback;
+    void                *user_data;
+} AsyncReadTask;
+
+static void
+async_read_thread (void *data, void *user_data)
+{
+    AsyncReadTask *task = data;
+    SeafBlockManager *mgr = user_data;
+    char *content = NULL;
+    size_t len = 0;
+
+    if (seaf_block_manager_read_block_content (mgr, task->store_id,
+                                               task->version, task->block_id,
+                                               &content, &len) < 0)
+        content = NULL;
+
+    task->callback (content, len, task->user_data);
+
+    g_free (task->store_id);
+    g_free (task);
+}
+
+int
+seaf_block_manager_read_block_async (SeafBlockManager *mgr,
+                                     const char *store_id,
+                                     int version,
+                                     const char *block_id,
+                                     BlockReadCallback callback,
+                                     void *user_data)
+{
+    struct SeafBlockManagerPriv *priv = mgr->priv;
+    AsyncReadTask *task;
+    GError *error = NULL;
+
+    pthread_mutex_lock (&priv->lock);
+    if (!priv->read_pool) {
+        priv->read_pool = g_thread_pool_new (async_read_thread, mgr,
+                                             ASYNC_READ_THREADS, FALSE,
+                                             &error);
+        if (error) {
+            seaf_warning ("Failed to start block read threads: %s.\n",
+                          error->message);
+            g_clear_error (&error);
+            priv->read_pool = NULL;
+        }
+    }
+    pthread_mutex_unlock (&priv->lock);
+
+    if (!priv->read_pool)
+        return -1;
+
+    task = g_new0 (AsyncReadTask, 1);
+    task->store_id = g_strdup (store_id);
+    task->version = version;
+    memcpy (task->block_id, block_id, 40);
+    task->callback = callback;
+    task->user_data = user_data;
+
+    g_thread_pool_push (priv->read_pool, task, &error);
+    if (error) {
+        seaf_warning ("Failed to read block %.8s: %s.\n",
+                      block_id, error->message);
+        g_clear_error (&error);
+        g_free (task->store_id);
+        g_free (task);
+        return -1;
+    }
+
+    return 0;
+}
+
+int
+seaf_block_manager_compact_store (SeafBlockManager *mgr,
+                                  const char *store_id)
+{
+    if (!mgr->backend->compact)
+        return 0;
+
+    return mgr->backend->compact (mgr->backend, store_id);
+}
+
 int
 seaf_block_manager_remove_store (SeafBlockManager *mgr,
                                  const char *store_id)
 {
+    if (mgr->priv->exists_filter)
+        exists_filter_remove_store (mgr->priv->exists_filter, store_id);
+
     return mgr->backend->remove_store (mgr->backend, store_id);
 }
@@ -17,6 +17,8 @@ struct _SeafBlockManager {
     struct _SeafileSession *seaf;
 
     struct BlockBackend *backend;
+
+    struct SeafBlockManagerPriv *priv;
 };
 
 
@@ -103,12 +105,96 @@ seaf_block_manager_block_exists (SeafBlockManager *mgr,
                                  int version,
                                  const char *block_id);
 
+/*
+ * Check @n blocks at once, setting @exists[i] for each. Backends with
+ * a high latency per request check them concurrently.
+ */
+int
+seaf_block_manager_blocks_exist (SeafBlockManager *mgr,
+                                 const char *store_id,
+                                 int version,
+                                 const char **block_ids,
+                                 int n,
+                                 gboolean *exists);
+
+/* Counters of the [block_cache] cache. Returns -1 if it's not enabled. */
+int
+seaf_block_manager_get_cache_stats (SeafBlockManager *mgr,
+                                    BlockCacheStats *stats);
+
+/*
+ * Counters of the blocks shared between stores, with [block_backend]
+ * dedup. Returns -1 if it's not enabled.
+ */
+int
+seaf_block_manager_get_dedup_stats (SeafBlockManager *mgr,
+                                    BlockDedupStats *stats);
+
+/* Like seaf_block_manager_get_dedup_stats() with the pool stats filled
+ * in, from a scan of the whole pool.
+ */
+int
+seaf_block_manager_scan_dedup_pool (SeafBlockManager *mgr,
+                                    gboolean remove_orphans,
+                                    BlockDedupStats *stats);
+
+/* Whether other stores share the block, so removing it from @store_id
+ * frees no space. Always FALSE without dedup.
+ */
+gboolean
+seaf_block_manager_block_is_shared (SeafBlockManager *mgr,
+                                    const char *store_id,
+                                    int version,
+                                    const char *block_id);
+
+/*
+ * Keep an in-memory filter of the blocks in each store, so that
+ * seaf_block_manager_block_exists() can answer most misses without
+ * touching the backend. Only safe if this process is the only one
+ * writing blocks.
+ */
+int
+seaf_block_manager_enable_exists_filter (SeafBlockManager *mgr);
+
+/*
+ * Copy the exists filter of a store, see exists_filter_export().
+ * Returns -1 if the filter isn't enabled or not ready yet.
+ */
+int
+seaf_block_manager_export_exists_filter (SeafBlockManager *mgr,
+                                         const char *store_id,
+                                         int version,
+                                         unsigned char **bits,
+                                         guint64 *n_bits,
+                                         int *n_hashes);
+
 int
 seaf_block_manager_remove_block (SeafBlockManager *mgr,
                                  const char *store_id,
                                  int version,
                                  const char *block_id);
 
+/* Returns -1 to fail the commit. */
+typedef int (*BlockCommitHook) (const char *store_id, const char *block_id);
+
+/*
+ * Have @hook called after each block committed from now on. Set it
+ * before blocks are written.
+ */
+void
+seaf_block_manager_set_commit_hook (SeafBlockManager *mgr,
+                                    BlockCommitHook hook);
+
+/*
+ * For writers that skip blocks which already exist: call the commit hook
+ * for @block_id as if it had been written. Returns -1 if the hook fails,
+ * then the write must fail too.
+ */
+int
+seaf_block_manager_reuse_block (SeafBlockManager *mgr,
+                                const char *store_id,
+                                const char *block_id);
+
 BlockMetadata *
 seaf_block_manager_stat_block (SeafBlockManager *mgr,
                                const char *store_id,
@@ -119,6 +205,45 @@ BlockMetadata *
 seaf_block_manager_stat_block_by_handle (SeafBlockManager *mgr,
                                          BlockHandle *handle);
 
+/*
+ * Set @sizes[i] to the size of @block_ids[i]. Many blocks are looked up
+ * in parallel, which hides the latency of remote backends.
+ * Returns -1 if any block can't be found.
+ */
+int
+seaf_block_manager_stat_blocks (SeafBlockManager *mgr,
+                                const char *store_id,
+                                int version,
+                                const char **block_ids,
+                                int n_blocks,
+                                guint32 *sizes);
+
+/*
+ * Get a new fd with the raw content of a block opened for read, so that
+ * it can be sent without copying it through user space. The caller
+ * owns the fd. Nothing must have been read from @handle yet.
+ *
+ * Returns: the fd, or -1 if the backend can't provide one. Use
+ * seaf_block_manager_read_block() then.
+ */
+int
+seaf_block_manager_get_block_fd (SeafBlockManager *mgr,
+                                 BlockHandle *handle,
+                                 guint32 *size);
+
+/*
+ * Hint that @block_id will be read soon, so the backend can start
+ * reading it in the background.
+ *
+ * Returns: the bytes to be read, or -1 if the backend can't prefetch or
+ * the block isn't found.
+ */
+gint64
+seaf_block_manager_prefetch_block (SeafBlockManager *mgr,
+                                   const char *store_id,
+                                   int version,
+                                   const char *block_id);
+
 int
 seaf_block_manager_foreach_block (SeafBlockManager *mgr,
                                   const char *store_id,
@@ -126,6 +251,51 @@ seaf_block_manager_foreach_block (SeafBlockManager *mgr,
                                   SeafBlockFunc process,
                                   void *user_data);
 
+/*
+ * Enumerate the blocks of a store in sorted batches, one per id prefix,
+ * starting from @start_prefix (NULL for all). Passing the last prefix
+ * seen resumes an interrupted scan.
+ */
+int
+seaf_block_manager_foreach_block_batch (SeafBlockManager *mgr,
+                                        const char *store_id,
+                                        int version,
+                                        const char *start_prefix,
+                                        SeafBlockBatchFunc process,
+                                        void *user_data);
+
+/*
+ * Read a whole block into memory, freed with g_free(). Returns -1 on
+ * I/O error.
+ */
+int
+seaf_block_manager_read_block_content (SeafBlockManager *mgr,
+                                       const char *store_id,
+                                       int version,
+                                       const char *block_id,
+                                       char **content,
+                                       size_t *len);
+
+/*
+ * Called on a worker thread once the whole block has been read.
+ * @content is NULL on error, otherwise free it with g_free().
+ */
+typedef void (*BlockReadCallback) (char *content, size_t len, void *user_data);
+
+/*
+ * Read a whole block without blocking the calling thread.
+ *
+ * Returns: 0 if the read was queued, -1 on error. On success
+ * @callback is always called exactly once.
+ */
+int
+seaf_block_manager_read_block_async (SeafBlockManager *mgr,
+                                     const char *store_id,
+                                     int version,
+                                     const char *block_id,
+                                     BlockReadCallback callback,
+                                     void *user_data);
+
 int
 seaf_block_manager_copy_block (SeafBlockManager *mgr,
                                const char *src_store_id,
@@ -134,6 +304,13 @@ seaf_block_manager_copy_block (SeafBlockManager *mgr,
                                int dst_version,
                                const char *block_id);
 
+/* Reclaim the space of removed blocks, if the backend needs that.
+ * Returns 0 on success, -1 on error.
+ */
+int
+seaf_block_manager_compact_store (SeafBlockManager *mgr,
+                                  const char *store_id);
+
 /* Remove all blocks for a repo. Only valid for version 1 repo. */
 int
 seaf_block_manager_remove_store (SeafBlockManager *mgr,
@@ -151,4 +328,18 @@ seaf_block_manager_verify_block (SeafBlockManager *mgr,
                                  const char *block_id,
                                  gboolean *io_error);
 
+/*
+ * Verify @n_blocks blocks at once, hashing several of them in parallel
+ * where the CPU allows. @valid[i] is set to whether the content of
+ * @block_ids[i] matches its id. Returns -1 on the first I/O error; blocks
+ * before the failed one have been checked.
+ */
+int
+seaf_block_manager_verify_blocks (SeafBlockManager *mgr,
+                                  const char *store_id,
+                                  int version,
+                                  const char **block_ids,
+                                  int n_blocks,
+                                  gboolean *valid);
+
 #endif
@@ -65,18 +65,89 @@ blocktx_decrypt_init (EVP_CIPHER_CTX *ctx,
     return 0;
 }
 
+static void
+gcm_nonce (const unsigned char *iv, int dir, guint64 seq, unsigned char *nonce)
+{
+    int i;
+
+    memcpy (nonce, iv, GCM_NONCE_SIZE);
+    nonce[0] ^= (unsigned char)dir;
+    for (i = 0; i < 8; ++i)
+        nonce[GCM_NONCE_SIZE - 1 - i] ^= (unsigned char)(seq >> (i * 8));
+}
+
+int
+blocktx_gcm_encrypt_init (EVP_CIPHER_CTX *ctx,
+                          const unsigned char *key,
+                          const unsigned char *iv,
+                          int dir, guint64 seq)
+{
+    unsigned char nonce[GCM_NONCE_SIZE];
+
+    gcm_nonce (iv, dir, seq, nonce);
+
+    EVP_CIPHER_CTX_init (ctx);
+
+    /* The default IV length of GCM is 12 bytes. */
+    if (EVP_EncryptInit_ex (ctx, EVP_aes_256_gcm(), NULL, key, nonce) == 0)
+        return -1;
+
+    return 0;
+}
+
+int
+blocktx_gcm_decrypt_init (EVP_CIPHER_CTX *ctx,
+                          const unsigned char *key,
+                          const unsigned char *iv,
+                          int dir, guint64 seq)
+{
+    unsigned char nonce[GCM_NONCE_SIZE];
+
+    gcm_nonce (iv, dir, seq, nonce);
+
+    EVP_CIPHER_CTX_init (ctx);
+
+    if (EVP_DecryptInit_ex (ctx, EVP_aes_256_gcm(), NULL, key, nonce) == 0)
+        return -1;
+
+    return 0;
+}
+
+static gboolean
+is_gcm (EVP_CIPHER_CTX *ctx)
+{
+    return EVP_CIPHER_CTX_mode (ctx) == EVP_CIPH_GCM_MODE;
+}
+
+static void
+parser_decrypt_init (FrameParser *parser, EVP_CIPHER_CTX *ctx)
+{
+    if (parser->version == 1)
+        blocktx_decrypt_init (ctx, parser->key, parser->iv);
+    else if (parser->version == 2)
+        blocktx_decrypt_init (ctx, parser->key_v2, parser->iv_v2);
+    else
+        blocktx_gcm_decrypt_init (ctx, parser->key_v2, parser->iv_v2,
+                                  parser->recv_dir, parser->recv_seq++);
+}
+
 /* Sending frame */
 
 int
-send_encrypted_data_frame_begin (evutil_socket_t data_fd,
+send_encrypted_data_frame_begin (EVP_CIPHER_CTX *ctx,
+                                 evutil_socket_t data_fd,
                                  int frame_len)
 {
-    /* Compute data size after encryption.
-     * Block size is 16 bytes and AES always add one padding block.
-     */
     int enc_frame_len;
 
-    enc_frame_len = ((frame_len >> 4) + 1) << 4;
+    /* Compute data size after encryption.
+     * For CBC, block size is 16 bytes and AES always add one padding block.
+     * GCM doesn't pad, but appends the tag.
+     */
+    if (is_gcm (ctx))
+        enc_frame_len = frame_len + GCM_TAG_SIZE;
+    else
+        enc_frame_len = ((frame_len >> 4) + 1) << 4;
     enc_frame_len = htonl (enc_frame_len);
 
     if (sendn (data_fd, &enc_frame_len, sizeof(int)) < 0) {
@@ -116,13 +187,22 @@ int
 send_encrypted_data_frame_end (EVP_CIPHER_CTX *ctx,
                                evutil_socket_t data_fd)
 {
-    char out_buf[ENC_BLOCK_SIZE];
+    char out_buf[ENC_BLOCK_SIZE + GCM_TAG_SIZE];
     int out_len;
 
     if (EVP_EncryptFinal_ex (ctx, (unsigned char *)out_buf, &out_len) == 0) {
         seaf_warning ("Failed to encrypt data.\n");
         return -1;
     }
+
+    if (is_gcm (ctx)) {
+        if (EVP_CIPHER_CTX_ctrl (ctx, EVP_CTRL_GCM_GET_TAG, GCM_TAG_SIZE,
+                                 out_buf + out_len) == 0) {
+            seaf_warning ("Failed to get frame tag.\n");
+            return -1;
+        }
+        out_len += GCM_TAG_SIZE;
+    }
     if (sendn (data_fd, out_buf, out_len) < 0) {
         seaf_warning ("Failed to write data: %s.\n",
                       evutil_socket_error_to_string(evutil_socket_geterror(data_fd)));
@@ -140,7 +220,7 @@ handle_frame_content (struct evbuffer *buf, FrameParser *parser)
     char *frame;
     EVP_CIPHER_CTX ctx;
     char *out;
-    int outlen, outlen2;
+    int data_len, outlen, outlen2;
     int ret = 0;
 
     struct evbuffer *input = buf;
@@ -148,20 +228,29 @@ handle_frame_content (struct evbuffer *buf, FrameParser *parser)
     if (evbuffer_get_length (input) < parser->enc_frame_len)
         return 0;
 
-    if (parser->version == 1)
-        blocktx_decrypt_init (&ctx, parser->key, parser->iv);
-    else if (parser->version == 2)
-        blocktx_decrypt_init (&ctx, parser->key_v2, parser->iv_v2);
+    parser_decrypt_init (parser, &ctx);
 
     frame = g_malloc (parser->enc_frame_len);
     out = g_malloc (parser->enc_frame_len + ENC_BLOCK_SIZE);
 
     evbuffer_remove (input, frame, parser->enc_frame_len);
 
+    data_len = parser->enc_frame_len;
+    if (is_gcm (&ctx)) {
+        if (data_len < GCM_TAG_SIZE) {
+            seaf_warning ("Frame is too short: %d.\n", data_len);
+            ret = -1;
+            goto out;
+        }
+        data_len -= GCM_TAG_SIZE;
+        EVP_CIPHER_CTX_ctrl (&ctx, EVP_CTRL_GCM_SET_TAG, GCM_TAG_SIZE,
+                             frame + data_len);
+    }
+
     if (EVP_DecryptUpdate (&ctx,
                            (unsigned char *)out, &outlen,
                            (unsigned char *)frame,
-                           parser->enc_frame_len) == 0) {
+                           data_len) == 0) {
         seaf_warning ("Failed to decrypt frame content.\n");
         ret = -1;
         goto out;
@@ -207,6 +296,78 @@ handle_one_frame (struct evbuffer *buf, FrameParser *parser)
     }
 }
 
+/*
+ * In GCM mode the tag at the end of the frame is only checked once the
+ * whole frame is there. Decrypted fragments are passed on before, so the
+ * callback must not trust what it got before the last call.
+ */
+static int
+handle_gcm_fragment_content (struct evbuffer *buf, FrameParser *parser)
+{
+    char *fragment = NULL, *out = NULL;
+    unsigned char tag[GCM_TAG_SIZE];
+    int fragment_len, outlen;
+    int ret = 0;
+
+    struct evbuffer *input = buf;
+
+    fragment_len = MIN (evbuffer_get_length (input),
+                        parser->remain - GCM_TAG_SIZE);
+    if (fragment_len > 0) {
+        fragment = g_malloc (fragment_len);
+        evbuffer_remove (input, fragment, fragment_len);
+
+        out = g_malloc (fragment_len + ENC_BLOCK_SIZE);
+
+        if (EVP_DecryptUpdate (&parser->ctx,
+                               (unsigned char *)out, &outlen,
+                               (unsigned char *)fragment, fragment_len) == 0) {
+            seaf_warning ("Failed to decrypt frame fragment.\n");
+            ret = -1;
+            goto out;
+        }
+
+        ret = parser->fragment_cb (out, outlen, 0, parser->cbarg);
+        if (ret < 0)
+            goto out;
+
+        parser->remain -= fragment_len;
+    }
+
+    if (parser->remain > GCM_TAG_SIZE ||
+        evbuffer_get_length (input) < GCM_TAG_SIZE)
+        goto out;
+
+    evbuffer_remove (input, tag, GCM_TAG_SIZE);
+    EVP_CIPHER_CTX_ctrl (&parser->ctx, EVP_CTRL_GCM_SET_TAG, GCM_TAG_SIZE, tag);
+
+    if (!out)
+        out = g_malloc (ENC_BLOCK_SIZE);
+    if (EVP_DecryptFinal_ex (&parser->ctx, (unsigned char *)out, &outlen) == 0) {
+        seaf_warning ("Frame failed authentication.\n");
+        ret = -1;
+        goto out;
+    }
+
+    ret = parser->fragment_cb (out, outlen, 1, parser->cbarg);
+    if (ret < 0)
+        goto out;
+
+    EVP_CIPHER_CTX_cleanup (&parser->ctx);
+    parser->enc_init = FALSE;
+    parser->enc_frame_len = 0;
+
+out:
+    g_free (fragment);
+    g_free (out);
+    if (ret < 0) {
+        EVP_CIPHER_CTX_cleanup (&parser->ctx);
+        parser->enc_init = FALSE;
+        parser->enc_frame_len = 0;
+    }
+    return ret;
+}
+
 static int
 handle_frame_fragment_content (struct evbuffer *buf, FrameParser *parser)
 {
@@ -216,6 +377,9 @@ handle_frame_fragment_content (struct evbuffer *buf, FrameParser *parser)
 
     struct evbuffer *input = buf;
 
+    if (parser->version >= 3)
+        return handle_gcm_fragment_content (buf, parser);
+
     fragment_len = evbuffer_get_length (input);
     fragment = g_malloc (fragment_len);
     evbuffer_remove (input, fragment, fragment_len);
@@ -280,10 +444,13 @@ handle_frame_fragments (struct evbuffer *buf, FrameParser *parser)
         parser->enc_frame_len = ntohl (frame_len);
         parser->remain = parser->enc_frame_len;
 
-        if (parser->version == 1)
-            blocktx_decrypt_init (&parser->ctx, parser->key, parser->iv);
-        else if (parser->version == 2)
-            blocktx_decrypt_init (&parser->ctx, parser->key_v2, parser->iv_v2);
+        if (parser->version >= 3 && parser->enc_frame_len < GCM_TAG_SIZE) {
+            seaf_warning ("Frame is too short: %d.\n", parser->enc_frame_len);
+            parser->enc_frame_len = 0;
+            return -1;
+        }
+
+        parser_decrypt_init (parser, &parser->ctx);
         parser->enc_init = TRUE;
 
         if (evbuffer_get_length (input) > 0)
@@ -11,7 +11,20 @@
 #define ENC_KEY_SIZE 32
 #define ENC_BLOCK_SIZE 16
 
-#define BLOCK_PROTOCOL_VERSION 2
+/*
+ * Version 1 and 2 encrypt frames with AES-256-CBC. Version 3 uses
+ * AES-256-GCM, which also authenticates each frame.
+ */
+#define BLOCK_PROTOCOL_VERSION 3
+
+#define GCM_TAG_SIZE 16
+#define GCM_NONCE_SIZE 12
+
+/* Frames in each direction have their own GCM nonces. */
+enum {
+    BLOCKTX_DIR_TO_SERVER = 0,
+    BLOCKTX_DIR_TO_CLIENT,
+};
 
 enum {
     STATUS_OK = 0,
@@ -77,12 +90,31 @@ blocktx_decrypt_init (EVP_CIPHER_CTX *ctx,
                       const unsigned char *key,
                       const unsigned char *iv);
 
+/*
+ * Prepare @ctx for frame number @seq sent in direction @dir. The nonce
+ * is made from @iv, @dir and @seq, so it's never used twice with a key.
+ */
+int
+blocktx_gcm_encrypt_init (EVP_CIPHER_CTX *ctx,
+                          const unsigned char *key,
+                          const unsigned char *iv,
+                          int dir, guint64 seq);
+
+int
+blocktx_gcm_decrypt_init (EVP_CIPHER_CTX *ctx,
+                          const unsigned char *key,
+                          const unsigned char *iv,
+                          int dir, guint64 seq);
+
 /*
  * Encrypted data is sent in "frames".
  * Format of a frame:
  *
  * length of data in the frame after encryption + encrypted data.
  *
+ * In GCM mode the encrypted data is followed by the tag, which is
+ * counted in the length.
+ *
  * Each frame can contain three types of contents:
  * 1. Auth request or response;
  * 2. Block request or response header;
@@ -90,7 +122,8 @@ blocktx_decrypt_init (EVP_CIPHER_CTX *ctx,
  */
 
 int
-send_encrypted_data_frame_begin (evutil_socket_t data_fd,
+send_encrypted_data_frame_begin (EVP_CIPHER_CTX *ctx,
+                                 evutil_socket_t data_fd,
                                  int frame_len);
 
 int
@@ -119,6 +152,10 @@ typedef struct _FrameParser {
 
     int version;
 
+    /* Version 3: direction and number of the next frame received. */
+    int recv_dir;
+    guint64 recv_seq;
+
     /* Used when parsing fragments */
     int remain;
 
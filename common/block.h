@@ -21,9 +21,44 @@ enum {
     BLOCK_WRITE,
 };
 
+typedef struct BlockCacheStats {
+    guint64     hits;
+    guint64     misses;
+    guint64     evictions;
+    guint64     entries;
+    guint64     bytes;
+    guint64     max_bytes;
+    /* Block content read from the cache and from the primary backend. */
+    guint64     cache_bytes;
+    guint64     primary_bytes;
+} BlockCacheStats;
+
+typedef struct BlockDedupStats {
+    /* Blocks committed as links to the pool since the start. */
+    guint64     linked_blocks;
+    guint64     linked_bytes;
+    /* From a scan of the pool, 0 if it wasn't scanned. */
+    guint64     pool_blocks;
+    guint64     shared_blocks;      /* in more than one store */
+    guint64     saved_bytes;        /* stored once instead of per store */
+    guint64     orphans_removed;
+} BlockDedupStats;
+
 typedef gboolean (*SeafBlockFunc) (const char *store_id,
                                    int version,
                                    const char *block_id,
                                    void *user_data);
 
+/*
+ * Called with the blocks whose id starts with @prefix (two hex digits),
+ * sorted. Prefixes come in ascending order, so a scan can be resumed
+ * from the last prefix it completed. Return FALSE to stop.
+ */
+typedef gboolean (*SeafBlockBatchFunc) (const char *store_id,
+                                        int version,
+                                        const char *prefix,
+                                        char **block_ids,
+                                        int n_blocks,
+                                        void *user_data);
+
 #endif
@@ -0,0 +1,408 @@
+/* -*- Mode: C; tab-width: 4; indent-tabs-mode: nil; c-basic-offset: 4 -*- */
+
+#include "common.h"
+
+#include <fcntl.h>
+#include <pthread.h>
+#include <zlib.h>
+#include <glib/gstdio.h>
+
+#include "utils.h"
+#include "blocklist-cache.h"
+#include "log.h"
+
+/*
+ * Table file of a store. Integers are big endian.
+ *
+ *   header: magic "SBL1"
+ *   record: raw file id (20 bytes), n_blocks (32), raw block ids
+ *           (20 bytes each), crc32 of all the preceding fields (32)
+ *
+ * The file is indexed in memory the first time the store is used.
+ */
+#define TABLE_MAGIC "SBL1"
+#define TABLE_HEADER_LEN 4
+#define RECORD_HEAD_LEN 24
+#define RECORD_LEN(n_blocks) (RECORD_HEAD_LEN + 20 * (n_blocks) + 4)
+
+#define MIN_SLOTS 1024
+
+/* Open addressing index from file id to record offset. Offset 0 is
+ * the header, so it marks an empty slot.
+ */
+typedef struct IndexSlot {
+    unsigned char file_id[20];
+    guint32 offset;
+} IndexSlot;
+
+typedef struct StoreTable {
+    int fd;
+    guint32 size;
+    IndexSlot *slots;
+    guint32 n_slots;            /* power of 2 */
+    guint32 n_entries;
+    pthread_mutex_t lock;
+} StoreTable;
+
+struct BlockListCache {
+    char *dir;
+    guint32 max_table_size;
+    GHashTable *tables;         /* store_id -> StoreTable */
+    pthread_mutex_t lock;
+};
+
+static void
+put_be32 (unsigned char *p, guint32 v)
+{
+    p[0] = v >> 24;
+    p[1] = v >> 16;
+    p[2] = v >> 8;
+    p[3] = v;
+}
+
+static guint32
+get_be32 (const unsigned char *p)
+{
+    return ((guint32)p[0] << 24) | ((guint32)p[1] << 16) |
+        ((guint32)p[2] << 8) | (guint32)p[3];
+}
+
+static IndexSlot *
+find_slot (StoreTable *table, const unsigned char *file_id)
+{
+    guint32 mask = table->n_slots - 1;
+    guint32 i = get_be32 (file_id) & mask;
+
+    /* Ids are sha1s, so their first bytes are hash enough. */
+    while (table->slots[i].offset != 0 &&
+           memcmp (table->slots[i].file_id, file_id, 20) != 0)
+        i = (i + 1) & mask;
+
+    return &table->slots[i];
+}
+
+static void
+index_add (StoreTable *table, const unsigned char *file_id, guint32 offset)
+{
+    IndexSlot *slot;
+
+    if ((guint64)(table->n_entries + 1) * 10 > (guint64)table->n_slots * 7) {
+        IndexSlot *old = table->slots;
+        guint32 old_n = table->n_slots, i;
+
+        table->n_slots = old_n * 2;
+        table->slots = g_new0 (IndexSlot, table->n_slots);
+        for (i = 0; i < old_n; ++i) {
+            if (old[i].offset != 0)
+                *find_slot (table, old[i].file_id) = old[i];
+        }
+        g_free (old);
+    }
+
+    slot = find_slot (table, file_id);
+    if (slot->offset == 0)
+        ++table->n_entries;
+    memcpy (slot->file_id, file_id, 20);
+    slot->offset = offset;
+}
+
+static void
+index_reset (StoreTable *table)
+{
+    g_free (table->slots);
+    table->n_slots = MIN_SLOTS;
+    table->slots = g_new0 (IndexSlot, table->n_slots);
+    table->n_entries = 0;
+}
+
+/* Start the table file over, with only the header in it. */
+static int
+reset_table (StoreTable *table)
+{
+    index_reset (table);
+    table->size = 0;
+
+    if (ftruncate (table->fd, 0) < 0 ||
+        lseek (table->fd, 0, SEEK_SET) < 0 ||
+        writen (table->fd, TABLE_MAGIC, TABLE_HEADER_LEN) != TABLE_HEADER_LEN) {
+        seaf_warning ("Failed to reset block list cache table: %s.\n",
+                      strerror(errno));
+        return -1;
+    }
+
+    table->size = TABLE_HEADER_LEN;
+    return 0;
+}
+
+/*
+ * Index the records of a table file. Everything after the first bad
+ * record, usually one torn by a crash, is cut off.
+ */
+static int
+load_table (StoreTable *table, const char *path, guint32 max_size)
+{
+    char *contents = NULL;
+    gsize len = 0;
+    const unsigned char *p;
+    guint32 offset, n_blocks, rec_len;
+
+    if (!g_file_get_contents (path, &contents, &len, NULL) ||
+        len < TABLE_HEADER_LEN || len > max_size ||
+        memcmp (contents, TABLE_MAGIC, TABLE_HEADER_LEN) != 0) {
+        g_free (contents);
+        return reset_table (table);
+    }
+
+    p = (const unsigned char *)contents;
+    offset = TABLE_HEADER_LEN;
+    while (offset + RECORD_HEAD_LEN <= len) {
+        n_blocks = get_be32 (p + offset + 20);
+        if (n_blocks > (len - offset - RECORD_HEAD_LEN) / 20)
+            break;
+        rec_len = RECORD_LEN(n_blocks);
+        if (offset + rec_len > len)
+            break;
+        if (crc32 (0, p + offset, rec_len - 4) !=
+            get_be32 (p + offset + rec_len - 4))
+            break;
+
+        index_add (table, p + offset, offset);
+        offset += rec_len;
+    }
+    g_free (contents);
+
+    if (offset < len) {
+        seaf_warning ("Dropping %u bytes of bad records from %s.\n",
+                      (guint32)(len - offset), path);
+        if (ftruncate (table->fd, offset) < 0)
+            return reset_table (table);
+    }
+
+    table->size = offset;
+    return 0;
+}
+
+static StoreTable *
+open_table (BlockListCache *cache, const char *store_id)
+{
+    StoreTable *table;
+    char *path;
+
+    path = g_build_filename (cache->dir, store_id, NULL);
+
+    table = g_new0 (StoreTable, 1);
+    /* Not seaf_util_create(), which truncates the file on Windows. */
+    table->fd = g_open (path, O_RDWR | O_CREAT | O_BINARY, 0644);
+    if (table->fd < 0) {
+        seaf_warning ("Failed to open %s: %s.\n", path, strerror(errno));
+        g_free (table);
+        g_free (path);
+        return NULL;
+    }
+    pthread_mutex_init (&table->lock, NULL);
+    index_reset (table);
+
+    if (load_table (table, path, cache->max_table_size) < 0) {
+        close (table->fd);
+        pthread_mutex_destroy (&table->lock);
+        g_free (table->slots);
+        g_free (table);
+        table = NULL;
+    }
+
+    g_free (path);
+    return table;
+}
+
+static void
+table_free (StoreTable *table)
+{
+    close (table->fd);
+    pthread_mutex_destroy (&table->lock);
+    g_free (table->slots);
+    g_free (table);
+}
+
+/*
+ * Returns the table of @store_id with its lock held. The table lock is
+ * taken before the cache lock is released, so that a table can't be
+ * removed while it's in use.
+ */
+static StoreTable *
+lock_table (BlockListCache *cache, const char *store_id)
+{
+    StoreTable *table;
+
+    pthread_mutex_lock (&cache->lock);
+    table = g_hash_table_lookup (cache->tables, store_id);
+    if (!table) {
+        table = open_table (cache, store_id);
+        if (table)
+            g_hash_table_insert (cache->tables, g_strdup(store_id), table);
+    }
+    if (table)
+        pthread_mutex_lock (&table->lock);
+    pthread_mutex_unlock (&cache->lock);
+
+    return table;
+}
+
+BlockListCache *
+blocklist_cache_new (const char *dir, gint64 max_table_size)
+{
+    BlockListCache *cache;
+
+    if (checkdir_with_mkdir (dir) < 0) {
+        seaf_warning ("Failed to create block list cache dir %s.\n", dir);
+        return NULL;
+    }
+
+    cache = g_new0 (BlockListCache, 1);
+    cache->dir = g_strdup (dir);
+    /* Record offsets are 32 bits. */
+    cache->max_table_size = (guint32)CLAMP (max_table_size, 4096, G_MAXINT32);
+    cache->tables = g_hash_table_new_full (g_str_hash, g_str_equal,
+                                           g_free, NULL);
+    pthread_mutex_init (&cache->lock, NULL);
+
+    return cache;
+}
+
+char **
+blocklist_cache_lookup (BlockListCache *cache,
+                        const char *store_id,
+                        const char *file_id,
+                        int *n_blocks)
+{
+    StoreTable *table;
+    IndexSlot *slot;
+    unsigned char raw_id[20], head[RECORD_HEAD_LEN];
+    unsigned char *rec = NULL;
+    guint32 n, rec_len, i;
+    char **block_ids = NULL;
+
+    if (hex_to_rawdata (file_id, raw_id, 20) < 0)
+        return NULL;
+
+    table = lock_table (cache, store_id);
+    if (!table)
+        return NULL;
+
+    slot = find_slot (table, raw_id);
+    if (slot->offset == 0)
+        goto out;
+
+    if (lseek (table->fd, slot->offset, SEEK_SET) < 0 ||
+        readn (table->fd, head, RECORD_HEAD_LEN) != RECORD_HEAD_LEN)
+        goto out;
+
+    n = get_be32 (head + 20);
+    rec_len = RECORD_LEN(n);
+    if (memcmp (head, raw_id, 20) != 0 ||
+        n > (table->size - slot->offset - RECORD_HEAD_LEN) / 20 ||
+        slot->offset + rec_len > table->size)
+        goto out;
+
+    rec = g_malloc (rec_len);
+    memcpy (rec, head, RECORD_HEAD_LEN);
+    if (readn (table->fd, rec + RECORD_HEAD_LEN, rec_len - RECORD_HEAD_LEN) !=
+        rec_len - RECORD_HEAD_LEN)
+        goto out;
+
+    if (crc32 (0, rec, rec_len - 4) != get_be32 (rec + rec_len - 4)) {
+        seaf_warning ("Bad block list cache record for %s in store %.8s.\n",
+                      file_id, store_id);
+        goto out;
+    }
+
+    block_ids = g_new0 (char *, n + 1);
+    for (i = 0; i < n; ++i) {
+        block_ids[i] = g_malloc (41);
+        rawdata_to_hex (rec + RECORD_HEAD_LEN + 20 * i, block_ids[i], 20);
+    }
+    *n_blocks = n;
+
+out:
+    pthread_mutex_unlock (&table->lock);
+    g_free (rec);
+    return block_ids;
+}
+
+void
+blocklist_cache_insert (BlockListCache *cache,
+                        const char *store_id,
+                        const char *file_id,
+                        char **block_ids,
+                        int n_blocks)
+{
+    StoreTable *table;
+    unsigned char *rec;
+    guint32 rec_len = RECORD_LEN(n_blocks);
+    int i;
+
+    if (n_blocks < 0 || rec_len + TABLE_HEADER_LEN > cache->max_table_size)
+        return;
+
+    rec = g_malloc (rec_len);
+    if (hex_to_rawdata (file_id, rec, 20) < 0)
+        goto free_rec;
+    put_be32 (rec + 20, n_blocks);
+    for (i = 0; i < n_blocks; ++i) {
+        if (hex_to_rawdata (block_ids[i], rec + RECORD_HEAD_LEN + 20 * i, 20) < 0)
+            goto free_rec;
+    }
+    put_be32 (rec + rec_len - 4, crc32 (0, rec, rec_len - 4));
+
+    table = lock_table (cache, store_id);
+    if (!table)
+        goto free_rec;
+
+    if (find_slot (table, rec)->offset != 0)
+        goto out;
+
+    if (table->size + rec_len > cache->max_table_size &&
+        reset_table (table) < 0)
+        goto out;
+
+    if (lseek (table->fd, table->size, SEEK_SET) < 0 ||
+        writen (table->fd, rec, rec_len) != rec_len) {
+        seaf_warning ("Failed to write block list cache of store %.8s: %s.\n",
+                      store_id, strerror(errno));
+        /* Don't leave a partial record in the middle of the file. */
+        if (ftruncate (table->fd, table->size) < 0)
+            reset_table (table);
+        goto out;
+    }
+
+    index_add (table, rec, table->size);
+    table->size += rec_len;
+
+out:
+    pthread_mutex_unlock (&table->lock);
+free_rec:
+    g_free (rec);
+}
+
+void
+blocklist_cache_remove_store (BlockListCache *cache, const char *store_id)
+{
+    StoreTable *table;
+    char *path;
+
+    pthread_mutex_lock (&cache->lock);
+
+    table = g_hash_table_lookup (cache->tables, store_id);
+    if (table) {
+        /* Wait for the current user of the table. */
+        pthread_mutex_lock (&table->lock);
+        g_hash_table_remove (cache->tables, store_id);
+        pthread_mutex_unlock (&table->lock);
+        table_free (table);
+    }
+
+    path = g_build_filename (cache->dir, store_id, NULL);
+    seaf_util_unlink (path);
+    g_free (path);
+
+    pthread_mutex_unlock (&cache->lock);
+}
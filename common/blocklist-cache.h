@@ -0,0 +1,45 @@
+/* -*- Mode: C; tab-width: 4; indent-tabs-mode: nil; c-basic-offset: 4 -*- */
+
+#ifndef BLOCKLIST_CACHE_H
+#define BLOCKLIST_CACHE_H
+
+#include <glib.h>
+
+/*
+ * Persistent cache of the block ids of file objects, one table file per
+ * store under the cache dir.
+ *
+ * File ids are content addresses, so an entry never goes stale. Tables
+ * only grow; one that reaches the size limit is started over. Each record
+ * carries a checksum, so a torn or damaged record is a miss, never a
+ * wrong block list.
+ */
+
+typedef struct BlockListCache BlockListCache;
+
+/* @max_table_size is the limit of each table file, in bytes. */
+BlockListCache *
+blocklist_cache_new (const char *dir, gint64 max_table_size);
+
+/*
+ * Returns a NULL-terminated array of the block ids of @file_id, to be
+ * freed with g_strfreev(), or NULL if it's not cached.
+ */
+char **
+blocklist_cache_lookup (BlockListCache *cache,
+                        const char *store_id,
+                        const char *file_id,
+                        int *n_blocks);
+
+void
+blocklist_cache_insert (BlockListCache *cache,
+                        const char *store_id,
+                        const char *file_id,
+                        char **block_ids,
+                        int n_blocks);
+
+/* Drop the table of a removed store. */
+void
+blocklist_cache_remove_store (BlockListCache *cache, const char *store_id);
+
+#endif
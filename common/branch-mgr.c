@@ -60,7 +60,8 @@ seaf_branch_set_commit (SeafBranch *branch, const char *commit_id)
 void
 seaf_branch_ref (SeafBranch *branch)
 {
-    branch->ref++;
+    /* Branches are shared by cached repos on the server. */
+    g_atomic_int_inc (&branch->ref);
 }
 
 void
@@ -69,10 +70,29 @@ seaf_branch_unref (SeafBranch *branch)
     if (!branch)
         return;
 
-    if (--branch->ref <= 0)
+    if (g_atomic_int_dec_and_test (&branch->ref))
         seaf_branch_free (branch);
 }
 
+#if defined( SEAFILE_SERVER ) && defined( FULL_FEATURE )
+#include <ccnet/timer.h>
+
+#define DEFAULT_BRANCH_CACHE_TTL 60
+#define MAX_CACHED_REPOS 100000
+
+/* How often the branch updates of other servers are checked, in ms. */
+#define BRANCH_POLL_INTERVAL 1000
+/* Updates are looked up this far back, for clock skew between servers. */
+#define BRANCH_POLL_SKEW 5
+/* Updates are kept this long for servers to see them. */
+#define BRANCH_UPDATE_KEEP 3600
+
+typedef struct CachedBranch {
+    char commit_id[41];
+    gint64 expire_time;
+} CachedBranch;
+#endif
+
 struct _SeafBranchManagerPriv {
     sqlite3 *db;
 #ifndef SEAFILE_SERVER
@@ -80,15 +100,41 @@ struct _SeafBranchManagerPriv {
 #endif
 
 #if defined( SEAFILE_SERVER ) && defined( FULL_FEATURE )
-    uint32_t cevent_id;
+    /* repo_id -> (name -> CachedBranch). Kept up to date by the branch
+     * updates of this process. Those of other servers sharing the DB
+     * are seen through the BranchUpdates table if share_updates is set,
+     * otherwise cached heads may be stale for up to cache_ttl seconds.
+     */
+    GHashTable *cache;
+    pthread_mutex_t cache_lock;
+    /* Bumped on every update, so that heads read before one aren't
+     * cached after it.
+     */
+    guint64 cache_gen;
+    int cache_ttl;
+
+    gboolean share_updates;
+    CcnetTimer *poll_timer;
+    gint64 last_poll;
+    int n_polls;
 #endif    
 };
 
 #if defined( SEAFILE_SERVER ) && defined( FULL_FEATURE )
 
 #include "mq-mgr.h"
-#include <ccnet/cevent.h>
-static void publish_repo_update_event (CEvent *event, void *data);
+static int init_branch_cache (SeafBranchManager *mgr);
+static void set_cached_branch (SeafBranchManager *mgr, const char *repo_id,
+                               const char *name, const char *commit_id);
+
+/* Cached repos keep their head branch, so drop them on any change. */
+#define invalidate_repo(repo_id)                                        \
+    seaf_repo_manager_invalidate_repo (seaf->repo_mgr, (repo_id))
+
+#else
+
+#define invalidate_repo(repo_id)
+#define set_cached_branch(mgr, repo_id, name, commit_id)
 
 #endif    
 
@@ -113,13 +159,15 @@ seaf_branch_manager_new (struct _SeafileSession *seaf)
 int
 seaf_branch_manager_init (SeafBranchManager *mgr)
 {
+    if (open_db (mgr) < 0)
+        return -1;
+
 #if defined( SEAFILE_SERVER ) && defined( FULL_FEATURE )
-    mgr->priv->cevent_id = cevent_manager_register (seaf->ev_mgr,
-                                    (cevent_handler)publish_repo_update_event,
-                                                    NULL);
-#endif    
+    if (init_branch_cache (mgr) < 0)
+        return -1;
+#endif
 
-    return open_db (mgr);
+    return 0;
 }
 
 static int
@@ -244,6 +292,8 @@ seaf_branch_manager_add_branch (SeafBranchManager *mgr, SeafBranch *branch)
         if (rc < 0)
             return -1;
     }
+    invalidate_repo (branch->repo_id);
+    set_cached_branch (mgr, branch->repo_id, branch->name, branch->commit_id);
     return 0;
 #endif
 }
@@ -271,6 +321,8 @@ seaf_branch_manager_del_branch (SeafBranchManager *mgr,
     int rc = seaf_db_statement_query (mgr->seaf->db,
                                       "DELETE FROM Branch WHERE name=? AND repo_id=?",
                                       2, "string", name, "string", repo_id);
+    invalidate_repo (repo_id);
+    set_cached_branch (mgr, repo_id, name, NULL);
     if (rc < 0)
         return -1;
     return 0;
@@ -303,6 +355,9 @@ seaf_branch_manager_update_branch (SeafBranchManager *mgr, SeafBranch *branch)
                                       3, "string", branch->commit_id,
                                       "string", branch->name,
                                       "string", branch->repo_id);
+    invalidate_repo (branch->repo_id);
+    set_cached_branch (mgr, branch->repo_id, branch->name,
+                       rc < 0 ? NULL : branch->commit_id);
     if (rc < 0)
         return -1;
     return 0;
@@ -311,52 +366,330 @@ seaf_branch_manager_update_branch (SeafBranchManager *mgr, SeafBranch *branch)
 
 #if defined( SEAFILE_SERVER ) && defined( FULL_FEATURE )
 
+/* Branch head cache */
+
+static void
+record_branch_update (SeafBranchManager *mgr, const char *repo_id)
+{
+    if (!mgr->priv->share_updates)
+        return;
+
+    if (seaf_db_statement_query (mgr->seaf->db,
+                                 "INSERT INTO BranchUpdates (repo_id, update_time) "
+                                 "VALUES (?, ?)",
+                                 2, "string", repo_id,
+                                 "int64", (gint64)time(NULL)) < 0)
+        seaf_warning ("[branch mgr] Failed to record update of repo %.8s.\n",
+                      repo_id);
+}
+
+static void
+uncache_repo_locked (SeafBranchManagerPriv *priv, const char *repo_id)
+{
+    ++priv->cache_gen;
+    g_hash_table_remove (priv->cache, repo_id);
+}
+
+/* Cache @commit_id as the head after an update, or drop the branch if
+ * it's NULL.
+ */
+static void
+set_cached_branch (SeafBranchManager *mgr, const char *repo_id,
+                   const char *name, const char *commit_id)
+{
+    SeafBranchManagerPriv *priv = mgr->priv;
+    GHashTable *branches;
+    CachedBranch *cached;
+
+    if (priv->cache_ttl > 0) {
+        pthread_mutex_lock (&priv->cache_lock);
+
+        ++priv->cache_gen;
+        branches = g_hash_table_lookup (priv->cache, repo_id);
+        if (!commit_id) {
+            if (branches)
+                g_hash_table_remove (branches, name);
+        } else if (branches ||
+                   g_hash_table_size (priv->cache) < MAX_CACHED_REPOS) {
+            if (!branches) {
+                branches = g_hash_table_new_full (g_str_hash, g_str_equal,
+                                                  g_free, g_free);
+                g_hash_table_insert (priv->cache, g_strdup (repo_id), branches);
+            }
+            cached = g_new0 (CachedBranch, 1);
+            memcpy (cached->commit_id, commit_id, 40);
+            cached->expire_time = (gint64)time(NULL) + priv->cache_ttl;
+            g_hash_table_replace (branches, g_strdup (name), cached);
+        }
+
+        pthread_mutex_unlock (&priv->cache_lock);
+    }
+
+    record_branch_update (mgr, repo_id);
+}
+
 static gboolean
-get_commit_id (SeafDBRow *row, void *data)
+lookup_cached_branch (SeafBranchManagerPriv *priv, const char *repo_id,
+                      const char *name, char *commit_id, guint64 *gen)
 {
-    char *out_commit_id = data;
-    const char *commit_id;
+    GHashTable *branches;
+    CachedBranch *cached;
+    gboolean found = FALSE;
+
+    pthread_mutex_lock (&priv->cache_lock);
+
+    branches = g_hash_table_lookup (priv->cache, repo_id);
+    cached = branches ? g_hash_table_lookup (branches, name) : NULL;
+    if (cached) {
+        if (cached->expire_time > (gint64)time(NULL)) {
+            memcpy (commit_id, cached->commit_id, 41);
+            found = TRUE;
+        } else {
+            g_hash_table_remove (branches, name);
+        }
+    }
+    *gen = priv->cache_gen;
 
-    commit_id = seaf_db_row_get_column_text (row, 0);
-    memcpy (out_commit_id, commit_id, 41);
-    out_commit_id[40] = '\0';
+    pthread_mutex_unlock (&priv->cache_lock);
 
-    return FALSE;
+    return found;
 }
 
-typedef struct {
-    char *repo_id;
-    char *commit_id;
-} RepoUpdateEventData;
+static gboolean
+repo_branches_expired (gpointer key, gpointer value, gpointer user_data)
+{
+    GHashTable *branches = value;
+    GHashTableIter iter;
+    gpointer k, v;
+    gint64 *now = user_data;
+
+    g_hash_table_iter_init (&iter, branches);
+    while (g_hash_table_iter_next (&iter, &k, &v)) {
+        if (((CachedBranch *)v)->expire_time > *now)
+            return FALSE;
+    }
+    return TRUE;
+}
 
 static void
-publish_repo_update_event (CEvent *event, void *data)
+cache_branch (SeafBranchManagerPriv *priv, const char *repo_id,
+              const char *name, const char *commit_id, guint64 gen)
 {
-    RepoUpdateEventData *rdata = event->data;
+    GHashTable *branches;
+    CachedBranch *cached;
+    gint64 now = (gint64)time(NULL);
+
+    pthread_mutex_lock (&priv->cache_lock);
+
+    /* The branch changed while it was being read. */
+    if (gen != priv->cache_gen)
+        goto out;
+
+    branches = g_hash_table_lookup (priv->cache, repo_id);
+    if (!branches) {
+        if (g_hash_table_size (priv->cache) >= MAX_CACHED_REPOS) {
+            g_hash_table_foreach_remove (priv->cache, repo_branches_expired,
+                                         &now);
+            if (g_hash_table_size (priv->cache) >= MAX_CACHED_REPOS)
+                goto out;
+        }
+        branches = g_hash_table_new_full (g_str_hash, g_str_equal,
+                                          g_free, g_free);
+        g_hash_table_insert (priv->cache, g_strdup (repo_id), branches);
+    }
 
-    char buf[128];
-    snprintf (buf, sizeof(buf), "repo-update\t%s\t%s",
-              rdata->repo_id, rdata->commit_id);
+    cached = g_new0 (CachedBranch, 1);
+    memcpy (cached->commit_id, commit_id, 40);
+    cached->expire_time = now + priv->cache_ttl;
+    g_hash_table_replace (branches, g_strdup (name), cached);
 
-    seaf_mq_manager_publish_event (seaf->mq_mgr, buf);
+out:
+    pthread_mutex_unlock (&priv->cache_lock);
+}
+
+static gboolean
+collect_updated_repo (SeafDBRow *row, void *data)
+{
+    GHashTable *repos = data;
+    const char *repo_id = seaf_db_row_get_column_text (row, 0);
+
+    if (repo_id)
+        g_hash_table_replace (repos, g_strdup (repo_id), NULL);
+    return TRUE;
+}
+
+/* Drop the heads other servers may have updated since the last poll. */
+static int
+poll_branch_updates (void *vmgr)
+{
+    SeafBranchManager *mgr = vmgr;
+    SeafBranchManagerPriv *priv = mgr->priv;
+    GHashTable *repos;
+    GHashTableIter iter;
+    gpointer key;
+    gint64 now = (gint64)time(NULL);
+
+    repos = g_hash_table_new_full (g_str_hash, g_str_equal, g_free, NULL);
+    if (seaf_db_statement_foreach_row (mgr->seaf->db,
+                                       "SELECT repo_id FROM BranchUpdates "
+                                       "WHERE update_time>=?",
+                                       collect_updated_repo, repos,
+                                       1, "int64",
+                                       priv->last_poll - BRANCH_POLL_SKEW) < 0) {
+        /* Nothing cached can be trusted. */
+        pthread_mutex_lock (&priv->cache_lock);
+        ++priv->cache_gen;
+        g_hash_table_remove_all (priv->cache);
+        pthread_mutex_unlock (&priv->cache_lock);
+        g_hash_table_destroy (repos);
+        return 1;
+    }
+    priv->last_poll = now;
+
+    pthread_mutex_lock (&priv->cache_lock);
+    g_hash_table_iter_init (&iter, repos);
+    while (g_hash_table_iter_next (&iter, &key, NULL))
+        uncache_repo_locked (priv, key);
+    pthread_mutex_unlock (&priv->cache_lock);
+
+    g_hash_table_iter_init (&iter, repos);
+    while (g_hash_table_iter_next (&iter, &key, NULL))
+        invalidate_repo (key);
+    g_hash_table_destroy (repos);
+
+    if (++priv->n_polls % 60 == 0)
+        seaf_db_statement_query (mgr->seaf->db,
+                                 "DELETE FROM BranchUpdates WHERE update_time<?",
+                                 1, "int64", now - BRANCH_UPDATE_KEEP);
 
-    g_free (rdata->repo_id);
-    g_free (rdata->commit_id);
-    g_free (rdata);
+    return 1;
+}
+
+static int
+create_updates_table (SeafDB *db)
+{
+    char *sql;
+
+    switch (seaf_db_type (db)) {
+    case SEAF_DB_TYPE_MYSQL:
+        sql = "CREATE TABLE IF NOT EXISTS BranchUpdates ("
+            "id BIGINT NOT NULL PRIMARY KEY AUTO_INCREMENT, "
+            "repo_id CHAR(37), update_time BIGINT, INDEX (update_time))"
+            "ENGINE=INNODB";
+        if (seaf_db_query (db, sql) < 0)
+            return -1;
+        break;
+    case SEAF_DB_TYPE_SQLITE:
+        sql = "CREATE TABLE IF NOT EXISTS BranchUpdates ("
+            "repo_id CHAR(36), update_time BIGINT)";
+        if (seaf_db_query (db, sql) < 0)
+            return -1;
+        sql = "CREATE INDEX IF NOT EXISTS branchupdates_time_idx "
+            "ON BranchUpdates (update_time)";
+        if (seaf_db_query (db, sql) < 0)
+            return -1;
+        break;
+    case SEAF_DB_TYPE_PGSQL:
+        sql = "CREATE TABLE IF NOT EXISTS BranchUpdates ("
+            "repo_id CHAR(36), update_time BIGINT)";
+        if (seaf_db_query (db, sql) < 0)
+            return -1;
+        if (!pgsql_index_exists (db, "branchupdates_time_idx")) {
+            sql = "CREATE INDEX branchupdates_time_idx "
+                "ON BranchUpdates (update_time)";
+            if (seaf_db_query (db, sql) < 0)
+                return -1;
+        }
+        break;
+    default:
+        g_return_val_if_reached (-1);
+    }
+
+    return 0;
+}
+
+static int
+init_branch_cache (SeafBranchManager *mgr)
+{
+    SeafBranchManagerPriv *priv = mgr->priv;
+    GError *error = NULL;
+    int ttl;
+
+    /*
+     * [library]
+     * branch_cache_ttl = 60   # seconds, 0 to disable
+     * # Set if other servers update the same DB, so that their updates
+     * # are seen within a second. Always set with sync workers and in
+     * # cluster mode.
+     * share_branch_updates = false
+     */
+    ttl = g_key_file_get_integer (seaf->config, "library", "branch_cache_ttl",
+                                  &error);
+    if (error) {
+        ttl = DEFAULT_BRANCH_CACHE_TTL;
+        g_clear_error (&error);
+    }
+    priv->cache_ttl = MAX (ttl, 0);
+
+    priv->share_updates = g_key_file_get_boolean (seaf->config, "library",
+                                                  "share_branch_updates", NULL) ||
+        seafile_session_shares_storage (seaf);
+
+    priv->cache = g_hash_table_new_full (g_str_hash, g_str_equal,
+                                         g_free,
+                                         (GDestroyNotify)g_hash_table_destroy);
+    pthread_mutex_init (&priv->cache_lock, NULL);
+
+    if (!priv->share_updates)
+        return 0;
+
+    if (create_updates_table (mgr->seaf->db) < 0) {
+        seaf_warning ("[branch mgr] Failed to create BranchUpdates table.\n");
+        return -1;
+    }
+    priv->last_poll = (gint64)time(NULL);
+    if (priv->cache_ttl > 0)
+        priv->poll_timer = ccnet_timer_new (poll_branch_updates, mgr,
+                                            BRANCH_POLL_INTERVAL);
+
+    return 0;
+}
+
+static gboolean
+get_commit_id (SeafDBRow *row, void *data)
+{
+    char *out_commit_id = data;
+    const char *commit_id;
+
+    commit_id = seaf_db_row_get_column_text (row, 0);
+    memcpy (out_commit_id, commit_id, 41);
+    out_commit_id[40] = '\0';
+
+    return FALSE;
 }
 
 static void
 on_branch_updated (SeafBranchManager *mgr, SeafBranch *branch)
 {
+    if (strcmp (branch->name, "master") == 0) {
+        seaf_repo_manager_update_repo_info (seaf->repo_mgr, branch->repo_id,
+                                            branch->commit_id);
+        schedule_file_rev_indexing (seaf->file_rev_index, branch->repo_id);
+
+        /* Clients also sync virtual repos, so they're told too. */
+        if (seaf->http_server)
+            seaf_http_server_notify_repo_update (seaf->http_server,
+                                                 branch->repo_id);
+    }
+
     if (seaf_repo_manager_is_virtual_repo (seaf->repo_mgr, branch->repo_id))
         return;
 
-    RepoUpdateEventData *rdata = g_new0 (RepoUpdateEventData, 1);
+    char buf[128];
+    snprintf (buf, sizeof(buf), "repo-update\t%s\t%s",
+              branch->repo_id, branch->commit_id);
 
-    rdata->repo_id = g_strdup (branch->repo_id);
-    rdata->commit_id = g_strdup (branch->commit_id);
-    
-    cevent_manager_add_event (seaf->ev_mgr, mgr->priv->cevent_id, rdata);
+    seaf_mq_manager_publish_event (seaf->mq_mgr, buf);
 }
 
 int
@@ -398,6 +731,12 @@ seaf_branch_manager_test_and_update_branch (SeafBranchManager *mgr,
                    branch->repo_id);
         seaf_db_rollback (trans);
         seaf_db_trans_close (trans);
+        /* The caller may have read a stale head from the cache. */
+        if (mgr->priv->cache_ttl > 0) {
+            pthread_mutex_lock (&mgr->priv->cache_lock);
+            uncache_repo_locked (mgr->priv, branch->repo_id);
+            pthread_mutex_unlock (&mgr->priv->cache_lock);
+        }
         return -1;
     }
 
@@ -419,6 +758,8 @@ seaf_branch_manager_test_and_update_branch (SeafBranchManager *mgr,
 
     seaf_db_trans_close (trans);
 
+    invalidate_repo (branch->repo_id);
+    set_cached_branch (mgr, branch->repo_id, branch->name, branch->commit_id);
     on_branch_updated (mgr, branch);
 
     return 0;
@@ -504,13 +845,20 @@ get_branch (SeafDBRow *row, void *vid)
     return FALSE;
 }
 
-static SeafBranch *
-real_get_branch (SeafBranchManager *mgr,
-                 const char *repo_id,
-                 const char *name)
+int
+seaf_branch_manager_get_head_id (SeafBranchManager *mgr,
+                                 const char *repo_id,
+                                 const char *name,
+                                 char *commit_id)
 {
-    char commit_id[41];
     char *sql;
+#ifdef FULL_FEATURE
+    guint64 gen = 0;
+
+    if (mgr->priv->cache_ttl > 0 &&
+        lookup_cached_branch (mgr->priv, repo_id, name, commit_id, &gen))
+        return 0;
+#endif
 
     commit_id[0] = 0;
     sql = "SELECT commit_id FROM Branch WHERE name=? AND repo_id=?";
@@ -518,10 +866,26 @@ real_get_branch (SeafBranchManager *mgr,
                                        get_branch, commit_id,
                                        2, "string", name, "string", repo_id) < 0) {
         g_warning ("[branch mgr] DB error when get branch %s.\n", name);
-        return NULL;
+        return -1;
     }
 
-    if (commit_id[0] == 0)
+#ifdef FULL_FEATURE
+    if (commit_id[0] != 0 && mgr->priv->cache_ttl > 0)
+        cache_branch (mgr->priv, repo_id, name, commit_id, gen);
+#endif
+
+    return 0;
+}
+
+static SeafBranch *
+real_get_branch (SeafBranchManager *mgr,
+                 const char *repo_id,
+                 const char *name)
+{
+    char commit_id[41];
+
+    if (seaf_branch_manager_get_head_id (mgr, repo_id, name, commit_id) < 0 ||
+        commit_id[0] == 0)
         return NULL;
 
     return seaf_branch_new (name, repo_id, commit_id);
@@ -67,6 +67,19 @@ seaf_branch_manager_get_branch (SeafBranchManager *mgr,
                                 const char *repo_id,
                                 const char *name);
 
+#ifdef SEAFILE_SERVER
+/*
+ * Copy the head of branch @name into @commit_id, which is left empty if
+ * there's no such branch. Unlike seaf_branch_manager_get_branch(), a
+ * DB error is told apart from a missing branch by returning -1.
+ */
+int
+seaf_branch_manager_get_head_id (SeafBranchManager *mgr,
+                                 const char *repo_id,
+                                 const char *name,
+                                 char *commit_id);
+#endif
+
 
 gboolean
 seaf_branch_manager_branch_exists (SeafBranchManager *mgr,
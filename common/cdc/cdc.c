@@ -9,9 +9,15 @@
 #include <string.h>
 #include <sys/stat.h>
 #include <errno.h>
+#include <pthread.h>
 #include <glib/gstdio.h>
 
+#ifndef WIN32
+#include <sys/mman.h>
+#endif
+
 #include "utils.h"
+#include "seaf-sha1.h"
 
 #include "cdc.h"
 #include "../seafile-crypt.h"
@@ -70,26 +76,341 @@ static int init_cdc_file_descriptor (int fd,
     return 0;
 }
 
+/*
+ * Block fingerprints, MurmurHash3 x64 128-bit. Words are read in host
+ * byte order; chunk maps never leave the machine they're made on.
+ */
+
+#define ROTL64(x, r) (((x) << (r)) | ((x) >> (64 - (r))))
+
+static uint64_t
+fp_fmix64 (uint64_t k)
+{
+    k ^= k >> 33;
+    k *= 0xff51afd7ed558ccdULL;
+    k ^= k >> 33;
+    k *= 0xc4ceb9fe1a85ec53ULL;
+    k ^= k >> 33;
+    return k;
+}
+
+static void
+block_fingerprint (const char *data, uint32_t len, uint8_t *fp)
+{
+    const uint8_t *p = (const uint8_t *)data;
+    const uint64_t c1 = 0x87c37b91114253d5ULL;
+    const uint64_t c2 = 0x4cf5ad432745937fULL;
+    uint64_t h1 = 0x5eaf, h2 = 0x5eaf;
+    uint64_t k1, k2;
+    uint32_t n = len / 16, rem = len & 15, i;
+
+    for (i = 0; i < n; ++i, p += 16) {
+        memcpy (&k1, p, 8);
+        memcpy (&k2, p + 8, 8);
+
+        k1 *= c1; k1 = ROTL64 (k1, 31); k1 *= c2; h1 ^= k1;
+        h1 = ROTL64 (h1, 27); h1 += h2; h1 = h1 * 5 + 0x52dce729;
+
+        k2 *= c2; k2 = ROTL64 (k2, 33); k2 *= c1; h2 ^= k2;
+        h2 = ROTL64 (h2, 31); h2 += h1; h2 = h2 * 5 + 0x38495ab5;
+    }
+
+    k1 = k2 = 0;
+    for (i = rem; i > 8; --i)
+        k2 ^= (uint64_t)p[i - 1] << ((i - 9) * 8);
+    for (i = MIN (rem, 8); i > 0; --i)
+        k1 ^= (uint64_t)p[i - 1] << ((i - 1) * 8);
+    if (rem > 8) {
+        k2 *= c2; k2 = ROTL64 (k2, 33); k2 *= c1; h2 ^= k2;
+    }
+    if (rem > 0) {
+        k1 *= c1; k1 = ROTL64 (k1, 31); k1 *= c2; h1 ^= k1;
+    }
+
+    h1 ^= len;
+    h2 ^= len;
+    h1 += h2;
+    h2 += h1;
+    h1 = fp_fmix64 (h1);
+    h2 = fp_fmix64 (h2);
+    h1 += h2;
+    h2 += h1;
+
+    memcpy (fp, &h1, 8);
+    memcpy (fp + 8, &h2, 8);
+}
+
+void
+cdc_chunk_map_free (CDCChunkMap *map)
+{
+    if (!map)
+        return;
+    g_free (map->blocks);
+    g_free (map);
+}
+
+/* Store the id of block @index, and its place in the chunk map if any.
+ * @fp is the fingerprint of the block's data, NULL without a chunk map.
+ */
+static void
+record_block (CDCFileDescriptor *file_descr, uint32_t index,
+              const CDCDescriptor *chunk, const uint8_t *fp)
+{
+    CDCBlockInfo *info;
+
+    memcpy (file_descr->blk_sha1s + index * CHECKSUM_LENGTH,
+            chunk->checksum, CHECKSUM_LENGTH);
+
+    if (!file_descr->chunk_map)
+        return;
+
+    info = &file_descr->chunk_map->blocks[index];
+    info->offset = chunk->offset;
+    info->len = chunk->len;
+    memcpy (info->fp, fp, CDC_FP_LEN);
+    memcpy (info->id, chunk->checksum, CHECKSUM_LENGTH);
+}
+
+/*
+ * Chunk pipeline.
+ *
+ * With more than one thread, the reading thread only looks for chunk
+ * boundaries. Each chunk is copied out and handed to a worker pool, which
+ * runs write_block (hash, encrypt and write). The number of chunks in
+ * flight is bounded, so memory use stays at a few block_max_sz per worker.
+ * Workers store the checksum at the chunk's own index, so blk_sha1s ends
+ * up in chunk order and the file id is identical to the serial path.
+ */
+
+/* Chunks queued or being processed per worker thread. */
+#define CDC_PIPELINE_DEPTH 2
+
+typedef struct CDCPipeline {
+    CDCFileDescriptor *file_descr;
+    struct SeafileCrypt *crypt;
+    gboolean write_data;
+
+    GThreadPool *tpool;
+
+    pthread_mutex_t lock;
+    pthread_cond_t cond;
+    int n_pending;
+    int max_pending;
+    gboolean failed;
+} CDCPipeline;
+
+typedef struct CDCChunkJob {
+    CDCDescriptor chunk;
+    uint32_t index;
+    /* FALSE if block_buf points into a mapping of the source file. */
+    gboolean own_buf;
+} CDCChunkJob;
+
+static void
+chunk_job_free (CDCChunkJob *job)
+{
+    if (job->own_buf)
+        free (job->chunk.block_buf);
+    g_free (job);
+}
+
+static void
+pipeline_worker (gpointer data, gpointer user_data)
+{
+    CDCChunkJob *job = data;
+    CDCPipeline *pipeline = user_data;
+    CDCFileDescriptor *file_descr = pipeline->file_descr;
+    uint8_t fp[CDC_FP_LEN];
+    int ret;
+
+    if (file_descr->chunk_map)
+        block_fingerprint (job->chunk.block_buf, job->chunk.len, fp);
+
+    ret = file_descr->write_block (file_descr->repo_id,
+                                   file_descr->version,
+                                   &job->chunk,
+                                   pipeline->crypt,
+                                   job->chunk.checksum,
+                                   pipeline->write_data);
+    if (ret >= 0)
+        record_block (file_descr, job->index, &job->chunk, fp);
+
+    pthread_mutex_lock (&pipeline->lock);
+    if (ret < 0)
+        pipeline->failed = TRUE;
+    --pipeline->n_pending;
+    pthread_cond_signal (&pipeline->cond);
+    pthread_mutex_unlock (&pipeline->lock);
+
+    chunk_job_free (job);
+}
+
+static CDCPipeline *
+cdc_pipeline_new (CDCFileDescriptor *file_descr,
+                  struct SeafileCrypt *crypt,
+                  gboolean write_data)
+{
+    CDCPipeline *pipeline = g_new0 (CDCPipeline, 1);
+    GError *error = NULL;
+
+    pipeline->file_descr = file_descr;
+    pipeline->crypt = crypt;
+    pipeline->write_data = write_data;
+    pipeline->max_pending = file_descr->n_threads * CDC_PIPELINE_DEPTH;
+    pthread_mutex_init (&pipeline->lock, NULL);
+    pthread_cond_init (&pipeline->cond, NULL);
+
+    pipeline->tpool = g_thread_pool_new (pipeline_worker,
+                                         pipeline,
+                                         file_descr->n_threads,
+                                         FALSE,
+                                         &error);
+    if (!pipeline->tpool) {
+        g_warning ("CDC: failed to create thread pool: %s.\n",
+                   error ? error->message : "");
+        g_clear_error (&error);
+        pthread_mutex_destroy (&pipeline->lock);
+        pthread_cond_destroy (&pipeline->cond);
+        g_free (pipeline);
+        return NULL;
+    }
+
+    return pipeline;
+}
+
+/* Queue the chunk. Blocks while the pipeline is full.
+ * If @copy is FALSE, chunk->block_buf must stay valid until
+ * cdc_pipeline_finish() returns.
+ */
+static int
+cdc_pipeline_submit (CDCPipeline *pipeline, CDCDescriptor *chunk,
+                     uint32_t index, gboolean copy)
+{
+    CDCChunkJob *job;
+    gboolean failed;
+
+    pthread_mutex_lock (&pipeline->lock);
+    while (pipeline->n_pending >= pipeline->max_pending && !pipeline->failed)
+        pthread_cond_wait (&pipeline->cond, &pipeline->lock);
+    failed = pipeline->failed;
+    if (!failed)
+        ++pipeline->n_pending;
+    pthread_mutex_unlock (&pipeline->lock);
+
+    if (failed)
+        return -1;
+
+    job = g_new0 (CDCChunkJob, 1);
+    job->index = index;
+    job->chunk.offset = chunk->offset;
+    job->chunk.len = chunk->len;
+    if (!copy) {
+        job->chunk.block_buf = chunk->block_buf;
+    } else {
+        job->chunk.block_buf = malloc (chunk->len);
+        if (!job->chunk.block_buf) {
+            g_free (job);
+            pthread_mutex_lock (&pipeline->lock);
+            --pipeline->n_pending;
+            pthread_mutex_unlock (&pipeline->lock);
+            return -1;
+        }
+        memcpy (job->chunk.block_buf, chunk->block_buf, chunk->len);
+        job->own_buf = TRUE;
+    }
+
+    g_thread_pool_push (pipeline->tpool, job, NULL);
+    return 0;
+}
+
+/* Wait until all queued chunks are processed.
+ * Returns -1 if any chunk failed to be written.
+ */
+static int
+cdc_pipeline_wait (CDCPipeline *pipeline)
+{
+    gboolean failed;
+
+    pthread_mutex_lock (&pipeline->lock);
+    while (pipeline->n_pending > 0)
+        pthread_cond_wait (&pipeline->cond, &pipeline->lock);
+    failed = pipeline->failed;
+    pthread_mutex_unlock (&pipeline->lock);
+
+    return failed ? -1 : 0;
+}
+
+/* Wait for all queued chunks and free the pipeline.
+ * Returns -1 if any chunk failed to be written.
+ */
+static int
+cdc_pipeline_finish (CDCPipeline *pipeline)
+{
+    int ret;
+
+    ret = cdc_pipeline_wait (pipeline);
+
+    g_thread_pool_free (pipeline->tpool, FALSE, TRUE);
+    pthread_mutex_destroy (&pipeline->lock);
+    pthread_cond_destroy (&pipeline->cond);
+    g_free (pipeline);
+
+    return ret;
+}
+
+/* Hand one chunk to write_block, directly or through the pipeline,
+ * and record its position in the block list.
+ */
+static int
+emit_chunk (CDCFileDescriptor *file_descr,
+            CDCPipeline *pipeline,
+            CDCDescriptor *chunk,
+            SeafileCrypt *crypt,
+            gboolean write_data,
+            gboolean copy)
+{
+    uint8_t fp[CDC_FP_LEN];
+    int ret;
+
+    if (file_descr->block_nr == file_descr->max_block_nr) {
+        g_warning ("Block id array is not large enough, bail out.\n");
+        return -1;
+    }
+
+    if (pipeline) {
+        ret = cdc_pipeline_submit (pipeline, chunk, file_descr->block_nr, copy);
+    } else {
+        if (file_descr->chunk_map)
+            block_fingerprint (chunk->block_buf, chunk->len, fp);
+        ret = file_descr->write_block (file_descr->repo_id,
+                                       file_descr->version,
+                                       chunk,
+                                       crypt,
+                                       chunk->checksum,
+                                       write_data);
+    }
+    if (ret < 0) {
+        g_warning ("CDC: failed to write chunk.\n");
+        return -1;
+    }
+
+    if (!pipeline)
+        record_block (file_descr, file_descr->block_nr, chunk, fp);
+    file_descr->block_nr++;
+
+    return 0;
+}
+
 #define WRITE_CDC_BLOCK(block_sz, write_data)                \
 do {                                                         \
     int _block_sz = (block_sz);                              \
     chunk_descr.len = _block_sz;                             \
     chunk_descr.offset = offset;                             \
-    ret = file_descr->write_block (file_descr->repo_id,      \
-                                   file_descr->version,      \
-                                   &chunk_descr,             \
-            crypt, chunk_descr.checksum,                     \
-                                   (write_data));            \
-    if (ret < 0) {                                           \
-        free (buf);                                          \
-        g_warning ("CDC: failed to write chunk.\n");         \
-        return -1;                                           \
+    if (emit_chunk (file_descr, pipeline, &chunk_descr,      \
+                    crypt, (write_data), TRUE) < 0) {        \
+        ret = -1;                                            \
+        goto out;                                            \
     }                                                        \
-    memcpy (file_descr->blk_sha1s +                          \
-            file_descr->block_nr * CHECKSUM_LENGTH,          \
-            chunk_descr.checksum, CHECKSUM_LENGTH);          \
-    SHA1_Update (&file_ctx, chunk_descr.checksum, 20);       \
-    file_descr->block_nr++;                                  \
     offset += _block_sz;                                     \
                                                              \
     memmove (buf, buf + _block_sz, tail - _block_sz);        \
@@ -97,6 +418,415 @@ do {                                                         \
     cur = 0;                                                 \
 }while(0);
 
+/*
+ * Boundary scanners.
+ *
+ * A scanner looks at the data of the current chunk, buf[0] being the first
+ * byte of the chunk, and decides where the chunk ends. Scanning can stop at
+ * the end of the loaded data and be resumed later with more data appended,
+ * so the rolling state is kept in the scanner.
+ */
+
+typedef struct CDCScanner {
+    int algorithm;
+    uint32_t block_min_sz;
+    uint32_t block_max_sz;
+    uint32_t block_sz;
+
+    /* Rabin */
+    uint32_t block_mask;
+    unsigned int rabin_fp;
+
+    /* FastCDC */
+    uint64_t mask_s;            /* used before reaching block_sz */
+    uint64_t mask_l;            /* used after reaching block_sz */
+    uint64_t gear_fp;
+} CDCScanner;
+
+/* Normalization level of FastCDC. The masks used before and after the
+ * expected chunk size have this many bits more and less than the mask
+ * matching the expected size.
+ */
+#define FASTCDC_NORMAL_LEVEL 2
+
+static uint64_t gear_table[256];
+
+static void
+gear_init ()
+{
+    /* The table must never change, or chunk boundaries of existing
+     * repos would move. Generate it from a fixed seed with splitmix64.
+     */
+    uint64_t x = 0x5eaf11e0c0dec0deULL;
+    uint64_t z;
+    int i;
+
+    for (i = 0; i < 256; ++i) {
+        z = (x += 0x9e3779b97f4a7c15ULL);
+        z = (z ^ (z >> 30)) * 0xbf58476d1ce4e5b9ULL;
+        z = (z ^ (z >> 27)) * 0x94d049bb133111ebULL;
+        gear_table[i] = z ^ (z >> 31);
+    }
+}
+
+/* Mask of the @n highest bits. Higher bits of the gear hash depend on more
+ * input bytes, so only they are used for boundary checks.
+ */
+static uint64_t
+gear_mask (int n)
+{
+    if (n <= 0)
+        return 0;
+    if (n >= 64)
+        return ~(uint64_t)0;
+    return ~(uint64_t)0 << (64 - n);
+}
+
+int
+cdc_algorithm_from_repo_version (int version)
+{
+    if (version >= CDC_FASTCDC_REPO_VERSION)
+        return CDC_ALGO_FASTCDC;
+    return CDC_ALGO_RABIN;
+}
+
+static void
+cdc_scanner_init (CDCScanner *scanner, CDCFileDescriptor *file_descr)
+{
+    int bits = 0;
+
+    memset (scanner, 0, sizeof(CDCScanner));
+
+    scanner->algorithm = file_descr->algorithm;
+    if (scanner->algorithm == CDC_ALGO_AUTO)
+        scanner->algorithm =
+            cdc_algorithm_from_repo_version (file_descr->version);
+
+    scanner->block_min_sz = file_descr->block_min_sz;
+    scanner->block_max_sz = file_descr->block_max_sz;
+    scanner->block_sz = file_descr->block_sz;
+    scanner->block_mask = file_descr->block_sz - 1;
+
+    while (((uint32_t)1 << (bits + 1)) <= scanner->block_sz)
+        ++bits;
+    scanner->mask_s = gear_mask (bits + FASTCDC_NORMAL_LEVEL);
+    scanner->mask_l = gear_mask (bits - FASTCDC_NORMAL_LEVEL);
+}
+
+static gboolean
+scan_rabin (CDCScanner *scanner, const char *buf, int *cur, int tail)
+{
+    uint32_t block_min_sz = scanner->block_min_sz;
+    uint32_t block_mask = scanner->block_mask;
+    unsigned int fingerprint = scanner->rabin_fp;
+    int c = *cur;
+
+    while (c < tail) {
+        fingerprint = (c == block_min_sz - 1) ?
+            finger((char *)buf + c - BLOCK_WIN_SZ + 1, BLOCK_WIN_SZ) :
+            rolling_finger (fingerprint, BLOCK_WIN_SZ,
+                            *(buf+c-BLOCK_WIN_SZ), *(buf + c));
+
+        if (((fingerprint & block_mask) ==  ((BREAK_VALUE & block_mask)))
+            || c + 1 >= scanner->block_max_sz) {
+            scanner->rabin_fp = fingerprint;
+            *cur = c;
+            return TRUE;
+        }
+        ++c;
+    }
+
+    scanner->rabin_fp = fingerprint;
+    *cur = c;
+    return FALSE;
+}
+
+static gboolean
+scan_fastcdc (CDCScanner *scanner, const char *buf, int *cur, int tail)
+{
+    uint32_t block_min_sz = scanner->block_min_sz;
+    uint64_t fingerprint = scanner->gear_fp;
+    uint64_t mask;
+    int c = *cur;
+
+    /* Bytes below block_min_sz are never hashed. The hash is restarted
+     * on the first byte after that region.
+     */
+    if (c == block_min_sz - 1)
+        fingerprint = 0;
+
+    while (c < tail) {
+        fingerprint = (fingerprint << 1) + gear_table[(uint8_t)buf[c]];
+        mask = (c + 1 < scanner->block_sz) ? scanner->mask_s : scanner->mask_l;
+
+        if (!(fingerprint & mask) || c + 1 >= scanner->block_max_sz) {
+            scanner->gear_fp = fingerprint;
+            *cur = c;
+            return TRUE;
+        }
+        ++c;
+    }
+
+    scanner->gear_fp = fingerprint;
+    *cur = c;
+    return FALSE;
+}
+
+/*
+ * Scan buf[*cur .. tail) for the end of the current chunk.
+ * Returns TRUE if a boundary is found, and *cur is set to the last byte
+ * of the chunk. Otherwise *cur is set to @tail.
+ */
+static gboolean
+cdc_scanner_scan (CDCScanner *scanner, const char *buf, int *cur, int tail)
+{
+    /* A block is at least of size block_min_sz. */
+    if (*cur < scanner->block_min_sz - 1)
+        *cur = scanner->block_min_sz - 1;
+    if (*cur >= tail)
+        return FALSE;
+
+    if (scanner->algorithm == CDC_ALGO_FASTCDC)
+        return scan_fastcdc (scanner, buf, cur, tail);
+    return scan_rabin (scanner, buf, cur, tail);
+}
+
+#ifndef WIN32
+/*
+ * Chunk a file by scanning a read-only mapping of it. Chunks are handed to
+ * write_block as slices of the mapping, so the data is never copied into or
+ * moved around in a chunk buffer.
+ *
+ * The pipeline, if any, is finished before the mapping goes away, and
+ * *pipeline is set to NULL.
+ * Returns 1 if the file cannot be mapped; the caller should read it instead.
+ */
+static int
+chunk_mapped_file (int fd_src,
+                   uint64_t file_size,
+                   CDCFileDescriptor *file_descr,
+                   CDCScanner *scanner,
+                   CDCPipeline **pipeline,
+                   SeafileCrypt *crypt,
+                   gboolean write_data)
+{
+    char *map;
+    CDCDescriptor chunk_descr;
+    uint32_t block_min_sz = file_descr->block_min_sz;
+    uint32_t block_max_sz = file_descr->block_max_sz;
+    uint64_t offset = 0, remain;
+    int tail, cur;
+    int ret = 0;
+
+    if (file_size == 0 || file_size > (uint64_t)SIZE_MAX)
+        return 1;
+
+    map = mmap (NULL, (size_t)file_size, PROT_READ, MAP_PRIVATE, fd_src, 0);
+    if (map == MAP_FAILED)
+        return 1;
+#ifdef MADV_SEQUENTIAL
+    madvise (map, (size_t)file_size, MADV_SEQUENTIAL);
+#endif
+
+    memset (&chunk_descr, 0, sizeof(chunk_descr));
+
+    while (offset < file_size) {
+        remain = file_size - offset;
+        tail = (remain < block_max_sz) ? (int)remain : (int)block_max_sz;
+
+        /* Same rules as the read path: what's left after the last boundary
+         * becomes the final block.
+         */
+        cur = 0;
+        if (tail >= block_min_sz &&
+            cdc_scanner_scan (scanner, map + offset, &cur, tail))
+            chunk_descr.len = cur + 1;
+        else
+            chunk_descr.len = tail;
+
+        chunk_descr.offset = offset;
+        chunk_descr.block_buf = map + offset;
+        if (emit_chunk (file_descr, *pipeline, &chunk_descr,
+                        crypt, write_data, FALSE) < 0) {
+            ret = -1;
+            break;
+        }
+        offset += chunk_descr.len;
+    }
+
+    file_descr->file_size += offset;
+
+    if (*pipeline) {
+        if (cdc_pipeline_finish (*pipeline) < 0)
+            ret = -1;
+        *pipeline = NULL;
+    }
+
+    munmap (map, (size_t)file_size);
+
+    return ret;
+}
+#endif
+
+/*
+ * Chunking against the chunk map of the previous version.
+ *
+ * Whether a block ends where it does only depends on its own data, since
+ * the scanner starts over at every boundary. So at a boundary of the new
+ * version, a block of the previous version with the same data would be
+ * found again by chunking. Blocks are looked for where they were, for
+ * changes that don't move data, and moved by the change in file size, for
+ * data after an insert or a delete. Past a change, chunking goes on until
+ * a boundary falls on one of those places again.
+ */
+
+static gboolean
+prev_map_usable (const CDCChunkMap *prev, CDCFileDescriptor *file_descr,
+                 CDCScanner *scanner)
+{
+    return (prev->n_blocks > 0 &&
+            prev->algorithm == scanner->algorithm &&
+            prev->block_min_sz == file_descr->block_min_sz &&
+            prev->block_max_sz == file_descr->block_max_sz &&
+            prev->block_sz == file_descr->block_sz);
+}
+
+/* The block of @prev starting at @old_offset. *@idx only moves forward, as
+ * the offsets looked up do.
+ */
+static const CDCBlockInfo *
+prev_block_at (const CDCChunkMap *prev, uint32_t *idx, uint64_t old_offset)
+{
+    while (*idx < prev->n_blocks && prev->blocks[*idx].offset < old_offset)
+        ++(*idx);
+    if (*idx < prev->n_blocks && prev->blocks[*idx].offset == old_offset)
+        return &prev->blocks[*idx];
+    return NULL;
+}
+
+/* @buf holds the @tail bytes of the new version at @offset. */
+static gboolean
+prev_block_unchanged (const CDCChunkMap *prev, const CDCBlockInfo *block,
+                      uint64_t offset, uint64_t file_size,
+                      const char *buf, int tail)
+{
+    uint8_t fp[CDC_FP_LEN];
+
+    if (block->len > (uint32_t)tail)
+        return FALSE;
+
+    /* The last block ended at the end of the file, not at a boundary. */
+    if (block == &prev->blocks[prev->n_blocks - 1] &&
+        offset + block->len != file_size)
+        return FALSE;
+
+    block_fingerprint (buf, block->len, fp);
+    return (memcmp (fp, block->fp, CDC_FP_LEN) == 0);
+}
+
+static int
+chunk_with_prev_map (int fd_src,
+                     uint64_t file_size,
+                     CDCFileDescriptor *file_descr,
+                     CDCScanner *scanner,
+                     CDCPipeline *pipeline,
+                     SeafileCrypt *crypt,
+                     gboolean write_data)
+{
+    const CDCChunkMap *prev = file_descr->prev_map;
+    int64_t delta = (int64_t)file_size - (int64_t)prev->file_size;
+    uint32_t block_min_sz = file_descr->block_min_sz;
+    uint32_t block_max_sz = file_descr->block_max_sz;
+    uint32_t i_same = 0, i_moved = 0;
+    const CDCBlockInfo *block;
+    CDCDescriptor chunk_descr;
+    uint64_t offset = 0, remain;
+    char *buf;
+    int tail = 0, want, cur, len, n;
+    int ret = 0;
+
+    buf = malloc (block_max_sz);
+    if (!buf)
+        return -1;
+
+    memset (&chunk_descr, 0, sizeof(chunk_descr));
+    chunk_descr.block_buf = buf;
+
+    /* buf holds the data at offset, tail bytes of it. */
+    while (offset < file_size) {
+        remain = file_size - offset;
+        want = (remain < block_max_sz) ? (int)remain : (int)block_max_sz;
+        if (tail < want) {
+            n = readn (fd_src, buf + tail, want - tail);
+            if (n < 0) {
+                g_warning ("CDC: failed to read: %s.\n", strerror(errno));
+                ret = -1;
+                break;
+            }
+            tail += n;
+            if (tail < want) {
+                g_warning ("File size changed while chunking.\n");
+                ret = -1;
+                break;
+            }
+        }
+
+        block = prev_block_at (prev, &i_same, offset);
+        if (block && !prev_block_unchanged (prev, block, offset, file_size,
+                                            buf, tail))
+            block = NULL;
+        if (!block && delta != 0 && (int64_t)offset >= delta) {
+            block = prev_block_at (prev, &i_moved,
+                                   (uint64_t)((int64_t)offset - delta));
+            if (block && !prev_block_unchanged (prev, block, offset, file_size,
+                                                buf, tail))
+                block = NULL;
+        }
+
+        if (block) {
+            if (file_descr->block_nr == file_descr->max_block_nr) {
+                g_warning ("Block id array is not large enough, bail out.\n");
+                ret = -1;
+                break;
+            }
+            chunk_descr.offset = offset;
+            chunk_descr.len = block->len;
+            memcpy (chunk_descr.checksum, block->id, CHECKSUM_LENGTH);
+            record_block (file_descr, file_descr->block_nr, &chunk_descr,
+                          block->fp);
+            file_descr->block_nr++;
+            len = block->len;
+        } else {
+            /* Same rules as the other paths: what's left after the last
+             * boundary becomes the final block.
+             */
+            cur = 0;
+            if (tail >= block_min_sz &&
+                cdc_scanner_scan (scanner, buf, &cur, tail))
+                len = cur + 1;
+            else
+                len = tail;
+
+            chunk_descr.offset = offset;
+            chunk_descr.len = len;
+            if (emit_chunk (file_descr, pipeline, &chunk_descr,
+                            crypt, write_data, TRUE) < 0) {
+                ret = -1;
+                break;
+            }
+        }
+
+        offset += len;
+        memmove (buf, buf + len, tail - len);
+        tail -= len;
+    }
+
+    file_descr->file_size += offset;
+
+    free (buf);
+    return ret;
+}
+
 /* content-defined chunking */
 int file_chunk_cdc(int fd_src,
                    CDCFileDescriptor *file_descr,
@@ -105,9 +835,9 @@ int file_chunk_cdc(int fd_src,
 {
     char *buf;
     uint32_t buf_sz;
-    SHA_CTX file_ctx;
     CDCDescriptor chunk_descr;
-    SHA1_Init (&file_ctx);
+    CDCScanner scanner;
+    CDCPipeline *pipeline = NULL;
 
     SeafStat sb;
     if (seaf_fstat (fd_src, &sb) < 0) {
@@ -118,17 +848,55 @@ int file_chunk_cdc(int fd_src,
 
     init_cdc_file_descriptor (fd_src, expected_size, file_descr);
     uint32_t block_min_sz = file_descr->block_min_sz;
-    uint32_t block_mask = file_descr->block_sz - 1;
+    cdc_scanner_init (&scanner, file_descr);
 
-    int fingerprint = 0;
-    int offset = 0;
+    uint64_t offset = 0;
     int ret = 0;
     int tail, cur, rsize;
 
+    /* Not worth starting threads if the file fits in one chunk. */
+    if (file_descr->n_threads > 1 && expected_size > block_min_sz) {
+        pipeline = cdc_pipeline_new (file_descr, crypt, write_data);
+        if (!pipeline)
+            return -1;
+    }
+
+    if (file_descr->chunk_map) {
+        CDCChunkMap *map = file_descr->chunk_map;
+
+        g_free (map->blocks);
+        map->blocks = g_new0 (CDCBlockInfo, file_descr->max_block_nr);
+        map->n_blocks = 0;
+        map->algorithm = scanner.algorithm;
+        map->block_min_sz = file_descr->block_min_sz;
+        map->block_max_sz = file_descr->block_max_sz;
+        map->block_sz = file_descr->block_sz;
+    }
+
+    buf = NULL;
+    if (file_descr->prev_map &&
+        prev_map_usable (file_descr->prev_map, file_descr, &scanner)) {
+        ret = chunk_with_prev_map (fd_src, expected_size, file_descr,
+                                   &scanner, pipeline, crypt, write_data);
+        goto out;
+    }
+
+#ifndef WIN32
+    if (file_descr->use_mmap) {
+        ret = chunk_mapped_file (fd_src, expected_size, file_descr,
+                                 &scanner, &pipeline, crypt, write_data);
+        if (ret <= 0)
+            goto out;
+        ret = 0;
+    }
+#endif
+
     buf_sz = file_descr->block_max_sz;
     buf = chunk_descr.block_buf = malloc (buf_sz);
-    if (!buf)
-        return -1;
+    if (!buf) {
+        ret = -1;
+        goto out;
+    }
 
     /* buf: a fix-sized buffer.
      * cur: data behind (inclusive) this offset has been scanned.
@@ -145,16 +913,16 @@ int file_chunk_cdc(int fd_src,
         ret = readn (fd_src, buf + tail, rsize);
         if (ret < 0) {
             g_warning ("CDC: failed to read: %s.\n", strerror(errno));
-            free (buf);
-            return -1;
+            ret = -1;
+            goto out;
         }
         tail += ret;
         file_descr->file_size += ret;
 
         if (file_descr->file_size > expected_size) {
             g_warning ("File size changed while chunking.\n");
-            free (buf);
-            return -1;
+            ret = -1;
+            goto out;
         }
 
         /* We've read all the data in this file. Output the block immediately
@@ -163,52 +931,39 @@ int file_chunk_cdc(int fd_src,
          * 2. We cannot find the break value until the end of this file.
          */
         if (tail < block_min_sz || cur >= tail) {
-            if (tail > 0) {
-                if (file_descr->block_nr == file_descr->max_block_nr) {
-                    g_warning ("Block id array is not large enough, bail out.\n");
-                    free (buf);
-                    return -1;
-                }
+            if (tail > 0)
                 WRITE_CDC_BLOCK (tail, write_data);
-            }
             break;
         }
 
-        /* 
-         * A block is at least of size block_min_sz.
-         */
-        if (cur < block_min_sz - 1)
-            cur = block_min_sz - 1;
-
-        while (cur < tail) {
-            fingerprint = (cur == block_min_sz - 1) ?
-                finger(buf + cur - BLOCK_WIN_SZ + 1, BLOCK_WIN_SZ) :
-                rolling_finger (fingerprint, BLOCK_WIN_SZ, 
-                                *(buf+cur-BLOCK_WIN_SZ), *(buf + cur));
-
-            /* get a chunk, write block info to chunk file */
-            if (((fingerprint & block_mask) ==  ((BREAK_VALUE & block_mask)))
-                || cur + 1 >= file_descr->block_max_sz)
-            {
-                if (file_descr->block_nr == file_descr->max_block_nr) {
-                    g_warning ("Block id array is not large enough, bail out.\n");
-                    free (buf);
-                    return -1;
-                }
-
-                WRITE_CDC_BLOCK (cur + 1, write_data);
-                break;
-            } else {
-                cur ++;
-            }
-        }
+        /* get a chunk, write block info to chunk file */
+        if (cdc_scanner_scan (&scanner, buf, &cur, tail))
+            WRITE_CDC_BLOCK (cur + 1, write_data);
+    }
+
+    ret = 0;
+
+out:
+    if (pipeline && cdc_pipeline_finish (pipeline) < 0) {
+        g_warning ("CDC: failed to write chunk.\n");
+        ret = -1;
     }
 
-    SHA1_Final (file_descr->file_sum, &file_ctx);
+    if (ret == 0) {
+        /* The file checksum is the SHA1 of all block checksums in order. */
+        seaf_sha1 (file_descr->blk_sha1s,
+                   file_descr->block_nr * CHECKSUM_LENGTH,
+                   file_descr->file_sum);
+
+        if (file_descr->chunk_map) {
+            file_descr->chunk_map->n_blocks = file_descr->block_nr;
+            file_descr->chunk_map->file_size = file_descr->file_size;
+        }
+    }
 
     free (buf);
 
-    return 0;
+    return ret;
 }
 
 int filename_chunk_cdc(const char *filename,
@@ -227,7 +982,202 @@ int filename_chunk_cdc(const char *filename,
     return ret;
 }
 
+/*
+ * Streaming interface.
+ *
+ * Data is appended to a block_max_sz buffer and scanned as it arrives, with
+ * the same rules as file_chunk_cdc(), so a stream produces the same blocks
+ * as chunking the same bytes from a file.
+ */
+
+struct _CDCStream {
+    CDCFileDescriptor *file_descr;
+    SeafileCrypt *crypt;
+    gboolean write_data;
+
+    CDCScanner scanner;
+    CDCPipeline *pipeline;
+
+    char *buf;
+    uint32_t buf_sz;
+    int tail;
+    int cur;
+    uint64_t offset;
+
+    gboolean failed;
+};
+
+/* Make room for one more block id. The total size isn't known up front,
+ * so the block list grows as needed. Workers write into the list, so the
+ * pipeline is drained before it is moved.
+ */
+static int
+stream_reserve_block (CDCStream *stream)
+{
+    CDCFileDescriptor *file_descr = stream->file_descr;
+    uint8_t *blk_sha1s;
+    int max_block_nr;
+
+    if (file_descr->block_nr < file_descr->max_block_nr)
+        return 0;
+
+    if (stream->pipeline && cdc_pipeline_wait (stream->pipeline) < 0)
+        return -1;
+
+    max_block_nr = file_descr->max_block_nr ? file_descr->max_block_nr * 2 : 16;
+    blk_sha1s = realloc (file_descr->blk_sha1s,
+                         (size_t)max_block_nr * CHECKSUM_LENGTH);
+    if (!blk_sha1s) {
+        g_warning ("CDC: out of memory.\n");
+        return -1;
+    }
+    file_descr->blk_sha1s = blk_sha1s;
+    file_descr->max_block_nr = max_block_nr;
+
+    return 0;
+}
+
+static int
+stream_emit (CDCStream *stream, int len)
+{
+    CDCDescriptor chunk_descr;
+
+    if (stream_reserve_block (stream) < 0)
+        return -1;
+
+    memset (&chunk_descr, 0, sizeof(chunk_descr));
+    chunk_descr.offset = stream->offset;
+    chunk_descr.len = len;
+    chunk_descr.block_buf = stream->buf;
+    if (emit_chunk (stream->file_descr, stream->pipeline, &chunk_descr,
+                    stream->crypt, stream->write_data, TRUE) < 0)
+        return -1;
+
+    stream->offset += len;
+    memmove (stream->buf, stream->buf + len, stream->tail - len);
+    stream->tail -= len;
+    stream->cur = 0;
+
+    return 0;
+}
+
+CDCStream *
+cdc_stream_new (CDCFileDescriptor *file_descr,
+                uint64_t size_hint,
+                SeafileCrypt *crypt,
+                gboolean write_data)
+{
+    CDCStream *stream;
+
+    init_cdc_file_descriptor (-1, size_hint, file_descr);
+    file_descr->file_size = 0;
+
+    stream = g_new0 (CDCStream, 1);
+    stream->file_descr = file_descr;
+    stream->crypt = crypt;
+    stream->write_data = write_data;
+    cdc_scanner_init (&stream->scanner, file_descr);
+
+    stream->buf_sz = file_descr->block_max_sz;
+    stream->buf = malloc (stream->buf_sz);
+    if (!stream->buf) {
+        g_warning ("CDC: out of memory.\n");
+        goto error;
+    }
+
+    if (file_descr->n_threads > 1) {
+        stream->pipeline = cdc_pipeline_new (file_descr, crypt, write_data);
+        if (!stream->pipeline)
+            goto error;
+    }
+
+    return stream;
+
+error:
+    free (stream->buf);
+    g_free (stream);
+    return NULL;
+}
+
+int
+cdc_stream_feed (CDCStream *stream, const void *data, size_t len)
+{
+    const char *ptr = data;
+    int n;
+
+    if (stream->failed)
+        return -1;
+
+    while (len > 0) {
+        n = stream->buf_sz - stream->tail;
+        if (len < (size_t)n)
+            n = (int)len;
+        memcpy (stream->buf + stream->tail, ptr, n);
+        stream->tail += n;
+        stream->file_descr->file_size += n;
+        ptr += n;
+        len -= n;
+
+        /* A full buffer always contains a boundary, since no block is
+         * larger than block_max_sz.
+         */
+        while (cdc_scanner_scan (&stream->scanner, stream->buf,
+                                 &stream->cur, stream->tail)) {
+            if (stream_emit (stream, stream->cur + 1) < 0) {
+                stream->failed = TRUE;
+                return -1;
+            }
+        }
+    }
+
+    return 0;
+}
+
+int
+cdc_stream_finish (CDCStream *stream)
+{
+    CDCFileDescriptor *file_descr = stream->file_descr;
+    int ret = 0;
+
+    if (stream->failed)
+        return -1;
+
+    /* No boundary in what's left, it becomes the last block. */
+    if (stream->tail > 0 && stream_emit (stream, stream->tail) < 0)
+        ret = -1;
+
+    if (stream->pipeline) {
+        if (cdc_pipeline_finish (stream->pipeline) < 0) {
+            g_warning ("CDC: failed to write chunk.\n");
+            ret = -1;
+        }
+        stream->pipeline = NULL;
+    }
+
+    if (ret == 0)
+        seaf_sha1 (file_descr->blk_sha1s,
+                   file_descr->block_nr * CHECKSUM_LENGTH,
+                   file_descr->file_sum);
+    else
+        stream->failed = TRUE;
+
+    return ret;
+}
+
+void
+cdc_stream_free (CDCStream *stream)
+{
+    if (!stream)
+        return;
+
+    if (stream->pipeline)
+        cdc_pipeline_finish (stream->pipeline);
+    free (stream->buf);
+    g_free (stream);
+}
+
 void cdc_init ()
 {
     rabin_init (BLOCK_WIN_SZ);
+    gear_init ();
 }
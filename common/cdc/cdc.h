@@ -15,6 +15,21 @@
 
 #define BREAK_VALUE     0x0013    ///0x0513
 
+/* Chunking algorithms. The algorithm decides where block boundaries fall,
+ * so every file in a repo must be chunked with the same one, otherwise
+ * blocks of unchanged regions are no longer shared between file versions.
+ */
+typedef enum {
+    CDC_ALGO_AUTO = 0,          /* derived from the repo version */
+    CDC_ALGO_RABIN,
+    CDC_ALGO_FASTCDC,
+} CDCAlgorithm;
+
+/* Repos of this version or later are chunked with FastCDC (gear hash
+ * with normalized chunking). Older repos keep the Rabin scanner.
+ */
+#define CDC_FASTCDC_REPO_VERSION 2
+
 
 #ifdef HAVE_MD5
 #include "md5.h"
@@ -30,6 +45,36 @@
 #define O_BINARY 0
 #endif
 
+/*
+ * Where each block of a chunked file lies, with a fingerprint of its data.
+ * The fingerprint is a fast 128-bit hash, not a cryptographic one. It is
+ * only compared against data at the same place in a later version of the
+ * same local file, to tell whether a block can be reused as it is.
+ */
+#define CDC_FP_LEN 16
+
+typedef struct CDCBlockInfo {
+    uint64_t offset;
+    uint32_t len;
+    uint8_t fp[CDC_FP_LEN];
+    uint8_t id[CHECKSUM_LENGTH];
+} CDCBlockInfo;
+
+typedef struct CDCChunkMap {
+    /* The chunking parameters, blocks can only be reused with the same. */
+    int algorithm;              /* never CDC_ALGO_AUTO */
+    uint32_t block_min_sz;
+    uint32_t block_max_sz;
+    uint32_t block_sz;
+
+    uint64_t file_size;
+    uint32_t n_blocks;
+    CDCBlockInfo *blocks;
+} CDCChunkMap;
+
+void
+cdc_chunk_map_free (CDCChunkMap *map);
+
 struct _CDCFileDescriptor;
 struct _CDCDescriptor;
 struct SeafileCrypt;
@@ -57,6 +102,38 @@ typedef struct _CDCFileDescriptor {
 
     char repo_id[37];
     int version;
+
+    /* One of CDCAlgorithm. Leave it as CDC_ALGO_AUTO to chunk the file
+     * the way other files of a @version repo are chunked.
+     */
+    int algorithm;
+
+    /* Number of threads running write_block on chunks. With more than one,
+     * write_block is called concurrently and must be thread-safe.
+     * 0 or 1 processes chunks one by one in the calling thread.
+     */
+    int n_threads;
+
+    /* Scan a read-only mapping of the file and pass chunks to write_block
+     * as slices of it, instead of reading into a chunk buffer. write_block
+     * must not modify block_buf then. Only use it for files nobody else
+     * truncates while they are chunked. Ignored where mmap is unavailable.
+     */
+    gboolean use_mmap;
+
+    /* If set, file_chunk_cdc() records where each block is in it.
+     * Its block list is allocated by file_chunk_cdc().
+     */
+    CDCChunkMap *chunk_map;
+
+    /* The chunk map of the previous version of the file. Blocks of it
+     * whose data is found unchanged at a block boundary, where it was or
+     * moved by the change in file size, are reused as they are: they are
+     * not scanned, hashed, encrypted or written again. The rest is chunked
+     * as usual, so the result is the same as chunking the whole file.
+     * use_mmap is ignored then.
+     */
+    const CDCChunkMap *prev_map;
 } CDCFileDescriptor;
 
 typedef struct _CDCDescriptor {
@@ -76,6 +153,40 @@ int filename_chunk_cdc(const char *filename,
                        struct SeafileCrypt *crypt,
                        gboolean write_data);
 
+/*
+ * Push-style chunking, for data that arrives in pieces, e.g. from the
+ * network, and never exists as a complete file.
+ *
+ * cdc_stream_new() sets up @file_descr like file_chunk_cdc() does.
+ * @size_hint is the expected total size, used to size the block list;
+ * pass 0 if unknown, the list grows as needed.
+ * Feed data with cdc_stream_feed(), in pieces of any size. Blocks are
+ * passed to write_block as soon as their end is found.
+ * cdc_stream_finish() writes the last block and computes file_sum. The
+ * result is the same as chunking all fed data with file_chunk_cdc().
+ * Always release the stream with cdc_stream_free(), after finishing it
+ * or to abandon it. Freeing doesn't free @file_descr->blk_sha1s.
+ */
+typedef struct _CDCStream CDCStream;
+
+CDCStream *
+cdc_stream_new (CDCFileDescriptor *file_descr,
+                uint64_t size_hint,
+                struct SeafileCrypt *crypt,
+                gboolean write_data);
+
+int
+cdc_stream_feed (CDCStream *stream, const void *data, size_t len);
+
+int
+cdc_stream_finish (CDCStream *stream);
+
+void
+cdc_stream_free (CDCStream *stream);
+
+int
+cdc_algorithm_from_repo_version (int version);
+
 void cdc_init ();
 
 #endif
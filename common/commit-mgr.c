@@ -6,17 +6,70 @@
 #include <openssl/sha.h>
 
 #include "utils.h"
+#include "json-scan.h"
 #include "db.h"
 #include "searpc-utils.h"
 
 #include "seafile-session.h"
 #include "commit-mgr.h"
 #include "seaf-utils.h"
+#include "obj-cache.h"
+
+#include <pthread.h>
 
 #define MAX_TIME_SKEW 259200    /* 3 days */
 
+/* Memory for loaded commits, in MB. */
+#ifdef SEAFILE_SERVER
+#define DEFAULT_COMMIT_CACHE_SIZE 16
+#else
+#define DEFAULT_COMMIT_CACHE_SIZE 4
+#endif
+
+/* Max number of commits kept in the commit graph. */
+#ifdef SEAFILE_SERVER
+#define DEFAULT_COMMIT_GRAPH_SIZE 200000
+#else
+#define DEFAULT_COMMIT_GRAPH_SIZE 50000
+#endif
+
+/*
+ * The commit graph keeps the parents, ctime and generation number of
+ * each commit seen by ancestry queries, so that they don't parse the
+ * commit objects again. The generation of a commit is one more than the
+ * largest generation of its parents, hence a commit can't be an ancestor
+ * of another one whose generation is not larger.
+ *
+ * A node is only added after all of its parents, so every ancestor of a
+ * node in the graph is in the graph too.
+ */
+typedef struct CommitNode {
+    char commit_id[41];
+    struct CommitNode *parents[2];
+    gint64 ctime;
+    guint32 generation;
+    /* This commit or one of its ancestors has a missing parent. */
+    gboolean truncated;
+} CommitNode;
+
+typedef struct CommitGraph {
+    GHashTable *nodes;          /* commit id -> CommitNode */
+    GHashTable *missing;        /* ids of missing parents */
+} CommitGraph;
+
 struct _SeafCommitManagerPriv {
-    int dummy;
+    /* Commits loaded from the store, keyed by (repo_id, commit_id).
+     * Shared by reference, callers must not modify them.
+     */
+    ObjCache *commit_cache;
+
+    /* repo id -> CommitGraph. Queries on the graphs run with
+     * graph_lock held and never do I/O.
+     */
+    GHashTable *graphs;
+    int n_graph_nodes;
+    int max_graph_nodes;
+    pthread_mutex_t graph_lock;
 };
 
 static SeafCommit *
@@ -35,6 +88,8 @@ static json_t *
 commit_to_json_object (SeafCommit *commit);
 static SeafCommit *
 commit_from_json_object (const char *id, json_t *object);
+static SeafCommit *
+commit_from_json_scan (const char *id, const char *data, gsize len);
 
 static void compute_commit_id (SeafCommit* commit)
 {
@@ -128,6 +183,10 @@ seaf_commit_from_data (const char *id, char *data, gsize len)
     SeafCommit *commit;
     json_error_t jerror;
 
+    commit = commit_from_json_scan (id, data, len);
+    if (commit)
+        return commit;
+
     object = json_loadb (data, len, 0, &jerror);
     if (!object) {
         /* Perhaps the commit object contains invalid UTF-8 character. */
@@ -167,10 +226,11 @@ seaf_commit_free (SeafCommit *commit)
     g_free (commit);
 }
 
+/* Commits are shared by the cache and several threads. */
 void
 seaf_commit_ref (SeafCommit *commit)
 {
-    commit->ref++;
+    g_atomic_int_inc (&commit->ref);
 }
 
 void
@@ -179,10 +239,62 @@ seaf_commit_unref (SeafCommit *commit)
     if (!commit)
         return;
 
-    if (--commit->ref <= 0)
+    if (g_atomic_int_dec_and_test (&commit->ref))
         seaf_commit_free (commit);
 }
 
+static gpointer
+commit_cache_ref (gpointer data)
+{
+    seaf_commit_ref (data);
+    return data;
+}
+
+static guint64
+commit_mem_size (SeafCommit *commit)
+{
+    guint64 size = sizeof(SeafCommit) + 256;
+
+    if (commit->desc)
+        size += strlen (commit->desc);
+    if (commit->repo_desc)
+        size += strlen (commit->repo_desc);
+
+    return size;
+}
+
+static void
+commit_graph_free (CommitGraph *graph)
+{
+    g_hash_table_destroy (graph->nodes);
+    g_hash_table_destroy (graph->missing);
+    g_free (graph);
+}
+
+static void
+drop_graph_locked (SeafCommitManager *mgr, const char *repo_id)
+{
+    CommitGraph *graph = g_hash_table_lookup (mgr->priv->graphs, repo_id);
+
+    if (!graph)
+        return;
+
+    mgr->priv->n_graph_nodes -= g_hash_table_size (graph->nodes);
+    g_hash_table_remove (mgr->priv->graphs, repo_id);
+}
+
+static CommitNode *
+lookup_node_locked (SeafCommitManager *mgr,
+                    const char *repo_id,
+                    const char *commit_id)
+{
+    CommitGraph *graph = g_hash_table_lookup (mgr->priv->graphs, repo_id);
+
+    if (!graph)
+        return NULL;
+    return g_hash_table_lookup (graph->nodes, commit_id);
+}
+
 SeafCommitManager*
 seaf_commit_manager_new (SeafileSession *seaf)
 {
@@ -192,12 +304,81 @@ seaf_commit_manager_new (SeafileSession *seaf)
     mgr->seaf = seaf;
     mgr->obj_store = seaf_obj_store_new (mgr->seaf, "commits");
 
+    mgr->priv->graphs = g_hash_table_new_full (g_str_hash, g_str_equal,
+                                               g_free,
+                                               (GDestroyNotify)commit_graph_free);
+    pthread_mutex_init (&mgr->priv->graph_lock, NULL);
+
     return mgr;
 }
 
+static void
+init_commit_cache (SeafCommitManager *mgr)
+{
+    int size_mb = DEFAULT_COMMIT_CACHE_SIZE;
+
+#ifdef SEAFILE_SERVER
+    GError *error = NULL;
+
+    /* [fileserver]
+     * commit_cache_size = 16   # MB, 0 to disable
+     */
+    size_mb = g_key_file_get_integer (seaf->config,
+                                      "fileserver", "commit_cache_size",
+                                      &error);
+    if (error) {
+        size_mb = DEFAULT_COMMIT_CACHE_SIZE;
+        g_clear_error (&error);
+    }
+#endif
+
+    if (size_mb <= 0)
+        return;
+
+    mgr->priv->commit_cache = obj_cache_new ((guint64)size_mb * 1024 * 1024,
+                                             commit_cache_ref,
+                                             (GDestroyNotify)seaf_commit_unref);
+    mem_stats_register ("commit_cache", obj_cache_get_mem_stats,
+                        mgr->priv->commit_cache);
+}
+
+static void
+init_commit_graph (SeafCommitManager *mgr)
+{
+    int size = DEFAULT_COMMIT_GRAPH_SIZE;
+
+#ifdef SEAFILE_SERVER
+    GError *error = NULL;
+
+    /* [fileserver]
+     * commit_graph_size = 200000   # commits, 0 to disable
+     */
+    size = g_key_file_get_integer (seaf->config,
+                                   "fileserver", "commit_graph_size",
+                                   &error);
+    if (error) {
+        size = DEFAULT_COMMIT_GRAPH_SIZE;
+        g_clear_error (&error);
+    }
+#endif
+
+    mgr->priv->max_graph_nodes = (size > 0) ? size : 0;
+}
+
+GPtrArray *
+seaf_commit_manager_get_hot_keys (SeafCommitManager *mgr, guint max_keys)
+{
+    if (!mgr->priv->commit_cache)
+        return NULL;
+    return obj_cache_get_hot_keys (mgr->priv->commit_cache, max_keys);
+}
+
 int
 seaf_commit_manager_init (SeafCommitManager *mgr)
 {
+    init_commit_cache (mgr);
+    init_commit_graph (mgr);
+
 #ifdef SEAFILE_SERVER
 
 #ifdef FULL_FEATURE
@@ -222,31 +403,12 @@ seaf_commit_manager_init (SeafCommitManager *mgr)
     return 0;
 }
 
-#if 0
-inline static void
-add_commit_to_cache (SeafCommitManager *mgr, SeafCommit *commit)
-{
-    g_hash_table_insert (mgr->priv->commit_cache,
-                         g_strdup(commit->commit_id),
-                         commit);
-    seaf_commit_ref (commit);
-}
-
-inline static void
-remove_commit_from_cache (SeafCommitManager *mgr, SeafCommit *commit)
-{
-    g_hash_table_remove (mgr->priv->commit_cache, commit->commit_id);
-    seaf_commit_unref (commit);
-}
-#endif
-
 int
 seaf_commit_manager_add_commit (SeafCommitManager *mgr,
                                 SeafCommit *commit)
 {
     int ret;
 
-    /* add_commit_to_cache (mgr, commit); */
     if ((ret = save_commit (mgr, commit->repo_id, commit->version, commit)) < 0)
         return -1;
     
@@ -261,20 +423,13 @@ seaf_commit_manager_del_commit (SeafCommitManager *mgr,
 {
     g_return_if_fail (id != NULL);
 
-#if 0
-    commit = g_hash_table_lookup(mgr->priv->commit_cache, id);
-    if (!commit)
-        goto delete;
+    if (mgr->priv->commit_cache)
+        obj_cache_remove (mgr->priv->commit_cache, repo_id, id);
 
-    /*
-     * Catch ref count bug here. We have bug in commit ref, the
-     * following assert can't pass. TODO: fix the commit ref bug
-     */
-    /* g_assert (commit->ref <= 1); */
-    remove_commit_from_cache (mgr, commit);
-
-delete:
-#endif
+    /* Deleted commits must not be found by ancestry queries any more. */
+    pthread_mutex_lock (&mgr->priv->graph_lock);
+    drop_graph_locked (mgr, repo_id);
+    pthread_mutex_unlock (&mgr->priv->graph_lock);
 
     delete_commit (mgr, repo_id, version, id);
 }
@@ -287,19 +442,19 @@ seaf_commit_manager_get_commit (SeafCommitManager *mgr,
 {
     SeafCommit *commit;
 
-#if 0
-    commit = g_hash_table_lookup (mgr->priv->commit_cache, id);
-    if (commit != NULL) {
-        seaf_commit_ref (commit);
-        return commit;
+    if (mgr->priv->commit_cache) {
+        commit = obj_cache_lookup (mgr->priv->commit_cache, repo_id, id);
+        if (commit)
+            return commit;
     }
-#endif
 
     commit = load_commit (mgr, repo_id, version, id);
     if (!commit)
         return NULL;
 
-    /* add_commit_to_cache (mgr, commit); */
+    if (mgr->priv->commit_cache)
+        obj_cache_insert (mgr->priv->commit_cache, repo_id, id, commit,
+                          commit_mem_size (commit));
 
     return commit;
 }
@@ -469,6 +624,7 @@ traverse_commit_tree_common (SeafCommitManager *mgr,
     SeafCommit *commit;
     GList *list = NULL;
     GHashTable *commit_hash;
+    gint64 valid_since = -1;
     gboolean ret = TRUE;
 
     commit = seaf_commit_manager_get_commit (mgr, repo_id, version, head);
@@ -479,6 +635,15 @@ traverse_commit_tree_common (SeafCommitManager *mgr,
         return FALSE;
     }
 
+#if defined( SEAFILE_SERVER ) && defined( FULL_FEATURE )
+    /* History older than valid-since may already be collected, or only
+     * wait for GC to be. It's kept up to date by the history pruner.
+     */
+    if (allow_truncate)
+        valid_since = seaf_repo_manager_get_repo_valid_since (seaf->repo_mgr,
+                                                              repo_id);
+#endif
+
     /* A hash table for recording id of traversed commits. */
     commit_hash = g_hash_table_new_full (g_str_hash, g_str_equal, g_free, NULL);
 
@@ -512,6 +677,15 @@ traverse_commit_tree_common (SeafCommitManager *mgr,
             continue;
         }
 
+        /* Like GC, keep the first commit older than valid-since, but
+         * none of its parents.
+         */
+        if (valid_since > 0 && (gint64)commit->ctime < valid_since &&
+            strcmp (commit->commit_id, head) != 0) {
+            seaf_commit_unref (commit);
+            continue;
+        }
+
         if (commit->parent_id) {
             if (insert_parent_commit (&list, commit_hash, repo_id, version,
                                       commit->parent_id, allow_truncate) < 0) {
@@ -582,15 +756,580 @@ seaf_commit_manager_commit_exists (SeafCommitManager *mgr,
                                    int version,
                                    const char *id)
 {
-#if 0
-    commit = g_hash_table_lookup (mgr->priv->commit_cache, id);
-    if (commit != NULL)
-        return TRUE;
-#endif
+    SeafCommit *commit;
+
+    if (mgr->priv->commit_cache) {
+        commit = obj_cache_lookup (mgr->priv->commit_cache, repo_id, id);
+        if (commit) {
+            seaf_commit_unref (commit);
+            return TRUE;
+        }
+    }
 
     return seaf_obj_store_obj_exists (mgr->obj_store, repo_id, version, id);
 }
 
+typedef struct PackCommitsData {
+    gint64 before;
+    GPtrArray *ids;
+} PackCommitsData;
+
+static gboolean
+collect_old_commit (SeafCommit *commit, void *vdata, gboolean *stop)
+{
+    PackCommitsData *data = vdata;
+
+    if ((gint64)commit->ctime < data->before)
+        g_ptr_array_add (data->ids, g_strdup (commit->commit_id));
+
+    return TRUE;
+}
+
+int
+seaf_commit_manager_pack_commits (SeafCommitManager *mgr,
+                                  const char *repo_id,
+                                  int version,
+                                  const char *head,
+                                  gint64 before)
+{
+    PackCommitsData data;
+    guint i;
+    int ret = 0;
+
+    data.before = before;
+    data.ids = g_ptr_array_new ();
+
+    if (!seaf_commit_manager_traverse_commit_tree_truncated (mgr, repo_id,
+                                                             version, head,
+                                                             collect_old_commit,
+                                                             &data, FALSE)) {
+        seaf_warning ("Failed to traverse commits of repo %.8s.\n", repo_id);
+        ret = -1;
+        goto out;
+    }
+
+    ret = seaf_obj_store_pack_objs (mgr->obj_store, repo_id, version,
+                                    (const char **)data.ids->pdata,
+                                    (int)data.ids->len);
+
+out:
+    for (i = 0; i < data.ids->len; ++i)
+        g_free (g_ptr_array_index (data.ids, i));
+    g_ptr_array_free (data.ids, TRUE);
+    return ret;
+}
+
+/* Commit graph */
+
+static gboolean
+node_in_graph (SeafCommitManager *mgr,
+               const char *repo_id,
+               const char *commit_id)
+{
+    CommitNode *node;
+
+    pthread_mutex_lock (&mgr->priv->graph_lock);
+    node = lookup_node_locked (mgr, repo_id, commit_id);
+    pthread_mutex_unlock (&mgr->priv->graph_lock);
+
+    return (node != NULL);
+}
+
+/*
+ * Add @commit, whose parents are either in the graph or listed
+ * in @missing, to the graph.
+ * Returns -1 if a parent has been dropped from the graph meanwhile.
+ */
+static int
+add_graph_node (SeafCommitManager *mgr,
+                SeafCommit *commit,
+                const gboolean *missing)
+{
+    SeafCommitManagerPriv *priv = mgr->priv;
+    const char *parent_ids[2] = { commit->parent_id, commit->second_parent_id };
+    CommitGraph *graph;
+    CommitNode *node, *parent;
+    int i, ret = 0;
+
+    pthread_mutex_lock (&priv->graph_lock);
+
+    if (priv->n_graph_nodes >= priv->max_graph_nodes) {
+        /* Start over rather than tracking the usage of each graph. */
+        g_hash_table_remove_all (priv->graphs);
+        priv->n_graph_nodes = 0;
+    }
+
+    graph = g_hash_table_lookup (priv->graphs, commit->repo_id);
+    if (!graph) {
+        graph = g_new0 (CommitGraph, 1);
+        graph->nodes = g_hash_table_new_full (g_str_hash, g_str_equal,
+                                              NULL, g_free);
+        graph->missing = g_hash_table_new_full (g_str_hash, g_str_equal,
+                                                g_free, NULL);
+        g_hash_table_insert (priv->graphs, g_strdup(commit->repo_id), graph);
+    }
+
+    if (g_hash_table_lookup (graph->nodes, commit->commit_id))
+        goto out;
+
+    node = g_new0 (CommitNode, 1);
+    memcpy (node->commit_id, commit->commit_id, 41);
+    node->ctime = commit->ctime;
+    node->generation = 1;
+
+    for (i = 0; i < 2; ++i) {
+        if (!parent_ids[i])
+            continue;
+
+        if (missing[i]) {
+            node->truncated = TRUE;
+            g_hash_table_replace (graph->missing, g_strdup(parent_ids[i]),
+                                  GINT_TO_POINTER(1));
+            continue;
+        }
+
+        parent = g_hash_table_lookup (graph->nodes, parent_ids[i]);
+        if (!parent) {
+            g_free (node);
+            ret = -1;
+            goto out;
+        }
+
+        node->parents[i] = parent;
+        if (parent->truncated)
+            node->truncated = TRUE;
+        if (parent->generation >= node->generation)
+            node->generation = parent->generation + 1;
+    }
+
+    g_hash_table_insert (graph->nodes, node->commit_id, node);
+    ++priv->n_graph_nodes;
+
+out:
+    pthread_mutex_unlock (&priv->graph_lock);
+    return ret;
+}
+
+/*
+ * If @commit_id is in the graph but some of its missing ancestors have
+ * been fetched since, the graph of the repo is no longer accurate.
+ */
+static void
+check_missing_commits (SeafCommitManager *mgr,
+                       const char *repo_id,
+                       int version,
+                       const char *commit_id)
+{
+    CommitGraph *graph;
+    CommitNode *node;
+    GList *ids = NULL, *ptr;
+    GHashTableIter iter;
+    gpointer key;
+    gboolean stale = FALSE;
+
+    pthread_mutex_lock (&mgr->priv->graph_lock);
+    graph = g_hash_table_lookup (mgr->priv->graphs, repo_id);
+    if (graph) {
+        node = g_hash_table_lookup (graph->nodes, commit_id);
+        if (node && node->truncated) {
+            g_hash_table_iter_init (&iter, graph->missing);
+            while (g_hash_table_iter_next (&iter, &key, NULL))
+                ids = g_list_prepend (ids, g_strdup(key));
+        }
+    }
+    pthread_mutex_unlock (&mgr->priv->graph_lock);
+
+    for (ptr = ids; ptr; ptr = ptr->next) {
+        if (seaf_commit_manager_commit_exists (mgr, repo_id, version,
+                                               ptr->data)) {
+            stale = TRUE;
+            break;
+        }
+    }
+    string_list_free (ids);
+
+    if (stale) {
+        pthread_mutex_lock (&mgr->priv->graph_lock);
+        drop_graph_locked (mgr, repo_id);
+        pthread_mutex_unlock (&mgr->priv->graph_lock);
+    }
+}
+
+/*
+ * Make sure @commit_id and all its ancestors are in the graph. Commits
+ * are added parents first, so each one is loaded at most twice, and the
+ * second time normally comes from the commit cache.
+ */
+static int
+ensure_graph_node (SeafCommitManager *mgr,
+                   const char *repo_id,
+                   int version,
+                   const char *commit_id)
+{
+    GQueue *stack;
+    char *id;
+    SeafCommit *commit;
+    const char *parent_ids[2];
+    gboolean missing[2];
+    gboolean pending;
+    int i, ret = 0;
+
+    if (mgr->priv->max_graph_nodes <= 0)
+        return -1;
+
+    check_missing_commits (mgr, repo_id, version, commit_id);
+
+    stack = g_queue_new ();
+    g_queue_push_head (stack, g_strdup(commit_id));
+
+    while ((id = g_queue_peek_head (stack)) != NULL) {
+        if (node_in_graph (mgr, repo_id, id)) {
+            g_free (g_queue_pop_head (stack));
+            continue;
+        }
+
+        commit = seaf_commit_manager_get_commit (mgr, repo_id, version, id);
+        if (!commit) {
+            seaf_warning ("Failed to find commit %s:%s.\n", repo_id, id);
+            ret = -1;
+            break;
+        }
+
+        parent_ids[0] = commit->parent_id;
+        parent_ids[1] = commit->second_parent_id;
+        pending = FALSE;
+        for (i = 0; i < 2; ++i) {
+            missing[i] = FALSE;
+            if (!parent_ids[i] || node_in_graph (mgr, repo_id, parent_ids[i]))
+                continue;
+            if (!seaf_commit_manager_commit_exists (mgr, repo_id, version,
+                                                    parent_ids[i])) {
+                missing[i] = TRUE;
+                continue;
+            }
+            g_queue_push_head (stack, g_strdup(parent_ids[i]));
+            pending = TRUE;
+        }
+
+        if (!pending) {
+            if (add_graph_node (mgr, commit, missing) < 0) {
+                seaf_commit_unref (commit);
+                ret = -1;
+                break;
+            }
+            g_free (g_queue_pop_head (stack));
+        }
+        seaf_commit_unref (commit);
+    }
+
+    while ((id = g_queue_pop_head (stack)) != NULL)
+        g_free (id);
+    g_queue_free (stack);
+    return ret;
+}
+
+int
+seaf_commit_manager_is_ancestor (SeafCommitManager *mgr,
+                                 const char *repo_id,
+                                 int version,
+                                 const char *ancestor,
+                                 const char *descendant,
+                                 const char **stop_ids,
+                                 int n_stops,
+                                 gboolean allow_truncate)
+{
+    CommitNode *anc, *node, *parent, **stops;
+    GHashTable *visited;
+    GQueue *queue;
+    int i, ret = 0;
+
+    if (ensure_graph_node (mgr, repo_id, version, descendant) < 0)
+        return -1;
+    if (ensure_graph_node (mgr, repo_id, version, ancestor) < 0) {
+        /* A missing ancestor can't be reached. */
+        if (allow_truncate &&
+            !seaf_commit_manager_commit_exists (mgr, repo_id, version, ancestor))
+            return 0;
+        return -1;
+    }
+
+    pthread_mutex_lock (&mgr->priv->graph_lock);
+
+    node = lookup_node_locked (mgr, repo_id, descendant);
+    anc = lookup_node_locked (mgr, repo_id, ancestor);
+    if (!node || !anc) {
+        /* Dropped from the graph in between. */
+        pthread_mutex_unlock (&mgr->priv->graph_lock);
+        return -1;
+    }
+
+    /* Generations below a missing commit are too low to prune by. */
+    if (node->truncated && !allow_truncate) {
+        pthread_mutex_unlock (&mgr->priv->graph_lock);
+        return -1;
+    }
+
+    stops = g_new0 (CommitNode *, n_stops + 1);
+    for (i = 0; i < n_stops; ++i)
+        stops[i] = lookup_node_locked (mgr, repo_id, stop_ids[i]);
+
+    visited = g_hash_table_new (g_direct_hash, g_direct_equal);
+    queue = g_queue_new ();
+    g_queue_push_tail (queue, node);
+    g_hash_table_insert (visited, node, node);
+
+    while ((node = g_queue_pop_head (queue)) != NULL) {
+        if (node == anc) {
+            ret = 1;
+            break;
+        }
+
+        for (i = 0; i < n_stops; ++i)
+            if (stops[i] == node)
+                break;
+        if (i < n_stops)
+            continue;
+
+        for (i = 0; i < 2; ++i) {
+            parent = node->parents[i];
+            if (!parent || g_hash_table_lookup (visited, parent))
+                continue;
+            /* @anc can't be an ancestor of an older generation. */
+            if (parent != anc && parent->generation <= anc->generation)
+                continue;
+            g_hash_table_insert (visited, parent, parent);
+            g_queue_push_tail (queue, parent);
+        }
+    }
+
+    pthread_mutex_unlock (&mgr->priv->graph_lock);
+
+    g_queue_free (queue);
+    g_hash_table_destroy (visited);
+    g_free (stops);
+    return ret;
+}
+
+/* A max-heap of nodes ordered by generation, then by ctime. */
+
+static gboolean
+node_before (CommitNode *a, CommitNode *b)
+{
+    if (a->generation != b->generation)
+        return a->generation > b->generation;
+    return a->ctime > b->ctime;
+}
+
+static void
+heap_push (GPtrArray *heap, CommitNode *node)
+{
+    guint i = heap->len, parent;
+
+    g_ptr_array_add (heap, node);
+    while (i > 0) {
+        parent = (i - 1) / 2;
+        if (!node_before (heap->pdata[i], heap->pdata[parent]))
+            break;
+        heap->pdata[i] = heap->pdata[parent];
+        heap->pdata[parent] = node;
+        i = parent;
+    }
+}
+
+static CommitNode *
+heap_pop (GPtrArray *heap)
+{
+    CommitNode *top, *tmp;
+    guint i = 0, child;
+
+    if (heap->len == 0)
+        return NULL;
+
+    top = heap->pdata[0];
+    heap->pdata[0] = heap->pdata[heap->len - 1];
+    g_ptr_array_remove_index (heap, heap->len - 1);
+
+    while ((child = 2 * i + 1) < heap->len) {
+        if (child + 1 < heap->len &&
+            node_before (heap->pdata[child + 1], heap->pdata[child]))
+            ++child;
+        if (!node_before (heap->pdata[child], heap->pdata[i]))
+            break;
+        tmp = heap->pdata[i];
+        heap->pdata[i] = heap->pdata[child];
+        heap->pdata[child] = tmp;
+        i = child;
+    }
+
+    return top;
+}
+
+#define PAINT_ONE    1
+#define PAINT_TWO    2
+#define PAINT_STALE  4
+#define PAINT_RESULT 8
+
+static gboolean
+heap_has_nonstale (GPtrArray *heap, GHashTable *flags)
+{
+    guint i;
+
+    for (i = 0; i < heap->len; ++i)
+        if (!(GPOINTER_TO_INT(g_hash_table_lookup (flags, heap->pdata[i])) &
+              PAINT_STALE))
+            return TRUE;
+    return FALSE;
+}
+
+static gint
+compare_node_by_time (gconstpointer a, gconstpointer b)
+{
+    const CommitNode *node_a = a;
+    const CommitNode *node_b = b;
+
+    /* Latest commit comes first in the list. */
+    if (node_a->ctime == node_b->ctime)
+        return 0;
+    return (node_a->ctime < node_b->ctime) ? 1 : -1;
+}
+
+/*
+ * Walk down from @one and @twos by generation, painting the commits
+ * reachable from each side. Commits reached from both sides are merge
+ * bases, and their ancestors are painted stale so that the walk stops
+ * as soon as only stale commits remain.
+ *
+ * Sets @results to the merge bases, latest first.
+ * Returns -1 if some commits on the way are missing.
+ */
+static int
+paint_down_to_common (CommitNode *one, int n, CommitNode **twos,
+                      GList **results)
+{
+    GHashTable *flags;
+    GPtrArray *heap;
+    CommitNode *node, *parent;
+    GList *result = NULL;
+    int f, pf, i;
+
+    *results = NULL;
+    for (i = 0; i < n; ++i) {
+        if (one == twos[i]) {
+            *results = g_list_append (NULL, one);
+            return 0;
+        }
+    }
+
+    /* Like the commit tree traversal, fail if some commits are missing. */
+    if (one->truncated)
+        return -1;
+    for (i = 0; i < n; ++i)
+        if (twos[i]->truncated)
+            return -1;
+
+    flags = g_hash_table_new (g_direct_hash, g_direct_equal);
+    heap = g_ptr_array_new ();
+
+    g_hash_table_insert (flags, one, GINT_TO_POINTER(PAINT_ONE));
+    heap_push (heap, one);
+    for (i = 0; i < n; ++i) {
+        f = GPOINTER_TO_INT(g_hash_table_lookup (flags, twos[i]));
+        g_hash_table_insert (flags, twos[i], GINT_TO_POINTER(f | PAINT_TWO));
+        heap_push (heap, twos[i]);
+    }
+
+    while (heap_has_nonstale (heap, flags)) {
+        node = heap_pop (heap);
+        f = GPOINTER_TO_INT(g_hash_table_lookup (flags, node));
+
+        pf = f & (PAINT_ONE | PAINT_TWO | PAINT_STALE);
+        if (pf == (PAINT_ONE | PAINT_TWO)) {
+            if (!(f & PAINT_RESULT)) {
+                g_hash_table_insert (flags, node,
+                                     GINT_TO_POINTER(f | PAINT_RESULT));
+                result = g_list_prepend (result, node);
+            }
+            pf |= PAINT_STALE;
+        }
+
+        for (i = 0; i < 2; ++i) {
+            parent = node->parents[i];
+            if (!parent)
+                continue;
+            f = GPOINTER_TO_INT(g_hash_table_lookup (flags, parent));
+            if ((f & pf) == pf)
+                continue;
+            g_hash_table_insert (flags, parent, GINT_TO_POINTER(f | pf));
+            heap_push (heap, parent);
+        }
+    }
+
+    /* Since descendants are always popped before their ancestors, a
+     * merge base below another one is painted stale before it's popped.
+     * So the results are independent of each other.
+     */
+    *results = g_list_sort (result, compare_node_by_time);
+
+    g_ptr_array_free (heap, TRUE);
+    g_hash_table_destroy (flags);
+    return 0;
+}
+
+int
+seaf_commit_manager_get_merge_base (SeafCommitManager *mgr,
+                                    const char *repo_id,
+                                    int version,
+                                    const char *head,
+                                    const char *remote,
+                                    char *ca_id)
+{
+    CommitNode *one, *two, **twos;
+    GList *result = NULL, *ptr;
+    int n, i, ret;
+
+    if (ensure_graph_node (mgr, repo_id, version, head) < 0 ||
+        ensure_graph_node (mgr, repo_id, version, remote) < 0)
+        return -1;
+
+    pthread_mutex_lock (&mgr->priv->graph_lock);
+
+    one = lookup_node_locked (mgr, repo_id, head);
+    two = lookup_node_locked (mgr, repo_id, remote);
+    if (!one || !two) {
+        pthread_mutex_unlock (&mgr->priv->graph_lock);
+        return -1;
+    }
+
+    ret = paint_down_to_common (one, 1, &two, &result);
+
+    /* More than one common ancestors.
+     * Loop until the oldest common ancestor is found.
+     */
+    while (ret == 0 && result && result->next) {
+        one = result->data;
+        n = g_list_length (result) - 1;
+        twos = g_new (CommitNode *, n);
+        for (ptr = result->next, i = 0; ptr; ptr = ptr->next, ++i)
+            twos[i] = ptr->data;
+        g_list_free (result);
+
+        ret = paint_down_to_common (one, n, twos, &result);
+        g_free (twos);
+    }
+
+    if (ret == 0) {
+        if (result)
+            memcpy (ca_id, ((CommitNode *)result->data)->commit_id, 41);
+        else
+            ca_id[0] = '\0';
+    }
+
+    pthread_mutex_unlock (&mgr->priv->graph_lock);
+
+    g_list_free (result);
+    return ret;
+}
+
 static json_t *
 commit_to_json_object (SeafCommit *commit)
 {
@@ -771,6 +1510,212 @@ commit_from_json_object (const char *commit_id, json_t *object)
     return commit;
 }
 
+enum {
+    SCAN_ROOT_ID = 0,
+    SCAN_REPO_ID,
+    SCAN_CREATOR_NAME,
+    SCAN_CREATOR,
+    SCAN_DESC,
+    SCAN_PARENT_ID,
+    SCAN_SECOND_PARENT_ID,
+    SCAN_REPO_NAME,
+    SCAN_REPO_DESC,
+    SCAN_REPO_CATEGORY,
+    SCAN_ENCRYPTED,
+    SCAN_MAGIC,
+    SCAN_KEY,
+    N_SCAN_STRS,
+};
+
+static const char *scan_str_keys[N_SCAN_STRS] = {
+    "root_id", "repo_id", "creator_name", "creator", "description",
+    "parent_id", "second_parent_id", "repo_name", "repo_desc",
+    "repo_category", "encrypted", "magic", "key",
+};
+
+enum {
+    SCAN_CTIME = 0,
+    SCAN_ENC_VERSION,
+    SCAN_NO_LOCAL_HISTORY,
+    SCAN_VERSION,
+    SCAN_NEW_MERGE,
+    SCAN_CONFLICT,
+    SCAN_REPAIRED,
+    N_SCAN_INTS,
+};
+
+static const char *scan_int_keys[N_SCAN_INTS] = {
+    "ctime", "enc_version", "no_local_history", "version",
+    "new_merge", "conflict", "repaired",
+};
+
+typedef struct ScannedCommit {
+    JsonScanStr strs[N_SCAN_STRS];
+    /* Null strings are not set, like missing ones. */
+    gboolean has_str[N_SCAN_STRS];
+    gint64 ints[N_SCAN_INTS];
+    gboolean has_int[N_SCAN_INTS];
+} ScannedCommit;
+
+static int
+scan_commit_member (JsonScan *scan, const JsonScanStr *key, ScannedCommit *sc)
+{
+    int i;
+
+    for (i = 0; i < N_SCAN_STRS; ++i) {
+        if (!json_scan_str_equal (key, scan_str_keys[i]))
+            continue;
+        sc->has_str[i] = FALSE;
+        if (json_scan_null (scan))
+            return 0;
+        if (json_scan_string (scan, &sc->strs[i]) < 0)
+            return -1;
+        sc->has_str[i] = TRUE;
+        return 0;
+    }
+
+    for (i = 0; i < N_SCAN_INTS; ++i) {
+        if (!json_scan_str_equal (key, scan_int_keys[i]))
+            continue;
+        sc->has_int[i] = TRUE;
+        return json_scan_int (scan, &sc->ints[i]);
+    }
+
+    return json_scan_skip (scan);
+}
+
+/* Copy an id straight into its fixed-size field. */
+static gboolean
+copy_scanned_id (const ScannedCommit *sc, int field, char *buf, int len)
+{
+    const JsonScanStr *str = &sc->strs[field];
+
+    if (!sc->has_str[field] || str->escaped || str->len != len)
+        return FALSE;
+    memcpy (buf, str->s, len);
+    buf[len] = '\0';
+    return TRUE;
+}
+
+/* Returns -1 if the string has a bad escape. */
+static int
+dup_scanned_str (const ScannedCommit *sc, int field, char **ret)
+{
+    *ret = NULL;
+    if (!sc->has_str[field])
+        return 0;
+    *ret = json_scan_str_dup (&sc->strs[field]);
+    return *ret ? 0 : -1;
+}
+
+/*
+ * Parse a commit object without building a jansson tree, straight
+ * into the commit struct. Returns NULL if the object is invalid, or
+ * uses anything the scanner doesn't handle, and leaves it to
+ * commit_from_json_object(), which also cleans up bad UTF-8 and reports
+ * the error.
+ */
+static SeafCommit *
+commit_from_json_scan (const char *commit_id, const char *data, gsize len)
+{
+    ScannedCommit sc;
+    JsonScan scan;
+    JsonScanStr key;
+    SeafCommit *commit;
+    char *encrypted = NULL;
+    int enc_version = 0;
+    int rc;
+
+    memset (&sc, 0, sizeof(sc));
+
+    json_scan_init (&scan, data, len);
+    if (json_scan_enter_object (&scan) < 0)
+        return NULL;
+    while ((rc = json_scan_next_member (&scan, &key)) > 0) {
+        if (scan_commit_member (&scan, &key, &sc) < 0)
+            return NULL;
+    }
+    if (rc < 0 || json_scan_finish (&scan) < 0)
+        return NULL;
+
+    commit = g_new0 (SeafCommit, 1);
+    commit->ref = 1;
+    memcpy (commit->commit_id, commit_id, 40);
+
+    if (!copy_scanned_id (&sc, SCAN_REPO_ID, commit->repo_id, 36) ||
+        !copy_scanned_id (&sc, SCAN_ROOT_ID, commit->root_id, 40) ||
+        !copy_scanned_id (&sc, SCAN_CREATOR, commit->creator_id, 40))
+        goto bad;
+
+    if (sc.has_str[SCAN_PARENT_ID]) {
+        commit->parent_id = g_new (char, 41);
+        if (!copy_scanned_id (&sc, SCAN_PARENT_ID, commit->parent_id, 40))
+            goto bad;
+    }
+    if (sc.has_str[SCAN_SECOND_PARENT_ID]) {
+        commit->second_parent_id = g_new (char, 41);
+        if (!copy_scanned_id (&sc, SCAN_SECOND_PARENT_ID,
+                              commit->second_parent_id, 40))
+            goto bad;
+    }
+
+    if (dup_scanned_str (&sc, SCAN_CREATOR_NAME, &commit->creator_name) < 0 ||
+        dup_scanned_str (&sc, SCAN_DESC, &commit->desc) < 0 ||
+        dup_scanned_str (&sc, SCAN_REPO_NAME, &commit->repo_name) < 0 ||
+        dup_scanned_str (&sc, SCAN_REPO_DESC, &commit->repo_desc) < 0 ||
+        dup_scanned_str (&sc, SCAN_REPO_CATEGORY, &commit->repo_category) < 0 ||
+        dup_scanned_str (&sc, SCAN_ENCRYPTED, &encrypted) < 0)
+        goto bad;
+    if (!commit->desc)
+        commit->desc = g_strdup ("");
+
+    /* Same as seaf_commit_new(). */
+    commit->ctime = (guint64)sc.ints[SCAN_CTIME];
+    if (commit->ctime == 0)
+        commit->ctime = (gint64)time(NULL);
+
+    commit->encrypted = (encrypted && strcmp (encrypted, "true") == 0);
+    if (commit->encrypted && sc.has_int[SCAN_ENC_VERSION]) {
+        enc_version = (int)sc.ints[SCAN_ENC_VERSION];
+        if (dup_scanned_str (&sc, SCAN_MAGIC, &commit->magic) < 0)
+            goto bad;
+    }
+
+    switch (enc_version) {
+    case 0:
+        break;
+    case 1:
+        if (!commit->magic || strlen(commit->magic) != 32)
+            goto bad;
+        break;
+    case 2:
+        if (!commit->magic || strlen(commit->magic) != 64 ||
+            dup_scanned_str (&sc, SCAN_KEY, &commit->random_key) < 0 ||
+            !commit->random_key || strlen(commit->random_key) != 96)
+            goto bad;
+        break;
+    default:
+        goto bad;
+    }
+    if (commit->encrypted)
+        commit->enc_version = enc_version;
+
+    commit->no_local_history = (sc.ints[SCAN_NO_LOCAL_HISTORY] != 0);
+    commit->version = (int)sc.ints[SCAN_VERSION];
+    commit->new_merge = (sc.ints[SCAN_NEW_MERGE] != 0);
+    commit->conflict = (sc.ints[SCAN_CONFLICT] != 0);
+    commit->repaired = (sc.ints[SCAN_REPAIRED] != 0);
+
+    g_free (encrypted);
+    return commit;
+
+bad:
+    g_free (encrypted);
+    g_free (commit->repo_category);
+    seaf_commit_free (commit);
+    return NULL;
+}
+
 static SeafCommit *
 load_commit (SeafCommitManager *mgr,
              const char *repo_id,
@@ -790,6 +1735,12 @@ load_commit (SeafCommitManager *mgr,
                                  commit_id, (void **)&data, &len) < 0)
         return NULL;
 
+    commit = commit_from_json_scan (commit_id, data, len);
+    if (commit) {
+        commit->manager = mgr;
+        goto out;
+    }
+
     object = json_loadb (data, len, 0, &jerror);
     if (!object) {
         /* Perhaps the commit object contains invalid UTF-8 character. */
@@ -118,7 +118,8 @@ seaf_commit_manager_del_commit (SeafCommitManager *mgr,
 /**
  * Find a commit object.
  * This function increments ref count of returned object.
- * Not MT safe.
+ * Loaded commits are cached and shared between callers and threads,
+ * so the returned commit must not be modified.
  */
 SeafCommit* 
 seaf_commit_manager_get_commit (SeafCommitManager *mgr,
@@ -138,6 +139,13 @@ seaf_commit_manager_get_commit_compatible (SeafCommitManager *mgr,
                                            const char *repo_id,
                                            const char *id);
 
+/*
+ * Keys of the most recently used cached commits, see
+ * obj_cache_get_hot_keys(). NULL if commits aren't cached.
+ */
+GPtrArray *
+seaf_commit_manager_get_hot_keys (SeafCommitManager *mgr, guint max_keys);
+
 /**
  * Traverse the commits DAG start from head in topological order.
  * The ordering is based on commit time.
@@ -186,4 +194,55 @@ seaf_commit_manager_commit_exists (SeafCommitManager *mgr,
                                    int version,
                                    const char *id);
 
+/*
+ * Move the commits reachable from @head that were created before
+ * @before into a pack of the commit store, in traversal order, so that
+ * later traversals read them sequentially. The commits are still read
+ * with seaf_commit_manager_get_commit().
+ */
+int
+seaf_commit_manager_pack_commits (SeafCommitManager *mgr,
+                                  const char *repo_id,
+                                  int version,
+                                  const char *head,
+                                  gint64 before);
+
+/*
+ * Check whether @ancestor is reachable from @descendant without going
+ * past any of the @n_stops commits in @stop_ids. If @allow_truncate is
+ * set, missing commits end the history as in
+ * seaf_commit_manager_traverse_commit_tree_truncated().
+ *
+ * The answer comes from an in-memory commit graph, so each commit is
+ * only parsed once.
+ *
+ * Returns 1 if it's an ancestor, 0 if not, -1 if the graph can't tell,
+ * e.g. because of missing commits. Fall back to traversing the commit
+ * tree in that case.
+ */
+int
+seaf_commit_manager_is_ancestor (SeafCommitManager *mgr,
+                                 const char *repo_id,
+                                 int version,
+                                 const char *ancestor,
+                                 const char *descendant,
+                                 const char **stop_ids,
+                                 int n_stops,
+                                 gboolean allow_truncate);
+
+/*
+ * Find the common ancestor of @head and @remote from the commit graph,
+ * the same one as get_merge_base() returns. @ca_id is set to an empty
+ * string if they have no common ancestor.
+ *
+ * Returns 0 on success, -1 if the graph can't tell.
+ */
+int
+seaf_commit_manager_get_merge_base (SeafCommitManager *mgr,
+                                    const char *repo_id,
+                                    int version,
+                                    const char *head,
+                                    const char *remote,
+                                    char *ca_id);
+
 #endif
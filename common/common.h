@@ -29,6 +29,9 @@
 
 #define CURRENT_REPO_VERSION 1
 
+/* Repos of this version or later store fs objects in a binary format. */
+#define BINARY_FS_REPO_VERSION 2
+
 /* For compatibility with the old protocol, use an UUID for signature.
  * Listen manager on the server will use the new block tx protocol if it
  * receives this signature as "token".
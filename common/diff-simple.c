@@ -66,6 +66,116 @@ diff_entry_free (DiffEntry *de)
     g_free (de);
 }
 
+/* Make room for @n more entries. */
+static void
+results_reserve (DiffResults *results, int n)
+{
+    if (results->n_entries + n <= results->cap)
+        return;
+    results->cap = MAX (results->cap * 2, results->n_entries + n);
+    results->cap = MAX (results->cap, 64);
+    results->entries = g_renew (DiffEntry, results->entries, results->cap);
+}
+
+DiffResults *
+diff_results_new ()
+{
+    DiffResults *results = g_new0 (DiffResults, 1);
+
+    results->names = g_string_chunk_new (4096);
+    results->path = g_string_new (NULL);
+
+    return results;
+}
+
+void
+diff_results_free (DiffResults *results)
+{
+    if (!results)
+        return;
+
+    g_free (results->entries);
+    g_string_chunk_free (results->names);
+    g_string_free (results->path, TRUE);
+    g_free (results);
+}
+
+static DiffEntry *
+results_add (DiffResults *results, char type, char status,
+             SeafDirent *dent, const char *basedir)
+{
+    DiffEntry *de;
+
+    results_reserve (results, 1);
+    de = &results->entries[results->n_entries++];
+    memset (de, 0, sizeof(*de));
+
+    de->type = type;
+    de->status = status;
+    hex_to_rawdata (dent->id, de->sha1, 20);
+
+    g_string_assign (results->path, basedir);
+    g_string_append (results->path, dent->name);
+    de->name = g_string_chunk_insert_len (results->names, results->path->str,
+                                          results->path->len);
+
+#ifdef SEAFILE_CLIENT
+    if (type == DIFF_TYPE_COMMITS &&
+        (status == DIFF_STATUS_ADDED ||
+         status == DIFF_STATUS_MODIFIED ||
+         status == DIFF_STATUS_DIR_ADDED ||
+         status == DIFF_STATUS_DIR_DELETED)) {
+        de->mtime = dent->mtime;
+        de->mode = dent->mode;
+        /* Few users change a tree, so the modifiers are shared. */
+        if (dent->modifier)
+            de->modifier = g_string_chunk_insert_const (results->names,
+                                                        dent->modifier);
+        de->size = dent->size;
+    }
+#endif
+
+    return de;
+}
+
+/* Entries with status 0 were taken out by resolving. */
+static void
+results_compact (DiffResults *results)
+{
+    int i, n = 0;
+
+    for (i = 0; i < results->n_entries; ++i) {
+        if (results->entries[i].status == 0)
+            continue;
+        if (n != i)
+            results->entries[n] = results->entries[i];
+        ++n;
+    }
+    results->n_entries = n;
+}
+
+GList *
+diff_results_to_list (DiffResults *results)
+{
+    GList *list = NULL;
+    DiffEntry *de, *copy;
+    int i;
+
+    for (i = 0; i < results->n_entries; ++i) {
+        de = &results->entries[i];
+        copy = g_new (DiffEntry, 1);
+        *copy = *de;
+        copy->name = g_strdup (de->name);
+        copy->new_name = g_strdup (de->new_name);
+#ifdef SEAFILE_CLIENT
+        copy->modifier = g_strdup (de->modifier);
+#endif
+        list = g_list_prepend (list, copy);
+    }
+
+    return list;
+}
+
 #ifndef SEAFILE_SERVER
 
 static void
@@ -174,11 +284,15 @@ dirent_same (SeafDirent *denta, SeafDirent *dentb)
 }
 
 static int
-diff_files (int n, SeafDirent *dents[], const char *basedir, DiffOptions *opt)
+diff_files (int n, SeafDirent *dents[], const char *basedir,
+            DiffPathState state, DiffOptions *opt)
 {
     SeafDirent *files[3];
     int i, n_files = 0;
 
+    if (state != DIFF_PATH_INCLUDE)
+        return 0;
+
     memset (files, 0, sizeof(files[0])*n);
     for (i = 0; i < n; ++i) {
         if (dents[i] && S_ISREG(dents[i]->mode)) {
@@ -198,7 +312,8 @@ diff_trees_recursive (int n, SeafDir *trees[],
                       const char *basedir, DiffOptions *opt);
 
 static int
-diff_directories (int n, SeafDirent *dents[], const char *basedir, DiffOptions *opt)
+diff_directories (int n, SeafDirent *dents[], const char *basedir,
+                  DiffPathState state, DiffOptions *opt)
 {
     SeafDirent *dirs[3];
     int i, n_dirs = 0;
@@ -206,6 +321,9 @@ diff_directories (int n, SeafDirent *dents[], const char *basedir, DiffOptions *
     int ret;
     SeafDir *sub_dirs[3], *dir;
 
+    if (state == DIFF_PATH_SKIP)
+        return 0;
+
     memset (dirs, 0, sizeof(dirs[0])*n);
     for (i = 0; i < n; ++i) {
         if (dents[i] && S_ISDIR(dents[i]->mode)) {
@@ -217,10 +335,13 @@ diff_directories (int n, SeafDirent *dents[], const char *basedir, DiffOptions *
     if (n_dirs == 0)
         return 0;
 
+    /* Dirs only leading to the wanted paths are not reported. */
     gboolean recurse = TRUE;
-    ret = opt->dir_cb (n, basedir, dirs, opt->data, &recurse);
-    if (ret < 0)
-        return ret;
+    if (state == DIFF_PATH_INCLUDE) {
+        ret = opt->dir_cb (n, basedir, dirs, opt->data, &recurse);
+        if (ret < 0)
+            return ret;
+    }
 
     if (!recurse)
         return 0;
@@ -228,10 +349,10 @@ diff_directories (int n, SeafDirent *dents[], const char *basedir, DiffOptions *
     memset (sub_dirs, 0, sizeof(sub_dirs[0])*n);
     for (i = 0; i < n; ++i) {
         if (dents[i] != NULL && S_ISDIR(dents[i]->mode)) {
-            dir = seaf_fs_manager_get_seafdir (seaf->fs_mgr,
-                                               opt->store_id,
-                                               opt->version,
-                                               dents[i]->id);
+            dir = seaf_fs_manager_get_seafdir_arena (seaf->fs_mgr,
+                                                     opt->store_id,
+                                                     opt->version,
+                                                     dents[i]->id);
             if (!dir) {
                 seaf_warning ("Failed to find dir %s.\n", dents[i]->id);
                 ret = -1;
@@ -255,13 +376,98 @@ free_sub_dirs:
     return ret;
 }
 
+/* Number of changed subdirs whose dirs are read ahead at once. */
+#define PREFETCH_WINDOW 64
+
+typedef struct DiffDents {
+    SeafDirent *dents[3];
+    /* A name can be a file in one tree and a dir in another. */
+    DiffPathState file_state;
+    DiffPathState dir_state;
+} DiffDents;
+
+/*
+ * Set the states of the entries of @dd by the filter. Returns FALSE if
+ * none of them is diffed.
+ */
+static gboolean
+filter_dents (int n, DiffDents *dd, const char *basedir, DiffOptions *opt)
+{
+    gboolean has_file = FALSE, has_dir = FALSE;
+    const char *name = NULL;
+    char *path;
+    int i;
+
+    if (!opt->filter) {
+        dd->file_state = dd->dir_state = DIFF_PATH_INCLUDE;
+        return TRUE;
+    }
+
+    for (i = 0; i < n; ++i) {
+        if (!dd->dents[i])
+            continue;
+        name = dd->dents[i]->name;
+        if (S_ISDIR(dd->dents[i]->mode))
+            has_dir = TRUE;
+        else
+            has_file = TRUE;
+    }
+
+    path = g_strconcat (basedir, name, NULL);
+    if (has_file)
+        dd->file_state = opt->filter (path, FALSE, opt->filter_data);
+    if (has_dir)
+        dd->dir_state = opt->filter (path, TRUE, opt->filter_data);
+    g_free (path);
+
+    return (dd->file_state != DIFF_PATH_SKIP || dd->dir_state != DIFF_PATH_SKIP);
+}
+
+/*
+ * Read the dirs of the changed subdirs in [start, start + PREFETCH_WINDOW)
+ * in one request. Only subdirs present in more than one tree are read
+ * ahead, since the callbacks may not recurse into added or removed ones.
+ */
+static void
+prefetch_sub_dirs (int n, GArray *changed, guint start, DiffOptions *opt)
+{
+    const char *ids[PREFETCH_WINDOW * 3];
+    DiffDents *dd;
+    guint i;
+    int j, n_dirs, n_ids = 0;
+
+    for (i = start; i < changed->len && i < start + PREFETCH_WINDOW; ++i) {
+        dd = &g_array_index (changed, DiffDents, i);
+        if (dd->dir_state == DIFF_PATH_SKIP)
+            continue;
+
+        n_dirs = 0;
+        for (j = 0; j < n; ++j)
+            if (dd->dents[j] && S_ISDIR(dd->dents[j]->mode))
+                ++n_dirs;
+        if (n_dirs < 2)
+            continue;
+
+        for (j = 0; j < n; ++j)
+            if (dd->dents[j] && S_ISDIR(dd->dents[j]->mode))
+                ids[n_ids++] = dd->dents[j]->id;
+    }
+
+    /* A single dir is read just as fast on its own. */
+    if (n_ids > 1)
+        seaf_fs_manager_prefetch_dirs (seaf->fs_mgr, opt->store_id,
+                                       opt->version, ids, n_ids);
+}
+
 static int
 diff_trees_recursive (int n, SeafDir *trees[],
                       const char *basedir, DiffOptions *opt)
 {
     GList *ptrs[3];
-    SeafDirent *dents[3];
+    DiffDents dd;
+    GArray *changed;
     int i;
+    guint k;
     SeafDirent *dent;
     char *first_name;
     gboolean done;
@@ -274,9 +480,14 @@ diff_trees_recursive (int n, SeafDir *trees[],
             ptrs[i] = NULL;
     }
 
+    /* First collect the changed entries of this level, so that the
+     * subdirs to descend into can be read ahead.
+     */
+    changed = g_array_new (FALSE, FALSE, sizeof(DiffDents));
+
     while (1) {
         first_name = NULL;
-        memset (dents, 0, sizeof(dents[0])*n);
+        memset (&dd, 0, sizeof(dd));
         done = TRUE;
 
         /* Find the "largest" name, assuming dirents are sorted. */
@@ -301,30 +512,45 @@ diff_trees_recursive (int n, SeafDir *trees[],
             if (ptrs[i] != NULL) {
                 dent = ptrs[i]->data;
                 if (strcmp(first_name, dent->name) == 0) {
-                    dents[i] = dent;
+                    dd.dents[i] = dent;
                     ptrs[i] = ptrs[i]->next;
                 }
             }
         }
 
-        if (n == 2 && dents[0] && dents[1] && dirent_same(dents[0], dents[1]))
+        if (n == 2 && dd.dents[0] && dd.dents[1] &&
+            dirent_same(dd.dents[0], dd.dents[1]))
             continue;
 
-        if (n == 3 && dents[0] && dents[1] && dents[2] &&
-            dirent_same(dents[0], dents[1]) && dirent_same(dents[0], dents[2]))
+        if (n == 3 && dd.dents[0] && dd.dents[1] && dd.dents[2] &&
+            dirent_same(dd.dents[0], dd.dents[1]) &&
+            dirent_same(dd.dents[0], dd.dents[2]))
             continue;
 
+        if (!filter_dents (n, &dd, basedir, opt))
+            continue;
+
+        g_array_append_val (changed, dd);
+    }
+
+    for (k = 0; k < changed->len; ++k) {
+        if (k % PREFETCH_WINDOW == 0)
+            prefetch_sub_dirs (n, changed, k, opt);
+
+        DiffDents *cur = &g_array_index (changed, DiffDents, k);
+
         /* Diff files of this level. */
-        ret = diff_files (n, dents, basedir, opt);
+        ret = diff_files (n, cur->dents, basedir, cur->file_state, opt);
         if (ret < 0)
-            return ret;
+            break;
 
         /* Recurse into sub level. */
-        ret = diff_directories (n, dents, basedir, opt);
+        ret = diff_directories (n, cur->dents, basedir, cur->dir_state, opt);
         if (ret < 0)
-            return ret;
+            break;
     }
 
+    g_array_free (changed, TRUE);
     return ret;
 }
 
@@ -338,10 +564,10 @@ diff_trees (int n, const char *roots[], DiffOptions *opt)
 
     trees = g_new0 (SeafDir *, n);
     for (i = 0; i < n; ++i) {
-        root = seaf_fs_manager_get_seafdir (seaf->fs_mgr,
-                                            opt->store_id,
-                                            opt->version,
-                                            roots[i]);
+        root = seaf_fs_manager_get_seafdir_arena (seaf->fs_mgr,
+                                                  opt->store_id,
+                                                  opt->version,
+                                                  roots[i]);
         if (!root) {
             seaf_warning ("Failed to find dir %s.\n", roots[i]);
             g_free (trees);
@@ -360,7 +586,7 @@ diff_trees (int n, const char *roots[], DiffOptions *opt)
 }
 
 typedef struct DiffData {
-    GList **results;
+    DiffResults *results;
     gboolean fold_dir_diff;
 } DiffData;
 
@@ -368,30 +594,25 @@ static int
 twoway_diff_files (int n, const char *basedir, SeafDirent *files[], void *vdata)
 {
     DiffData *data = vdata;
-    GList **results = data->results;
-    DiffEntry *de;
+    DiffResults *results = data->results;
     SeafDirent *tree1 = files[0];
     SeafDirent *tree2 = files[1];
 
     if (!tree1) {
-        de = diff_entry_new_from_dirent (DIFF_TYPE_COMMITS, DIFF_STATUS_ADDED,
-                                         tree2, basedir);
-        *results = g_list_prepend (*results, de);
+        results_add (results, DIFF_TYPE_COMMITS, DIFF_STATUS_ADDED,
+                     tree2, basedir);
         return 0;
     }
 
     if (!tree2) {
-        de = diff_entry_new_from_dirent (DIFF_TYPE_COMMITS, DIFF_STATUS_DELETED,
-                                         tree1, basedir);
-        *results = g_list_prepend (*results, de);
+        results_add (results, DIFF_TYPE_COMMITS, DIFF_STATUS_DELETED,
+                     tree1, basedir);
         return 0;
     }
 
-    if (!dirent_same (tree1, tree2)) {
-        de = diff_entry_new_from_dirent (DIFF_TYPE_COMMITS, DIFF_STATUS_MODIFIED,
-                                         tree2, basedir);
-        *results = g_list_prepend (*results, de);
-    }
+    if (!dirent_same (tree1, tree2))
+        results_add (results, DIFF_TYPE_COMMITS, DIFF_STATUS_MODIFIED,
+                     tree2, basedir);
 
     return 0;
 }
@@ -401,16 +622,14 @@ twoway_diff_dirs (int n, const char *basedir, SeafDirent *dirs[], void *vdata,
                   gboolean *recurse)
 {
     DiffData *data = vdata;
-    GList **results = data->results;
-    DiffEntry *de;
+    DiffResults *results = data->results;
     SeafDirent *tree1 = dirs[0];
     SeafDirent *tree2 = dirs[1];
 
     if (!tree1) {
         if (strcmp (tree2->id, EMPTY_SHA1) == 0 || data->fold_dir_diff) {
-            de = diff_entry_new_from_dirent (DIFF_TYPE_COMMITS, DIFF_STATUS_DIR_ADDED,
-                                             tree2, basedir);
-            *results = g_list_prepend (*results, de);
+            results_add (results, DIFF_TYPE_COMMITS, DIFF_STATUS_DIR_ADDED,
+                         tree2, basedir);
             *recurse = FALSE;
         } else
             *recurse = TRUE;
@@ -418,10 +637,8 @@ twoway_diff_dirs (int n, const char *basedir, SeafDirent *dirs[], void *vdata,
     }
 
     if (!tree2) {
-        de = diff_entry_new_from_dirent (DIFF_TYPE_COMMITS,
-                                         DIFF_STATUS_DIR_DELETED,
-                                         tree1, basedir);
-        *results = g_list_prepend (*results, de);
+        results_add (results, DIFF_TYPE_COMMITS, DIFF_STATUS_DIR_DELETED,
+                     tree1, basedir);
 
         if (data->fold_dir_diff) {
             *recurse = FALSE;
@@ -433,9 +650,19 @@ twoway_diff_dirs (int n, const char *basedir, SeafDirent *dirs[], void *vdata,
     return 0;
 }
 
+/* Move the entries of @array to the front of @results, like the entries
+ * were prepended while diffing.
+ */
+static void
+move_results_to_list (DiffResults *array, GList **results)
+{
+    *results = g_list_concat (diff_results_to_list (array), *results);
+    diff_results_free (array);
+}
+
 int
-diff_commits (SeafCommit *commit1, SeafCommit *commit2, GList **results,
-              gboolean fold_dir_diff)
+diff_commits_array (SeafCommit *commit1, SeafCommit *commit2,
+                    DiffResults *results, gboolean fold_dir_diff)
 {
     SeafRepo *repo = NULL;
     DiffOptions opt;
@@ -471,15 +698,29 @@ diff_commits (SeafCommit *commit1, SeafCommit *commit2, GList **results,
     roots[1] = commit2->root_id;
 
     diff_trees (2, roots, &opt);
-    diff_resolve_renames (results);
+    diff_results_resolve_renames (results);
 
     return 0;
 }
 
 int
-diff_commit_roots (const char *store_id, int version,
-                   const char *root1, const char *root2, GList **results,
-                   gboolean fold_dir_diff)
+diff_commits (SeafCommit *commit1, SeafCommit *commit2, GList **results,
+              gboolean fold_dir_diff)
+{
+    DiffResults *array = diff_results_new ();
+    int ret;
+
+    ret = diff_commits_array (commit1, commit2, array, fold_dir_diff);
+    move_results_to_list (array, results);
+
+    return ret;
+}
+
+static int
+diff_roots_array (const char *store_id, int version,
+                  const char *root1, const char *root2,
+                  DiffResults *results, gboolean fold_dir_diff,
+                  DiffPathFilter filter, void *filter_data)
 {
     DiffOptions opt;
     const char *roots[2];
@@ -495,16 +736,58 @@ diff_commit_roots (const char *store_id, int version,
     opt.file_cb = twoway_diff_files;
     opt.dir_cb = twoway_diff_dirs;
     opt.data = &data;
+    opt.filter = filter;
+    opt.filter_data = filter_data;
 
     roots[0] = root1;
     roots[1] = root2;
 
     diff_trees (2, roots, &opt);
-    diff_resolve_renames (results);
+    diff_results_resolve_renames (results);
 
     return 0;
 }
 
+int
+diff_commit_roots_array (const char *store_id, int version,
+                         const char *root1, const char *root2,
+                         DiffResults *results, gboolean fold_dir_diff)
+{
+    return diff_roots_array (store_id, version, root1, root2,
+                             results, fold_dir_diff, NULL, NULL);
+}
+
+int
+diff_commit_roots (const char *store_id, int version,
+                   const char *root1, const char *root2, GList **results,
+                   gboolean fold_dir_diff)
+{
+    DiffResults *array = diff_results_new ();
+    int ret;
+
+    ret = diff_commit_roots_array (store_id, version, root1, root2,
+                                   array, fold_dir_diff);
+    move_results_to_list (array, results);
+
+    return ret;
+}
+
+int
+diff_commit_roots_filtered (const char *store_id, int version,
+                            const char *root1, const char *root2,
+                            GList **results, gboolean fold_dir_diff,
+                            DiffPathFilter filter, void *filter_data)
+{
+    DiffResults *array = diff_results_new ();
+    int ret;
+
+    ret = diff_roots_array (store_id, version, root1, root2,
+                            array, fold_dir_diff, filter, filter_data);
+    move_results_to_list (array, results);
+
+    return ret;
+}
+
 static int
 threeway_diff_files (int n, const char *basedir, SeafDirent *files[], void *vdata)
 {
@@ -512,36 +795,30 @@ threeway_diff_files (int n, const char *basedir, SeafDirent *files[], void *vdat
     SeafDirent *m = files[0];
     SeafDirent *p1 = files[1];
     SeafDirent *p2 = files[2];
-    GList **results = data->results;
-    DiffEntry *de;
+    DiffResults *results = data->results;
 
     /* diff m with both p1 and p2. */
     if (m && p1 && p2) {
         if (!dirent_same(m, p1) && !dirent_same (m, p2)) {
-            de = diff_entry_new_from_dirent (DIFF_TYPE_COMMITS, DIFF_STATUS_MODIFIED,
-                                             m, basedir);
-            *results = g_list_prepend (*results, de);
+            results_add (results, DIFF_TYPE_COMMITS, DIFF_STATUS_MODIFIED,
+                         m, basedir);
         }
     } else if (!m && p1 && p2) {
-        de = diff_entry_new_from_dirent (DIFF_TYPE_COMMITS, DIFF_STATUS_DELETED,
-                                         p1, basedir);
-        *results = g_list_prepend (*results, de);
+        results_add (results, DIFF_TYPE_COMMITS, DIFF_STATUS_DELETED,
+                     p1, basedir);
     } else if (m && !p1 && p2) {
         if (!dirent_same (m, p2)) {
-            de = diff_entry_new_from_dirent (DIFF_TYPE_COMMITS, DIFF_STATUS_MODIFIED,
-                                             m, basedir);
-            *results = g_list_prepend (*results, de);
+            results_add (results, DIFF_TYPE_COMMITS, DIFF_STATUS_MODIFIED,
+                         m, basedir);
         }
     } else if (m && p1 && !p2) {
         if (!dirent_same (m, p1)) {
-            de = diff_entry_new_from_dirent (DIFF_TYPE_COMMITS, DIFF_STATUS_MODIFIED,
-                                             m, basedir);
-            *results = g_list_prepend (*results, de);
+            results_add (results, DIFF_TYPE_COMMITS, DIFF_STATUS_MODIFIED,
+                         m, basedir);
         }
     } else if (m && !p1 && !p2) {
-        de = diff_entry_new_from_dirent (DIFF_TYPE_COMMITS, DIFF_STATUS_ADDED,
-                                         m, basedir);
-        *results = g_list_prepend (*results, de);
+        results_add (results, DIFF_TYPE_COMMITS, DIFF_STATUS_ADDED,
+                     m, basedir);
     }
     /* Nothing to do for:
      * 1. !m && p1 && !p2;
@@ -561,14 +838,14 @@ threeway_diff_dirs (int n, const char *basedir, SeafDirent *dirs[], void *vdata,
 }
 
 int
-diff_merge (SeafCommit *merge, GList **results, gboolean fold_dir_diff)
+diff_merge_array (SeafCommit *merge, DiffResults *results, gboolean fold_dir_diff)
 {
     SeafRepo *repo = NULL;
     DiffOptions opt;
     const char *roots[3];
     SeafCommit *parent1, *parent2;
 
-    g_return_val_if_fail (*results == NULL, -1);
+    g_return_val_if_fail (results->n_entries == 0, -1);
     g_return_val_if_fail (merge->parent_id != NULL &&
                           merge->second_parent_id != NULL,
                           -1);
@@ -623,7 +900,7 @@ diff_merge (SeafCommit *merge, GList **results, gboolean fold_dir_diff)
     roots[2] = parent2->root_id;
 
     int ret = diff_trees (3, roots, &opt);
-    diff_resolve_renames (results);
+    diff_results_resolve_renames (results);
 
     seaf_commit_unref (parent1);
     seaf_commit_unref (parent2);
@@ -632,14 +909,30 @@ diff_merge (SeafCommit *merge, GList **results, gboolean fold_dir_diff)
 }
 
 int
-diff_merge_roots (const char *store_id, int version,
-                  const char *merged_root, const char *p1_root, const char *p2_root,
-                  GList **results, gboolean fold_dir_diff)
+diff_merge (SeafCommit *merge, GList **results, gboolean fold_dir_diff)
+{
+    DiffResults *array;
+    int ret;
+
+    g_return_val_if_fail (*results == NULL, -1);
+
+    array = diff_results_new ();
+    ret = diff_merge_array (merge, array, fold_dir_diff);
+    move_results_to_list (array, results);
+
+    return ret;
+}
+
+int
+diff_merge_roots_array (const char *store_id, int version,
+                        const char *merged_root, const char *p1_root,
+                        const char *p2_root,
+                        DiffResults *results, gboolean fold_dir_diff)
 {
     DiffOptions opt;
     const char *roots[3];
 
-    g_return_val_if_fail (*results == NULL, -1);
+    g_return_val_if_fail (results->n_entries == 0, -1);
 
     DiffData data;
     memset (&data, 0, sizeof(data));
@@ -658,11 +951,29 @@ diff_merge_roots (const char *store_id, int version,
     roots[2] = p2_root;
 
     diff_trees (3, roots, &opt);
-    diff_resolve_renames (results);
+    diff_results_resolve_renames (results);
 
     return 0;
 }
 
+int
+diff_merge_roots (const char *store_id, int version,
+                  const char *merged_root, const char *p1_root, const char *p2_root,
+                  GList **results, gboolean fold_dir_diff)
+{
+    DiffResults *array;
+    int ret;
+
+    g_return_val_if_fail (*results == NULL, -1);
+
+    array = diff_results_new ();
+    ret = diff_merge_roots_array (store_id, version, merged_root, p1_root, p2_root,
+                                  array, fold_dir_diff);
+    move_results_to_list (array, results);
+
+    return ret;
+}
+
 /* This function only resolve "strict" rename, i.e. two files must be
  * exactly the same.
  * Don't detect rename of empty files and empty dirs.
@@ -741,29 +1052,120 @@ diff_resolve_renames (GList **diff_entries)
 }
 
 static gboolean
-is_redundant_empty_dir (DiffEntry *de_dir, DiffEntry *de_file)
+is_rename_source (DiffEntry *de, const unsigned char *empty_sha1)
+{
+    return ((de->status == DIFF_STATUS_DELETED ||
+             de->status == DIFF_STATUS_DIR_DELETED) &&
+            memcmp (de->sha1, empty_sha1, 20) != 0);
+}
+
+static gboolean
+is_rename_target (DiffEntry *de, const unsigned char *empty_sha1)
 {
-    int dir_len;
+    return ((de->status == DIFF_STATUS_ADDED ||
+             de->status == DIFF_STATUS_DIR_ADDED) &&
+            memcmp (de->sha1, empty_sha1, 20) != 0);
+}
+
+/* Same as diff_resolve_renames(). The rename entries are appended in
+ * the order of the added entries, which gives the same list as the
+ * GList version once reversed.
+ */
+void
+diff_results_resolve_renames (DiffResults *results)
+{
+    GHashTable *deleted;
+    DiffEntry *de, *de_del, *de_rename;
+    unsigned char empty_sha1[20];
+    int i, n = results->n_entries, n_added = 0, n_deleted = 0;
+    int idx;
+
+    memset (empty_sha1, 0, 20);
 
-    if (de_dir->status == DIFF_STATUS_DIR_ADDED &&
-        de_file->status == DIFF_STATUS_DELETED)
-    {
-        dir_len = strlen (de_dir->name);
-        if (strlen (de_file->name) > dir_len &&
-            strncmp (de_dir->name, de_file->name, dir_len) == 0)
-            return TRUE;
+    for (i = 0; i < n; ++i) {
+        de = &results->entries[i];
+        if (is_rename_source (de, empty_sha1))
+            ++n_deleted;
+        else if (is_rename_target (de, empty_sha1))
+            ++n_added;
+    }
+    if (n_added == 0 || n_deleted == 0)
+        return;
+
+    /* The hash table points into the array, so it mustn't move while
+     * the renames are appended.
+     */
+    results_reserve (results, MIN (n_added, n_deleted));
+
+    deleted = g_hash_table_new (ccnet_sha1_hash, ccnet_sha1_equal);
+
+    /* The list version keeps the last deleted entry of the list, which
+     * is the first one diffed.
+     */
+    for (i = 0; i < n; ++i) {
+        de = &results->entries[i];
+        if (is_rename_source (de, empty_sha1) &&
+            !g_hash_table_contains (deleted, de->sha1))
+            g_hash_table_insert (deleted, de->sha1, GINT_TO_POINTER(i + 1));
     }
 
-    if (de_dir->status == DIFF_STATUS_DIR_DELETED &&
-        de_file->status == DIFF_STATUS_ADDED)
-    {
-        dir_len = strlen (de_dir->name);
-        if (strlen (de_file->name) > dir_len &&
-            strncmp (de_dir->name, de_file->name, dir_len) == 0)
-            return TRUE;
+    for (i = 0; i < n; ++i) {
+        de = &results->entries[i];
+        if (!is_rename_target (de, empty_sha1))
+            continue;
+
+        idx = GPOINTER_TO_INT (g_hash_table_lookup (deleted, de->sha1));
+        if (idx == 0)
+            continue;
+        de_del = &results->entries[idx - 1];
+        g_hash_table_remove (deleted, de->sha1);
+
+        de_rename = &results->entries[results->n_entries++];
+        memset (de_rename, 0, sizeof(*de_rename));
+        de_rename->type = de_del->type;
+        if (de->status == DIFF_STATUS_DIR_ADDED)
+            de_rename->status = DIFF_STATUS_DIR_RENAMED;
+        else
+            de_rename->status = DIFF_STATUS_RENAMED;
+        memcpy (de_rename->sha1, de_del->sha1, 20);
+        /* Both names are in the string chunk. */
+        de_rename->name = de_del->name;
+        de_rename->new_name = de->name;
+
+        de->status = 0;
+        de_del->status = 0;
+    }
+
+    g_hash_table_destroy (deleted);
+
+    results_compact (results);
+}
+
+static int
+compare_names (const void *a, const void *b)
+{
+    return strcmp (*(char * const *)a, *(char * const *)b);
+}
+
+/* Whether a name in the sorted @names is under @dir, i.e. starts with
+ * it and is longer. Those names directly follow @dir in the order.
+ */
+static gboolean
+has_name_under (char **names, int n, const char *dir)
+{
+    int lo = 0, hi = n, mid;
+
+    while (lo < hi) {
+        mid = lo + (hi - lo) / 2;
+        if (strcmp (names[mid], dir) < 0)
+            lo = mid + 1;
+        else
+            hi = mid;
     }
+    while (lo < n && strcmp (names[lo], dir) == 0)
+        ++lo;
 
-    return FALSE;
+    return (lo < n && strncmp (names[lo], dir, strlen(dir)) == 0);
 }
 
 /*
@@ -771,33 +1173,110 @@ is_redundant_empty_dir (DiffEntry *de_dir, DiffEntry *de_file)
  * Similarly, an empty dir entry may be deleted by adding some file in it.
  * In both cases, we don't want to include the empty dir entry in the
  * diff results.
+ *
+ * Sets @redundant for the empty dir entries to drop. The names of the
+ * added and deleted files are sorted, so that each dir is looked up
+ * with a binary search instead of comparing it with every entry.
  */
+static void
+find_redundant_empty_dirs (DiffEntry **entries, int n, gboolean *redundant)
+{
+    char **added, **deleted;
+    int i, n_added = 0, n_deleted = 0, n_dirs = 0;
+    DiffEntry *de;
+
+    for (i = 0; i < n; ++i) {
+        if (entries[i]->status == DIFF_STATUS_DIR_ADDED ||
+            entries[i]->status == DIFF_STATUS_DIR_DELETED)
+            ++n_dirs;
+    }
+    if (n_dirs == 0)
+        return;
+
+    added = g_new (char *, n);
+    deleted = g_new (char *, n);
+    for (i = 0; i < n; ++i) {
+        de = entries[i];
+        if (de->status == DIFF_STATUS_ADDED)
+            added[n_added++] = de->name;
+        else if (de->status == DIFF_STATUS_DELETED)
+            deleted[n_deleted++] = de->name;
+    }
+    qsort (added, n_added, sizeof(char *), compare_names);
+    qsort (deleted, n_deleted, sizeof(char *), compare_names);
+
+    for (i = 0; i < n; ++i) {
+        de = entries[i];
+        if (de->status == DIFF_STATUS_DIR_ADDED)
+            redundant[i] = has_name_under (deleted, n_deleted, de->name);
+        else if (de->status == DIFF_STATUS_DIR_DELETED)
+            redundant[i] = has_name_under (added, n_added, de->name);
+    }
+
+    g_free (added);
+    g_free (deleted);
+}
+
 void
 diff_resolve_empty_dirs (GList **diff_entries)
 {
-    GList *empty_dirs = NULL;
-    GList *p, *dir, *file;
-    DiffEntry *de, *de_dir, *de_file;
+    DiffEntry **entries;
+    GList **links;
+    gboolean *redundant;
+    GList *p;
+    int i, n = g_list_length (*diff_entries);
 
-    for (p = *diff_entries; p != NULL; p = p->next) {
-        de = p->data;
-        if (de->status == DIFF_STATUS_DIR_ADDED ||
-            de->status == DIFF_STATUS_DIR_DELETED)
-            empty_dirs = g_list_prepend (empty_dirs, p);
-    }
-
-    for (dir = empty_dirs; dir != NULL; dir = dir->next) {
-        de_dir = ((GList *)dir->data)->data;
-        for (file = *diff_entries; file != NULL; file = file->next) {
-            de_file = file->data;
-            if (is_redundant_empty_dir (de_dir, de_file)) {
-                *diff_entries = g_list_delete_link (*diff_entries, dir->data);
-                break;
-            }
-        }
+    if (n == 0)
+        return;
+
+    entries = g_new (DiffEntry *, n);
+    links = g_new (GList *, n);
+    redundant = g_new0 (gboolean, n);
+
+    for (p = *diff_entries, i = 0; p != NULL; p = p->next, ++i) {
+        entries[i] = p->data;
+        links[i] = p;
+    }
+
+    find_redundant_empty_dirs (entries, n, redundant);
+
+    for (i = 0; i < n; ++i) {
+        if (!redundant[i])
+            continue;
+        *diff_entries = g_list_delete_link (*diff_entries, links[i]);
+        diff_entry_free (entries[i]);
     }
 
-    g_list_free (empty_dirs);
+    g_free (entries);
+    g_free (links);
+    g_free (redundant);
+}
+
+void
+diff_results_resolve_empty_dirs (DiffResults *results)
+{
+    DiffEntry **entries;
+    gboolean *redundant;
+    int i, n = results->n_entries;
+
+    if (n == 0)
+        return;
+
+    entries = g_new (DiffEntry *, n);
+    redundant = g_new0 (gboolean, n);
+    for (i = 0; i < n; ++i)
+        entries[i] = &results->entries[i];
+
+    find_redundant_empty_dirs (entries, n, redundant);
+
+    for (i = 0; i < n; ++i) {
+        if (redundant[i])
+            results->entries[i].status = 0;
+    }
+    results_compact (results);
+
+    g_free (entries);
+    g_free (redundant);
 }
 
 int diff_unmerged_state(int mask)
@@ -858,11 +1337,11 @@ get_basename (char *path)
     return (slash + 1);
 }
 
-char *
-diff_results_to_description (GList *results)
+static char *
+describe_entries (DiffEntry **entries, int n)
 {
-    GList *p;
     DiffEntry *de;
+    int i;
     char *new_file = NULL, *removed_file = NULL;
     char *renamed_file = NULL, *modified_file = NULL;
     char *new_dir = NULL, *removed_dir = NULL;
@@ -870,11 +1349,11 @@ diff_results_to_description (GList *results)
     int n_new_dir = 0, n_removed_dir = 0;
     GString *desc;
 
-    if (results == NULL)
+    if (n == 0)
         return NULL;
 
-    for (p = results; p != NULL; p = p->next) {
-        de = p->data;
+    for (i = 0; i < n; ++i) {
+        de = entries[i];
         switch (de->status) {
         case DIFF_STATUS_ADDED:
             if (n_new == 0)
@@ -949,3 +1428,37 @@ diff_results_to_description (GList *results)
 
     return g_string_free (desc, FALSE);
 }
+
+char *
+diff_results_to_description (GList *results)
+{
+    DiffEntry **entries;
+    GList *p;
+    int i, n = g_list_length (results);
+    char *desc;
+
+    entries = g_new (DiffEntry *, MAX (n, 1));
+    for (p = results, i = 0; p != NULL; p = p->next, ++i)
+        entries[i] = p->data;
+
+    desc = describe_entries (entries, n);
+    g_free (entries);
+    return desc;
+}
+
+char *
+diff_results_array_to_description (DiffResults *results)
+{
+    DiffEntry **entries;
+    int i, n = results->n_entries;
+    char *desc;
+
+    /* In the order of the list version, which picks the first names. */
+    entries = g_new (DiffEntry *, MAX (n, 1));
+    for (i = 0; i < n; ++i)
+        entries[i] = &results->entries[n - 1 - i];
+
+    desc = describe_entries (entries, n);
+    g_free (entries);
+    return desc;
+}
@@ -60,6 +60,46 @@ diff_entry_new (char type, char status, unsigned char *sha1, const char *name);
 void
 diff_entry_free (DiffEntry *de);
 
+/*
+ * Diff results of the tree diffs, kept in one array instead of a list of
+ * separately allocated entries. The names of all the entries are
+ * allocated from @names, so the entries are only freed together.
+ *
+ * Entries are in the order they were diffed. The GList results have
+ * the reverse order, since entries are prepended to them.
+ */
+typedef struct DiffResults {
+    DiffEntry *entries;
+    int n_entries;
+    int cap;
+    GStringChunk *names;
+    GString *path;              /* scratch buffer for the entry names */
+} DiffResults;
+
+DiffResults *
+diff_results_new ();
+
+void
+diff_results_free (DiffResults *results);
+
+/* Returns a list of entries copied from @results, to be freed with
+ * diff_entry_free().
+ */
+GList *
+diff_results_to_list (DiffResults *results);
+
+typedef enum DiffPathState {
+    DIFF_PATH_SKIP = 0,
+    /* A dir leading to wanted paths: descended into without being diffed. */
+    DIFF_PATH_DESCEND,
+    DIFF_PATH_INCLUDE,
+} DiffPathState;
+
+/* @path is relative to the root, like "a/b". */
+typedef DiffPathState (*DiffPathFilter) (const char *path,
+                                         gboolean is_dir,
+                                         void *data);
+
 #ifndef SEAFILE_SERVER
 int
 diff_index (const char *repo_id, int version,
@@ -81,6 +121,13 @@ diff_commit_roots (const char *store_id, int version,
                    const char *root1, const char *root2, GList **results,
                    gboolean fold_dir_diff);
 
+/* Same as diff_commit_roots(), only for the paths @filter includes. */
+int
+diff_commit_roots_filtered (const char *store_id, int version,
+                            const char *root1, const char *root2,
+                            GList **results, gboolean fold_dir_diff,
+                            DiffPathFilter filter, void *filter_data);
+
 int
 diff_merge (SeafCommit *merge, GList **results, gboolean fold_dir_diff);
 
@@ -89,12 +136,37 @@ diff_merge_roots (const char *store_id, int version,
                   const char *merged_root, const char *p1_root, const char *p2_root,
                   GList **results, gboolean fold_dir_diff);
 
+/* Same as the functions above, for callers only scanning the results. */
+int
+diff_commits_array (SeafCommit *commit1, SeafCommit *commit2,
+                    DiffResults *results, gboolean fold_dir_diff);
+
+int
+diff_commit_roots_array (const char *store_id, int version,
+                         const char *root1, const char *root2,
+                         DiffResults *results, gboolean fold_dir_diff);
+
+int
+diff_merge_array (SeafCommit *merge, DiffResults *results, gboolean fold_dir_diff);
+
+int
+diff_merge_roots_array (const char *store_id, int version,
+                        const char *merged_root, const char *p1_root,
+                        const char *p2_root,
+                        DiffResults *results, gboolean fold_dir_diff);
+
 void
 diff_resolve_renames (GList **diff_entries);
 
+void
+diff_results_resolve_renames (DiffResults *results);
+
 void
 diff_resolve_empty_dirs (GList **diff_entries);
 
+void
+diff_results_resolve_empty_dirs (DiffResults *results);
+
 int 
 diff_unmerged_state(int mask);
 
@@ -104,6 +176,9 @@ format_diff_results(GList *results);
 char *
 diff_results_to_description (GList *results);
 
+char *
+diff_results_array_to_description (DiffResults *results);
+
 typedef int (*DiffFileCB) (int n,
                            const char *basedir,
                            SeafDirent *files[],
@@ -122,6 +197,12 @@ typedef struct DiffOptions {
     DiffFileCB file_cb;
     DiffDirCB dir_cb;
     void *data;
+
+    /* If set, only the paths it includes are diffed, and the objects of
+     * the dirs it skips needn't be present.
+     */
+    DiffPathFilter filter;
+    void *filter_data;
 } DiffOptions;
 
 int
@@ -0,0 +1,334 @@
+/* -*- Mode: C; tab-width: 4; indent-tabs-mode: nil; c-basic-offset: 4 -*- */
+
+#include "common.h"
+
+#include <pthread.h>
+
+#include "bloom-filter.h"
+#include "exists-filter.h"
+#include "log.h"
+
+/* About 1% false positives once a filter is full, 0.1% when half full. */
+#define BITS_PER_OBJ 10
+#define N_HASHES 4
+
+/* Filters are sized for twice the objects found by the scan, so that a
+ * store can grow before its filter has to be rebuilt.
+ */
+#define MIN_CAPACITY 1024
+
+enum {
+    FILTER_COUNTING,            /* first scan, sizing the bloom filter */
+    FILTER_LOADING,             /* second scan, filling it */
+    FILTER_READY,
+};
+
+typedef struct StoreFilter {
+    int         state;
+    /* Removed from the table while the builder still uses it. */
+    gboolean    dropped;
+    Bloom      *bloom;
+    guint64     capacity;
+    guint64     n_objs;
+    /* Objects written while counting, before the bloom filter exists. */
+    GPtrArray  *pending;
+} StoreFilter;
+
+struct ExistsFilter {
+    pthread_mutex_t       lock;
+    GHashTable           *stores;   /* store_id -> StoreFilter */
+    GThreadPool          *builders;
+    ExistsFilterScanFunc  scan;
+    void                 *scan_data;
+};
+
+typedef struct BuildTask {
+    char        *store_id;
+    int          version;
+    StoreFilter *sf;
+} BuildTask;
+
+typedef struct LoadData {
+    ExistsFilter *filter;
+    StoreFilter  *sf;
+} LoadData;
+
+static void
+build_thread (void *data, void *user_data);
+
+ExistsFilter *
+exists_filter_new (ExistsFilterScanFunc scan, void *scan_data)
+{
+    ExistsFilter *filter = g_new0 (ExistsFilter, 1);
+    GError *error = NULL;
+
+    /* Scans are disk bound, running more of them at once doesn't help. */
+    filter->builders = g_thread_pool_new (build_thread, filter,
+                                          1, FALSE, &error);
+    if (error) {
+        seaf_warning ("Failed to start exists filter thread: %s.\n",
+                      error->message);
+        g_clear_error (&error);
+        g_free (filter);
+        return NULL;
+    }
+
+    pthread_mutex_init (&filter->lock, NULL);
+    filter->stores = g_hash_table_new_full (g_str_hash, g_str_equal,
+                                            g_free, NULL);
+    filter->scan = scan;
+    filter->scan_data = scan_data;
+
+    return filter;
+}
+
+static void
+store_filter_free (StoreFilter *sf)
+{
+    guint i;
+
+    if (sf->bloom)
+        bloom_destroy (sf->bloom);
+    if (sf->pending) {
+        for (i = 0; i < sf->pending->len; ++i)
+            g_free (g_ptr_array_index (sf->pending, i));
+        g_ptr_array_free (sf->pending, TRUE);
+    }
+    g_free (sf);
+}
+
+/* Called with the lock held. */
+static void
+drop_store_filter (ExistsFilter *filter, const char *store_id, StoreFilter *sf)
+{
+    g_hash_table_remove (filter->stores, store_id);
+
+    if (sf->state == FILTER_READY)
+        store_filter_free (sf);
+    else
+        sf->dropped = TRUE;
+}
+
+static gboolean
+count_obj (const char *store_id, int version, const char *obj_id,
+           void *user_data)
+{
+    guint64 *count = user_data;
+
+    ++(*count);
+    return TRUE;
+}
+
+static gboolean
+load_obj (const char *store_id, int version, const char *obj_id,
+          void *user_data)
+{
+    LoadData *data = user_data;
+
+    pthread_mutex_lock (&data->filter->lock);
+    if (!data->sf->dropped) {
+        bloom_add (data->sf->bloom, obj_id);
+        ++data->sf->n_objs;
+    }
+    pthread_mutex_unlock (&data->filter->lock);
+
+    return TRUE;
+}
+
+static void
+build_thread (void *data, void *user_data)
+{
+    BuildTask *task = data;
+    ExistsFilter *filter = user_data;
+    StoreFilter *sf = task->sf;
+    LoadData load_data;
+    guint64 count = 0;
+    guint i;
+
+    if (filter->scan (filter->scan_data, task->store_id, task->version,
+                      count_obj, &count) < 0) {
+        seaf_warning ("Failed to scan store %s for exists filter.\n",
+                      task->store_id);
+        goto error;
+    }
+
+    pthread_mutex_lock (&filter->lock);
+
+    if (sf->dropped) {
+        pthread_mutex_unlock (&filter->lock);
+        goto error;
+    }
+
+    sf->capacity = MAX (count * 2, MIN_CAPACITY);
+    sf->bloom = bloom_create (sf->capacity * BITS_PER_OBJ, N_HASHES, 0);
+    if (!sf->bloom) {
+        pthread_mutex_unlock (&filter->lock);
+        goto error;
+    }
+
+    for (i = 0; i < sf->pending->len; ++i) {
+        bloom_add (sf->bloom, g_ptr_array_index (sf->pending, i));
+        g_free (g_ptr_array_index (sf->pending, i));
+    }
+    g_ptr_array_free (sf->pending, TRUE);
+    sf->pending = NULL;
+
+    sf->state = FILTER_LOADING;
+
+    pthread_mutex_unlock (&filter->lock);
+
+    load_data.filter = filter;
+    load_data.sf = sf;
+    if (filter->scan (filter->scan_data, task->store_id, task->version,
+                      load_obj, &load_data) < 0) {
+        seaf_warning ("Failed to scan store %s for exists filter.\n",
+                      task->store_id);
+        goto error;
+    }
+
+    pthread_mutex_lock (&filter->lock);
+    if (sf->dropped) {
+        pthread_mutex_unlock (&filter->lock);
+        goto error;
+    }
+    sf->state = FILTER_READY;
+    pthread_mutex_unlock (&filter->lock);
+
+    goto out;
+
+error:
+    /* Forget the store, the next query starts over. */
+    pthread_mutex_lock (&filter->lock);
+    if (!sf->dropped)
+        g_hash_table_remove (filter->stores, task->store_id);
+    store_filter_free (sf);
+    pthread_mutex_unlock (&filter->lock);
+
+out:
+    g_free (task->store_id);
+    g_free (task);
+}
+
+/* Called with the lock held. Starts building the filter if there's none. */
+static StoreFilter *
+get_store_filter (ExistsFilter *filter, const char *store_id, int version)
+{
+    StoreFilter *sf;
+    BuildTask *task;
+    GError *error = NULL;
+
+    sf = g_hash_table_lookup (filter->stores, store_id);
+    if (!sf) {
+        sf = g_new0 (StoreFilter, 1);
+        sf->state = FILTER_COUNTING;
+        sf->pending = g_ptr_array_new ();
+        g_hash_table_insert (filter->stores, g_strdup(store_id), sf);
+
+        task = g_new0 (BuildTask, 1);
+        task->store_id = g_strdup (store_id);
+        task->version = version;
+        task->sf = sf;
+        g_thread_pool_push (filter->builders, task, &error);
+        if (error) {
+            seaf_warning ("Failed to build exists filter for %s: %s.\n",
+                          store_id, error->message);
+            g_clear_error (&error);
+            g_hash_table_remove (filter->stores, store_id);
+            store_filter_free (sf);
+            g_free (task->store_id);
+            g_free (task);
+        }
+        return NULL;
+    }
+
+    return sf;
+}
+
+gboolean
+exists_filter_may_contain (ExistsFilter *filter,
+                           const char *store_id,
+                           int version,
+                           const char *obj_id)
+{
+    StoreFilter *sf;
+    gboolean ret = TRUE;
+
+    pthread_mutex_lock (&filter->lock);
+
+    sf = get_store_filter (filter, store_id, version);
+    if (sf && sf->state == FILTER_READY)
+        ret = bloom_test (sf->bloom, obj_id);
+
+    pthread_mutex_unlock (&filter->lock);
+
+    return ret;
+}
+
+int
+exists_filter_export (ExistsFilter *filter,
+                      const char *store_id,
+                      int version,
+                      unsigned char **bits,
+                      guint64 *n_bits,
+                      int *n_hashes)
+{
+    StoreFilter *sf;
+    int ret = -1;
+
+    pthread_mutex_lock (&filter->lock);
+
+    sf = get_store_filter (filter, store_id, version);
+    if (sf && sf->state == FILTER_READY) {
+        *bits = g_memdup (sf->bloom->a, (sf->bloom->asize + 7) / 8);
+        *n_bits = sf->bloom->asize;
+        *n_hashes = sf->bloom->k;
+        ret = 0;
+    }
+
+    pthread_mutex_unlock (&filter->lock);
+
+    return ret;
+}
+
+void
+exists_filter_add (ExistsFilter *filter,
+                   const char *store_id,
+                   const char *obj_id)
+{
+    StoreFilter *sf;
+
+    pthread_mutex_lock (&filter->lock);
+
+    /* Without a filter, the scan that builds one will find the object. */
+    sf = g_hash_table_lookup (filter->stores, store_id);
+    if (!sf)
+        goto out;
+
+    if (sf->state == FILTER_COUNTING) {
+        g_ptr_array_add (sf->pending, g_strdup(obj_id));
+        goto out;
+    }
+
+    bloom_add (sf->bloom, obj_id);
+
+    /* Too full to be useful. Rebuild it at the next query. */
+    if (++sf->n_objs > sf->capacity && sf->state == FILTER_READY)
+        drop_store_filter (filter, store_id, sf);
+
+out:
+    pthread_mutex_unlock (&filter->lock);
+}
+
+void
+exists_filter_remove_store (ExistsFilter *filter, const char *store_id)
+{
+    StoreFilter *sf;
+
+    pthread_mutex_lock (&filter->lock);
+
+    sf = g_hash_table_lookup (filter->stores, store_id);
+    if (sf)
+        drop_store_filter (filter, store_id, sf);
+
+    pthread_mutex_unlock (&filter->lock);
+}
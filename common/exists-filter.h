@@ -0,0 +1,71 @@
+/* -*- Mode: C; tab-width: 4; indent-tabs-mode: nil; c-basic-offset: 4 -*- */
+
+#ifndef EXISTS_FILTER_H
+#define EXISTS_FILTER_H
+
+#include <glib.h>
+
+/*
+ * In-memory membership filter for the objects or blocks of each store.
+ *
+ * The filter of a store is a bloom filter over everything the store holds,
+ * built by scanning the store in a background thread the first time it's
+ * queried. Until it's ready, every query answers "maybe". Afterwards
+ * a "no" means the object is definitely absent and the caller can skip
+ * the backend probe; a "maybe" still has to be checked on disk.
+ *
+ * To keep "no" exact, every object must be added once it's written.
+ * Removed objects are not taken out; they only cost a disk probe.
+ */
+
+typedef struct ExistsFilter ExistsFilter;
+
+typedef gboolean (*ExistsFilterAddFunc) (const char *store_id,
+                                         int version,
+                                         const char *obj_id,
+                                         void *user_data);
+
+/* Call @add for every object in the store. Returns -1 on error. */
+typedef int (*ExistsFilterScanFunc) (void *scan_data,
+                                     const char *store_id,
+                                     int version,
+                                     ExistsFilterAddFunc add,
+                                     void *add_data);
+
+ExistsFilter *
+exists_filter_new (ExistsFilterScanFunc scan, void *scan_data);
+
+/* Returns FALSE only if @obj_id is definitely not in the store. */
+gboolean
+exists_filter_may_contain (ExistsFilter *filter,
+                           const char *store_id,
+                           int version,
+                           const char *obj_id);
+
+/*
+ * Copy the bloom filter of a store, so that others can test against it
+ * without asking us each time. Bit n is bit (n % 8) of byte n / 8; an id
+ * is hashed as in bloom_test(). Like exists_filter_may_contain(), the
+ * first call starts building the filter.
+ *
+ * Returns: 0 and a new @bits, or -1 if the filter isn't ready yet.
+ */
+int
+exists_filter_export (ExistsFilter *filter,
+                      const char *store_id,
+                      int version,
+                      unsigned char **bits,
+                      guint64 *n_bits,
+                      int *n_hashes);
+
+/* Call after @obj_id has been written to the store. */
+void
+exists_filter_add (ExistsFilter *filter,
+                   const char *store_id,
+                   const char *obj_id);
+
+/* Drop the filter of a removed store. */
+void
+exists_filter_remove_store (ExistsFilter *filter, const char *store_id);
+
+#endif
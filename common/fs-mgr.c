@@ -1,5 +1,8 @@
 /* -*- Mode: C; tab-width: 4; indent-tabs-mode: nil; c-basic-offset: 4 -*- */
 
+#if defined(__linux__) && !defined(_GNU_SOURCE)
+#define _GNU_SOURCE             /* copy_file_range() */
+#endif
 #include "common.h"
 
 #include <ccnet.h>
@@ -7,9 +10,13 @@
 #include <sys/stat.h>
 #include <fcntl.h>
 #include <dirent.h>
+#include <pthread.h>
 
 #ifndef WIN32
     #include <arpa/inet.h>
+#else
+    #include <windows.h>
+    #include <io.h>
 #endif
 
 #include <openssl/sha.h>
@@ -20,22 +27,102 @@
 #include "fs-mgr.h"
 #include "block-mgr.h"
 #include "utils.h"
+#include "json-scan.h"
+#include "seaf-sha1.h"
 #include "seaf-utils.h"
+#include "obj-cache.h"
+#include "blocklist-cache.h"
 #include "log.h"
 #include "../common/seafile-crypt.h"
 
 #ifndef SEAFILE_SERVER
 #include "../daemon/vc-utils.h"
 #include "vc-common.h"
+
+#if defined(__linux__)
+#include <sys/ioctl.h>
+#include <linux/fs.h>
+#elif defined(__APPLE__)
+#include <sys/clonefile.h>
+#endif
 #endif  /* SEAFILE_SERVER */
 
 #include "db.h"
 
 #define SEAF_TMP_EXT "~"
 
+/* Files smaller than this are always chunked in the calling thread. */
+#define PARALLEL_CHUNK_MIN_SIZE (16 * 1024 * 1024)
+
+#define MAX_CRYPT_THREADS 4
+
+/* Threads decrypting the blocks of checked out files, shared by all
+ * checkouts.
+ */
+#define MAX_CHECKOUT_CRYPT_THREADS 16
+
+#define MAX_BLOCK_CHECK_THREADS 4
+
+/* Threads of seaf_fs_manager_traverse_tree_parallel(). Traversals are
+ * bound by the latency of reading dirs, not by the CPU.
+ */
+#ifdef SEAFILE_SERVER
+#define DEFAULT_TRAVERSE_THREADS 8
+#else
+#define DEFAULT_TRAVERSE_THREADS 4
+#endif
+
+/* Memory for parsed fs objects, in MB. Split evenly between dirs and
+ * files. Resolved paths get another quarter on top of that, and dir
+ * sizes an eighth.
+ */
+#ifdef SEAFILE_SERVER
+#define DEFAULT_FS_CACHE_SIZE 64
+#else
+#define DEFAULT_FS_CACHE_SIZE 16
+#endif
+
+/* Limit of each store's table in the client's persistent block list
+ * cache, in bytes.
+ */
+#define BLOCKLIST_CACHE_TABLE_SIZE (64 * 1024 * 1024)
+
 struct _SeafFSManagerPriv {
-    /* GHashTable      *seafile_cache; */
-    GHashTable      *bl_cache;
+    /* Parsed objects, keyed by (repo_id, obj_id). Seafiles are shared,
+     * dirs are copied on lookup since callers modify their entries.
+     */
+    ObjCache        *seafile_cache;
+    ObjCache        *dir_cache;
+
+    /* (root_id, path) -> PathCacheEntry. Root ids are immutable, so
+     * entries are only ever evicted.
+     */
+    ObjCache        *path_cache;
+    /* (repo_id, dir_id) -> total size of the files under the dir. */
+    ObjCache        *size_cache;
+    /* file_id -> block ids, kept on disk across restarts. Only used on
+     * the client, where the daemon is the only writer.
+     */
+    BlockListCache  *bl_cache;
+
+    /* Number of threads hashing and writing chunks of large files. */
+    int              chunk_threads;
+
+    /* Number of threads encrypting or decrypting blocks of encrypted
+     * files on the client.
+     */
+    int              crypt_threads;
+
+    /* Reads, decrypts and writes the blocks of encrypted files being
+     * checked out. NULL if there's only one core to spare.
+     */
+    GThreadPool     *checkout_pool;
+    int              checkout_threads;
+
+    int              traverse_threads;
+
+    /* Number of threads checking and storing uploaded blocks of a file. */
+    int              block_check_threads;
 };
 
 typedef struct SeafileOndisk {
@@ -56,6 +143,34 @@ typedef struct SeafdirOndisk {
     char    dirents[0];
 } __attribute__((gcc_struct, __packed__)) SeafdirOndisk;
 
+/*
+ * Binary format for fs objects of BINARY_FS_REPO_VERSION repos. All
+ * integers are big endian. Objects are not compressed, so that dirs can
+ * be searched in place. The object id is the sha1 of the whole object.
+ *
+ * Dir:  magic "SFD2", n_dirents (32), offset of each dirent from the
+ *       start of the object (32 each), then the dirents in descending
+ *       name order: mode (32), raw id (20 bytes), mtime (64), size (64),
+ *       name_len (16), modifier_len (16), name, modifier.
+ *
+ * File: magic "SFF2", file_size (64), n_blocks (32), raw block ids
+ *       (20 bytes each).
+ */
+#define BINARY_DIR_MAGIC "SFD2"
+#define BINARY_FILE_MAGIC "SFF2"
+#define BINARY_MAGIC_LEN 4
+
+#define BINARY_DIR_HDR_SIZE (BINARY_MAGIC_LEN + 4)
+#define BINARY_DIRENT_BASE_SIZE (4 + 20 + 8 + 8 + 2 + 2)
+#define BINARY_FILE_HDR_SIZE (BINARY_MAGIC_LEN + 8 + 4)
+
+static inline gboolean
+is_binary_object (const uint8_t *data, int len, const char *magic)
+{
+    return (len >= BINARY_MAGIC_LEN &&
+            memcmp (data, magic, BINARY_MAGIC_LEN) == 0);
+}
+
 #ifndef SEAFILE_SERVER
 uint32_t
 calculate_chunk_size (uint64_t total_size);
@@ -64,6 +179,8 @@ write_seafile (SeafFSManager *fs_mgr,
                const char *repo_id, int version,
                CDCFileDescriptor *cdc,
                unsigned char *obj_sha1);
+static void
+checkout_worker (gpointer data, gpointer user_data);
 #endif  /* SEAFILE_SERVER */
 
 SeafFSManager *
@@ -85,10 +202,140 @@ seaf_fs_manager_new (SeafileSession *seaf,
     return mgr;
 }
 
+static gpointer
+seafile_cache_ref (gpointer data)
+{
+    seafile_ref (data);
+    return data;
+}
+
+static gpointer
+seaf_dir_cache_copy (gpointer data);
+
+typedef struct PathCacheEntry {
+    char    obj_id[41];
+    guint32 mode;
+} PathCacheEntry;
+
+static gpointer
+path_cache_entry_copy (gpointer data)
+{
+    return g_memdup (data, sizeof(PathCacheEntry));
+}
+
+static gpointer
+size_cache_entry_copy (gpointer data)
+{
+    return g_memdup (data, sizeof(gint64));
+}
+
+static void
+init_fs_cache (SeafFSManager *mgr, int size_mb)
+{
+    guint64 half = (guint64)size_mb * 1024 * 1024 / 2;
+
+    if (size_mb <= 0)
+        return;
+
+    mgr->priv->seafile_cache = obj_cache_new (half, seafile_cache_ref,
+                                              (GDestroyNotify)seafile_unref);
+    mgr->priv->dir_cache = obj_cache_new (half, seaf_dir_cache_copy,
+                                          (GDestroyNotify)seaf_dir_free);
+    mgr->priv->path_cache = obj_cache_new (half / 2, path_cache_entry_copy,
+                                           g_free);
+    mgr->priv->size_cache = obj_cache_new (half / 4, size_cache_entry_copy,
+                                           g_free);
+
+    mem_stats_register ("file_cache", obj_cache_get_mem_stats,
+                        mgr->priv->seafile_cache);
+    mem_stats_register ("dir_cache", obj_cache_get_mem_stats,
+                        mgr->priv->dir_cache);
+    mem_stats_register ("path_cache", obj_cache_get_mem_stats,
+                        mgr->priv->path_cache);
+    mem_stats_register ("size_cache", obj_cache_get_mem_stats,
+                        mgr->priv->size_cache);
+}
+
+static gboolean
+path_cache_lookup (SeafFSManager *mgr, const char *root_id, const char *path,
+                   char *obj_id, guint32 *mode)
+{
+    PathCacheEntry *entry;
+
+    if (!mgr->priv->path_cache)
+        return FALSE;
+
+    entry = obj_cache_lookup (mgr->priv->path_cache, root_id, path);
+    if (!entry)
+        return FALSE;
+
+    memcpy (obj_id, entry->obj_id, 41);
+    if (mode)
+        *mode = entry->mode;
+    g_free (entry);
+    return TRUE;
+}
+
+static void
+path_cache_insert (SeafFSManager *mgr, const char *root_id, const char *path,
+                   const char *obj_id, guint32 mode)
+{
+    PathCacheEntry entry;
+
+    if (!mgr->priv->path_cache)
+        return;
+
+    memcpy (entry.obj_id, obj_id, 40);
+    entry.obj_id[40] = 0;
+    entry.mode = mode;
+    obj_cache_insert (mgr->priv->path_cache, root_id, path, &entry,
+                      sizeof(entry) + strlen(path) + 96);
+}
+
 int
 seaf_fs_manager_init (SeafFSManager *mgr)
 {
 #ifdef SEAFILE_SERVER
+    GError *error = NULL;
+    int cache_size;
+
+    mgr->priv->chunk_threads = g_key_file_get_integer (seaf->config,
+                                                       "fileserver",
+                                                       "chunk_threads",
+                                                       NULL);
+
+    /* [fileserver]
+     * block_check_threads = 4
+     */
+    mgr->priv->block_check_threads = g_key_file_get_integer (seaf->config,
+                                                             "fileserver",
+                                                             "block_check_threads",
+                                                             NULL);
+    if (mgr->priv->block_check_threads <= 0)
+        mgr->priv->block_check_threads = MIN (get_cpu_count (),
+                                              MAX_BLOCK_CHECK_THREADS);
+
+    /* [fileserver]
+     * traverse_threads = 8
+     */
+    mgr->priv->traverse_threads = g_key_file_get_integer (seaf->config,
+                                                          "fileserver",
+                                                          "traverse_threads",
+                                                          NULL);
+    if (mgr->priv->traverse_threads <= 0)
+        mgr->priv->traverse_threads = DEFAULT_TRAVERSE_THREADS;
+
+    /* [fileserver]
+     * fs_cache_size = 64   # MB, 0 to disable
+     */
+    cache_size = g_key_file_get_integer (seaf->config,
+                                         "fileserver", "fs_cache_size",
+                                         &error);
+    if (error) {
+        cache_size = DEFAULT_FS_CACHE_SIZE;
+        g_clear_error (&error);
+    }
+    init_fs_cache (mgr, cache_size);
 
 #ifdef FULL_FEATURE
     if (seaf_obj_store_init (mgr->obj_store, TRUE, seaf->ev_mgr) < 0) {
@@ -103,6 +350,25 @@ seaf_fs_manager_init (SeafFSManager *mgr)
 #endif
 
 #else
+    /* Don't take all cores from the user. */
+    mgr->priv->crypt_threads = MIN (get_cpu_count () - 1, MAX_CRYPT_THREADS);
+    mgr->priv->checkout_threads = MIN (get_cpu_count () - 1,
+                                       MAX_CHECKOUT_CRYPT_THREADS);
+    if (mgr->priv->checkout_threads > 1)
+        mgr->priv->checkout_pool = g_thread_pool_new (checkout_worker, NULL,
+                                                      mgr->priv->checkout_threads,
+                                                      FALSE, NULL);
+    mgr->priv->traverse_threads = DEFAULT_TRAVERSE_THREADS;
+
+    init_fs_cache (mgr, DEFAULT_FS_CACHE_SIZE);
+
+    /* Syncing without the cache still works, just slower. */
+    char *bl_cache_dir = g_build_filename (seaf->seaf_dir, "blocklist-cache",
+                                           NULL);
+    mgr->priv->bl_cache = blocklist_cache_new (bl_cache_dir,
+                                               BLOCKLIST_CACHE_TABLE_SIZE);
+    g_free (bl_cache_dir);
+
     if (seaf_obj_store_init (mgr->obj_store, TRUE, seaf->ev_mgr) < 0) {
         g_warning ("[fs mgr] Failed to init fs object store.\n");
         return -1;
@@ -113,20 +379,26 @@ seaf_fs_manager_init (SeafFSManager *mgr)
 }
 
 #ifndef SEAFILE_SERVER
+/* Read a block and decrypt it if needed. *content is NULL for an empty
+ * block. Safe to call from several threads.
+ */
 static int
-checkout_block (const char *repo_id,
-                int version,
-                const char *block_id,
-                int wfd,
-                SeafileCrypt *crypt)
+load_block (const char *repo_id,
+            int version,
+            const char *block_id,
+            SeafileCrypt *crypt,
+            char **content,
+            int *len)
 {
     SeafBlockManager *block_mgr = seaf->block_mgr;
     BlockHandle *handle;
     BlockMetadata *bmd;
-    char *dec_out = NULL;
     int dec_out_len = -1;
     char *blk_content = NULL;
 
+    *content = NULL;
+    *len = 0;
+
     handle = seaf_block_manager_open_block (block_mgr,
                                             repo_id, version,
                                             block_id, BLOCK_READ);
@@ -144,6 +416,7 @@ checkout_block (const char *repo_id,
 
     /* empty file, skip it */
     if (bmd->size == 0) {
+        g_free (bmd);
         seaf_block_manager_close_block (block_mgr, handle);
         seaf_block_manager_block_handle_free (block_mgr, handle);
         return 0;
@@ -168,41 +441,25 @@ checkout_block (const char *repo_id,
             goto checkout_blk_error;
         }
 
-        /* decrypt the block */
-        int ret = seafile_decrypt (&dec_out,
-                                   &dec_out_len,
-                                   blk_content,
-                                   bmd->size,
-                                   crypt);
+        /* decrypt the block in place */
+        int ret = seafile_decrypt_to_buf (blk_content,
+                                          &dec_out_len,
+                                          blk_content,
+                                          bmd->size,
+                                          crypt);
 
         if (ret != 0) {
             g_warning ("Decryt block %s failed. \n", block_id);
             goto checkout_blk_error;
         }
 
-        /* write the decrypted content */
-        ret = writen (wfd, dec_out, dec_out_len);
-
-
-        if (ret !=  dec_out_len) {
-            g_warning ("Failed to write the decryted block %s.\n",
-                       block_id);
-            goto checkout_blk_error;
-        }
-
-        g_free (blk_content);
-        g_free (dec_out);
-
+        *len = dec_out_len;
     } else {
-        /* not an encrypted block */
-        if (writen(wfd, blk_content, bmd->size) != bmd->size) {
-            g_warning ("Failed to write the decryted block %s.\n",
-                       block_id);
-            goto checkout_blk_error;
-        }
-        g_free (blk_content);
+        *len = bmd->size;
     }
 
+    *content = blk_content;
+
     g_free (bmd);
     seaf_block_manager_close_block (block_mgr, handle);
     seaf_block_manager_block_handle_free (block_mgr, handle);
@@ -212,8 +469,6 @@ checkout_blk_error:
 
     if (blk_content)
         free (blk_content);
-    if (dec_out)
-        g_free (dec_out);
     if (bmd)
         g_free (bmd);
 
@@ -222,55 +477,259 @@ checkout_blk_error:
     return -1;
 }
 
-int
-seaf_fs_manager_checkout_file (SeafFSManager *mgr,
-                               const char *repo_id,
-                               int version,
-                               const char *file_id,
-                               const char *file_path,
-                               guint32 mode,
-                               guint64 mtime,
-                               SeafileCrypt *crypt,
-                               const char *in_repo_path,
-                               const char *conflict_head_id,
-                               gboolean force_conflict,
-                               gboolean *conflicted,
-                               const char *email)
+static int
+checkout_block (const char *repo_id,
+                int version,
+                const char *block_id,
+                int wfd,
+                SeafileCrypt *crypt)
 {
-    Seafile *seafile;
-    char *blk_id;
+    char *content;
+    int len;
+    int ret = 0;
+
+    if (load_block (repo_id, version, block_id, crypt, &content, &len) < 0)
+        return -1;
+
+    if (content && writen (wfd, content, len) != len) {
+        g_warning ("Failed to write the decryted block %s.\n", block_id);
+        ret = -1;
+    }
+
+    free (content);
+    return ret;
+}
+
+/*
+ * Parallel checkout of encrypted files.
+ *
+ * Decryption is the expensive part of checking out an encrypted file.
+ * Blocks are read and decrypted by a thread pool shared by all checkouts,
+ * a few blocks ahead of the last one written. The offset of a block is
+ * only known once the blocks before it are decrypted, since their
+ * padding is removed. The worker that completes a run of decrypted
+ * blocks from the start writes them in place, so blocks are written on
+ * several threads while the next ones are decrypted.
+ */
+
+/* Blocks loaded ahead of the last one written, per thread. */
+#define CHECKOUT_DEPTH 2
+
+/* Limit of the above per file, so that concurrent checkouts of large
+ * files don't hold too many blocks.
+ */
+#define MAX_CHECKOUT_WINDOW 16
+
+typedef struct CheckoutFile CheckoutFile;
+
+typedef struct CheckoutJob {
+    CheckoutFile *file;
+    const char *block_id;
+    char *content;
+    int len;
+    gint64 offset;
+    int result;
+    gboolean done;
+} CheckoutJob;
+
+struct CheckoutFile {
+    const char *repo_id;
+    int version;
+    SeafileCrypt *crypt;
     int wfd;
-    int i;
-    char *tmp_path;
-    char *conflict_path;
 
-    *conflicted = FALSE;
+    CheckoutJob *jobs;
+    int n_jobs;
+
+    pthread_mutex_t lock;
+    pthread_cond_t cond;
+    int n_done;                 /* jobs read and decrypted, or failed */
+    int n_placed;               /* jobs before this have offsets */
+    gint64 next_offset;
+    int n_writing;              /* workers writing placed blocks */
+    int n_written;
+    gboolean error;
+};
 
-    seafile = seaf_fs_manager_get_seafile (mgr, repo_id, version, file_id);
-    if (!seafile) {
-        g_warning ("File %s does not exist.\n", file_id);
-        return -1;
+static int
+write_at (int fd, const char *buf, int len, gint64 offset)
+{
+#ifdef WIN32
+    HANDLE handle = (HANDLE)_get_osfhandle (fd);
+    OVERLAPPED ol;
+    DWORD n;
+
+    while (len > 0) {
+        memset (&ol, 0, sizeof(ol));
+        ol.Offset = (DWORD)offset;
+        ol.OffsetHigh = (DWORD)(offset >> 32);
+        if (!WriteFile (handle, buf, len, &n, &ol))
+            return -1;
+        buf += n;
+        len -= n;
+        offset += n;
     }
+#else
+    ssize_t n;
 
-    tmp_path = g_strconcat (file_path, SEAF_TMP_EXT, NULL);
+    while (len > 0) {
+        n = pwrite (fd, buf, len, (off_t)offset);
+        if (n < 0) {
+            if (errno == EINTR)
+                continue;
+            return -1;
+        }
+        buf += n;
+        len -= n;
+        offset += n;
+    }
+#endif
 
-    mode_t rmode = mode & 0100 ? 0777 : 0666;
-    wfd = seaf_util_create (tmp_path, O_WRONLY | O_TRUNC | O_CREAT | O_BINARY,
-                            rmode & ~S_IFMT);
-    if (wfd < 0) {
-        g_warning ("Failed to open file %s for checkout: %s.\n",
-                   tmp_path, strerror(errno));
-        goto bad;
+    return 0;
+}
+
+static void
+checkout_worker (gpointer data, gpointer user_data)
+{
+    CheckoutJob *job = data;
+    CheckoutFile *file = job->file;
+    CheckoutJob *placed;
+    char *content = NULL;
+    int len = 0;
+    int result = -1;
+    gboolean error;
+    int start, end, i;
+    gboolean failed = FALSE;
+
+    pthread_mutex_lock (&file->lock);
+    error = file->error;
+    pthread_mutex_unlock (&file->lock);
+
+    /* Don't spend time on a file that can't be checked out. */
+    if (!error)
+        result = load_block (file->repo_id, file->version, job->block_id,
+                             file->crypt, &content, &len);
+
+    pthread_mutex_lock (&file->lock);
+    job->content = content;
+    job->len = len;
+    job->result = result;
+    job->done = TRUE;
+    ++file->n_done;
+    if (result < 0)
+        file->error = TRUE;
+
+    /* Place the blocks decrypted so far. If this job isn't the next one
+     * to be placed, the worker of that job writes this one too.
+     */
+    start = end = file->n_placed;
+    while (!file->error && end < file->n_jobs && file->jobs[end].done) {
+        file->jobs[end].offset = file->next_offset;
+        file->next_offset += file->jobs[end].len;
+        ++end;
+    }
+    file->n_placed = end;
+    if (end > start)
+        ++file->n_writing;
+    pthread_cond_broadcast (&file->cond);
+    pthread_mutex_unlock (&file->lock);
+
+    if (end == start)
+        return;
+
+    for (i = start; i < end; ++i) {
+        placed = &file->jobs[i];
+        if (!failed && placed->content &&
+            write_at (file->wfd, placed->content, placed->len,
+                      placed->offset) < 0) {
+            g_warning ("Failed to write the decryted block %s: %s.\n",
+                       placed->block_id, strerror(errno));
+            failed = TRUE;
+        }
+        free (placed->content);
+        placed->content = NULL;
     }
 
+    pthread_mutex_lock (&file->lock);
+    file->n_written += end - start;
+    --file->n_writing;
+    if (failed)
+        file->error = TRUE;
+    pthread_cond_broadcast (&file->cond);
+    pthread_mutex_unlock (&file->lock);
+}
+
+static int
+checkout_blocks_parallel (Seafile *seafile,
+                          const char *repo_id,
+                          int version,
+                          int wfd,
+                          SeafileCrypt *crypt,
+                          GThreadPool *tpool,
+                          int n_threads)
+{
+    CheckoutFile file;
+    int window = MIN (n_threads * CHECKOUT_DEPTH, MAX_CHECKOUT_WINDOW);
+    int next = 0, i;
+    int ret = 0;
+
+    memset (&file, 0, sizeof(file));
+    file.repo_id = repo_id;
+    file.version = version;
+    file.crypt = crypt;
+    file.wfd = wfd;
+    file.n_jobs = seafile->n_blocks;
+    pthread_mutex_init (&file.lock, NULL);
+    pthread_cond_init (&file.cond, NULL);
+
+    file.jobs = g_new0 (CheckoutJob, seafile->n_blocks);
     for (i = 0; i < seafile->n_blocks; ++i) {
-        blk_id = seafile->blk_sha1s[i];
-        if (checkout_block (repo_id, version, blk_id, wfd, crypt) < 0)
-            goto bad;
+        file.jobs[i].file = &file;
+        file.jobs[i].block_id = seafile->blk_sha1s[i];
     }
 
-    close (wfd);
-    wfd = -1;
+    pthread_mutex_lock (&file.lock);
+    while (file.n_written < file.n_jobs && !file.error) {
+        while (next < file.n_jobs && next < file.n_written + window)
+            g_thread_pool_push (tpool, &file.jobs[next++], NULL);
+        pthread_cond_wait (&file.cond, &file.lock);
+    }
+
+    /* The queued jobs refer to the file, wait until they're done with it. */
+    while (file.n_done < next || file.n_writing > 0)
+        pthread_cond_wait (&file.cond, &file.lock);
+
+    if (file.error)
+        ret = -1;
+    pthread_mutex_unlock (&file.lock);
+
+    for (i = 0; i < file.n_jobs; ++i)
+        free (file.jobs[i].content);
+    g_free (file.jobs);
+
+    pthread_mutex_destroy (&file.lock);
+    pthread_cond_destroy (&file.cond);
+
+    return ret;
+}
+
+/*
+ * Move a fully written @tmp_path to @file_path, or to a conflict file if
+ * @file_path can't be replaced. @tmp_path is removed on failure.
+ */
+static int
+install_checkout_file (const char *repo_id,
+                       int version,
+                       const char *tmp_path,
+                       const char *file_path,
+                       guint64 mtime,
+                       const char *in_repo_path,
+                       const char *conflict_head_id,
+                       gboolean force_conflict,
+                       gboolean *conflicted,
+                       const char *email)
+{
+    char *conflict_path;
 
     if (force_conflict || seaf_util_rename (tmp_path, file_path) < 0) {
         *conflicted = TRUE;
@@ -333,50 +792,267 @@ seaf_fs_manager_checkout_file (SeafFSManager *mgr,
         }
     }
 
-    g_free (tmp_path);
-    seafile_unref (seafile);
     return 0;
 
 bad:
-    if (wfd >= 0)
-        close (wfd);
     /* Remove the tmp file if it still exists, in case that rename fails. */
     seaf_util_unlink (tmp_path);
-    g_free (tmp_path);
-    seafile_unref (seafile);
     return -1;
 }
 
-#endif /* SEAFILE_SERVER */
-
-static void *
-create_seafile_v0 (CDCFileDescriptor *cdc, int *ondisk_size, char *seafile_id)
+int
+seaf_fs_manager_checkout_file (SeafFSManager *mgr,
+                               const char *repo_id,
+                               int version,
+                               const char *file_id,
+                               const char *file_path,
+                               guint32 mode,
+                               guint64 mtime,
+                               SeafileCrypt *crypt,
+                               const char *in_repo_path,
+                               const char *conflict_head_id,
+                               gboolean force_conflict,
+                               gboolean *conflicted,
+                               const char *email)
 {
-    SeafileOndisk *ondisk;
-
-    rawdata_to_hex (cdc->file_sum, seafile_id, 20);
-
-    *ondisk_size = sizeof(SeafileOndisk) + cdc->block_nr * 20;
-    ondisk = (SeafileOndisk *)g_new0 (char, *ondisk_size);
+    Seafile *seafile;
+    char *blk_id;
+    int wfd;
+    int i;
+    char *tmp_path;
 
-    ondisk->type = htonl(SEAF_METADATA_TYPE_FILE);
-    ondisk->file_size = hton64 (cdc->file_size);
-    memcpy (ondisk->block_ids, cdc->blk_sha1s, cdc->block_nr * 20);
+    *conflicted = FALSE;
 
-    return ondisk;
-}
+    seafile = seaf_fs_manager_get_seafile (mgr, repo_id, version, file_id);
+    if (!seafile) {
+        g_warning ("File %s does not exist.\n", file_id);
+        return -1;
+    }
 
-static void *
-create_seafile_json (int repo_version,
-                     CDCFileDescriptor *cdc,
-                     int *ondisk_size,
-                     char *seafile_id)
-{
-    json_t *object, *block_id_array;
+    tmp_path = g_strconcat (file_path, SEAF_TMP_EXT, NULL);
 
-    object = json_object ();
+    mode_t rmode = mode & 0100 ? 0777 : 0666;
+    wfd = seaf_util_create (tmp_path, O_WRONLY | O_TRUNC | O_CREAT | O_BINARY,
+                            rmode & ~S_IFMT);
+    if (wfd < 0) {
+        g_warning ("Failed to open file %s for checkout: %s.\n",
+                   tmp_path, strerror(errno));
+        goto bad;
+    }
 
-    json_object_set_int_member (object, "type", SEAF_METADATA_TYPE_FILE);
+    if (crypt && mgr->priv->checkout_pool && seafile->n_blocks > 1) {
+        if (checkout_blocks_parallel (seafile, repo_id, version, wfd, crypt,
+                                      mgr->priv->checkout_pool,
+                                      mgr->priv->checkout_threads) < 0)
+            goto bad;
+    } else {
+        for (i = 0; i < seafile->n_blocks; ++i) {
+            blk_id = seafile->blk_sha1s[i];
+            if (checkout_block (repo_id, version, blk_id, wfd, crypt) < 0)
+                goto bad;
+        }
+    }
+
+    close (wfd);
+    wfd = -1;
+
+    if (install_checkout_file (repo_id, version, tmp_path, file_path, mtime,
+                               in_repo_path, conflict_head_id,
+                               force_conflict, conflicted, email) < 0)
+        goto bad;
+
+    g_free (tmp_path);
+    seafile_unref (seafile);
+    return 0;
+
+bad:
+    if (wfd >= 0)
+        close (wfd);
+    seaf_util_unlink (tmp_path);
+    g_free (tmp_path);
+    seafile_unref (seafile);
+    return -1;
+}
+
+/* Whether a file was changed between the two stats. */
+static gboolean
+file_changed (const SeafStat *before, const SeafStat *after)
+{
+    return (before->st_size != after->st_size ||
+            before->st_mtime != after->st_mtime ||
+            before->st_ctime != after->st_ctime);
+}
+
+/*
+ * Copy @src_path to the new file @dst_path. Where the file system supports
+ * it the copy shares the data extents of the source, otherwise the kernel
+ * copies the data without passing it through user space.
+ *
+ * The source is a file in the worktree, which the user may be editing.
+ * The copy fails if the source changed while it was copied.
+ */
+static int
+copy_local_file (const char *src_path, const char *dst_path, mode_t rmode)
+{
+    int rfd = -1, wfd = -1;
+    char buf[64 * 1024];
+    SeafStat before, after;
+    ssize_t n;
+    int ret = -1;
+
+#ifdef __APPLE__
+    /* clonefile() refuses to replace an existing file. */
+    seaf_util_unlink (dst_path);
+    if (seaf_stat (src_path, &before) == 0 &&
+        clonefile (src_path, dst_path, 0) == 0) {
+        if (seaf_stat (src_path, &after) < 0 || file_changed (&before, &after)) {
+            seaf_warning ("%s changed while it was copied.\n", src_path);
+            seaf_util_unlink (dst_path);
+            return -1;
+        }
+        if (chmod (dst_path, rmode & ~S_IFMT) < 0)
+            seaf_warning ("Failed to set mode for %s: %s.\n",
+                          dst_path, strerror(errno));
+        return 0;
+    }
+#endif
+
+    rfd = seaf_util_open (src_path, O_RDONLY | O_BINARY);
+    if (rfd < 0) {
+        seaf_warning ("Failed to open %s: %s.\n", src_path, strerror(errno));
+        goto out;
+    }
+
+    if (seaf_fstat (rfd, &before) < 0) {
+        seaf_warning ("Failed to stat %s: %s.\n", src_path, strerror(errno));
+        goto out;
+    }
+
+    wfd = seaf_util_create (dst_path, O_WRONLY | O_TRUNC | O_CREAT | O_BINARY,
+                            rmode & ~S_IFMT);
+    if (wfd < 0) {
+        seaf_warning ("Failed to open file %s for checkout: %s.\n",
+                      dst_path, strerror(errno));
+        goto out;
+    }
+
+#if defined(__linux__) && defined(FICLONE)
+    if (ioctl (wfd, FICLONE, rfd) == 0)
+        goto check_source;
+#endif
+
+#ifdef HAVE_COPY_FILE_RANGE
+    {
+        gint64 copied = 0;
+
+        while ((n = copy_file_range (rfd, NULL, wfd, NULL, 1 << 30, 0)) > 0)
+            copied += n;
+        if (n == 0)
+            goto check_source;
+        /* Not supported between these files, copy it in user space. */
+        if (copied > 0) {
+            seaf_warning ("Failed to copy %s to %s: %s.\n",
+                          src_path, dst_path, strerror(errno));
+            goto out;
+        }
+    }
+#endif
+
+    while ((n = readn (rfd, buf, sizeof(buf))) > 0) {
+        if (writen (wfd, buf, n) != n) {
+            seaf_warning ("Failed to write %s: %s.\n", dst_path, strerror(errno));
+            goto out;
+        }
+    }
+    if (n < 0) {
+        seaf_warning ("Failed to read %s: %s.\n", src_path, strerror(errno));
+        goto out;
+    }
+
+#if (defined(__linux__) && defined(FICLONE)) || defined(HAVE_COPY_FILE_RANGE)
+check_source:
+#endif
+    if (seaf_fstat (rfd, &after) < 0 || file_changed (&before, &after)) {
+        seaf_warning ("%s changed while it was copied.\n", src_path);
+        goto out;
+    }
+
+    ret = 0;
+
+out:
+    if (rfd >= 0)
+        close (rfd);
+    if (wfd >= 0 && close (wfd) < 0)
+        ret = -1;
+    return ret;
+}
+
+int
+seaf_fs_manager_checkout_file_from_local (SeafFSManager *mgr,
+                                          const char *repo_id,
+                                          int version,
+                                          const char *src_path,
+                                          const char *file_path,
+                                          guint32 mode,
+                                          guint64 mtime,
+                                          const char *in_repo_path,
+                                          const char *conflict_head_id,
+                                          gboolean force_conflict,
+                                          gboolean *conflicted,
+                                          const char *email)
+{
+    char *tmp_path;
+    int ret = 0;
+
+    *conflicted = FALSE;
+
+    tmp_path = g_strconcat (file_path, SEAF_TMP_EXT, NULL);
+
+    if (copy_local_file (src_path, tmp_path, mode & 0100 ? 0777 : 0666) < 0) {
+        seaf_util_unlink (tmp_path);
+        ret = -1;
+        goto out;
+    }
+
+    ret = install_checkout_file (repo_id, version, tmp_path, file_path, mtime,
+                                 in_repo_path, conflict_head_id,
+                                 force_conflict, conflicted, email);
+
+out:
+    g_free (tmp_path);
+    return ret;
+}
+
+#endif /* SEAFILE_SERVER */
+
+static void *
+create_seafile_v0 (CDCFileDescriptor *cdc, int *ondisk_size, char *seafile_id)
+{
+    SeafileOndisk *ondisk;
+
+    rawdata_to_hex (cdc->file_sum, seafile_id, 20);
+
+    *ondisk_size = sizeof(SeafileOndisk) + cdc->block_nr * 20;
+    ondisk = (SeafileOndisk *)g_new0 (char, *ondisk_size);
+
+    ondisk->type = htonl(SEAF_METADATA_TYPE_FILE);
+    ondisk->file_size = hton64 (cdc->file_size);
+    memcpy (ondisk->block_ids, cdc->blk_sha1s, cdc->block_nr * 20);
+
+    return ondisk;
+}
+
+static void *
+create_seafile_json (int repo_version,
+                     CDCFileDescriptor *cdc,
+                     int *ondisk_size,
+                     char *seafile_id)
+{
+    json_t *object, *block_id_array;
+
+    object = json_object ();
+
+    json_object_set_int_member (object, "type", SEAF_METADATA_TYPE_FILE);
     json_object_set_int_member (object, "version",
                                 seafile_version_from_repo_version(repo_version));
 
@@ -405,11 +1081,44 @@ create_seafile_json (int repo_version,
     return data;
 }
 
+static void *
+create_seafile_binary (CDCFileDescriptor *cdc,
+                       int *ondisk_size,
+                       char *seafile_id)
+{
+    uint8_t *data, *ptr;
+    unsigned char sha1[20];
+
+    *ondisk_size = BINARY_FILE_HDR_SIZE + cdc->block_nr * 20;
+    data = g_new (uint8_t, *ondisk_size);
+
+    ptr = data;
+    memcpy (ptr, BINARY_FILE_MAGIC, BINARY_MAGIC_LEN);
+    ptr += BINARY_MAGIC_LEN;
+    put64bit (&ptr, cdc->file_size);
+    put32bit (&ptr, cdc->block_nr);
+    memcpy (ptr, cdc->blk_sha1s, cdc->block_nr * 20);
+
+    calculate_sha1 (sha1, (const char *)data, *ondisk_size);
+    rawdata_to_hex (sha1, seafile_id, 20);
+
+    return data;
+}
+
 void
 seaf_fs_manager_calculate_seafile_id_json (int repo_version,
                                            CDCFileDescriptor *cdc,
                                            guint8 *file_id_sha1)
 {
+    if (repo_version >= BINARY_FS_REPO_VERSION) {
+        char seafile_id[41];
+        int len;
+
+        g_free (create_seafile_binary (cdc, &len, seafile_id));
+        hex_to_rawdata (seafile_id, file_id_sha1, 20);
+        return;
+    }
+
     json_t *object, *block_id_array;
 
     object = json_object ();
@@ -453,7 +1162,14 @@ write_seafile (SeafFSManager *fs_mgr,
     void *ondisk;
     int ondisk_size;
 
-    if (version > 0) {
+    if (version >= BINARY_FS_REPO_VERSION) {
+        ondisk = create_seafile_binary (cdc, &ondisk_size, seafile_id);
+
+        if (seaf_obj_store_write_obj (fs_mgr->obj_store, repo_id, version, seafile_id,
+                                      ondisk, ondisk_size, FALSE) < 0)
+            ret = -1;
+        g_free (ondisk);
+    } else if (version > 0) {
         ondisk = create_seafile_json (version, cdc, &ondisk_size, seafile_id);
 
         guint8 *compressed;
@@ -511,11 +1227,13 @@ do_write_chunk (const char *repo_id, int version,
 
     rawdata_to_hex (checksum, chksum_str, 20);
 
-    /* Don't write if the block already exists. */
+    /* Don't write if the block already exists. It's still used by the
+     * new file, so the commit hook is told about it.
+     */
     if (seaf_block_manager_block_exists (seaf->block_mgr,
                                          repo_id, version,
                                          chksum_str))
-        return 0;
+        return seaf_block_manager_reuse_block (blk_mgr, repo_id, chksum_str);
 
     handle = seaf_block_manager_open_block (blk_mgr,
                                             repo_id, version,
@@ -558,7 +1276,6 @@ seafile_write_chunk (const char *repo_id,
                      uint8_t *checksum,
                      gboolean write_data)
 {
-    SHA_CTX ctx;
     int ret = 0;
 
     /* Encrypt before write to disk if needed, and we don't encrypt
@@ -577,18 +1294,14 @@ seafile_write_chunk (const char *repo_id,
             return -1;
         }
 
-        SHA1_Init (&ctx);
-        SHA1_Update (&ctx, encrypted_buf, enc_len);
-        SHA1_Final (checksum, &ctx);
+        seaf_sha1 (encrypted_buf, enc_len, checksum);
 
         if (write_data)
             ret = do_write_chunk (repo_id, version, checksum, encrypted_buf, enc_len);
         g_free (encrypted_buf);
     } else {
         /* not a encrypted repo, go ahead */
-        SHA1_Init (&ctx);
-        SHA1_Update (&ctx, chunk->block_buf, chunk->len);
-        SHA1_Final (checksum, &ctx);
+        seaf_sha1 (chunk->block_buf, chunk->len, checksum);
 
         if (write_data)
             ret = do_write_chunk (repo_id, version, checksum, chunk->block_buf, chunk->len);
@@ -612,9 +1325,31 @@ seaf_fs_manager_index_blocks (SeafFSManager *mgr,
                               gint64 *size,
                               SeafileCrypt *crypt,
                               gboolean write_data)
+{
+    return seaf_fs_manager_index_blocks_with_map (mgr, repo_id, version,
+                                                  file_path, sha1, size,
+                                                  crypt, write_data,
+                                                  NULL, NULL);
+}
+
+int
+seaf_fs_manager_index_blocks_with_map (SeafFSManager *mgr,
+                                       const char *repo_id,
+                                       int version,
+                                       const char *file_path,
+                                       unsigned char sha1[],
+                                       gint64 *size,
+                                       SeafileCrypt *crypt,
+                                       gboolean write_data,
+                                       const CDCChunkMap *prev_map,
+                                       CDCChunkMap **new_map)
 {
     SeafStat sb;
     CDCFileDescriptor cdc;
+    CDCChunkMap *map = NULL;
+
+    if (new_map)
+        *new_map = NULL;
 
     if (seaf_stat (file_path, &sb) < 0) {
         g_warning ("Bad file %s: %s.\n", file_path, strerror(errno));
@@ -635,14 +1370,28 @@ seaf_fs_manager_index_blocks (SeafFSManager *mgr,
         cdc.write_block = seafile_write_chunk;
         memcpy (cdc.repo_id, repo_id, 36);
         cdc.version = version;
+        if (sb.st_size >= PARALLEL_CHUNK_MIN_SIZE)
+            cdc.n_threads = crypt ? MAX (mgr->priv->chunk_threads,
+                                         mgr->priv->crypt_threads) :
+                                    mgr->priv->chunk_threads;
+#ifdef SEAFILE_SERVER
+        /* Files indexed on the server are private temp files. */
+        cdc.use_mmap = TRUE;
+#endif
+        cdc.prev_map = prev_map;
+        if (new_map)
+            map = cdc.chunk_map = g_new0 (CDCChunkMap, 1);
+
         if (filename_chunk_cdc (file_path, &cdc, crypt, write_data) < 0) {
             g_warning ("Failed to chunk file with CDC.\n");
-            return -1;
+            goto error;
         }
 
-        if (write_data && write_seafile (mgr, repo_id, version, &cdc, sha1) < 0) {
+        if (!write_data)
+            seaf_fs_manager_calculate_seafile_id_json (version, &cdc, sha1);
+        else if (write_seafile (mgr, repo_id, version, &cdc, sha1) < 0) {
             g_warning ("Failed to write seafile for %s.\n", file_path);
-            return -1;
+            goto error;
         }
     }
 
@@ -650,10 +1399,120 @@ seaf_fs_manager_index_blocks (SeafFSManager *mgr,
 
     if (cdc.blk_sha1s)
         free (cdc.blk_sha1s);
+    if (new_map)
+        *new_map = map;
+
+    return 0;
+
+error:
+    if (cdc.blk_sha1s)
+        free (cdc.blk_sha1s);
+    cdc_chunk_map_free (map);
+    return -1;
+}
+
+struct SeafStreamIndexer {
+    SeafFSManager *mgr;
+    CDCFileDescriptor cdc;
+    CDCStream *stream;
+};
+
+gboolean
+seaf_stream_indexer_supports_size (gint64 max_size)
+{
+    return (max_size >= 0 &&
+            calculate_chunk_size (max_size) == calculate_chunk_size (0));
+}
+
+SeafStreamIndexer *
+seaf_stream_indexer_new (SeafFSManager *mgr,
+                         const char *repo_id,
+                         int version,
+                         gint64 max_size,
+                         SeafileCrypt *crypt)
+{
+    SeafStreamIndexer *indexer;
+    CDCFileDescriptor *cdc;
+
+    /* Blocks would be cut differently than by index_blocks(), and would
+     * not be shared with other copies of the file. */
+    if (!seaf_stream_indexer_supports_size (max_size)) {
+        seaf_warning ("Can't stream files of up to %"G_GINT64_FORMAT" bytes.\n",
+                      max_size);
+        return NULL;
+    }
+
+    indexer = g_new0 (SeafStreamIndexer, 1);
+    cdc = &indexer->cdc;
+    indexer->mgr = mgr;
+
+    cdc->block_sz = calculate_chunk_size (max_size);
+    cdc->block_min_sz = cdc->block_sz >> 2;
+    cdc->block_max_sz = cdc->block_sz << 2;
+    cdc->write_block = seafile_write_chunk;
+    memcpy (cdc->repo_id, repo_id, 36);
+    cdc->version = version;
+    if (max_size >= PARALLEL_CHUNK_MIN_SIZE)
+        cdc->n_threads = crypt ? MAX (mgr->priv->chunk_threads,
+                                      mgr->priv->crypt_threads) :
+                                 mgr->priv->chunk_threads;
+
+    /* @max_size may cover more than this file, so let the block list
+     * grow instead of sizing it up front.
+     */
+    indexer->stream = cdc_stream_new (cdc, 0, crypt, TRUE);
+    if (!indexer->stream) {
+        g_free (indexer);
+        return NULL;
+    }
+
+    return indexer;
+}
+
+int
+seaf_stream_indexer_feed (SeafStreamIndexer *indexer,
+                          const void *data,
+                          size_t len)
+{
+    return cdc_stream_feed (indexer->stream, data, len);
+}
+
+int
+seaf_stream_indexer_finish (SeafStreamIndexer *indexer,
+                            unsigned char sha1[],
+                            gint64 *size)
+{
+    CDCFileDescriptor *cdc = &indexer->cdc;
+
+    if (cdc_stream_finish (indexer->stream) < 0) {
+        seaf_warning ("Failed to chunk file with CDC.\n");
+        return -1;
+    }
 
+    if (cdc->file_size == 0) {
+        /* Empty files have no seafile object, like in index_blocks. */
+        memset (sha1, 0, 20);
+    } else if (write_seafile (indexer->mgr, cdc->repo_id, cdc->version,
+                              cdc, sha1) < 0) {
+        seaf_warning ("Failed to write seafile.\n");
+        return -1;
+    }
+
+    *size = (gint64)cdc->file_size;
     return 0;
 }
 
+void
+seaf_stream_indexer_free (SeafStreamIndexer *indexer)
+{
+    if (!indexer)
+        return;
+
+    cdc_stream_free (indexer->stream);
+    free (indexer->cdc.blk_sha1s);
+    g_free (indexer);
+}
+
 static int
 check_and_write_block (const char *repo_id, int version,
                        const char *path, unsigned char *sha1, const char *block_id)
@@ -671,12 +1530,9 @@ check_and_write_block (const char *repo_id, int version,
         }
     }
 
-    SHA_CTX block_ctx;
     unsigned char checksum[20];
 
-    SHA1_Init (&block_ctx);
-    SHA1_Update (&block_ctx, content, len);
-    SHA1_Final (checksum, &block_ctx);
+    seaf_sha1 (content, len, checksum);
 
     if (memcmp (checksum, sha1, 20) != 0) {
         seaf_warning ("Block id %s doesn't match content.\n", block_id);
@@ -694,34 +1550,83 @@ out:
     return ret;
 }
 
+/*
+ * Uploaded blocks are checked against their ids and written to the block
+ * store by a thread pool. Only the file id depends on the block order,
+ * and it only needs the block ids.
+ */
+
+typedef struct BlockCheckJob {
+    const char *path;
+    const char *block_id;
+    unsigned char sha1[20];
+    int result;
+} BlockCheckJob;
+
+static void
+block_check_worker (gpointer data, gpointer user_data)
+{
+    BlockCheckJob *job = data;
+    CDCFileDescriptor *cdc = user_data;
+
+    job->result = check_and_write_block (cdc->repo_id, cdc->version,
+                                         job->path, job->sha1, job->block_id);
+}
+
 static int
-check_and_write_file_blocks (CDCFileDescriptor *cdc, GList *paths, GList *blockids)
+check_and_write_file_blocks (CDCFileDescriptor *cdc, GList *paths, GList *blockids,
+                             int n_threads)
 {
     GList *ptr, *q;
-    SHA_CTX file_ctx;
+    SeafSHA1Ctx file_ctx;
+    BlockCheckJob *jobs;
+    GThreadPool *tpool = NULL;
+    int n_jobs = g_list_length (paths);
+    int i;
     int ret = 0;
 
-    SHA1_Init (&file_ctx);
-    for (ptr = paths, q = blockids; ptr; ptr = ptr->next, q = q->next) {
-        char *path = ptr->data;
-        char *blk_id = q->data;
-        unsigned char sha1[20];
+    jobs = g_new0 (BlockCheckJob, n_jobs);
+    for (ptr = paths, q = blockids, i = 0; ptr; ptr = ptr->next, q = q->next, ++i) {
+        jobs[i].path = ptr->data;
+        jobs[i].block_id = q->data;
+        hex_to_rawdata (jobs[i].block_id, jobs[i].sha1, 20);
+    }
+
+    if (n_threads > 1 && n_jobs > 1)
+        tpool = g_thread_pool_new (block_check_worker, cdc,
+                                   MIN (n_threads, n_jobs), FALSE, NULL);
+
+    if (tpool) {
+        for (i = 0; i < n_jobs; ++i)
+            g_thread_pool_push (tpool, &jobs[i], NULL);
+        /* Wait for all the jobs. */
+        g_thread_pool_free (tpool, FALSE, TRUE);
+    } else {
+        for (i = 0; i < n_jobs; ++i) {
+            block_check_worker (&jobs[i], cdc);
+            if (jobs[i].result < 0)
+                break;
+        }
+    }
 
-        hex_to_rawdata (blk_id, sha1, 20);
-        ret = check_and_write_block (cdc->repo_id, cdc->version, path, sha1, blk_id);
-        if (ret < 0)
+    seaf_sha1_init (&file_ctx);
+    for (i = 0; i < n_jobs; ++i) {
+        if (jobs[i].result < 0) {
+            ret = -1;
             goto out;
+        }
 
         memcpy (cdc->blk_sha1s + cdc->block_nr * CHECKSUM_LENGTH,
-                sha1, CHECKSUM_LENGTH);
+                jobs[i].sha1, CHECKSUM_LENGTH);
         cdc->block_nr++;
 
-        SHA1_Update (&file_ctx, sha1, 20);
+        seaf_sha1_update (&file_ctx, jobs[i].sha1, 20);
     }
 
-    SHA1_Final (cdc->file_sum, &file_ctx);
+    seaf_sha1_final (cdc->file_sum, &file_ctx);
 
 out:
+    g_free (jobs);
     return ret;
 }
 
@@ -770,7 +1675,8 @@ seaf_fs_manager_index_file_blocks (SeafFSManager *mgr,
             goto out;
         }
 
-        if (check_and_write_file_blocks (&cdc, paths, blockids) < 0) {
+        if (check_and_write_file_blocks (&cdc, paths, blockids,
+                                         mgr->priv->block_check_threads) < 0) {
             seaf_warning ("Failed to check and write file blocks.\n");
             ret = -1;
             goto out;
@@ -790,10 +1696,11 @@ out:
     return ret;
 }
 
+/* Seafiles are shared by the cache and several threads. */
 void
 seafile_ref (Seafile *seafile)
 {
-    ++seafile->ref_count;
+    g_atomic_int_inc (&seafile->ref_count);
 }
 
 static void
@@ -816,7 +1723,7 @@ seafile_unref (Seafile *seafile)
     if (!seafile)
         return;
 
-    if (--seafile->ref_count <= 0)
+    if (g_atomic_int_dec_and_test (&seafile->ref_count))
         seafile_free (seafile);
 }
 
@@ -866,6 +1773,47 @@ seafile_from_v0_data (const char *id, const void *data, int len)
     return seafile;
 }
 
+static Seafile *
+seafile_from_binary (const char *id, const uint8_t *data, int len)
+{
+    const uint8_t *ptr = data + BINARY_MAGIC_LEN;
+    Seafile *seafile;
+    guint64 file_size;
+    guint32 n_blocks;
+    int i;
+
+    if (len < BINARY_FILE_HDR_SIZE) {
+        seaf_warning ("[fs mgr] Corrupt seafile object %s.\n", id);
+        return NULL;
+    }
+
+    file_size = get64bit (&ptr);
+    n_blocks = get32bit (&ptr);
+    if (n_blocks != (len - BINARY_FILE_HDR_SIZE) / 20 ||
+        (len - BINARY_FILE_HDR_SIZE) % 20 != 0) {
+        seaf_warning ("[fs mgr] Corrupt seafile object %s.\n", id);
+        return NULL;
+    }
+
+    seafile = g_new0 (Seafile, 1);
+
+    seafile->object.type = SEAF_METADATA_TYPE_FILE;
+    seafile->version = BINARY_SEAFILE_OBJ_VERSION;
+    memcpy (seafile->file_id, id, 40);
+    seafile->file_size = file_size;
+    seafile->n_blocks = n_blocks;
+
+    seafile->blk_sha1s = g_new0 (char *, n_blocks);
+    for (i = 0; i < n_blocks; ++i) {
+        seafile->blk_sha1s[i] = g_new (char, 41);
+        rawdata_to_hex (ptr, seafile->blk_sha1s[i], 20);
+        ptr += 20;
+    }
+
+    seafile->ref_count = 1;
+    return seafile;
+}
+
 static Seafile *
 seafile_from_json_object (const char *id, json_t *object)
 {
@@ -925,12 +1873,102 @@ seafile_from_json_object (const char *id, json_t *object)
     return seafile;
 }
 
-static Seafile *
-seafile_from_json (const char *id, void *data, int len)
+/* Block ids go straight into their 41-byte buffers. */
+static int
+scan_block_ids (JsonScan *scan, GPtrArray *blk_sha1s)
 {
-    guint8 *decompressed;
-    int outlen;
-    json_t *object = NULL;
+    JsonScanStr str;
+    char *blk_sha1;
+    int rc;
+
+    if (json_scan_enter_array (scan) < 0)
+        return -1;
+
+    while ((rc = json_scan_next_element (scan)) > 0) {
+        if (json_scan_string (scan, &str) < 0 || str.escaped || str.len != 40)
+            return -1;
+        blk_sha1 = g_new (char, 41);
+        memcpy (blk_sha1, str.s, 40);
+        blk_sha1[40] = '\0';
+        g_ptr_array_add (blk_sha1s, blk_sha1);
+    }
+
+    return rc;
+}
+
+/*
+ * Parse a seafile object without building a jansson tree. Returns NULL
+ * if the object is invalid, or uses anything the scanner doesn't
+ * handle, and leaves the reporting to the jansson parser.
+ */
+static Seafile *
+seafile_from_json_scan (const char *id, const char *data, int len)
+{
+    JsonScan scan;
+    JsonScanStr key;
+    GPtrArray *blk_sha1s;
+    gint64 type = 0, version = 0, file_size = 0;
+    gboolean has_blocks = FALSE;
+    Seafile *seafile = NULL;
+    int rc;
+
+    /* Block ids take 43 bytes with the quotes and comma. */
+    blk_sha1s = g_ptr_array_sized_new (len / 43 + 1);
+
+    json_scan_init (&scan, data, len);
+    if (json_scan_enter_object (&scan) < 0)
+        goto out;
+
+    while ((rc = json_scan_next_member (&scan, &key)) > 0) {
+        if (json_scan_str_equal (&key, "block_ids")) {
+            /* Keep the last one, like jansson does for duplicate keys. */
+            g_ptr_array_foreach (blk_sha1s, (GFunc)g_free, NULL);
+            g_ptr_array_set_size (blk_sha1s, 0);
+            rc = scan_block_ids (&scan, blk_sha1s);
+            has_blocks = TRUE;
+        } else if (json_scan_str_equal (&key, "size"))
+            rc = json_scan_int (&scan, &file_size);
+        else if (json_scan_str_equal (&key, "type"))
+            rc = json_scan_int (&scan, &type);
+        else if (json_scan_str_equal (&key, "version"))
+            rc = json_scan_int (&scan, &version);
+        else
+            rc = json_scan_skip (&scan);
+        if (rc < 0)
+            goto out;
+    }
+    if (rc < 0 || json_scan_finish (&scan) < 0)
+        goto out;
+
+    if (type != SEAF_METADATA_TYPE_FILE || version < 1 || !has_blocks)
+        goto out;
+
+    seafile = g_new0 (Seafile, 1);
+
+    seafile->object.type = SEAF_METADATA_TYPE_FILE;
+    memcpy (seafile->file_id, id, 40);
+    seafile->version = (int)version;
+    seafile->file_size = (guint64)file_size;
+    seafile->n_blocks = blk_sha1s->len;
+    seafile->blk_sha1s = (char **)g_ptr_array_free (blk_sha1s, FALSE);
+    blk_sha1s = NULL;
+
+    seafile->ref_count = 1;
+
+out:
+    if (blk_sha1s) {
+        g_ptr_array_foreach (blk_sha1s, (GFunc)g_free, NULL);
+        g_ptr_array_free (blk_sha1s, TRUE);
+    }
+    return seafile;
+}
+
+static Seafile *
+seafile_from_json (const char *id, void *data, int len)
+{
+    guint8 *decompressed;
+    int outlen;
+    json_t *object = NULL;
     json_error_t error;
     Seafile *seafile;
 
@@ -939,6 +1977,12 @@ seafile_from_json (const char *id, void *data, int len)
         return NULL;
     }
 
+    seafile = seafile_from_json_scan (id, (const char *)decompressed, outlen);
+    if (seafile) {
+        g_free (decompressed);
+        return seafile;
+    }
+
     object = json_loadb ((const char *)decompressed, outlen, 0, &error);
     g_free (decompressed);
     if (!object) {
@@ -958,7 +2002,9 @@ seafile_from_json (const char *id, void *data, int len)
 static Seafile *
 seafile_from_data (const char *id, void *data, int len, gboolean is_json)
 {
-    if (is_json)
+    if (is_json && is_binary_object (data, len, BINARY_FILE_MAGIC))
+        return seafile_from_binary (id, data, len);
+    else if (is_json)
         return seafile_from_json (id, data, len);
     else
         return seafile_from_v0_data (id, data, len);
@@ -974,14 +2020,6 @@ seaf_fs_manager_get_seafile (SeafFSManager *mgr,
     int len;
     Seafile *seafile;
 
-#if 0
-    seafile = g_hash_table_lookup (mgr->priv->seafile_cache, file_id);
-    if (seafile) {
-        seafile_ref (seafile);
-        return seafile;
-    }
-#endif
-
     if (memcmp (file_id, EMPTY_SHA1, 40) == 0) {
         seafile = g_new0 (Seafile, 1);
         memset (seafile->file_id, '0', 40);
@@ -989,6 +2027,12 @@ seaf_fs_manager_get_seafile (SeafFSManager *mgr,
         return seafile;
     }
 
+    if (mgr->priv->seafile_cache) {
+        seafile = obj_cache_lookup (mgr->priv->seafile_cache, repo_id, file_id);
+        if (seafile)
+            return seafile;
+    }
+
     if (seaf_obj_store_read_obj (mgr->obj_store, repo_id, version,
                                  file_id, &data, &len) < 0) {
         g_warning ("[fs mgr] Failed to read file %s.\n", file_id);
@@ -998,13 +2042,9 @@ seaf_fs_manager_get_seafile (SeafFSManager *mgr,
     seafile = seafile_from_data (file_id, data, len, (version > 0));
     g_free (data);
 
-#if 0
-    /*
-     * Add to cache. Also increase ref count.
-     */
-    seafile_ref (seafile);
-    g_hash_table_insert (mgr->priv->seafile_cache, g_strdup(file_id), seafile);
-#endif
+    if (seafile && mgr->priv->seafile_cache)
+        obj_cache_insert (mgr->priv->seafile_cache, repo_id, file_id, seafile,
+                          sizeof(Seafile) + seafile->n_blocks * (sizeof(char *) + 48));
 
     return seafile;
 }
@@ -1060,10 +2100,38 @@ seafile_to_json (Seafile *file, int *len)
     return (guint8 *)data;
 }
 
+static guint8 *
+seafile_to_binary (Seafile *file, int *len)
+{
+    uint8_t *data, *ptr;
+    unsigned char sha1[20];
+    int i;
+
+    *len = BINARY_FILE_HDR_SIZE + file->n_blocks * 20;
+    data = g_new (uint8_t, *len);
+
+    ptr = data;
+    memcpy (ptr, BINARY_FILE_MAGIC, BINARY_MAGIC_LEN);
+    ptr += BINARY_MAGIC_LEN;
+    put64bit (&ptr, file->file_size);
+    put32bit (&ptr, file->n_blocks);
+    for (i = 0; i < file->n_blocks; ++i) {
+        hex_to_rawdata (file->blk_sha1s[i], ptr, 20);
+        ptr += 20;
+    }
+
+    calculate_sha1 (sha1, (const char *)data, *len);
+    rawdata_to_hex (sha1, file->file_id, 20);
+
+    return data;
+}
+
 static guint8 *
 seafile_to_data (Seafile *file, int *len)
 {
-    if (file->version > 0) {
+    if (file->version >= BINARY_SEAFILE_OBJ_VERSION)
+        return seafile_to_binary (file, len);
+    else if (file->version > 0) {
         guint8 *data;
         int orig_len;
         guint8 *compressed;
@@ -1107,7 +2175,7 @@ seafile_save (SeafFSManager *fs_mgr,
 
 static void compute_dir_id_v0 (SeafDir *dir, GList *entries)
 {
-    SHA_CTX ctx;
+    SeafSHA1Ctx ctx;
     GList *p;
     uint8_t sha1[20];
     SeafDirent *dent;
@@ -1119,19 +2187,19 @@ static void compute_dir_id_v0 (SeafDir *dir, GList *entries)
         return;
     }
 
-    SHA1_Init (&ctx);
+    seaf_sha1_init (&ctx);
     for (p = entries; p; p = p->next) {
         dent = (SeafDirent *)p->data;
-        SHA1_Update (&ctx, dent->id, 40);
-        SHA1_Update (&ctx, dent->name, dent->name_len);
+        seaf_sha1_update (&ctx, dent->id, 40);
+        seaf_sha1_update (&ctx, dent->name, dent->name_len);
         /* Convert mode to little endian before compute. */
         if (G_BYTE_ORDER == G_BIG_ENDIAN)
             mode_le = GUINT32_SWAP_LE_BE (dent->mode);
         else
             mode_le = dent->mode;
-        SHA1_Update (&ctx, &mode_le, sizeof(mode_le));
+        seaf_sha1_update (&ctx, &mode_le, sizeof(mode_le));
     }
-    SHA1_Final (sha1, &ctx);
+    seaf_sha1_final (sha1, &ctx);
 
     rawdata_to_hex (sha1, dir->dir_id, 20);
 }
@@ -1166,6 +2234,12 @@ seaf_dir_free (SeafDir *dir)
     if (dir == NULL)
         return;
 
+    if (dir->in_arena) {
+        g_free (dir->ondisk);
+        g_free (dir);
+        return;
+    }
+
     GList *ptr = dir->entries;
     while (ptr) {
         seaf_dirent_free ((SeafDirent *)ptr->data);
@@ -1224,6 +2298,146 @@ seaf_dirent_dup (SeafDirent *dent)
     return new_dent;
 }
 
+/* Deep copy of a dir loaded from disk, for the dir cache. */
+static gpointer
+seaf_dir_cache_copy (gpointer data)
+{
+    SeafDir *dir = data, *copy;
+    GList *entries = NULL, *ptr;
+
+    for (ptr = dir->entries; ptr; ptr = ptr->next)
+        entries = g_list_prepend (entries, seaf_dirent_dup (ptr->data));
+
+    copy = g_new0 (SeafDir, 1);
+    copy->object.type = dir->object.type;
+    copy->version = dir->version;
+    memcpy (copy->dir_id, dir->dir_id, 41);
+    copy->entries = g_list_reverse (entries);
+
+    return copy;
+}
+
+/* Rough heap usage of @dir, including allocator overhead. */
+static guint64
+seaf_dir_mem_size (SeafDir *dir)
+{
+    GList *ptr;
+    SeafDirent *dent;
+    guint64 size = sizeof(SeafDir);
+
+    for (ptr = dir->entries; ptr; ptr = ptr->next) {
+        dent = ptr->data;
+        size += sizeof(GList) + sizeof(SeafDirent) + dent->name_len + 48;
+        if (dent->modifier)
+            size += strlen (dent->modifier) + 16;
+    }
+
+    return size;
+}
+
+/*
+ * Arena dirs. The layout of the single allocation is the SeafDir, then
+ * n GList nodes, n SeafDirents, and the nul-terminated strings.
+ */
+
+typedef struct DirArena {
+    SeafDir     *dir;
+    GList       *links;
+    SeafDirent  *dents;
+    char        *strings;
+    int          n;
+} DirArena;
+
+static void
+dir_arena_init (DirArena *arena, const char *dir_id, int version,
+                int n_dirents, gsize str_size)
+{
+    char *base;
+
+    base = g_malloc0 (sizeof(SeafDir) +
+                      n_dirents * (sizeof(GList) + sizeof(SeafDirent)) +
+                      str_size);
+
+    arena->dir = (SeafDir *)base;
+    arena->links = (GList *)(base + sizeof(SeafDir));
+    arena->dents = (SeafDirent *)(arena->links + n_dirents);
+    arena->strings = (char *)(arena->dents + n_dirents);
+    arena->n = 0;
+
+    arena->dir->object.type = SEAF_METADATA_TYPE_DIR;
+    arena->dir->version = version;
+    memcpy (arena->dir->dir_id, dir_id, 40);
+    arena->dir->in_arena = TRUE;
+}
+
+static char *
+dir_arena_strndup (DirArena *arena, const char *str, int len)
+{
+    char *ret = arena->strings;
+
+    memcpy (ret, str, len);
+    ret[len] = 0;
+    arena->strings += len + 1;
+    return ret;
+}
+
+/* Append a dirent with @name. The caller fills in the other fields. */
+static SeafDirent *
+dir_arena_add (DirArena *arena, const char *name, int name_len)
+{
+    SeafDirent *dent = &arena->dents[arena->n];
+    GList *link = &arena->links[arena->n];
+
+    dent->version = arena->dir->version;
+    dent->name_len = name_len;
+    dent->name = dir_arena_strndup (arena, name, name_len);
+
+    link->data = dent;
+    if (arena->n > 0) {
+        link->prev = link - 1;
+        link->prev->next = link;
+    } else
+        arena->dir->entries = link;
+    ++arena->n;
+
+    return dent;
+}
+
+static gpointer
+seaf_dir_arena_copy (gpointer data)
+{
+    SeafDir *dir = data;
+    DirArena arena;
+    SeafDirent *dent, *copy;
+    GList *ptr;
+    int n = 0;
+    gsize str_size = 0;
+
+    for (ptr = dir->entries; ptr; ptr = ptr->next) {
+        dent = ptr->data;
+        str_size += dent->name_len + 1;
+        if (dent->modifier)
+            str_size += strlen (dent->modifier) + 1;
+        ++n;
+    }
+
+    dir_arena_init (&arena, dir->dir_id, dir->version, n, str_size);
+    for (ptr = dir->entries; ptr; ptr = ptr->next) {
+        dent = ptr->data;
+        copy = dir_arena_add (&arena, dent->name, dent->name_len);
+        copy->version = dent->version;
+        copy->mode = dent->mode;
+        memcpy (copy->id, dent->id, 41);
+        copy->mtime = dent->mtime;
+        copy->size = dent->size;
+        if (dent->modifier)
+            copy->modifier = dir_arena_strndup (&arena, dent->modifier,
+                                                strlen (dent->modifier));
+    }
+
+    return arena.dir;
+}
+
 static SeafDir *
 seaf_dir_from_v0_data (const char *dir_id, const uint8_t *data, int len)
 {
@@ -1382,51 +2596,668 @@ seaf_dir_from_json_object (const char *dir_id, json_t *object)
         }
         dir->entries = g_list_prepend (dir->entries, dirent);
     }
-    dir->entries = g_list_reverse (dir->entries);
+    dir->entries = g_list_reverse (dir->entries);
+
+    return dir;
+}
+
+static SeafDir *
+seaf_dir_from_json_object_arena (const char *dir_id, json_t *object)
+{
+    json_t *dirent_array, *dirent_obj;
+    DirArena arena;
+    SeafDirent *dent;
+    int version, i;
+    size_t n_dirents;
+    guint32 mode;
+    const char *id, *name, *modifier;
+    gsize str_size = 0;
+
+    if (json_object_get_int_member (object, "type") != SEAF_METADATA_TYPE_DIR) {
+        seaf_warning ("Object %s is not a dir.\n", dir_id);
+        return NULL;
+    }
+
+    version = (int) json_object_get_int_member (object, "version");
+    if (version < 1) {
+        seaf_warning ("Dir object %s version should be > 0, version is %d.\n",
+                      dir_id, version);
+        return NULL;
+    }
+
+    dirent_array = json_object_get (object, "dirents");
+    if (!dirent_array) {
+        seaf_warning ("No dirents in dir object %s.\n", dir_id);
+        return NULL;
+    }
+
+    /* Validate and size the arena first. */
+    n_dirents = json_array_size (dirent_array);
+    for (i = 0; i < n_dirents; ++i) {
+        dirent_obj = json_array_get (dirent_array, i);
+        mode = (guint32) json_object_get_int_member (dirent_obj, "mode");
+        id = json_object_get_string_member (dirent_obj, "id");
+        name = json_object_get_string_member (dirent_obj, "name");
+        if (!id || !name) {
+            seaf_warning ("Dirent id or name not set for dir object %s.\n",
+                          dir_id);
+            return NULL;
+        }
+        str_size += strlen(name) + 1;
+        if (S_ISREG(mode)) {
+            modifier = json_object_get_string_member (dirent_obj, "modifier");
+            if (!modifier) {
+                seaf_warning ("Dirent modifier not set for dir object %s.\n",
+                              dir_id);
+                return NULL;
+            }
+            str_size += strlen(modifier) + 1;
+        }
+    }
+
+    dir_arena_init (&arena, dir_id, version, n_dirents, str_size);
+
+    for (i = 0; i < n_dirents; ++i) {
+        dirent_obj = json_array_get (dirent_array, i);
+        name = json_object_get_string_member (dirent_obj, "name");
+        dent = dir_arena_add (&arena, name, strlen(name));
+        dent->mode = (guint32) json_object_get_int_member (dirent_obj, "mode");
+        memcpy (dent->id, json_object_get_string_member (dirent_obj, "id"), 40);
+        dent->mtime = json_object_get_int_member (dirent_obj, "mtime");
+        if (S_ISREG(dent->mode)) {
+            modifier = json_object_get_string_member (dirent_obj, "modifier");
+            dent->modifier = dir_arena_strndup (&arena, modifier,
+                                                strlen(modifier));
+            dent->size = json_object_get_int_member (dirent_obj, "size");
+        }
+    }
+
+    return arena.dir;
+}
+
+typedef struct ScannedDirent {
+    guint32 mode;
+    JsonScanStr id;
+    JsonScanStr name;
+    JsonScanStr modifier;
+    gboolean has_modifier;
+    gint64 mtime;
+    gint64 size;
+} ScannedDirent;
+
+/* Called for each dirent of a scanned dir object, in order. */
+typedef int (*ScanDirentFunc) (const ScannedDirent *dent, void *data);
+
+static int
+scan_dirent (JsonScan *scan, ScannedDirent *dent)
+{
+    JsonScanStr key;
+    gboolean has_id = FALSE, has_name = FALSE;
+    gint64 mode = 0;
+    int rc;
+
+    memset (dent, 0, sizeof(*dent));
+
+    if (json_scan_enter_object (scan) < 0)
+        return -1;
+
+    while ((rc = json_scan_next_member (scan, &key)) > 0) {
+        if (json_scan_str_equal (&key, "id")) {
+            rc = json_scan_string (scan, &dent->id);
+            has_id = TRUE;
+        } else if (json_scan_str_equal (&key, "mode"))
+            rc = json_scan_int (scan, &mode);
+        else if (json_scan_str_equal (&key, "modifier")) {
+            rc = json_scan_string (scan, &dent->modifier);
+            dent->has_modifier = TRUE;
+        } else if (json_scan_str_equal (&key, "mtime"))
+            rc = json_scan_int (scan, &dent->mtime);
+        else if (json_scan_str_equal (&key, "name")) {
+            rc = json_scan_string (scan, &dent->name);
+            has_name = TRUE;
+        } else if (json_scan_str_equal (&key, "size"))
+            rc = json_scan_int (scan, &dent->size);
+        else
+            rc = json_scan_skip (scan);
+        if (rc < 0)
+            return -1;
+    }
+    if (rc < 0)
+        return -1;
+
+    dent->mode = (guint32)mode;
+    if (!has_id || dent->id.escaped || dent->id.len != 40 || !has_name ||
+        (S_ISREG(dent->mode) && !dent->has_modifier))
+        return -1;
+
+    return 0;
+}
+
+/*
+ * Scan a dir object, calling @func for each dirent. Returns -1 if the
+ * object is invalid, or uses anything the scanner doesn't handle, so
+ * that it can be parsed with jansson instead.
+ */
+static int
+scan_dir_object (const char *data, int len, ScanDirentFunc func, void *cb_data,
+                 int *version)
+{
+    JsonScan scan;
+    JsonScanStr key;
+    ScannedDirent dent;
+    gint64 type = 0, v = 0;
+    gboolean has_dirents = FALSE;
+    int rc;
+
+    json_scan_init (&scan, data, len);
+    if (json_scan_enter_object (&scan) < 0)
+        return -1;
+
+    while ((rc = json_scan_next_member (&scan, &key)) > 0) {
+        if (json_scan_str_equal (&key, "dirents")) {
+            /* Callers can't take back dirents of a duplicate key. */
+            if (has_dirents || json_scan_enter_array (&scan) < 0)
+                return -1;
+            while ((rc = json_scan_next_element (&scan)) > 0) {
+                if (scan_dirent (&scan, &dent) < 0 || func (&dent, cb_data) < 0)
+                    return -1;
+            }
+            has_dirents = TRUE;
+        } else if (json_scan_str_equal (&key, "type"))
+            rc = json_scan_int (&scan, &type);
+        else if (json_scan_str_equal (&key, "version"))
+            rc = json_scan_int (&scan, &v);
+        else
+            rc = json_scan_skip (&scan);
+        if (rc < 0)
+            return -1;
+    }
+    if (rc < 0 || json_scan_finish (&scan) < 0)
+        return -1;
+
+    if (type != SEAF_METADATA_TYPE_DIR || v < 1 || !has_dirents)
+        return -1;
+
+    *version = (int)v;
+    return 0;
+}
+
+static int
+add_scanned_dirent (const ScannedDirent *sd, void *vdirents)
+{
+    GList **dirents = vdirents;
+    SeafDirent *dirent;
+    int len;
+
+    dirent = g_new0 (SeafDirent, 1);
+    dirent->mode = sd->mode;
+    memcpy (dirent->id, sd->id.s, 40);
+    dirent->mtime = sd->mtime;
+
+    dirent->name = g_malloc (sd->name.len + 1);
+    len = json_scan_str_copy (&sd->name, dirent->name);
+    if (len < 0)
+        goto bad;
+    dirent->name_len = len;
+
+    if (S_ISREG(dirent->mode)) {
+        dirent->modifier = json_scan_str_dup (&sd->modifier);
+        if (!dirent->modifier)
+            goto bad;
+        dirent->size = sd->size;
+    }
+
+    *dirents = g_list_prepend (*dirents, dirent);
+    return 0;
+
+bad:
+    seaf_dirent_free (dirent);
+    return -1;
+}
+
+static SeafDir *
+seaf_dir_from_json_scan (const char *dir_id, const char *data, int len)
+{
+    GList *dirents = NULL, *ptr;
+    SeafDir *dir;
+    int version;
+
+    if (scan_dir_object (data, len, add_scanned_dirent, &dirents, &version) < 0) {
+        g_list_free_full (dirents, (GDestroyNotify)seaf_dirent_free);
+        return NULL;
+    }
+
+    dir = g_new0 (SeafDir, 1);
+
+    dir->object.type = SEAF_METADATA_TYPE_DIR;
+    memcpy (dir->dir_id, dir_id, 40);
+    dir->version = version;
+
+    /* The version comes after the dirents. */
+    for (ptr = dirents; ptr; ptr = ptr->next)
+        ((SeafDirent *)ptr->data)->version = version;
+    dir->entries = g_list_reverse (dirents);
+
+    return dir;
+}
+
+static int
+size_scanned_dirent (const ScannedDirent *sd, void *vsizes)
+{
+    gsize *sizes = vsizes;
+
+    /* Unescaped strings are never longer. */
+    ++sizes[0];
+    sizes[1] += sd->name.len + 1;
+    if (S_ISREG(sd->mode))
+        sizes[1] += sd->modifier.len + 1;
+    return 0;
+}
+
+/* Copy @str into the arena, unescaped. Returns its length, or -1. */
+static int
+dir_arena_scan_str (DirArena *arena, const JsonScanStr *str, char **ret)
+{
+    int len = json_scan_str_copy (str, arena->strings);
+
+    if (len < 0)
+        return -1;
+    *ret = arena->strings;
+    arena->strings += len + 1;
+    return len;
+}
+
+static int
+arena_add_scanned_dirent (const ScannedDirent *sd, void *varena)
+{
+    DirArena *arena = varena;
+    SeafDirent *dent;
+    char *name;
+    int name_len;
+
+    if (sd->name.escaped) {
+        name = json_scan_str_dup (&sd->name);
+        if (!name)
+            return -1;
+        dent = dir_arena_add (arena, name, strlen(name));
+        g_free (name);
+    } else {
+        dent = dir_arena_add (arena, sd->name.s, sd->name.len);
+    }
+
+    dent->mode = sd->mode;
+    memcpy (dent->id, sd->id.s, 40);
+    dent->mtime = sd->mtime;
+    if (S_ISREG(dent->mode)) {
+        if (dir_arena_scan_str (arena, &sd->modifier, &dent->modifier) < 0)
+            return -1;
+        dent->size = sd->size;
+    }
+
+    return 0;
+}
+
+static SeafDir *
+seaf_dir_from_json_scan_arena (const char *dir_id, const char *data, int len)
+{
+    DirArena arena;
+    /* Number of dirents and size of their strings. */
+    gsize sizes[2] = { 0, 0 };
+    int version;
+
+    /* Validate and size the arena first. */
+    if (scan_dir_object (data, len, size_scanned_dirent, sizes, &version) < 0)
+        return NULL;
+
+    dir_arena_init (&arena, dir_id, version, (int)sizes[0], sizes[1]);
+
+    if (scan_dir_object (data, len, arena_add_scanned_dirent, &arena,
+                         &version) < 0) {
+        seaf_dir_free (arena.dir);
+        return NULL;
+    }
+
+    return arena.dir;
+}
+
+static SeafDir *
+seaf_dir_from_json (const char *dir_id, uint8_t *data, int len,
+                    gboolean arena)
+{
+    guint8 *decompressed;
+    int outlen;
+    json_t *object = NULL;
+    json_error_t error;
+    SeafDir *dir;
+
+    if (seaf_decompress (data, len, &decompressed, &outlen) < 0) {
+        seaf_warning ("Failed to decompress dir object %s.\n", dir_id);
+        return NULL;
+    }
+
+    if (arena)
+        dir = seaf_dir_from_json_scan_arena (dir_id, (const char *)decompressed,
+                                             outlen);
+    else
+        dir = seaf_dir_from_json_scan (dir_id, (const char *)decompressed,
+                                       outlen);
+    if (dir) {
+        g_free (decompressed);
+        return dir;
+    }
+
+    object = json_loadb ((const char *)decompressed, outlen, 0, &error);
+    g_free (decompressed);
+    if (!object) {
+        if (error.text)
+            g_warning ("Failed to load seafdir json object: %s.\n", error.text);
+        else
+            g_warning ("Failed to load seafdir json object.\n");
+        return NULL;
+    }
+
+    if (arena)
+        dir = seaf_dir_from_json_object_arena (dir_id, object);
+    else
+        dir = seaf_dir_from_json_object (dir_id, object);
+
+    json_decref (object);
+    return dir;
+}
+
+/*
+ * Check the header and offset table of a binary dir object.
+ * Returns the number of dirents, or -1 if the object is corrupt.
+ */
+static int
+binary_dir_check (const char *dir_id, const uint8_t *data, int len)
+{
+    const uint8_t *ptr = data + BINARY_MAGIC_LEN;
+    guint32 n_dirents;
+
+    if (len < BINARY_DIR_HDR_SIZE)
+        goto bad;
+
+    n_dirents = get32bit (&ptr);
+    if (n_dirents > (len - BINARY_DIR_HDR_SIZE) /
+                    (4 + BINARY_DIRENT_BASE_SIZE))
+        goto bad;
+
+    return (int)n_dirents;
+
+bad:
+    seaf_warning ("[fs mgr] Corrupt dir object %s.\n", dir_id);
+    return -1;
+}
+
+/*
+ * Locate dirent @i of a checked binary dir object. Sets @name and
+ * @name_len, and returns a pointer to the start of the dirent, or NULL
+ * if it doesn't fit in the object.
+ */
+static const uint8_t *
+binary_dirent_at (const uint8_t *data, int len, int i,
+                  const char **name, int *name_len)
+{
+    const uint8_t *ptr = data + BINARY_DIR_HDR_SIZE + i * 4;
+    const uint8_t *dent, *p;
+    guint32 off;
+    guint16 nlen, mlen;
+
+    off = get32bit (&ptr);
+    if (off > len || len - off < BINARY_DIRENT_BASE_SIZE)
+        return NULL;
+
+    dent = data + off;
+    p = dent + BINARY_DIRENT_BASE_SIZE - 4;
+    nlen = get16bit (&p);
+    mlen = get16bit (&p);
+    if (len - off - BINARY_DIRENT_BASE_SIZE < nlen + mlen)
+        return NULL;
+
+    *name = (const char *)p;
+    *name_len = nlen;
+    return dent;
+}
+
+static SeafDirent *
+binary_dirent_parse (const uint8_t *dent)
+{
+    const uint8_t *ptr = dent;
+    SeafDirent *dirent;
+    guint16 name_len, modifier_len;
+
+    dirent = g_new0 (SeafDirent, 1);
+    dirent->version = BINARY_DIR_OBJ_VERSION;
+    dirent->mode = get32bit (&ptr);
+    rawdata_to_hex (ptr, dirent->id, 20);
+    ptr += 20;
+    dirent->mtime = (gint64)get64bit (&ptr);
+    dirent->size = (gint64)get64bit (&ptr);
+    name_len = get16bit (&ptr);
+    modifier_len = get16bit (&ptr);
+
+    dirent->name_len = name_len;
+    dirent->name = g_strndup ((const char *)ptr, name_len);
+    ptr += name_len;
+    if (S_ISREG(dirent->mode))
+        dirent->modifier = g_strndup ((const char *)ptr, modifier_len);
+    else
+        dirent->size = 0;
+
+    return dirent;
+}
+
+static SeafDir *
+seaf_dir_from_binary (const char *dir_id, const uint8_t *data, int len)
+{
+    SeafDir *dir;
+    const uint8_t *dent;
+    const char *name;
+    int n_dirents, name_len, i;
+
+    n_dirents = binary_dir_check (dir_id, data, len);
+    if (n_dirents < 0)
+        return NULL;
+
+    dir = g_new0 (SeafDir, 1);
+
+    dir->object.type = SEAF_METADATA_TYPE_DIR;
+    memcpy (dir->dir_id, dir_id, 40);
+    dir->version = BINARY_DIR_OBJ_VERSION;
+
+    /* Prepend from the end to keep the on-disk order. */
+    for (i = n_dirents - 1; i >= 0; --i) {
+        dent = binary_dirent_at (data, len, i, &name, &name_len);
+        if (!dent) {
+            seaf_warning ("[fs mgr] Corrupt dir object %s.\n", dir_id);
+            seaf_dir_free (dir);
+            return NULL;
+        }
+        dir->entries = g_list_prepend (dir->entries,
+                                       binary_dirent_parse (dent));
+    }
+
+    return dir;
+}
+
+/* Compare like strcmp(), for names that are not nul-terminated. */
+static inline int
+compare_names (const char *a, int a_len, const char *b, int b_len)
+{
+    int ret = memcmp (a, b, MIN (a_len, b_len));
+
+    if (ret != 0)
+        return ret;
+    return a_len - b_len;
+}
+
+/*
+ * Binary search @name in a binary dir object, without parsing the other
+ * dirents. Returns 1 and sets @dirent if found, 0 if not found, -1 if
+ * the object is corrupt.
+ */
+static int
+binary_dir_lookup (const char *dir_id, const uint8_t *data, int len,
+                   const char *name, SeafDirent **dirent)
+{
+    int n_dirents, lo, hi, mid, cmp;
+    int name_len = strlen (name), dname_len;
+    const char *dname;
+    const uint8_t *dent;
+
+    n_dirents = binary_dir_check (dir_id, data, len);
+    if (n_dirents < 0)
+        return -1;
+
+    /* Names are in descending order. */
+    lo = 0;
+    hi = n_dirents;
+    while (lo < hi) {
+        mid = lo + (hi - lo) / 2;
+        dent = binary_dirent_at (data, len, mid, &dname, &dname_len);
+        if (!dent) {
+            seaf_warning ("[fs mgr] Corrupt dir object %s.\n", dir_id);
+            return -1;
+        }
+
+        cmp = compare_names (name, name_len, dname, dname_len);
+        if (cmp == 0) {
+            *dirent = binary_dirent_parse (dent);
+            return 1;
+        } else if (cmp > 0)
+            hi = mid;
+        else
+            lo = mid + 1;
+    }
+
+    return 0;
+}
+
+static SeafDir *
+seaf_dir_from_v0_data_arena (const char *dir_id, const uint8_t *data, int len)
+{
+    DirArena arena;
+    SeafDirent *dent;
+    const uint8_t *ptr, *p;
+    int remain, n = 0, dirent_base_size;
+    guint32 name_len, mode;
+    gsize str_size = 0;
+
+    ptr = data;
+    if (len < sizeof(SeafdirOndisk) ||
+        get32bit (&ptr) != SEAF_METADATA_TYPE_DIR) {
+        g_warning ("Data does not contain a directory.\n");
+        return NULL;
+    }
+
+    /* First pass to size the arena. */
+    dirent_base_size = 2 * sizeof(guint32) + 40;
+    ptr = data + 4;
+    remain = len - 4;
+    while (remain > dirent_base_size) {
+        p = ptr + 4 + 40;
+        name_len = get32bit (&p);
+        remain -= dirent_base_size;
+        if (remain < name_len) {
+            g_warning ("Bad data format for dir objcet %s.\n", dir_id);
+            return NULL;
+        }
+        str_size += MIN (name_len, SEAF_DIR_NAME_LEN - 1) + 1;
+        ptr += dirent_base_size + name_len;
+        remain -= name_len;
+        ++n;
+    }
+
+    dir_arena_init (&arena, dir_id, 0, n, str_size);
+
+    ptr = data + 4;
+    while (arena.n < n) {
+        mode = get32bit (&ptr);
+        p = ptr;
+        ptr += 40;
+        name_len = get32bit (&ptr);
+        dent = dir_arena_add (&arena, (const char *)ptr,
+                              MIN (name_len, SEAF_DIR_NAME_LEN - 1));
+        dent->mode = mode;
+        memcpy (dent->id, p, 40);
+        ptr += name_len;
+    }
 
-    return dir;
+    return arena.dir;
 }
 
 static SeafDir *
-seaf_dir_from_json (const char *dir_id, uint8_t *data, int len)
+seaf_dir_from_binary_arena (const char *dir_id, const uint8_t *data, int len)
 {
-    guint8 *decompressed;
-    int outlen;
-    json_t *object = NULL;
-    json_error_t error;
-    SeafDir *dir;
+    DirArena arena;
+    SeafDirent *dent;
+    const uint8_t *ptr;
+    const char *name;
+    int n_dirents, name_len, i;
+    guint16 modifier_len;
+    gsize str_size = 0;
 
-    if (seaf_decompress (data, len, &decompressed, &outlen) < 0) {
-        seaf_warning ("Failed to decompress dir object %s.\n", dir_id);
+    n_dirents = binary_dir_check (dir_id, data, len);
+    if (n_dirents < 0)
         return NULL;
+
+    for (i = 0; i < n_dirents; ++i) {
+        ptr = binary_dirent_at (data, len, i, &name, &name_len);
+        if (!ptr) {
+            seaf_warning ("[fs mgr] Corrupt dir object %s.\n", dir_id);
+            return NULL;
+        }
+        ptr += BINARY_DIRENT_BASE_SIZE - 2;
+        str_size += name_len + get16bit (&ptr) + 2;
     }
 
-    object = json_loadb ((const char *)decompressed, outlen, 0, &error);
-    g_free (decompressed);
-    if (!object) {
-        if (error.text)
-            g_warning ("Failed to load seafdir json object: %s.\n", error.text);
+    dir_arena_init (&arena, dir_id, BINARY_DIR_OBJ_VERSION, n_dirents, str_size);
+
+    for (i = 0; i < n_dirents; ++i) {
+        ptr = binary_dirent_at (data, len, i, &name, &name_len);
+        dent = dir_arena_add (&arena, name, name_len);
+        dent->mode = get32bit (&ptr);
+        rawdata_to_hex (ptr, dent->id, 20);
+        ptr += 20;
+        dent->mtime = (gint64)get64bit (&ptr);
+        dent->size = (gint64)get64bit (&ptr);
+        ptr += 2;
+        modifier_len = get16bit (&ptr);
+        if (S_ISREG(dent->mode))
+            dent->modifier = dir_arena_strndup (&arena, name + name_len,
+                                                modifier_len);
         else
-            g_warning ("Failed to load seafdir json object.\n");
-        return NULL;
+            dent->size = 0;
     }
 
-    dir = seaf_dir_from_json_object (dir_id, object);
-
-    json_decref (object);
-    return dir;
+    return arena.dir;
 }
 
 SeafDir *
 seaf_dir_from_data (const char *dir_id, uint8_t *data, int len,
                     gboolean is_json)
 {
-    if (is_json)
-        return seaf_dir_from_json (dir_id, data, len);
+    if (is_json && is_binary_object (data, len, BINARY_DIR_MAGIC))
+        return seaf_dir_from_binary (dir_id, data, len);
+    else if (is_json)
+        return seaf_dir_from_json (dir_id, data, len, FALSE);
     else
         return seaf_dir_from_v0_data (dir_id, data, len);
 }
 
+static SeafDir *
+seaf_dir_from_data_arena (const char *dir_id, uint8_t *data, int len,
+                          gboolean is_json)
+{
+    if (is_json && is_binary_object (data, len, BINARY_DIR_MAGIC))
+        return seaf_dir_from_binary_arena (dir_id, data, len);
+    else if (is_json)
+        return seaf_dir_from_json (dir_id, data, len, TRUE);
+    else
+        return seaf_dir_from_v0_data_arena (dir_id, data, len);
+}
+
 inline static int
 ondisk_dirent_size (SeafDirent *dirent)
 {
@@ -1518,10 +3349,80 @@ seaf_dir_to_json (SeafDir *dir, int *len)
     return data;
 }
 
+static gint
+compare_dirents (gconstpointer a, gconstpointer b);
+
+static gboolean
+is_dirents_sorted (GList *dirents);
+
+static void *
+seaf_dir_to_binary (SeafDir *dir, int *len)
+{
+    GList *ptr;
+    SeafDirent *dent;
+    int n_dirents, size, modifier_len, i;
+    uint8_t *data, *offsets, *p;
+    unsigned char sha1[20];
+
+    if (!is_dirents_sorted (dir->entries))
+        dir->entries = g_list_sort (dir->entries, compare_dirents);
+
+    n_dirents = g_list_length (dir->entries);
+    size = BINARY_DIR_HDR_SIZE + n_dirents * 4;
+    for (ptr = dir->entries; ptr; ptr = ptr->next) {
+        dent = ptr->data;
+        modifier_len = (S_ISREG(dent->mode) && dent->modifier) ?
+            strlen(dent->modifier) : 0;
+        if (dent->name_len > G_MAXUINT16 || modifier_len > G_MAXUINT16) {
+            seaf_warning ("Dirent %s in dir is too long.\n", dent->name);
+            return NULL;
+        }
+        size += BINARY_DIRENT_BASE_SIZE + dent->name_len + modifier_len;
+    }
+
+    data = g_new (uint8_t, size);
+    memcpy (data, BINARY_DIR_MAGIC, BINARY_MAGIC_LEN);
+    p = data + BINARY_MAGIC_LEN;
+    put32bit (&p, n_dirents);
+
+    offsets = p;
+    p += n_dirents * 4;
+    for (ptr = dir->entries, i = 0; ptr; ptr = ptr->next, ++i) {
+        dent = ptr->data;
+        modifier_len = (S_ISREG(dent->mode) && dent->modifier) ?
+            strlen(dent->modifier) : 0;
+
+        put32bit (&offsets, (guint32)(p - data));
+
+        put32bit (&p, dent->mode);
+        hex_to_rawdata (dent->id, p, 20);
+        p += 20;
+        put64bit (&p, (guint64)dent->mtime);
+        put64bit (&p, S_ISREG(dent->mode) ? (guint64)dent->size : 0);
+        put16bit (&p, dent->name_len);
+        put16bit (&p, modifier_len);
+        memcpy (p, dent->name, dent->name_len);
+        p += dent->name_len;
+        if (modifier_len > 0) {
+            memcpy (p, dent->modifier, modifier_len);
+            p += modifier_len;
+        }
+    }
+
+    *len = size;
+
+    calculate_sha1 (sha1, (const char *)data, size);
+    rawdata_to_hex (sha1, dir->dir_id, 20);
+
+    return data;
+}
+
 void *
 seaf_dir_to_data (SeafDir *dir, int *len)
 {
-    if (dir->version > 0) {
+    if (dir->version >= BINARY_DIR_OBJ_VERSION)
+        return seaf_dir_to_binary (dir, len);
+    else if (dir->version > 0) {
         guint8 *data;
         int orig_len;
         guint8 *compressed;
@@ -1571,14 +3472,18 @@ seaf_fs_manager_get_seafdir (SeafFSManager *mgr,
     int len;
     SeafDir *dir;
 
-    /* TODO: add hash cache */
-
     if (memcmp (dir_id, EMPTY_SHA1, 40) == 0) {
         dir = g_new0 (SeafDir, 1);
         memset (dir->dir_id, '0', 40);
         return dir;
     }
 
+    if (mgr->priv->dir_cache) {
+        dir = obj_cache_lookup (mgr->priv->dir_cache, repo_id, dir_id);
+        if (dir)
+            return dir;
+    }
+
     if (seaf_obj_store_read_obj (mgr->obj_store, repo_id, version,
                                  dir_id, &data, &len) < 0) {
         g_warning ("[fs mgr] Failed to read dir %s.\n", dir_id);
@@ -1588,9 +3493,143 @@ seaf_fs_manager_get_seafdir (SeafFSManager *mgr,
     dir = seaf_dir_from_data (dir_id, data, len, (version > 0));
     g_free (data);
 
+    if (dir && mgr->priv->dir_cache)
+        obj_cache_insert (mgr->priv->dir_cache, repo_id, dir_id, dir,
+                          seaf_dir_mem_size (dir));
+
+    return dir;
+}
+
+SeafDir *
+seaf_fs_manager_get_seafdir_arena (SeafFSManager *mgr,
+                                   const char *repo_id,
+                                   int version,
+                                   const char *dir_id)
+{
+    void *data;
+    int len;
+    SeafDir *dir;
+
+    if (memcmp (dir_id, EMPTY_SHA1, 40) == 0) {
+        dir = g_new0 (SeafDir, 1);
+        memset (dir->dir_id, '0', 40);
+        return dir;
+    }
+
+    if (mgr->priv->dir_cache) {
+        dir = obj_cache_lookup_copy (mgr->priv->dir_cache, repo_id, dir_id,
+                                     seaf_dir_arena_copy);
+        if (dir)
+            return dir;
+    }
+
+    if (seaf_obj_store_read_obj (mgr->obj_store, repo_id, version,
+                                 dir_id, &data, &len) < 0) {
+        g_warning ("[fs mgr] Failed to read dir %s.\n", dir_id);
+        return NULL;
+    }
+
+    dir = seaf_dir_from_data_arena (dir_id, data, len, (version > 0));
+    g_free (data);
+
+    if (dir && mgr->priv->dir_cache)
+        obj_cache_insert (mgr->priv->dir_cache, repo_id, dir_id, dir,
+                          seaf_dir_mem_size (dir));
+
     return dir;
 }
 
+typedef struct PrefetchData {
+    SeafFSManager *mgr;
+    const char *repo_id;
+    int version;
+} PrefetchData;
+
+static gboolean
+prefetch_dir_cb (const char *obj_id, void *data, int len, void *user_data)
+{
+    PrefetchData *pd = user_data;
+    SeafDir *dir;
+
+    /* Errors are reported when the dir is actually read. */
+    if (!data)
+        return TRUE;
+
+    dir = seaf_dir_from_data_arena (obj_id, data, len, (pd->version > 0));
+    if (dir) {
+        obj_cache_insert (pd->mgr->priv->dir_cache, pd->repo_id, obj_id, dir,
+                          seaf_dir_mem_size (dir));
+        seaf_dir_free (dir);
+    }
+
+    return TRUE;
+}
+
+void
+seaf_fs_manager_prefetch_dirs (SeafFSManager *mgr,
+                               const char *repo_id,
+                               int version,
+                               const char **dir_ids,
+                               int n)
+{
+    const char **missing;
+    GHashTable *seen;
+    PrefetchData pd;
+    int i, n_missing = 0;
+
+    if (!mgr->priv->dir_cache || n < 1)
+        return;
+
+    missing = g_new (const char *, n);
+    seen = g_hash_table_new (g_str_hash, g_str_equal);
+    for (i = 0; i < n; ++i) {
+        if (memcmp (dir_ids[i], EMPTY_SHA1, 40) == 0 ||
+            g_hash_table_lookup (seen, dir_ids[i]) ||
+            obj_cache_contains (mgr->priv->dir_cache, repo_id, dir_ids[i]))
+            continue;
+        g_hash_table_insert (seen, (gpointer)dir_ids[i], (gpointer)dir_ids[i]);
+        missing[n_missing++] = dir_ids[i];
+    }
+    g_hash_table_destroy (seen);
+
+    if (n_missing > 0) {
+        pd.mgr = mgr;
+        pd.repo_id = repo_id;
+        pd.version = version;
+        seaf_obj_store_read_objs (mgr->obj_store, repo_id, version,
+                                  missing, n_missing, prefetch_dir_cb, &pd);
+    }
+
+    g_free (missing);
+}
+
+void
+seaf_fs_manager_get_cache_stats (SeafFSManager *mgr,
+                                 ObjCacheStats *dir_stats,
+                                 ObjCacheStats *file_stats)
+{
+    memset (dir_stats, 0, sizeof(ObjCacheStats));
+    memset (file_stats, 0, sizeof(ObjCacheStats));
+
+    if (mgr->priv->dir_cache)
+        obj_cache_get_stats (mgr->priv->dir_cache, dir_stats);
+    if (mgr->priv->seafile_cache)
+        obj_cache_get_stats (mgr->priv->seafile_cache, file_stats);
+}
+
+GPtrArray *
+seaf_fs_manager_get_hot_keys (SeafFSManager *mgr, int type, guint max_keys)
+{
+    ObjCache *cache;
+
+    cache = (type == SEAF_METADATA_TYPE_DIR) ? mgr->priv->dir_cache :
+                                               mgr->priv->seafile_cache;
+    if (!cache)
+        return NULL;
+
+    return obj_cache_get_hot_keys (cache, max_keys);
+}
+
 static gint
 compare_dirents (gconstpointer a, gconstpointer b)
 {
@@ -1712,7 +3751,11 @@ int
 seaf_metadata_type_from_data (const char *obj_id,
                               uint8_t *data, int len, gboolean is_json)
 {
-    if (is_json)
+    if (is_json && is_binary_object (data, len, BINARY_DIR_MAGIC))
+        return SEAF_METADATA_TYPE_DIR;
+    else if (is_json && is_binary_object (data, len, BINARY_FILE_MAGIC))
+        return SEAF_METADATA_TYPE_FILE;
+    else if (is_json)
         return parse_metadata_type_json (obj_id, data, len);
     else
         return parse_metadata_type_v0 (data, len);
@@ -1733,6 +3776,28 @@ fs_object_from_v0_data (const char *obj_id, const uint8_t *data, int len)
     }
 }
 
+/*
+ * Objects are saved with sorted keys, so the first one tells the type,
+ * for picking the scanner. The scanners check the actual type.
+ */
+static int
+guess_json_fs_type (const char *data, int len)
+{
+    JsonScan scan;
+    JsonScanStr key;
+
+    json_scan_init (&scan, data, len);
+    if (json_scan_enter_object (&scan) < 0 ||
+        json_scan_next_member (&scan, &key) <= 0)
+        return SEAF_METADATA_TYPE_INVALID;
+
+    if (json_scan_str_equal (&key, "block_ids"))
+        return SEAF_METADATA_TYPE_FILE;
+    else if (json_scan_str_equal (&key, "dirents"))
+        return SEAF_METADATA_TYPE_DIR;
+    return SEAF_METADATA_TYPE_INVALID;
+}
+
 SeafFSObject *
 fs_object_from_json (const char *obj_id, uint8_t *data, int len)
 {
@@ -1741,13 +3806,27 @@ fs_object_from_json (const char *obj_id, uint8_t *data, int len)
     json_t *object;
     json_error_t error;
     int type;
-    SeafFSObject *fs_obj;
+    SeafFSObject *fs_obj = NULL;
 
     if (seaf_decompress (data, len, &decompressed, &outlen) < 0) {
         seaf_warning ("Failed to decompress fs object %s.\n", obj_id);
         return NULL;
     }
 
+    type = guess_json_fs_type ((const char *)decompressed, outlen);
+    if (type == SEAF_METADATA_TYPE_FILE)
+        fs_obj = (SeafFSObject *)seafile_from_json_scan (obj_id,
+                                                         (const char *)decompressed,
+                                                         outlen);
+    else if (type == SEAF_METADATA_TYPE_DIR)
+        fs_obj = (SeafFSObject *)seaf_dir_from_json_scan (obj_id,
+                                                          (const char *)decompressed,
+                                                          outlen);
+    if (fs_obj) {
+        g_free (decompressed);
+        return fs_obj;
+    }
+
     object = json_loadb ((const char *)decompressed, outlen, 0, &error);
     g_free (decompressed);
     if (!object) {
@@ -1780,7 +3859,11 @@ seaf_fs_object_from_data (const char *obj_id,
                           uint8_t *data, int len,
                           gboolean is_json)
 {
-    if (is_json)
+    if (is_json && is_binary_object (data, len, BINARY_DIR_MAGIC))
+        return (SeafFSObject *)seaf_dir_from_binary (obj_id, data, len);
+    else if (is_json && is_binary_object (data, len, BINARY_FILE_MAGIC))
+        return (SeafFSObject *)seafile_from_binary (obj_id, data, len);
+    else if (is_json)
         return fs_object_from_json (obj_id, data, len);
     else
         return fs_object_from_v0_data (obj_id, data, len);
@@ -1803,7 +3886,7 @@ block_list_new ()
 {
     BlockList *bl = g_new0 (BlockList, 1);
 
-    bl->block_hash = g_hash_table_new_full (g_str_hash, g_str_equal, g_free, NULL);
+    bl->block_set = id_set_new ();
     bl->block_ids = g_ptr_array_new_with_free_func (g_free);
 
     return bl;
@@ -1812,8 +3895,7 @@ block_list_new ()
 void
 block_list_free (BlockList *bl)
 {
-    if (bl->block_hash)
-        g_hash_table_destroy (bl->block_hash);
+    id_set_free (bl->block_set);
     g_ptr_array_free (bl->block_ids, TRUE);
     g_free (bl);
 }
@@ -1821,11 +3903,10 @@ block_list_free (BlockList *bl)
 void
 block_list_insert (BlockList *bl, const char *block_id)
 {
-    if (g_hash_table_lookup (bl->block_hash, block_id))
+    /* Bad ids are kept, so that they fail when the block is read. */
+    if (id_set_add (bl->block_set, block_id) == 0)
         return;
 
-    char *key = g_strdup(block_id);
-    g_hash_table_replace (bl->block_hash, key, key);
     g_ptr_array_add (bl->block_ids, g_strdup(block_id));
     ++bl->n_blocks;
 }
@@ -1836,15 +3917,13 @@ block_list_difference (BlockList *bl1, BlockList *bl2)
     BlockList *bl;
     int i;
     char *block_id;
-    char *key;
 
     bl = block_list_new ();
 
     for (i = 0; i < bl1->block_ids->len; ++i) {
         block_id = g_ptr_array_index (bl1->block_ids, i);
-        if (g_hash_table_lookup (bl2->block_hash, block_id) == NULL) {
-            key = g_strdup(block_id);
-            g_hash_table_replace (bl->block_hash, key, key);
+        if (!id_set_contains (bl2->block_set, block_id)) {
+            id_set_add (bl->block_set, block_id);
             g_ptr_array_add (bl->block_ids, g_strdup(block_id));
             ++bl->n_blocks;
         }
@@ -1896,7 +3975,7 @@ traverse_dir (SeafFSManager *mgr,
     if (stop)
         return 0;
 
-    dir = seaf_fs_manager_get_seafdir (mgr, repo_id, version, id);
+    dir = seaf_fs_manager_get_seafdir_arena (mgr, repo_id, version, id);
     if (!dir) {
         g_warning ("[fs-mgr]get seafdir %s failed\n", id);
         if (skip_errors)
@@ -1925,23 +4004,329 @@ traverse_dir (SeafFSManager *mgr,
         }
     }
 
-    seaf_dir_free (dir);
-    return 0;
+    seaf_dir_free (dir);
+    return 0;
+}
+
+int
+seaf_fs_manager_traverse_tree (SeafFSManager *mgr,
+                               const char *repo_id,
+                               int version,
+                               const char *root_id,
+                               TraverseFSTreeCallback callback,
+                               void *user_data,
+                               gboolean skip_errors)
+{
+    if (strcmp (root_id, EMPTY_SHA1) == 0) {
+        return 0;
+    }
+    return traverse_dir (mgr, repo_id, version, root_id, callback, user_data, skip_errors);
+}
+
+/* Parallel traversal */
+
+#define VISITED_SHARDS 16
+
+struct _FSVisitedSet {
+    IdSet *shards[VISITED_SHARDS];
+    pthread_mutex_t locks[VISITED_SHARDS];
+};
+
+FSVisitedSet *
+fs_visited_set_new (void)
+{
+    FSVisitedSet *set = g_new0 (FSVisitedSet, 1);
+    int i;
+
+    for (i = 0; i < VISITED_SHARDS; ++i) {
+        set->shards[i] = id_set_new ();
+        pthread_mutex_init (&set->locks[i], NULL);
+    }
+
+    return set;
+}
+
+void
+fs_visited_set_free (FSVisitedSet *set)
+{
+    int i;
+
+    if (!set)
+        return;
+
+    for (i = 0; i < VISITED_SHARDS; ++i) {
+        id_set_free (set->shards[i]);
+        pthread_mutex_destroy (&set->locks[i]);
+    }
+    g_free (set);
+}
+
+gboolean
+fs_visited_set_add (FSVisitedSet *set, const char *obj_id)
+{
+    unsigned char raw[20];
+    int shard;
+    gboolean added;
+
+    /* Loading a bad id fails later anyway. */
+    if (hex_to_rawdata (obj_id, raw, 20) < 0)
+        return TRUE;
+    shard = raw[0] & (VISITED_SHARDS - 1);
+
+    pthread_mutex_lock (&set->locks[shard]);
+    added = id_set_add_raw (set->shards[shard], raw);
+    pthread_mutex_unlock (&set->locks[shard]);
+
+    return added;
+}
+
+struct ParallelTraverse;
+
+/* Each worker takes dirs from the head of its own deque and pushes the
+ * subdirs it finds there, so it goes depth first like traverse_dir().
+ * Idle workers steal from the tail of the others' deques, which holds
+ * the dirs closest to the root, i.e. the largest pieces of work.
+ */
+typedef struct TraverseWorker {
+    struct ParallelTraverse *pt;
+    int index;
+    GQueue *deque;
+    pthread_mutex_t lock;
+} TraverseWorker;
+
+typedef struct ParallelTraverse {
+    SeafFSManager *mgr;
+    const char *repo_id;
+    int version;
+    TraverseFSTreeCallback callback;
+    void *user_data;
+    gboolean skip_errors;
+    FSVisitedSet *visited;
+
+    TraverseWorker *workers;
+    int n_workers;
+
+    pthread_mutex_t lock;
+    pthread_cond_t cond;
+    /* Dirs sitting in the deques. */
+    int n_queued;
+    /* Dirs queued or being traversed. The traversal is done at 0. */
+    int n_pending;
+    gboolean failed;
+} ParallelTraverse;
+
+static void
+push_dir (TraverseWorker *worker, const char *dir_id)
+{
+    ParallelTraverse *pt = worker->pt;
+
+    pthread_mutex_lock (&worker->lock);
+    g_queue_push_head (worker->deque, g_strdup(dir_id));
+    pthread_mutex_unlock (&worker->lock);
+
+    pthread_mutex_lock (&pt->lock);
+    ++pt->n_queued;
+    ++pt->n_pending;
+    pthread_cond_signal (&pt->cond);
+    pthread_mutex_unlock (&pt->lock);
+}
+
+static char *
+take_dir (TraverseWorker *worker)
+{
+    ParallelTraverse *pt = worker->pt;
+    TraverseWorker *victim;
+    char *dir_id;
+    int i;
+
+    pthread_mutex_lock (&worker->lock);
+    dir_id = g_queue_pop_head (worker->deque);
+    pthread_mutex_unlock (&worker->lock);
+
+    for (i = 1; !dir_id && i < pt->n_workers; ++i) {
+        victim = &pt->workers[(worker->index + i) % pt->n_workers];
+        pthread_mutex_lock (&victim->lock);
+        dir_id = g_queue_pop_tail (victim->deque);
+        pthread_mutex_unlock (&victim->lock);
+    }
+
+    if (dir_id) {
+        pthread_mutex_lock (&pt->lock);
+        --pt->n_queued;
+        pthread_mutex_unlock (&pt->lock);
+    }
+
+    return dir_id;
+}
+
+static void
+finish_dir (ParallelTraverse *pt, gboolean failed)
+{
+    pthread_mutex_lock (&pt->lock);
+    if (failed)
+        pt->failed = TRUE;
+    if (--pt->n_pending == 0 || pt->failed)
+        pthread_cond_broadcast (&pt->cond);
+    pthread_mutex_unlock (&pt->lock);
+}
+
+/* Returns FALSE if the traversal should fail. */
+static gboolean
+traverse_dir_parallel (TraverseWorker *worker, const char *id)
+{
+    ParallelTraverse *pt = worker->pt;
+    SeafDir *dir;
+    GList *p;
+    SeafDirent *dent;
+    gboolean stop = FALSE;
+
+    if (!pt->callback (pt->mgr, pt->repo_id, pt->version,
+                       id, SEAF_METADATA_TYPE_DIR, pt->user_data, &stop) &&
+        !pt->skip_errors)
+        return FALSE;
+
+    if (stop)
+        return TRUE;
+
+    dir = seaf_fs_manager_get_seafdir_arena (pt->mgr, pt->repo_id,
+                                             pt->version, id);
+    if (!dir) {
+        seaf_warning ("[fs-mgr]get seafdir %s failed\n", id);
+        return pt->skip_errors;
+    }
+
+    for (p = dir->entries; p; p = p->next) {
+        dent = p->data;
+
+        if (pt->visited && !fs_visited_set_add (pt->visited, dent->id))
+            continue;
+
+        if (S_ISREG(dent->mode)) {
+            if (traverse_file (pt->mgr, pt->repo_id, pt->version, dent->id,
+                               pt->callback, pt->user_data,
+                               pt->skip_errors) < 0) {
+                seaf_dir_free (dir);
+                return FALSE;
+            }
+        } else if (S_ISDIR(dent->mode)) {
+            push_dir (worker, dent->id);
+        }
+    }
+
+    seaf_dir_free (dir);
+    return TRUE;
+}
+
+static void *
+traverse_worker (void *vworker)
+{
+    TraverseWorker *worker = vworker;
+    ParallelTraverse *pt = worker->pt;
+    char *dir_id;
+    gboolean ok;
+
+    while (1) {
+        dir_id = take_dir (worker);
+        if (dir_id) {
+            /* Just drain the deques once failed. */
+            ok = g_atomic_int_get (&pt->failed) ? TRUE :
+                traverse_dir_parallel (worker, dir_id);
+            g_free (dir_id);
+            finish_dir (pt, !ok);
+            continue;
+        }
+
+        pthread_mutex_lock (&pt->lock);
+        while (pt->n_queued == 0 && pt->n_pending > 0 && !pt->failed)
+            pthread_cond_wait (&pt->cond, &pt->lock);
+        if (pt->n_pending == 0 || pt->failed) {
+            pthread_mutex_unlock (&pt->lock);
+            break;
+        }
+        pthread_mutex_unlock (&pt->lock);
+    }
+
+    return NULL;
 }
 
 int
-seaf_fs_manager_traverse_tree (SeafFSManager *mgr,
-                               const char *repo_id,
-                               int version,
-                               const char *root_id,
-                               TraverseFSTreeCallback callback,
-                               void *user_data,
-                               gboolean skip_errors)
+seaf_fs_manager_traverse_tree_parallel (SeafFSManager *mgr,
+                                        const char *repo_id,
+                                        int version,
+                                        const char *root_id,
+                                        TraverseFSTreeCallback callback,
+                                        void *user_data,
+                                        gboolean skip_errors,
+                                        FSVisitedSet *visited)
 {
-    if (strcmp (root_id, EMPTY_SHA1) == 0) {
+    ParallelTraverse pt;
+    pthread_t *threads;
+    gboolean *started;
+    char *dir_id;
+    int i, ret = 0;
+
+    if (strcmp (root_id, EMPTY_SHA1) == 0)
+        return 0;
+
+    if (visited && !fs_visited_set_add (visited, root_id))
         return 0;
+
+    memset (&pt, 0, sizeof(pt));
+    pt.mgr = mgr;
+    pt.repo_id = repo_id;
+    pt.version = version;
+    pt.callback = callback;
+    pt.user_data = user_data;
+    pt.skip_errors = skip_errors;
+    pt.visited = visited;
+    pthread_mutex_init (&pt.lock, NULL);
+    pthread_cond_init (&pt.cond, NULL);
+
+    pt.n_workers = MAX (mgr->priv->traverse_threads, 1);
+    pt.workers = g_new0 (TraverseWorker, pt.n_workers);
+    for (i = 0; i < pt.n_workers; ++i) {
+        pt.workers[i].pt = &pt;
+        pt.workers[i].index = i;
+        pt.workers[i].deque = g_queue_new ();
+        pthread_mutex_init (&pt.workers[i].lock, NULL);
     }
-    return traverse_dir (mgr, repo_id, version, root_id, callback, user_data, skip_errors);
+
+    push_dir (&pt.workers[0], root_id);
+
+    threads = g_new0 (pthread_t, pt.n_workers);
+    started = g_new0 (gboolean, pt.n_workers);
+    for (i = 1; i < pt.n_workers; ++i) {
+        if (pthread_create (&threads[i], NULL, traverse_worker,
+                            &pt.workers[i]) == 0)
+            started[i] = TRUE;
+        else
+            seaf_warning ("[fs-mgr] Failed to start traverse thread.\n");
+    }
+
+    /* The calling thread is worker 0. */
+    traverse_worker (&pt.workers[0]);
+
+    for (i = 1; i < pt.n_workers; ++i) {
+        if (started[i])
+            pthread_join (threads[i], NULL);
+    }
+
+    if (pt.failed)
+        ret = -1;
+
+    for (i = 0; i < pt.n_workers; ++i) {
+        while ((dir_id = g_queue_pop_head (pt.workers[i].deque)) != NULL)
+            g_free (dir_id);
+        g_queue_free (pt.workers[i].deque);
+        pthread_mutex_destroy (&pt.workers[i].lock);
+    }
+    g_free (pt.workers);
+    g_free (threads);
+    g_free (started);
+    pthread_mutex_destroy (&pt.lock);
+    pthread_cond_destroy (&pt.cond);
+
+    return ret;
 }
 
 static int
@@ -2023,27 +4408,78 @@ seaf_fs_manager_traverse_path (SeafFSManager *mgr,
     return ret;
 }
 
+typedef struct FillBlocklistData {
+    BlockList *bl;
+    pthread_mutex_t lock;
+} FillBlocklistData;
+
+char **
+seaf_fs_manager_get_file_block_ids (SeafFSManager *mgr,
+                                    const char *repo_id,
+                                    int version,
+                                    const char *file_id,
+                                    int *n_blocks)
+{
+    Seafile *seafile;
+    char **block_ids;
+    int i;
+
+    if (mgr->priv->bl_cache) {
+        block_ids = blocklist_cache_lookup (mgr->priv->bl_cache,
+                                            repo_id, file_id, n_blocks);
+        if (block_ids)
+            return block_ids;
+    }
+
+    seafile = seaf_fs_manager_get_seafile (mgr, repo_id, version, file_id);
+    if (!seafile)
+        return NULL;
+
+    block_ids = g_new0 (char *, seafile->n_blocks + 1);
+    for (i = 0; i < seafile->n_blocks; ++i)
+        block_ids[i] = g_strdup (seafile->blk_sha1s[i]);
+    *n_blocks = seafile->n_blocks;
+
+    if (mgr->priv->bl_cache && memcmp (file_id, EMPTY_SHA1, 40) != 0)
+        blocklist_cache_insert (mgr->priv->bl_cache, repo_id, file_id,
+                                block_ids, *n_blocks);
+
+    seafile_unref (seafile);
+    return block_ids;
+}
+
+void
+seaf_fs_manager_remove_blocklist_cache (SeafFSManager *mgr,
+                                        const char *repo_id)
+{
+    if (mgr->priv->bl_cache)
+        blocklist_cache_remove_store (mgr->priv->bl_cache, repo_id);
+}
+
 static gboolean
 fill_blocklist (SeafFSManager *mgr,
                 const char *repo_id, int version,
                 const char *obj_id, int type,
                 void *user_data, gboolean *stop)
 {
-    BlockList *bl = user_data;
-    Seafile *seafile;
-    int i;
+    FillBlocklistData *data = user_data;
+    char **block_ids;
+    int n_blocks, i;
 
     if (type == SEAF_METADATA_TYPE_FILE) {
-        seafile = seaf_fs_manager_get_seafile (mgr, repo_id, version, obj_id);
-        if (!seafile) {
+        block_ids = seaf_fs_manager_get_file_block_ids (mgr, repo_id, version,
+                                                        obj_id, &n_blocks);
+        if (!block_ids) {
             g_warning ("[fs mgr] Failed to find file %s.\n", obj_id);
             return FALSE;
         }
 
-        for (i = 0; i < seafile->n_blocks; ++i)
-            block_list_insert (bl, seafile->blk_sha1s[i]);
+        pthread_mutex_lock (&data->lock);
+        for (i = 0; i < n_blocks; ++i)
+            block_list_insert (data->bl, block_ids[i]);
+        pthread_mutex_unlock (&data->lock);
 
-        seafile_unref (seafile);
+        g_strfreev (block_ids);
     }
 
     return TRUE;
@@ -2056,9 +4492,21 @@ seaf_fs_manager_populate_blocklist (SeafFSManager *mgr,
                                     const char *root_id,
                                     BlockList *bl)
 {
-    return seaf_fs_manager_traverse_tree (mgr, repo_id, version, root_id,
-                                          fill_blocklist,
-                                          bl, FALSE);
+    FillBlocklistData data;
+    FSVisitedSet *visited;
+    int ret;
+
+    data.bl = bl;
+    pthread_mutex_init (&data.lock, NULL);
+    visited = fs_visited_set_new ();
+
+    ret = seaf_fs_manager_traverse_tree_parallel (mgr, repo_id, version,
+                                                  root_id, fill_blocklist,
+                                                  &data, FALSE, visited);
+
+    fs_visited_set_free (visited);
+    pthread_mutex_destroy (&data.lock);
+    return ret;
 }
 
 gboolean
@@ -2074,6 +4522,27 @@ seaf_fs_manager_object_exists (SeafFSManager *mgr,
     return seaf_obj_store_obj_exists (mgr->obj_store, repo_id, version, id);
 }
 
+int
+seaf_fs_manager_objects_exist (SeafFSManager *mgr,
+                               const char *repo_id,
+                               int version,
+                               const char **ids,
+                               int n,
+                               gboolean *exists)
+{
+    int i, ret;
+
+    ret = seaf_obj_store_objs_exist (mgr->obj_store, repo_id, version,
+                                     ids, n, exists);
+
+    for (i = 0; i < n; ++i) {
+        if (memcmp (ids[i], EMPTY_SHA1, 40) == 0)
+            exists[i] = TRUE;
+    }
+
+    return ret;
+}
+
 void
 seaf_fs_manager_delete_object (SeafFSManager *mgr,
                                const char *repo_id,
@@ -2110,10 +4579,20 @@ get_dir_size (SeafFSManager *mgr, const char *repo_id, int version, const char *
     SeafDir *dir;
     SeafDirent *seaf_dent;
     guint64 size = 0;
-    gint64 result;
+    gint64 result, *cached;
     GList *p;
 
-    dir = seaf_fs_manager_get_seafdir (mgr, repo_id, version, id);
+    /* Dirs are immutable, so are their sizes. */
+    if (mgr->priv->size_cache) {
+        cached = obj_cache_lookup (mgr->priv->size_cache, repo_id, id);
+        if (cached) {
+            result = *cached;
+            g_free (cached);
+            return result;
+        }
+    }
+
+    dir = seaf_fs_manager_get_seafdir_arena (mgr, repo_id, version, id);
     if (!dir)
         return -1;
 
@@ -2145,6 +4624,12 @@ get_dir_size (SeafFSManager *mgr, const char *repo_id, int version, const char *
     }
 
     seaf_dir_free (dir);
+
+    if (mgr->priv->size_cache) {
+        result = (gint64)size;
+        obj_cache_insert (mgr->priv->size_cache, repo_id, id, &result,
+                          sizeof(result) + 96);
+    }
     return size;
 }
 
@@ -2202,60 +4687,243 @@ seaf_fs_manager_count_fs_files (SeafFSManager *mgr,
      return count_dir_files (mgr, repo_id, version, root_id);
 }
 
-SeafDir *
-seaf_fs_manager_get_seafdir_by_path (SeafFSManager *mgr,
-                                     const char *repo_id,
-                                     int version,
-                                     const char *root_id,
-                                     const char *path,
-                                     GError **error)
+SeafDirent *
+seaf_fs_manager_lookup_dirent (SeafFSManager *mgr,
+                               const char *repo_id,
+                               int version,
+                               const char *dir_id,
+                               const char *name,
+                               GError **error)
 {
-    SeafDir *dir;
-    SeafDirent *dent;
-    const char *dir_id = root_id;
-    char *name, *saveptr;
-    char *tmp_path = g_strdup(path);
+    SeafDir *dir = NULL;
+    SeafDirent *dent = NULL;
+    void *data;
+    int len;
+    GList *p;
 
-    dir = seaf_fs_manager_get_seafdir (mgr, repo_id, version, dir_id);
-    if (!dir) {
-        g_set_error (error, SEAFILE_DOMAIN, SEAF_ERR_DIR_MISSING, "directory is missing");
+    if (memcmp (dir_id, EMPTY_SHA1, 40) == 0)
         return NULL;
-    }
 
-    name = strtok_r (tmp_path, "/", &saveptr);
-    while (name != NULL) {
-        GList *l;
-        for (l = dir->entries; l != NULL; l = l->next) {
-            dent = l->data;
+    if (version >= BINARY_FS_REPO_VERSION) {
+        if (seaf_obj_store_read_obj (mgr->obj_store, repo_id, version,
+                                     dir_id, &data, &len) < 0) {
+            seaf_warning ("[fs mgr] Failed to read dir %s.\n", dir_id);
+            g_set_error (error, SEAFILE_DOMAIN, SEAF_ERR_DIR_MISSING,
+                         "directory is missing");
+            return NULL;
+        }
 
-            if (strcmp(dent->name, name) == 0 && S_ISDIR(dent->mode)) {
-                dir_id = dent->id;
-                break;
-            }
+        if (is_binary_object (data, len, BINARY_DIR_MAGIC)) {
+            if (binary_dir_lookup (dir_id, data, len, name, &dent) < 0)
+                g_set_error (error, SEAFILE_DOMAIN, SEAF_ERR_GENERAL,
+                             "corrupt directory");
+            g_free (data);
+            return dent;
         }
 
-        if (!l) {
-            g_set_error (error, SEAFILE_DOMAIN, SEAF_ERR_PATH_NO_EXIST,
-                         "Path does not exists %s", path);
-            seaf_dir_free (dir);
-            dir = NULL;
+        dir = seaf_dir_from_data (dir_id, data, len, TRUE);
+        g_free (data);
+    } else
+        dir = seaf_fs_manager_get_seafdir (mgr, repo_id, version, dir_id);
+
+    if (!dir) {
+        g_set_error (error, SEAFILE_DOMAIN, SEAF_ERR_DIR_MISSING,
+                     "directory is missing");
+        return NULL;
+    }
+
+    for (p = dir->entries; p != NULL; p = p->next) {
+        SeafDirent *d = p->data;
+        if (strcmp (d->name, name) == 0) {
+            dent = seaf_dirent_dup (d);
             break;
         }
+    }
 
-        SeafDir *prev = dir;
-        dir = seaf_fs_manager_get_seafdir (mgr, repo_id, version, dir_id);
-        seaf_dir_free (prev);
+    seaf_dir_free (dir);
+    return dent;
+}
+
+/* Dirents [@offset, @offset + @limit) of a binary dir object. */
+static int
+binary_dir_list (const char *dir_id, const uint8_t *data, int len,
+                 int offset, int limit, int *total, GList **dirents)
+{
+    const uint8_t *dent;
+    const char *name;
+    int n_dirents, name_len, end, i;
+
+    *dirents = NULL;
+
+    n_dirents = binary_dir_check (dir_id, data, len);
+    if (n_dirents < 0)
+        return -1;
+    if (total)
+        *total = n_dirents;
+
+    end = (limit < 0 || limit > n_dirents - offset) ? n_dirents : offset + limit;
+    for (i = end - 1; i >= offset; --i) {
+        dent = binary_dirent_at (data, len, i, &name, &name_len);
+        if (!dent) {
+            seaf_warning ("[fs mgr] Corrupt dir object %s.\n", dir_id);
+            g_list_free_full (*dirents, (GDestroyNotify)seaf_dirent_free);
+            *dirents = NULL;
+            return -1;
+        }
+        *dirents = g_list_prepend (*dirents, binary_dirent_parse (dent));
+    }
 
-        if (!dir) {
+    return 0;
+}
+
+GList *
+seaf_fs_manager_list_dirents (SeafFSManager *mgr,
+                              const char *repo_id,
+                              int version,
+                              const char *dir_id,
+                              int offset,
+                              int limit,
+                              int *total,
+                              GError **error)
+{
+    SeafDir *dir = NULL;
+    GList *dirents = NULL, *p;
+    void *data;
+    int len, n = 0;
+
+    if (total)
+        *total = 0;
+    if (offset < 0)
+        offset = 0;
+
+    if (memcmp (dir_id, EMPTY_SHA1, 40) == 0)
+        return NULL;
+
+    if (version >= BINARY_FS_REPO_VERSION) {
+        if (seaf_obj_store_read_obj (mgr->obj_store, repo_id, version,
+                                     dir_id, &data, &len) < 0) {
+            seaf_warning ("[fs mgr] Failed to read dir %s.\n", dir_id);
             g_set_error (error, SEAFILE_DOMAIN, SEAF_ERR_DIR_MISSING,
                          "directory is missing");
+            return NULL;
+        }
+
+        if (is_binary_object (data, len, BINARY_DIR_MAGIC)) {
+            if (binary_dir_list (dir_id, data, len, offset, limit,
+                                 total, &dirents) < 0)
+                g_set_error (error, SEAFILE_DOMAIN, SEAF_ERR_GENERAL,
+                             "corrupt directory");
+            g_free (data);
+            return dirents;
+        }
+        g_free (data);
+    }
+
+    dir = seaf_fs_manager_get_seafdir_sorted (mgr, repo_id, version, dir_id);
+    if (!dir) {
+        g_set_error (error, SEAFILE_DOMAIN, SEAF_ERR_DIR_MISSING,
+                     "directory is missing");
+        return NULL;
+    }
+
+    for (p = g_list_nth (dir->entries, offset); p != NULL; p = p->next) {
+        if (limit >= 0 && n >= limit)
+            break;
+        dirents = g_list_prepend (dirents, seaf_dirent_dup (p->data));
+        ++n;
+    }
+    if (total)
+        *total = g_list_length (dir->entries);
+
+    seaf_dir_free (dir);
+    return g_list_reverse (dirents);
+}
+
+/*
+ * Find the id of the dir at @path, looking up one dirent per level.
+ * Sets SEAF_ERR_PATH_NO_EXIST if the path doesn't exist or is not a dir.
+ */
+static int
+resolve_dir_id (SeafFSManager *mgr,
+                const char *repo_id,
+                int version,
+                const char *root_id,
+                const char *path,
+                char *dir_id,
+                GError **error)
+{
+    SeafDirent *dent;
+    char *name, *saveptr;
+    char *tmp_path;
+    GError *tmp_error = NULL;
+    guint32 mode;
+    int ret = 0;
+
+    /* Files are cached under the same keys, by path_to_obj_id. */
+    if (path_cache_lookup (mgr, root_id, path, dir_id, &mode)) {
+        if (S_ISDIR(mode))
+            return 0;
+        g_set_error (error, SEAFILE_DOMAIN, SEAF_ERR_PATH_NO_EXIST,
+                     "Path does not exists %s", path);
+        return -1;
+    }
+
+    tmp_path = g_strdup(path);
+
+    memcpy (dir_id, root_id, 40);
+    dir_id[40] = 0;
+
+    name = strtok_r (tmp_path, "/", &saveptr);
+    while (name != NULL) {
+        dent = seaf_fs_manager_lookup_dirent (mgr, repo_id, version,
+                                              dir_id, name, &tmp_error);
+        if (tmp_error) {
+            g_propagate_error (error, tmp_error);
+            ret = -1;
+            break;
+        }
+
+        if (!dent || !S_ISDIR(dent->mode)) {
+            g_set_error (error, SEAFILE_DOMAIN, SEAF_ERR_PATH_NO_EXIST,
+                         "Path does not exists %s", path);
+            seaf_dirent_free (dent);
+            ret = -1;
             break;
         }
 
+        memcpy (dir_id, dent->id, 40);
+        seaf_dirent_free (dent);
+
         name = strtok_r (NULL, "/", &saveptr);
     }
 
+    if (ret == 0)
+        path_cache_insert (mgr, root_id, path, dir_id, S_IFDIR);
+
     g_free (tmp_path);
+    return ret;
+}
+
+SeafDir *
+seaf_fs_manager_get_seafdir_by_path (SeafFSManager *mgr,
+                                     const char *repo_id,
+                                     int version,
+                                     const char *root_id,
+                                     const char *path,
+                                     GError **error)
+{
+    SeafDir *dir;
+    char dir_id[41];
+
+    if (resolve_dir_id (mgr, repo_id, version, root_id, path,
+                        dir_id, error) < 0)
+        return NULL;
+
+    dir = seaf_fs_manager_get_seafdir (mgr, repo_id, version, dir_id);
+    if (!dir)
+        g_set_error (error, SEAFILE_DOMAIN, SEAF_ERR_DIR_MISSING,
+                     "directory is missing");
+
     return dir;
 }
 
@@ -2271,10 +4939,11 @@ seaf_fs_manager_path_to_obj_id (SeafFSManager *mgr,
     char *copy = g_strdup (path);
     int off = strlen(copy) - 1;
     char *slash, *name;
-    SeafDir *base_dir = NULL;
+    char dir_id[41];
     SeafDirent *dent;
-    GList *p;
     char *obj_id = NULL;
+    char *key = NULL;
+    GError *tmp_error = NULL;
 
     while (off >= 0 && copy[off] == '/')
         copy[off--] = 0;
@@ -2288,54 +4957,55 @@ seaf_fs_manager_path_to_obj_id (SeafFSManager *mgr,
         goto out;
     }
 
+    if (path_cache_lookup (mgr, root_id, copy, dir_id, mode)) {
+        obj_id = g_strdup (dir_id);
+        goto out;
+    }
+    key = g_strdup (copy);
+
     slash = strrchr (copy, '/');
     if (!slash) {
-        base_dir = seaf_fs_manager_get_seafdir (mgr, repo_id, version, root_id);
-        if (!base_dir) {
-            g_warning ("Failed to find root dir %s.\n", root_id);
-            g_set_error (error, SEAFILE_DOMAIN, SEAF_ERR_GENERAL, " ");
-            goto out;
-        }
+        memcpy (dir_id, root_id, 40);
+        dir_id[40] = 0;
         name = copy;
     } else {
         *slash = 0;
         name = slash + 1;
-        GError *tmp_error = NULL;
-        base_dir = seaf_fs_manager_get_seafdir_by_path (mgr,
-                                                        repo_id,
-                                                        version,
-                                                        root_id,
-                                                        copy,
-                                                        &tmp_error);
-        if (tmp_error &&
-            !g_error_matches(tmp_error,
-                             SEAFILE_DOMAIN,
-                             SEAF_ERR_PATH_NO_EXIST)) {
+        if (resolve_dir_id (mgr, repo_id, version, root_id, copy,
+                            dir_id, &tmp_error) < 0) {
+            /* The path doesn't exist in this commit. */
+            if (g_error_matches (tmp_error,
+                                 SEAFILE_DOMAIN,
+                                 SEAF_ERR_PATH_NO_EXIST)) {
+                g_clear_error (&tmp_error);
+                goto out;
+            }
             g_warning ("Failed to get dir for %s.\n", copy);
             g_propagate_error (error, tmp_error);
             goto out;
         }
+    }
 
-        /* The path doesn't exist in this commit. */
-        if (!base_dir)
-            goto out;
+    dent = seaf_fs_manager_lookup_dirent (mgr, repo_id, version,
+                                          dir_id, name, &tmp_error);
+    if (tmp_error) {
+        g_warning ("Failed to find dir %s.\n", dir_id);
+        g_propagate_error (error, tmp_error);
+        goto out;
     }
 
-    for (p = base_dir->entries; p != NULL; p = p->next) {
-        dent = p->data;
-        if (strcmp (dent->name, name) == 0) {
-            obj_id = g_strdup (dent->id);
-            if (mode) {
-                *mode = dent->mode;
-            }
-            break;
+    if (dent) {
+        obj_id = g_strdup (dent->id);
+        if (mode) {
+            *mode = dent->mode;
         }
+        path_cache_insert (mgr, root_id, key, dent->id, dent->mode);
+        seaf_dirent_free (dent);
     }
 
 out:
-    if (base_dir)
-        seaf_dir_free (base_dir);
     g_free (copy);
+    g_free (key);
     return obj_id;
 }
 
@@ -2398,36 +5068,26 @@ seaf_fs_manager_get_dirent_by_path (SeafFSManager *mgr,
                                     GError **error)
 {
     SeafDirent *dent = NULL;
-    SeafDir *dir = NULL;
     char *parent_dir = NULL;
     char *file_name = NULL;
+    char dir_id[41];
 
     parent_dir  = g_path_get_dirname(path);
     file_name = g_path_get_basename(path);
 
-    if (strcmp (parent_dir, ".") == 0)
-        dir = seaf_fs_manager_get_seafdir (mgr, repo_id, version, root_id);
-    else
-        dir = seaf_fs_manager_get_seafdir_by_path (mgr, repo_id, version,
-                                                   root_id, parent_dir, error);
-
-    if (!dir) {
+    if (strcmp (parent_dir, ".") == 0) {
+        memcpy (dir_id, root_id, 40);
+        dir_id[40] = 0;
+    } else if (resolve_dir_id (mgr, repo_id, version, root_id, parent_dir,
+                               dir_id, error) < 0) {
         seaf_warning ("dir %s doesn't exist in repo %.8s.\n", parent_dir, repo_id);
         goto out;
     }
 
-    GList *p;
-    for (p = dir->entries; p; p = p->next) {
-        SeafDirent *d = p->data;
-        if (strcmp (d->name, file_name) == 0) {
-            dent = seaf_dirent_dup(d);
-            break;
-        }
-    }
+    dent = seaf_fs_manager_lookup_dirent (mgr, repo_id, version,
+                                          dir_id, file_name, error);
 
 out:
-    if (dir)
-        seaf_dir_free (dir);
     g_free (parent_dir);
     g_free (file_name);
 
@@ -2446,7 +5106,7 @@ verify_seafdir_v0 (const char *dir_id, const uint8_t *data, int len,
     const uint8_t *ptr;
     int remain;
     int dirent_base_size;
-    SHA_CTX ctx;
+    SeafSHA1Ctx ctx;
     uint8_t sha1[20];
     char check_id[41];
 
@@ -2466,7 +5126,7 @@ verify_seafdir_v0 (const char *dir_id, const uint8_t *data, int len,
     }
 
     if (verify_id)
-        SHA1_Init (&ctx);
+        seaf_sha1_init (&ctx);
 
     dirent_base_size = 2 * sizeof(guint32) + 40;
     while (remain > dirent_base_size) {
@@ -2491,16 +5151,16 @@ verify_seafdir_v0 (const char *dir_id, const uint8_t *data, int len,
             if (G_BYTE_ORDER == G_BIG_ENDIAN)
                 mode = GUINT32_SWAP_LE_BE (mode);
 
-            SHA1_Update (&ctx, id, 40);
-            SHA1_Update (&ctx, name, name_len);
-            SHA1_Update (&ctx, &mode, sizeof(mode));
+            seaf_sha1_update (&ctx, id, 40);
+            seaf_sha1_update (&ctx, name, name_len);
+            seaf_sha1_update (&ctx, &mode, sizeof(mode));
         }
     }
 
     if (!verify_id)
         return TRUE;
 
-    SHA1_Final (sha1, &ctx);
+    seaf_sha1_final (sha1, &ctx);
     rawdata_to_hex (sha1, check_id, 20);
 
     if (strcmp (check_id, dir_id) == 0)
@@ -2517,6 +5177,13 @@ verify_fs_object_json (const char *obj_id, uint8_t *data, int len)
     unsigned char sha1[20];
     char hex[41];
 
+    if (is_binary_object (data, len, BINARY_DIR_MAGIC) ||
+        is_binary_object (data, len, BINARY_FILE_MAGIC)) {
+        calculate_sha1 (sha1, (const char *)data, len);
+        rawdata_to_hex (sha1, hex, 20);
+        return (strcmp(hex, obj_id) == 0);
+    }
+
     if (seaf_decompress (data, len, &decompressed, &outlen) < 0) {
         seaf_warning ("Failed to decompress fs object %s.\n", obj_id);
         return FALSE;
@@ -2571,7 +5238,7 @@ static gboolean
 verify_seafile_v0 (const char *id, const void *data, int len, gboolean verify_id)
 {
     const SeafileOndisk *ondisk = data;
-    SHA_CTX ctx;
+    SeafSHA1Ctx ctx;
     uint8_t sha1[20];
     char check_id[41];
 
@@ -2594,9 +5261,9 @@ verify_seafile_v0 (const char *id, const void *data, int len, gboolean verify_id
     if (!verify_id)
         return TRUE;
 
-    SHA1_Init (&ctx);
-    SHA1_Update (&ctx, ondisk->block_ids, len - sizeof(SeafileOndisk));
-    SHA1_Final (sha1, &ctx);
+    seaf_sha1_init (&ctx);
+    seaf_sha1_update (&ctx, ondisk->block_ids, len - sizeof(SeafileOndisk));
+    seaf_sha1_final (sha1, &ctx);
 
     rawdata_to_hex (sha1, check_id, 20);
 
@@ -2700,11 +5367,27 @@ seaf_fs_manager_verify_object (SeafFSManager *mgr,
     return ret;
 }
 
+gboolean
+seaf_fs_manager_verify_object_data (int version,
+                                    const char *obj_id,
+                                    const void *data,
+                                    int len)
+{
+    if (memcmp (obj_id, EMPTY_SHA1, 40) == 0)
+        return TRUE;
+
+    if (version == 0)
+        return verify_fs_object_v0 (obj_id, (uint8_t *)data, len, TRUE);
+    return verify_fs_object_json (obj_id, (uint8_t *)data, len);
+}
+
 int
 dir_version_from_repo_version (int repo_version)
 {
     if (repo_version == 0)
         return 0;
+    else if (repo_version >= BINARY_FS_REPO_VERSION)
+        return BINARY_DIR_OBJ_VERSION;
     else
         return CURRENT_DIR_OBJ_VERSION;
 }
@@ -2714,6 +5397,8 @@ seafile_version_from_repo_version (int repo_version)
 {
     if (repo_version == 0)
         return 0;
+    else if (repo_version >= BINARY_FS_REPO_VERSION)
+        return BINARY_SEAFILE_OBJ_VERSION;
     else
         return CURRENT_SEAFILE_OBJ_VERSION;
 }
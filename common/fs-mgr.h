@@ -6,8 +6,10 @@
 #include <glib.h>
 
 #include "seafile-object.h"
+#include "id-set.h"
 
 #include "obj-store.h"
+#include "obj-cache.h"
 
 #include "cdc/cdc.h"
 #include "../common/seafile-crypt.h"
@@ -15,6 +17,10 @@
 #define CURRENT_DIR_OBJ_VERSION 1
 #define CURRENT_SEAFILE_OBJ_VERSION 1
 
+/* Object versions of BINARY_FS_REPO_VERSION repos. */
+#define BINARY_DIR_OBJ_VERSION 2
+#define BINARY_SEAFILE_OBJ_VERSION 2
+
 typedef struct _SeafFSManager SeafFSManager;
 typedef struct _SeafFSObject SeafFSObject;
 typedef struct _Seafile Seafile;
@@ -79,6 +85,11 @@ struct _SeafDir {
     /* data in on-disk format. */
     void  *ondisk;
     int    ondisk_size;
+
+    /* The dir, its list nodes, dirents and strings are in one allocation.
+     * Such dirs are read-only and freed as a whole by seaf_dir_free().
+     */
+    gboolean in_arena;
 };
 
 SeafDir *
@@ -124,8 +135,7 @@ void
 seaf_fs_object_free (SeafFSObject *obj);
 
 typedef struct {
-    /* TODO: GHashTable may be inefficient when we have large number of IDs. */
-    GHashTable  *block_hash;
+    IdSet       *block_set;
     GPtrArray   *block_ids;
     uint32_t     n_blocks;
     uint32_t     n_valid_blocks;
@@ -182,6 +192,26 @@ seaf_fs_manager_checkout_file (SeafFSManager *mgr,
                                gboolean *conflicted,
                                const char *email);
 
+/*
+ * Like seaf_fs_manager_checkout_file(), but take the content from
+ * @src_path, a file in the worktree known to have the same content.
+ * The copy is cloned where the file system allows. Fails if @src_path
+ * changes while it's copied; take the file from its blocks then.
+ */
+int
+seaf_fs_manager_checkout_file_from_local (SeafFSManager *mgr,
+                                          const char *repo_id,
+                                          int version,
+                                          const char *src_path,
+                                          const char *file_path,
+                                          guint32 mode,
+                                          guint64 mtime,
+                                          const char *in_repo_path,
+                                          const char *conflict_head_id,
+                                          gboolean force_conflict,
+                                          gboolean *conflicted,
+                                          const char *email);
+
 #endif  /* not SEAFILE_SERVER */
 
 /**
@@ -197,6 +227,11 @@ seaf_fs_manager_index_file_blocks (SeafFSManager *mgr,
                                    unsigned char sha1[],
                                    gint64 file_size);
 
+/*
+ * Chunk @file_path and return its file id in @sha1. If @write_data is
+ * FALSE, neither the blocks nor the file object are written, only the id
+ * is computed.
+ */
 int
 seaf_fs_manager_index_blocks (SeafFSManager *mgr,
                               const char *repo_id,
@@ -207,6 +242,64 @@ seaf_fs_manager_index_blocks (SeafFSManager *mgr,
                               SeafileCrypt *crypt,
                               gboolean write_data);
 
+/*
+ * Like seaf_fs_manager_index_blocks(), reusing the blocks of @prev_map,
+ * the chunk map of the previous version of the file, where its data is
+ * unchanged. @prev_map may be NULL. If @new_map is not NULL, it's set to
+ * the chunk map of the file, or NULL for an empty file.
+ */
+int
+seaf_fs_manager_index_blocks_with_map (SeafFSManager *mgr,
+                                       const char *repo_id,
+                                       int version,
+                                       const char *file_path,
+                                       unsigned char sha1[],
+                                       gint64 *size,
+                                       SeafileCrypt *crypt,
+                                       gboolean write_data,
+                                       const CDCChunkMap *prev_map,
+                                       CDCChunkMap **new_map);
+
+/*
+ * Index a file whose content arrives in pieces, e.g. an upload, without
+ * having it on disk. Blocks are written to the block store as soon as
+ * they are cut. @max_size bounds the size of the file and picks the
+ * number of chunking threads. The block size depends on the file size,
+ * which is only known at the end, so every size up to @max_size must get
+ * the same one, see seaf_stream_indexer_supports_size(). Then the file
+ * gets the same id as when indexed from disk with
+ * seaf_fs_manager_index_blocks(). Returns NULL otherwise.
+ *
+ * seaf_stream_indexer_finish() writes the seafile object and returns its
+ * id in @sha1. Always free the indexer, after finishing or to abandon it.
+ * Blocks written for an abandoned file are left to GC.
+ */
+typedef struct SeafStreamIndexer SeafStreamIndexer;
+
+/* Whether files of up to @max_size bytes can be indexed as a stream. */
+gboolean
+seaf_stream_indexer_supports_size (gint64 max_size);
+
+SeafStreamIndexer *
+seaf_stream_indexer_new (SeafFSManager *mgr,
+                         const char *repo_id,
+                         int version,
+                         gint64 max_size,
+                         SeafileCrypt *crypt);
+
+int
+seaf_stream_indexer_feed (SeafStreamIndexer *indexer,
+                          const void *data,
+                          size_t len);
+
+int
+seaf_stream_indexer_finish (SeafStreamIndexer *indexer,
+                            unsigned char sha1[],
+                            gint64 *size);
+
+void
+seaf_stream_indexer_free (SeafStreamIndexer *indexer);
+
 Seafile *
 seaf_fs_manager_get_seafile (SeafFSManager *mgr,
                              const char *repo_id,
@@ -219,6 +312,42 @@ seaf_fs_manager_get_seafdir (SeafFSManager *mgr,
                              int version,
                              const char *dir_id);
 
+/* Hit/miss counters of the parsed dir and file caches. */
+void
+seaf_fs_manager_get_cache_stats (SeafFSManager *mgr,
+                                 ObjCacheStats *dir_stats,
+                                 ObjCacheStats *file_stats);
+
+/*
+ * Keys of the most recently used cached dirs or files, by @type, see
+ * obj_cache_get_hot_keys(). NULL if they aren't cached.
+ */
+GPtrArray *
+seaf_fs_manager_get_hot_keys (SeafFSManager *mgr, int type, guint max_keys);
+
+/*
+ * Like seaf_fs_manager_get_seafdir(), but the dir is allocated as one
+ * block. The caller must not change its entries, or keep its dirents
+ * after seaf_dir_free(). Meant for read-only tree walks.
+ */
+SeafDir *
+seaf_fs_manager_get_seafdir_arena (SeafFSManager *mgr,
+                                   const char *repo_id,
+                                   int version,
+                                   const char *dir_id);
+
+/*
+ * Read the dirs that are not cached yet into the dir cache, all in one
+ * request to the backend. Tree walks call this before descending into
+ * several dirs, so that they don't wait for a round-trip per dir.
+ */
+void
+seaf_fs_manager_prefetch_dirs (SeafFSManager *mgr,
+                               const char *repo_id,
+                               int version,
+                               const char **dir_ids,
+                               int n);
+
 /* Make sure entries in the returned dir is sorted in descending order.
  */
 SeafDir *
@@ -234,6 +363,24 @@ seaf_fs_manager_get_seafdir_sorted_by_path (SeafFSManager *mgr,
                                             const char *root_id,
                                             const char *path);
 
+/*
+ * Get the block ids of file @file_id. The client keeps them in a
+ * persistent cache, so that repeated uploads don't have to read the
+ * object again. Returns a NULL-terminated array to be freed with
+ * g_strfreev(), or NULL on error.
+ */
+char **
+seaf_fs_manager_get_file_block_ids (SeafFSManager *mgr,
+                                    const char *repo_id,
+                                    int version,
+                                    const char *file_id,
+                                    int *n_blocks);
+
+/* Drop the cached block lists of a removed repo. */
+void
+seaf_fs_manager_remove_blocklist_cache (SeafFSManager *mgr,
+                                        const char *repo_id);
+
 int
 seaf_fs_manager_populate_blocklist (SeafFSManager *mgr,
                                     const char *repo_id,
@@ -261,6 +408,38 @@ seaf_fs_manager_traverse_tree (SeafFSManager *mgr,
                                void *user_data,
                                gboolean skip_errors);
 
+/* A set of object ids that can be shared by several threads. */
+typedef struct _FSVisitedSet FSVisitedSet;
+
+FSVisitedSet *
+fs_visited_set_new (void);
+
+void
+fs_visited_set_free (FSVisitedSet *set);
+
+/* Returns TRUE if @obj_id was not in the set before. */
+gboolean
+fs_visited_set_add (FSVisitedSet *set, const char *obj_id);
+
+/*
+ * Like seaf_fs_manager_traverse_tree(), but dirs are read by several
+ * threads ([fileserver] traverse_threads), so @callback must be
+ * thread-safe and the objects are not visited in a fixed order.
+ *
+ * If @visited is not NULL, objects already in it are skipped together
+ * with their subtrees, and the traversed ones are added to it. The same
+ * set can be passed to several traversals, e.g. one per commit.
+ */
+int
+seaf_fs_manager_traverse_tree_parallel (SeafFSManager *mgr,
+                                        const char *repo_id,
+                                        int version,
+                                        const char *root_id,
+                                        TraverseFSTreeCallback callback,
+                                        void *user_data,
+                                        gboolean skip_errors,
+                                        FSVisitedSet *visited);
+
 typedef gboolean (*TraverseFSPathCallback) (SeafFSManager *mgr,
                                             const char *path,
                                             SeafDirent *dent,
@@ -282,6 +461,14 @@ seaf_fs_manager_object_exists (SeafFSManager *mgr,
                                int version,
                                const char *id);
 
+int
+seaf_fs_manager_objects_exist (SeafFSManager *mgr,
+                               const char *repo_id,
+                               int version,
+                               const char **ids,
+                               int n,
+                               gboolean *exists);
+
 void
 seaf_fs_manager_delete_object (SeafFSManager *mgr,
                                const char *repo_id,
@@ -363,6 +550,38 @@ seaf_fs_manager_get_dirent_by_path (SeafFSManager *mgr,
                                     const char *path,
                                     GError **error);
 
+/*
+ * Find the dirent @name in dir @dir_id. Binary dir objects are searched
+ * in place, without parsing the other dirents.
+ * Returns NULL if not found, or if the dir can't be read and @error is set.
+ */
+SeafDirent *
+seaf_fs_manager_lookup_dirent (SeafFSManager *mgr,
+                               const char *repo_id,
+                               int version,
+                               const char *dir_id,
+                               const char *name,
+                               GError **error);
+
+/*
+ * List @limit dirents of dir @dir_id from @offset, or all of them from
+ * @offset if @limit is negative. Dirents are in the order they're stored,
+ * descending by name, so pages stay consistent. Only the listed dirents
+ * of binary dir objects are parsed. Sets @total to the number of dirents
+ * in the dir, if not NULL.
+ * Returns NULL for an empty page, or if the dir can't be read and @error
+ * is set.
+ */
+GList *
+seaf_fs_manager_list_dirents (SeafFSManager *mgr,
+                              const char *repo_id,
+                              int version,
+                              const char *dir_id,
+                              int offset,
+                              int limit,
+                              int *total,
+                              GError **error);
+
 /* Check object integrity. */
 
 gboolean
@@ -389,6 +608,16 @@ seaf_fs_manager_verify_object (SeafFSManager *mgr,
                                gboolean verify_id,
                                gboolean *io_error);
 
+/*
+ * Check that @data, as it would be stored, is the object @obj_id. Doesn't
+ * touch the store, so any thread can verify objects before writing them.
+ */
+gboolean
+seaf_fs_manager_verify_object_data (int version,
+                                    const char *obj_id,
+                                    const void *data,
+                                    int len);
+
 int
 dir_version_from_repo_version (int repo_version);
 
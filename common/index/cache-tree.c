@@ -9,6 +9,7 @@
 #include "tree-walk.h"
 #endif
 #include "cache-tree.h"
+#include "seaf-sha1.h"
 
 #include <glib.h>
 
@@ -333,6 +334,153 @@ static int update_one(const char *repo_id,
     return i;
 }
 
+static void record_ids_recursive(struct cache_tree *it, struct index_state *istate,
+                                 GString *path)
+{
+    int i, len = path->len;
+
+    for (i = 0; i < it->subtree_nr; i++) {
+        struct cache_tree_sub *down = it->down[i];
+
+        if (!down->cache_tree || down->cache_tree->entry_count < 0)
+            continue;
+
+        if (len > 0)
+            g_string_append_c(path, '/');
+        g_string_append_len(path, down->name, down->namelen);
+
+        if (down->cache_tree->has_digest)
+            index_set_tree_id(istate, path->str, path->len,
+                              down->cache_tree->sha1, down->cache_tree->digest);
+        else
+            index_add_tree_id(istate, path->str, path->len,
+                              down->cache_tree->sha1);
+        record_ids_recursive(down->cache_tree, istate, path);
+
+        g_string_truncate(path, len);
+    }
+}
+
+void cache_tree_record_ids(struct cache_tree *it, struct index_state *istate)
+{
+    GString *path = g_string_new("");
+
+    if (istate->tree_ids)
+        g_hash_table_remove_all(istate->tree_ids);
+    record_ids_recursive(it, istate, path);
+    g_string_free(path, TRUE);
+}
+
+/* A dir open in the pass of cache_tree_prime(). */
+struct prime_dir {
+    const char *name;           /* the path of its first entry */
+    int len;
+    int start;
+    guint64 mtime;
+    SeafSHA1Ctx ctx;
+};
+
+static struct cache_tree *tree_at_path(struct cache_tree *it,
+                                       const char *path, int pathlen)
+{
+    struct cache_tree_sub *sub;
+    const char *p = path, *end = path + pathlen, *slash;
+
+    while (p < end) {
+        slash = memchr(p, '/', end - p);
+        if (!slash)
+            slash = end;
+        sub = find_subtree(it, p, slash - p, 1);
+        if (!sub->cache_tree)
+            sub->cache_tree = cache_tree();
+        it = sub->cache_tree;
+        p = slash + 1;
+    }
+    return it;
+}
+
+static void close_prime_dir(struct cache_tree *root, struct index_state *istate,
+                            struct prime_dir *dir, int end)
+{
+    struct cache_tree *it;
+    struct index_tree_id *id;
+    char *key;
+
+    it = tree_at_path(root, dir->name, dir->len);
+    seaf_sha1_final(it->digest, &dir->ctx);
+    it->has_digest = 1;
+
+    key = g_strndup(dir->name, dir->len);
+    id = g_hash_table_lookup(istate->tree_ids, key);
+    g_free(key);
+
+    /* Same as what commit_trees_cb() would compute for the dir. */
+    if (id && memcmp(id->digest, it->digest, 20) == 0) {
+        memcpy(it->sha1, id->sha1, 20);
+        it->entry_count = end - dir->start;
+        it->mtime = dir->mtime;
+    }
+}
+
+void cache_tree_prime(struct cache_tree *root, struct index_state *istate, int version)
+{
+    GArray *stack;
+    struct prime_dir *dir, new_dir;
+    struct cache_entry *ce;
+    const char *slash;
+    int i, j, pos, namelen;
+
+    /* Dirs of version 0 repos don't have mtimes. */
+    if (!istate->tree_ids || version == 0)
+        return;
+
+    stack = g_array_new(FALSE, FALSE, sizeof(struct prime_dir));
+
+    for (i = 0; i <= istate->cache_nr; i++) {
+        ce = (i < istate->cache_nr) ? istate->cache[i] : NULL;
+
+        /* Close the dirs the entry isn't under. */
+        while (stack->len > 0) {
+            dir = &g_array_index(stack, struct prime_dir, stack->len - 1);
+            if (ce && ce_namelen(ce) > dir->len &&
+                memcmp(ce->name, dir->name, dir->len) == 0 &&
+                ce->name[dir->len] == '/')
+                break;
+            close_prime_dir(root, istate, dir, i);
+            g_array_set_size(stack, stack->len - 1);
+        }
+        if (!ce)
+            break;
+
+        /* Open the dirs it's the first entry of. */
+        namelen = ce_namelen(ce);
+        pos = 0;
+        if (stack->len > 0)
+            pos = g_array_index(stack, struct prime_dir, stack->len - 1).len + 1;
+        while ((slash = memchr(ce->name + pos, '/', namelen - pos)) != NULL) {
+            new_dir.name = ce->name;
+            new_dir.len = slash - ce->name;
+            new_dir.start = i;
+            new_dir.mtime = 0;
+            seaf_sha1_init(&new_dir.ctx);
+            g_array_append_val(stack, new_dir);
+            pos = new_dir.len + 1;
+        }
+
+        /* Removed entries are counted, but not committed. */
+        if (ce->ce_flags & CE_REMOVE)
+            continue;
+        for (j = 0; j < stack->len; j++) {
+            dir = &g_array_index(stack, struct prime_dir, j);
+            index_digest_entry(&dir->ctx, ce);
+            if (ce->ce_mtime.sec > dir->mtime)
+                dir->mtime = ce->ce_mtime.sec;
+        }
+    }
+
+    g_array_free(stack, TRUE);
+}
+
 int cache_tree_update(const char *repo_id,
                       int repo_version,
                       const char *worktree,
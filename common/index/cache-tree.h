@@ -4,6 +4,7 @@
 #include <glib.h>
 
 struct cache_tree;
+struct index_state;
 struct cache_tree_sub {
     struct cache_tree *cache_tree;
     int namelen;
@@ -18,6 +19,9 @@ struct cache_tree {
     int subtree_alloc;
     guint64 mtime;
     struct cache_tree_sub **down;
+    /* Of the entries under the dir, set by cache_tree_prime(). */
+    int has_digest;
+    unsigned char digest[20];
 };
 
 typedef int (*CommitCB) (const char *, int,
@@ -36,6 +40,20 @@ struct cache_tree_sub *cache_tree_sub(struct cache_tree *, const char *);
 /* struct cache_tree *cache_tree_read(const char *buffer, unsigned long size); */
 
 int cache_tree_fully_valid(struct cache_tree *);
+
+/*
+ * Record the ids of the sub dirs of an updated cache tree in @istate,
+ * the index it was built from. See index_add_tree_id().
+ */
+void cache_tree_record_ids(struct cache_tree *, struct index_state *istate);
+
+/*
+ * Start an empty cache tree from the dir ids recorded in @istate. The
+ * dirs whose entries didn't change since they were committed are valid,
+ * so cache_tree_update() only builds the dirs with changed entries and
+ * their parents. The entries are read once, in index order.
+ */
+void cache_tree_prime(struct cache_tree *, struct index_state *istate, int version);
 int cache_tree_update(const char *repo_id, int version,
                       const char *worktree,
                       struct cache_tree *, struct cache_entry **, int, int, int, CommitCB);
@@ -20,7 +20,7 @@
 
 #include <glib.h>
 #include <glib/gstdio.h>
-#include <openssl/sha.h>
+#include "seaf-sha1.h"
 
 #ifdef WIN32
 
@@ -73,7 +73,6 @@ static void replace_index_entry(struct index_state *istate, int nr, struct cache
 
 static int verify_hdr(struct cache_header *hdr, unsigned long size)
 {
-    SHA_CTX c;
     unsigned char sha1[20];
 
     if (hdr->hdr_signature != htonl(CACHE_SIGNATURE)) {
@@ -81,13 +80,11 @@ static int verify_hdr(struct cache_header *hdr, unsigned long size)
         return -1;
     }
     if (hdr->hdr_version != htonl(2) && hdr->hdr_version != htonl(3) &&
-        hdr->hdr_version != htonl(4)) {
+        hdr->hdr_version != htonl(4) && hdr->hdr_version != htonl(5)) {
         g_critical("bad index version\n");
         return -1;
     }
-    SHA1_Init(&c);
-    SHA1_Update(&c, hdr, size - 20);
-    SHA1_Final(sha1, &c);
+    seaf_sha1(hdr, size - 20, sha1);
     if (hashcmp(sha1, (unsigned char *)hdr + size - 20)) {
         g_critical("bad index file sha1 signature\n");
         return -1;
@@ -245,12 +242,74 @@ static int read_modifiers (struct index_state *istate, void *data, unsigned int
     return 0;
 }
 
+/*
+ * Add the tree ids in @data to @table. Without @copy, the keys and ids
+ * in @table point into @data.
+ */
+static int parse_tree_ids (GHashTable *table, void *data, unsigned int size,
+                           gboolean copy)
+{
+    char *p = data, *end = (char *)data + size;
+    struct index_tree_id *id;
+    size_t len;
+
+    /* path, NUL, 20 bytes of id, 20 bytes of digest */
+    while (p < end) {
+        len = strnlen (p, end - p);
+        if (p + len + 41 > end) {
+            g_warning ("Bad tree id extension in index.\n");
+            g_hash_table_remove_all (table);
+            return 0;
+        }
+        if (copy) {
+            id = g_new (struct index_tree_id, 1);
+            memcpy (id->sha1, p + len + 1, 20);
+            memcpy (id->digest, p + len + 21, 20);
+            g_hash_table_replace (table, g_strndup (p, len), id);
+        } else {
+            g_hash_table_replace (table, p, p + len + 1);
+        }
+        p += len + 41;
+    }
+
+    return 0;
+}
+
+static int remove_tree_ids (GHashTable *table, void *data, unsigned int size)
+{
+    char *p = data, *end = (char *)data + size;
+    size_t len;
+
+    while (p < end) {
+        len = strnlen (p, end - p);
+        if (len == end - p) {
+            g_warning ("Bad tree id removal in index.\n");
+            g_hash_table_remove_all (table);
+            return 0;
+        }
+        g_hash_table_remove (table, p);
+        p += len + 1;
+    }
+
+    return 0;
+}
+
+static int read_tree_ids (struct index_state *istate, void *data, unsigned int size)
+{
+    if (!istate->tree_ids)
+        istate->tree_ids = g_hash_table_new_full (g_str_hash, g_str_equal,
+                                                  g_free, g_free);
+    return parse_tree_ids (istate->tree_ids, data, size, TRUE);
+}
+
 static int read_index_extension(struct index_state *istate,
                                 unsigned int ext, void *data, unsigned int sz)
 {
     switch (ext) {
     case CACHE_EXT_MODIFIER:
         return read_modifiers (istate, data, sz);
+    case CACHE_EXT_TREE_IDS:
+        return read_tree_ids (istate, data, sz);
     default:
         g_critical("unknown extension %u.\n", ext);
         break;
@@ -262,16 +321,390 @@ static void alloc_index (struct index_state *istate)
 {
     istate->cache_alloc = alloc_nr(istate->cache_nr);
     istate->cache = calloc(istate->cache_alloc, sizeof(struct cache_entry *));
-    istate->name_hash = g_hash_table_new_full (g_str_hash, g_str_equal,
-                                               g_free, NULL);
+    init_name_hash (&istate->name_hash, istate->cache_nr, 0);
 #if defined WIN32 || defined __APPLE__
-    istate->i_name_hash = g_hash_table_new_full (g_str_hash, g_str_equal,
-                                                 g_free, NULL);
+    init_name_hash (&istate->i_name_hash, istate->cache_nr, 1);
 #endif
     istate->initialized = 1;
     istate->name_hash_initialized = 1;
 }
 
+#define ALIGN8(x) (((x) + 7) & ~((size_t)7))
+
+/* The flags of an entry that are kept on disk. */
+#define CE_RECORD_FLAGS (0xFFFF | CE_EXTENDED_FLAGS)
+
+/* Size of @ce in a version 5 index, with @modifier after its name. */
+static size_t ce_record_size (const struct cache_entry *ce, const char *modifier)
+{
+    size_t size = ce_size(ce);
+
+    if (modifier)
+        size += ALIGN8(strlen(modifier) + 1);
+    return size;
+}
+
+/*
+ * Size of the entry at @ce in a version 5 index, with @avail bytes left
+ * for it. Returns 0 if it isn't a valid entry.
+ */
+static size_t mapped_entry_size (const struct cache_entry *ce, size_t avail)
+{
+    size_t max_len, namelen, len, size;
+
+    if (avail < cache_entry_size(0))
+        return 0;
+    /* Pointers and in-memory flags are never written. */
+    if (!(ce->ce_flags & CE_MAPPED) ||
+        (ce->ce_flags & ~(CE_RECORD_FLAGS | CE_STORAGE_MASK)) ||
+        ce->modifier || ce->next)
+        return 0;
+
+    max_len = avail - offsetof(struct cache_entry, name);
+    namelen = strnlen (ce->name, max_len);
+    if (namelen == max_len ||
+        (ce->ce_flags & CE_NAMEMASK) != MIN(namelen, CE_NAMEMASK))
+        return 0;
+
+    size = cache_entry_size(namelen);
+    if (size > avail)
+        return 0;
+    if (ce->ce_flags & CE_MODIFIER_INLINE) {
+        len = strnlen ((const char *)ce + size, avail - size);
+        if (len == avail - size)
+            return 0;
+        size += ALIGN8(len + 1);
+        if (size > avail)
+            return 0;
+    }
+    return size;
+}
+
+/*
+ * Find the tree ids among the extensions of a version 5 base part,
+ * from @off to @end. Returns -1 if the extensions are corrupt.
+ */
+static int find_tree_ids_ext (char *map, size_t off, size_t end,
+                              char **data, unsigned int *size)
+{
+    struct cache_ext_hdr *exthdr;
+    unsigned int name, sz;
+
+    *data = NULL;
+    *size = 0;
+    while (off + sizeof(*exthdr) <= end) {
+        exthdr = (struct cache_ext_hdr *)(map + off);
+        name = ntohl(exthdr->ext_name);
+        sz = ntohl(exthdr->ext_size);
+        off += sizeof(*exthdr);
+        if (sz > end - off)
+            return -1;
+        if (name == CACHE_EXT_TREE_IDS) {
+            *data = map + off;
+            *size = sz;
+        } else {
+            g_critical("unknown extension %u.\n", name);
+        }
+        off += sz;
+    }
+    return 0;
+}
+
+typedef int (*DeltaOpFunc) (unsigned int type, void *data, unsigned int size,
+                            void *user_data);
+
+/*
+ * Call @func on the ops of the delta segments after the base part, in
+ * order, up to the first one that isn't intact. Returns where that
+ * segment starts, or 0 if an intact one is corrupt.
+ */
+static size_t walk_index_deltas (char *map, size_t base_size, size_t size,
+                                 DeltaOpFunc func, void *user_data)
+{
+    struct cache_delta_hdr *hdr;
+    struct cache_delta_op *op;
+    unsigned char sha1[20];
+    size_t valid = base_size, off, end;
+    char *p, *ops_end;
+
+    while (1) {
+        off = ALIGN8(valid);
+        if (off > size || size - off < sizeof(*hdr) + 20)
+            break;
+        hdr = (struct cache_delta_hdr *)(map + off);
+        if (hdr->delta_signature != htonl(CACHE_DELTA_SIGNATURE) ||
+            hdr->delta_size > size - off - sizeof(*hdr) - 20)
+            break;
+        end = off + sizeof(*hdr) + hdr->delta_size + 20;
+
+        /* Left by a crash while appending. */
+        seaf_sha1 (hdr, sizeof(*hdr) + hdr->delta_size, sha1);
+        if (hashcmp (sha1, (unsigned char *)map + end - 20) != 0)
+            break;
+
+        p = (char *)(hdr + 1);
+        ops_end = p + hdr->delta_size;
+        while (p < ops_end) {
+            op = (struct cache_delta_op *)p;
+            if ((size_t)(ops_end - p) < sizeof(*op) ||
+                ALIGN8((size_t)op->op_size) > (size_t)(ops_end - p) - sizeof(*op))
+                return 0;
+            if (func (op->op_type, p + sizeof(*op), op->op_size, user_data) < 0)
+                return 0;
+            p += sizeof(*op) + ALIGN8((size_t)op->op_size);
+        }
+        valid = end;
+    }
+    return valid;
+}
+
+/* What the deltas did to an entry, keyed by name and stage. */
+typedef struct DeltaOp {
+    const char *name;
+    unsigned int flags;
+    struct cache_entry *ce;     /* NULL if the entry was removed */
+} DeltaOp;
+
+static guint delta_op_hash (gconstpointer key)
+{
+    const DeltaOp *op = key;
+
+    return g_str_hash (op->name) ^ (op->flags & CE_STAGEMASK);
+}
+
+static gboolean delta_op_equal (gconstpointer a, gconstpointer b)
+{
+    const DeltaOp *op1 = a, *op2 = b;
+
+    return (op1->flags & CE_STAGEMASK) == (op2->flags & CE_STAGEMASK) &&
+        strcmp (op1->name, op2->name) == 0;
+}
+
+typedef struct DeltaLoad {
+    struct index_state *istate;
+    GHashTable *ops;            /* DeltaOp, the last one of each entry */
+} DeltaLoad;
+
+static int load_delta_op (unsigned int type, void *data, unsigned int size,
+                          void *user_data)
+{
+    DeltaLoad *load = user_data;
+    struct cache_delta_remove *rm = data;
+    DeltaOp *op;
+
+    switch (type) {
+    case CACHE_DELTA_ENTRY:
+        if (mapped_entry_size (data, size) != size)
+            return -1;
+        op = g_new (DeltaOp, 1);
+        op->ce = data;
+        op->name = op->ce->name;
+        op->flags = op->ce->ce_flags;
+        g_hash_table_replace (load->ops, op, op);
+        return 0;
+    case CACHE_DELTA_REMOVE:
+        if (size <= sizeof(*rm) ||
+            strnlen (rm->name, size - sizeof(*rm)) == size - sizeof(*rm))
+            return -1;
+        op = g_new (DeltaOp, 1);
+        op->ce = NULL;
+        op->name = rm->name;
+        op->flags = rm->flags;
+        g_hash_table_replace (load->ops, op, op);
+        return 0;
+    case CACHE_DELTA_TREE_IDS:
+        return read_tree_ids (load->istate, data, size);
+    case CACHE_DELTA_REMOVE_TREE_IDS:
+        if (load->istate->tree_ids)
+            remove_tree_ids (load->istate->tree_ids, data, size);
+        return 0;
+    default:
+        g_critical("unknown index delta op %u.\n", type);
+        return -1;
+    }
+}
+
+static int compare_entries (gconstpointer a, gconstpointer b)
+{
+    const struct cache_entry *ce1 = *(struct cache_entry **)a;
+    const struct cache_entry *ce2 = *(struct cache_entry **)b;
+
+    return cache_name_compare (ce1->name, ce1->ce_flags, ce2->name, ce2->ce_flags);
+}
+
+/*
+ * Apply the delta ops to @base, the @nr sorted entries of the base part.
+ * Returns the resulting entries, and their number in @nr.
+ */
+static struct cache_entry **apply_delta_ops (struct cache_entry **base,
+                                             unsigned int *nr, GHashTable *ops)
+{
+    struct cache_entry **cache, **result;
+    GPtrArray *added;
+    GHashTableIter iter;
+    gpointer key;
+    DeltaOp lookup, *op;
+    unsigned int i, j, k, n;
+
+    /* Changed and removed entries are replaced in place. */
+    cache = g_new (struct cache_entry *, *nr);
+    for (i = n = 0; i < *nr; ++i) {
+        lookup.name = base[i]->name;
+        lookup.flags = base[i]->ce_flags;
+        op = g_hash_table_lookup (ops, &lookup);
+        if (!op) {
+            cache[n++] = base[i];
+            continue;
+        }
+        if (op->ce)
+            cache[n++] = op->ce;
+        g_hash_table_remove (ops, op);
+    }
+
+    /* The ops left add entries, merge them in. */
+    added = g_ptr_array_new ();
+    g_hash_table_iter_init (&iter, ops);
+    while (g_hash_table_iter_next (&iter, &key, NULL)) {
+        op = key;
+        if (op->ce)
+            g_ptr_array_add (added, op->ce);
+    }
+    g_ptr_array_sort (added, compare_entries);
+
+    result = g_new (struct cache_entry *, n + added->len);
+    for (i = j = k = 0; i < n || j < added->len; ++k) {
+        if (j == added->len ||
+            (i < n && compare_entries (&cache[i], &added->pdata[j]) < 0))
+            result[k] = cache[i++];
+        else
+            result[k] = added->pdata[j++];
+    }
+
+    *nr = k;
+    g_free (cache);
+    g_ptr_array_free (added, TRUE);
+    return result;
+}
+
+#ifdef WIN32
+/*
+ * A mapped file can't be replaced or truncated on Windows, so entries are
+ * copied out of it.
+ */
+static struct cache_entry *copy_mapped_entry (struct cache_entry *ce)
+{
+    struct cache_entry *copy = calloc(1, ce_size(ce));
+
+    memcpy(copy, ce, ce_size(ce));
+    copy->ce_flags &= ~CE_STORAGE_MASK;
+    copy->modifier = g_strdup(ce_modifier(ce));
+    return copy;
+}
+#endif
+
+static int read_index_v5 (struct index_state *istate, char *map, size_t map_size,
+                          SeafStat *st)
+{
+    struct cache_header5 *hdr = (struct cache_header5 *)map;
+    struct cache_entry **base = NULL, **cache = NULL;
+    DeltaLoad load;
+    char *tree_ids;
+    unsigned int tree_ids_size;
+    size_t off, end, size, base_size, valid_size;
+    unsigned int nr, i;
+
+    load.istate = istate;
+    load.ops = g_hash_table_new_full (delta_op_hash, delta_op_equal, g_free, NULL);
+
+    if (map_size < sizeof(*hdr) + 20) {
+        g_critical("index file smaller than expected\n");
+        goto unmap;
+    }
+    if (hdr->hdr_entry_size != sizeof(struct cache_entry)) {
+        g_critical("index file was written on another platform\n");
+        goto unmap;
+    }
+    if (hdr->hdr_base_size < sizeof(*hdr) + 20 || hdr->hdr_base_size > map_size)
+        goto corrupt;
+    base_size = hdr->hdr_base_size;
+    if (verify_hdr((struct cache_header *)hdr, base_size) < 0)
+        goto unmap;
+
+    end = base_size - 20;
+    off = sizeof(*hdr);
+    nr = ntohl(hdr->hdr_entries);
+    if (nr > (end - off) / cache_entry_size(0))
+        goto corrupt;
+
+    /* The entries are used where they are in the file. */
+    base = g_new (struct cache_entry *, nr);
+    for (i = 0; i < nr; i++) {
+        base[i] = (struct cache_entry *)(map + off);
+        size = mapped_entry_size (base[i], end - off);
+        if (!size)
+            goto corrupt;
+        off += size;
+    }
+    istate->records_end = off;
+
+    if (find_tree_ids_ext (map, off, end, &tree_ids, &tree_ids_size) < 0)
+        goto corrupt;
+    if (tree_ids)
+        read_tree_ids (istate, tree_ids, tree_ids_size);
+
+    valid_size = walk_index_deltas (map, base_size, map_size, load_delta_op, &load);
+    if (!valid_size)
+        goto corrupt;
+
+    if (g_hash_table_size (load.ops) > 0) {
+        cache = apply_delta_ops (base, &nr, load.ops);
+        g_free (base);
+    } else {
+        cache = base;
+    }
+    base = NULL;
+
+    istate->cache_nr = nr;
+    alloc_index (istate);
+    for (i = 0; i < nr; i++) {
+#ifdef WIN32
+        set_index_entry(istate, i, copy_mapped_entry (cache[i]));
+#else
+        set_index_entry(istate, i, cache[i]);
+#endif
+    }
+
+    istate->version = 5;
+    istate->timestamp.sec = st->st_mtime;
+    istate->timestamp.nsec = 0;
+
+#ifdef WIN32
+    g_free (cache);
+    munmap(map, map_size);
+#else
+    istate->map = map;
+    istate->map_size = map_size;
+    istate->base_size = base_size;
+    istate->valid_size = valid_size;
+    istate->file_size = st->st_size;
+    istate->file_ino = st->st_ino;
+    istate->loaded = cache;
+    istate->loaded_nr = nr;
+    istate->can_append = 1;
+#endif
+
+    g_hash_table_destroy (load.ops);
+    return istate->cache_nr;
+
+corrupt:
+    g_critical("index file corrupt\n");
+unmap:
+    munmap(map, map_size);
+    g_free (base);
+    g_hash_table_destroy (load.ops);
+    return -1;
+}
+
 /* remember to discard_cache() before reading a different cache! */
 int read_index_from(struct index_state *istate, const char *path, int repo_version)
 {
@@ -285,8 +718,8 @@ int read_index_from(struct index_state *istate, const char *path, int repo_versi
     if (istate->initialized)
         return istate->cache_nr;
 
-    /* All newly created index files are version 4. */
-    istate->version = 4;
+    /* All newly created index files are version 5. */
+    istate->version = 5;
     /* Index file stores modifier info if repo version > 0 */
     if (repo_version > 0)
         istate->has_modifier = 1;
@@ -321,12 +754,16 @@ int read_index_from(struct index_state *istate, const char *path, int repo_versi
     }
 
     hdr = mm;
+    if (hdr->hdr_signature == htonl(CACHE_SIGNATURE) &&
+        hdr->hdr_version == htonl(5))
+        return read_index_v5 (istate, mm, mmap_size, &st);
+
     if (verify_hdr(hdr, mmap_size) < 0)
         goto unmap;
 
     /* Index version will be set to on-disk value here.
      * If the index is from an old repo, it will be set to 2.
-     * But when we write the index, it'll be updated to version 4.
+     * But when we write the index, it'll be updated to version 5.
      */
     istate->version = ntohl(hdr->hdr_version);
     istate->cache_nr = ntohl(hdr->hdr_entries);
@@ -760,6 +1197,98 @@ void remove_marked_cache_entries(struct index_state *istate)
     istate->cache_nr = j;
 }
 
+void index_digest_entry(struct SeafSHA1Ctx *ctx, const struct cache_entry *ce)
+{
+    guint32 mode = ce->ce_mode;
+    gint64 mtime = ce->ce_mtime.sec;
+    guint64 size = ce->ce_size;
+
+    seaf_sha1_update (ctx, ce->name, ce_namelen(ce) + 1);
+    seaf_sha1_update (ctx, &mode, sizeof(mode));
+    seaf_sha1_update (ctx, ce->sha1, 20);
+    seaf_sha1_update (ctx, &mtime, sizeof(mtime));
+    seaf_sha1_update (ctx, &size, sizeof(size));
+    if (ce_modifier(ce))
+        seaf_sha1_update (ctx, ce_modifier(ce), strlen(ce_modifier(ce)) + 1);
+}
+
+/* Digest of the entries under dir @path, of what their dir ids are made of. */
+static void span_digest(struct index_state *istate, const char *path, int pathlen,
+                        unsigned char digest[20])
+{
+    SeafSHA1Ctx ctx;
+    char *prefix;
+    int pos;
+
+    prefix = g_malloc (pathlen + 2);
+    memcpy (prefix, path, pathlen);
+    prefix[pathlen] = '/';
+    prefix[pathlen + 1] = '\0';
+
+    seaf_sha1_init (&ctx);
+
+    pos = index_name_pos (istate, prefix, pathlen + 1);
+    if (pos < 0)
+        pos = -pos - 1;
+    for (; pos < istate->cache_nr; pos++) {
+        struct cache_entry *ce = istate->cache[pos];
+
+        if (strncmp (ce->name, prefix, pathlen + 1) != 0)
+            break;
+        if (ce->ce_flags & CE_REMOVE)
+            continue;
+
+        index_digest_entry (&ctx, ce);
+    }
+
+    seaf_sha1_final (digest, &ctx);
+    g_free (prefix);
+}
+
+void index_add_tree_id(struct index_state *istate, const char *path, int pathlen,
+                       const unsigned char *sha1)
+{
+    unsigned char digest[20];
+
+    span_digest (istate, path, pathlen, digest);
+    index_set_tree_id (istate, path, pathlen, sha1, digest);
+}
+
+void index_set_tree_id(struct index_state *istate, const char *path, int pathlen,
+                       const unsigned char *sha1, const unsigned char *digest)
+{
+    struct index_tree_id *id;
+
+    if (!istate->tree_ids)
+        istate->tree_ids = g_hash_table_new_full (g_str_hash, g_str_equal,
+                                                  g_free, g_free);
+
+    id = g_new (struct index_tree_id, 1);
+    memcpy (id->sha1, sha1, 20);
+    memcpy (id->digest, digest, 20);
+    g_hash_table_replace (istate->tree_ids, g_strndup (path, pathlen), id);
+}
+
+int index_tree_id_matches(struct index_state *istate, const char *path, int pathlen,
+                          const unsigned char *sha1)
+{
+    struct index_tree_id *id;
+    unsigned char digest[20];
+    char *key;
+
+    if (!istate->tree_ids)
+        return 0;
+
+    key = g_strndup (path, pathlen);
+    id = g_hash_table_lookup (istate->tree_ids, key);
+    g_free (key);
+    if (!id || memcmp (id->sha1, sha1, 20) != 0)
+        return 0;
+
+    span_digest (istate, path, pathlen, digest);
+    return memcmp (id->digest, digest, 20) == 0;
+}
+
 int remove_file_from_index(struct index_state *istate, const char *path)
 {
     int pos = index_name_pos(istate, path, strlen(path));
@@ -971,6 +1500,16 @@ int add_index_entry(struct index_state *istate, struct cache_entry *ce, int opti
     return 0;
 }
 
+gboolean
+index_file_changed (struct index_state *istate, const char *path, SeafStat *st)
+{
+    struct cache_entry *ce;
+    unsigned ce_option = CE_MATCH_IGNORE_VALID|CE_MATCH_IGNORE_SKIP_WORKTREE|CE_MATCH_RACY_IS_DIRTY;
+
+    ce = index_name_exists (istate, path, strlen(path), 0);
+    return (!ce || ce_stage(ce) || ie_match_stat (ce, st, ce_option) != 0);
+}
+
 int add_to_index(const char *repo_id,
                  int version,
                  struct index_state *istate,
@@ -982,6 +1521,24 @@ int add_to_index(const char *repo_id,
                  IndexCB index_cb,
                  const char *modifier,
                  gboolean *added)
+{
+    return add_to_index_with_id (repo_id, version, istate, path, full_path,
+                                 st, flags, crypt, index_cb, modifier,
+                                 NULL, added);
+}
+
+int add_to_index_with_id(const char *repo_id,
+                         int version,
+                         struct index_state *istate,
+                         const char *path,
+                         const char *full_path,
+                         SeafStat *st,
+                         int flags,
+                         SeafileCrypt *crypt,
+                         IndexCB index_cb,
+                         const char *modifier,
+                         const unsigned char *file_id,
+                         gboolean *added)
 {
     int size, namelen;
     mode_t st_mode = st->st_mode;
@@ -1060,7 +1617,9 @@ int add_to_index(const char *repo_id,
     }
 #endif
 
-    if (index_cb (repo_id, version, full_path, sha1, crypt, TRUE) < 0) {
+    if (file_id) {
+        memcpy (sha1, file_id, 20);
+    } else if (index_cb (repo_id, version, full_path, sha1, crypt, TRUE) < 0) {
         free (ce);
         return -1;
     }
@@ -1268,7 +1827,7 @@ create_renamed_cache_entry (struct cache_entry *ce,
     memcpy (new_ce, ce, sizeof(struct cache_entry));
     new_ce->ce_flags = namelen;
     new_ce->current_mtime = 0;
-    new_ce->modifier = g_strdup(ce->modifier);
+    new_ce->modifier = g_strdup(ce_modifier(ce));
     new_ce->next = NULL;
     memcpy (new_ce->name, new_ce_name, namelen);
     g_free (new_ce_name);
@@ -1600,12 +2159,7 @@ static int type_from_string(const char *str)
 static void hash_sha1_file(const void *buf, unsigned long len,
                            const char *type, unsigned char *sha1)
 {
-    SHA_CTX c;
-
-    /* Sha1.. */
-    SHA1_Init(&c);
-    SHA1_Update(&c, buf, len);
-    SHA1_Final(sha1, &c);
+    seaf_sha1(buf, len, sha1);
 }
 
 static int index_mem(unsigned char *sha1, void *buf, uint64_t size,
@@ -1686,19 +2240,23 @@ static unsigned char write_buffer[WRITE_BUFFER_SIZE];
 static unsigned long write_buffer_len;
 #endif
 
-#define WRITE_BUFFER_SIZE 8192
+/* Large enough to hold any single on-disk entry (name is at most
+ * CE_NAMEMASK bytes), so entries can be encoded in place.
+ */
+#define WRITE_BUFFER_SIZE (128 * 1024)
 
 typedef struct {
-    SHA_CTX context;
+    /* First, so that entries encoded in it are aligned. */
     unsigned char write_buffer[WRITE_BUFFER_SIZE];
     unsigned long write_buffer_len;
+    SeafSHA1Ctx context;
 } WriteIndexInfo;
 
 static int ce_write_flush(WriteIndexInfo *info, int fd)
 {
     unsigned int buffered = info->write_buffer_len;
     if (buffered) {
-        SHA1_Update(&info->context, info->write_buffer, buffered);
+        seaf_sha1_update(&info->context, info->write_buffer, buffered);
         if (writen(fd, info->write_buffer, buffered) != buffered)
             return -1;
         info->write_buffer_len = 0;
@@ -1743,7 +2301,7 @@ static int ce_flush(WriteIndexInfo *info, int fd)
 
     if (left) {
         info->write_buffer_len = 0;
-        SHA1_Update(&info->context, info->write_buffer, left);
+        seaf_sha1_update(&info->context, info->write_buffer, left);
     }
 
     /* Flush first if not enough space for SHA1 signature */
@@ -1754,7 +2312,7 @@ static int ce_flush(WriteIndexInfo *info, int fd)
     }
 
     /* Append the SHA1 signature at the end */
-    SHA1_Final(info->write_buffer + left, &info->context);
+    seaf_sha1_final(info->write_buffer + left, &info->context);
     left += 20;
     return (writen(fd, info->write_buffer, left) != left) ? -1 : 0;
 }
@@ -1841,83 +2399,117 @@ static int ce_write_entry(WriteIndexInfo *info, int fd, struct cache_entry *ce)
     return result;
 }
 
-static int ce_write_entry2(WriteIndexInfo *info, int fd, struct cache_entry *ce)
+static void encode_entry (struct cache_entry *rec, const struct cache_entry *ce,
+                          const char *modifier, size_t size)
 {
-    int size = ondisk_ce_size2(ce);
-    struct ondisk_cache_entry2 *ondisk = calloc(1, size);
-    char *name;
-    int result;
-
-    ondisk->ctime.sec = hton64(ce->ce_ctime.sec);
-    ondisk->mtime.sec = hton64(ce->ce_mtime.sec);
-    ondisk->dev  = htonl(ce->ce_dev);
-    ondisk->ino  = htonl(ce->ce_ino);
-    ondisk->mode = htonl(ce->ce_mode);
-    ondisk->uid  = htonl(ce->ce_uid);
-    ondisk->gid  = htonl(ce->ce_gid);
-    ondisk->size = hton64(ce->ce_size);
-    hashcpy(ondisk->sha1, ce->sha1);
-    ondisk->flags = htons(ce->ce_flags);
-    name = ondisk->name;
-    memcpy(name, ce->name, ce_namelen(ce));
-
-    result = ce_write(info, fd, ondisk, size);
-    free(ondisk);
-    return result;
+    memset(rec, 0, size);
+    rec->ce_ctime = ce->ce_ctime;
+    rec->ce_mtime = ce->ce_mtime;
+    rec->ce_dev  = ce->ce_dev;
+    rec->ce_ino  = ce->ce_ino;
+    rec->ce_mode = ce->ce_mode;
+    rec->ce_uid  = ce->ce_uid;
+    rec->ce_gid  = ce->ce_gid;
+    rec->ce_size = ce->ce_size;
+    rec->ce_flags = (ce->ce_flags & CE_RECORD_FLAGS) | CE_MAPPED;
+    hashcpy(rec->sha1, ce->sha1);
+    memcpy(rec->name, ce->name, ce_namelen(ce));
+    if (modifier) {
+        rec->ce_flags |= CE_MODIFIER_INLINE;
+        strcpy((char *)rec + ce_size(ce), modifier);
+    }
 }
 
-static int
-modifiers_to_string (GString *buf, struct index_state *istate)
+static int ce_write_entry5(WriteIndexInfo *info, int fd, struct cache_entry *ce)
 {
-    int i;
-    struct cache_entry *ce;
+    const char *modifier = ce_modifier(ce);
+    size_t size = ce_record_size(ce, modifier);
+    struct cache_entry *rec;
+    int ret;
 
-    for (i = 0; i < istate->cache_nr; ++i) {
-        ce = istate->cache[i];
-        if (S_ISDIR(ce->ce_mode) || (ce->ce_flags & CE_REMOVE))
-            continue;
-        if (!ce->modifier) {
-            g_warning ("BUG: index entry %s doesn't have modifier info.\n",
-                       ce->name);
-            return -1;
-        }
-        g_string_append_printf (buf, "%s\n", ce->modifier);
+    if (size > WRITE_BUFFER_SIZE) {
+        rec = g_malloc (size);
+        encode_entry (rec, ce, modifier, size);
+        ret = ce_write(info, fd, rec, size);
+        g_free (rec);
+        return ret;
     }
 
+    /* Encode straight into the write buffer instead of allocating a
+     * temporary entry for every file in the index.
+     */
+    if (WRITE_BUFFER_SIZE - info->write_buffer_len < size &&
+        ce_write_flush(info, fd) < 0)
+        return -1;
+
+    rec = (struct cache_entry *)(info->write_buffer + info->write_buffer_len);
+    encode_entry (rec, ce, modifier, size);
+
+    info->write_buffer_len += size;
+    if (info->write_buffer_len == WRITE_BUFFER_SIZE)
+        return ce_write_flush(info, fd);
     return 0;
 }
 
+static void tree_ids_to_string (GString *buf, GHashTable *tree_ids)
+{
+    GHashTableIter iter;
+    gpointer key, value;
+
+    g_hash_table_iter_init (&iter, tree_ids);
+    while (g_hash_table_iter_next (&iter, &key, &value)) {
+        g_string_append_len (buf, key, strlen(key) + 1);
+        g_string_append_len (buf, value, sizeof(struct index_tree_id));
+    }
+}
+
 int write_index(struct index_state *istate, int newfd)
 {
-    WriteIndexInfo info;
-    struct cache_header hdr;
-    int i, removed, extended;
+    WriteIndexInfo *info;
+    struct cache_header5 hdr;
+    GString *tree_ids = NULL;
+    int i, removed;
+    int ret = -1;
     struct cache_entry **cache = istate->cache;
     int entries = istate->cache_nr;
+    guint64 base_size;
     SeafStat st;
 
-    memset (&info, 0, sizeof(info));
+    /* The write buffer is too big for the stack of worker threads. */
+    info = g_new0 (WriteIndexInfo, 1);
 
-    for (i = removed = extended = 0; i < entries; i++) {
-        if (cache[i]->ce_flags & CE_REMOVE)
+    /* The header has the size of the whole file, add it up first. */
+    base_size = sizeof(hdr) + 20;
+    for (i = removed = 0; i < entries; i++) {
+        struct cache_entry *ce = cache[i];
+        if (ce->ce_flags & CE_REMOVE) {
             removed++;
+            continue;
+        }
+        if (istate->has_modifier && !S_ISDIR(ce->ce_mode) && !ce_modifier(ce)) {
+            g_warning ("BUG: index entry %s doesn't have modifier info.\n",
+                       ce->name);
+            goto out;
+        }
+        base_size += ce_record_size(ce, ce_modifier(ce));
+    }
 
-        /* reduce extended entries if possible */
-        /* cache[i]->ce_flags &= ~CE_EXTENDED; */
-        /* if (cache[i]->ce_flags & CE_EXTENDED_FLAGS) { */
-        /*     extended++; */
-        /*     cache[i]->ce_flags |= CE_EXTENDED; */
-        /* } */
+    if (istate->tree_ids && g_hash_table_size (istate->tree_ids) > 0) {
+        tree_ids = g_string_new ("");
+        tree_ids_to_string (tree_ids, istate->tree_ids);
+        base_size += sizeof(struct cache_ext_hdr) + tree_ids->len;
     }
 
     hdr.hdr_signature = htonl(CACHE_SIGNATURE);
-    /* Always use version 4 for newly created index files */
-    hdr.hdr_version = htonl(4);
+    /* Always use version 5 for newly created index files */
+    hdr.hdr_version = htonl(5);
     hdr.hdr_entries = htonl(entries - removed);
+    hdr.hdr_entry_size = sizeof(struct cache_entry);
+    hdr.hdr_base_size = base_size;
 
-    SHA1_Init(&info.context);
-    if (ce_write(&info, newfd, &hdr, sizeof(hdr)) < 0)
-        return -1;
+    seaf_sha1_init(&info->context);
+    if (ce_write(info, newfd, &hdr, sizeof(hdr)) < 0)
+        goto out;
 
     for (i = 0; i < entries; i++) {
         struct cache_entry *ce = cache[i];
@@ -1925,32 +2517,259 @@ int write_index(struct index_state *istate, int newfd)
             continue;
         /* if (!ce_uptodate(ce) && is_racy_timestamp(istate, ce)) */
         /*     ce_smudge_racily_clean_entry(ce); */
-        if (ce_write_entry2(&info, newfd, ce) < 0)
-            return -1;
+        if (ce_write_entry5(info, newfd, ce) < 0)
+            goto out;
     }
 
     /* Write extension data here */
-    if (istate->has_modifier) {
-        GString *buf = g_string_new ("");
-        int err;
+    if (tree_ids &&
+        (write_index_ext_header(info, newfd, CACHE_EXT_TREE_IDS, tree_ids->len) < 0 ||
+         ce_write(info, newfd, tree_ids->str, tree_ids->len) < 0))
+        goto out;
 
-        if (modifiers_to_string (buf, istate) < 0) {
-            g_string_free (buf, TRUE);
-            return -1;
+    if (ce_flush(info, newfd) || seaf_fstat(newfd, &st))
+        goto out;
+    istate->timestamp.sec = (unsigned int)st.st_mtime;
+    istate->timestamp.nsec = 0;
+    ret = 0;
+
+out:
+    if (tree_ids)
+        g_string_free (tree_ids, TRUE);
+    g_free (info);
+    return ret;
+}
+
+/*
+ * Appended deltas are read on every load. Once they would reach this
+ * fraction of the base part, the index is written anew instead.
+ */
+#define MAX_APPENDED_RATIO 4
+
+static void *delta_add_op (GByteArray *seg, unsigned int type, unsigned int size)
+{
+    struct cache_delta_op *op;
+    guint len = seg->len;
+
+    g_byte_array_set_size (seg, len + sizeof(*op) + ALIGN8(size));
+    memset (seg->data + len, 0, sizeof(*op) + ALIGN8(size));
+    op = (struct cache_delta_op *)(seg->data + len);
+    op->op_type = type;
+    op->op_size = size;
+    return op + 1;
+}
+
+static void delta_add_entry (GByteArray *seg, const struct cache_entry *ce)
+{
+    const char *modifier = ce_modifier(ce);
+    size_t size = ce_record_size(ce, modifier);
+
+    encode_entry (delta_add_op (seg, CACHE_DELTA_ENTRY, size), ce, modifier, size);
+}
+
+static void delta_add_remove (GByteArray *seg, const struct cache_entry *ce)
+{
+    struct cache_delta_remove *rm;
+    size_t namelen = ce_namelen(ce);
+
+    rm = delta_add_op (seg, CACHE_DELTA_REMOVE, sizeof(*rm) + namelen + 1);
+    rm->flags = ce->ce_flags & (CE_NAMEMASK | CE_STAGEMASK);
+    memcpy (rm->name, ce->name, namelen);
+}
+
+/* Whether @ce differs from @orig, an entry of a version 5 index file. */
+static int entry_changed (const struct cache_entry *ce,
+                          const struct cache_entry *orig)
+{
+    return memcmp (&ce->ce_ctime, &orig->ce_ctime, sizeof(ce->ce_ctime)) != 0 ||
+        memcmp (&ce->ce_mtime, &orig->ce_mtime, sizeof(ce->ce_mtime)) != 0 ||
+        ce->ce_dev != orig->ce_dev ||
+        ce->ce_ino != orig->ce_ino ||
+        ce->ce_mode != orig->ce_mode ||
+        ce->ce_uid != orig->ce_uid ||
+        ce->ce_gid != orig->ce_gid ||
+        ce->ce_size != orig->ce_size ||
+        (ce->ce_flags & CE_RECORD_FLAGS) != (orig->ce_flags & CE_RECORD_FLAGS) ||
+        hashcmp (ce->sha1, orig->sha1) != 0 ||
+        g_strcmp0 (ce_modifier(ce), ce_modifier(orig)) != 0;
+}
+
+static int old_tree_id_op (unsigned int type, void *data, unsigned int size,
+                           void *user_data)
+{
+    if (type == CACHE_DELTA_TREE_IDS)
+        return parse_tree_ids (user_data, data, size, FALSE);
+    if (type == CACHE_DELTA_REMOVE_TREE_IDS)
+        return remove_tree_ids (user_data, data, size);
+    return 0;
+}
+
+/* Add ops for the tree ids that changed since they were read from @file. */
+static void diff_tree_ids (struct index_state *istate, char *file, GByteArray *seg)
+{
+    GHashTable *old_ids = g_hash_table_new (g_str_hash, g_str_equal);
+    GString *changed = g_string_new (""), *removed = g_string_new ("");
+    GHashTableIter iter;
+    gpointer key, value, old;
+    char *data;
+    unsigned int size;
+
+    /* Both were checked when the index was read. */
+    find_tree_ids_ext (file, istate->records_end, istate->base_size - 20,
+                       &data, &size);
+    if (data)
+        parse_tree_ids (old_ids, data, size, FALSE);
+    walk_index_deltas (file, istate->base_size, istate->valid_size,
+                       old_tree_id_op, old_ids);
+
+    if (istate->tree_ids) {
+        g_hash_table_iter_init (&iter, istate->tree_ids);
+        while (g_hash_table_iter_next (&iter, &key, &value)) {
+            old = g_hash_table_lookup (old_ids, key);
+            if (!old || memcmp (old, value, sizeof(struct index_tree_id)) != 0) {
+                g_string_append_len (changed, key, strlen(key) + 1);
+                g_string_append_len (changed, value, sizeof(struct index_tree_id));
+            }
         }
+    }
 
-        err = write_index_ext_header(&info, newfd, CACHE_EXT_MODIFIER, buf->len) < 0
-            || ce_write(&info, newfd, buf->str, buf->len) < 0;
-        g_string_free (buf, TRUE);
-        if (err)
-            return -1;
+    g_hash_table_iter_init (&iter, old_ids);
+    while (g_hash_table_iter_next (&iter, &key, NULL)) {
+        if (!istate->tree_ids || !g_hash_table_lookup (istate->tree_ids, key))
+            g_string_append_len (removed, key, strlen(key) + 1);
     }
 
-    if (ce_flush(&info, newfd) || seaf_fstat(newfd, &st))
-        return -1;
-    istate->timestamp.sec = (unsigned int)st.st_mtime;
-    istate->timestamp.nsec = 0;
-    return 0;
+    if (changed->len > 0)
+        memcpy (delta_add_op (seg, CACHE_DELTA_TREE_IDS, changed->len),
+                changed->str, changed->len);
+    if (removed->len > 0)
+        memcpy (delta_add_op (seg, CACHE_DELTA_REMOVE_TREE_IDS, removed->len),
+                removed->str, removed->len);
+
+    g_string_free (changed, TRUE);
+    g_string_free (removed, TRUE);
+    g_hash_table_destroy (old_ids);
+}
+
+int append_index(struct index_state *istate, const char *path)
+{
+    static const char zeros[8];
+    struct cache_entry **cache = istate->cache;
+    const struct cache_entry *orig;
+    struct cache_delta_hdr *hdr;
+    GByteArray *seg = NULL;
+    char *file = MAP_FAILED;
+    unsigned char sha1[20];
+    size_t start, appended;
+    unsigned int i, j;
+    SeafStat st;
+    int cmp, fd;
+    int ret = 1;
+
+    if (!istate->can_append)
+        return 1;
+
+    fd = seaf_util_open (path, O_RDWR | O_BINARY);
+    if (fd < 0)
+        return 1;
+
+    /* Only the file that was read, nothing written over it since. */
+    if (seaf_fstat (fd, &st) < 0 ||
+        (guint64)st.st_size != istate->file_size ||
+        (guint64)st.st_ino != istate->file_ino)
+        goto out;
+
+    /* The entries as they are in the file, untouched by changes in place. */
+    file = mmap(NULL, istate->valid_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    if (file == MAP_FAILED ||
+        memcmp (file + istate->base_size - 20,
+                (char *)istate->map + istate->base_size - 20, 20) != 0)
+        goto out;
+
+    seg = g_byte_array_new ();
+    g_byte_array_set_size (seg, sizeof(*hdr));
+
+    /* Both are sorted, walk them side by side. */
+    i = j = 0;
+    while (i < istate->loaded_nr || j < istate->cache_nr) {
+        if (j < istate->cache_nr && (cache[j]->ce_flags & CE_REMOVE)) {
+            j++;
+            continue;
+        }
+
+        orig = NULL;
+        if (i < istate->loaded_nr)
+            orig = (struct cache_entry *)
+                (file + ((char *)istate->loaded[i] - (char *)istate->map));
+
+        if (j == istate->cache_nr)
+            cmp = -1;
+        else if (!orig)
+            cmp = 1;
+        else
+            cmp = cache_name_compare (orig->name, orig->ce_flags,
+                                      cache[j]->name, cache[j]->ce_flags);
+
+        if (cmp < 0) {
+            delta_add_remove (seg, orig);
+            i++;
+        } else if (cmp > 0) {
+            delta_add_entry (seg, cache[j]);
+            j++;
+        } else {
+            if (entry_changed (cache[j], orig))
+                delta_add_entry (seg, cache[j]);
+            i++;
+            j++;
+        }
+    }
+
+    diff_tree_ids (istate, file, seg);
+
+    if (seg->len == sizeof(*hdr)) {
+        ret = 0;
+        goto out;
+    }
+
+    start = ALIGN8(istate->valid_size);
+    appended = start - ALIGN8(istate->base_size) + seg->len + 20;
+    if (appended > istate->base_size / MAX_APPENDED_RATIO)
+        goto out;
+
+    hdr = (struct cache_delta_hdr *)seg->data;
+    hdr->delta_signature = htonl(CACHE_DELTA_SIGNATURE);
+    hdr->delta_size = seg->len - sizeof(*hdr);
+    seaf_sha1 (seg->data, seg->len, sha1);
+    g_byte_array_append (seg, sha1, 20);
+
+    /* Drop what a crash left after the last intact segment. */
+    if (((guint64)st.st_size > istate->valid_size &&
+         ftruncate (fd, istate->valid_size) < 0) ||
+        lseek (fd, istate->valid_size, SEEK_SET) < 0 ||
+        writen (fd, zeros, start - istate->valid_size) != start - istate->valid_size ||
+        writen (fd, seg->data, seg->len) != seg->len) {
+        g_warning ("Failed to append to index %s: %s.\n", path, strerror(errno));
+        if (ftruncate (fd, istate->valid_size) < 0)
+            g_warning ("Failed to truncate index %s: %s.\n", path, strerror(errno));
+        ret = -1;
+        goto out;
+    }
+
+    if (seaf_fstat (fd, &st) == 0) {
+        istate->timestamp.sec = (unsigned int)st.st_mtime;
+        istate->timestamp.nsec = 0;
+    }
+    /* What was appended isn't in the map, later saves write it anew. */
+    istate->can_append = 0;
+    ret = 0;
+
+out:
+    if (seg)
+        g_byte_array_free (seg, TRUE);
+    if (file != MAP_FAILED)
+        munmap(file, istate->valid_size);
+    close (fd);
+    return ret;
 }
 
 int discard_index(struct index_state *istate)
@@ -1964,16 +2783,30 @@ int discard_index(struct index_state *istate)
     istate->timestamp.sec = 0;
     istate->timestamp.nsec = 0;
     istate->name_hash_initialized = 0;
-    g_hash_table_destroy (istate->name_hash);
+    free_name_hash (&istate->name_hash);
 #if defined WIN32 || defined __APPLE__
-    g_hash_table_destroy (istate->i_name_hash);
+    free_name_hash (&istate->i_name_hash);
 #endif
     /* cache_tree_free(&(istate->cache_tree)); */
+    if (istate->tree_ids) {
+        g_hash_table_unref (istate->tree_ids);
+        istate->tree_ids = NULL;
+    }
     /* free(istate->alloc); */
     free(istate->cache);
     istate->alloc = NULL;
     istate->initialized = 0;
 
+    /* After the entries, some of which may be in the map. */
+    if (istate->map) {
+        munmap(istate->map, istate->map_size);
+        istate->map = NULL;
+    }
+    g_free (istate->loaded);
+    istate->loaded = NULL;
+    istate->loaded_nr = 0;
+    istate->can_append = 0;
+
     /* no need to throw away allocated active_cache */
     return 0;
 }
@@ -1981,43 +2814,7 @@ int discard_index(struct index_state *istate)
 void cache_entry_free (struct cache_entry *ce)
 {
     g_free (ce->modifier);
-    free (ce);
-}
-
-void remove_name_hash(struct index_state *istate, struct cache_entry *ce)
-{
-    g_hash_table_remove (istate->name_hash, ce->name);
-
-#if defined WIN32 || defined __APPLE__
-    char *i_name = g_utf8_strdown (ce->name, -1);
-    g_hash_table_remove (istate->i_name_hash, i_name);
-    g_free (i_name);
-#endif
-}
-
-void add_name_hash(struct index_state *istate, struct cache_entry *ce)
-{
-    g_hash_table_insert (istate->name_hash, g_strdup(ce->name), ce);
-#if defined WIN32 || defined __APPLE__
-    g_hash_table_insert (istate->i_name_hash, g_utf8_strdown(ce->name, -1), ce);
-#endif
-}
-
-struct cache_entry *index_name_exists(struct index_state *istate,
-                                      const char *name, int namelen,
-                                      int igncase)
-{
-#if defined WIN32 || defined __APPLE__
-    if (!igncase)
-        return g_hash_table_lookup (istate->name_hash, name);
-    else {
-        struct cache_entry *ce;
-        char *i_name = g_utf8_strdown (name, -1);
-        ce = g_hash_table_lookup (istate->i_name_hash, i_name);
-        g_free (i_name);
-        return ce;
-    }
-#else
-    return g_hash_table_lookup (istate->name_hash, name);
-#endif
+    /* Mapped entries go with the map, in discard_index(). */
+    if (!(ce->ce_flags & CE_MAPPED))
+        free (ce);
 }
@@ -171,12 +171,52 @@ struct ondisk_cache_entry_extended {
 } __attribute__ ((packed));
 
 #define CACHE_EXT_MODIFIER 1
+#define CACHE_EXT_TREE_IDS 2
 
 struct cache_ext_hdr {
     unsigned int ext_name;
     unsigned int ext_size;
 } __attribute__ ((packed));
 
+/*
+ * Version 5 stores entries as struct cache_entry, in the layout and byte
+ * order of the machine, so that they are used in place from the mmap'ed
+ * file. The base part (header, entries, extensions and sha1) is followed
+ * by delta segments, appended by append_index() instead of writing the
+ * whole file again.
+ */
+struct cache_header5 {
+    unsigned int hdr_signature;
+    unsigned int hdr_version;
+    unsigned int hdr_entries;
+    unsigned int hdr_entry_size;    /* sizeof(struct cache_entry) */
+    guint64 hdr_base_size;          /* up to and including the sha1 */
+};
+
+#define CACHE_DELTA_SIGNATURE 0x444c5441    /* "DLTA" */
+
+/* At 8 byte offsets after the base part, followed by the sha1 of both. */
+struct cache_delta_hdr {
+    unsigned int delta_signature;
+    unsigned int delta_size;        /* of the ops */
+};
+
+/* Each op is padded to 8 bytes, so entries in it can be used in place. */
+struct cache_delta_op {
+    unsigned int op_type;
+    unsigned int op_size;
+};
+
+#define CACHE_DELTA_ENTRY 1             /* an entry, added or changed */
+#define CACHE_DELTA_REMOVE 2            /* struct cache_delta_remove */
+#define CACHE_DELTA_TREE_IDS 3          /* like CACHE_EXT_TREE_IDS */
+#define CACHE_DELTA_REMOVE_TREE_IDS 4   /* NUL terminated paths */
+
+struct cache_delta_remove {
+    unsigned int flags;             /* name length and stage */
+    char name[0];
+};
+
 struct cache_entry {
     struct cache_time64 ce_ctime;
     struct cache_time64 ce_mtime;
@@ -222,6 +262,13 @@ struct cache_entry {
 #define CE_UNPACKED          (1 << 24)
 #define CE_NEW_SKIP_WORKTREE (1 << 25)
 
+/*
+ * Entry of a version 5 index, used from the mmap'ed file. Its modifier
+ * is stored after the name, until ce_set_modifier() is called.
+ */
+#define CE_MAPPED            (1 << 26)
+#define CE_MODIFIER_INLINE   (1 << 27)
+
 /*
  * Extended on-disk flags
  */
@@ -247,16 +294,18 @@ struct cache_entry {
  * another. But we never change the name, or the hash state!
  */
 #define CE_STATE_MASK (CE_HASHED | CE_UNHASHED)
+/* Where the entry and its modifier are kept, never copied either. */
+#define CE_STORAGE_MASK (CE_MAPPED | CE_MODIFIER_INLINE)
 
 static inline void copy_cache_entry(struct cache_entry *dst, struct cache_entry *src)
 {
-    unsigned int state = dst->ce_flags & CE_STATE_MASK;
+    unsigned int state = dst->ce_flags & (CE_STATE_MASK | CE_STORAGE_MASK);
 
     /* Don't copy modifier, hash chain and name */
     memcpy(dst, src, offsetof(struct cache_entry, modifier));
 
     /* Restore the hash state */
-    dst->ce_flags = (dst->ce_flags & ~CE_STATE_MASK) | state;
+    dst->ce_flags = (dst->ce_flags & ~(CE_STATE_MASK | CE_STORAGE_MASK)) | state;
 }
 
 static inline unsigned create_ce_flags(size_t len, unsigned stage)
@@ -275,6 +324,7 @@ static inline size_t ce_namelen(const struct cache_entry *ce)
 }
 
 #define ce_size(ce) cache_entry_size(ce_namelen(ce))
+
 #define ondisk_ce_size(ce) ondisk_cache_entry_size(ce_namelen(ce))
 #define ondisk_ce_size2(ce) ondisk_cache_entry_size2(ce_namelen(ce))
 #define ce_stage(ce) ((CE_STAGEMASK & (ce)->ce_flags) >> CE_STAGESHIFT)
@@ -324,6 +374,35 @@ static inline unsigned int canon_mode(unsigned int mode)
 #define ondisk_cache_entry_size2(len) flexible_size(ondisk_cache_entry2,len)
 #define ondisk_cache_entry_extended_size(len) flexible_size(ondisk_cache_entry_extended,len)
 
+/* Use these rather than ce->modifier, which is NULL for mapped entries. */
+static inline const char *ce_modifier(const struct cache_entry *ce)
+{
+    if (ce->modifier || !(ce->ce_flags & CE_MODIFIER_INLINE))
+        return ce->modifier;
+    return (const char *)ce + ce_size(ce);
+}
+
+static inline void ce_set_modifier(struct cache_entry *ce, const char *modifier)
+{
+    g_free(ce->modifier);
+    ce->modifier = g_strdup(modifier);
+    ce->ce_flags &= ~CE_MODIFIER_INLINE;
+}
+
+/* See name-hash.c. */
+struct name_hash_slot {
+    unsigned int hash;          /* 0 if the slot is empty */
+    unsigned int len;           /* ce_namelen(ce) */
+    struct cache_entry *ce;
+};
+
+struct name_hash {
+    unsigned int size;          /* a power of 2 */
+    unsigned int nr;
+    int icase;
+    struct name_hash_slot *slots;
+};
+
 struct index_state {
     unsigned int version;
     struct cache_entry **cache;
@@ -333,11 +412,38 @@ struct index_state {
     void *alloc;
     unsigned name_hash_initialized : 1,
          initialized : 1;
-    GHashTable *name_hash;
+    struct name_hash name_hash;
 #if defined WIN32 || defined __APPLE__
-    GHashTable *i_name_hash;    /* ignore case */
+    struct name_hash i_name_hash;   /* ignore case */
 #endif
     int has_modifier;
+    /* dir path -> struct index_tree_id, see index_add_tree_id() */
+    GHashTable *tree_ids;
+
+    /*
+     * Version 5 index read from disk, which the CE_MAPPED entries are in.
+     * @loaded are the entries as read, for append_index() to diff against.
+     */
+    void *map;
+    size_t map_size;
+    size_t base_size;
+    size_t records_end;         /* where the extensions of the base start */
+    size_t valid_size;          /* up to the last intact delta segment */
+    guint64 file_size;
+    guint64 file_ino;
+    struct cache_entry **loaded;
+    unsigned int loaded_nr;
+    int can_append;
+};
+
+/*
+ * The dir id a span of index entries was committed as. @digest covers
+ * the entries themselves, so an id is only used while its entries are
+ * unchanged and the index doesn't have to invalidate ids on updates.
+ */
+struct index_tree_id {
+    unsigned char sha1[20];
+    unsigned char digest[20];
 };
 
 extern struct index_state the_index;
@@ -389,10 +495,23 @@ static inline enum object_type object_type(unsigned int mode)
 /* Initialize and use the cache information */
 extern int read_index(struct index_state *);
 extern int read_index_preload(struct index_state *, const char **pathspec);
+/*
+ * Stat the regular file entries of @index under @worktree on several
+ * threads, and mark the ones that match the worktree up-to-date, so that
+ * later serial passes can skip them. Does nothing for small indexes.
+ */
+extern void preload_index(struct index_state *, const char *worktree);
 extern int read_index_from(struct index_state *, const char *path, int repo_version);
 extern int is_index_unborn(struct index_state *);
 extern int read_index_unmerged(struct index_state *);
 extern int write_index(struct index_state *, int newfd);
+/*
+ * Append the changes since @istate was read from @path to the file.
+ * Returns 1 if the index has to be written with write_index() instead,
+ * because it isn't a version 5 index, changed on disk since, or has as
+ * many changes appended as is worth it. Returns -1 on errors.
+ */
+extern int append_index(struct index_state *, const char *path);
 extern int discard_index(struct index_state *);
 extern int unmerged_index(const struct index_state *);
 extern int verify_path(const char *path);
@@ -408,6 +527,20 @@ extern int remove_index_entry_at(struct index_state *, int pos);
 extern void remove_marked_cache_entries(struct index_state *istate);
 extern int remove_file_from_index(struct index_state *, const char *path);
 
+/* Record that the entries under dir @path were committed as @sha1. */
+extern void index_add_tree_id(struct index_state *, const char *path, int pathlen,
+                              const unsigned char *sha1);
+/* Like index_add_tree_id(), with the digest of the entries computed already. */
+extern void index_set_tree_id(struct index_state *, const char *path, int pathlen,
+                              const unsigned char *sha1, const unsigned char *digest);
+/* Returns 1 if the entries under dir @path are the ones committed as @sha1. */
+extern int index_tree_id_matches(struct index_state *, const char *path, int pathlen,
+                                 const unsigned char *sha1);
+
+struct SeafSHA1Ctx;
+/* Add the fields of @ce its dir id depends on to the digest of a dir. */
+extern void index_digest_entry(struct SeafSHA1Ctx *ctx, const struct cache_entry *ce);
+
 #define ADD_CACHE_VERBOSE 1
 #define ADD_CACHE_PRETEND 2
 #define ADD_CACHE_IGNORE_ERRORS    4
@@ -433,6 +566,28 @@ int add_to_index(const char *repo_id,
                  const char *modifier,
                  gboolean *added);
 
+/*
+ * Like add_to_index(), with the file already indexed as @file_id by
+ * @index_cb, so that files can be chunked in parallel and added in order.
+ * @index_cb is still used where the id has to be recomputed.
+ */
+int add_to_index_with_id(const char *repo_id,
+                         int version,
+                         struct index_state *istate,
+                         const char *path,
+                         const char *full_path,
+                         SeafStat *st,
+                         int flags,
+                         struct SeafileCrypt *crypt,
+                         IndexCB index_cb,
+                         const char *modifier,
+                         const unsigned char *file_id,
+                         gboolean *added);
+
+/* Whether add_to_index() would have to index the file again. */
+gboolean
+index_file_changed (struct index_state *istate, const char *path, SeafStat *st);
+
 int
 add_empty_dir_to_index (struct index_state *istate,
                         const char *path,
@@ -480,6 +635,8 @@ extern int index_path(unsigned char *sha1, const char *path, SeafStat *st);
 extern void fill_stat_cache_info(struct cache_entry *ce, SeafStat *st);
 extern void mark_all_ce_unused(struct index_state *index);
 
+void init_name_hash (struct name_hash *table, unsigned int nr, int icase);
+void free_name_hash (struct name_hash *table);
 void remove_name_hash(struct index_state *istate, struct cache_entry *ce);
 void add_name_hash(struct index_state *istate, struct cache_entry *ce);
 struct cache_entry *index_name_exists(struct index_state *istate,
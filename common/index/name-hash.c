@@ -1,195 +1,282 @@
+/* -*- Mode: C; tab-width: 4; indent-tabs-mode: nil; c-basic-offset: 4 -*- */
 /*
  * name-hash.c
  *
  * Hashing names in the index state
  *
- * Copyright (C) 2008 Linus Torvalds
+ * An open-addressing table with linear probing. Each slot keeps the
+ * hash and length of the name next to the entry, so most probes are
+ * decided without touching the cache entry itself. Removal shifts the
+ * following slots back, so there are no tombstones to skip or clean up.
  */
 #define NO_THE_INDEX_COMPATIBILITY_MACROS
+
+#ifdef HAVE_CONFIG_H
+#include <config.h>
+#endif
+
+#include "common.h"
+
 #include "index.h"
 
+#include <glib.h>
+
+#define NAME_HASH_MIN_SIZE 64
+
+/* Keep the table at most 70% full. */
+#define NAME_HASH_FULL(size, nr) ((guint64)(nr) * 10 >= (guint64)(size) * 7)
+
+static inline unsigned int
+fnv_step (unsigned int hash, unsigned char c)
+{
+    return (hash ^ c) * 16777619U;
+}
+
+static inline unsigned int
+fix_hash (unsigned int hash)
+{
+    /* 0 marks an empty slot. */
+    return hash ? hash : 1;
+}
+
+static gboolean
+is_ascii (const char *name, int namelen)
+{
+    int i;
+
+    for (i = 0; i < namelen; ++i)
+        if ((unsigned char)name[i] & 0x80)
+            return FALSE;
+    return TRUE;
+}
+
+static unsigned int
+hash_exact (const char *name, int namelen)
+{
+    unsigned int hash = 2166136261U;
+    int i;
+
+    for (i = 0; i < namelen; ++i)
+        hash = fnv_step (hash, (unsigned char)name[i]);
+    return fix_hash (hash);
+}
+
 /*
- * This removes bit 5 if bit 6 is set.
- *
- * That will make US-ASCII characters hash to their upper-case
- * equivalent. We could easily do this one whole word at a time,
- * but that's for future worries.
+ * Names are folded the way g_utf8_strdown() does. Only names with non-ASCII
+ * characters need a folded copy, the rest are folded byte by byte.
  */
-static inline unsigned char icase_hash(unsigned char c)
+static unsigned int
+hash_icase (const char *name, int namelen)
 {
-    return c & ~((c & 0x40) >> 1);
+    unsigned int hash = 2166136261U;
+    char *folded;
+    int i;
+
+    if (is_ascii (name, namelen)) {
+        for (i = 0; i < namelen; ++i)
+            hash = fnv_step (hash, g_ascii_tolower (name[i]));
+        return fix_hash (hash);
+    }
+
+    folded = g_utf8_strdown (name, namelen);
+    hash = hash_exact (folded, strlen(folded));
+    g_free (folded);
+    return hash;
 }
 
-unsigned int hash_name(const char *name, int namelen)
+static gboolean
+same_name_icase (const char *name1, int len1, const char *name2, int len2)
 {
-    unsigned int hash = 0x123;
+    char *folded1, *folded2;
+    gboolean ret;
 
-    do {
-        unsigned char c = *name++;
-        c = icase_hash(c);
-        hash = hash*101 + c;
-    } while (--namelen);
-    return hash;
+    if (is_ascii (name1, len1) && is_ascii (name2, len2))
+        return len1 == len2 && g_ascii_strncasecmp (name1, name2, len1) == 0;
+
+    folded1 = g_utf8_strdown (name1, len1);
+    folded2 = g_utf8_strdown (name2, len2);
+    ret = (strcmp (folded1, folded2) == 0);
+    g_free (folded1);
+    g_free (folded2);
+    return ret;
 }
 
-#if 0
-static void hash_index_entry_directories(struct index_state *istate, struct cache_entry *ce)
+static inline unsigned int
+name_hash_of (const struct name_hash *table, const char *name, int namelen)
 {
-    /*
-     * Throw each directory component in the hash for quick lookup
-     * during a git status. Directory components are stored with their
-     * closing slash.  Despite submodules being a directory, they never
-     * reach this point, because they are stored without a closing slash
-     * in the cache.
-     *
-     * Note that the cache_entry stored with the directory does not
-     * represent the directory itself.  It is a pointer to an existing
-     * filename, and its only purpose is to represent existence of the
-     * directory in the cache.  It is very possible multiple directory
-     * hash entries may point to the same cache_entry.
-     */
-    unsigned int hash;
-    void **pos;
-
-    const char *ptr = ce->name;
-    while (*ptr) {
-        while (*ptr && *ptr != '/')
-            ++ptr;
-        if (*ptr == '/') {
-            ++ptr;
-            hash = hash_name(ce->name, ptr - ce->name);
-            if (!lookup_hash(hash, &istate->name_hash)) {
-                pos = insert_hash(hash, ce, &istate->name_hash);
-                if (pos) {
-                    ce->next = *pos;
-                    *pos = ce;
-                }
-            }
-        }
+    return table->icase ? hash_icase (name, namelen) : hash_exact (name, namelen);
+}
+
+static inline gboolean
+slot_matches (const struct name_hash *table, const struct name_hash_slot *slot,
+              unsigned int hash, const char *name, int namelen)
+{
+    if (slot->hash != hash)
+        return FALSE;
+    if (!table->icase)
+        return slot->len == (unsigned int)namelen &&
+            memcmp (slot->ce->name, name, namelen) == 0;
+    return same_name_icase (slot->ce->name, slot->len, name, namelen);
+}
+
+/* The slot with @name, or the empty slot where it would go. */
+static struct name_hash_slot *
+find_slot (const struct name_hash *table, unsigned int hash,
+           const char *name, int namelen)
+{
+    unsigned int mask = table->size - 1;
+    unsigned int i = hash & mask;
+    struct name_hash_slot *slot;
+
+    while (1) {
+        slot = &table->slots[i];
+        if (!slot->hash || slot_matches (table, slot, hash, name, namelen))
+            return slot;
+        i = (i + 1) & mask;
     }
 }
-#endif
 
-static void hash_index_entry(struct index_state *istate, struct cache_entry *ce)
+static void
+resize_name_hash (struct name_hash *table, unsigned int size)
 {
-    void **pos;
-    unsigned int hash;
+    struct name_hash_slot *old_slots = table->slots;
+    unsigned int old_size = table->size;
+    unsigned int i, j, mask;
 
-    if (ce->ce_flags & CE_HASHED)
-        return;
-    ce->ce_flags |= CE_HASHED;
-    ce->next = NULL;
-    hash = hash_name(ce->name, ce_namelen(ce));
-    pos = insert_hash(hash, ce, &istate->name_hash);
-    if (pos) {
-        ce->next = *pos;
-        *pos = ce;
+    table->slots = g_new0 (struct name_hash_slot, size);
+    table->size = size;
+    mask = size - 1;
+
+    /* Hashes are kept in the slots, and names are already unique. */
+    for (i = 0; i < old_size; ++i) {
+        if (!old_slots[i].hash)
+            continue;
+        j = old_slots[i].hash & mask;
+        while (table->slots[j].hash)
+            j = (j + 1) & mask;
+        table->slots[j] = old_slots[i];
     }
 
-    /* if (ignore_case) */
-    /*  hash_index_entry_directories(istate, ce); */
+    g_free (old_slots);
 }
 
-static void lazy_init_name_hash(struct index_state *istate)
+void
+init_name_hash (struct name_hash *table, unsigned int nr, int icase)
 {
-    int nr;
+    unsigned int size = NAME_HASH_MIN_SIZE;
 
-    if (istate->name_hash_initialized)
-        return;
-    for (nr = 0; nr < istate->cache_nr; nr++)
-        hash_index_entry(istate, istate->cache[nr]);
-    istate->name_hash_initialized = 1;
+    /* Size it for @nr entries up front, to avoid growing while loading. */
+    while (NAME_HASH_FULL(size, nr))
+        size <<= 1;
+
+    table->slots = g_new0 (struct name_hash_slot, size);
+    table->size = size;
+    table->nr = 0;
+    table->icase = icase;
 }
 
-void add_name_hash(struct index_state *istate, struct cache_entry *ce)
+void
+free_name_hash (struct name_hash *table)
 {
-    ce->ce_flags &= ~CE_UNHASHED;
-    if (istate->name_hash_initialized)
-        hash_index_entry(istate, ce);
+    g_free (table->slots);
+    table->slots = NULL;
+    table->size = 0;
+    table->nr = 0;
 }
 
-#if 0
-static int slow_same_name(const char *name1, int len1, const char *name2, int len2)
+/* Map the name of @ce to @ce, replacing any entry with the same name. */
+static void
+name_hash_insert (struct name_hash *table, struct cache_entry *ce)
 {
-    if (len1 != len2)
-        return 0;
+    int namelen = ce_namelen(ce);
+    unsigned int hash;
+    struct name_hash_slot *slot;
 
-    while (len1) {
-        unsigned char c1 = *name1++;
-        unsigned char c2 = *name2++;
-        len1--;
-        if (c1 != c2) {
-            c1 = toupper(c1);
-            c2 = toupper(c2);
-            if (c1 != c2)
-                return 0;
-        }
-    }
-    return 1;
+    if (!table->slots)
+        return;
+
+    if (NAME_HASH_FULL(table->size, table->nr + 1))
+        resize_name_hash (table, table->size << 1);
+
+    hash = name_hash_of (table, ce->name, namelen);
+    slot = find_slot (table, hash, ce->name, namelen);
+    if (!slot->hash)
+        ++table->nr;
+    slot->hash = hash;
+    slot->len = namelen;
+    slot->ce = ce;
 }
-#endif
 
-static int same_name(const struct cache_entry *ce, const char *name, int namelen, int icase)
+static void
+name_hash_remove (struct name_hash *table, const char *name, int namelen)
 {
-    int len = ce_namelen(ce);
+    unsigned int mask = table->size - 1;
+    unsigned int i, j, home;
+    struct name_hash_slot *slot;
 
-    /*
-     * Always do exact compare, even if we want a case-ignoring comparison;
-     * we do the quick exact one first, because it will be the common case.
-     */
-    if (len == namelen && !cache_name_compare(name, namelen, ce->name, len))
-        return 1;
-    else
-        return 0;
-
-    /* if (!icase) */
-    /*  return 0; */
+    if (!table->slots)
+        return;
 
-    /*
-     * If the entry we're comparing is a filename (no trailing slash), then compare
-     * the lengths exactly.
-     */
-    /* if (name[namelen - 1] != '/') */
-    /*  return slow_same_name(name, namelen, ce->name, len); */
+    slot = find_slot (table, name_hash_of (table, name, namelen), name, namelen);
+    if (!slot->hash)
+        return;
 
     /*
-     * For a directory, we point to an arbitrary cache_entry filename.  Just
-     * make sure the directory portion matches.
+     * Move back the slots after the hole that can't be reached from
+     * their home slot any more.
      */
-    /* return slow_same_name(name, namelen, ce->name, namelen < len ? namelen : len); */
+    i = slot - table->slots;
+    j = i;
+    while (1) {
+        j = (j + 1) & mask;
+        if (!table->slots[j].hash)
+            break;
+        home = table->slots[j].hash & mask;
+        /* Leave it if its home is cyclically in (i, j]. */
+        if (i <= j ? (i < home && home <= j) : (i < home || home <= j))
+            continue;
+        table->slots[i] = table->slots[j];
+        i = j;
+    }
+    memset (&table->slots[i], 0, sizeof(struct name_hash_slot));
+    --table->nr;
 }
 
-struct cache_entry *index_name_exists(struct index_state *istate, const char *name, int namelen, int icase)
+static struct cache_entry *
+name_hash_lookup (const struct name_hash *table, const char *name, int namelen)
 {
-    unsigned int hash = hash_name(name, namelen);
-    struct cache_entry *ce;
+    struct name_hash_slot *slot;
 
-    lazy_init_name_hash(istate);
-    ce = lookup_hash(hash, &istate->name_hash);
+    if (!table->slots || table->nr == 0)
+        return NULL;
 
-    while (ce) {
-        if (!(ce->ce_flags & CE_UNHASHED)) {
-            if (same_name(ce, name, namelen, icase))
-                return ce;
-        }
-        ce = ce->next;
-    }
+    slot = find_slot (table, name_hash_of (table, name, namelen), name, namelen);
+    return slot->hash ? slot->ce : NULL;
+}
 
-    /*
-     * Might be a submodule.  Despite submodules being directories,
-     * they are stored in the name hash without a closing slash.
-     * When ignore_case is 1, directories are stored in the name hash
-     * with their closing slash.
-     *
-     * The side effect of this storage technique is we have need to
-     * remove the slash from name and perform the lookup again without
-     * the slash.  If a match is made, S_ISGITLINK(ce->mode) will be
-     * true.
-     */
-    /* if (icase && name[namelen - 1] == '/') { */
-    /*  ce = index_name_exists(istate, name, namelen - 1, icase); */
-    /*  if (ce && S_ISGITLINK(ce->ce_mode)) */
-    /*      return ce; */
-    /* } */
-    return NULL;
+void remove_name_hash(struct index_state *istate, struct cache_entry *ce)
+{
+    name_hash_remove (&istate->name_hash, ce->name, ce_namelen(ce));
+#if defined WIN32 || defined __APPLE__
+    name_hash_remove (&istate->i_name_hash, ce->name, ce_namelen(ce));
+#endif
+}
+
+void add_name_hash(struct index_state *istate, struct cache_entry *ce)
+{
+    name_hash_insert (&istate->name_hash, ce);
+#if defined WIN32 || defined __APPLE__
+    name_hash_insert (&istate->i_name_hash, ce);
+#endif
+}
+
+struct cache_entry *index_name_exists(struct index_state *istate,
+                                      const char *name, int namelen,
+                                      int igncase)
+{
+#if defined WIN32 || defined __APPLE__
+    if (igncase)
+        return name_hash_lookup (&istate->i_name_hash, name, namelen);
+#endif
+    return name_hash_lookup (&istate->name_hash, name, namelen);
 }
@@ -0,0 +1,94 @@
+/* -*- Mode: C; tab-width: 4; indent-tabs-mode: nil; c-basic-offset: 4 -*- */
+
+/*
+ * Parallel stat of index entries, like git's preload-index.
+ */
+
+#include <config.h>
+#include "common.h"
+#include "utils.h"
+#include "index.h"
+
+#include <pthread.h>
+
+/* Don't start more threads than this. */
+#define MAX_PRELOAD_THREADS 20
+
+/* Minimum number of entries handled by one thread. Below that, thread
+ * startup costs more than the stats it saves.
+ */
+#define PRELOAD_THREAD_COST 500
+
+struct preload_range {
+    struct index_state *index;
+    const char *worktree;
+    int offset;
+    int nr;
+    pthread_t tid;
+};
+
+static void *
+preload_thread (void *data)
+{
+    struct preload_range *p = data;
+    struct cache_entry **cep = p->index->cache + p->offset;
+    struct cache_entry *ce;
+    char path[SEAF_PATH_MAX];
+    SeafStat st;
+    int nr = p->nr;
+
+    for (; nr > 0; --nr, ++cep) {
+        ce = *cep;
+
+        if (ce_stage(ce) || ce_uptodate(ce) || ce_skip_worktree(ce))
+            continue;
+        if (!S_ISREG(ce->ce_mode))
+            continue;
+
+        snprintf (path, SEAF_PATH_MAX, "%s/%s", p->worktree, ce->name);
+        if (seaf_stat (path, &st) < 0)
+            continue;
+        if (ie_match_stat (ce, &st, 0) != 0)
+            continue;
+
+        /* Each thread only touches entries in its own range. */
+        ce_mark_uptodate (ce);
+    }
+
+    return NULL;
+}
+
+void
+preload_index (struct index_state *index, const char *worktree)
+{
+    struct preload_range ranges[MAX_PRELOAD_THREADS];
+    gboolean started[MAX_PRELOAD_THREADS];
+    int threads, work, offset, i;
+
+    threads = index->cache_nr / PRELOAD_THREAD_COST;
+    if (threads < 2)
+        return;
+    if (threads > MAX_PRELOAD_THREADS)
+        threads = MAX_PRELOAD_THREADS;
+
+    work = (index->cache_nr + threads - 1) / threads;
+    offset = 0;
+    for (i = 0; i < threads; ++i) {
+        struct preload_range *p = &ranges[i];
+
+        p->index = index;
+        p->worktree = worktree;
+        p->offset = offset;
+        p->nr = MIN (work, (int)index->cache_nr - offset);
+        offset += p->nr;
+
+        started[i] = (pthread_create (&p->tid, NULL, preload_thread, p) == 0);
+        if (!started[i])
+            preload_thread (p);
+    }
+
+    for (i = 0; i < threads; ++i) {
+        if (started[i])
+            pthread_join (ranges[i].tid, NULL);
+    }
+}
@@ -0,0 +1,316 @@
+/* -*- Mode: C; tab-width: 4; indent-tabs-mode: nil; c-basic-offset: 4 -*- */
+
+#include "common.h"
+
+#include <pthread.h>
+
+#include "utils.h"
+#include "io-stats.h"
+
+/* Upper bounds of the histogram buckets, in microseconds. */
+static const gint64 bucket_bounds[] = {
+    50, 100, 250, 500,
+    1000, 2500, 5000,
+    10000, 25000, 50000,
+    100000, 250000, 500000,
+    1000000, 2500000, 5000000,
+    10000000,
+};
+#define N_BUCKETS G_N_ELEMENTS(bucket_bounds)
+
+static const char *op_names[N_IO_OPS] = {
+    "open",
+    "read",
+    "write",
+    "commit",
+    "exists",
+    "stat",
+    "delete",
+};
+
+typedef struct OpStats {
+    gint64 buckets[N_BUCKETS + 1]; /* the last one is +Inf */
+    gint64 sum;                    /* microseconds */
+    gint64 count;
+    gint64 errors;
+    gint64 bytes;
+} OpStats;
+
+/* Only the owning thread writes to it, see http-metrics.c. */
+typedef struct ThreadIoStats {
+    OpStats ops[IO_STATS_MAX_SOURCES][N_IO_OPS];
+} ThreadIoStats;
+
+static char *store_names[IO_STATS_MAX_SOURCES];
+static char *backend_names[IO_STATS_MAX_SOURCES];
+static int n_sources;
+
+static pthread_once_t stats_once = PTHREAD_ONCE_INIT;
+static pthread_key_t stats_key;
+
+static GList *all_stats;        /* every ThreadIoStats ever created */
+static GList *free_stats;       /* those whose thread has exited */
+static pthread_mutex_t stats_lock = PTHREAD_MUTEX_INITIALIZER;
+
+static void
+release_thread_stats (void *data)
+{
+    pthread_mutex_lock (&stats_lock);
+    free_stats = g_list_prepend (free_stats, data);
+    pthread_mutex_unlock (&stats_lock);
+}
+
+static void
+create_key (void)
+{
+    pthread_key_create (&stats_key, release_thread_stats);
+}
+
+static ThreadIoStats *
+get_thread_stats (void)
+{
+    ThreadIoStats *stats;
+
+    pthread_once (&stats_once, create_key);
+
+    stats = pthread_getspecific (stats_key);
+    if (stats)
+        return stats;
+
+    pthread_mutex_lock (&stats_lock);
+    if (free_stats) {
+        stats = free_stats->data;
+        free_stats = g_list_delete_link (free_stats, free_stats);
+    } else {
+        stats = g_new0 (ThreadIoStats, 1);
+        all_stats = g_list_prepend (all_stats, stats);
+    }
+    pthread_mutex_unlock (&stats_lock);
+
+    pthread_setspecific (stats_key, stats);
+
+    return stats;
+}
+
+int
+io_stats_register (const char *store, const char *backend)
+{
+    int i, ret = -1;
+
+    pthread_mutex_lock (&stats_lock);
+
+    for (i = 0; i < n_sources; ++i) {
+        if (strcmp (store_names[i], store) == 0 &&
+            strcmp (backend_names[i], backend) == 0) {
+            ret = i;
+            goto out;
+        }
+    }
+
+    if (n_sources < IO_STATS_MAX_SOURCES) {
+        store_names[n_sources] = g_strdup (store);
+        backend_names[n_sources] = g_strdup (backend);
+        ret = n_sources++;
+    }
+
+out:
+    pthread_mutex_unlock (&stats_lock);
+    return ret;
+}
+
+void
+io_stats_observe (int source, IoOp op, gint64 start, gint64 bytes,
+                  gboolean failed)
+{
+    OpStats *stats;
+    gint64 elapsed;
+    int i;
+
+    if (source < 0)
+        return;
+
+    stats = &get_thread_stats()->ops[source][op];
+    elapsed = get_current_time () - start;
+    if (elapsed < 0)
+        elapsed = 0;
+
+    for (i = 0; i < N_BUCKETS; ++i) {
+        if (elapsed <= bucket_bounds[i])
+            break;
+    }
+    ++stats->buckets[i];
+    stats->sum += elapsed;
+    ++stats->count;
+    if (failed)
+        ++stats->errors;
+    else if (bytes > 0)
+        stats->bytes += bytes;
+}
+
+/* Add up the stats of all threads. Returns the number of sources. */
+static int
+collect (OpStats total[IO_STATS_MAX_SOURCES][N_IO_OPS])
+{
+    ThreadIoStats *stats;
+    OpStats *src, *dst;
+    GList *ptr;
+    int n, i, j, k;
+
+    memset (total, 0, sizeof(OpStats) * IO_STATS_MAX_SOURCES * N_IO_OPS);
+
+    pthread_mutex_lock (&stats_lock);
+    n = n_sources;
+    for (ptr = all_stats; ptr; ptr = ptr->next) {
+        stats = ptr->data;
+        for (i = 0; i < n; ++i) {
+            for (j = 0; j < N_IO_OPS; ++j) {
+                src = &stats->ops[i][j];
+                dst = &total[i][j];
+                for (k = 0; k <= N_BUCKETS; ++k)
+                    dst->buckets[k] += src->buckets[k];
+                dst->sum += src->sum;
+                dst->count += src->count;
+                dst->errors += src->errors;
+                dst->bytes += src->bytes;
+            }
+        }
+    }
+    pthread_mutex_unlock (&stats_lock);
+
+    return n;
+}
+
+/* Upper bound of the bucket the @q quantile falls in, -1 if beyond. */
+static gint64
+quantile (OpStats *stats, double q)
+{
+    gint64 rank = (gint64)(stats->count * q), cumulative = 0;
+    int i;
+
+    for (i = 0; i < N_BUCKETS; ++i) {
+        cumulative += stats->buckets[i];
+        if (cumulative > rank)
+            return bucket_bounds[i];
+    }
+    return -1;
+}
+
+char *
+io_stats_dump (void)
+{
+    OpStats total[IO_STATS_MAX_SOURCES][N_IO_OPS];
+    OpStats *stats;
+    GString *out;
+    gint64 cumulative;
+    int n, i, j, k;
+
+    n = collect (total);
+
+    out = g_string_new (NULL);
+
+    g_string_append (out,
+                     "# HELP seafile_storage_ops_total Storage operations.\n"
+                     "# TYPE seafile_storage_ops_total counter\n");
+    for (i = 0; i < n; ++i)
+        for (j = 0; j < N_IO_OPS; ++j)
+            if (total[i][j].count > 0)
+                g_string_append_printf (out,
+                                        "seafile_storage_ops_total{store=\"%s\",backend=\"%s\",op=\"%s\"} %"G_GINT64_FORMAT"\n",
+                                        store_names[i], backend_names[i],
+                                        op_names[j], total[i][j].count);
+
+    g_string_append (out,
+                     "# HELP seafile_storage_errors_total Storage operations that failed.\n"
+                     "# TYPE seafile_storage_errors_total counter\n");
+    for (i = 0; i < n; ++i)
+        for (j = 0; j < N_IO_OPS; ++j)
+            if (total[i][j].count > 0)
+                g_string_append_printf (out,
+                                        "seafile_storage_errors_total{store=\"%s\",backend=\"%s\",op=\"%s\"} %"G_GINT64_FORMAT"\n",
+                                        store_names[i], backend_names[i],
+                                        op_names[j], total[i][j].errors);
+
+    g_string_append (out,
+                     "# HELP seafile_storage_bytes_total Bytes read or written.\n"
+                     "# TYPE seafile_storage_bytes_total counter\n");
+    for (i = 0; i < n; ++i)
+        for (j = 0; j < N_IO_OPS; ++j)
+            if (total[i][j].bytes > 0)
+                g_string_append_printf (out,
+                                        "seafile_storage_bytes_total{store=\"%s\",backend=\"%s\",op=\"%s\"} %"G_GINT64_FORMAT"\n",
+                                        store_names[i], backend_names[i],
+                                        op_names[j], total[i][j].bytes);
+
+    g_string_append (out,
+                     "# HELP seafile_storage_op_seconds Latency of storage operations.\n"
+                     "# TYPE seafile_storage_op_seconds histogram\n");
+    for (i = 0; i < n; ++i) {
+        for (j = 0; j < N_IO_OPS; ++j) {
+            stats = &total[i][j];
+            if (stats->count == 0)
+                continue;
+
+            cumulative = 0;
+            for (k = 0; k < N_BUCKETS; ++k) {
+                cumulative += stats->buckets[k];
+                g_string_append_printf (out,
+                                        "seafile_storage_op_seconds_bucket{store=\"%s\",backend=\"%s\",op=\"%s\",le=\"%g\"} %"G_GINT64_FORMAT"\n",
+                                        store_names[i], backend_names[i],
+                                        op_names[j], bucket_bounds[k] / 1e6,
+                                        cumulative);
+            }
+            g_string_append_printf (out,
+                                    "seafile_storage_op_seconds_bucket{store=\"%s\",backend=\"%s\",op=\"%s\",le=\"+Inf\"} %"G_GINT64_FORMAT"\n"
+                                    "seafile_storage_op_seconds_sum{store=\"%s\",backend=\"%s\",op=\"%s\"} %.6f\n"
+                                    "seafile_storage_op_seconds_count{store=\"%s\",backend=\"%s\",op=\"%s\"} %"G_GINT64_FORMAT"\n",
+                                    store_names[i], backend_names[i], op_names[j],
+                                    stats->count,
+                                    store_names[i], backend_names[i], op_names[j],
+                                    stats->sum / 1e6,
+                                    store_names[i], backend_names[i], op_names[j],
+                                    stats->count);
+        }
+    }
+
+    return g_string_free (out, FALSE);
+}
+
+char *
+io_stats_to_json (void)
+{
+    OpStats total[IO_STATS_MAX_SOURCES][N_IO_OPS];
+    OpStats *stats;
+    GString *buf;
+    gboolean first_op;
+    int n, i, j;
+
+    n = collect (total);
+
+    buf = g_string_new ("{");
+    for (i = 0; i < n; ++i) {
+        g_string_append_printf (buf, "%s\"%s:%s\": {", i ? ", " : "",
+                                store_names[i], backend_names[i]);
+        first_op = TRUE;
+        for (j = 0; j < N_IO_OPS; ++j) {
+            stats = &total[i][j];
+            if (stats->count == 0)
+                continue;
+            g_string_append_printf (buf, "%s\"%s\": {\"count\": %"G_GINT64_FORMAT", "
+                                    "\"errors\": %"G_GINT64_FORMAT", "
+                                    "\"bytes\": %"G_GINT64_FORMAT", "
+                                    "\"avg_us\": %"G_GINT64_FORMAT", "
+                                    "\"p50_us\": %"G_GINT64_FORMAT", "
+                                    "\"p99_us\": %"G_GINT64_FORMAT"}",
+                                    first_op ? "" : ", ", op_names[j],
+                                    stats->count, stats->errors, stats->bytes,
+                                    stats->sum / stats->count,
+                                    quantile (stats, 0.5),
+                                    quantile (stats, 0.99));
+            first_op = FALSE;
+        }
+        g_string_append (buf, "}");
+    }
+    g_string_append (buf, "}");
+
+    return g_string_free (buf, FALSE);
+}
@@ -0,0 +1,52 @@
+/* -*- Mode: C; tab-width: 4; indent-tabs-mode: nil; c-basic-offset: 4 -*- */
+
+#ifndef IO_STATS_H
+#define IO_STATS_H
+
+#include <glib.h>
+
+/*
+ * Operation counters and latency histograms of the object and block
+ * stores, by store and backend.
+ *
+ * Like the HTTP metrics, each thread counts in its own copy without
+ * locking, and the copies of all threads are added up when the stats
+ * are read.
+ */
+
+typedef enum IoOp {
+    IO_OP_OPEN,
+    IO_OP_READ,
+    IO_OP_WRITE,
+    IO_OP_COMMIT,
+    IO_OP_EXISTS,
+    IO_OP_STAT,
+    IO_OP_DELETE,
+    N_IO_OPS
+} IoOp;
+
+/* Most stores that can be registered. */
+#define IO_STATS_MAX_SOURCES 8
+
+/*
+ * Register a store, such as "commits", "fs" or "blocks", using @backend.
+ * Returns the source to count its operations under, or -1 if there are
+ * too many stores already.
+ */
+int
+io_stats_register (const char *store, const char *backend);
+
+/* Count one operation of @source, started at @start from get_current_time(). */
+void
+io_stats_observe (int source, IoOp op, gint64 start, gint64 bytes,
+                  gboolean failed);
+
+/* The stats in the Prometheus text format. */
+char *
+io_stats_dump (void);
+
+/* The stats as a JSON object, keyed by "<store>:<backend>" and op. */
+char *
+io_stats_to_json (void);
+
+#endif
@@ -0,0 +1,136 @@
+/* -*- Mode: C; tab-width: 4; indent-tabs-mode: nil; c-basic-offset: 4 -*- */
+
+#include "common.h"
+
+#include <pthread.h>
+
+#include "mem-stats.h"
+
+typedef struct MemSource {
+    char *name;
+    MemStatsFunc func;
+    gpointer data;
+} MemSource;
+
+/* Sources are only added, at startup, and never removed. */
+static GList *sources;
+static pthread_mutex_t sources_lock = PTHREAD_MUTEX_INITIALIZER;
+
+void
+mem_stats_register (const char *name, MemStatsFunc func, gpointer data)
+{
+    MemSource *source = g_new0 (MemSource, 1);
+
+    source->name = g_strdup (name);
+    source->func = func;
+    source->data = data;
+
+    pthread_mutex_lock (&sources_lock);
+    sources = g_list_append (sources, source);
+    pthread_mutex_unlock (&sources_lock);
+}
+
+/* Returns the stats of all sources, in registration order. */
+static GArray *
+collect (GList **names)
+{
+    GArray *all = g_array_new (FALSE, TRUE, sizeof(MemStats));
+    MemSource *source;
+    MemStats stats;
+    GList *ptr;
+
+    *names = NULL;
+
+    pthread_mutex_lock (&sources_lock);
+    for (ptr = sources; ptr; ptr = ptr->next) {
+        source = ptr->data;
+        memset (&stats, 0, sizeof(stats));
+        source->func (source->data, &stats);
+        g_array_append_val (all, stats);
+        *names = g_list_prepend (*names, source->name);
+    }
+    pthread_mutex_unlock (&sources_lock);
+
+    /* Names are never freed, so they can be used without the lock. */
+    *names = g_list_reverse (*names);
+    return all;
+}
+
+char *
+mem_stats_dump (void)
+{
+    GArray *all;
+    GList *names, *ptr;
+    MemStats *stats;
+    GString *out;
+    int i;
+
+    all = collect (&names);
+    out = g_string_new (NULL);
+
+    g_string_append (out,
+                     "# HELP seafile_memory_bytes Estimated memory held.\n"
+                     "# TYPE seafile_memory_bytes gauge\n");
+    for (ptr = names, i = 0; ptr; ptr = ptr->next, ++i)
+        g_string_append_printf (out,
+                                "seafile_memory_bytes{subsystem=\"%s\"} %"G_GINT64_FORMAT"\n",
+                                (char *)ptr->data,
+                                g_array_index (all, MemStats, i).bytes);
+
+    g_string_append (out,
+                     "# HELP seafile_memory_entries Entries held.\n"
+                     "# TYPE seafile_memory_entries gauge\n");
+    for (ptr = names, i = 0; ptr; ptr = ptr->next, ++i)
+        g_string_append_printf (out,
+                                "seafile_memory_entries{subsystem=\"%s\"} %"G_GINT64_FORMAT"\n",
+                                (char *)ptr->data,
+                                g_array_index (all, MemStats, i).entries);
+
+    g_string_append (out,
+                     "# HELP seafile_memory_evictions_total Entries dropped to stay within the limits.\n"
+                     "# TYPE seafile_memory_evictions_total counter\n");
+    for (ptr = names, i = 0; ptr; ptr = ptr->next, ++i) {
+        stats = &g_array_index (all, MemStats, i);
+        if (stats->max_entries == 0 && stats->max_bytes == 0)
+            continue;
+        g_string_append_printf (out,
+                                "seafile_memory_evictions_total{subsystem=\"%s\"} %"G_GINT64_FORMAT"\n",
+                                (char *)ptr->data, stats->evictions);
+    }
+
+    g_list_free (names);
+    g_array_free (all, TRUE);
+    return g_string_free (out, FALSE);
+}
+
+char *
+mem_stats_to_json (void)
+{
+    GArray *all;
+    GList *names, *ptr;
+    MemStats *stats;
+    GString *buf;
+    gint64 total = 0;
+    int i;
+
+    all = collect (&names);
+    buf = g_string_new ("{");
+
+    for (ptr = names, i = 0; ptr; ptr = ptr->next, ++i) {
+        stats = &g_array_index (all, MemStats, i);
+        total += stats->bytes;
+        g_string_append_printf (buf, "\"%s\": {\"bytes\": %"G_GINT64_FORMAT", "
+                                "\"entries\": %"G_GINT64_FORMAT", "
+                                "\"max_bytes\": %"G_GINT64_FORMAT", "
+                                "\"max_entries\": %"G_GINT64_FORMAT", "
+                                "\"evictions\": %"G_GINT64_FORMAT"}, ",
+                                (char *)ptr->data, stats->bytes, stats->entries,
+                                stats->max_bytes, stats->max_entries,
+                                stats->evictions);
+    }
+    g_string_append_printf (buf, "\"total_bytes\": %"G_GINT64_FORMAT"}", total);
+
+    g_list_free (names);
+    g_array_free (all, TRUE);
+    return g_string_free (buf, FALSE);
+}
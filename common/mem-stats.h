@@ -0,0 +1,44 @@
+/* -*- Mode: C; tab-width: 4; indent-tabs-mode: nil; c-basic-offset: 4 -*- */
+
+#ifndef MEM_STATS_H
+#define MEM_STATS_H
+
+#include <glib.h>
+
+/*
+ * Memory accounting of the caches and other long-lived structures, so
+ * that the growth of a long-running process can be put down to one of
+ * them.
+ *
+ * Each subsystem registers a function reporting its current size, which
+ * is only called when the stats are read. Bytes are estimates of what a
+ * subsystem keeps, its structures, keys and strings, without allocator
+ * overhead.
+ */
+
+typedef struct MemStats {
+    gint64 entries;
+    gint64 bytes;
+    gint64 max_entries;         /* 0 if not limited by entries */
+    gint64 max_bytes;           /* 0 if not limited by bytes */
+    gint64 evictions;           /* entries dropped to stay within the limits */
+} MemStats;
+
+typedef void (*MemStatsFunc) (gpointer data, MemStats *stats);
+
+/* Rough cost of a hash table entry, besides its key and value. */
+#define MEM_STATS_HASH_ENTRY_SIZE (3 * sizeof(gpointer))
+
+/* Report the size of @name with @func (@data) from now on. */
+void
+mem_stats_register (const char *name, MemStatsFunc func, gpointer data);
+
+/* The stats in the Prometheus text format. */
+char *
+mem_stats_dump (void);
+
+/* The stats as a JSON object, keyed by name. */
+char *
+mem_stats_to_json (void);
+
+#endif
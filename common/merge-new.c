@@ -5,6 +5,130 @@
 #define DEBUG_FLAG SEAFILE_DEBUG_MERGE
 #include "log.h"
 
+#include <pthread.h>
+
+#ifdef SEAFILE_SERVER
+#define DEFAULT_MERGE_THREADS 4
+#else
+#define DEFAULT_MERGE_THREADS 2
+#endif
+
+/* Threads a parallel merge may still start. Shared by all the copies
+ * of MergeOptions made for sub merges.
+ */
+typedef struct MergeThreads {
+    gint n_free;
+} MergeThreads;
+
+#ifdef SEAFILE_SERVER
+#define MERGE_CACHE_SIZE 1024
+
+/*
+ * Results of the latest 3-way merges. A client retrying an upload after
+ * its head update lost a race merges the same trees again, and trees are
+ * content-addressed, so the result can be reused.
+ */
+typedef struct MergeResult {
+    char *key;
+    char merged_tree_root[41];
+    gboolean conflict;
+} MergeResult;
+
+static GHashTable *merge_cache;
+/* MergeResults, oldest first */
+static GQueue *merge_cache_order;
+static pthread_mutex_t merge_cache_lock = PTHREAD_MUTEX_INITIALIZER;
+
+/* Conflict files are named from the remote head, so it's in the key. */
+static char *
+merge_cache_key (const char *store_id, int version,
+                 const char *roots[], MergeOptions *opt)
+{
+    return g_strdup_printf ("%s:%d:%s:%s:%s:%s:%s", store_id, version,
+                            roots[0], roots[1], roots[2],
+                            opt->remote_repo_id, opt->remote_head);
+}
+
+static gboolean
+lookup_merge_result (const char *store_id, int version,
+                     const char *key, MergeOptions *opt)
+{
+    MergeResult *res;
+    gboolean found = FALSE;
+
+    pthread_mutex_lock (&merge_cache_lock);
+    if (merge_cache) {
+        res = g_hash_table_lookup (merge_cache, key);
+        if (res) {
+            memcpy (opt->merged_tree_root, res->merged_tree_root, 41);
+            opt->conflict = res->conflict;
+            found = TRUE;
+        }
+    }
+    pthread_mutex_unlock (&merge_cache_lock);
+
+    /* The merged tree may have been collected if it was never committed. */
+    if (found && !seaf_fs_manager_object_exists (seaf->fs_mgr, store_id, version,
+                                                 opt->merged_tree_root)) {
+        opt->merged_tree_root[0] = '\0';
+        opt->conflict = FALSE;
+        found = FALSE;
+    }
+
+    return found;
+}
+
+static void
+add_merge_result (char *key, MergeOptions *opt)
+{
+    MergeResult *res;
+
+    pthread_mutex_lock (&merge_cache_lock);
+
+    if (!merge_cache) {
+        merge_cache = g_hash_table_new (g_str_hash, g_str_equal);
+        merge_cache_order = g_queue_new ();
+    }
+
+    if (g_hash_table_lookup (merge_cache, key)) {
+        g_free (key);
+        goto out;
+    }
+
+    if (g_queue_get_length (merge_cache_order) >= MERGE_CACHE_SIZE) {
+        res = g_queue_pop_head (merge_cache_order);
+        g_hash_table_remove (merge_cache, res->key);
+        g_free (res->key);
+        g_free (res);
+    }
+
+    res = g_new0 (MergeResult, 1);
+    res->key = key;
+    memcpy (res->merged_tree_root, opt->merged_tree_root, 41);
+    res->conflict = opt->conflict;
+    g_hash_table_insert (merge_cache, res->key, res);
+    g_queue_push_tail (merge_cache_order, res);
+
+out:
+    pthread_mutex_unlock (&merge_cache_lock);
+}
+#endif  /* SEAFILE_SERVER */
+
+/* A sub dir merged on its own thread. The job owns copies of
+ * everything it reads, so the parent only has to join it.
+ */
+typedef struct MergeJob {
+    pthread_t thread;
+    const char *store_id;
+    int version;
+    SeafDirent *dents[3];
+    int dir_mask;
+    char *basedir;
+    MergeOptions opt;
+    SeafDirent *merged_dent;
+    int ret;
+} MergeJob;
+
 static int
 merge_trees_recursive (const char *store_id, int version,
                        int n, SeafDir *trees[],
@@ -77,6 +201,22 @@ out:
     return conflict_name;
 }
 
+/*
+ * Dirents of dirs loaded with seaf_fs_manager_get_seafdir_arena() can't
+ * be renamed in place. Replace the remote entry with a renamed copy
+ * instead; the caller frees it after the name has been merged.
+ */
+static void
+rename_remote_dirent (SeafDirent *dents[], char *new_name)
+{
+    SeafDirent *dent = seaf_dirent_dup (dents[2]);
+
+    g_free (dent->name);
+    dent->name = new_name;
+    dent->name_len = strlen (new_name);
+    dents[2] = dent;
+}
+
 static int
 merge_entries (const char *store_id, int version,
                int n, SeafDirent *dents[],
@@ -137,12 +277,8 @@ merge_entries (const char *store_id, int version,
             if (!conflict_name)
                 return -1;
 
-            /* Change remote entry name in place. So opt->callback
-             * will see the conflict name, not the original name.
-             */
-            g_free (remote->name);
-            remote->name = conflict_name;
-            remote->name_len = strlen (remote->name);
+            rename_remote_dirent (dents, conflict_name);
+            remote = dents[2];
 
             *dents_out = g_list_prepend (*dents_out, seaf_dirent_dup(head));
             *dents_out = g_list_prepend (*dents_out, seaf_dirent_dup(remote));
@@ -167,9 +303,8 @@ merge_entries (const char *store_id, int version,
 
                 /* Change the name of remote, keep dir name in head unchanged. 
                  */
-                g_free (remote->name);
-                remote->name = conflict_name;
-                remote->name_len = strlen (remote->name);
+                rename_remote_dirent (dents, conflict_name);
+                remote = dents[2];
 
                 *dents_out = g_list_prepend (*dents_out, seaf_dirent_dup(remote));
 
@@ -208,10 +343,8 @@ merge_entries (const char *store_id, int version,
                 if (!conflict_name)
                     return -1;
 
-                /* Change remote dir name to conflict name in place. */
-                g_free (dents[2]->name);
-                dents[2]->name = conflict_name;
-                dents[2]->name_len = strlen (dents[2]->name);
+                /* Change remote dir name to conflict name. */
+                rename_remote_dirent (dents, conflict_name);
 
                 *dents_out = g_list_prepend (*dents_out, seaf_dirent_dup(head));
 
@@ -264,9 +397,8 @@ merge_entries (const char *store_id, int version,
             if (!conflict_name)
                 return -1;
 
-            g_free (remote->name);
-            remote->name = conflict_name;
-            remote->name_len = strlen (remote->name);
+            rename_remote_dirent (dents, conflict_name);
+            remote = dents[2];
 
             *dents_out = g_list_prepend (*dents_out, seaf_dirent_dup(remote));
 
@@ -303,9 +435,7 @@ merge_entries (const char *store_id, int version,
             if (!conflict_name)
                 return -1;
 
-            g_free (dents[2]->name);
-            dents[2]->name = conflict_name;
-            dents[2]->name_len = strlen (dents[2]->name);
+            rename_remote_dirent (dents, conflict_name);
 
             *dents_out = g_list_prepend (*dents_out, seaf_dirent_dup(head));
 
@@ -319,20 +449,196 @@ merge_entries (const char *store_id, int version,
     return 0;
 }
 
+/*
+ * Merge the sub dirs in @dents recursively. In a 3-way merge with
+ * do_merge, *merged_dent is set to the entry for the merged dir, if
+ * there should be one in the result.
+ */
+static int
+merge_sub_dirs (const char *store_id, int version,
+                int n, SeafDirent *dents[], int dir_mask,
+                const char *basedir,
+                SeafDirent **merged_dent,
+                MergeOptions *opt)
+{
+    SeafDir *dir;
+    SeafDir *sub_dirs[3];
+    char *dirname = NULL;
+    char *new_basedir;
+    int ret = 0;
+    int i;
+
+    *merged_dent = NULL;
+
+    memset (sub_dirs, 0, sizeof(sub_dirs[0])*n);
+    for (i = 0; i < n; ++i) {
+        if (dents[i] != NULL && S_ISDIR(dents[i]->mode)) {
+            dir = seaf_fs_manager_get_seafdir_arena (seaf->fs_mgr,
+                                                     store_id, version,
+                                                     dents[i]->id);
+            if (!dir) {
+                seaf_warning ("Failed to find dir %s.\n", dents[i]->id);
+                ret = -1;
+                goto free_sub_dirs;
+            }
+            opt->visit_dirs++;
+            sub_dirs[i] = dir;
+
+            dirname = dents[i]->name;
+        }
+    }
+
+    new_basedir = g_strconcat (basedir, dirname, "/", NULL);
+
+    ret = merge_trees_recursive (store_id, version, n, sub_dirs, new_basedir, opt);
+
+    g_free (new_basedir);
+
+    if (ret == 0 && n == 3 && opt->do_merge) {
+        if (dir_mask == 3 || dir_mask == 6 || dir_mask == 7) {
+            *merged_dent = seaf_dirent_dup (dents[1]);
+            memcpy ((*merged_dent)->id, opt->merged_tree_root, 40);
+        } else if (dir_mask == 5) {
+            *merged_dent = seaf_dirent_dup (dents[2]);
+            memcpy ((*merged_dent)->id, opt->merged_tree_root, 40);
+        }
+    }
+
+free_sub_dirs:
+    for (i = 0; i < n; ++i)
+        seaf_dir_free (sub_dirs[i]);
+
+    return ret;
+}
+
+static gboolean
+grab_merge_thread (MergeThreads *threads)
+{
+    gint n;
+
+    while ((n = g_atomic_int_get (&threads->n_free)) > 0) {
+        if (g_atomic_int_compare_and_exchange (&threads->n_free, n, n - 1))
+            return TRUE;
+    }
+    return FALSE;
+}
+
+static void
+merge_job_free (MergeJob *job)
+{
+    int i;
+
+    for (i = 0; i < 3; ++i)
+        seaf_dirent_free (job->dents[i]);
+    g_free (job->basedir);
+    seaf_dirent_free (job->merged_dent);
+    g_free (job);
+}
+
+static void *
+merge_job_thread (void *vdata)
+{
+    MergeJob *job = vdata;
+
+    job->ret = merge_sub_dirs (job->store_id, job->version,
+                               3, job->dents, job->dir_mask,
+                               job->basedir, &job->merged_dent, &job->opt);
+
+    g_atomic_int_inc (&job->opt.threads->n_free);
+    return NULL;
+}
+
+/*
+ * Start merging the sub dirs in @dents on a new thread, if the merge
+ * is allowed to start one more. Returns the job, or NULL if the caller
+ * should merge them itself.
+ */
+static MergeJob *
+start_merge_job (const char *store_id, int version,
+                 SeafDirent *dents[], int dir_mask,
+                 const char *basedir,
+                 MergeOptions *opt)
+{
+    MergeJob *job;
+    int i;
+
+    if (!opt->threads || !grab_merge_thread (opt->threads))
+        return NULL;
+
+    job = g_new0 (MergeJob, 1);
+    job->store_id = store_id;
+    job->version = version;
+    for (i = 0; i < 3; ++i) {
+        if (dents[i])
+            job->dents[i] = seaf_dirent_dup (dents[i]);
+    }
+    job->dir_mask = dir_mask;
+    job->basedir = g_strdup (basedir);
+
+    /* The sub merge gets its own result and counters, which are
+     * added to the parent's in join_merge_jobs().
+     */
+    job->opt = *opt;
+    job->opt.visit_dirs = 0;
+    job->opt.conflict = FALSE;
+
+    if (pthread_create (&job->thread, NULL, merge_job_thread, job) != 0) {
+        seaf_warning ("Failed to start merge thread, merging %s%s in place.\n",
+                      basedir, dents[1] ? dents[1]->name : dents[2]->name);
+        g_atomic_int_inc (&opt->threads->n_free);
+        merge_job_free (job);
+        return NULL;
+    }
+
+    return job;
+}
+
+/*
+ * Wait for the jobs started at this level, in the order they were
+ * started, and add their results to @dents_out and @opt.
+ */
+static int
+join_merge_jobs (GList *jobs, GList **dents_out, MergeOptions *opt)
+{
+    GList *ptr;
+    MergeJob *job;
+    int ret = 0;
+
+    jobs = g_list_reverse (jobs);
+    for (ptr = jobs; ptr; ptr = ptr->next) {
+        job = ptr->data;
+        pthread_join (job->thread, NULL);
+
+        opt->visit_dirs += job->opt.visit_dirs;
+        if (job->opt.conflict)
+            opt->conflict = TRUE;
+
+        if (job->ret < 0)
+            ret = -1;
+        else if (job->merged_dent) {
+            *dents_out = g_list_prepend (*dents_out, job->merged_dent);
+            job->merged_dent = NULL;
+        }
+
+        merge_job_free (job);
+    }
+    g_list_free (jobs);
+
+    return ret;
+}
+
 static int
 merge_directories (const char *store_id, int version,
                    int n, SeafDirent *dents[],
                    const char *basedir,
                    GList **dents_out,
+                   GList **jobs,
                    MergeOptions *opt)
 {
-    SeafDir *dir;
-    SeafDir *sub_dirs[3];
-    char *dirname = NULL;
-    char *new_basedir;
     int ret = 0;
     int dir_mask = 0, i;
     SeafDirent *merged_dent;
+    MergeJob *job;
 
     for (i = 0; i < n; ++i) {
         if (dents[i] && S_ISDIR(dents[i]->mode))
@@ -405,45 +711,22 @@ merge_directories (const char *store_id, int version,
         }
     }
 
-    memset (sub_dirs, 0, sizeof(sub_dirs[0])*n);
-    for (i = 0; i < n; ++i) {
-        if (dents[i] != NULL && S_ISDIR(dents[i]->mode)) {
-            dir = seaf_fs_manager_get_seafdir (seaf->fs_mgr,
-                                               store_id, version,
-                                               dents[i]->id);
-            if (!dir) {
-                seaf_warning ("Failed to find dir %s.\n", dents[i]->id);
-                ret = -1;
-                goto free_sub_dirs;
-            }
-            opt->visit_dirs++;
-            sub_dirs[i] = dir;
-
-            dirname = dents[i]->name;
-        }
-    }
-
-    new_basedir = g_strconcat (basedir, dirname, "/", NULL);
-
-    ret = merge_trees_recursive (store_id, version, n, sub_dirs, new_basedir, opt);
-
-    g_free (new_basedir);
-
+    /* Only the 3-way merge with do_merge runs sub merges in parallel,
+     * since it doesn't call opt->callback.
+     */
     if (n == 3 && opt->do_merge) {
-        if (dir_mask == 3 || dir_mask == 6 || dir_mask == 7) {
-            merged_dent = seaf_dirent_dup (dents[1]);
-            memcpy (merged_dent->id, opt->merged_tree_root, 40);
-            *dents_out = g_list_prepend (*dents_out, merged_dent);
-        } else if (dir_mask == 5) {
-            merged_dent = seaf_dirent_dup (dents[2]);
-            memcpy (merged_dent->id, opt->merged_tree_root, 40);
-            *dents_out = g_list_prepend (*dents_out, merged_dent);
+        job = start_merge_job (store_id, version, dents, dir_mask,
+                               basedir, opt);
+        if (job) {
+            *jobs = g_list_prepend (*jobs, job);
+            return 0;
         }
     }
 
-free_sub_dirs:
-    for (i = 0; i < n; ++i)
-        seaf_dir_free (sub_dirs[i]);
+    ret = merge_sub_dirs (store_id, version, n, dents, dir_mask,
+                          basedir, &merged_dent, opt);
+    if (merged_dent)
+        *dents_out = g_list_prepend (*dents_out, merged_dent);
 
     return ret;
 }
@@ -471,6 +754,8 @@ merge_trees_recursive (const char *store_id, int version,
     int ret = 0;
     SeafDir *merged_tree;
     GList *merged_dents = NULL;
+    GList *jobs = NULL;
+    SeafDirent *remote_dent;
 
     for (i = 0; i < n; ++i) {
         if (trees[i])
@@ -517,22 +802,36 @@ merge_trees_recursive (const char *store_id, int version,
                 }
             }
         }
+        remote_dent = (n == 3) ? dents[2] : NULL;
 
         /* Merge entries of this level. */
         if (n_files > 0) {
             ret = merge_entries (store_id, version,
                                  n, dents, basedir, &merged_dents, opt);
-            if (ret < 0)
-                return ret;
         }
 
         /* Recurse into sub level. */
-        if (n_dirs > 0) {
+        if (ret >= 0 && n_dirs > 0) {
             ret = merge_directories (store_id, version,
-                                     n, dents, basedir, &merged_dents, opt);
-            if (ret < 0)
-                return ret;
+                                     n, dents, basedir, &merged_dents,
+                                     &jobs, opt);
         }
+
+        /* Free the copy made if the remote entry was renamed. */
+        if (n == 3 && dents[2] != remote_dent)
+            seaf_dirent_free (dents[2]);
+
+        if (ret < 0)
+            break;
+    }
+
+    /* Always wait for the sub merges, even if this level failed. */
+    if (jobs && join_merge_jobs (jobs, &merged_dents, opt) < 0)
+        ret = -1;
+
+    if (ret < 0) {
+        g_list_free_full (merged_dents, (GDestroyNotify)seaf_dirent_free);
+        return ret;
     }
 
     if (n == 3 && opt->do_merge) {
@@ -557,21 +856,67 @@ merge_trees_recursive (const char *store_id, int version,
     return ret;
 }
 
+static int
+get_merge_threads ()
+{
+    int n_threads = DEFAULT_MERGE_THREADS;
+
+#ifdef SEAFILE_SERVER
+    GError *error = NULL;
+
+    /* [fileserver]
+     * merge_threads = 4
+     */
+    n_threads = g_key_file_get_integer (seaf->config,
+                                        "fileserver", "merge_threads",
+                                        &error);
+    if (error) {
+        n_threads = DEFAULT_MERGE_THREADS;
+        g_clear_error (&error);
+    }
+#endif
+
+    return (n_threads > 0) ? n_threads : 1;
+}
+
 int
 seaf_merge_trees (const char *store_id, int version,
                   int n, const char *roots[], MergeOptions *opt)
 {
     SeafDir **trees, *root;
+    MergeThreads threads;
     int i, ret;
 
     g_return_val_if_fail (n == 2 || n == 3, -1);
 
+#ifdef SEAFILE_SERVER
+    /* Only merges without side effects are cached. */
+    char *cache_key = NULL;
+    if (n == 3 && opt->do_merge && !opt->callback) {
+        cache_key = merge_cache_key (store_id, version, roots, opt);
+        if (lookup_merge_result (store_id, version, cache_key, opt)) {
+            g_free (cache_key);
+            return 0;
+        }
+    }
+#endif
+
+    opt->threads = NULL;
+    if (n == 3 && opt->do_merge && opt->parallel) {
+        /* The calling thread is one of them. */
+        threads.n_free = get_merge_threads () - 1;
+        opt->threads = &threads;
+    }
+
     trees = g_new0 (SeafDir *, n);
     for (i = 0; i < n; ++i) {
-        root = seaf_fs_manager_get_seafdir (seaf->fs_mgr, store_id, version, roots[i]);
+        root = seaf_fs_manager_get_seafdir_arena (seaf->fs_mgr, store_id, version, roots[i]);
         if (!root) {
             seaf_warning ("Failed to find dir %s.\n", roots[i]);
             g_free (trees);
+#ifdef SEAFILE_SERVER
+            g_free (cache_key);
+#endif
             return -1;
         }
         trees[i] = root;
@@ -579,9 +924,20 @@ seaf_merge_trees (const char *store_id, int version,
 
     ret = merge_trees_recursive (store_id, version, n, trees, "", opt);
 
+    opt->threads = NULL;
+
     for (i = 0; i < n; ++i)
         seaf_dir_free (trees[i]);
     g_free (trees);
 
+#ifdef SEAFILE_SERVER
+    if (cache_key) {
+        if (ret == 0)
+            add_merge_result (cache_key, opt);
+        else
+            g_free (cache_key);
+    }
+#endif
+
     return ret;
 }
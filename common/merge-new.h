@@ -25,6 +25,11 @@ typedef struct MergeOptions {
     char                merged_tree_root[41]; /* merge result */
     int                 visit_dirs;
     gboolean            conflict;
+    /* merge changed sub dirs on several threads. Only used with
+     * do_merge, the merged tree is the same as a serial merge. */
+    gboolean            parallel;
+
+    struct MergeThreads *threads; /* internal */
 } MergeOptions;
 
 int
@@ -1,6 +1,8 @@
 /* -*- Mode: C; tab-width: 4; indent-tabs-mode: nil; c-basic-offset: 4 -*- */
 
 #include <ccnet.h>
+#include <ccnet/cevent.h>
+#include <pthread.h>
 
 #include "mq-mgr.h"
 
@@ -14,11 +16,25 @@ struct _SeafMqManagerPriv {
     CcnetTimer *timer; 
     /* keep it in memory since we always use the same message */
     CcnetMessage *heartbeat_msg;
+
+    /* Events not sent yet, see seaf_mq_manager_publish_event(). */
+    pthread_mutex_t event_lock;
+    GQueue *events;
+    GHashTable *pending;        /* contents of @events */
+    gboolean flush_queued;
+    guint32 flush_ev_id;
+    CcnetTimer *flush_timer;
+    int flush_interval;
+    int batch_size;
 };
 
 #define HEARTBEAT_INTERVAL 2    /* 2s */
+
+#define DEFAULT_EVENT_FLUSH_INTERVAL 500    /* ms */
+#define DEFAULT_EVENT_BATCH_SIZE 100
     
 static int heartbeat_pulse (void *vmanager);
+static void load_event_config (SeafMqManager *mgr);
 
 SeafMqManager *
 seaf_mq_manager_new (SeafileSession *seaf)
@@ -34,6 +50,11 @@ seaf_mq_manager_new (SeafileSession *seaf)
     mgr->seaf = seaf;
     mgr->priv = priv;
 
+    pthread_mutex_init (&priv->event_lock, NULL);
+    priv->events = g_queue_new ();
+    priv->pending = g_hash_table_new (g_str_hash, g_str_equal);
+    load_event_config (mgr);
+
     priv->mqclient_proc = (CcnetMqclientProc *)
         ccnet_proc_factory_create_master_processor (client->proc_factory,
                                                     "mq-client");
@@ -62,12 +83,63 @@ start_mq_client (CcnetMqclientProc *mqclient)
     return 0;
 }
 
+static void
+load_event_config (SeafMqManager *mgr)
+{
+    SeafMqManagerPriv *priv = mgr->priv;
+    int interval = DEFAULT_EVENT_FLUSH_INTERVAL;
+    int batch_size = DEFAULT_EVENT_BATCH_SIZE;
+
+#ifdef SEAFILE_SERVER
+    GError *error = NULL;
+
+    /*
+     * [events]
+     * flush_interval = 500   # ms, 0 to send every event at once
+     * batch_size = 100       # events that make a flush happen sooner
+     */
+    interval = g_key_file_get_integer (mgr->seaf->config,
+                                       "events", "flush_interval", &error);
+    if (error) {
+        interval = DEFAULT_EVENT_FLUSH_INTERVAL;
+        g_clear_error (&error);
+    }
+    batch_size = g_key_file_get_integer (mgr->seaf->config,
+                                         "events", "batch_size", &error);
+    if (error || batch_size <= 0) {
+        batch_size = DEFAULT_EVENT_BATCH_SIZE;
+        g_clear_error (&error);
+    }
+#endif
+
+    priv->flush_interval = MAX (interval, 0);
+    priv->batch_size = batch_size;
+}
+
+static void flush_events (SeafMqManager *mgr);
+
+static void
+on_flush_event (CEvent *event, void *vmgr)
+{
+    flush_events (vmgr);
+}
+
+static int
+flush_pulse (void *vmgr)
+{
+    flush_events (vmgr);
+    return TRUE;
+}
+
 int
 seaf_mq_manager_init (SeafMqManager *mgr)
 {
     SeafMqManagerPriv *priv = mgr->priv;
     if (start_mq_client(priv->mqclient_proc) < 0)
         return -1;
+
+    priv->flush_ev_id = cevent_manager_register (mgr->seaf->ev_mgr,
+                                                 on_flush_event, mgr);
     return 0;
 }
 
@@ -77,6 +149,9 @@ seaf_mq_manager_start (SeafMqManager *mgr)
     SeafMqManagerPriv *priv = mgr->priv;
     priv->timer = ccnet_timer_new (heartbeat_pulse, mgr, 
                                    HEARTBEAT_INTERVAL * 1000);
+    if (priv->flush_interval > 0)
+        priv->flush_timer = ccnet_timer_new (flush_pulse, mgr,
+                                             priv->flush_interval);
     return 0;
 }
 
@@ -152,15 +227,59 @@ seaf_mq_manager_publish_notification (SeafMqManager *mgr,
     ccnet_message_free (msg);
 }
 
+/* Send the queued events, in the main thread. */
+static void
+flush_events (SeafMqManager *mgr)
+{
+    static const char *app = "seaf_server.event";
+    SeafMqManagerPriv *priv = mgr->priv;
+    GQueue *events;
+    CcnetMessage *msg;
+    char *content;
+
+    pthread_mutex_lock (&priv->event_lock);
+    events = priv->events;
+    priv->events = g_queue_new ();
+    g_hash_table_remove_all (priv->pending);
+    priv->flush_queued = FALSE;
+    pthread_mutex_unlock (&priv->event_lock);
+
+    while ((content = g_queue_pop_head (events)) != NULL) {
+        msg = create_message (mgr, app, content, 0);
+        _send_message (mgr, msg);
+        ccnet_message_free (msg);
+        g_free (content);
+    }
+    g_queue_free (events);
+}
+
 void
 seaf_mq_manager_publish_event (SeafMqManager *mgr, const char *content)
 {
-    static const char *app = "seaf_server.event";
+    SeafMqManagerPriv *priv = mgr->priv;
+    gboolean flush = FALSE;
+    char *copy;
 
-    CcnetMessage *msg = create_message (mgr, app, content, 0);
-    _send_message (mgr, msg);
+    pthread_mutex_lock (&priv->event_lock);
 
-    ccnet_message_free (msg);
+    /* The same event again before the last one was sent. */
+    if (!g_hash_table_lookup_extended (priv->pending, content, NULL, NULL)) {
+        copy = g_strdup (content);
+        g_queue_push_tail (priv->events, copy);
+        g_hash_table_insert (priv->pending, copy, NULL);
+    }
+
+    if (!priv->flush_queued &&
+        (priv->flush_interval == 0 ||
+         g_queue_get_length (priv->events) >= priv->batch_size)) {
+        priv->flush_queued = TRUE;
+        flush = TRUE;
+    }
+
+    pthread_mutex_unlock (&priv->event_lock);
+
+    if (flush)
+        cevent_manager_add_event (mgr->seaf->ev_mgr, priv->flush_ev_id, NULL);
 }
 
 static int
@@ -55,6 +55,11 @@ seaf_mq_manager_publish_notification (SeafMqManager *mgr,
                                       const char *type,
                                       const char *content);
 
+/*
+ * Can be called from any thread. Events are queued and sent from the
+ * main thread in batches, once per flush interval or once enough of them
+ * are queued. An event that is already queued isn't queued again.
+ */
 void
 seaf_mq_manager_publish_event (SeafMqManager *mgr, const char *content);
 
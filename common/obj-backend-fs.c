@@ -12,11 +12,17 @@
 #include <fcntl.h>
 #endif
 
+#include <pthread.h>
+
 #ifdef WIN32
 #include <windows.h>
 #include <io.h>
 #endif
 
+#ifdef SEAFILE_SERVER
+#include "obj-pack.h"
+#endif
+
 #define DEBUG_FLAG SEAFILE_DEBUG_OTHER
 #include "log.h"
 
@@ -25,8 +31,23 @@ typedef struct FsPriv {
     int v0_dir_len;
     char *obj_dir;
     int   dir_len;
+    /* ObjBatch of the calling thread. */
+    pthread_key_t batch_key;
+#ifdef SEAFILE_SERVER
+    /* Packed commits, see obj-pack.h. NULL for other objects. */
+    ObjPacks *packs;
+#endif
 } FsPriv;
 
+/* Objects written in a batch with need_sync, synced together when it
+ * ends. Each of their dirs is synced once.
+ */
+typedef struct ObjBatch {
+    int         depth;
+    GPtrArray  *paths;
+    GHashTable *dirs;
+} ObjBatch;
+
 static void
 id_to_path (FsPriv *priv, const char *obj_id, char path[],
             const char *repo_id, int version)
@@ -72,6 +93,14 @@ obj_backend_fs_read (ObjBackend *bend,
     /* seaf_debug ("object path: %s\n", path); */
 
     g_file_get_contents (path, (gchar**)data, &tmp_len, &error);
+#ifdef SEAFILE_SERVER
+    FsPriv *priv = bend->priv;
+    if (error && priv->packs && version > 0 &&
+        obj_packs_read (priv->packs, repo_id, obj_id, data, len) == 0) {
+        g_clear_error (&error);
+        return 0;
+    }
+#endif
     if (error) {
 #ifdef MIGRATION
         g_clear_error (&error);
@@ -95,6 +124,89 @@ obj_backend_fs_read (ObjBackend *bend,
     return 0;
 }
 
+static int
+cmp_item_path (gconstpointer a, gconstpointer b)
+{
+    const ObjBackendItem *ia = *(ObjBackendItem **)a;
+    const ObjBackendItem *ib = *(ObjBackendItem **)b;
+    int rc;
+
+    rc = strcmp (ia->repo_id, ib->repo_id);
+    if (rc != 0)
+        return rc;
+    return strcmp (ia->obj_id, ib->obj_id);
+}
+
+static int
+read_obj_fd (int fd, void **data, int *len)
+{
+    SeafStat st;
+    char *buf;
+
+    if (seaf_fstat (fd, &st) < 0)
+        return -1;
+
+    buf = g_malloc (st.st_size + 1);
+    if (readn (fd, buf, st.st_size) != st.st_size) {
+        g_free (buf);
+        return -1;
+    }
+    buf[st.st_size] = 0;
+
+    *data = buf;
+    *len = (int)st.st_size;
+    return 0;
+}
+
+/*
+ * Open all the objects first and tell the kernel we'll need them, so that
+ * their reads are queued together, then read them in path order.
+ */
+static void
+obj_backend_fs_read_many (ObjBackend *bend,
+                          ObjBackendItem *items,
+                          int n)
+{
+    GPtrArray *sorted = g_ptr_array_sized_new (n);
+    int *fds = g_new (int, n);
+    char path[SEAF_PATH_MAX];
+    ObjBackendItem *item;
+    int i;
+
+    for (i = 0; i < n; ++i)
+        g_ptr_array_add (sorted, &items[i]);
+    g_ptr_array_sort (sorted, cmp_item_path);
+
+    for (i = 0; i < n; ++i) {
+        item = g_ptr_array_index (sorted, i);
+        id_to_path (bend->priv, item->obj_id, path,
+                    item->repo_id, item->version);
+        fds[i] = g_open (path, O_RDONLY | O_BINARY, 0);
+#ifdef POSIX_FADV_WILLNEED
+        if (fds[i] >= 0)
+            posix_fadvise (fds[i], 0, 0, POSIX_FADV_WILLNEED);
+#endif
+    }
+
+    for (i = 0; i < n; ++i) {
+        item = g_ptr_array_index (sorted, i);
+        if (fds[i] < 0) {
+            /* Let the single read handle fallbacks and logging. */
+            item->success = (obj_backend_fs_read (bend, item->repo_id,
+                                                  item->version, item->obj_id,
+                                                  &item->data,
+                                                  &item->len) == 0);
+            continue;
+        }
+
+        item->success = (read_obj_fd (fds[i], &item->data, &item->len) == 0);
+        close (fds[i]);
+    }
+
+    g_ptr_array_free (sorted, TRUE);
+    g_free (fds);
+}
+
 /*
  * Flush operating system and disk caches for @fd.
  */
@@ -295,6 +407,8 @@ obj_backend_fs_write (ObjBackend *bend,
                       int len,
                       gboolean need_sync)
 {
+    FsPriv *priv = bend->priv;
+    ObjBatch *batch = pthread_getspecific (priv->batch_key);
     char path[SEAF_PATH_MAX];
 
     id_to_path (bend->priv, obj_id, path, repo_id, version);
@@ -308,11 +422,19 @@ obj_backend_fs_write (ObjBackend *bend,
         return -1;
     }
 
-    if (save_obj_contents (path, data, len, need_sync) < 0) {
+    if (save_obj_contents (path, data, len, need_sync && !batch) < 0) {
         seaf_warning ("[obj backend] Failed to write obj %s.\n", obj_id);
         return -1;
     }
 
+    /* Objects written without need_sync, fs objects among them, stay
+     * unsynced in a batch too.
+     */
+    if (batch && need_sync) {
+        g_ptr_array_add (batch->paths, g_strdup (path));
+        g_hash_table_insert (batch->dirs, g_path_get_dirname (path), NULL);
+    }
+
     /* g_get_current_time (&e); */
 
     /* seaf_message ("write obj time: %ldus.\n", */
@@ -335,6 +457,12 @@ obj_backend_fs_exists (ObjBackend *bend,
     if (seaf_stat (path, &st) == 0)
         return TRUE;
 
+#ifdef SEAFILE_SERVER
+    FsPriv *priv = bend->priv;
+    if (priv->packs && version > 0)
+        return obj_packs_contain (priv->packs, repo_id, obj_id);
+#endif
+
     return FALSE;
 }
 
@@ -348,6 +476,12 @@ obj_backend_fs_delete (ObjBackend *bend,
 
     id_to_path (bend->priv, obj_id, path, repo_id, version);
     g_unlink (path);
+
+#ifdef SEAFILE_SERVER
+    FsPriv *priv = bend->priv;
+    if (priv->packs && version > 0)
+        obj_packs_remove (priv->packs, repo_id, obj_id);
+#endif
 }
 
 static int
@@ -385,6 +519,10 @@ obj_backend_fs_foreach_obj (ObjBackend *bend,
     pos = path + dir_len;
 
     while ((dname1 = g_dir_read_name(dir1)) != NULL) {
+        /* Skip the pack dir. */
+        if (strlen (dname1) != 2)
+            continue;
+
         snprintf (pos, sizeof(path) - dir_len, "/%s", dname1);
 
         dir2 = g_dir_open (path, 0, NULL);
@@ -403,6 +541,11 @@ obj_backend_fs_foreach_obj (ObjBackend *bend,
         g_dir_close (dir2);
     }
 
+#ifdef SEAFILE_SERVER
+    if (priv->packs && version > 0)
+        obj_packs_foreach (priv->packs, repo_id, version, process, user_data);
+#endif
+
 out:
     if (dir1)
         g_dir_close (dir1);
@@ -434,6 +577,21 @@ obj_backend_fs_copy (ObjBackend *bend,
         return -1;
     }
 
+#ifdef SEAFILE_SERVER
+    /* A packed object can't be linked, copy it out. */
+    FsPriv *priv = bend->priv;
+    void *data;
+    int len, rc;
+
+    if (priv->packs && src_version > 0 &&
+        !g_file_test (src_path, G_FILE_TEST_EXISTS) &&
+        obj_packs_read (priv->packs, src_repo_id, obj_id, &data, &len) == 0) {
+        rc = save_obj_contents (dst_path, data, len, TRUE);
+        g_free (data);
+        return rc;
+    }
+#endif
+
 #ifdef WIN32
     if (!CreateHardLink (dst_path, src_path, NULL)) {
         seaf_warning ("Failed to link %s to %s: %d.\n",
@@ -448,10 +606,158 @@ obj_backend_fs_copy (ObjBackend *bend,
                       src_path, dst_path, strerror(errno));
         return -1;
     }
+    /* Linked by someone else at the same time. */
+    return 0;
+#endif
+}
+
+#ifdef SEAFILE_SERVER
+static int
+read_loose_obj (const char *repo_id, const char *obj_id,
+                void **data, int *len, void *vbend)
+{
+    ObjBackend *bend = vbend;
+    char path[SEAF_PATH_MAX];
+    gsize tmp_len;
+
+    id_to_path (bend->priv, obj_id, path, repo_id, 1);
+    if (!g_file_get_contents (path, (gchar **)data, &tmp_len, NULL))
+        return -1;
+
+    *len = (int)tmp_len;
+    return 0;
+}
+
+static int
+obj_backend_fs_pack (ObjBackend *bend,
+                     const char *repo_id,
+                     int version,
+                     const char **obj_ids,
+                     int n)
+{
+    FsPriv *priv = bend->priv;
+    char path[SEAF_PATH_MAX];
+    int i;
+
+    if (!priv->packs || version == 0)
+        return 0;
+
+    if (obj_packs_write (priv->packs, repo_id, obj_ids, n,
+                         read_loose_obj, bend) < 0)
+        return -1;
+
+    for (i = 0; i < n; ++i) {
+        if (!obj_packs_contain (priv->packs, repo_id, obj_ids[i]))
+            continue;
+        id_to_path (priv, obj_ids[i], path, repo_id, version);
+        g_unlink (path);
+    }
+
+    return 0;
+}
+#endif
+
+static void
+obj_backend_fs_begin_batch (ObjBackend *bend)
+{
+    FsPriv *priv = bend->priv;
+    ObjBatch *batch = pthread_getspecific (priv->batch_key);
+
+    if (!batch) {
+        batch = g_new0 (ObjBatch, 1);
+        batch->paths = g_ptr_array_new ();
+        batch->dirs = g_hash_table_new_full (g_str_hash, g_str_equal,
+                                             g_free, NULL);
+        pthread_setspecific (priv->batch_key, batch);
+    }
+    ++batch->depth;
+}
+
+static int
+sync_dir (const char *dir)
+{
+#ifdef __linux__
+    int fd = open (dir, O_RDONLY);
+    int ret = 0;
+
+    if (fd < 0) {
+        seaf_warning ("Failed to open dir %s: %s.\n", dir, strerror(errno));
+        return -1;
+    }
+    if (fsync (fd) < 0 && errno != EINVAL) {
+        seaf_warning ("Failed to fsync dir %s: %s.\n", dir, strerror(errno));
+        ret = -1;
+    }
+    close (fd);
     return ret;
+#else
+    /* Renames are durable on their own, see rename_and_sync(). */
+    return 0;
 #endif
 }
 
+/*
+ * Make the objects of @batch durable, with one fsync per object and one
+ * per directory, instead of the fsync of each rename. Not syncfs(), which would also flush everything else
+ * on the filesystem, blocks of unrelated uploads included.
+ */
+static int
+sync_batch (ObjBatch *batch)
+{
+    GHashTableIter iter;
+    gpointer key, value;
+    guint i;
+    int fd, ret = 0;
+
+    for (i = 0; i < batch->paths->len; ++i) {
+        const char *path = g_ptr_array_index (batch->paths, i);
+
+        fd = g_open (path, O_RDWR | O_BINARY, 0);
+        if (fd < 0) {
+            seaf_warning ("[obj backend] Failed to open obj %s: %s.\n",
+                          path, strerror(errno));
+            ret = -1;
+            continue;
+        }
+        if (fsync_obj_contents (fd) < 0)
+            ret = -1;
+        close (fd);
+    }
+
+    g_hash_table_iter_init (&iter, batch->dirs);
+    while (g_hash_table_iter_next (&iter, &key, &value)) {
+        if (sync_dir (key) < 0)
+            ret = -1;
+    }
+
+    return ret;
+}
+
+static int
+obj_backend_fs_end_batch (ObjBackend *bend)
+{
+    FsPriv *priv = bend->priv;
+    ObjBatch *batch = pthread_getspecific (priv->batch_key);
+    guint i;
+    int ret = 0;
+
+    if (!batch || --batch->depth > 0)
+        return 0;
+
+    pthread_setspecific (priv->batch_key, NULL);
+
+    if (batch->paths->len > 0)
+        ret = sync_batch (batch);
+
+    for (i = 0; i < batch->paths->len; ++i)
+        g_free (g_ptr_array_index (batch->paths, i));
+    g_ptr_array_free (batch->paths, TRUE);
+    g_hash_table_destroy (batch->dirs);
+    g_free (batch);
+
+    return ret;
+}
+
 ObjBackend *
 obj_backend_fs_new (const char *seaf_dir, const char *obj_type)
 {
@@ -481,11 +787,23 @@ obj_backend_fs_new (const char *seaf_dir, const char *obj_type)
     }
 
     bend->read = obj_backend_fs_read;
+    bend->read_many = obj_backend_fs_read_many;
     bend->write = obj_backend_fs_write;
     bend->exists = obj_backend_fs_exists;
     bend->delete = obj_backend_fs_delete;
     bend->foreach_obj = obj_backend_fs_foreach_obj;
     bend->copy = obj_backend_fs_copy;
+    bend->begin_batch = obj_backend_fs_begin_batch;
+    bend->end_batch = obj_backend_fs_end_batch;
+
+#ifdef SEAFILE_SERVER
+    if (strcmp (obj_type, "commits") == 0) {
+        priv->packs = obj_packs_new (priv->obj_dir);
+        bend->pack = obj_backend_fs_pack;
+    }
+#endif
+
+    pthread_key_create (&priv->batch_key, NULL);
 
     return bend;
 
@@ -8,14 +8,24 @@
 
 #include <pthread.h>
 
+/* Objects are keyed by their id alone, so one copy is shared by all repos. */
+
+#define DEFAULT_MAX_CONNECTIONS 16
+
 typedef struct RiakPriv {
     const char *host;
     const char *port;
     const char *bucket;
     int n_write;
 
+    /* Idle connections. At most max_conns are open, which also bounds
+     * the requests in flight to max_conns times the pipeline depth.
+     */
     GQueue *conn_pool;
+    int n_conns;
+    int max_conns;
     pthread_mutex_t lock;
+    pthread_cond_t cond;
 } RiakPriv;
 
 static SeafRiakClient *
@@ -25,9 +35,15 @@ get_connection (RiakPriv *priv)
 
     pthread_mutex_lock (&priv->lock);
 
+    while (g_queue_is_empty (priv->conn_pool) &&
+           priv->n_conns >= priv->max_conns)
+        pthread_cond_wait (&priv->cond, &priv->lock);
+
     connection = g_queue_pop_head (priv->conn_pool);
-    if (!connection)
+    if (!connection) {
         connection = seaf_riak_client_new (priv->host, priv->port);
+        ++priv->n_conns;
+    }
     pthread_mutex_unlock (&priv->lock);
     return connection;
 }
@@ -37,11 +53,14 @@ return_connection (RiakPriv *priv, SeafRiakClient *connection)
 {
     pthread_mutex_lock (&priv->lock);
     g_queue_push_tail (priv->conn_pool, connection);
+    pthread_cond_signal (&priv->cond);
     pthread_mutex_unlock (&priv->lock);
 }
 
 static int
 obj_backend_riak_read (ObjBackend *bend,
+                       const char *repo_id,
+                       int version,
                        const char *obj_id,
                        void **data,
                        int *len)
@@ -58,9 +77,12 @@ obj_backend_riak_read (ObjBackend *bend,
 
 static int
 obj_backend_riak_write (ObjBackend *bend,
+                        const char *repo_id,
+                        int version,
                         const char *obj_id,
                         void *data,
-                        int len)
+                        int len,
+                        gboolean need_sync)
 {
     SeafRiakClient *conn = get_connection (bend->priv);
     RiakPriv *priv = bend->priv;
@@ -73,8 +95,74 @@ obj_backend_riak_write (ObjBackend *bend,
     return ret;
 }
 
+static void
+obj_backend_riak_read_many (ObjBackend *bend,
+                            ObjBackendItem *items,
+                            int n)
+{
+    SeafRiakClient *conn = get_connection (bend->priv);
+    RiakPriv *priv = bend->priv;
+    const char **keys = g_new (const char *, n);
+    void **values = g_new0 (void *, n);
+    int *sizes = g_new0 (int, n);
+    int *results = g_new0 (int, n);
+    int i;
+
+    for (i = 0; i < n; ++i)
+        keys[i] = items[i].obj_id;
+
+    seaf_riak_client_get_many (conn, priv->bucket, keys, n,
+                               values, sizes, results);
+
+    for (i = 0; i < n; ++i) {
+        items[i].success = (results[i] == 0);
+        items[i].data = values[i];
+        items[i].len = sizes[i];
+    }
+
+    return_connection (priv, conn);
+    g_free (keys);
+    g_free (values);
+    g_free (sizes);
+    g_free (results);
+}
+
+static void
+obj_backend_riak_write_many (ObjBackend *bend,
+                             ObjBackendItem *items,
+                             int n)
+{
+    SeafRiakClient *conn = get_connection (bend->priv);
+    RiakPriv *priv = bend->priv;
+    const char **keys = g_new (const char *, n);
+    void **values = g_new (void *, n);
+    int *sizes = g_new (int, n);
+    int *results = g_new0 (int, n);
+    int i;
+
+    for (i = 0; i < n; ++i) {
+        keys[i] = items[i].obj_id;
+        values[i] = items[i].data;
+        sizes[i] = items[i].len;
+    }
+
+    seaf_riak_client_put_many (conn, priv->bucket, keys, n,
+                               values, sizes, priv->n_write, results);
+
+    for (i = 0; i < n; ++i)
+        items[i].success = (results[i] == 0);
+
+    return_connection (priv, conn);
+    g_free (keys);
+    g_free (values);
+    g_free (sizes);
+    g_free (results);
+}
+
 static gboolean
 obj_backend_riak_exists (ObjBackend *bend,
+                         const char *repo_id,
+                         int version,
                          const char *obj_id)
 {
     SeafRiakClient *conn = get_connection (bend->priv);
@@ -89,6 +177,8 @@ obj_backend_riak_exists (ObjBackend *bend,
 
 static void
 obj_backend_riak_delete (ObjBackend *bend,
+                         const char *repo_id,
+                         int version,
                          const char *obj_id)
 {
     SeafRiakClient *conn = get_connection (bend->priv);
@@ -99,11 +189,35 @@ obj_backend_riak_delete (ObjBackend *bend,
     return_connection (priv, conn);
 }
 
+static int
+obj_backend_riak_foreach_obj (ObjBackend *bend,
+                              const char *repo_id,
+                              int version,
+                              SeafObjFunc process,
+                              void *user_data)
+{
+    seaf_warning ("[riak] Listing the objects of a repo is not supported.\n");
+    return -1;
+}
+
+static int
+obj_backend_riak_copy (ObjBackend *bend,
+                       const char *src_repo_id,
+                       int src_version,
+                       const char *dst_repo_id,
+                       int dst_version,
+                       const char *obj_id)
+{
+    /* The object is shared by all repos already. */
+    return 0;
+}
+
 ObjBackend *
 obj_backend_riak_new (const char *host,
                       const char *port,
                       const char *bucket,
-                      const char *write_policy)
+                      const char *write_policy,
+                      int max_connections)
 {
     ObjBackend *bend;
     RiakPriv *priv;
@@ -123,12 +237,19 @@ obj_backend_riak_new (const char *host,
         g_return_val_if_reached (NULL);
 
     priv->conn_pool = g_queue_new ();
+    priv->max_conns = max_connections > 0 ? max_connections :
+        DEFAULT_MAX_CONNECTIONS;
     pthread_mutex_init (&priv->lock, NULL);
+    pthread_cond_init (&priv->cond, NULL);
 
     bend->read = obj_backend_riak_read;
     bend->write = obj_backend_riak_write;
     bend->exists = obj_backend_riak_exists;
     bend->delete = obj_backend_riak_delete;
+    bend->foreach_obj = obj_backend_riak_foreach_obj;
+    bend->copy = obj_backend_riak_copy;
+    bend->read_many = obj_backend_riak_read_many;
+    bend->write_many = obj_backend_riak_write_many;
 
     return bend;
 }
@@ -139,7 +260,8 @@ ObjBackend *
 obj_backend_riak_new (const char *host,
                       const char *port,
                       const char *bucket,
-                      const char *write_policy)
+                      const char *write_policy,
+                      int max_connections)
 {
     seaf_warning ("Riak backend is not enabled.\n");
     return NULL;
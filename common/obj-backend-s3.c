@@ -0,0 +1,313 @@
+#include "common.h"
+#include "log.h"
+#include "obj-backend.h"
+
+#ifdef S3_BACKEND
+
+#include "s3-client.h"
+
+#include <pthread.h>
+
+/* Objects are stored as <repo_id>/<obj_id>. */
+
+typedef struct S3Priv {
+    SeafS3Config *conf;
+
+    GQueue *conn_pool;
+    pthread_mutex_t lock;
+} S3Priv;
+
+static SeafS3Client *
+get_connection (S3Priv *priv)
+{
+    SeafS3Client *connection;
+
+    pthread_mutex_lock (&priv->lock);
+
+    connection = g_queue_pop_head (priv->conn_pool);
+    if (!connection)
+        connection = seaf_s3_client_new (priv->conf);
+    pthread_mutex_unlock (&priv->lock);
+    return connection;
+}
+
+static void
+return_connection (S3Priv *priv, SeafS3Client *connection)
+{
+    pthread_mutex_lock (&priv->lock);
+    g_queue_push_tail (priv->conn_pool, connection);
+    pthread_mutex_unlock (&priv->lock);
+}
+
+static int
+obj_backend_s3_read (ObjBackend *bend,
+                     const char *repo_id,
+                     int version,
+                     const char *obj_id,
+                     void **data,
+                     int *len)
+{
+    S3Priv *priv = bend->priv;
+    SeafS3Client *conn = get_connection (priv);
+    char *key;
+    int ret;
+
+    if (!conn)
+        return -1;
+
+    key = g_strconcat (repo_id, "/", obj_id, NULL);
+    ret = seaf_s3_client_get (conn, key, data, len);
+    g_free (key);
+
+    return_connection (priv, conn);
+    return ret;
+}
+
+static void
+obj_backend_s3_read_many (ObjBackend *bend,
+                          ObjBackendItem *items,
+                          int n)
+{
+    S3Priv *priv = bend->priv;
+    SeafS3Client *conn = get_connection (priv);
+    char **keys;
+    void **data;
+    int *lens;
+    int i;
+
+    if (!conn)
+        return;
+
+    keys = g_new0 (char *, n + 1);
+    data = g_new0 (void *, n);
+    lens = g_new0 (int, n);
+    for (i = 0; i < n; ++i)
+        keys[i] = g_strconcat (items[i].repo_id, "/", items[i].obj_id, NULL);
+
+    seaf_s3_client_get_many (conn, (const char **)keys, n, data, lens);
+
+    for (i = 0; i < n; ++i) {
+        items[i].data = data[i];
+        items[i].len = lens[i];
+        items[i].success = (data[i] != NULL);
+    }
+
+    g_strfreev (keys);
+    g_free (data);
+    g_free (lens);
+    return_connection (priv, conn);
+}
+
+static int
+obj_backend_s3_write (ObjBackend *bend,
+                      const char *repo_id,
+                      int version,
+                      const char *obj_id,
+                      void *data,
+                      int len,
+                      gboolean need_sync)
+{
+    S3Priv *priv = bend->priv;
+    SeafS3Client *conn = get_connection (priv);
+    char *key;
+    int ret;
+
+    if (!conn)
+        return -1;
+
+    /* S3 only acknowledges a put once the object is durable. */
+    key = g_strconcat (repo_id, "/", obj_id, NULL);
+    ret = seaf_s3_client_put (conn, key, data, len);
+    g_free (key);
+
+    return_connection (priv, conn);
+    return ret;
+}
+
+static gboolean
+obj_backend_s3_exists (ObjBackend *bend,
+                       const char *repo_id,
+                       int version,
+                       const char *obj_id)
+{
+    S3Priv *priv = bend->priv;
+    SeafS3Client *conn = get_connection (priv);
+    char *key;
+    gboolean ret;
+
+    if (!conn)
+        return FALSE;
+
+    key = g_strconcat (repo_id, "/", obj_id, NULL);
+    ret = (seaf_s3_client_head (conn, key, NULL) == 1);
+    g_free (key);
+
+    return_connection (priv, conn);
+    return ret;
+}
+
+static int
+obj_backend_s3_exists_batch (ObjBackend *bend,
+                             const char *repo_id,
+                             int version,
+                             const char **obj_ids,
+                             int n,
+                             gboolean *exists)
+{
+    S3Priv *priv = bend->priv;
+    SeafS3Client *conn = get_connection (priv);
+    char **keys;
+    int i, ret;
+
+    if (!conn)
+        return -1;
+
+    keys = g_new0 (char *, n + 1);
+    for (i = 0; i < n; ++i)
+        keys[i] = g_strconcat (repo_id, "/", obj_ids[i], NULL);
+
+    ret = seaf_s3_client_head_many (conn, (const char **)keys, n, exists);
+
+    g_strfreev (keys);
+    return_connection (priv, conn);
+    return ret;
+}
+
+static void
+obj_backend_s3_delete (ObjBackend *bend,
+                       const char *repo_id,
+                       int version,
+                       const char *obj_id)
+{
+    S3Priv *priv = bend->priv;
+    SeafS3Client *conn = get_connection (priv);
+    char *key;
+
+    if (!conn)
+        return;
+
+    key = g_strconcat (repo_id, "/", obj_id, NULL);
+    seaf_s3_client_delete (conn, key);
+    g_free (key);
+
+    return_connection (priv, conn);
+}
+
+typedef struct ForeachData {
+    const char *repo_id;
+    int version;
+    size_t prefix_len;
+    SeafObjFunc process;
+    void *user_data;
+} ForeachData;
+
+static gboolean
+foreach_key (const char *key, void *user_data)
+{
+    ForeachData *data = user_data;
+    const char *obj_id = key + data->prefix_len;
+
+    if (strlen (obj_id) != 40)
+        return TRUE;
+
+    return data->process (data->repo_id, data->version, obj_id,
+                          data->user_data);
+}
+
+static int
+obj_backend_s3_foreach_obj (ObjBackend *bend,
+                            const char *repo_id,
+                            int version,
+                            SeafObjFunc process,
+                            void *user_data)
+{
+    S3Priv *priv = bend->priv;
+    SeafS3Client *conn = get_connection (priv);
+    ForeachData data;
+    char *prefix;
+    int ret;
+
+    if (!conn)
+        return -1;
+
+    prefix = g_strconcat (repo_id, "/", NULL);
+    data.repo_id = repo_id;
+    data.version = version;
+    data.prefix_len = strlen (prefix);
+    data.process = process;
+    data.user_data = user_data;
+
+    ret = seaf_s3_client_list (conn, prefix, foreach_key, &data);
+    g_free (prefix);
+
+    return_connection (priv, conn);
+    return ret;
+}
+
+static int
+obj_backend_s3_copy (ObjBackend *bend,
+                     const char *src_repo_id,
+                     int src_version,
+                     const char *dst_repo_id,
+                     int dst_version,
+                     const char *obj_id)
+{
+    S3Priv *priv = bend->priv;
+    SeafS3Client *conn = get_connection (priv);
+    char *src_key, *dst_key;
+    int ret;
+
+    if (!conn)
+        return -1;
+
+    src_key = g_strconcat (src_repo_id, "/", obj_id, NULL);
+    dst_key = g_strconcat (dst_repo_id, "/", obj_id, NULL);
+    ret = seaf_s3_client_copy (conn, src_key, dst_key);
+    g_free (src_key);
+    g_free (dst_key);
+
+    return_connection (priv, conn);
+    return ret;
+}
+
+ObjBackend *
+obj_backend_s3_new (GKeyFile *config, const char *group)
+{
+    ObjBackend *bend;
+    S3Priv *priv;
+    SeafS3Config *conf;
+
+    conf = seaf_s3_config_load (config, group);
+    if (!conf)
+        return NULL;
+
+    bend = g_new0(ObjBackend, 1);
+    priv = g_new0(S3Priv, 1);
+    bend->priv = priv;
+
+    priv->conf = conf;
+    priv->conn_pool = g_queue_new ();
+    pthread_mutex_init (&priv->lock, NULL);
+
+    bend->read = obj_backend_s3_read;
+    bend->read_many = obj_backend_s3_read_many;
+    bend->write = obj_backend_s3_write;
+    bend->exists = obj_backend_s3_exists;
+    bend->exists_batch = obj_backend_s3_exists_batch;
+    bend->delete = obj_backend_s3_delete;
+    bend->foreach_obj = obj_backend_s3_foreach_obj;
+    bend->copy = obj_backend_s3_copy;
+
+    return bend;
+}
+
+#else
+
+ObjBackend *
+obj_backend_s3_new (GKeyFile *config, const char *group)
+{
+    seaf_warning ("S3 backend is not enabled.\n");
+    return NULL;
+}
+
+#endif  /* S3_BACKEND */
@@ -6,6 +6,17 @@
 
 typedef struct ObjBackend ObjBackend;
 
+/* One object of a read_many or write_many call. */
+typedef struct ObjBackendItem {
+    const char  *repo_id;
+    int          version;
+    const char  *obj_id;
+    void        *data;
+    int          len;
+    gboolean     need_sync;
+    gboolean     success;
+} ObjBackendItem;
+
 struct ObjBackend {
     int         (*read) (ObjBackend *bend,
                          const char *repo_id,
@@ -27,6 +38,14 @@ struct ObjBackend {
                            int version,
                            const char *obj_id);
 
+    /* Optional. Set @exists[i] for each of the @n objects. */
+    int         (*exists_batch) (ObjBackend *bend,
+                                 const char *repo_id,
+                                 int version,
+                                 const char **obj_ids,
+                                 int n,
+                                 gboolean *exists);
+
     void        (*delete) (ObjBackend *bend,
                            const char *repo_id,
                            int version,
@@ -45,6 +64,29 @@ struct ObjBackend {
                          int dst_version,
                          const char *obj_id);
 
+    /* Optional. Read or write @n objects in one go, setting success
+     * for each item. read_many fills in data and len.
+     */
+    void        (*read_many) (ObjBackend *bend,
+                              ObjBackendItem *items,
+                              int n);
+
+    void        (*write_many) (ObjBackend *bend,
+                               ObjBackendItem *items,
+                               int n);
+
+    /* Optional. See seaf_obj_store_pack_objs(). */
+    int         (*pack) (ObjBackend *bend,
+                         const char *repo_id,
+                         int version,
+                         const char **obj_ids,
+                         int n);
+
+    /* Optional. See seaf_obj_store_begin_batch(). */
+    void        (*begin_batch) (ObjBackend *bend);
+
+    int         (*end_batch) (ObjBackend *bend);
+
     void *priv;
 };
 
@@ -0,0 +1,339 @@
+/* -*- Mode: C; tab-width: 4; indent-tabs-mode: nil; c-basic-offset: 4 -*- */
+
+#include "common.h"
+
+#include <pthread.h>
+
+#include "obj-cache.h"
+
+/* Lookups from different threads rarely contend on the same shard. */
+#define N_SHARDS 16
+
+/* Length of the "<store_id>/<obj_id>" keys, with the NUL. */
+#define KEY_SIZE (36 + 1 + 40 + 1)
+
+typedef struct CacheEntry {
+    char     *key;
+    gpointer  value;
+    guint64   size;
+    GList     link;             /* in the shard's LRU queue */
+} CacheEntry;
+
+typedef struct CacheShard {
+    pthread_mutex_t  lock;
+    GHashTable      *entries;   /* key -> CacheEntry */
+    GQueue           lru;       /* most recently used first */
+    guint64          bytes;
+    guint64          hits;
+    guint64          misses;
+    guint64          evictions;
+} CacheShard;
+
+struct ObjCache {
+    CacheShard        shards[N_SHARDS];
+    guint64           shard_max_bytes;
+    ObjCacheCopyFunc  copy_func;
+    GDestroyNotify    free_func;
+};
+
+ObjCache *
+obj_cache_new (guint64 max_bytes,
+               ObjCacheCopyFunc copy_func,
+               GDestroyNotify free_func)
+{
+    ObjCache *cache;
+    int i;
+
+    cache = g_new0 (ObjCache, 1);
+    cache->shard_max_bytes = max_bytes / N_SHARDS;
+    cache->copy_func = copy_func;
+    cache->free_func = free_func;
+
+    for (i = 0; i < N_SHARDS; ++i) {
+        CacheShard *shard = &cache->shards[i];
+
+        pthread_mutex_init (&shard->lock, NULL);
+        shard->entries = g_hash_table_new (g_str_hash, g_str_equal);
+        g_queue_init (&shard->lru);
+    }
+
+    return cache;
+}
+
+static void
+free_entry (ObjCache *cache, CacheEntry *entry)
+{
+    cache->free_func (entry->value);
+    g_free (entry->key);
+    g_free (entry);
+}
+
+void
+obj_cache_free (ObjCache *cache)
+{
+    CacheEntry *entry;
+    int i;
+
+    if (!cache)
+        return;
+
+    for (i = 0; i < N_SHARDS; ++i) {
+        CacheShard *shard = &cache->shards[i];
+
+        while ((entry = g_queue_peek_head (&shard->lru)) != NULL) {
+            g_queue_unlink (&shard->lru, &entry->link);
+            free_entry (cache, entry);
+        }
+        g_hash_table_destroy (shard->entries);
+        pthread_mutex_destroy (&shard->lock);
+    }
+
+    g_free (cache);
+}
+
+static char *
+make_key (const char *store_id, const char *obj_id)
+{
+    return g_strconcat (store_id ? store_id : "", "/", obj_id, NULL);
+}
+
+static CacheShard *
+get_shard (ObjCache *cache, const char *key)
+{
+    return &cache->shards[g_str_hash (key) % N_SHARDS];
+}
+
+gpointer
+obj_cache_lookup (ObjCache *cache, const char *store_id, const char *obj_id)
+{
+    return obj_cache_lookup_copy (cache, store_id, obj_id, cache->copy_func);
+}
+
+gpointer
+obj_cache_lookup_copy (ObjCache *cache, const char *store_id,
+                       const char *obj_id, ObjCacheCopyFunc copy_func)
+{
+    CacheShard *shard;
+    CacheEntry *entry;
+    gpointer ret = NULL;
+    char *key;
+
+    key = make_key (store_id, obj_id);
+    shard = get_shard (cache, key);
+
+    pthread_mutex_lock (&shard->lock);
+
+    entry = g_hash_table_lookup (shard->entries, key);
+    if (entry) {
+        g_queue_unlink (&shard->lru, &entry->link);
+        g_queue_push_head_link (&shard->lru, &entry->link);
+        ret = copy_func (entry->value);
+        ++shard->hits;
+    } else {
+        ++shard->misses;
+    }
+
+    pthread_mutex_unlock (&shard->lock);
+
+    g_free (key);
+    return ret;
+}
+
+gboolean
+obj_cache_contains (ObjCache *cache, const char *store_id, const char *obj_id)
+{
+    CacheShard *shard;
+    CacheEntry *entry;
+    char *key;
+
+    key = make_key (store_id, obj_id);
+    shard = get_shard (cache, key);
+
+    pthread_mutex_lock (&shard->lock);
+
+    entry = g_hash_table_lookup (shard->entries, key);
+    if (entry) {
+        g_queue_unlink (&shard->lru, &entry->link);
+        g_queue_push_head_link (&shard->lru, &entry->link);
+    }
+
+    pthread_mutex_unlock (&shard->lock);
+
+    g_free (key);
+    return (entry != NULL);
+}
+
+void
+obj_cache_insert (ObjCache *cache, const char *store_id, const char *obj_id,
+                  gpointer value, guint64 size)
+{
+    CacheShard *shard;
+    CacheEntry *entry, *old;
+    GList *link;
+
+    /* Too big to be worth pushing everything else out. */
+    if (size > cache->shard_max_bytes / 4)
+        return;
+
+    entry = g_new0 (CacheEntry, 1);
+    entry->key = make_key (store_id, obj_id);
+    entry->value = cache->copy_func (value);
+    entry->size = size;
+    entry->link.data = entry;
+
+    shard = get_shard (cache, entry->key);
+
+    pthread_mutex_lock (&shard->lock);
+
+    /* Another thread may have loaded the same object meanwhile. */
+    if (g_hash_table_lookup (shard->entries, entry->key)) {
+        pthread_mutex_unlock (&shard->lock);
+        free_entry (cache, entry);
+        return;
+    }
+
+    g_hash_table_insert (shard->entries, entry->key, entry);
+    g_queue_push_head_link (&shard->lru, &entry->link);
+    shard->bytes += size;
+
+    while (shard->bytes > cache->shard_max_bytes) {
+        link = g_queue_peek_tail_link (&shard->lru);
+        old = link->data;
+        g_queue_unlink (&shard->lru, link);
+        g_hash_table_remove (shard->entries, old->key);
+        shard->bytes -= old->size;
+        ++shard->evictions;
+        free_entry (cache, old);
+    }
+
+    pthread_mutex_unlock (&shard->lock);
+}
+
+void
+obj_cache_remove (ObjCache *cache, const char *store_id, const char *obj_id)
+{
+    CacheShard *shard;
+    CacheEntry *entry;
+    char *key;
+
+    key = make_key (store_id, obj_id);
+    shard = get_shard (cache, key);
+
+    pthread_mutex_lock (&shard->lock);
+
+    entry = g_hash_table_lookup (shard->entries, key);
+    if (entry) {
+        g_queue_unlink (&shard->lru, &entry->link);
+        g_hash_table_remove (shard->entries, entry->key);
+        shard->bytes -= entry->size;
+        free_entry (cache, entry);
+    }
+
+    pthread_mutex_unlock (&shard->lock);
+
+    g_free (key);
+}
+
+void
+obj_cache_remove_store (ObjCache *cache, const char *store_id)
+{
+    char *prefix = g_strconcat (store_id, "/", NULL);
+    size_t prefix_len = strlen (prefix);
+    CacheEntry *entry;
+    GList *link, *next;
+    int i;
+
+    for (i = 0; i < N_SHARDS; ++i) {
+        CacheShard *shard = &cache->shards[i];
+
+        pthread_mutex_lock (&shard->lock);
+
+        for (link = shard->lru.head; link; link = next) {
+            next = link->next;
+            entry = link->data;
+            if (strncmp (entry->key, prefix, prefix_len) != 0)
+                continue;
+            g_queue_unlink (&shard->lru, link);
+            g_hash_table_remove (shard->entries, entry->key);
+            shard->bytes -= entry->size;
+            free_entry (cache, entry);
+        }
+
+        pthread_mutex_unlock (&shard->lock);
+    }
+
+    g_free (prefix);
+}
+
+GPtrArray *
+obj_cache_get_hot_keys (ObjCache *cache, guint max_keys)
+{
+    GPtrArray *keys = g_ptr_array_new_with_free_func (g_free);
+    GPtrArray *shard_keys[N_SHARDS];
+    guint per_shard = (max_keys + N_SHARDS - 1) / N_SHARDS;
+    GList *link;
+    guint i, j;
+
+    for (i = 0; i < N_SHARDS; ++i) {
+        CacheShard *shard = &cache->shards[i];
+
+        shard_keys[i] = g_ptr_array_new ();
+        pthread_mutex_lock (&shard->lock);
+        for (link = shard->lru.head;
+             link && shard_keys[i]->len < per_shard;
+             link = link->next)
+            g_ptr_array_add (shard_keys[i],
+                             g_strdup (((CacheEntry *)link->data)->key));
+        pthread_mutex_unlock (&shard->lock);
+    }
+
+    /* Keys are spread evenly over the shards, so taking them in turns
+     * keeps about the order of the last use.
+     */
+    for (j = 0; j < per_shard; ++j)
+        for (i = 0; i < N_SHARDS; ++i)
+            if (j < shard_keys[i]->len && keys->len < max_keys)
+                g_ptr_array_add (keys, g_ptr_array_index (shard_keys[i], j));
+            else if (j < shard_keys[i]->len)
+                g_free (g_ptr_array_index (shard_keys[i], j));
+
+    for (i = 0; i < N_SHARDS; ++i)
+        g_ptr_array_free (shard_keys[i], TRUE);
+
+    return keys;
+}
+
+void
+obj_cache_get_stats (ObjCache *cache, ObjCacheStats *stats)
+{
+    int i;
+
+    memset (stats, 0, sizeof(ObjCacheStats));
+    stats->max_bytes = cache->shard_max_bytes * N_SHARDS;
+
+    for (i = 0; i < N_SHARDS; ++i) {
+        CacheShard *shard = &cache->shards[i];
+
+        pthread_mutex_lock (&shard->lock);
+        stats->hits += shard->hits;
+        stats->misses += shard->misses;
+        stats->evictions += shard->evictions;
+        stats->entries += g_hash_table_size (shard->entries);
+        stats->bytes += shard->bytes;
+        pthread_mutex_unlock (&shard->lock);
+    }
+}
+
+void
+obj_cache_get_mem_stats (gpointer cache, MemStats *stats)
+{
+    ObjCacheStats cs;
+
+    obj_cache_get_stats (cache, &cs);
+
+    stats->entries = cs.entries;
+    stats->bytes = cs.bytes +
+        cs.entries * (sizeof(CacheEntry) + MEM_STATS_HASH_ENTRY_SIZE + KEY_SIZE);
+    stats->max_bytes = cs.max_bytes;
+    stats->evictions = cs.evictions;
+}
@@ -0,0 +1,84 @@
+/* -*- Mode: C; tab-width: 4; indent-tabs-mode: nil; c-basic-offset: 4 -*- */
+
+#ifndef OBJ_CACHE_H
+#define OBJ_CACHE_H
+
+#include <glib.h>
+
+#include "mem-stats.h"
+
+/*
+ * Sharded, thread-safe LRU cache of parsed objects, keyed by
+ * (store_id, obj_id).
+ *
+ * Objects are content addressed, so cached values never go stale. The
+ * cache owns its values. Lookups return @copy_func (value), which is
+ * either a new reference or a private copy, depending on whether callers
+ * may modify what they get. Values are dropped with @free_func once the
+ * total charge goes over the memory budget.
+ */
+
+typedef struct ObjCache ObjCache;
+
+typedef gpointer (*ObjCacheCopyFunc) (gpointer value);
+
+typedef struct ObjCacheStats {
+    guint64 hits;
+    guint64 misses;
+    guint64 evictions;
+    guint64 entries;
+    guint64 bytes;
+    guint64 max_bytes;
+} ObjCacheStats;
+
+ObjCache *
+obj_cache_new (guint64 max_bytes,
+               ObjCacheCopyFunc copy_func,
+               GDestroyNotify free_func);
+
+void
+obj_cache_free (ObjCache *cache);
+
+/* Returns a copy of the cached value, or NULL on a miss. */
+gpointer
+obj_cache_lookup (ObjCache *cache, const char *store_id, const char *obj_id);
+
+/* Like obj_cache_lookup(), but copy the value with @copy_func. */
+gpointer
+obj_cache_lookup_copy (ObjCache *cache, const char *store_id,
+                       const char *obj_id, ObjCacheCopyFunc copy_func);
+
+/* Check for a value without copying it. Doesn't count as a hit or a
+ * miss, but keeps the value from being evicted soon.
+ */
+gboolean
+obj_cache_contains (ObjCache *cache, const char *store_id, const char *obj_id);
+
+/* Cache a copy of @value, charged as @size bytes. The caller keeps @value. */
+void
+obj_cache_insert (ObjCache *cache, const char *store_id, const char *obj_id,
+                  gpointer value, guint64 size);
+
+/* Drop the cached value, for objects that are deleted. */
+void
+obj_cache_remove (ObjCache *cache, const char *store_id, const char *obj_id);
+
+/* Drop every cached value of @store_id. Walks the whole cache. */
+void
+obj_cache_remove_store (ObjCache *cache, const char *store_id);
+
+/*
+ * Keys of up to @max_keys cached values, "<store_id>/<obj_id>", the most
+ * recently used first. For saving what's hot across restarts.
+ */
+GPtrArray *
+obj_cache_get_hot_keys (ObjCache *cache, guint max_keys);
+
+void
+obj_cache_get_stats (ObjCache *cache, ObjCacheStats *stats);
+
+/* A MemStatsFunc, to register a cache with mem_stats_register(). */
+void
+obj_cache_get_mem_stats (gpointer cache, MemStats *stats);
+
+#endif
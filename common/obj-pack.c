@@ -0,0 +1,688 @@
+/* -*- Mode: C; tab-width: 4; indent-tabs-mode: nil; c-basic-offset: 4 -*- */
+
+#include "common.h"
+
+#include "utils.h"
+
+#include <sys/stat.h>
+#include <sys/file.h>
+#include <fcntl.h>
+#include <pthread.h>
+
+#include "obj-pack.h"
+
+#define DEBUG_FLAG SEAFILE_DEBUG_OTHER
+#include "log.h"
+
+#define PACK_IDX_MAGIC "SFOI"
+#define PACK_IDX_VERSION 1
+
+/* Bytes read from a pack at once, starting at the object asked for. */
+#define PACK_READ_AHEAD (256 * 1024)
+
+/* Don't start a pack for fewer new objects than this. */
+#define PACK_MIN_OBJS 256
+
+typedef struct PackIdxHeader {
+    char    magic[4];
+    guint32 version;
+    guint32 n_objs;
+} __attribute__((gcc_struct, __packed__)) PackIdxHeader;
+
+typedef struct PackIdxRecord {
+    guint8  obj_id[20];
+    guint64 offset;
+    guint32 len;
+} __attribute__((gcc_struct, __packed__)) PackIdxRecord;
+
+typedef struct Pack {
+    int             fd;
+    PackIdxRecord  *records;    /* sorted by id */
+    guint32         n_records;
+
+    /* The last bytes read, guarded by @lock. */
+    pthread_mutex_t lock;
+    char           *window;
+    guint32         window_cap;
+    guint64         window_off;
+    guint32         window_len;
+} Pack;
+
+/* The packs of a repo as they were when its pack dir last changed. */
+typedef struct RepoPacks {
+    int         ref;
+    gint64      mtime;
+    GPtrArray  *packs;          /* newest first */
+    GHashTable *removed;        /* ids */
+    guint32     next_seq;
+} RepoPacks;
+
+struct ObjPacks {
+    char            *obj_dir;
+    pthread_mutex_t  lock;
+    GHashTable      *repos;     /* repo id -> RepoPacks */
+};
+
+static void
+pack_free (Pack *pack)
+{
+    if (pack->fd >= 0)
+        close (pack->fd);
+    g_free (pack->records);
+    g_free (pack->window);
+    pthread_mutex_destroy (&pack->lock);
+    g_free (pack);
+}
+
+static void
+repo_packs_unref (RepoPacks *rp)
+{
+    guint i;
+
+    if (!rp || !g_atomic_int_dec_and_test (&rp->ref))
+        return;
+
+    for (i = 0; i < rp->packs->len; ++i)
+        pack_free (g_ptr_array_index (rp->packs, i));
+    g_ptr_array_free (rp->packs, TRUE);
+    g_hash_table_destroy (rp->removed);
+    g_free (rp);
+}
+
+ObjPacks *
+obj_packs_new (const char *obj_dir)
+{
+    ObjPacks *packs = g_new0 (ObjPacks, 1);
+
+    packs->obj_dir = g_strdup (obj_dir);
+    pthread_mutex_init (&packs->lock, NULL);
+    packs->repos = g_hash_table_new_full (g_str_hash, g_str_equal,
+                                          g_free,
+                                          (GDestroyNotify)repo_packs_unref);
+
+    return packs;
+}
+
+static char *
+pack_dir (ObjPacks *packs, const char *repo_id)
+{
+    return g_build_filename (packs->obj_dir, repo_id, "pack", NULL);
+}
+
+/* -1 if the dir doesn't exist. */
+static gint64
+dir_mtime (const char *dir)
+{
+    SeafStat st;
+
+    if (seaf_stat (dir, &st) < 0)
+        return -1;
+#ifdef __linux__
+    return (gint64)st.st_mtim.tv_sec * 1000000000 + st.st_mtim.tv_nsec;
+#else
+    return (gint64)st.st_mtime;
+#endif
+}
+
+static Pack *
+load_pack (const char *dir, guint32 seq)
+{
+    char path[SEAF_PATH_MAX];
+    PackIdxHeader header;
+    Pack *pack = NULL;
+    SeafStat st;
+    size_t len;
+    int fd;
+
+    snprintf (path, sizeof(path), "%s/pack-%08x.idx", dir, seq);
+    fd = g_open (path, O_RDONLY | O_BINARY, 0);
+    if (fd < 0) {
+        seaf_warning ("[obj pack] Failed to open %s: %s.\n",
+                      path, strerror(errno));
+        return NULL;
+    }
+
+    if (readn (fd, &header, sizeof(header)) != sizeof(header) ||
+        memcmp (header.magic, PACK_IDX_MAGIC, 4) != 0 ||
+        header.version != PACK_IDX_VERSION ||
+        seaf_fstat (fd, &st) < 0 ||
+        st.st_size != sizeof(header) +
+                      (gint64)header.n_objs * sizeof(PackIdxRecord)) {
+        seaf_warning ("[obj pack] Invalid pack index %s.\n", path);
+        goto error;
+    }
+
+    pack = g_new0 (Pack, 1);
+    pack->fd = -1;
+    pthread_mutex_init (&pack->lock, NULL);
+    pack->n_records = header.n_objs;
+    len = (size_t)header.n_objs * sizeof(PackIdxRecord);
+    pack->records = g_malloc (MAX (len, 1));
+    if (readn (fd, pack->records, len) != len) {
+        seaf_warning ("[obj pack] Failed to read %s.\n", path);
+        goto error;
+    }
+    close (fd);
+    fd = -1;
+
+    snprintf (path, sizeof(path), "%s/pack-%08x.pack", dir, seq);
+    pack->fd = g_open (path, O_RDONLY | O_BINARY, 0);
+    if (pack->fd < 0) {
+        seaf_warning ("[obj pack] Failed to open %s: %s.\n",
+                      path, strerror(errno));
+        goto error;
+    }
+
+    return pack;
+
+error:
+    if (fd >= 0)
+        close (fd);
+    if (pack)
+        pack_free (pack);
+    return NULL;
+}
+
+static void
+load_removed (const char *dir, GHashTable *removed)
+{
+    char path[SEAF_PATH_MAX];
+    char *data = NULL, *p;
+    gsize len;
+    char hex[41];
+
+    snprintf (path, sizeof(path), "%s/removed", dir);
+    if (!g_file_get_contents (path, &data, &len, NULL))
+        return;
+
+    for (p = data; p + 20 <= data + len; p += 20) {
+        rawdata_to_hex ((unsigned char *)p, hex, 20);
+        g_hash_table_replace (removed, g_strdup (hex), NULL);
+    }
+    g_free (data);
+}
+
+static gint
+compare_seq_desc (gconstpointer a, gconstpointer b)
+{
+    guint32 sa = GPOINTER_TO_UINT (*(gpointer *)a);
+    guint32 sb = GPOINTER_TO_UINT (*(gpointer *)b);
+
+    return (sa < sb) - (sa > sb);
+}
+
+static RepoPacks *
+load_repo_packs (const char *dir, gint64 mtime)
+{
+    RepoPacks *rp = g_new0 (RepoPacks, 1);
+    GPtrArray *seqs = g_ptr_array_new ();
+    GDir *d;
+    const char *name;
+    guint32 seq;
+    char suffix[8];
+    Pack *pack;
+    guint i;
+
+    rp->ref = 1;
+    rp->mtime = mtime;
+    rp->packs = g_ptr_array_new ();
+    rp->removed = g_hash_table_new_full (g_str_hash, g_str_equal,
+                                         g_free, NULL);
+
+    d = g_dir_open (dir, 0, NULL);
+    if (!d)
+        goto out;
+
+    while ((name = g_dir_read_name (d)) != NULL) {
+        if (sscanf (name, "pack-%8x.%4s", &seq, suffix) != 2 ||
+            strcmp (suffix, "idx") != 0)
+            continue;
+        g_ptr_array_add (seqs, GUINT_TO_POINTER (seq));
+        if (seq >= rp->next_seq)
+            rp->next_seq = seq + 1;
+    }
+    g_dir_close (d);
+
+    g_ptr_array_sort (seqs, compare_seq_desc);
+    for (i = 0; i < seqs->len; ++i) {
+        pack = load_pack (dir, GPOINTER_TO_UINT (g_ptr_array_index (seqs, i)));
+        if (pack)
+            g_ptr_array_add (rp->packs, pack);
+    }
+
+    load_removed (dir, rp->removed);
+
+out:
+    g_ptr_array_free (seqs, TRUE);
+    return rp;
+}
+
+/* The current packs of @repo_id, or NULL if it has none. */
+static RepoPacks *
+get_repo_packs (ObjPacks *packs, const char *repo_id)
+{
+    char *dir = pack_dir (packs, repo_id);
+    gint64 mtime = dir_mtime (dir);
+    RepoPacks *rp = NULL;
+
+    pthread_mutex_lock (&packs->lock);
+
+    if (mtime < 0) {
+        g_hash_table_remove (packs->repos, repo_id);
+        goto out;
+    }
+
+    rp = g_hash_table_lookup (packs->repos, repo_id);
+    if (!rp || rp->mtime != mtime) {
+        rp = load_repo_packs (dir, mtime);
+        g_hash_table_replace (packs->repos, g_strdup (repo_id), rp);
+    }
+    g_atomic_int_inc (&rp->ref);
+
+out:
+    pthread_mutex_unlock (&packs->lock);
+    g_free (dir);
+    return rp;
+}
+
+static int
+compare_record (const void *key, const void *rec)
+{
+    return memcmp (key, ((const PackIdxRecord *)rec)->obj_id, 20);
+}
+
+static PackIdxRecord *
+lookup (RepoPacks *rp, const char *obj_id, Pack **ppack)
+{
+    unsigned char raw[20];
+    PackIdxRecord *rec;
+    Pack *pack;
+    guint i;
+
+    if (g_hash_table_lookup_extended (rp->removed, obj_id, NULL, NULL) ||
+        hex_to_rawdata (obj_id, raw, 20) < 0)
+        return NULL;
+
+    for (i = 0; i < rp->packs->len; ++i) {
+        pack = g_ptr_array_index (rp->packs, i);
+        rec = bsearch (raw, pack->records, pack->n_records,
+                       sizeof(PackIdxRecord), compare_record);
+        if (rec) {
+            *ppack = pack;
+            return rec;
+        }
+    }
+
+    return NULL;
+}
+
+static int
+read_record (Pack *pack, const PackIdxRecord *rec, void **data, int *len)
+{
+    guint32 want;
+    ssize_t n;
+    int ret = 0;
+
+    pthread_mutex_lock (&pack->lock);
+
+    if (rec->offset < pack->window_off ||
+        rec->offset + rec->len > pack->window_off + pack->window_len) {
+        want = MAX (rec->len, PACK_READ_AHEAD);
+        if (want > pack->window_cap) {
+            pack->window = g_realloc (pack->window, want);
+            pack->window_cap = want;
+        }
+
+        do {
+            n = pread (pack->fd, pack->window, want, (off_t)rec->offset);
+        } while (n < 0 && errno == EINTR);
+
+        if (n < (ssize_t)rec->len) {
+            seaf_warning ("[obj pack] Failed to read pack: %s.\n",
+                          n < 0 ? strerror(errno) : "short read");
+            pack->window_len = 0;
+            ret = -1;
+            goto out;
+        }
+        pack->window_off = rec->offset;
+        pack->window_len = (guint32)n;
+    }
+
+    /* NUL-terminated like the loose objects read with g_file_get_contents(). */
+    *data = g_malloc (rec->len + 1);
+    memcpy (*data, pack->window + (rec->offset - pack->window_off), rec->len);
+    ((char *)*data)[rec->len] = 0;
+    *len = (int)rec->len;
+
+out:
+    pthread_mutex_unlock (&pack->lock);
+    return ret;
+}
+
+int
+obj_packs_read (ObjPacks *packs, const char *repo_id, const char *obj_id,
+                void **data, int *len)
+{
+    RepoPacks *rp = get_repo_packs (packs, repo_id);
+    PackIdxRecord *rec;
+    Pack *pack;
+    int ret = -1;
+
+    if (!rp)
+        return -1;
+
+    rec = lookup (rp, obj_id, &pack);
+    if (rec)
+        ret = read_record (pack, rec, data, len);
+
+    repo_packs_unref (rp);
+    return ret;
+}
+
+gboolean
+obj_packs_contain (ObjPacks *packs, const char *repo_id, const char *obj_id)
+{
+    RepoPacks *rp = get_repo_packs (packs, repo_id);
+    Pack *pack;
+    gboolean ret;
+
+    if (!rp)
+        return FALSE;
+
+    ret = (lookup (rp, obj_id, &pack) != NULL);
+
+    repo_packs_unref (rp);
+    return ret;
+}
+
+gboolean
+obj_packs_foreach (ObjPacks *packs, const char *repo_id, int version,
+                   SeafObjFunc process, void *user_data)
+{
+    RepoPacks *rp = get_repo_packs (packs, repo_id);
+    Pack *pack;
+    char hex[41];
+    guint i, j;
+    gboolean ret = TRUE;
+
+    if (!rp)
+        return TRUE;
+
+    for (i = 0; i < rp->packs->len && ret; ++i) {
+        pack = g_ptr_array_index (rp->packs, i);
+        for (j = 0; j < pack->n_records; ++j) {
+            rawdata_to_hex (pack->records[j].obj_id, hex, 20);
+            if (g_hash_table_lookup_extended (rp->removed, hex, NULL, NULL))
+                continue;
+            if (!process (repo_id, version, hex, user_data)) {
+                ret = FALSE;
+                break;
+            }
+        }
+    }
+
+    repo_packs_unref (rp);
+    return ret;
+}
+
+static int
+lock_packs (const char *dir)
+{
+    char path[SEAF_PATH_MAX];
+    int fd;
+
+    if (g_mkdir_with_parents (dir, 0777) < 0) {
+        seaf_warning ("[obj pack] Failed to create %s.\n", dir);
+        return -1;
+    }
+
+    snprintf (path, sizeof(path), "%s/lock", dir);
+    fd = g_open (path, O_RDWR | O_CREAT | O_BINARY, 0644);
+    if (fd < 0) {
+        seaf_warning ("[obj pack] Failed to open %s: %s.\n",
+                      path, strerror(errno));
+        return -1;
+    }
+
+    while (flock (fd, LOCK_EX) < 0) {
+        if (errno != EINTR) {
+            seaf_warning ("[obj pack] Failed to lock %s: %s.\n",
+                          dir, strerror(errno));
+            close (fd);
+            return -1;
+        }
+    }
+
+    return fd;
+}
+
+static void
+unlock_packs (int fd)
+{
+    flock (fd, LOCK_UN);
+    close (fd);
+}
+
+/* Write @len bytes to @path through a synced temp file. */
+static int
+replace_file (const char *path, const void *data, size_t len)
+{
+    char tmp_path[SEAF_PATH_MAX];
+    int fd;
+
+    snprintf (tmp_path, sizeof(tmp_path), "%s.tmp", path);
+    fd = g_open (tmp_path, O_WRONLY | O_CREAT | O_TRUNC | O_BINARY, 0644);
+    if (fd < 0) {
+        seaf_warning ("[obj pack] Failed to open %s: %s.\n",
+                      tmp_path, strerror(errno));
+        return -1;
+    }
+
+    if (writen (fd, data, len) != len || fsync (fd) < 0) {
+        seaf_warning ("[obj pack] Failed to write %s: %s.\n",
+                      tmp_path, strerror(errno));
+        close (fd);
+        g_unlink (tmp_path);
+        return -1;
+    }
+    close (fd);
+
+    if (g_rename (tmp_path, path) < 0) {
+        seaf_warning ("[obj pack] Failed to rename %s: %s.\n",
+                      tmp_path, strerror(errno));
+        g_unlink (tmp_path);
+        return -1;
+    }
+
+#ifdef __linux__
+    /* Make the rename durable before the caller relies on it. */
+    char *dir = g_path_get_dirname (path);
+    fd = open (dir, O_RDONLY);
+    if (fd >= 0) {
+        fsync (fd);
+        close (fd);
+    }
+    g_free (dir);
+#endif
+
+    return 0;
+}
+
+void
+obj_packs_remove (ObjPacks *packs, const char *repo_id, const char *obj_id)
+{
+    char *dir = pack_dir (packs, repo_id);
+    char path[SEAF_PATH_MAX];
+    RepoPacks *rp = NULL;
+    GByteArray *ids = NULL;
+    GHashTableIter iter;
+    gpointer key;
+    unsigned char raw[20];
+    Pack *pack;
+    int lock_fd;
+
+    /* Nothing to do unless it's packed. */
+    if (dir_mtime (dir) < 0) {
+        g_free (dir);
+        return;
+    }
+
+    lock_fd = lock_packs (dir);
+    if (lock_fd < 0)
+        goto out;
+
+    rp = get_repo_packs (packs, repo_id);
+    if (!rp || !lookup (rp, obj_id, &pack))
+        goto out;
+
+    ids = g_byte_array_new ();
+    g_hash_table_iter_init (&iter, rp->removed);
+    while (g_hash_table_iter_next (&iter, &key, NULL)) {
+        hex_to_rawdata (key, raw, 20);
+        g_byte_array_append (ids, raw, 20);
+    }
+    hex_to_rawdata (obj_id, raw, 20);
+    g_byte_array_append (ids, raw, 20);
+
+    snprintf (path, sizeof(path), "%s/removed", dir);
+    replace_file (path, ids->data, ids->len);
+
+out:
+    if (lock_fd >= 0)
+        unlock_packs (lock_fd);
+    if (ids)
+        g_byte_array_free (ids, TRUE);
+    repo_packs_unref (rp);
+    g_free (dir);
+}
+
+static gint
+compare_records (gconstpointer a, gconstpointer b)
+{
+    return memcmp (((const PackIdxRecord *)a)->obj_id,
+                   ((const PackIdxRecord *)b)->obj_id, 20);
+}
+
+int
+obj_packs_write (ObjPacks *packs, const char *repo_id,
+                 const char **obj_ids, int n,
+                 ObjPackReadFunc read_obj, void *user_data)
+{
+    char *dir = pack_dir (packs, repo_id);
+    char path[SEAF_PATH_MAX];
+    RepoPacks *rp = NULL;
+    GArray *records = NULL;
+    GHashTable *seen = NULL;
+    PackIdxRecord rec;
+    PackIdxHeader *header;
+    Pack *pack;
+    guint64 offset = 0;
+    guint32 seq = 0;
+    void *data;
+    int len, i, n_new = 0;
+    size_t idx_len;
+    char *idx = NULL;
+    int lock_fd, fd = -1;
+    int ret = -1;
+
+    lock_fd = lock_packs (dir);
+    if (lock_fd < 0)
+        goto out;
+
+    rp = get_repo_packs (packs, repo_id);
+    seq = rp ? rp->next_seq : 0;
+
+    for (i = 0; i < n; ++i) {
+        if (!rp || !lookup (rp, obj_ids[i], &pack))
+            ++n_new;
+    }
+    if (n_new < PACK_MIN_OBJS) {
+        ret = 0;
+        goto out;
+    }
+
+    snprintf (path, sizeof(path), "%s/pack-%08x.pack", dir, seq);
+    fd = g_open (path, O_WRONLY | O_CREAT | O_TRUNC | O_BINARY, 0644);
+    if (fd < 0) {
+        seaf_warning ("[obj pack] Failed to open %s: %s.\n",
+                      path, strerror(errno));
+        goto out;
+    }
+
+    records = g_array_sized_new (FALSE, FALSE, sizeof(PackIdxRecord), n);
+    seen = g_hash_table_new (g_str_hash, g_str_equal);
+
+    for (i = 0; i < n; ++i) {
+        if (g_hash_table_lookup_extended (seen, obj_ids[i], NULL, NULL) ||
+            (rp && lookup (rp, obj_ids[i], &pack)) ||
+            hex_to_rawdata (obj_ids[i], rec.obj_id, 20) < 0)
+            continue;
+        g_hash_table_insert (seen, (gpointer)obj_ids[i], NULL);
+
+        if (read_obj (repo_id, obj_ids[i], &data, &len, user_data) < 0)
+            continue;
+
+        if (writen (fd, data, len) != len) {
+            seaf_warning ("[obj pack] Failed to write %s: %s.\n",
+                          path, strerror(errno));
+            g_free (data);
+            goto out;
+        }
+        g_free (data);
+
+        rec.offset = offset;
+        rec.len = (guint32)len;
+        g_array_append_val (records, rec);
+        offset += len;
+    }
+
+    if (records->len == 0) {
+        close (fd);
+        fd = -1;
+        g_unlink (path);
+        ret = 0;
+        goto out;
+    }
+
+    if (fsync (fd) < 0) {
+        seaf_warning ("[obj pack] Failed to sync %s: %s.\n",
+                      path, strerror(errno));
+        goto out;
+    }
+
+    g_array_sort (records, compare_records);
+    idx_len = sizeof(PackIdxHeader) + records->len * sizeof(PackIdxRecord);
+    idx = g_malloc (idx_len);
+    header = (PackIdxHeader *)idx;
+    memcpy (header->magic, PACK_IDX_MAGIC, 4);
+    header->version = PACK_IDX_VERSION;
+    header->n_objs = records->len;
+    memcpy (idx + sizeof(PackIdxHeader), records->data,
+            records->len * sizeof(PackIdxRecord));
+
+    /* The pack is only seen once its index is there. */
+    snprintf (path, sizeof(path), "%s/pack-%08x.idx", dir, seq);
+    if (replace_file (path, idx, idx_len) < 0)
+        goto out;
+
+    ret = 0;
+
+out:
+    if (fd >= 0) {
+        close (fd);
+        if (ret < 0) {
+            snprintf (path, sizeof(path), "%s/pack-%08x.pack", dir, seq);
+            g_unlink (path);
+        }
+    }
+    if (lock_fd >= 0)
+        unlock_packs (lock_fd);
+    if (records)
+        g_array_free (records, TRUE);
+    if (seen)
+        g_hash_table_destroy (seen);
+    g_free (idx);
+    repo_packs_unref (rp);
+    g_free (dir);
+    return ret;
+}
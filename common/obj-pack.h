@@ -0,0 +1,60 @@
+#ifndef OBJ_PACK_H
+#define OBJ_PACK_H
+
+#include <glib.h>
+#include "obj-store.h"
+
+/*
+ * Packs of objects.
+ *
+ * Objects that are read a lot but never written again, like old commits,
+ * can be moved out of the one-file-per-object layout into packs:
+ *
+ *   <obj_dir>/<repo_id>/pack/pack-00000000.pack  objects, back to back
+ *   <obj_dir>/<repo_id>/pack/pack-00000000.idx   sorted id -> (offset, len)
+ *   <obj_dir>/<repo_id>/pack/removed             ids deleted after packing
+ *   <obj_dir>/<repo_id>/pack/lock                serializes writers
+ *
+ * A pack never changes once its index is in place, so a process only
+ * reloads the packs of a repo when the pack dir has changed. Objects are
+ * stored in the order they were packed in, and reading one also reads
+ * the ones right after it, so reading them in that order again takes
+ * little I/O.
+ */
+
+typedef struct ObjPacks ObjPacks;
+
+ObjPacks *
+obj_packs_new (const char *obj_dir);
+
+/* Returns -1 if @obj_id isn't in the packs of @repo_id. */
+int
+obj_packs_read (ObjPacks *packs, const char *repo_id, const char *obj_id,
+                void **data, int *len);
+
+gboolean
+obj_packs_contain (ObjPacks *packs, const char *repo_id, const char *obj_id);
+
+/* Returns FALSE if @process stopped the iteration. */
+gboolean
+obj_packs_foreach (ObjPacks *packs, const char *repo_id, int version,
+                   SeafObjFunc process, void *user_data);
+
+void
+obj_packs_remove (ObjPacks *packs, const char *repo_id, const char *obj_id);
+
+typedef int (*ObjPackReadFunc) (const char *repo_id, const char *obj_id,
+                                void **data, int *len, void *user_data);
+
+/*
+ * Write the @n objects into a new pack, in that order, reading them with
+ * @read_obj. Objects already packed or that can't be read are skipped,
+ * and nothing is written for only a few new objects. The caller removes
+ * the packed originals afterwards.
+ */
+int
+obj_packs_write (ObjPacks *packs, const char *repo_id,
+                 const char **obj_ids, int n,
+                 ObjPackReadFunc read_obj, void *user_data);
+
+#endif
@@ -1,14 +1,27 @@
 #include "common.h"
 
+#include <pthread.h>
 #include <ccnet/cevent.h>
 #include "seafile-session.h"
 
 #include "obj-backend.h"
 #include "obj-store.h"
+#include "exists-filter.h"
+#include "io-stats.h"
+#include "mem-stats.h"
+#include "utils.h"
 
-#define MAX_READER_THREADS 2
-#define MAX_WRITER_THREADS 2
-#define MAX_STAT_THREADS 2
+/*
+ * Threads of each async pool, unless async_threads is set in the backend
+ * group. Remote backends spend most of the time waiting on the network.
+ */
+#define DEFAULT_FS_ASYNC_THREADS 4
+#define DEFAULT_REMOTE_ASYNC_THREADS 16
+
+/* Most objects an async thread hands to read_many or write_many at once. */
+#define MAX_BATCH_OBJS 32
+
+struct MultiGet;
 
 typedef struct AsyncTask {
     guint32 rw_id;
@@ -16,7 +29,14 @@ typedef struct AsyncTask {
     void    *data;
     int     len;
     gboolean need_sync;
+    gboolean need_write;        /* data is counted in async_bytes */
     gboolean success;
+    ObjPriority priority;
+    /* Set for the reads of seaf_obj_store_read_objs(), which are not
+     * reported through the event manager.
+     */
+    struct MultiGet *mget;
+    gboolean done;
 } AsyncTask;
 
 typedef struct OSCallbackStruct {
@@ -24,30 +44,62 @@ typedef struct OSCallbackStruct {
     int version;
     OSAsyncCallback cb;
     void *cb_data;
+    ObjPriority priority;
 } OSCallbackStruct;
 
+/*
+ * Tasks of an async pool wait here, by priority. A push to the thread
+ * pool only wakes up a thread, which then takes the next task, or as
+ * many as it can if the backend reads or writes many objects at once.
+ */
+typedef struct TaskQueue {
+    GAsyncQueue *queues[N_OBJ_PRIORITIES];
+} TaskQueue;
+
+/* Waited on by the caller of seaf_obj_store_read_objs(). */
+typedef struct MultiGet {
+    const char *repo_id;
+    int version;
+    pthread_mutex_t lock;
+    pthread_cond_t cond;
+} MultiGet;
+
 struct SeafObjStore {
     ObjBackend   *bend;
 
+    /* Optional, see seaf_obj_store_enable_exists_filter(). */
+    ExistsFilter *exists_filter;
+
+    int          io_source;     /* see io-stats.h */
+
     CEventManager *ev_mgr;
+    /* Threads of each async pool. */
+    int          n_threads;
+
+    /* Async tasks not done yet, and the bytes they hold to write. */
+    gint         async_tasks;
+    gint         async_bytes;
 
     /* For async read. */
     guint32      next_rd_id;
     GThreadPool *read_tpool;
     GHashTable  *readers;
     guint32      read_ev_id;
+    TaskQueue    read_queue;
 
     /* For async write. */
     guint32      next_wr_id;
     GThreadPool *write_tpool;
     GHashTable  *writers;
     guint32      write_ev_id;
+    TaskQueue    write_queue;
 
     /* For async stat. */
     guint32      next_st_id;
     GThreadPool *stat_tpool;
     GHashTable  *stats;
     guint32      stat_ev_id;
+    TaskQueue    stat_queue;
 };
 typedef struct SeafObjStore SeafObjStore;
 
@@ -68,24 +120,203 @@ on_stat_done (CEvent *event, void *data);
 extern ObjBackend *
 obj_backend_fs_new (const char *seaf_dir, const char *obj_type);
 
+#ifdef SEAFILE_SERVER
+static char *
+backend_group (const char *obj_type)
+{
+    if (strcmp (obj_type, "commits") == 0)
+        return g_strdup ("commit_object_backend");
+    return g_strdup_printf ("%s_object_backend", obj_type);
+}
+
+extern ObjBackend *
+obj_backend_s3_new (GKeyFile *config, const char *group);
+
+extern ObjBackend *
+obj_backend_riak_new (const char *host,
+                      const char *port,
+                      const char *bucket,
+                      const char *write_policy,
+                      int max_connections);
+
+/*
+ * [fs_object_backend]
+ * name = riak
+ * host = 127.0.0.1
+ * port = 8098
+ * bucket = seafile-fs
+ * write_policy = quorum
+ * max_connections = 16
+ */
+static ObjBackend *
+load_riak_backend (GKeyFile *config, const char *group)
+{
+    ObjBackend *bend = NULL;
+    char *host, *port, *bucket, *policy;
+    int max_conns;
+
+    host = g_key_file_get_string (config, group, "host", NULL);
+    port = g_key_file_get_string (config, group, "port", NULL);
+    bucket = g_key_file_get_string (config, group, "bucket", NULL);
+    policy = g_key_file_get_string (config, group, "write_policy", NULL);
+    max_conns = g_key_file_get_integer (config, group, "max_connections", NULL);
+
+    if (!host || !port || !bucket) {
+        g_warning ("[Object store] Riak host, port or bucket not set in %s.\n",
+                   group);
+        goto out;
+    }
+
+    bend = obj_backend_riak_new (host, port, bucket,
+                                 policy ? policy : "quorum", max_conns);
+
+out:
+    g_free (host);
+    g_free (port);
+    g_free (bucket);
+    g_free (policy);
+    return bend;
+}
+
+/*
+ * [commit_object_backend]
+ * name = s3
+ *
+ * [fs_object_backend]
+ * name = s3
+ *
+ * See s3-client.h for the other options.
+ */
+static ObjBackend *
+load_obj_backend (SeafileSession *seaf, const char *obj_type,
+                  const char *group, const char **backend_name)
+{
+    ObjBackend *bend;
+    char *name;
+
+    name = g_key_file_get_string (seaf->config, group, "name", NULL);
+    if (name && strcmp (name, "s3") == 0) {
+        bend = obj_backend_s3_new (seaf->config, group);
+        *backend_name = "s3";
+    } else if (name && strcmp (name, "riak") == 0) {
+        bend = load_riak_backend (seaf->config, group);
+        *backend_name = "riak";
+    } else {
+        bend = obj_backend_fs_new (seaf->seaf_dir, obj_type);
+        *backend_name = "fs";
+    }
+
+    g_free (name);
+    return bend;
+}
+#endif
+
+static void
+obj_store_get_mem_stats (gpointer data, MemStats *stats)
+{
+    SeafObjStore *store = data;
+
+    stats->entries = g_atomic_int_get (&store->async_tasks);
+    stats->bytes = g_atomic_int_get (&store->async_bytes) +
+        stats->entries * sizeof(AsyncTask);
+}
+
 struct SeafObjStore *
 seaf_obj_store_new (SeafileSession *seaf, const char *obj_type)
 {
     SeafObjStore *store = g_new0 (SeafObjStore, 1);
+    const char *backend_name = "fs";
+    char *name;
+#ifdef SEAFILE_SERVER
+    char *group;
+#endif
 
     if (!store)
         return NULL;
 
+#ifdef SEAFILE_SERVER
+    /*
+     * [fs_object_backend]
+     * async_threads = 16
+     */
+    group = backend_group (obj_type);
+    store->bend = load_obj_backend (seaf, obj_type, group, &backend_name);
+    store->n_threads = g_key_file_get_integer (seaf->config, group,
+                                               "async_threads", NULL);
+    g_free (group);
+#else
     store->bend = obj_backend_fs_new (seaf->seaf_dir, obj_type);
+#endif
     if (!store->bend) {
         g_warning ("[Object store] Failed to load backend.\n");
         g_free (store);
         return NULL;
     }
 
+    if (store->n_threads <= 0)
+        store->n_threads = (strcmp (backend_name, "fs") == 0) ?
+            DEFAULT_FS_ASYNC_THREADS : DEFAULT_REMOTE_ASYNC_THREADS;
+
+    store->io_source = io_stats_register (obj_type, backend_name);
+
+    name = g_strconcat (obj_type, "_async_tasks", NULL);
+    mem_stats_register (name, obj_store_get_mem_stats, store);
+    g_free (name);
+
     return store;
 }
 
+static void
+task_queue_init (TaskQueue *queue)
+{
+    int i;
+
+    for (i = 0; i < N_OBJ_PRIORITIES; ++i)
+        queue->queues[i] = g_async_queue_new ();
+}
+
+static int
+task_queue_length (TaskQueue *queue)
+{
+    int i, n = 0;
+
+    for (i = 0; i < N_OBJ_PRIORITIES; ++i)
+        n += MAX (g_async_queue_length (queue->queues[i]), 0);
+    return n;
+}
+
+/* Take up to @max tasks, the ones of higher priority first. */
+static int
+pop_tasks (TaskQueue *queue, AsyncTask **tasks, int max)
+{
+    int prio, n = 0;
+
+    for (prio = 0; prio < N_OBJ_PRIORITIES && n < max; ++prio)
+        while (n < max &&
+               (tasks[n] = g_async_queue_try_pop (queue->queues[prio])) != NULL)
+            ++n;
+
+    return n;
+}
+
+static int
+queue_task (GThreadPool *tpool, TaskQueue *queue, AsyncTask *task)
+{
+    GError *error = NULL;
+
+    g_async_queue_push (queue->queues[task->priority], task);
+    /* Even if no new thread could be started, the push is queued for the
+     * running ones.
+     */
+    g_thread_pool_push (tpool, queue, &error);
+    if (error) {
+        g_clear_error (&error);
+        return -1;
+    }
+
+    return 0;
+}
+
 static int
 async_init (SeafObjStore *obj_store, CEventManager *ev_mgr)
 {
@@ -95,7 +326,7 @@ async_init (SeafObjStore *obj_store, CEventManager *ev_mgr)
 
     obj_store->read_tpool = g_thread_pool_new (reader_thread,
                                                obj_store,
-                                               MAX_READER_THREADS,
+                                               obj_store->n_threads,
                                                FALSE,
                                                &error);
     if (error) {
@@ -106,13 +337,14 @@ async_init (SeafObjStore *obj_store, CEventManager *ev_mgr)
 
     obj_store->readers = g_hash_table_new_full (g_direct_hash, g_direct_equal,
                                                 NULL, g_free);
+    task_queue_init (&obj_store->read_queue);
     obj_store->read_ev_id = cevent_manager_register (ev_mgr,
                                                      on_read_done,
                                                      obj_store);
 
     obj_store->write_tpool = g_thread_pool_new (writer_thread,
                                                 obj_store,
-                                                MAX_WRITER_THREADS,
+                                                obj_store->n_threads,
                                                 FALSE,
                                                 &error);
     if (error) {
@@ -123,23 +355,25 @@ async_init (SeafObjStore *obj_store, CEventManager *ev_mgr)
 
     obj_store->writers = g_hash_table_new_full (g_direct_hash, g_direct_equal,
                                                 NULL, g_free);
+    task_queue_init (&obj_store->write_queue);
     obj_store->write_ev_id = cevent_manager_register (ev_mgr,
                                                       on_write_done,
                                                       obj_store);
 
     obj_store->stat_tpool = g_thread_pool_new (stat_thread,
                                                obj_store,
-                                               MAX_STAT_THREADS,
+                                               obj_store->n_threads,
                                                FALSE,
                                                &error);
     if (error) {
-        g_warning ("Failed to start statr thread pool: %s.\n", error->message);
+        g_warning ("Failed to start stat thread pool: %s.\n", error->message);
         g_clear_error (&error);
         return -1;
     }
 
     obj_store->stats = g_hash_table_new_full (g_direct_hash, g_direct_equal,
                                               NULL, g_free);
+    task_queue_init (&obj_store->stat_queue);
     obj_store->stat_ev_id = cevent_manager_register (ev_mgr,
                                                      on_stat_done,
                                                      obj_store);
@@ -167,8 +401,146 @@ seaf_obj_store_read_obj (struct SeafObjStore *obj_store,
                          int *len)
 {
     ObjBackend *bend = obj_store->bend;
+    gint64 start = get_current_time ();
+    int ret;
 
-    return bend->read (bend, repo_id, version, obj_id, data, len);
+    ret = bend->read (bend, repo_id, version, obj_id, data, len);
+
+    io_stats_observe (obj_store->io_source, IO_OP_READ, start,
+                      ret == 0 ? *len : 0, ret < 0);
+    return ret;
+}
+
+/*
+ * Without read_many, the objects are read by the async threads, ahead of
+ * the tasks of the transfer processors. The tasks live on the stack, so
+ * each batch is waited for as a whole.
+ */
+static int
+read_objs_async (SeafObjStore *obj_store,
+                 const char *repo_id,
+                 int version,
+                 const char **obj_ids,
+                 int n,
+                 SeafObjReadFunc callback,
+                 void *user_data)
+{
+    AsyncTask tasks[MAX_BATCH_OBJS];
+    MultiGet mget;
+    int start, n_items, i;
+    gboolean stop = FALSE;
+    gint64 t, bytes;
+    int ret = 0;
+
+    mget.repo_id = repo_id;
+    mget.version = version;
+    pthread_mutex_init (&mget.lock, NULL);
+    pthread_cond_init (&mget.cond, NULL);
+
+    for (start = 0; start < n && !stop; start += n_items) {
+        n_items = MIN (n - start, MAX_BATCH_OBJS);
+        t = get_current_time ();
+
+        memset (tasks, 0, sizeof(AsyncTask) * n_items);
+        for (i = 0; i < n_items; ++i) {
+            g_strlcpy (tasks[i].obj_id, obj_ids[start + i],
+                       sizeof(tasks[i].obj_id));
+            tasks[i].priority = OBJ_PRIORITY_HIGH;
+            tasks[i].mget = &mget;
+            queue_task (obj_store->read_tpool, &obj_store->read_queue,
+                        &tasks[i]);
+        }
+
+        pthread_mutex_lock (&mget.lock);
+        for (i = 0; i < n_items; ++i)
+            while (!tasks[i].done)
+                pthread_cond_wait (&mget.cond, &mget.lock);
+        pthread_mutex_unlock (&mget.lock);
+
+        bytes = 0;
+        for (i = 0; i < n_items; ++i)
+            if (tasks[i].success)
+                bytes += tasks[i].len;
+        io_stats_observe (obj_store->io_source, IO_OP_READ, t, bytes, FALSE);
+
+        for (i = 0; i < n_items; ++i) {
+            if (!tasks[i].success)
+                ret = -1;
+            if (!stop &&
+                !callback (tasks[i].obj_id,
+                           tasks[i].success ? tasks[i].data : NULL,
+                           tasks[i].len, user_data))
+                stop = TRUE;
+            g_free (tasks[i].data);
+        }
+    }
+
+    pthread_mutex_destroy (&mget.lock);
+    pthread_cond_destroy (&mget.cond);
+    return ret;
+}
+
+int
+seaf_obj_store_read_objs (struct SeafObjStore *obj_store,
+                          const char *repo_id,
+                          int version,
+                          const char **obj_ids,
+                          int n,
+                          SeafObjReadFunc callback,
+                          void *user_data)
+{
+    ObjBackend *bend = obj_store->bend;
+    ObjBackendItem items[MAX_BATCH_OBJS];
+    int start, n_items, i;
+    gboolean stop = FALSE;
+    gint64 t, bytes;
+    int ret = 0;
+
+    if (obj_store->read_tpool && !bend->read_many)
+        return read_objs_async (obj_store, repo_id, version, obj_ids, n,
+                                callback, user_data);
+
+    for (start = 0; start < n && !stop; start += n_items) {
+        n_items = MIN (n - start, MAX_BATCH_OBJS);
+        t = get_current_time ();
+
+        memset (items, 0, sizeof(ObjBackendItem) * n_items);
+        for (i = 0; i < n_items; ++i) {
+            items[i].repo_id = repo_id;
+            items[i].version = version;
+            items[i].obj_id = obj_ids[start + i];
+        }
+
+        if (bend->read_many) {
+            bend->read_many (bend, items, n_items);
+        } else {
+            for (i = 0; i < n_items; ++i)
+                items[i].success = (bend->read (bend, repo_id, version,
+                                                items[i].obj_id,
+                                                &items[i].data,
+                                                &items[i].len) == 0);
+        }
+
+        /* A batch counts as one read. */
+        bytes = 0;
+        for (i = 0; i < n_items; ++i)
+            if (items[i].success)
+                bytes += items[i].len;
+        io_stats_observe (obj_store->io_source, IO_OP_READ, t, bytes, FALSE);
+
+        for (i = 0; i < n_items; ++i) {
+            if (!items[i].success)
+                ret = -1;
+            if (!stop &&
+                !callback (items[i].obj_id,
+                           items[i].success ? items[i].data : NULL,
+                           items[i].len, user_data))
+                stop = TRUE;
+            g_free (items[i].data);
+        }
+    }
+
+    return ret;
 }
 
 int
@@ -181,8 +553,111 @@ seaf_obj_store_write_obj (struct SeafObjStore *obj_store,
                           gboolean need_sync)
 {
     ObjBackend *bend = obj_store->bend;
+    gint64 start = get_current_time ();
+    int ret;
+
+    ret = bend->write (bend, repo_id, version, obj_id, data, len, need_sync);
+
+    io_stats_observe (obj_store->io_source, IO_OP_WRITE, start, len, ret < 0);
+
+    if (ret == 0 && obj_store->exists_filter)
+        exists_filter_add (obj_store->exists_filter, repo_id, obj_id);
+
+    return ret;
+}
+
+int
+seaf_obj_store_write_objs (struct SeafObjStore *obj_store,
+                           const char *repo_id,
+                           int version,
+                           const char **obj_ids,
+                           void **data,
+                           int *lens,
+                           int n)
+{
+    ObjBackend *bend = obj_store->bend;
+    ObjBackendItem items[MAX_BATCH_OBJS];
+    int start, n_items, i;
+    gint64 t, bytes;
+    gboolean failed;
+    int ret = 0;
+
+    seaf_obj_store_begin_batch (obj_store);
+
+    for (start = 0; start < n; start += n_items) {
+        n_items = MIN (n - start, MAX_BATCH_OBJS);
+        t = get_current_time ();
+
+        memset (items, 0, sizeof(ObjBackendItem) * n_items);
+        for (i = 0; i < n_items; ++i) {
+            items[i].repo_id = repo_id;
+            items[i].version = version;
+            items[i].obj_id = obj_ids[start + i];
+            items[i].data = data[start + i];
+            items[i].len = lens[start + i];
+        }
+
+        if (bend->write_many) {
+            bend->write_many (bend, items, n_items);
+        } else {
+            for (i = 0; i < n_items; ++i)
+                items[i].success = (bend->write (bend, repo_id, version,
+                                                 items[i].obj_id,
+                                                 items[i].data,
+                                                 items[i].len, FALSE) == 0);
+        }
+
+        bytes = 0;
+        failed = FALSE;
+        for (i = 0; i < n_items; ++i) {
+            if (!items[i].success) {
+                failed = TRUE;
+                continue;
+            }
+            bytes += items[i].len;
+            if (obj_store->exists_filter)
+                exists_filter_add (obj_store->exists_filter, repo_id,
+                                   items[i].obj_id);
+        }
+        io_stats_observe (obj_store->io_source, IO_OP_WRITE, t, bytes, failed);
+
+        if (failed) {
+            ret = -1;
+            break;
+        }
+    }
+
+    if (seaf_obj_store_end_batch (obj_store) < 0)
+        ret = -1;
+
+    return ret;
+}
+
+void
+seaf_obj_store_begin_batch (struct SeafObjStore *obj_store)
+{
+    ObjBackend *bend = obj_store->bend;
+
+    if (bend->begin_batch)
+        bend->begin_batch (bend);
+}
+
+int
+seaf_obj_store_end_batch (struct SeafObjStore *obj_store)
+{
+    ObjBackend *bend = obj_store->bend;
+    gint64 start;
+    int ret;
+
+    if (!bend->end_batch)
+        return 0;
+
+    /* Writes of a batch are only durable once it ends. */
+    start = get_current_time ();
+    ret = bend->end_batch (bend);
 
-    return bend->write (bend, repo_id, version, obj_id, data, len, need_sync);
+    io_stats_observe (obj_store->io_source, IO_OP_COMMIT, start, 0, ret < 0);
+    return ret;
 }
 
 gboolean
@@ -192,8 +667,87 @@ seaf_obj_store_obj_exists (struct SeafObjStore *obj_store,
                            const char *obj_id)
 {
     ObjBackend *bend = obj_store->bend;
+    gint64 start;
+    gboolean ret;
+
+    if (obj_store->exists_filter &&
+        !exists_filter_may_contain (obj_store->exists_filter,
+                                    repo_id, version, obj_id))
+        return FALSE;
+
+    start = get_current_time ();
+    ret = bend->exists (bend, repo_id, version, obj_id);
 
-    return bend->exists (bend, repo_id, version, obj_id);
+    io_stats_observe (obj_store->io_source, IO_OP_EXISTS, start, 0, FALSE);
+    return ret;
+}
+
+int
+seaf_obj_store_objs_exist (struct SeafObjStore *obj_store,
+                           const char *repo_id,
+                           int version,
+                           const char **obj_ids,
+                           int n,
+                           gboolean *exists)
+{
+    ObjBackend *bend = obj_store->bend;
+    const char **check = g_new (const char *, n);
+    int *idx = g_new (int, n);
+    gboolean *found;
+    gint64 start;
+    int i, n_check = 0;
+    int ret = 0;
+
+    for (i = 0; i < n; ++i) {
+        exists[i] = FALSE;
+        if (obj_store->exists_filter &&
+            !exists_filter_may_contain (obj_store->exists_filter,
+                                        repo_id, version, obj_ids[i]))
+            continue;
+        idx[n_check] = i;
+        check[n_check++] = obj_ids[i];
+    }
+
+    if (n_check == 0)
+        goto out;
+
+    found = g_new0 (gboolean, n_check);
+    start = get_current_time ();
+    if (bend->exists_batch) {
+        ret = bend->exists_batch (bend, repo_id, version,
+                                  check, n_check, found);
+    } else {
+        for (i = 0; i < n_check; ++i)
+            found[i] = bend->exists (bend, repo_id, version, check[i]);
+    }
+    io_stats_observe (obj_store->io_source, IO_OP_EXISTS, start, 0, ret < 0);
+    for (i = 0; i < n_check; ++i)
+        exists[idx[i]] = found[i];
+    g_free (found);
+
+out:
+    g_free (check);
+    g_free (idx);
+    return ret;
+}
+
+static int
+scan_objs (void *data, const char *repo_id, int version,
+           ExistsFilterAddFunc add, void *add_data)
+{
+    ObjBackend *bend = data;
+
+    return bend->foreach_obj (bend, repo_id, version, add, add_data);
+}
+
+int
+seaf_obj_store_enable_exists_filter (struct SeafObjStore *obj_store)
+{
+    obj_store->exists_filter = exists_filter_new (scan_objs, obj_store->bend);
+    if (!obj_store->exists_filter)
+        return -1;
+
+    return 0;
 }
 
 void
@@ -203,8 +757,11 @@ seaf_obj_store_delete_obj (struct SeafObjStore *obj_store,
                            const char *obj_id)
 {
     ObjBackend *bend = obj_store->bend;
+    gint64 start = get_current_time ();
+
+    bend->delete (bend, repo_id, version, obj_id);
 
-    return bend->delete (bend, repo_id, version, obj_id);
+    io_stats_observe (obj_store->io_source, IO_OP_DELETE, start, 0, FALSE);
 }
 
 int
@@ -228,64 +785,184 @@ seaf_obj_store_copy_obj (struct SeafObjStore *obj_store,
                          const char *obj_id)
 {
     ObjBackend *bend = obj_store->bend;
+    int ret;
 
     if (strcmp (obj_id, EMPTY_SHA1) == 0)
         return 0;
 
-    return bend->copy (bend, src_repo_id, src_version, dst_repo_id, dst_version, obj_id);
+    ret = bend->copy (bend, src_repo_id, src_version, dst_repo_id, dst_version, obj_id);
+
+    if (ret == 0 && obj_store->exists_filter)
+        exists_filter_add (obj_store->exists_filter, dst_repo_id, obj_id);
+
+    return ret;
+}
+
+int
+seaf_obj_store_pack_objs (struct SeafObjStore *obj_store,
+                          const char *repo_id,
+                          int version,
+                          const char **obj_ids,
+                          int n)
+{
+    ObjBackend *bend = obj_store->bend;
+
+    if (!bend->pack || n == 0)
+        return 0;
+
+    return bend->pack (bend, repo_id, version, obj_ids, n);
 }
 
 static void
-reader_thread (void *data, void *user_data)
+read_batch (SeafObjStore *obj_store)
 {
-    AsyncTask *task = data;
-    SeafObjStore *obj_store = user_data;
     ObjBackend *bend = obj_store->bend;
+    AsyncTask *tasks[MAX_BATCH_OBJS];
+    ObjBackendItem items[MAX_BATCH_OBJS];
+    AsyncTask *pending[MAX_BATCH_OBJS];
     OSCallbackStruct *callback;
+    int n, n_items = 0, i;
 
-    callback = g_hash_table_lookup (obj_store->readers,
-                                    (gpointer)(long)(task->rw_id));
-    if (callback) {
-        task->success = TRUE;
+    n = pop_tasks (&obj_store->read_queue, tasks, MAX_BATCH_OBJS);
 
-        if (bend->read (bend, callback->repo_id, callback->version,
-                        task->obj_id, &task->data, &task->len) < 0)
-            task->success = FALSE;
+    for (i = 0; i < n; ++i) {
+        callback = g_hash_table_lookup (obj_store->readers,
+                                        (gpointer)(long)(tasks[i]->rw_id));
+        if (!callback)
+            continue;
+
+        memset (&items[n_items], 0, sizeof(ObjBackendItem));
+        items[n_items].repo_id = callback->repo_id;
+        items[n_items].version = callback->version;
+        items[n_items].obj_id = tasks[i]->obj_id;
+        pending[n_items++] = tasks[i];
     }
 
-    cevent_manager_add_event (obj_store->ev_mgr, obj_store->read_ev_id,
-                              task);
+    if (n_items > 0)
+        bend->read_many (bend, items, n_items);
+
+    for (i = 0; i < n_items; ++i) {
+        pending[i]->success = items[i].success;
+        pending[i]->data = items[i].data;
+        pending[i]->len = items[i].len;
+    }
+
+    for (i = 0; i < n; ++i)
+        cevent_manager_add_event (obj_store->ev_mgr, obj_store->read_ev_id,
+                                  tasks[i]);
 }
 
 static void
-stat_thread (void *data, void *user_data)
+write_batch (SeafObjStore *obj_store)
+{
+    ObjBackend *bend = obj_store->bend;
+    AsyncTask *tasks[MAX_BATCH_OBJS];
+    ObjBackendItem items[MAX_BATCH_OBJS];
+    AsyncTask *pending[MAX_BATCH_OBJS];
+    OSCallbackStruct *callback;
+    int n, n_items = 0, i;
+
+    n = pop_tasks (&obj_store->write_queue, tasks, MAX_BATCH_OBJS);
+
+    for (i = 0; i < n; ++i) {
+        callback = g_hash_table_lookup (obj_store->writers,
+                                        (gpointer)(long)(tasks[i]->rw_id));
+        if (!callback)
+            continue;
+
+        memset (&items[n_items], 0, sizeof(ObjBackendItem));
+        items[n_items].repo_id = callback->repo_id;
+        items[n_items].version = callback->version;
+        items[n_items].obj_id = tasks[i]->obj_id;
+        items[n_items].data = tasks[i]->data;
+        items[n_items].len = tasks[i]->len;
+        items[n_items].need_sync = tasks[i]->need_sync;
+        pending[n_items++] = tasks[i];
+    }
+
+    if (n_items > 0)
+        bend->write_many (bend, items, n_items);
+
+    for (i = 0; i < n_items; ++i) {
+        pending[i]->success = items[i].success;
+        if (items[i].success && obj_store->exists_filter)
+            exists_filter_add (obj_store->exists_filter,
+                               items[i].repo_id, items[i].obj_id);
+    }
+
+    for (i = 0; i < n; ++i)
+        cevent_manager_add_event (obj_store->ev_mgr, obj_store->write_ev_id,
+                                  tasks[i]);
+}
+
+static void
+multi_get_read (SeafObjStore *obj_store, AsyncTask *task)
 {
-    AsyncTask *task = data;
+    ObjBackend *bend = obj_store->bend;
+    MultiGet *mget = task->mget;
+    gboolean success;
+
+    success = (bend->read (bend, mget->repo_id, mget->version,
+                           task->obj_id, &task->data, &task->len) == 0);
+
+    pthread_mutex_lock (&mget->lock);
+    task->success = success;
+    task->done = TRUE;
+    pthread_cond_broadcast (&mget->cond);
+    pthread_mutex_unlock (&mget->lock);
+}
+
+static void
+reader_thread (void *data, void *user_data)
+{
+    AsyncTask *task;
     SeafObjStore *obj_store = user_data;
     ObjBackend *bend = obj_store->bend;
     OSCallbackStruct *callback;
 
-    callback = g_hash_table_lookup (obj_store->stats,
+    if (bend->read_many) {
+        read_batch (obj_store);
+        return;
+    }
+
+    if (pop_tasks (&obj_store->read_queue, &task, 1) == 0)
+        return;
+
+    if (task->mget) {
+        multi_get_read (obj_store, task);
+        return;
+    }
+
+    callback = g_hash_table_lookup (obj_store->readers,
                                     (gpointer)(long)(task->rw_id));
     if (callback) {
         task->success = TRUE;
 
-        if (!bend->exists (bend, callback->repo_id, callback->version, task->obj_id))
+        if (bend->read (bend, callback->repo_id, callback->version,
+                        task->obj_id, &task->data, &task->len) < 0)
             task->success = FALSE;
     }
 
-    cevent_manager_add_event (obj_store->ev_mgr, obj_store->stat_ev_id,
+    cevent_manager_add_event (obj_store->ev_mgr, obj_store->read_ev_id,
                               task);
 }
 
 static void
 writer_thread (void *data, void *user_data)
 {
-    AsyncTask *task = data;
+    AsyncTask *task;
     SeafObjStore *obj_store = user_data;
     ObjBackend *bend = obj_store->bend;
     OSCallbackStruct *callback;
 
+    if (bend->write_many) {
+        write_batch (obj_store);
+        return;
+    }
+
+    if (pop_tasks (&obj_store->write_queue, &task, 1) == 0)
+        return;
+
     callback = g_hash_table_lookup (obj_store->writers,
                                     (gpointer)(long)(task->rw_id));
     if (callback) {
@@ -294,12 +971,48 @@ writer_thread (void *data, void *user_data)
         if (bend->write (bend, callback->repo_id, callback->version,
                          task->obj_id, task->data, task->len, task->need_sync) < 0)
             task->success = FALSE;
+        else if (obj_store->exists_filter)
+            exists_filter_add (obj_store->exists_filter,
+                               callback->repo_id, task->obj_id);
     }
 
     cevent_manager_add_event (obj_store->ev_mgr, obj_store->write_ev_id,
                               task);
 }
 
+static void
+stat_thread (void *data, void *user_data)
+{
+    AsyncTask *task;
+    SeafObjStore *obj_store = user_data;
+    OSCallbackStruct *callback;
+
+    if (pop_tasks (&obj_store->stat_queue, &task, 1) == 0)
+        return;
+
+    callback = g_hash_table_lookup (obj_store->stats,
+                                    (gpointer)(long)(task->rw_id));
+    if (callback)
+        task->success = seaf_obj_store_obj_exists (obj_store,
+                                                   callback->repo_id,
+                                                   callback->version,
+                                                   task->obj_id);
+
+    cevent_manager_add_event (obj_store->ev_mgr, obj_store->stat_ev_id,
+                              task);
+}
+
+static void
+async_task_free (SeafObjStore *obj_store, AsyncTask *task)
+{
+    g_atomic_int_add (&obj_store->async_tasks, -1);
+    if (task->need_write)
+        g_atomic_int_add (&obj_store->async_bytes, -task->len);
+
+    g_free (task->data);
+    g_free (task);
+}
+
 static void
 on_read_done (CEvent *event, void *user_data)
 {
@@ -320,8 +1033,7 @@ on_read_done (CEvent *event, void *user_data)
         callback->cb (&res, callback->cb_data);
     }
 
-    g_free (task->data);
-    g_free (task);
+    async_task_free (obj_store, task);
 }
 
 static void
@@ -344,8 +1056,7 @@ on_stat_done (CEvent *event, void *user_data)
         callback->cb (&res, callback->cb_data);
     }
 
-    g_free (task->data);
-    g_free (task);
+    async_task_free (obj_store, task);
 }
 
 static void
@@ -368,8 +1079,7 @@ on_write_done (CEvent *event, void *user_data)
         callback->cb (&res, callback->cb_data);
     }
 
-    g_free (task->data);
-    g_free (task);
+    async_task_free (obj_store, task);
 }
 
 guint32
@@ -386,6 +1096,7 @@ seaf_obj_store_register_async_read (struct SeafObjStore *obj_store,
     cb_struct->version = version;
     cb_struct->cb = callback;
     cb_struct->cb_data = cb_data;
+    cb_struct->priority = OBJ_PRIORITY_NORMAL;
 
     g_hash_table_insert (obj_store->readers, (gpointer)(long)id, cb_struct);
 
@@ -399,19 +1110,46 @@ seaf_obj_store_unregister_async_read (struct SeafObjStore *obj_store,
     g_hash_table_remove (obj_store->readers, (gpointer)(long)reader_id);
 }
 
+static void
+set_priority (GHashTable *table, guint32 id, ObjPriority priority)
+{
+    OSCallbackStruct *cb_struct;
+
+    cb_struct = g_hash_table_lookup (table, (gpointer)(long)id);
+    if (cb_struct)
+        cb_struct->priority = priority;
+}
+
+void
+seaf_obj_store_set_read_priority (struct SeafObjStore *obj_store,
+                                  guint32 reader_id,
+                                  ObjPriority priority)
+{
+    set_priority (obj_store->readers, reader_id, priority);
+}
+
+static ObjPriority
+get_priority (GHashTable *table, guint32 id)
+{
+    OSCallbackStruct *cb_struct;
+
+    cb_struct = g_hash_table_lookup (table, (gpointer)(long)id);
+    return cb_struct ? cb_struct->priority : OBJ_PRIORITY_NORMAL;
+}
+
 int
 seaf_obj_store_async_read (struct SeafObjStore *obj_store,
                            guint32 reader_id,
                            const char *obj_id)
 {
     AsyncTask *task = g_new0 (AsyncTask, 1);
-    GError *error = NULL;
 
     task->rw_id = reader_id;
     memcpy (task->obj_id, obj_id, 41);
+    task->priority = get_priority (obj_store->readers, reader_id);
+    g_atomic_int_inc (&obj_store->async_tasks);
 
-    g_thread_pool_push (obj_store->read_tpool, task, &error);
-    if (error) {
+    if (queue_task (obj_store->read_tpool, &obj_store->read_queue, task) < 0) {
         g_warning ("Failed to start aysnc read of %s.\n", obj_id);
         return -1;
     }
@@ -433,6 +1171,7 @@ seaf_obj_store_register_async_stat (struct SeafObjStore *obj_store,
     cb_struct->version = version;
     cb_struct->cb = callback;
     cb_struct->cb_data = cb_data;
+    cb_struct->priority = OBJ_PRIORITY_NORMAL;
 
     g_hash_table_insert (obj_store->stats, (gpointer)(long)id, cb_struct);
 
@@ -452,13 +1191,13 @@ seaf_obj_store_async_stat (struct SeafObjStore *obj_store,
                            const char *obj_id)
 {
     AsyncTask *task = g_new0 (AsyncTask, 1);
-    GError *error = NULL;
 
     task->rw_id = stat_id;
     memcpy (task->obj_id, obj_id, 41);
+    task->priority = get_priority (obj_store->stats, stat_id);
+    g_atomic_int_inc (&obj_store->async_tasks);
 
-    g_thread_pool_push (obj_store->stat_tpool, task, &error);
-    if (error) {
+    if (queue_task (obj_store->stat_tpool, &obj_store->stat_queue, task) < 0) {
         g_warning ("Failed to start aysnc stat of %s.\n", obj_id);
         return -1;
     }
@@ -480,6 +1219,7 @@ seaf_obj_store_register_async_write (struct SeafObjStore *obj_store,
     cb_struct->version = version;
     cb_struct->cb = callback;
     cb_struct->cb_data = cb_data;
+    cb_struct->priority = OBJ_PRIORITY_NORMAL;
 
     g_hash_table_insert (obj_store->writers, (gpointer)(long)id, cb_struct);
 
@@ -493,6 +1233,14 @@ seaf_obj_store_unregister_async_write (struct SeafObjStore *obj_store,
     g_hash_table_remove (obj_store->writers, (gpointer)(long)writer_id);
 }
 
+void
+seaf_obj_store_set_write_priority (struct SeafObjStore *obj_store,
+                                   guint32 writer_id,
+                                   ObjPriority priority)
+{
+    set_priority (obj_store->writers, writer_id, priority);
+}
+
 int
 seaf_obj_store_async_write (struct SeafObjStore *obj_store,
                             guint32 writer_id,
@@ -502,19 +1250,36 @@ seaf_obj_store_async_write (struct SeafObjStore *obj_store,
                             gboolean need_sync)
 {
     AsyncTask *task = g_new0 (AsyncTask, 1);
-    GError *error = NULL;
 
     task->rw_id = writer_id;
     memcpy (task->obj_id, obj_id, 41);
     task->data = g_memdup (obj_data, data_len);
     task->len = data_len;
     task->need_sync = need_sync;
+    task->need_write = TRUE;
+    task->priority = get_priority (obj_store->writers, writer_id);
+    g_atomic_int_inc (&obj_store->async_tasks);
+    g_atomic_int_add (&obj_store->async_bytes, data_len);
 
-    g_thread_pool_push (obj_store->write_tpool, task, &error);
-    if (error) {
+    if (queue_task (obj_store->write_tpool, &obj_store->write_queue, task) < 0) {
         g_warning ("Failed to start aysnc write of %s.\n", obj_id);
         return -1;
     }
 
     return 0;
 }
+
+int
+seaf_obj_store_get_async_stats (struct SeafObjStore *obj_store,
+                                ObjStoreAsyncStats *stats)
+{
+    if (!obj_store->read_tpool)
+        return -1;
+
+    stats->n_threads = obj_store->n_threads;
+    stats->n_queued_reads = task_queue_length (&obj_store->read_queue);
+    stats->n_queued_writes = task_queue_length (&obj_store->write_queue);
+    stats->n_queued_stats = task_queue_length (&obj_store->stat_queue);
+
+    return 0;
+}
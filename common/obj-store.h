@@ -8,9 +8,25 @@ struct _SeafileSession;
 struct SeafObjStore;
 struct CEventManager;
 
+/*
+ * Priorities of async tasks. Higher priority tasks are taken first, and
+ * tasks of the same priority in the order they were queued.
+ */
+typedef enum ObjPriority {
+    OBJ_PRIORITY_HIGH = 0,
+    OBJ_PRIORITY_NORMAL,
+    OBJ_PRIORITY_LOW,
+    N_OBJ_PRIORITIES,
+} ObjPriority;
+
 struct SeafObjStore *
 seaf_obj_store_new (struct _SeafileSession *seaf, const char *obj_type);
 
+/*
+ * With @enable_async, reads, writes and stats can be run by pools of
+ * threads, sized by async_threads in the backend group. Backends that
+ * read or write many objects at once get the queued tasks in batches.
+ */
 int
 seaf_obj_store_init (struct SeafObjStore *obj_store,
                      gboolean enable_async,
@@ -26,6 +42,31 @@ seaf_obj_store_read_obj (struct SeafObjStore *obj_store,
                          void **data,
                          int *len);
 
+/*
+ * Called for each object of seaf_obj_store_read_objs(), in the order of
+ * the ids. @data is NULL if the object couldn't be read and is freed
+ * after the call. Return FALSE to stop.
+ */
+typedef gboolean (*SeafObjReadFunc) (const char *obj_id,
+                                     void *data,
+                                     int len,
+                                     void *user_data);
+
+/*
+ * Read many objects. Backends may read them concurrently or in a better
+ * order than one by one. Otherwise, if async is enabled, the objects are
+ * read by the async threads, ahead of the other tasks. Returns -1 if
+ * any object couldn't be read.
+ */
+int
+seaf_obj_store_read_objs (struct SeafObjStore *obj_store,
+                          const char *repo_id,
+                          int version,
+                          const char **obj_ids,
+                          int n,
+                          SeafObjReadFunc callback,
+                          void *user_data);
+
 int
 seaf_obj_store_write_obj (struct SeafObjStore *obj_store,
                           const char *repo_id,
@@ -35,12 +76,44 @@ seaf_obj_store_write_obj (struct SeafObjStore *obj_store,
                           int len,
                           gboolean need_sync);
 
+/*
+ * Write @n objects as one batch. Backends that can write many objects at
+ * once get them together, and all of them are synced at the end, like
+ * in seaf_obj_store_begin_batch(). Stops at the first batch that fails.
+ * Returns -1 if any object couldn't be written or synced.
+ */
+int
+seaf_obj_store_write_objs (struct SeafObjStore *obj_store,
+                           const char *repo_id,
+                           int version,
+                           const char **obj_ids,
+                           void **data,
+                           int *lens,
+                           int n);
+
 gboolean
 seaf_obj_store_obj_exists (struct SeafObjStore *obj_store,
                            const char *repo_id,
                            int version,
                            const char *obj_id);
 
+/* Check @n objects at once, setting @exists[i] for each. */
+int
+seaf_obj_store_objs_exist (struct SeafObjStore *obj_store,
+                           const char *repo_id,
+                           int version,
+                           const char **obj_ids,
+                           int n,
+                           gboolean *exists);
+
+/*
+ * Keep an in-memory filter of the objects in each repo, so that
+ * seaf_obj_store_obj_exists() can answer most misses without touching
+ * the backend. Only safe if this process is the only one writing objects.
+ */
+int
+seaf_obj_store_enable_exists_filter (struct SeafObjStore *obj_store);
+
 void
 seaf_obj_store_delete_obj (struct SeafObjStore *obj_store,
                            const char *repo_id,
@@ -67,6 +140,35 @@ seaf_obj_store_copy_obj (struct SeafObjStore *obj_store,
                          int dst_version,
                          const char *obj_id);
 
+/*
+ * Move @n objects that won't change any more into a pack, in the order
+ * they'll most likely be read in (see obj-pack.h). They stay readable
+ * the same way. Does nothing if the backend can't pack objects.
+ */
+int
+seaf_obj_store_pack_objs (struct SeafObjStore *obj_store,
+                          const char *repo_id,
+                          int version,
+                          const char **obj_ids,
+                          int n);
+
+/*
+ * Batched writes.
+ *
+ * Objects the calling thread writes between begin and end are not synced
+ * one by one, whatever their need_sync. seaf_obj_store_end_batch() makes
+ * all of them durable at once, so call it before anything that must only
+ * refer to objects on disk, e.g. a commit. Nested batches end with the
+ * outermost one.
+ *
+ * Returns: 0 on success, -1 if the objects couldn't be synced.
+ */
+void
+seaf_obj_store_begin_batch (struct SeafObjStore *obj_store);
+
+int
+seaf_obj_store_end_batch (struct SeafObjStore *obj_store);
+
 /* Asynchronous I/O interface. */
 
 typedef struct OSAsyncResult {
@@ -97,6 +199,12 @@ seaf_obj_store_async_read (struct SeafObjStore *obj_store,
                            guint32 reader_id,
                            const char *obj_id);
 
+/* Reads are queued at normal priority unless set otherwise. */
+void
+seaf_obj_store_set_read_priority (struct SeafObjStore *obj_store,
+                                  guint32 reader_id,
+                                  ObjPriority priority);
+
 /* Async write */
 guint32
 seaf_obj_store_register_async_write (struct SeafObjStore *obj_store,
@@ -117,6 +225,11 @@ seaf_obj_store_async_write (struct SeafObjStore *obj_store,
                             int data_len,
                             gboolean need_sync);
 
+void
+seaf_obj_store_set_write_priority (struct SeafObjStore *obj_store,
+                                   guint32 writer_id,
+                                   ObjPriority priority);
+
 /* Async stat */
 guint32
 seaf_obj_store_register_async_stat (struct SeafObjStore *obj_store,
@@ -134,4 +247,16 @@ seaf_obj_store_async_stat (struct SeafObjStore *obj_store,
                            guint32 stat_id,
                            const char *obj_id);
 
+typedef struct ObjStoreAsyncStats {
+    int n_threads;              /* of each pool */
+    int n_queued_reads;
+    int n_queued_writes;
+    int n_queued_stats;
+} ObjStoreAsyncStats;
+
+/* Returns -1 if async is not enabled. */
+int
+seaf_obj_store_get_async_stats (struct SeafObjStore *obj_store,
+                                ObjStoreAsyncStats *stats);
+
 #endif
@@ -30,6 +30,30 @@ seaf_riak_client_put (SeafRiakClient *client,
                       int size,
                       int n_w);
 
+/*
+ * Bulk versions of get and put. The requests are pipelined onto the
+ * client's keep-alive connections, a few at a time. results[i] is set to
+ * 0 or -1 for each key.
+ */
+void
+seaf_riak_client_get_many (SeafRiakClient *client,
+                           const char *bucket,
+                           const char **keys,
+                           int n,
+                           void **values,
+                           int *sizes,
+                           int *results);
+
+void
+seaf_riak_client_put_many (SeafRiakClient *client,
+                           const char *bucket,
+                           const char **keys,
+                           int n,
+                           void **values,
+                           int *sizes,
+                           int n_w,
+                           int *results);
+
 gboolean
 seaf_riak_client_query (SeafRiakClient *client,
                         const char *bucket,
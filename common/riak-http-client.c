@@ -5,6 +5,7 @@
 #include <stdlib.h>
 #include <string.h>
 #include <curl/curl.h>
+#include <sys/select.h>
 #include <glib.h>
 
 #include "log.h"
@@ -15,10 +16,19 @@
 #define seaf_warning g_warning
 #endif
 
+/* Requests of a bulk get or put in flight at a time, per client. */
+#define RIAK_PIPELINE_DEPTH 8
+
 struct SeafRiakClient {
     CURL *curl;
     char *host;
     char *port;
+
+    /* For bulk requests. The multi handle keeps the connections alive
+     * between calls and pipelines requests onto them.
+     */
+    CURLM *multi;
+    CURL *pipe[RIAK_PIPELINE_DEPTH];
 };
 
 typedef struct RiakObject {
@@ -41,6 +51,14 @@ seaf_riak_client_new (const char *host, const char *port)
 void
 seaf_riak_client_free (SeafRiakClient *client)
 {
+    int i;
+
+    for (i = 0; i < RIAK_PIPELINE_DEPTH; ++i) {
+        if (client->pipe[i])
+            curl_easy_cleanup (client->pipe[i]);
+    }
+    if (client->multi)
+        curl_multi_cleanup (client->multi);
     curl_easy_cleanup (client->curl);
     g_free (client->host);
     g_free (client->port);
@@ -66,18 +84,11 @@ recv_object (void *contents, size_t size, size_t nmemb, void *userp)
     return realsize;
 }
 
-int
-seaf_riak_client_get (SeafRiakClient *client,
-                      const char *bucket,
-                      const char *key,
-                      void **value,
-                      int *size)
+static void
+setup_get (SeafRiakClient *client, CURL *curl,
+           const char *bucket, const char *key,
+           GString *url, RiakObject *object)
 {
-    CURL *curl = client->curl;
-    GString *url = g_string_new (NULL);
-    RiakObject *object = g_new0 (RiakObject, 1);
-    int rc, ret = 0;
-
     g_string_append_printf (url, "http://%s:%s/riak/%s/%s?r=1",
                             client->host, client->port, bucket, key);
     curl_easy_setopt (curl, CURLOPT_URL, url->str);
@@ -89,6 +100,21 @@ seaf_riak_client_get (SeafRiakClient *client,
 #ifdef RIAK_TEST
     curl_easy_setopt (curl, CURLOPT_VERBOSE, 1L);
 #endif
+}
+
+int
+seaf_riak_client_get (SeafRiakClient *client,
+                      const char *bucket,
+                      const char *key,
+                      void **value,
+                      int *size)
+{
+    CURL *curl = client->curl;
+    GString *url = g_string_new (NULL);
+    RiakObject *object = g_new0 (RiakObject, 1);
+    int rc, ret = 0;
+
+    setup_get (client, curl, bucket, key, url, object);
 
     rc = curl_easy_perform (curl);
     if (rc != 0) {
@@ -126,20 +152,11 @@ send_object (void *ptr, size_t size, size_t nmemb, void *userp)
     return copy_size;
 }
 
-int
-seaf_riak_client_put (SeafRiakClient *client,
-                      const char *bucket,
-                      const char *key,
-                      void *value,
-                      int size,
-                      int n_w)
+static void
+setup_put (SeafRiakClient *client, CURL *curl,
+           const char *bucket, const char *key, int n_w,
+           GString *url, RiakObject *object, struct curl_slist **headers)
 {
-    CURL *curl = client->curl;
-    GString *url = g_string_new (NULL);
-    RiakObject *object = g_new0 (RiakObject, 1);
-    int rc, ret = 0;
-    struct curl_slist *headers = NULL;
-
     g_string_append_printf (url, "http://%s:%s/riak/%s/%s",
                             client->host, client->port, bucket, key);
     switch (n_w) {
@@ -156,18 +173,36 @@ seaf_riak_client_put (SeafRiakClient *client,
     curl_easy_setopt (curl, CURLOPT_URL, url->str);
     /* Ask libcurl to send a PUT request. */
     curl_easy_setopt (curl, CURLOPT_UPLOAD, 1L);
+    curl_easy_setopt (curl, CURLOPT_INFILESIZE, (long)object->size);
     curl_easy_setopt (curl, CURLOPT_FAILONERROR, 1L);
 #ifdef RIAK_TEST
     curl_easy_setopt (curl, CURLOPT_VERBOSE, 1L);
 #endif
 
-    headers = curl_slist_append (headers, "Content-type: application/binary");
-    curl_easy_setopt (curl, CURLOPT_HTTPHEADER, headers);
+    *headers = curl_slist_append (*headers, "Content-type: application/binary");
+    curl_easy_setopt (curl, CURLOPT_HTTPHEADER, *headers);
 
-    object->data = value;
-    object->size = (size_t)size;
     curl_easy_setopt (curl, CURLOPT_READFUNCTION, send_object);
     curl_easy_setopt (curl, CURLOPT_READDATA, object);
+}
+
+int
+seaf_riak_client_put (SeafRiakClient *client,
+                      const char *bucket,
+                      const char *key,
+                      void *value,
+                      int size,
+                      int n_w)
+{
+    CURL *curl = client->curl;
+    GString *url = g_string_new (NULL);
+    RiakObject *object = g_new0 (RiakObject, 1);
+    int rc, ret = 0;
+    struct curl_slist *headers = NULL;
+
+    object->data = value;
+    object->size = (size_t)size;
+    setup_put (client, curl, bucket, key, n_w, url, object, &headers);
 
     rc = curl_easy_perform (curl);
     if (rc != 0) {
@@ -184,6 +219,217 @@ seaf_riak_client_put (SeafRiakClient *client,
     return ret;
 }
 
+typedef struct BulkRequest {
+    int idx;
+    GString *url;
+    RiakObject object;
+    struct curl_slist *headers;
+} BulkRequest;
+
+static CURLM *
+get_multi (SeafRiakClient *client)
+{
+    int i;
+
+    if (!client->multi) {
+        client->multi = curl_multi_init ();
+        curl_multi_setopt (client->multi, CURLMOPT_PIPELINING, 1L);
+        for (i = 0; i < RIAK_PIPELINE_DEPTH; ++i)
+            client->pipe[i] = curl_easy_init ();
+    }
+
+    return client->multi;
+}
+
+/*
+ * Run @n requests on the client's pipeline handles. @setup prepares
+ * request i on a handle, @done is called with its curl result.
+ */
+typedef void (*BulkSetupFunc) (SeafRiakClient *client, CURL *curl,
+                               BulkRequest *req, void *data);
+typedef void (*BulkDoneFunc) (BulkRequest *req, CURLcode rc, void *data);
+
+static void
+run_bulk (SeafRiakClient *client, int n,
+          BulkSetupFunc setup, BulkDoneFunc done, void *data)
+{
+    CURLM *multi = get_multi (client);
+    BulkRequest reqs[RIAK_PIPELINE_DEPTH];
+    CURLMsg *msg;
+    CURL *curl;
+    int next = 0, running = 0, still, msgs, maxfd, i;
+    long timeout;
+    fd_set rfds, wfds, efds;
+    struct timeval tv;
+
+    for (i = 0; i < RIAK_PIPELINE_DEPTH && next < n; ++i) {
+        memset (&reqs[i], 0, sizeof(BulkRequest));
+        reqs[i].idx = next++;
+        reqs[i].url = g_string_new (NULL);
+        setup (client, client->pipe[i], &reqs[i], data);
+        curl_easy_setopt (client->pipe[i], CURLOPT_PRIVATE, &reqs[i]);
+        curl_multi_add_handle (multi, client->pipe[i]);
+        ++running;
+    }
+
+    while (running > 0) {
+        curl_multi_perform (multi, &still);
+
+        while ((msg = curl_multi_info_read (multi, &msgs)) != NULL) {
+            BulkRequest *req;
+
+            if (msg->msg != CURLMSG_DONE)
+                continue;
+
+            curl = msg->easy_handle;
+            curl_easy_getinfo (curl, CURLINFO_PRIVATE, (char **)&req);
+            curl_multi_remove_handle (multi, curl);
+            --running;
+
+            done (req, msg->data.result, data);
+            curl_slist_free_all (req->headers);
+            g_string_free (req->url, TRUE);
+            curl_easy_reset (curl);
+
+            /* Reuse the handle, and its connection, for the next one. */
+            if (next < n) {
+                memset (req, 0, sizeof(BulkRequest));
+                req->idx = next++;
+                req->url = g_string_new (NULL);
+                setup (client, curl, req, data);
+                curl_easy_setopt (curl, CURLOPT_PRIVATE, req);
+                curl_multi_add_handle (multi, curl);
+                ++running;
+            }
+        }
+
+        if (running == 0)
+            break;
+
+        FD_ZERO (&rfds);
+        FD_ZERO (&wfds);
+        FD_ZERO (&efds);
+        maxfd = -1;
+        curl_multi_fdset (multi, &rfds, &wfds, &efds, &maxfd);
+        curl_multi_timeout (multi, &timeout);
+        if (timeout < 0 || timeout > 100)
+            timeout = 100;
+
+        tv.tv_sec = 0;
+        tv.tv_usec = timeout * 1000;
+        if (maxfd < 0)
+            select (0, NULL, NULL, NULL, &tv);
+        else
+            select (maxfd + 1, &rfds, &wfds, &efds, &tv);
+    }
+}
+
+typedef struct BulkData {
+    const char *bucket;
+    const char **keys;
+    void **values;
+    int *sizes;
+    int *results;
+    int n_w;
+} BulkData;
+
+static void
+bulk_get_setup (SeafRiakClient *client, CURL *curl,
+                BulkRequest *req, void *data)
+{
+    BulkData *bulk = data;
+
+    setup_get (client, curl, bulk->bucket, bulk->keys[req->idx],
+               req->url, &req->object);
+}
+
+static void
+bulk_get_done (BulkRequest *req, CURLcode rc, void *data)
+{
+    BulkData *bulk = data;
+
+    if (rc != 0) {
+        bulk->results[req->idx] = -1;
+        g_free (req->object.data);
+        return;
+    }
+
+    bulk->results[req->idx] = 0;
+    bulk->values[req->idx] = req->object.data;
+    bulk->sizes[req->idx] = (int)req->object.size;
+}
+
+void
+seaf_riak_client_get_many (SeafRiakClient *client,
+                           const char *bucket,
+                           const char **keys,
+                           int n,
+                           void **values,
+                           int *sizes,
+                           int *results)
+{
+    BulkData bulk;
+
+    memset (&bulk, 0, sizeof(bulk));
+    bulk.bucket = bucket;
+    bulk.keys = keys;
+    bulk.values = values;
+    bulk.sizes = sizes;
+    bulk.results = results;
+
+    run_bulk (client, n, bulk_get_setup, bulk_get_done, &bulk);
+}
+
+static void
+bulk_put_setup (SeafRiakClient *client, CURL *curl,
+                BulkRequest *req, void *data)
+{
+    BulkData *bulk = data;
+
+    req->object.data = bulk->values[req->idx];
+    req->object.size = (size_t)bulk->sizes[req->idx];
+    setup_put (client, curl, bulk->bucket, bulk->keys[req->idx], bulk->n_w,
+               req->url, &req->object, &req->headers);
+}
+
+static void
+bulk_put_done (BulkRequest *req, CURLcode rc, void *data)
+{
+    BulkData *bulk = data;
+
+    if (rc != 0) {
+        seaf_warning ("[riak http] Failed to put object [%s:%s]: %s.\n",
+                      bulk->bucket, bulk->keys[req->idx],
+                      curl_easy_strerror(rc));
+        bulk->results[req->idx] = -1;
+    } else {
+        bulk->results[req->idx] = 0;
+    }
+}
+
+void
+seaf_riak_client_put_many (SeafRiakClient *client,
+                           const char *bucket,
+                           const char **keys,
+                           int n,
+                           void **values,
+                           int *sizes,
+                           int n_w,
+                           int *results)
+{
+    BulkData bulk;
+
+    memset (&bulk, 0, sizeof(bulk));
+    bulk.bucket = bucket;
+    bulk.keys = keys;
+    bulk.values = values;
+    bulk.sizes = sizes;
+    bulk.results = results;
+    bulk.n_w = n_w;
+
+    run_bulk (client, n, bulk_put_setup, bulk_put_done, &bulk);
+}
+
 gboolean
 seaf_riak_client_query (SeafRiakClient *client,
                         const char *bucket,
@@ -18,6 +18,9 @@
 #ifdef SEAFILE_SERVER
 #include "monitor-rpc-wrappers.h"
 #include "web-accesstoken-mgr.h"
+#include "block-tx-server.h"
+#include "io-stats.h"
+#include "mem-stats.h"
 #endif
 
 #ifndef SEAFILE_SERVER
@@ -493,10 +496,16 @@ convert_http_task (HttpTxTask *task)
     if (task->type == HTTP_TASK_TYPE_DOWNLOAD) {
         g_object_set (t, "ttype", "download", NULL);
         if (task->runtime_state == HTTP_TASK_RT_STATE_BLOCK) {
+            char *current_file = http_tx_task_get_current_file (task);
+
             g_object_set (t, "block_total", task->n_files,
                           "block_done", task->done_files,
+                          "current_file", current_file,
+                          "dsize", task->done_bytes,
+                          "rsize", task->planned_bytes - task->done_bytes,
                           NULL);
             g_object_set (t, "rate", http_tx_task_get_rate(task), NULL);
+            g_free (current_file);
         }
     } else {
         g_object_set (t, "ttype", "upload", NULL);
@@ -508,6 +517,10 @@ convert_http_task (HttpTxTask *task)
         }
     }
 
+    char *stats = http_tx_task_stats_to_json (task);
+    g_object_set (t, "stats", stats, NULL);
+    g_free (stats);
+
     return t;
 }
 
@@ -844,6 +857,76 @@ seafile_get_path_sync_status (const char *repo_id,
     return status;
 }
 
+char *
+seafile_get_dir_sync_status (const char *repo_id,
+                             const char *dir,
+                             GError **error)
+{
+    char *canon_path = NULL;
+    int len;
+    char *ret;
+
+    if (!repo_id || !dir) {
+        g_set_error (error, SEAFILE_DOMAIN, SEAF_ERR_BAD_ARGS, "Argument should not be null");
+        return NULL;
+    }
+
+    while (*dir == '/')
+        ++dir;
+    canon_path = g_strdup(dir);
+    len = strlen(canon_path);
+    if (len > 0 && canon_path[len-1] == '/')
+        canon_path[len-1] = 0;
+
+    ret = seaf_sync_manager_get_dir_sync_status_json (seaf->sync_mgr,
+                                                      repo_id,
+                                                      canon_path);
+    g_free (canon_path);
+    return ret;
+}
+
+int
+seafile_get_sync_status_version (const char *repo_id, GError **error)
+{
+    if (!repo_id) {
+        g_set_error (error, SEAFILE_DOMAIN, SEAF_ERR_BAD_ARGS, "Argument should not be null");
+        return -1;
+    }
+
+    return seaf_sync_manager_get_sync_status_version (seaf->sync_mgr, repo_id);
+}
+
+char *
+seafile_get_wt_monitor_stats (GError **error)
+{
+    GList *ptr, *repos;
+    SeafRepo *repo;
+    WTStatus *status;
+    GString *buf;
+    gboolean first = TRUE;
+
+    repos = seaf_repo_manager_get_repo_list (seaf->repo_mgr, -1, -1);
+    buf = g_string_new ("{");
+
+    for (ptr = repos; ptr; ptr = ptr->next) {
+        repo = ptr->data;
+        status = seaf_wt_monitor_get_worktree_status (seaf->wt_monitor, repo->id);
+        if (!status)
+            continue;
+        g_string_append_printf (buf, "%s\"%s\": {\"overflows\": %"G_GINT64_FORMAT", "
+                                "\"queued_events\": %u}",
+                                first ? "" : ", ", repo->id,
+                                wt_status_get_overflows (status),
+                                wt_status_get_queue_length (status));
+        first = FALSE;
+        wt_status_unref (status);
+    }
+    g_string_append (buf, "}");
+
+    g_list_free (repos);
+    return g_string_free (buf, FALSE);
+}
+
 #endif  /* not define SEAFILE_SERVER */
 
 /*
@@ -973,6 +1056,45 @@ seafile_get_repo_list (int start, int limit, GError **error)
 }
 
 #ifdef SEAFILE_SERVER
+static gboolean
+check_page_args (const char *after_repo_id, int limit, GError **error)
+{
+    if (after_repo_id && after_repo_id[0] != '\0' &&
+        !is_uuid_valid (after_repo_id)) {
+        g_set_error (error, SEAFILE_DOMAIN, SEAF_ERR_BAD_ARGS, "Invalid repo id");
+        return FALSE;
+    }
+    if (limit <= 0) {
+        g_set_error (error, SEAFILE_DOMAIN, SEAF_ERR_BAD_ARGS, "Invalid limit");
+        return FALSE;
+    }
+    return TRUE;
+}
+
+GList *
+seafile_get_repo_list_after (const char *after_repo_id, int limit,
+                             GError **error)
+{
+    if (!check_page_args (after_repo_id, limit, error))
+        return NULL;
+
+    return seaf_repo_manager_get_repo_list_after (seaf->repo_mgr,
+                                                  after_repo_id, limit,
+                                                  error);
+}
+
+GList *
+seafile_get_trash_repo_list_after (const char *after_repo_id, int limit,
+                                   GError **error)
+{
+    if (!check_page_args (after_repo_id, limit, error))
+        return NULL;
+
+    return seaf_repo_manager_get_trash_repo_list_after (seaf->repo_mgr,
+                                                        after_repo_id, limit,
+                                                        error);
+}
+
 gint64
 seafile_count_repos (GError **error)
 {
@@ -1337,6 +1459,26 @@ seafile_set_repo_token (const char *repo_id,
     return 0;
 }
 
+int
+seafile_prioritize_download (const char *repo_id,
+                             const char *path,
+                             GError **error)
+{
+    if (repo_id == NULL || path == NULL) {
+        g_set_error (error, SEAFILE_DOMAIN, SEAF_ERR_BAD_ARGS, "Arguments should not be empty");
+        return -1;
+    }
+
+    if (!is_uuid_valid (repo_id)) {
+        g_set_error (error, SEAFILE_DOMAIN, SEAF_ERR_BAD_ARGS, "Invalid repo id");
+        return -1;
+    }
+
+    http_tx_manager_prioritize_path (seaf->http_tx_mgr, repo_id, path);
+
+    return 0;
+}
+
 #endif
 
 int
@@ -3364,6 +3506,60 @@ seafile_list_dir (const char *repo_id,
     return res;
 }
 
+GList *
+seafile_list_dir_page (const char *repo_id,
+                       const char *dir_id, int offset, int limit,
+                       GError **error)
+{
+    SeafRepo *repo;
+    SeafDirent *dent;
+    SeafileDirent *d;
+    GList *dirents, *ptr;
+    GList *res = NULL;
+    GError *tmp_error = NULL;
+
+    if (!repo_id || !is_uuid_valid(repo_id) || dir_id == NULL) {
+        g_set_error (error, SEAFILE_DOMAIN, SEAF_ERR_BAD_DIR_ID, "Bad dir id");
+        return NULL;
+    }
+
+    repo = seaf_repo_manager_get_repo (seaf->repo_mgr, repo_id);
+    if (!repo) {
+        g_set_error (error, SEAFILE_DOMAIN, SEAF_ERR_BAD_ARGS, "Bad repo id");
+        return NULL;
+    }
+
+    dirents = seaf_fs_manager_list_dirents (seaf->fs_mgr,
+                                            repo->store_id, repo->version,
+                                            dir_id, offset,
+                                            limit > 0 ? limit : -1,
+                                            NULL, &tmp_error);
+    if (tmp_error) {
+        g_set_error (error, SEAFILE_DOMAIN, SEAF_ERR_BAD_DIR_ID, "Bad dir id");
+        g_clear_error (&tmp_error);
+        seaf_repo_unref (repo);
+        return NULL;
+    }
+
+    for (ptr = dirents; ptr; ptr = ptr->next) {
+        dent = ptr->data;
+        d = g_object_new (SEAFILE_TYPE_DIRENT,
+                          "obj_id", dent->id,
+                          "obj_name", dent->name,
+                          "mode", dent->mode,
+                          "version", dent->version,
+                          "mtime", dent->mtime,
+                          "size", dent->size,
+                          "permission", "",
+                          NULL);
+        res = g_list_prepend (res, d);
+    }
+
+    g_list_free_full (dirents, (GDestroyNotify)seaf_dirent_free);
+    seaf_repo_unref (repo);
+    return g_list_reverse (res);
+}
+
 GList *
 seafile_list_file_revisions (const char *repo_id,
                              const char *path,
@@ -3653,6 +3849,25 @@ seafile_list_dir_with_perm (const char *repo_id,
                                                  error);
 }
 
+GList *
+seafile_list_dir_page_with_perm (const char *repo_id,
+                                 const char *path,
+                                 const char *dir_id,
+                                 const char *user,
+                                 int offset,
+                                 int limit,
+                                 GError **error)
+{
+    return seaf_repo_manager_list_dir_page_with_perm (seaf->repo_mgr,
+                                                      repo_id,
+                                                      path,
+                                                      dir_id,
+                                                      user,
+                                                      offset,
+                                                      limit,
+                                                      error);
+}
+
 int
 seafile_set_share_permission (const char *repo_id,
                               const char *from_email,
@@ -3854,6 +4069,306 @@ seafile_get_system_default_repo_id (GError **error)
     return get_system_default_repo_id(seaf);
 }
 
+/* Stats of the parsed fs object caches */
+
+static void
+append_cache_stats (GString *buf, const char *name, ObjCacheStats *st)
+{
+    g_string_append_printf (buf, "\"%s\": {\"hits\": %"G_GUINT64_FORMAT", "
+                            "\"misses\": %"G_GUINT64_FORMAT", "
+                            "\"evictions\": %"G_GUINT64_FORMAT", "
+                            "\"entries\": %"G_GUINT64_FORMAT", "
+                            "\"bytes\": %"G_GUINT64_FORMAT", "
+                            "\"max_bytes\": %"G_GUINT64_FORMAT"}",
+                            name, st->hits, st->misses, st->evictions,
+                            st->entries, st->bytes, st->max_bytes);
+}
+
+char *
+seafile_get_fs_cache_stats (GError **error)
+{
+    ObjCacheStats dir_stats, file_stats;
+    GString *buf;
+
+    seaf_fs_manager_get_cache_stats (seaf->fs_mgr, &dir_stats, &file_stats);
+
+    buf = g_string_new ("{");
+    append_cache_stats (buf, "dirs", &dir_stats);
+    g_string_append (buf, ", ");
+    append_cache_stats (buf, "files", &file_stats);
+    g_string_append (buf, "}");
+
+    return g_string_free (buf, FALSE);
+}
+
+char *
+seafile_get_block_cache_stats (GError **error)
+{
+    BlockCacheStats st;
+    double hit_ratio;
+
+    if (seaf_block_manager_get_cache_stats (seaf->block_mgr, &st) < 0) {
+        g_set_error (error, SEAFILE_DOMAIN, SEAF_ERR_GENERAL,
+                     "Block cache is not enabled");
+        return NULL;
+    }
+
+    hit_ratio = (st.hits + st.misses) ? (double)st.hits / (st.hits + st.misses) : 0;
+
+    return g_strdup_printf ("{\"hits\": %"G_GUINT64_FORMAT", "
+                            "\"misses\": %"G_GUINT64_FORMAT", "
+                            "\"hit_ratio\": %.4f, "
+                            "\"evictions\": %"G_GUINT64_FORMAT", "
+                            "\"entries\": %"G_GUINT64_FORMAT", "
+                            "\"bytes\": %"G_GUINT64_FORMAT", "
+                            "\"max_bytes\": %"G_GUINT64_FORMAT", "
+                            "\"cache_bytes_served\": %"G_GUINT64_FORMAT", "
+                            "\"primary_bytes_served\": %"G_GUINT64_FORMAT"}",
+                            st.hits, st.misses, hit_ratio, st.evictions,
+                            st.entries, st.bytes, st.max_bytes,
+                            st.cache_bytes, st.primary_bytes);
+}
+
+char *
+seafile_get_io_stats (GError **error)
+{
+    return io_stats_to_json ();
+}
+
+char *
+seafile_get_memory_stats (GError **error)
+{
+    return mem_stats_to_json ();
+}
+
+char *
+seafile_get_db_query_stats (GError **error)
+{
+    return seaf_db_get_query_stats (seaf->db);
+}
+
+/* Live load of the server */
+
+static double
+hit_ratio (guint64 hits, guint64 misses)
+{
+    return (hits + misses) ? (double)hits / (hits + misses) : 0;
+}
+
+static void
+append_pool_stats (GString *buf, const char *name,
+                   CcnetJobManager *mgr, int max_threads)
+{
+    g_string_append_printf (buf, "\"%s\": {\"queued\": %u, "
+                            "\"threads\": %u, \"max_threads\": %d}",
+                            name,
+                            g_thread_pool_unprocessed (mgr->thread_pool),
+                            g_thread_pool_get_num_threads (mgr->thread_pool),
+                            max_threads);
+}
+
+char *
+seafile_get_server_metrics (GError **error)
+{
+    GString *buf;
+    SeafDBPoolStats db;
+    ObjCacheStats dirs, files;
+    BlockCacheStats blocks;
+    BlockDedupStats dedup;
+    ObjStoreAsyncStats obj_async;
+    SizeSchedulerStats size;
+    BranchUpdateStats updates;
+    BlockTxServerStats block_tx;
+    RpcBatchStats batch;
+    BgJobStats bg;
+    ClusterStats cluster;
+    HistoryPrunerStats pruner;
+    char *io_json;
+    int n_queued, n_running, i;
+
+    buf = g_string_new ("{");
+
+    append_pool_stats (buf, "sync_pool", seaf->job_mgr,
+                       seaf->sync_thread_pool_size);
+    g_string_append (buf, ", ");
+    append_pool_stats (buf, "rpc_pool", seaf->session->job_mgr,
+                       seaf->rpc_thread_pool_size);
+
+    seaf_http_server_get_job_stats (seaf->http_server, &n_queued, &n_running);
+    g_string_append_printf (buf, ", \"http_jobs\": {\"queued\": %d, "
+                            "\"threads\": %d, \"max_threads\": %d}",
+                            n_queued, n_running,
+                            seaf->http_server->blocking_threads);
+
+    seaf_db_get_pool_stats (seaf->db, &db);
+    g_string_append_printf (buf, ", \"db_pool\": {\"active\": %d, "
+                            "\"size\": %d, \"max\": %d, \"waiting\": %d, "
+                            "\"replicas\": %d}",
+                            db.active, db.size, db.max, db.waiting,
+                            db.n_replicas);
+
+    seaf_fs_manager_get_cache_stats (seaf->fs_mgr, &dirs, &files);
+    g_string_append_printf (buf, ", \"cache_hit_ratio\": {\"dirs\": %.4f, "
+                            "\"files\": %.4f",
+                            hit_ratio (dirs.hits, dirs.misses),
+                            hit_ratio (files.hits, files.misses));
+    if (seaf_block_manager_get_cache_stats (seaf->block_mgr, &blocks) == 0)
+        g_string_append_printf (buf, ", \"blocks\": %.4f",
+                                hit_ratio (blocks.hits, blocks.misses));
+    g_string_append (buf, "}");
+
+    if (seaf_block_manager_get_dedup_stats (seaf->block_mgr, &dedup) == 0)
+        g_string_append_printf (buf, ", \"block_dedup\": {"
+                                "\"linked_blocks\": %"G_GUINT64_FORMAT", "
+                                "\"saved_bytes\": %"G_GUINT64_FORMAT"}",
+                                dedup.linked_blocks, dedup.linked_bytes);
+
+    if (seaf_obj_store_get_async_stats (seaf->fs_mgr->obj_store,
+                                        &obj_async) == 0)
+        g_string_append_printf (buf, ", \"fs_obj_async\": {\"threads\": %d, "
+                                "\"queued_reads\": %d, \"queued_writes\": %d, "
+                                "\"queued_stats\": %d}",
+                                obj_async.n_threads, obj_async.n_queued_reads,
+                                obj_async.n_queued_writes,
+                                obj_async.n_queued_stats);
+
+    size_scheduler_get_stats (seaf->size_sched, &size);
+    g_string_append_printf (buf, ", \"size_sched\": {\"queued\": %d, "
+                            "\"running\": %d}",
+                            size.n_urgent + size.n_queued, size.n_running);
+
+    seaf_repo_manager_get_merge_stats (&n_queued, &n_running);
+    g_string_append_printf (buf, ", \"virtual_repo_merges\": {\"queued\": %d, "
+                            "\"running\": %d}",
+                            n_queued, n_running);
+
+    seaf_http_server_get_update_stats (seaf->http_server, &updates);
+    g_string_append_printf (buf, ", \"branch_updates\": {\"updates\": %"G_GINT64_FORMAT", "
+                            "\"merges\": %"G_GINT64_FORMAT", "
+                            "\"retries\": %"G_GINT64_FORMAT"}",
+                            updates.updates, updates.merges, updates.retries);
+
+    block_tx_server_get_stats (&block_tx);
+    g_string_append_printf (buf, ", \"block_tx\": {\"connections\": %d, "
+                            "\"queued\": %d, \"threads\": %d}",
+                            block_tx.n_conns, block_tx.n_queued,
+                            block_tx.n_threads);
+
+    rpc_batch_get_stats (seaf->rpc_batch, &batch);
+    g_string_append_printf (buf, ", \"rpc_batch\": {\"queued\": %d, "
+                            "\"threads\": %d, \"max_threads\": %d, "
+                            "\"batches\": %"G_GINT64_FORMAT", "
+                            "\"calls\": %"G_GINT64_FORMAT", "
+                            "\"avg_queue_wait_usec\": %"G_GINT64_FORMAT", "
+                            "\"max_queue_wait_usec\": %"G_GINT64_FORMAT"}",
+                            batch.n_queued, batch.n_running,
+                            seaf->rpc_batch->n_threads,
+                            batch.n_batches, batch.n_calls,
+                            batch.n_calls ? batch.total_wait_usec / batch.n_calls : 0,
+                            batch.max_wait_usec);
+
+    io_json = io_scheduler_stats_to_json (seaf->io_sched);
+    if (io_json) {
+        g_string_append_printf (buf, ", \"io_scheduler\": %s", io_json);
+        free (io_json);
+    }
+
+    g_string_append (buf, ", \"bg_jobs\": {");
+    for (i = 0; i < N_BG_JOB_CATEGORIES; ++i) {
+        bg_job_manager_get_stats (seaf->bg_job_mgr, i, &bg);
+        g_string_append_printf (buf, "%s\"%s\": {\"queued\": %d, "
+                                "\"running\": %d, \"limit\": %d, "
+                                "\"finished\": %"G_GINT64_FORMAT", "
+                                "\"cancelled\": %"G_GINT64_FORMAT", "
+                                "\"avg_queue_wait_usec\": %"G_GINT64_FORMAT", "
+                                "\"max_queue_wait_usec\": %"G_GINT64_FORMAT"}",
+                                i ? ", " : "", bg_job_category_name (i),
+                                bg.n_queued, bg.n_running, bg.limit,
+                                bg.n_finished, bg.n_cancelled,
+                                (bg.n_finished + bg.n_running) ?
+                                bg.total_wait_usec / (bg.n_finished + bg.n_running) : 0,
+                                bg.max_wait_usec);
+    }
+    g_string_append (buf, "}");
+
+    history_pruner_get_stats (seaf->history_pruner, &pruner);
+    g_string_append_printf (buf, ", \"history_pruner\": {\"running\": %s, "
+                            "\"passes\": %"G_GINT64_FORMAT", "
+                            "\"pruned_repos\": %"G_GINT64_FORMAT"}",
+                            pruner.running ? "true" : "false",
+                            pruner.n_passes, pruner.n_pruned);
+
+    if (seaf->cluster_mgr->enabled) {
+        seaf_cluster_manager_get_stats (seaf->cluster_mgr, &cluster);
+        g_string_append_printf (buf, ", \"cluster\": {\"node\": \"%s\", "
+                                "\"nodes\": %d, "
+                                "\"forwarded_updates\": %"G_GINT64_FORMAT", "
+                                "\"forward_errors\": %"G_GINT64_FORMAT"}",
+                                seaf->cluster_mgr->self->id, cluster.n_nodes,
+                                cluster.n_forwarded, cluster.n_forward_errors);
+    }
+
+    g_string_append (buf, "}");
+
+    return g_string_free (buf, FALSE);
+}
+
+char *
+seafile_batch_rpc (const char *calls, int parallel, GError **error)
+{
+    if (!calls) {
+        g_set_error (error, SEAFILE_DOMAIN, SEAF_ERR_BAD_ARGS, "Argument should not be null");
+        return NULL;
+    }
+
+    return rpc_batch_run (seaf->rpc_batch, calls, parallel, error);
+}
+
+char *
+seafile_get_repos_info_by_ids (const char *repo_ids, GError **error)
+{
+    json_t *ids, *infos;
+    json_error_t jerror;
+    GList *id_list = NULL;
+    const char *repo_id;
+    char *ret = NULL;
+    size_t i;
+
+    if (!repo_ids) {
+        g_set_error (error, SEAFILE_DOMAIN, SEAF_ERR_BAD_ARGS, "Argument should not be null");
+        return NULL;
+    }
+
+    ids = json_loads (repo_ids, 0, &jerror);
+    if (!ids || !json_is_array (ids)) {
+        g_set_error (error, SEAFILE_DOMAIN, SEAF_ERR_BAD_ARGS,
+                     "Repo ids should be a JSON list");
+        goto out;
+    }
+
+    for (i = 0; i < json_array_size (ids); ++i) {
+        repo_id = json_string_value (json_array_get (ids, i));
+        if (!repo_id || !is_uuid_valid (repo_id)) {
+            g_set_error (error, SEAFILE_DOMAIN, SEAF_ERR_BAD_ARGS, "Invalid repo id");
+            goto out;
+        }
+        id_list = g_list_prepend (id_list, (char *)repo_id);
+    }
+
+    infos = seaf_repo_manager_get_repo_summaries (seaf->repo_mgr, id_list);
+    if (!infos) {
+        g_set_error (error, SEAFILE_DOMAIN, SEAF_ERR_GENERAL, "Database error");
+        goto out;
+    }
+    ret = json_dumps (infos, JSON_COMPACT);
+    json_decref (infos);
+
+out:
+    g_list_free (id_list);
+    json_decref (ids);
+    return ret;
+}
+
 static int
 update_valid_since_time (SeafRepo *repo, gint64 new_time)
 {
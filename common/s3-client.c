@@ -0,0 +1,841 @@
+/* -*- Mode: C; tab-width: 4; indent-tabs-mode: nil; c-basic-offset: 4 -*- */
+
+#include "common.h"
+
+#ifdef S3_BACKEND
+
+#include <curl/curl.h>
+#include <openssl/hmac.h>
+#include <openssl/sha.h>
+#include <pthread.h>
+#include <sys/select.h>
+#include <time.h>
+
+#include "utils.h"
+#include "log.h"
+#include "s3-client.h"
+
+#define EMPTY_SHA256 \
+    "e3b0c44298fc1c149afbf4c8996fb92427ae41e4649b934ca495991b7852b855"
+
+struct SeafS3Client {
+    const SeafS3Config *conf;
+    CURL               *curl;
+    /* For concurrent requests. Also keeps their connections open. */
+    CURLM              *multi;
+};
+
+typedef struct S3Request {
+    CURL               *curl;
+    gboolean            own_curl;
+    struct curl_slist  *headers;
+    char               *url;
+
+    const char         *body;
+    size_t              body_len;
+    size_t              body_off;
+
+    GByteArray         *resp;
+    gint64              content_length;
+    char               *etag;
+
+    CURLcode            result;
+    long                status;
+} S3Request;
+
+static pthread_once_t curl_init_once = PTHREAD_ONCE_INIT;
+
+static void
+init_curl (void)
+{
+    curl_global_init (CURL_GLOBAL_ALL);
+}
+
+SeafS3Config *
+seaf_s3_config_load (GKeyFile *config, const char *group)
+{
+    SeafS3Config *conf = g_new0 (SeafS3Config, 1);
+    GError *error = NULL;
+
+    conf->bucket = g_key_file_get_string (config, group, "bucket", NULL);
+    conf->key_id = g_key_file_get_string (config, group, "key_id", NULL);
+    conf->key = g_key_file_get_string (config, group, "key", NULL);
+    if (!conf->bucket || !conf->key_id || !conf->key) {
+        seaf_warning ("[%s] needs bucket, key_id and key for S3.\n", group);
+        seaf_s3_config_free (conf);
+        return NULL;
+    }
+
+    conf->host = g_key_file_get_string (config, group, "host", NULL);
+    if (!conf->host)
+        conf->host = g_strdup ("s3.amazonaws.com");
+
+    conf->region = g_key_file_get_string (config, group, "aws_region", NULL);
+    if (!conf->region)
+        conf->region = g_strdup ("us-east-1");
+
+    conf->use_https = g_key_file_get_boolean (config, group, "use_https",
+                                              &error);
+    if (error) {
+        conf->use_https = TRUE;
+        g_clear_error (&error);
+    }
+
+    conf->path_style = g_key_file_get_boolean (config, group,
+                                               "path_style_request", NULL);
+
+    return conf;
+}
+
+void
+seaf_s3_config_free (SeafS3Config *conf)
+{
+    if (!conf)
+        return;
+
+    g_free (conf->host);
+    g_free (conf->bucket);
+    g_free (conf->key_id);
+    g_free (conf->key);
+    g_free (conf->region);
+    g_free (conf);
+}
+
+SeafS3Client *
+seaf_s3_client_new (const SeafS3Config *conf)
+{
+    SeafS3Client *client;
+
+    pthread_once (&curl_init_once, init_curl);
+
+    client = g_new0 (SeafS3Client, 1);
+    client->conf = conf;
+    client->curl = curl_easy_init ();
+    client->multi = curl_multi_init ();
+    if (!client->curl || !client->multi) {
+        seaf_warning ("Failed to init curl.\n");
+        seaf_s3_client_free (client);
+        return NULL;
+    }
+
+    return client;
+}
+
+void
+seaf_s3_client_free (SeafS3Client *client)
+{
+    if (!client)
+        return;
+
+    if (client->curl)
+        curl_easy_cleanup (client->curl);
+    if (client->multi)
+        curl_multi_cleanup (client->multi);
+    g_free (client);
+}
+
+/* Signing. */
+
+static void
+sha256_hex (const void *data, size_t len, char *hex)
+{
+    unsigned char md[SHA256_DIGEST_LENGTH];
+
+    SHA256 (data, len, md);
+    rawdata_to_hex (md, hex, SHA256_DIGEST_LENGTH);
+}
+
+/* @md may be the same buffer as @key. */
+static void
+hmac_sha256 (const void *key, int key_len, const char *data,
+             unsigned char *md)
+{
+    unsigned char out[SHA256_DIGEST_LENGTH];
+    unsigned int md_len;
+
+    HMAC (EVP_sha256(), key, key_len,
+          (const unsigned char *)data, strlen(data), out, &md_len);
+    memcpy (md, out, SHA256_DIGEST_LENGTH);
+}
+
+static void
+uri_encode (GString *out, const char *s, gboolean encode_slash)
+{
+    for (; *s; ++s) {
+        if (g_ascii_isalnum (*s) || *s == '-' || *s == '_' ||
+            *s == '.' || *s == '~' || (*s == '/' && !encode_slash))
+            g_string_append_c (out, *s);
+        else
+            g_string_append_printf (out, "%%%02X", (unsigned char)*s);
+    }
+}
+
+static char *
+sign_request (const SeafS3Config *conf, const char *method,
+              const char *host, const char *uri, const char *query,
+              const char *payload_hash, const char *copy_source,
+              const char *amz_date, const char *date)
+{
+    GString *creq = g_string_new (NULL);
+    const char *signed_headers;
+    char creq_hash[65];
+    char *scope, *to_sign, *secret, *auth;
+    unsigned char k[SHA256_DIGEST_LENGTH], sig[SHA256_DIGEST_LENGTH];
+    char sig_hex[65];
+
+    if (copy_source)
+        signed_headers = "host;x-amz-content-sha256;x-amz-copy-source;x-amz-date";
+    else
+        signed_headers = "host;x-amz-content-sha256;x-amz-date";
+
+    g_string_append_printf (creq, "%s\n%s\n%s\n", method, uri,
+                            query ? query : "");
+    g_string_append_printf (creq, "host:%s\n", host);
+    g_string_append_printf (creq, "x-amz-content-sha256:%s\n", payload_hash);
+    if (copy_source)
+        g_string_append_printf (creq, "x-amz-copy-source:%s\n", copy_source);
+    g_string_append_printf (creq, "x-amz-date:%s\n", amz_date);
+    g_string_append_printf (creq, "\n%s\n%s", signed_headers, payload_hash);
+
+    sha256_hex (creq->str, creq->len, creq_hash);
+    g_string_free (creq, TRUE);
+
+    scope = g_strdup_printf ("%s/%s/s3/aws4_request", date, conf->region);
+    to_sign = g_strdup_printf ("AWS4-HMAC-SHA256\n%s\n%s\n%s",
+                               amz_date, scope, creq_hash);
+
+    secret = g_strconcat ("AWS4", conf->key, NULL);
+    hmac_sha256 (secret, strlen(secret), date, k);
+    hmac_sha256 (k, sizeof(k), conf->region, k);
+    hmac_sha256 (k, sizeof(k), "s3", k);
+    hmac_sha256 (k, sizeof(k), "aws4_request", k);
+    hmac_sha256 (k, sizeof(k), to_sign, sig);
+    rawdata_to_hex (sig, sig_hex, sizeof(sig));
+
+    auth = g_strdup_printf ("Authorization: AWS4-HMAC-SHA256 "
+                            "Credential=%s/%s, SignedHeaders=%s, Signature=%s",
+                            conf->key_id, scope, signed_headers, sig_hex);
+
+    g_free (scope);
+    g_free (to_sign);
+    g_free (secret);
+    return auth;
+}
+
+/* Requests. */
+
+static size_t
+recv_body (void *ptr, size_t size, size_t nmemb, void *userp)
+{
+    S3Request *req = userp;
+
+    g_byte_array_append (req->resp, ptr, size * nmemb);
+    return size * nmemb;
+}
+
+static size_t
+recv_header (void *ptr, size_t size, size_t nmemb, void *userp)
+{
+    S3Request *req = userp;
+    size_t len = size * nmemb;
+    char *line = g_strndup (ptr, len);
+
+    g_strstrip (line);
+    if (g_ascii_strncasecmp (line, "ETag:", 5) == 0) {
+        g_free (req->etag);
+        req->etag = g_strdup (g_strstrip (line + 5));
+    } else if (g_ascii_strncasecmp (line, "Content-Length:", 15) == 0) {
+        req->content_length = g_ascii_strtoll (line + 15, NULL, 10);
+    }
+    g_free (line);
+
+    return len;
+}
+
+static size_t
+send_body (void *ptr, size_t size, size_t nmemb, void *userp)
+{
+    S3Request *req = userp;
+    size_t n = MIN (size * nmemb, req->body_len - req->body_off);
+
+    memcpy (ptr, req->body + req->body_off, n);
+    req->body_off += n;
+    return n;
+}
+
+/*
+ * Set up a signed request on @curl. @query must already be in canonical
+ * form: sorted by name, names and values URI encoded.
+ */
+static void
+s3_request_init (SeafS3Client *client, S3Request *req, CURL *curl,
+                 const char *method, const char *key, const char *query,
+                 const void *body, size_t body_len, const char *src_key)
+{
+    const SeafS3Config *conf = client->conf;
+    GString *uri = g_string_new (NULL);
+    GString *copy_source = NULL;
+    char *host, *auth, *header;
+    char payload_hash[65];
+    char amz_date[32], date[16];
+    time_t now = time (NULL);
+    struct tm tm;
+
+    memset (req, 0, sizeof(S3Request));
+    req->curl = curl;
+    req->body = body;
+    req->body_len = body_len;
+    req->resp = g_byte_array_new ();
+    req->content_length = -1;
+
+    gmtime_r (&now, &tm);
+    strftime (amz_date, sizeof(amz_date), "%Y%m%dT%H%M%SZ", &tm);
+    strftime (date, sizeof(date), "%Y%m%d", &tm);
+
+    if (conf->path_style) {
+        host = g_strdup (conf->host);
+        g_string_append_printf (uri, "/%s", conf->bucket);
+        if (key[0] != 0)
+            g_string_append_c (uri, '/');
+    } else {
+        host = g_strdup_printf ("%s.%s", conf->bucket, conf->host);
+        g_string_append_c (uri, '/');
+    }
+    uri_encode (uri, key, FALSE);
+
+    if (body_len > 0)
+        sha256_hex (body, body_len, payload_hash);
+    else
+        memcpy (payload_hash, EMPTY_SHA256, 65);
+
+    if (src_key) {
+        copy_source = g_string_new (NULL);
+        g_string_append_printf (copy_source, "/%s/", conf->bucket);
+        uri_encode (copy_source, src_key, FALSE);
+    }
+
+    auth = sign_request (conf, method, host, uri->str, query, payload_hash,
+                         copy_source ? copy_source->str : NULL,
+                         amz_date, date);
+
+    req->headers = curl_slist_append (req->headers, auth);
+    header = g_strdup_printf ("x-amz-date: %s", amz_date);
+    req->headers = curl_slist_append (req->headers, header);
+    g_free (header);
+    header = g_strdup_printf ("x-amz-content-sha256: %s", payload_hash);
+    req->headers = curl_slist_append (req->headers, header);
+    g_free (header);
+    if (copy_source) {
+        header = g_strdup_printf ("x-amz-copy-source: %s", copy_source->str);
+        req->headers = curl_slist_append (req->headers, header);
+        g_free (header);
+    }
+    /* Don't wait for "100 Continue" before sending the body. */
+    req->headers = curl_slist_append (req->headers, "Expect:");
+
+    req->url = g_strdup_printf ("%s://%s%s%s%s",
+                                conf->use_https ? "https" : "http",
+                                host, uri->str,
+                                query ? "?" : "", query ? query : "");
+
+    curl_easy_setopt (curl, CURLOPT_URL, req->url);
+    curl_easy_setopt (curl, CURLOPT_HTTPHEADER, req->headers);
+    curl_easy_setopt (curl, CURLOPT_NOSIGNAL, 1L);
+    curl_easy_setopt (curl, CURLOPT_CONNECTTIMEOUT, 30L);
+    /* Give up on connections stalled for a minute. */
+    curl_easy_setopt (curl, CURLOPT_LOW_SPEED_LIMIT, 1L);
+    curl_easy_setopt (curl, CURLOPT_LOW_SPEED_TIME, 60L);
+    curl_easy_setopt (curl, CURLOPT_WRITEFUNCTION, recv_body);
+    curl_easy_setopt (curl, CURLOPT_WRITEDATA, req);
+    curl_easy_setopt (curl, CURLOPT_HEADERFUNCTION, recv_header);
+    curl_easy_setopt (curl, CURLOPT_HEADERDATA, req);
+    curl_easy_setopt (curl, CURLOPT_PRIVATE, req);
+
+    if (strcmp (method, "HEAD") == 0) {
+        curl_easy_setopt (curl, CURLOPT_NOBODY, 1L);
+    } else if (strcmp (method, "PUT") == 0) {
+        curl_easy_setopt (curl, CURLOPT_UPLOAD, 1L);
+        curl_easy_setopt (curl, CURLOPT_READFUNCTION, send_body);
+        curl_easy_setopt (curl, CURLOPT_READDATA, req);
+        curl_easy_setopt (curl, CURLOPT_INFILESIZE_LARGE, (curl_off_t)body_len);
+    } else if (strcmp (method, "POST") == 0) {
+        curl_easy_setopt (curl, CURLOPT_POST, 1L);
+        curl_easy_setopt (curl, CURLOPT_POSTFIELDS, body ? body : "");
+        curl_easy_setopt (curl, CURLOPT_POSTFIELDSIZE, (long)body_len);
+    } else if (strcmp (method, "DELETE") == 0) {
+        curl_easy_setopt (curl, CURLOPT_CUSTOMREQUEST, "DELETE");
+    }
+
+    g_free (host);
+    g_free (auth);
+    g_string_free (uri, TRUE);
+    if (copy_source)
+        g_string_free (copy_source, TRUE);
+}
+
+static void
+s3_request_cleanup (S3Request *req)
+{
+    curl_slist_free_all (req->headers);
+    g_free (req->url);
+    if (req->resp)
+        g_byte_array_free (req->resp, TRUE);
+    g_free (req->etag);
+    if (req->own_curl)
+        curl_easy_cleanup (req->curl);
+}
+
+/* NUL-terminated response body. */
+static const char *
+resp_str (S3Request *req)
+{
+    g_byte_array_append (req->resp, (const guint8 *)"", 1);
+    g_byte_array_set_size (req->resp, req->resp->len - 1);
+    return (const char *)req->resp->data;
+}
+
+static void
+warn_failed (S3Request *req, const char *what, const char *key)
+{
+    if (req->result != CURLE_OK)
+        seaf_warning ("S3 %s %s failed: %s.\n", what, key,
+                      curl_easy_strerror (req->result));
+    else
+        seaf_warning ("S3 %s %s failed with status %ld: %.200s\n",
+                      what, key, req->status, resp_str (req));
+}
+
+/* Run one request on the client's own handle, reusing its connection. */
+static void
+s3_do (SeafS3Client *client, S3Request *req,
+       const char *method, const char *key, const char *query,
+       const void *body, size_t body_len, const char *src_key)
+{
+    curl_easy_reset (client->curl);
+    s3_request_init (client, req, client->curl, method, key, query,
+                     body, body_len, src_key);
+
+    req->result = curl_easy_perform (client->curl);
+    if (req->result == CURLE_OK)
+        curl_easy_getinfo (client->curl, CURLINFO_RESPONSE_CODE, &req->status);
+}
+
+/* Run @n requests, at most @max_parallel at a time. */
+static void
+s3_do_many (SeafS3Client *client, S3Request **reqs, int n, int max_parallel)
+{
+    CURLM *multi = client->multi;
+    CURLMsg *msg;
+    S3Request *req;
+    int next = 0, running = 0, still, msgs, maxfd;
+    long timeout;
+    fd_set rfds, wfds, efds;
+    struct timeval tv;
+
+    while (next < n && running < max_parallel) {
+        curl_multi_add_handle (multi, reqs[next++]->curl);
+        ++running;
+    }
+
+    while (running > 0) {
+        curl_multi_perform (multi, &still);
+
+        while ((msg = curl_multi_info_read (multi, &msgs)) != NULL) {
+            if (msg->msg != CURLMSG_DONE)
+                continue;
+
+            curl_easy_getinfo (msg->easy_handle, CURLINFO_PRIVATE,
+                               (char **)&req);
+            req->result = msg->data.result;
+            if (req->result == CURLE_OK)
+                curl_easy_getinfo (msg->easy_handle, CURLINFO_RESPONSE_CODE,
+                                   &req->status);
+            curl_multi_remove_handle (multi, msg->easy_handle);
+            --running;
+
+            if (next < n) {
+                curl_multi_add_handle (multi, reqs[next++]->curl);
+                ++running;
+            }
+        }
+
+        if (running == 0)
+            break;
+
+        FD_ZERO (&rfds);
+        FD_ZERO (&wfds);
+        FD_ZERO (&efds);
+        maxfd = -1;
+        curl_multi_fdset (multi, &rfds, &wfds, &efds, &maxfd);
+        curl_multi_timeout (multi, &timeout);
+        if (timeout < 0 || timeout > 100)
+            timeout = 100;
+
+        tv.tv_sec = 0;
+        tv.tv_usec = timeout * 1000;
+        if (maxfd < 0)
+            /* Nothing to wait on yet, e.g. while resolving. */
+            select (0, NULL, NULL, NULL, &tv);
+        else
+            select (maxfd + 1, &rfds, &wfds, &efds, &tv);
+    }
+}
+
+static S3Request *
+s3_request_new_multi (SeafS3Client *client,
+                      const char *method, const char *key, const char *query,
+                      const void *body, size_t body_len)
+{
+    S3Request *req = g_new0 (S3Request, 1);
+
+    s3_request_init (client, req, curl_easy_init (), method, key, query,
+                     body, body_len, NULL);
+    req->own_curl = TRUE;
+
+    return req;
+}
+
+/* The text of the first <tag>...</tag> after @start. */
+static char *
+xml_get_value (const char *start, const char *tag, const char **end)
+{
+    char *open = g_strdup_printf ("<%s>", tag);
+    char *close = g_strdup_printf ("</%s>", tag);
+    const char *p, *q;
+    char *ret = NULL;
+
+    p = strstr (start, open);
+    if (p) {
+        p += strlen (open);
+        q = strstr (p, close);
+        if (q) {
+            ret = g_strndup (p, q - p);
+            if (end)
+                *end = q + strlen (close);
+        }
+    }
+
+    g_free (open);
+    g_free (close);
+    return ret;
+}
+
+/* Operations. */
+
+int
+seaf_s3_client_get (SeafS3Client *client, const char *key,
+                    void **data, int *len)
+{
+    S3Request req;
+    int ret = -1;
+
+    s3_do (client, &req, "GET", key, NULL, NULL, 0, NULL);
+    if (req.result != CURLE_OK || req.status != 200) {
+        if (req.status != 404)
+            warn_failed (&req, "get", key);
+        goto out;
+    }
+
+    /* Never hand out NULL, even for an empty object. */
+    resp_str (&req);
+    *len = req.resp->len;
+    *data = g_byte_array_free (req.resp, FALSE);
+    req.resp = NULL;
+    ret = 0;
+
+out:
+    s3_request_cleanup (&req);
+    return ret;
+}
+
+int
+seaf_s3_client_put (SeafS3Client *client, const char *key,
+                    const void *data, int len)
+{
+    S3Request req;
+    int ret = 0;
+
+    s3_do (client, &req, "PUT", key, NULL, data, len, NULL);
+    if (req.result != CURLE_OK || req.status != 200) {
+        warn_failed (&req, "put", key);
+        ret = -1;
+    }
+
+    s3_request_cleanup (&req);
+    return ret;
+}
+
+static void
+abort_multipart (SeafS3Client *client, const char *key, const char *query)
+{
+    S3Request req;
+
+    s3_do (client, &req, "DELETE", key, query, NULL, 0, NULL);
+    if (req.result != CURLE_OK || req.status / 100 != 2)
+        warn_failed (&req, "abort upload", key);
+    s3_request_cleanup (&req);
+}
+
+int
+seaf_s3_client_put_multipart (SeafS3Client *client, const char *key,
+                              const void *data, gint64 len,
+                              gint64 part_size, int max_parallel)
+{
+    S3Request req;
+    S3Request **parts = NULL;
+    char *upload_id = NULL;
+    GString *id_query = NULL, *body = NULL;
+    char *query;
+    gint64 off, n;
+    int n_parts, i;
+    int ret = -1;
+
+    s3_do (client, &req, "POST", key, "uploads=", NULL, 0, NULL);
+    if (req.result == CURLE_OK && req.status == 200)
+        upload_id = xml_get_value (resp_str (&req), "UploadId", NULL);
+    if (!upload_id)
+        warn_failed (&req, "start upload", key);
+    s3_request_cleanup (&req);
+    if (!upload_id)
+        return -1;
+
+    id_query = g_string_new ("uploadId=");
+    uri_encode (id_query, upload_id, TRUE);
+
+    n_parts = (len + part_size - 1) / part_size;
+    parts = g_new0 (S3Request *, n_parts);
+    for (i = 0, off = 0; i < n_parts; ++i, off += part_size) {
+        n = MIN (part_size, len - off);
+        query = g_strdup_printf ("partNumber=%d&%s", i + 1, id_query->str);
+        parts[i] = s3_request_new_multi (client, "PUT", key, query,
+                                         (const char *)data + off, n);
+        g_free (query);
+    }
+
+    s3_do_many (client, parts, n_parts, max_parallel);
+
+    body = g_string_new ("<CompleteMultipartUpload>");
+    for (i = 0; i < n_parts; ++i) {
+        if (parts[i]->result != CURLE_OK || parts[i]->status != 200 ||
+            !parts[i]->etag) {
+            warn_failed (parts[i], "upload part of", key);
+            abort_multipart (client, key, id_query->str);
+            goto out;
+        }
+        g_string_append_printf (body,
+                                "<Part><PartNumber>%d</PartNumber>"
+                                "<ETag>%s</ETag></Part>",
+                                i + 1, parts[i]->etag);
+    }
+    g_string_append (body, "</CompleteMultipartUpload>");
+
+    s3_do (client, &req, "POST", key, id_query->str,
+           body->str, body->len, NULL);
+    /* Errors may come with status 200, in the body. */
+    if (req.result != CURLE_OK || req.status != 200 ||
+        strstr (resp_str (&req), "<Error>") != NULL) {
+        warn_failed (&req, "complete upload", key);
+        abort_multipart (client, key, id_query->str);
+    } else {
+        ret = 0;
+    }
+    s3_request_cleanup (&req);
+
+out:
+    for (i = 0; i < n_parts; ++i) {
+        s3_request_cleanup (parts[i]);
+        g_free (parts[i]);
+    }
+    g_free (parts);
+    if (body)
+        g_string_free (body, TRUE);
+    g_string_free (id_query, TRUE);
+    g_free (upload_id);
+    return ret;
+}
+
+int
+seaf_s3_client_head (SeafS3Client *client, const char *key, gint64 *size)
+{
+    S3Request req;
+    int ret;
+
+    s3_do (client, &req, "HEAD", key, NULL, NULL, 0, NULL);
+    if (req.result == CURLE_OK && req.status == 200) {
+        if (size)
+            *size = req.content_length;
+        ret = 1;
+    } else if (req.result == CURLE_OK && req.status == 404) {
+        ret = 0;
+    } else {
+        warn_failed (&req, "head", key);
+        ret = -1;
+    }
+
+    s3_request_cleanup (&req);
+    return ret;
+}
+
+#define MAX_PARALLEL_HEADS 16
+
+int
+seaf_s3_client_head_many (SeafS3Client *client, const char **keys, int n,
+                          gboolean *exists)
+{
+    S3Request **reqs;
+    int i, ret = 0;
+
+    if (n == 0)
+        return 0;
+
+    reqs = g_new0 (S3Request *, n);
+    for (i = 0; i < n; ++i)
+        reqs[i] = s3_request_new_multi (client, "HEAD", keys[i], NULL, NULL, 0);
+
+    s3_do_many (client, reqs, n, MAX_PARALLEL_HEADS);
+
+    for (i = 0; i < n; ++i) {
+        if (reqs[i]->result == CURLE_OK && reqs[i]->status == 200) {
+            exists[i] = TRUE;
+        } else if (reqs[i]->result == CURLE_OK && reqs[i]->status == 404) {
+            exists[i] = FALSE;
+        } else {
+            warn_failed (reqs[i], "head", keys[i]);
+            exists[i] = FALSE;
+            ret = -1;
+        }
+        s3_request_cleanup (reqs[i]);
+        g_free (reqs[i]);
+    }
+    g_free (reqs);
+
+    return ret;
+}
+
+#define MAX_PARALLEL_GETS 16
+
+int
+seaf_s3_client_get_many (SeafS3Client *client, const char **keys, int n,
+                         void **data, int *lens)
+{
+    S3Request **reqs;
+    int i, ret = 0;
+
+    if (n == 0)
+        return 0;
+
+    reqs = g_new0 (S3Request *, n);
+    for (i = 0; i < n; ++i)
+        reqs[i] = s3_request_new_multi (client, "GET", keys[i], NULL, NULL, 0);
+
+    s3_do_many (client, reqs, n, MAX_PARALLEL_GETS);
+
+    for (i = 0; i < n; ++i) {
+        if (reqs[i]->result == CURLE_OK && reqs[i]->status == 200) {
+            resp_str (reqs[i]);
+            lens[i] = reqs[i]->resp->len;
+            data[i] = g_byte_array_free (reqs[i]->resp, FALSE);
+            reqs[i]->resp = NULL;
+        } else {
+            if (reqs[i]->status != 404)
+                warn_failed (reqs[i], "get", keys[i]);
+            data[i] = NULL;
+            lens[i] = 0;
+            ret = -1;
+        }
+        s3_request_cleanup (reqs[i]);
+        g_free (reqs[i]);
+    }
+    g_free (reqs);
+
+    return ret;
+}
+
+int
+seaf_s3_client_delete (SeafS3Client *client, const char *key)
+{
+    S3Request req;
+    int ret = 0;
+
+    s3_do (client, &req, "DELETE", key, NULL, NULL, 0, NULL);
+    if (req.result != CURLE_OK ||
+        (req.status / 100 != 2 && req.status != 404)) {
+        warn_failed (&req, "delete", key);
+        ret = -1;
+    }
+
+    s3_request_cleanup (&req);
+    return ret;
+}
+
+int
+seaf_s3_client_copy (SeafS3Client *client, const char *src_key,
+                     const char *dst_key)
+{
+    S3Request req;
+    int ret = 0;
+
+    s3_do (client, &req, "PUT", dst_key, NULL, NULL, 0, src_key);
+    /* Errors may come with status 200, in the body. */
+    if (req.result != CURLE_OK || req.status != 200 ||
+        strstr (resp_str (&req), "<Error>") != NULL) {
+        warn_failed (&req, "copy to", dst_key);
+        ret = -1;
+    }
+
+    s3_request_cleanup (&req);
+    return ret;
+}
+
+int
+seaf_s3_client_list (SeafS3Client *client, const char *prefix,
+                     SeafS3ListFunc func, void *user_data)
+{
+    S3Request req;
+    GString *query;
+    char *token = NULL, *key;
+    const char *p;
+    gboolean truncated = FALSE, stop = FALSE;
+    int ret = 0;
+
+    do {
+        query = g_string_new (NULL);
+        if (token) {
+            g_string_append (query, "continuation-token=");
+            uri_encode (query, token, TRUE);
+            g_string_append_c (query, '&');
+            g_free (token);
+            token = NULL;
+        }
+        g_string_append (query, "list-type=2&prefix=");
+        uri_encode (query, prefix, TRUE);
+
+        s3_do (client, &req, "GET", "", query->str, NULL, 0, NULL);
+        g_string_free (query, TRUE);
+
+        if (req.result != CURLE_OK || req.status != 200) {
+            warn_failed (&req, "list", prefix);
+            s3_request_cleanup (&req);
+            ret = -1;
+            break;
+        }
+
+        p = resp_str (&req);
+        while (!stop && (key = xml_get_value (p, "Key", &p)) != NULL) {
+            if (!func (key, user_data))
+                stop = TRUE;
+            g_free (key);
+        }
+
+        p = resp_str (&req);
+        truncated = (strstr (p, "<IsTruncated>true</IsTruncated>") != NULL);
+        token = xml_get_value (p, "NextContinuationToken", NULL);
+
+        s3_request_cleanup (&req);
+    } while (!stop && truncated && token);
+
+    g_free (token);
+    return ret;
+}
+
+#endif  /* S3_BACKEND */
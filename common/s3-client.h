@@ -0,0 +1,100 @@
+/* -*- Mode: C; tab-width: 4; indent-tabs-mode: nil; c-basic-offset: 4 -*- */
+
+#ifndef SEAF_S3_CLIENT_H
+#define SEAF_S3_CLIENT_H
+
+#include <glib.h>
+
+/*
+ * Minimal client for S3 compatible object stores, signing requests with
+ * AWS signature version 4.
+ *
+ * A client keeps its HTTP connections open between requests. It is not
+ * thread safe; give each thread its own client, e.g. from a pool.
+ */
+
+typedef struct SeafS3Config {
+    char        *host;          /* host[:port] of the service */
+    char        *bucket;
+    char        *key_id;
+    char        *key;
+    char        *region;
+    gboolean     use_https;
+    /* host/bucket/key instead of bucket.host/key */
+    gboolean     path_style;
+} SeafS3Config;
+
+typedef struct SeafS3Client SeafS3Client;
+
+/*
+ * [group]
+ * bucket = seafile-blocks
+ * key_id = ...
+ * key = ...
+ * host = s3.amazonaws.com
+ * aws_region = us-east-1
+ * use_https = true
+ * path_style_request = false
+ */
+SeafS3Config *
+seaf_s3_config_load (GKeyFile *config, const char *group);
+
+void
+seaf_s3_config_free (SeafS3Config *conf);
+
+SeafS3Client *
+seaf_s3_client_new (const SeafS3Config *conf);
+
+void
+seaf_s3_client_free (SeafS3Client *client);
+
+/* Returns 0 on success, -1 on error or if the object doesn't exist. */
+int
+seaf_s3_client_get (SeafS3Client *client, const char *key,
+                    void **data, int *len);
+
+/* Fetch @n keys with concurrent requests. @data[i] is NULL for the keys
+ * that failed, and -1 is returned if there are any.
+ */
+int
+seaf_s3_client_get_many (SeafS3Client *client, const char **keys, int n,
+                         void **data, int *lens);
+
+int
+seaf_s3_client_put (SeafS3Client *client, const char *key,
+                    const void *data, int len);
+
+/* Upload @data in parts of @part_size, up to @max_parallel at a time. */
+int
+seaf_s3_client_put_multipart (SeafS3Client *client, const char *key,
+                              const void *data, gint64 len,
+                              gint64 part_size, int max_parallel);
+
+/* Returns 1 if the object exists, 0 if not, -1 on error.
+ * @size may be NULL.
+ */
+int
+seaf_s3_client_head (SeafS3Client *client, const char *key, gint64 *size);
+
+/* Check @n keys with concurrent requests. Returns -1 if any check failed. */
+int
+seaf_s3_client_head_many (SeafS3Client *client, const char **keys, int n,
+                          gboolean *exists);
+
+/* Deleting an object that doesn't exist succeeds. */
+int
+seaf_s3_client_delete (SeafS3Client *client, const char *key);
+
+/* Server side copy within the bucket. */
+int
+seaf_s3_client_copy (SeafS3Client *client, const char *src_key,
+                     const char *dst_key);
+
+typedef gboolean (*SeafS3ListFunc) (const char *key, void *user_data);
+
+/* Call @func on every key starting with @prefix, until it returns FALSE. */
+int
+seaf_s3_client_list (SeafS3Client *client, const char *prefix,
+                     SeafS3ListFunc func, void *user_data);
+
+#endif
@@ -2,6 +2,7 @@
 #include "common.h"
 
 #include <zdb.h>
+#include <pthread.h>
 #include "seaf-db.h"
 
 #ifdef WIN32
@@ -11,41 +12,184 @@
 
 #define MAX_GET_CONNECTION_RETRIES 3
 
+/* Seconds the reads of a thread stay on the primary after it wrote. */
+#define DEFAULT_READ_AFTER_WRITE 5
+
+#define DEFAULT_SLOW_QUERY_THRESHOLD 1000 /* ms */
+
+/* Distinct statements to keep stats of, the others are summed up. */
+#define MAX_QUERY_STATS 1000
+#define OTHER_QUERIES "(other)"
+#define TRANSACTION_QUERY "(transaction)"
+
+/* Time spent waiting for connections of a pool. */
+typedef struct PoolWaitStats {
+    gint64 n_gets;
+    gint64 total_wait;          /* microseconds */
+    gint64 max_wait;
+} PoolWaitStats;
+
+typedef struct QueryStats {
+    gint64 count;
+    gint64 errors;
+    gint64 total_time;          /* microseconds */
+    gint64 max_time;
+} QueryStats;
+
+/* Like get_current_time(), seaf-server-init builds this without lib/. */
+static gint64
+now_usec (void)
+{
+    GTimeVal tv;
+
+    g_get_current_time (&tv);
+    return tv.tv_sec * (gint64)1000000 + tv.tv_usec;
+}
+
+/* A connection pool, with the statement caches of its connections. */
+typedef struct DBPool {
+    ConnectionPool_T pool;
+
+    /* Prepared statements are cached for MySQL and PostgreSQL. */
+    gboolean cache_stmts;
+    pthread_key_t stmt_cache_key;
+    gint n_kept_conns;
+    int max_kept_conns;
+
+    /* Replicas aren't waited for, reads go to the primary instead. */
+    gboolean is_replica;
+    /* A replica that failed isn't tried again until then. */
+    gint down_until;
+
+    /* Threads retrying for a connection of a full pool. */
+    gint n_waiting;
+
+    PoolWaitStats wait_stats;
+    pthread_mutex_t wait_stats_lock;
+} DBPool;
+
+/* Seconds before a replica that failed is tried again. */
+#define REPLICA_RETRY_INTERVAL 30
+
 struct SeafDB {
     int type;
-    ConnectionPool_T pool;
+    DBPool *pool;               /* the primary */
+
+    /*
+     * Reads outside of transactions go to the replicas, if there are any,
+     * in turn. After a write, the reads of the same thread go to the
+     * primary for @read_after_write seconds, so they see the write even
+     * if the replicas lag behind.
+     */
+    GPtrArray *replicas;        /* DBPool */
+    gint next_replica;
+    int read_after_write;
+    pthread_key_t last_write_key;
+
+    /*
+     * sql -> QueryStats, of the statements and transactions. Execution
+     * time starts when a statement has its connection, waiting for the
+     * pool is counted in the wait stats of the pool.
+     */
+    GHashTable *query_stats;
+    pthread_mutex_t query_stats_lock;
+    gint64 slow_query_threshold; /* microseconds, 0 to not log */
 };
 
+static void
+init_stmt_cache (DBPool *pool);
+
 struct SeafDBRow {
     ResultSet_T res;
 };
 
 struct SeafDBTrans {
+    SeafDB *db;
     Connection_T conn;
+    gint64 start;
 };
 
-SeafDB *
-seaf_db_new_mysql (const char *host,
-                   const char *port,
-                   const char *user, 
-                   const char *passwd,
-                   const char *db_name,
-                   const char *unix_socket,
-                   gboolean use_ssl,
-                   const char *charset,
-                   int max_connections)
+static DBPool *
+db_pool_new (const char *url, int max_connections, gboolean cache_stmts)
 {
-    SeafDB *db;
-    GString *url;
+    DBPool *pool;
     URL_T zdb_url;
-    gboolean has_param = FALSE;
+
+    zdb_url = URL_new (url);
+    if (!zdb_url) {
+        g_warning ("Invalid db url.\n");
+        return NULL;
+    }
+
+    pool = g_new0 (DBPool, 1);
+    pthread_mutex_init (&pool->wait_stats_lock, NULL);
+    pool->pool = ConnectionPool_new (zdb_url);
+    if (!pool->pool) {
+        g_warning ("Failed to create db connection pool.\n");
+        URL_free (&zdb_url);
+        g_free (pool);
+        return NULL;
+    }
+
+    if (max_connections > 0)
+        ConnectionPool_setMaxConnections (pool->pool, max_connections);
+    ConnectionPool_start (pool->pool);
+
+    if (cache_stmts)
+        init_stmt_cache (pool);
+
+    return pool;
+}
+
+static void
+db_pool_free (DBPool *pool)
+{
+    if (pool->cache_stmts)
+        pthread_key_delete (pool->stmt_cache_key);
+    ConnectionPool_stop (pool->pool);
+    ConnectionPool_free (&pool->pool);
+    g_free (pool);
+}
+
+static SeafDB *
+seaf_db_new (int type, const char *url, int max_connections)
+{
+    SeafDB *db;
 
     db = g_new0 (SeafDB, 1);
-    if (!db) {
-        g_warning ("Failed to alloc db structure.\n");
+    db->type = type;
+    db->pool = db_pool_new (url, max_connections,
+                            type != SEAF_DB_TYPE_SQLITE);
+    if (!db->pool) {
+        g_free (db);
         return NULL;
     }
 
+    db->replicas = g_ptr_array_new ();
+    db->read_after_write = DEFAULT_READ_AFTER_WRITE;
+    pthread_key_create (&db->last_write_key, g_free);
+
+    db->query_stats = g_hash_table_new_full (g_str_hash, g_str_equal,
+                                             g_free, g_free);
+    pthread_mutex_init (&db->query_stats_lock, NULL);
+    db->slow_query_threshold = (gint64)DEFAULT_SLOW_QUERY_THRESHOLD * 1000;
+
+    return db;
+}
+
+static char *
+mysql_url (const char *host,
+           const char *port,
+           const char *user,
+           const char *passwd,
+           const char *db_name,
+           const char *unix_socket,
+           gboolean use_ssl,
+           const char *charset)
+{
+    GString *url;
+    gboolean has_param = FALSE;
+
     char *passwd_esc = g_uri_escape_string (passwd, NULL, FALSE);
 
     url = g_string_new ("");
@@ -67,18 +211,46 @@ seaf_db_new_mysql (const char *host,
 
     g_free (passwd_esc);
 
-    zdb_url = URL_new (url->str);
-    db->pool = ConnectionPool_new (zdb_url);
-    if (!db->pool) {
-        g_warning ("Failed to create db connection pool.\n");
-        g_string_free (url, TRUE);
-        g_free (db);
-        return NULL;
-    }
+    return g_string_free (url, FALSE);
+}
+
+static char *
+pgsql_url (const char *host,
+           const char *user,
+           const char *passwd,
+           const char *db_name,
+           const char *unix_socket)
+{
+    GString *url;
+
+    url = g_string_new ("");
+    g_string_append_printf (url, "postgresql://%s:%s@%s/", user, passwd, host);
+    if (db_name)
+        g_string_append (url, db_name);
+    if (unix_socket)
+        g_string_append_printf (url, "?unix-socket=%s", unix_socket);
+
+    return g_string_free (url, FALSE);
+}
+
+SeafDB *
+seaf_db_new_mysql (const char *host,
+                   const char *port,
+                   const char *user, 
+                   const char *passwd,
+                   const char *db_name,
+                   const char *unix_socket,
+                   gboolean use_ssl,
+                   const char *charset,
+                   int max_connections)
+{
+    SeafDB *db;
+    char *url;
 
-    ConnectionPool_setMaxConnections (db->pool, max_connections);
-    ConnectionPool_start (db->pool);
-    db->type = SEAF_DB_TYPE_MYSQL;
+    url = mysql_url (host, port, user, passwd, db_name,
+                     unix_socket, use_ssl, charset);
+    db = seaf_db_new (SEAF_DB_TYPE_MYSQL, url, max_connections);
+    g_free (url);
 
     return db;
 }
@@ -91,33 +263,11 @@ seaf_db_new_pgsql (const char *host,
                    const char *unix_socket)
 {
     SeafDB *db;
-    GString *url;
-    URL_T zdb_url;
-
-    db = g_new0(SeafDB, 1);
-    if (!db) {
-        g_warning ("Failed to alloc db structre.\n");
-        return NULL;
-    }
-
-    url = g_string_new ("");
-    g_string_append_printf (url, "postgresql://%s:%s@%s/", user, passwd, host);
-    if (db_name)
-        g_string_append (url, db_name);
-    if (unix_socket)
-        g_string_append_printf (url, "?unix-socket=%s", unix_socket);
-
-    zdb_url = URL_new (url->str);
-    db->pool = ConnectionPool_new (zdb_url);
-    if (!db->pool) {
-        g_warning ("Failed to create db connection pool.\n");
-        g_string_free(url, TRUE);
-        g_free (db);
-        return NULL;
-    }
+    char *url;
 
-    ConnectionPool_start (db->pool);
-    db->type = SEAF_DB_TYPE_PGSQL;
+    url = pgsql_url (host, user, passwd, db_name, unix_socket);
+    db = seaf_db_new (SEAF_DB_TYPE_PGSQL, url, 0);
+    g_free (url);
 
     return db;
 }
@@ -126,39 +276,93 @@ SeafDB *
 seaf_db_new_sqlite (const char *db_path, int max_connections)
 {
     SeafDB *db;
-    GString *url;
-    URL_T zdb_url;
+    char *url;
 
-    db = g_new0 (SeafDB, 1);
-    if (!db) {
-        g_warning ("Failed to alloc db structure.\n");
-        return NULL;
-    }
+    url = g_strdup_printf ("sqlite://%s", db_path);
+    db = seaf_db_new (SEAF_DB_TYPE_SQLITE, url, max_connections);
+    g_free (url);
 
-    url = g_string_new ("");
-    g_string_append_printf (url, "sqlite://%s", db_path);
+    return db;
+}
 
-    zdb_url = URL_new (url->str);
-    db->pool = ConnectionPool_new (zdb_url);
-    if (!db->pool) {
-        g_warning ("Failed to create db connection pool.\n");
-        g_string_free (url, TRUE);
-        g_free (db);
-        return NULL;
-    }
+static int
+add_replica (SeafDB *db, const char *url, int max_connections)
+{
+    DBPool *pool;
 
-    ConnectionPool_setMaxConnections (db->pool, max_connections);
-    ConnectionPool_start (db->pool);
-    db->type = SEAF_DB_TYPE_SQLITE;
+    pool = db_pool_new (url, max_connections, TRUE);
+    if (!pool)
+        return -1;
+    pool->is_replica = TRUE;
 
-    return db;
+    g_ptr_array_add (db->replicas, pool);
+    return 0;
+}
+
+int
+seaf_db_add_mysql_replica (SeafDB *db,
+                           const char *host,
+                           const char *port,
+                           const char *user,
+                           const char *passwd,
+                           const char *db_name,
+                           const char *unix_socket,
+                           gboolean use_ssl,
+                           const char *charset,
+                           int max_connections)
+{
+    char *url;
+    int ret;
+
+    if (db->type != SEAF_DB_TYPE_MYSQL)
+        return -1;
+
+    url = mysql_url (host, port, user, passwd, db_name,
+                     unix_socket, use_ssl, charset);
+    ret = add_replica (db, url, max_connections);
+    g_free (url);
+
+    return ret;
+}
+
+int
+seaf_db_add_pgsql_replica (SeafDB *db,
+                           const char *host,
+                           const char *user,
+                           const char *passwd,
+                           const char *db_name,
+                           const char *unix_socket)
+{
+    char *url;
+    int ret;
+
+    if (db->type != SEAF_DB_TYPE_PGSQL)
+        return -1;
+
+    url = pgsql_url (host, user, passwd, db_name, unix_socket);
+    ret = add_replica (db, url, 0);
+    g_free (url);
+
+    return ret;
+}
+
+void
+seaf_db_set_read_after_write (SeafDB *db, int seconds)
+{
+    db->read_after_write = seconds;
 }
 
 void
 seaf_db_free (SeafDB *db)
 {
-    ConnectionPool_stop (db->pool);
-    ConnectionPool_free (&db->pool);
+    guint i;
+
+    for (i = 0; i < db->replicas->len; ++i)
+        db_pool_free (g_ptr_array_index (db->replicas, i));
+    g_ptr_array_free (db->replicas, TRUE);
+    pthread_key_delete (db->last_write_key);
+
+    db_pool_free (db->pool);
     g_free (db);
 }
 
@@ -168,18 +372,177 @@ seaf_db_type (SeafDB *db)
     return db->type;
 }
 
+void
+seaf_db_get_pool_stats (SeafDB *db, SeafDBPoolStats *stats)
+{
+    DBPool *pool = db->pool;
+
+    stats->size = ConnectionPool_size (pool->pool);
+    stats->active = ConnectionPool_active (pool->pool);
+    stats->max = ConnectionPool_getMaxConnections (pool->pool);
+    stats->waiting = g_atomic_int_get (&pool->n_waiting);
+    stats->n_replicas = db->replicas->len;
+}
+
+static void
+account_pool_wait (DBPool *pool, gint64 start)
+{
+    gint64 wait = now_usec () - start;
+
+    pthread_mutex_lock (&pool->wait_stats_lock);
+    ++pool->wait_stats.n_gets;
+    pool->wait_stats.total_wait += wait;
+    if (wait > pool->wait_stats.max_wait)
+        pool->wait_stats.max_wait = wait;
+    pthread_mutex_unlock (&pool->wait_stats_lock);
+}
+
+void
+seaf_db_set_slow_query_threshold (SeafDB *db, int msec)
+{
+    db->slow_query_threshold = (gint64)MAX (msec, 0) * 1000;
+}
+
+static void
+append_json_string (GString *buf, const char *s)
+{
+    g_string_append_c (buf, '"');
+    for (; *s; ++s) {
+        if (*s == '"' || *s == '\\')
+            g_string_append_printf (buf, "\\%c", *s);
+        else if ((unsigned char)*s < 0x20)
+            g_string_append_printf (buf, "\\u%04x", (unsigned char)*s);
+        else
+            g_string_append_c (buf, *s);
+    }
+    g_string_append_c (buf, '"');
+}
+
+static void
+append_wait_stats (GString *buf, const char *name, PoolWaitStats *stats)
+{
+    g_string_append_printf (buf, "\"%s\": {\"gets\": %"G_GINT64_FORMAT", "
+                            "\"total_wait_ms\": %.3f, "
+                            "\"avg_wait_us\": %"G_GINT64_FORMAT", "
+                            "\"max_wait_ms\": %.3f}",
+                            name, stats->n_gets, stats->total_wait / 1000.0,
+                            stats->n_gets ? stats->total_wait / stats->n_gets : 0,
+                            stats->max_wait / 1000.0);
+}
+
+static void
+add_wait_stats (PoolWaitStats *total, DBPool *pool)
+{
+    pthread_mutex_lock (&pool->wait_stats_lock);
+    total->n_gets += pool->wait_stats.n_gets;
+    total->total_wait += pool->wait_stats.total_wait;
+    total->max_wait = MAX (total->max_wait, pool->wait_stats.max_wait);
+    pthread_mutex_unlock (&pool->wait_stats_lock);
+}
+
+static gint
+compare_query_time (gconstpointer a, gconstpointer b)
+{
+    const QueryStats *x = ((gpointer *)a)[1], *y = ((gpointer *)b)[1];
+
+    if (x->total_time != y->total_time)
+        return x->total_time > y->total_time ? -1 : 1;
+    return 0;
+}
+
+char *
+seaf_db_get_query_stats (SeafDB *db)
+{
+    PoolWaitStats primary, replicas;
+    GHashTableIter iter;
+    gpointer key, value, *pairs;
+    QueryStats *stats;
+    GString *buf;
+    guint n, i;
+
+    memset (&primary, 0, sizeof(primary));
+    memset (&replicas, 0, sizeof(replicas));
+    add_wait_stats (&primary, db->pool);
+    for (i = 0; i < db->replicas->len; ++i)
+        add_wait_stats (&replicas, g_ptr_array_index (db->replicas, i));
+
+    buf = g_string_new ("{");
+    g_string_append_printf (buf, "\"slow_query_threshold_ms\": %"G_GINT64_FORMAT", ",
+                            db->slow_query_threshold / 1000);
+    append_wait_stats (buf, "pool", &primary);
+    if (db->replicas->len > 0) {
+        g_string_append (buf, ", ");
+        append_wait_stats (buf, "replica_pools", &replicas);
+    }
+    g_string_append (buf, ", \"statements\": [");
+
+    pthread_mutex_lock (&db->query_stats_lock);
+
+    /* Copy (sql, stats) pairs out to sort them by total time. */
+    n = g_hash_table_size (db->query_stats);
+    pairs = g_new (gpointer, 2 * n);
+    i = 0;
+    g_hash_table_iter_init (&iter, db->query_stats);
+    while (g_hash_table_iter_next (&iter, &key, &value)) {
+        pairs[2 * i] = key;
+        pairs[2 * i + 1] = value;
+        ++i;
+    }
+    qsort (pairs, n, 2 * sizeof(gpointer), compare_query_time);
+
+    for (i = 0; i < n; ++i) {
+        stats = pairs[2 * i + 1];
+        g_string_append (buf, i ? ", {\"sql\": " : "{\"sql\": ");
+        append_json_string (buf, pairs[2 * i]);
+        g_string_append_printf (buf, ", \"count\": %"G_GINT64_FORMAT", "
+                                "\"errors\": %"G_GINT64_FORMAT", "
+                                "\"total_ms\": %.3f, "
+                                "\"avg_ms\": %.3f, "
+                                "\"max_ms\": %.3f}",
+                                stats->count, stats->errors,
+                                stats->total_time / 1000.0,
+                                stats->total_time / 1000.0 / stats->count,
+                                stats->max_time / 1000.0);
+    }
+
+    pthread_mutex_unlock (&db->query_stats_lock);
+
+    g_free (pairs);
+    g_string_append (buf, "]}");
+    return g_string_free (buf, FALSE);
+}
+
 static Connection_T
-get_db_connection (SeafDB *db)
+get_pool_connection (DBPool *pool)
 {
     Connection_T conn;
     int n_retries = 0;
+    gint64 start = now_usec ();
+
+    if (pool->is_replica) {
+        conn = ConnectionPool_getConnection (pool->pool);
+        if (!conn) {
+            g_warning ("Failed to get replica connection, "
+                       "reading from the primary.\n");
+            g_atomic_int_set (&pool->down_until,
+                              (gint)time(NULL) + REPLICA_RETRY_INTERVAL);
+        }
+        account_pool_wait (pool, start);
+        return conn;
+    }
 
     /* Wait for at most 30 seconds before getting a connection from pool. */
-    do {
-        conn = ConnectionPool_getConnection (db->pool);
-        if (!conn)
+    conn = ConnectionPool_getConnection (pool->pool);
+    if (!conn) {
+        g_atomic_int_inc (&pool->n_waiting);
+        do {
             g_usleep (100000);
-    } while (!conn && ++n_retries < 300);
+            conn = ConnectionPool_getConnection (pool->pool);
+        } while (!conn && ++n_retries < 300);
+        g_atomic_int_add (&pool->n_waiting, -1);
+    }
+
+    account_pool_wait (pool, start);
 
     if (!conn)
         g_warning ("Failed to get database connection.\n");
@@ -187,6 +550,112 @@ get_db_connection (SeafDB *db)
     return conn;
 }
 
+/*
+ * Count a statement or transaction that took from @start until now, and
+ * log it if it's slow.
+ */
+static void
+account_query (SeafDB *db, const char *sql, gint64 start, gboolean failed)
+{
+    gint64 elapsed = now_usec () - start;
+    QueryStats *stats;
+
+    pthread_mutex_lock (&db->query_stats_lock);
+
+    stats = g_hash_table_lookup (db->query_stats, sql);
+    if (!stats) {
+        if (g_hash_table_size (db->query_stats) >= MAX_QUERY_STATS)
+            sql = OTHER_QUERIES;
+        stats = g_hash_table_lookup (db->query_stats, sql);
+    }
+    if (!stats) {
+        stats = g_new0 (QueryStats, 1);
+        g_hash_table_insert (db->query_stats, g_strdup (sql), stats);
+    }
+
+    ++stats->count;
+    if (failed)
+        ++stats->errors;
+    stats->total_time += elapsed;
+    if (elapsed > stats->max_time)
+        stats->max_time = elapsed;
+
+    pthread_mutex_unlock (&db->query_stats_lock);
+
+    if (db->slow_query_threshold > 0 && elapsed >= db->slow_query_threshold)
+        g_warning ("Slow query (%.1f ms%s): %s\n", elapsed / 1000.0,
+                   failed ? ", failed" : "", sql);
+}
+
+/* The primary, for writes. Reads of this thread stay there for a while. */
+static DBPool *
+write_pool (SeafDB *db)
+{
+    gint64 *last_write;
+
+    if (db->replicas->len == 0)
+        return db->pool;
+
+    last_write = pthread_getspecific (db->last_write_key);
+    if (!last_write) {
+        last_write = g_new0 (gint64, 1);
+        pthread_setspecific (db->last_write_key, last_write);
+    }
+    *last_write = (gint64)time(NULL);
+
+    return db->pool;
+}
+
+static DBPool *
+read_pool (SeafDB *db)
+{
+    gint64 *last_write;
+    gint now = (gint)time(NULL);
+    DBPool *pool;
+    guint n, i;
+
+    if (db->replicas->len == 0)
+        return db->pool;
+
+    last_write = pthread_getspecific (db->last_write_key);
+    if (last_write && now - *last_write < db->read_after_write)
+        return db->pool;
+
+    n = (guint)g_atomic_int_exchange_and_add (&db->next_replica, 1);
+    for (i = 0; i < db->replicas->len; ++i) {
+        pool = g_ptr_array_index (db->replicas, (n + i) % db->replicas->len);
+        if (g_atomic_int_get (&pool->down_until) <= now)
+            return pool;
+    }
+
+    return db->pool;
+}
+
+/* Falls back to the primary if @pool is a replica that's out. */
+static Connection_T
+get_connection_from (SeafDB *db, DBPool *pool)
+{
+    Connection_T conn;
+
+    conn = get_pool_connection (pool);
+    if (!conn && pool != db->pool)
+        conn = get_pool_connection (db->pool);
+
+    return conn;
+}
+
+static Connection_T
+get_db_connection (SeafDB *db)
+{
+    return get_pool_connection (write_pool (db));
+}
+
+static Connection_T
+get_read_connection (SeafDB *db)
+{
+    return get_connection_from (db, read_pool (db));
+}
+
 int
 seaf_db_query (SeafDB *db, const char *sql)
 {
@@ -218,7 +687,7 @@ seaf_db_check_for_existence (SeafDB *db, const char *sql, gboolean *db_err)
 
     *db_err = FALSE;
 
-    conn = get_db_connection (db);
+    conn = get_read_connection (db);
     if (!conn) {
         *db_err = TRUE;
         return FALSE;
@@ -257,7 +726,7 @@ seaf_db_foreach_selected_row (SeafDB *db, const char *sql,
     SeafDBRow seaf_row;
     int n_rows = 0;
 
-    conn = get_db_connection (db);
+    conn = get_read_connection (db);
     if (!conn)
         return -1;
 
@@ -318,7 +787,7 @@ seaf_db_get_int (SeafDB *db, const char *sql)
     ResultSet_T result;
     SeafDBRow seaf_row;
 
-    conn = get_db_connection (db);
+    conn = get_read_connection (db);
     if (!conn)
         return -1;
 
@@ -353,7 +822,7 @@ seaf_db_get_int64 (SeafDB *db, const char *sql)
     ResultSet_T result;
     SeafDBRow seaf_row;
 
-    conn = get_db_connection (db);
+    conn = get_read_connection (db);
     if (!conn)
         return -1;
 
@@ -389,7 +858,7 @@ seaf_db_get_string (SeafDB *db, const char *sql)
     ResultSet_T result;
     SeafDBRow seaf_row;
 
-    conn = get_db_connection (db);
+    conn = get_read_connection (db);
     if (!conn)
         return NULL;
 
@@ -452,21 +921,224 @@ pgsql_index_exists (SeafDB *db, const char *index_name)
     return seaf_db_check_for_existence (db, sql, &db_err);
 }
 
-/* Prepared Statements */
-
-struct SeafDBStatement {
-    PreparedStatement_T p;
-    Connection_T conn;
-};
-typedef struct SeafDBStatement SeafDBStatement;
+/* Prepared Statements */
+
+/*
+ * libzdb frees the statements of a connection when it goes back to the
+ * pool, so statements can only be reused on a connection kept out of it.
+ * Each thread running statements keeps a connection of its own, with an
+ * LRU of the statements prepared on it by SQL text. Only half the pool is
+ * kept this way, the other threads and transactions use the pool as
+ * before.
+ *
+ * libzdb can't free a single statement either. Statements pushed out of
+ * the LRU stay on the connection, until there are so many that the
+ * connection goes back to the pool and a new one is taken.
+ */
+#define STMT_CACHE_SIZE 64
+/* Check a kept connection after it was idle for this many seconds. */
+#define KEPT_CONN_IDLE_CHECK 60
+
+typedef struct CachedStmt {
+    char *sql;
+    PreparedStatement_T p;
+    GList link;                 /* in the LRU queue */
+} CachedStmt;
+
+typedef struct StmtCache {
+    DBPool *pool;
+    Connection_T conn;
+    GHashTable *stmts;          /* sql -> CachedStmt */
+    GQueue lru;                 /* most recently used first */
+    int n_prepared;             /* on conn, including the evicted ones */
+    /* Statements in use. Nested ones use the pool. */
+    int depth;
+    /* Set on errors, to start over with a new connection. */
+    gboolean broken;
+    gint64 last_used;
+} StmtCache;
+
+struct SeafDBStatement {
+    PreparedStatement_T p;
+    Connection_T conn;
+    StmtCache *cache;
+
+    /* For the query stats, see account_query(). */
+    SeafDB *db;
+    const char *sql;
+    gint64 start;
+    gboolean failed;
+};
+typedef struct SeafDBStatement SeafDBStatement;
+
+static void
+cached_stmt_free (CachedStmt *stmt)
+{
+    /* The statement itself belongs to the connection. */
+    g_free (stmt->sql);
+    g_free (stmt);
+}
+
+/* Forget the statements and give the connection back to the pool. */
+static void
+stmt_cache_reset (StmtCache *cache)
+{
+    g_hash_table_remove_all (cache->stmts);
+    g_queue_init (&cache->lru);
+    cache->n_prepared = 0;
+    cache->broken = FALSE;
+
+    if (cache->conn) {
+        Connection_close (cache->conn);
+        cache->conn = NULL;
+    }
+}
+
+/* Called when a thread with a cache exits. */
+static void
+stmt_cache_free (void *data)
+{
+    StmtCache *cache = data;
+
+    stmt_cache_reset (cache);
+    g_hash_table_destroy (cache->stmts);
+    g_atomic_int_add (&cache->pool->n_kept_conns, -1);
+    g_free (cache);
+}
+
+static void
+init_stmt_cache (DBPool *pool)
+{
+    if (pthread_key_create (&pool->stmt_cache_key, stmt_cache_free) != 0) {
+        g_warning ("Failed to create key for statement cache.\n");
+        return;
+    }
+
+    pool->max_kept_conns = ConnectionPool_getMaxConnections (pool->pool) / 2;
+    pool->cache_stmts = (pool->max_kept_conns > 0);
+}
+
+/* The statement cache of this thread, NULL if it can't have one now. */
+static StmtCache *
+get_stmt_cache (DBPool *pool)
+{
+    StmtCache *cache;
+    gint64 now;
+
+    if (!pool->cache_stmts)
+        return NULL;
+
+    cache = pthread_getspecific (pool->stmt_cache_key);
+    if (!cache) {
+        if (g_atomic_int_exchange_and_add (&pool->n_kept_conns, 1) >= pool->max_kept_conns) {
+            g_atomic_int_add (&pool->n_kept_conns, -1);
+            return NULL;
+        }
+
+        cache = g_new0 (StmtCache, 1);
+        cache->pool = pool;
+        cache->stmts = g_hash_table_new_full (g_str_hash, g_str_equal, NULL,
+                                              (GDestroyNotify)cached_stmt_free);
+        g_queue_init (&cache->lru);
+        pthread_setspecific (pool->stmt_cache_key, cache);
+    }
+
+    if (cache->depth > 0)
+        return NULL;
+
+    now = (gint64)time(NULL);
+    if (cache->conn && now - cache->last_used > KEPT_CONN_IDLE_CHECK &&
+        !Connection_ping (cache->conn))
+        stmt_cache_reset (cache);
+
+    if (!cache->conn) {
+        cache->conn = get_pool_connection (pool);
+        if (!cache->conn)
+            return NULL;
+    }
+    cache->last_used = now;
+
+    return cache;
+}
+
+static SeafDBStatement *
+prepare_cached_statement (StmtCache *cache, const char *sql)
+{
+    CachedStmt *stmt, *old;
+    PreparedStatement_T p;
+    SeafDBStatement *ret;
+
+    stmt = g_hash_table_lookup (cache->stmts, sql);
+    if (stmt) {
+        g_queue_unlink (&cache->lru, &stmt->link);
+        g_queue_push_head_link (&cache->lru, &stmt->link);
+    } else {
+        TRY
+            p = Connection_prepareStatement (cache->conn, "%s", sql);
+        CATCH (SQLException)
+            g_warning ("Error prepare statement %s: %s.\n", sql, Exception_frame.message);
+            stmt_cache_reset (cache);
+            return NULL;
+        END_TRY;
+
+        stmt = g_new0 (CachedStmt, 1);
+        stmt->sql = g_strdup (sql);
+        stmt->p = p;
+        stmt->link.data = stmt;
+        g_hash_table_insert (cache->stmts, stmt->sql, stmt);
+        g_queue_push_head_link (&cache->lru, &stmt->link);
+        ++cache->n_prepared;
+
+        if (g_hash_table_size (cache->stmts) > STMT_CACHE_SIZE) {
+            old = g_queue_peek_tail (&cache->lru);
+            g_queue_unlink (&cache->lru, &old->link);
+            g_hash_table_remove (cache->stmts, old->sql);
+        }
+    }
+
+    ++cache->depth;
+
+    ret = g_new0 (SeafDBStatement, 1);
+    ret->p = stmt->p;
+    ret->conn = cache->conn;
+    ret->cache = cache;
+    return ret;
+}
+
+/* Errors may leave the connection unusable, so don't keep it. */
+static void
+statement_failed (SeafDBStatement *p)
+{
+    if (p->cache)
+        p->cache->broken = TRUE;
+    p->failed = TRUE;
+}
 
-SeafDBStatement *
-seaf_db_prepare_statement (SeafDB *db, const char *sql)
+/* Writes go to the primary, reads may go to a replica. */
+static SeafDBStatement *
+seaf_db_prepare_statement (SeafDB *db, const char *sql, gboolean write)
 {
     PreparedStatement_T p;
-    SeafDBStatement *ret = g_new0 (SeafDBStatement, 1);
+    SeafDBStatement *ret;
+    StmtCache *cache;
+    DBPool *pool;
+
+    pool = write ? write_pool (db) : read_pool (db);
+
+    cache = get_stmt_cache (pool);
+    if (cache) {
+        ret = prepare_cached_statement (cache, sql);
+        if (ret) {
+            ret->db = db;
+            ret->sql = sql;
+            ret->start = now_usec ();
+            return ret;
+        }
+    }
 
-    Connection_T conn = get_db_connection (db);
+    ret = g_new0 (SeafDBStatement, 1);
+
+    Connection_T conn = get_connection_from (db, pool);
     if (!conn) {
         g_free (ret);
         return NULL;
@@ -476,6 +1148,9 @@ seaf_db_prepare_statement (SeafDB *db, const char *sql)
         p = Connection_prepareStatement (conn, "%s", sql);
         ret->p = p;
         ret->conn = conn;
+        ret->db = db;
+        ret->sql = sql;
+        ret->start = now_usec ();
         RETURN (ret);
     CATCH (SQLException)
         g_warning ("Error prepare statement %s: %s.\n", sql, Exception_frame.message);
@@ -491,7 +1166,17 @@ seaf_db_prepare_statement (SeafDB *db, const char *sql)
 void
 seaf_db_statement_free (SeafDBStatement *p)
 {
-    Connection_close (p->conn);
+    StmtCache *cache = p->cache;
+
+    account_query (p->db, p->sql, p->start, p->failed);
+
+    if (cache) {
+        if (--cache->depth == 0 &&
+            (cache->broken || cache->n_prepared > 2 * STMT_CACHE_SIZE))
+            stmt_cache_reset (cache);
+    } else {
+        Connection_close (p->conn);
+    }
     g_free (p);
 }
 
@@ -574,7 +1259,7 @@ seaf_db_statement_query (SeafDB *db, const char *sql, int n, ...)
     SeafDBStatement *p;
     volatile int ret = 0;
 
-    p = seaf_db_prepare_statement (db, sql);
+    p = seaf_db_prepare_statement (db, sql, TRUE);
     if (!p)
         return -1;
 
@@ -591,6 +1276,7 @@ seaf_db_statement_query (SeafDB *db, const char *sql, int n, ...)
         PreparedStatement_execute (p->p);
     CATCH (SQLException)
         g_warning ("Error execute prep stmt: %s.\n", Exception_frame.message);
+        statement_failed (p);
         ret = -1;
     END_TRY;
 
@@ -607,7 +1293,7 @@ seaf_db_statement_exists (SeafDB *db, const char *sql, gboolean *db_err, int n,
 
     *db_err = FALSE;
 
-    p = seaf_db_prepare_statement (db, sql);
+    p = seaf_db_prepare_statement (db, sql, FALSE);
     if (!p)
         return FALSE;
 
@@ -624,6 +1310,7 @@ seaf_db_statement_exists (SeafDB *db, const char *sql, gboolean *db_err, int n,
         result = PreparedStatement_executeQuery (p->p);
     CATCH (SQLException)
         g_warning ("Error exec prep stmt: %s.\n", Exception_frame.message);
+        statement_failed (p);
         seaf_db_statement_free (p);
         *db_err = TRUE;
         return FALSE;
@@ -635,6 +1322,7 @@ seaf_db_statement_exists (SeafDB *db, const char *sql, gboolean *db_err, int n,
     CATCH (SQLException)
         g_warning ("Error get next result from prep stmt: %s.\n",
                    Exception_frame.message);
+        statement_failed (p);
         *db_err = TRUE;
         ret = FALSE;
     END_TRY;
@@ -655,7 +1343,7 @@ seaf_db_statement_foreach_row (SeafDB *db,
     SeafDBRow seaf_row;
     volatile int n_rows = 0;
 
-    p = seaf_db_prepare_statement (db, sql);
+    p = seaf_db_prepare_statement (db, sql, FALSE);
     if (!p)
         return -1;
 
@@ -672,6 +1360,7 @@ seaf_db_statement_foreach_row (SeafDB *db,
         result = PreparedStatement_executeQuery (p->p);
     CATCH (SQLException)
         g_warning ("Error exec prep stmt: %s.\n", Exception_frame.message);
+        statement_failed (p);
         seaf_db_statement_free (p);
         return -1;
     END_TRY;
@@ -686,6 +1375,7 @@ seaf_db_statement_foreach_row (SeafDB *db,
     CATCH (SQLException)
         g_warning ("Error get next result for prep stmt: %s.\n",
                    Exception_frame.message);
+        statement_failed (p);
         seaf_db_statement_free (p);
         return -1;
     END_TRY;
@@ -702,7 +1392,7 @@ seaf_db_statement_get_int (SeafDB *db, const char *sql, int n, ...)
     ResultSet_T result;
     SeafDBRow seaf_row;
 
-    p = seaf_db_prepare_statement (db, sql);
+    p = seaf_db_prepare_statement (db, sql, FALSE);
     if (!p)
         return -1;
 
@@ -719,6 +1409,7 @@ seaf_db_statement_get_int (SeafDB *db, const char *sql, int n, ...)
         result = PreparedStatement_executeQuery (p->p);
     CATCH (SQLException)
         g_warning ("Error exec prep stmt: %s.\n", Exception_frame.message);
+        statement_failed (p);
         seaf_db_statement_free (p);
         return -1;
     END_TRY;
@@ -731,6 +1422,7 @@ seaf_db_statement_get_int (SeafDB *db, const char *sql, int n, ...)
     CATCH (SQLException)
         g_warning ("Error get next result for prep stmt: %s.\n",
                    Exception_frame.message);
+        statement_failed (p);
         seaf_db_statement_free (p);
         return -1;
     END_TRY;
@@ -747,7 +1439,7 @@ seaf_db_statement_get_int64 (SeafDB *db, const char *sql, int n, ...)
     ResultSet_T result;
     SeafDBRow seaf_row;
 
-    p = seaf_db_prepare_statement (db, sql);
+    p = seaf_db_prepare_statement (db, sql, FALSE);
     if (!p)
         return -1;
 
@@ -764,6 +1456,7 @@ seaf_db_statement_get_int64 (SeafDB *db, const char *sql, int n, ...)
         result = PreparedStatement_executeQuery (p->p);
     CATCH (SQLException)
         g_warning ("Error exec prep stmt: %s.\n", Exception_frame.message);
+        statement_failed (p);
         seaf_db_statement_free (p);
         return -1;
     END_TRY;
@@ -776,6 +1469,7 @@ seaf_db_statement_get_int64 (SeafDB *db, const char *sql, int n, ...)
     CATCH (SQLException)
         g_warning ("Error get next result for prep stmt: %s.\n",
                    Exception_frame.message);
+        statement_failed (p);
         seaf_db_statement_free (p);
         return -1;
     END_TRY;
@@ -793,7 +1487,7 @@ seaf_db_statement_get_string (SeafDB *db, const char *sql, int n, ...)
     ResultSet_T result;
     SeafDBRow seaf_row;
 
-    p = seaf_db_prepare_statement (db, sql);
+    p = seaf_db_prepare_statement (db, sql, FALSE);
     if (!p)
         return NULL;
 
@@ -810,6 +1504,7 @@ seaf_db_statement_get_string (SeafDB *db, const char *sql, int n, ...)
         result = PreparedStatement_executeQuery (p->p);
     CATCH (SQLException)
         g_warning ("Error exec prep stmt: %s.\n", Exception_frame.message);
+        statement_failed (p);
         seaf_db_statement_free (p);
         return NULL;
     END_TRY;
@@ -824,6 +1519,7 @@ seaf_db_statement_get_string (SeafDB *db, const char *sql, int n, ...)
     CATCH (SQLException)
         g_warning ("Error get next result for prep stmt: %s.\n",
                    Exception_frame.message);
+        statement_failed (p);
         seaf_db_statement_free (p);
         return NULL;
     END_TRY;
@@ -850,7 +1546,9 @@ seaf_db_begin_transaction (SeafDB *db)
         return NULL;
     }
 
+    trans->db = db;
     trans->conn = conn;
+    trans->start = now_usec ();
     TRY
         Connection_beginTransaction (trans->conn);
     CATCH (SQLException)
@@ -866,6 +1564,8 @@ seaf_db_begin_transaction (SeafDB *db)
 void
 seaf_db_trans_close (SeafDBTrans *trans)
 {
+    account_query (trans->db, TRANSACTION_QUERY, trans->start, FALSE);
+
     Connection_close (trans->conn);
     g_free (trans);
 }
@@ -917,8 +1617,8 @@ trans_prepare_statement (Connection_T conn, const char *sql)
     return NULL;
 }
 
-int
-seaf_db_trans_query (SeafDBTrans *trans, const char *sql, int n, ...)
+static int
+trans_query_va (SeafDBTrans *trans, const char *sql, int n, va_list args)
 {
     PreparedStatement_T p;
 
@@ -926,13 +1626,8 @@ seaf_db_trans_query (SeafDBTrans *trans, const char *sql, int n, ...)
     if (!p)
         return -1;
 
-    va_list args;
-    va_start (args, n);
-    if (set_parameters_va (p, n, args) < 0) {
-        va_end (args);
+    if (set_parameters_va (p, n, args) < 0)
         return -1;
-    }
-    va_end (args);
 
     /* Handle zdb "exception"s. */
     TRY
@@ -947,11 +1642,26 @@ seaf_db_trans_query (SeafDBTrans *trans, const char *sql, int n, ...)
     return 0;
 }
 
-gboolean
-seaf_db_trans_check_for_existence (SeafDBTrans *trans,
-                                   const char *sql,
-                                   gboolean *db_err,
-                                   int n, ...)
+int
+seaf_db_trans_query (SeafDBTrans *trans, const char *sql, int n, ...)
+{
+    gint64 start = now_usec ();
+    va_list args;
+    int ret;
+
+    va_start (args, n);
+    ret = trans_query_va (trans, sql, n, args);
+    va_end (args);
+
+    account_query (trans->db, sql, start, ret < 0);
+    return ret;
+}
+
+static gboolean
+trans_check_for_existence_va (SeafDBTrans *trans,
+                              const char *sql,
+                              gboolean *db_err,
+                              int n, va_list args)
 {
     ResultSet_T result;
     gboolean ret = TRUE;
@@ -964,13 +1674,8 @@ seaf_db_trans_check_for_existence (SeafDBTrans *trans,
     if (!p)
         return FALSE;
 
-    va_list args;
-    va_start (args, n);
-    if (set_parameters_va (p, n, args) < 0) {
-        va_end (args);
+    if (set_parameters_va (p, n, args) < 0)
         return -1;
-    }
-    va_end (args);
 
     TRY
         result = PreparedStatement_executeQuery (p);
@@ -993,10 +1698,28 @@ seaf_db_trans_check_for_existence (SeafDBTrans *trans,
     return ret;
 }
 
-int
-seaf_db_trans_foreach_selected_row (SeafDBTrans *trans, const char *sql, 
-                                    SeafDBRowFunc callback, void *data,
-                                    int n, ...)
+gboolean
+seaf_db_trans_check_for_existence (SeafDBTrans *trans,
+                                   const char *sql,
+                                   gboolean *db_err,
+                                   int n, ...)
+{
+    gint64 start = now_usec ();
+    va_list args;
+    gboolean ret;
+
+    va_start (args, n);
+    ret = trans_check_for_existence_va (trans, sql, db_err, n, args);
+    va_end (args);
+
+    account_query (trans->db, sql, start, *db_err);
+    return ret;
+}
+
+static int
+trans_foreach_selected_row_va (SeafDBTrans *trans, const char *sql,
+                               SeafDBRowFunc callback, void *data,
+                               int n, va_list args)
 {
     ResultSet_T result;
     SeafDBRow seaf_row;
@@ -1008,13 +1731,8 @@ seaf_db_trans_foreach_selected_row (SeafDBTrans *trans, const char *sql,
     if (!p)
         return FALSE;
 
-    va_list args;
-    va_start (args, n);
-    if (set_parameters_va (p, n, args) < 0) {
-        va_end (args);
+    if (set_parameters_va (p, n, args) < 0)
         return -1;
-    }
-    va_end (args);
 
     TRY
         result = PreparedStatement_executeQuery (p);
@@ -1038,3 +1756,462 @@ seaf_db_trans_foreach_selected_row (SeafDBTrans *trans, const char *sql,
 
     return n_rows;
 }
+
+int
+seaf_db_trans_foreach_selected_row (SeafDBTrans *trans, const char *sql,
+                                    SeafDBRowFunc callback, void *data,
+                                    int n, ...)
+{
+    gint64 start = now_usec ();
+    va_list args;
+    int ret;
+
+    va_start (args, n);
+    ret = trans_foreach_selected_row_va (trans, sql, callback, data, n, args);
+    va_end (args);
+
+    account_query (trans->db, sql, start, ret < 0);
+    return ret;
+}
+
+/* Batched statements */
+
+/* Rows per multi-row statement, well within the parameter limits. */
+#define BATCH_ROWS 100
+
+enum {
+    PARAM_INT,
+    PARAM_INT64,
+    PARAM_STRING,
+};
+
+typedef struct BatchParam {
+    int type;
+    gint64 x;
+    char *s;
+} BatchParam;
+
+struct SeafDBBatch {
+    SeafDBTrans *trans;
+    gboolean own_trans;
+    char *sql_head;
+    char *sql_tail;
+    int n_columns;
+
+    BatchParam *params;         /* BATCH_ROWS rows */
+    int n_rows;
+    /* The statement of a full batch, reused for every full batch. */
+    PreparedStatement_T full_p;
+    gboolean failed;
+};
+
+/* Read @n (type, value) pairs from @args into @params. */
+static int
+collect_params_va (BatchParam *params, int n, va_list args)
+{
+    int i;
+    const char *type;
+
+    for (i = 0; i < n; ++i) {
+        type = va_arg (args, const char *);
+        if (strcmp(type, "int") == 0) {
+            params[i].type = PARAM_INT;
+            params[i].x = va_arg (args, int);
+        } else if (strcmp (type, "int64") == 0) {
+            params[i].type = PARAM_INT64;
+            params[i].x = va_arg (args, gint64);
+        } else if (strcmp (type, "string") == 0) {
+            params[i].type = PARAM_STRING;
+            params[i].s = g_strdup (va_arg (args, const char *));
+        } else {
+            g_warning ("BUG: invalid prep stmt parameter type %s.\n", type);
+            g_return_val_if_reached (-1);
+        }
+    }
+
+    return 0;
+}
+
+static int
+set_collected_params (PreparedStatement_T p, int offset,
+                      BatchParam *params, int n)
+{
+    int i, rc = 0;
+
+    for (i = 0; i < n && rc == 0; ++i) {
+        switch (params[i].type) {
+        case PARAM_INT:
+            rc = seaf_db_statement_set_int (p, offset + i + 1, (int)params[i].x);
+            break;
+        case PARAM_INT64:
+            rc = seaf_db_statement_set_int64 (p, offset + i + 1, params[i].x);
+            break;
+        default:
+            rc = seaf_db_statement_set_string (p, offset + i + 1, params[i].s);
+            break;
+        }
+    }
+
+    return rc;
+}
+
+static void
+clear_params (BatchParam *params, int n)
+{
+    int i;
+
+    for (i = 0; i < n; ++i) {
+        g_free (params[i].s);
+        params[i].s = NULL;
+    }
+}
+
+/* "(?,?,?),(?,?,?)" for @n_rows rows of @n_columns. */
+static void
+append_placeholders (GString *sql, int n_rows, int n_columns)
+{
+    int i, j;
+
+    for (i = 0; i < n_rows; ++i) {
+        g_string_append (sql, i == 0 ? "(" : ",(");
+        for (j = 0; j < n_columns; ++j)
+            g_string_append (sql, j == 0 ? "?" : ",?");
+        g_string_append_c (sql, ')');
+    }
+}
+
+static PreparedStatement_T
+prepare_batch_statement (SeafDBBatch *batch, int n_rows)
+{
+    GString *sql = g_string_new (batch->sql_head);
+    PreparedStatement_T p;
+
+    g_string_append_c (sql, ' ');
+    append_placeholders (sql, n_rows, batch->n_columns);
+    if (batch->sql_tail) {
+        g_string_append_c (sql, ' ');
+        g_string_append (sql, batch->sql_tail);
+    }
+
+    p = trans_prepare_statement (batch->trans->conn, sql->str);
+    g_string_free (sql, TRUE);
+    return p;
+}
+
+static int
+flush_batch (SeafDBBatch *batch)
+{
+    PreparedStatement_T p;
+    int n_rows = batch->n_rows;
+    gint64 start;
+
+    if (n_rows == 0)
+        return 0;
+    batch->n_rows = 0;
+
+    if (batch->failed)
+        goto out;
+
+    start = now_usec ();
+
+    if (n_rows == BATCH_ROWS) {
+        if (!batch->full_p)
+            batch->full_p = prepare_batch_statement (batch, n_rows);
+        p = batch->full_p;
+    } else {
+        p = prepare_batch_statement (batch, n_rows);
+    }
+    if (!p) {
+        batch->failed = TRUE;
+        goto out;
+    }
+
+    if (set_collected_params (p, 0, batch->params,
+                              n_rows * batch->n_columns) < 0) {
+        batch->failed = TRUE;
+        goto out;
+    }
+
+    TRY
+        PreparedStatement_execute (p);
+    CATCH (SQLException)
+        g_warning ("Error exec batch stmt: %s.\n", Exception_frame.message);
+        batch->failed = TRUE;
+    END_TRY;
+
+    /* All batches of a statement are counted under its head. */
+    account_query (batch->trans->db, batch->sql_head, start, batch->failed);
+
+out:
+    clear_params (batch->params, n_rows * batch->n_columns);
+    return batch->failed ? -1 : 0;
+}
+
+SeafDBBatch *
+seaf_db_batch_new (SeafDB *db, SeafDBTrans *trans,
+                   const char *sql_head, const char *sql_tail,
+                   int n_columns)
+{
+    SeafDBBatch *batch;
+
+    if (n_columns <= 0)
+        return NULL;
+
+    batch = g_new0 (SeafDBBatch, 1);
+    if (trans) {
+        batch->trans = trans;
+    } else {
+        batch->trans = seaf_db_begin_transaction (db);
+        if (!batch->trans) {
+            g_free (batch);
+            return NULL;
+        }
+        batch->own_trans = TRUE;
+    }
+
+    batch->sql_head = g_strdup (sql_head);
+    batch->sql_tail = g_strdup (sql_tail);
+    batch->n_columns = n_columns;
+    batch->params = g_new0 (BatchParam, BATCH_ROWS * n_columns);
+
+    return batch;
+}
+
+int
+seaf_db_batch_add_row (SeafDBBatch *batch, ...)
+{
+    va_list args;
+    int rc;
+
+    va_start (args, batch);
+    rc = collect_params_va (&batch->params[batch->n_rows * batch->n_columns],
+                            batch->n_columns, args);
+    va_end (args);
+
+    ++batch->n_rows;
+    if (rc < 0) {
+        batch->failed = TRUE;
+        return -1;
+    }
+
+    if (batch->n_rows == BATCH_ROWS)
+        return flush_batch (batch);
+
+    return batch->failed ? -1 : 0;
+}
+
+int
+seaf_db_batch_finish (SeafDBBatch *batch)
+{
+    int ret;
+
+    flush_batch (batch);
+    ret = batch->failed ? -1 : 0;
+
+    if (batch->own_trans) {
+        if (ret == 0 && seaf_db_commit (batch->trans) < 0)
+            ret = -1;
+        if (ret < 0)
+            seaf_db_rollback (batch->trans);
+        seaf_db_trans_close (batch->trans);
+    }
+
+    g_free (batch->sql_head);
+    g_free (batch->sql_tail);
+    g_free (batch->params);
+    g_free (batch);
+
+    return ret;
+}
+
+/* @sql with its "%s" replaced by @n_values placeholders. */
+static char *
+expand_in_list (const char *sql, int n_values)
+{
+    const char *mark = strstr (sql, "%s");
+    GString *buf;
+    int i;
+
+    if (!mark) {
+        g_warning ("BUG: no %%s for the IN list in %s.\n", sql);
+        return NULL;
+    }
+
+    buf = g_string_new_len (sql, mark - sql);
+    for (i = 0; i < n_values; ++i)
+        g_string_append (buf, i == 0 ? "?" : ",?");
+    g_string_append (buf, mark + 2);
+
+    return g_string_free (buf, FALSE);
+}
+
+int
+seaf_db_statement_query_in (SeafDB *db, SeafDBTrans *trans,
+                            const char *sql, GList *values, int n, ...)
+{
+    BatchParam *params = NULL;
+    SeafDBStatement *stmt = NULL;
+    PreparedStatement_T p;
+    GList *ptr;
+    char *chunk_sql;
+    int n_left, n_values, i;
+    gint64 start;
+    volatile int ret = 0;
+
+    if (!values)
+        return 0;
+
+    if (n > 0) {
+        va_list args;
+        params = g_new0 (BatchParam, n);
+        va_start (args, n);
+        ret = collect_params_va (params, n, args);
+        va_end (args);
+        if (ret < 0)
+            goto out;
+    }
+
+    ptr = values;
+    n_left = g_list_length (values);
+    while (ptr && ret == 0) {
+        n_values = MIN (n_left, BATCH_ROWS);
+        n_left -= n_values;
+        chunk_sql = expand_in_list (sql, n_values);
+        if (!chunk_sql) {
+            ret = -1;
+            break;
+        }
+
+        start = now_usec ();
+        if (trans) {
+            p = trans_prepare_statement (trans->conn, chunk_sql);
+        } else {
+            stmt = seaf_db_prepare_statement (db, chunk_sql, TRUE);
+            p = stmt ? stmt->p : NULL;
+            /* Count all chunks under the statement they come from. */
+            if (stmt)
+                stmt->sql = sql;
+        }
+        g_free (chunk_sql);
+        if (!p) {
+            ret = -1;
+            break;
+        }
+
+        if (set_collected_params (p, 0, params, n) < 0)
+            ret = -1;
+        for (i = 0; i < n_values && ret == 0; ++i, ptr = ptr->next) {
+            if (seaf_db_statement_set_string (p, n + i + 1, ptr->data) < 0)
+                ret = -1;
+        }
+
+        if (ret == 0) {
+            TRY
+                PreparedStatement_execute (p);
+            CATCH (SQLException)
+                g_warning ("Error exec prep stmt: %s.\n", Exception_frame.message);
+                if (stmt)
+                    statement_failed (stmt);
+                ret = -1;
+            END_TRY;
+        }
+
+        if (stmt) {
+            seaf_db_statement_free (stmt);
+            stmt = NULL;
+        } else {
+            account_query (trans->db, sql, start, ret < 0);
+        }
+    }
+
+out:
+    if (params) {
+        clear_params (params, n);
+        g_free (params);
+    }
+    return ret;
+}
+
+int
+seaf_db_statement_foreach_row_in (SeafDB *db, const char *sql, GList *values,
+                                  SeafDBRowFunc callback, void *data,
+                                  int n, ...)
+{
+    BatchParam *params = NULL;
+    SeafDBStatement *stmt;
+    ResultSet_T result;
+    SeafDBRow seaf_row;
+    GList *ptr;
+    char *chunk_sql;
+    int n_left, n_values, i;
+    volatile gboolean stop = FALSE;
+    volatile int ret = 0;
+    volatile int n_rows = 0;
+
+    if (!values)
+        return 0;
+
+    if (n > 0) {
+        va_list args;
+        params = g_new0 (BatchParam, n);
+        va_start (args, n);
+        ret = collect_params_va (params, n, args);
+        va_end (args);
+        if (ret < 0)
+            goto out;
+    }
+
+    ptr = values;
+    n_left = g_list_length (values);
+    while (ptr && ret == 0 && !stop) {
+        n_values = MIN (n_left, BATCH_ROWS);
+        n_left -= n_values;
+        chunk_sql = expand_in_list (sql, n_values);
+        if (!chunk_sql) {
+            ret = -1;
+            break;
+        }
+
+        stmt = seaf_db_prepare_statement (db, chunk_sql, FALSE);
+        g_free (chunk_sql);
+        if (!stmt) {
+            ret = -1;
+            break;
+        }
+        stmt->sql = sql;
+
+        if (set_collected_params (stmt->p, 0, params, n) < 0)
+            ret = -1;
+        for (i = 0; i < n_values && ret == 0; ++i, ptr = ptr->next) {
+            if (seaf_db_statement_set_string (stmt->p, n + i + 1, ptr->data) < 0)
+                ret = -1;
+        }
+
+        if (ret == 0) {
+            TRY
+                result = PreparedStatement_executeQuery (stmt->p);
+                seaf_row.res = result;
+                while (ResultSet_next (result)) {
+                    n_rows++;
+                    if (!callback (&seaf_row, data)) {
+                        stop = TRUE;
+                        break;
+                    }
+                }
+            CATCH (SQLException)
+                g_warning ("Error exec prep stmt: %s.\n", Exception_frame.message);
+                statement_failed (stmt);
+                ret = -1;
+            END_TRY;
+        }
+
+        seaf_db_statement_free (stmt);
+    }
+
+out:
+    if (params) {
+        clear_params (params, n);
+        g_free (params);
+    }
+    return ret < 0 ? -1 : n_rows;
+}
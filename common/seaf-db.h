@@ -34,12 +34,70 @@ seaf_db_new_pgsql (const char *host,
 SeafDB *
 seaf_db_new_sqlite (const char *db_path, int max_connections);
 
+/*
+ * Read replicas. Reads outside of transactions go to the replicas in
+ * turn, writes and transactions go to the primary. After a thread writes,
+ * its reads go to the primary for a few seconds, so they see the write.
+ * Reads also go to the primary when no replica is up.
+ */
+
+int
+seaf_db_add_mysql_replica (SeafDB *db,
+                           const char *host,
+                           const char *port,
+                           const char *user,
+                           const char *passwd,
+                           const char *db_name,
+                           const char *unix_socket,
+                           gboolean use_ssl,
+                           const char *charset,
+                           int max_connections);
+
+int
+seaf_db_add_pgsql_replica (SeafDB *db,
+                           const char *host,
+                           const char *user,
+                           const char *passwd,
+                           const char *db_name,
+                           const char *unix_socket);
+
+/* How long reads stay on the primary after a write, 5 seconds by default. */
+void
+seaf_db_set_read_after_write (SeafDB *db, int seconds);
+
 void
 seaf_db_free (SeafDB *db);
 
 int
 seaf_db_type (SeafDB *db);
 
+typedef struct SeafDBPoolStats {
+    int size;                   /* connections open */
+    int active;                 /* connections in use */
+    int max;
+    int waiting;                /* threads waiting for a free connection */
+    int n_replicas;
+} SeafDBPoolStats;
+
+/* Usage of the connection pool of the primary. */
+void
+seaf_db_get_pool_stats (SeafDB *db, SeafDBPoolStats *stats);
+
+/*
+ * Statements and transactions taking at least @msec are logged with their
+ * SQL, 1000 by default. 0 turns the log off.
+ */
+void
+seaf_db_set_slow_query_threshold (SeafDB *db, int msec);
+
+/*
+ * Count, errors, total and max time of each prepared statement and of
+ * transactions, and the time spent waiting for pool connections, as a
+ * JSON object. Statements are sorted by total time.
+ */
+char *
+seaf_db_get_query_stats (SeafDB *db);
+
 int
 seaf_db_query (SeafDB *db, const char *sql);
 
@@ -126,4 +184,55 @@ seaf_db_statement_get_int64 (SeafDB *db, const char *sql, int n, ...);
 char *
 seaf_db_statement_get_string (SeafDB *db, const char *sql, int n, ...);
 
+/* Batched statements */
+
+typedef struct SeafDBBatch SeafDBBatch;
+
+/*
+ * Insert rows of @n_columns parameters with multi-row statements
+ * "@sql_head (?,...),(?,...) @sql_tail", up to 100 rows each. @sql_head
+ * ends with "VALUES", and @sql_tail may add an upsert clause for the
+ * db type, or be NULL.
+ *
+ * The statements run in @trans, or in a transaction of the batch itself
+ * if @trans is NULL, which is committed by seaf_db_batch_finish().
+ */
+SeafDBBatch *
+seaf_db_batch_new (SeafDB *db, SeafDBTrans *trans,
+                   const char *sql_head, const char *sql_tail,
+                   int n_columns);
+
+/* Add a row of @n_columns (type, value) pairs, like the parameters of
+ * seaf_db_statement_query(). Rows may be sent before the batch finishes.
+ */
+int
+seaf_db_batch_add_row (SeafDBBatch *batch, ...);
+
+/*
+ * Send the rows left and free @batch. Returns -1 if any statement of the
+ * batch failed, in which case its own transaction is rolled back.
+ */
+int
+seaf_db_batch_finish (SeafDBBatch *batch);
+
+/*
+ * Run @sql with its "%s" replaced by a list of placeholders for the
+ * strings in @values, such as "DELETE FROM T WHERE id IN (%s)". Long
+ * lists are split over several statements. The @n parameters come
+ * before the list in @sql. Runs in @trans if it's given.
+ */
+int
+seaf_db_statement_query_in (SeafDB *db, SeafDBTrans *trans,
+                            const char *sql, GList *values, int n, ...);
+
+/*
+ * Like seaf_db_statement_query_in(), but for SELECT statements. Calls
+ * @callback on the rows of every statement. Returns the number of rows
+ * or -1 on error.
+ */
+int
+seaf_db_statement_foreach_row_in (SeafDB *db, const char *sql, GList *values,
+                                  SeafDBRowFunc callback, void *data,
+                                  int n, ...);
+
 #endif
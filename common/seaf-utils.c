@@ -52,6 +52,41 @@ sqlite_db_start (SeafileSession *session)
 
 #define MYSQL_DEFAULT_PORT "3306"
 
+/*
+ * [database]
+ * replica_hosts = db2, db3:3307
+ * replica_read_after_write = 5
+ *
+ * Replicas take the user, password and db name of the primary. Returns
+ * the replicas as a NULL terminated list of hosts.
+ */
+static char **
+load_replica_config (SeafileSession *session)
+{
+    char *hosts;
+    char **list;
+    int read_after_write;
+    GError *error = NULL;
+
+    hosts = g_key_file_get_string (session->config,
+                                   "database", "replica_hosts", NULL);
+    if (!hosts)
+        return NULL;
+
+    list = g_strsplit (hosts, ",", -1);
+    g_free (hosts);
+
+    read_after_write = g_key_file_get_integer (session->config, "database",
+                                               "replica_read_after_write",
+                                               &error);
+    if (!error)
+        seaf_db_set_read_after_write (session->db, read_after_write);
+    else
+        g_clear_error (&error);
+
+    return list;
+}
+
 static int
 mysql_db_start (SeafileSession *session)
 {
@@ -110,6 +145,23 @@ mysql_db_start (SeafileSession *session)
         return -1;
     }
 
+    char **replicas = load_replica_config (session);
+    char **ptr, *replica_host, *replica_port;
+    for (ptr = replicas; ptr && *ptr; ++ptr) {
+        replica_host = g_strstrip (*ptr);
+        if (*replica_host == 0)
+            continue;
+        replica_port = strchr (replica_host, ':');
+        if (replica_port)
+            *replica_port++ = 0;
+        if (seaf_db_add_mysql_replica (session->db, replica_host,
+                                       replica_port ? replica_port : port,
+                                       user, passwd, db, NULL,
+                                       use_ssl, charset, max_connections) < 0)
+            g_warning ("Failed to add db replica %s.\n", replica_host);
+    }
+    g_strfreev (replicas);
+
     g_free (host);
     g_free (port);
     g_free (user);
@@ -160,6 +212,18 @@ pgsql_db_start (SeafileSession *session)
         return -1;
     }
 
+    char **replicas = load_replica_config (session);
+    char **ptr, *replica_host;
+    for (ptr = replicas; ptr && *ptr; ++ptr) {
+        replica_host = g_strstrip (*ptr);
+        if (*replica_host == 0)
+            continue;
+        if (seaf_db_add_pgsql_replica (session->db, replica_host,
+                                       user, passwd, db, NULL) < 0)
+            g_warning ("Failed to add db replica %s.\n", replica_host);
+    }
+    g_strfreev (replicas);
+
     g_free (host);
     g_free (user);
     g_free (passwd);
@@ -169,11 +233,31 @@ pgsql_db_start (SeafileSession *session)
     return 0;
 }
 
+/*
+ * [database]
+ * slow_query_threshold = 1000   # ms, 0 to not log slow queries
+ */
+static void
+load_slow_query_config (SeafileSession *session)
+{
+    GError *error = NULL;
+    int msec;
+
+    msec = g_key_file_get_integer (session->config, "database",
+                                   "slow_query_threshold", &error);
+    if (error) {
+        g_clear_error (&error);
+        return;
+    }
+    seaf_db_set_slow_query_threshold (session->db, msec);
+}
+
 int
 load_database_config (SeafileSession *session)
 {
     char *type;
     GError *error = NULL;
+    int ret;
 
     type = g_key_file_get_string (session->config, "database", "type", &error);
     /* Default to use sqlite if not set. */
@@ -181,17 +265,20 @@ load_database_config (SeafileSession *session)
         type = "sqlite";
 
     if (strcasecmp (type, "sqlite") == 0) {
-        return sqlite_db_start (session);
+        ret = sqlite_db_start (session);
     } else if (strcasecmp (type, "mysql") == 0) {
-        return mysql_db_start (session);
+        ret = mysql_db_start (session);
     } else if (strcasecmp (type, "pgsql") == 0) {
-        return pgsql_db_start (session);
+        ret = pgsql_db_start (session);
     } else {
         g_warning ("Unsupported db type %s.\n", type);
         return -1;
     }
 
-    return 0;
+    if (ret == 0)
+        load_slow_query_config (session);
+
+    return ret;
 }
 
 #endif
@@ -1,9 +1,11 @@
 /* -*- Mode: C; tab-width: 4; indent-tabs-mode: nil; c-basic-offset: 4 -*- */
 
 #include <string.h>
+#include <pthread.h>
 #include <glib.h>
 #include "seafile-crypt.h"
 #include <openssl/rand.h>
+#include <openssl/crypto.h>
 
 #include "utils.h"
 #include "log.h"
@@ -237,210 +239,308 @@ seafile_update_random_key (const char *old_passwd, const char *old_random_key,
     return 0;
 }
 
-int
-seafile_encrypt (char **data_out,
-                 int *out_len,
-                 const char *data_in,
-                 const int in_len,
-                 SeafileCrypt *crypt)
+/*
+ * Per-thread cipher contexts.
+ *
+ * Setting up a context expands the key, which costs about as much as
+ * encrypting a small block. Each thread keeps one context for encryption
+ * and one for decryption. While blocks of the same repo are processed,
+ * only the IV is reset between blocks.
+ */
+
+typedef struct CipherCache {
+    EVP_CIPHER_CTX enc_ctx;
+    EVP_CIPHER_CTX dec_ctx;
+    gboolean enc_valid;
+    gboolean dec_valid;
+    /* The key the contexts are set up with. */
+    SeafileCrypt enc_crypt;
+    SeafileCrypt dec_crypt;
+} CipherCache;
+
+static pthread_key_t cipher_cache_key;
+static pthread_once_t cipher_cache_once = PTHREAD_ONCE_INIT;
+
+static void
+cipher_cache_free (void *data)
 {
-    *data_out = NULL;
-    *out_len = -1;
+    CipherCache *cache = data;
+
+    if (cache->enc_valid)
+        EVP_CIPHER_CTX_cleanup (&cache->enc_ctx);
+    if (cache->dec_valid)
+        EVP_CIPHER_CTX_cleanup (&cache->dec_ctx);
+    /* Like the derived keys, the copies mustn't outlive their use. */
+    OPENSSL_cleanse (&cache->enc_crypt, sizeof(SeafileCrypt));
+    OPENSSL_cleanse (&cache->dec_crypt, sizeof(SeafileCrypt));
+    g_free (cache);
+}
 
-    /* check validation */
-    if ( data_in == NULL || in_len <= 0 || crypt == NULL) {
-        g_warning ("Invalid params.\n");
-        return -1;
-    }
+static void
+cipher_cache_key_init ()
+{
+    pthread_key_create (&cipher_cache_key, cipher_cache_free);
+}
 
-    EVP_CIPHER_CTX ctx;
-    int ret;
-    int blks;
+static CipherCache *
+get_cipher_cache ()
+{
+    CipherCache *cache;
 
-    /* Prepare CTX for encryption. */
-    EVP_CIPHER_CTX_init (&ctx);
+    pthread_once (&cipher_cache_once, cipher_cache_key_init);
 
-    if (crypt->version == 2)
-        ret = EVP_EncryptInit_ex (&ctx,
-                                  EVP_aes_256_cbc(), /* cipher mode */
-                                  NULL, /* engine, NULL for default */
-                                  crypt->key,  /* derived key */
-                                  crypt->iv);  /* initial vector */
-    else if (crypt->version == 1)
-        ret = EVP_EncryptInit_ex (&ctx,
-                                  EVP_aes_128_cbc(), /* cipher mode */
-                                  NULL, /* engine, NULL for default */
-                                  crypt->key,  /* derived key */
-                                  crypt->iv);  /* initial vector */
+    cache = pthread_getspecific (cipher_cache_key);
+    if (!cache) {
+        cache = g_new0 (CipherCache, 1);
+        pthread_setspecific (cipher_cache_key, cache);
+    }
+
+    return cache;
+}
+
+static const EVP_CIPHER *
+get_cipher (int version)
+{
+    if (version == 2)
+        return EVP_aes_256_cbc();
+    else if (version == 1)
+        return EVP_aes_128_cbc();
     else
-        ret = EVP_EncryptInit_ex (&ctx,
-                                  EVP_aes_128_ecb(), /* cipher mode */
-                                  NULL, /* engine, NULL for default */
-                                  crypt->key,  /* derived key */
-                                  crypt->iv);  /* initial vector */
+        return EVP_aes_128_ecb();
+}
 
-    if (ret == ENC_FAILURE)
-        return -1;
+static gboolean
+same_key (const SeafileCrypt *a, const SeafileCrypt *b)
+{
+    int key_len = (a->version == 2) ? 32 : 16;
 
-    /* Allocating output buffer. */
-    
-    /*
-      For EVP symmetric encryption, padding is always used __even if__
-      data size is a multiple of block size, in which case the padding
-      length is the block size. so we have the following:
-    */
-    
-    blks = (in_len / BLK_SIZE) + 1;
+    return (a->version == b->version &&
+            memcmp (a->key, b->key, key_len) == 0 &&
+            memcmp (a->iv, b->iv, sizeof(a->iv)) == 0);
+}
+
+/* Prepare the cached context of this thread for @crypt. Returns NULL
+ * on failure.
+ */
+static EVP_CIPHER_CTX *
+get_cipher_ctx (SeafileCrypt *crypt, gboolean encrypt)
+{
+    CipherCache *cache = get_cipher_cache ();
+    EVP_CIPHER_CTX *ctx = encrypt ? &cache->enc_ctx : &cache->dec_ctx;
+    gboolean *valid = encrypt ? &cache->enc_valid : &cache->dec_valid;
+    SeafileCrypt *cached = encrypt ? &cache->enc_crypt : &cache->dec_crypt;
+    int ret;
+
+    if (*valid && same_key (cached, crypt)) {
+        /* Only reset the IV, the expanded key is kept. */
+        ret = EVP_CipherInit_ex (ctx, NULL, NULL, NULL, crypt->iv,
+                                 encrypt ? 1 : 0);
+    } else {
+        if (*valid)
+            EVP_CIPHER_CTX_cleanup (ctx);
+        EVP_CIPHER_CTX_init (ctx);
+        *valid = TRUE;
+        memcpy (cached, crypt, sizeof(SeafileCrypt));
+        ret = EVP_CipherInit_ex (ctx,
+                                 get_cipher (crypt->version),
+                                 NULL, /* engine, NULL for default */
+                                 crypt->key,  /* derived key */
+                                 crypt->iv,  /* initial vector */
+                                 encrypt ? 1 : 0);
+    }
 
-    *data_out = (char *)g_malloc (blks * BLK_SIZE);
+    if (ret == ENC_FAILURE) {
+        EVP_CIPHER_CTX_cleanup (ctx);
+        OPENSSL_cleanse (cached, sizeof(SeafileCrypt));
+        *valid = FALSE;
+        return NULL;
+    }
 
-    if (*data_out == NULL) {
-        g_warning ("failed to allocate the output buffer.\n");
-        goto enc_error;
-    }                
+    return ctx;
+}
+
+/* Drop the cached context after an error, so that the next call starts
+ * from a clean state.
+ */
+static void
+reset_cipher_ctx (gboolean encrypt)
+{
+    CipherCache *cache = get_cipher_cache ();
+
+    if (encrypt && cache->enc_valid) {
+        EVP_CIPHER_CTX_cleanup (&cache->enc_ctx);
+        OPENSSL_cleanse (&cache->enc_crypt, sizeof(SeafileCrypt));
+        cache->enc_valid = FALSE;
+    } else if (!encrypt && cache->dec_valid) {
+        EVP_CIPHER_CTX_cleanup (&cache->dec_ctx);
+        OPENSSL_cleanse (&cache->dec_crypt, sizeof(SeafileCrypt));
+        cache->dec_valid = FALSE;
+    }
+}
 
+int
+seafile_encrypt_to_buf (char *data_out,
+                        int *out_len,
+                        const char *data_in,
+                        const int in_len,
+                        SeafileCrypt *crypt)
+{
+    EVP_CIPHER_CTX *ctx;
     int update_len, final_len;
+    int ret;
+
+    *out_len = -1;
+
+    /* check validation */
+    if (data_out == NULL || data_in == NULL || in_len <= 0 || crypt == NULL) {
+        g_warning ("Invalid params.\n");
+        return -1;
+    }
+
+    ctx = get_cipher_ctx (crypt, TRUE);
+    if (!ctx)
+        return -1;
 
     /* Do the encryption. */
-    ret = EVP_EncryptUpdate (&ctx,
-                             (unsigned char*)*data_out,
+    ret = EVP_EncryptUpdate (ctx,
+                             (unsigned char*)data_out,
                              &update_len,
                              (unsigned char*)data_in,
                              in_len);
-
     if (ret == ENC_FAILURE)
         goto enc_error;
 
-
     /* Finish the possible partial block. */
-    ret = EVP_EncryptFinal_ex (&ctx,
-                               (unsigned char*)*data_out + update_len,
+    ret = EVP_EncryptFinal_ex (ctx,
+                               (unsigned char*)data_out + update_len,
                                &final_len);
 
-    *out_len = update_len + final_len;
-
     /* out_len should be equal to the allocated buffer size. */
-    if (ret == ENC_FAILURE || *out_len != (blks * BLK_SIZE))
+    if (ret == ENC_FAILURE ||
+        update_len + final_len != seafile_encrypted_len (in_len))
         goto enc_error;
-    
-    EVP_CIPHER_CTX_cleanup (&ctx);
 
+    *out_len = update_len + final_len;
     return 0;
 
 enc_error:
-
-    EVP_CIPHER_CTX_cleanup (&ctx);
-
-    *out_len = -1;
-
-    if (*data_out != NULL)
-        g_free (*data_out);
-
-    *data_out = NULL;
-
+    reset_cipher_ctx (TRUE);
     return -1;
-    
 }
-                               
-
-    
 
 int
-seafile_decrypt (char **data_out,
-                 int *out_len,
-                 const char *data_in,
-                 const int in_len,
-                 SeafileCrypt *crypt)
+seafile_decrypt_to_buf (char *data_out,
+                        int *out_len,
+                        const char *data_in,
+                        const int in_len,
+                        SeafileCrypt *crypt)
 {
-    *data_out = NULL;
+    EVP_CIPHER_CTX *ctx;
+    int update_len, final_len;
+    int ret;
+
     *out_len = -1;
 
     /* Check validation. Because padding is always used, in_len must
      * be a multiple of BLK_SIZE */
-    if ( data_in == NULL || in_len <= 0 || in_len % BLK_SIZE != 0 ||
-         crypt == NULL) {
-
+    if (data_out == NULL || data_in == NULL || in_len <= 0 ||
+        in_len % BLK_SIZE != 0 || crypt == NULL) {
         g_warning ("Invalid param(s).\n");
         return -1;
     }
 
-    EVP_CIPHER_CTX ctx;
-    int ret;
-
-    /* Prepare CTX for decryption. */
-    EVP_CIPHER_CTX_init (&ctx);
-
-    if (crypt->version == 2)
-        ret = EVP_DecryptInit_ex (&ctx,
-                                  EVP_aes_256_cbc(), /* cipher mode */
-                                  NULL, /* engine, NULL for default */
-                                  crypt->key,  /* derived key */
-                                  crypt->iv);  /* initial vector */
-    else if (crypt->version == 1)
-        ret = EVP_DecryptInit_ex (&ctx,
-                                  EVP_aes_128_cbc(), /* cipher mode */
-                                  NULL, /* engine, NULL for default */
-                                  crypt->key,  /* derived key */
-                                  crypt->iv);  /* initial vector */
-    else
-        ret = EVP_DecryptInit_ex (&ctx,
-                                  EVP_aes_128_ecb(), /* cipher mode */
-                                  NULL, /* engine, NULL for default */
-                                  crypt->key,  /* derived key */
-                                  crypt->iv);  /* initial vector */
-
-    if (ret == DEC_FAILURE)
+    ctx = get_cipher_ctx (crypt, FALSE);
+    if (!ctx)
         return -1;
 
-    /* Allocating output buffer. */
-    
-    *data_out = (char *)g_malloc (in_len);
-
-    if (*data_out == NULL) {
-        g_warning ("failed to allocate the output buffer.\n");
-        goto dec_error;
-    }                
-
-    int update_len, final_len;
-
     /* Do the decryption. */
-    ret = EVP_DecryptUpdate (&ctx,
-                             (unsigned char*)*data_out,
+    ret = EVP_DecryptUpdate (ctx,
+                             (unsigned char*)data_out,
                              &update_len,
                              (unsigned char*)data_in,
                              in_len);
-
     if (ret == DEC_FAILURE)
         goto dec_error;
 
-
     /* Finish the possible partial block. */
-    ret = EVP_DecryptFinal_ex (&ctx,
-                               (unsigned char*)*data_out + update_len,
+    ret = EVP_DecryptFinal_ex (ctx,
+                               (unsigned char*)data_out + update_len,
                                &final_len);
 
-    *out_len = update_len + final_len;
-
     /* out_len should be smaller than in_len. */
-    if (ret == DEC_FAILURE || *out_len > in_len)
+    if (ret == DEC_FAILURE || update_len + final_len > in_len)
         goto dec_error;
 
-    EVP_CIPHER_CTX_cleanup (&ctx);
-    
+    *out_len = update_len + final_len;
     return 0;
 
 dec_error:
+    reset_cipher_ctx (FALSE);
+    return -1;
+}
 
-    EVP_CIPHER_CTX_cleanup (&ctx);
-
+int
+seafile_encrypt (char **data_out,
+                 int *out_len,
+                 const char *data_in,
+                 const int in_len,
+                 SeafileCrypt *crypt)
+{
+    *data_out = NULL;
     *out_len = -1;
-    if (*data_out != NULL)
+
+    /* check validation */
+    if ( data_in == NULL || in_len <= 0 || crypt == NULL) {
+        g_warning ("Invalid params.\n");
+        return -1;
+    }
+
+    /*
+      For EVP symmetric encryption, padding is always used __even if__
+      data size is a multiple of block size, in which case the padding
+      length is the block size.
+    */
+    *data_out = (char *)g_malloc (seafile_encrypted_len (in_len));
+
+    if (seafile_encrypt_to_buf (*data_out, out_len,
+                                data_in, in_len, crypt) < 0) {
         g_free (*data_out);
+        *data_out = NULL;
+        return -1;
+    }
+
+    return 0;
+}
 
+int
+seafile_decrypt (char **data_out,
+                 int *out_len,
+                 const char *data_in,
+                 const int in_len,
+                 SeafileCrypt *crypt)
+{
     *data_out = NULL;
+    *out_len = -1;
 
-    return -1;
-    
+    /* Check validation. Because padding is always used, in_len must
+     * be a multiple of BLK_SIZE */
+    if ( data_in == NULL || in_len <= 0 || in_len % BLK_SIZE != 0 ||
+         crypt == NULL) {
+
+        g_warning ("Invalid param(s).\n");
+        return -1;
+    }
+
+    *data_out = (char *)g_malloc (in_len);
+
+    if (seafile_decrypt_to_buf (*data_out, out_len,
+                                data_in, in_len, crypt) < 0) {
+        g_free (*data_out);
+        *data_out = NULL;
+        return -1;
+    }
+
+    return 0;
 }
 
 int
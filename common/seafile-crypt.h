@@ -97,6 +97,34 @@ seafile_decrypt (char **data_out,
                  const int in_len,
                  SeafileCrypt *crypt);
 
+/* Size of the output of encrypting @in_len bytes. Padding is always
+ * added, even if @in_len is a multiple of BLK_SIZE.
+ */
+#define seafile_encrypted_len(in_len) ((((in_len) / BLK_SIZE) + 1) * BLK_SIZE)
+
+/*
+  Like seafile_encrypt/seafile_decrypt, but write to the caller's buffer
+  @data_out, which must hold seafile_encrypted_len(in_len) bytes for
+  encryption and @in_len bytes for decryption.
+
+  Cipher contexts are set up once per thread and reused for as long as
+  the same key is used, so these are cheap to call block by block, from
+  several threads at once.
+*/
+int
+seafile_encrypt_to_buf (char *data_out,
+                        int *out_len,
+                        const char *data_in,
+                        const int in_len,
+                        SeafileCrypt *crypt);
+
+int
+seafile_decrypt_to_buf (char *data_out,
+                        int *out_len,
+                        const char *data_in,
+                        const int in_len,
+                        SeafileCrypt *crypt);
+
 int
 seafile_decrypt_init (EVP_CIPHER_CTX *ctx,
                       int version,
@@ -12,7 +12,7 @@ static void add_entry(struct unpack_trees_options *o, struct cache_entry *ce,
     unsigned int size = ce_size(ce);
     struct cache_entry *new = malloc(size);
 
-    clear |= CE_HASHED | CE_UNHASHED;
+    clear |= CE_HASHED | CE_UNHASHED | CE_STORAGE_MASK;
 
     if (set & CE_REMOVE)
         set |= CE_WT_REMOVE;
@@ -20,7 +20,7 @@ static void add_entry(struct unpack_trees_options *o, struct cache_entry *ce,
     memcpy(new, ce, size);
     new->next = NULL;
     new->ce_flags = (new->ce_flags & ~clear) | set;
-    new->modifier = g_strdup(ce->modifier);
+    new->modifier = g_strdup(ce_modifier(ce));
     add_index_entry(&o->result, new, ADD_CACHE_OK_TO_ADD|ADD_CACHE_OK_TO_REPLACE);
 }
 
@@ -529,6 +529,76 @@ static void debug_unpack_callback(int n,
         debug_name_entry(i, names + i);
 }
 
+/*
+ * In a 3-way merge, a dir whose remote tree is the same as in head or in
+ * the common ancestor has no changes to take from the remote. Whatever
+ * is in the index for it is the merge result.
+ */
+static int remote_tree_unchanged(int n, unsigned long mask, unsigned long dirmask,
+                                 const struct name_entry *names,
+                                 const struct traverse_info *info)
+{
+    if (n != 3 || mask != dirmask || info->conflicts)
+        return 0;
+    if (!names[2].mode)
+        return 0;
+    if (names[1].mode && !hashcmp(names[1].sha1, names[2].sha1))
+        return 1;
+    if (names[0].mode && !hashcmp(names[0].sha1, names[2].sha1))
+        return 1;
+    return 0;
+}
+
+/*
+ * All the trees have the same dir, and the index entries under it are
+ * still the ones that dir was committed from.
+ */
+static int trees_match_index(int n, unsigned long mask, unsigned long dirmask,
+                             const struct name_entry *names,
+                             const struct traverse_info *info,
+                             const char *path, int len)
+{
+    struct unpack_trees_options *o = info->data;
+    int i;
+
+    if (mask != dirmask || mask != (1ul << n) - 1 || info->conflicts)
+        return 0;
+    for (i = 1; i < n; i++) {
+        if (hashcmp(names[0].sha1, names[i].sha1))
+            return 0;
+    }
+    return index_tree_id_matches(o->src_index, path, len, names[0].sha1);
+}
+
+static void keep_index_subtree(const struct name_entry *p,
+                               const struct traverse_info *info)
+{
+    struct unpack_trees_options *o = info->data;
+    struct index_state *index = o->src_index;
+    int len = traverse_path_len(info, p);
+    char *prefix = malloc(len + 2);
+    int pos;
+
+    make_traverse_path(prefix, info, p);
+    prefix[len] = '/';
+    prefix[len + 1] = '\0';
+
+    pos = index_name_pos(index, prefix, len + 1);
+    if (pos < 0)
+        pos = -pos - 1;
+    for (; pos < index->cache_nr; pos++) {
+        struct cache_entry *ce = index->cache[pos];
+        if (strncmp(ce->name, prefix, len + 1) != 0)
+            break;
+        if (ce->ce_flags & CE_UNPACKED)
+            continue;
+        add_entry(o, ce, 0, 0);
+        mark_ce_used(ce, o);
+    }
+
+    free(prefix);
+}
+
 static int unpack_callback(int n, unsigned long mask, unsigned long dirmask, struct name_entry *names, struct traverse_info *info)
 {
     struct cache_entry *src[MAX_UNPACK_TREES + 1] = { NULL, };
@@ -623,6 +693,28 @@ static int unpack_callback(int n, unsigned long mask, unsigned long dirmask, str
         }
 #endif
 
+        if (o->skip_unchanged_trees && o->merge && !src[0] &&
+            remote_tree_unchanged(n, mask, dirmask, names, info)) {
+            keep_index_subtree(p, info);
+            return mask;
+        }
+
+        /* Nothing to do under a dir no tree or the index changed. */
+        if (o->merge && !src[0] && o->src_index->tree_ids) {
+            int len = traverse_path_len(info, p);
+            char *path = malloc(len + 1);
+            int same_dir;
+
+            make_traverse_path(path, info, p);
+            same_dir = trees_match_index(n, mask, dirmask, names, info,
+                                         path, len);
+            free(path);
+            if (same_dir) {
+                keep_index_subtree(p, info);
+                return mask;
+            }
+        }
+
         if (traverse_trees_recursive(n, dirmask, conflicts,
                                      names, info) < 0)
             return -1;
@@ -659,6 +751,9 @@ int unpack_trees(unsigned len, struct tree_desc *t, struct unpack_trees_options
     o->result.timestamp.sec = o->src_index->timestamp.sec;
     o->result.timestamp.nsec = o->src_index->timestamp.nsec;
     o->merge_size = len;
+    /* The ids check their own entries, so they hold for the result too. */
+    if (o->src_index->tree_ids)
+        o->result.tree_ids = g_hash_table_ref(o->src_index->tree_ids);
     mark_all_ce_unused(o->src_index);
 
     if (!dfc)
@@ -38,7 +38,10 @@ struct unpack_trees_options {
         debug_unpack,
         skip_sparse_checkout,
         gently,
-        show_all_errors;
+        show_all_errors,
+        /* 3-way merge: keep the index entries of dirs the remote tree
+         * didn't change, without descending into them. */
+        skip_unchanged_trees;
     char repo_id[37];
     int version;
     const char *prefix;
@@ -216,6 +216,18 @@ get_merge_base (SeafCommit *head, SeafCommit *remote)
     SeafCommit *one, **twos;
     int n, i;
     SeafCommit *ret = NULL;
+    char ca_id[41];
+
+    if (seaf_commit_manager_get_merge_base (seaf->commit_mgr,
+                                            head->repo_id, head->version,
+                                            head->commit_id, remote->commit_id,
+                                            ca_id) == 0) {
+        if (ca_id[0] == '\0')
+            return NULL;
+        return seaf_commit_manager_get_commit (seaf->commit_mgr,
+                                               head->repo_id, head->version,
+                                               ca_id);
+    }
 
     one = head;
     twos = (SeafCommit **) calloc (1, sizeof(SeafCommit *));
@@ -273,11 +285,27 @@ vc_compare_commits (const char *repo_id, int version,
 {
     SeafCommit *commit1, *commit2, *ca;
     VCCompareResult ret;
+    int res1, res2;
 
     /* Treat the same as up-to-date. */
     if (strcmp (c1, c2) == 0)
         return VC_UP_TO_DATE;
 
+    /* Try the commit graph first, then fall back to parsing the commits. */
+    res1 = seaf_commit_manager_is_ancestor (seaf->commit_mgr, repo_id, version,
+                                            c1, c2, NULL, 0, FALSE);
+    if (res1 == 1)
+        return VC_UP_TO_DATE;
+    if (res1 == 0) {
+        res2 = seaf_commit_manager_is_ancestor (seaf->commit_mgr,
+                                                repo_id, version,
+                                                c2, c1, NULL, 0, FALSE);
+        if (res2 == 1)
+            return VC_FAST_FORWARD;
+        else if (res2 == 0)
+            return VC_INDEPENDENT;
+    }
+
     commit1 = seaf_commit_manager_get_commit (seaf->commit_mgr, repo_id, version, c1);
     if (!commit1)
         return VC_INDEPENDENT;
@@ -0,0 +1,104 @@
+/* -*- Mode: C; tab-width: 4; indent-tabs-mode: nil; c-basic-offset: 4 -*- */
+
+#include "common.h"
+
+#include <unistd.h>
+#include <string.h>
+
+#include <glib.h>
+
+#include "utils.h"
+#include "proc-stats.h"
+
+#ifdef __linux__
+
+/* Fields of /proc/<pid>/stat after the command name, see proc(5). */
+static int
+read_stat (int pid, guint64 *cpu_ticks, int *n_threads, gint64 *rss_pages)
+{
+    char path[64];
+    char *contents = NULL, *p;
+    unsigned long utime, stime;
+    long threads, rss;
+    int ret = -1;
+
+    snprintf (path, sizeof(path), "/proc/%d/stat", pid);
+    if (!g_file_get_contents (path, &contents, NULL, NULL))
+        return -1;
+
+    /* The command name may contain spaces and parentheses. */
+    p = strrchr (contents, ')');
+    if (!p)
+        goto out;
+
+    if (sscanf (p + 2,
+                "%*c %*d %*d %*d %*d %*d %*u %*u %*u %*u %*u "
+                "%lu %lu %*d %*d %*d %*d %ld %*d %*u %*u %ld",
+                &utime, &stime, &threads, &rss) != 4)
+        goto out;
+
+    *cpu_ticks = (guint64)utime + stime;
+    *n_threads = (int)threads;
+    *rss_pages = rss;
+    ret = 0;
+
+out:
+    g_free (contents);
+    return ret;
+}
+
+static int
+count_fds (int pid)
+{
+    char path[64];
+    GDir *dir;
+    int n = 0;
+
+    snprintf (path, sizeof(path), "/proc/%d/fd", pid);
+    dir = g_dir_open (path, 0, NULL);
+    if (!dir)
+        return -1;
+    while (g_dir_read_name (dir) != NULL)
+        ++n;
+    g_dir_close (dir);
+
+    return n;
+}
+
+int
+proc_stats_sample (int pid, ProcStats *stats)
+{
+    guint64 cpu_ticks;
+    gint64 rss_pages, now;
+    int n_threads;
+    long hz = sysconf (_SC_CLK_TCK);
+
+    if (read_stat (pid, &cpu_ticks, &n_threads, &rss_pages) < 0)
+        return -1;
+
+    now = get_current_time ();
+    if (stats->pid == pid && now > stats->sampled_at && hz > 0)
+        stats->cpu_percent = (double)(cpu_ticks - stats->cpu_ticks) / hz
+            * 1000000 / (now - stats->sampled_at) * 100;
+    else
+        stats->cpu_percent = 0;
+
+    stats->pid = pid;
+    stats->cpu_ticks = cpu_ticks;
+    stats->sampled_at = now;
+    stats->n_threads = n_threads;
+    stats->rss = rss_pages * sysconf (_SC_PAGESIZE);
+    stats->n_fds = count_fds (pid);
+
+    return 0;
+}
+
+#else
+
+int
+proc_stats_sample (int pid, ProcStats *stats)
+{
+    return -1;
+}
+
+#endif
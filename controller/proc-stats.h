@@ -0,0 +1,31 @@
+/* -*- Mode: C; tab-width: 4; indent-tabs-mode: nil; c-basic-offset: 4 -*- */
+
+#ifndef PROC_STATS_H
+#define PROC_STATS_H
+
+#include <glib.h>
+
+/*
+ * Resource usage of a process, read from /proc. Only available on Linux.
+ */
+typedef struct ProcStats {
+    int pid;
+    double cpu_percent;         /* of one core, since the previous sample */
+    gint64 rss;                 /* bytes */
+    int n_fds;
+    int n_threads;
+
+    /* For the CPU usage of the next sample. */
+    guint64 cpu_ticks;
+    gint64 sampled_at;
+} ProcStats;
+
+/*
+ * Sample @pid into @stats. CPU usage is computed against the previous
+ * sample in @stats, and is 0 for the first sample of a process.
+ * Returns -1 if the process is gone or can't be read.
+ */
+int
+proc_stats_sample (int pid, ProcStats *stats);
+
+#endif
@@ -9,15 +9,26 @@
 #include <errno.h>
 #include <string.h>
 #include <getopt.h>
+#include <fcntl.h>
 
 #include <glib.h>
 #include <ccnet.h>
 
 #include "utils.h"
 #include "log.h"
+#include "fileserver-config.h"
 #include "seafile-controller.h"
 
 #define CHECK_PROCESS_INTERVAL 10        /* every 10 seconds */
+#define CONNECT_CCNET_INTERVAL 50        /* ms, before the first connect */
+#define MAX_CONNECT_CCNET_INTERVAL 1000
+/* Seconds to wait for a process to report it's ready before going on. */
+#define READY_TIMEOUT 120
+#define MAX_SYNC_WORKERS 64
+
+/* Seconds a process restarted by the watchdog has to exit on SIGTERM. */
+#define WATCHDOG_STOP_TIMEOUT 30
+#define DEFAULT_WATCHDOG_CHECKS 3
 
 SeafileController *ctl;
 
@@ -47,6 +58,8 @@ static const struct option long_opts[] = {
 static void controller_exit (int code) __attribute__((noreturn));
 
 static int read_seafdav_config();
+static int read_sync_workers_config();
+static int read_watchdog_config();
 
 static void
 controller_exit (int code)
@@ -61,9 +74,12 @@ controller_exit (int code)
 // Utility functions Start
 //
 
-/* returns the pid of the newly created process */
+/*
+ * Returns the pid of the newly created process. If @ready_fd is not -1,
+ * the process gets a copy of it, and its number in SEAFILE_READY_FD.
+ */
 static int
-spawn_process (char *argv[])
+spawn_process (char *argv[], int ready_fd)
 {
     char **ptr = argv;
     GString *buf = g_string_new(argv[0]);
@@ -77,6 +93,14 @@ spawn_process (char *argv[])
 
     if (pid == 0) {
         /* child process */
+        if (ready_fd >= 0) {
+            char fd_str[16];
+            /* The copy isn't closed on exec. */
+            snprintf (fd_str, sizeof(fd_str), "%d", dup (ready_fd));
+            g_setenv ("SEAFILE_READY_FD", fd_str, TRUE);
+        } else {
+            g_unsetenv ("SEAFILE_READY_FD");
+        }
         execvp (argv[0], argv);
         seaf_warning ("failed to execvp %s\n", argv[0]);
         exit(-1);
@@ -125,12 +149,8 @@ read_pid_from_pidfile (const char *pidfile)
 }
 
 static void
-try_kill_process(int which)
+kill_by_pidfile (const char *pidfile)
 {
-    if (which < 0 || which >= N_PID)
-        return;
-
-    char *pidfile = ctl->pidfile[which];
     int pid = read_pid_from_pidfile(pidfile);
     if (pid > 0) {
         // if SIGTERM send success, then remove related pid file
@@ -140,11 +160,190 @@ try_kill_process(int which)
     }
 }
 
+static void
+try_kill_process(int which)
+{
+    if (which < 0 || which >= N_PID)
+        return;
+
+    kill_by_pidfile (ctl->pidfile[which]);
+}
+
 
 //
 // Utility functions End
 //
 
+//
+// Startup phases Start
+//
+
+static void check_startup_progress ();
+
+static gint64
+phase_msec (StartupPhase *phase)
+{
+    return (phase->ready_time - phase->start_time) / 1000;
+}
+
+static void
+cancel_ready_wait (StartupPhase *phase)
+{
+    if (phase->ready_watch != 0) {
+        g_source_remove (phase->ready_watch);
+        phase->ready_watch = 0;
+    }
+    if (phase->ready_timeout != 0) {
+        g_source_remove (phase->ready_timeout);
+        phase->ready_timeout = 0;
+    }
+}
+
+static void
+set_phase_ready (StartupPhase *phase)
+{
+    phase->ready_time = get_current_time ();
+    seaf_message ("%s is ready after %"G_GINT64_FORMAT" ms.\n",
+                  phase->name, phase_msec (phase));
+    check_startup_progress ();
+}
+
+static gboolean
+on_ready_pipe (GIOChannel *source, GIOCondition condition, gpointer data)
+{
+    StartupPhase *phase = data;
+    char c;
+
+    phase->ready_watch = 0;
+    cancel_ready_wait (phase);
+
+    if ((condition & G_IO_IN) &&
+        read (g_io_channel_unix_get_fd (source), &c, 1) == 1) {
+        set_phase_ready (phase);
+    } else {
+        /* Restarted by the process monitor. */
+        seaf_warning ("%s exited before it was ready.\n", phase->name);
+    }
+
+    /* Closes the pipe. */
+    return FALSE;
+}
+
+static gboolean
+on_ready_timeout (gpointer data)
+{
+    StartupPhase *phase = data;
+
+    phase->ready_timeout = 0;
+    cancel_ready_wait (phase);
+
+    /* It may not support SEAFILE_READY_FD. */
+    seaf_warning ("%s is not ready after %d seconds, going on.\n",
+                  phase->name, READY_TIMEOUT);
+    set_phase_ready (phase);
+
+    return FALSE;
+}
+
+/*
+ * Spawns a process that writes a byte to SEAFILE_READY_FD once it serves
+ * requests, and records its startup in @phase.
+ */
+static int
+spawn_with_ready_pipe (char *argv[], StartupPhase *phase)
+{
+    GIOChannel *channel;
+    int fds[2];
+    int pid;
+
+    cancel_ready_wait (phase);
+    phase->start_time = get_current_time ();
+    phase->ready_time = 0;
+
+    if (pipe (fds) < 0) {
+        seaf_warning ("Failed to create pipe: %s.\n", strerror(errno));
+        pid = spawn_process (argv, -1);
+        if (pid > 0)
+            set_phase_ready (phase);
+        return pid;
+    }
+    /* Other processes mustn't hold the pipe open. */
+    fcntl (fds[0], F_SETFD, FD_CLOEXEC);
+    fcntl (fds[1], F_SETFD, FD_CLOEXEC);
+
+    pid = spawn_process (argv, fds[1]);
+    close (fds[1]);
+    if (pid <= 0) {
+        close (fds[0]);
+        return pid;
+    }
+
+    channel = g_io_channel_unix_new (fds[0]);
+    g_io_channel_set_close_on_unref (channel, TRUE);
+    phase->ready_watch = g_io_add_watch (channel, G_IO_IN | G_IO_HUP | G_IO_ERR,
+                                         on_ready_pipe, phase);
+    g_io_channel_unref (channel);
+    phase->ready_timeout = g_timeout_add_seconds (READY_TIMEOUT,
+                                                  on_ready_timeout, phase);
+
+    return pid;
+}
+
+static void
+reset_startup ()
+{
+    int i;
+
+    for (i = 0; i < N_PID; ++i) {
+        cancel_ready_wait (&ctl->startup[i]);
+        ctl->startup[i].start_time = ctl->startup[i].ready_time = 0;
+    }
+    for (i = 0; i < ctl->n_sync_workers; ++i) {
+        cancel_ready_wait (&ctl->worker_startup[i]);
+        ctl->worker_startup[i].start_time = ctl->worker_startup[i].ready_time = 0;
+    }
+
+    ctl->startup_begin = get_current_time ();
+    ctl->startup_end = 0;
+    ctl->seafdav_checked = FALSE;
+}
+
+static void
+append_phase_stats (GString *buf, StartupPhase *phase)
+{
+    if (phase->start_time == 0)
+        return;
+
+    if (buf->str[buf->len - 1] != '[')
+        g_string_append (buf, ", ");
+    g_string_append_printf (buf, "{\"name\": \"%s\", \"ready\": %s, "
+                            "\"msec\": %"G_GINT64_FORMAT"}",
+                            phase->name, phase->ready_time ? "true" : "false",
+                            phase->ready_time ? phase_msec (phase) : 0);
+}
+
+static void
+append_startup_stats (GString *buf)
+{
+    int i;
+
+    g_string_append_printf (buf, "\"startup\": {\"finished\": %s, "
+                            "\"msec\": %"G_GINT64_FORMAT", \"phases\": [",
+                            ctl->startup_end ? "true" : "false",
+                            ctl->startup_end ?
+                            (ctl->startup_end - ctl->startup_begin) / 1000 : 0);
+    append_phase_stats (buf, &ctl->startup[PID_CCNET]);
+    append_phase_stats (buf, &ctl->startup[PID_SERVER]);
+    for (i = 0; i < ctl->n_sync_workers; ++i)
+        append_phase_stats (buf, &ctl->worker_startup[i]);
+    append_phase_stats (buf, &ctl->startup[PID_SEAFDAV]);
+    g_string_append (buf, "]}");
+}
+
+//
+// Startup phases End
+//
+
 static int
 start_ccnet_server ()
 {
@@ -167,7 +366,12 @@ start_ccnet_server ()
         "-P", ctl->pidfile[PID_CCNET],
         NULL};
 
-    int pid = spawn_process (argv);
+    StartupPhase *phase = &ctl->startup[PID_CCNET];
+    g_strlcpy (phase->name, "ccnet-server", sizeof(phase->name));
+    phase->start_time = get_current_time ();
+    phase->ready_time = 0;
+
+    int pid = spawn_process (argv, -1);
     if (pid <= 0) {
         seaf_warning ("Failed to spawn ccnet-server\n");
         return -1;
@@ -201,7 +405,10 @@ start_seaf_server ()
         argv[9] = NULL;
     }
 
-    int pid = spawn_process (argv);
+    StartupPhase *phase = &ctl->startup[PID_SERVER];
+    g_strlcpy (phase->name, "seaf-server", sizeof(phase->name));
+
+    int pid = spawn_with_ready_pipe (argv, phase);
     if (pid <= 0) {
         seaf_warning ("Failed to spawn seaf-server\n");
         return -1;
@@ -210,6 +417,47 @@ start_seaf_server ()
     return 0;
 }
 
+static int
+start_sync_worker (int i)
+{
+    char *logfile;
+    char name[64];
+
+    if (!ctl->config_dir || !ctl->seafile_dir)
+        return -1;
+
+    seaf_message ("starting sync worker %d ...\n", i);
+
+    snprintf (name, sizeof(name), "seafile-worker-%d.log", i);
+    logfile = g_build_filename (ctl->logdir, name, NULL);
+
+    char *argv[] = {
+        "seaf-server",
+        "-c", ctl->config_dir,
+        "-d", ctl->seafile_dir,
+        "-l", logfile,
+        "-P", ctl->worker_pidfiles[i],
+        "-w",
+        "-C",
+        NULL};
+
+    if (!ctl->cloud_mode) {
+        argv[10] = NULL;
+    }
+
+    StartupPhase *phase = &ctl->worker_startup[i];
+    snprintf (phase->name, sizeof(phase->name), "sync worker %d", i);
+
+    int pid = spawn_with_ready_pipe (argv, phase);
+    g_free (logfile);
+    if (pid <= 0) {
+        seaf_warning ("Failed to spawn sync worker %d\n", i);
+        return -1;
+    }
+
+    return 0;
+}
+
 static const char *
 get_python_executable() {
     static const char *python = NULL;
@@ -369,13 +617,20 @@ start_seafdav() {
         args = argv;
     }
 
-    int pid = spawn_process (args);
+    StartupPhase *phase = &ctl->startup[PID_SEAFDAV];
+    g_strlcpy (phase->name, "seafdav", sizeof(phase->name));
+    phase->start_time = get_current_time ();
+
+    int pid = spawn_process (args, -1);
 
     if (pid <= 0) {
         seaf_warning ("Failed to spawn seafdav\n");
         return -1;
     }
 
+    /* seafdav doesn't report when it's ready. */
+    phase->ready_time = phase->start_time;
+
     return 0;
 }
 
@@ -388,17 +643,14 @@ run_controller_loop ()
 }
 
 static gboolean
-need_restart (int which)
+pidfile_need_restart (const char *pidfile)
 {
-    if (which < 0 || which >= N_PID)
-        return FALSE;
-
-    int pid = read_pid_from_pidfile (ctl->pidfile[which]);
+    int pid = read_pid_from_pidfile (pidfile);
     if (pid == PID_ERROR_ENOENT) {
-        seaf_warning ("pid file %s does not exist\n", ctl->pidfile[which]);
+        seaf_warning ("pid file %s does not exist\n", pidfile);
         return TRUE;
     } else if (pid == PID_ERROR_OTHER) {
-        seaf_warning ("failed to read pidfile %s: %s\n", ctl->pidfile[which], strerror(errno));
+        seaf_warning ("failed to read pidfile %s: %s\n", pidfile, strerror(errno));
         return FALSE;
     } else {
         char buf[256];
@@ -411,21 +663,234 @@ need_restart (int which)
     }
 }
 
+static gboolean
+need_restart (int which)
+{
+    if (which < 0 || which >= N_PID)
+        return FALSE;
+
+    return pidfile_need_restart (ctl->pidfile[which]);
+}
+
+static gboolean
+process_alive (int pid)
+{
+    char buf[64];
+    snprintf (buf, sizeof(buf), "/proc/%d", pid);
+    return g_file_test (buf, G_FILE_TEST_IS_DIR);
+}
+
+//
+// Watchdog Start
+//
+
+/*
+ * Whether @w is still exiting after the watchdog stopped it. It is killed
+ * if it takes too long, and restarted by check_process() once it's gone.
+ */
+static gboolean
+watchdog_stopping (const char *name, WatchedProc *w)
+{
+    if (w->stopping_pid <= 0)
+        return FALSE;
+
+    if (!process_alive (w->stopping_pid)) {
+        w->stopping_pid = 0;
+        return FALSE;
+    }
+
+    if (get_current_time () >= w->stop_deadline) {
+        seaf_warning ("%s (pid %d) did not exit in %d seconds, killing it.\n",
+                      name, w->stopping_pid, WATCHDOG_STOP_TIMEOUT);
+        kill ((pid_t)w->stopping_pid, SIGKILL);
+    }
+    return TRUE;
+}
+
+/* Describes in @buf which limits @stats is over. */
+static gboolean
+over_limits (ProcStats *stats, GString *buf)
+{
+    WatchdogConfig *conf = &ctl->watchdog;
+
+    if (conf->max_rss > 0 && stats->rss > conf->max_rss)
+        g_string_append_printf (buf, " memory %"G_GINT64_FORMAT" MB > %"G_GINT64_FORMAT" MB",
+                                stats->rss >> 20, conf->max_rss >> 20);
+    if (conf->max_fds > 0 && stats->n_fds > conf->max_fds)
+        g_string_append_printf (buf, " open files %d > %d",
+                                stats->n_fds, conf->max_fds);
+    if (conf->max_threads > 0 && stats->n_threads > conf->max_threads)
+        g_string_append_printf (buf, " threads %d > %d",
+                                stats->n_threads, conf->max_threads);
+    if (conf->max_cpu_percent > 0 && stats->cpu_percent > conf->max_cpu_percent)
+        g_string_append_printf (buf, " cpu %.0f%% > %d%%",
+                                stats->cpu_percent, conf->max_cpu_percent);
+
+    return buf->len > 0;
+}
+
+static void
+watch_process (const char *name, const char *pidfile, WatchedProc *w,
+               gboolean can_restart)
+{
+    GString *buf;
+    int pid;
+
+    w->has_stats = FALSE;
+    if (w->stopping_pid > 0)
+        return;
+
+    pid = read_pid_from_pidfile (pidfile);
+    if (pid <= 0 || proc_stats_sample (pid, &w->stats) < 0)
+        return;
+    w->has_stats = TRUE;
+
+    buf = g_string_new (NULL);
+    if (!over_limits (&w->stats, buf)) {
+        if (w->over_limit > 0)
+            seaf_message ("%s (pid %d) is back within the limits.\n", name, pid);
+        w->over_limit = 0;
+        goto out;
+    }
+
+    /* Only log when it goes over, not on every check. */
+    if (w->over_limit++ == 0)
+        seaf_warning ("%s (pid %d) is over the limits:%s.\n", name, pid, buf->str);
+
+    if (!ctl->watchdog.restart || !can_restart ||
+        w->over_limit < ctl->watchdog.checks)
+        goto out;
+
+    seaf_warning ("%s (pid %d) has been over the limits for %d checks:%s. "
+                  "Restarting it.\n", name, pid, w->over_limit, buf->str);
+    if (kill ((pid_t)pid, SIGTERM) == 0) {
+        g_unlink (pidfile);
+        w->stopping_pid = pid;
+        w->stop_deadline = get_current_time () +
+            (gint64)WATCHDOG_STOP_TIMEOUT * G_USEC_PER_SEC;
+        w->over_limit = 0;
+        w->restarts++;
+        w->has_stats = FALSE;
+    }
+
+out:
+    g_string_free (buf, TRUE);
+}
+
+static void
+append_proc_stats (GString *buf, const char *name, WatchedProc *w)
+{
+    if (!w->has_stats)
+        return;
+
+    if (buf->str[buf->len - 1] != '[')
+        g_string_append (buf, ", ");
+    g_string_append_printf (buf, "{\"name\": \"%s\", \"pid\": %d, "
+                            "\"cpu_percent\": %.1f, \"rss\": %"G_GINT64_FORMAT", "
+                            "\"open_fds\": %d, \"threads\": %d, "
+                            "\"over_limit_checks\": %d, \"watchdog_restarts\": %d}",
+                            name, w->stats.pid, w->stats.cpu_percent,
+                            w->stats.rss, w->stats.n_fds, w->stats.n_threads,
+                            w->over_limit, w->restarts);
+}
+
+/* Written on every check, read by seaf-monitor-tool process-stats. */
+static void
+write_stats_file ()
+{
+    WatchdogConfig *conf = &ctl->watchdog;
+    GString *buf = g_string_new (NULL);
+    GError *error = NULL;
+    char name[64];
+    int i;
+
+    g_string_append_printf (buf, "{\"time\": %"G_GINT64_FORMAT", "
+                            "\"limits\": {\"max_rss\": %"G_GINT64_FORMAT", "
+                            "\"max_open_fds\": %d, \"max_threads\": %d, "
+                            "\"max_cpu_percent\": %d, \"restart\": %s}, "
+                            "\"processes\": [",
+                            get_current_time () / G_USEC_PER_SEC,
+                            conf->max_rss, conf->max_fds, conf->max_threads,
+                            conf->max_cpu_percent,
+                            conf->restart ? "true" : "false");
+
+    append_proc_stats (buf, "ccnet-server", &ctl->watched[PID_CCNET]);
+    append_proc_stats (buf, "seaf-server", &ctl->watched[PID_SERVER]);
+    for (i = 0; i < ctl->n_sync_workers; ++i) {
+        snprintf (name, sizeof(name), "sync-worker-%d", i);
+        append_proc_stats (buf, name, &ctl->watched_workers[i]);
+    }
+    append_proc_stats (buf, "seafdav", &ctl->watched[PID_SEAFDAV]);
+    g_string_append (buf, "], ");
+    append_startup_stats (buf);
+    g_string_append (buf, "}\n");
+
+    if (!g_file_set_contents (ctl->stats_file, buf->str, buf->len, &error)) {
+        seaf_warning ("Failed to write %s: %s\n", ctl->stats_file, error->message);
+        g_clear_error (&error);
+    }
+    g_string_free (buf, TRUE);
+}
+
+static void
+watchdog_check ()
+{
+    char name[64];
+    int i;
+
+    /* Restarting ccnet-server means restarting everything, so only warn. */
+    watch_process ("ccnet-server", ctl->pidfile[PID_CCNET],
+                   &ctl->watched[PID_CCNET], FALSE);
+    watch_process ("seaf-server", ctl->pidfile[PID_SERVER],
+                   &ctl->watched[PID_SERVER], TRUE);
+    for (i = 0; i < ctl->n_sync_workers; ++i) {
+        snprintf (name, sizeof(name), "sync worker %d", i);
+        watch_process (name, ctl->worker_pidfiles[i],
+                       &ctl->watched_workers[i], TRUE);
+    }
+    if (ctl->seafdav_config.enabled)
+        watch_process ("seafdav", ctl->pidfile[PID_SEAFDAV],
+                       &ctl->watched[PID_SEAFDAV], TRUE);
+
+    write_stats_file ();
+}
+
+//
+// Watchdog End
+//
+
 static gboolean
 check_process (void *data)
 {
-    if (need_restart(PID_SERVER)) {
+    char name[64];
+    int i;
+
+    if (!watchdog_stopping ("seaf-server", &ctl->watched[PID_SERVER]) &&
+        need_restart(PID_SERVER)) {
         seaf_message ("seaf-server need restart...\n");
         start_seaf_server ();
     }
 
-    if (ctl->seafdav_config.enabled) {
-        if (need_restart(PID_SEAFDAV)) {
+    for (i = 0; i < ctl->n_sync_workers; ++i) {
+        snprintf (name, sizeof(name), "sync worker %d", i);
+        if (!watchdog_stopping (name, &ctl->watched_workers[i]) &&
+            pidfile_need_restart (ctl->worker_pidfiles[i])) {
+            seaf_message ("sync worker %d need restart...\n", i);
+            start_sync_worker (i);
+        }
+    }
+
+    /* Started by check_startup_progress() first. */
+    if (ctl->seafdav_config.enabled && ctl->seafdav_checked) {
+        if (!watchdog_stopping ("seafdav", &ctl->watched[PID_SEAFDAV]) &&
+            need_restart(PID_SEAFDAV)) {
             seaf_message ("seafdav need restart...\n");
             start_seafdav ();
         }
     }
 
+    watchdog_check ();
+
     return TRUE;
 }
 
@@ -515,19 +980,62 @@ rm_client_fd_from_mainloop ()
     }
 }
 
+/*
+ * Called whenever a process gets ready. seafdav needs seaf-server, and
+ * startup is finished once seaf-server and the sync workers are ready.
+ */
 static void
-on_ccnet_connected ()
+check_startup_progress ()
 {
-    if (start_seaf_server () < 0)
-        controller_exit(1);
+    StartupPhase *slowest = NULL;
+    int i;
 
-    if (ctl->seafdav_config.enabled) {
-        if (need_restart(PID_SEAFDAV)) {
+    if (ctl->startup_end != 0 || ctl->startup[PID_SERVER].ready_time == 0)
+        return;
+
+    /* Only tried once, the process monitor takes over. */
+    if (!ctl->seafdav_checked) {
+        ctl->seafdav_checked = TRUE;
+        if (!ctl->seafdav_config.enabled) {
+            seaf_message ("seafdav not enabled.\n");
+        } else if (need_restart(PID_SEAFDAV)) {
             if (start_seafdav() < 0)
                 controller_exit(1);
         }
-    } else {
-        seaf_message ("seafdav not enabled.\n");
+    }
+
+    for (i = 0; i < ctl->n_sync_workers; ++i) {
+        if (ctl->worker_startup[i].ready_time == 0)
+            return;
+        if (!slowest || phase_msec (&ctl->worker_startup[i]) > phase_msec (slowest))
+            slowest = &ctl->worker_startup[i];
+    }
+
+    ctl->startup_end = get_current_time ();
+    seaf_message ("Startup finished after %"G_GINT64_FORMAT" ms: "
+                  "ccnet-server %"G_GINT64_FORMAT" ms, "
+                  "seaf-server %"G_GINT64_FORMAT" ms, "
+                  "slowest sync worker %"G_GINT64_FORMAT" ms.\n",
+                  (ctl->startup_end - ctl->startup_begin) / 1000,
+                  phase_msec (&ctl->startup[PID_CCNET]),
+                  phase_msec (&ctl->startup[PID_SERVER]),
+                  slowest ? phase_msec (slowest) : 0);
+}
+
+static void
+on_ccnet_connected ()
+{
+    int i;
+
+    set_phase_ready (&ctl->startup[PID_CCNET]);
+
+    /* They only depend on ccnet-server, and report when they're ready. */
+    if (start_seaf_server () < 0)
+        controller_exit(1);
+
+    for (i = 0; i < ctl->n_sync_workers; ++i) {
+        if (start_sync_worker (i) < 0)
+            controller_exit(1);
     }
 
     add_client_fd_to_mainloop ();
@@ -535,6 +1043,19 @@ on_ccnet_connected ()
     start_process_monitor ();
 }
 
+static guint connect_interval;
+
+static gboolean do_connect_ccnet ();
+
+/* Tries soon after the start, then backs off to once a second. */
+static gboolean
+retry_connect_ccnet ()
+{
+    connect_interval = MIN (connect_interval * 2, MAX_CONNECT_CCNET_INTERVAL);
+    g_timeout_add (connect_interval, do_connect_ccnet, NULL);
+    return FALSE;
+}
+
 static gboolean
 do_connect_ccnet ()
 {
@@ -544,13 +1065,13 @@ do_connect_ccnet ()
 
     if (!client->connected) {
         if (ccnet_client_connect_daemon (client, CCNET_CLIENT_ASYNC) < 0) {
-            return TRUE;
+            return retry_connect_ccnet ();
         }
     }
 
     if (!sync_client->connected) {
         if (ccnet_client_connect_daemon (sync_client, CCNET_CLIENT_SYNC) < 0) {
-            return TRUE;
+            return retry_connect_ccnet ();
         }
     }
 
@@ -572,6 +1093,10 @@ stop_ccnet_server ()
     try_kill_process(PID_CCNET);
     try_kill_process(PID_SERVER);
     try_kill_process(PID_SEAFDAV);
+
+    int i;
+    for (i = 0; i < ctl->n_sync_workers; ++i)
+        kill_by_pidfile (ctl->worker_pidfiles[i]);
 }
 
 static void
@@ -588,6 +1113,17 @@ init_pidfile_path (SeafileController *ctl)
     ctl->pidfile[PID_CCNET] = g_build_filename (pid_dir, "ccnet.pid", NULL);
     ctl->pidfile[PID_SERVER] = g_build_filename (pid_dir, "seaf-server.pid", NULL);
     ctl->pidfile[PID_SEAFDAV] = g_build_filename (pid_dir, "seafdav.pid", NULL);
+    ctl->stats_file = g_build_filename (pid_dir, "process-stats.json", NULL);
+
+    int i;
+    char name[64];
+    ctl->worker_pidfiles = g_new0 (char *, ctl->n_sync_workers + 1);
+    for (i = 0; i < ctl->n_sync_workers; ++i) {
+        snprintf (name, sizeof(name), "seaf-worker-%d.pid", i);
+        ctl->worker_pidfiles[i] = g_build_filename (pid_dir, name, NULL);
+    }
+    ctl->watched_workers = g_new0 (WatchedProc, ctl->n_sync_workers + 1);
+    ctl->worker_startup = g_new0 (StartupPhase, ctl->n_sync_workers + 1);
 }
 
 static int
@@ -641,6 +1177,14 @@ seaf_controller_init (SeafileController *ctl,
         return -1;
     }
 
+    if (read_sync_workers_config() < 0) {
+        return -1;
+    }
+
+    if (read_watchdog_config() < 0) {
+        return -1;
+    }
+
     init_pidfile_path (ctl);
     setup_env ();
 
@@ -650,12 +1194,16 @@ seaf_controller_init (SeafileController *ctl,
 static int
 seaf_controller_start ()
 {
+    reset_startup ();
+
     if (start_ccnet_server () < 0) {
         seaf_warning ("Failed to start ccnet server\n");
         return -1;
     }
 
-    g_timeout_add (1000 * 1, do_connect_ccnet, NULL);
+    /* ccnet-server is ready once it accepts connections. */
+    connect_interval = CONNECT_CCNET_INTERVAL;
+    g_timeout_add (connect_interval, do_connect_ccnet, NULL);
 
     return 0;
 }
@@ -870,6 +1418,144 @@ out:
     return ret;
 }
 
+/*
+ * [fileserver]
+ * sync_workers = 4
+ * sync_worker_port = 8083
+ *
+ * The workers only serve the sync API, on their own port, and can't take
+ * requests that need web access tokens, see http-server.c.
+ */
+static int
+read_sync_workers_config()
+{
+    int ret = 0;
+    char *seafile_conf = NULL;
+    GKeyFile *key_file = NULL;
+    GError *error = NULL;
+    int n;
+
+    seafile_conf = g_build_filename(ctl->seafile_dir, "seafile.conf", NULL);
+    if (!g_file_test(seafile_conf, G_FILE_TEST_EXISTS)) {
+        goto out;
+    }
+
+    key_file = g_key_file_new ();
+    if (!g_key_file_load_from_file (key_file, seafile_conf,
+                                    G_KEY_FILE_NONE, NULL)) {
+        seaf_warning("Failed to load seafile.conf\n");
+        ret = -1;
+        goto out;
+    }
+
+    n = fileserver_config_get_integer (key_file, "sync_workers", &error);
+    if (error != NULL) {
+        g_clear_error (&error);
+        goto out;
+    }
+
+    if (n < 0 || n > MAX_SYNC_WORKERS) {
+        seaf_warning("Invalid sync_workers %d, should be 0 to %d\n",
+                     n, MAX_SYNC_WORKERS);
+        ret = -1;
+        goto out;
+    }
+    ctl->n_sync_workers = n;
+
+out:
+    if (key_file) {
+        g_key_file_free (key_file);
+    }
+    g_free (seafile_conf);
+
+    return ret;
+}
+
+static int
+get_watchdog_integer (GKeyFile *key_file, const char *key, int default_value)
+{
+    GError *error = NULL;
+    int value;
+
+    value = g_key_file_get_integer (key_file, "watchdog", key, &error);
+    if (error != NULL) {
+        if (error->code != G_KEY_FILE_ERROR_KEY_NOT_FOUND &&
+            error->code != G_KEY_FILE_ERROR_GROUP_NOT_FOUND) {
+            seaf_message ("Error when reading watchdog.%s, use default value %d\n",
+                          key, default_value);
+        }
+        g_clear_error (&error);
+        return default_value;
+    }
+
+    if (value < 0) {
+        seaf_message ("Invalid watchdog.%s %d, use default value %d\n",
+                      key, value, default_value);
+        return default_value;
+    }
+    return value;
+}
+
+/*
+ * [watchdog]
+ * max_rss_mb = 4096
+ * max_open_fds = 10000
+ * max_threads = 500
+ * max_cpu_percent = 0
+ * restart = true
+ * checks_before_restart = 3
+ *
+ * A process over any limit is logged. With restart, seaf-server, sync
+ * workers and seafdav are restarted once they have been over a limit for
+ * checks_before_restart checks in a row, CHECK_PROCESS_INTERVAL seconds
+ * apart. Limits are off when not set or 0.
+ */
+static int
+read_watchdog_config()
+{
+    int ret = 0;
+    char *seafile_conf = NULL;
+    GKeyFile *key_file = NULL;
+    GError *error = NULL;
+    WatchdogConfig *conf = &ctl->watchdog;
+
+    conf->checks = DEFAULT_WATCHDOG_CHECKS;
+
+    seafile_conf = g_build_filename(ctl->seafile_dir, "seafile.conf", NULL);
+    if (!g_file_test(seafile_conf, G_FILE_TEST_EXISTS)) {
+        goto out;
+    }
+
+    key_file = g_key_file_new ();
+    if (!g_key_file_load_from_file (key_file, seafile_conf,
+                                    G_KEY_FILE_NONE, NULL)) {
+        seaf_warning("Failed to load seafile.conf\n");
+        ret = -1;
+        goto out;
+    }
+
+    conf->max_rss = (gint64)get_watchdog_integer (key_file, "max_rss_mb", 0) << 20;
+    conf->max_fds = get_watchdog_integer (key_file, "max_open_fds", 0);
+    conf->max_threads = get_watchdog_integer (key_file, "max_threads", 0);
+    conf->max_cpu_percent = get_watchdog_integer (key_file, "max_cpu_percent", 0);
+    conf->checks = MAX (get_watchdog_integer (key_file, "checks_before_restart",
+                                              DEFAULT_WATCHDOG_CHECKS), 1);
+
+    conf->restart = g_key_file_get_boolean (key_file, "watchdog", "restart", &error);
+    if (error != NULL) {
+        conf->restart = FALSE;
+        g_clear_error (&error);
+    }
+
+out:
+    if (key_file) {
+        g_key_file_free (key_file);
+    }
+    g_free (seafile_conf);
+
+    return ret;
+}
+
 int main (int argc, char **argv)
 {
     if (argc <= 1) {
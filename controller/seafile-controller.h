@@ -7,19 +7,30 @@
  *
  *       - ccnet-server
  *       - seaf-server
+ *       - seaf-server sync workers, if sync_workers is set in seafile.conf
  *       - seaf-mon
  *
+ *       seaf-server and the sync workers are started together once
+ *       ccnet-server accepts connections, and seafdav once seaf-server
+ *       reports it's ready. The time of each phase is logged.
+ *
  *    2. Repair:
  *
  *       - ensure ccnet process availability by watching client->connfd
  *       - ensure server processes availablity by checking process is running periodically
  *         If some process has stopped working, try to restart it.
  *
+ *    3. Watch: record CPU, memory, open files and threads of the processes,
+ *       warn when they go over the limits in seafile.conf, and restart
+ *       processes that stay over them, if configured to.
+ *
  */
 
 #ifndef SEAFILE_CONTROLLER_H
 #define SEAFILE_CONTROLLER_H
 
+#include "proc-stats.h"
+
 typedef struct _SeafileController SeafileController;
 
 enum {
@@ -41,6 +52,37 @@ typedef struct SeafDavConfig {
 
 } SeafDavConfig;
 
+/* Limits are off when 0. */
+typedef struct WatchdogConfig {
+    gint64 max_rss;             /* bytes */
+    int max_fds;
+    int max_threads;
+    int max_cpu_percent;
+    /* Consecutive checks over a limit before restarting. */
+    int checks;
+    gboolean restart;
+} WatchdogConfig;
+
+typedef struct WatchedProc {
+    ProcStats stats;
+    gboolean has_stats;
+    int over_limit;             /* consecutive checks over a limit */
+    int restarts;
+    /* Sent SIGTERM by the watchdog, killed if still alive at the deadline. */
+    int stopping_pid;
+    gint64 stop_deadline;
+} WatchedProc;
+
+/* Times are from get_current_time(), 0 if not reached yet. */
+typedef struct StartupPhase {
+    char name[32];
+    gint64 start_time;
+    gint64 ready_time;
+    /* Waiting for the process to write to its ready pipe. */
+    guint ready_watch;
+    guint ready_timeout;
+} StartupPhase;
+
 struct _SeafileController {
     char *config_dir;
     char *seafile_dir;
@@ -59,5 +101,22 @@ struct _SeafileController {
     char                *pidfile[N_PID];
 
     SeafDavConfig       seafdav_config;
+
+    /* seaf-server -w processes sharing the sync worker port */
+    int                 n_sync_workers;
+    char                **worker_pidfiles;
+
+    WatchdogConfig      watchdog;
+    WatchedProc         watched[N_PID];
+    WatchedProc         *watched_workers;
+    /* Latest stats, for seaf-monitor-tool. */
+    char                *stats_file;
+
+    /* Last (re)start of ccnet-server, and of the processes depending on it. */
+    gint64              startup_begin;
+    gint64              startup_end;
+    StartupPhase        startup[N_PID];
+    StartupPhase        *worker_startup;
+    gboolean            seafdav_checked;
 };
 #endif
@@ -0,0 +1,211 @@
+/* -*- Mode: C; tab-width: 4; indent-tabs-mode: nil; c-basic-offset: 4 -*- */
+
+#include "common.h"
+
+#include <pthread.h>
+
+#include "seafile-session.h"
+#include "block-index.h"
+#include "utils.h"
+#include "log.h"
+
+/* Rebuild the index at the next download once it's this old. */
+#define INDEX_MAX_AGE 3600      /* seconds */
+
+typedef struct StoreBlocks {
+    char store_id[37];
+    int version;
+    unsigned char *ids;         /* sorted raw ids */
+    guint32 n_ids;
+} StoreBlocks;
+
+struct BlockIndex {
+    SeafileSession *seaf;
+    pthread_mutex_t lock;
+    GPtrArray *stores;          /* StoreBlocks, NULL until first built */
+    gint64 build_time;
+    gboolean building;
+};
+
+typedef struct BuildData {
+    BlockIndex *index;
+    GPtrArray *stores;
+} BuildData;
+
+static void
+store_blocks_free (StoreBlocks *sb)
+{
+    g_free (sb->ids);
+    g_free (sb);
+}
+
+static void
+free_stores (GPtrArray *stores)
+{
+    guint i;
+
+    for (i = 0; i < stores->len; ++i)
+        store_blocks_free (g_ptr_array_index (stores, i));
+    g_ptr_array_free (stores, TRUE);
+}
+
+BlockIndex *
+block_index_new (SeafileSession *seaf)
+{
+    BlockIndex *index = g_new0 (BlockIndex, 1);
+
+    index->seaf = seaf;
+    pthread_mutex_init (&index->lock, NULL);
+
+    return index;
+}
+
+static gboolean
+collect_block (const char *store_id, int version,
+               const char *block_id, void *user_data)
+{
+    GByteArray *ids = user_data;
+    unsigned char raw[20];
+
+    if (hex_to_rawdata (block_id, raw, 20) == 0)
+        g_byte_array_append (ids, raw, 20);
+
+    return TRUE;
+}
+
+static int
+cmp_raw_id (const void *a, const void *b)
+{
+    return memcmp (a, b, 20);
+}
+
+static void *
+build_index_thread (void *vdata)
+{
+    BuildData *data = vdata;
+    SeafBlockManager *mgr = data->index->seaf->block_mgr;
+    StoreBlocks *sb;
+    GByteArray *ids;
+    guint i;
+
+    for (i = 0; i < data->stores->len; ++i) {
+        sb = g_ptr_array_index (data->stores, i);
+
+        ids = g_byte_array_new ();
+        if (seaf_block_manager_foreach_block (mgr, sb->store_id, sb->version,
+                                              collect_block, ids) < 0)
+            seaf_warning ("Failed to list blocks of store %.8s.\n",
+                          sb->store_id);
+
+        sb->n_ids = ids->len / 20;
+        qsort (ids->data, sb->n_ids, 20, cmp_raw_id);
+        sb->ids = g_byte_array_free (ids, FALSE);
+    }
+
+    return vdata;
+}
+
+static void
+build_index_done (void *vdata)
+{
+    BuildData *data = vdata;
+    BlockIndex *index = data->index;
+    GPtrArray *old;
+
+    pthread_mutex_lock (&index->lock);
+    old = index->stores;
+    index->stores = data->stores;
+    index->build_time = (gint64)time(NULL);
+    index->building = FALSE;
+    pthread_mutex_unlock (&index->lock);
+
+    if (old)
+        free_stores (old);
+    g_free (data);
+}
+
+void
+block_index_prepare (BlockIndex *index)
+{
+    BuildData *data;
+    GList *repos, *ptr;
+    SeafRepo *repo;
+    StoreBlocks *sb;
+
+    if (index->building ||
+        (index->stores && (gint64)time(NULL) - index->build_time < INDEX_MAX_AGE))
+        return;
+
+    data = g_new0 (BuildData, 1);
+    data->index = index;
+    data->stores = g_ptr_array_new ();
+
+    /* The repo list is only safe to walk on the main thread. */
+    repos = seaf_repo_manager_get_repo_list (index->seaf->repo_mgr, -1, -1);
+    for (ptr = repos; ptr; ptr = ptr->next) {
+        repo = ptr->data;
+        sb = g_new0 (StoreBlocks, 1);
+        memcpy (sb->store_id, repo->id, 36);
+        sb->version = repo->version;
+        g_ptr_array_add (data->stores, sb);
+    }
+    g_list_free (repos);
+
+    index->building = TRUE;
+    ccnet_job_manager_schedule_job (index->seaf->job_mgr,
+                                    build_index_thread,
+                                    build_index_done,
+                                    data);
+}
+
+int
+block_index_copy_block (BlockIndex *index,
+                        const char *store_id,
+                        int version,
+                        const char *block_id)
+{
+    unsigned char raw[20];
+    StoreBlocks *sb;
+    GList *sources = NULL, *ptr;
+    int *versions = NULL;
+    int n_sources = 0, i;
+    guint j;
+    int ret = -1;
+
+    if (hex_to_rawdata (block_id, raw, 20) < 0)
+        return -1;
+
+    pthread_mutex_lock (&index->lock);
+    if (index->stores) {
+        versions = g_new0 (int, index->stores->len);
+        for (j = 0; j < index->stores->len; ++j) {
+            sb = g_ptr_array_index (index->stores, j);
+            if (strcmp (sb->store_id, store_id) == 0)
+                continue;
+            if (bsearch (raw, sb->ids, sb->n_ids, 20, cmp_raw_id)) {
+                sources = g_list_append (sources, g_strdup(sb->store_id));
+                versions[n_sources++] = sb->version;
+            }
+        }
+    }
+    pthread_mutex_unlock (&index->lock);
+
+    /* Copying may also fail because another thread just linked the
+     * block, so check for it either way.
+     */
+    for (ptr = sources, i = 0; ptr; ptr = ptr->next, ++i) {
+        seaf_block_manager_copy_block (index->seaf->block_mgr,
+                                       ptr->data, versions[i],
+                                       store_id, version, block_id);
+        if (seaf_block_manager_block_exists (index->seaf->block_mgr,
+                                             store_id, version, block_id)) {
+            ret = 0;
+            break;
+        }
+    }
+
+    string_list_free (sources);
+    g_free (versions);
+
+    return ret;
+}
@@ -0,0 +1,42 @@
+/* -*- Mode: C; tab-width: 4; indent-tabs-mode: nil; c-basic-offset: 4 -*- */
+
+#ifndef BLOCK_INDEX_H
+#define BLOCK_INDEX_H
+
+#include <glib.h>
+
+/*
+ * Index of the blocks in the local stores of all repos, so that a
+ * download can link a block that another repo already has instead of
+ * fetching it again.
+ *
+ * The index is a snapshot, built in a background thread and rebuilt when
+ * it's old. It may miss recent blocks, which are then fetched, or list
+ * removed ones, whose copy fails and which are then fetched too.
+ */
+
+struct _SeafileSession;
+
+typedef struct BlockIndex BlockIndex;
+
+BlockIndex *
+block_index_new (struct _SeafileSession *seaf);
+
+/*
+ * Start building the index if there's none or it's old. Call from the
+ * main thread, before a download that may use it.
+ */
+void
+block_index_prepare (BlockIndex *index);
+
+/*
+ * Copy @block_id into @store_id from another store that has it.
+ * Returns 0 if the block is now in @store_id, -1 otherwise.
+ */
+int
+block_index_copy_block (BlockIndex *index,
+                        const char *store_id,
+                        int version,
+                        const char *block_id);
+
+#endif
@@ -18,6 +18,7 @@
 #include "block-tx-client.h"
 #include "block-tx-utils.h"
 #include "utils.h"
+#include "seafile-config.h"
 
 /*
  * Handshake:
@@ -63,8 +64,17 @@ struct _BlockTxClient {
     struct evbuffer *recv_buf;
 
     int recv_state;
+    /* The block the response being received is for. */
     char *curr_block_id;
 
+    /*
+     * Blocks requested and waiting for a response, in the order they
+     * were requested, curr_block_id first. With version 3, up to
+     * window_size blocks are requested before the first one is done.
+     */
+    GQueue *in_flight;
+    int window_size;
+
     /* Used by get block */
     BlockHandle *block;
 
@@ -78,11 +88,16 @@ struct _BlockTxClient {
 
     gboolean break_loop;
 
+    /* Version 3: number of the next frame sent. */
+    guint64 send_seq;
+
     int version;
 };
 
 typedef struct _BlockTxClient BlockTxClient;
 
+#define DEFAULT_BLOCK_TX_WINDOW 8
+
 /* Connection establishment. */
 
 static int
@@ -206,6 +221,19 @@ send_handshake (evutil_socket_t data_fd, BlockTxInfo *info)
     return 0;
 }
 
+/* Prepare @ctx for the next frame sent to the server. */
+static void
+init_send_ctx (BlockTxClient *client, EVP_CIPHER_CTX *ctx)
+{
+    if (client->version == 1)
+        blocktx_encrypt_init (ctx, client->key, client->iv);
+    else if (client->version == 2)
+        blocktx_encrypt_init (ctx, client->key_v2, client->iv_v2);
+    else
+        blocktx_gcm_encrypt_init (ctx, client->key_v2, client->iv_v2,
+                                  BLOCKTX_DIR_TO_SERVER, client->send_seq++);
+}
+
 static void
 init_frame_parser (BlockTxClient *client)
 {
@@ -214,12 +242,13 @@ init_frame_parser (BlockTxClient *client)
     if (client->version == 1) {
         memcpy (parser->key, client->key, ENC_BLOCK_SIZE);
         memcpy (parser->iv, client->iv, ENC_BLOCK_SIZE);
-    } else if (client->version == 2) {
+    } else {
         memcpy (parser->key_v2, client->key_v2, ENC_KEY_SIZE);
         memcpy (parser->iv_v2, client->iv_v2, ENC_BLOCK_SIZE);
     }
 
     parser->version = client->version;
+    parser->recv_dir = BLOCKTX_DIR_TO_CLIENT;
     parser->cbarg = client;
 }
 
@@ -249,7 +278,7 @@ handle_handshake_response (BlockTxClient *client)
         if (client->version == 1)
             blocktx_generate_encrypt_key (info->session_key, sizeof(info->session_key),
                                           client->key, client->iv);
-        else if (client->version == 2)
+        else if (client->version == 2 || client->version == 3)
             blocktx_generate_encrypt_key (info->session_key, sizeof(info->session_key),
                                           client->key_v2, client->iv_v2);
         else {
@@ -346,14 +375,11 @@ send_authentication (BlockTxClient *client)
     EVP_CIPHER_CTX ctx;
     int ret = 0;
 
-    if (client->version == 1)
-        blocktx_encrypt_init (&ctx, client->key, client->iv);
-    else if (client->version == 2)
-        blocktx_encrypt_init (&ctx, client->key_v2, client->iv_v2);
+    init_send_ctx (client, &ctx);
 
     seaf_debug ("session token length is %d.\n", strlen(task->session_token));
 
-    if (send_encrypted_data_frame_begin (client->data_fd,
+    if (send_encrypted_data_frame_begin (&ctx, client->data_fd,
                                          strlen(task->session_token) + 1) < 0) {
         seaf_warning ("Send auth request: failed to begin.\n");
         client->info->result = BLOCK_CLIENT_NET_ERROR;
@@ -391,23 +417,20 @@ out:
 /* Block header */
 
 static int
-send_block_header (BlockTxClient *client, int command)
+send_block_header (BlockTxClient *client, int command, const char *block_id)
 {
     RequestHeader header;
     EVP_CIPHER_CTX ctx;
     int ret = 0;
 
     header.command = htonl (command);
-    memcpy (header.block_id, client->curr_block_id, 40);
+    memcpy (header.block_id, block_id, 40);
 
-    if (client->version == 1)
-        blocktx_encrypt_init (&ctx, client->key, client->iv);
-    else if (client->version == 2)
-        blocktx_encrypt_init (&ctx, client->key_v2, client->iv_v2);
+    init_send_ctx (client, &ctx);
 
-    if (send_encrypted_data_frame_begin (client->data_fd, sizeof(header)) < 0) {
+    if (send_encrypted_data_frame_begin (&ctx, client->data_fd, sizeof(header)) < 0) {
         seaf_warning ("Send block header %s: failed to begin.\n",
-                      client->curr_block_id);
+                      block_id);
         client->info->result = BLOCK_CLIENT_NET_ERROR;
         ret = -1;
         goto out;
@@ -417,7 +440,7 @@ send_block_header (BlockTxClient *client, int command)
                              &header, sizeof(header)) < 0)
     {
         seaf_warning ("Send block header %s: failed to send data.\n",
-                      client->curr_block_id);
+                      block_id);
         client->info->result = BLOCK_CLIENT_NET_ERROR;
         ret = -1;
         goto out;
@@ -425,7 +448,7 @@ send_block_header (BlockTxClient *client, int command)
 
     if (send_encrypted_data_frame_end (&ctx, client->data_fd) < 0) {
         seaf_warning ("Send block header %s: failed to end.\n",
-                      client->curr_block_id);
+                      block_id);
         client->info->result = BLOCK_CLIENT_NET_ERROR;
         ret = -1;
         goto out;
@@ -513,7 +536,7 @@ handle_block_header (BlockTxClient *client)
 
 /* Block content */
 
-#define SEND_BUFFER_SIZE 4096
+#define SEND_BUFFER_SIZE (64 << 10)
 
 static int
 send_encrypted_block (BlockTxClient *client,
@@ -525,7 +548,7 @@ send_encrypted_block (BlockTxClient *client,
     int size, n, remain;
     int ret = 0;
     EVP_CIPHER_CTX ctx;
-    char send_buf[SEND_BUFFER_SIZE];
+    char *send_buf = g_malloc (SEND_BUFFER_SIZE);
 
     md = seaf_block_manager_stat_block_by_handle (seaf->block_mgr, handle);
     if (!md) {
@@ -537,12 +560,9 @@ send_encrypted_block (BlockTxClient *client,
     size = md->size;
     g_free (md);
 
-    if (client->version == 1)
-        blocktx_encrypt_init (&ctx, client->key, client->iv);
-    else if (client->version == 2)
-        blocktx_encrypt_init (&ctx, client->key_v2, client->iv_v2);
+    init_send_ctx (client, &ctx);
 
-    if (send_encrypted_data_frame_begin (client->data_fd, size) < 0) {
+    if (send_encrypted_data_frame_begin (&ctx, client->data_fd, size) < 0) {
         seaf_warning ("Send block %s: failed to begin.\n", block_id);
         info->result = BLOCK_CLIENT_NET_ERROR;
         ret = -1;
@@ -605,11 +625,12 @@ send_encrypted_block (BlockTxClient *client,
 
 out:
     EVP_CIPHER_CTX_cleanup (&ctx);
+    g_free (send_buf);
     return ret;
 }
 
 static int
-send_block_content (BlockTxClient *client)
+send_block_content (BlockTxClient *client, const char *block_id)
 {
     TransferTask *task = client->info->task;
     BlockHandle *handle = NULL;
@@ -618,15 +639,15 @@ send_block_content (BlockTxClient *client)
     handle = seaf_block_manager_open_block (seaf->block_mgr,
                                             task->repo_id,
                                             task->repo_version,
-                                            client->curr_block_id,
+                                            block_id,
                                             BLOCK_READ);
     if (!handle) {
-        seaf_warning ("Failed to open block %s.\n", client->curr_block_id);
+        seaf_warning ("Failed to open block %s.\n", block_id);
         client->info->result = BLOCK_CLIENT_FAILED;
         return -1;
     }
 
-    ret = send_encrypted_block (client, handle, client->curr_block_id);
+    ret = send_encrypted_block (client, handle, block_id);
 
     seaf_block_manager_close_block (seaf->block_mgr, handle);
     seaf_block_manager_block_handle_free (seaf->block_mgr, handle);
@@ -690,60 +711,115 @@ handle_block_content (BlockTxClient *client)
     return handle_frame_fragments (client->recv_buf, &client->parser);
 }
 
-static int
-transfer_next_block (BlockTxClient *client)
+/* Take the next block to request, or NULL if there's none left. */
+static char *
+take_next_block (BlockTxClient *client)
 {
     TransferTask *task = client->info->task;
+    BlockTxInfo *parent = client->info->parent;
+    char *block_id;
 
-    if (client->curr_block_id) {
-        g_queue_pop_head (task->block_ids);
-        g_free (client->curr_block_id);
-        client->curr_block_id = NULL;
-    }
+    if (!parent)
+        return g_queue_peek_nth (task->block_ids,
+                                 g_queue_get_length (client->in_flight));
 
-    if (g_queue_get_length (task->block_ids) == 0) {
-        seaf_debug ("Transfer blocks done.\n");
-        client->info->result = BLOCK_CLIENT_SUCCESS;
-        client->break_loop = TRUE;
-        return 0;
-    }
+    /* Streams take the blocks off the shared queue. */
+    pthread_mutex_lock (&parent->blocks_lock);
+    block_id = g_queue_pop_head (task->block_ids);
+    pthread_mutex_unlock (&parent->blocks_lock);
 
-    client->curr_block_id = g_queue_peek_head (task->block_ids);
+    return block_id;
+}
 
-    if (task->type == TASK_TYPE_UPLOAD) {
-        seaf_debug ("Put block %s.\n", client->curr_block_id);
+static int
+send_block_request (BlockTxClient *client, const char *block_id)
+{
+    if (client->info->task->type == TASK_TYPE_UPLOAD) {
+        seaf_debug ("Put block %s.\n", block_id);
 
-        if (send_block_header (client, REQUEST_COMMAND_PUT) < 0) {
+        if (send_block_header (client, REQUEST_COMMAND_PUT, block_id) < 0) {
             seaf_warning ("Failed to send block header for PUT %s.\n",
-                          client->curr_block_id);
+                          block_id);
             return -1;
         }
 
-        if (send_block_content (client) < 0) {
+        if (send_block_content (client, block_id) < 0) {
             seaf_warning ("Failed to send block content for %s.\n",
-                          client->curr_block_id);
+                          block_id);
             return -1;
         }
-
-        seaf_debug ("recv_state set to HEADER.\n");
-
-        client->parser.content_cb = handle_block_header_content_cb;
-        client->recv_state = RECV_STATE_HEADER;
     } else {
-        seaf_debug ("Get block %s.\n", client->curr_block_id);
+        seaf_debug ("Get block %s.\n", block_id);
 
-        if (send_block_header (client, REQUEST_COMMAND_GET) < 0) {
+        if (send_block_header (client, REQUEST_COMMAND_GET, block_id) < 0) {
             seaf_warning ("Failed to send block header for GET %s.\n",
-                          client->curr_block_id);
+                          block_id);
             return -1;
         }
+    }
 
-        seaf_debug ("recv_state set to HEADER.\n");
+    return 0;
+}
 
-        client->parser.content_cb = handle_block_header_content_cb;
-        client->parser.fragment_cb = save_block_content_cb;
-        client->recv_state = RECV_STATE_HEADER;
+/* Forget the blocks in flight. Streams own theirs. */
+static void
+clear_in_flight (BlockTxClient *client)
+{
+    char *block_id;
+
+    while ((block_id = g_queue_pop_head (client->in_flight)) != NULL) {
+        if (client->info->parent)
+            g_free (block_id);
     }
+    client->curr_block_id = NULL;
+}
+
+/*
+ * Called when the response for the current block is done, or to start a
+ * batch. Requests more blocks until the window is full and waits for the
+ * response for the oldest one.
+ */
+static int
+transfer_next_block (BlockTxClient *client)
+{
+    TransferTask *task = client->info->task;
+    int window = client->version >= 3 ? client->window_size : 1;
+    char *block_id;
+
+    if (client->curr_block_id) {
+        g_queue_pop_head (client->in_flight);
+        if (client->info->parent)
+            g_free (client->curr_block_id);
+        else
+            g_free (g_queue_pop_head (task->block_ids));
+        client->curr_block_id = NULL;
+    }
+
+    while ((int)g_queue_get_length (client->in_flight) < window) {
+        block_id = take_next_block (client);
+        if (!block_id)
+            break;
+
+        g_queue_push_tail (client->in_flight, block_id);
+        if (send_block_request (client, block_id) < 0)
+            return -1;
+    }
+
+    if (g_queue_get_length (client->in_flight) == 0) {
+        seaf_debug ("Transfer blocks done.\n");
+        client->info->result = BLOCK_CLIENT_SUCCESS;
+        client->break_loop = TRUE;
+        return 0;
+    }
+
+    client->curr_block_id = g_queue_peek_head (client->in_flight);
+
+    seaf_debug ("recv_state set to HEADER.\n");
+
+    client->parser.content_cb = handle_block_header_content_cb;
+    if (task->type == TASK_TYPE_DOWNLOAD)
+        client->parser.fragment_cb = save_block_content_cb;
+    client->recv_state = RECV_STATE_HEADER;
 
     return 0;
 }
@@ -752,6 +828,7 @@ static void
 recv_data_cb (BlockTxClient *client)
 {
     int ret = 0;
+    size_t len;
 
     /* Let evbuffer determine how much data can be read. */
     int n = evbuffer_read (client->recv_buf, client->data_fd, -1);
@@ -768,27 +845,34 @@ recv_data_cb (BlockTxClient *client)
         return;
     }
 
-    switch (client->recv_state) {
-    case RECV_STATE_HANDSHAKE:
-        ret = handle_handshake_response (client);
-        break;
-    case RECV_STATE_AUTH:
-        ret = handle_auth_response (client);
-        break;
-    case RECV_STATE_HEADER:
-        ret = handle_block_header (client);
-        if (ret < 0)
+    /* With several blocks in flight, more than one response can be here. */
+    do {
+        len = evbuffer_get_length (client->recv_buf);
+
+        switch (client->recv_state) {
+        case RECV_STATE_HANDSHAKE:
+            ret = handle_handshake_response (client);
+            break;
+        case RECV_STATE_AUTH:
+            ret = handle_auth_response (client);
             break;
+        case RECV_STATE_HEADER:
+            ret = handle_block_header (client);
+            if (ret < 0)
+                break;
 
-        if (client->recv_state == RECV_STATE_CONTENT &&
-            client->info->task->type == TASK_TYPE_DOWNLOAD)
-            ret = handle_block_content (client);
+            if (client->recv_state == RECV_STATE_CONTENT &&
+                client->info->task->type == TASK_TYPE_DOWNLOAD)
+                ret = handle_block_content (client);
 
-        break;
-    case RECV_STATE_CONTENT:
-        ret = handle_block_content (client);
-        break;
-    }
+            break;
+        case RECV_STATE_CONTENT:
+            ret = handle_block_content (client);
+            break;
+        }
+    } while (ret == 0 && !client->break_loop &&
+             evbuffer_get_length (client->recv_buf) > 0 &&
+             evbuffer_get_length (client->recv_buf) < len);
 
     if (ret < 0)
         client->break_loop = TRUE;
@@ -809,6 +893,8 @@ shutdown_client (BlockTxClient *client)
     evbuffer_free (client->recv_buf);
     evutil_closesocket (client->data_fd);
 
+    clear_in_flight (client);
+
     client->recv_state = RECV_STATE_DONE;
 }
 
@@ -844,6 +930,10 @@ handle_command (BlockTxClient *client, int command)
         seaf_debug ("Canceled command received.\n");
         client->info->result = BLOCK_CLIENT_CANCELED;
 
+        /* Pass it on to the other streams of the task. */
+        if (client->info->parent)
+            pipewrite (client->info->cmd_pipe[1], &command, sizeof(int));
+
         if (client->info->transfer_once) {
             shutdown_client (client);
             ret = TRUE;
@@ -1009,9 +1099,14 @@ retry:
 
     if (restart) {
         seaf_message ("Restarting block tx client.\n");
+        GQueue *in_flight = client->in_flight;
+        int window_size = client->window_size;
+        clear_in_flight (client);
         memset (client, 0, sizeof(BlockTxClient));
         client->info = info;
         client->cb = cb;
+        client->in_flight = in_flight;
+        client->window_size = window_size;
         client->info->result = BLOCK_CLIENT_UNKNOWN;
         goto retry;
     }
@@ -1024,6 +1119,9 @@ block_tx_client_thread_done (void *vdata)
 {
     BlockTxClient *client = vdata;
 
+    clear_in_flight (client);
+    g_queue_free (client->in_flight);
+
     client->cb (client->info);
 
     g_free (client);
@@ -1033,10 +1131,18 @@ int
 block_tx_client_start (BlockTxInfo *info, BlockTxClientDoneCB cb)
 {
     BlockTxClient *client = g_new0 (BlockTxClient, 1);
+    gboolean exists;
     int ret = 0;
 
     client->info = info;
     client->cb = cb;
+    client->in_flight = g_queue_new ();
+
+    client->window_size = seafile_session_config_get_int (seaf,
+                                                          KEY_BLOCK_TX_WINDOW,
+                                                          &exists);
+    if (!exists || client->window_size <= 0)
+        client->window_size = DEFAULT_BLOCK_TX_WINDOW;
 
     ret = ccnet_job_manager_schedule_job (seaf->job_mgr,
                                           block_tx_client_thread,
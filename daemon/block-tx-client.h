@@ -10,6 +10,8 @@ typedef void (*BlockTxClientDoneCB) (BlockTxInfo *);
  *
  * 1. In upload, the client is set to one-time mode.
  * After all blocks are uploaded, the client done callback is called.
+ * Several clients can serve the same task in this mode, see
+ * BlockTxInfo.parent. Each of them calls the done callback.
  * 
  * 2. In download, the client is set to interactive mode.
  * The block tx client first has to connect to the server and do authentication.
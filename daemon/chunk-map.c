@@ -0,0 +1,221 @@
+/* -*- Mode: C; tab-width: 4; indent-tabs-mode: nil; c-basic-offset: 4 -*- */
+
+#include "common.h"
+
+#include <zlib.h>
+
+#include "seafile-session.h"
+#include "utils.h"
+#include "chunk-map.h"
+#include "log.h"
+
+/*
+ * Map file. Integers are big endian.
+ *
+ *   header: magic "SCM1", file id (20 bytes), algorithm (32),
+ *           block_min_sz (32), block_max_sz (32), block_sz (32),
+ *           file size (64), number of blocks (32)
+ *   record: offset (64), length (32), fingerprint, block id
+ *   trailer: crc32 of everything before (32)
+ */
+#define MAP_MAGIC "SCM1"
+#define MAP_HEADER_LEN 52
+#define MAP_RECORD_LEN (12 + CDC_FP_LEN + CHECKSUM_LENGTH)
+
+static void
+put_be32 (GString *buf, guint32 v)
+{
+    unsigned char p[4];
+
+    p[0] = v >> 24;
+    p[1] = v >> 16;
+    p[2] = v >> 8;
+    p[3] = v;
+    g_string_append_len (buf, (char *)p, 4);
+}
+
+static void
+put_be64 (GString *buf, guint64 v)
+{
+    put_be32 (buf, (guint32)(v >> 32));
+    put_be32 (buf, (guint32)v);
+}
+
+static guint32
+get_be32 (const unsigned char *p)
+{
+    return ((guint32)p[0] << 24) | ((guint32)p[1] << 16) |
+        ((guint32)p[2] << 8) | (guint32)p[3];
+}
+
+static guint64
+get_be64 (const unsigned char *p)
+{
+    return ((guint64)get_be32 (p) << 32) | get_be32 (p + 4);
+}
+
+static char *
+get_repo_dir (const char *repo_id)
+{
+    return g_strdup_printf ("%s/%s.chunks", seaf->repo_mgr->index_dir, repo_id);
+}
+
+static char *
+get_map_path (const char *repo_id, const char *path)
+{
+    char *name, *map_path;
+
+    name = g_compute_checksum_for_string (G_CHECKSUM_SHA1, path, -1);
+    map_path = g_strdup_printf ("%s/%s.chunks/%s",
+                                seaf->repo_mgr->index_dir, repo_id, name);
+    g_free (name);
+
+    return map_path;
+}
+
+/* The blocks must cover the file, one after another. */
+static int
+parse_records (CDCChunkMap *map, const unsigned char *p)
+{
+    CDCBlockInfo *info;
+    guint64 offset = 0;
+    guint32 i;
+
+    map->blocks = g_new0 (CDCBlockInfo, map->n_blocks);
+    for (i = 0; i < map->n_blocks; ++i, p += MAP_RECORD_LEN) {
+        info = &map->blocks[i];
+        info->offset = get_be64 (p);
+        info->len = get_be32 (p + 8);
+        memcpy (info->fp, p + 12, CDC_FP_LEN);
+        memcpy (info->id, p + 12 + CDC_FP_LEN, CHECKSUM_LENGTH);
+
+        if (info->offset != offset || info->len == 0 ||
+            info->len > map->block_max_sz)
+            return -1;
+        offset += info->len;
+    }
+
+    return (offset == map->file_size) ? 0 : -1;
+}
+
+CDCChunkMap *
+chunk_map_load (const char *repo_id, const char *path,
+                const unsigned char *file_id)
+{
+    char *map_path, *contents = NULL;
+    gsize len = 0;
+    const unsigned char *p;
+    CDCChunkMap *map = NULL;
+
+    map_path = get_map_path (repo_id, path);
+    if (!g_file_get_contents (map_path, &contents, &len, NULL))
+        goto out;
+
+    p = (const unsigned char *)contents;
+    if (len < MAP_HEADER_LEN + 4 ||
+        memcmp (p, MAP_MAGIC, 4) != 0 ||
+        crc32 (0, p, len - 4) != get_be32 (p + len - 4))
+        goto bad;
+
+    /* Made for another version of the file. */
+    if (memcmp (p + 4, file_id, 20) != 0)
+        goto out;
+
+    map = g_new0 (CDCChunkMap, 1);
+    map->algorithm = (int)get_be32 (p + 24);
+    map->block_min_sz = get_be32 (p + 28);
+    map->block_max_sz = get_be32 (p + 32);
+    map->block_sz = get_be32 (p + 36);
+    map->file_size = get_be64 (p + 40);
+    map->n_blocks = get_be32 (p + 48);
+
+    if ((len - MAP_HEADER_LEN - 4) / MAP_RECORD_LEN != map->n_blocks ||
+        (len - MAP_HEADER_LEN - 4) % MAP_RECORD_LEN != 0 ||
+        parse_records (map, p + MAP_HEADER_LEN) < 0) {
+        cdc_chunk_map_free (map);
+        map = NULL;
+        goto bad;
+    }
+
+    goto out;
+
+bad:
+    seaf_warning ("Chunk map %s is corrupted, removing it.\n", map_path);
+    seaf_util_unlink (map_path);
+
+out:
+    g_free (contents);
+    g_free (map_path);
+    return map;
+}
+
+int
+chunk_map_save (const char *repo_id, const char *path,
+                const unsigned char *file_id, const CDCChunkMap *map)
+{
+    char *dir, *map_path;
+    GString *buf;
+    GError *error = NULL;
+    const CDCBlockInfo *info;
+    guint32 i;
+    int ret = 0;
+
+    dir = get_repo_dir (repo_id);
+    if (checkdir_with_mkdir (dir) < 0) {
+        seaf_warning ("Failed to create dir %s.\n", dir);
+        g_free (dir);
+        return -1;
+    }
+    g_free (dir);
+
+    buf = g_string_sized_new (MAP_HEADER_LEN + map->n_blocks * MAP_RECORD_LEN + 4);
+    g_string_append_len (buf, MAP_MAGIC, 4);
+    g_string_append_len (buf, (char *)file_id, 20);
+    put_be32 (buf, (guint32)map->algorithm);
+    put_be32 (buf, map->block_min_sz);
+    put_be32 (buf, map->block_max_sz);
+    put_be32 (buf, map->block_sz);
+    put_be64 (buf, map->file_size);
+    put_be32 (buf, map->n_blocks);
+    for (i = 0; i < map->n_blocks; ++i) {
+        info = &map->blocks[i];
+        put_be64 (buf, info->offset);
+        put_be32 (buf, info->len);
+        g_string_append_len (buf, (char *)info->fp, CDC_FP_LEN);
+        g_string_append_len (buf, (char *)info->id, CHECKSUM_LENGTH);
+    }
+    put_be32 (buf, crc32 (0, (unsigned char *)buf->str, buf->len));
+
+    map_path = get_map_path (repo_id, path);
+    if (!g_file_set_contents (map_path, buf->str, buf->len, &error)) {
+        seaf_warning ("Failed to save chunk map %s: %s.\n",
+                      map_path, error->message);
+        g_clear_error (&error);
+        ret = -1;
+    }
+
+    g_free (map_path);
+    g_string_free (buf, TRUE);
+    return ret;
+}
+
+void
+chunk_map_remove_repo (const char *repo_id)
+{
+    char *dir, *map_path;
+    GDir *d;
+    const char *name;
+
+    dir = get_repo_dir (repo_id);
+    d = g_dir_open (dir, 0, NULL);
+    if (d) {
+        while ((name = g_dir_read_name (d)) != NULL) {
+            map_path = g_build_filename (dir, name, NULL);
+            seaf_util_unlink (map_path);
+            g_free (map_path);
+        }
+        g_dir_close (d);
+        seaf_util_rmdir (dir);
+    }
+    g_free (dir);
+}
@@ -0,0 +1,43 @@
+/* -*- Mode: C; tab-width: 4; indent-tabs-mode: nil; c-basic-offset: 4 -*- */
+
+#ifndef CHUNK_MAP_H
+#define CHUNK_MAP_H
+
+#include <glib.h>
+
+#include "cdc/cdc.h"
+
+/*
+ * Chunk maps of the large files in worktrees, as of their last indexing.
+ * When such a file changes, only the regions around the changes are
+ * chunked again; the blocks in between are taken from its map without
+ * hashing, encrypting or writing them. See CDCFileDescriptor.prev_map.
+ *
+ * Maps are kept in "<index dir>/<repo id>.chunks/", one per file, named
+ * after the sha1 of its path in the worktree. A map is saved with the id
+ * of the file it was made for, and is only loaded for that id, when it's
+ * the version of the file in the index. Its blocks are then in the repo.
+ * Maps are only saved for indexings that wrote the blocks.
+ */
+
+/* Smaller files are chunked as a whole. */
+#define CHUNK_MAP_MIN_SIZE ((gint64)64 << 20)
+
+/*
+ * The map of @path, if it was made for @file_id. NULL if there is none,
+ * it's for another version of the file, or it's corrupted.
+ */
+CDCChunkMap *
+chunk_map_load (const char *repo_id, const char *path,
+                const unsigned char *file_id);
+
+/* Save @map as the one of @path, made for @file_id. */
+int
+chunk_map_save (const char *repo_id, const char *path,
+                const unsigned char *file_id, const CDCChunkMap *map);
+
+/* Remove the maps of all files in @repo_id. */
+void
+chunk_map_remove_repo (const char *repo_id);
+
+#endif
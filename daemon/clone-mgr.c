@@ -878,6 +878,10 @@ add_transfer_task (CloneTask *task, GError **error)
 
 typedef struct {
     CloneTask *task;
+    /* Before the fetch, the worktree files are only hashed. Files the
+     * server has are then adopted without being written to the block store.
+     */
+    gboolean hash_only;
     gboolean success;
 } IndexAux;
 
@@ -892,6 +896,7 @@ index_files_job (void *data)
                                         task->worktree,
                                         task->passwd, task->enc_version,
                                         task->random_key,
+                                        aux->hash_only,
                                         task->root_id) == 0)
         aux->success = TRUE;
 
@@ -981,6 +986,7 @@ start_index_or_transfer (SeafCloneManager *mgr, CloneTask *task, GError **error)
 
         aux = g_new0 (IndexAux, 1);
         aux->task = task;
+        aux->hash_only = TRUE;
 
         ccnet_job_manager_schedule_job (seaf->job_mgr,
                                         index_files_job,
@@ -1291,6 +1297,11 @@ add_task_common (SeafCloneManager *mgr,
     task->enc_version = enc_version;
     task->random_key = g_strdup (random_key);
     task->repo_version = repo_version;
+
+    /* Have it ready by the time blocks are downloaded, so that the ones
+     * shared with other local repos are linked from their stores.
+     */
+    block_index_prepare (seaf->block_index);
     if (more_info) {
         json_error_t jerror;
         json_t *object = NULL;
@@ -1740,7 +1751,7 @@ print_index (struct index_state *istate)
         rawdata_to_hex (ce->sha1, id, 20);
         g_message ("%s, %s, %o, %"G_GUINT64_FORMAT", %s, %d\n",
                    ce->name, id, ce->ce_mode, 
-                   ce->ce_mtime.sec, ce->modifier, ce_stage(ce));
+                   ce->ce_mtime.sec, ce_modifier(ce), ce_stage(ce));
     }
 
     return 0;
@@ -0,0 +1,277 @@
+/* -*- Mode: C; tab-width: 4; indent-tabs-mode: nil; c-basic-offset: 4 -*- */
+
+#include "common.h"
+
+#include <zlib.h>
+
+#include "utils.h"
+#include "dir-cache.h"
+#include "log.h"
+
+/*
+ * Cache file. Integers are big endian.
+ *
+ *   header: magic "SDC1", ignore rules signature (20 bytes)
+ *   record: path length (32), path, mtime (64), n_names (32),
+ *           then the names, each as length (32) and bytes
+ *   trailer: crc32 of everything before (32)
+ */
+#define CACHE_MAGIC "SDC1"
+#define CACHE_HEADER_LEN 24
+
+/* Changes within this many seconds might not show in the mtime. */
+#define RACY_SECONDS 2
+
+typedef struct CachedDir {
+    gint64 mtime;
+    char **names;
+    gboolean used;
+} CachedDir;
+
+struct DirCache {
+    char *path;
+    unsigned char ignore_sig[20];
+    GHashTable *dirs;           /* path -> CachedDir */
+    gboolean changed;
+};
+
+static void
+cached_dir_free (CachedDir *cd)
+{
+    g_strfreev (cd->names);
+    g_free (cd);
+}
+
+static void
+put_be32 (GString *buf, guint32 v)
+{
+    unsigned char p[4];
+
+    p[0] = v >> 24;
+    p[1] = v >> 16;
+    p[2] = v >> 8;
+    p[3] = v;
+    g_string_append_len (buf, (char *)p, 4);
+}
+
+static guint32
+get_be32 (const unsigned char *p)
+{
+    return ((guint32)p[0] << 24) | ((guint32)p[1] << 16) |
+        ((guint32)p[2] << 8) | (guint32)p[3];
+}
+
+static void
+put_string (GString *buf, const char *s)
+{
+    guint32 len = strlen(s);
+
+    put_be32 (buf, len);
+    g_string_append_len (buf, s, len);
+}
+
+/* Read a length-prefixed string at *@p, NULL if it runs past @end. */
+static char *
+get_string (const unsigned char **p, const unsigned char *end)
+{
+    guint32 len;
+    char *s;
+
+    if (end - *p < 4)
+        return NULL;
+    len = get_be32 (*p);
+    *p += 4;
+    if ((guint32)(end - *p) < len)
+        return NULL;
+    s = g_strndup ((const char *)*p, len);
+    *p += len;
+    return s;
+}
+
+static int
+parse_records (DirCache *cache, const unsigned char *p, const unsigned char *end)
+{
+    char *dir;
+    CachedDir *cd;
+    guint32 n_names, i;
+
+    while (p < end) {
+        dir = get_string (&p, end);
+        if (!dir)
+            return -1;
+        if (end - p < 12) {
+            g_free (dir);
+            return -1;
+        }
+        cd = g_new0 (CachedDir, 1);
+        cd->mtime = (gint64)(((guint64)get_be32 (p) << 32) | get_be32 (p + 4));
+        n_names = get_be32 (p + 8);
+        p += 12;
+        /* Every name takes at least 4 bytes. */
+        if (n_names > (guint32)(end - p) / 4) {
+            g_free (dir);
+            g_free (cd);
+            return -1;
+        }
+        cd->names = g_new0 (char *, n_names + 1);
+        for (i = 0; i < n_names; ++i) {
+            cd->names[i] = get_string (&p, end);
+            if (!cd->names[i]) {
+                g_free (dir);
+                cached_dir_free (cd);
+                return -1;
+            }
+        }
+        g_hash_table_replace (cache->dirs, dir, cd);
+    }
+
+    return 0;
+}
+
+DirCache *
+dir_cache_load (const char *path, const unsigned char *ignore_sig)
+{
+    DirCache *cache = g_new0 (DirCache, 1);
+    char *contents = NULL;
+    gsize len = 0;
+    const unsigned char *p;
+
+    cache->path = g_strdup (path);
+    memcpy (cache->ignore_sig, ignore_sig, 20);
+    cache->dirs = g_hash_table_new_full (g_str_hash, g_str_equal,
+                                         g_free,
+                                         (GDestroyNotify)cached_dir_free);
+
+    if (!g_file_get_contents (path, &contents, &len, NULL))
+        return cache;
+
+    p = (const unsigned char *)contents;
+    if (len < CACHE_HEADER_LEN + 4 ||
+        memcmp (p, CACHE_MAGIC, 4) != 0 ||
+        crc32 (0, p, len - 4) != get_be32 (p + len - 4)) {
+        seaf_warning ("Dir cache %s is corrupted, starting over.\n", path);
+        /* Save it back even if nothing changes, to replace the bad file. */
+        cache->changed = TRUE;
+        goto out;
+    }
+
+    /* The ignore rules changed, so the cached names may be wrong. */
+    if (memcmp (p + 4, ignore_sig, 20) != 0) {
+        cache->changed = TRUE;
+        goto out;
+    }
+
+    if (parse_records (cache, p + CACHE_HEADER_LEN, p + len - 4) < 0) {
+        seaf_warning ("Dir cache %s is corrupted, starting over.\n", path);
+        g_hash_table_remove_all (cache->dirs);
+        cache->changed = TRUE;
+    }
+
+out:
+    g_free (contents);
+    return cache;
+}
+
+char **
+dir_cache_lookup (DirCache *cache, const char *dir, gint64 mtime)
+{
+    CachedDir *cd = g_hash_table_lookup (cache->dirs, dir);
+
+    if (!cd)
+        return NULL;
+
+    cd->used = TRUE;
+    if (cd->mtime != mtime)
+        return NULL;
+
+    return cd->names;
+}
+
+void
+dir_cache_set (DirCache *cache, const char *dir, gint64 mtime, char **names)
+{
+    CachedDir *cd;
+
+    if (mtime + RACY_SECONDS > (gint64)time(NULL)) {
+        if (g_hash_table_remove (cache->dirs, dir))
+            cache->changed = TRUE;
+        return;
+    }
+
+    cd = g_new0 (CachedDir, 1);
+    cd->mtime = mtime;
+    cd->names = g_strdupv (names);
+    cd->used = TRUE;
+    g_hash_table_replace (cache->dirs, g_strdup(dir), cd);
+    cache->changed = TRUE;
+}
+
+static gboolean
+unused_dir (gpointer key, gpointer value, gpointer user_data)
+{
+    CachedDir *cd = value;
+
+    return !cd->used;
+}
+
+void
+dir_cache_prune (DirCache *cache)
+{
+    if (g_hash_table_foreach_remove (cache->dirs, unused_dir, NULL) > 0)
+        cache->changed = TRUE;
+}
+
+static void
+write_record (gpointer key, gpointer value, gpointer user_data)
+{
+    GString *buf = user_data;
+    CachedDir *cd = value;
+    guint32 n_names = g_strv_length (cd->names);
+    guint32 i;
+
+    put_string (buf, key);
+    put_be32 (buf, (guint32)((guint64)cd->mtime >> 32));
+    put_be32 (buf, (guint32)cd->mtime);
+    put_be32 (buf, n_names);
+    for (i = 0; i < n_names; ++i)
+        put_string (buf, cd->names[i]);
+}
+
+int
+dir_cache_save (DirCache *cache)
+{
+    GString *buf;
+    GError *error = NULL;
+    int ret = 0;
+
+    if (!cache->changed)
+        return 0;
+
+    buf = g_string_new (CACHE_MAGIC);
+    g_string_append_len (buf, (char *)cache->ignore_sig, 20);
+    g_hash_table_foreach (cache->dirs, write_record, buf);
+    put_be32 (buf, crc32 (0, (unsigned char *)buf->str, buf->len));
+
+    if (!g_file_set_contents (cache->path, buf->str, buf->len, &error)) {
+        seaf_warning ("Failed to save dir cache %s: %s.\n",
+                      cache->path, error->message);
+        g_clear_error (&error);
+        ret = -1;
+    } else {
+        cache->changed = FALSE;
+    }
+
+    g_string_free (buf, TRUE);
+    return ret;
+}
+
+void
+dir_cache_free (DirCache *cache)
+{
+    if (!cache)
+        return;
+
+    g_hash_table_destroy (cache->dirs);
+    g_free (cache->path);
+    g_free (cache);
+}
@@ -0,0 +1,53 @@
+/* -*- Mode: C; tab-width: 4; indent-tabs-mode: nil; c-basic-offset: 4 -*- */
+
+#ifndef DIR_CACHE_H
+#define DIR_CACHE_H
+
+#include <glib.h>
+
+/*
+ * Names of the entries in each worktree dir that aren't ignored, as of
+ * the mtime of the dir. A dir's mtime changes whenever an entry is added,
+ * removed or renamed in it, so a full scan can take the names of a dir
+ * with an unchanged mtime from here instead of reading the dir and
+ * checking every name against the ignore rules.
+ *
+ * The cache is dropped as a whole when the ignore rules change.
+ */
+
+typedef struct DirCache DirCache;
+
+/*
+ * Load the cache saved at @path. If there is none, or it was saved with
+ * a different @ignore_sig, the cache starts empty.
+ */
+DirCache *
+dir_cache_load (const char *path, const unsigned char *ignore_sig);
+
+/*
+ * The names cached for @dir, if its mtime is still @mtime.
+ * Owned by the cache.
+ */
+char **
+dir_cache_lookup (DirCache *cache, const char *dir, gint64 mtime);
+
+/*
+ * Cache a copy of @names for @dir, read at @mtime.
+ * Dirs changed in the last few seconds aren't cached, as another change
+ * in the same second wouldn't change their mtime.
+ */
+void
+dir_cache_set (DirCache *cache, const char *dir, gint64 mtime, char **names);
+
+/* Drop the dirs neither looked up nor set since the cache was loaded. */
+void
+dir_cache_prune (DirCache *cache);
+
+/* Write the cache back if it changed. Returns 0 on success. */
+int
+dir_cache_save (DirCache *cache);
+
+void
+dir_cache_free (DirCache *cache);
+
+#endif
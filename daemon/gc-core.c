@@ -9,47 +9,118 @@
 #define DEBUG_FLAG SEAFILE_DEBUG_OTHER
 #include "log.h"
 
-#define MAX_BF_SIZE (((size_t)1) << 29)   /* 64 MB */
+#define MAX_BF_SIZE (((guint64)1) << 29)   /* 64 MB */
+
+/*
+ * GC sleeps for GC_THROTTLE_USEC after reading this many files or
+ * checking this many blocks, to leave the disk to the rest of the daemon.
+ */
+#define GC_THROTTLE_BATCH 256
+#define GC_THROTTLE_USEC 10000  /* 10ms */
+
+/*
+ * Incremental runs only find blocks that were live at the last run. Blocks
+ * written but never committed (e.g. interrupted transfers) need a full run,
+ * which is done on the first GC of a repo and every FULL_GC_RUNS runs.
+ */
+#define FULL_GC_RUNS 10
 
 /* Total number of blocks to be scanned. */
 static guint64 total_blocks;
 static guint64 removed_blocks;
 static guint64 reachable_blocks;
 
+static guint64 throttle_count;
+
+/* State of a version 1 repo as of its last GC. */
+typedef struct {
+    /* The heads the live blocks were taken from. */
+    char *heads;
+    /* Sorted binary ids of the live blocks. */
+    GArray *live_blocks;
+} RepoGCState;
+
+typedef struct {
+    unsigned char sha1[20];
+} BlockSha1;
+
+/* repo_id -> RepoGCState */
+static GHashTable *repo_states;
+static int runs_since_full;
+
+static inline void
+gc_throttle ()
+{
+    if (++throttle_count % GC_THROTTLE_BATCH == 0)
+        g_usleep (GC_THROTTLE_USEC);
+}
+
+static void
+repo_gc_state_free (RepoGCState *state)
+{
+    g_free (state->heads);
+    g_array_free (state->live_blocks, TRUE);
+    g_free (state);
+}
+
 /*
- * The number of bits in the bloom filter is 4 times the number of all blocks.
- * Let m be the bits in the bf, n be the number of blocks to be added to the bf
- * (the number of live blocks), and k = 3 (closed to optimal for m/n = 4),
- * the probability of false-positive is
+ * The number of bits in the bloom filter is 6 times the number of all blocks.
+ * Let n be the number of blocks added to the bf (the number of live blocks).
+ * The filter is a blocked one (see bloom-filter.h), which needs a few more
+ * bits than a plain one: with m/n = 6 the probability of false-positive is
  *
- *     p = (1 - e^(-kn/m))^k = 0.15
+ *     p = 0.10
  *
- * Because m = 4 * total_blocks >= 4 * (live blocks) = 4n, we should have p <= 0.15.
- * Put it another way, we'll clean up at least 85% dead blocks in each gc operation.
- * See http://en.wikipedia.org/wiki/Bloom_filter.
+ * Because m = 6 * total_blocks >= 6 * (live blocks) = 6n, we should have p <= 0.10.
+ * Put it another way, we'll clean up at least 90% dead blocks in each gc operation.
  *
  * Supose we have 8TB space, and the avg block size is 1MB, we'll have 8M blocks, then
- * the size of bf is (8M * 4)/8 = 4MB.
+ * the size of bf is (8M * 6)/8 = 6MB.
  *
  * If total_blocks is a small number (e.g. < 100), we should try to clean all dead blocks.
  * So we set the minimal size of the bf to 1KB.
  */
-static Bloom *
+static BlockedBloom *
 alloc_gc_index ()
 {
-    size_t size;
+    guint64 size;
 
-    size = (size_t) MAX(total_blocks << 2, 1 << 13);
+    size = MAX(total_blocks * 6, 1 << 13);
     size = MIN (size, MAX_BF_SIZE);
 
-    seaf_message ("GC index size is %u Byte.\n", (int)size >> 3);
+    seaf_message ("GC index size is %u Byte.\n", (int)(size >> 3));
+
+    return bbloom_create (size);
+}
+
+static void
+index_add (BlockedBloom *index, const char *block_id)
+{
+    unsigned char raw[20];
+
+    if (hex_to_rawdata (block_id, raw, 20) < 0) {
+        seaf_warning ("Invalid block id %s.\n", block_id);
+        return;
+    }
+    bbloom_add (index, raw);
+}
 
-    return bloom_create (size, 3, 0);
+/* Blocks with bad ids are kept. */
+static gboolean
+index_test (BlockedBloom *index, const char *block_id)
+{
+    unsigned char raw[20];
+
+    if (hex_to_rawdata (block_id, raw, 20) < 0)
+        return TRUE;
+    return bbloom_test (index, raw);
 }
 
 typedef struct {
     SeafRepo *repo;
-    Bloom *index;
+    BlockedBloom *index;
+    /* Ids of the live blocks, if they're collected. */
+    GHashTable *live;
     GHashTable *visited;
     gboolean no_history;
     char remote_end_commit[41];
@@ -65,10 +136,12 @@ add_blocks_to_index (SeafFSManager *mgr,
                      const char *repo_id, int repo_version,
                      GCData *data, const char *file_id)
 {
-    Bloom *index = data->index;
+    BlockedBloom *index = data->index;
     Seafile *seafile;
     int i;
 
+    gc_throttle ();
+
     seafile = seaf_fs_manager_get_seafile (mgr,
                                            repo_id,
                                            repo_version,
@@ -79,7 +152,13 @@ add_blocks_to_index (SeafFSManager *mgr,
     }
 
     for (i = 0; i < seafile->n_blocks; ++i) {
-        bloom_add (index, seafile->blk_sha1s[i]);
+        if (index)
+            index_add (index, seafile->blk_sha1s[i]);
+        if (data->live &&
+            !g_hash_table_lookup (data->live, seafile->blk_sha1s[i])) {
+            char *key = g_strdup(seafile->blk_sha1s[i]);
+            g_hash_table_replace (data->live, key, key);
+        }
         ++data->traversed_blocks;
     }
 
@@ -145,7 +224,8 @@ traverse_commit (SeafCommit *commit, void *vdata, gboolean *stop)
 }
 
 static int
-populate_gc_index_for_repo (SeafRepo *repo, Bloom *index, gboolean ignore_errors)
+populate_gc_index_for_repo (SeafRepo *repo, BlockedBloom *index, GHashTable *live,
+                            gboolean ignore_errors)
 {
     GList *branches, *ptr;
     SeafBranch *branch;
@@ -163,6 +243,7 @@ populate_gc_index_for_repo (SeafRepo *repo, Bloom *index, gboolean ignore_errors
     data = g_new0(GCData, 1);
     data->repo = repo;
     data->index = index;
+    data->live = live;
     data->visited = g_hash_table_new_full (g_str_hash, g_str_equal, g_free, NULL);
     data->no_history = TRUE;
     if (data->no_history) {
@@ -210,7 +291,8 @@ populate_gc_index_for_repo (SeafRepo *repo, Bloom *index, gboolean ignore_errors
 
 static int
 populate_gc_index_for_head (const char *repo_id, int version,
-                            const char *head_id, Bloom *index)
+                            const char *head_id, BlockedBloom *index,
+                            GHashTable *live)
 {
     SeafCommit *head;
     GCData *data;
@@ -229,6 +311,7 @@ populate_gc_index_for_head (const char *repo_id, int version,
 
     data = g_new0 (GCData, 1);
     data->index = index;
+    data->live = live;
 
     ret = seaf_fs_manager_traverse_tree (seaf->fs_mgr,
                                          repo_id,
@@ -245,7 +328,7 @@ populate_gc_index_for_head (const char *repo_id, int version,
 }
 
 static int
-populate_gc_index_for_precheckout_repo (SeafRepo *repo, Bloom *index)
+populate_gc_index_for_precheckout_repo (SeafRepo *repo, BlockedBloom *index)
 {
     SeafBranch *master;
     SeafCommit *head;
@@ -290,7 +373,7 @@ populate_gc_index_for_precheckout_repo (SeafRepo *repo, Bloom *index)
 }
 
 typedef struct {
-    Bloom *index;
+    BlockedBloom *index;
     int dry_run;
 } CheckBlocksData;
 
@@ -301,9 +384,11 @@ check_block_liveness (const char *repo_id,
                       void *vdata)
 {
     CheckBlocksData *data = vdata;
-    Bloom *index = data->index;
+    BlockedBloom *index = data->index;
 
-    if (!bloom_test (index, block_id)) {
+    gc_throttle ();
+
+    if (!index_test (index, block_id)) {
         ++removed_blocks;
         if (!data->dry_run)
             seaf_block_manager_remove_block (seaf->block_mgr,
@@ -317,7 +402,7 @@ check_block_liveness (const char *repo_id,
 int
 gc_v0_repos (GList *repos, int dry_run, int ignore_errors)
 {
-    Bloom *index;
+    BlockedBloom *index;
     GList *clone_heads = NULL, *ptr;
     int ret;
 
@@ -350,7 +435,7 @@ gc_v0_repos (GList *repos, int dry_run, int ignore_errors)
     for (ptr = repos; ptr != NULL; ptr = ptr->next) {
         SeafRepo *repo = ptr->data;
         if (repo->head)
-            ret = populate_gc_index_for_repo (repo, index, ignore_errors);
+            ret = populate_gc_index_for_repo (repo, index, NULL, ignore_errors);
         else
             ret = populate_gc_index_for_precheckout_repo (repo, index);
         if (ret < 0 && !ignore_errors)
@@ -364,7 +449,7 @@ gc_v0_repos (GList *repos, int dry_run, int ignore_errors)
      */
     clone_heads = seaf_transfer_manager_get_clone_heads (seaf->transfer_mgr);
     for (ptr = clone_heads; ptr != NULL; ptr = ptr->next) {
-        populate_gc_index_for_head (NULL, 0, (char *)ptr->data, index);
+        populate_gc_index_for_head (NULL, 0, (char *)ptr->data, index, NULL);
         g_free (ptr->data);
     }
 
@@ -398,15 +483,91 @@ gc_v0_repos (GList *repos, int dry_run, int ignore_errors)
                       total_blocks, reachable_blocks, removed_blocks);
 
 out:
-    bloom_destroy (index);
+    bbloom_destroy (index);
     g_list_free (clone_heads);
     return ret;
 }
 
+static int
+cmp_block_sha1 (const void *a, const void *b)
+{
+    return memcmp (a, b, 20);
+}
+
+static GArray *
+live_blocks_to_array (GHashTable *live)
+{
+    GArray *array = g_array_sized_new (FALSE, FALSE, sizeof(BlockSha1),
+                                       g_hash_table_size (live));
+    GHashTableIter iter;
+    gpointer key;
+    BlockSha1 b;
+
+    g_hash_table_iter_init (&iter, live);
+    while (g_hash_table_iter_next (&iter, &key, NULL)) {
+        if (hex_to_sha1 ((const char *)key, b.sha1) < 0)
+            continue;
+        g_array_append_val (array, b);
+    }
+    qsort (array->data, array->len, sizeof(BlockSha1), cmp_block_sha1);
+
+    return array;
+}
+
+/*
+ * The commits the live blocks of @repo are taken from. If they didn't
+ * change, no block of the repo can have become garbage.
+ */
+static char *
+get_repo_heads (SeafRepo *repo)
+{
+    GList *branches, *ptr;
+    SeafBranch *branch;
+    GString *buf = g_string_new (NULL);
+    char *value;
+
+    branches = seaf_branch_manager_get_branch_list (seaf->branch_mgr, repo->id);
+    for (ptr = branches; ptr; ptr = ptr->next) {
+        branch = ptr->data;
+        g_string_append_printf (buf, "%s:%s\n", branch->name, branch->commit_id);
+        seaf_branch_unref (branch);
+    }
+    g_list_free (branches);
+
+    value = seaf_repo_manager_get_repo_property (repo->manager, repo->id,
+                                                 REPO_LOCAL_HEAD);
+    g_string_append_printf (buf, "local-head:%s\n", value ? value : "");
+    g_free (value);
+
+    value = seaf_repo_manager_get_repo_property (repo->manager, repo->id,
+                                                 REPO_REMOTE_HEAD);
+    g_string_append_printf (buf, "remote-head:%s\n", value ? value : "");
+    g_free (value);
+
+    value = seaf_transfer_manager_get_clone_head (seaf->transfer_mgr, repo->id);
+    g_string_append_printf (buf, "clone-head:%s\n", value ? value : "");
+    g_free (value);
+
+    return g_string_free (buf, FALSE);
+}
+
+static void
+save_repo_state (SeafRepo *repo, char *heads, GHashTable *live)
+{
+    RepoGCState *state = g_new0 (RepoGCState, 1);
+
+    state->heads = heads;
+    state->live_blocks = live_blocks_to_array (live);
+    g_hash_table_replace (repo_states, g_strdup(repo->id), state);
+}
+
 int
 gc_v1_repo (SeafRepo *repo, int dry_run, int ignore_errors)
 {
-    Bloom *index;
+    BlockedBloom *index;
+    GHashTable *live = NULL;
+    char *heads = NULL;
+    gboolean complete;
     int ret;
 
     if (!repo->head) {
@@ -439,11 +600,18 @@ gc_v1_repo (SeafRepo *repo, int dry_run, int ignore_errors)
         return -1;
     }
 
+    /* Keep the live blocks for the next run to start from. */
+    if (!dry_run) {
+        heads = get_repo_heads (repo);
+        live = g_hash_table_new_full (g_str_hash, g_str_equal, g_free, NULL);
+    }
+
     seaf_message ("Populating index.\n");
 
-    ret = populate_gc_index_for_repo (repo, index, ignore_errors);
+    ret = populate_gc_index_for_repo (repo, index, live, ignore_errors);
     if (ret < 0 && !ignore_errors) 
         goto out;
+    complete = (ret == 0);
 
     /* If seaf-daemon exits while downloading blocks, the downloaded new
      * blocks won't be refered by any repo_id. So after restart
@@ -454,10 +622,12 @@ gc_v1_repo (SeafRepo *repo, int dry_run, int ignore_errors)
                                                              repo->id);
     if (clone_head) {
         ret = populate_gc_index_for_head (repo->id, repo->version,
-                                          clone_head, index);
+                                          clone_head, index, live);
         g_free (clone_head);
         if (ret < 0 && !ignore_errors)
             goto out;
+        if (ret < 0)
+            complete = FALSE;
     }
 
     if (!dry_run)
@@ -490,16 +660,153 @@ gc_v1_repo (SeafRepo *repo, int dry_run, int ignore_errors)
                       "%"G_GUINT64_FORMAT" blocks can be removed.\n",
                       total_blocks, reachable_blocks, removed_blocks);
 
+    /* With errors ignored the live blocks may be incomplete. */
+    if (live && complete) {
+        save_repo_state (repo, heads, live);
+        heads = NULL;
+    }
+
+out:
+    bbloom_destroy (index);
+    if (live)
+        g_hash_table_destroy (live);
+    g_free (heads);
+    return ret;
+}
+
+/*
+ * Only blocks that were live at the last run can have become garbage since,
+ * so there's no need to list the whole block store. The blocks that are
+ * still live are collected exactly, and the ones that are no longer live
+ * are removed.
+ */
+static int
+gc_v1_repo_incremental (SeafRepo *repo, RepoGCState *state,
+                        int dry_run, int ignore_errors)
+{
+    GHashTable *live;
+    GArray *new_live = NULL;
+    char *heads, *clone_head;
+    BlockSha1 *old_b, *new_b;
+    guint i, j;
+    int cmp = 0;
+    char block_id[41];
+    int ret = 0;
+
+    heads = get_repo_heads (repo);
+    if (strcmp (heads, state->heads) == 0) {
+        seaf_message ("Heads of repo %s(%.8s) not changed. Skip GC.\n",
+                      repo->name, repo->id);
+        g_free (heads);
+        return 0;
+    }
+
+    removed_blocks = 0;
+    reachable_blocks = 0;
+
+    seaf_message ("Incremental GC started. %u blocks were live at last GC.\n",
+                  state->live_blocks->len);
+
+    live = g_hash_table_new_full (g_str_hash, g_str_equal, g_free, NULL);
+
+    ret = populate_gc_index_for_repo (repo, NULL, live, ignore_errors);
+    if (ret < 0)
+        goto out;
+
+    clone_head = seaf_transfer_manager_get_clone_head (seaf->transfer_mgr,
+                                                       repo->id);
+    if (clone_head) {
+        ret = populate_gc_index_for_head (repo->id, repo->version,
+                                          clone_head, NULL, live);
+        g_free (clone_head);
+        if (ret < 0)
+            goto out;
+    }
+
+    new_live = live_blocks_to_array (live);
+
+    /* Both are sorted, so walk them side by side. */
+    old_b = (BlockSha1 *)state->live_blocks->data;
+    new_b = (BlockSha1 *)new_live->data;
+    for (i = 0, j = 0; i < state->live_blocks->len; ++i) {
+        while (j < new_live->len &&
+               (cmp = memcmp (new_b[j].sha1, old_b[i].sha1, 20)) < 0)
+            ++j;
+        if (j < new_live->len && cmp == 0)
+            continue;
+
+        gc_throttle ();
+
+        rawdata_to_hex (old_b[i].sha1, block_id, 20);
+        if (!seaf_block_manager_block_exists (seaf->block_mgr,
+                                              repo->id, repo->version,
+                                              block_id))
+            continue;
+
+        ++removed_blocks;
+        if (!dry_run)
+            seaf_block_manager_remove_block (seaf->block_mgr,
+                                             repo->id, repo->version,
+                                             block_id);
+    }
+
+    if (!dry_run)
+        seaf_message ("Incremental GC finished. %u reachable blocks, "
+                      "%"G_GUINT64_FORMAT" blocks are removed.\n",
+                      new_live->len, removed_blocks);
+    else
+        seaf_message ("Incremental GC finished. %u reachable blocks, "
+                      "%"G_GUINT64_FORMAT" blocks can be removed.\n",
+                      new_live->len, removed_blocks);
+
+    /* A dry run leaves the blocks for the next run to find. */
+    if (!dry_run) {
+        g_free (state->heads);
+        state->heads = heads;
+        heads = NULL;
+        g_array_free (state->live_blocks, TRUE);
+        state->live_blocks = new_live;
+        new_live = NULL;
+    }
+
 out:
-    bloom_destroy (index);
+    if (ret < 0)
+        seaf_warning ("Incremental GC of repo %.8s failed.\n", repo->id);
+    g_hash_table_destroy (live);
+    if (new_live)
+        g_array_free (new_live, TRUE);
+    g_free (heads);
     return ret;
 }
 
+static gboolean
+repo_not_exists (gpointer key, gpointer value, gpointer user_data)
+{
+    return !seaf_repo_manager_repo_exists (seaf->repo_mgr, key);
+}
+
 int
 gc_core_run (int dry_run, int ignore_errors)
 {
     GList *repos = NULL, *v0_repos = NULL, *del_repos = NULL, *ptr;
     SeafRepo *repo;
+    RepoGCState *state;
+    gboolean full;
+
+    if (!repo_states)
+        repo_states = g_hash_table_new_full (g_str_hash, g_str_equal,
+                                             g_free,
+                                             (GDestroyNotify)repo_gc_state_free);
+
+    full = (runs_since_full >= FULL_GC_RUNS);
+    if (full && !dry_run) {
+        g_hash_table_remove_all (repo_states);
+        runs_since_full = 0;
+    }
+    if (!dry_run)
+        ++runs_since_full;
+
+    throttle_count = 0;
 
     seaf_message ("=== GC version 1 repos ===\n");
 
@@ -509,7 +816,11 @@ gc_core_run (int dry_run, int ignore_errors)
         if (repo->version > 0) {
             seaf_message ("GC version %d repo %s(%.8s)\n",
                           repo->version, repo->name, repo->id);
-            gc_v1_repo (repo, dry_run, ignore_errors);
+            state = g_hash_table_lookup (repo_states, repo->id);
+            if (state && !full && repo->head)
+                gc_v1_repo_incremental (repo, state, dry_run, ignore_errors);
+            else
+                gc_v1_repo (repo, dry_run, ignore_errors);
         } else
             v0_repos = g_list_prepend (v0_repos, repo);
     }
@@ -535,5 +846,7 @@ gc_core_run (int dry_run, int ignore_errors)
     }
     g_list_free (del_repos);
 
+    g_hash_table_foreach_remove (repo_states, repo_not_exists, NULL);
+
     return 0;
 }
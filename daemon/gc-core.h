@@ -1,6 +1,10 @@
 #ifndef GC_CORE_H
 #define GC_CORE_H
 
+/*
+ * Remove the blocks no repo refers to. Version 1 repos GC'ed before in this
+ * process only look at the blocks that were live at the last run.
+ */
 int gc_core_run (int dry_run, int ignore_errors);
 
 #endif
@@ -1,6 +1,15 @@
 /* -*- Mode: C; tab-width: 4; indent-tabs-mode: nil; c-basic-offset: 4 -*- */
 
 #include "common.h"
+
+#if defined __linux__
+#include <sys/syscall.h>
+#elif defined __APPLE__
+#include <sys/resource.h>
+#elif defined WIN32
+#include <windows.h>
+#endif
+
 #include "log.h"
 
 #include "seafile-session.h"
@@ -35,10 +44,45 @@ gc_is_started ()
     return g_atomic_int_get (&gc_started);
 }
 
+#ifdef __linux__
+/* From linux/ioprio.h, which isn't always installed. */
+#define IOPRIO_CLASS_SHIFT 13
+#define IOPRIO_CLASS_NONE 0
+#define IOPRIO_CLASS_IDLE 3
+#define IOPRIO_WHO_PROCESS 1
+#endif
+
+/*
+ * Have the disk serve the GC thread only when nobody else needs it.
+ * The job threads are shared, so the priority is restored afterwards.
+ */
+static void
+set_background_io (gboolean background)
+{
+#if defined __linux__ && defined SYS_ioprio_set
+    int ioprio = (background ? IOPRIO_CLASS_IDLE : IOPRIO_CLASS_NONE)
+        << IOPRIO_CLASS_SHIFT;
+
+    /* Who 0 is the calling thread. */
+    if (syscall (SYS_ioprio_set, IOPRIO_WHO_PROCESS, 0, ioprio) < 0)
+        seaf_warning ("Failed to set io priority: %s.\n", strerror(errno));
+#elif defined __APPLE__
+    if (setiopolicy_np (IOPOL_TYPE_DISK, IOPOL_SCOPE_THREAD,
+                        background ? IOPOL_THROTTLE : IOPOL_DEFAULT) < 0)
+        seaf_warning ("Failed to set io policy: %s.\n", strerror(errno));
+#elif defined WIN32
+    SetThreadPriority (GetCurrentThread (),
+                       background ? THREAD_MODE_BACKGROUND_BEGIN :
+                       THREAD_MODE_BACKGROUND_END);
+#endif
+}
+
 static void *
 gc_thread_func (void *data)
 {
+    set_background_io (TRUE);
     gc_core_run (0, 0);
+    set_background_io (FALSE);
     return NULL;
 }
 
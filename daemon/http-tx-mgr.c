@@ -4,6 +4,7 @@
 #include <curl/curl.h>
 #include <jansson.h>
 #include <event2/buffer.h>
+#include <openssl/sha.h>
 
 #include <ccnet/ccnet-client.h>
 
@@ -15,19 +16,34 @@
 #include "seafile-error.h"
 #include "utils.h"
 #include "diff-simple.h"
+#include "sync-paths.h"
 
 #define DEBUG_FLAG SEAFILE_DEBUG_TRANSFER
 #include "log.h"
 
 #define HTTP_OK 200
+#define HTTP_PARTIAL_CONTENT 206
 #define HTTP_BAD_REQUEST 400
 #define HTTP_FORBIDDEN 403
 #define HTTP_NOT_FOUND 404
+#define HTTP_CONFLICT 409
 #define HTTP_NO_QUOTA 443
 #define HTTP_REPO_DELETED 444
 #define HTTP_INTERNAL_SERVER_ERROR 500
 
-#define RESET_BYTES_INTERVAL_MSEC 1000
+/* Task rates are sampled this often, over the last second. */
+#define RATE_SAMPLE_INTERVAL_MSEC (1000 / HTTP_TX_RATE_SAMPLES)
+
+/* Tokens a bucket can save up while idle, in milliseconds of its rate. */
+#define BUCKET_BURST_MSEC 100
+
+#define DEFAULT_TRANSFER_PRIORITY 1
+#define MAX_TRANSFER_PRIORITY 10
+
+/* Idle connections kept per host, and for how long. */
+#define MAX_IDLE_CONNECTIONS 8
+#define CONNECTION_IDLE_TIMEOUT 300 /* seconds */
+#define CLEAN_CONNECTIONS_INTERVAL_MSEC 60000
 
 #ifndef SEAFILE_CLIENT_VERSION
 #define SEAFILE_CLIENT_VERSION PACKAGE_VERSION
@@ -47,17 +63,52 @@
 
 struct _Connection {
     CURL *curl;
-    gint64 ctime;               /* Used to clean up unused connection. */
+    gint64 ctime;               /* Last returned to the pool. */
 };
 typedef struct _Connection Connection;
 
+/*
+ * The connections to a host share TLS sessions and DNS lookups, so a new
+ * connection doesn't need a full handshake, and also open connections
+ * where libcurl supports that.
+ */
 struct _ConnectionPool {
     char *host;
-    GQueue *queue;
+    GQueue *queue;              /* idle, most recently used last */
     pthread_mutex_t lock;
+    CURLSH *share;
+    pthread_mutex_t share_locks[CURL_LOCK_DATA_LAST];
 };
 typedef struct _ConnectionPool ConnectionPool;
 
+/*
+ * Token bucket with weighted fair queuing among the waiting threads.
+ * Each take is stamped with the virtual finish time of its task, which
+ * grows by bytes / priority, and the earliest stamp goes first; so tasks
+ * share the bandwidth by their priority, whatever their number of
+ * threads or the size of their writes.
+ */
+typedef struct _BucketWaiter {
+    HttpTxTask *task;
+    double finish;
+} BucketWaiter;
+
+struct _TokenBucket {
+    gint *limit;                /* bytes per second, <= 0 for none */
+    pthread_mutex_t lock;
+    pthread_cond_t cond;
+    gint64 tokens;              /* negative while in debt */
+    gint64 last_fill;
+    double vclock;              /* finish time of the last take */
+    GList *waiters;             /* sorted by finish time */
+};
+typedef struct _TokenBucket TokenBucket;
+
+typedef struct _PriorityPaths {
+    GPtrArray *paths;
+    guint serial;
+} PriorityPaths;
+
 struct _HttpTxPriv {
     GHashTable *download_tasks;
     GHashTable *upload_tasks;
@@ -66,6 +117,30 @@ struct _HttpTxPriv {
     pthread_mutex_t pools_lock;
 
     CcnetTimer *reset_bytes_timer;
+    CcnetTimer *clean_connections_timer;
+
+    TokenBucket upload_bucket;
+    TokenBucket download_bucket;
+
+    /* repo_id -> PriorityPaths set through the RPC. Also protects the
+     * current file of the tasks, which checkout threads update.
+     */
+    GHashTable *priority_paths;
+    pthread_mutex_t priority_lock;
+
+    /* Requests run by the async engine, see http_async_request_start()
+     * and http_engine_perform().
+     */
+    CURLM *multi;
+    pthread_mutex_t async_lock;
+    pthread_cond_t async_cond;
+    GQueue *async_queue;        /* not started yet */
+    int max_async_requests;
+    GQueue *transfer_queue;     /* not started yet */
+    int max_transfer_requests;
+    GList *paused;              /* by callbacks, only used by the engine */
+    GAsyncQueue *async_done;    /* completed, for the main thread */
+    CcnetTimer *async_done_timer;
 };
 typedef struct _HttpTxPriv HttpTxPriv;
 
@@ -93,11 +168,23 @@ http_tx_task_new (HttpTxManager *mgr,
     task->host = g_strdup(host);
     task->token = g_strdup(token);
 
+    task->stats.start_time = get_current_time ();
+    task->stats.phase_start = task->stats.start_time;
+
     if (passwd)
         task->passwd = g_strdup(passwd);
     if (worktree)
         task->worktree = g_strdup(worktree);
 
+    task->priority = DEFAULT_TRANSFER_PRIORITY;
+    char *priority = seaf_repo_manager_get_repo_property (seaf->repo_mgr,
+                                                          repo_id,
+                                                          REPO_PROP_TRANSFER_PRIORITY);
+    if (priority) {
+        task->priority = CLAMP (atoi (priority), 1, MAX_TRANSFER_PRIORITY);
+        g_free (priority);
+    }
+
     return task;
 }
 
@@ -109,6 +196,7 @@ http_tx_task_free (HttpTxTask *task)
     g_free (task->passwd);
     g_free (task->worktree);
     g_free (task->email);
+    g_free (task->current_file);
     g_free (task);
 }
 
@@ -146,13 +234,16 @@ static const char *http_task_error_strs[] = {
 /* Http connection and connection pool. */
 
 static Connection *
-connection_new ()
+connection_new (ConnectionPool *pool)
 {
     Connection *conn = g_new0 (Connection, 1);
 
     conn->curl = curl_easy_init();
     conn->ctime = (gint64)time(NULL);
 
+    /* Stays set through curl_easy_reset(). */
+    curl_easy_setopt (conn->curl, CURLOPT_SHARE, pool->share);
+
     return conn;
 }
 
@@ -163,13 +254,45 @@ connection_free (Connection *conn)
     g_free (conn);
 }
 
+static void
+share_lock (CURL *handle, curl_lock_data data, curl_lock_access access,
+            void *userptr)
+{
+    ConnectionPool *pool = userptr;
+
+    pthread_mutex_lock (&pool->share_locks[data]);
+}
+
+static void
+share_unlock (CURL *handle, curl_lock_data data, void *userptr)
+{
+    ConnectionPool *pool = userptr;
+
+    pthread_mutex_unlock (&pool->share_locks[data]);
+}
+
 static ConnectionPool *
 connection_pool_new (const char *host)
 {
     ConnectionPool *pool = g_new0 (ConnectionPool, 1);
+    int i;
+
     pool->host = g_strdup(host);
     pool->queue = g_queue_new ();
     pthread_mutex_init (&pool->lock, NULL);
+
+    for (i = 0; i < CURL_LOCK_DATA_LAST; ++i)
+        pthread_mutex_init (&pool->share_locks[i], NULL);
+    pool->share = curl_share_init ();
+    curl_share_setopt (pool->share, CURLSHOPT_LOCKFUNC, share_lock);
+    curl_share_setopt (pool->share, CURLSHOPT_UNLOCKFUNC, share_unlock);
+    curl_share_setopt (pool->share, CURLSHOPT_USERDATA, pool);
+    curl_share_setopt (pool->share, CURLSHOPT_SHARE, CURL_LOCK_DATA_DNS);
+    curl_share_setopt (pool->share, CURLSHOPT_SHARE, CURL_LOCK_DATA_SSL_SESSION);
+#if LIBCURL_VERSION_NUM >= 0x073900
+    curl_share_setopt (pool->share, CURLSHOPT_SHARE, CURL_LOCK_DATA_CONNECT);
+#endif
+
     return pool;
 }
 
@@ -195,9 +318,10 @@ connection_pool_get_connection (ConnectionPool *pool)
     Connection *conn = NULL;
 
     pthread_mutex_lock (&pool->lock);
-    conn = g_queue_pop_head (pool->queue);
+    /* The most recently used one is the most likely to be still open. */
+    conn = g_queue_pop_tail (pool->queue);
     if (!conn) {
-        conn = connection_new ();
+        conn = connection_new (pool);
     }
     pthread_mutex_unlock (&pool->lock);
 
@@ -211,10 +335,206 @@ connection_pool_return_connection (ConnectionPool *pool, Connection *conn)
         return;
 
     curl_easy_reset (conn->curl);
+    conn->ctime = (gint64)time(NULL);
 
     pthread_mutex_lock (&pool->lock);
     g_queue_push_tail (pool->queue, conn);
+    if (g_queue_get_length (pool->queue) > MAX_IDLE_CONNECTIONS)
+        conn = g_queue_pop_head (pool->queue);
+    else
+        conn = NULL;
     pthread_mutex_unlock (&pool->lock);
+
+    if (conn)
+        connection_free (conn);
+}
+
+/* Close the connections that have been idle for too long. */
+static int
+clean_connections (void *vdata)
+{
+    HttpTxPriv *priv = vdata;
+    GHashTableIter iter;
+    gpointer key, value;
+    ConnectionPool *pool;
+    Connection *conn;
+    GList *expired = NULL, *ptr;
+    gint64 now = (gint64)time(NULL);
+
+    pthread_mutex_lock (&priv->pools_lock);
+    g_hash_table_iter_init (&iter, priv->connection_pools);
+    while (g_hash_table_iter_next (&iter, &key, &value)) {
+        pool = value;
+        pthread_mutex_lock (&pool->lock);
+        while ((conn = g_queue_peek_head (pool->queue)) != NULL &&
+               now - conn->ctime >= CONNECTION_IDLE_TIMEOUT)
+            expired = g_list_prepend (expired, g_queue_pop_head (pool->queue));
+        pthread_mutex_unlock (&pool->lock);
+    }
+    pthread_mutex_unlock (&priv->pools_lock);
+
+    for (ptr = expired; ptr; ptr = ptr->next)
+        connection_free ((Connection *)ptr->data);
+    g_list_free (expired);
+
+    return 1;
+}
+
+/* Options that curl_easy_reset() clears, set for every request. */
+static void
+set_connection_options (CURL *curl)
+{
+    curl_easy_setopt (curl, CURLOPT_TCP_KEEPALIVE, 1L);
+#if LIBCURL_VERSION_NUM >= 0x072f00
+    /* Negotiated with ALPN, only used if the server offers it. */
+    curl_easy_setopt (curl, CURLOPT_HTTP_VERSION, CURL_HTTP_VERSION_2TLS);
+#endif
+}
+
+static void
+token_bucket_init (TokenBucket *bucket, gint *limit)
+{
+    bucket->limit = limit;
+    pthread_mutex_init (&bucket->lock, NULL);
+    pthread_cond_init (&bucket->cond, NULL);
+    bucket->last_fill = get_current_time ();
+}
+
+static void
+token_bucket_fill (TokenBucket *bucket, gint64 limit)
+{
+    gint64 now = get_current_time ();
+    gint64 burst = limit * BUCKET_BURST_MSEC / 1000;
+
+    bucket->tokens += (now - bucket->last_fill) * limit / 1000000;
+    if (bucket->tokens > burst)
+        bucket->tokens = burst;
+    bucket->last_fill = now;
+}
+
+static gint
+cmp_waiter_finish (gconstpointer a, gconstpointer b)
+{
+    double fa = ((const BucketWaiter *)a)->finish;
+    double fb = ((const BucketWaiter *)b)->finish;
+
+    return (fa > fb) - (fa < fb);
+}
+
+/*
+ * Take @n bytes for @task, waiting for our turn and for the bucket to be
+ * out of debt. A take bigger than the bucket leaves it in debt, which
+ * the next takers wait off, so the rate holds for any size of write.
+ */
+static void
+token_bucket_take (TokenBucket *bucket, HttpTxTask *task, int n)
+{
+    BucketWaiter waiter;
+    gint64 limit, wait_usec;
+    struct timespec deadline;
+
+    if (g_atomic_int_get (bucket->limit) <= 0)
+        return;
+
+    pthread_mutex_lock (&bucket->lock);
+
+    waiter.task = task;
+    waiter.finish = MAX (task->vtime, bucket->vclock) + (double)n / task->priority;
+    task->vtime = waiter.finish;
+    bucket->waiters = g_list_insert_sorted (bucket->waiters, &waiter,
+                                            cmp_waiter_finish);
+
+    while (1) {
+        limit = g_atomic_int_get (bucket->limit);
+        if (limit <= 0)
+            break;
+        token_bucket_fill (bucket, limit);
+
+        if (bucket->waiters->data != &waiter) {
+            pthread_cond_wait (&bucket->cond, &bucket->lock);
+            continue;
+        }
+        if (bucket->tokens >= 0)
+            break;
+
+        /* Sleep until the debt is paid off, but notice limit changes. */
+        wait_usec = MIN (-bucket->tokens * 1000000 / limit, 100000) + 1000;
+        deadline.tv_sec = (bucket->last_fill + wait_usec) / 1000000;
+        deadline.tv_nsec = (bucket->last_fill + wait_usec) % 1000000 * 1000;
+        pthread_cond_timedwait (&bucket->cond, &bucket->lock, &deadline);
+    }
+
+    bucket->tokens -= n;
+    bucket->vclock = waiter.finish;
+    bucket->waiters = g_list_remove (bucket->waiters, &waiter);
+    pthread_cond_broadcast (&bucket->cond);
+
+    pthread_mutex_unlock (&bucket->lock);
+}
+
+/*
+ * Whether @task may move bytes now, for callbacks on the async engine,
+ * which can't wait in token_bucket_take(): the bucket is out of debt and
+ * no waiting take goes before @task's next one.
+ */
+static gboolean
+token_bucket_ready (TokenBucket *bucket, HttpTxTask *task)
+{
+    gint64 limit;
+    double start;
+    gboolean ready;
+
+    limit = g_atomic_int_get (bucket->limit);
+    if (limit <= 0)
+        return TRUE;
+
+    pthread_mutex_lock (&bucket->lock);
+
+    token_bucket_fill (bucket, limit);
+    start = MAX (task->vtime, bucket->vclock);
+    ready = (bucket->tokens >= 0 &&
+             (!bucket->waiters ||
+              ((BucketWaiter *)bucket->waiters->data)->finish > start));
+
+    pthread_mutex_unlock (&bucket->lock);
+
+    return ready;
+}
+
+/* Take @n bytes moved by @task after token_bucket_ready(), without waiting. */
+static void
+token_bucket_charge (TokenBucket *bucket, HttpTxTask *task, int n)
+{
+    if (g_atomic_int_get (bucket->limit) <= 0)
+        return;
+
+    pthread_mutex_lock (&bucket->lock);
+
+    task->vtime = MAX (task->vtime, bucket->vclock) + (double)n / task->priority;
+    bucket->vclock = task->vtime;
+    bucket->tokens -= n;
+    /* Waiting takes may go first now. */
+    pthread_cond_broadcast (&bucket->cond);
+
+    pthread_mutex_unlock (&bucket->lock);
+}
+
+static void
+clear_priority_paths (PriorityPaths *pp)
+{
+    guint i;
+
+    for (i = 0; i < pp->paths->len; ++i)
+        g_free (g_ptr_array_index (pp->paths, i));
+    g_ptr_array_set_size (pp->paths, 0);
+}
+
+static void
+priority_paths_free (PriorityPaths *pp)
+{
+    clear_priority_paths (pp);
+    g_ptr_array_free (pp->paths, TRUE);
+    g_free (pp);
 }
 
 HttpTxManager *
@@ -235,11 +555,53 @@ http_tx_manager_new (struct _SeafileSession *seaf)
     priv->connection_pools = g_hash_table_new (g_str_hash, g_str_equal);
     pthread_mutex_init (&priv->pools_lock, NULL);
 
+    pthread_mutex_init (&priv->async_lock, NULL);
+    pthread_cond_init (&priv->async_cond, NULL);
+    priv->async_queue = g_queue_new ();
+    priv->transfer_queue = g_queue_new ();
+    priv->async_done = g_async_queue_new ();
+
+    priv->priority_paths = g_hash_table_new_full (g_str_hash, g_str_equal,
+                                                  g_free,
+                                                  (GDestroyNotify)priority_paths_free);
+    pthread_mutex_init (&priv->priority_lock, NULL);
+
+    token_bucket_init (&priv->upload_bucket, &seaf->sync_mgr->upload_limit);
+    token_bucket_init (&priv->download_bucket, &seaf->sync_mgr->download_limit);
+
     mgr->priv = priv;
 
     return mgr;
 }
 
+static int
+take_tx_bytes (HttpTxTask *task)
+{
+    int n;
+
+    do {
+        n = g_atomic_int_get (&task->tx_bytes);
+    } while (!g_atomic_int_compare_and_exchange (&task->tx_bytes, n, 0));
+
+    task->stats.bytes += n;
+    return n;
+}
+
+static void
+sample_task_rate (HttpTxTask *task)
+{
+    int i, n, total = 0;
+
+    n = take_tx_bytes (task);
+
+    task->rate_samples[task->rate_index] = n;
+    task->rate_index = (task->rate_index + 1) % HTTP_TX_RATE_SAMPLES;
+
+    for (i = 0; i < HTTP_TX_RATE_SAMPLES; ++i)
+        total += task->rate_samples[i];
+    task->last_tx_bytes = total;
+}
+
 static int
 reset_bytes (void *vdata)
 {
@@ -247,35 +609,35 @@ reset_bytes (void *vdata)
     HttpTxPriv *priv = mgr->priv;
     GHashTableIter iter;
     gpointer key, value;
-    HttpTxTask *task;
 
     g_hash_table_iter_init (&iter, priv->download_tasks);
-    while (g_hash_table_iter_next (&iter, &key, &value)) {
-        task = value;
-        task->last_tx_bytes = g_atomic_int_get (&task->tx_bytes);
-        g_atomic_int_set (&task->tx_bytes, 0);
-    }
+    while (g_hash_table_iter_next (&iter, &key, &value))
+        sample_task_rate (value);
 
     g_hash_table_iter_init (&iter, priv->upload_tasks);
-    while (g_hash_table_iter_next (&iter, &key, &value)) {
-        task = value;
-        task->last_tx_bytes = g_atomic_int_get (&task->tx_bytes);
-        g_atomic_int_set (&task->tx_bytes, 0);
-    }
+    while (g_hash_table_iter_next (&iter, &key, &value))
+        sample_task_rate (value);
 
     return 1;
 }
 
+static int http_async_start (HttpTxPriv *priv);
+
 int
 http_tx_manager_start (HttpTxManager *mgr)
 {
     curl_global_init (CURL_GLOBAL_ALL);
 
-    /* TODO: add a timer to clean up unused Http connections. */
-
     mgr->priv->reset_bytes_timer = ccnet_timer_new (reset_bytes,
                                                     mgr,
-                                                    RESET_BYTES_INTERVAL_MSEC);
+                                                    RATE_SAMPLE_INTERVAL_MSEC);
+
+    mgr->priv->clean_connections_timer = ccnet_timer_new (clean_connections,
+                                                          mgr->priv,
+                                                          CLEAN_CONNECTIONS_INTERVAL_MSEC);
+
+    if (http_async_start (mgr->priv) < 0)
+        return -1;
 
     return 0;
 }
@@ -343,6 +705,8 @@ recv_response (void *contents, size_t size, size_t nmemb, void *userp)
 
 typedef size_t (*HttpRecvCallback) (void *, size_t, size_t, void *);
 
+static CURLcode http_engine_perform (CURL *curl);
+
 /*
  * The @timeout parameter is for detecting network connection problems. 
  * The @timeout parameter should be set to TRUE for data-transfer-only operations,
@@ -372,6 +736,7 @@ http_get (CURL *curl, const char *url, const char *token,
 
     curl_easy_setopt(curl, CURLOPT_URL, url);
     curl_easy_setopt(curl, CURLOPT_NOSIGNAL, 1L);
+    set_connection_options (curl);
 
     if (timeout) {
         /* Set low speed limit to 1 bytes. This effectively means no data. */
@@ -399,7 +764,7 @@ http_get (CURL *curl, const char *url, const char *token,
 
     curl_easy_setopt(curl, CURLOPT_FOLLOWLOCATION, 1L);
 
-    int rc = curl_easy_perform (curl);
+    int rc = http_engine_perform (curl);
     if (rc != 0) {
         seaf_warning ("libcurl failed to GET %s: %s.\n",
                       url, curl_easy_strerror(rc));
@@ -505,6 +870,7 @@ http_put (CURL *curl, const char *url, const char *token,
     }
 
     curl_easy_setopt(curl, CURLOPT_NOSIGNAL, 1L);
+    set_connection_options (curl);
 
     HttpResponse rsp;
     memset (&rsp, 0, sizeof(rsp));
@@ -518,7 +884,7 @@ http_put (CURL *curl, const char *url, const char *token,
 
     curl_easy_setopt(curl, CURLOPT_FOLLOWLOCATION, 1L);
 
-    int rc = curl_easy_perform (curl);
+    int rc = http_engine_perform (curl);
     if (rc != 0) {
         seaf_warning ("libcurl failed to PUT %s: %s.\n",
                       url, curl_easy_strerror(rc));
@@ -592,6 +958,7 @@ http_post (CURL *curl, const char *url, const char *token,
     curl_easy_setopt(curl, CURLOPT_POSTFIELDSIZE_LARGE, (curl_off_t)req_size);
 
     curl_easy_setopt(curl, CURLOPT_NOSIGNAL, 1L);
+    set_connection_options (curl);
 
     HttpResponse rsp;
     memset (&rsp, 0, sizeof(rsp));
@@ -607,7 +974,7 @@ http_post (CURL *curl, const char *url, const char *token,
     /* All POST requests should remain POST after redirect. */
     curl_easy_setopt(curl, CURLOPT_POSTREDIR, CURL_REDIR_POST_ALL);
 
-    int rc = curl_easy_perform (curl);
+    int rc = http_engine_perform (curl);
     if (rc != 0) {
         seaf_warning ("libcurl failed to POST %s: %s.\n",
                       url, curl_easy_strerror(rc));
@@ -654,141 +1021,620 @@ handle_http_errors (HttpTxTask *task, int status)
         task->error = HTTP_TASK_ERR_UNKNOWN;
 }
 
+/*
+ * Async engine.
+ *
+ * All HTTP requests are driven by a single thread with the curl multi
+ * interface. Requests that aren't part of a transfer task, such as
+ * protocol and head commit checks, don't hold a thread at all while they
+ * wait for the server; their callbacks are called in the main thread.
+ * The requests of transfer tasks, blocks and fs objects included, are
+ * made with http_engine_perform(), which waits for the engine to run them.
+ *
+ * At most max_async_requests queries and max_transfer_requests transfer
+ * requests run at once; the rest wait in their queue. Curl callbacks of
+ * transfers are called in the engine thread, so they must not wait: when
+ * over the rate limit they pause their transfer, see http_engine_admit().
+ */
+
+#define DEFAULT_HTTP_MAX_ASYNC_REQUESTS 10
+#define DEFAULT_HTTP_MAX_TRANSFER_REQUESTS 32
+
+#if LIBCURL_VERSION_NUM >= 0x074400
+#define HAVE_CURL_MULTI_WAKEUP 1
+/* New requests wake the engine up, this is only a safety net. */
+#define ASYNC_POLL_MSEC 1000
+#else
+/* How long the engine waits on sockets before looking for new requests. */
+#define ASYNC_POLL_MSEC 10
+#endif
+/* How often paused transfers are given another go. */
+#define PAUSED_RETRY_MSEC 10
+/* How often completed requests are handed to their callbacks. */
+#define ASYNC_DONE_INTERVAL_MSEC 50
+
+typedef struct _HttpEngineHandle HttpEngineHandle;
+
+/* A request on the engine, the CURLOPT_PRIVATE of its curl handle. */
+struct _HttpEngineHandle {
+    CURL *curl;
+    gboolean transfer;          /* counts against max_transfer_requests */
+    /* Called in the engine thread once the request is done. */
+    void (*done) (HttpEngineHandle *handle, CURLcode result);
+    HttpTxTask *paused_task;    /* set while paused for the rate limit */
+};
+
+typedef struct _HttpAsyncRequest HttpAsyncRequest;
+
+/* @req->status is -1 if no response was received. */
+typedef void (*HttpAsyncCallback) (HttpAsyncRequest *req, void *user_data);
+
+struct _HttpAsyncRequest {
+    HttpEngineHandle handle;
+    char *url;
+    int status;
+    char *rsp_content;
+    gint64 rsp_size;
+
+    ConnectionPool *pool;
+    Connection *conn;
+    struct curl_slist *headers;
+    char *req_content;
+    HttpResponse rsp;
+    HttpAsyncCallback callback;
+    void *user_data;
+};
+
 static void
-emit_transfer_done_signal (HttpTxTask *task)
+http_async_request_free (HttpAsyncRequest *req)
 {
-    if (task->type == HTTP_TASK_TYPE_DOWNLOAD)
-        g_signal_emit_by_name (seaf, "repo-http-fetched", task);
-    else
-        g_signal_emit_by_name (seaf, "repo-http-uploaded", task);
+    if (req->conn)
+        connection_pool_return_connection (req->pool, req->conn);
+    curl_slist_free_all (req->headers);
+    g_free (req->url);
+    g_free (req->req_content);
+    g_free (req->rsp_content);
+    g_free (req->rsp.content);
+    g_free (req);
 }
 
 static void
-transition_state (HttpTxTask *task, int state, int rt_state)
+http_async_request_finish (HttpEngineHandle *handle, CURLcode result)
 {
-    seaf_message ("Transfer repo '%.8s': ('%s', '%s') --> ('%s', '%s')\n",
-                  task->repo_id,
-                  http_task_state_to_str(task->state),
-                  http_task_rt_state_to_str(task->runtime_state),
-                  http_task_state_to_str(state),
-                  http_task_rt_state_to_str(rt_state));
-
-    if (state != task->state)
-        task->state = state;
-    task->runtime_state = rt_state;
+    HttpTxPriv *priv = seaf->http_tx_mgr->priv;
+    HttpAsyncRequest *req = (HttpAsyncRequest *)handle;
+    long status;
 
-    if (rt_state == HTTP_TASK_RT_STATE_FINISHED) {
-        /* Clear download head info. */
-        if (task->type == HTTP_TASK_TYPE_DOWNLOAD &&
-            state == HTTP_TASK_STATE_FINISHED)
-            seaf_repo_manager_set_repo_property (seaf->repo_mgr,
-                                                 task->repo_id,
-                                                 REPO_PROP_DOWNLOAD_HEAD,
-                                                 EMPTY_SHA1);
+    req->status = -1;
 
-        emit_transfer_done_signal (task);
+    if (result != CURLE_OK) {
+        seaf_warning ("libcurl failed to %s %s: %s.\n",
+                      req->req_content ? "POST" : "GET",
+                      req->url, curl_easy_strerror(result));
+    } else if (curl_easy_getinfo (req->conn->curl, CURLINFO_RESPONSE_CODE,
+                                  &status) != CURLE_OK) {
+        seaf_warning ("Failed to get status code for %s.\n", req->url);
+    } else {
+        req->status = status;
+        req->rsp_content = req->rsp.content;
+        req->rsp_size = req->rsp.size;
+        req->rsp.content = NULL;
     }
+
+    connection_pool_return_connection (req->pool, req->conn);
+    req->conn = NULL;
+
+    g_async_queue_push (priv->async_done, req);
 }
 
-typedef struct {
-    char *host;
-    gboolean use_fileserver_port;
-    HttpProtocolVersionCallback callback;
-    void *user_data;
+static gint
+cmp_paused_vtime (gconstpointer a, gconstpointer b)
+{
+    double va = ((const HttpEngineHandle *)a)->paused_task->vtime;
+    double vb = ((const HttpEngineHandle *)b)->paused_task->vtime;
 
-    gboolean success;
-    gboolean not_supported;
-    int version;
-} CheckProtocolData;
+    return (va > vb) - (va < vb);
+}
 
-static int
-parse_protocol_version (const char *rsp_content, int rsp_size, CheckProtocolData *data)
+/* Give the paused transfers another go, the least served task first. */
+static void
+resume_paused_transfers (HttpTxPriv *priv)
 {
-    json_t *object = NULL;
-    json_error_t jerror;
-    int version;
+    GList *paused, *ptr;
+    HttpEngineHandle *handle;
 
-    object = json_loadb (rsp_content, rsp_size, 0, &jerror);
-    if (!object) {
-        seaf_warning ("Parse response failed: %s.\n", jerror.text);
-        return -1;
-    }
+    paused = g_list_sort (priv->paused, cmp_paused_vtime);
+    priv->paused = NULL;
 
-    if (json_object_has_member (object, "version")) {
-        version = json_object_get_int_member (object, "version");
-        data->version = version;
-    } else {
-        seaf_warning ("Response doesn't contain protocol version.\n");
-        json_decref (object);
-        return -1;
+    for (ptr = paused; ptr; ptr = ptr->next) {
+        handle = ptr->data;
+        handle->paused_task = NULL;
+        /* Its callback may pause it again right away. */
+        curl_easy_pause (handle->curl, CURLPAUSE_CONT);
     }
-
-    json_decref (object);
-    return 0;
+    g_list_free (paused);
 }
 
 static void *
-check_protocol_version_thread (void *vdata)
+http_async_thread (void *vdata)
 {
-    CheckProtocolData *data = vdata;
-    HttpTxPriv *priv = seaf->http_tx_mgr->priv;
-    ConnectionPool *pool;
-    Connection *conn;
-    CURL *curl;
-    char *url;
-    int status;
-    char *rsp_content = NULL;
-    gint64 rsp_size;
+    HttpTxPriv *priv = vdata;
+    CURLM *multi = priv->multi;
+    CURLMsg *msg;
+    CURLcode result;
+    HttpEngineHandle *handle;
+    int n_queries = 0, n_transfers = 0, still_running, n_msgs;
+    gint64 last_resume = 0, now;
 
-    pool = find_connection_pool (priv, data->host);
-    if (!pool) {
-        seaf_warning ("Failed to create connection pool for host %s.\n", data->host);
-        return vdata;
-    }
+    while (1) {
+        pthread_mutex_lock (&priv->async_lock);
+        while (n_queries + n_transfers == 0 &&
+               g_queue_is_empty (priv->async_queue) &&
+               g_queue_is_empty (priv->transfer_queue))
+            pthread_cond_wait (&priv->async_cond, &priv->async_lock);
+        while (n_queries < priv->max_async_requests &&
+               (handle = g_queue_pop_head (priv->async_queue)) != NULL) {
+            curl_multi_add_handle (multi, handle->curl);
+            ++n_queries;
+        }
+        while (n_transfers < priv->max_transfer_requests &&
+               (handle = g_queue_pop_head (priv->transfer_queue)) != NULL) {
+            curl_multi_add_handle (multi, handle->curl);
+            ++n_transfers;
+        }
+        pthread_mutex_unlock (&priv->async_lock);
 
-    conn = connection_pool_get_connection (pool);
-    if (!conn) {
-        seaf_warning ("Failed to get connection to host %s.\n", data->host);
-        return vdata;
-    }
+        now = get_current_time ();
+        if (priv->paused && now - last_resume >= PAUSED_RETRY_MSEC * 1000) {
+            resume_paused_transfers (priv);
+            last_resume = now;
+        }
 
-    curl = conn->curl;
+        curl_multi_perform (multi, &still_running);
+
+        while ((msg = curl_multi_info_read (multi, &n_msgs)) != NULL) {
+            if (msg->msg != CURLMSG_DONE)
+                continue;
+            /* msg is gone once the handle is removed. */
+            result = msg->data.result;
+            curl_easy_getinfo (msg->easy_handle, CURLINFO_PRIVATE, (char **)&handle);
+            curl_multi_remove_handle (multi, msg->easy_handle);
+            if (handle->paused_task)
+                priv->paused = g_list_remove (priv->paused, handle);
+            if (handle->transfer)
+                --n_transfers;
+            else
+                --n_queries;
+
+            handle->done (handle, result);
+        }
 
-    if (!data->use_fileserver_port)
-        url = g_strdup_printf ("%s/seafhttp/protocol-version", data->host);
-    else
-        url = g_strdup_printf ("%s/protocol-version", data->host);
+        if (n_queries + n_transfers > 0) {
+#ifdef HAVE_CURL_MULTI_WAKEUP
+            curl_multi_poll (multi, NULL, 0,
+                             priv->paused ? PAUSED_RETRY_MSEC : ASYNC_POLL_MSEC,
+                             NULL);
+#else
+            curl_multi_wait (multi, NULL, 0,
+                             priv->paused ? PAUSED_RETRY_MSEC : ASYNC_POLL_MSEC,
+                             NULL);
+#endif
+        }
+    }
 
-    if (http_get (curl, url, NULL, &status, &rsp_content, &rsp_size, NULL, NULL, FALSE) < 0) {
-        goto out;
+    return NULL;
+}
+
+/* Queue @handle to be run by the engine. */
+static void
+http_engine_submit (HttpTxPriv *priv, HttpEngineHandle *handle)
+{
+    curl_easy_setopt (handle->curl, CURLOPT_PRIVATE, handle);
+
+    pthread_mutex_lock (&priv->async_lock);
+    g_queue_push_tail (handle->transfer ? priv->transfer_queue : priv->async_queue,
+                       handle);
+    pthread_cond_signal (&priv->async_cond);
+    pthread_mutex_unlock (&priv->async_lock);
+
+#ifdef HAVE_CURL_MULTI_WAKEUP
+    /* In case the engine is waiting on the sockets of other requests. */
+    curl_multi_wakeup (priv->multi);
+#endif
+}
+
+static int
+http_async_done_pulse (void *vdata)
+{
+    HttpTxPriv *priv = vdata;
+    HttpAsyncRequest *req;
+
+    while ((req = g_async_queue_try_pop (priv->async_done)) != NULL) {
+        req->callback (req, req->user_data);
+        http_async_request_free (req);
     }
 
-    data->success = TRUE;
+    return 1;
+}
 
-    if (status == HTTP_OK) {
-        if (rsp_size == 0)
-            data->not_supported = TRUE;
-        else if (parse_protocol_version (rsp_content, rsp_size, data) < 0)
-            data->not_supported = TRUE;
+static int
+http_async_start (HttpTxPriv *priv)
+{
+    pthread_attr_t attr;
+    pthread_t tid;
+    gboolean exists;
+    int max_requests;
+    int rc;
+
+    max_requests = seafile_session_config_get_int (seaf,
+                                                   KEY_HTTP_MAX_ASYNC_REQUESTS,
+                                                   &exists);
+    if (!exists || max_requests <= 0)
+        max_requests = DEFAULT_HTTP_MAX_ASYNC_REQUESTS;
+    priv->max_async_requests = max_requests;
+
+    max_requests = seafile_session_config_get_int (seaf,
+                                                   KEY_HTTP_MAX_TRANSFER_REQUESTS,
+                                                   &exists);
+    if (!exists || max_requests <= 0)
+        max_requests = DEFAULT_HTTP_MAX_TRANSFER_REQUESTS;
+    priv->max_transfer_requests = max_requests;
+
+    priv->multi = curl_multi_init ();
+#if LIBCURL_VERSION_NUM >= 0x072b00
+    /* Requests to the same server share HTTP/2 connections. */
+    curl_multi_setopt (priv->multi, CURLMOPT_PIPELINING, CURLPIPE_MULTIPLEX);
+#endif
+
+    pthread_attr_init (&attr);
+    pthread_attr_setdetachstate (&attr, PTHREAD_CREATE_DETACHED);
+    rc = pthread_create (&tid, &attr, http_async_thread, priv);
+    pthread_attr_destroy (&attr);
+    if (rc != 0) {
+        seaf_warning ("Failed to start http async thread: %s.\n", strerror(rc));
+        return -1;
+    }
+
+    priv->async_done_timer = ccnet_timer_new (http_async_done_pulse, priv,
+                                              ASYNC_DONE_INTERVAL_MSEC);
+
+    return 0;
+}
+
+/*
+ * GET @url, or POST @req_content to it if that's not NULL. @req_content
+ * is taken over. @callback is always called, in the main thread.
+ */
+static void
+http_async_request_start (const char *host, char *url, const char *token,
+                          char *req_content,
+                          HttpAsyncCallback callback, void *user_data)
+{
+    HttpTxPriv *priv = seaf->http_tx_mgr->priv;
+    HttpAsyncRequest *req;
+    CURL *curl;
+    char *token_header;
+
+    req = g_new0 (HttpAsyncRequest, 1);
+    req->url = url;
+    req->req_content = req_content;
+    req->callback = callback;
+    req->user_data = user_data;
+
+    req->pool = find_connection_pool (priv, host);
+    req->conn = connection_pool_get_connection (req->pool);
+    curl = req->conn->curl;
+    req->handle.curl = curl;
+    req->handle.done = http_async_request_finish;
+
+    req->headers = curl_slist_append (req->headers, "User-Agent: Seafile/"SEAFILE_CLIENT_VERSION" ("USER_AGENT_OS")");
+    if (token) {
+        token_header = g_strdup_printf ("Seafile-Repo-Token: %s", token);
+        req->headers = curl_slist_append (req->headers, token_header);
+        g_free (token_header);
+    }
+    curl_easy_setopt(curl, CURLOPT_HTTPHEADER, req->headers);
+
+    curl_easy_setopt(curl, CURLOPT_URL, url);
+    curl_easy_setopt(curl, CURLOPT_NOSIGNAL, 1L);
+    set_connection_options (curl);
+#if LIBCURL_VERSION_NUM >= 0x072b00
+    /* Rather wait for a stream on an HTTP/2 connection being set up. */
+    curl_easy_setopt(curl, CURLOPT_PIPEWAIT, 1L);
+#endif
+
+    if (seaf->disable_verify_certificate) {
+        curl_easy_setopt (curl, CURLOPT_SSL_VERIFYPEER, 0L);
+        curl_easy_setopt (curl, CURLOPT_SSL_VERIFYHOST, 0L);
+    }
+
+    if (req_content) {
+        curl_easy_setopt(curl, CURLOPT_POST, 1L);
+        curl_easy_setopt(curl, CURLOPT_POSTFIELDS, req_content);
+        curl_easy_setopt(curl, CURLOPT_POSTFIELDSIZE_LARGE,
+                         (curl_off_t)strlen(req_content));
+        /* All POST requests should remain POST after redirect. */
+        curl_easy_setopt(curl, CURLOPT_POSTREDIR, CURL_REDIR_POST_ALL);
+    }
+
+    curl_easy_setopt(curl, CURLOPT_WRITEFUNCTION, recv_response);
+    curl_easy_setopt(curl, CURLOPT_WRITEDATA, &req->rsp);
+
+    gboolean is_https = (strncasecmp(url, "https", strlen("https")) == 0);
+    set_proxy (curl, is_https);
+
+    curl_easy_setopt(curl, CURLOPT_FOLLOWLOCATION, 1L);
+
+    http_engine_submit (priv, &req->handle);
+}
+
+/* Call @callback for a request that couldn't be made, like the others. */
+static void
+http_async_request_fail (HttpAsyncCallback callback, void *user_data)
+{
+    HttpTxPriv *priv = seaf->http_tx_mgr->priv;
+    HttpAsyncRequest *req;
+
+    req = g_new0 (HttpAsyncRequest, 1);
+    req->status = -1;
+    req->callback = callback;
+    req->user_data = user_data;
+
+    g_async_queue_push (priv->async_done, req);
+}
+
+/* A request of a transfer task, waited for by the thread that made it. */
+typedef struct _HttpSyncRequest {
+    HttpEngineHandle handle;
+    CURLcode result;
+    gboolean done;
+    pthread_mutex_t lock;
+    pthread_cond_t cond;
+} HttpSyncRequest;
+
+static void
+http_sync_request_done (HttpEngineHandle *handle, CURLcode result)
+{
+    HttpSyncRequest *req = (HttpSyncRequest *)handle;
+
+    pthread_mutex_lock (&req->lock);
+    req->result = result;
+    req->done = TRUE;
+    pthread_cond_signal (&req->cond);
+    pthread_mutex_unlock (&req->lock);
+}
+
+/*
+ * Run the request set up on @curl on the engine, like curl_easy_perform().
+ * Its callbacks are called in the engine thread.
+ */
+static CURLcode
+http_engine_perform (CURL *curl)
+{
+    HttpTxPriv *priv = seaf->http_tx_mgr->priv;
+    HttpSyncRequest req;
+
+    memset (&req, 0, sizeof(req));
+    req.handle.curl = curl;
+    req.handle.transfer = TRUE;
+    req.handle.done = http_sync_request_done;
+    pthread_mutex_init (&req.lock, NULL);
+    pthread_cond_init (&req.cond, NULL);
+
+    http_engine_submit (priv, &req.handle);
+
+    pthread_mutex_lock (&req.lock);
+    while (!req.done)
+        pthread_cond_wait (&req.cond, &req.lock);
+    pthread_mutex_unlock (&req.lock);
+
+    pthread_mutex_destroy (&req.lock);
+    pthread_cond_destroy (&req.cond);
+    return req.result;
+}
+
+/*
+ * For curl callbacks of transfers, which are called in the engine thread
+ * and can't wait in token_bucket_take(). Returns TRUE if @task may move
+ * bytes now. Otherwise the transfer on @curl is paused until the engine
+ * resumes it, and the callback must return the pause code of curl at once,
+ * without taking any data.
+ */
+static gboolean
+http_engine_admit (TokenBucket *bucket, HttpTxTask *task, CURL *curl)
+{
+    HttpTxPriv *priv = seaf->http_tx_mgr->priv;
+    HttpEngineHandle *handle = NULL;
+
+    if (token_bucket_ready (bucket, task))
+        return TRUE;
+
+    curl_easy_getinfo (curl, CURLINFO_PRIVATE, (char **)&handle);
+    if (!handle->paused_task)
+        priv->paused = g_list_prepend (priv->paused, handle);
+    handle->paused_task = task;
+    return FALSE;
+}
+
+static void
+emit_transfer_done_signal (HttpTxTask *task)
+{
+    if (task->type == HTTP_TASK_TYPE_DOWNLOAD)
+        g_signal_emit_by_name (seaf, "repo-http-fetched", task);
+    else
+        g_signal_emit_by_name (seaf, "repo-http-uploaded", task);
+}
+
+char *
+http_tx_task_stats_to_json (HttpTxTask *task)
+{
+    HttpTxStats *stats = &task->stats;
+    json_t *object, *phases;
+    gint64 end;
+    char *ret;
+    int i;
+
+    if (task->runtime_state == HTTP_TASK_RT_STATE_FINISHED)
+        end = stats->phase_start;
+    else
+        end = get_current_time ();
+
+    phases = json_object ();
+    for (i = HTTP_TASK_RT_STATE_CHECK; i < HTTP_TASK_RT_STATE_FINISHED; ++i) {
+        gint64 t = stats->phase_time[i];
+        if (i == task->runtime_state)
+            t += end - stats->phase_start;
+        json_object_set_new (phases, http_task_rt_state_to_str (i),
+                             json_integer (t / 1000));
+    }
+
+    object = json_object ();
+    json_object_set_new (object, "type",
+                         json_string (task->type == HTTP_TASK_TYPE_DOWNLOAD ?
+                                      "download" : "upload"));
+    json_object_set_new (object, "state",
+                         json_string (http_task_state_to_str (task->state)));
+    json_object_set_new (object, "total_ms",
+                         json_integer ((end - stats->start_time) / 1000));
+    json_object_set_new (object, "phases", phases);
+    json_object_set_new (object, "check_ms",
+                         json_integer (stats->check_time / 1000));
+    json_object_set_new (object, "checks", json_integer (stats->n_checks));
+    json_object_set_new (object, "fs_objects",
+                         json_integer (stats->n_fs_objects));
+    if (task->type == HTTP_TASK_TYPE_UPLOAD) {
+        json_object_set_new (object, "fs_list_ms",
+                             json_integer (stats->fs_list_time / 1000));
+        json_object_set_new (object, "blocks",
+                             json_integer (task->done_blocks));
     } else {
-        seaf_warning ("Bad response code for GET %s: %d.\n", url, status);
-        data->not_supported = TRUE;
+        json_object_set_new (object, "update_local_ms",
+                             json_integer (stats->update_local_time / 1000));
+        json_object_set_new (object, "files", json_integer (task->done_files));
     }
+    json_object_set_new (object, "bytes",
+                         json_integer (stats->bytes + task->tx_bytes));
 
-out:
-    g_free (url);
-    g_free (rsp_content);
-    connection_pool_return_connection (pool, conn);
+    ret = json_dumps (object, JSON_COMPACT);
+    json_decref (object);
+    return ret;
+}
 
-    return vdata;
+static void
+account_phase (HttpTxTask *task, int rt_state)
+{
+    HttpTxStats *stats = &task->stats;
+    gint64 now;
+    char *json;
+
+    if (rt_state == task->runtime_state)
+        return;
+
+    now = get_current_time ();
+    stats->phase_time[task->runtime_state] += now - stats->phase_start;
+    stats->phase_start = now;
+
+    if (rt_state != HTTP_TASK_RT_STATE_FINISHED)
+        return;
+
+    /* The rest since the last rate sample. */
+    take_tx_bytes (task);
+
+    task->runtime_state = rt_state;
+    json = http_tx_task_stats_to_json (task);
+    if (json) {
+        seaf_message ("Transfer repo '%.8s' stats: %s\n", task->repo_id, json);
+        g_free (json);
+    }
+}
+
+static void
+transition_state (HttpTxTask *task, int state, int rt_state)
+{
+    seaf_message ("Transfer repo '%.8s': ('%s', '%s') --> ('%s', '%s')\n",
+                  task->repo_id,
+                  http_task_state_to_str(task->state),
+                  http_task_rt_state_to_str(task->runtime_state),
+                  http_task_state_to_str(state),
+                  http_task_rt_state_to_str(rt_state));
+
+    if (state != task->state)
+        task->state = state;
+    account_phase (task, rt_state);
+    task->runtime_state = rt_state;
+
+    if (rt_state == HTTP_TASK_RT_STATE_FINISHED) {
+        /* Clear download head info. */
+        if (task->type == HTTP_TASK_TYPE_DOWNLOAD &&
+            state == HTTP_TASK_STATE_FINISHED)
+            seaf_repo_manager_set_repo_property (seaf->repo_mgr,
+                                                 task->repo_id,
+                                                 REPO_PROP_DOWNLOAD_HEAD,
+                                                 EMPTY_SHA1);
+
+        emit_transfer_done_signal (task);
+    }
+}
+
+typedef struct {
+    char *host;
+    gboolean use_fileserver_port;
+    HttpProtocolVersionCallback callback;
+    void *user_data;
+
+    gboolean success;
+    gboolean not_supported;
+    int version;
+} CheckProtocolData;
+
+static int
+parse_protocol_version (const char *rsp_content, int rsp_size, CheckProtocolData *data)
+{
+    json_t *object = NULL;
+    json_error_t jerror;
+    int version;
+
+    object = json_loadb (rsp_content, rsp_size, 0, &jerror);
+    if (!object) {
+        seaf_warning ("Parse response failed: %s.\n", jerror.text);
+        return -1;
+    }
+
+    if (json_object_has_member (object, "version")) {
+        version = json_object_get_int_member (object, "version");
+        data->version = version;
+    } else {
+        seaf_warning ("Response doesn't contain protocol version.\n");
+        json_decref (object);
+        return -1;
+    }
+
+    json_decref (object);
+    return 0;
 }
 
 static void
-check_protocol_version_done (void *vdata)
+check_protocol_version_done (HttpAsyncRequest *req, void *vdata)
 {
     CheckProtocolData *data = vdata;
     HttpProtocolVersion result;
 
+    if (req->status >= 0) {
+        data->success = TRUE;
+
+        if (req->status == HTTP_OK) {
+            if (req->rsp_size == 0)
+                data->not_supported = TRUE;
+            else if (parse_protocol_version (req->rsp_content, req->rsp_size,
+                                             data) < 0)
+                data->not_supported = TRUE;
+        } else {
+            seaf_warning ("Bad response code for GET %s: %d.\n",
+                          req->url, req->status);
+            data->not_supported = TRUE;
+        }
+    }
+
     memset (&result, 0, sizeof(result));
     result.check_success = data->success;
     result.not_supported = data->not_supported;
@@ -808,16 +1654,20 @@ http_tx_manager_check_protocol_version (HttpTxManager *manager,
                                         void *user_data)
 {
     CheckProtocolData *data = g_new0 (CheckProtocolData, 1);
+    char *url;
 
     data->host = g_strdup(host);
     data->use_fileserver_port = use_fileserver_port;
     data->callback = callback;
     data->user_data = user_data;
 
-    ccnet_job_manager_schedule_job (seaf->job_mgr,
-                                    check_protocol_version_thread,
-                                    check_protocol_version_done,
-                                    data);
+    if (!use_fileserver_port)
+        url = g_strdup_printf ("%s/seafhttp/protocol-version", host);
+    else
+        url = g_strdup_printf ("%s/protocol-version", host);
+
+    http_async_request_start (host, url, NULL, NULL,
+                              check_protocol_version_done, data);
 
     return 0;
 }
@@ -872,68 +1722,23 @@ parse_head_commit_info (const char *rsp_content, int rsp_size, CheckHeadData *da
     return 0;
 }
 
-static void *
-check_head_commit_thread (void *vdata)
+static void
+check_head_commit_done (HttpAsyncRequest *req, void *vdata)
 {
     CheckHeadData *data = vdata;
-    HttpTxPriv *priv = seaf->http_tx_mgr->priv;
-    ConnectionPool *pool;
-    Connection *conn;
-    CURL *curl;
-    char *url;
-    int status;
-    char *rsp_content = NULL;
-    gint64 rsp_size;
-
-    pool = find_connection_pool (priv, data->host);
-    if (!pool) {
-        seaf_warning ("Failed to create connection pool for host %s.\n", data->host);
-        return vdata;
-    }
-
-    conn = connection_pool_get_connection (pool);
-    if (!conn) {
-        seaf_warning ("Failed to get connection to host %s.\n", data->host);
-        return vdata;
-    }
-
-    curl = conn->curl;
-
-    if (!data->use_fileserver_port)
-        url = g_strdup_printf ("%s/seafhttp/repo/%s/commit/HEAD",
-                               data->host, data->repo_id);
-    else
-        url = g_strdup_printf ("%s/repo/%s/commit/HEAD",
-                               data->host, data->repo_id);
-
-    if (http_get (curl, url, data->token, &status, &rsp_content, &rsp_size,
-                  NULL, NULL, FALSE) < 0)
-        goto out;
+    HttpHeadCommit result;
 
-    if (status == HTTP_OK) {
-        if (parse_head_commit_info (rsp_content, rsp_size, data) < 0)
-            goto out;
-        data->success = TRUE;
-    } else if (status == HTTP_REPO_DELETED) {
+    if (req->status == HTTP_OK) {
+        if (parse_head_commit_info (req->rsp_content, req->rsp_size, data) == 0)
+            data->success = TRUE;
+    } else if (req->status == HTTP_REPO_DELETED) {
         data->is_deleted = TRUE;
         data->success = TRUE;
-    } else {
-        seaf_warning ("Bad response code for GET %s: %d.\n", url, status);
+    } else if (req->status >= 0) {
+        seaf_warning ("Bad response code for GET %s: %d.\n",
+                      req->url, req->status);
     }
 
-out:
-    g_free (url);
-    g_free (rsp_content);
-    connection_pool_return_connection (pool, conn);
-    return vdata;
-}
-
-static void
-check_head_commit_done (void *vdata)
-{
-    CheckHeadData *data = vdata;
-    HttpHeadCommit result;
-
     memset (&result, 0, sizeof(result));
     result.check_success = data->success;
     result.is_corrupt = data->is_corrupt;
@@ -958,6 +1763,7 @@ http_tx_manager_check_head_commit (HttpTxManager *manager,
                                    void *user_data)
 {
     CheckHeadData *data = g_new0 (CheckHeadData, 1);
+    char *url;
 
     memcpy (data->repo_id, repo_id, 36);
     data->repo_version = repo_version;
@@ -967,12 +1773,289 @@ http_tx_manager_check_head_commit (HttpTxManager *manager,
     data->user_data = user_data;
     data->use_fileserver_port = use_fileserver_port;
 
-    ccnet_job_manager_schedule_job (seaf->job_mgr,
-                                    check_head_commit_thread,
-                                    check_head_commit_done,
-                                    data);
-
-    return 0;
+    if (!use_fileserver_port)
+        url = g_strdup_printf ("%s/seafhttp/repo/%s/commit/HEAD",
+                               host, data->repo_id);
+    else
+        url = g_strdup_printf ("%s/repo/%s/commit/HEAD",
+                               host, data->repo_id);
+
+    http_async_request_start (host, url, token, NULL,
+                              check_head_commit_done, data);
+
+    return 0;
+}
+
+/* Check head commits of many repos. */
+
+void
+http_head_commit_req_free (HttpHeadCommitReq *req)
+{
+    if (!req)
+        return;
+    g_free (req->token);
+    g_free (req);
+}
+
+typedef struct {
+    char *host;
+    gboolean use_fileserver_port;
+    HttpHeadCommitsCallback callback;
+    void *user_data;
+
+    gboolean success;
+    GHashTable *heads;
+} CheckHeadsData;
+
+static json_t *
+head_commit_requests_to_json (GList *requests)
+{
+    GList *ptr;
+    HttpHeadCommitReq *req;
+    json_t *object, *array;
+
+    array = json_array ();
+
+    for (ptr = requests; ptr; ptr = ptr->next) {
+        req = ptr->data;
+
+        object = json_object ();
+        json_object_set_new (object, "repo_id", json_string(req->repo_id));
+        json_object_set_new (object, "token", json_string(req->token));
+
+        json_array_append_new (array, object);
+    }
+
+    return array;
+}
+
+static char *
+compose_check_head_commits_request (GList *requests)
+{
+    json_t *array;
+    char *req_str = NULL;
+
+    array = head_commit_requests_to_json (requests);
+
+    req_str = json_dumps (array, 0);
+    if (!req_str) {
+        seaf_warning ("Failed to json_dumps.\n");
+    }
+
+    json_decref (array);
+    return req_str;
+}
+
+static int
+parse_head_commits (const char *rsp_content, int rsp_size, CheckHeadsData *data)
+{
+    json_t *object, *member;
+    json_error_t jerror;
+    const char *repo_id, *head_commit;
+    void *iter;
+
+    object = json_loadb (rsp_content, rsp_size, 0, &jerror);
+    if (!object) {
+        seaf_warning ("Parse response failed: %s.\n", jerror.text);
+        return -1;
+    }
+
+    data->heads = g_hash_table_new_full (g_str_hash, g_str_equal,
+                                         g_free, g_free);
+
+    for (iter = json_object_iter (object); iter;
+         iter = json_object_iter_next (object, iter)) {
+        repo_id = json_object_iter_key (iter);
+        member = json_object_iter_value (iter);
+        head_commit = json_string_value (member);
+        if (strlen(repo_id) != 36 || !head_commit || strlen(head_commit) != 40) {
+            seaf_warning ("Invalid head commits response format.\n");
+            continue;
+        }
+        g_hash_table_insert (data->heads, g_strdup(repo_id), g_strdup(head_commit));
+    }
+
+    json_decref (object);
+    return 0;
+}
+
+static void
+check_head_commits_done (HttpAsyncRequest *req, void *vdata)
+{
+    CheckHeadsData *data = vdata;
+    HttpHeadCommits cb_data;
+
+    if (req->status == HTTP_OK) {
+        if (parse_head_commits (req->rsp_content, req->rsp_size, data) == 0)
+            data->success = TRUE;
+    } else if (req->status >= 0) {
+        seaf_warning ("Bad response code for POST %s: %d.\n",
+                      req->url, req->status);
+    }
+
+    memset (&cb_data, 0, sizeof(cb_data));
+    cb_data.success = data->success;
+    cb_data.heads = data->heads;
+
+    data->callback (&cb_data, data->user_data);
+
+    if (data->heads)
+        g_hash_table_unref (data->heads);
+    g_free (data->host);
+    g_free (data);
+}
+
+int
+http_tx_manager_check_head_commits (HttpTxManager *manager,
+                                    const char *host,
+                                    gboolean use_fileserver_port,
+                                    GList *head_commit_requests,
+                                    HttpHeadCommitsCallback callback,
+                                    void *user_data)
+{
+    CheckHeadsData *data = g_new0 (CheckHeadsData, 1);
+    char *url;
+    char *req_content;
+    GList *ptr;
+
+    data->host = g_strdup(host);
+    data->callback = callback;
+    data->user_data = user_data;
+    data->use_fileserver_port = use_fileserver_port;
+
+    req_content = compose_check_head_commits_request (head_commit_requests);
+
+    for (ptr = head_commit_requests; ptr; ptr = ptr->next)
+        http_head_commit_req_free ((HttpHeadCommitReq *)ptr->data);
+    g_list_free (head_commit_requests);
+
+    if (!req_content) {
+        http_async_request_fail (check_head_commits_done, data);
+        return 0;
+    }
+
+    if (!use_fileserver_port)
+        url = g_strdup_printf ("%s/seafhttp/repo/head-commits-multi/", host);
+    else
+        url = g_strdup_printf ("%s/repo/head-commits-multi/", host);
+
+    http_async_request_start (host, url, NULL, req_content,
+                              check_head_commits_done, data);
+
+    return 0;
+}
+
+/* Wait for head changes of many repos. */
+
+typedef struct {
+    HttpHeadWatchCallback callback;
+    void *user_data;
+} WatchHeadsData;
+
+static int
+parse_head_watch (const char *rsp_content, int rsp_size, HttpHeadWatch *result)
+{
+    json_t *object, *cursor, *repos;
+    json_error_t jerror;
+    const char *repo_id;
+    size_t i;
+    int ret = 0;
+
+    object = json_loadb (rsp_content, rsp_size, 0, &jerror);
+    if (!object) {
+        seaf_warning ("Parse response failed: %s.\n", jerror.text);
+        return -1;
+    }
+
+    cursor = json_object_get (object, "cursor");
+    repos = json_object_get (object, "repos");
+    if (!json_is_integer (cursor) || !json_is_array (repos)) {
+        seaf_warning ("Invalid head commits watch response format.\n");
+        ret = -1;
+        goto out;
+    }
+
+    result->cursor = json_integer_value (cursor);
+    for (i = 0; i < json_array_size (repos); ++i) {
+        repo_id = json_string_value (json_array_get (repos, i));
+        if (!repo_id || strlen(repo_id) != 36)
+            continue;
+        result->repo_ids = g_list_prepend (result->repo_ids, g_strdup(repo_id));
+    }
+
+out:
+    json_decref (object);
+    return ret;
+}
+
+static void
+watch_head_commits_done (HttpAsyncRequest *req, void *vdata)
+{
+    WatchHeadsData *data = vdata;
+    HttpHeadWatch result;
+
+    memset (&result, 0, sizeof(result));
+
+    if (req->status == HTTP_OK) {
+        if (parse_head_watch (req->rsp_content, req->rsp_size, &result) == 0)
+            result.success = TRUE;
+    } else if (req->status >= 0) {
+        seaf_warning ("Bad response code for POST %s: %d.\n",
+                      req->url, req->status);
+    }
+
+    data->callback (&result, data->user_data);
+
+    string_list_free (result.repo_ids);
+    g_free (data);
+}
+
+int
+http_tx_manager_watch_head_commits (HttpTxManager *manager,
+                                    const char *host,
+                                    gboolean use_fileserver_port,
+                                    gboolean has_cursor,
+                                    gint64 cursor,
+                                    GList *head_commit_requests,
+                                    HttpHeadWatchCallback callback,
+                                    void *user_data)
+{
+    WatchHeadsData *data = g_new0 (WatchHeadsData, 1);
+    json_t *object;
+    char *url;
+    char *req_content;
+    GList *ptr;
+
+    data->callback = callback;
+    data->user_data = user_data;
+
+    object = json_object ();
+    if (has_cursor)
+        json_object_set_new (object, "cursor", json_integer (cursor));
+    json_object_set_new (object, "repos",
+                         head_commit_requests_to_json (head_commit_requests));
+    req_content = json_dumps (object, 0);
+    json_decref (object);
+
+    for (ptr = head_commit_requests; ptr; ptr = ptr->next)
+        http_head_commit_req_free ((HttpHeadCommitReq *)ptr->data);
+    g_list_free (head_commit_requests);
+
+    if (!req_content) {
+        seaf_warning ("Failed to json_dumps.\n");
+        http_async_request_fail (watch_head_commits_done, data);
+        return 0;
+    }
+
+    if (!use_fileserver_port)
+        url = g_strdup_printf ("%s/seafhttp/repo/head-commits-watch/", host);
+    else
+        url = g_strdup_printf ("%s/repo/head-commits-watch/", host);
+
+    http_async_request_start (host, url, NULL, req_content,
+                              watch_head_commits_done, data);
+
+    return 0;
 }
 
 /* Get folder permissions. */
@@ -1214,81 +2297,31 @@ compose_get_folder_perms_request (GList *requests)
     return req_str;
 }
 
-static void *
-get_folder_perms_thread (void *vdata)
+static void
+get_folder_perms_done (HttpAsyncRequest *req, void *vdata)
 {
     GetFolderPermsData *data = vdata;
-    HttpTxPriv *priv = seaf->http_tx_mgr->priv;
-    ConnectionPool *pool;
-    Connection *conn;
-    CURL *curl;
-    char *url;
-    char *req_content = NULL;
-    int status;
-    char *rsp_content = NULL;
-    gint64 rsp_size;
+    HttpFolderPerms cb_data;
     GList *ptr;
 
-    pool = find_connection_pool (priv, data->host);
-    if (!pool) {
-        seaf_warning ("Failed to create connection pool for host %s.\n", data->host);
-        return vdata;
-    }
-
-    conn = connection_pool_get_connection (pool);
-    if (!conn) {
-        seaf_warning ("Failed to get connection to host %s.\n", data->host);
-        return vdata;
-    }
-
-    curl = conn->curl;
-
-    if (!data->use_fileserver_port)
-        url = g_strdup_printf ("%s/seafhttp/repo/folder-perm", data->host);
-    else
-        url = g_strdup_printf ("%s/repo/folder-perm", data->host);
-
-    req_content = compose_get_folder_perms_request (data->requests);
-    if (!req_content)
-        goto out;
-
-    if (http_post (curl, url, NULL, req_content, strlen(req_content),
-                   &status, &rsp_content, &rsp_size, FALSE) < 0)
-        goto out;
-
-    if (status == HTTP_OK) {
-        if (parse_folder_perms (rsp_content, rsp_size, data) < 0)
-            goto out;
-        data->success = TRUE;
-    } else {
-        seaf_warning ("Bad response code for GET %s: %d.\n", url, status);
+    if (req->status == HTTP_OK) {
+        if (parse_folder_perms (req->rsp_content, req->rsp_size, data) == 0)
+            data->success = TRUE;
+    } else if (req->status >= 0) {
+        seaf_warning ("Bad response code for POST %s: %d.\n",
+                      req->url, req->status);
     }
 
-out:
     for (ptr = data->requests; ptr; ptr = ptr->next)
         http_folder_perm_req_free ((HttpFolderPermReq *)ptr->data);
     g_list_free (data->requests);
 
-    g_free (url);
-    g_free (req_content);
-    g_free (rsp_content);
-    connection_pool_return_connection (pool, conn);
-    return vdata;
-}
-
-static void
-get_folder_perms_done (void *vdata)
-{
-    GetFolderPermsData *data = vdata;
-    HttpFolderPerms cb_data;
-
     memset (&cb_data, 0, sizeof(cb_data));
     cb_data.success = data->success;
     cb_data.results = data->results;
 
     data->callback (&cb_data, data->user_data);
 
-    GList *ptr;
     for (ptr = data->results; ptr; ptr = ptr->next)
         http_folder_perm_res_free ((HttpFolderPermRes *)ptr->data);
     g_list_free (data->results);
@@ -1306,6 +2339,8 @@ http_tx_manager_get_folder_perms (HttpTxManager *manager,
                                   void *user_data)
 {
     GetFolderPermsData *data = g_new0 (GetFolderPermsData, 1);
+    char *url;
+    char *req_content;
 
     data->host = g_strdup(host);
     data->requests = folder_perm_requests;
@@ -1313,10 +2348,19 @@ http_tx_manager_get_folder_perms (HttpTxManager *manager,
     data->user_data = user_data;
     data->use_fileserver_port = use_fileserver_port;
 
-    ccnet_job_manager_schedule_job (seaf->job_mgr,
-                                    get_folder_perms_thread,
-                                    get_folder_perms_done,
-                                    data);
+    req_content = compose_get_folder_perms_request (folder_perm_requests);
+    if (!req_content) {
+        http_async_request_fail (get_folder_perms_done, data);
+        return 0;
+    }
+
+    if (!use_fileserver_port)
+        url = g_strdup_printf ("%s/seafhttp/repo/folder-perm", host);
+    else
+        url = g_strdup_printf ("%s/repo/folder-perm", host);
+
+    http_async_request_start (host, url, NULL, req_content,
+                              get_folder_perms_done, data);
 
     return 0;
 }
@@ -1496,6 +2540,27 @@ check_quota_and_active_paths_diff_dirs (int n, const char *basedir,
     return 0;
 }
 
+/*
+ * With some sub-folders synced, local and master only differ in those.
+ * The rest of the tree may not be present locally, so it's not diffed.
+ */
+static SyncPaths *
+get_active_sync_paths (HttpTxTask *task)
+{
+    SeafRepo *repo = seaf_repo_manager_get_repo (seaf->repo_mgr, task->repo_id);
+
+    return repo ? seaf_repo_get_active_sync_paths (repo) : NULL;
+}
+
+static void
+set_sync_paths_filter (DiffOptions *opts, SyncPaths *sync_paths)
+{
+    if (sync_paths) {
+        opts->filter = sync_paths_filter;
+        opts->filter_data = sync_paths;
+    }
+}
+
 static int
 calculate_upload_size_delta_and_active_paths (HttpTxTask *task,
                                               gint64 *delta,
@@ -1504,6 +2569,7 @@ calculate_upload_size_delta_and_active_paths (HttpTxTask *task,
     int ret = 0;
     SeafBranch *local = NULL, *master = NULL;
     SeafCommit *local_head = NULL, *master_head = NULL;
+    SyncPaths *sync_paths = get_active_sync_paths (task);
 
     local = seaf_branch_manager_get_branch (seaf->branch_mgr, task->repo_id, "local");
     if (!local) {
@@ -1549,6 +2615,7 @@ calculate_upload_size_delta_and_active_paths (HttpTxTask *task,
     opts.file_cb = check_quota_and_active_paths_diff_files;
     opts.dir_cb = check_quota_and_active_paths_diff_dirs;
     opts.data = &data;
+    set_sync_paths_filter (&opts, sync_paths);
 
     const char *trees[2];
     trees[0] = local_head->root_id;
@@ -1568,6 +2635,7 @@ out:
     seaf_branch_unref (master);
     seaf_commit_unref (local_head);
     seaf_commit_unref (master_head);
+    sync_paths_free (sync_paths);
 
     return ret;
 }
@@ -1716,12 +2784,57 @@ collect_dir_ids (int n, const char *basedir, SeafDirent *dirs[], void *vdata,
     return 0;
 }
 
+/*
+ * The dirs leading to the synced sub-folders are walked through, not
+ * diffed. Add the ones changed, other than the root.
+ */
+static void
+collect_parent_dir_ids (HttpTxTask *task, const SyncPaths *sync_paths,
+                        const char *local_root, const char *master_root,
+                        CalcFsListData *data)
+{
+    char *path, *p, *local_id, *master_id;
+    int i, dummy;
+
+    for (i = 0; i < sync_paths->n_paths; ++i) {
+        path = g_strdup (sync_paths->paths[i]);
+        for (p = strchr (path, '/'); p; p = strchr (p + 1, '/')) {
+            *p = '\0';
+            local_id = seaf_fs_manager_get_seafdir_id_by_path (seaf->fs_mgr,
+                                                               task->repo_id,
+                                                               task->repo_version,
+                                                               local_root,
+                                                               path, NULL);
+            if (!local_id) {
+                *p = '/';
+                break;
+            }
+            master_id = seaf_fs_manager_get_seafdir_id_by_path (seaf->fs_mgr,
+                                                                task->repo_id,
+                                                                task->repo_version,
+                                                                master_root,
+                                                                path, NULL);
+            if (strcmp (local_id, EMPTY_SHA1) != 0 &&
+                (!master_id || strcmp (local_id, master_id) != 0) &&
+                !g_hash_table_lookup (data->checked_objs, local_id)) {
+                *data->pret = g_list_prepend (*data->pret, g_strdup (local_id));
+                g_hash_table_insert (data->checked_objs, g_strdup (local_id), &dummy);
+            }
+            g_free (local_id);
+            g_free (master_id);
+            *p = '/';
+        }
+        g_free (path);
+    }
+}
+
 static GList *
 calculate_send_fs_object_list (HttpTxTask *task)
 {
     GList *ret = NULL;
     SeafBranch *local = NULL, *master = NULL;
     SeafCommit *local_head = NULL, *master_head = NULL;
+    SyncPaths *sync_paths = get_active_sync_paths (task);
     GList *ptr;
 
     local = seaf_branch_manager_get_branch (seaf->branch_mgr, task->repo_id, "local");
@@ -1768,6 +2881,7 @@ calculate_send_fs_object_list (HttpTxTask *task)
     opts.file_cb = collect_file_ids;
     opts.dir_cb = collect_dir_ids;
     opts.data = data;
+    set_sync_paths_filter (&opts, sync_paths);
 
     const char *trees[2];
     trees[0] = local_head->root_id;
@@ -1778,6 +2892,9 @@ calculate_send_fs_object_list (HttpTxTask *task)
         for (ptr = ret; ptr; ptr = ptr->next)
             g_free (ptr->data);
         ret = NULL;
+    } else if (sync_paths) {
+        collect_parent_dir_ids (task, sync_paths, local_head->root_id,
+                                master_head->root_id, data);
     }
 
     g_hash_table_destroy (data->checked_objs);
@@ -1788,26 +2905,169 @@ out:
     seaf_branch_unref (master);
     seaf_commit_unref (local_head);
     seaf_commit_unref (master_head);
+    sync_paths_free (sync_paths);
     return ret;
 }
 
 #define ID_LIST_SEGMENT_N 1000
 
-static int
-upload_check_id_list_segment (HttpTxTask *task, Connection *conn, const char *url,
-                              GList **send_id_list, GList **recv_id_list)
-{
-    json_t *array;
-    json_error_t jerror;
-    char *obj_id;
-    int n_sent = 0;
-    char *data = NULL;
-    int len;
-    CURL *curl;
-    int status;
-    char *rsp_content = NULL;
-    gint64 rsp_size;
-    int ret = 0;
+/* Servers send a filter of the blocks they have from this version on. */
+#define BLOCK_FILTER_PROTO_VERSION 6
+
+#define BLOCK_FILTER_HDR_LEN 16
+
+typedef struct {
+    unsigned char *bits;
+    guint64 n_bits;
+    int n_hashes;
+    int word_size;
+    gboolean big_endian;
+} BlockFilter;
+
+static void
+block_filter_free (BlockFilter *filter)
+{
+    g_free (filter->bits);
+    g_free (filter);
+}
+
+/*
+ * Get the server's bloom filter of the blocks in the repo, see
+ * get_block_filter_cb() in the server. Returns NULL if there's none.
+ */
+static BlockFilter *
+get_block_filter (HttpTxTask *task, Connection *conn)
+{
+    CURL *curl = conn->curl;
+    char *url;
+    int status;
+    char *rsp_content = NULL;
+    gint64 rsp_size;
+    const unsigned char *hdr;
+    BlockFilter *filter = NULL;
+    guint64 n_bits = 0;
+    int i;
+
+    if (!task->use_fileserver_port)
+        url = g_strdup_printf ("%s/seafhttp/repo/%s/block-filter",
+                               task->host, task->repo_id);
+    else
+        url = g_strdup_printf ("%s/repo/%s/block-filter",
+                               task->host, task->repo_id);
+
+    if (http_get (curl, url, task->token, &status, &rsp_content, &rsp_size,
+                  NULL, NULL, TRUE) < 0 || status != HTTP_OK)
+        goto out;
+
+    if (rsp_size < BLOCK_FILTER_HDR_LEN ||
+        memcmp (rsp_content, "SBF1", 4) != 0)
+        goto bad;
+
+    hdr = (const unsigned char *)rsp_content;
+    for (i = 0; i < 8; ++i)
+        n_bits = (n_bits << 8) | hdr[8 + i];
+
+    /* The hash words are taken from a sha256. */
+    if (n_bits == 0 || hdr[4] == 0 ||
+        (hdr[5] != 4 && hdr[5] != 8) || hdr[4] * hdr[5] > SHA256_DIGEST_LENGTH ||
+        (n_bits + 7) / 8 != rsp_size - BLOCK_FILTER_HDR_LEN)
+        goto bad;
+
+    filter = g_new0 (BlockFilter, 1);
+    filter->n_hashes = hdr[4];
+    filter->word_size = hdr[5];
+    filter->big_endian = hdr[6];
+    filter->n_bits = n_bits;
+    filter->bits = g_memdup (rsp_content + BLOCK_FILTER_HDR_LEN,
+                             rsp_size - BLOCK_FILTER_HDR_LEN);
+    goto out;
+
+bad:
+    seaf_warning ("Invalid block filter from server %s.\n", task->host);
+
+out:
+    curl_easy_reset (curl);
+    g_free (url);
+    g_free (rsp_content);
+
+    return filter;
+}
+
+/* Same hashing as bloom_test() on the server's platform. */
+static gboolean
+block_filter_may_contain (BlockFilter *filter, const char *block_id)
+{
+    unsigned char sha256[SHA256_DIGEST_LENGTH];
+    const unsigned char *p;
+    guint64 word, bit;
+    int i, j;
+
+    SHA256 ((const unsigned char *)block_id, strlen(block_id), sha256);
+
+    for (i = 0; i < filter->n_hashes; ++i) {
+        p = sha256 + i * filter->word_size;
+        word = 0;
+        for (j = 0; j < filter->word_size; ++j) {
+            if (filter->big_endian)
+                word = (word << 8) | p[j];
+            else
+                word |= (guint64)p[j] << (8 * j);
+        }
+        bit = word % filter->n_bits;
+        if (!(filter->bits[bit / 8] & (1 << (bit % 8))))
+            return FALSE;
+    }
+
+    return TRUE;
+}
+
+/*
+ * Move the blocks that the server's filter says it doesn't have from
+ * @block_list to @needed_list, so that only the rest have to be checked.
+ */
+static void
+filter_new_blocks (HttpTxTask *task, Connection *conn,
+                   GList **block_list, GList **needed_list)
+{
+    BlockFilter *filter;
+    GList *ptr, *next;
+    int n_new = 0;
+
+    filter = get_block_filter (task, conn);
+    if (!filter)
+        return;
+
+    for (ptr = *block_list; ptr; ptr = next) {
+        next = ptr->next;
+        if (!block_filter_may_contain (filter, ptr->data)) {
+            *block_list = g_list_remove_link (*block_list, ptr);
+            *needed_list = g_list_concat (ptr, *needed_list);
+            ++n_new;
+        }
+    }
+
+    seaf_debug ("%d blocks are not on %s:%s by its filter.\n",
+                n_new, task->host, task->repo_id);
+
+    block_filter_free (filter);
+}
+
+static int
+upload_check_id_list_segment (HttpTxTask *task, Connection *conn, const char *url,
+                              GList **send_id_list, GList **recv_id_list)
+{
+    json_t *array;
+    json_error_t jerror;
+    char *obj_id;
+    int n_sent = 0;
+    char *data = NULL;
+    int len;
+    CURL *curl;
+    int status;
+    char *rsp_content = NULL;
+    gint64 rsp_size;
+    gint64 start;
+    int ret = 0;
 
     /* Convert object id list to JSON format. */
 
@@ -1835,11 +3095,14 @@ upload_check_id_list_segment (HttpTxTask *task, Connection *conn, const char *ur
 
     curl = conn->curl;
 
-    if (http_post (curl, url, task->token,
-                   data, len,
-                   &status, &rsp_content, &rsp_size, FALSE) < 0) {
+    start = get_current_time ();
+    ret = http_post (curl, url, task->token,
+                     data, len,
+                     &status, &rsp_content, &rsp_size, FALSE);
+    task->stats.check_time += get_current_time () - start;
+    ++task->stats.n_checks;
+    if (ret < 0) {
         task->error = HTTP_TASK_ERR_NET;
-        ret = -1;
         goto out;
     }
 
@@ -1889,7 +3152,7 @@ out:
     return ret;
 }
 
-#define MAX_OBJECT_PACK_SIZE (1 << 20) /* 1MB */
+#define MAX_OBJECT_PACK_SIZE (4 << 20) /* 4MB */
 
 typedef struct {
     char obj_id[40];
@@ -1897,52 +3160,76 @@ typedef struct {
     guint8 object[0];
 } __attribute__((__packed__)) ObjectHeader;
 
+typedef struct {
+    struct evbuffer *buf;
+    int n_read;
+    gboolean error;
+} SendFSData;
+
+static gboolean
+pack_fs_object (const char *obj_id, void *data, int len, void *user_data)
+{
+    SendFSData *send = user_data;
+    ObjectHeader hdr;
+
+    if (!data) {
+        send->error = TRUE;
+        return FALSE;
+    }
+
+    memcpy (hdr.obj_id, obj_id, 40);
+    hdr.obj_size = htonl (len);
+
+    evbuffer_add (send->buf, &hdr, sizeof(hdr));
+    evbuffer_add (send->buf, data, len);
+    ++send->n_read;
+
+    return (evbuffer_get_length (send->buf) < MAX_OBJECT_PACK_SIZE);
+}
+
 static int
 send_fs_objects (HttpTxTask *task, Connection *conn, GList **send_fs_list)
 {
     struct evbuffer *buf;
-    ObjectHeader hdr;
-    char *obj_id;
-    char *data;
-    int len;
-    int total_size;
+    SendFSData send;
+    const char **ids;
+    GList *ptr;
     unsigned char *package;
     CURL *curl;
-    char *url;
+    char *url = NULL;
     int status;
     int ret = 0;
     int n_sent = 0;
+    int n, i;
 
     buf = evbuffer_new ();
+    curl = conn->curl;
 
-    while (*send_fs_list != NULL) {
-        obj_id = (*send_fs_list)->data;
-
-        if (seaf_obj_store_read_obj (seaf->fs_mgr->obj_store,
-                                     task->repo_id, task->repo_version,
-                                     obj_id, (void **)&data, &len) < 0) {
-            seaf_warning ("Failed to read fs object %s in repo %s.\n",
-                          obj_id, task->repo_id);
-            task->error = HTTP_TASK_ERR_BAD_LOCAL_DATA;
-            ret = -1;
-            goto out;
-        }
-
-        ++n_sent;
-
-        memcpy (hdr.obj_id, obj_id, 40);
-        hdr.obj_size = htonl (len);
-
-        evbuffer_add (buf, &hdr, sizeof(hdr));
-        evbuffer_add (buf, data, len);
+    n = g_list_length (*send_fs_list);
+    ids = g_new0 (const char *, n);
+    for (ptr = *send_fs_list, i = 0; ptr; ptr = ptr->next, ++i)
+        ids[i] = ptr->data;
+
+    send.buf = buf;
+    send.n_read = 0;
+    send.error = FALSE;
+    seaf_obj_store_read_objs (seaf->fs_mgr->obj_store,
+                              task->repo_id, task->repo_version,
+                              ids, n, pack_fs_object, &send);
+
+    if (send.error) {
+        seaf_warning ("Failed to read fs object %s in repo %s.\n",
+                      ids[send.n_read], task->repo_id);
+        task->error = HTTP_TASK_ERR_BAD_LOCAL_DATA;
+        g_free (ids);
+        ret = -1;
+        goto out;
+    }
+    g_free (ids);
 
-        g_free (data);
+    for (n_sent = 0; n_sent < send.n_read; ++n_sent) {
+        g_free ((*send_fs_list)->data);
         *send_fs_list = g_list_delete_link (*send_fs_list, *send_fs_list);
-        g_free (obj_id);
-
-        total_size = evbuffer_get_length (buf);
-        if (total_size >= MAX_OBJECT_PACK_SIZE)
-            break;
     }
 
     seaf_debug ("Sending %d fs objects for %s:%s.\n",
@@ -1950,8 +3237,6 @@ send_fs_objects (HttpTxTask *task, Connection *conn, GList **send_fs_list)
 
     package = evbuffer_pullup (buf, -1);
 
-    curl = conn->curl;
-
     if (!task->use_fileserver_port)
         url = g_strdup_printf ("%s/seafhttp/repo/%s/recv-fs/",
                                task->host, task->repo_id);
@@ -1983,20 +3268,17 @@ out:
 
 typedef struct {
     GList *block_list;
-    GHashTable *added_blocks;
+    IdSet *added_blocks;
     HttpTxTask *task;
 } CalcBlockListData;
 
 static void
-add_to_block_list (GList **block_list, GHashTable *added_blocks, const char *block_id)
+add_to_block_list (GList **block_list, IdSet *added_blocks, const char *block_id)
 {
-    int dummy;
-
-    if (g_hash_table_lookup (added_blocks, block_id))
+    if (id_set_add (added_blocks, block_id) == 0)
         return;
 
     *block_list = g_list_prepend (*block_list, g_strdup(block_id));
-    g_hash_table_insert (added_blocks, g_strdup(block_id), &dummy);
 }
 
 static int
@@ -2006,51 +3288,57 @@ block_list_diff_files (int n, const char *basedir, SeafDirent *files[], void *vd
     SeafDirent *file2 = files[1];
     CalcBlockListData *data = vdata;
     HttpTxTask *task = data->task;
-    Seafile *f1 = NULL, *f2 = NULL;
-    int i;
+    char **blocks1 = NULL, **blocks2 = NULL;
+    int n1, n2, i;
 
+    /* Block lists come from the fs manager's persistent cache, so a
+     * retried upload doesn't read the file objects again.
+     */
     if (file1 && strcmp (file1->id, EMPTY_SHA1) != 0) {
         if (!file2) {
-            f1 = seaf_fs_manager_get_seafile (seaf->fs_mgr,
-                                              task->repo_id, task->repo_version,
-                                              file1->id);
-            if (!f1) {
+            blocks1 = seaf_fs_manager_get_file_block_ids (seaf->fs_mgr,
+                                                          task->repo_id,
+                                                          task->repo_version,
+                                                          file1->id, &n1);
+            if (!blocks1) {
                 seaf_warning ("Failed to get seafile object %s.\n", file1->id);
                 return -1;
             }
-            for (i = 0; i < f1->n_blocks; ++i)
+            for (i = 0; i < n1; ++i)
                 add_to_block_list (&data->block_list, data->added_blocks,
-                                   f1->blk_sha1s[i]);
-            seafile_unref (f1);
+                                   blocks1[i]);
+            g_strfreev (blocks1);
         } else if (strcmp (file1->id, file2->id) != 0) {
-            f1 = seaf_fs_manager_get_seafile (seaf->fs_mgr,
-                                              task->repo_id, task->repo_version,
-                                              file1->id);
-            if (!f1) {
+            blocks1 = seaf_fs_manager_get_file_block_ids (seaf->fs_mgr,
+                                                          task->repo_id,
+                                                          task->repo_version,
+                                                          file1->id, &n1);
+            if (!blocks1) {
                 seaf_warning ("Failed to get seafile object %s.\n", file1->id);
                 return -1;
             }
-            f2 = seaf_fs_manager_get_seafile (seaf->fs_mgr,
-                                              task->repo_id, task->repo_version,
-                                              file2->id);
-            if (!f2) {
-                seafile_unref (f1);
+            blocks2 = seaf_fs_manager_get_file_block_ids (seaf->fs_mgr,
+                                                          task->repo_id,
+                                                          task->repo_version,
+                                                          file2->id, &n2);
+            if (!blocks2) {
+                g_strfreev (blocks1);
                 seaf_warning ("Failed to get seafile object %s.\n", file2->id);
                 return -1;
             }
 
             GHashTable *h = g_hash_table_new (g_str_hash, g_str_equal);
             int dummy;
-            for (i = 0; i < f2->n_blocks; ++i)
-                g_hash_table_insert (h, f2->blk_sha1s[i], &dummy);
+            for (i = 0; i < n2; ++i)
+                g_hash_table_insert (h, blocks2[i], &dummy);
 
-            for (i = 0; i < f1->n_blocks; ++i)
-                if (!g_hash_table_lookup (h, f1->blk_sha1s[i]))
+            for (i = 0; i < n1; ++i)
+                if (!g_hash_table_lookup (h, blocks1[i]))
                     add_to_block_list (&data->block_list, data->added_blocks,
-                                       f1->blk_sha1s[i]);
+                                       blocks1[i]);
 
-            seafile_unref (f1);
-            seafile_unref (f2);
+            g_strfreev (blocks1);
+            g_strfreev (blocks2);
             g_hash_table_destroy (h);
         }
     }
@@ -2072,6 +3360,7 @@ calculate_block_list (HttpTxTask *task, GList **plist)
     int ret = 0;
     SeafBranch *local = NULL, *master = NULL;
     SeafCommit *local_head = NULL, *master_head = NULL;
+    SyncPaths *sync_paths = get_active_sync_paths (task);
 
     local = seaf_branch_manager_get_branch (seaf->branch_mgr, task->repo_id, "local");
     if (!local) {
@@ -2107,7 +3396,7 @@ calculate_block_list (HttpTxTask *task, GList **plist)
 
     CalcBlockListData data;
     memset (&data, 0, sizeof(data));
-    data.added_blocks = g_hash_table_new_full (g_str_hash, g_str_equal, g_free, NULL);
+    data.added_blocks = id_set_new ();
     data.task = task;
 
     DiffOptions opts;
@@ -2117,6 +3406,7 @@ calculate_block_list (HttpTxTask *task, GList **plist)
     opts.file_cb = block_list_diff_files;
     opts.dir_cb = block_list_diff_dirs;
     opts.data = &data;
+    set_sync_paths_filter (&opts, sync_paths);
 
     const char *trees[2];
     trees[0] = local_head->root_id;
@@ -2124,7 +3414,7 @@ calculate_block_list (HttpTxTask *task, GList **plist)
     if (diff_trees (2, trees, &opts) < 0) {
         seaf_warning ("Failed to diff local and master head for repo %.8s.\n",
                       task->repo_id);
-        g_hash_table_destroy (data.added_blocks);
+        id_set_free (data.added_blocks);
 
         GList *ptr;
         for (ptr = data.block_list; ptr; ptr = ptr->next)
@@ -2134,7 +3424,7 @@ calculate_block_list (HttpTxTask *task, GList **plist)
         goto out;
     }
 
-    g_hash_table_destroy (data.added_blocks);
+    id_set_free (data.added_blocks);
     *plist = data.block_list;
 
 out:
@@ -2142,6 +3432,7 @@ out:
     seaf_branch_unref (master);
     seaf_commit_unref (local_head);
     seaf_commit_unref (master_head);
+    sync_paths_free (sync_paths);
     return ret;
 }
 
@@ -2149,8 +3440,25 @@ typedef struct {
     char block_id[41];
     BlockHandle *block;
     HttpTxTask *task;
+    CURL *curl;
 } SendBlockData;
 
+/*
+ * Update the rate of the task and global transferred bytes. Curl callbacks
+ * don't @wait for the rate limit, they are admitted by it beforehand.
+ */
+static void
+count_sent_bytes (HttpTxTask *task, int n, gboolean wait)
+{
+    g_atomic_int_add (&task->tx_bytes, n);
+    g_atomic_int_add (&(seaf->sync_mgr->sent_bytes), n);
+
+    if (wait)
+        token_bucket_take (&task->manager->priv->upload_bucket, task, n);
+    else
+        token_bucket_charge (&task->manager->priv->upload_bucket, task, n);
+}
+
 static size_t
 send_block_callback (void *ptr, size_t size, size_t nmemb, void *userp)
 {
@@ -2159,9 +3467,13 @@ send_block_callback (void *ptr, size_t size, size_t nmemb, void *userp)
     HttpTxTask *task = data->task;
     int n;
 
-    if (task->state == HTTP_TASK_STATE_CANCELED)
+    /* Also stop when another upload worker of the task failed. */
+    if (task->state == HTTP_TASK_STATE_CANCELED || task->error != HTTP_TASK_OK)
         return CURL_READFUNC_ABORT;
 
+    if (!http_engine_admit (&task->manager->priv->upload_bucket, task, data->curl))
+        return CURL_READFUNC_PAUSE;
+
     n = seaf_block_manager_read_block (seaf->block_mgr,
                                        data->block,
                                        ptr, realsize);
@@ -2172,25 +3484,145 @@ send_block_callback (void *ptr, size_t size, size_t nmemb, void *userp)
         return CURL_READFUNC_ABORT;
     }
 
-    /* Update global transferred bytes. */
-    g_atomic_int_add (&(seaf->sync_mgr->sent_bytes), n);
+    count_sent_bytes (task, n, FALSE);
 
-    /* If uploaded bytes exceeds the limit, wait until the counter
-     * is reset. We check the counter every 100 milliseconds, so we
-     * can waste up to 100 milliseconds without sending data after
-     * the counter is reset.
-     */
-    while (1) {
-        gint sent = g_atomic_int_get(&(seaf->sync_mgr->sent_bytes));
-        if (seaf->sync_mgr->upload_limit > 0 &&
-            sent > seaf->sync_mgr->upload_limit)
-            /* 100 milliseconds */
-            g_usleep (100000);
+    return n;
+}
+
+/* Servers accept blocks in parts from this protocol version on. */
+#define BLOCK_PARTS_PROTO_VERSION 5
+
+/* Blocks bigger than this are uploaded in parts of this size. */
+#define BLOCK_PART_SIZE (1 << 20) /* 1MB */
+
+/* Times a part is sent again after a network error. */
+#define BLOCK_PART_RETRIES 3
+
+static gboolean
+send_in_parts (HttpTxTask *task, guint32 size)
+{
+    return (task->protocol_version >= BLOCK_PARTS_PROTO_VERSION &&
+            size > BLOCK_PART_SIZE);
+}
+
+/*
+ * Upload a block BLOCK_PART_SIZE bytes at a time. The server keeps the
+ * parts it has received and replies with its count of bytes, so after a
+ * network error only the interrupted part is sent again.
+ */
+static int
+send_block_parts (HttpTxTask *task, Connection *conn, const char *block_id,
+                  guint32 size)
+{
+    CURL *curl = conn->curl;
+    BlockHandle *block;
+    char *content;
+    char *url = NULL;
+    int status;
+    char *rsp_content = NULL;
+    gint64 rsp_size;
+    gint64 offset = 0, received;
+    int len, retries = 0;
+    int ret = 0;
+
+    block = seaf_block_manager_open_block (seaf->block_mgr,
+                                           task->repo_id, task->repo_version,
+                                           block_id, BLOCK_READ);
+    if (!block) {
+        seaf_warning ("Failed to open block %s in repo %s.\n",
+                      block_id, task->repo_id);
+        return -1;
+    }
+
+    content = g_malloc (size);
+    if (seaf_block_manager_read_block (seaf->block_mgr, block,
+                                       content, size) != size) {
+        seaf_warning ("Failed to read block %s in repo %.8s.\n",
+                      block_id, task->repo_id);
+        task->error = HTTP_TASK_ERR_BAD_LOCAL_DATA;
+        ret = -1;
+        goto out;
+    }
+
+    while (offset < size) {
+        /* Also stop when another upload worker of the task failed. */
+        if (task->state == HTTP_TASK_STATE_CANCELED)
+            goto out;
+        if (task->error != HTTP_TASK_OK) {
+            ret = -1;
+            goto out;
+        }
+
+        len = MIN (BLOCK_PART_SIZE, size - offset);
+
+        g_free (url);
+        if (!task->use_fileserver_port)
+            url = g_strdup_printf ("%s/seafhttp/repo/%s/block/%s"
+                                   "?offset=%"G_GINT64_FORMAT"&size=%u",
+                                   task->host, task->repo_id, block_id,
+                                   offset, size);
         else
-            break;
+            url = g_strdup_printf ("%s/repo/%s/block/%s"
+                                   "?offset=%"G_GINT64_FORMAT"&size=%u",
+                                   task->host, task->repo_id, block_id,
+                                   offset, size);
+
+        count_sent_bytes (task, len, TRUE);
+
+        g_free (rsp_content);
+        rsp_content = NULL;
+        if (http_put (curl, url, task->token,
+                      content + offset, len,
+                      NULL, NULL,
+                      &status, &rsp_content, &rsp_size, TRUE) < 0) {
+            curl_easy_reset (curl);
+            if (task->state == HTTP_TASK_STATE_CANCELED)
+                goto out;
+            if (++retries > BLOCK_PART_RETRIES) {
+                task->error = HTTP_TASK_ERR_NET;
+                ret = -1;
+                goto out;
+            }
+            /* The server says where to go on from. */
+            continue;
+        }
+        curl_easy_reset (curl);
+
+        if (status != HTTP_OK && status != HTTP_CONFLICT) {
+            seaf_warning ("Bad response code for PUT %s: %d.\n", url, status);
+            handle_http_errors (task, status);
+            ret = -1;
+            goto out;
+        }
+
+        received = -1;
+        if (rsp_content && rsp_size > 0 && rsp_size < 32) {
+            char buf[32];
+            memcpy (buf, rsp_content, rsp_size);
+            buf[rsp_size] = 0;
+            received = g_ascii_strtoll (buf, NULL, 10);
+        }
+        if (received < 0 || received > size ||
+            (status == HTTP_OK && received <= offset)) {
+            seaf_warning ("Invalid response for PUT %s.\n", url);
+            task->error = HTTP_TASK_ERR_SERVER;
+            ret = -1;
+            goto out;
+        }
+
+        if (status == HTTP_OK)
+            retries = 0;
+        offset = received;
     }
 
-    return n;
+out:
+    g_free (url);
+    g_free (rsp_content);
+    g_free (content);
+    seaf_block_manager_close_block (seaf->block_mgr, block);
+    seaf_block_manager_block_handle_free (seaf->block_mgr, block);
+
+    return ret;
 }
 
 static int
@@ -2212,6 +3644,12 @@ send_block (HttpTxTask *task, Connection *conn, const char *block_id)
         return -1;
     }
 
+    if (send_in_parts (task, bmd->size)) {
+        ret = send_block_parts (task, conn, block_id, bmd->size);
+        g_free (bmd);
+        return ret;
+    }
+
     block = seaf_block_manager_open_block (seaf->block_mgr,
                                            task->repo_id, task->repo_version,
                                            block_id, BLOCK_READ);
@@ -2229,6 +3667,7 @@ send_block (HttpTxTask *task, Connection *conn, const char *block_id)
     data.task = task;
 
     curl = conn->curl;
+    data.curl = curl;
 
     if (!task->use_fileserver_port)
         url = g_strdup_printf ("%s/seafhttp/repo/%s/block/%s",
@@ -2266,50 +3705,550 @@ out:
     return ret;
 }
 
+#define SEND_BLOCKS_N 64
+#define MAX_SEND_BLOCKS_PACK_SIZE (4 << 20) /* 4MB */
+
+/* Servers accept recv-blocks from this protocol version on. */
+#define RECV_BLOCKS_PROTO_VERSION 3
+
+/* Append a block framed as id (40), size (32, big endian) and content. */
 static int
-update_branch (HttpTxTask *task, Connection *conn)
+pack_local_block (HttpTxTask *task, const char *block_id, guint32 size,
+                  struct evbuffer *buf)
 {
-    CURL *curl;
-    char *url;
-    int status;
+    BlockHandle *block;
+    char *content;
+    guint32 size_net;
     int ret = 0;
 
-    curl = conn->curl;
-
-    if (!task->use_fileserver_port)
-        url = g_strdup_printf ("%s/seafhttp/repo/%s/commit/HEAD/?head=%s",
-                               task->host, task->repo_id, task->head);
-    else
-        url = g_strdup_printf ("%s/repo/%s/commit/HEAD/?head=%s",
-                               task->host, task->repo_id, task->head);
+    block = seaf_block_manager_open_block (seaf->block_mgr,
+                                           task->repo_id, task->repo_version,
+                                           block_id, BLOCK_READ);
+    if (!block) {
+        seaf_warning ("Failed to open block %s in repo %s.\n",
+                      block_id, task->repo_id);
+        return -1;
+    }
 
-    if (http_put (curl, url, task->token,
-                  NULL, 0,
-                  NULL, NULL,
-                  &status, NULL, NULL, FALSE) < 0) {
-        task->error = HTTP_TASK_ERR_NET;
+    content = g_malloc (size);
+    if (seaf_block_manager_read_block (seaf->block_mgr, block,
+                                       content, size) != size) {
+        seaf_warning ("Failed to read block %s in repo %.8s.\n",
+                      block_id, task->repo_id);
         ret = -1;
         goto out;
     }
 
-    if (status != HTTP_OK) {
-        seaf_warning ("Bad response code for PUT %s: %d.\n", url, status);
-        handle_http_errors (task, status);
-        ret = -1;
-    }
+    evbuffer_add (buf, block_id, 40);
+    size_net = htonl (size);
+    evbuffer_add (buf, &size_net, 4);
+    evbuffer_add (buf, content, size);
 
 out:
-    g_free (url);
-    curl_easy_reset (curl);
-
+    g_free (content);
+    seaf_block_manager_close_block (seaf->block_mgr, block);
+    seaf_block_manager_block_handle_free (seaf->block_mgr, block);
     return ret;
 }
 
-static void
-update_master_branch (HttpTxTask *task)
+/*
+ * Upload up to SEND_BLOCKS_N blocks from the head of @block_list in
+ * one recv-blocks request, and remove them from the list. A block too
+ * big for a pack, and any block the server failed to store, is sent
+ * on its own.
+ */
+static int
+send_blocks_pack (HttpTxTask *task, Connection *conn, GList **block_list)
 {
-    SeafBranch *branch;
-    branch = seaf_branch_manager_get_branch (seaf->branch_mgr,
+    struct evbuffer *buf;
+    BlockMetadata *bmd;
+    GList *sent = NULL, *ptr;
+    char *block_id;
+    gint64 total = 0;
+    CURL *curl;
+    char *url = NULL;
+    int status;
+    char *rsp_content = NULL;
+    gint64 rsp_size;
+    json_t *failed = NULL;
+    json_error_t jerror;
+    int n_sent = 0, i;
+    int ret = 0;
+
+    buf = evbuffer_new ();
+    curl = conn->curl;
+
+    while (*block_list && n_sent < SEND_BLOCKS_N) {
+        block_id = (*block_list)->data;
+
+        bmd = seaf_block_manager_stat_block (seaf->block_mgr,
+                                             task->repo_id, task->repo_version,
+                                             block_id);
+        if (!bmd) {
+            seaf_warning ("Failed to stat block %s in repo %s.\n",
+                          block_id, task->repo_id);
+            task->error = HTTP_TASK_ERR_BAD_LOCAL_DATA;
+            ret = -1;
+            goto out;
+        }
+
+        if (total + bmd->size > MAX_SEND_BLOCKS_PACK_SIZE ||
+            send_in_parts (task, bmd->size)) {
+            g_free (bmd);
+            if (n_sent > 0)
+                break;
+
+            /* Too big for a pack, or resumable on its own. */
+            *block_list = g_list_delete_link (*block_list, *block_list);
+            ret = send_block (task, conn, block_id);
+            if (ret == 0)
+                g_atomic_int_inc (&task->done_blocks);
+            g_free (block_id);
+            goto out;
+        }
+
+        if (pack_local_block (task, block_id, bmd->size, buf) < 0) {
+            g_free (bmd);
+            task->error = HTTP_TASK_ERR_BAD_LOCAL_DATA;
+            ret = -1;
+            goto out;
+        }
+        total += bmd->size;
+        g_free (bmd);
+
+        *block_list = g_list_delete_link (*block_list, *block_list);
+        sent = g_list_prepend (sent, block_id);
+        ++n_sent;
+    }
+
+    seaf_debug ("Sending %d blocks for %s:%s.\n",
+                n_sent, task->host, task->repo_id);
+
+    count_sent_bytes (task, total, TRUE);
+
+    if (!task->use_fileserver_port)
+        url = g_strdup_printf ("%s/seafhttp/repo/%s/recv-blocks/",
+                               task->host, task->repo_id);
+    else
+        url = g_strdup_printf ("%s/repo/%s/recv-blocks/",
+                               task->host, task->repo_id);
+
+    if (http_post (curl, url, task->token,
+                   (char *)evbuffer_pullup (buf, -1), evbuffer_get_length (buf),
+                   &status, &rsp_content, &rsp_size, TRUE) < 0) {
+        if (task->state != HTTP_TASK_STATE_CANCELED)
+            task->error = HTTP_TASK_ERR_NET;
+        ret = -1;
+        goto out;
+    }
+
+    if (status != HTTP_OK) {
+        seaf_warning ("Bad response code for POST %s: %d.\n", url, status);
+        handle_http_errors (task, status);
+        ret = -1;
+        goto out;
+    }
+
+    failed = json_loadb (rsp_content, rsp_size, 0, &jerror);
+    if (!failed || !json_is_array (failed)) {
+        seaf_warning ("Invalid response for POST %s.\n", url);
+        task->error = HTTP_TASK_ERR_SERVER;
+        ret = -1;
+        goto out;
+    }
+
+    g_atomic_int_add (&task->done_blocks, n_sent - json_array_size (failed));
+
+    for (i = 0; i < json_array_size (failed); ++i) {
+        const char *id = json_string_value (json_array_get (failed, i));
+
+        /* Only resend blocks we sent. */
+        for (ptr = sent; ptr; ptr = ptr->next)
+            if (id && strcmp (ptr->data, id) == 0)
+                break;
+        if (!ptr) {
+            seaf_warning ("Unexpected block %s in response of POST %s.\n",
+                          id, url);
+            task->error = HTTP_TASK_ERR_SERVER;
+            ret = -1;
+            goto out;
+        }
+
+        /* Curl may still hold settings of the previous request. */
+        curl_easy_reset (curl);
+        if (send_block (task, conn, id) < 0) {
+            ret = -1;
+            goto out;
+        }
+        g_atomic_int_inc (&task->done_blocks);
+
+        if (task->state == HTTP_TASK_STATE_CANCELED)
+            goto out;
+    }
+
+out:
+    if (failed)
+        json_decref (failed);
+    string_list_free (sent);
+    g_free (url);
+    g_free (rsp_content);
+    evbuffer_free (buf);
+    curl_easy_reset (curl);
+
+    return ret;
+}
+
+/* Requests for fs objects a task keeps in flight, one per connection. */
+#define FS_OBJECT_WORKERS 4
+
+/* Objects per request: they start at FS_BATCH_START and double while
+ * that makes a request move more objects per second.
+ */
+#define FS_BATCH_START 100
+#define MIN_FS_BATCH 50
+#define MAX_FS_BATCH 6400
+
+typedef struct FsObjectTransfer {
+    HttpTxTask *task;
+    ConnectionPool *pool;
+    gboolean upload;
+
+    pthread_mutex_t lock;
+    GList *obj_list;            /* not taken by a worker yet */
+    int batch;
+    double best_rate;           /* objects per second at the best batch */
+    gboolean failed;
+} FsObjectTransfer;
+
+static int
+get_fs_objects (HttpTxTask *task, Connection *conn, GList **fs_list);
+
+static GList *
+take_fs_objects (FsObjectTransfer *ft)
+{
+    GList *ids = NULL, *link;
+    int n;
+
+    pthread_mutex_lock (&ft->lock);
+    if (!ft->failed && ft->task->state != HTTP_TASK_STATE_CANCELED) {
+        for (n = ft->batch; ft->obj_list && n > 0; --n) {
+            link = ft->obj_list;
+            ft->obj_list = g_list_remove_link (ft->obj_list, link);
+            ids = g_list_concat (link, ids);
+        }
+    }
+    pthread_mutex_unlock (&ft->lock);
+
+    return g_list_reverse (ids);
+}
+
+/*
+ * Put back the objects a request didn't move and adapt the batch size
+ * to how fast it moved the others. The transfers are bound by round
+ * trips while bigger batches move more objects per second; a batch
+ * whose rate falls well below the best is halved again, for when the
+ * link or the server got slower.
+ */
+static void
+finish_fs_batch (FsObjectTransfer *ft, GList *left, int n_moved, gint64 usec)
+{
+    double rate;
+
+    pthread_mutex_lock (&ft->lock);
+
+    ft->obj_list = g_list_concat (left, ft->obj_list);
+
+    if (n_moved > 0 && usec > 0) {
+        rate = (double)n_moved * 1000000 / usec;
+        if (rate > ft->best_rate * 1.1) {
+            ft->best_rate = rate;
+            if (ft->batch < MAX_FS_BATCH && n_moved >= ft->batch)
+                ft->batch *= 2;
+        } else if (rate < ft->best_rate * 0.5) {
+            ft->best_rate = rate;
+            ft->batch = MAX (ft->batch / 2, MIN_FS_BATCH);
+        }
+    }
+
+    pthread_mutex_unlock (&ft->lock);
+}
+
+static void
+fs_objects_worker (FsObjectTransfer *ft, Connection *conn)
+{
+    HttpTxTask *task = ft->task;
+    GList *ids;
+    int n_taken, n_moved, rc;
+    gint64 start;
+
+    while ((ids = take_fs_objects (ft)) != NULL) {
+        n_taken = g_list_length (ids);
+        start = get_current_time ();
+
+        if (ft->upload)
+            rc = send_fs_objects (task, conn, &ids);
+        else
+            rc = get_fs_objects (task, conn, &ids);
+
+        n_moved = n_taken - g_list_length (ids);
+        if (rc == 0 && n_moved == 0 && !ft->upload) {
+            seaf_warning ("Server didn't return any of %d fs objects of repo %.8s.\n",
+                          n_taken, task->repo_id);
+            task->error = HTTP_TASK_ERR_SERVER;
+            rc = -1;
+        }
+        if (rc < 0) {
+            string_list_free (ids);
+            pthread_mutex_lock (&ft->lock);
+            ft->failed = TRUE;
+            pthread_mutex_unlock (&ft->lock);
+            return;
+        }
+
+        finish_fs_batch (ft, ids, n_moved, get_current_time () - start);
+    }
+}
+
+static void *
+fs_objects_thread (void *vdata)
+{
+    FsObjectTransfer *ft = vdata;
+    Connection *conn;
+
+    conn = connection_pool_get_connection (ft->pool);
+    if (!conn) {
+        seaf_warning ("Failed to get connection to host %s.\n", ft->task->host);
+        return NULL;
+    }
+
+    fs_objects_worker (ft, conn);
+
+    connection_pool_return_connection (ft->pool, conn);
+    return NULL;
+}
+
+/*
+ * Send (@upload) or get the fs objects in @obj_list, which is consumed,
+ * with up to FS_OBJECT_WORKERS requests in flight. The calling thread is
+ * one of the workers, on @conn.
+ */
+static int
+transfer_fs_objects (HttpTxTask *task, ConnectionPool *pool, Connection *conn,
+                     GList *obj_list, gboolean upload)
+{
+    FsObjectTransfer ft;
+    pthread_t threads[FS_OBJECT_WORKERS];
+    gboolean started[FS_OBJECT_WORKERS];
+    int n_workers, i;
+
+    memset (&ft, 0, sizeof(ft));
+    ft.task = task;
+    ft.pool = pool;
+    ft.upload = upload;
+    ft.obj_list = obj_list;
+    ft.batch = FS_BATCH_START;
+    pthread_mutex_init (&ft.lock, NULL);
+
+    n_workers = CLAMP ((int)(g_list_length (obj_list) / FS_BATCH_START),
+                       1, FS_OBJECT_WORKERS);
+
+    memset (started, 0, sizeof(started));
+    for (i = 1; i < n_workers; ++i) {
+        if (pthread_create (&threads[i], NULL, fs_objects_thread, &ft) == 0)
+            started[i] = TRUE;
+        else
+            seaf_warning ("Failed to start fs object thread.\n");
+    }
+
+    fs_objects_worker (&ft, conn);
+
+    for (i = 1; i < n_workers; ++i) {
+        if (started[i])
+            pthread_join (threads[i], NULL);
+    }
+
+    string_list_free (ft.obj_list);
+    pthread_mutex_destroy (&ft.lock);
+
+    return ft.failed ? -1 : 0;
+}
+
+/* Most connections a task uploads blocks on at the same time. */
+#define UPLOAD_BLOCK_WORKERS 4
+
+typedef struct UploadBlocks {
+    HttpTxTask *task;
+    ConnectionPool *pool;
+    gboolean use_packs;
+
+    pthread_mutex_t lock;
+    GList *block_list;          /* not taken by a worker yet */
+    gboolean failed;
+} UploadBlocks;
+
+/* Take the next blocks to send, or NULL when the workers should stop. */
+static GList *
+take_upload_blocks (UploadBlocks *ub)
+{
+    GList *blocks = NULL, *link;
+    int n = ub->use_packs ? SEND_BLOCKS_N : 1;
+
+    pthread_mutex_lock (&ub->lock);
+    if (!ub->failed && ub->task->state != HTTP_TASK_STATE_CANCELED) {
+        while (ub->block_list && n-- > 0) {
+            link = ub->block_list;
+            ub->block_list = g_list_remove_link (ub->block_list, link);
+            blocks = g_list_concat (link, blocks);
+        }
+    }
+    pthread_mutex_unlock (&ub->lock);
+
+    return g_list_reverse (blocks);
+}
+
+static void
+upload_blocks_worker (UploadBlocks *ub, Connection *conn)
+{
+    HttpTxTask *task = ub->task;
+    GList *blocks;
+
+    while ((blocks = take_upload_blocks (ub)) != NULL) {
+        if (ub->use_packs) {
+            while (blocks) {
+                if (send_blocks_pack (task, conn, &blocks) < 0)
+                    goto failed;
+                if (task->state == HTTP_TASK_STATE_CANCELED)
+                    break;
+            }
+        } else {
+            if (send_block (task, conn, blocks->data) < 0) {
+                seaf_warning ("Failed to send block %s for repo %.8s.\n",
+                              (char *)blocks->data, task->repo_id);
+                goto failed;
+            }
+            g_atomic_int_inc (&task->done_blocks);
+        }
+        string_list_free (blocks);
+    }
+    return;
+
+failed:
+    string_list_free (blocks);
+    pthread_mutex_lock (&ub->lock);
+    ub->failed = TRUE;
+    pthread_mutex_unlock (&ub->lock);
+}
+
+static void *
+upload_blocks_thread (void *vdata)
+{
+    UploadBlocks *ub = vdata;
+    Connection *conn;
+
+    conn = connection_pool_get_connection (ub->pool);
+    if (!conn) {
+        seaf_warning ("Failed to get connection to host %s.\n", ub->task->host);
+        return NULL;
+    }
+
+    upload_blocks_worker (ub, conn);
+
+    connection_pool_return_connection (ub->pool, conn);
+    return NULL;
+}
+
+/*
+ * Send the blocks in @block_list, which is consumed, on up to
+ * UPLOAD_BLOCK_WORKERS connections at once. The calling thread is one
+ * of the workers, on @conn. Once one worker fails the others stop after
+ * the request they're sending.
+ */
+static int
+upload_blocks (HttpTxTask *task, ConnectionPool *pool, Connection *conn,
+               GList *block_list)
+{
+    UploadBlocks ub;
+    pthread_t threads[UPLOAD_BLOCK_WORKERS];
+    gboolean started[UPLOAD_BLOCK_WORKERS];
+    int n_batches, n_workers, i;
+
+    memset (&ub, 0, sizeof(ub));
+    ub.task = task;
+    ub.pool = pool;
+    ub.use_packs = (task->protocol_version >= RECV_BLOCKS_PROTO_VERSION);
+    ub.block_list = block_list;
+    pthread_mutex_init (&ub.lock, NULL);
+
+    n_batches = g_list_length (block_list);
+    if (ub.use_packs)
+        n_batches = (n_batches + SEND_BLOCKS_N - 1) / SEND_BLOCKS_N;
+    n_workers = CLAMP (n_batches, 1, UPLOAD_BLOCK_WORKERS);
+
+    memset (started, 0, sizeof(started));
+    for (i = 1; i < n_workers; ++i) {
+        if (pthread_create (&threads[i], NULL, upload_blocks_thread, &ub) == 0)
+            started[i] = TRUE;
+        else
+            seaf_warning ("Failed to start upload thread.\n");
+    }
+
+    upload_blocks_worker (&ub, conn);
+
+    for (i = 1; i < n_workers; ++i) {
+        if (started[i])
+            pthread_join (threads[i], NULL);
+    }
+
+    string_list_free (ub.block_list);
+    pthread_mutex_destroy (&ub.lock);
+
+    return ub.failed ? -1 : 0;
+}
+
+static int
+update_branch (HttpTxTask *task, Connection *conn)
+{
+    CURL *curl;
+    char *url;
+    int status;
+    int ret = 0;
+
+    curl = conn->curl;
+
+    if (!task->use_fileserver_port)
+        url = g_strdup_printf ("%s/seafhttp/repo/%s/commit/HEAD/?head=%s",
+                               task->host, task->repo_id, task->head);
+    else
+        url = g_strdup_printf ("%s/repo/%s/commit/HEAD/?head=%s",
+                               task->host, task->repo_id, task->head);
+
+    if (http_put (curl, url, task->token,
+                  NULL, 0,
+                  NULL, NULL,
+                  &status, NULL, NULL, FALSE) < 0) {
+        task->error = HTTP_TASK_ERR_NET;
+        ret = -1;
+        goto out;
+    }
+
+    if (status != HTTP_OK) {
+        seaf_warning ("Bad response code for PUT %s: %d.\n", url, status);
+        handle_http_errors (task, status);
+        ret = -1;
+    }
+
+out:
+    g_free (url);
+    curl_easy_reset (curl);
+
+    return ret;
+}
+
+static void
+update_master_branch (HttpTxTask *task)
+{
+    SeafBranch *branch;
+    branch = seaf_branch_manager_get_branch (seaf->branch_mgr,
                                              task->repo_id,
                                              "master");
     if (!branch) {
@@ -2359,7 +4298,7 @@ http_upload_thread (void *vdata)
     char *url = NULL;
     GList *send_fs_list = NULL, *needed_fs_list = NULL;
     GList *block_list = NULL, *needed_block_list = NULL;
-    GList *ptr;
+    int ret;
     GHashTable *active_paths = NULL;
 
     SeafBranch *local = seaf_branch_manager_get_branch (seaf->branch_mgr,
@@ -2430,7 +4369,9 @@ http_upload_thread (void *vdata)
 
     transition_state (task, task->state, HTTP_TASK_RT_STATE_FS);
 
+    gint64 t = get_current_time ();
     send_fs_list = calculate_send_fs_object_list (task);
+    task->stats.fs_list_time = get_current_time () - t;
     if (!send_fs_list) {
         seaf_warning ("Failed to calculate fs object list for repo %.8s.\n",
                       task->repo_id);
@@ -2458,16 +4399,19 @@ http_upload_thread (void *vdata)
     g_free (url);
     url = NULL;
 
-    while (needed_fs_list != NULL) {
-        if (send_fs_objects (task, conn, &needed_fs_list) < 0) {
-            seaf_warning ("Failed to send fs objects for repo %.8s.\n", task->repo_id);
-            goto out;
-        }
+    task->stats.n_fs_objects = g_list_length (needed_fs_list);
 
-        if (task->state == HTTP_TASK_STATE_CANCELED)
-            goto out;
+    /* The list is consumed. */
+    ret = transfer_fs_objects (task, pool, conn, needed_fs_list, TRUE);
+    needed_fs_list = NULL;
+    if (ret < 0) {
+        seaf_warning ("Failed to send fs objects for repo %.8s.\n", task->repo_id);
+        goto out;
     }
 
+    if (task->state == HTTP_TASK_STATE_CANCELED)
+        goto out;
+
     transition_state (task, task->state, HTTP_TASK_RT_STATE_BLOCK);
 
     if (calculate_block_list (task, &block_list) < 0) {
@@ -2477,6 +4421,9 @@ http_upload_thread (void *vdata)
         goto out;
     }
 
+    if (task->protocol_version >= BLOCK_FILTER_PROTO_VERSION)
+        filter_new_blocks (task, conn, &block_list, &needed_block_list);
+
     if (!task->use_fileserver_port)
         url = g_strdup_printf ("%s/seafhttp/repo/%s/check-blocks/",
                                task->host, task->repo_id);
@@ -2503,22 +4450,17 @@ http_upload_thread (void *vdata)
     seaf_debug ("%d blocks to send for %s:%s.\n",
                 task->n_blocks, task->host, task->repo_id);
 
-    char *block_id;
-    for (ptr = needed_block_list; ptr; ptr = ptr->next) {
-        block_id = ptr->data;
-
-        if (send_block (task, conn, block_id) < 0) {
-            seaf_warning ("Failed to send block %s for repo %.8s.\n",
-                          block_id, task->repo_id);
-            goto out;
-        }
-
-        if (task->state == HTTP_TASK_STATE_CANCELED)
-            goto out;
-
-        ++(task->done_blocks);
+    /* The list is consumed. */
+    ret = upload_blocks (task, pool, conn, needed_block_list);
+    needed_block_list = NULL;
+    if (ret < 0) {
+        seaf_warning ("Failed to send blocks for repo %.8s.\n", task->repo_id);
+        goto out;
     }
 
+    if (task->state == HTTP_TASK_STATE_CANCELED)
+        goto out;
+
     transition_state (task, task->state, HTTP_TASK_RT_STATE_UPDATE_BRANCH);
 
     if (update_branch (task, conn) < 0) {
@@ -2617,6 +4559,8 @@ http_tx_manager_add_download (HttpTxManager *manager,
                          g_strdup(repo_id),
                          task);
 
+    block_index_prepare (seaf->block_index);
+
     ccnet_job_manager_schedule_job (seaf->job_mgr,
                                     http_download_thread,
                                     http_download_done,
@@ -2795,8 +4739,201 @@ out:
     return ret;
 }
 
-#define GET_FS_OBJECT_N 100
+typedef struct WalkDir {
+    char *path;                 /* "" or ending with "/" */
+    char dir_id[41];
+    char master_id[41];         /* "" if not in the master tree */
+} WalkDir;
+
+static void
+walk_dir_free (WalkDir *wd)
+{
+    g_free (wd->path);
+    g_free (wd);
+}
+
+static WalkDir *
+walk_dir_new (const char *path, const char *dir_id, const char *master_id)
+{
+    WalkDir *wd = g_new0 (WalkDir, 1);
+
+    wd->path = g_strdup (path);
+    memcpy (wd->dir_id, dir_id, 40);
+    if (master_id)
+        memcpy (wd->master_id, master_id, 40);
+    return wd;
+}
+
+static SeafDirent *
+find_dirent (SeafDir *dir, const char *name)
+{
+    GList *ptr;
+
+    if (!dir)
+        return NULL;
+    for (ptr = dir->entries; ptr; ptr = ptr->next)
+        if (strcmp (((SeafDirent *)ptr->data)->name, name) == 0)
+            return ptr->data;
+    return NULL;
+}
+
+static void
+add_missing_object (HttpTxTask *task, GHashTable *seen,
+                    const char *obj_id, GList **list)
+{
+    if (strcmp (obj_id, EMPTY_SHA1) == 0 || g_hash_table_lookup (seen, obj_id))
+        return;
+    g_hash_table_add (seen, g_strdup (obj_id));
+
+    if (!seaf_obj_store_obj_exists (seaf->fs_mgr->obj_store,
+                                    task->repo_id, task->repo_version, obj_id))
+        *list = g_list_prepend (*list, g_strdup (obj_id));
+}
+
+/*
+ * With only some sub-folders of the repo synced, the server's fs id list
+ * would have the objects of the whole tree. Walk the server tree a level
+ * at a time instead, getting the objects of the selected paths and of
+ * the dirs leading to them. Subtrees that were already synced and didn't
+ * change since the master commit are complete locally and not walked.
+ */
+static int
+get_selected_fs_objects (HttpTxTask *task, ConnectionPool *pool, Connection *conn,
+                         const SyncPaths *wanted, const SyncPaths *synced)
+{
+    SeafCommit *head = NULL, *master_head = NULL;
+    SeafBranch *master;
+    GQueue level = G_QUEUE_INIT, next = G_QUEUE_INIT;
+    GList *fetch = NULL, *files = NULL, *ptr;
+    GHashTable *seen;
+    WalkDir *wd;
+    SeafDir *dir, *master_dir;
+    SeafDirent *dent, *mdent;
+    DiffPathState state;
+    char *path;
+    int ret = 0;
+
+    head = seaf_commit_manager_get_commit (seaf->commit_mgr,
+                                           task->repo_id, task->repo_version,
+                                           task->head);
+    if (!head) {
+        seaf_warning ("Failed to get commit %s.\n", task->head);
+        task->error = HTTP_TASK_ERR_BAD_LOCAL_DATA;
+        return -1;
+    }
+
+    master = seaf_branch_manager_get_branch (seaf->branch_mgr,
+                                             task->repo_id, "master");
+    if (master) {
+        master_head = seaf_commit_manager_get_commit (seaf->commit_mgr,
+                                                      task->repo_id,
+                                                      task->repo_version,
+                                                      master->commit_id);
+        seaf_branch_unref (master);
+    }
+
+    seen = g_hash_table_new_full (g_str_hash, g_str_equal, g_free, NULL);
 
+    g_queue_push_tail (&level, walk_dir_new ("", head->root_id,
+                                             master_head ? master_head->root_id : NULL));
+
+    while (!g_queue_is_empty (&level)) {
+        /* The dirs of this level, and the files found in the last one. */
+        for (ptr = level.head; ptr; ptr = ptr->next) {
+            wd = ptr->data;
+            add_missing_object (task, seen, wd->dir_id, &fetch);
+        }
+        fetch = g_list_concat (fetch, files);
+        files = NULL;
+
+        if (fetch) {
+            task->stats.n_fs_objects += g_list_length (fetch);
+            /* The list is consumed. */
+            ret = transfer_fs_objects (task, pool, conn, fetch, FALSE);
+            fetch = NULL;
+            if (ret < 0 || task->state == HTTP_TASK_STATE_CANCELED)
+                goto out;
+        }
+
+        while ((wd = g_queue_pop_head (&level)) != NULL) {
+            dir = seaf_fs_manager_get_seafdir (seaf->fs_mgr,
+                                               task->repo_id, task->repo_version,
+                                               wd->dir_id);
+            if (!dir) {
+                seaf_warning ("Failed to get dir %s of repo %.8s.\n",
+                              wd->dir_id, task->repo_id);
+                task->error = HTTP_TASK_ERR_BAD_LOCAL_DATA;
+                walk_dir_free (wd);
+                ret = -1;
+                goto out;
+            }
+            master_dir = NULL;
+            if (wd->master_id[0] != 0)
+                master_dir = seaf_fs_manager_get_seafdir (seaf->fs_mgr,
+                                                          task->repo_id,
+                                                          task->repo_version,
+                                                          wd->master_id);
+
+            for (ptr = dir->entries; ptr; ptr = ptr->next) {
+                dent = ptr->data;
+                path = g_strconcat (wd->path, dent->name, NULL);
+                state = sync_paths_check (wanted, path, S_ISDIR(dent->mode));
+
+                if (state == DIFF_PATH_SKIP) {
+                    g_free (path);
+                    continue;
+                }
+
+                if (!S_ISDIR(dent->mode)) {
+                    add_missing_object (task, seen, dent->id, &files);
+                    g_free (path);
+                    continue;
+                }
+
+                mdent = find_dirent (master_dir, dent->name);
+                if (mdent && !S_ISDIR(mdent->mode))
+                    mdent = NULL;
+                if (!(mdent && strcmp (mdent->id, dent->id) == 0 &&
+                      sync_paths_covers (synced, path))) {
+                    char *sub_path = g_strconcat (path, "/", NULL);
+                    g_queue_push_tail (&next, walk_dir_new (sub_path, dent->id,
+                                                            mdent ? mdent->id : NULL));
+                    g_free (sub_path);
+                }
+                g_free (path);
+            }
+
+            seaf_dir_free (master_dir);
+            seaf_dir_free (dir);
+            walk_dir_free (wd);
+        }
+
+        level = next;
+        g_queue_init (&next);
+    }
+
+    if (files) {
+        task->stats.n_fs_objects += g_list_length (files);
+        ret = transfer_fs_objects (task, pool, conn, files, FALSE);
+        files = NULL;
+    }
+
+out:
+    g_queue_foreach (&level, (GFunc)walk_dir_free, NULL);
+    g_queue_clear (&level);
+    g_queue_foreach (&next, (GFunc)walk_dir_free, NULL);
+    g_queue_clear (&next);
+    string_list_free (files);
+    g_hash_table_destroy (seen);
+    seaf_commit_unref (head);
+    seaf_commit_unref (master_head);
+    return ret;
+}
+
+/*
+ * Request the fs objects in @fs_list. The ids of the objects the server
+ * didn't return are left in it.
+ */
 static int
 get_fs_objects (HttpTxTask *task, Connection *conn, GList **fs_list)
 {
@@ -2827,9 +4964,7 @@ get_fs_objects (HttpTxTask *task, Connection *conn, GList **fs_list)
         *fs_list = g_list_delete_link (*fs_list, *fs_list);
 
         g_hash_table_replace (requested, obj_id, obj_id);
-
-        if (++n_sent >= GET_FS_OBJECT_N)
-            break;
+        ++n_sent;
     }
 
     seaf_debug ("Requesting %d fs objects from %s:%s.\n",
@@ -2930,180 +5065,869 @@ out:
     return ret;
 }
 
-typedef struct {
+typedef struct {
+    char block_id[41];
+    BlockHandle *block;
+    HttpTxTask *task;
+    CURL *curl;
+    gboolean started;           /* got data of the current response */
+    gboolean skip_response;     /* which isn't the block */
+    gint64 pos;                 /* offset in the block of the next byte */
+    gint64 written;
+} GetBlockData;
+
+/* Times an interrupted block download is resumed, if it made progress. */
+#define BLOCK_RESUME_RETRIES 3
+
+/*
+ * Update the rate of the task and global transferred bytes. Curl callbacks
+ * don't @wait for the rate limit, they are admitted by it beforehand.
+ */
+static void
+count_recv_bytes (HttpTxTask *task, int n, gboolean wait)
+{
+    g_atomic_int_add (&task->tx_bytes, n);
+    g_atomic_int_add (&(seaf->sync_mgr->recv_bytes), n);
+
+    if (wait)
+        token_bucket_take (&task->manager->priv->download_bucket, task, n);
+    else
+        token_bucket_charge (&task->manager->priv->download_bucket, task, n);
+}
+
+static size_t
+get_block_callback (void *ptr, size_t size, size_t nmemb, void *userp)
+{
+    size_t realsize = size *nmemb;
+    GetBlockData *data = userp;
+    HttpTxTask *task = data->task;
+    size_t skip = 0;
+    size_t n;
+    long status = 0;
+
+    if (task->state == HTTP_TASK_STATE_CANCELED)
+        return 0;
+
+    /* Before anything of the data is taken, it's passed again on resume. */
+    if (!http_engine_admit (&task->manager->priv->download_bucket, task, data->curl))
+        return CURL_WRITEFUNC_PAUSE;
+
+    if (!data->started) {
+        data->started = TRUE;
+        curl_easy_getinfo (data->curl, CURLINFO_RESPONSE_CODE, &status);
+        /* A server that doesn't support ranges sends the whole block. */
+        if (status == HTTP_PARTIAL_CONTENT)
+            data->pos = data->written;
+        else if (status == HTTP_OK)
+            data->pos = 0;
+        else
+            data->skip_response = TRUE;
+    }
+
+    if (data->skip_response)
+        return realsize;
+
+    /* Bytes we already have. */
+    if (data->pos < data->written) {
+        skip = MIN ((gint64)realsize, data->written - data->pos);
+        data->pos += skip;
+        if (skip == realsize)
+            return realsize;
+    }
+
+    n = seaf_block_manager_write_block (seaf->block_mgr,
+                                        data->block,
+                                        (char *)ptr + skip, realsize - skip);
+    if (n < realsize - skip) {
+        seaf_warning ("Failed to write block %s in repo %.8s.\n",
+                      data->block_id, task->repo_id);
+        task->error = HTTP_TASK_ERR_BAD_LOCAL_DATA;
+        return skip + n;
+    }
+    data->pos += n;
+    data->written += n;
+
+    count_recv_bytes (task, n, FALSE);
+
+    return realsize;
+}
+
+int
+get_block (HttpTxTask *task, Connection *conn, const char *block_id)
+{
+    CURL *curl;
+    char *url;
+    int status;
+    BlockHandle *block;
+    int ret = 0;
+
+    block = seaf_block_manager_open_block (seaf->block_mgr,
+                                           task->repo_id, task->repo_version,
+                                           block_id, BLOCK_WRITE);
+    if (!block) {
+        seaf_warning ("Failed to open block %s in repo %.8s.\n",
+                      block_id, task->repo_id);
+        return -1;
+    }
+
+    GetBlockData data;
+    memset (&data, 0, sizeof(data));
+    memcpy (data.block_id, block_id, 40);
+    data.block = block;
+    data.task = task;
+
+    curl = conn->curl;
+    data.curl = curl;
+
+    if (!task->use_fileserver_port)
+        url = g_strdup_printf ("%s/seafhttp/repo/%s/block/%s",
+                               task->host, task->repo_id, block_id);
+    else
+        url = g_strdup_printf ("%s/repo/%s/block/%s",
+                               task->host, task->repo_id, block_id);
+
+    int retries = 0;
+    int rc;
+    gint64 last_written;
+    char range[32];
+    while (1) {
+        data.started = FALSE;
+        data.skip_response = FALSE;
+        last_written = data.written;
+
+        /* Go on from where the last try stopped. */
+        if (data.written > 0) {
+            snprintf (range, sizeof(range), "%"G_GINT64_FORMAT"-", data.written);
+            curl_easy_setopt (curl, CURLOPT_RANGE, range);
+        }
+
+        rc = http_get (curl, url, task->token, &status, NULL, NULL,
+                       get_block_callback, &data, TRUE);
+        curl_easy_reset (curl);
+        if (rc == 0)
+            break;
+
+        if (task->state == HTTP_TASK_STATE_CANCELED)
+            goto error;
+
+        if (task->error == HTTP_TASK_OK && data.written > last_written &&
+            ++retries <= BLOCK_RESUME_RETRIES) {
+            seaf_message ("Resuming download of block %s at %"G_GINT64_FORMAT".\n",
+                          block_id, data.written);
+            continue;
+        }
+
+        if (task->error == HTTP_TASK_OK)
+            task->error = HTTP_TASK_ERR_NET;
+        ret = -1;
+        goto error;
+    }
+
+    if (status != HTTP_OK && status != HTTP_PARTIAL_CONTENT) {
+        seaf_warning ("Bad response code for GET %s: %d.\n", url, status);
+        handle_http_errors (task, status);
+        ret = -1;
+        goto error;
+    }
+
+    seaf_block_manager_close_block (seaf->block_mgr, block);
+
+    if (seaf_block_manager_commit_block (seaf->block_mgr, block) < 0) {
+        seaf_warning ("Failed to commit block %s in repo %.8s.\n",
+                      block_id, task->repo_id);
+        task->error = HTTP_TASK_ERR_WRITE_LOCAL_DATA;
+        ret = -1;
+    }
+
+    seaf_block_manager_block_handle_free (seaf->block_mgr, block);
+
+    g_free (url);
+
+    return ret;
+
+error:
+    g_free (url);
+
+    seaf_block_manager_close_block (seaf->block_mgr, block);
+    seaf_block_manager_block_handle_free (seaf->block_mgr, block);
+
+    return ret;
+}
+
+static int
+save_block (HttpTxTask *task, const char *block_id, const void *data, int len)
+{
+    BlockHandle *block;
+
+    block = seaf_block_manager_open_block (seaf->block_mgr,
+                                           task->repo_id, task->repo_version,
+                                           block_id, BLOCK_WRITE);
+    if (!block) {
+        seaf_warning ("Failed to open block %s in repo %.8s.\n",
+                      block_id, task->repo_id);
+        return -1;
+    }
+
+    if (seaf_block_manager_write_block (seaf->block_mgr, block,
+                                        data, len) != len) {
+        seaf_warning ("Failed to write block %s in repo %.8s.\n",
+                      block_id, task->repo_id);
+        seaf_block_manager_close_block (seaf->block_mgr, block);
+        seaf_block_manager_block_handle_free (seaf->block_mgr, block);
+        return -1;
+    }
+
+    seaf_block_manager_close_block (seaf->block_mgr, block);
+
+    if (seaf_block_manager_commit_block (seaf->block_mgr, block) < 0) {
+        seaf_warning ("Failed to commit block %s in repo %.8s.\n",
+                      block_id, task->repo_id);
+        seaf_block_manager_block_handle_free (seaf->block_mgr, block);
+        return -1;
+    }
+
+    seaf_block_manager_block_handle_free (seaf->block_mgr, block);
+    return 0;
+}
+
+#define GET_BLOCKS_N 64
+
+/* Servers serve pack-blocks from this protocol version on. */
+#define PACK_BLOCKS_PROTO_VERSION 2
+
+/*
+ * Download up to GET_BLOCKS_N blocks from @block_list in one request.
+ * Blocks the server left out of the response are put back to the list.
+ */
+static int
+get_blocks_pack (HttpTxTask *task, Connection *conn, GList **block_list)
+{
+    json_t *array;
+    char *block_id;
+    int n_sent = 0;
+    char *data = NULL;
+    int len;
+    CURL *curl;
+    char *url = NULL;
+    int status;
+    char *rsp_content = NULL;
+    gint64 rsp_size;
+    int ret = 0;
+    GHashTable *requested;
+
+    requested = g_hash_table_new_full (g_str_hash, g_str_equal, g_free, NULL);
+
+    array = json_array ();
+
+    while (*block_list != NULL) {
+        block_id = (*block_list)->data;
+        json_array_append_new (array, json_string(block_id));
+
+        *block_list = g_list_delete_link (*block_list, *block_list);
+
+        g_hash_table_replace (requested, block_id, block_id);
+
+        if (++n_sent >= GET_BLOCKS_N)
+            break;
+    }
+
+    seaf_debug ("Requesting %d blocks from %s:%s.\n",
+                n_sent, task->host, task->repo_id);
+
+    data = json_dumps (array, 0);
+    len = strlen(data);
+    json_decref (array);
+
+    curl = conn->curl;
+
+    if (!task->use_fileserver_port)
+        url = g_strdup_printf ("%s/seafhttp/repo/%s/pack-blocks/",
+                               task->host, task->repo_id);
+    else
+        url = g_strdup_printf ("%s/repo/%s/pack-blocks/",
+                               task->host, task->repo_id);
+
+    if (http_post (curl, url, task->token,
+                   data, len,
+                   &status, &rsp_content, &rsp_size, TRUE) < 0) {
+        task->error = HTTP_TASK_ERR_NET;
+        ret = -1;
+        goto out;
+    }
+
+    if (status != HTTP_OK) {
+        seaf_warning ("Bad response code for POST %s: %d.\n", url, status);
+        handle_http_errors (task, status);
+        ret = -1;
+        goto out;
+    }
+
+    int n_recv = 0;
+    char *p = rsp_content;
+    ObjectHeader *hdr = (ObjectHeader *)p;
+    char recv_block_id[41];
+    gint64 n = 0;
+    int size;
+    while (n < rsp_size) {
+        if (task->state == HTTP_TASK_STATE_CANCELED)
+            goto out;
+
+        if (n + sizeof(ObjectHeader) > rsp_size) {
+            seaf_warning ("Incomplete block package received for repo %.8s.\n",
+                          task->repo_id);
+            task->error = HTTP_TASK_ERR_SERVER;
+            ret = -1;
+            goto out;
+        }
+        memcpy (recv_block_id, hdr->obj_id, 40);
+        recv_block_id[40] = 0;
+        size = ntohl (hdr->obj_size);
+        if (n + sizeof(ObjectHeader) + size > rsp_size ||
+            !g_hash_table_lookup (requested, recv_block_id)) {
+            seaf_warning ("Bad block package received for repo %.8s.\n",
+                          task->repo_id);
+            task->error = HTTP_TASK_ERR_SERVER;
+            ret = -1;
+            goto out;
+        }
+
+        if (save_block (task, recv_block_id, hdr->object, size) < 0) {
+            task->error = HTTP_TASK_ERR_WRITE_LOCAL_DATA;
+            ret = -1;
+            goto out;
+        }
+        count_recv_bytes (task, size, TRUE);
+
+        ++n_recv;
+        g_hash_table_remove (requested, recv_block_id);
+
+        p += (sizeof(ObjectHeader) + size);
+        n += (sizeof(ObjectHeader) + size);
+        hdr = (ObjectHeader *)p;
+    }
+
+    seaf_debug ("Received %d blocks from %s:%s.\n",
+                n_recv, task->host, task->repo_id);
+
+    if (n_recv == 0) {
+        seaf_warning ("No blocks received for repo %.8s.\n", task->repo_id);
+        task->error = HTTP_TASK_ERR_SERVER;
+        ret = -1;
+        goto out;
+    }
+
+out:
+    /* Put back the blocks not received. */
+    if (ret == 0) {
+        GHashTableIter iter;
+        gpointer key, value;
+        g_hash_table_iter_init (&iter, requested);
+        while (g_hash_table_iter_next (&iter, &key, &value))
+            *block_list = g_list_prepend (*block_list, g_strdup((char *)key));
+    }
+    g_hash_table_destroy (requested);
+    g_free (url);
+    g_free (data);
+    g_free (rsp_content);
+    curl_easy_reset (curl);
+
+    return ret;
+}
+
+/*
+ * Download the blocks in @block_ids, several in one request if the server
+ * supports that. Frees the list.
+ */
+static int
+download_blocks (HttpTxTask *task, Connection *conn, GList *block_ids)
+{
+    GList *ptr;
+    int ret = 0;
+
+    if (task->protocol_version >= PACK_BLOCKS_PROTO_VERSION &&
+        g_list_length (block_ids) > 1) {
+        while (block_ids != NULL) {
+            ret = get_blocks_pack (task, conn, &block_ids);
+            if (ret < 0 || task->state == HTTP_TASK_STATE_CANCELED)
+                break;
+        }
+    } else {
+        for (ptr = block_ids; ptr; ptr = ptr->next) {
+            ret = get_block (task, conn, ptr->data);
+            if (ret < 0 || task->state == HTTP_TASK_STATE_CANCELED)
+                break;
+        }
+    }
+
+    string_list_free (block_ids);
+    return ret;
+}
+
+/* Add the blocks of @file_id that are not on disk yet to @block_ids. */
+static int
+collect_missing_blocks (HttpTxTask *task, const char *file_id,
+                        GHashTable *seen, GList **block_ids)
+{
+    char **blocks;
+    int n_blocks, i;
+
+    blocks = seaf_fs_manager_get_file_block_ids (seaf->fs_mgr,
+                                                 task->repo_id,
+                                                 task->repo_version,
+                                                 file_id, &n_blocks);
+    if (!blocks) {
+        seaf_warning ("Failed to find seafile object %s in repo %.8s.\n",
+                      file_id, task->repo_id);
+        return -1;
+    }
+
+    for (i = 0; i < n_blocks; ++i) {
+        if (g_hash_table_lookup (seen, blocks[i]))
+            continue;
+        g_hash_table_insert (seen, g_strdup(blocks[i]), GINT_TO_POINTER(1));
+
+        if (!seaf_block_manager_block_exists (seaf->block_mgr,
+                                              task->repo_id,
+                                              task->repo_version,
+                                              blocks[i]) &&
+            block_index_copy_block (seaf->block_index,
+                                    task->repo_id,
+                                    task->repo_version,
+                                    blocks[i]) < 0)
+            *block_ids = g_list_prepend (*block_ids, g_strdup(blocks[i]));
+    }
+
+    g_strfreev (blocks);
+    return 0;
+}
+
+static int
+download_missing_blocks (HttpTxTask *task, GList *file_ids)
+{
+    HttpTxPriv *priv = seaf->http_tx_mgr->priv;
+    ConnectionPool *pool;
+    Connection *conn;
+    GHashTable *seen;
+    GList *block_ids = NULL, *ptr;
+    int ret = 0;
+
+    seen = g_hash_table_new_full (g_str_hash, g_str_equal, g_free, NULL);
+    for (ptr = file_ids; ptr; ptr = ptr->next) {
+        if (collect_missing_blocks (task, ptr->data, seen, &block_ids) < 0) {
+            g_hash_table_destroy (seen);
+            string_list_free (block_ids);
+            return -1;
+        }
+    }
+    g_hash_table_destroy (seen);
+
+    if (!block_ids)
+        return 0;
+    block_ids = g_list_reverse (block_ids);
+
+    pool = find_connection_pool (priv, task->host);
+    if (!pool) {
+        seaf_warning ("Failed to create connection pool for host %s.\n", task->host);
+        task->error = HTTP_TASK_ERR_NOT_ENOUGH_MEMORY;
+        string_list_free (block_ids);
+        return -1;
+    }
+
+    conn = connection_pool_get_connection (pool);
+    if (!conn) {
+        seaf_warning ("Failed to get connection to host %s.\n", task->host);
+        task->error = HTTP_TASK_ERR_NOT_ENOUGH_MEMORY;
+        string_list_free (block_ids);
+        return -1;
+    }
+
+    ret = download_blocks (task, conn, block_ids);
+
+    connection_pool_return_connection (pool, conn);
+
+    return ret;
+}
+
+/* Most blocks fetched at the same time ahead of checkout. */
+#define DOWNLOAD_BLOCK_WORKERS 4
+
+/* How far fetching runs ahead of the file being checked out. Fetched
+ * blocks are only removed once their file is checked out.
+ */
+#define DOWNLOAD_AHEAD_FILES 64
+#define DOWNLOAD_AHEAD_SIZE (64 << 20) /* 64MB */
+
+/* Blocks of files up to this size are fetched in packs, whose responses
+ * are kept in memory.
+ */
+#define PACK_MAX_FILE_SIZE (1 << 20) /* 1MB */
+
+typedef struct DownloadFile {
+    char file_id[41];
+    gint64 size;
+    gboolean started;
+    int pending;                /* blocks not landed yet */
+} DownloadFile;
+
+typedef struct DownloadBlock {
     char block_id[41];
-    BlockHandle *block;
+    gboolean packable;
+    gboolean landed;
+    GList *waiters;             /* DownloadFile, until it lands */
+} DownloadBlock;
+
+struct _HttpBlockDownload {
     HttpTxTask *task;
-} GetBlockData;
+    ConnectionPool *pool;
+    gboolean use_packs;
+    int error;                  /* task->error before the workers started */
 
-static size_t
-get_block_callback (void *ptr, size_t size, size_t nmemb, void *userp)
-{
-    size_t realsize = size *nmemb;
-    SendBlockData *data = userp;
-    HttpTxTask *task = data->task;
-    size_t n;
+    pthread_t threads[DOWNLOAD_BLOCK_WORKERS];
+    int n_threads;
 
-    if (task->state == HTTP_TASK_STATE_CANCELED)
-        return 0;
+    pthread_mutex_t lock;
+    pthread_cond_t cond;
+    DownloadFile *files;        /* in checkout order */
+    int n_files;
+    GHashTable *file_index;     /* file_id -> index + 1 */
+    int next_file;              /* the next one to start */
+    int cursor;                 /* the one being checked out */
+    GHashTable *blocks;         /* block_id -> DownloadBlock */
+    GQueue *queue;              /* blocks not taken by a worker yet */
+    int n_running;
+    gboolean failed;
+    gboolean stop;
+};
 
-    n = seaf_block_manager_write_block (seaf->block_mgr,
-                                        data->block,
-                                        ptr, realsize);
-    if (n < realsize) {
-        seaf_warning ("Failed to write block %s in repo %.8s.\n",
-                      data->block_id, task->repo_id);
-        task->error = HTTP_TASK_ERR_BAD_LOCAL_DATA;
-        return n;
-    }
+static void
+download_block_free (DownloadBlock *block)
+{
+    g_list_free (block->waiters);
+    g_free (block);
+}
 
-    /* Update global transferred bytes. */
-    g_atomic_int_add (&(seaf->sync_mgr->recv_bytes), n);
+static gboolean
+can_start_next_file (HttpBlockDownload *dl)
+{
+    gint64 size_ahead = 0;
+    int i;
 
-    /* If uploaded bytes exceeds the limit, wait until the counter
-     * is reset. We check the counter every 100 milliseconds, so we
-     * can waste up to 100 milliseconds without sending data after
-     * the counter is reset.
-     */
-    while (1) {
-        gint sent = g_atomic_int_get(&(seaf->sync_mgr->recv_bytes));
-        if (seaf->sync_mgr->download_limit > 0 &&
-            sent > seaf->sync_mgr->download_limit)
-            /* 100 milliseconds */
-            g_usleep (100000);
-        else
-            break;
-    }
+    if (dl->next_file >= dl->n_files)
+        return FALSE;
+    if (dl->next_file <= dl->cursor)
+        return TRUE;
+    if (dl->next_file - dl->cursor > DOWNLOAD_AHEAD_FILES)
+        return FALSE;
 
-    return n;
+    for (i = dl->cursor + 1; i < dl->next_file; ++i)
+        size_ahead += dl->files[i].size;
+    return size_ahead < DOWNLOAD_AHEAD_SIZE;
 }
 
-int
-get_block (HttpTxTask *task, Connection *conn, const char *block_id)
+/* Queue the missing blocks of the next file. Called with the lock held. */
+static void
+start_next_file (HttpBlockDownload *dl)
 {
-    CURL *curl;
-    char *url;
-    int status;
-    BlockHandle *block;
-    int ret = 0;
+    HttpTxTask *task = dl->task;
+    DownloadFile *file = &dl->files[dl->next_file++];
+    DownloadBlock *block;
+    Seafile *seafile;
+    int i;
 
-    block = seaf_block_manager_open_block (seaf->block_mgr,
+    file->started = TRUE;
+
+    seafile = seaf_fs_manager_get_seafile (seaf->fs_mgr,
                                            task->repo_id, task->repo_version,
-                                           block_id, BLOCK_WRITE);
-    if (!block) {
-        seaf_warning ("Failed to open block %s in repo %.8s.\n",
-                      block_id, task->repo_id);
-        return -1;
+                                           file->file_id);
+    if (!seafile) {
+        /* Checkout reports it. */
+        seaf_warning ("Failed to find seafile object %s in repo %.8s.\n",
+                      file->file_id, task->repo_id);
+        return;
     }
+    file->size = seafile->file_size;
 
-    GetBlockData data;
-    memcpy (data.block_id, block_id, 40);
-    data.block = block;
-    data.task = task;
-
-    curl = conn->curl;
+    for (i = 0; i < seafile->n_blocks; ++i) {
+        block = g_hash_table_lookup (dl->blocks, seafile->blk_sha1s[i]);
+        if (block) {
+            if (!block->landed && !g_list_find (block->waiters, file)) {
+                block->waiters = g_list_prepend (block->waiters, file);
+                ++file->pending;
+            }
+            continue;
+        }
 
-    if (!task->use_fileserver_port)
-        url = g_strdup_printf ("%s/seafhttp/repo/%s/block/%s",
-                               task->host, task->repo_id, block_id);
-    else
-        url = g_strdup_printf ("%s/repo/%s/block/%s",
-                               task->host, task->repo_id, block_id);
+        if (seaf_block_manager_block_exists (seaf->block_mgr,
+                                             task->repo_id, task->repo_version,
+                                             seafile->blk_sha1s[i]) ||
+            block_index_copy_block (seaf->block_index,
+                                    task->repo_id, task->repo_version,
+                                    seafile->blk_sha1s[i]) == 0)
+            continue;
 
-    if (http_get (curl, url, task->token, &status, NULL, NULL,
-                  get_block_callback, &data, TRUE) < 0) {
-        if (task->state == HTTP_TASK_STATE_CANCELED)
-            goto error;
+        block = g_new0 (DownloadBlock, 1);
+        memcpy (block->block_id, seafile->blk_sha1s[i], 40);
+        block->packable = (seafile->file_size <= PACK_MAX_FILE_SIZE);
+        block->waiters = g_list_prepend (NULL, file);
+        ++file->pending;
 
-        if (task->error == HTTP_TASK_OK)
-            task->error = HTTP_TASK_ERR_NET;
-        ret = -1;
-        goto error;
+        g_hash_table_insert (dl->blocks, block->block_id, block);
+        g_queue_push_tail (dl->queue, block);
     }
 
-    if (status != HTTP_OK) {
-        seaf_warning ("Bad response code for GET %s: %d.\n", url, status);
-        handle_http_errors (task, status);
-        ret = -1;
-        goto error;
+    seafile_unref (seafile);
+}
+
+/*
+ * Take the next blocks to fetch, or NULL when the workers should stop.
+ * Blocks are queued file by file in checkout order, so the files about
+ * to be checked out are completed first.
+ */
+static GList *
+take_download_blocks (HttpBlockDownload *dl)
+{
+    DownloadBlock *block;
+    GList *blocks = NULL;
+    int n = 1;
+
+    pthread_mutex_lock (&dl->lock);
+    while (!dl->stop && !dl->failed &&
+           dl->task->state != HTTP_TASK_STATE_CANCELED) {
+        /* Look far enough ahead to fill a pack. */
+        while (g_queue_get_length (dl->queue) < GET_BLOCKS_N &&
+               can_start_next_file (dl))
+            start_next_file (dl);
+
+        if (!g_queue_is_empty (dl->queue)) {
+            block = g_queue_pop_head (dl->queue);
+            blocks = g_list_prepend (blocks, block);
+            while (dl->use_packs && block->packable && n < GET_BLOCKS_N) {
+                block = g_queue_peek_head (dl->queue);
+                if (!block || !block->packable)
+                    break;
+                blocks = g_list_prepend (blocks, g_queue_pop_head (dl->queue));
+                ++n;
+            }
+            break;
+        }
+
+        if (dl->next_file >= dl->n_files)
+            break;
+        /* Wait for checkout to catch up. */
+        pthread_cond_wait (&dl->cond, &dl->lock);
     }
+    pthread_mutex_unlock (&dl->lock);
 
-    seaf_block_manager_close_block (seaf->block_mgr, block);
+    return g_list_reverse (blocks);
+}
 
-    if (seaf_block_manager_commit_block (seaf->block_mgr, block) < 0) {
-        seaf_warning ("Failed to commit block %s in repo %.8s.\n",
-                      block_id, task->repo_id);
-        task->error = HTTP_TASK_ERR_WRITE_LOCAL_DATA;
-        ret = -1;
+/* Called with the lock held. */
+static void
+land_block (DownloadBlock *block)
+{
+    GList *ptr;
+
+    block->landed = TRUE;
+    for (ptr = block->waiters; ptr; ptr = ptr->next)
+        --((DownloadFile *)ptr->data)->pending;
+    g_list_free (block->waiters);
+    block->waiters = NULL;
+}
+
+static void *
+block_download_thread (void *vdata)
+{
+    HttpBlockDownload *dl = vdata;
+    HttpTxTask *task = dl->task;
+    Connection *conn;
+    GList *blocks, *block_ids, *ptr;
+    int ret;
+
+    conn = connection_pool_get_connection (dl->pool);
+    if (!conn) {
+        seaf_warning ("Failed to get connection to host %s.\n", task->host);
+        goto out;
     }
 
-    seaf_block_manager_block_handle_free (seaf->block_mgr, block);
+    while ((blocks = take_download_blocks (dl)) != NULL) {
+        block_ids = NULL;
+        for (ptr = blocks; ptr; ptr = ptr->next)
+            block_ids = g_list_prepend (block_ids,
+                                        g_strdup(((DownloadBlock *)ptr->data)->block_id));
+        block_ids = g_list_reverse (block_ids);
 
-    g_free (url);
+        ret = download_blocks (task, conn, block_ids);
 
-    return ret;
+        pthread_mutex_lock (&dl->lock);
+        if (ret < 0 || task->state == HTTP_TASK_STATE_CANCELED) {
+            dl->failed = TRUE;
+        } else {
+            for (ptr = blocks; ptr; ptr = ptr->next)
+                land_block (ptr->data);
+        }
+        pthread_cond_broadcast (&dl->cond);
+        pthread_mutex_unlock (&dl->lock);
 
-error:
-    g_free (url);
+        g_list_free (blocks);
+    }
 
-    seaf_block_manager_close_block (seaf->block_mgr, block);
-    seaf_block_manager_block_handle_free (seaf->block_mgr, block);
+    connection_pool_return_connection (dl->pool, conn);
 
-    return ret;
+out:
+    pthread_mutex_lock (&dl->lock);
+    --dl->n_running;
+    pthread_cond_broadcast (&dl->cond);
+    pthread_mutex_unlock (&dl->lock);
+
+    return NULL;
 }
 
 int
-http_tx_task_download_file_blocks (HttpTxTask *task, const char *file_id)
+http_tx_task_start_block_download (HttpTxTask *task, GList *file_ids)
 {
-    Seafile *file;
     HttpTxPriv *priv = seaf->http_tx_mgr->priv;
-    ConnectionPool *pool;
-    Connection *conn;
-    int ret = 0;
+    HttpBlockDownload *dl;
+    GList *ptr;
+    int i;
 
-    file = seaf_fs_manager_get_seafile (seaf->fs_mgr,
-                                        task->repo_id,
-                                        task->repo_version,
-                                        file_id);
-    if (!file) {
-        seaf_warning ("Failed to find seafile object %s in repo %.8s.\n",
-                      file_id, task->repo_id);
-        return -1;
-    }
+    if (task->block_download || !file_ids)
+        return 0;
 
-    pool = find_connection_pool (priv, task->host);
-    if (!pool) {
+    dl = g_new0 (HttpBlockDownload, 1);
+    dl->task = task;
+    dl->pool = find_connection_pool (priv, task->host);
+    if (!dl->pool) {
         seaf_warning ("Failed to create connection pool for host %s.\n", task->host);
-        task->error = HTTP_TASK_ERR_NOT_ENOUGH_MEMORY;
-        seafile_unref (file);
+        g_free (dl);
         return -1;
     }
-
-    conn = connection_pool_get_connection (pool);
-    if (!conn) {
-        seaf_warning ("Failed to get connection to host %s.\n", task->host);
-        task->error = HTTP_TASK_ERR_NOT_ENOUGH_MEMORY;
-        seafile_unref (file);
-        return -1;
+    dl->use_packs = (task->protocol_version >= PACK_BLOCKS_PROTO_VERSION);
+    dl->error = task->error;
+
+    dl->n_files = g_list_length (file_ids);
+    dl->files = g_new0 (DownloadFile, dl->n_files);
+    dl->file_index = g_hash_table_new (g_str_hash, g_str_equal);
+    for (ptr = file_ids, i = 0; ptr; ptr = ptr->next, ++i) {
+        memcpy (dl->files[i].file_id, ptr->data, 40);
+        if (!g_hash_table_lookup (dl->file_index, dl->files[i].file_id))
+            g_hash_table_insert (dl->file_index, dl->files[i].file_id,
+                                 GINT_TO_POINTER(i + 1));
+    }
+    dl->blocks = g_hash_table_new_full (g_str_hash, g_str_equal, NULL,
+                                        (GDestroyNotify)download_block_free);
+    dl->queue = g_queue_new ();
+    pthread_mutex_init (&dl->lock, NULL);
+    pthread_cond_init (&dl->cond, NULL);
+
+    for (i = 0; i < DOWNLOAD_BLOCK_WORKERS; ++i) {
+        if (pthread_create (&dl->threads[dl->n_threads], NULL,
+                            block_download_thread, dl) != 0) {
+            seaf_warning ("Failed to start block download thread.\n");
+            break;
+        }
+        ++dl->n_threads;
     }
+    dl->n_running = dl->n_threads;
+
+    task->block_download = dl;
+
+    return 0;
+}
 
+void
+http_tx_task_stop_block_download (HttpTxTask *task)
+{
+    HttpBlockDownload *dl = task->block_download;
     int i;
-    char *block_id;
-    for (i = 0; i < file->n_blocks; ++i) {
-        block_id = file->blk_sha1s[i];
-        if (!seaf_block_manager_block_exists (seaf->block_mgr,
-                                              task->repo_id,
-                                              task->repo_version,
-                                              block_id)) {
-            ret = get_block (task, conn, block_id);
-            if (ret < 0 || task->state == HTTP_TASK_STATE_CANCELED)
-                break;
-        }
+
+    if (!dl)
+        return;
+
+    pthread_mutex_lock (&dl->lock);
+    dl->stop = TRUE;
+    pthread_cond_broadcast (&dl->cond);
+    pthread_mutex_unlock (&dl->lock);
+
+    for (i = 0; i < dl->n_threads; ++i)
+        pthread_join (dl->threads[i], NULL);
+
+    /* Whatever failed is fetched again when its file is checked out,
+     * which reports the error if it is still there.
+     */
+    if (dl->failed)
+        task->error = dl->error;
+
+    g_free (dl->files);
+    g_hash_table_destroy (dl->file_index);
+    g_hash_table_destroy (dl->blocks);
+    g_queue_free (dl->queue);
+    pthread_mutex_destroy (&dl->lock);
+    pthread_cond_destroy (&dl->cond);
+    g_free (dl);
+
+    task->block_download = NULL;
+}
+
+/*
+ * Wait until the workers have fetched the blocks of @file_id, if it was
+ * given to them. Returns FALSE if they won't.
+ */
+static gboolean
+wait_for_file_blocks (HttpBlockDownload *dl, const char *file_id)
+{
+    HttpTxTask *task = dl->task;
+    DownloadFile *file;
+    gpointer index;
+    gboolean ret;
+
+    index = g_hash_table_lookup (dl->file_index, file_id);
+    if (!index)
+        return TRUE;
+    file = &dl->files[GPOINTER_TO_INT(index) - 1];
+
+    pthread_mutex_lock (&dl->lock);
+
+    if (GPOINTER_TO_INT(index) - 1 > dl->cursor) {
+        dl->cursor = GPOINTER_TO_INT(index) - 1;
+        pthread_cond_broadcast (&dl->cond);
     }
 
-    connection_pool_return_connection (pool, conn);
+    while (!(file->started && file->pending == 0) &&
+           !dl->failed && dl->n_running > 0 &&
+           task->state != HTTP_TASK_STATE_CANCELED)
+        pthread_cond_wait (&dl->cond, &dl->lock);
+
+    ret = (file->started && file->pending == 0);
+
+    pthread_mutex_unlock (&dl->lock);
+
+    return ret;
+}
+
+int
+http_tx_task_download_file_blocks (HttpTxTask *task, const char *file_id)
+{
+    GList *file_ids;
+    int error;
+    int ret;
 
-    seafile_unref (file);
+    if (task->block_download &&
+        !wait_for_file_blocks (task->block_download, file_id))
+        http_tx_task_stop_block_download (task);
+
+    /* Also fetches the blocks shared with a file that has been checked
+     * out and cleaned up since they landed.
+     */
+    file_ids = g_list_prepend (NULL, (char *)file_id);
+    ret = download_missing_blocks (task, file_ids);
+    g_list_free (file_ids);
+
+    if (ret < 0 && task->block_download) {
+        /* Keep our error over the workers'. */
+        error = task->error;
+        http_tx_task_stop_block_download (task);
+        task->error = error;
+    }
 
     return ret;
 }
@@ -3234,26 +6058,51 @@ http_download_thread (void *vdata)
 
     transition_state (task, task->state, HTTP_TASK_RT_STATE_FS);
 
-    if (get_needed_fs_id_list (task, conn, &fs_id_list) < 0) {
-        seaf_warning ("Failed to get fs id list for repo %.8s on server %s.\n",
-                      task->repo_id, task->host);
-        goto out;
-    }
+    SyncPaths *wanted = NULL, *synced = NULL;
+    int ret;
 
-    if (task->state == HTTP_TASK_STATE_CANCELED)
-        goto out;
+    if (!task->is_clone) {
+        SeafRepo *repo = seaf_repo_manager_get_repo (seaf->repo_mgr, task->repo_id);
+        if (repo)
+            seaf_repo_get_sync_paths (repo, &wanted, &synced);
+    }
 
-    while (fs_id_list != NULL) {
-        if (get_fs_objects (task, conn, &fs_id_list) < 0) {
+    if (wanted) {
+        ret = get_selected_fs_objects (task, pool, conn, wanted, synced);
+        sync_paths_free (wanted);
+        sync_paths_free (synced);
+        if (ret < 0) {
             seaf_warning ("Failed to get fs objects for repo %.8s on server %s.\n",
                           task->repo_id, task->host);
             goto out;
         }
+    } else {
+        sync_paths_free (synced);
+
+        if (get_needed_fs_id_list (task, conn, &fs_id_list) < 0) {
+            seaf_warning ("Failed to get fs id list for repo %.8s on server %s.\n",
+                          task->repo_id, task->host);
+            goto out;
+        }
 
         if (task->state == HTTP_TASK_STATE_CANCELED)
             goto out;
+
+        task->stats.n_fs_objects = g_list_length (fs_id_list);
+
+        /* The list is consumed. */
+        ret = transfer_fs_objects (task, pool, conn, fs_id_list, FALSE);
+        fs_id_list = NULL;
+        if (ret < 0) {
+            seaf_warning ("Failed to get fs objects for repo %.8s on server %s.\n",
+                          task->repo_id, task->host);
+            goto out;
+        }
     }
 
+    if (task->state == HTTP_TASK_STATE_CANCELED)
+        goto out;
+
     transition_state (task, task->state, HTTP_TASK_RT_STATE_BLOCK);
 
     /* Record download head commit id, so that we can resume download
@@ -3280,7 +6129,9 @@ http_download_thread (void *vdata)
         goto out;
     }
 
+    gint64 t = get_current_time ();
     update_local_repo (task);
+    task->stats.update_local_time = get_current_time () - t;
 
 out:
     connection_pool_return_connection (pool, conn);
@@ -3361,6 +6212,125 @@ http_tx_task_get_rate (HttpTxTask *task)
     return task->last_tx_bytes;
 }
 
+void
+http_tx_manager_prioritize_path (HttpTxManager *manager,
+                                 const char *repo_id,
+                                 const char *path)
+{
+    HttpTxPriv *priv = manager->priv;
+    PriorityPaths *pp;
+
+    /* Paths are relative to the worktree, as in the diff entries. */
+    while (*path == '/')
+        ++path;
+
+    pthread_mutex_lock (&priv->priority_lock);
+
+    pp = g_hash_table_lookup (priv->priority_paths, repo_id);
+    if (!pp) {
+        pp = g_new0 (PriorityPaths, 1);
+        pp->paths = g_ptr_array_new ();
+        g_hash_table_insert (priv->priority_paths, g_strdup(repo_id), pp);
+    }
+    g_ptr_array_add (pp->paths, g_strdup(path));
+    ++pp->serial;
+
+    pthread_mutex_unlock (&priv->priority_lock);
+}
+
+gboolean
+http_tx_manager_is_path_prioritized (HttpTxManager *manager,
+                                     const char *repo_id,
+                                     const char *path)
+{
+    HttpTxPriv *priv = manager->priv;
+    PriorityPaths *pp;
+    const char *prefix;
+    size_t len;
+    gboolean ret = FALSE;
+    guint i;
+
+    pthread_mutex_lock (&priv->priority_lock);
+
+    pp = g_hash_table_lookup (priv->priority_paths, repo_id);
+    for (i = 0; pp && i < pp->paths->len; ++i) {
+        prefix = g_ptr_array_index (pp->paths, i);
+        len = strlen (prefix);
+        /* An empty path is the whole repo. */
+        if (len == 0 ||
+            (strncmp (path, prefix, len) == 0 &&
+             (path[len] == '\0' || path[len] == '/'))) {
+            ret = TRUE;
+            break;
+        }
+    }
+
+    pthread_mutex_unlock (&priv->priority_lock);
+
+    return ret;
+}
+
+guint
+http_tx_manager_get_priority_serial (HttpTxManager *manager,
+                                     const char *repo_id)
+{
+    HttpTxPriv *priv = manager->priv;
+    PriorityPaths *pp;
+    guint serial = 0;
+
+    pthread_mutex_lock (&priv->priority_lock);
+    pp = g_hash_table_lookup (priv->priority_paths, repo_id);
+    if (pp)
+        serial = pp->serial;
+    pthread_mutex_unlock (&priv->priority_lock);
+
+    return serial;
+}
+
+void
+http_tx_manager_clear_priorities (HttpTxManager *manager,
+                                  const char *repo_id)
+{
+    HttpTxPriv *priv = manager->priv;
+    PriorityPaths *pp;
+
+    pthread_mutex_lock (&priv->priority_lock);
+    /* Keep the serial going, a checkout may be comparing to it. */
+    pp = g_hash_table_lookup (priv->priority_paths, repo_id);
+    if (pp)
+        clear_priority_paths (pp);
+    pthread_mutex_unlock (&priv->priority_lock);
+}
+
+void
+http_tx_task_set_current_file (HttpTxTask *task, const char *path,
+                               gint64 done_bytes)
+{
+    HttpTxPriv *priv = task->manager->priv;
+    char *old;
+
+    pthread_mutex_lock (&priv->priority_lock);
+    old = task->current_file;
+    task->current_file = g_strdup (path);
+    task->done_bytes = done_bytes;
+    pthread_mutex_unlock (&priv->priority_lock);
+
+    g_free (old);
+}
+
+char *
+http_tx_task_get_current_file (HttpTxTask *task)
+{
+    HttpTxPriv *priv = task->manager->priv;
+    char *path;
+
+    pthread_mutex_lock (&priv->priority_lock);
+    path = g_strdup (task->current_file);
+    pthread_mutex_unlock (&priv->priority_lock);
+
+    return path;
+}
+
 const char *
 http_task_state_to_str (int state)
 {
@@ -58,6 +58,28 @@ struct _HttpTxManager {
 
 typedef struct _HttpTxManager HttpTxManager;
 
+/* Rates are measured over the last second, updated this many times in it. */
+#define HTTP_TX_RATE_SAMPLES 4
+
+/*
+ * Where the time of a task went, for tuning. Times are in microseconds
+ * and only touched by the thread running the task, except that bytes is
+ * summed up from the rate samples in the main thread.
+ */
+typedef struct _HttpTxStats {
+    gint64 start_time;
+    gint64 phase_start;
+    gint64 phase_time[N_HTTP_TASK_RT_STATE];
+
+    gint64 fs_list_time;        /* finding the fs objects to upload */
+    gint64 check_time;          /* check-fs and check-blocks requests */
+    int n_checks;
+    gint64 update_local_time;   /* updating the local repo after download */
+
+    int n_fs_objects;           /* fs objects actually transferred */
+    gint64 bytes;
+} HttpTxStats;
+
 struct _HttpTxTask {
     HttpTxManager *manager;
 
@@ -87,10 +109,25 @@ struct _HttpTxTask {
     int n_files;
     int done_files;
 
-    gint tx_bytes;              /* bytes transferred in this second. */
+    gint tx_bytes;              /* bytes transferred since the last sample. */
     gint last_tx_bytes;         /* bytes transferred in the last second. */
+    gint rate_samples[HTTP_TX_RATE_SAMPLES];
+    int rate_index;
+
+    int priority;               /* share of the bandwidth, from 1 */
+    double vtime;               /* for fair queuing on the rate limits */
+
+    struct _HttpBlockDownload *block_download; /* runs ahead of checkout */
+
+    /* Checkout plan, see http_tx_task_set_current_file(). */
+    char *current_file;
+    gint64 planned_bytes;
+    gint64 done_bytes;
+
+    HttpTxStats stats;
 };
 typedef struct _HttpTxTask HttpTxTask;
+typedef struct _HttpBlockDownload HttpBlockDownload;
 
 HttpTxManager *
 http_tx_manager_new (struct _SeafileSession *seaf);
@@ -165,6 +202,62 @@ http_tx_manager_check_head_commit (HttpTxManager *manager,
                                    HttpHeadCommitCallback callback,
                                    void *user_data);
 
+typedef struct _HttpHeadCommitReq {
+    char repo_id[37];
+    char *token;
+} HttpHeadCommitReq;
+
+void
+http_head_commit_req_free (HttpHeadCommitReq *req);
+
+struct _HttpHeadCommits {
+    gboolean success;
+    GHashTable *heads;          /* repo_id -> head commit id */
+};
+typedef struct _HttpHeadCommits HttpHeadCommits;
+
+typedef void (*HttpHeadCommitsCallback) (HttpHeadCommits *result,
+                                         void *user_data);
+
+/*
+ * Asynchronous interface for getting the head commits of many repos on a
+ * server in one request. Repos that are deleted, corrupted or whose token
+ * is refused are left out of the result; check them one by one.
+ */
+int
+http_tx_manager_check_head_commits (HttpTxManager *manager,
+                                    const char *host,
+                                    gboolean use_fileserver_port,
+                                    GList *head_commit_requests, /* HttpHeadCommitReq */
+                                    HttpHeadCommitsCallback callback,
+                                    void *user_data);
+
+struct _HttpHeadWatch {
+    gboolean success;
+    gint64 cursor;
+    GList *repo_ids;            /* repos updated after the cursor sent */
+};
+typedef struct _HttpHeadWatch HttpHeadWatch;
+
+typedef void (*HttpHeadWatchCallback) (HttpHeadWatch *result,
+                                       void *user_data);
+
+/*
+ * Asynchronous long poll for head changes of many repos. The server
+ * replies once some of the repos are updated after @cursor, or with none
+ * after a while. Without a cursor it replies right away with the cursor
+ * to start from.
+ */
+int
+http_tx_manager_watch_head_commits (HttpTxManager *manager,
+                                    const char *host,
+                                    gboolean use_fileserver_port,
+                                    gboolean has_cursor,
+                                    gint64 cursor,
+                                    GList *head_commit_requests, /* HttpHeadCommitReq */
+                                    HttpHeadWatchCallback callback,
+                                    void *user_data);
+
 typedef struct _HttpFolderPermReq {
     char repo_id[37];
     char *token;
@@ -202,9 +295,24 @@ http_tx_manager_get_folder_perms (HttpTxManager *manager,
                                   HttpGetFolderPermsCallback callback,
                                   void *user_data);
 
+/*
+ * Start fetching the missing blocks of @file_ids, in checkout order, on
+ * several connections in the background.
+ */
+int
+http_tx_task_start_block_download (HttpTxTask *task, GList *file_ids);
+
+/*
+ * Make sure all blocks of @file_id are local. Returns as soon as they are,
+ * even if blocks of later files are still being fetched.
+ */
 int
 http_tx_task_download_file_blocks (HttpTxTask *task, const char *file_id);
 
+/* Stop the workers started by http_tx_task_start_block_download(). */
+void
+http_tx_task_stop_block_download (HttpTxTask *task);
+
 GList*
 http_tx_manager_get_upload_tasks (HttpTxManager *manager);
 
@@ -222,12 +330,53 @@ http_tx_manager_cancel_task (HttpTxManager *manager,
 int
 http_tx_task_get_rate (HttpTxTask *task);
 
+/*
+ * Have @path of @repo_id, a file or a folder, checked out before the
+ * other files of the current or the next download.
+ */
+void
+http_tx_manager_prioritize_path (HttpTxManager *manager,
+                                 const char *repo_id,
+                                 const char *path);
+
+/* Whether @path is in or under a prioritized path of @repo_id. */
+gboolean
+http_tx_manager_is_path_prioritized (HttpTxManager *manager,
+                                     const char *repo_id,
+                                     const char *path);
+
+/* Changes whenever a path of @repo_id is prioritized. */
+guint
+http_tx_manager_get_priority_serial (HttpTxManager *manager,
+                                     const char *repo_id);
+
+/* Forget the prioritized paths of @repo_id once they're checked out. */
+void
+http_tx_manager_clear_priorities (HttpTxManager *manager,
+                                  const char *repo_id);
+
+/*
+ * Record the file being checked out, and the bytes of the planned files
+ * checked out so far. Called from the checkout thread.
+ */
+void
+http_tx_task_set_current_file (HttpTxTask *task, const char *path,
+                               gint64 done_bytes);
+
+/* Returns a copy of the file being checked out, or NULL. */
+char *
+http_tx_task_get_current_file (HttpTxTask *task);
+
 const char *
 http_task_state_to_str (int state);
 
 const char *
 http_task_rt_state_to_str (int rt_state);
 
+/* Timing and counts of @task as a JSON object. */
+char *
+http_tx_task_stats_to_json (HttpTxTask *task);
+
 const char *
 http_task_error_str (int task_errno);
 
@@ -86,6 +86,10 @@ static int seafile_merge_trees(struct merge_options *o,
     else
         opts->update = 1;
     opts->merge = 1;
+    /* Only the dirs changed by the remote are merged entry by entry.
+     * Recovering a merge has to redo it on the whole tree.
+     */
+    opts->skip_unchanged_trees = !o->recover_merge;
     opts->head_idx = 2;
     opts->base = o->worktree;
     opts->fn = threeway_merge;
@@ -134,6 +138,7 @@ char *write_tree_from_memory(struct merge_options *o)
 
     /* if (!active_cache_tree) */
     it = cache_tree();
+    cache_tree_prime(it, o->index, o->version);
 
     if (cache_tree_update(o->repo_id, o->version,
                           o->worktree, 
@@ -143,6 +148,7 @@ char *write_tree_from_memory(struct merge_options *o)
         cache_tree_free (&it);
         return NULL;
     }
+    cache_tree_record_ids(it, o->index);
 
     rawdata_to_hex(it->sha1, root_id, 20);
     cache_tree_free (&it);
@@ -246,7 +252,7 @@ static GList *get_unmerged(struct index_state *index)
         e->stages[ce_stage(ce)].current_mtime = ce->current_mtime;
         e->stages[ce_stage(ce)].mode = ce->ce_mode;
         hashcpy(e->stages[ce_stage(ce)].sha, ce->sha1);
-        e->stages[ce_stage(ce)].modifier = g_strdup(ce->modifier);
+        e->stages[ce_stage(ce)].modifier = g_strdup(ce_modifier(ce));
     }
     unmerged = g_list_reverse(unmerged);
 
@@ -27,7 +27,7 @@ print_index (struct index_state *istate)
         rawdata_to_hex (ce->sha1, id, 20);
         g_message ("%s, %s, %o, %"G_GUINT64_FORMAT", %s, %d\n",
                    ce->name, id, ce->ce_mode, 
-                   ce->ce_mtime.sec, ce->modifier, ce_stage(ce));
+                   ce->ce_mtime.sec, ce_modifier(ce), ce_stage(ce));
     }
 
     return 0;
@@ -29,6 +29,9 @@
 #include "index/cache-tree.h"
 #include "unpack-trees.h"
 #include "diff-simple.h"
+#include "dir-cache.h"
+#include "chunk-map.h"
+#include "sync-paths.h"
 
 #include "db.h"
 
@@ -45,6 +48,13 @@ struct _SeafRepoManagerPriv {
     pthread_mutex_t db_lock;
     GHashTable *checkout_tasks_hash;
     pthread_rwlock_t lock;
+    int checkout_threads;
+    /* repo id -> (key -> value), only set while loading the repos. */
+    GHashTable *startup_props;
+    GQueue *pending_watches;    /* ids of repos to watch after startup */
+    struct CcnetTimer *watch_timer;
+    /* repo id -> number of locked file records, protected by db_lock. */
+    GHashTable *locked_file_counts;
 };
 
 static const char *ignore_table[] = {
@@ -108,6 +118,33 @@ load_locked_file (sqlite3_stmt *stmt, void *data)
     return TRUE;
 }
 
+/* Must be called with db_lock held. */
+static void
+count_locked_files (SeafRepoManager *mgr, const char *repo_id, int delta)
+{
+    int n = GPOINTER_TO_INT (g_hash_table_lookup (mgr->priv->locked_file_counts,
+                                                  repo_id));
+
+    n += delta;
+    if (n > 0)
+        g_hash_table_replace (mgr->priv->locked_file_counts,
+                              g_strdup(repo_id), GINT_TO_POINTER(n));
+    else
+        g_hash_table_remove (mgr->priv->locked_file_counts, repo_id);
+}
+
+gboolean
+seaf_repo_manager_has_locked_files (SeafRepoManager *mgr, const char *repo_id)
+{
+    gboolean ret;
+
+    pthread_mutex_lock (&mgr->priv->db_lock);
+    ret = (g_hash_table_lookup (mgr->priv->locked_file_counts, repo_id) != NULL);
+    pthread_mutex_unlock (&mgr->priv->db_lock);
+
+    return ret;
+}
+
 LockedFileSet *
 seaf_repo_manager_get_locked_file_set (SeafRepoManager *mgr, const char *repo_id)
 {
@@ -157,6 +194,7 @@ locked_file_set_add_update (LockedFileSet *fset,
     char *sql;
     sqlite3_stmt *stmt;
     LockedFile *file;
+    SeafRepo *repo;
     gboolean exists;
 
     exists = (g_hash_table_lookup (fset->locked_files, path) != NULL);
@@ -183,6 +221,12 @@ locked_file_set_add_update (LockedFileSet *fset,
             return -1;
         }
         sqlite3_finalize (stmt);
+        count_locked_files (mgr, fset->repo_id, 1);
+
+        /* Check the new file soon, however long the others back off. */
+        repo = seaf_repo_manager_get_repo (mgr, fset->repo_id);
+        if (repo)
+            repo->next_check_locked_time = 0;
 
         file = g_new0 (LockedFile, 1);
         file->operation = g_strdup(operation);
@@ -254,9 +298,12 @@ locked_file_set_remove (LockedFileSet *fset, const char *path, gboolean db_only)
         return -1;
     }
     sqlite3_finalize (stmt);
+    count_locked_files (mgr, fset->repo_id, -1);
     pthread_mutex_unlock (&mgr->priv->db_lock);
 
-    g_hash_table_remove (fset->locked_files, path);
+    /* The caller may be iterating over the set. */
+    if (!db_only)
+        g_hash_table_remove (fset->locked_files, path);
 
     return 0;
 }
@@ -616,6 +663,10 @@ seaf_repo_free (SeafRepo *repo)
     g_free (repo->relay_id);
     g_free (repo->email);
     g_free (repo->token);
+    if (repo->locked_retries)
+        g_hash_table_destroy (repo->locked_retries);
+    sync_paths_free (repo->sync_paths);
+    sync_paths_free (repo->synced_paths);
     g_free (repo);
 }
 
@@ -765,6 +816,54 @@ seaf_repo_unset_readonly (SeafRepo *repo)
     save_repo_property (repo->manager, repo->id, REPO_PROP_IS_READONLY, "false");
 }
 
+void
+seaf_repo_get_sync_paths (SeafRepo *repo, SyncPaths **wanted, SyncPaths **synced)
+{
+    pthread_mutex_lock (&repo->lock);
+    *wanted = sync_paths_dup (repo->sync_paths);
+    *synced = sync_paths_dup (repo->synced_paths);
+    pthread_mutex_unlock (&repo->lock);
+}
+
+SyncPaths *
+seaf_repo_get_active_sync_paths (SeafRepo *repo)
+{
+    SyncPaths *paths;
+
+    pthread_mutex_lock (&repo->lock);
+    paths = sync_paths_intersect (repo->sync_paths, repo->synced_paths);
+    pthread_mutex_unlock (&repo->lock);
+
+    return paths;
+}
+
+gboolean
+seaf_repo_sync_paths_pending (SeafRepo *repo)
+{
+    gboolean ret;
+
+    pthread_mutex_lock (&repo->lock);
+    ret = !sync_paths_equal (repo->sync_paths, repo->synced_paths);
+    pthread_mutex_unlock (&repo->lock);
+
+    return ret;
+}
+
+void
+seaf_repo_set_synced_paths (SeafRepo *repo, const SyncPaths *synced)
+{
+    char *value = sync_paths_to_string (synced);
+
+    pthread_mutex_lock (&repo->lock);
+    sync_paths_free (repo->synced_paths);
+    repo->synced_paths = sync_paths_dup (synced);
+    pthread_mutex_unlock (&repo->lock);
+
+    save_repo_property (repo->manager, repo->id, REPO_PROP_SYNCED_PATHS,
+                        value ? value : "");
+    g_free (value);
+}
+
 gboolean
 seaf_repo_manager_is_ignored_hidden_file (const char *filename)
 {
@@ -882,6 +981,50 @@ should_ignore(const char *basepath, const char *filename, void *data)
     return FALSE;
 }
 
+/*
+ * Chunk @path and return its id in @sha1. A large file whose previous
+ * version @prev_id is in the index is rechunked only around the changes,
+ * if it was last indexed with its blocks written.
+ */
+static int
+index_file (const char *repo_id,
+            int version,
+            const char *path,
+            const unsigned char *prev_id,
+            unsigned char sha1[],
+            SeafileCrypt *crypt,
+            gboolean write_data)
+{
+    gint64 size;
+    SeafStat st;
+    CDCChunkMap *prev_map = NULL, *new_map = NULL;
+    gboolean large;
+    int ret = 0;
+
+    large = (seaf_stat (path, &st) == 0 && st.st_size >= CHUNK_MAP_MIN_SIZE);
+    if (large && prev_id)
+        prev_map = chunk_map_load (repo_id, path, prev_id);
+
+    /* Check in blocks and get object ID. */
+    if (seaf_fs_manager_index_blocks_with_map (seaf->fs_mgr, repo_id, version,
+                                               path, sha1, &size, crypt,
+                                               write_data, prev_map,
+                                               (large && write_data) ?
+                                               &new_map : NULL) < 0) {
+        g_warning ("Failed to index file %s.\n", path);
+        ret = -1;
+        goto out;
+    }
+
+    if (new_map)
+        chunk_map_save (repo_id, path, sha1, new_map);
+
+out:
+    cdc_chunk_map_free (prev_map);
+    cdc_chunk_map_free (new_map);
+    return ret;
+}
+
 static int
 index_cb (const char *repo_id,
           int version,
@@ -890,15 +1033,7 @@ index_cb (const char *repo_id,
           SeafileCrypt *crypt,
           gboolean write_data)
 {
-    gint64 size;
-
-    /* Check in blocks and get object ID. */
-    if (seaf_fs_manager_index_blocks (seaf->fs_mgr, repo_id, version,
-                                      path, sha1, &size, crypt, write_data) < 0) {
-        g_warning ("Failed to index file %s.\n", path);
-        return -1;
-    }
-    return 0;
+    return index_file (repo_id, version, path, NULL, sha1, crypt, write_data);
 }
 
 #define MAX_COMMIT_SIZE 100 * (1 << 20) /* 100MB */
@@ -909,91 +1044,243 @@ typedef struct _AddOptions {
     GList *group_perms;
     gboolean is_repo_ro;
     gboolean startup_scan;
+    DirCache *dir_cache;        /* NULL if not a full scan */
+    gboolean hash_only;         /* only compute file ids, write no objects */
+    SyncPaths *sync_paths;      /* NULL if the whole repo is synced */
 } AddOptions;
 
+/* Changed files are chunked by this many threads at once. The resulting
+ * ids are then added to the index in the order the files were found, so
+ * the index doesn't depend on which thread finishes first.
+ */
+#define MAX_INDEX_THREADS 8
+#define INDEX_BATCH_FILES 256
+
+typedef struct AddItem {
+    char *path;
+    char *full_path;
+    SeafStat st;
+    gboolean empty_dir;
+    gboolean indexed;           /* file_id is set, or indexing failed */
+    gboolean failed;
+    unsigned char file_id[20];
+    gboolean has_prev_id;
+    unsigned char prev_id[20];  /* id of the file in the index */
+} AddItem;
+
+static void
+add_item_free (AddItem *item)
+{
+    g_free (item->path);
+    g_free (item->full_path);
+    g_free (item);
+}
+
+typedef struct IndexBatch {
+    const char *repo_id;
+    int version;
+    SeafileCrypt *crypt;
+    gboolean write_data;
+    AddItem **items;
+    int n_items;
+    int next;
+    pthread_mutex_t lock;
+} IndexBatch;
+
+static void *
+index_batch_worker (void *vdata)
+{
+    IndexBatch *batch = vdata;
+    AddItem *item;
+
+    while (1) {
+        pthread_mutex_lock (&batch->lock);
+        item = batch->next < batch->n_items ? batch->items[batch->next++] : NULL;
+        pthread_mutex_unlock (&batch->lock);
+        if (!item)
+            break;
+
+        if (index_file (batch->repo_id, batch->version, item->full_path,
+                        item->has_prev_id ? item->prev_id : NULL,
+                        item->file_id, batch->crypt, batch->write_data) < 0)
+            item->failed = TRUE;
+        item->indexed = TRUE;
+    }
+
+    return NULL;
+}
+
+/* Chunk @items on up to MAX_INDEX_THREADS threads. */
+static void
+index_items (const char *repo_id, int version, SeafileCrypt *crypt,
+             AddItem **items, int n_items, gboolean write_data)
+{
+    IndexBatch batch;
+    pthread_t threads[MAX_INDEX_THREADS];
+    int n_threads, n_started, i;
+
+    memset (&batch, 0, sizeof(batch));
+    batch.repo_id = repo_id;
+    batch.version = version;
+    batch.crypt = crypt;
+    batch.write_data = write_data;
+    batch.items = items;
+    batch.n_items = n_items;
+    pthread_mutex_init (&batch.lock, NULL);
+
+    /* Don't take all cores from the user. */
+    n_threads = MIN (get_cpu_count () - 1, MAX_INDEX_THREADS);
+    n_threads = MIN (n_threads, n_items);
+
+    /* The calling thread is one of the workers. */
+    n_started = 0;
+    for (i = 1; i < n_threads; ++i) {
+        if (pthread_create (&threads[n_started], NULL,
+                            index_batch_worker, &batch) != 0) {
+            seaf_warning ("Failed to start index thread.\n");
+            break;
+        }
+        ++n_started;
+    }
+
+    index_batch_worker (&batch);
+
+    for (i = 0; i < n_started; ++i)
+        pthread_join (threads[i], NULL);
+
+    pthread_mutex_destroy (&batch.lock);
+}
+
 #ifndef WIN32
 
+/* The cache of dir contents for full scans of @repo's worktree. */
+static DirCache *
+load_dir_cache (SeafRepo *repo, GList *ignore_list)
+{
+    GChecksum *checksum;
+    unsigned char sig[20];
+    gsize len = sizeof(sig);
+    GList *ptr;
+    char *path;
+    DirCache *cache;
+
+    /* The cached names are only valid for the same ignore rules. */
+    checksum = g_checksum_new (G_CHECKSUM_SHA1);
+    g_checksum_update (checksum, (guchar *)repo->worktree, -1);
+    g_checksum_update (checksum, (guchar *)(seaf->sync_extra_temp_file ? "\1" : "\2"), 1);
+    for (ptr = ignore_list; ptr; ptr = ptr->next) {
+        g_checksum_update (checksum, (guchar *)"\n", 1);
+        g_checksum_update (checksum, (guchar *)ptr->data, -1);
+    }
+    g_checksum_get_digest (checksum, sig, &len);
+    g_checksum_free (checksum);
+
+    path = g_strdup_printf ("%s/%s.dirs", seaf->repo_mgr->index_dir, repo->id);
+    cache = dir_cache_load (path, sig);
+    g_free (path);
+
+    return cache;
+}
+
+static void
+save_dir_cache (DirCache *cache)
+{
+    /* Dirs not seen in a full scan are gone. */
+    dir_cache_prune (cache);
+    dir_cache_save (cache);
+    dir_cache_free (cache);
+}
+
 /*
- * @remain_files: returns the files haven't been added under this path.
- *                If it's set to NULL, no partial commit will be created.
+ * Find the files and empty dirs to add under @path, in the order they're
+ * to be added. Nothing is added yet.
  */
-static int
-add_recursive (const char *repo_id,
-               int version,
-               const char *modifier,
-               struct index_state *istate, 
-               const char *worktree,
-               const char *path,
-               SeafileCrypt *crypt,
-               gboolean ignore_empty_dir,
-               GList *ignore_list,
-               gint64 *total_size,
-               GQueue **remain_files,
-               AddOptions *options)
+static void
+collect_add_items (const char *worktree,
+                   const char *path,
+                   gboolean ignore_empty_dir,
+                   GList *ignore_list,
+                   AddOptions *options,
+                   GPtrArray *items)
 {
     char *full_path;
     GDir *dir;
     const char *dname;
     char *subpath;
     SeafStat st;
+    AddItem *item;
+    GPtrArray *read_names;
+    char **names = NULL, **free_names = NULL;
     int n;
-    int ret = 0;
+    DiffPathState state = DIFF_PATH_INCLUDE;
 
     full_path = g_build_path (PATH_SEPERATOR, worktree, path, NULL);
     if (seaf_stat (full_path, &st) < 0) {
         /* Ignore broken symlinks on Linux and Mac OS X */
         if (lstat (full_path, &st) == 0 && S_ISLNK(st.st_mode)) {
             g_free (full_path);
-            return 0;
+            return;
         }
         g_warning ("Failed to stat %s.\n", full_path);
         g_free (full_path);
         /* Ignore error. */
-        return 0;
+        return;
     }
 
-    if (S_ISREG(st.st_mode)) {
-        gboolean added = FALSE;
+    /* Dirs leading to the synced sub-folders are only walked through. */
+    if (options && options->sync_paths && path[0] != 0) {
+        state = sync_paths_check (options->sync_paths, path, S_ISDIR(st.st_mode));
+        if (state == DIFF_PATH_SKIP) {
+            g_free (full_path);
+            return;
+        }
+    }
 
+    if (S_ISREG(st.st_mode)) {
         if (options &&
             !is_path_writable (options->user_perms, options->group_perms,
                                options->is_repo_ro, path)) {
             g_free (full_path);
-            return ret;
+            return;
         }
 
-        if (!remain_files) {
-            ret = add_to_index (repo_id, version, istate, path, full_path,
-                                &st, 0, crypt, index_cb, modifier, &added);
-        } else if (*remain_files == NULL) {
-            ret = add_to_index (repo_id, version, istate, path, full_path,
-                                &st, 0, crypt, index_cb, modifier, &added);
-            if (added) {
-                *total_size += (gint64)(st.st_size);
-                if (*total_size >= MAX_COMMIT_SIZE)
-                    *remain_files = g_queue_new ();
-            }
-        } else
-            g_queue_push_tail (*remain_files, g_strdup(path));
-
-        g_free (full_path);
-        return 0;
+        item = g_new0 (AddItem, 1);
+        item->path = g_strdup (path);
+        item->full_path = full_path;
+        item->st = st;
+        g_ptr_array_add (items, item);
+        return;
     }
 
     if (S_ISDIR(st.st_mode)) {
-        dir = g_dir_open (full_path, 0, NULL);
-        if (!dir) {
-            g_warning ("Failed to open dir %s: %s.\n", full_path, strerror(errno));
-            g_free (full_path);
-            return 0;
-        }
+        if (options && options->dir_cache)
+            names = dir_cache_lookup (options->dir_cache, path,
+                                      (gint64)st.st_mtime);
+
+        if (!names) {
+            dir = g_dir_open (full_path, 0, NULL);
+            if (!dir) {
+                g_warning ("Failed to open dir %s: %s.\n", full_path, strerror(errno));
+                g_free (full_path);
+                return;
+            }
 
-        n = 0;
-        while ((dname = g_dir_read_name(dir)) != NULL) {
-            if (should_ignore(full_path, dname, ignore_list))
-                continue;
+            read_names = g_ptr_array_new ();
+            while ((dname = g_dir_read_name(dir)) != NULL) {
+                if (!should_ignore(full_path, dname, ignore_list))
+                    g_ptr_array_add (read_names, g_strdup(dname));
+            }
+            g_dir_close (dir);
+            g_ptr_array_add (read_names, NULL);
 
-            ++n;
+            names = free_names = (char **)g_ptr_array_free (read_names, FALSE);
+            if (options && options->dir_cache)
+                dir_cache_set (options->dir_cache, path,
+                               (gint64)st.st_mtime, names);
+        }
+
+        for (n = 0; names[n] != NULL; ++n) {
+            dname = names[n];
 
 #ifdef __APPLE__
             char *norm_dname = g_utf8_normalize (dname, -1, G_NORMALIZE_NFC);
@@ -1003,27 +1290,137 @@ add_recursive (const char *repo_id,
             subpath = g_build_path (PATH_SEPERATOR, path, dname, NULL);
 #endif
 
-            ret = add_recursive (repo_id, version, modifier,
-                                 istate, worktree, subpath,
-                                 crypt, ignore_empty_dir, ignore_list,
-                                 total_size, remain_files, options);
+            collect_add_items (worktree, subpath, ignore_empty_dir,
+                               ignore_list, options, items);
             g_free (subpath);
         }
-        g_dir_close (dir);
+        g_strfreev (free_names);
 
         if (n == 0 && path[0] != 0 && !ignore_empty_dir &&
+            state == DIFF_PATH_INCLUDE &&
             (!options ||
              is_path_writable(options->user_perms, options->group_perms,
                               options->is_repo_ro, path)))
         {
-            if (!remain_files || *remain_files == NULL)
-                add_empty_dir_to_index (istate, path, &st);
-            else
-                g_queue_push_tail (*remain_files, g_strdup(path));
+            item = g_new0 (AddItem, 1);
+            item->path = g_strdup (path);
+            item->st = st;
+            item->empty_dir = TRUE;
+            g_ptr_array_add (items, item);
         }
     }
 
     g_free (full_path);
+}
+
+/*
+ * Chunk the changed files among @items[@start..], up to INDEX_BATCH_FILES
+ * of them and @max_bytes in total, at least one file.
+ */
+static void
+index_next_batch (const char *repo_id, int version, SeafileCrypt *crypt,
+                  struct index_state *istate, GPtrArray *items, guint start,
+                  gint64 max_bytes, gboolean write_data)
+{
+    GPtrArray *changed = g_ptr_array_new ();
+    gint64 bytes = 0;
+    AddItem *item;
+    struct cache_entry *ce;
+    guint j;
+
+    for (j = start; j < items->len && changed->len < INDEX_BATCH_FILES; ++j) {
+        item = g_ptr_array_index (items, j);
+        if (item->empty_dir || item->indexed ||
+            !index_file_changed (istate, item->path, &item->st))
+            continue;
+        if (changed->len > 0 && bytes + (gint64)item->st.st_size > max_bytes)
+            break;
+        bytes += (gint64)item->st.st_size;
+
+        /* The index isn't safe to read from the index threads. */
+        if (item->st.st_size >= CHUNK_MAP_MIN_SIZE) {
+            ce = index_name_exists (istate, item->path, strlen(item->path), 0);
+            if (ce && !ce_stage(ce)) {
+                memcpy (item->prev_id, ce->sha1, 20);
+                item->has_prev_id = TRUE;
+            }
+        }
+        g_ptr_array_add (changed, item);
+    }
+
+    if (changed->len > 0)
+        index_items (repo_id, version, crypt, (AddItem **)changed->pdata,
+                     changed->len, write_data);
+
+    g_ptr_array_free (changed, TRUE);
+}
+
+/*
+ * @remain_files: returns the files haven't been added under this path.
+ *                If it's set to NULL, no partial commit will be created.
+ */
+static int
+add_recursive (const char *repo_id,
+               int version,
+               const char *modifier,
+               struct index_state *istate, 
+               const char *worktree,
+               const char *path,
+               SeafileCrypt *crypt,
+               gboolean ignore_empty_dir,
+               GList *ignore_list,
+               gint64 *total_size,
+               GQueue **remain_files,
+               AddOptions *options)
+{
+    GPtrArray *items = g_ptr_array_new ();
+    AddItem *item;
+    gboolean added;
+    gint64 max_bytes;
+    guint i;
+
+    collect_add_items (worktree, path, ignore_empty_dir, ignore_list,
+                       options, items);
+
+    for (i = 0; i < items->len; ++i) {
+        item = g_ptr_array_index (items, i);
+
+        if (remain_files && *remain_files != NULL) {
+            g_queue_push_tail (*remain_files, g_strdup(item->path));
+            continue;
+        }
+
+        if (item->empty_dir) {
+            add_empty_dir_to_index (istate, item->path, &item->st);
+            continue;
+        }
+
+        if (!item->indexed && index_file_changed (istate, item->path, &item->st)) {
+            /* Don't chunk much more than fits in this commit. */
+            max_bytes = remain_files ? MAX_COMMIT_SIZE - *total_size : G_MAXINT64;
+            index_next_batch (repo_id, version, crypt, istate, items, i,
+                              max_bytes, !(options && options->hash_only));
+        }
+
+        if (item->failed)
+            continue;
+
+        added = FALSE;
+        add_to_index_with_id (repo_id, version, istate, item->path,
+                              item->full_path, &item->st, 0, crypt, index_cb,
+                              modifier, item->indexed ? item->file_id : NULL,
+                              &added);
+        if (remain_files && added) {
+            *total_size += (gint64)(item->st.st_size);
+            if (*total_size >= MAX_COMMIT_SIZE)
+                *remain_files = g_queue_new ();
+        }
+    }
+
+    for (i = 0; i < items->len; ++i)
+        add_item_free (g_ptr_array_index (items, i));
+    g_ptr_array_free (items, TRUE);
+
     return 0;
 }
 
@@ -1052,6 +1449,17 @@ is_empty_dir (const char *path, GList *ignore_list)
 
 #else
 
+static int
+hash_cb (const char *repo_id,
+         int version,
+         const char *path,
+         unsigned char sha1[],
+         SeafileCrypt *crypt,
+         gboolean write_data)
+{
+    return index_cb (repo_id, version, path, sha1, crypt, FALSE);
+}
+
 static int
 add_file (const char *repo_id,
           int version,
@@ -1068,6 +1476,7 @@ add_file (const char *repo_id,
     gboolean added = FALSE;
     int ret = 0;
     gboolean is_writable = TRUE;
+    IndexCB cb = index_cb;
 
     if (options)
         is_writable = is_path_writable(options->user_perms, options->group_perms,
@@ -1111,9 +1520,12 @@ add_file (const char *repo_id,
         }
     }
 
+    if (options && options->hash_only)
+        cb = hash_cb;
+
     if (!remain_files) {
         ret = add_to_index (repo_id, version, istate, path, full_path,
-                            st, 0, crypt, index_cb, modifier, &added);
+                            st, 0, crypt, cb, modifier, &added);
         if (!added) {
             /* If the contents of the file doesn't change, move it to
                synced status.
@@ -1126,7 +1538,7 @@ add_file (const char *repo_id,
         }
     } else if (*remain_files == NULL) {
         ret = add_to_index (repo_id, version, istate, path, full_path,
-                            st, 0, crypt, index_cb, modifier, &added);
+                            st, 0, crypt, cb, modifier, &added);
         if (added) {
             *total_size += (gint64)(st->st_size);
             if (*total_size >= MAX_COMMIT_SIZE)
@@ -1479,6 +1891,10 @@ remove_deleted (struct index_state *istate, const char *worktree, const char *pr
             strncmp (ce->name, full_prefix, len) != 0)
             continue;
 
+        /* Preloaded entries are known to exist as regular files. */
+        if (ce_uptodate (ce) && S_ISREG (ce->ce_mode))
+            continue;
+
         snprintf (path, SEAF_PATH_MAX, "%s/%s", worktree, ce->name);
         ret = seaf_stat (path, &st);
 
@@ -1510,6 +1926,8 @@ scan_worktree_for_changes (struct index_state *istate, SeafRepo *repo,
                            LockedFileSet *fset,
                            GList *user_perms, GList *group_perms)
 {
+    int ret;
+
     remove_deleted (istate, repo->worktree, "", ignore_list, fset,
                     user_perms, group_perms, repo->is_readonly);
 
@@ -1519,13 +1937,21 @@ scan_worktree_for_changes (struct index_state *istate, SeafRepo *repo,
     options.user_perms = user_perms;
     options.group_perms = group_perms;
     options.is_repo_ro = repo->is_readonly;
+    options.sync_paths = seaf_repo_get_active_sync_paths (repo);
+#ifndef WIN32
+    options.dir_cache = load_dir_cache (repo, ignore_list);
+#endif
 
-    if (add_recursive (repo->id, repo->version, repo->email,
-                       istate, repo->worktree, "", crypt, FALSE, ignore_list,
-                       NULL, NULL, &options) < 0)
-        return -1;
+    ret = add_recursive (repo->id, repo->version, repo->email,
+                         istate, repo->worktree, "", crypt, FALSE, ignore_list,
+                         NULL, NULL, &options);
 
-    return 0;
+#ifndef WIN32
+    save_dir_cache (options.dir_cache);
+#endif
+    sync_paths_free (options.sync_paths);
+
+    return ret;
 }
 
 static gboolean
@@ -1580,8 +2006,11 @@ add_path_to_index (SeafRepo *repo, struct index_state *istate,
         options.user_perms = user_perms;
         options.group_perms = group_perms;
         options.is_repo_ro = repo->is_readonly;
+        options.sync_paths = seaf_repo_get_active_sync_paths (repo);
 #ifdef WIN32
         options.startup_scan = TRUE;
+#else
+        options.dir_cache = load_dir_cache (repo, ignore_list);
 #endif
 
         add_recursive (repo->id, repo->version, repo->email, istate,
@@ -1589,6 +2018,11 @@ add_path_to_index (SeafRepo *repo, struct index_state *istate,
                        crypt, FALSE, ignore_list,
                        total_size, remain_files, &options);
 
+#ifndef WIN32
+        save_dir_cache (options.dir_cache);
+#endif
+        sync_paths_free (options.sync_paths);
+
         return 0;
     }
 
@@ -1634,11 +2068,13 @@ add_path_to_index (SeafRepo *repo, struct index_state *istate,
     options.user_perms = user_perms;
     options.group_perms = group_perms;
     options.is_repo_ro = repo->is_readonly;
+    options.sync_paths = seaf_repo_get_active_sync_paths (repo);
 
     /* Add is always recursive */
     add_recursive (repo->id, repo->version, repo->email, istate, repo->worktree, path,
                    crypt, FALSE, ignore_list, total_size, remain_files, &options);
 
+    sync_paths_free (options.sync_paths);
     g_free (full_path);
     return 0;
 }
@@ -1697,11 +2133,18 @@ add_path_to_index (SeafRepo *repo, struct index_state *istate,
     options.user_perms = user_perms;
     options.group_perms = group_perms;
     options.is_repo_ro = repo->is_readonly;
+    options.sync_paths = seaf_repo_get_active_sync_paths (repo);
+    if (path[0] == 0)
+        options.dir_cache = load_dir_cache (repo, ignore_list);
 
     /* Add is always recursive */
     add_recursive (repo->id, repo->version, repo->email, istate, repo->worktree, path,
                    crypt, FALSE, ignore_list, total_size, remain_files, &options);
 
+    if (options.dir_cache)
+        save_dir_cache (options.dir_cache);
+    sync_paths_free (options.sync_paths);
+
     return 0;
 }
 
@@ -2013,9 +2456,7 @@ handle_add_files (SeafRepo *repo, struct index_state *istate,
                 /* Cache remaining files in the event structure. */
                 event->remain_files = remain_files;
 
-                pthread_mutex_lock (&status->q_lock);
-                g_queue_push_head (status->event_q, event);
-                pthread_mutex_unlock (&status->q_lock);
+                wt_status_push_event_head (status, event);
             }
 
             return TRUE;
@@ -2026,9 +2467,7 @@ handle_add_files (SeafRepo *repo, struct index_state *istate,
         add_remain_files (repo, istate, crypt, event->remain_files,
                           ignore_list, total_size);
         if (g_queue_get_length (event->remain_files) != 0) {
-            pthread_mutex_lock (&status->q_lock);
-            g_queue_push_head (status->event_q, event);
-            pthread_mutex_unlock (&status->q_lock);
+            wt_status_push_event_head (status, event);
             return TRUE;
         }
         if (*total_size >= MAX_COMMIT_SIZE)
@@ -2287,6 +2726,39 @@ update_path_sync_status (SeafRepo *repo, WTStatus *status,
     }
 }
 
+/*
+ * Fit @event to the synced sub-folders. Returns FALSE if it only touches
+ * paths outside of them. A rename across their border becomes a delete
+ * or an update.
+ */
+static gboolean
+fit_event_to_sync_paths (SyncPaths *paths, WTEvent *event)
+{
+    gboolean old_in, new_in;
+
+    if (!paths || !event->path || event->path[0] == 0)
+        return TRUE;
+
+    /* Files or dirs, paths leading to the folders are walked through. */
+    old_in = (sync_paths_check (paths, event->path, TRUE) != DIFF_PATH_SKIP);
+    if (event->ev_type != WT_EVENT_RENAME)
+        return old_in;
+
+    new_in = (sync_paths_check (paths, event->new_path, TRUE) != DIFF_PATH_SKIP);
+    if (old_in && !new_in) {
+        event->ev_type = WT_EVENT_DELETE;
+        g_free (event->new_path);
+        event->new_path = NULL;
+    } else if (!old_in && new_in) {
+        event->ev_type = WT_EVENT_CREATE_OR_UPDATE;
+        g_free (event->path);
+        event->path = event->new_path;
+        event->new_path = NULL;
+    }
+
+    return (old_in || new_in);
+}
+
 static int
 apply_worktree_changes_to_index (SeafRepo *repo, struct index_state *istate,
                                  SeafileCrypt *crypt, GList *ignore_list,
@@ -2294,8 +2766,10 @@ apply_worktree_changes_to_index (SeafRepo *repo, struct index_state *istate,
                                  GList *user_perms, GList *group_perms)
 {
     WTStatus *status;
-    WTEvent *event, *next_event;
+    WTEvent *event;
+    guint64 last_seq, seq;
     gboolean not_found;
+    SyncPaths *sync_paths;
 
     status = seaf_wt_monitor_get_worktree_status (seaf->wt_monitor, repo->id);
     if (!status) {
@@ -2304,6 +2778,8 @@ apply_worktree_changes_to_index (SeafRepo *repo, struct index_state *istate,
         return -1;
     }
 
+    sync_paths = seaf_repo_get_active_sync_paths (repo);
+
 #ifdef WIN32
     update_path_sync_status (repo, status, istate, ignore_list,
                              user_perms, group_perms);
@@ -2311,13 +2787,13 @@ apply_worktree_changes_to_index (SeafRepo *repo, struct index_state *istate,
 
     GList *scanned_dirs = NULL, *scanned_del_dirs = NULL;
 
-    WTEvent *last_event;
-
-    pthread_mutex_lock (&status->q_lock);
-    last_event = g_queue_peek_tail (status->event_q);
-    pthread_mutex_unlock (&status->q_lock);
+    /* Events added while we're processing are left for the next commit.
+     * Events merged into later ones get a new seq, so this still
+     * works if the last event is merged away.
+     */
+    last_seq = wt_status_last_event_seq (status);
 
-    if (!last_event) {
+    if (last_seq == 0) {
         seaf_message ("All events are processed for repo %s.\n", repo->id);
         status->partial_commit = FALSE;
         goto out;
@@ -2326,22 +2802,21 @@ apply_worktree_changes_to_index (SeafRepo *repo, struct index_state *istate,
     gint64 total_size = 0;
 
     while (1) {
-        pthread_mutex_lock (&status->q_lock);
-        event = g_queue_pop_head (status->event_q);
-        next_event = g_queue_peek_head (status->event_q);
-        pthread_mutex_unlock (&status->q_lock);
+        event = wt_status_pop_event (status);
         if (!event)
             break;
+        seq = event->seq;
+
+        if (!fit_event_to_sync_paths (sync_paths, event)) {
+            seaf_debug ("%s is not in the synced folders, ignore.\n", event->path);
+            goto next;
+        }
 
         switch (event->ev_type) {
         case WT_EVENT_CREATE_OR_UPDATE:
-            /* If consecutive CREATE_OR_UPDATE events present
-               in the event queue, only process the last one.
-            */
-            if (next_event &&
-                next_event->ev_type == event->ev_type &&
-                strcmp (next_event->path, event->path) == 0)
-                break;
+            /* Repeated events on the same path were already merged
+             * when they were queued.
+             */
 
             /* CREATE_OR_UPDATE event tells us the exact path of changed file/dir.
              * If the event path is not writable, we don't need to check the paths
@@ -2442,6 +2917,7 @@ apply_worktree_changes_to_index (SeafRepo *repo, struct index_state *istate,
             memset (&options, 0, sizeof(options));
             options.fset = fset;
             options.is_repo_ro = repo->is_readonly;
+            options.sync_paths = sync_paths;
 
             /* We should always scan the destination to compare with the renamed
              * index entries. For example, in the following case:
@@ -2472,19 +2948,20 @@ apply_worktree_changes_to_index (SeafRepo *repo, struct index_state *istate,
             break;
         }
 
-        if (event == last_event) {
-            wt_event_free (event);
+    next:
+        wt_event_free (event);
+        if (seq >= last_seq) {
             seaf_message ("All events are processed for repo %s.\n", repo->id);
             status->partial_commit = FALSE;
             break;
-        } else
-            wt_event_free (event);
+        }
     }
 
 out:
     wt_status_unref (status);
     string_list_free (scanned_dirs);
     string_list_free (scanned_del_dirs);
+    sync_paths_free (sync_paths);
 
     return 0;
 }
@@ -2558,6 +3035,31 @@ retry:
     string_list_free (unmerged_paths);
 }
 
+/*
+ * Drop the entries of the sub-folders that are not synced any more. Their
+ * files stay in the worktree, but are no longer tracked.
+ */
+static void
+remove_unsynced_entries (struct index_state *istate, const SyncPaths *sync_paths)
+{
+    struct cache_entry *ce;
+    gboolean removed = FALSE;
+    int i;
+
+    if (!sync_paths)
+        return;
+
+    for (i = 0; i < istate->cache_nr; ++i) {
+        ce = istate->cache[i];
+        if (!sync_paths_covers (sync_paths, ce->name)) {
+            ce->ce_flags |= CE_REMOVE;
+            removed = TRUE;
+        }
+    }
+    if (removed)
+        remove_marked_cache_entries (istate);
+}
+
 static int
 index_add (SeafRepo *repo, struct index_state *istate,
            gboolean is_force_commit, gboolean handle_unmerged)
@@ -2593,10 +3095,15 @@ index_add (SeafRepo *repo, struct index_state *istate,
             seaf_warning ("Failed to apply worktree changes to index.\n");
             ret = -1;
         }
-    } else if (scan_worktree_for_changes (istate, repo, crypt, ignore_list, fset,
-                                          user_perms, group_perms) < 0) {
-        seaf_warning ("Failed to scan worktree for changes.\n");
-        ret = -1;
+    } else {
+        /* A full scan stats every entry. */
+        preload_index (istate, repo->worktree);
+
+        if (scan_worktree_for_changes (istate, repo, crypt, ignore_list, fset,
+                                       user_perms, group_perms) < 0) {
+            seaf_warning ("Failed to scan worktree for changes.\n");
+            ret = -1;
+        }
     }
 
     /* If the index contains unmerged entries, check and remove those entries
@@ -2606,6 +3113,10 @@ index_add (SeafRepo *repo, struct index_state *istate,
     if (handle_unmerged)
         handle_unmerged_index_entries (repo, istate, crypt, ignore_list);
 
+    SyncPaths *sync_paths = seaf_repo_get_active_sync_paths (repo);
+    remove_unsynced_entries (istate, sync_paths);
+    sync_paths_free (sync_paths);
+
     seaf_repo_free_ignore_files (ignore_list);
 
 #ifdef WIN32
@@ -2636,6 +3147,7 @@ seaf_repo_index_worktree_files (const char *repo_id,
                                 const char *passwd,
                                 int enc_version,
                                 const char *random_key,
+                                gboolean hash_only,
                                 char *root_id)
 {
     char index_path[SEAF_PATH_MAX];
@@ -2644,8 +3156,11 @@ seaf_repo_index_worktree_files (const char *repo_id,
     SeafileCrypt *crypt = NULL;
     struct cache_tree *it = NULL;
     GList *ignore_list = NULL;
+    AddOptions options;
 
     memset (&istate, 0, sizeof(istate));
+    memset (&options, 0, sizeof(options));
+    options.hash_only = hash_only;
     snprintf (index_path, SEAF_PATH_MAX, "%s/%s", seaf->repo_mgr->index_dir, repo_id);
 
     /* Remove existing index. An existing index signifies an interrupted
@@ -2675,18 +3190,20 @@ seaf_repo_index_worktree_files (const char *repo_id,
      */
     if (add_recursive (repo_id, repo_version, modifier,
                        &istate, worktree, "", crypt, FALSE, ignore_list,
-                       NULL, NULL, NULL) < 0)
+                       NULL, NULL, &options) < 0)
         goto error;
 
     remove_deleted (&istate, worktree, "", ignore_list, NULL, NULL, NULL, FALSE);
 
     it = cache_tree ();
+    cache_tree_prime (it, &istate, repo_version);
     if (cache_tree_update (repo_id, repo_version, worktree,
                            it, istate.cache, istate.cache_nr,
                            0, 0, commit_trees_cb) < 0) {
         g_warning ("Failed to build cache tree");
         goto error;
     }
+    cache_tree_record_ids (it, &istate);
 
     rawdata_to_hex (it->sha1, root_id, 20);
 
@@ -2735,6 +3252,8 @@ seaf_repo_is_worktree_changed (SeafRepo *repo)
     }
     repo->index_corrupted = FALSE;
 
+    preload_index (&istate, repo->worktree);
+
     wt_status_collect_changes_worktree (&istate, &res, repo->worktree);
     if (res != NULL)
         goto changed;
@@ -2858,14 +3377,11 @@ seaf_repo_is_index_unmerged (SeafRepo *repo)
 }
 
 static int
-commit_tree (SeafRepo *repo, struct cache_tree *it,
+commit_tree (SeafRepo *repo, const char *root_id,
              const char *desc, char commit_id[],
              gboolean unmerged)
 {
     SeafCommit *commit;
-    char root_id[41];
-
-    rawdata_to_hex (it->sha1, root_id, 20);
 
     commit = seaf_commit_new (NULL, repo->id, root_id,
                               repo->email ? repo->email
@@ -2937,12 +3453,63 @@ print_index (struct index_state *istate)
         rawdata_to_hex (ce->sha1, id, 20);
         seaf_message ("%s, %s, %o, %"G_GINT64_FORMAT", %s, %"G_GINT64_FORMAT", %d\n",
                       ce->name, id, ce->ce_mode, 
-                      ce->ce_mtime.sec, ce->modifier, ce->ce_size, ce_stage(ce));
+                      ce->ce_mtime.sec, ce_modifier(ce), ce->ce_size, ce_stage(ce));
     }
 
     return 0;
 }
 
+/* The worktree events taken by index_add() won't be lost any more. */
+static void
+mark_worktree_events_saved (SeafRepo *repo)
+{
+    WTStatus *status;
+
+    status = seaf_wt_monitor_get_worktree_status (seaf->wt_monitor, repo->id);
+    if (status) {
+        wt_status_mark_saved (status);
+        wt_status_unref (status);
+    }
+}
+
+/*
+ * With some sub-folders synced, the tree built from the index only has
+ * those. Put it over the head commit's tree in @root_id.
+ */
+static int
+graft_unsynced_paths (SeafRepo *repo, char *root_id)
+{
+    SyncPaths *sync_paths;
+    SeafCommit *head;
+    char new_root[41];
+    int ret = 0;
+
+    sync_paths = seaf_repo_get_active_sync_paths (repo);
+    if (!sync_paths || !repo->head)
+        goto out;
+
+    head = seaf_commit_manager_get_commit (seaf->commit_mgr, repo->id,
+                                           repo->version, repo->head->commit_id);
+    if (!head) {
+        seaf_warning ("Failed to get head commit of repo %.8s.\n", repo->id);
+        ret = -1;
+        goto out;
+    }
+
+    if (sync_paths_graft_tree (sync_paths, repo->id, repo->version,
+                               root_id, head->root_id, new_root) < 0) {
+        seaf_warning ("Failed to graft synced folders of repo %.8s.\n", repo->id);
+        ret = -1;
+    } else {
+        memcpy (root_id, new_root, 41);
+    }
+    seaf_commit_unref (head);
+
+out:
+    sync_paths_free (sync_paths);
+    return ret;
+}
+
 char *
 seaf_repo_index_commit (SeafRepo *repo, const char *desc, gboolean is_force_commit,
                         GError **error)
@@ -2952,6 +3519,7 @@ seaf_repo_index_commit (SeafRepo *repo, const char *desc, gboolean is_force_comm
     struct cache_tree *it;
     char index_path[SEAF_PATH_MAX];
     char commit_id[41];
+    char root_id[41];
     gboolean unmerged = FALSE;
 
     if (!check_worktree_common (repo))
@@ -2983,7 +3551,8 @@ seaf_repo_index_commit (SeafRepo *repo, const char *desc, gboolean is_force_comm
             g_free (my_desc);
 
             /* Still need to update index even nothing to commit. */
-            update_index (&istate, index_path);
+            if (update_index (&istate, index_path) == 0)
+                mark_worktree_events_saved (repo);
             discard_index (&istate);
 
             return NULL;
@@ -2992,18 +3561,41 @@ seaf_repo_index_commit (SeafRepo *repo, const char *desc, gboolean is_force_comm
         my_desc = gen_desc;
     }
 
+    /* Dir objects are synced together, before the commit refers to them. */
+    seaf_obj_store_begin_batch (seaf->fs_mgr->obj_store);
+
+    /* Only the dirs with changed entries are built and saved again. */
     it = cache_tree ();
+    cache_tree_prime (it, &istate, repo->version);
     if (cache_tree_update (repo->id, repo->version,
                            repo->worktree,
                            it, istate.cache,
                            istate.cache_nr, 0, 0, commit_trees_cb) < 0) {
         g_warning ("Failed to build cache tree");
         g_set_error (error, SEAFILE_DOMAIN, SEAF_ERR_INTERNAL, "Internal data structure error");
+        seaf_obj_store_end_batch (seaf->fs_mgr->obj_store);
         cache_tree_free (&it);
         goto error;
     }
+    cache_tree_record_ids (it, &istate);
 
-    if (commit_tree (repo, it, my_desc, commit_id, unmerged) < 0) {
+    /* The sub-folders not synced are taken from the head commit. */
+    rawdata_to_hex (it->sha1, root_id, 20);
+    if (graft_unsynced_paths (repo, root_id) < 0) {
+        g_set_error (error, SEAFILE_DOMAIN, SEAF_ERR_INTERNAL, "Internal error");
+        seaf_obj_store_end_batch (seaf->fs_mgr->obj_store);
+        cache_tree_free (&it);
+        goto error;
+    }
+
+    if (seaf_obj_store_end_batch (seaf->fs_mgr->obj_store) < 0) {
+        g_warning ("Failed to sync dir objects.\n");
+        g_set_error (error, SEAFILE_DOMAIN, SEAF_ERR_INTERNAL, "Internal error");
+        cache_tree_free (&it);
+        goto error;
+    }
+
+    if (commit_tree (repo, root_id, my_desc, commit_id, unmerged) < 0) {
         g_warning ("Failed to save commit file");
         g_set_error (error, SEAFILE_DOMAIN, SEAF_ERR_INTERNAL, "Internal error");
         cache_tree_free (&it);
@@ -3014,6 +3606,7 @@ seaf_repo_index_commit (SeafRepo *repo, const char *desc, gboolean is_force_comm
 
     if (update_index (&istate, index_path) < 0)
         goto error;
+    mark_worktree_events_saved (repo);
 
     discard_index (&istate);
 
@@ -3298,23 +3891,59 @@ error:
     return -1;
 }
 
-int
-checkout_file (const char *repo_id,
-               int repo_version,
-               const char *worktree,
-               const char *name,
-               const char *file_id,
-               gint64 mtime,
-               unsigned int mode,
-               SeafileCrypt *crypt,
-               struct cache_entry *ce,
-               TransferTask *task,
-               HttpTxTask *http_task,
-               gboolean is_http,
-               const char *conflict_head_id,
-               GHashTable *conflict_hash,
-               GHashTable *no_conflict_hash,
-               gboolean download_only)
+/*
+ * The part of checking out a file that only touches the file itself, so
+ * that several files can be written at once. Set up by
+ * prepare_checkout_file().
+ */
+typedef struct CheckoutWrite {
+    const char *repo_id;
+    int repo_version;
+    char file_id[41];
+    const char *name;
+    char *path;                 /* NULL if there is nothing to write */
+    unsigned int mode;
+    gint64 mtime;
+    SeafileCrypt *crypt;
+    const char *conflict_head_id;
+    const char *email;
+    gboolean force_conflict;
+    gboolean case_conflict;
+
+    /* Results */
+    int rc;
+    gboolean conflicted;
+} CheckoutWrite;
+
+static int finish_checkout_file (CheckoutWrite *w, struct cache_entry *ce);
+
+/*
+ * Everything up to writing the file: compare with the worktree, make the
+ * leading dirs and download the blocks. Returns the result if there's
+ * nothing left to write, otherwise sets @w->path for write_checkout_file().
+ *
+ * If @local_copy is set, it's a file in the worktree with the same content.
+ * The file is then copied from it here instead of downloaded.
+ */
+static int
+prepare_checkout_file (const char *repo_id,
+                       int repo_version,
+                       const char *worktree,
+                       const char *name,
+                       const char *file_id,
+                       gint64 mtime,
+                       unsigned int mode,
+                       SeafileCrypt *crypt,
+                       struct cache_entry *ce,
+                       TransferTask *task,
+                       HttpTxTask *http_task,
+                       gboolean is_http,
+                       const char *conflict_head_id,
+                       GHashTable *conflict_hash,
+                       GHashTable *no_conflict_hash,
+                       gboolean download_only,
+                       const char *local_copy,
+                       CheckoutWrite *w)
 {
     char *path;
     SeafStat st, st2;
@@ -3324,6 +3953,8 @@ checkout_file (const char *repo_id,
     gboolean force_conflict = FALSE;
     gboolean update_mode_only = FALSE;
 
+    memset (w, 0, sizeof(*w));
+
 #ifndef __linux__
     path = build_case_conflict_free_path (worktree, name,
                                           conflict_hash, no_conflict_hash,
@@ -3382,6 +4013,38 @@ checkout_file (const char *repo_id,
 #endif
     }
 
+    w->repo_id = repo_id;
+    w->repo_version = repo_version;
+    memcpy (w->file_id, file_id, 41);
+    w->name = name;
+    w->mode = mode;
+    w->mtime = mtime;
+    w->crypt = crypt;
+    w->conflict_head_id = conflict_head_id;
+    w->email = is_http ? http_task->email : task->email;
+    w->case_conflict = case_conflict;
+
+    if (local_copy && !download_only && !force_conflict) {
+        if (seaf_fs_manager_checkout_file_from_local (seaf->fs_mgr,
+                                                      repo_id,
+                                                      repo_version,
+                                                      local_copy,
+                                                      path,
+                                                      mode,
+                                                      mtime,
+                                                      name,
+                                                      conflict_head_id,
+                                                      FALSE,
+                                                      &w->conflicted,
+                                                      w->email) == 0) {
+            seaf_debug ("Copied %s from %s.\n", path, local_copy);
+            w->path = path;
+            w->rc = FETCH_CHECKOUT_SUCCESS;
+            return finish_checkout_file (w, ce);
+        }
+        /* Get it from the server instead. */
+    }
+
     /* Download the blocks of this file. */
     int rc;
     if (!is_http) {
@@ -3427,47 +4090,12 @@ checkout_file (const char *repo_id,
         }
     }
 
-    /* then checkout the file. */
-    gboolean conflicted = FALSE;
-    if (seaf_fs_manager_checkout_file (seaf->fs_mgr,
-                                       repo_id,
-                                       repo_version,
-                                       file_id,
-                                       path,
-                                       mode,
-                                       mtime,
-                                       crypt,
-                                       name,
-                                       conflict_head_id,
-                                       force_conflict,
-                                       &conflicted,
-                                       is_http ? http_task->email : task->email) < 0) {
-        seaf_warning ("Failed to checkout file %s.\n", path);
-        g_free (path);
-        return FETCH_CHECKOUT_FAILED;
-    }
-
-    /* If case conflict, this file has been checked out to another path.
-     * Remove the current entry, otherwise it won't be removed later
-     * since it's timestamp is 0.
-     */
-    if (case_conflict) {
-        ce->ce_flags |= CE_REMOVE;
-        g_free (path);
-        return FETCH_CHECKOUT_SUCCESS;
-    }
-
-    if (conflicted) {
-        g_free (path);
-        return FETCH_CHECKOUT_SUCCESS;
-    }
+    w->path = path;
+    w->force_conflict = force_conflict;
+    return FETCH_CHECKOUT_SUCCESS;
 
 update_cache:
     /* finally fill cache_entry info */
-    /* Only update index if we checked out the file without any error
-     * or conflicts. The timestamp of the entry will remain 0 if error
-     * or conflicted.
-     */
     seaf_stat (path, &st);
     fill_stat_cache_info (ce, &st);
 
@@ -3475,6 +4103,93 @@ update_cache:
     return FETCH_CHECKOUT_SUCCESS;
 }
 
+/* Safe to run on any thread, for different files at once. */
+static void
+write_checkout_file (CheckoutWrite *w)
+{
+    w->conflicted = FALSE;
+    if (seaf_fs_manager_checkout_file (seaf->fs_mgr,
+                                       w->repo_id,
+                                       w->repo_version,
+                                       w->file_id,
+                                       w->path,
+                                       w->mode,
+                                       w->mtime,
+                                       w->crypt,
+                                       w->name,
+                                       w->conflict_head_id,
+                                       w->force_conflict,
+                                       &w->conflicted,
+                                       w->email) < 0) {
+        seaf_warning ("Failed to checkout file %s.\n", w->path);
+        w->rc = FETCH_CHECKOUT_FAILED;
+        return;
+    }
+    w->rc = FETCH_CHECKOUT_SUCCESS;
+}
+
+/* Update @ce after write_checkout_file() and free @w->path. */
+static int
+finish_checkout_file (CheckoutWrite *w, struct cache_entry *ce)
+{
+    SeafStat st;
+    int rc = w->rc;
+
+    if (rc == FETCH_CHECKOUT_SUCCESS) {
+        /* If case conflict, this file has been checked out to another path.
+         * Remove the current entry, otherwise it won't be removed later
+         * since it's timestamp is 0.
+         */
+        if (w->case_conflict) {
+            ce->ce_flags |= CE_REMOVE;
+        } else if (!w->conflicted) {
+            /* Only update index if we checked out the file without any error
+             * or conflicts. The timestamp of the entry will remain 0 if error
+             * or conflicted.
+             */
+            seaf_stat (w->path, &st);
+            fill_stat_cache_info (ce, &st);
+        }
+    }
+
+    g_free (w->path);
+    w->path = NULL;
+    return rc;
+}
+
+int
+checkout_file (const char *repo_id,
+               int repo_version,
+               const char *worktree,
+               const char *name,
+               const char *file_id,
+               gint64 mtime,
+               unsigned int mode,
+               SeafileCrypt *crypt,
+               struct cache_entry *ce,
+               TransferTask *task,
+               HttpTxTask *http_task,
+               gboolean is_http,
+               const char *conflict_head_id,
+               GHashTable *conflict_hash,
+               GHashTable *no_conflict_hash,
+               gboolean download_only)
+{
+    CheckoutWrite w;
+    int rc;
+
+    rc = prepare_checkout_file (repo_id, repo_version, worktree, name,
+                                file_id, mtime, mode, crypt, ce,
+                                task, http_task, is_http, conflict_head_id,
+                                conflict_hash, no_conflict_hash,
+                                download_only, NULL, &w);
+    if (!w.path)
+        return rc;
+
+    write_checkout_file (&w);
+    return finish_checkout_file (&w, ce);
+}
+
 int
 checkout_empty_dir (const char *worktree,
                     const char *name,
@@ -3547,8 +4262,10 @@ cache_entry_from_diff_entry (DiffEntry *de)
     return ce;
 }
 
+/* Blocks in @busy are still needed by files being written. */
 static void
-cleanup_file_blocks (const char *repo_id, int version, const char *file_id)
+cleanup_file_blocks (const char *repo_id, int version, const char *file_id,
+                     GHashTable *busy)
 {
     Seafile *file;
     int i;
@@ -3556,10 +4273,13 @@ cleanup_file_blocks (const char *repo_id, int version, const char *file_id)
     file = seaf_fs_manager_get_seafile (seaf->fs_mgr,
                                         repo_id, version,
                                         file_id);
-    for (i = 0; i < file->n_blocks; ++i)
+    for (i = 0; i < file->n_blocks; ++i) {
+        if (busy && g_hash_table_lookup (busy, file->blk_sha1s[i]))
+            continue;
         seaf_block_manager_remove_block (seaf->block_mgr,
                                          repo_id, version,
                                          file->blk_sha1s[i]);
+    }
 
     seafile_unref (file);
 }
@@ -3833,6 +4553,494 @@ update_sync_status (struct cache_entry *ce, void *user_data)
 
 #define UPDATE_CACHE_SIZE_LIMIT 100 * (1 << 20) /* 100MB */
 
+/*
+ * Files are prepared on the checkout thread in plan order: dirs are made
+ * and blocks fetched there. Only writing the files out, which reads and
+ * decrypts the blocks, is spread over the pool. The index is only
+ * updated on the checkout thread, as files finish.
+ */
+#define DEFAULT_CHECKOUT_THREADS 4
+#define MAX_CHECKOUT_THREADS 16
+
+typedef struct CheckoutItem {
+    DiffEntry *de;
+    struct cache_entry *ce;
+    gboolean add_ce;
+    gboolean checked_out;       /* not ignored */
+    gboolean is_locked;
+    char file_id[41];
+    int rc;
+    CheckoutWrite w;
+    char **blocks;              /* kept from cleanup while it's written */
+    int n_blocks;
+} CheckoutItem;
+
+typedef struct CheckoutPool {
+    pthread_t threads[MAX_CHECKOUT_THREADS];
+    int n_threads;
+    GAsyncQueue *todo;
+    GAsyncQueue *done;
+    int n_pending;
+    GHashTable *busy_blocks;    /* block id -> number of files using it */
+} CheckoutPool;
+
+typedef struct CheckoutCtx {
+    const char *repo_id;
+    int repo_version;
+    gboolean is_clone;
+    gboolean is_http;
+    TransferTask *task;
+    HttpTxTask *http_task;
+    struct index_state *istate;
+    const char *index_path;
+    LockedFileSet *fset;
+    const char *worktree;
+    CheckoutPool *pool;
+    GHashTable *in_flight;      /* names of the files in the pool */
+    GHashTable *local_files;    /* file id -> name of a checked out copy */
+    gint64 done_bytes;
+    gint64 checkout_size;
+} CheckoutCtx;
+
+static void *
+checkout_thread (void *vdata)
+{
+    CheckoutPool *pool = vdata;
+    CheckoutItem *item;
+
+    while (1) {
+        item = g_async_queue_pop (pool->todo);
+        /* The pool itself is the signal to stop. */
+        if ((void *)item == (void *)pool)
+            break;
+        write_checkout_file (&item->w);
+        g_async_queue_push (pool->done, item);
+    }
+
+    return NULL;
+}
+
+static CheckoutPool *
+checkout_pool_new (int n_threads)
+{
+    CheckoutPool *pool = g_new0 (CheckoutPool, 1);
+    int i;
+
+    pool->todo = g_async_queue_new ();
+    pool->done = g_async_queue_new ();
+    pool->busy_blocks = g_hash_table_new_full (g_str_hash, g_str_equal,
+                                               g_free, NULL);
+
+    for (i = 0; i < n_threads; ++i) {
+        if (pthread_create (&pool->threads[pool->n_threads], NULL,
+                            checkout_thread, pool) != 0) {
+            seaf_warning ("Failed to start checkout thread.\n");
+            break;
+        }
+        ++pool->n_threads;
+    }
+
+    if (pool->n_threads == 0) {
+        g_async_queue_unref (pool->todo);
+        g_async_queue_unref (pool->done);
+        g_hash_table_destroy (pool->busy_blocks);
+        g_free (pool);
+        return NULL;
+    }
+
+    return pool;
+}
+
+static void
+checkout_pool_push (CheckoutPool *pool, CheckoutCtx *ctx, CheckoutItem *item)
+{
+    int i, n;
+
+    item->blocks = seaf_fs_manager_get_file_block_ids (seaf->fs_mgr,
+                                                       ctx->repo_id,
+                                                       ctx->repo_version,
+                                                       item->file_id,
+                                                       &item->n_blocks);
+    for (i = 0; item->blocks && i < item->n_blocks; ++i) {
+        n = GPOINTER_TO_INT (g_hash_table_lookup (pool->busy_blocks,
+                                                  item->blocks[i]));
+        g_hash_table_insert (pool->busy_blocks, g_strdup(item->blocks[i]),
+                             GINT_TO_POINTER(n + 1));
+    }
+
+    g_hash_table_insert (ctx->in_flight, item->de->name, item);
+
+    ++pool->n_pending;
+    g_async_queue_push (pool->todo, item);
+}
+
+/* Wait for any written file. */
+static CheckoutItem *
+checkout_pool_pop (CheckoutPool *pool, CheckoutCtx *ctx)
+{
+    CheckoutItem *item;
+    int i, n;
+
+    item = g_async_queue_pop (pool->done);
+    --pool->n_pending;
+
+    g_hash_table_remove (ctx->in_flight, item->de->name);
+
+    for (i = 0; item->blocks && i < item->n_blocks; ++i) {
+        n = GPOINTER_TO_INT (g_hash_table_lookup (pool->busy_blocks,
+                                                  item->blocks[i]));
+        if (n <= 1)
+            g_hash_table_remove (pool->busy_blocks, item->blocks[i]);
+        else
+            g_hash_table_insert (pool->busy_blocks, g_strdup(item->blocks[i]),
+                                 GINT_TO_POINTER(n - 1));
+    }
+    g_strfreev (item->blocks);
+    item->blocks = NULL;
+
+    return item;
+}
+
+static void
+checkout_pool_free (CheckoutPool *pool)
+{
+    int i;
+
+    for (i = 0; i < pool->n_threads; ++i)
+        g_async_queue_push (pool->todo, pool);
+    for (i = 0; i < pool->n_threads; ++i)
+        pthread_join (pool->threads[i], NULL);
+
+    g_async_queue_unref (pool->todo);
+    g_async_queue_unref (pool->done);
+    g_hash_table_destroy (pool->busy_blocks);
+    g_free (pool);
+}
+
+/* Update the index and the sync status for a file that is done. */
+static void
+finish_checkout_item (CheckoutCtx *ctx, CheckoutItem *item)
+{
+    DiffEntry *de = item->de;
+    struct cache_entry *ce = item->ce;
+    int rc = item->rc;
+
+    if (item->w.path) {
+        rc = finish_checkout_file (&item->w, ce);
+        /* Later files with the same content can be copied from it. */
+        if (rc == FETCH_CHECKOUT_SUCCESS &&
+            !item->w.conflicted && !item->w.case_conflict)
+            g_hash_table_insert (ctx->local_files,
+                                 g_strdup (item->file_id), g_strdup (de->name));
+    }
+
+    if (item->checked_out) {
+        if (!item->is_locked) {
+            cleanup_file_blocks (ctx->repo_id, ctx->repo_version, item->file_id,
+                                 ctx->pool ? ctx->pool->busy_blocks : NULL);
+            if (!ctx->is_clone) {
+                SyncStatus status;
+                if (rc == FETCH_CHECKOUT_FAILED)
+                    status = SYNC_STATUS_ERROR;
+                else
+                    status = SYNC_STATUS_SYNCED;
+                seaf_sync_manager_update_active_path (seaf->sync_mgr,
+                                                      ctx->repo_id,
+                                                      de->name,
+                                                      de->mode,
+                                                      status);
+            }
+        } else {
+#ifdef WIN32
+            locked_file_set_add_update (ctx->fset, de->name, LOCKED_OP_UPDATE,
+                                        ce->ce_mtime.sec, item->file_id);
+            /* Stay in syncing status if the file is locked. */
+#endif
+        }
+    }
+
+    if (!ctx->is_http)
+        ++(ctx->task->n_downloaded);
+    else
+        ++(ctx->http_task->done_files);
+    ctx->done_bytes += de->size;
+
+    if (item->add_ce) {
+        if (!(ce->ce_flags & CE_REMOVE)) {
+            add_index_entry (ctx->istate, ce,
+                             (ADD_CACHE_OK_TO_ADD|ADD_CACHE_OK_TO_REPLACE));
+        }
+    } else {
+        ce->ce_mtime.sec = de->mtime;
+        ce->ce_size = de->size;
+        memcpy (ce->sha1, de->sha1, 20);
+        ce_set_modifier (ce, de->modifier);
+        ce->ce_mode = create_ce_mode (de->mode);
+    }
+
+    /* Save index file to disk after checking out some size of files.
+     * This way we don't need to re-compare too many files if this
+     * checkout is interrupted.
+     */
+    ctx->checkout_size += ce->ce_size;
+    if (ctx->checkout_size >= UPDATE_CACHE_SIZE_LIMIT) {
+        seaf_debug ("Save index file.\n");
+        update_index (ctx->istate, ctx->index_path);
+        ctx->checkout_size = 0;
+    }
+
+    g_free (item);
+}
+
+/* Index all the checked out files by content. */
+static GHashTable *
+build_local_files (struct index_state *istate)
+{
+    GHashTable *local_files;
+    struct cache_entry *ce;
+    char file_id[41];
+    int i;
+
+    local_files = g_hash_table_new_full (g_str_hash, g_str_equal,
+                                         g_free, g_free);
+
+    for (i = 0; i < istate->cache_nr; ++i) {
+        ce = istate->cache[i];
+        if (!S_ISREG(ce->ce_mode) || ce_stage(ce) != 0 ||
+            ce->ce_mtime.sec == 0 || ce->ce_size == 0)
+            continue;
+        rawdata_to_hex (ce->sha1, file_id, 20);
+        g_hash_table_insert (local_files, g_strdup (file_id),
+                             g_strdup (ce->name));
+    }
+
+    return local_files;
+}
+
+/*
+ * Find a file in the worktree with the content of @de that's safe to copy:
+ * it still matches the index and isn't being written by the pool.
+ * Returns its full path.
+ */
+static char *
+find_local_copy (CheckoutCtx *ctx, DiffEntry *de, const char *file_id)
+{
+    const char *name;
+    struct cache_entry *ce;
+    char *path;
+    SeafStat st;
+
+    if (de->size == 0)
+        return NULL;
+
+    name = g_hash_table_lookup (ctx->local_files, file_id);
+    if (!name || strcmp (name, de->name) == 0 ||
+        g_hash_table_lookup (ctx->in_flight, name))
+        return NULL;
+
+    ce = index_name_exists (ctx->istate, name, strlen(name), 0);
+    if (!ce || memcmp (ce->sha1, de->sha1, 20) != 0)
+        return NULL;
+
+    path = g_build_filename (ctx->worktree, name, NULL);
+    if (seaf_stat (path, &st) < 0 || !S_ISREG(st.st_mode) ||
+        st.st_mtime != ce->ce_mtime.sec || st.st_size != ce->ce_size) {
+        g_free (path);
+        return NULL;
+    }
+
+    return path;
+}
+
+static void
+drain_checkout_pool (CheckoutCtx *ctx)
+{
+    while (ctx->pool && ctx->pool->n_pending > 0)
+        finish_checkout_item (ctx, checkout_pool_pop (ctx->pool, ctx));
+}
+
+static int
+checkout_rank (DiffEntry *de, GHashTable *prioritized)
+{
+    if (de->status != DIFF_STATUS_ADDED && de->status != DIFF_STATUS_MODIFIED)
+        return 0;
+    return g_hash_table_lookup (prioritized, de) ? 1 : 2;
+}
+
+static gint
+compare_checkout_order (gconstpointer a, gconstpointer b, gpointer data)
+{
+    DiffEntry *da = (DiffEntry *)a, *db = (DiffEntry *)b;
+    int ra = checkout_rank (da, data), rb = checkout_rank (db, data);
+
+    if (ra != rb)
+        return ra - rb;
+    if (ra == 0)
+        return 0;
+    return (da->size > db->size) - (da->size < db->size);
+}
+
+/*
+ * Order the files to check out: those prioritized through the RPC first,
+ * then the others from the smallest, so that most files show up before
+ * the big ones are done. The other entries stay in front in their order.
+ */
+static GList *
+plan_checkout (const char *repo_id, GList *entries)
+{
+    GHashTable *prioritized;
+    GList *ptr;
+    DiffEntry *de;
+
+    prioritized = g_hash_table_new (g_direct_hash, g_direct_equal);
+    for (ptr = entries; ptr; ptr = ptr->next) {
+        de = ptr->data;
+        if (checkout_rank (de, prioritized) != 0 &&
+            http_tx_manager_is_path_prioritized (seaf->http_tx_mgr,
+                                                 repo_id, de->name))
+            g_hash_table_insert (prioritized, de, de);
+    }
+
+    /* The sort is stable. */
+    entries = g_list_sort_with_data (entries, compare_checkout_order,
+                                     prioritized);
+    g_hash_table_destroy (prioritized);
+
+    return entries;
+}
+
+/* Plan again the entries from @ptr on, after paths were prioritized. */
+static GList *
+replan_checkout (const char *repo_id, GList **results, GList *ptr)
+{
+    GList *prev = ptr->prev;
+
+    if (prev) {
+        prev->next = NULL;
+        ptr->prev = NULL;
+    }
+
+    ptr = plan_checkout (repo_id, ptr);
+
+    if (prev) {
+        prev->next = ptr;
+        ptr->prev = prev;
+    } else {
+        *results = ptr;
+    }
+
+    return ptr;
+}
+
+/* Whether the content of @de is already in the worktree, at its own path
+ * or at another one it can be copied from.
+ */
+static gboolean
+content_in_worktree (CheckoutCtx *ctx, DiffEntry *de, const char *file_id)
+{
+    struct cache_entry *ce;
+
+    ce = index_name_exists (ctx->istate, de->name, strlen(de->name), 0);
+    if (ce && ce_stage(ce) == 0 && ce->ce_mtime.sec != 0 &&
+        memcmp (ce->sha1, de->sha1, 20) == 0)
+        return TRUE;
+
+    return (de->size > 0 && g_hash_table_lookup (ctx->local_files, file_id));
+}
+
+/* Start fetching the blocks of the files to check out, in the order they
+ * are checked out. Files already in the worktree are left out; if they
+ * turn out to have changed, their blocks are fetched on checkout.
+ */
+static void
+start_block_download (HttpTxTask *http_task, CheckoutCtx *ctx, GList *results)
+{
+    GList *ptr, *file_ids = NULL;
+    DiffEntry *de;
+    char *file_id;
+
+    for (ptr = results; ptr; ptr = ptr->next) {
+        de = ptr->data;
+        if (de->status != DIFF_STATUS_ADDED && de->status != DIFF_STATUS_MODIFIED)
+            continue;
+        /* The blocks of ignored files would never be cleaned up. */
+        if (should_ignore_on_checkout (de->name))
+            continue;
+
+        file_id = g_new (char, 41);
+        rawdata_to_hex (de->sha1, file_id, 20);
+        if (content_in_worktree (ctx, de, file_id)) {
+            g_free (file_id);
+            continue;
+        }
+        file_ids = g_list_prepend (file_ids, file_id);
+    }
+
+    if (file_ids) {
+        file_ids = g_list_reverse (file_ids);
+        http_tx_task_start_block_download (http_task, file_ids);
+        string_list_free (file_ids);
+    }
+}
+
+/*
+ * When cloning into a non-empty folder, the worktree was only hashed (see
+ * seaf_repo_index_worktree_files()). Now that the remote fs objects are
+ * here, the files the server has are known by id; they are adopted by
+ * checkout as they are. Write the blocks and objects of the other files,
+ * which the merged tree will refer to.
+ */
+static void
+write_local_only_files (const char *repo_id,
+                        int repo_version,
+                        const char *worktree,
+                        struct index_state *istate,
+                        SeafileCrypt *crypt)
+{
+    GPtrArray *items = g_ptr_array_new ();
+    struct cache_entry *ce;
+    AddItem *item;
+    char file_id[41];
+    int i;
+    guint j;
+
+    for (i = 0; i < istate->cache_nr; ++i) {
+        ce = istate->cache[i];
+        if (!S_ISREG(ce->ce_mode) || ce_stage(ce) != 0)
+            continue;
+        rawdata_to_hex (ce->sha1, file_id, 20);
+        if (strcmp (file_id, EMPTY_SHA1) == 0 ||
+            seaf_fs_manager_object_exists (seaf->fs_mgr, repo_id,
+                                           repo_version, file_id))
+            continue;
+
+        item = g_new0 (AddItem, 1);
+        item->path = g_strdup (ce->name);
+        item->full_path = g_build_filename (worktree, ce->name, NULL);
+        g_ptr_array_add (items, item);
+    }
+
+    if (items->len > 0) {
+        seaf_message ("Writing %u local files not on the server for repo %.8s.\n",
+                      items->len, repo_id);
+        index_items (repo_id, repo_version, crypt,
+                     (AddItem **)items->pdata, items->len, TRUE);
+    }
+
+    for (j = 0; j < items->len; ++j) {
+        item = g_ptr_array_index (items, j);
+        ce = index_name_exists (istate, item->path, strlen(item->path), 0);
+        /* It changed since it was hashed, so it's indexed again on the
+         * next commit and checked for conflicts on checkout.
+         */
+        if (item->failed || memcmp (item->file_id, ce->sha1, 20) != 0)
+            seaf_warning ("File %s changed while cloning repo %.8s.\n",
+                          item->path, repo_id);
+        add_item_free (item);
+    }
+    g_ptr_array_free (items, TRUE);
+}
+
 int
 seaf_repo_fetch_and_checkout (TransferTask *task,
                               HttpTxTask *http_task,
@@ -3856,6 +5064,14 @@ seaf_repo_fetch_and_checkout (TransferTask *task,
     GHashTable *conflict_hash = NULL, *no_conflict_hash = NULL;
     GList *ignore_list = NULL;
     LockedFileSet *fset = NULL;
+    CheckoutCtx ctx;
+    CheckoutItem *item;
+    char *local_copy;
+    int n_threads;
+    SyncPaths *wanted = NULL, *synced = NULL, *active = NULL;
+    SyncPathsChange change;
+
+    memset (&ctx, 0, sizeof(ctx));
 
     if (is_http) {
         repo_id = http_task->repo_id;
@@ -3907,9 +5123,13 @@ seaf_repo_fetch_and_checkout (TransferTask *task,
         }
     }
 
-    if (!is_clone)
+    if (!is_clone) {
         worktree = repo->worktree;
 
+        seaf_repo_get_sync_paths (repo, &wanted, &synced);
+        active = sync_paths_intersect (wanted, synced);
+    }
+
     remote_head = seaf_commit_manager_get_commit (seaf->commit_mgr,
                                                   repo_id,
                                                   repo_version,
@@ -3921,15 +5141,33 @@ seaf_repo_fetch_and_checkout (TransferTask *task,
         goto out;
     }
 
-    if (diff_commit_roots (repo_id, repo_version,
-                           master_head ? master_head->root_id : EMPTY_SHA1,
-                           remote_head->root_id,
-                           &results, TRUE) < 0) {
+    /* Only the sub-folders synced are checked out. */
+    if (diff_commit_roots_filtered (repo_id, repo_version,
+                                    master_head ? master_head->root_id : EMPTY_SHA1,
+                                    remote_head->root_id,
+                                    &results, TRUE,
+                                    active ? sync_paths_filter : NULL,
+                                    active) < 0) {
         seaf_warning ("Failed to diff for repo %.8s.\n", repo_id);
         ret = FETCH_CHECKOUT_FAILED;
         goto out;
     }
 
+    /* The sub-folders selected since the last checkout are added as a whole. */
+    if (!sync_paths_equal (wanted, synced)) {
+        change.wanted = wanted;
+        change.synced = synced;
+        if (diff_commit_roots_filtered (repo_id, repo_version,
+                                        EMPTY_SHA1, remote_head->root_id,
+                                        &results, TRUE,
+                                        sync_paths_added_filter, &change) < 0) {
+            seaf_warning ("Failed to diff added sync paths for repo %.8s.\n",
+                          repo_id);
+            ret = FETCH_CHECKOUT_FAILED;
+            goto out;
+        }
+    }
+
     GList *ptr;
     DiffEntry *de;
 
@@ -4065,33 +5303,80 @@ seaf_repo_fetch_and_checkout (TransferTask *task,
         }
     }
 
+    if (is_clone)
+        write_local_only_files (repo_id, repo_version, worktree, &istate, crypt);
+
     if (istate.cache_changed)
         update_index (&istate, index_path);
 
-    gint64 checkout_size = 0;
+    ctx.repo_id = repo_id;
+    ctx.repo_version = repo_version;
+    ctx.is_clone = is_clone;
+    ctx.is_http = is_http;
+    ctx.task = task;
+    ctx.http_task = http_task;
+    ctx.istate = &istate;
+    ctx.index_path = index_path;
+    ctx.fset = fset;
+    ctx.worktree = worktree;
+    ctx.in_flight = g_hash_table_new (g_str_hash, g_str_equal);
+    ctx.local_files = build_local_files (&istate);
+
+    guint priority_serial = 0;
     int rc;
+    if (is_http) {
+        priority_serial = http_tx_manager_get_priority_serial (seaf->http_tx_mgr,
+                                                               repo_id);
+        results = plan_checkout (repo_id, results);
+
+        http_task->planned_bytes = 0;
+        for (ptr = results; ptr; ptr = ptr->next) {
+            de = ptr->data;
+            if (de->status == DIFF_STATUS_ADDED ||
+                de->status == DIFF_STATUS_MODIFIED)
+                http_task->planned_bytes += de->size;
+        }
+
+        start_block_download (http_task, &ctx, results);
+    }
+
+    n_threads = seaf->repo_mgr->priv->checkout_threads;
+    if (n_threads > 1)
+        ctx.pool = checkout_pool_new (n_threads);
+
     for (ptr = results; ptr; ptr = ptr->next) {
+        /* Go on with the paths the user asked for since we started. */
+        if (is_http &&
+            http_tx_manager_get_priority_serial (seaf->http_tx_mgr, repo_id) !=
+            priority_serial) {
+            priority_serial = http_tx_manager_get_priority_serial (seaf->http_tx_mgr,
+                                                                   repo_id);
+            ptr = replan_checkout (repo_id, &results, ptr);
+            http_tx_task_stop_block_download (http_task);
+            start_block_download (http_task, &ctx, ptr);
+        }
+
         de = ptr->data;
 
         if (de->status == DIFF_STATUS_ADDED ||
             de->status == DIFF_STATUS_MODIFIED) {
             seaf_debug ("Checkout file %s.\n", de->name);
 
-            gboolean add_ce = FALSE;
-            gboolean is_locked = FALSE;
-            char file_id[41];
-
-            rawdata_to_hex (de->sha1, file_id, 20);
+            item = g_new0 (CheckoutItem, 1);
+            item->de = de;
+            item->rc = FETCH_CHECKOUT_SUCCESS;
+            rawdata_to_hex (de->sha1, item->file_id, 20);
 
-            ce = index_name_exists (&istate, de->name, strlen(de->name), 0);
-            if (!ce) {
-                ce = cache_entry_from_diff_entry (de);
-                add_ce = TRUE;
+            item->ce = index_name_exists (&istate, de->name, strlen(de->name), 0);
+            if (!item->ce) {
+                item->ce = cache_entry_from_diff_entry (de);
+                item->add_ce = TRUE;
             }
 
             if (!should_ignore_on_checkout (de->name)) {
+                item->checked_out = TRUE;
 #ifdef WIN32
-                is_locked = do_check_file_locked (de->name, worktree);
+                item->is_locked = do_check_file_locked (de->name, worktree);
 #endif
 
                 if (!is_clone)
@@ -4101,99 +5386,65 @@ seaf_repo_fetch_and_checkout (TransferTask *task,
                                                           de->mode,
                                                           SYNC_STATUS_SYNCING);
 
-                rc = checkout_file (repo_id,
-                                    repo_version,
-                                    worktree,
-                                    de->name,
-                                    file_id,
-                                    de->mtime,
-                                    de->mode,
-                                    crypt,
-                                    ce,
-                                    task,
-                                    http_task,
-                                    is_http,
-                                    remote_head_id,
-                                    conflict_hash,
-                                    no_conflict_hash,
-                                    is_locked);
+                if (is_http)
+                    http_tx_task_set_current_file (http_task, de->name,
+                                                   ctx.done_bytes);
+
+                local_copy = NULL;
+                if (!item->is_locked)
+                    local_copy = find_local_copy (&ctx, de, item->file_id);
+
+                rc = prepare_checkout_file (repo_id,
+                                            repo_version,
+                                            worktree,
+                                            de->name,
+                                            item->file_id,
+                                            de->mtime,
+                                            de->mode,
+                                            crypt,
+                                            item->ce,
+                                            task,
+                                            http_task,
+                                            is_http,
+                                            remote_head_id,
+                                            conflict_hash,
+                                            no_conflict_hash,
+                                            item->is_locked,
+                                            local_copy,
+                                            &item->w);
+                g_free (local_copy);
 
                 /* Even if the file failed to check out, still need to update index.
                  * But we have to stop after transfer errors.
                  */
-                if (rc == FETCH_CHECKOUT_CANCELED) {
-                    seaf_debug ("Transfer canceled.\n");
-                    ret = FETCH_CHECKOUT_CANCELED;
-                    if (add_ce)
-                        cache_entry_free (ce);
-                    if (!is_clone)
-                        seaf_sync_manager_delete_active_path (seaf->sync_mgr,
-                                                              repo_id,
-                                                              de->name);
-                    goto out;
-                } else if (rc == FETCH_CHECKOUT_TRANSFER_ERROR) {
-                    seaf_warning ("Transfer failed.\n");
-                    ret = FETCH_CHECKOUT_TRANSFER_ERROR;
-                    if (add_ce)
-                        cache_entry_free (ce);
+                if (rc == FETCH_CHECKOUT_CANCELED ||
+                    rc == FETCH_CHECKOUT_TRANSFER_ERROR) {
+                    if (rc == FETCH_CHECKOUT_CANCELED)
+                        seaf_debug ("Transfer canceled.\n");
+                    else
+                        seaf_warning ("Transfer failed.\n");
+                    ret = rc;
+                    if (item->add_ce)
+                        cache_entry_free (item->ce);
                     if (!is_clone)
                         seaf_sync_manager_delete_active_path (seaf->sync_mgr,
                                                               repo_id,
                                                               de->name);
+                    g_free (item);
                     goto out;
                 }
-
-                if (!is_locked) {
-                    cleanup_file_blocks (repo_id, repo_version, file_id);
-                    if (!is_clone) {
-                        SyncStatus status;
-                        if (rc == FETCH_CHECKOUT_FAILED)
-                            status = SYNC_STATUS_ERROR;
-                        else
-                            status = SYNC_STATUS_SYNCED;
-                        seaf_sync_manager_update_active_path (seaf->sync_mgr,
-                                                              repo_id,
-                                                              de->name,
-                                                              de->mode,
-                                                              status);
-                    }
-                } else {
-#ifdef WIN32
-                    locked_file_set_add_update (fset, de->name, LOCKED_OP_UPDATE,
-                                                ce->ce_mtime.sec, file_id);
-                    /* Stay in syncing status if the file is locked. */
-#endif
-                }
+                item->rc = rc;
             }
 
-            if (!is_http)
-                ++(task->n_downloaded);
-            else
-                ++(http_task->done_files);
-
-            if (add_ce) {
-                if (!(ce->ce_flags & CE_REMOVE)) {
-                    add_index_entry (&istate, ce,
-                                     (ADD_CACHE_OK_TO_ADD|ADD_CACHE_OK_TO_REPLACE));
-                }
+            if (item->w.path && ctx.pool) {
+                checkout_pool_push (ctx.pool, &ctx, item);
+                /* Keep enough files queued for all threads. */
+                while (ctx.pool->n_pending >= 2 * ctx.pool->n_threads)
+                    finish_checkout_item (&ctx, checkout_pool_pop (ctx.pool, &ctx));
             } else {
-                ce->ce_mtime.sec = de->mtime;
-                ce->ce_size = de->size;
-                memcpy (ce->sha1, de->sha1, 20);
-                if (ce->modifier) g_free (ce->modifier);
-                ce->modifier = g_strdup(de->modifier);
-                ce->ce_mode = create_ce_mode (de->mode);
-            }
-
-            /* Save index file to disk after checking out some size of files.
-             * This way we don't need to re-compare too many files if this
-             * checkout is interrupted.
-             */
-            checkout_size += ce->ce_size;
-            if (checkout_size >= UPDATE_CACHE_SIZE_LIMIT) {
-                seaf_debug ("Save index file.\n");
-                update_index (&istate, index_path);
-                checkout_size = 0;
+                if (item->w.path)
+                    write_checkout_file (&item->w);
+                finish_checkout_item (&ctx, item);
             }
         } else if (de->status == DIFF_STATUS_DIR_ADDED) {
             seaf_debug ("Checkout empty dir %s.\n", de->name);
@@ -4229,9 +5480,35 @@ seaf_repo_fetch_and_checkout (TransferTask *task,
         }
     }
 
+    drain_checkout_pool (&ctx);
+
+    if (ret == FETCH_CHECKOUT_SUCCESS && !sync_paths_equal (wanted, synced))
+        remove_unsynced_entries (&istate, wanted);
+
     update_index (&istate, index_path);
 
+    if (ret == FETCH_CHECKOUT_SUCCESS && !sync_paths_equal (wanted, synced))
+        seaf_repo_set_synced_paths (repo, wanted);
+
+    if (is_http)
+        http_tx_manager_clear_priorities (seaf->http_tx_mgr, repo_id);
+
 out:
+    /* Files still being written are added to the index as usual. */
+    if (ctx.pool) {
+        drain_checkout_pool (&ctx);
+        checkout_pool_free (ctx.pool);
+    }
+    if (ctx.in_flight)
+        g_hash_table_destroy (ctx.in_flight);
+    if (ctx.local_files)
+        g_hash_table_destroy (ctx.local_files);
+
+    if (is_http) {
+        http_tx_task_stop_block_download (http_task);
+        http_tx_task_set_current_file (http_task, NULL, ctx.done_bytes);
+    }
+
     discard_index (&istate);
 
     seaf_branch_unref (master);
@@ -4241,6 +5518,10 @@ out:
     for (ptr = results; ptr; ptr = ptr->next)
         diff_entry_free ((DiffEntry *)ptr->data);
 
+    sync_paths_free (wanted);
+    sync_paths_free (synced);
+    sync_paths_free (active);
+
     g_free (crypt);
     if (conflict_hash)
         g_hash_table_destroy (conflict_hash);
@@ -4344,6 +5625,8 @@ seaf_repo_manager_new (SeafileSession *seaf)
     office_temp_ignore_patterns[3] = NULL;
 
     mgr->priv->repo_hash = g_hash_table_new_full (g_str_hash, g_str_equal, g_free, NULL);
+    mgr->priv->locked_file_counts = g_hash_table_new_full (g_str_hash, g_str_equal,
+                                                           g_free, NULL);
 
     pthread_rwlock_init (&mgr->priv->lock, NULL);
 
@@ -4362,9 +5645,55 @@ seaf_repo_manager_init (SeafRepoManager *mgr)
     /* Load all the repos into memory on the client side. */
     load_repos (mgr, mgr->seaf->seaf_dir);
 
+    gboolean exists;
+    int checkout_threads = seafile_session_config_get_int (mgr->seaf,
+                                                           KEY_CHECKOUT_THREADS,
+                                                           &exists);
+    if (!exists || checkout_threads <= 0)
+        checkout_threads = DEFAULT_CHECKOUT_THREADS;
+    mgr->priv->checkout_threads = MIN (checkout_threads, MAX_CHECKOUT_THREADS);
+
     return 0;
 }
 
+/* Adding a watch waits for the monitor to go through the whole worktree,
+ * so repos are watched one at a time after startup. The daemon answers
+ * requests in between, instead of only after all repos are watched.
+ */
+#define STARTUP_WATCH_INTERVAL 50 /* ms */
+
+static int
+watch_next_repo (void *vmgr)
+{
+    SeafRepoManager *mgr = vmgr;
+    char *repo_id;
+    SeafRepo *repo;
+
+    repo_id = g_queue_pop_head (mgr->priv->pending_watches);
+    if (!repo_id) {
+        g_queue_free (mgr->priv->pending_watches);
+        mgr->priv->pending_watches = NULL;
+        ccnet_timer_free (&mgr->priv->watch_timer);
+        return 0;
+    }
+
+    /* The repo may have been removed or changed since startup. */
+    repo = seaf_repo_manager_get_repo (mgr, repo_id);
+    /* Enabling auto sync again watches all repos. */
+    if (repo && repo->auto_sync && !repo->worktree_invalid &&
+        seaf_sync_manager_is_auto_sync_enabled (seaf->sync_mgr)) {
+        if (seaf_wt_monitor_watch_repo (seaf->wt_monitor, repo->id, repo->worktree) < 0) {
+            g_warning ("failed to watch repo %s.\n", repo->id);
+        } else {
+            /* Commit the changes made while the daemon was not running. */
+            seaf_sync_manager_wake_repo (seaf->sync_mgr, repo->id, 0);
+        }
+    }
+
+    g_free (repo_id);
+    return 1;
+}
+
 static void
 watch_repos (SeafRepoManager *mgr)
 {
@@ -4372,18 +5701,17 @@ watch_repos (SeafRepoManager *mgr)
     SeafRepo *repo;
     gpointer key, value;
 
+    mgr->priv->pending_watches = g_queue_new ();
+
     g_hash_table_iter_init (&iter, mgr->priv->repo_hash);
     while (g_hash_table_iter_next (&iter, &key, &value)) {
         repo = value;
-        if (repo->auto_sync && !repo->worktree_invalid) {
-            if (seaf_wt_monitor_watch_repo (seaf->wt_monitor, repo->id, repo->worktree) < 0) {
-                g_warning ("failed to watch repo %s.\n", repo->id);
-                /* If we fail to add watch at the beginning, sync manager
-                 * will periodically check repo status and retry.
-                 */
-            }
-        }
+        if (repo->auto_sync && !repo->worktree_invalid)
+            g_queue_push_tail (mgr->priv->pending_watches, g_strdup(repo->id));
     }
+
+    mgr->priv->watch_timer = ccnet_timer_new (watch_next_repo, mgr,
+                                              STARTUP_WATCH_INTERVAL);
 }
 
 int
@@ -4450,6 +5778,8 @@ seaf_repo_manager_add_repo (SeafRepoManager *manager,
 
     pthread_rwlock_unlock (&manager->priv->lock);
 
+    seaf_sync_manager_wake_repo (seaf->sync_mgr, repo->id, 0);
+
     return 0;
 }
 
@@ -4552,6 +5882,11 @@ seaf_repo_manager_remove_repo_ondisk (SeafRepoManager *mgr,
     char path[SEAF_PATH_MAX];
     snprintf (path, SEAF_PATH_MAX, "%s/%s", mgr->index_dir, repo_id);
     seaf_util_unlink (path);
+    snprintf (path, SEAF_PATH_MAX, "%s/%s.dirs", mgr->index_dir, repo_id);
+    seaf_util_unlink (path);
+
+    seaf_fs_manager_remove_blocklist_cache (seaf->fs_mgr, repo_id);
+    chunk_map_remove_repo (repo_id);
 
     /* remove branch */
     GList *p;
@@ -4584,6 +5919,7 @@ seaf_repo_manager_remove_repo_ondisk (SeafRepoManager *mgr,
     snprintf (sql, sizeof(sql), "DELETE FROM LockedFiles WHERE repo_id = '%s'",
               repo_id);
     sqlite_query_exec (mgr->priv->db, sql);
+    g_hash_table_remove (mgr->priv->locked_file_counts, repo_id);
 #endif
 
     snprintf (sql, sizeof(sql), "DELETE FROM FolderUserPerms WHERE repo_id = '%s'", 
@@ -4925,6 +6261,12 @@ load_repo_property (SeafRepoManager *manager,
     sqlite3 *db = manager->priv->db;
     char sql[256];
     char *value = NULL;
+    GHashTable *repo_props;
+
+    if (manager->priv->startup_props) {
+        repo_props = g_hash_table_lookup (manager->priv->startup_props, repo_id);
+        return repo_props ? g_strdup (g_hash_table_lookup (repo_props, key)) : NULL;
+    }
 
     pthread_mutex_lock (&manager->priv->db_lock);
 
@@ -5078,6 +6420,14 @@ load_repo (SeafRepoManager *manager, const char *repo_id)
         repo->is_readonly = TRUE;
     else
         repo->is_readonly = FALSE;
+    g_free (value);
+
+    value = load_repo_property (manager, repo->id, REPO_PROP_SYNC_PATHS);
+    repo->sync_paths = sync_paths_parse (value);
+    g_free (value);
+    value = load_repo_property (manager, repo->id, REPO_PROP_SYNCED_PATHS);
+    repo->synced_paths = sync_paths_parse (value);
+    g_free (value);
 
     g_hash_table_insert (manager->priv->repo_hash, g_strdup(repo->id), repo);
 
@@ -5200,6 +6550,70 @@ remove_deleted_repo (sqlite3_stmt *stmt, void *vmanager)
     return TRUE;
 }
 
+static gboolean
+collect_property_cb (sqlite3_stmt *stmt, void *vprops)
+{
+    GHashTable *props = vprops;
+    GHashTable *repo_props;
+    const char *repo_id, *key, *value;
+
+    repo_id = (const char *) sqlite3_column_text (stmt, 0);
+    key = (const char *) sqlite3_column_text (stmt, 1);
+    value = (const char *) sqlite3_column_text (stmt, 2);
+    if (!repo_id || !key)
+        return TRUE;
+
+    repo_props = g_hash_table_lookup (props, repo_id);
+    if (!repo_props) {
+        repo_props = g_hash_table_new_full (g_str_hash, g_str_equal,
+                                            g_free, g_free);
+        g_hash_table_insert (props, g_strdup(repo_id), repo_props);
+    }
+
+    /* Like the query of a single property, the first row wins. */
+    if (!g_hash_table_lookup_extended (repo_props, key, NULL, NULL))
+        g_hash_table_insert (repo_props, g_strdup(key), g_strdup(value));
+
+    return TRUE;
+}
+
+#ifdef WIN32
+static gboolean
+load_locked_count_cb (sqlite3_stmt *stmt, void *vmanager)
+{
+    SeafRepoManager *manager = vmanager;
+    const char *repo_id = (const char *) sqlite3_column_text (stmt, 0);
+    int n = sqlite3_column_int (stmt, 1);
+
+    if (repo_id && n > 0)
+        g_hash_table_replace (manager->priv->locked_file_counts,
+                              g_strdup(repo_id), GINT_TO_POINTER(n));
+
+    return TRUE;
+}
+#endif
+
+/* Read the properties of all repos at once, rather than with a few
+ * queries for every repo.
+ */
+static GHashTable *
+load_all_repo_properties (sqlite3 *db)
+{
+    GHashTable *props;
+
+    props = g_hash_table_new_full (g_str_hash, g_str_equal, g_free,
+                                   (GDestroyNotify)g_hash_table_destroy);
+    if (sqlite_foreach_selected_row (db,
+                                     "SELECT repo_id, key, value FROM RepoProperty",
+                                     collect_property_cb, props) < 0) {
+        g_warning ("Error read repo properties.\n");
+        g_hash_table_destroy (props);
+        return NULL;
+    }
+
+    return props;
+}
+
 static void
 load_repos (SeafRepoManager *manager, const char *seaf_dir)
 {
@@ -5214,10 +6628,22 @@ load_repos (SeafRepoManager *manager, const char *seaf_dir)
         return;
     }
 
+#ifdef WIN32
+    sql = "SELECT repo_id, COUNT(*) FROM LockedFiles GROUP BY repo_id";
+    if (sqlite_foreach_selected_row (db, sql, load_locked_count_cb, manager) < 0)
+        g_warning ("Error read locked files.\n");
+#endif
+
+    /* Falls back to a query per property if NULL. */
+    manager->priv->startup_props = load_all_repo_properties (db);
+
     sql = "SELECT repo_id FROM Repo;";
-    if (sqlite_foreach_selected_row (db, sql, load_repo_cb, manager) < 0) {
+    if (sqlite_foreach_selected_row (db, sql, load_repo_cb, manager) < 0)
         g_warning ("Error read repo db.\n");
-        return;
+
+    if (manager->priv->startup_props) {
+        g_hash_table_destroy (manager->priv->startup_props);
+        manager->priv->startup_props = NULL;
     }
 }
 
@@ -5317,6 +6743,7 @@ seaf_repo_manager_set_repo_property (SeafRepoManager *manager,
             seaf_wt_monitor_watch_repo (seaf->wt_monitor, repo->id,
                                         repo->worktree);
             repo->last_sync_time = 0;
+            seaf_sync_manager_wake_repo (seaf->sync_mgr, repo->id, 0);
         } else {
             repo->auto_sync = 0;
             seaf_wt_monitor_unwatch_repo (seaf->wt_monitor, repo->id);
@@ -5335,6 +6762,24 @@ seaf_repo_manager_set_repo_property (SeafRepoManager *manager,
     if (strcmp(key, REPO_RELAY_ID) == 0)
         return seaf_repo_manager_set_repo_relay_id (manager, repo, value);
 
+    if (strcmp (key, REPO_PROP_SYNC_PATHS) == 0) {
+        SyncPaths *paths = sync_paths_parse (value);
+        char *normalized = sync_paths_to_string (paths);
+
+        pthread_mutex_lock (&repo->lock);
+        sync_paths_free (repo->sync_paths);
+        repo->sync_paths = paths;
+        pthread_mutex_unlock (&repo->lock);
+
+        save_repo_property (manager, repo_id, key, normalized ? normalized : "");
+        g_free (normalized);
+
+        /* The newly selected paths are downloaded on the next sync. */
+        if (seaf->started && seaf_repo_sync_paths_pending (repo))
+            seaf_sync_manager_wake_repo (seaf->sync_mgr, repo->id, 0);
+        return 0;
+    }
+
     if (strcmp (key, REPO_PROP_SERVER_URL) == 0) {
         char *url = canonical_server_url (value);
 
@@ -29,9 +29,17 @@
 #define REPO_PROP_DOWNLOAD_HEAD "download-head"
 #define REPO_PROP_IS_READONLY "is-readonly"
 #define REPO_PROP_SERVER_URL  "server-url"
+#define REPO_PROP_TRANSFER_PRIORITY "transfer-priority"
+/* Where the worktree watch can resume after a restart, if supported. */
+#define REPO_PROP_WATCH_RESUME "watch-resume"
+/* Sub-folders to sync, one per line. The whole repo is synced if unset. */
+#define REPO_PROP_SYNC_PATHS  "sync-paths"
+/* The sub-folders the worktree was last checked out with. */
+#define REPO_PROP_SYNCED_PATHS "synced-paths"
 
 struct _SeafRepoManager;
 typedef struct _SeafRepo SeafRepo;
+struct SyncPaths;
 
 /* The caller can use the properties directly. But the caller should
  * always write on repos via the API. 
@@ -62,9 +70,11 @@ struct _SeafRepo {
     int         wt_check_time;
     int         last_sync_time;
 
-    /* Last time check locked files. */
-    int         last_check_locked_time;
+    /* Next time to check locked files, 0 for as soon as possible. */
+    gint64      next_check_locked_time;
     gboolean    checking_locked_files;
+    /* path -> LockedFileRetry, only used by the locked files check. */
+    GHashTable *locked_retries;
 
     unsigned char enc_key[32];   /* 256-bit encryption key */
     unsigned char enc_iv[16];
@@ -92,6 +102,12 @@ struct _SeafRepo {
     /* Can be server_url or server_url:8082, depends on which one works. */
     char *effective_host;
     gboolean use_fileserver_port;
+
+    /* Selective sync, NULL for the whole repo. Protected by @lock,
+     * use the functions below from other threads.
+     */
+    struct SyncPaths *sync_paths;
+    struct SyncPaths *synced_paths;
 };
 
 
@@ -118,6 +134,26 @@ seaf_repo_unset_readonly (SeafRepo *repo);
 int
 seaf_repo_checkdir (SeafRepo *repo);
 
+/* Copies of the wanted sync paths and of the ones checked out. */
+void
+seaf_repo_get_sync_paths (SeafRepo *repo,
+                          struct SyncPaths **wanted,
+                          struct SyncPaths **synced);
+
+/*
+ * The sub-folders the index and the worktree have: wanted, and already
+ * checked out. Returns NULL if the whole repo is synced.
+ */
+struct SyncPaths *
+seaf_repo_get_active_sync_paths (SeafRepo *repo);
+
+/* TRUE if the worktree isn't checked out with the wanted paths yet. */
+gboolean
+seaf_repo_sync_paths_pending (SeafRepo *repo);
+
+void
+seaf_repo_set_synced_paths (SeafRepo *repo, const struct SyncPaths *synced);
+
 /* Update repo name, desc, magic etc from commit.
  */
 void
@@ -138,6 +174,12 @@ seaf_repo_get_commits (SeafRepo *repo);
 int
 seaf_repo_index_add (SeafRepo *repo, const char *path);
 
+/*
+ * Index the files in @worktree from scratch and return the root of the
+ * resulting tree in @root_id. If @hash_only is TRUE, only the dirs are
+ * written; the blocks and objects of the files are left to
+ * seaf_repo_fetch_and_checkout(), which writes those the server doesn't have.
+ */
 int
 seaf_repo_index_worktree_files (const char *repo_id,
                                 int version,
@@ -146,6 +188,7 @@ seaf_repo_index_worktree_files (const char *repo_id,
                                 const char *passwd,
                                 int enc_version,
                                 const char *random_key,
+                                gboolean hash_only,
                                 char *root_id);
 
 int
@@ -476,6 +519,10 @@ locked_file_set_remove (LockedFileSet *fset, const char *path, gboolean db_only)
 LockedFile *
 locked_file_set_lookup (LockedFileSet *fset, const char *path);
 
+/* Whether @repo_id has locked file records, without reading the db. */
+gboolean
+seaf_repo_manager_has_locked_files (SeafRepoManager *mgr, const char *repo_id);
+
 /* Folder Permissions. */
 
 typedef enum FolderPermType {
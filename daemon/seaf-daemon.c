@@ -131,6 +131,11 @@ start_rpc_service (CcnetClient *client)
                                      "seafile_set_repo_token",
                                      searpc_signature_int__string_string());
 
+    searpc_server_register_function ("seafile-rpcserver",
+                                     seafile_prioritize_download,
+                                     "seafile_prioritize_download",
+                                     searpc_signature_int__string_string());
+
     searpc_server_register_function ("seafile-rpcserver",
                                      seafile_get_upload_rate,
                                      "seafile_get_upload_rate",
@@ -276,6 +281,18 @@ start_rpc_service (CcnetClient *client)
                                      seafile_get_path_sync_status,
                                      "seafile_get_path_sync_status",
                                      searpc_signature_string__string_string_int());
+    searpc_server_register_function ("seafile-rpcserver",
+                                     seafile_get_dir_sync_status,
+                                     "seafile_get_dir_sync_status",
+                                     searpc_signature_string__string_string());
+    searpc_server_register_function ("seafile-rpcserver",
+                                     seafile_get_sync_status_version,
+                                     "seafile_get_sync_status_version",
+                                     searpc_signature_int__string());
+    searpc_server_register_function ("seafile-rpcserver",
+                                     seafile_get_wt_monitor_stats,
+                                     "seafile_get_wt_monitor_stats",
+                                     searpc_signature_string__void());
 }
 
 static void
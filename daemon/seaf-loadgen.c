@@ -0,0 +1,1159 @@
+/* -*- Mode: C; tab-width: 4; indent-tabs-mode: nil; c-basic-offset: 4 -*- */
+
+/*
+ * seaf-loadgen simulates sync clients against a seafile file server, to
+ * find out what a server setup can take before it's rolled out.
+ *
+ * Each client is a thread with its own keep-alive connection. It picks a
+ * repo and a scenario at random, by the weights given with -m, runs it
+ * and waits for a random think time:
+ *
+ *   poll      head-commits-multi for all repos, like the sync manager
+ *   download  head commit, commit, fs-id-list, pack-fs and some blocks
+ *   upload    commit, check-fs, recv-fs, check-blocks and some blocks
+ *
+ * The requests are made the way http-tx-mgr.c makes them. Uploads only
+ * send objects and blocks that were downloaded from the same repo before
+ * the run, and never update the branch, so the repos are not changed.
+ *
+ * When the run ends, the request rate, errors and latency percentiles of
+ * each endpoint are printed, and the same as JSON on the last line.
+ */
+
+#include "common.h"
+#include "log.h"
+
+#include <getopt.h>
+#include <math.h>
+#include <pthread.h>
+#include <curl/curl.h>
+#include <jansson.h>
+
+#include "utils.h"
+
+#define PACK_FS_BATCH 100           /* ids per pack-fs request */
+#define ID_LIST_SEGMENT_N 1000      /* ids per check-fs or check-blocks */
+#define MAX_KEPT_IDS 10000          /* fs and block ids kept per repo */
+#define PREPARE_OBJS 1000           /* fs objects fetched to find blocks */
+#define RECV_FS_OBJS 100            /* fs objects sent back by uploads */
+#define MAX_POLL_REPOS 1000         /* see MAX_HEAD_COMMITS_MULTI */
+#define HTTP_TIMEOUT_SEC 45
+
+#define SEAF_METADATA_TYPE_FILE 1
+#define BINARY_FILE_MAGIC "SFF2"
+#define BINARY_FILE_HDR_SIZE (4 + 8 + 4)
+
+typedef enum Endpoint {
+    EP_HEAD_COMMIT,
+    EP_HEAD_COMMITS_MULTI,
+    EP_GET_COMMIT,
+    EP_FS_ID_LIST,
+    EP_PACK_FS,
+    EP_GET_BLOCK,
+    EP_PUT_COMMIT,
+    EP_CHECK_FS,
+    EP_RECV_FS,
+    EP_CHECK_BLOCKS,
+    EP_PUT_BLOCK,
+    N_ENDPOINTS
+} Endpoint;
+
+static const char *endpoint_names[N_ENDPOINTS] = {
+    "head-commit",
+    "head-commits-multi",
+    "get-commit",
+    "fs-id-list",
+    "pack-fs",
+    "get-block",
+    "put-commit",
+    "check-fs",
+    "recv-fs",
+    "check-blocks",
+    "put-block",
+};
+
+typedef enum Scenario {
+    SCENARIO_POLL,
+    SCENARIO_DOWNLOAD,
+    SCENARIO_UPLOAD,
+    N_SCENARIOS
+} Scenario;
+
+static const char *scenario_names[N_SCENARIOS] = {
+    "poll",
+    "download",
+    "upload",
+};
+
+typedef struct LoadParams {
+    char *server;               /* up to, not including, "/repo/" */
+    int n_clients;
+    int duration;               /* seconds */
+    int think_time;             /* mean, in ms */
+    int mix[N_SCENARIOS];       /* weights */
+    int max_objs;               /* fs objects per download or upload */
+    int max_blocks;             /* blocks per download or upload */
+    gboolean insecure;          /* don't verify certificates */
+} LoadParams;
+
+static LoadParams params = {
+    .n_clients = 10,
+    .duration = 60,
+    .think_time = 1000,
+    .mix = { 70, 20, 10 },
+    .max_objs = 200,
+    .max_blocks = 2,
+};
+
+typedef struct LoadRepo {
+    char repo_id[37];
+    char *token;
+
+    /* Read before the run, replayed by the clients. */
+    char head[41];
+    int version;
+    char *commit;
+    gint64 commit_len;
+    GPtrArray *fs_ids;
+    GByteArray *fs_pack;        /* objects as pack-fs returns them */
+    int n_pack_objs;
+    GPtrArray *block_ids;
+    GPtrArray *blocks;          /* GByteArray, of the first block ids */
+} LoadRepo;
+
+static GPtrArray *repos;
+
+typedef struct EndpointStats {
+    GArray *latencies;          /* gint64, microseconds */
+    gint64 errors;
+    gint64 bytes;
+} EndpointStats;
+
+typedef struct LoadClient {
+    int index;
+    pthread_t thread;
+    CURL *curl;
+    GRand *rand;
+    EndpointStats stats[N_ENDPOINTS];
+    gint64 scenarios[N_SCENARIOS];
+} LoadClient;
+
+static gint64 deadline;
+
+typedef struct Response {
+    char *content;
+    size_t size;
+} Response;
+
+static size_t
+recv_response (void *ptr, size_t size, size_t nmemb, void *userp)
+{
+    size_t realsize = size * nmemb;
+    Response *rsp = userp;
+
+    rsp->content = g_realloc (rsp->content, rsp->size + realsize);
+    memcpy (rsp->content + rsp->size, ptr, realsize);
+    rsp->size += realsize;
+
+    return realsize;
+}
+
+/*
+ * Send one request with the repo token, like http_get(), http_put() and
+ * http_post() in http-tx-mgr.c do, and count it under @ep. Returns the
+ * status code, or -1 if the request failed. The response is returned in
+ * @rsp_content if it's not NULL.
+ */
+static int
+do_request (LoadClient *client, Endpoint ep, const char *method,
+            const char *url, const char *token,
+            const char *body, gint64 body_len,
+            char **rsp_content, gint64 *rsp_size)
+{
+    CURL *curl = client->curl;
+    struct curl_slist *headers = NULL;
+    char *token_header;
+    EndpointStats *stats = &client->stats[ep];
+    Response rsp;
+    gint64 start, elapsed;
+    long status = -1;
+    int rc;
+
+    memset (&rsp, 0, sizeof(rsp));
+
+    headers = curl_slist_append (headers, "User-Agent: seaf-loadgen");
+    token_header = g_strdup_printf ("Seafile-Repo-Token: %s", token);
+    headers = curl_slist_append (headers, token_header);
+    g_free (token_header);
+
+    curl_easy_setopt (curl, CURLOPT_HTTPHEADER, headers);
+    curl_easy_setopt (curl, CURLOPT_URL, url);
+    curl_easy_setopt (curl, CURLOPT_NOSIGNAL, 1L);
+    curl_easy_setopt (curl, CURLOPT_LOW_SPEED_LIMIT, 1L);
+    curl_easy_setopt (curl, CURLOPT_LOW_SPEED_TIME, (long)HTTP_TIMEOUT_SEC);
+    curl_easy_setopt (curl, CURLOPT_WRITEFUNCTION, recv_response);
+    curl_easy_setopt (curl, CURLOPT_WRITEDATA, &rsp);
+    if (params.insecure) {
+        curl_easy_setopt (curl, CURLOPT_SSL_VERIFYPEER, 0L);
+        curl_easy_setopt (curl, CURLOPT_SSL_VERIFYHOST, 0L);
+    }
+
+    if (strcmp (method, "GET") != 0) {
+        curl_easy_setopt (curl, CURLOPT_CUSTOMREQUEST, method);
+        curl_easy_setopt (curl, CURLOPT_POSTFIELDS, body ? body : "");
+        curl_easy_setopt (curl, CURLOPT_POSTFIELDSIZE_LARGE,
+                          (curl_off_t)(body ? body_len : 0));
+    }
+
+    start = get_current_time ();
+    rc = curl_easy_perform (curl);
+    elapsed = get_current_time () - start;
+
+    if (rc != CURLE_OK) {
+        seaf_warning ("Failed to %s %s: %s.\n", method, url,
+                      curl_easy_strerror (rc));
+    } else if (curl_easy_getinfo (curl, CURLINFO_RESPONSE_CODE,
+                                  &status) != CURLE_OK) {
+        status = -1;
+    }
+
+    g_array_append_val (stats->latencies, elapsed);
+    if (status < 200 || status >= 300)
+        ++stats->errors;
+    stats->bytes += body_len + rsp.size;
+
+    if (rsp_content && status >= 200 && status < 300) {
+        *rsp_content = rsp.content;
+        *rsp_size = rsp.size;
+    } else {
+        g_free (rsp.content);
+    }
+
+    curl_slist_free_all (headers);
+    curl_easy_reset (curl);
+
+    return (int)status;
+}
+
+static gboolean
+ok (int status)
+{
+    return status >= 200 && status < 300;
+}
+
+static char *
+id_list_to_json (GPtrArray *ids, int start, int n)
+{
+    json_t *array = json_array ();
+    char *ret;
+    int i;
+
+    for (i = start; i < start + n && i < ids->len; ++i)
+        json_array_append_new (array, json_string (g_ptr_array_index (ids, i)));
+
+    ret = json_dumps (array, 0);
+    json_decref (array);
+    return ret;
+}
+
+static int
+get_head_commit (LoadClient *client, LoadRepo *repo, char *head)
+{
+    char *url, *rsp = NULL;
+    gint64 rsp_size;
+    json_t *object;
+    json_error_t jerror;
+    const char *commit_id;
+    int status, ret = -1;
+
+    url = g_strdup_printf ("%s/repo/%s/commit/HEAD",
+                           params.server, repo->repo_id);
+    status = do_request (client, EP_HEAD_COMMIT, "GET", url, repo->token,
+                         NULL, 0, &rsp, &rsp_size);
+    g_free (url);
+    if (!ok (status))
+        return -1;
+
+    object = json_loadb (rsp, rsp_size, 0, &jerror);
+    if (!object) {
+        seaf_warning ("Invalid head commit of repo %.8s: %s.\n",
+                      repo->repo_id, jerror.text);
+        goto out;
+    }
+    commit_id = json_string_value (json_object_get (object, "head_commit_id"));
+    if (commit_id && strlen (commit_id) == 40) {
+        memcpy (head, commit_id, 41);
+        ret = 0;
+    }
+    json_decref (object);
+
+out:
+    g_free (rsp);
+    return ret;
+}
+
+static int
+get_fs_id_list (LoadClient *client, LoadRepo *repo, GPtrArray *ids)
+{
+    char *url, *rsp = NULL;
+    gint64 rsp_size;
+    json_t *array;
+    json_error_t jerror;
+    const char *id;
+    int status, i;
+
+    url = g_strdup_printf ("%s/repo/%s/fs-id-list/?server-head=%s",
+                           params.server, repo->repo_id, repo->head);
+    status = do_request (client, EP_FS_ID_LIST, "GET", url, repo->token,
+                         NULL, 0, &rsp, &rsp_size);
+    g_free (url);
+    if (!ok (status))
+        return -1;
+
+    if (!ids) {
+        g_free (rsp);
+        return 0;
+    }
+
+    array = json_loadb (rsp, rsp_size, 0, &jerror);
+    g_free (rsp);
+    if (!array) {
+        seaf_warning ("Invalid fs id list of repo %.8s: %s.\n",
+                      repo->repo_id, jerror.text);
+        return -1;
+    }
+
+    for (i = 0; i < json_array_size (array) && ids->len < MAX_KEPT_IDS; ++i) {
+        id = json_string_value (json_array_get (array, i));
+        if (id)
+            g_ptr_array_add (ids, g_strdup (id));
+    }
+    json_decref (array);
+
+    return 0;
+}
+
+typedef struct ObjectHeader {
+    char obj_id[40];
+    guint32 obj_size;
+    guint8 object[0];
+} __attribute__((__packed__)) ObjectHeader;
+
+static void
+add_block_id (LoadRepo *repo, const unsigned char *sha1)
+{
+    char id[41];
+
+    if (repo->block_ids->len >= MAX_KEPT_IDS)
+        return;
+
+    rawdata_to_hex (sha1, id, 20);
+    g_ptr_array_add (repo->block_ids, g_strdup (id));
+}
+
+/* Collect the block ids of a file object, in any of the repo versions. */
+static void
+collect_block_ids (LoadRepo *repo, guint8 *data, int len)
+{
+    const guint8 *ptr = data;
+    guint8 *json_data = NULL;
+    int json_len, i, n;
+    json_t *object = NULL, *array;
+    const char *id;
+    unsigned char sha1[20];
+
+    if (repo->version >= 2) {
+        if (len < BINARY_FILE_HDR_SIZE || memcmp (data, BINARY_FILE_MAGIC, 4) != 0)
+            return;
+        ptr += 4 + 8;
+        n = get32bit (&ptr);
+        for (i = 0; i < n && BINARY_FILE_HDR_SIZE + (i + 1) * 20 <= len; ++i)
+            add_block_id (repo, ptr + i * 20);
+        return;
+    }
+
+    if (repo->version == 0) {
+        if (len < 12)
+            return;
+        if (get32bit (&ptr) != SEAF_METADATA_TYPE_FILE)
+            return;
+        ptr += 8;
+        for (i = 0; 12 + (i + 1) * 20 <= len; ++i)
+            add_block_id (repo, ptr + i * 20);
+        return;
+    }
+
+    if (seaf_decompress (data, len, &json_data, &json_len) < 0)
+        return;
+
+    object = json_loadb ((const char *)json_data, json_len, 0, NULL);
+    if (!object)
+        goto out;
+    if (json_integer_value (json_object_get (object, "type")) !=
+        SEAF_METADATA_TYPE_FILE)
+        goto out;
+
+    array = json_object_get (object, "block_ids");
+    for (i = 0; i < json_array_size (array); ++i) {
+        id = json_string_value (json_array_get (array, i));
+        if (id && hex_to_rawdata (id, sha1, 20) == 0)
+            add_block_id (repo, sha1);
+    }
+
+out:
+    if (object)
+        json_decref (object);
+    g_free (json_data);
+}
+
+/* Fetch @n fs objects from @start of @ids. When preparing, keep them. */
+static int
+pack_fs (LoadClient *client, LoadRepo *repo, GPtrArray *ids, int start, int n,
+         gboolean prepare)
+{
+    char *url, *body, *rsp = NULL;
+    gint64 rsp_size, off = 0;
+    ObjectHeader *hdr;
+    guint32 size;
+    int status;
+
+    url = g_strdup_printf ("%s/repo/%s/pack-fs/", params.server, repo->repo_id);
+    body = id_list_to_json (ids, start, n);
+    status = do_request (client, EP_PACK_FS, "POST", url, repo->token,
+                         body, strlen (body), &rsp, &rsp_size);
+    g_free (url);
+    free (body);
+    if (!ok (status))
+        return -1;
+
+    if (!prepare) {
+        g_free (rsp);
+        return 0;
+    }
+
+    while (off + sizeof(ObjectHeader) <= rsp_size) {
+        hdr = (ObjectHeader *)(rsp + off);
+        size = ntohl (hdr->obj_size);
+        if (off + sizeof(ObjectHeader) + size > rsp_size)
+            break;
+
+        collect_block_ids (repo, hdr->object, size);
+        if (repo->n_pack_objs < RECV_FS_OBJS) {
+            g_byte_array_append (repo->fs_pack, (guint8 *)hdr,
+                                 sizeof(ObjectHeader) + size);
+            ++repo->n_pack_objs;
+        }
+
+        off += sizeof(ObjectHeader) + size;
+    }
+
+    g_free (rsp);
+    return 0;
+}
+
+static int
+get_block (LoadClient *client, LoadRepo *repo, const char *block_id,
+           GByteArray **data)
+{
+    char *url, *rsp = NULL;
+    gint64 rsp_size;
+    int status;
+
+    url = g_strdup_printf ("%s/repo/%s/block/%s",
+                           params.server, repo->repo_id, block_id);
+    status = do_request (client, EP_GET_BLOCK, "GET", url, repo->token,
+                         NULL, 0, &rsp, &rsp_size);
+    g_free (url);
+    if (!ok (status))
+        return -1;
+
+    if (data) {
+        *data = g_byte_array_sized_new (rsp_size);
+        g_byte_array_append (*data, (guint8 *)rsp, rsp_size);
+    }
+    g_free (rsp);
+    return 0;
+}
+
+/*
+ * Read the head commit, fs ids, some fs objects and some blocks of @repo,
+ * for the clients to request and send back during the run.
+ */
+static int
+prepare_repo (LoadClient *client, LoadRepo *repo)
+{
+    char *url;
+    json_t *object;
+    GByteArray *block;
+    int status, i, n;
+
+    if (get_head_commit (client, repo, repo->head) < 0) {
+        seaf_warning ("Failed to get head commit of repo %.8s.\n", repo->repo_id);
+        return -1;
+    }
+
+    url = g_strdup_printf ("%s/repo/%s/commit/%s",
+                           params.server, repo->repo_id, repo->head);
+    status = do_request (client, EP_GET_COMMIT, "GET", url, repo->token,
+                         NULL, 0, &repo->commit, &repo->commit_len);
+    g_free (url);
+    if (!ok (status)) {
+        seaf_warning ("Failed to get commit %s.\n", repo->head);
+        return -1;
+    }
+
+    object = json_loadb (repo->commit, repo->commit_len, 0, NULL);
+    if (object) {
+        repo->version = json_integer_value (json_object_get (object,
+                                                             "version"));
+        json_decref (object);
+    }
+
+    if (get_fs_id_list (client, repo, repo->fs_ids) < 0) {
+        seaf_warning ("Failed to get fs id list of repo %.8s.\n", repo->repo_id);
+        return -1;
+    }
+
+    n = MIN (repo->fs_ids->len, PREPARE_OBJS);
+    for (i = 0; i < n; i += PACK_FS_BATCH) {
+        if (pack_fs (client, repo, repo->fs_ids, i,
+                     MIN (PACK_FS_BATCH, n - i), TRUE) < 0) {
+            seaf_warning ("Failed to get fs objects of repo %.8s.\n",
+                          repo->repo_id);
+            return -1;
+        }
+    }
+
+    for (i = 0; i < params.max_blocks && i < repo->block_ids->len; ++i) {
+        if (get_block (client, repo, g_ptr_array_index (repo->block_ids, i),
+                       &block) < 0) {
+            seaf_warning ("Failed to get block %s.\n",
+                          (char *)g_ptr_array_index (repo->block_ids, i));
+            return -1;
+        }
+        g_ptr_array_add (repo->blocks, block);
+    }
+
+    seaf_message ("Repo %.8s: version %d, %u fs ids, %u block ids, "
+                  "%u blocks kept.\n", repo->repo_id, repo->version,
+                  repo->fs_ids->len, repo->block_ids->len, repo->blocks->len);
+
+    return 0;
+}
+
+static void
+run_poll (LoadClient *client)
+{
+    LoadRepo *repo;
+    json_t *array, *object;
+    char *url, *body;
+    int i;
+
+    array = json_array ();
+    for (i = 0; i < repos->len && i < MAX_POLL_REPOS; ++i) {
+        repo = g_ptr_array_index (repos, i);
+        object = json_object ();
+        json_object_set_new (object, "repo_id", json_string (repo->repo_id));
+        json_object_set_new (object, "token", json_string (repo->token));
+        json_array_append_new (array, object);
+    }
+    body = json_dumps (array, 0);
+    json_decref (array);
+
+    /* The tokens are in the body, the header is only sent along. */
+    repo = g_ptr_array_index (repos, 0);
+    url = g_strdup_printf ("%s/repo/head-commits-multi/", params.server);
+    do_request (client, EP_HEAD_COMMITS_MULTI, "POST", url, repo->token,
+                body, strlen (body), NULL, NULL);
+
+    g_free (url);
+    free (body);
+}
+
+static int
+random_start (LoadClient *client, guint len, int n)
+{
+    if (len <= n)
+        return 0;
+    return g_rand_int_range (client->rand, 0, len - n + 1);
+}
+
+static void
+run_download (LoadClient *client, LoadRepo *repo)
+{
+    char head[41];
+    char *url;
+    int start, n, i;
+
+    if (get_head_commit (client, repo, head) < 0)
+        return;
+
+    url = g_strdup_printf ("%s/repo/%s/commit/%s",
+                           params.server, repo->repo_id, repo->head);
+    if (!ok (do_request (client, EP_GET_COMMIT, "GET", url, repo->token,
+                         NULL, 0, NULL, NULL))) {
+        g_free (url);
+        return;
+    }
+    g_free (url);
+
+    if (get_fs_id_list (client, repo, NULL) < 0)
+        return;
+
+    n = MIN (params.max_objs, repo->fs_ids->len);
+    start = random_start (client, repo->fs_ids->len, n);
+    for (i = 0; i < n; i += PACK_FS_BATCH) {
+        if (pack_fs (client, repo, repo->fs_ids, start + i,
+                     MIN (PACK_FS_BATCH, n - i), FALSE) < 0)
+            return;
+    }
+
+    n = MIN (params.max_blocks, repo->block_ids->len);
+    start = random_start (client, repo->block_ids->len, n);
+    for (i = 0; i < n; ++i) {
+        if (get_block (client, repo,
+                       g_ptr_array_index (repo->block_ids, start + i), NULL) < 0)
+            return;
+    }
+}
+
+static int
+check_ids (LoadClient *client, LoadRepo *repo, Endpoint ep,
+           const char *path, GPtrArray *ids, int start, int n)
+{
+    char *url, *body;
+    int status;
+
+    url = g_strdup_printf ("%s/repo/%s/%s/", params.server, repo->repo_id, path);
+    body = id_list_to_json (ids, start, n);
+    status = do_request (client, ep, "POST", url, repo->token,
+                         body, strlen (body), NULL, NULL);
+    g_free (url);
+    free (body);
+
+    return ok (status) ? 0 : -1;
+}
+
+static void
+run_upload (LoadClient *client, LoadRepo *repo)
+{
+    GByteArray *block;
+    char *url;
+    int start, n, i;
+
+    url = g_strdup_printf ("%s/repo/%s/commit/%s",
+                           params.server, repo->repo_id, repo->head);
+    if (!ok (do_request (client, EP_PUT_COMMIT, "PUT", url, repo->token,
+                         repo->commit, repo->commit_len, NULL, NULL))) {
+        g_free (url);
+        return;
+    }
+    g_free (url);
+
+    n = MIN (params.max_objs, repo->fs_ids->len);
+    start = random_start (client, repo->fs_ids->len, n);
+    for (i = 0; i < n; i += ID_LIST_SEGMENT_N) {
+        if (check_ids (client, repo, EP_CHECK_FS, "check-fs", repo->fs_ids,
+                       start + i, MIN (ID_LIST_SEGMENT_N, n - i)) < 0)
+            return;
+    }
+
+    if (repo->fs_pack->len > 0) {
+        url = g_strdup_printf ("%s/repo/%s/recv-fs/",
+                               params.server, repo->repo_id);
+        i = do_request (client, EP_RECV_FS, "POST", url, repo->token,
+                        (char *)repo->fs_pack->data, repo->fs_pack->len,
+                        NULL, NULL);
+        g_free (url);
+        if (!ok (i))
+            return;
+    }
+
+    n = MIN (params.max_objs, repo->block_ids->len);
+    start = random_start (client, repo->block_ids->len, n);
+    for (i = 0; i < n; i += ID_LIST_SEGMENT_N) {
+        if (check_ids (client, repo, EP_CHECK_BLOCKS, "check-blocks",
+                       repo->block_ids, start + i,
+                       MIN (ID_LIST_SEGMENT_N, n - i)) < 0)
+            return;
+    }
+
+    for (i = 0; i < repo->blocks->len; ++i) {
+        block = g_ptr_array_index (repo->blocks, i);
+        url = g_strdup_printf ("%s/repo/%s/block/%s", params.server,
+                               repo->repo_id,
+                               (char *)g_ptr_array_index (repo->block_ids, i));
+        n = do_request (client, EP_PUT_BLOCK, "PUT", url, repo->token,
+                        (char *)block->data, block->len, NULL, NULL);
+        g_free (url);
+        if (!ok (n))
+            return;
+    }
+}
+
+static Scenario
+pick_scenario (LoadClient *client)
+{
+    int total = 0, r, i;
+
+    for (i = 0; i < N_SCENARIOS; ++i)
+        total += params.mix[i];
+
+    r = g_rand_int_range (client->rand, 0, total);
+    for (i = 0; i < N_SCENARIOS - 1; ++i) {
+        if (r < params.mix[i])
+            break;
+        r -= params.mix[i];
+    }
+    return i;
+}
+
+/* Sleep for an exponentially distributed time, but not past the end. */
+static void
+think (LoadClient *client)
+{
+    gint64 usec, left;
+
+    if (params.think_time <= 0)
+        return;
+
+    usec = (gint64)(-log (1.0 - g_rand_double (client->rand)) *
+                    params.think_time * 1000);
+    left = deadline - get_current_time ();
+    if (usec > left)
+        usec = left;
+    if (usec > 0)
+        g_usleep (usec);
+}
+
+static void *
+client_thread (void *vclient)
+{
+    LoadClient *client = vclient;
+    LoadRepo *repo;
+    Scenario scenario;
+
+    /* Spread the first requests of the clients over a think time. */
+    think (client);
+
+    while (get_current_time () < deadline) {
+        scenario = pick_scenario (client);
+        repo = g_ptr_array_index (repos, g_rand_int_range (client->rand, 0,
+                                                           repos->len));
+        switch (scenario) {
+        case SCENARIO_POLL:
+            run_poll (client);
+            break;
+        case SCENARIO_DOWNLOAD:
+            run_download (client, repo);
+            break;
+        case SCENARIO_UPLOAD:
+            run_upload (client, repo);
+            break;
+        default:
+            break;
+        }
+        ++client->scenarios[scenario];
+
+        think (client);
+    }
+
+    return NULL;
+}
+
+static LoadClient *
+load_client_new (int index)
+{
+    LoadClient *client = g_new0 (LoadClient, 1);
+    int i;
+
+    client->index = index;
+    client->curl = curl_easy_init ();
+    client->rand = g_rand_new_with_seed (index);
+    for (i = 0; i < N_ENDPOINTS; ++i)
+        client->stats[i].latencies = g_array_new (FALSE, FALSE, sizeof(gint64));
+
+    return client;
+}
+
+static void
+load_client_free (LoadClient *client)
+{
+    int i;
+
+    curl_easy_cleanup (client->curl);
+    g_rand_free (client->rand);
+    for (i = 0; i < N_ENDPOINTS; ++i)
+        g_array_free (client->stats[i].latencies, TRUE);
+    g_free (client);
+}
+
+static LoadRepo *
+load_repo_new (const char *repo_id, const char *token)
+{
+    LoadRepo *repo;
+
+    if (!is_uuid_valid (repo_id)) {
+        seaf_warning ("Invalid repo id %s.\n", repo_id);
+        return NULL;
+    }
+
+    repo = g_new0 (LoadRepo, 1);
+    memcpy (repo->repo_id, repo_id, 36);
+    repo->token = g_strdup (token);
+    repo->fs_ids = g_ptr_array_new ();
+    repo->fs_pack = g_byte_array_new ();
+    repo->block_ids = g_ptr_array_new ();
+    repo->blocks = g_ptr_array_new ();
+
+    return repo;
+}
+
+/* Lines of "<repo id> <token>". */
+static int
+load_repo_file (const char *path)
+{
+    char *content = NULL;
+    char **lines, **fields;
+    LoadRepo *repo;
+    GError *error = NULL;
+    int i, ret = 0;
+
+    if (!g_file_get_contents (path, &content, NULL, &error)) {
+        seaf_warning ("Failed to read %s: %s.\n", path, error->message);
+        g_clear_error (&error);
+        return -1;
+    }
+
+    lines = g_strsplit (content, "\n", -1);
+    for (i = 0; lines[i]; ++i) {
+        g_strstrip (lines[i]);
+        if (lines[i][0] == '\0' || lines[i][0] == '#')
+            continue;
+
+        fields = g_strsplit_set (lines[i], " \t", 2);
+        if (!fields[0] || !fields[1]) {
+            seaf_warning ("Bad line in %s: %s.\n", path, lines[i]);
+            g_strfreev (fields);
+            ret = -1;
+            break;
+        }
+        g_strstrip (fields[1]);
+        repo = load_repo_new (fields[0], fields[1]);
+        g_strfreev (fields);
+        if (!repo) {
+            ret = -1;
+            break;
+        }
+        g_ptr_array_add (repos, repo);
+    }
+
+    g_strfreev (lines);
+    g_free (content);
+    return ret;
+}
+
+/* "poll=70,download=20,upload=10", scenarios left out get no weight. */
+static int
+parse_mix (const char *str)
+{
+    char **parts, **kv;
+    int i, j, total = 0, ret = 0;
+
+    memset (params.mix, 0, sizeof(params.mix));
+
+    parts = g_strsplit (str, ",", -1);
+    for (i = 0; parts[i] && ret == 0; ++i) {
+        kv = g_strsplit (parts[i], "=", 2);
+        ret = -1;
+        for (j = 0; kv[0] && kv[1] && j < N_SCENARIOS; ++j) {
+            if (strcmp (g_strstrip (kv[0]), scenario_names[j]) == 0) {
+                params.mix[j] = atoi (kv[1]);
+                if (params.mix[j] >= 0)
+                    ret = 0;
+                break;
+            }
+        }
+        g_strfreev (kv);
+    }
+    g_strfreev (parts);
+
+    for (i = 0; i < N_SCENARIOS; ++i)
+        total += params.mix[i];
+
+    return (ret == 0 && total > 0) ? 0 : -1;
+}
+
+static int
+cmp_latency (const void *a, const void *b)
+{
+    gint64 x = *(const gint64 *)a, y = *(const gint64 *)b;
+
+    return x < y ? -1 : (x > y ? 1 : 0);
+}
+
+static double
+percentile_ms (GArray *latencies, double p)
+{
+    guint i;
+
+    if (latencies->len == 0)
+        return 0;
+
+    i = (guint)(p * (latencies->len - 1) + 0.5);
+    return g_array_index (latencies, gint64, i) / 1000.0;
+}
+
+static void
+report (LoadClient **clients, double seconds)
+{
+    EndpointStats total[N_ENDPOINTS];
+    gint64 scenarios[N_SCENARIOS];
+    EndpointStats *stats, *src;
+    json_t *result, *endpoints, *object;
+    char *json;
+    int i, j;
+
+    memset (scenarios, 0, sizeof(scenarios));
+    for (j = 0; j < N_ENDPOINTS; ++j) {
+        memset (&total[j], 0, sizeof(EndpointStats));
+        total[j].latencies = g_array_new (FALSE, FALSE, sizeof(gint64));
+    }
+
+    for (i = 0; i < params.n_clients; ++i) {
+        for (j = 0; j < N_ENDPOINTS; ++j) {
+            src = &clients[i]->stats[j];
+            g_array_append_vals (total[j].latencies, src->latencies->data,
+                                 src->latencies->len);
+            total[j].errors += src->errors;
+            total[j].bytes += src->bytes;
+        }
+        for (j = 0; j < N_SCENARIOS; ++j)
+            scenarios[j] += clients[i]->scenarios[j];
+    }
+
+    result = json_object ();
+    json_object_set_new (result, "clients", json_integer (params.n_clients));
+    json_object_set_new (result, "seconds", json_real (seconds));
+
+    object = json_object ();
+    for (j = 0; j < N_SCENARIOS; ++j)
+        json_object_set_new (object, scenario_names[j],
+                             json_integer (scenarios[j]));
+    json_object_set_new (result, "scenarios", object);
+
+    printf ("%-20s %8s %7s %9s %9s %9s %9s %9s %9s\n",
+            "endpoint", "requests", "errors", "req/s", "MB/s",
+            "p50 ms", "p90 ms", "p99 ms", "max ms");
+
+    endpoints = json_object ();
+    for (j = 0; j < N_ENDPOINTS; ++j) {
+        stats = &total[j];
+        if (stats->latencies->len == 0)
+            continue;
+
+        g_array_sort (stats->latencies, cmp_latency);
+
+        printf ("%-20s %8u %7"G_GINT64_FORMAT" %9.1f %9.2f %9.1f %9.1f %9.1f %9.1f\n",
+                endpoint_names[j], stats->latencies->len, stats->errors,
+                stats->latencies->len / seconds,
+                stats->bytes / seconds / (1 << 20),
+                percentile_ms (stats->latencies, 0.5),
+                percentile_ms (stats->latencies, 0.9),
+                percentile_ms (stats->latencies, 0.99),
+                percentile_ms (stats->latencies, 1));
+
+        object = json_object ();
+        json_object_set_new (object, "requests",
+                             json_integer (stats->latencies->len));
+        json_object_set_new (object, "errors", json_integer (stats->errors));
+        json_object_set_new (object, "rps",
+                             json_real (stats->latencies->len / seconds));
+        json_object_set_new (object, "bytes", json_integer (stats->bytes));
+        json_object_set_new (object, "p50_ms",
+                             json_real (percentile_ms (stats->latencies, 0.5)));
+        json_object_set_new (object, "p90_ms",
+                             json_real (percentile_ms (stats->latencies, 0.9)));
+        json_object_set_new (object, "p99_ms",
+                             json_real (percentile_ms (stats->latencies, 0.99)));
+        json_object_set_new (object, "max_ms",
+                             json_real (percentile_ms (stats->latencies, 1)));
+        json_object_set_new (endpoints, endpoint_names[j], object);
+    }
+    json_object_set_new (result, "endpoints", endpoints);
+
+    json = json_dumps (result, JSON_COMPACT);
+    printf ("%s\n", json);
+    free (json);
+    json_decref (result);
+
+    for (j = 0; j < N_ENDPOINTS; ++j)
+        g_array_free (total[j].latencies, TRUE);
+}
+
+static const char *short_opts = "hs:f:r:t:n:d:T:m:o:b:k";
+static const struct option long_opts[] = {
+    { "help", no_argument, NULL, 'h', },
+    { "server", required_argument, NULL, 's', },
+    { "repo-file", required_argument, NULL, 'f', },
+    { "repo-id", required_argument, NULL, 'r', },
+    { "token", required_argument, NULL, 't', },
+    { "clients", required_argument, NULL, 'n', },
+    { "duration", required_argument, NULL, 'd', },
+    { "think-time", required_argument, NULL, 'T', },
+    { "mix", required_argument, NULL, 'm', },
+    { "objects", required_argument, NULL, 'o', },
+    { "blocks", required_argument, NULL, 'b', },
+    { "insecure", no_argument, NULL, 'k', },
+    { 0, 0, 0, 0, },
+};
+
+static void usage ()
+{
+    fprintf (stderr,
+             "usage: seaf-loadgen -s <server url> (-f <repo file> | -r <repo id> -t <token>)\n"
+             "           [-n clients] [-d seconds] [-T think time ms]\n"
+             "           [-m poll=70,download=20,upload=10]\n"
+             "           [-o fs objects] [-b blocks] [-k]\n"
+             "\n"
+             "The server url is the file server root, e.g. http://host:8082\n"
+             "or https://host/seafhttp. The repo file has one \"<repo id> <token>\"\n"
+             "per line; the tokens need write permission for uploads.\n");
+}
+
+int
+main (int argc, char *argv[])
+{
+    LoadClient **clients, *prepare;
+    char *repo_file = NULL, *repo_id = NULL, *token = NULL;
+    LoadRepo *repo;
+    gint64 start;
+    int c, i, ret = 0;
+
+    while ((c = getopt_long (argc, argv,
+                             short_opts, long_opts, NULL)) != EOF) {
+        switch (c) {
+        case 'h':
+            usage ();
+            exit (0);
+        case 's':
+            params.server = g_strdup (optarg);
+            break;
+        case 'f':
+            repo_file = g_strdup (optarg);
+            break;
+        case 'r':
+            repo_id = g_strdup (optarg);
+            break;
+        case 't':
+            token = g_strdup (optarg);
+            break;
+        case 'n':
+            params.n_clients = atoi (optarg);
+            break;
+        case 'd':
+            params.duration = atoi (optarg);
+            break;
+        case 'T':
+            params.think_time = atoi (optarg);
+            break;
+        case 'm':
+            if (parse_mix (optarg) < 0) {
+                usage ();
+                exit (-1);
+            }
+            break;
+        case 'o':
+            params.max_objs = atoi (optarg);
+            break;
+        case 'b':
+            params.max_blocks = atoi (optarg);
+            break;
+        case 'k':
+            params.insecure = TRUE;
+            break;
+        default:
+            usage ();
+            exit (-1);
+        }
+    }
+
+    if (!params.server || (!repo_file && (!repo_id || !token)) ||
+        params.n_clients < 1 || params.duration < 1 ||
+        params.max_objs < 0 || params.max_blocks < 0) {
+        usage ();
+        exit (-1);
+    }
+
+    /* No trailing slash, the paths are appended. */
+    i = strlen (params.server);
+    while (i > 0 && params.server[i - 1] == '/')
+        params.server[--i] = '\0';
+
+#if !GLIB_CHECK_VERSION(2, 35, 0)
+    g_type_init ();
+#endif
+
+    if (seafile_log_init ("-", "info", "debug") < 0) {
+        fprintf (stderr, "Failed to init log.\n");
+        exit (1);
+    }
+
+    curl_global_init (CURL_GLOBAL_ALL);
+
+    repos = g_ptr_array_new ();
+    if (repo_file) {
+        if (load_repo_file (repo_file) < 0)
+            exit (1);
+    }
+    if (repo_id && token) {
+        repo = load_repo_new (repo_id, token);
+        if (!repo)
+            exit (1);
+        g_ptr_array_add (repos, repo);
+    }
+    if (repos->len == 0) {
+        seaf_warning ("No repos to load.\n");
+        exit (1);
+    }
+
+    /* The requests made while preparing are not counted. */
+    prepare = load_client_new (-1);
+    for (i = 0; i < repos->len; ++i) {
+        if (prepare_repo (prepare, g_ptr_array_index (repos, i)) < 0)
+            exit (1);
+    }
+    load_client_free (prepare);
+
+    seaf_message ("Running %d clients on %u repos for %d seconds.\n",
+                  params.n_clients, repos->len, params.duration);
+
+    clients = g_new0 (LoadClient *, params.n_clients);
+    start = get_current_time ();
+    deadline = start + (gint64)params.duration * 1000000;
+
+    for (i = 0; i < params.n_clients; ++i) {
+        clients[i] = load_client_new (i);
+        if (pthread_create (&clients[i]->thread, NULL,
+                            client_thread, clients[i]) != 0) {
+            seaf_warning ("Failed to start client %d.\n", i);
+            load_client_free (clients[i]);
+            params.n_clients = i;
+            ret = 1;
+            break;
+        }
+    }
+
+    for (i = 0; i < params.n_clients; ++i)
+        pthread_join (clients[i]->thread, NULL);
+
+    report (clients, (get_current_time () - start) / 1e6);
+
+    for (i = 0; i < params.n_clients; ++i)
+        load_client_free (clients[i]);
+    g_free (clients);
+
+    curl_global_cleanup ();
+
+    return ret;
+}
@@ -17,10 +17,26 @@
 #define KEY_ALLOW_INVALID_WORKTREE "allow_invalid_worktree"
 #define KEY_ALLOW_REPO_NOT_FOUND_ON_SERVER "allow_repo_not_found_on_server"
 #define KEY_SYNC_EXTRA_TEMP_FILE "sync_extra_temp_file"
+/* Seconds without changes in a worktree before it's committed. */
+#define KEY_COMMIT_QUIET_PERIOD "commit_quiet_period"
+/* Files written at once when checking out, 1 to write them one by one. */
+#define KEY_CHECKOUT_THREADS "checkout_threads"
+/* Sync tasks that can run at the same time. */
+#define KEY_MAX_SYNC_TASKS "max_sync_tasks"
+/* Connections an upload or old-protocol download transfers blocks over. */
+#define KEY_BLOCK_TX_STREAMS "block_tx_streams"
+/* Blocks requested on a connection before the first one is done. */
+#define KEY_BLOCK_TX_WINDOW "block_tx_window"
+/* Milliseconds FSEvents collects worktree changes before reporting them. */
+#define KEY_FSEVENTS_LATENCY "fsevents_latency"
+/* Only report the dirs that changed on macOS, not the files. */
+#define KEY_FSEVENTS_DIR_EVENTS "fsevents_dir_events"
 
 /* Http sync settings. */
 #define KEY_ENABLE_HTTP_SYNC "enable_http_sync"
 #define KEY_DISABLE_VERIFY_CERTIFICATE "disable_verify_certificate"
+#define KEY_HTTP_MAX_ASYNC_REQUESTS "http_max_async_requests"
+#define KEY_HTTP_MAX_TRANSFER_REQUESTS "http_max_transfer_requests"
 
 /* Http sync proxy settings. */
 #define KEY_USE_PROXY "use_proxy"
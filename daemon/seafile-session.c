@@ -175,6 +175,7 @@ seafile_session_new(const char *seafile_dir,
     session->http_tx_mgr = http_tx_manager_new (session);
     if (!session->http_tx_mgr)
         goto onerror;
+    session->block_index = block_index_new (session);
 
     session->job_mgr = ccnet_job_manager_new (MAX_THREADS);
     session->ev_mgr = cevent_manager_new ();
@@ -22,6 +22,7 @@
 #include "mq-mgr.h"
 
 #include "http-tx-mgr.h"
+#include "block-index.h"
 
 #include <searpc-client.h>
 
@@ -69,6 +70,8 @@ struct _SeafileSession {
 
     HttpTxManager       *http_tx_mgr;
 
+    BlockIndex          *block_index;
+
     /* Set after all components are up and running. */
     gboolean             started;
 
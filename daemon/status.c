@@ -10,6 +10,7 @@
 #include "fs-mgr.h"
 #include "index/index.h"
 #include "diff-simple.h"
+#include "sync-paths.h"
 #include "vc-utils.h"
 #include "utils.h"
 #include "cdc/cdc.h"
@@ -326,6 +327,8 @@ wt_status_collect_changes_index (struct index_state *index,
 {
     SeafFSManager *fs_mgr;
     SeafCommit *head;
+    SyncPaths *sync_paths;
+    char root_id[41];
     int pos = 0;
     DiffEntry *de;
 
@@ -338,19 +341,30 @@ wt_status_collect_changes_index (struct index_state *index,
         return;
     }
 
+    /* The index only has the synced sub-folders, compare it with those. */
+    sync_paths = seaf_repo_get_active_sync_paths (repo);
+    if (sync_paths_graft_tree (sync_paths, repo->id, repo->version,
+                               head->root_id, EMPTY_SHA1, root_id) < 0) {
+        seaf_warning ("Failed to get synced folders of %s.\n", head->root_id);
+        sync_paths_free (sync_paths);
+        seaf_commit_unref (head);
+        return;
+    }
+    sync_paths_free (sync_paths);
+
     mark_all_ce_unused (index);
 
     /* if repo is initial, we don't need to check index changes */
-    if (strncmp(EMPTY_SHA1, head->root_id, 40) != 0) {
+    if (strncmp(EMPTY_SHA1, root_id, 40) != 0) {
         SeafDir *root;
 
         /* call diff_index to get status */
         root = seaf_fs_manager_get_seafdir (fs_mgr,
                                             repo->id,
                                             repo->version,
-                                            head->root_id);
+                                            root_id);
         if (!root) {
-            seaf_warning ("Failed to get root %s.\n", head->root_id);
+            seaf_warning ("Failed to get root %s.\n", root_id);
             seaf_commit_unref (head);
             return;
         }
@@ -31,10 +31,15 @@
 #include "log.h"
 
 #define DEFAULT_SYNC_INTERVAL 30 /* 30s */
+#define DEFAULT_COMMIT_QUIET_PERIOD 2 /* 2s */
 #define CHECK_SYNC_INTERVAL  1000 /* 1s */
 #define UPDATE_TX_STATE_INTERVAL 1000 /* 1s */
-#define MAX_RUNNING_SYNC_TASKS 5
-#define CHECK_LOCKED_FILES_INTERVAL 10 /* 10s */
+#define DEFAULT_MAX_RUNNING_SYNC_TASKS 5
+/* Repos are checked at least this often, e.g. to notice a removed worktree. */
+#define MAX_IDLE_CHECK_INTERVAL 10 /* 10s */
+/* A file that is still locked is checked again after twice the wait. */
+#define MIN_LOCKED_FILE_RETRY 10 /* 10s */
+#define MAX_LOCKED_FILE_RETRY 600 /* 10min */
 #define CHECK_FOLDER_PERMS_INTERVAL 30 /* 30s */
 
 enum {
@@ -61,9 +66,39 @@ struct _HttpServerState {
     gboolean folder_perms_not_supported;
     gint64 last_check_perms_time;
     gboolean checking_folder_perms;
+
+    /* Head commits of the repos on this server, fetched in one request
+     * every sync interval. Entries are removed once used.
+     */
+    GHashTable *head_commits;
+    gint64 last_check_heads_time;
+    gboolean checking_heads;
+
+    /* Long poll for head changes, see watch_head_commits(). */
+    gboolean watching_heads;
+    gboolean has_heads_cursor;
+    gint64 heads_cursor;
+    gint64 last_watch_fail_time;
 };
 typedef struct _HttpServerState HttpServerState;
 
+/* Server protocol version with head-commits-multi. */
+#define HEAD_COMMITS_MULTI_PROTO_VERSION 4
+/* Server protocol version with head-commits-watch. */
+#define HEAD_COMMITS_WATCH_PROTO_VERSION 7
+/* Seconds before watching a server again after a failure. */
+#define WATCH_RETRY_INTERVAL 30
+/* The server takes at most this many repos per request. */
+#define MAX_HEAD_COMMITS_MULTI 1000
+
+/* When a repo is next checked for sync. */
+typedef struct SyncDeadline {
+    gint64 time;
+    /* Repos due at the same time are checked in the order they were queued. */
+    guint64 seq;
+    char repo_id[37];
+} SyncDeadline;
+
 struct _SeafSyncManagerPriv {
     struct CcnetTimer *check_sync_timer;
     struct CcnetTimer *update_tx_state_timer;
@@ -74,6 +109,18 @@ struct _SeafSyncManagerPriv {
 
     GHashTable *active_paths;
     pthread_mutex_t paths_lock;
+    /* Bumped on every change of a path's sync status, under paths_lock. */
+    int status_serial;
+
+    /*
+     * A min-heap of SyncDeadline. A repo's entry is current if its time is
+     * the one in sched_times; entries left behind when a repo is woken up
+     * earlier are skipped when they come up.
+     */
+    GArray *sched_heap;
+    GHashTable *sched_times;    /* repo_id -> gint64 * */
+    guint64 sched_seq;
+    pthread_mutex_t sched_lock;
 
 #ifdef WIN32
     GAsyncQueue *refresh_paths;
@@ -82,9 +129,8 @@ struct _SeafSyncManagerPriv {
 };
 
 struct _ActivePathsInfo {
-    GHashTable *paths;
-    struct SyncStatusTree *syncing_tree;
-    struct SyncStatusTree *synced_tree;
+    struct SyncStatusTree *tree;
+    int version;                /* status_serial at the last change */
 };
 typedef struct _ActivePathsInfo ActivePathsInfo;
 
@@ -158,6 +204,27 @@ seaf_sync_manager_new (SeafileSession *seaf)
     if (exists)
         mgr->upload_limit = upload_limit;
 
+    int quiet_period = seafile_session_config_get_int (seaf,
+                                                       KEY_COMMIT_QUIET_PERIOD,
+                                                       &exists);
+    if (exists && quiet_period >= 0)
+        mgr->commit_quiet_period = quiet_period;
+    else
+        mgr->commit_quiet_period = DEFAULT_COMMIT_QUIET_PERIOD;
+
+    int max_tasks = seafile_session_config_get_int (seaf,
+                                                    KEY_MAX_SYNC_TASKS,
+                                                    &exists);
+    if (exists && max_tasks > 0)
+        mgr->max_running_tasks = max_tasks;
+    else
+        mgr->max_running_tasks = DEFAULT_MAX_RUNNING_SYNC_TASKS;
+
+    mgr->priv->sched_heap = g_array_new (FALSE, FALSE, sizeof(SyncDeadline));
+    mgr->priv->sched_times = g_hash_table_new_full (g_str_hash, g_str_equal,
+                                                    g_free, g_free);
+    pthread_mutex_init (&mgr->priv->sched_lock, NULL);
+
     mgr->priv->active_paths = g_hash_table_new_full (g_str_hash, g_str_equal,
                                                      g_free,
                                                      (GDestroyNotify)active_paths_info_free);
@@ -189,6 +256,145 @@ seaf_sync_manager_get_sync_info (SeafSyncManager *mgr,
     return g_hash_table_lookup (mgr->sync_infos, repo_id);
 }
 
+static inline gboolean
+deadline_before (const SyncDeadline *a, const SyncDeadline *b)
+{
+    return a->time < b->time || (a->time == b->time && a->seq < b->seq);
+}
+
+static void
+sched_heap_push (GArray *heap, const SyncDeadline *dl)
+{
+    SyncDeadline *d;
+    guint i, parent;
+    SyncDeadline tmp;
+
+    g_array_append_vals (heap, dl, 1);
+    d = (SyncDeadline *)heap->data;
+
+    for (i = heap->len - 1; i > 0; i = parent) {
+        parent = (i - 1) / 2;
+        if (!deadline_before (&d[i], &d[parent]))
+            break;
+        tmp = d[i];
+        d[i] = d[parent];
+        d[parent] = tmp;
+    }
+}
+
+static void
+sched_heap_pop (GArray *heap)
+{
+    SyncDeadline *d = (SyncDeadline *)heap->data;
+    guint i, child, n;
+    SyncDeadline tmp;
+
+    n = heap->len - 1;
+    d[0] = d[n];
+    g_array_set_size (heap, n);
+
+    for (i = 0; (child = 2 * i + 1) < n; i = child) {
+        if (child + 1 < n && deadline_before (&d[child + 1], &d[child]))
+            ++child;
+        if (!deadline_before (&d[child], &d[i]))
+            break;
+        tmp = d[i];
+        d[i] = d[child];
+        d[child] = tmp;
+    }
+}
+
+/* Must be called with sched_lock held. */
+static void
+schedule_repo_at (SeafSyncManager *mgr, const char *repo_id, gint64 time)
+{
+    SeafSyncManagerPriv *priv = mgr->priv;
+    gint64 *cur = g_hash_table_lookup (priv->sched_times, repo_id);
+    SyncDeadline dl;
+
+    if (cur && *cur <= time)
+        return;
+
+    if (!cur) {
+        cur = g_new (gint64, 1);
+        g_hash_table_insert (priv->sched_times, g_strdup(repo_id), cur);
+    }
+    *cur = time;
+
+    dl.time = time;
+    dl.seq = priv->sched_seq++;
+    memcpy (dl.repo_id, repo_id, 37);
+    sched_heap_push (priv->sched_heap, &dl);
+}
+
+void
+seaf_sync_manager_wake_repo (SeafSyncManager *mgr,
+                             const char *repo_id,
+                             int delay)
+{
+    pthread_mutex_lock (&mgr->priv->sched_lock);
+    schedule_repo_at (mgr, repo_id, (gint64)time(NULL) + delay);
+    pthread_mutex_unlock (&mgr->priv->sched_lock);
+}
+
+/* When all repos are woken, e.g. at startup, they're checked at this rate
+ * rather than all at once. At startup a repo is also woken as soon as its
+ * worktree is watched.
+ */
+#define STARTUP_CHECKS_PER_SEC 10
+
+static void
+wake_all_repos (SeafSyncManager *mgr)
+{
+    GList *repos, *ptr;
+    SeafRepo *repo;
+    int i = 0;
+
+    repos = seaf_repo_manager_get_repo_list (seaf->repo_mgr, -1, -1);
+    for (ptr = repos; ptr; ptr = ptr->next) {
+        repo = ptr->data;
+        seaf_sync_manager_wake_repo (mgr, repo->id, i++ / STARTUP_CHECKS_PER_SEC);
+    }
+    g_list_free (repos);
+}
+
+/*
+ * Take the next repo due by @now into @repo_id. Returns FALSE if no repo
+ * is due yet.
+ */
+static gboolean
+pop_due_repo (SeafSyncManager *mgr, gint64 now, char *repo_id)
+{
+    SeafSyncManagerPriv *priv = mgr->priv;
+    SyncDeadline *top;
+    gint64 *cur;
+    gboolean ret = FALSE;
+
+    pthread_mutex_lock (&priv->sched_lock);
+
+    while (priv->sched_heap->len > 0) {
+        top = (SyncDeadline *)priv->sched_heap->data;
+        if (top->time > now)
+            break;
+
+        cur = g_hash_table_lookup (priv->sched_times, top->repo_id);
+        if (cur && *cur == top->time) {
+            memcpy (repo_id, top->repo_id, 37);
+            g_hash_table_remove (priv->sched_times, repo_id);
+            sched_heap_pop (priv->sched_heap);
+            ret = TRUE;
+            break;
+        }
+
+        /* The repo was woken up earlier than this. */
+        sched_heap_pop (priv->sched_heap);
+    }
+
+    pthread_mutex_unlock (&priv->sched_lock);
+
+    return ret;
+}
+
 int
 seaf_sync_manager_init (SeafSyncManager *mgr)
 {
@@ -413,6 +619,8 @@ seaf_sync_manager_start (SeafSyncManager *mgr)
 {
     add_repo_relays ();
 
+    wake_all_repos (mgr);
+
     mgr->priv->check_sync_timer = ccnet_timer_new (
         auto_sync_pulse, mgr, CHECK_SYNC_INTERVAL);
 
@@ -661,6 +869,7 @@ transition_sync_state (SyncTask *task, int new_state)
             new_state == SYNC_STATE_ERROR) {
             task->info->in_sync = FALSE;
             --(task->mgr->n_running_tasks);
+            seaf_sync_manager_wake_repo (task->mgr, task->info->repo_id, 0);
             if (new_state == SYNC_STATE_ERROR)
                 task->info->err_cnt++;
             else
@@ -711,6 +920,7 @@ seaf_sync_manager_set_task_error (SyncTask *task, int error)
         task->info->in_sync = FALSE;
         task->info->err_cnt++;
         --(task->mgr->n_running_tasks);
+        seaf_sync_manager_wake_repo (task->mgr, task->info->repo_id, 0);
 
 #if 0
         if (task->repo && error != SYNC_ERROR_RELAY_OFFLINE
@@ -1005,12 +1215,22 @@ check_fast_forward_with_limit (SeafRepo *repo,
                                gboolean *error)
 {
     CheckFFData data;
+    const char *stop_ids[2] = { last_uploaded, last_checkout };
+    int res;
+
+    *error = FALSE;
+
+    res = seaf_commit_manager_is_ancestor (seaf->commit_mgr,
+                                           repo->id, repo->version,
+                                           remote_id, local_id,
+                                           stop_ids, 2, TRUE);
+    if (res >= 0)
+        return (res == 1);
 
     memset (&data, 0, sizeof(data));
     memcpy (data.remote_id, remote_id, 40);
     memcpy (data.last_uploaded, last_uploaded, 40);
     memcpy (data.last_checkout, last_checkout, 40);
-    *error = FALSE;
 
     if (!seaf_commit_manager_traverse_commit_tree_truncated (seaf->commit_mgr,
                                                              repo->id,
@@ -1241,6 +1461,11 @@ remove_repo_blocks (void *vtask)
 #else
     GHashTable *block_hash;
 
+    if (!seaf_repo_manager_has_locked_files (seaf->repo_mgr, task->repo->id)) {
+        seaf_block_manager_remove_store (seaf->block_mgr, task->repo->id);
+        return vtask;
+    }
+
     block_hash = load_locked_files_blocks (task->repo->id);
     if (g_hash_table_size (block_hash) == 0) {
         g_hash_table_destroy (block_hash);
@@ -1451,8 +1676,11 @@ update_sync_status_v2 (SyncTask *task)
             seaf_repo_manager_del_repo (seaf->repo_mgr, repo);
         }
     } else {
-        /* If local head is the same as remote head, already in sync. */
-        if (strcmp (local->commit_id, info->head_commit) == 0) {
+        /* If local head is the same as remote head, already in sync.
+         * Unless other sub-folders were selected since the last checkout.
+         */
+        if (strcmp (local->commit_id, info->head_commit) == 0 &&
+            !seaf_repo_sync_paths_pending (repo)) {
             /* As long as the repo is synced with the server. All the local
              * blocks are not useful any more.
              */
@@ -1564,6 +1792,51 @@ check_head_commit_done (HttpHeadCommit *result, void *user_data)
     update_sync_status_v2 (task);
 }
 
+/*
+ * Take the head commit fetched for the repo by check_head_commits(), so
+ * that it's used at most once. Returns FALSE if there is none or it's
+ * too old.
+ */
+static gboolean
+take_fetched_head_commit (SeafSyncManager *mgr, SeafRepo *repo, char *head)
+{
+    HttpServerState *state;
+    char *fetched;
+    gboolean ret = FALSE;
+
+    if (!repo->server_url)
+        return FALSE;
+
+    state = g_hash_table_lookup (mgr->http_server_states, repo->server_url);
+    if (!state || !state->head_commits)
+        return FALSE;
+
+    fetched = g_hash_table_lookup (state->head_commits, repo->id);
+    if (!fetched)
+        return FALSE;
+
+    if ((gint64)time(NULL) - state->last_check_heads_time < mgr->sync_interval) {
+        memcpy (head, fetched, 41);
+        ret = TRUE;
+    }
+    g_hash_table_remove (state->head_commits, repo->id);
+
+    return ret;
+}
+
+static void
+use_fetched_head_commit (SyncTask *task, const char *head)
+{
+    HttpHeadCommit result;
+
+    memset (&result, 0, sizeof(result));
+    result.check_success = TRUE;
+    memcpy (result.head_commit, head, 40);
+
+    transition_sync_state (task, SYNC_STATE_INIT);
+    check_head_commit_done (&result, task);
+}
+
 static int
 check_head_commit_http (SyncTask *task)
 {
@@ -1763,9 +2036,10 @@ sync_repo (SeafSyncManager *manager, SeafRepo *repo)
             return 0;
         } else if (last_changed != 0 && status->last_check <= last_changed) {
             /* Commit and sync if the repo has been updated after the
-             * last check and is not updated for the last 2 seconds.
+             * last check and is not updated for the quiet period, so
+             * that files still being written are not committed.
              */
-            if (now - last_changed >= 2) {
+            if (now - last_changed >= manager->commit_quiet_period) {
                 start_sync (manager, repo, TRUE, FALSE, FALSE);
                 status->last_check = now;
                 wt_status_unref (status);
@@ -1775,7 +2049,7 @@ sync_repo (SeafSyncManager *manager, SeafRepo *repo)
         wt_status_unref (status);
     }
 
-    if (manager->n_running_tasks >= MAX_RUNNING_SYNC_TASKS)
+    if (manager->n_running_tasks >= manager->max_running_tasks)
         return -1;
 
     if (repo->last_sync_time > now - manager->sync_interval)
@@ -1857,9 +2131,10 @@ create_commit_from_event_queue (SeafSyncManager *manager, SeafRepo *repo,
             ret = TRUE;
         } else if (last_changed != 0 && status->last_check <= last_changed) {
             /* Commit and sync if the repo has been updated after the
-             * last check and is not updated for the last 2 seconds.
+             * last check and is not updated for the quiet period, so
+             * that files still being written are not committed.
              */
-            if (now - last_changed >= 2) {
+            if (now - last_changed >= manager->commit_quiet_period) {
                 task = create_sync_task_v2 (manager, repo, is_manual_sync, FALSE);
                 repo->create_partial_commit = TRUE;
                 commit_repo (task);
@@ -1880,7 +2155,7 @@ can_schedule_repo (SeafSyncManager *manager, SeafRepo *repo)
 
     return ((repo->last_sync_time == 0 ||
              repo->last_sync_time < now - manager->sync_interval) &&
-            manager->n_running_tasks < MAX_RUNNING_SYNC_TASKS);
+            manager->n_running_tasks < manager->max_running_tasks);
 }
 
 static int
@@ -1890,6 +2165,11 @@ sync_repo_v2 (SeafSyncManager *manager, SeafRepo *repo, gboolean is_manual_sync)
     SyncTask *task;
     int ret = 0;
     char *last_download = NULL;
+    char fetched_head[41];
+    gboolean has_fetched_head;
+
+    /* Any sync makes the fetched head stale, so always take it. */
+    has_fetched_head = take_fetched_head_commit (manager, repo, fetched_head);
 
     master = seaf_branch_manager_get_branch (seaf->branch_mgr, repo->id, "master");
     if (!master) {
@@ -1936,9 +2216,12 @@ sync_repo_v2 (SeafSyncManager *manager, SeafRepo *repo, gboolean is_manual_sync)
 
     if (is_manual_sync || can_schedule_repo (manager, repo)) {
         task = create_sync_task_v2 (manager, repo, is_manual_sync, FALSE);
-        if (task->http_sync)
-            check_head_commit_http (task);
-        else
+        if (task->http_sync) {
+            if (has_fetched_head && !is_manual_sync)
+                use_fetched_head_commit (task, fetched_head);
+            else
+                check_head_commit_http (task);
+        } else
             start_sync_repo_proc (manager, task);
     }
 
@@ -2207,15 +2490,6 @@ out:
     return ret;
 }
 
-gint
-cmp_repos_by_sync_time (gconstpointer a, gconstpointer b, gpointer user_data)
-{
-    const SeafRepo *repo_a = a;
-    const SeafRepo *repo_b = b;
-
-    return (repo_a->last_sync_time - repo_b->last_sync_time);
-}
-
 #ifdef WIN32
 
 static void
@@ -2248,10 +2522,6 @@ handle_locked_file_update (SeafRepo *repo, struct index_state *istate,
     SeafBranch *master = NULL;
     gboolean ret = TRUE;
 
-    /* File is still locked, do nothing. */
-    if (do_check_file_locked (path, repo->worktree))
-        return FALSE;
-
     seaf_debug ("Update previously locked file %s in repo %.8s.\n",
                 path, repo->id);
 
@@ -2335,10 +2605,6 @@ handle_locked_file_delete (SeafRepo *repo, struct index_state *istate,
     gboolean file_exists = TRUE;
     gboolean ret = TRUE;
 
-    /* File is still locked, do nothing. */
-    if (do_check_file_locked (path, repo->worktree))
-        return FALSE;
-
     seaf_debug ("Delete previously locked file %s in repo %.8s.\n",
                 path, repo->id);
 
@@ -2362,6 +2628,41 @@ out:
     return ret;
 }
 
+typedef struct LockedFileRetry {
+    gint64 next_check;
+    int wait;
+} LockedFileRetry;
+
+/* Whether @path is due for a check. */
+static gboolean
+locked_file_due (SeafRepo *repo, const char *path, gint64 now)
+{
+    LockedFileRetry *retry = g_hash_table_lookup (repo->locked_retries, path);
+
+    return (!retry || retry->next_check <= now);
+}
+
+/* Wait longer before checking @path, which is still locked, again. */
+static void
+back_off_locked_file (SeafRepo *repo, const char *path, gint64 now)
+{
+    LockedFileRetry *retry = g_hash_table_lookup (repo->locked_retries, path);
+
+    if (!retry) {
+        retry = g_new0 (LockedFileRetry, 1);
+        retry->wait = MIN_LOCKED_FILE_RETRY;
+        g_hash_table_insert (repo->locked_retries, g_strdup(path), retry);
+    } else {
+        retry->wait = MIN (retry->wait * 2, MAX_LOCKED_FILE_RETRY);
+    }
+    retry->next_check = now + retry->wait;
+}
+
+/*
+ * Handle the locked files of @repo that are due and no longer locked. Files
+ * still locked are retried with exponential backoff, and the repo is
+ * checked again when the first of them is due.
+ */
 static void *
 check_locked_files (void *vdata)
 {
@@ -2373,20 +2674,25 @@ check_locked_files (void *vdata)
     LockedFile *locked;
     char index_path[SEAF_PATH_MAX];
     struct index_state istate;
+    gboolean index_loaded = FALSE;
+    gint64 now = (gint64)time(NULL);
+    gint64 next = 0;
+    LockedFileRetry *retry;
 
     fset = seaf_repo_manager_get_locked_file_set (seaf->repo_mgr, repo->id);
 
-    if (g_hash_table_size (fset->locked_files) == 0) {
-        locked_file_set_free (fset);
-        return vdata;
+    if (!repo->locked_retries)
+        repo->locked_retries = g_hash_table_new_full (g_str_hash, g_str_equal,
+                                                      g_free, g_free);
+
+    /* Forget the files handled or removed elsewhere. */
+    g_hash_table_iter_init (&iter, repo->locked_retries);
+    while (g_hash_table_iter_next (&iter, &key, &value)) {
+        if (!locked_file_set_lookup (fset, key))
+            g_hash_table_iter_remove (&iter);
     }
 
     memset (&istate, 0, sizeof(istate));
-    snprintf (index_path, SEAF_PATH_MAX, "%s/%s", repo->manager->index_dir, repo->id);
-    if (read_index_from (&istate, index_path, repo->version) < 0) {
-        seaf_warning ("Failed to load index.\n");
-        return vdata;
-    }
 
     gboolean success;
     g_hash_table_iter_init (&iter, fset->locked_files);
@@ -2394,17 +2700,50 @@ check_locked_files (void *vdata)
         path = key;
         locked = value;
 
+        if (!locked_file_due (repo, path, now))
+            continue;
+
+        /* File is still locked, do nothing. */
+        if (do_check_file_locked (path, repo->worktree)) {
+            back_off_locked_file (repo, path, now);
+            continue;
+        }
+
         success = FALSE;
-        if (strcmp (locked->operation, LOCKED_OP_UPDATE) == 0)
+        if (strcmp (locked->operation, LOCKED_OP_UPDATE) == 0) {
+            /* Only updates need the index, so it's read when the first of
+             * them gets unlocked.
+             */
+            if (!index_loaded) {
+                snprintf (index_path, SEAF_PATH_MAX, "%s/%s",
+                          repo->manager->index_dir, repo->id);
+                if (read_index_from (&istate, index_path, repo->version) < 0) {
+                    seaf_warning ("Failed to load index.\n");
+                    back_off_locked_file (repo, path, now);
+                    break;
+                }
+                index_loaded = TRUE;
+            }
             success = handle_locked_file_update (repo, &istate, fset, path, locked);
-        else if (strcmp (locked->operation, LOCKED_OP_DELETE) == 0)
+        } else if (strcmp (locked->operation, LOCKED_OP_DELETE) == 0)
             success = handle_locked_file_delete (repo, &istate, fset, path, locked);
 
-        if (success)
+        if (success) {
+            g_hash_table_remove (repo->locked_retries, path);
             g_hash_table_iter_remove (&iter);
+        }
     }
 
-    discard_index (&istate);
+    g_hash_table_iter_init (&iter, repo->locked_retries);
+    while (g_hash_table_iter_next (&iter, &key, &value)) {
+        retry = value;
+        if (next == 0 || retry->next_check < next)
+            next = retry->next_check;
+    }
+    repo->next_check_locked_time = next;
+
+    if (index_loaded)
+        discard_index (&istate);
     locked_file_set_free (fset);
 
     return vdata;
@@ -2414,7 +2753,13 @@ static void
 check_locked_files_done (void *vdata)
 {
     SeafRepo *repo = vdata;
+    gint64 now = (gint64)time(NULL);
+
     repo->checking_locked_files = FALSE;
+
+    if (repo->next_check_locked_time != 0)
+        seaf_sync_manager_wake_repo (seaf->sync_mgr, repo->id,
+                                     (int)MAX (repo->next_check_locked_time - now, 1));
 }
 
 #endif
@@ -2536,6 +2881,219 @@ check_folder_permissions (SeafSyncManager *mgr, GList *repos)
     }
 }
 
+static gboolean
+is_repo_in_sync (gpointer key, gpointer value, gpointer user_data)
+{
+    SyncInfo *info = seaf_sync_manager_get_sync_info (seaf->sync_mgr, key);
+
+    return (info && info->in_sync);
+}
+
+static void
+check_head_commits_done (HttpHeadCommits *result, void *user_data)
+{
+    HttpServerState *server_state = user_data;
+
+    server_state->checking_heads = FALSE;
+
+    if (server_state->head_commits) {
+        g_hash_table_unref (server_state->head_commits);
+        server_state->head_commits = NULL;
+    }
+
+    /* Without a result the repos are checked one by one. */
+    if (result->success) {
+        server_state->head_commits = g_hash_table_ref (result->heads);
+        /* An upload during the request may have moved the head. */
+        g_hash_table_foreach_remove (server_state->head_commits,
+                                     is_repo_in_sync, NULL);
+    }
+    server_state->last_check_heads_time = (gint64)time(NULL);
+}
+
+static void
+check_head_commits_one_server (SeafSyncManager *mgr,
+                               const char *host,
+                               HttpServerState *server_state,
+                               GList *repos)
+{
+    GList *ptr;
+    SeafRepo *repo;
+    SyncInfo *info;
+    HttpHeadCommitReq *req;
+    GList *requests = NULL;
+    int n_requests = 0;
+
+    gint64 now = (gint64)time(NULL);
+
+    if (server_state->http_version < HEAD_COMMITS_MULTI_PROTO_VERSION ||
+        server_state->checking_heads)
+        return;
+
+    if (server_state->last_check_heads_time > 0 &&
+        now - server_state->last_check_heads_time < mgr->sync_interval)
+        return;
+
+    for (ptr = repos; ptr; ptr = ptr->next) {
+        repo = ptr->data;
+
+        if (!repo->head || !repo->token || !repo->auto_sync ||
+            repo->version == 0)
+            continue;
+
+        info = seaf_sync_manager_get_sync_info (mgr, repo->id);
+        if (info && info->in_sync)
+            continue;
+
+        if (g_strcmp0 (host, repo->server_url) != 0)
+            continue;
+
+        req = g_new0 (HttpHeadCommitReq, 1);
+        memcpy (req->repo_id, repo->id, 36);
+        req->token = g_strdup(repo->token);
+
+        requests = g_list_prepend (requests, req);
+        /* The rest are checked one by one. */
+        if (++n_requests == MAX_HEAD_COMMITS_MULTI)
+            break;
+    }
+
+    if (!requests)
+        return;
+
+    server_state->checking_heads = TRUE;
+
+    /* The requests list will be freed in http tx manager. */
+    http_tx_manager_check_head_commits (seaf->http_tx_mgr,
+                                        server_state->effective_host,
+                                        server_state->use_fileserver_port,
+                                        requests,
+                                        check_head_commits_done,
+                                        server_state);
+}
+
+/*
+ * Fetch the heads of all repos of a server at once, instead of one
+ * request per repo when it's scheduled for sync.
+ */
+static void
+check_head_commits (SeafSyncManager *mgr, GList *repos)
+{
+    GHashTableIter iter;
+    gpointer key, value;
+
+    if (!mgr->priv->auto_sync_enabled || !seaf->enable_http_sync)
+        return;
+
+    g_hash_table_iter_init (&iter, mgr->http_server_states);
+    while (g_hash_table_iter_next (&iter, &key, &value))
+        check_head_commits_one_server (mgr, key, value, repos);
+}
+
+static void
+watch_head_commits_done (HttpHeadWatch *result, void *user_data)
+{
+    HttpServerState *server_state = user_data;
+    GList *ptr;
+    char *repo_id;
+
+    server_state->watching_heads = FALSE;
+
+    if (!result->success) {
+        server_state->has_heads_cursor = FALSE;
+        server_state->last_watch_fail_time = (gint64)time(NULL);
+        return;
+    }
+
+    for (ptr = result->repo_ids; ptr; ptr = ptr->next) {
+        repo_id = ptr->data;
+        /* The head fetched before is out of date now. */
+        if (server_state->head_commits)
+            g_hash_table_remove (server_state->head_commits, repo_id);
+        seaf_sync_manager_wake_repo (seaf->sync_mgr, repo_id, 0);
+    }
+
+    server_state->heads_cursor = result->cursor;
+    server_state->has_heads_cursor = TRUE;
+}
+
+static void
+watch_head_commits_one_server (SeafSyncManager *mgr,
+                               const char *host,
+                               HttpServerState *server_state,
+                               GList *repos)
+{
+    GList *ptr;
+    SeafRepo *repo;
+    HttpHeadCommitReq *req;
+    GList *requests = NULL;
+    int n_requests = 0;
+
+    gint64 now = (gint64)time(NULL);
+
+    if (server_state->http_version < HEAD_COMMITS_WATCH_PROTO_VERSION ||
+        server_state->watching_heads)
+        return;
+
+    if (server_state->last_watch_fail_time > 0 &&
+        now - server_state->last_watch_fail_time < WATCH_RETRY_INTERVAL)
+        return;
+
+    for (ptr = repos; ptr; ptr = ptr->next) {
+        repo = ptr->data;
+
+        if (!repo->head || !repo->token || !repo->auto_sync ||
+            repo->version == 0)
+            continue;
+
+        if (g_strcmp0 (host, repo->server_url) != 0)
+            continue;
+
+        req = g_new0 (HttpHeadCommitReq, 1);
+        memcpy (req->repo_id, repo->id, 36);
+        req->token = g_strdup(repo->token);
+
+        requests = g_list_prepend (requests, req);
+        /* The rest are left to the polling. */
+        if (++n_requests == MAX_HEAD_COMMITS_MULTI)
+            break;
+    }
+
+    if (!requests)
+        return;
+
+    server_state->watching_heads = TRUE;
+
+    /* The requests list will be freed in http tx manager. */
+    http_tx_manager_watch_head_commits (seaf->http_tx_mgr,
+                                        server_state->effective_host,
+                                        server_state->use_fileserver_port,
+                                        server_state->has_heads_cursor,
+                                        server_state->heads_cursor,
+                                        requests,
+                                        watch_head_commits_done,
+                                        server_state);
+}
+
+/*
+ * Keep a long poll open to each server that supports it, so that repos
+ * changed on the server are synced right away instead of at their next
+ * check. The polling stays, for servers that miss some changes.
+ */
+static void
+watch_head_commits (SeafSyncManager *mgr, GList *repos)
+{
+    GHashTableIter iter;
+    gpointer key, value;
+
+    if (!mgr->priv->auto_sync_enabled || !seaf->enable_http_sync)
+        return;
+
+    g_hash_table_iter_init (&iter, mgr->http_server_states);
+    while (g_hash_table_iter_next (&iter, &key, &value))
+        watch_head_commits_one_server (mgr, key, value, repos);
+}
+
 static void
 print_active_paths (SeafSyncManager *mgr)
 {
@@ -2548,116 +3106,182 @@ print_active_paths (SeafSyncManager *mgr)
     }
 }
 
+/*
+ * Seconds until @repo needs another check, if nothing wakes it up earlier:
+ * when the changes in its worktree have been quiet long enough to commit,
+ * or when it's due for the periodic sync.
+ */
 static int
-auto_sync_pulse (void *vmanager)
+next_check_delay (SeafSyncManager *manager, SeafRepo *repo)
 {
-    SeafSyncManager *manager = vmanager;
-    GList *repos, *ptr;
-    SeafRepo *repo;
-    gint64 now;
+    SyncInfo *info = get_sync_info (manager, repo->id);
+    WTStatus *status;
+    gint now = (gint)time(NULL);
+    gint last_changed;
+    int delay = MAX_IDLE_CHECK_INTERVAL;
 
-    /* print_active_paths (manager); */
+    /* The repo is woken up when the task ends. */
+    if (info->in_sync)
+        return delay;
 
-    repos = seaf_repo_manager_get_repo_list (manager->seaf->repo_mgr, -1, -1);
+    status = seaf_wt_monitor_get_worktree_status (manager->seaf->wt_monitor,
+                                                  repo->id);
+    if (status) {
+        last_changed = g_atomic_int_get (&status->last_changed);
+        if (status->last_check == 0 || status->partial_commit)
+            delay = 1;
+        else if (last_changed != 0 && status->last_check <= last_changed)
+            delay = MAX (last_changed + manager->commit_quiet_period - now, 1);
+        wt_status_unref (status);
+    }
 
-    check_folder_permissions (manager, repos);
+    /* Also covers waiting for a running task to finish. */
+    delay = MIN (delay,
+                 MAX (repo->last_sync_time + manager->sync_interval + 1 - now, 1));
 
-    /* Sort repos by last_sync_time, so that we don't "starve" any repo. */
-    repos = g_list_sort_with_data (repos, cmp_repos_by_sync_time, NULL);
+    return delay;
+}
 
-    for (ptr = repos; ptr != NULL; ptr = ptr->next) {
-        repo = ptr->data;
+/* Check @repo for sync. Returns the seconds until the next check. */
+static int
+check_repo (SeafSyncManager *manager, SeafRepo *repo)
+{
+#ifdef WIN32
+    gint64 now;
+#endif
 
-        /* Every second, we'll check the worktree to see if it still exists.
-         * We'll invalidate worktree if it gets moved or deleted.
-         * But there is a hole here: If the user delete the worktree dir and
-         * recreate a dir with the same name within a second, we'll falsely
-         * see the worktree as valid. What's worse, the new worktree dir won't
-         * be monitored.
-         * This problem can only be solved by restart.
-         */
-        /* If repo has been checked out and the worktree doesn't exist,
-         * we'll delete the repo automatically.
-         */
+    /* We'll check the worktree to see if it still exists.
+     * We'll invalidate worktree if it gets moved or deleted.
+     * But there is a hole here: If the user delete the worktree dir and
+     * recreate a dir with the same name between two checks, we'll falsely
+     * see the worktree as valid. What's worse, the new worktree dir won't
+     * be monitored.
+     * This problem can only be solved by restart.
+     */
+    /* If repo has been checked out and the worktree doesn't exist,
+     * we'll delete the repo automatically.
+     */
 
-        if (repo->head != NULL) {
-            if (seaf_repo_check_worktree (repo) < 0) {
-                if (!repo->worktree_invalid) {
-                    // The repo worktree was valid, but now it's invalid
-                    seaf_repo_manager_invalidate_repo_worktree (seaf->repo_mgr, repo);
-                    if (!seafile_session_config_get_allow_invalid_worktree(seaf)) {
-                        auto_delete_repo (manager, repo);
-                    }
-                }
-                continue;
-            } else {
-                if (repo->worktree_invalid) {
-                    // The repo worktree was invalid, but now it's valid again,
-                    // so we start watch it
-                    seaf_repo_manager_validate_repo_worktree (seaf->repo_mgr, repo);
-                    continue;
+    if (repo->head != NULL) {
+        if (seaf_repo_check_worktree (repo) < 0) {
+            if (!repo->worktree_invalid) {
+                // The repo worktree was valid, but now it's invalid
+                seaf_repo_manager_invalidate_repo_worktree (seaf->repo_mgr, repo);
+                if (!seafile_session_config_get_allow_invalid_worktree(seaf)) {
+                    auto_delete_repo (manager, repo);
+                    return -1;
                 }
             }
+            return MAX_IDLE_CHECK_INTERVAL;
+        } else {
+            if (repo->worktree_invalid) {
+                // The repo worktree was invalid, but now it's valid again,
+                // so we start watch it
+                seaf_repo_manager_validate_repo_worktree (seaf->repo_mgr, repo);
+                return 1;
+            }
         }
+    }
 
-        repo->worktree_invalid = FALSE;
+    repo->worktree_invalid = FALSE;
 
-        if (!repo->token) {
-            /* If the user has logged out of the account, the repo token would
-             * be null */
-            seaf_debug ("repo token of %s (%.8s) is null, would not sync it\n", repo->name, repo->id);
-            continue;
-        }
+    if (!repo->token) {
+        /* If the user has logged out of the account, the repo token would
+         * be null */
+        seaf_debug ("repo token of %s (%.8s) is null, would not sync it\n", repo->name, repo->id);
+        return MAX_IDLE_CHECK_INTERVAL;
+    }
 
-        /* Don't sync repos not checked out yet. */
-        if (!repo->head)
-            continue;
+    /* Don't sync repos not checked out yet. */
+    if (!repo->head)
+        return 1;
 
-        if (!manager->priv->auto_sync_enabled || !repo->auto_sync)
-            continue;
+    if (!manager->priv->auto_sync_enabled || !repo->auto_sync)
+        return MAX_IDLE_CHECK_INTERVAL;
 
 #ifdef WIN32
-        if (repo->version > 0) {
-            if (repo->checking_locked_files)
-                continue;
-
-            now = (gint64)time(NULL);
-            if (repo->last_check_locked_time == 0 ||
-                now - repo->last_check_locked_time >= CHECK_LOCKED_FILES_INTERVAL)
-            {
-                repo->checking_locked_files = TRUE;
-                ccnet_job_manager_schedule_job (seaf->job_mgr,
-                                                check_locked_files,
-                                                check_locked_files_done,
-                                                repo);
-                repo->last_check_locked_time = now;
-
-            }
+    if (repo->version > 0) {
+        if (repo->checking_locked_files)
+            return 1;
+
+        now = (gint64)time(NULL);
+        if (now >= repo->next_check_locked_time &&
+            seaf_repo_manager_has_locked_files (seaf->repo_mgr, repo->id))
+        {
+            repo->checking_locked_files = TRUE;
+            ccnet_job_manager_schedule_job (seaf->job_mgr,
+                                            check_locked_files,
+                                            check_locked_files_done,
+                                            repo);
         }
+    }
 #endif
 
-        SyncInfo *info = get_sync_info (manager, repo->id);
+    SyncInfo *info = get_sync_info (manager, repo->id);
 
-        if (info->in_sync)
-            continue;
+    if (info->in_sync)
+        return MAX_IDLE_CHECK_INTERVAL;
 
-        if (repo->version > 0) {
-            /* For repo version > 0, only use http sync. */
-            if (seaf->enable_http_sync) {
-                if (check_http_protocol (manager, repo)) {
-                    sync_repo_v2 (manager, repo, FALSE);
-                }
-            }
-        } else {
-            /* If relay is not ready or protocol version is not determined,
-             * need to wait.
-             */
-            if (check_relay_status (manager, repo))
-                sync_repo (manager, repo);
-        }
+    if (repo->version > 0) {
+        /* For repo version > 0, only use http sync. */
+        if (!seaf->enable_http_sync)
+            return MAX_IDLE_CHECK_INTERVAL;
+        /* Wait for the protocol check. */
+        if (!check_http_protocol (manager, repo))
+            return 1;
+        sync_repo_v2 (manager, repo, FALSE);
+    } else {
+        /* If relay is not ready or protocol version is not determined,
+         * need to wait.
+         */
+        if (!check_relay_status (manager, repo))
+            return 1;
+        sync_repo (manager, repo);
     }
 
+    return next_check_delay (manager, repo);
+}
+
+/*
+ * Repos are kept in a heap by the time they're next checked, so that only
+ * the repos that are due are looked at. Worktree changes and finished sync
+ * tasks wake a repo up before its time.
+ */
+static int
+auto_sync_pulse (void *vmanager)
+{
+    SeafSyncManager *manager = vmanager;
+    GList *repos;
+    SeafRepo *repo;
+    char repo_id[37];
+    gint64 now;
+    int delay;
+
+    /* print_active_paths (manager); */
+
+    repos = seaf_repo_manager_get_repo_list (manager->seaf->repo_mgr, -1, -1);
+
+    check_folder_permissions (manager, repos);
+
+    check_head_commits (manager, repos);
+
+    watch_head_commits (manager, repos);
+
     g_list_free (repos);
+
+    now = (gint64)time(NULL);
+    while (pop_due_repo (manager, now, repo_id)) {
+        /* Deleted repos are dropped from the schedule here. */
+        repo = seaf_repo_manager_get_repo (seaf->repo_mgr, repo_id);
+        if (!repo)
+            continue;
+
+        delay = check_repo (manager, repo);
+        if (delay >= 0)
+            seaf_sync_manager_wake_repo (manager, repo_id,
+                                         MIN (delay, MAX_IDLE_CHECK_INTERVAL));
+    }
+
     return TRUE;
 }
 
@@ -2933,6 +3557,7 @@ seaf_sync_manager_enable_auto_sync (SeafSyncManager *mgr)
     enable_auto_sync_for_repos (mgr);
 
     mgr->priv->auto_sync_enabled = TRUE;
+    wake_all_repos (mgr);
     g_debug ("[sync mgr] auto sync is enabled\n");
     return 0;
 }
@@ -2951,9 +3576,7 @@ active_paths_info_new (SeafRepo *repo)
 {
     ActivePathsInfo *info = g_new0 (ActivePathsInfo, 1);
 
-    info->paths = g_hash_table_new_full (g_str_hash, g_str_equal, g_free, NULL);
-    info->syncing_tree = sync_status_tree_new (repo->worktree);
-    info->synced_tree = sync_status_tree_new (repo->worktree);
+    info->tree = sync_status_tree_new (repo->worktree);
 
     return info;
 }
@@ -2963,9 +3586,7 @@ active_paths_info_free (ActivePathsInfo *info)
 {
     if (!info)
         return;
-    g_hash_table_destroy (info->paths);
-    sync_status_tree_free (info->syncing_tree);
-    sync_status_tree_free (info->synced_tree);
+    sync_status_tree_free (info->tree);
     g_free (info);
 }
 
@@ -3003,31 +3624,10 @@ seaf_sync_manager_update_active_path (SeafSyncManager *mgr,
         g_hash_table_insert (mgr->priv->active_paths, g_strdup(repo_id), info);
     }
 
-    SyncStatus existing = (SyncStatus) g_hash_table_lookup (info->paths, path);
-    if (!existing) {
-        g_hash_table_insert (info->paths, g_strdup(path), (void*)status);
-        if (status == SYNC_STATUS_SYNCING)
-            sync_status_tree_add (info->syncing_tree, path, mode);
-        else if (status == SYNC_STATUS_SYNCED)
-            sync_status_tree_add (info->synced_tree, path, mode);
-        else {
-#ifdef WIN32
-            seaf_sync_manager_add_refresh_path (mgr, path);
-#endif
-        }
-    } else if (existing != status) {
-        g_hash_table_replace (info->paths, g_strdup(path), (void*)status);
-
-        if (existing == SYNC_STATUS_SYNCING)
-            sync_status_tree_del (info->syncing_tree, path);
-        else if (existing == SYNC_STATUS_SYNCED)
-            sync_status_tree_del (info->synced_tree, path);
-
-        if (status == SYNC_STATUS_SYNCING)
-            sync_status_tree_add (info->syncing_tree, path, mode);
-        else if (status == SYNC_STATUS_SYNCED)
-            sync_status_tree_add (info->synced_tree, path, mode);
-
+    /* The tree refreshes the dirs whose status changes. */
+    SyncStatus existing = sync_status_tree_set (info->tree, path, status);
+    if (existing != status) {
+        info->version = ++mgr->priv->status_serial;
 #ifdef WIN32
         seaf_sync_manager_add_refresh_path (mgr, path);
 #endif
@@ -3056,9 +3656,8 @@ seaf_sync_manager_delete_active_path (SeafSyncManager *mgr,
         return;
     }
 
-    g_hash_table_remove (info->paths, path);
-    sync_status_tree_del (info->syncing_tree, path);
-    sync_status_tree_del (info->synced_tree, path);
+    if (sync_status_tree_del (info->tree, path) != SYNC_STATUS_NONE)
+        info->version = ++mgr->priv->status_serial;
 
     pthread_mutex_unlock (&mgr->priv->paths_lock);
 }
@@ -3095,15 +3694,15 @@ seaf_sync_manager_get_path_sync_status (SeafSyncManager *mgr,
         goto out;
     }
 
-    ret = (SyncStatus) g_hash_table_lookup (info->paths, path);
+    ret = sync_status_tree_get (info->tree, path);
     if (is_dir && (ret == SYNC_STATUS_NONE)) {
-        /* If a dir is not in the syncing tree but in the synced tree,
-         * it's synced. Otherwise if it's in the syncing tree, some files
-         * under it must be syncing, so it should be in syncing status too.
+        /* If no path under a dir is syncing but some are synced,
+         * it's synced. Otherwise if some files under it are syncing,
+         * it should be in syncing status too.
          */
-        if (sync_status_tree_exists (info->syncing_tree, path))
+        if (sync_status_tree_has_status (info->tree, path, SYNC_STATUS_SYNCING))
             ret = SYNC_STATUS_SYNCING;
-        else if (sync_status_tree_exists (info->synced_tree, path))
+        else if (sync_status_tree_has_status (info->tree, path, SYNC_STATUS_SYNCED))
             ret = SYNC_STATUS_SYNCED;
     }
 
@@ -3113,29 +3712,85 @@ out:
     return g_strdup(path_status_tbl[ret]);
 }
 
-static json_t *
-active_paths_to_json (GHashTable *paths)
+static void
+child_status_to_json (const char *name, int status, void *data)
 {
-    json_t *array = NULL, *obj = NULL;
-    GHashTableIter iter;
-    gpointer key, value;
-    char *path;
-    SyncStatus status;
+    json_t *object = data;
 
-    array = json_array ();
+    json_object_set_new (object, name, json_string(path_status_tbl[status]));
+}
 
-    g_hash_table_iter_init (&iter, paths);
-    while (g_hash_table_iter_next (&iter, &key, &value)) {
-        path = key;
-        status = (SyncStatus)value;
+char *
+seaf_sync_manager_get_dir_sync_status_json (SeafSyncManager *mgr,
+                                            const char *repo_id,
+                                            const char *dir)
+{
+    ActivePathsInfo *info;
+    json_t *object, *children;
+    int version = 0;
+    char *ret;
 
-        obj = json_object ();
-        json_object_set (obj, "path", json_string(path));
-        json_object_set (obj, "status", json_string(path_status_tbl[status]));
+    children = json_object ();
 
-        json_array_append (array, obj);
+    pthread_mutex_lock (&mgr->priv->paths_lock);
+
+    info = g_hash_table_lookup (mgr->priv->active_paths, repo_id);
+    if (info) {
+        sync_status_tree_foreach_child (info->tree, dir,
+                                        child_status_to_json, children);
+        version = info->version;
     }
 
+    pthread_mutex_unlock (&mgr->priv->paths_lock);
+
+    object = json_object ();
+    json_object_set_new (object, "version", json_integer(version));
+    json_object_set_new (object, "children", children);
+
+    ret = json_dumps (object, JSON_COMPACT);
+    json_decref (object);
+
+    return ret;
+}
+
+int
+seaf_sync_manager_get_sync_status_version (SeafSyncManager *mgr,
+                                           const char *repo_id)
+{
+    ActivePathsInfo *info;
+    int version = 0;
+
+    pthread_mutex_lock (&mgr->priv->paths_lock);
+
+    info = g_hash_table_lookup (mgr->priv->active_paths, repo_id);
+    if (info)
+        version = info->version;
+
+    pthread_mutex_unlock (&mgr->priv->paths_lock);
+
+    return version;
+}
+
+static void
+active_path_to_json (const char *path, int status, void *data)
+{
+    json_t *array = data;
+    json_t *obj;
+
+    obj = json_object ();
+    json_object_set (obj, "path", json_string(path));
+    json_object_set (obj, "status", json_string(path_status_tbl[status]));
+
+    json_array_append (array, obj);
+}
+
+static json_t *
+active_paths_to_json (struct SyncStatusTree *tree)
+{
+    json_t *array = json_array ();
+
+    sync_status_tree_foreach (tree, active_path_to_json, array);
+
     return array;
 }
 
@@ -3159,7 +3814,7 @@ seaf_sync_manager_list_active_paths_json (SeafSyncManager *mgr)
         info = value;
 
         obj = json_object();
-        path_array = active_paths_to_json (info->paths);
+        path_array = active_paths_to_json (info->tree);
         json_object_set (obj, "repo_id", json_string(repo_id));
         json_object_set (obj, "paths", path_array);
 
@@ -3189,7 +3844,7 @@ seaf_sync_manager_active_paths_number (SeafSyncManager *mgr)
     g_hash_table_iter_init (&iter, mgr->priv->active_paths);
     while (g_hash_table_iter_next (&iter, &key, &value)) {
         info = value;
-        ret += g_hash_table_size(info->paths);
+        ret += sync_status_tree_size (info->tree);
     }
 
     return ret;
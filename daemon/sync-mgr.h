@@ -105,8 +105,10 @@ struct _SeafSyncManager {
 
     GHashTable *sync_infos;
     int         n_running_tasks;
+    int         max_running_tasks;
     gboolean    commit_job_running;
     int         sync_interval;
+    int         commit_quiet_period;
 
     GHashTable *server_states;
     GHashTable *http_server_states;
@@ -154,6 +156,15 @@ seaf_sync_manager_enable_auto_sync (SeafSyncManager *mgr);
 int
 seaf_sync_manager_is_auto_sync_enabled (SeafSyncManager *mgr);
 
+/*
+ * Have @repo_id checked for sync in @delay seconds, or sooner if it's
+ * already due earlier. Can be called from any thread.
+ */
+void
+seaf_sync_manager_wake_repo (SeafSyncManager *mgr,
+                             const char *repo_id,
+                             int delay);
+
 const char *
 sync_error_to_str (int error);
 
@@ -178,6 +189,26 @@ seaf_sync_manager_get_path_sync_status (SeafSyncManager *mgr,
                                         const char *path,
                                         gboolean is_dir);
 
+/*
+ * The status of all children of @dir with a status, as a JSON object of
+ * {"version": N, "children": {name: status, ...}}. Children not listed have
+ * no status. The version changes whenever a status in the repo changes,
+ * see seaf_sync_manager_get_sync_status_version().
+ */
+char *
+seaf_sync_manager_get_dir_sync_status_json (SeafSyncManager *mgr,
+                                            const char *repo_id,
+                                            const char *dir);
+
+/*
+ * A number that changes whenever the sync status of a path in @repo_id
+ * changes, so that callers can tell if statuses they got are still
+ * current with a single cheap call.
+ */
+int
+seaf_sync_manager_get_sync_status_version (SeafSyncManager *mgr,
+                                           const char *repo_id);
+
 char *
 seaf_sync_manager_list_active_paths_json (SeafSyncManager *mgr);
 
@@ -0,0 +1,371 @@
+/* -*- Mode: C; tab-width: 4; indent-tabs-mode: nil; c-basic-offset: 4 -*- */
+
+#include "common.h"
+
+#include "seafile-session.h"
+#include "sync-paths.h"
+#include "log.h"
+
+/* TRUE if @path is @dir or under it. */
+static gboolean
+is_under (const char *path, const char *dir)
+{
+    int len = strlen (dir);
+
+    return (strncmp (path, dir, len) == 0 &&
+            (path[len] == '\0' || path[len] == '/'));
+}
+
+/*
+ * Strip the white space and slashes around @line. Returns NULL for a
+ * blank line or a bad path, and "" for the root.
+ */
+static char *
+normalize_path (const char *line)
+{
+    char *path, *p, *end;
+    char **parts;
+    int i;
+
+    path = g_strstrip (g_strdup (line));
+    if (path[0] == '\0') {
+        g_free (path);
+        return NULL;
+    }
+
+    for (p = path; *p == '/'; ++p)
+        ;
+    end = p + strlen (p);
+    while (end > p && end[-1] == '/')
+        --end;
+    *end = '\0';
+    memmove (path, p, end - p + 1);
+
+    parts = g_strsplit (path, "/", -1);
+    for (i = 0; parts[i] != NULL; ++i) {
+        if (path[0] != '\0' &&
+            (parts[i][0] == '\0' || strcmp (parts[i], ".") == 0 ||
+             strcmp (parts[i], "..") == 0)) {
+            seaf_warning ("Bad sync path %s.\n", line);
+            g_free (path);
+            path = NULL;
+            break;
+        }
+    }
+    g_strfreev (parts);
+
+    return path;
+}
+
+static gint
+compare_paths (gconstpointer a, gconstpointer b)
+{
+    return strcmp (*(char **)a, *(char **)b);
+}
+
+/* Takes the paths in @array, keeping the ones not under another. */
+static SyncPaths *
+paths_from_array (GPtrArray *array)
+{
+    SyncPaths *paths = g_new0 (SyncPaths, 1);
+    char *path;
+    guint i;
+    int j;
+
+    g_ptr_array_sort (array, compare_paths);
+
+    paths->paths = g_new0 (char *, array->len + 1);
+    for (i = 0; i < array->len; ++i) {
+        path = g_ptr_array_index (array, i);
+        for (j = 0; j < paths->n_paths; ++j)
+            if (is_under (path, paths->paths[j]))
+                break;
+        if (j < paths->n_paths)
+            g_free (path);
+        else
+            paths->paths[paths->n_paths++] = path;
+    }
+    g_ptr_array_free (array, TRUE);
+
+    return paths;
+}
+
+SyncPaths *
+sync_paths_parse (const char *value)
+{
+    GPtrArray *array;
+    char **lines, *path;
+    gboolean whole = FALSE;
+    int i;
+
+    if (!value)
+        return NULL;
+
+    array = g_ptr_array_new_with_free_func (g_free);
+    lines = g_strsplit (value, "\n", -1);
+    for (i = 0; lines[i] != NULL; ++i) {
+        path = normalize_path (lines[i]);
+        if (!path)
+            continue;
+        if (path[0] == '\0') {
+            g_free (path);
+            whole = TRUE;
+            break;
+        }
+        g_ptr_array_add (array, path);
+    }
+    g_strfreev (lines);
+
+    if (whole || array->len == 0) {
+        g_ptr_array_free (array, TRUE);
+        return NULL;
+    }
+
+    g_ptr_array_set_free_func (array, NULL);
+    return paths_from_array (array);
+}
+
+char *
+sync_paths_to_string (const SyncPaths *paths)
+{
+    if (!paths)
+        return NULL;
+    return g_strjoinv ("\n", paths->paths);
+}
+
+SyncPaths *
+sync_paths_dup (const SyncPaths *paths)
+{
+    SyncPaths *copy;
+
+    if (!paths)
+        return NULL;
+
+    copy = g_new0 (SyncPaths, 1);
+    copy->paths = g_strdupv (paths->paths);
+    copy->n_paths = paths->n_paths;
+    return copy;
+}
+
+void
+sync_paths_free (SyncPaths *paths)
+{
+    if (!paths)
+        return;
+    g_strfreev (paths->paths);
+    g_free (paths);
+}
+
+gboolean
+sync_paths_equal (const SyncPaths *a, const SyncPaths *b)
+{
+    int i;
+
+    if (!a || !b)
+        return (a == b);
+
+    if (a->n_paths != b->n_paths)
+        return FALSE;
+    for (i = 0; i < a->n_paths; ++i)
+        if (strcmp (a->paths[i], b->paths[i]) != 0)
+            return FALSE;
+    return TRUE;
+}
+
+SyncPaths *
+sync_paths_intersect (const SyncPaths *a, const SyncPaths *b)
+{
+    GPtrArray *array;
+    int i;
+
+    if (!a)
+        return sync_paths_dup (b);
+    if (!b)
+        return sync_paths_dup (a);
+
+    /* Selected subtrees either nest or don't overlap. */
+    array = g_ptr_array_new ();
+    for (i = 0; i < a->n_paths; ++i)
+        if (sync_paths_covers (b, a->paths[i]))
+            g_ptr_array_add (array, g_strdup (a->paths[i]));
+    for (i = 0; i < b->n_paths; ++i)
+        if (sync_paths_covers (a, b->paths[i]))
+            g_ptr_array_add (array, g_strdup (b->paths[i]));
+
+    return paths_from_array (array);
+}
+
+DiffPathState
+sync_paths_check (const SyncPaths *paths, const char *path, gboolean is_dir)
+{
+    int len, i;
+    const char *p;
+
+    if (!paths)
+        return DIFF_PATH_INCLUDE;
+
+    len = strlen (path);
+    for (i = 0; i < paths->n_paths; ++i) {
+        p = paths->paths[i];
+        if (is_under (path, p))
+            return DIFF_PATH_INCLUDE;
+        if (is_dir && (len == 0 || (strncmp (p, path, len) == 0 && p[len] == '/')))
+            return DIFF_PATH_DESCEND;
+    }
+
+    return DIFF_PATH_SKIP;
+}
+
+gboolean
+sync_paths_covers (const SyncPaths *paths, const char *path)
+{
+    return (sync_paths_check (paths, path, FALSE) == DIFF_PATH_INCLUDE);
+}
+
+DiffPathState
+sync_paths_filter (const char *path, gboolean is_dir, void *data)
+{
+    return sync_paths_check (data, path, is_dir);
+}
+
+DiffPathState
+sync_paths_added_filter (const char *path, gboolean is_dir, void *data)
+{
+    SyncPathsChange *change = data;
+    DiffPathState wanted, synced;
+
+    wanted = sync_paths_check (change->wanted, path, is_dir);
+    synced = sync_paths_check (change->synced, path, is_dir);
+
+    if (wanted == DIFF_PATH_SKIP || synced == DIFF_PATH_INCLUDE)
+        return DIFF_PATH_SKIP;
+    if (wanted == DIFF_PATH_INCLUDE && synced == DIFF_PATH_SKIP)
+        return DIFF_PATH_INCLUDE;
+
+    /* Parts of the subtree were already synced. */
+    return is_dir ? DIFF_PATH_DESCEND : DIFF_PATH_SKIP;
+}
+
+typedef struct GraftCtx {
+    const SyncPaths *paths;
+    const char *repo_id;
+    int version;
+} GraftCtx;
+
+static int
+graft_dir (GraftCtx *ctx, const char *dir_path,
+           const char *selected_id, const char *other_id, char *dir_id)
+{
+    SeafDir *sel = NULL, *other = NULL, *new_dir;
+    GList *psel, *pother, *entries = NULL;
+    SeafDirent *sd, *od, *dent;
+    const char *name;
+    char *path, *sub_path;
+    char sub_id[41];
+    int cmp, ret = 0;
+
+    sel = seaf_fs_manager_get_seafdir (seaf->fs_mgr, ctx->repo_id,
+                                       ctx->version, selected_id);
+    other = seaf_fs_manager_get_seafdir (seaf->fs_mgr, ctx->repo_id,
+                                         ctx->version, other_id);
+    if (!sel || !other) {
+        seaf_warning ("Failed to get dir %s of repo %.8s.\n",
+                      sel ? other_id : selected_id, ctx->repo_id);
+        ret = -1;
+        goto out;
+    }
+
+    /* Entries are sorted by name in descending order. */
+    psel = sel->entries;
+    pother = other->entries;
+    while (psel || pother) {
+        sd = od = NULL;
+        if (psel && pother)
+            cmp = strcmp (((SeafDirent *)psel->data)->name,
+                          ((SeafDirent *)pother->data)->name);
+        else
+            cmp = psel ? 1 : -1;
+        if (cmp >= 0) {
+            sd = psel->data;
+            psel = psel->next;
+        }
+        if (cmp <= 0) {
+            od = pother->data;
+            pother = pother->next;
+        }
+
+        name = sd ? sd->name : od->name;
+        path = g_strconcat (dir_path, name, NULL);
+        dent = NULL;
+
+        if (sync_paths_covers (ctx->paths, path)) {
+            if (sd)
+                dent = seaf_dirent_dup (sd);
+        } else if (sync_paths_check (ctx->paths, path, TRUE) == DIFF_PATH_DESCEND &&
+                   (!od || S_ISDIR(od->mode)) &&
+                   ((sd && S_ISDIR(sd->mode)) || od)) {
+            /* A dir leading to selected paths, with parts of both. */
+            sub_path = g_strconcat (path, "/", NULL);
+            ret = graft_dir (ctx, sub_path,
+                             (sd && S_ISDIR(sd->mode)) ? sd->id : EMPTY_SHA1,
+                             od ? od->id : EMPTY_SHA1,
+                             sub_id);
+            g_free (sub_path);
+            if (ret < 0) {
+                g_free (path);
+                goto out;
+            }
+            dent = seaf_dirent_new (dir_version_from_repo_version (ctx->version),
+                                    sub_id, S_IFDIR, name,
+                                    od ? od->mtime : sd->mtime, NULL, -1);
+        } else if (od) {
+            dent = seaf_dirent_dup (od);
+        }
+
+        g_free (path);
+        if (dent)
+            entries = g_list_prepend (entries, dent);
+    }
+    entries = g_list_reverse (entries);
+
+    new_dir = seaf_dir_new (NULL, entries,
+                            dir_version_from_repo_version (ctx->version));
+    if (strcmp (new_dir->dir_id, EMPTY_SHA1) != 0 &&
+        !seaf_fs_manager_object_exists (seaf->fs_mgr, ctx->repo_id,
+                                        ctx->version, new_dir->dir_id) &&
+        seaf_dir_save (seaf->fs_mgr, ctx->repo_id, ctx->version, new_dir) < 0) {
+        seaf_warning ("Failed to save dir %s of repo %.8s.\n",
+                      new_dir->dir_id, ctx->repo_id);
+        ret = -1;
+    }
+    memcpy (dir_id, new_dir->dir_id, 40);
+    dir_id[40] = '\0';
+    seaf_dir_free (new_dir);
+
+out:
+    seaf_dir_free (sel);
+    seaf_dir_free (other);
+    return ret;
+}
+
+int
+sync_paths_graft_tree (const SyncPaths *paths,
+                       const char *repo_id,
+                       int version,
+                       const char *selected_root,
+                       const char *other_root,
+                       char *root_id)
+{
+    GraftCtx ctx;
+
+    if (!paths) {
+        memcpy (root_id, selected_root, 41);
+        return 0;
+    }
+
+    ctx.paths = paths;
+    ctx.repo_id = repo_id;
+    ctx.version = version;
+
+    return graft_dir (&ctx, "", selected_root, other_root, root_id);
+}
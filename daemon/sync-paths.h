@@ -0,0 +1,89 @@
+/* -*- Mode: C; tab-width: 4; indent-tabs-mode: nil; c-basic-offset: 4 -*- */
+
+#ifndef SYNC_PATHS_H
+#define SYNC_PATHS_H
+
+#include <glib.h>
+
+#include "diff-simple.h"
+
+/*
+ * The sub-folders synced when only a part of a repo is wanted on this
+ * client. Paths are relative to the repo root, like "docs/2024", and
+ * none is under another one. A NULL selection is the whole repo.
+ *
+ * Only the objects and blocks under the selected paths, and the dirs
+ * leading to them, are downloaded. The index and the worktree only have
+ * the selected subtrees. Commits take the rest of their tree from the
+ * head commit, so the parts not synced stay as they are on the server.
+ */
+typedef struct SyncPaths {
+    char **paths;               /* sorted */
+    int n_paths;
+} SyncPaths;
+
+/*
+ * Parse a selection saved as one path per line. Returns NULL for an
+ * empty value or one selecting the root, which is the whole repo.
+ */
+SyncPaths *
+sync_paths_parse (const char *value);
+
+/* Returns NULL if @paths is NULL. */
+char *
+sync_paths_to_string (const SyncPaths *paths);
+
+SyncPaths *
+sync_paths_dup (const SyncPaths *paths);
+
+void
+sync_paths_free (SyncPaths *paths);
+
+gboolean
+sync_paths_equal (const SyncPaths *a, const SyncPaths *b);
+
+/* The paths selected by both. Returns NULL if both are NULL. */
+SyncPaths *
+sync_paths_intersect (const SyncPaths *a, const SyncPaths *b);
+
+/*
+ * DIFF_PATH_INCLUDE if @path is a selected path or under one,
+ * DIFF_PATH_DESCEND if it's a dir leading to one.
+ */
+DiffPathState
+sync_paths_check (const SyncPaths *paths, const char *path, gboolean is_dir);
+
+gboolean
+sync_paths_covers (const SyncPaths *paths, const char *path);
+
+/* A DiffPathFilter, for @data being a SyncPaths. */
+DiffPathState
+sync_paths_filter (const char *path, gboolean is_dir, void *data);
+
+typedef struct SyncPathsChange {
+    const SyncPaths *wanted;
+    const SyncPaths *synced;
+} SyncPathsChange;
+
+/*
+ * A DiffPathFilter for the paths selected by @data->wanted and not by
+ * @data->synced, for @data being a SyncPathsChange.
+ */
+DiffPathState
+sync_paths_added_filter (const char *path, gboolean is_dir, void *data);
+
+/*
+ * Build the tree with the selected paths of @selected_root and the rest
+ * of @other_root, and return its id in @root_id. Only the dirs of
+ * @other_root leading to selected paths are read. The new dir objects
+ * are saved in the fs store of @repo_id.
+ */
+int
+sync_paths_graft_tree (const SyncPaths *paths,
+                       const char *repo_id,
+                       int version,
+                       const char *selected_root,
+                       const char *other_root,
+                       char *root_id);
+
+#endif
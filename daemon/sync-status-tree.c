@@ -6,282 +6,463 @@
 
 #include "log.h"
 
-struct _SyncStatusDir {
-    GHashTable *dirents;        /* name -> dirent. */
-};
-typedef struct _SyncStatusDir SyncStatusDir;
-
-struct _SyncStatusDirent {
-    char *name;
-    int mode;
-    /* Only used for directories. */
-    SyncStatusDir *subdir;
-};
-typedef struct _SyncStatusDirent SyncStatusDirent;
+/*
+ * Children are kept inline in an array sorted by name, whose capacity is
+ * the power of 2 at or above the number of children. Names are interned
+ * per tree, since the same names repeat in many dirs.
+ */
+typedef struct SyncStatusNode {
+    const char *name;
+    struct SyncStatusNode *children;
+    guint32 status : 3;
+    guint32 n_children : 29;
+    /* Paths at or under this node with these statuses. */
+    guint32 n_syncing;
+    guint32 n_synced;
+} SyncStatusNode;
+
+typedef struct InternedName {
+    int ref;
+    char name[1];
+} InternedName;
 
 struct SyncStatusTree {
-    SyncStatusDir *root;
+    SyncStatusNode root;
+    GHashTable *names;          /* name -> InternedName */
+    unsigned int n_paths;
     char *worktree;
 };
 typedef struct SyncStatusTree SyncStatusTree;
 
-static void
-sync_status_dirent_free (SyncStatusDirent *dirent);
-
-static SyncStatusDir *
-sync_status_dir_new ()
+static const char *
+intern_name (SyncStatusTree *tree, const char *name, int len)
 {
-    SyncStatusDir *dir = g_new0 (SyncStatusDir, 1);
-    dir->dirents = g_hash_table_new_full (g_str_hash, g_str_equal,
-                                          g_free,
-                                          (GDestroyNotify)sync_status_dirent_free);
-    return dir;
+    InternedName *in;
+    char *key = g_strndup (name, len);
+
+    in = g_hash_table_lookup (tree->names, key);
+    if (in) {
+        g_free (key);
+        ++in->ref;
+        return in->name;
+    }
+
+    in = g_malloc (sizeof(InternedName) + len);
+    in->ref = 1;
+    memcpy (in->name, key, len + 1);
+    g_free (key);
+    g_hash_table_insert (tree->names, in->name, in);
+
+    return in->name;
 }
 
 static void
-sync_status_dir_free (SyncStatusDir *dir)
+unintern_name (SyncStatusTree *tree, const char *name)
 {
-    if (!dir)
-        return;
-    g_hash_table_destroy (dir->dirents);
-    g_free (dir);
+    InternedName *in = g_hash_table_lookup (tree->names, name);
+
+    if (in && --in->ref == 0)
+        g_hash_table_remove (tree->names, name);
 }
 
-static SyncStatusDirent *
-sync_status_dirent_new (const char *name, int mode)
+static guint32
+children_capacity (guint32 n)
 {
-    SyncStatusDirent *dirent = g_new0(SyncStatusDirent, 1);
-    dirent->name = g_strdup(name);
-    dirent->mode = mode;
+    guint32 cap = 1;
 
-    if (S_ISDIR(mode))
-        dirent->subdir = sync_status_dir_new ();
+    if (n == 0)
+        return 0;
+    while (cap < n)
+        cap <<= 1;
+    return cap;
+}
 
-    return dirent;
+static int
+compare_name (const char *name, const char *comp, int len)
+{
+    int ret = strncmp (name, comp, len);
+
+    if (ret != 0)
+        return ret;
+    return name[len] == 0 ? 0 : 1;
 }
 
-static void
-sync_status_dirent_free (SyncStatusDirent *dirent)
+/*
+ * Binary search the children of @node for the component @comp. Returns
+ * the index of the child, or -1 and sets @pos to where it would go.
+ */
+static int
+find_child (SyncStatusNode *node, const char *comp, int len, guint32 *pos)
 {
-    if (!dirent)
-        return;
-    g_free (dirent->name);
-    sync_status_dir_free (dirent->subdir);
-    g_free (dirent);
+    guint32 lo = 0, hi = node->n_children, mid;
+    int cmp;
+
+    while (lo < hi) {
+        mid = lo + (hi - lo) / 2;
+        cmp = compare_name (node->children[mid].name, comp, len);
+        if (cmp == 0)
+            return mid;
+        if (cmp < 0)
+            lo = mid + 1;
+        else
+            hi = mid;
+    }
+
+    if (pos)
+        *pos = lo;
+    return -1;
 }
 
-SyncStatusTree *
-sync_status_tree_new (const char *worktree)
+static SyncStatusNode *
+insert_child (SyncStatusTree *tree, SyncStatusNode *node, guint32 pos,
+              const char *comp, int len)
 {
-    SyncStatusTree *tree = g_new0(SyncStatusTree, 1);
-    tree->root = sync_status_dir_new ();
-    tree->worktree = g_strdup(worktree);
-    return tree;
+    guint32 n = node->n_children;
+    SyncStatusNode *child;
+
+    if (n == children_capacity (n))
+        node->children = g_renew (SyncStatusNode, node->children,
+                                  children_capacity (n + 1));
+    memmove (&node->children[pos + 1], &node->children[pos],
+             (n - pos) * sizeof(SyncStatusNode));
+    node->n_children = n + 1;
+
+    child = &node->children[pos];
+    memset (child, 0, sizeof(SyncStatusNode));
+    child->name = intern_name (tree, comp, len);
+
+    return child;
 }
 
-#ifdef WIN32
 static void
-refresh_recursive (const char *basedir, SyncStatusDir *dir)
+free_node_contents (SyncStatusTree *tree, SyncStatusNode *node)
 {
-    GHashTableIter iter;
-    gpointer key, value;
-    char *dname, *path;
-    SyncStatusDirent *dirent;
+    guint32 i;
 
-    g_hash_table_iter_init (&iter, dir->dirents);
-    while (g_hash_table_iter_next (&iter, &key, &value)) {
-        dname = key;
-        dirent = value;
+    for (i = 0; i < node->n_children; ++i) {
+        free_node_contents (tree, &node->children[i]);
+        unintern_name (tree, node->children[i].name);
+    }
+    g_free (node->children);
+    node->children = NULL;
+    node->n_children = 0;
+}
 
-        path = g_strconcat(basedir, "/", dname, NULL);
-        seaf_sync_manager_add_refresh_path (seaf->sync_mgr, path);
+static void
+remove_child (SyncStatusTree *tree, SyncStatusNode *node, guint32 idx)
+{
+    guint32 n = node->n_children - 1;
+
+    free_node_contents (tree, &node->children[idx]);
+    unintern_name (tree, node->children[idx].name);
 
-        if (S_ISDIR(dirent->mode))
-            refresh_recursive (path, dirent->subdir);
+    memmove (&node->children[idx], &node->children[idx + 1],
+             (n - idx) * sizeof(SyncStatusNode));
+    node->n_children = n;
 
-        g_free (path);
+    if (n == 0) {
+        g_free (node->children);
+        node->children = NULL;
+    } else if (n == children_capacity (n)) {
+        node->children = g_renew (SyncStatusNode, node->children, n);
     }
 }
+
+static void
+count_status (SyncStatusNode *node, int status, int delta)
+{
+    if (status == SYNC_STATUS_SYNCING)
+        node->n_syncing += delta;
+    else if (status == SYNC_STATUS_SYNCED)
+        node->n_synced += delta;
+}
+
+#ifdef WIN32
+/* Have Explorer refresh @path if its status as a dir changed. */
+static void
+refresh_if_changed (SyncStatusTree *tree, SyncStatusNode *node,
+                    gboolean had_syncing, gboolean had_synced,
+                    const char *path, int len)
+{
+    char *full_path;
+
+    if ((node->n_syncing > 0) == had_syncing &&
+        (node->n_synced > 0) == had_synced)
+        return;
+
+    full_path = g_strdup_printf ("%s/%.*s", tree->worktree, len, path);
+    seaf_sync_manager_add_refresh_path (seaf->sync_mgr, full_path);
+    g_free (full_path);
+}
 #endif
 
+SyncStatusTree *
+sync_status_tree_new (const char *worktree)
+{
+    SyncStatusTree *tree = g_new0(SyncStatusTree, 1);
+    tree->root.name = "";
+    tree->names = g_hash_table_new_full (g_str_hash, g_str_equal,
+                                         NULL, g_free);
+    tree->worktree = g_strdup(worktree);
+    return tree;
+}
+
 void
 sync_status_tree_free (struct SyncStatusTree *tree)
 {
     if (!tree)
         return;
 
-#ifdef WIN32
-    /* refresh_recursive (tree->worktree, tree->root); */
-#endif
     /* Free the tree recursively. */
-    sync_status_dir_free (tree->root);
+    free_node_contents (tree, &tree->root);
+    g_hash_table_destroy (tree->names);
 
     g_free (tree->worktree);
+    g_free (tree);
 }
 
-void
-sync_status_tree_add (SyncStatusTree *tree,
-                      const char *path,
-                      int mode)
+/* Length of the path component at @comp. */
+static inline int
+comp_len (const char *comp)
 {
-    char **dnames = NULL;
-    guint n, i;
-    char *dname;
-    SyncStatusDir *dir = tree->root;
-    SyncStatusDirent *dirent;
-    GString *buf;
-
-    dnames = g_strsplit (path, "/", 0);
-    if (!dnames)
-        return;
-    n = g_strv_length (dnames);
-
-    buf = g_string_new ("");
-    g_string_append (buf, tree->worktree);
-
-    for (i = 0; i < n; i++) {
-        dname = dnames[i];
-        dirent = g_hash_table_lookup (dir->dirents, dname);
-        g_string_append (buf, "/");
-        g_string_append (buf, dname);
-        if (dirent) {
-            if (S_ISDIR(dirent->mode)) {
-                if (i == (n-1)) {
-                    goto out;
-                } else {
-                    dir = dirent->subdir;
-                }
-            } else {
-                goto out;
-            }
-        } else {
-            if (i == (n-1)) {
-                dirent = sync_status_dirent_new (dname, mode);
-                g_hash_table_insert (dir->dirents, g_strdup(dname), dirent);
-            } else {
-                dirent = sync_status_dirent_new (dname, S_IFDIR);
-                g_hash_table_insert (dir->dirents, g_strdup(dname), dirent);
-                dir = dirent->subdir;
-            }
+    const char *end = strchr (comp, '/');
+    return end ? end - comp : strlen(comp);
+}
+
+/*
+ * Set the status of the path @comp below @node to @status, and update the
+ * counts along the way back. @path is the whole path, for refreshing.
+ */
+static int
+set_recursive (SyncStatusTree *tree, SyncStatusNode *node,
+               const char *path, const char *comp, int status)
+{
+    SyncStatusNode *child;
+    guint32 pos;
+    int len, idx, old;
+
+    if (*comp == 0) {
+        old = node->status;
+        node->status = status;
+        return old;
+    }
+
+    len = comp_len (comp);
+    idx = find_child (node, comp, len, &pos);
+    if (idx >= 0)
+        child = &node->children[idx];
+    else
+        child = insert_child (tree, node, pos, comp, len);
+
 #ifdef WIN32
-            seaf_sync_manager_add_refresh_path (seaf->sync_mgr, buf->str);
+    gboolean had_syncing = (child->n_syncing > 0);
+    gboolean had_synced = (child->n_synced > 0);
 #endif
-        }
+
+    old = set_recursive (tree, child, path,
+                         comp[len] == '/' ? comp + len + 1 : comp + len,
+                         status);
+    if (old != status) {
+        count_status (child, old, -1);
+        count_status (child, status, 1);
     }
 
-out:
-    g_string_free (buf, TRUE);
-    g_strfreev (dnames);
+#ifdef WIN32
+    refresh_if_changed (tree, child, had_syncing, had_synced,
+                        path, comp + len - path);
+#endif
+
+    return old;
 }
 
-inline static gboolean
-is_empty_dir (SyncStatusDirent *dirent)
+int
+sync_status_tree_set (SyncStatusTree *tree,
+                      const char *path,
+                      int status)
 {
-    return (g_hash_table_size(dirent->subdir->dirents) == 0);
+    int old;
+
+    old = set_recursive (tree, &tree->root, path, path, status);
+    if (old != status) {
+        count_status (&tree->root, old, -1);
+        count_status (&tree->root, status, 1);
+    }
+    if (old == SYNC_STATUS_NONE)
+        ++tree->n_paths;
+
+    return old;
 }
 
-static void
-remove_item (SyncStatusDir *dir, const char *dname, const char *fullpath)
+static int
+del_recursive (SyncStatusTree *tree, SyncStatusNode *node,
+               const char *path, const char *comp)
 {
-    g_hash_table_remove (dir->dirents, dname);
+    SyncStatusNode *child;
+    int len, idx, old;
+
+    if (*comp == 0) {
+        old = node->status;
+        node->status = SYNC_STATUS_NONE;
+        return old;
+    }
+
+    len = comp_len (comp);
+    idx = find_child (node, comp, len, NULL);
+    if (idx < 0)
+        return SYNC_STATUS_NONE;
+    child = &node->children[idx];
+
+#ifdef WIN32
+    gboolean had_syncing = (child->n_syncing > 0);
+    gboolean had_synced = (child->n_synced > 0);
+#endif
+
+    old = del_recursive (tree, child, path,
+                         comp[len] == '/' ? comp + len + 1 : comp + len);
+    count_status (child, old, -1);
+
 #ifdef WIN32
-    seaf_sync_manager_add_refresh_path (seaf->sync_mgr, fullpath);
+    refresh_if_changed (tree, child, had_syncing, had_synced,
+                        path, comp + len - path);
 #endif
+
+    /* Nothing left to track here. */
+    if (child->status == SYNC_STATUS_NONE && child->n_children == 0)
+        remove_child (tree, node, idx);
+
+    return old;
 }
 
-static void
-delete_recursive (SyncStatusDir *dir, char **dnames, guint n, guint i,
-                  const char *base)
+int
+sync_status_tree_del (SyncStatusTree *tree,
+                      const char *path)
 {
-    char *dname;
-    SyncStatusDirent *dirent;
-    char *fullpath = NULL;
-
-    dname = dnames[i];
-    fullpath = g_strconcat (base, "/", dname, NULL);
-
-    dirent = g_hash_table_lookup (dir->dirents, dname);
-    if (dirent) {
-        if (S_ISDIR(dirent->mode)) {
-            if (i == (n-1)) {
-                if (is_empty_dir(dirent))
-                    remove_item (dir, dname, fullpath);
-            } else {
-                delete_recursive (dirent->subdir, dnames, n, ++i, fullpath);
-                /* If this dir becomes empty after deleting the entry below,
-                 * remove the dir itself too.
-                 */
-                if (is_empty_dir(dirent))
-                    remove_item (dir, dname, fullpath);
-            }
-        } else if (i == (n-1)) {
-            remove_item (dir, dname, fullpath);
-        }
+    int old;
+
+    old = del_recursive (tree, &tree->root, path, path);
+    count_status (&tree->root, old, -1);
+    if (old != SYNC_STATUS_NONE)
+        --tree->n_paths;
+
+    return old;
+}
+
+static SyncStatusNode *
+lookup_node (SyncStatusTree *tree, const char *path)
+{
+    SyncStatusNode *node = &tree->root;
+    const char *comp = path;
+    int len, idx;
+
+    while (*comp) {
+        len = comp_len (comp);
+        idx = find_child (node, comp, len, NULL);
+        if (idx < 0)
+            return NULL;
+        node = &node->children[idx];
+        comp += len;
+        if (*comp == '/')
+            ++comp;
     }
 
-    g_free (fullpath);
+    return node;
 }
 
-void
-sync_status_tree_del (SyncStatusTree *tree,
+int
+sync_status_tree_get (SyncStatusTree *tree,
                       const char *path)
 {
-    char **dnames = NULL;
-    guint n;
-    SyncStatusDir *dir = tree->root;
+    SyncStatusNode *node = lookup_node (tree, path);
 
-    dnames = g_strsplit (path, "/", 0);
-    if (!dnames)
-        return;
-    n = g_strv_length (dnames);
+    return node ? node->status : SYNC_STATUS_NONE;
+}
+
+int
+sync_status_tree_has_status (SyncStatusTree *tree,
+                             const char *path,
+                             int status)
+{
+    SyncStatusNode *node;
+
+    /* The worktree itself isn't looked up as a dir. */
+    if (*path == 0)
+        return 0;
 
-    delete_recursive (dir, dnames, n, 0, tree->worktree);
+    node = lookup_node (tree, path);
+    if (!node)
+        return 0;
 
-out:
-    g_strfreev (dnames);
+    if (status == SYNC_STATUS_SYNCING)
+        return node->n_syncing > 0;
+    if (status == SYNC_STATUS_SYNCED)
+        return node->n_synced > 0;
+    return 0;
 }
 
 int
-sync_status_tree_exists (SyncStatusTree *tree,
-                         const char *path)
+sync_status_tree_foreach_child (SyncStatusTree *tree,
+                                const char *path,
+                                SyncStatusChildFunc func,
+                                void *data)
 {
-    char **dnames = NULL;
-    guint n, i;
-    char *dname;
-    SyncStatusDir *dir = tree->root;
-    SyncStatusDirent *dirent;
-    int ret = 0;
-
-    dnames = g_strsplit (path, "/", 0);
-    if (!dnames)
-        return ret;
-    n = g_strv_length (dnames);
-
-    for (i = 0; i < n; i++) {
-        dname = dnames[i];
-        dirent = g_hash_table_lookup (dir->dirents, dname);
-        if (dirent) {
-            if (S_ISDIR(dirent->mode)) {
-                if (i == (n-1)) {
-                    ret = 1;
-                    goto out;
-                } else {
-                    dir = dirent->subdir;
-                }
-            } else {
-                if (i == (n-1)) {
-                    ret = 1;
-                    goto out;
-                } else {
-                    goto out;
-                }
-            }
-        } else {
-            goto out;
+    SyncStatusNode *node = lookup_node (tree, path);
+    SyncStatusNode *child;
+    int status, n = 0;
+    guint32 i;
+
+    if (!node)
+        return 0;
+
+    for (i = 0; i < node->n_children; ++i) {
+        child = &node->children[i];
+        status = child->status;
+        if (status == SYNC_STATUS_NONE) {
+            if (child->n_syncing > 0)
+                status = SYNC_STATUS_SYNCING;
+            else if (child->n_synced > 0)
+                status = SYNC_STATUS_SYNCED;
+            else
+                continue;
         }
+        func (child->name, status, data);
+        ++n;
+    }
+
+    return n;
+}
+
+unsigned int
+sync_status_tree_size (SyncStatusTree *tree)
+{
+    return tree->n_paths;
+}
+
+static void
+foreach_recursive (SyncStatusNode *node, GString *path,
+                   SyncStatusTreeFunc func, void *data)
+{
+    gsize len = path->len;
+    guint32 i;
+
+    if (node->status != SYNC_STATUS_NONE)
+        func (path->str, node->status, data);
+
+    for (i = 0; i < node->n_children; ++i) {
+        if (len > 0)
+            g_string_append_c (path, '/');
+        g_string_append (path, node->children[i].name);
+        foreach_recursive (&node->children[i], path, func, data);
+        g_string_truncate (path, len);
     }
+}
+
+void
+sync_status_tree_foreach (SyncStatusTree *tree,
+                          SyncStatusTreeFunc func,
+                          void *data)
+{
+    GString *path = g_string_new ("");
 
-out:
-    g_strfreev (dnames);
-    return ret;
+    foreach_recursive (&tree->root, path, func, data);
+    g_string_free (path, TRUE);
 }
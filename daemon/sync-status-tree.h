@@ -1,6 +1,14 @@
 #ifndef SYNC_STATUS_TREE_H
 #define SYNC_STATUS_TREE_H
 
+/*
+ * The sync status of the active paths of a repo, kept as a trie of path
+ * components. Every node also counts the syncing and synced paths at or
+ * under it, so the status of a dir is known without walking its subtree.
+ *
+ * Statuses are the SyncStatus values of sync-mgr.h.
+ */
+
 struct SyncStatusTree;
 
 struct SyncStatusTree *
@@ -10,24 +18,60 @@ void
 sync_status_tree_free (struct SyncStatusTree *tree);
 
 /*
- * Add a @path into the @tree. If any directory along the path is missing,
- * it will be created. If the path already exists, it won't be overwritten.
+ * Set the status of @path, creating the nodes along the path.
+ * Returns the previous status of @path, SYNC_STATUS_NONE if it had none.
  */
-void
-sync_status_tree_add (struct SyncStatusTree *tree,
+int
+sync_status_tree_set (struct SyncStatusTree *tree,
                       const char *path,
-                      int mode);
+                      int status);
 
 /*
- * Delete a path from the tree. If directory becomes empty after the deletion,
- * it will be deleted too. All empty direcotries along the path will be deleted.
+ * Delete the status of @path. Dirs left without a status or children are
+ * deleted too. Returns the previous status of @path.
  */
-void
+int
 sync_status_tree_del (struct SyncStatusTree *tree,
                       const char *path);
 
+/* The status of @path itself, SYNC_STATUS_NONE if it has none. */
 int
-sync_status_tree_exists (struct SyncStatusTree *tree,
-                         const char *path);
+sync_status_tree_get (struct SyncStatusTree *tree,
+                      const char *path);
+
+/*
+ * Whether @path or any path under it has @status, which is either
+ * SYNC_STATUS_SYNCING or SYNC_STATUS_SYNCED.
+ */
+int
+sync_status_tree_has_status (struct SyncStatusTree *tree,
+                             const char *path,
+                             int status);
+
+/* Number of paths with a status. */
+unsigned int
+sync_status_tree_size (struct SyncStatusTree *tree);
+
+/*
+ * Call @func on the children of the dir @path that have a status of their
+ * own or paths with a status under them, with the status they show as.
+ * A child without a status of its own shows as syncing if any path under
+ * it is syncing, otherwise as synced. Children not passed to @func have
+ * no status. Returns the number of children passed.
+ */
+typedef void (*SyncStatusChildFunc) (const char *name, int status, void *data);
+
+int
+sync_status_tree_foreach_child (struct SyncStatusTree *tree,
+                                const char *path,
+                                SyncStatusChildFunc func,
+                                void *data);
+
+typedef void (*SyncStatusTreeFunc) (const char *path, int status, void *data);
+
+void
+sync_status_tree_foreach (struct SyncStatusTree *tree,
+                          SyncStatusTreeFunc func,
+                          void *data);
 
 #endif
@@ -56,6 +56,10 @@
 
 #define DEFAULT_BLOCK_SIZE  (1 << 20)
 
+#define DEFAULT_BLOCK_TX_STREAMS 4
+/* Don't open a stream for fewer blocks than this. */
+#define MIN_BLOCKS_PER_STREAM 8
+
 static int schedule_task_pulse (void *vmanager);
 static void state_machine_tick (TransferTask *task);
 static void
@@ -1283,10 +1287,90 @@ block_tx_client_once_mode_done_cb (BlockTxInfo *info)
     g_free (info);
 }
 
+static void
+block_tx_stream_done_cb (BlockTxInfo *info)
+{
+    BlockTxInfo *parent = info->parent;
+
+    /* Keep the first error, and stop the other streams on a failure. */
+    if (info->result != BLOCK_CLIENT_SUCCESS &&
+        parent->result == BLOCK_CLIENT_SUCCESS) {
+        parent->result = info->result;
+        if (info->result != BLOCK_CLIENT_CANCELED && parent->n_running > 1)
+            block_tx_client_run_command (parent, BLOCK_CLIENT_CMD_CANCEL);
+    }
+
+    g_free (info->enc_session_key);
+    g_free (info);
+
+    if (--parent->n_running == 0) {
+        pthread_mutex_destroy (&parent->blocks_lock);
+        block_tx_client_once_mode_done_cb (parent);
+    }
+}
+
+static int
+get_block_tx_streams (TransferTask *task)
+{
+    gboolean exists;
+    int n;
+
+    n = seafile_session_config_get_int (seaf, KEY_BLOCK_TX_STREAMS, &exists);
+    if (!exists || n <= 0)
+        n = DEFAULT_BLOCK_TX_STREAMS;
+
+    n = MIN (n, (int)g_queue_get_length (task->block_ids) /
+             MIN_BLOCKS_PER_STREAM);
+    return MAX (n, 1);
+}
+
+/*
+ * Transfer the blocks over @n_streams connections, each with its own
+ * session key, so that one slow block doesn't hold up the others.
+ */
+static int
+start_block_tx_streams (BlockTxInfo *info, int n_streams)
+{
+    TransferTask *task = info->task;
+    BlockTxInfo *stream;
+    int i;
+
+    pthread_mutex_init (&info->blocks_lock, NULL);
+    info->result = BLOCK_CLIENT_SUCCESS;
+
+    for (i = 0; i < n_streams; ++i) {
+        stream = g_new0 (BlockTxInfo, 1);
+        stream->task = task;
+        stream->cs = info->cs;
+        stream->cmd_pipe[0] = info->cmd_pipe[0];
+        stream->cmd_pipe[1] = info->cmd_pipe[1];
+        stream->transfer_once = TRUE;
+        stream->parent = info;
+
+        if (generate_session_key (stream, task->dest_id) < 0 ||
+            block_tx_client_start (stream, block_tx_stream_done_cb) < 0) {
+            seaf_warning ("Failed to start block tx stream %d.\n", i);
+            g_free (stream->enc_session_key);
+            g_free (stream);
+            break;
+        }
+
+        ++info->n_running;
+    }
+
+    if (info->n_running == 0) {
+        pthread_mutex_destroy (&info->blocks_lock);
+        return -1;
+    }
+
+    return 0;
+}
+
 static void
 start_block_tx_client_run_once (TransferTask *task)
 {
     BlockTxInfo *info;
+    int n_streams;
 
     info = g_new0 (BlockTxInfo, 1);
 
@@ -1294,7 +1378,9 @@ start_block_tx_client_run_once (TransferTask *task)
     /* Only use the first chunk server. */
     info->cs = task->chunk_servers->data;
 
-    if (generate_session_key (info, task->dest_id) < 0) {
+    n_streams = get_block_tx_streams (task);
+
+    if (n_streams == 1 && generate_session_key (info, task->dest_id) < 0) {
         transition_state_to_error (task, TASK_ERR_START_BLOCK_CLIENT);
         return;
     }
@@ -1310,7 +1396,13 @@ start_block_tx_client_run_once (TransferTask *task)
 
     task->tx_info = info;
 
-    if (block_tx_client_start (info, block_tx_client_once_mode_done_cb) < 0) {
+    if (n_streams > 1) {
+        if (start_block_tx_streams (info, n_streams) < 0) {
+            transition_state_to_error (task, TASK_ERR_START_BLOCK_CLIENT);
+            return;
+        }
+    } else if (block_tx_client_start (info,
+                                      block_tx_client_once_mode_done_cb) < 0) {
         seaf_warning ("Failed to start block tx client.\n");
         transition_state_to_error (task, TASK_ERR_START_BLOCK_CLIENT);
         return;
@@ -4,6 +4,7 @@
 #define TRANSFER_MGR_H
 
 #include <glib.h>
+#include <pthread.h>
 #include <ccnet/timer.h>
 #include <ccnet/peer.h>
 
@@ -120,6 +121,17 @@ typedef struct _BlockTxInfo {
     /* TRUE if the client only transfer one batch of blocks and end.*/
     gboolean transfer_once;
     gint ready_for_transfer;
+
+    /*
+     * In run-once mode, the blocks of a task can be transferred over
+     * several connections at once. Each stream has its own info, with
+     * its own session key, and points to the info of the task. The
+     * streams share the command pipe and task->block_ids.
+     */
+    struct _BlockTxInfo *parent;
+    /* Only used in the info of the task. */
+    pthread_mutex_t blocks_lock;
+    int n_running;
 } BlockTxInfo;
 
 struct _SeafTransferManager;
@@ -48,7 +48,7 @@ commit_trees_cb (const char *repo_id, int version,
         unsigned mode;
         guint64 mtime;
         gint64 size;
-        char *modifier;
+        const char *modifier;
 
         if (ce->ce_flags & CE_REMOVE)
             continue; /* entry being removed */
@@ -82,7 +82,7 @@ commit_trees_cb (const char *repo_id, int version,
             mode = ce->ce_mode;
             mtime = ce->ce_mtime.sec;
             size = ce->ce_size;
-            modifier = ce->modifier;
+            modifier = ce_modifier(ce);
             entlen = pathlen - baselen;
             name = g_strndup(path + baselen, entlen);
             rawdata_to_hex (sha1, hex, 20);
@@ -145,6 +145,10 @@ update_index (struct index_state *istate, const char *index_path)
     int index_fd;
     int ret = 0;
 
+    /* Most saves change a few entries, add just those when possible. */
+    if (append_index (istate, index_path) == 0)
+        return 0;
+
     snprintf (index_shadow, SEAF_PATH_MAX, "%s.shadow", index_path);
     index_fd = seaf_util_create (index_shadow, O_RDWR | O_CREAT | O_TRUNC | O_BINARY,
                                  0666);
@@ -352,6 +356,8 @@ compare_file_content (const char *path, SeafStat *st, const unsigned char *ce_sh
         cdc.block_min_sz = cdc.block_sz >> 2;
         cdc.block_max_sz = cdc.block_sz << 2;
         cdc.write_block = seafile_write_chunk;
+        /* Chunk the same way as the repo does, or the ids won't match. */
+        cdc.version = repo_version;
         if (filename_chunk_cdc (path, &cdc, crypt, FALSE) < 0) {
             g_warning ("Failed to chunk file.\n");
             return -1;
@@ -1,10 +1,17 @@
 /* -*- Mode: C; tab-width: 4; indent-tabs-mode: nil; c-basic-offset: 4 -*- */
+#ifndef _GNU_SOURCE
+#define _GNU_SOURCE             /* open_by_handle_at() */
+#endif
 #include "common.h"
 
 #include <sys/select.h>
 #include <sys/inotify.h>
 #include <sys/ioctl.h>
 #include <dirent.h>
+#include <fcntl.h>
+#ifdef HAVE_SYS_FANOTIFY_H
+#include <sys/fanotify.h>
+#endif
 
 #include <sys/time.h>
 #include <sys/types.h>
@@ -40,10 +47,34 @@ typedef struct RepoWatchInfo {
     RenameInfo *rename_info;
     EventInfo last_event;
     char *worktree;
+
+    /* Set if the worktree is watched with one fanotify mark on its whole
+     * filesystem instead of an inotify watch per dir.
+     */
+    gboolean fanotify;
+    int mount_fd;               /* for open_by_handle_at() */
+    char *real_worktree;        /* as found in /proc/self/fd */
+    GHashTable *dir_cache;      /* dir handle -> path in worktree, NULL if outside */
 } RepoWatchInfo;
 
 #define WATCH_MASK IN_MODIFY | IN_CREATE | IN_DELETE | IN_MOVED_FROM | IN_MOVED_TO | IN_CLOSE_WRITE | IN_ATTRIB
 
+/*
+ * FAN_REPORT_DFID_NAME reports the handle of the parent dir and the name
+ * of each entry, which is all we need to build worktree paths. Marking a
+ * whole filesystem needs CAP_SYS_ADMIN, and resolving the handles needs
+ * CAP_DAC_READ_SEARCH; without them we fall back to inotify.
+ */
+#if defined(HAVE_SYS_FANOTIFY_H) && defined(FAN_REPORT_DFID_NAME)
+#define USE_FANOTIFY
+
+#define FAN_WATCH_MASK (FAN_MODIFY | FAN_CREATE | FAN_DELETE | FAN_MOVED_FROM | \
+                        FAN_MOVED_TO | FAN_CLOSE_WRITE | FAN_ATTRIB | FAN_ONDIR)
+
+#define FAN_EVENT_BUF_SIZE 65536
+#define DIR_CACHE_MAX 100000
+#endif
+
 struct SeafWTMonitorPriv {
     pthread_mutex_t hash_lock;
     GHashTable *handle_hash;        /* repo_id -> inotify_fd */
@@ -144,6 +175,11 @@ free_repo_watch_info (RepoWatchInfo *info)
     free_mapping (info->mapping);
     free_rename_info (info->rename_info);
     g_free (info->worktree);
+    if (info->fanotify) {
+        close (info->mount_fd);
+        g_free (info->real_worktree);
+        g_hash_table_destroy (info->dir_cache);
+    }
     g_free (info);
 }
 
@@ -179,9 +215,11 @@ add_event_to_queue (WTStatus *status,
 
     seaf_debug ("Adding event: %s, %s %s\n", name, path, new_path?new_path:"");
 
-    pthread_mutex_lock (&status->q_lock);
-    g_queue_push_tail (status->event_q, event);
-    pthread_mutex_unlock (&status->q_lock);
+    wt_status_push_event (status, event);
+
+    /* The changes can be committed once they're quiet. */
+    seaf_sync_manager_wake_repo (seaf->sync_mgr, status->repo_id,
+                                 seaf->sync_mgr->commit_quiet_period);
 }
 
 /*
@@ -381,6 +419,307 @@ out:
         g_atomic_int_set (&info->status->last_changed, (gint)time(NULL));
 }
 
+#ifdef USE_FANOTIFY
+
+/* Path of the dir opened as @fd, relative to the worktree, or NULL if
+ * it's outside of the worktree.
+ */
+static char *
+fd_to_worktree_path (RepoWatchInfo *info, int fd)
+{
+    char proc_path[64];
+    char path[PATH_MAX];
+    ssize_t len;
+    size_t wt_len;
+
+    snprintf (proc_path, sizeof(proc_path), "/proc/self/fd/%d", fd);
+    len = readlink (proc_path, path, sizeof(path) - 1);
+    if (len < 0)
+        return NULL;
+    path[len] = 0;
+
+    if (!info->real_worktree)
+        return g_strdup (path);
+
+    wt_len = strlen (info->real_worktree);
+    if (strncmp (path, info->real_worktree, wt_len) != 0)
+        return NULL;
+    if (path[wt_len] == 0)
+        return g_strdup ("");
+    if (path[wt_len] != '/')
+        return NULL;
+    return g_strdup (path + wt_len + 1);
+}
+
+/*
+ * Look up the worktree path of the dir with @handle. Most events of a
+ * filesystem-wide mark come from outside the worktree, so the answer is
+ * cached either way; the cache is dropped whenever a dir moves.
+ */
+static const char *
+resolve_dir_handle (RepoWatchInfo *info, struct file_handle *handle)
+{
+    char *key;
+    gpointer value;
+    char *path = NULL;
+    int fd;
+
+    key = g_malloc (2 * (sizeof(int) + handle->handle_bytes) + 1);
+    rawdata_to_hex ((unsigned char *)&handle->handle_type, key, sizeof(int));
+    rawdata_to_hex (handle->f_handle, key + 2 * sizeof(int),
+                    handle->handle_bytes);
+
+    if (g_hash_table_lookup_extended (info->dir_cache, key, NULL, &value)) {
+        g_free (key);
+        return value;
+    }
+
+    fd = open_by_handle_at (info->mount_fd, handle, O_PATH);
+    if (fd >= 0) {
+        path = fd_to_worktree_path (info, fd);
+        close (fd);
+    } else if (errno != ENOENT && errno != ESTALE) {
+        seaf_warning ("[wt mon] failed to open dir handle: %s.\n",
+                      strerror(errno));
+    }
+
+    if (g_hash_table_size (info->dir_cache) >= DIR_CACHE_MAX)
+        g_hash_table_remove_all (info->dir_cache);
+    g_hash_table_insert (info->dir_cache, key, path);
+
+    return path;
+}
+
+/*
+ * fanotify move events carry no cookie. Like with inotify, a MOVED_FROM
+ * directly followed by a MOVED_TO in the same batch is taken as a rename;
+ * anything else in between splits them into a delete and a create.
+ */
+static void
+flush_fanotify_rename (RepoWatchInfo *info)
+{
+    RenameInfo *rename_info = info->rename_info;
+
+    if (rename_info->processing) {
+        add_event_to_queue (info->status, WT_EVENT_DELETE,
+                            rename_info->old_path, NULL);
+        unset_rename_processing_state (rename_info);
+    }
+}
+
+static void
+process_one_fanotify_event (RepoWatchInfo *info, guint64 mask,
+                            const char *filename)
+{
+    WTStatus *status = info->status;
+    RenameInfo *rename_info = info->rename_info;
+    gboolean update_last_changed = TRUE;
+
+    if (mask & FAN_MOVED_FROM) {
+        seaf_debug ("Move %s ->\n", filename);
+        flush_fanotify_rename (info);
+        set_rename_processing_state (rename_info, 0, filename);
+        goto out;
+    }
+
+    if (mask & FAN_MOVED_TO) {
+        seaf_debug ("Move -> %s.\n", filename);
+        if (rename_info->processing) {
+            add_event_to_queue (status, WT_EVENT_RENAME,
+                                rename_info->old_path, filename);
+            unset_rename_processing_state (rename_info);
+        } else {
+            add_event_to_queue (status, WT_EVENT_CREATE_OR_UPDATE,
+                                filename, NULL);
+        }
+        goto out;
+    }
+
+    flush_fanotify_rename (info);
+
+    if (mask & FAN_DELETE) {
+        seaf_debug ("Deleted %s.\n", filename);
+        add_event_to_queue (status, WT_EVENT_DELETE, filename, NULL);
+    } else if (mask & FAN_CREATE) {
+        /* As with inotify, file creations are left to the write events. */
+        if (!(mask & FAN_ONDIR)) {
+            char *fullpath = g_build_filename (info->worktree, filename, NULL);
+            struct stat st;
+            gboolean is_link = (lstat (fullpath, &st) == 0 &&
+                                S_ISLNK(st.st_mode));
+            g_free (fullpath);
+            if (!is_link) {
+                update_last_changed = FALSE;
+                goto out;
+            }
+        }
+        seaf_debug ("Created %s.\n", filename);
+        add_event_to_queue (status, WT_EVENT_CREATE_OR_UPDATE, filename, NULL);
+    } else if (mask & (FAN_MODIFY | FAN_CLOSE_WRITE)) {
+        /* The kernel already merges repeated events on the same file. */
+        if (mask & FAN_ONDIR) {
+            update_last_changed = FALSE;
+            goto out;
+        }
+        seaf_debug ("Modified %s.\n", filename);
+        add_event_to_queue (status, WT_EVENT_CREATE_OR_UPDATE, filename, NULL);
+    } else if (mask & FAN_ATTRIB) {
+        seaf_debug ("Attribute changed %s.\n", filename);
+        add_event_to_queue (status, WT_EVENT_ATTRIB, filename, NULL);
+    }
+
+out:
+    if (update_last_changed)
+        g_atomic_int_set (&info->status->last_changed, (gint)time(NULL));
+}
+
+static gboolean
+process_fanotify_events (RepoWatchInfo *info, int fan_fd)
+{
+    char buf[FAN_EVENT_BUF_SIZE] __attribute__((aligned(8)));
+    struct fanotify_event_metadata *meta;
+    struct fanotify_event_info_fid *fid;
+    struct file_handle *handle;
+    const char *parent, *name;
+    char *filename;
+    ssize_t len;
+
+    len = read (fan_fd, buf, sizeof(buf));
+    if (len < 0) {
+        if (errno == EAGAIN || errno == EINTR)
+            return TRUE;
+        seaf_warning ("Failed to read fanotify fd: %s.\n", strerror(errno));
+        return FALSE;
+    }
+
+    for (meta = (struct fanotify_event_metadata *)buf;
+         FAN_EVENT_OK (meta, len);
+         meta = FAN_EVENT_NEXT (meta, len)) {
+        if (meta->vers != FANOTIFY_METADATA_VERSION) {
+            seaf_warning ("Unexpected fanotify metadata version %d.\n",
+                          meta->vers);
+            return FALSE;
+        }
+        if (meta->fd >= 0)
+            close (meta->fd);
+
+        if (meta->mask & FAN_Q_OVERFLOW) {
+            flush_fanotify_rename (info);
+            add_event_to_queue (info->status, WT_EVENT_OVERFLOW, NULL, NULL);
+            continue;
+        }
+
+        fid = (struct fanotify_event_info_fid *)(meta + 1);
+        if ((char *)fid + sizeof(*fid) > (char *)meta + meta->event_len ||
+            fid->hdr.info_type != FAN_EVENT_INFO_TYPE_DFID_NAME)
+            continue;
+        handle = (struct file_handle *)fid->handle;
+        name = (const char *)handle->f_handle + handle->handle_bytes;
+
+        if ((meta->mask & FAN_ONDIR) &&
+            (meta->mask & (FAN_MOVED_FROM | FAN_MOVED_TO | FAN_DELETE)))
+            g_hash_table_remove_all (info->dir_cache);
+
+        parent = resolve_dir_handle (info, handle);
+        if (!parent) {
+            /* Don't pair a move out of the worktree with a later move in. */
+            if (meta->mask & (FAN_MOVED_FROM | FAN_MOVED_TO))
+                flush_fanotify_rename (info);
+            continue;
+        }
+
+        /* "." is reported for events on the dir itself. */
+        if (strcmp (name, ".") == 0) {
+            if (parent[0] == 0)
+                continue;
+            filename = g_strdup (parent);
+        } else {
+            filename = g_build_filename (parent, name, NULL);
+        }
+
+        seaf_debug ("fanotify event %llx on %s.\n",
+                    (unsigned long long)meta->mask, filename);
+        process_one_fanotify_event (info, meta->mask, filename);
+        g_free (filename);
+    }
+
+    /* A rename pair is always in one batch; an unpaired move is a move
+     * out of the worktree.
+     */
+    flush_fanotify_rename (info);
+
+    return TRUE;
+}
+
+/*
+ * Set up @info to be watched by fanotify. Returns the fanotify fd, or -1
+ * if it's not supported here.
+ */
+static int
+add_fanotify_watch (RepoWatchInfo *info, const char *worktree)
+{
+    struct file_handle *handle = NULL;
+    int mount_id, fan_fd = -1, mount_fd = -1, fd;
+
+    fan_fd = fanotify_init (FAN_CLASS_NOTIF | FAN_REPORT_DFID_NAME |
+                            FAN_CLOEXEC | FAN_NONBLOCK, O_RDONLY);
+    if (fan_fd < 0) {
+        seaf_debug ("[wt mon] fanotify_init failed: %s.\n", strerror(errno));
+        return -1;
+    }
+
+    if (fanotify_mark (fan_fd, FAN_MARK_ADD | FAN_MARK_FILESYSTEM,
+                       FAN_WATCH_MASK, AT_FDCWD, worktree) < 0) {
+        seaf_debug ("[wt mon] fanotify_mark on %s failed: %s.\n",
+                    worktree, strerror(errno));
+        goto error;
+    }
+
+    mount_fd = open (worktree, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+    if (mount_fd < 0) {
+        seaf_warning ("[wt mon] failed to open %s: %s.\n",
+                      worktree, strerror(errno));
+        goto error;
+    }
+
+    /* Check that dir handles can be opened, and find the worktree path
+     * that the kernel reports, with symlinks resolved.
+     */
+    handle = g_malloc0 (sizeof(struct file_handle) + MAX_HANDLE_SZ);
+    handle->handle_bytes = MAX_HANDLE_SZ;
+    if (name_to_handle_at (AT_FDCWD, worktree, handle, &mount_id, 0) < 0) {
+        seaf_debug ("[wt mon] name_to_handle_at on %s failed: %s.\n",
+                    worktree, strerror(errno));
+        goto error;
+    }
+    fd = open_by_handle_at (mount_fd, handle, O_PATH);
+    if (fd < 0) {
+        seaf_debug ("[wt mon] open_by_handle_at failed: %s.\n", strerror(errno));
+        goto error;
+    }
+    info->real_worktree = fd_to_worktree_path (info, fd);
+    close (fd);
+    if (!info->real_worktree)
+        goto error;
+
+    info->fanotify = TRUE;
+    info->mount_fd = mount_fd;
+    info->dir_cache = g_hash_table_new_full (g_str_hash, g_str_equal,
+                                             g_free, g_free);
+    g_free (handle);
+
+    return fan_fd;
+
+error:
+    g_free (handle);
+    if (mount_fd >= 0)
+        close (mount_fd);
+    close (fan_fd);
+    return -1;
+}
+
+#endif  /* USE_FANOTIFY */
+
 static gboolean
 process_events (SeafWTMonitorPriv *priv, const char *repo_id, int in_fd)
 {
@@ -392,6 +731,12 @@ process_events (SeafWTMonitorPriv *priv, const char *repo_id, int in_fd)
     char *dir;
     gboolean ret = FALSE;
 
+#ifdef USE_FANOTIFY
+    info = g_hash_table_lookup (priv->info_hash, (gpointer)(long)in_fd);
+    if (info && info->fanotify)
+        return process_fanotify_events (info, in_fd);
+#endif
+
     rc = ioctl (in_fd, FIONREAD, &buf_size);
     if (rc < 0) {
         seaf_warning ("Cannot get inotify event buf size: %s.\n", strerror(errno));
@@ -575,17 +920,34 @@ add_watch (SeafWTMonitorPriv *priv, const char *repo_id, const char *worktree)
     int inotify_fd;
     RepoWatchInfo *info;
 
+    info = create_repo_watch_info (repo_id, worktree);
+
+#ifdef USE_FANOTIFY
+    inotify_fd = add_fanotify_watch (info, worktree);
+    if (inotify_fd >= 0) {
+        seaf_message ("[wt mon] watching %s with fanotify.\n", worktree);
+
+        pthread_mutex_lock (&priv->hash_lock);
+        g_hash_table_insert (priv->handle_hash,
+                             g_strdup(repo_id), (gpointer)(long)inotify_fd);
+        g_hash_table_insert (priv->info_hash, (gpointer)(long)inotify_fd, info);
+        pthread_mutex_unlock (&priv->hash_lock);
+
+        add_event_to_queue (info->status, WT_EVENT_SCAN_DIR, "", NULL);
+        return inotify_fd;
+    }
+#endif
+
     inotify_fd = inotify_init ();
     if (inotify_fd < 0) {
         seaf_warning ("[wt mon] inotify_init failed: %s.\n", strerror(errno));
+        free_repo_watch_info (info);
         return -1;
     }
 
     pthread_mutex_lock (&priv->hash_lock);
     g_hash_table_insert (priv->handle_hash,
                          g_strdup(repo_id), (gpointer)(long)inotify_fd);
-
-    info = create_repo_watch_info (repo_id, worktree);
     g_hash_table_insert (priv->info_hash, (gpointer)(long)inotify_fd, info);
     pthread_mutex_unlock (&priv->hash_lock);
 
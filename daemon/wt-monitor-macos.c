@@ -13,20 +13,50 @@
 #include "seafile-session.h"
 #include "utils.h"
 #include "wt-monitor.h"
+#include "seafile-config.h"
 #define DEBUG_FLAG SEAFILE_DEBUG_WATCH
 #include "log.h"
 
+#define DEFAULT_LATENCY_MS 250
+
+/* Seconds between saves of the points watches can resume from. */
+#define SAVE_RESUME_INTERVAL 30.0
+
+#define ITEM_CONTENT_FLAGS                                              \
+    (kFSEventStreamEventFlagItemCreated | kFSEventStreamEventFlagItemRemoved \
+     | kFSEventStreamEventFlagItemRenamed | kFSEventStreamEventFlagItemModified)
+
+#define ITEM_ATTR_FLAGS                                                 \
+    (kFSEventStreamEventFlagItemXattrMod                                \
+     | kFSEventStreamEventFlagItemInodeMetaMod                          \
+     | kFSEventStreamEventFlagItemChangeOwner)
+
 typedef struct RepoWatchInfo {
     WTStatus *status;
     char *worktree;
+    gboolean file_events;
+    /* NULL if the event ids of the volume don't persist across boots. */
+    char *volume_uuid;
+    FSEventStreamEventId last_id;   /* all older events are queued */
+    FSEventStreamEventId saved_id;  /* stored as the resume point */
 } RepoWatchInfo;
 
 struct SeafWTMonitorPriv {
     pthread_mutex_t hash_lock;
     GHashTable *handle_hash;        /* repo_id -> inotify_fd (or handle) */
     GHashTable *info_hash;          /* inotify_fd(or handle in deeed) -> RepoWatchInfo */
+
+    CFTimeInterval latency;
+    gboolean file_events;
 };
 
+/* Changes to one path in a batch of events. */
+typedef struct PathChange {
+    char *full_path;
+    FSEventStreamEventFlags flags;
+    size_t last;                    /* index of the last event on the path */
+} PathChange;
+
 static void
 add_event_to_queue (WTStatus *status,
                     int type, const char *path, const char *new_path);
@@ -52,6 +82,7 @@ free_repo_watch_info (RepoWatchInfo *info)
 {
     wt_status_unref (info->status);
     g_free (info->worktree);
+    g_free (info->volume_uuid);
     g_free (info);
 }
 
@@ -97,124 +128,126 @@ add_event_to_queue (WTStatus *status,
 
     seaf_debug ("Adding event: %s, %s %s\n", name, path, new_path?new_path:"");
 
-    pthread_mutex_lock (&status->q_lock);
-    g_queue_push_tail (status->event_q, event);
-    pthread_mutex_unlock (&status->q_lock);
+    wt_status_push_event (status, event);
+
+    /* The changes can be committed once they're quiet. */
+    seaf_sync_manager_wake_repo (seaf->sync_mgr, status->repo_id,
+                                 seaf->sync_mgr->commit_quiet_period);
 }
 
-#if 0
-static void
-process_one_event (const char* eventPath,
-                   RepoWatchInfo *info,
-                   const char *worktree,
-                   const FSEventStreamEventId eventId,
-                   const FSEventStreamEventFlags eventFlags)
+/* Worktree relative path of @event_path, in NFC. */
+static char *
+get_relative_path (const char *worktree, const char *event_path)
 {
-    WTStatus *status = info->status;
-    char *filename;
-    char *event_path_nfc;
+    char *event_path_nfc, *path;
     const char *tmp;
+    int len;
 
-    event_path_nfc = g_utf8_normalize (eventPath, -1, G_NORMALIZE_NFC);
+    event_path_nfc = g_utf8_normalize (event_path, -1, G_NORMALIZE_NFC);
 
-    tmp = event_path_nfc + strlen(worktree);
+    tmp = event_path_nfc + MIN (strlen(worktree), strlen(event_path_nfc));
     if (*tmp == '/')
         tmp++;
-    filename = g_strdup(tmp);
+    path = g_strdup(tmp);
     g_free (event_path_nfc);
 
     /* Path for folder returned from system may contain a '/' at the end. */
-    int len = strlen(filename);
-    if (len > 0 && filename[len - 1] == '/')
-        filename[len - 1] = 0;
-
-    /* Reinterpreted RENAMED as combine of CREATED or DELETED event */
-    if (eventFlags & kFSEventStreamEventFlagItemRenamed) {
-        seaf_debug ("Rename Event Affected: %s \n", filename);
-        struct stat buf;
-        if (stat (eventPath, &buf)) {
-            /* ret = -1, file is gone */
-            add_event_to_queue (status, WT_EVENT_DELETE, filename, NULL);
-        } else {
-            /* ret = 0, file is here, but rename behaviour is unknown to us */
-            add_event_to_queue (status, WT_EVENT_CREATE_OR_UPDATE, filename, NULL);
-        }
-    } else if (eventFlags & kFSEventStreamEventFlagItemModified) {
-        seaf_debug ("Modified %s.\n", filename);
-        add_event_to_queue (status, WT_EVENT_CREATE_OR_UPDATE, filename, NULL);
-    } else if (eventFlags & kFSEventStreamEventFlagItemCreated) {
-        seaf_debug ("Created %s.\n", filename);
-         /**
-          * no need to rechecking recursively in FSEventStream
-          *
-          * these flags are useful if necessary:
-          * kFSEventStreamEventFlagItemIsFile
-          * kFSEventStreamEventFlagItemIsDir
-          * kFSEventStreamEventFlagItemIsSymlink
-          */
-        add_event_to_queue (status, WT_EVENT_CREATE_OR_UPDATE, filename, NULL);
-    } else if (eventFlags & kFSEventStreamEventFlagItemRemoved) {
-        seaf_debug ("Deleted %s.\n", filename);
-        add_event_to_queue (status, WT_EVENT_DELETE, filename, NULL);
-    } else if (eventFlags & kFSEventStreamEventFlagItemXattrMod) {
-        seaf_debug ("XattrMod %s.\n", filename);
-        add_event_to_queue (status, WT_EVENT_ATTRIB, filename, NULL);
-    } else if (eventFlags & kFSEventStreamEventFlagRootChanged) {
+    len = strlen(path);
+    if (len > 0 && path[len - 1] == '/')
+        path[len - 1] = 0;
+
+    return path;
+}
+
+/* Changes that can't be told path by path. Returns TRUE if @flags were
+ * such changes.
+ */
+static gboolean
+process_scan_event (RepoWatchInfo *info, const char *path,
+                    FSEventStreamEventFlags flags)
+{
+    WTStatus *status = info->status;
+
+    if (flags & (kFSEventStreamEventFlagUserDropped |
+                 kFSEventStreamEventFlagKernelDropped)) {
+        seaf_debug ("Events dropped, flags %x.\n", flags);
+        add_event_to_queue (status, WT_EVENT_OVERFLOW, NULL, NULL);
+    } else if (flags & kFSEventStreamEventFlagMustScanSubDirs) {
+        seaf_debug ("Must scan %s.\n", path);
+        if (path[0] == 0)
+            add_event_to_queue (status, WT_EVENT_SCAN_DIR, "", NULL);
+        else
+            add_event_to_queue (status, WT_EVENT_CREATE_OR_UPDATE, path, NULL);
+    } else if (flags & kFSEventStreamEventFlagRootChanged) {
         /* An empty path indicates repo-mgr to scan the whole worktree. */
         seaf_debug ("RootChange event.\n");
-        add_event_to_queue (info->status, WT_EVENT_CREATE_OR_UPDATE, "", NULL);
+        add_event_to_queue (status, WT_EVENT_CREATE_OR_UPDATE, "", NULL);
+    } else if (flags & kFSEventStreamEventFlagHistoryDone) {
+        seaf_debug ("Done replaying events of repo %s.\n", status->repo_id);
     } else {
-        seaf_debug ("Unhandled event with flags %x.\n", eventFlags);
+        return FALSE;
     }
 
-    g_free (filename);
-    g_atomic_int_set (&info->status->last_changed, (gint)time(NULL));
+    return TRUE;
 }
-#endif
 
+/*
+ * The flags of a file event are all the changes to the path since the
+ * last report, so only the current state of the path tells if it's still
+ * there.
+ */
 static void
-process_one_event (const char* eventPath,
-                   RepoWatchInfo *info,
-                   const char *worktree,
-                   const FSEventStreamEventId eventId,
-                   const FSEventStreamEventFlags eventFlags)
+process_file_event (RepoWatchInfo *info, const char *path,
+                    const char *full_path, FSEventStreamEventFlags flags)
 {
     WTStatus *status = info->status;
-    char *dirname;
-    char *event_path_nfc;
-    const char *tmp;
-
-    event_path_nfc = g_utf8_normalize (eventPath, -1, G_NORMALIZE_NFC);
+    struct stat st;
 
-    tmp = event_path_nfc + strlen(worktree);
-    if (*tmp == '/')
-        tmp++;
-    dirname = g_strdup(tmp);
-    g_free (event_path_nfc);
+    /* The changes of the root dir itself are the changes of its files. */
+    if (path[0] == 0)
+        return;
 
-    /* Path for folder returned from system may contain a '/' at the end. */
-    int len = strlen(dirname);
-    if (len > 0 && dirname[len - 1] == '/')
-        dirname[len - 1] = 0;
+    if (lstat (full_path, &st) < 0) {
+        seaf_debug ("Deleted %s, flags %x.\n", path, flags);
+        add_event_to_queue (status, WT_EVENT_DELETE, path, NULL);
+    } else if (!(flags & ITEM_CONTENT_FLAGS) && (flags & ITEM_ATTR_FLAGS)) {
+        seaf_debug ("Attributes changed %s.\n", path);
+        add_event_to_queue (status, WT_EVENT_ATTRIB, path, NULL);
+    } else if (flags & ITEM_CONTENT_FLAGS) {
+        seaf_debug ("Created or updated %s, flags %x.\n", path, flags);
+        add_event_to_queue (status, WT_EVENT_CREATE_OR_UPDATE, path, NULL);
+    } else {
+        seaf_debug ("Unhandled event with flags %x.\n", flags);
+    }
+}
 
-    if (eventFlags & kFSEventStreamEventFlagItemRenamed) {
+/* Without file events, only the dir containing the changes is reported. */
+static void
+process_dir_event (RepoWatchInfo *info, const char *dirname,
+                   FSEventStreamEventFlags flags)
+{
+    if (flags & kFSEventStreamEventFlagItemRenamed) {
         seaf_debug ("Rename event in dir: %s \n", dirname);
-    } else if (eventFlags & kFSEventStreamEventFlagItemModified) {
+    } else if (flags & kFSEventStreamEventFlagItemModified) {
         seaf_debug ("Modified event in dir %s.\n", dirname);
-    } else if (eventFlags & kFSEventStreamEventFlagItemCreated) {
+    } else if (flags & kFSEventStreamEventFlagItemCreated) {
         seaf_debug ("Created event in dir %s.\n", dirname);
-    } else if (eventFlags & kFSEventStreamEventFlagItemRemoved) {
+    } else if (flags & kFSEventStreamEventFlagItemRemoved) {
         seaf_debug ("Deleted event in dir %s.\n", dirname);
-    } else if (eventFlags & kFSEventStreamEventFlagItemXattrMod) {
+    } else if (flags & kFSEventStreamEventFlagItemXattrMod) {
         seaf_debug ("XattrMod event in dir %s.\n", dirname);
     } else {
-        seaf_debug ("Unhandled event with flags %x.\n", eventFlags);
+        seaf_debug ("Unhandled event with flags %x.\n", flags);
     }
 
-    add_event_to_queue (status, WT_EVENT_CREATE_OR_UPDATE, dirname, NULL);
+    add_event_to_queue (info->status, WT_EVENT_CREATE_OR_UPDATE, dirname, NULL);
+}
 
-    g_free (dirname);
-    g_atomic_int_set (&info->status->last_changed, (gint)time(NULL));
+static void
+free_path_change (PathChange *change)
+{
+    g_free (change->full_path);
+    g_free (change);
 }
 
 static void
@@ -226,11 +259,13 @@ stream_callback (ConstFSEventStreamRef streamRef,
                       const FSEventStreamEventId eventIds[])
 {
     RepoWatchInfo *info;
-    char *repo_id;
     SeafWTMonitor *monitor = (SeafWTMonitor *)clientCallBackInfo;
     SeafWTMonitorPriv *priv = monitor->priv;
     char **paths = (char **)eventPaths;
-    char *dir;
+    char **rel_paths;
+    GHashTable *changes;
+    PathChange *change;
+    size_t i;
 
     info = g_hash_table_lookup (priv->info_hash, (gpointer)(long)streamRef);
     if (!info) {
@@ -238,12 +273,141 @@ stream_callback (ConstFSEventStreamRef streamRef,
         return;
     }
 
-    int i;
+    /* Coalesce the events on each path, so that a path is queued once per
+     * batch, at the position of its last event.
+     */
+    rel_paths = g_new0 (char *, numEvents);
+    changes = g_hash_table_new_full (g_str_hash, g_str_equal,
+                                     NULL, (GDestroyNotify)free_path_change);
+
     for (i = 0; i < numEvents; i++) {
         seaf_debug("%ld Change %llu in %s, flags %x\n", (long)CFRunLoopGetCurrent(),
                    eventIds[i], paths[i], eventFlags[i]);
-        process_one_event (paths[i], info, info->worktree,
-                           eventIds[i], eventFlags[i]);
+
+        rel_paths[i] = get_relative_path (info->worktree, paths[i]);
+        change = g_hash_table_lookup (changes, rel_paths[i]);
+        if (!change) {
+            change = g_new0 (PathChange, 1);
+            change->full_path = g_strdup (paths[i]);
+            g_hash_table_insert (changes, rel_paths[i], change);
+        }
+        change->flags |= eventFlags[i];
+        change->last = i;
+    }
+
+    for (i = 0; i < numEvents; i++) {
+        change = g_hash_table_lookup (changes, rel_paths[i]);
+        if (change->last != i)
+            continue;
+
+        if (process_scan_event (info, rel_paths[i], change->flags))
+            continue;
+        if (info->file_events)
+            process_file_event (info, rel_paths[i], change->full_path,
+                                change->flags);
+        else
+            process_dir_event (info, rel_paths[i], change->flags);
+    }
+
+    if (numEvents > 0) {
+        info->last_id = MAX (info->last_id, eventIds[numEvents - 1]);
+        g_atomic_int_set (&info->status->last_changed, (gint)time(NULL));
+    }
+
+    g_hash_table_destroy (changes);
+    for (i = 0; i < numEvents; i++)
+        g_free (rel_paths[i]);
+    g_free (rel_paths);
+}
+
+/* Resume points */
+
+static char *
+get_volume_uuid (const char *worktree)
+{
+    struct stat st;
+    CFUUIDRef uuid;
+    CFStringRef str;
+    char buf[64];
+    char *ret = NULL;
+
+    if (stat (worktree, &st) < 0)
+        return NULL;
+
+    uuid = FSEventsCopyUUIDForDevice (st.st_dev);
+    if (!uuid)
+        return NULL;
+
+    str = CFUUIDCreateString (kCFAllocatorDefault, uuid);
+    if (CFStringGetCString (str, buf, sizeof(buf), kCFStringEncodingUTF8))
+        ret = g_strdup (buf);
+
+    CFRelease (str);
+    CFRelease (uuid);
+    return ret;
+}
+
+/* The resume point of a repo is "<volume uuid> <event id>". Event ids are
+ * only comparable on the same volume, and only until it's reformatted or
+ * its event database is purged, which changes the uuid.
+ */
+static FSEventStreamEventId
+load_resume_id (const char *repo_id, const char *volume_uuid)
+{
+    FSEventStreamEventId id = kFSEventStreamEventIdSinceNow;
+    char *value;
+    char **tokens;
+
+    if (!volume_uuid)
+        return id;
+
+    value = seaf_repo_manager_get_repo_property (seaf->repo_mgr, repo_id,
+                                                 REPO_PROP_WATCH_RESUME);
+    if (!value)
+        return id;
+
+    tokens = g_strsplit (value, " ", 2);
+    if (g_strv_length (tokens) == 2 && strcmp (tokens[0], volume_uuid) == 0) {
+        id = g_ascii_strtoull (tokens[1], NULL, 10);
+        if (id == 0)
+            id = kFSEventStreamEventIdSinceNow;
+    }
+
+    g_strfreev (tokens);
+    g_free (value);
+    return id;
+}
+
+/* A watch can resume from the last event once all the changes queued
+ * before it are in the saved index.
+ */
+static void
+save_resume_points (CFRunLoopTimerRef timer, void *vmonitor)
+{
+    SeafWTMonitor *monitor = vmonitor;
+    SeafWTMonitorPriv *priv = monitor->priv;
+    GHashTableIter iter;
+    gpointer key, value;
+    RepoWatchInfo *info;
+    char *resume;
+
+    /* The hash tables are only changed in this thread. */
+    g_hash_table_iter_init (&iter, priv->info_hash);
+    while (g_hash_table_iter_next (&iter, &key, &value)) {
+        info = value;
+        if (!info->volume_uuid || info->last_id == info->saved_id)
+            continue;
+        if (!wt_status_all_saved (info->status))
+            continue;
+
+        resume = g_strdup_printf ("%s %llu", info->volume_uuid,
+                                  (unsigned long long)info->last_id);
+        if (seaf_repo_manager_set_repo_property (seaf->repo_mgr,
+                                                 info->status->repo_id,
+                                                 REPO_PROP_WATCH_RESUME,
+                                                 resume) == 0)
+            info->saved_id = info->last_id;
+        g_free (resume);
     }
 }
 
@@ -252,7 +416,10 @@ add_watch (SeafWTMonitor *monitor, const char* repo_id, const char* worktree)
 {
     SeafWTMonitorPriv *priv = monitor->priv;
     RepoWatchInfo *info;
-    double latency = 0.25; /* unit: second */
+    FSEventStreamCreateFlags flags = kFSEventStreamCreateFlagWatchRoot;
+    FSEventStreamEventId since;
+    gboolean file_events;
+    char *volume_uuid;
 
     char *worktree_nfd = g_utf8_normalize (worktree, -1, G_NORMALIZE_NFD);
 
@@ -263,18 +430,26 @@ add_watch (SeafWTMonitor *monitor, const char* repo_id, const char* worktree)
     CFArrayRef pathsToWatch = CFArrayCreate(NULL, (const void **)mypaths, 1, NULL);
     FSEventStreamRef stream;
 
-    /* Create the stream, passing in a callback */
-    seaf_debug("Use kFSEventStreamCreateFlagWatchRoot\n");
     // kFSEventStreamCreateFlagFileEvents does not work for libraries with name
     // containing accent characters.
+    file_events = priv->file_events && g_str_is_ascii (worktree);
+    if (file_events)
+        flags |= kFSEventStreamCreateFlagFileEvents;
+
+    volume_uuid = get_volume_uuid (worktree);
+    since = load_resume_id (repo_id, volume_uuid);
+
+    /* Create the stream, passing in a callback */
+    seaf_debug ("Watch repo %s with %s events, latency %.3f s.\n", repo_id,
+                file_events ? "file" : "dir", priv->latency);
     struct FSEventStreamContext ctx = {0, monitor, NULL, NULL, NULL};
     stream = FSEventStreamCreate(kCFAllocatorDefault,
                                  stream_callback,
                                  &ctx,
                                  pathsToWatch,
-                                 kFSEventStreamEventIdSinceNow,
-                                 latency,
-                                 kFSEventStreamCreateFlagWatchRoot
+                                 since,
+                                 priv->latency,
+                                 flags
                                  );
 
     CFRelease (mypaths[0]);
@@ -282,6 +457,7 @@ add_watch (SeafWTMonitor *monitor, const char* repo_id, const char* worktree)
 
     if (!stream) {
         seaf_warning ("[wt] Failed to create event stream.\n");
+        g_free (volume_uuid);
         return stream;
     }
 
@@ -290,16 +466,26 @@ add_watch (SeafWTMonitor *monitor, const char* repo_id, const char* worktree)
     /* FSEventStreamShow (stream); */
     seaf_debug ("[wt mon] Add repo %s watch success: %s.\n", repo_id, worktree);
 
+    info = create_repo_watch_info (repo_id, worktree);
+    info->file_events = file_events;
+    info->volume_uuid = volume_uuid;
+
     pthread_mutex_lock (&priv->hash_lock);
     g_hash_table_insert (priv->handle_hash,
                          g_strdup(repo_id), (gpointer)(long)stream);
-
-    info = create_repo_watch_info (repo_id, worktree);
     g_hash_table_insert (priv->info_hash, (gpointer)(long)stream, info);
     pthread_mutex_unlock (&priv->hash_lock);
 
-    /* A special event indicates repo-mgr to scan the whole worktree. */
-    add_event_to_queue (info->status, WT_EVENT_SCAN_DIR, "", NULL);
+    if (since != kFSEventStreamEventIdSinceNow) {
+        /* The changes while the watch was down are replayed. */
+        seaf_message ("Resume watching repo %s from event %llu.\n",
+                      repo_id, (unsigned long long)since);
+        info->last_id = info->saved_id = since;
+    } else {
+        /* A special event indicates repo-mgr to scan the whole worktree. */
+        info->last_id = FSEventsGetCurrentEventId ();
+        add_event_to_queue (info->status, WT_EVENT_SCAN_DIR, "", NULL);
+    }
     return stream;
 }
 
@@ -343,12 +529,44 @@ add_command_pipe (SeafWTMonitor *monitor)
     return 0;
 }
 
+static void
+load_watch_config (SeafWTMonitorPriv *priv)
+{
+    gboolean exists;
+    int latency_ms;
+
+    latency_ms = seafile_session_config_get_int (seaf, KEY_FSEVENTS_LATENCY,
+                                                 &exists);
+    if (!exists || latency_ms < 0)
+        latency_ms = DEFAULT_LATENCY_MS;
+    priv->latency = latency_ms / 1000.0;
+
+    priv->file_events = !seafile_session_config_get_bool (seaf,
+                                                          KEY_FSEVENTS_DIR_EVENTS);
+}
+
+static void
+add_resume_timer (SeafWTMonitor *monitor)
+{
+    CFRunLoopTimerContext ctx = {0, monitor, NULL, NULL, NULL};
+    CFRunLoopTimerRef timer;
+
+    timer = CFRunLoopTimerCreate (kCFAllocatorDefault,
+                                  CFAbsoluteTimeGetCurrent() + SAVE_RESUME_INTERVAL,
+                                  SAVE_RESUME_INTERVAL, 0, 0,
+                                  save_resume_points, &ctx);
+    CFRunLoopAddTimer (CFRunLoopGetCurrent(), timer, kCFRunLoopDefaultMode);
+    CFRelease (timer);
+}
+
 static void *
 wt_monitor_job_darwin (void *vmonitor)
 {
     SeafWTMonitor *monitor = (SeafWTMonitor *)vmonitor;
 
+    load_watch_config (monitor->priv);
     add_command_pipe (monitor);
+    add_resume_timer (monitor);
     while (1) {
         CFRunLoopRun();
     }
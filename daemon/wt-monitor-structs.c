@@ -41,6 +41,8 @@ WTStatus *create_wt_status (const char *repo_id)
 
     memcpy (status->repo_id, repo_id, 36);
     status->event_q = g_queue_new ();
+    status->event_index = g_sequence_new (NULL);
+    status->next_seq = 1;
     pthread_mutex_init (&status->q_lock, NULL);
 
     status->active_paths = g_queue_new ();
@@ -66,6 +68,7 @@ static void free_wt_status (WTStatus *status)
         g_queue_foreach (status->event_q, free_event_cb, NULL);
         g_queue_free (status->event_q);
     }
+    g_sequence_free (status->event_index);
     pthread_mutex_destroy (&status->q_lock);
     g_free (status);
 }
@@ -84,3 +87,235 @@ wt_status_unref (WTStatus *status)
     if (--(status->ref_count) <= 0)
         free_wt_status (status);
 }
+
+/* Event queue */
+
+static gboolean
+is_indexed_type (int type)
+{
+    return (type == WT_EVENT_CREATE_OR_UPDATE ||
+            type == WT_EVENT_ATTRIB ||
+            type == WT_EVENT_DELETE);
+}
+
+static gint
+compare_indexed_events (gconstpointer a, gconstpointer b, gpointer user_data)
+{
+    const WTEvent *e1 = a, *e2 = b;
+    int rc = strcmp (e1->path, e2->path);
+
+    if (rc != 0)
+        return rc;
+    return e1->ev_type - e2->ev_type;
+}
+
+static WTEvent *
+find_indexed_event (WTStatus *status, const char *path, int type)
+{
+    WTEvent key;
+    GSequenceIter *iter;
+    WTEvent *event;
+
+    key.path = (char *)path;
+    key.ev_type = type;
+
+    /* Points after the equal element, if there's one. */
+    iter = g_sequence_search (status->event_index, &key,
+                              compare_indexed_events, NULL);
+    if (g_sequence_iter_is_begin (iter))
+        return NULL;
+    event = g_sequence_get (g_sequence_iter_prev (iter));
+    if (compare_indexed_events (event, &key, NULL) != 0)
+        return NULL;
+    return event;
+}
+
+static void
+drop_queued_event (WTStatus *status, WTEvent *event)
+{
+    g_sequence_remove (event->index_iter);
+    g_queue_delete_link (status->event_q, event->link);
+    wt_event_free (event);
+}
+
+static void
+append_event (WTStatus *status, WTEvent *event)
+{
+    event->seq = status->next_seq++;
+    g_queue_push_tail (status->event_q, event);
+    event->link = g_queue_peek_tail_link (status->event_q);
+}
+
+/* Merge with an earlier event of the same type on the same path. */
+static gboolean
+move_to_tail (WTStatus *status, WTEvent *event)
+{
+    WTEvent *old = find_indexed_event (status, event->path, event->ev_type);
+
+    if (!old)
+        return FALSE;
+
+    g_queue_unlink (status->event_q, old->link);
+    old->seq = status->next_seq++;
+    g_queue_push_tail_link (status->event_q, old->link);
+    return TRUE;
+}
+
+/*
+ * Drop the queued updates of everything under @path, and of @path itself.
+ * Queued deletes under @path are only dropped if @drop_deletes is set:
+ * rename has to see them to not carry the deleted entries along.
+ */
+static void
+drop_subtree_events (WTStatus *status, const char *path, gboolean drop_deletes)
+{
+    WTEvent key, *event;
+    GSequenceIter *iter, *next;
+    char *prefix;
+    size_t len;
+
+    if (path[0] == 0)
+        return;
+
+    if ((event = find_indexed_event (status, path, WT_EVENT_CREATE_OR_UPDATE)))
+        drop_queued_event (status, event);
+    if ((event = find_indexed_event (status, path, WT_EVENT_ATTRIB)))
+        drop_queued_event (status, event);
+
+    prefix = g_strconcat (path, "/", NULL);
+    len = strlen (prefix);
+
+    /* Paths under @path sort together, right after the prefix itself. */
+    key.path = prefix;
+    key.ev_type = -1;
+    iter = g_sequence_search (status->event_index, &key,
+                              compare_indexed_events, NULL);
+    while (!g_sequence_iter_is_end (iter)) {
+        event = g_sequence_get (iter);
+        if (strncmp (event->path, prefix, len) != 0)
+            break;
+        next = g_sequence_iter_next (iter);
+        if (drop_deletes || event->ev_type != WT_EVENT_DELETE)
+            drop_queued_event (status, event);
+        iter = next;
+    }
+
+    g_free (prefix);
+}
+
+void
+wt_status_push_event (WTStatus *status, WTEvent *event)
+{
+    pthread_mutex_lock (&status->q_lock);
+
+    if (event->ev_type == WT_EVENT_OVERFLOW)
+        ++status->n_overflows;
+
+    if (event->ev_type == WT_EVENT_DELETE)
+        drop_subtree_events (status, event->path, TRUE);
+    else if (event->ev_type == WT_EVENT_RENAME)
+        drop_subtree_events (status, event->path, FALSE);
+
+    if (is_indexed_type (event->ev_type) && move_to_tail (status, event)) {
+        pthread_mutex_unlock (&status->q_lock);
+        wt_event_free (event);
+        return;
+    }
+
+    append_event (status, event);
+    if (is_indexed_type (event->ev_type))
+        event->index_iter = g_sequence_insert_sorted (status->event_index, event,
+                                                      compare_indexed_events,
+                                                      NULL);
+
+    pthread_mutex_unlock (&status->q_lock);
+}
+
+void
+wt_status_push_event_head (WTStatus *status, WTEvent *event)
+{
+    pthread_mutex_lock (&status->q_lock);
+    /* Later events on the same path aren't merged into this one. */
+    g_queue_push_head (status->event_q, event);
+    event->link = g_queue_peek_head_link (status->event_q);
+    pthread_mutex_unlock (&status->q_lock);
+}
+
+WTEvent *
+wt_status_pop_event (WTStatus *status)
+{
+    WTEvent *event;
+
+    pthread_mutex_lock (&status->q_lock);
+    event = g_queue_pop_head (status->event_q);
+    if (event) {
+        status->taken_seq = event->seq;
+        event->link = NULL;
+        if (event->index_iter) {
+            g_sequence_remove (event->index_iter);
+            event->index_iter = NULL;
+        }
+    }
+    pthread_mutex_unlock (&status->q_lock);
+
+    return event;
+}
+
+guint64
+wt_status_last_event_seq (WTStatus *status)
+{
+    WTEvent *event;
+    guint64 seq;
+
+    pthread_mutex_lock (&status->q_lock);
+    event = g_queue_peek_tail (status->event_q);
+    seq = event ? event->seq : 0;
+    pthread_mutex_unlock (&status->q_lock);
+
+    return seq;
+}
+
+gint64
+wt_status_get_overflows (WTStatus *status)
+{
+    gint64 n;
+
+    pthread_mutex_lock (&status->q_lock);
+    n = status->n_overflows;
+    pthread_mutex_unlock (&status->q_lock);
+
+    return n;
+}
+
+guint
+wt_status_get_queue_length (WTStatus *status)
+{
+    guint n;
+
+    pthread_mutex_lock (&status->q_lock);
+    n = g_queue_get_length (status->event_q);
+    pthread_mutex_unlock (&status->q_lock);
+
+    return n;
+}
+
+void
+wt_status_mark_saved (WTStatus *status)
+{
+    pthread_mutex_lock (&status->q_lock);
+    status->saved_seq = status->taken_seq;
+    pthread_mutex_unlock (&status->q_lock);
+}
+
+gboolean
+wt_status_all_saved (WTStatus *status)
+{
+    gboolean ret;
+
+    pthread_mutex_lock (&status->q_lock);
+    ret = (g_queue_get_length (status->event_q) == 0 &&
+           status->saved_seq == status->taken_seq);
+    pthread_mutex_unlock (&status->q_lock);
+
+    return ret;
+}
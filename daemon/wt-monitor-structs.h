@@ -23,6 +23,13 @@ typedef struct WTEvent {
      * this queue so that we don't have to rescan the dir from beginning.
      */
     GQueue *remain_files;
+
+    /* Position in the event queue, and in the coalescing index if this
+     * event can be merged with later events on the same path.
+     */
+    guint64 seq;
+    GList *link;
+    GSequenceIter *index_iter;
 } WTEvent;
 
 WTEvent *wt_event_new (int type, const char *path, const char *new_path);
@@ -43,6 +50,16 @@ typedef struct WTStatus {
 
     pthread_mutex_t q_lock;
     GQueue *event_q;
+    /* Updates, attribute changes and deletes in event_q, sorted by path. */
+    GSequence *event_index;
+    guint64 next_seq;
+    /* Times the changes were too many for the monitor to keep. */
+    gint64 n_overflows;
+    /* Seq of the last event popped, and of the last one popped before
+     * the index was saved.
+     */
+    guint64 taken_seq;
+    guint64 saved_seq;
 
     /* Paths that're updated. They corresponds to CREATE_OR_UPDATE events.
      * Use a separate queue since we need to process them simultaneously with
@@ -59,4 +76,35 @@ void wt_status_ref (WTStatus *status);
 
 void wt_status_unref (WTStatus *status);
 
+/*
+ * Add @event to the tail of the event queue, taking ownership of it.
+ *
+ * Repeated updates or attribute changes of a path are merged into one
+ * event at the tail. A delete or rename of a dir drops the queued
+ * updates in its subtree, since the dir is handled as a whole. Must not be
+ * called with q_lock held.
+ */
+void wt_status_push_event (WTStatus *status, WTEvent *event);
+
+/* Put back an event taken by wt_status_pop_event(), to be processed first. */
+void wt_status_push_event_head (WTStatus *status, WTEvent *event);
+
+/* Returns NULL if the queue is empty. */
+WTEvent *wt_status_pop_event (WTStatus *status);
+
+/* Sequence number of the newest event, or 0 if the queue is empty. */
+guint64 wt_status_last_event_seq (WTStatus *status);
+
+/* Number of overflow events pushed since the repo was watched. */
+gint64 wt_status_get_overflows (WTStatus *status);
+
+/* Number of events in the queue. */
+guint wt_status_get_queue_length (WTStatus *status);
+
+/* Record that the events popped so far are in the saved index. */
+void wt_status_mark_saved (WTStatus *status);
+
+/* TRUE if every event pushed so far is in the saved index. */
+gboolean wt_status_all_saved (WTStatus *status);
+
 #endif
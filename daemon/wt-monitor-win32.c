@@ -22,14 +22,23 @@
     FILE_NOTIFY_CHANGE_FILE_NAME |  FILE_NOTIFY_CHANGE_LAST_WRITE \
     | FILE_NOTIFY_CHANGE_DIR_NAME | FILE_NOTIFY_CHANGE_SIZE 
 
-/* Use large buffer to prevent events overflow. */
-#define DIR_WATCH_BUFSIZE 1 << 20 /* 1MB */
+/* Use large buffer to prevent events overflow. The buffer of a repo is
+ * doubled, up to DIR_WATCH_MAX_BUFSIZE, each time it overflows.
+ */
+#define DIR_WATCH_BUFSIZE (1 << 20) /* 1MB */
+#define DIR_WATCH_MAX_BUFSIZE (8 << 20)
+/* Network shares don't accept buffers larger than 64KB. */
+#define DIR_WATCH_NET_BUFSIZE (64 << 10)
 
 /* Hold the OVERLAPPED struct for asynchronous ReadDirectoryChangesW(), and
-   the buf to receive dir change info. */
+   the bufs to receive dir change info. While the changes in one buf are
+   processed, the kernel fills the other one.
+*/
 typedef struct DirWatchAux {
     OVERLAPPED ol;
-    char buf[DIR_WATCH_BUFSIZE];
+    char *bufs[2];
+    int cur;                    /* the buf of the outstanding read */
+    DWORD buf_size;
     gboolean unused;
 } DirWatchAux;
 
@@ -51,11 +60,18 @@ typedef struct RepoWatchInfo {
     char *worktree;
 } RepoWatchInfo;
 
+typedef struct WatchBufSize {
+    DWORD size;
+    DWORD max;                  /* lowered for network shares */
+} WatchBufSize;
+
 struct SeafWTMonitorPriv {
     pthread_mutex_t hash_lock;
     GHashTable *handle_hash;    /* repo_id -> dir handle */
     GHashTable *info_hash;      /* handle -> RepoWatchInfo  */
     GHashTable *buf_hash;       /* handle -> aux buf */
+    /* repo_id -> WatchBufSize, kept across re-watches of the repo. */
+    GHashTable *buf_sizes;
 
     HANDLE iocp_handle;
 
@@ -67,6 +83,8 @@ static void *wt_monitor_job_win32 (void *vmonitor);
 
 static void handle_watch_command (SeafWTMonitor *monitor, WatchCommand *cmd);
 
+static HANDLE get_handle_of_path (const wchar_t *path);
+
 /* RenameInfo */
 
 static RenameInfo *create_rename_info ()
@@ -122,6 +140,43 @@ free_repo_watch_info (RepoWatchInfo *info)
     g_free (info);
 }
 
+/* DirWatchAux */
+
+static DirWatchAux *
+create_dir_watch_aux (DWORD buf_size)
+{
+    DirWatchAux *aux = g_new0 (DirWatchAux, 1);
+
+    aux->bufs[0] = g_malloc (buf_size);
+    aux->bufs[1] = g_malloc (buf_size);
+    aux->buf_size = buf_size;
+
+    return aux;
+}
+
+static void
+free_dir_watch_aux (DirWatchAux *aux)
+{
+    g_free (aux->bufs[0]);
+    g_free (aux->bufs[1]);
+    g_free (aux);
+}
+
+static WatchBufSize *
+get_watch_buf_size (SeafWTMonitorPriv *priv, const char *repo_id)
+{
+    WatchBufSize *size = g_hash_table_lookup (priv->buf_sizes, repo_id);
+
+    if (!size) {
+        size = g_new0 (WatchBufSize, 1);
+        size->size = DIR_WATCH_BUFSIZE;
+        size->max = DIR_WATCH_MAX_BUFSIZE;
+        g_hash_table_insert (priv->buf_sizes, g_strdup(repo_id), size);
+    }
+
+    return size;
+}
+
 static inline void
 init_overlapped(OVERLAPPED *ol)
 {
@@ -164,9 +219,11 @@ add_event_to_queue (WTStatus *status,
 
     seaf_debug ("Adding event: %s, %s %s\n", name, path, new_path?new_path:"");
 
-    pthread_mutex_lock (&status->q_lock);
-    g_queue_push_tail (status->event_q, event);
-    pthread_mutex_unlock (&status->q_lock);
+    wt_status_push_event (status, event);
+
+    /* The changes can be committed once they're quiet. */
+    seaf_sync_manager_wake_repo (seaf->sync_mgr, status->repo_id,
+                                 seaf->sync_mgr->commit_quiet_period);
 
     if (type == WT_EVENT_CREATE_OR_UPDATE) {
         pthread_mutex_lock (&status->ap_q_lock);
@@ -191,13 +248,16 @@ start_watch_dir_change(SeafWTMonitorPriv *priv, HANDLE dir_handle)
 
     BOOL first_alloc = FALSE;
     DirWatchAux *aux = g_hash_table_lookup (priv->buf_hash, dir_handle);
+    RepoWatchInfo *info = g_hash_table_lookup (priv->info_hash, dir_handle);
+    WatchBufSize *size = NULL;
 
     /* allocate aux buffer at the first watch, it would be freed if the repo
        is removed
     */
     if (!aux) {
         first_alloc = TRUE;
-        aux = g_new0(DirWatchAux, 1);
+        size = get_watch_buf_size (priv, info->status->repo_id);
+        aux = create_dir_watch_aux (size->size);
         init_overlapped(&aux->ol);
     }
 
@@ -207,18 +267,30 @@ start_watch_dir_change(SeafWTMonitorPriv *priv, HANDLE dir_handle)
     */
     BOOL ret;
     DWORD code;
-    RepoWatchInfo *info;
 retry:
     ret = ReadDirectoryChangesW
         (dir_handle,            /* dir handle */
-         aux->buf,              /* buf to hold change info */
-         DIR_WATCH_BUFSIZE,     /* buf size */
+         aux->bufs[aux->cur],   /* buf to hold change info */
+         aux->buf_size,         /* buf size */
          TRUE,                  /* watch subtree */
          DIR_WATCH_MASK,        /* notify filter */
          NULL,                  /* bytes returned */
          &aux->ol,              /* pointer to overlapped */
          NULL);                 /* completion routine */
 
+    if (!ret && first_alloc &&
+        GetLastError() == ERROR_INVALID_PARAMETER &&
+        aux->buf_size > DIR_WATCH_NET_BUFSIZE) {
+        /* The worktree is on a network share. */
+        seaf_message ("Using %d KB watch buffer for repo %s.\n",
+                      DIR_WATCH_NET_BUFSIZE >> 10, info->status->repo_id);
+        size->size = size->max = DIR_WATCH_NET_BUFSIZE;
+        free_dir_watch_aux (aux);
+        aux = create_dir_watch_aux (size->size);
+        init_overlapped(&aux->ol);
+        goto retry;
+    }
+
     if (!ret) {
         code = GetLastError();
         seaf_warning("Failed to ReadDirectoryChangesW, "
@@ -226,12 +298,11 @@ retry:
 
         if (first_alloc)
             /* if failed at the first watch, free the aux buffer */
-            g_free(aux);
+            free_dir_watch_aux(aux);
         else if (code == ERROR_NOTIFY_ENUM_DIR) {
             /* If buffer overflowed after the last call,
              * add an overflow event and retry watch.
              */
-            info = g_hash_table_lookup (priv->info_hash, dir_handle);
             add_event_to_queue (info->status, WT_EVENT_OVERFLOW, NULL, NULL);
             goto retry;
         }
@@ -524,14 +595,124 @@ process_events (const char *repo_id, RepoWatchInfo *info,
     return TRUE;
 }
 
+/* Move the watch of @info to a new handle, whose first read allocates a
+ * buffer of the current size of the repo. The kernel buffer of a handle
+ * is allocated at its first read and keeps that size.
+ */
+static int
+rewatch_with_new_buf (SeafWTMonitor *monitor, HANDLE old_handle,
+                      RepoWatchInfo *info)
+{
+    SeafWTMonitorPriv *priv = monitor->priv;
+    HANDLE new_handle;
+    wchar_t *path;
+
+    path = wchar_from_utf8 (info->worktree);
+    new_handle = get_handle_of_path (path);
+    g_free (path);
+    if (!new_handle)
+        return -1;
+
+    pthread_mutex_lock (&priv->hash_lock);
+    g_hash_table_steal (priv->info_hash, old_handle);
+    g_hash_table_insert (priv->info_hash, (gpointer)new_handle, info);
+    g_hash_table_insert (priv->handle_hash,
+                         g_strdup(info->status->repo_id), (gpointer)new_handle);
+    pthread_mutex_unlock (&priv->hash_lock);
+
+    /* No read is outstanding on the old handle, so its aux can go now. */
+    g_hash_table_remove (priv->buf_hash, old_handle);
+    CloseHandle (old_handle);
+
+    if (!add_handle_to_iocp (monitor, new_handle)) {
+        seaf_warning ("Failed to watch worktree of repo %s again.\n",
+                      info->status->repo_id);
+        return -1;
+    }
+
+    return 0;
+}
+
+/* The kernel drops all the changes of a read when they don't fit in the
+ * buffer, and completes it with no bytes.
+ */
+static void
+handle_overflow (SeafWTMonitor *monitor, HANDLE dir_handle,
+                 RepoWatchInfo *info)
+{
+    SeafWTMonitorPriv *priv = monitor->priv;
+    DirWatchAux *aux = g_hash_table_lookup (priv->buf_hash, dir_handle);
+    WatchBufSize *size = get_watch_buf_size (priv, info->status->repo_id);
+
+    add_event_to_queue (info->status, WT_EVENT_OVERFLOW, NULL, NULL);
+
+    if (size->size < size->max) {
+        size->size = MIN (size->size * 2, size->max);
+        seaf_message ("Worktree changes of repo %s overflowed %"G_GINT64_FORMAT
+                      " times, growing watch buffer to %lu KB.\n",
+                      info->status->repo_id, wt_status_get_overflows (info->status),
+                      size->size >> 10);
+        if (rewatch_with_new_buf (monitor, dir_handle, info) == 0)
+            return;
+    } else {
+        seaf_message ("Worktree changes of repo %s overflowed %"G_GINT64_FORMAT
+                      " times.\n", info->status->repo_id,
+                      wt_status_get_overflows (info->status));
+    }
+
+    reset_overlapped (&aux->ol);
+    if (!start_watch_dir_change (priv, dir_handle))
+        seaf_warning ("start_watch_dir_change failed for repo %s.\n",
+                      info->status->repo_id);
+}
+
+/* Handle a completed read on @dir_handle. @error is 0 on success. */
+static void
+handle_dir_change (SeafWTMonitor *monitor, HANDLE dir_handle,
+                   DWORD bytes_read, DWORD error)
+{
+    SeafWTMonitorPriv *priv = monitor->priv;
+    RepoWatchInfo *info;
+    DirWatchAux *aux;
+    int done;
+
+    info = g_hash_table_lookup (priv->info_hash, dir_handle);
+    if (!info) {
+        /* A previously unwatched dir_handle's DirWatchAux buf was
+           scheduled to be freed. */
+        g_hash_table_remove (priv->buf_hash, dir_handle);
+        return;
+    }
+
+    if (error != 0 && error != ERROR_NOTIFY_ENUM_DIR) {
+        seaf_warning ("Failed to read worktree changes of repo %s, "
+                      "error code %lu.\n", info->status->repo_id, error);
+        return;
+    }
+
+    if (bytes_read == 0) {
+        handle_overflow (monitor, dir_handle, info);
+        return;
+    }
+
+    /* Let the kernel fill the other buf while this one is processed. */
+    aux = g_hash_table_lookup (priv->buf_hash, dir_handle);
+    done = aux->cur;
+    aux->cur = !aux->cur;
+    reset_overlapped (&aux->ol);
+    if (!start_watch_dir_change (priv, dir_handle))
+        seaf_warning ("start_watch_dir_change failed "
+                      "for repo %s, error code %lu\n",
+                      info->status->repo_id, GetLastError());
+
+    process_events (info->status->repo_id, info, aux->bufs[done], bytes_read);
+}
+
 static void *
 wt_monitor_job_win32 (void *vmonitor)
 {
     SeafWTMonitor *monitor = vmonitor;
     SeafWTMonitorPriv *priv = monitor->priv;
-    /* 2 * sizeof(inotify_event) + 256, should be large enough for one event.*/
-    RepoWatchInfo *info;
-
 
     DWORD bytesRead = 0;
     ULONG_PTR key = 0;
@@ -560,7 +741,13 @@ wt_monitor_job_win32 (void *vmonitor)
 
         static int retry;
 
-        if (!ret) {
+        if (!ret && ol && key != (ULONG_PTR)monitor->cmd_pipe[0]) {
+            /* A read on a dir handle failed, or was aborted since the
+             * handle was closed.
+             */
+            handle_dir_change (monitor, (HANDLE)key, 0, GetLastError());
+            continue;
+        } else if (!ret) {
             seaf_warning ("GetQueuedCompletionStatus failed, "
                           "error code %lu", GetLastError());
 
@@ -594,29 +781,7 @@ wt_monitor_job_win32 (void *vmonitor)
 
         } else {
             /* Trigger by one of the dir watch handles */
-
-            HANDLE hTriggered = (HANDLE)key;
-            info = (RepoWatchInfo *)g_hash_table_lookup
-                (priv->info_hash, (gconstpointer)hTriggered); 
-
-            if (info) {
-                DirWatchAux *aux = g_hash_table_lookup (priv->buf_hash,
-                                                        (gconstpointer)hTriggered);
-
-                process_events (info->status->repo_id, info, aux->buf, bytesRead);
-
-                reset_overlapped(ol);
-                if (!start_watch_dir_change(priv, hTriggered)) {
-
-                    seaf_warning ("start_watch_dir_change failed"
-                                  "for repo %s, error code %lu\n",
-                                  info->status->repo_id, GetLastError());
-                }
-            } else {
-                /* A previously unwatched dir_handle's DirWatchAux buf was
-                   scheduled to be freed. */
-                g_hash_table_remove (priv->buf_hash, (gconstpointer)hTriggered);
-            }
+            handle_dir_change (monitor, (HANDLE)key, bytesRead, 0);
         }
     }
     return NULL;
@@ -794,7 +959,10 @@ seaf_wt_monitor_new (SeafileSession *seaf)
         (g_direct_hash, g_direct_equal, NULL, (GDestroyNotify)free_repo_watch_info);
 
     priv->buf_hash = g_hash_table_new_full
-        (g_direct_hash, g_direct_equal, NULL, g_free);
+        (g_direct_hash, g_direct_equal, NULL, (GDestroyNotify)free_dir_watch_aux);
+
+    priv->buf_sizes = g_hash_table_new_full
+        (g_str_hash, g_str_equal, g_free, g_free);
 
     monitor->priv = priv;
     monitor->seaf = seaf;
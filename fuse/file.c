@@ -3,6 +3,8 @@
 #define FUSE_USE_VERSION  26
 #include <fuse.h>
 
+#include <pthread.h>
+
 #include <glib.h>
 #include <glib-object.h>
 
@@ -11,97 +13,430 @@
 
 #include "log.h"
 #include "utils.h"
+#include "obj-cache.h"
 
 #include "seaf-fuse.h"
 
-int read_file(SeafileSession *seaf,
-              const char *store_id, int version,
-              Seafile *file,
-              char *buf, size_t size,
-              off_t offset, struct fuse_file_info *info)
+#define DEFAULT_BLOCK_CACHE_SIZE 256    /* MB */
+#define DEFAULT_READ_AHEAD_BLOCKS 2
+#define OFFSET_CACHE_SIZE (16 << 20)
+#define STAT_BATCH 256
+
+/*
+ * Whole blocks recently read by any open file. Reading a file in small
+ * chunks would otherwise open and read the same block again for each
+ * chunk.
+ */
+typedef struct CachedBlock {
+    gint ref;
+    char *data;
+    guint32 size;
+} CachedBlock;
+
+static ObjCache *block_cache;
+static int read_ahead_blocks;
+
+/*
+ * Start offsets of the blocks of whole files, keyed by file id, so that
+ * the blocks of a file are only stat'ed once, not on each open.
+ */
+typedef struct BlockOffsets {
+    int n;
+    gint64 *offsets;
+} BlockOffsets;
+
+static ObjCache *offset_cache;
+
+/* "<store id>/<block id>" of the blocks being read ahead. */
+static GHashTable *prefetching;
+static pthread_mutex_t prefetch_lock = PTHREAD_MUTEX_INITIALIZER;
+
+struct FuseFile {
+    char store_id[37];
+    int version;
+    Seafile *file;
+
+    pthread_mutex_t lock;
+    /* offsets[i] is where block i starts, known for i < n_offsets. */
+    gint64 *offsets;
+    int n_offsets;
+    /* Where the last read ended, to tell sequential reads. */
+    gint64 next_offset;
+    /* Blocks up to this one have been read ahead. */
+    int read_ahead_end;
+};
+
+static gpointer
+cached_block_ref (gpointer value)
 {
-    BlockHandle *handle = NULL;;
+    CachedBlock *block = value;
+
+    g_atomic_int_inc (&block->ref);
+    return block;
+}
+
+static void
+cached_block_unref (CachedBlock *block)
+{
+    if (!block)
+        return;
+
+    if (g_atomic_int_dec_and_test (&block->ref)) {
+        g_free (block->data);
+        g_free (block);
+    }
+}
+
+static BlockOffsets *
+block_offsets_copy (BlockOffsets *bo)
+{
+    BlockOffsets *copy = g_new0 (BlockOffsets, 1);
+
+    copy->n = bo->n;
+    copy->offsets = g_memdup (bo->offsets, bo->n * sizeof(gint64));
+    return copy;
+}
+
+static void
+block_offsets_free (BlockOffsets *bo)
+{
+    g_free (bo->offsets);
+    g_free (bo);
+}
+
+void
+fuse_block_cache_init (SeafileSession *seaf)
+{
+    GError *error = NULL;
+    int size;
+
+    /*
+     * [fuse]
+     * block_cache_size = 256   # MB, 0 to disable
+     * read_ahead_blocks = 2
+     */
+    size = g_key_file_get_integer (seaf->config, "fuse", "block_cache_size",
+                                   &error);
+    if (error) {
+        size = DEFAULT_BLOCK_CACHE_SIZE;
+        g_clear_error (&error);
+    }
+
+    read_ahead_blocks = g_key_file_get_integer (seaf->config, "fuse",
+                                                "read_ahead_blocks", &error);
+    if (error) {
+        read_ahead_blocks = DEFAULT_READ_AHEAD_BLOCKS;
+        g_clear_error (&error);
+    }
+
+    offset_cache = obj_cache_new (OFFSET_CACHE_SIZE,
+                                  (ObjCacheCopyFunc)block_offsets_copy,
+                                  (GDestroyNotify)block_offsets_free);
+
+    if (size <= 0) {
+        read_ahead_blocks = 0;
+        return;
+    }
+
+    block_cache = obj_cache_new ((guint64)size << 20, cached_block_ref,
+                                 (GDestroyNotify)cached_block_unref);
+    prefetching = g_hash_table_new_full (g_str_hash, g_str_equal,
+                                         g_free, NULL);
+}
+
+static CachedBlock *
+load_block (SeafileSession *seaf, const char *store_id, int version,
+            const char *block_id)
+{
+    BlockHandle *handle;
     BlockMetadata *bmd;
-    char *blkid;
-    char *ptr;
-    off_t off = 0, nleft;
-    int i, n, ret = -EIO;
+    CachedBlock *block = NULL;
+    guint32 size;
+    int n, done = 0;
 
-    for (i = 0; i < file->n_blocks; i++) {
-        blkid = file->blk_sha1s[i];
+    handle = seaf_block_manager_open_block (seaf->block_mgr,
+                                            store_id, version,
+                                            block_id, BLOCK_READ);
+    if (!handle) {
+        seaf_warning ("Failed to open block %s.\n", block_id);
+        return NULL;
+    }
 
-        bmd = seaf_block_manager_stat_block(seaf->block_mgr, store_id, version, blkid);
-        if (!bmd)
-            return -EIO;
+    bmd = seaf_block_manager_stat_block_by_handle (seaf->block_mgr, handle);
+    if (!bmd) {
+        seaf_warning ("Failed to stat block %s.\n", block_id);
+        goto out;
+    }
+    size = bmd->size;
+    g_free (bmd);
+
+    block = g_new0 (CachedBlock, 1);
+    block->ref = 1;
+    block->size = size;
+    block->data = g_malloc (MAX (size, 1));
+
+    while (done < size) {
+        n = seaf_block_manager_read_block (seaf->block_mgr, handle,
+                                           block->data + done, size - done);
+        if (n <= 0) {
+            seaf_warning ("Failed to read block %s.\n", block_id);
+            cached_block_unref (block);
+            block = NULL;
+            goto out;
+        }
+        done += n;
+    }
+
+out:
+    seaf_block_manager_close_block (seaf->block_mgr, handle);
+    seaf_block_manager_block_handle_free (seaf->block_mgr, handle);
+    return block;
+}
+
+static CachedBlock *
+get_block (SeafileSession *seaf, const char *store_id, int version,
+           const char *block_id)
+{
+    CachedBlock *block;
+
+    if (block_cache) {
+        block = obj_cache_lookup (block_cache, store_id, block_id);
+        if (block)
+            return block;
+    }
+
+    block = load_block (seaf, store_id, version, block_id);
+    if (block && block_cache)
+        obj_cache_insert (block_cache, store_id, block_id, block, block->size);
+
+    return block;
+}
+
+typedef struct PrefetchData {
+    char *key;
+    char store_id[37];
+    char block_id[41];
+} PrefetchData;
+
+static void
+prefetch_done (char *content, size_t len, void *user_data)
+{
+    PrefetchData *data = user_data;
+    CachedBlock *block;
 
-        if (offset < off + bmd->size) {
-            g_free (bmd);
-            break;
+    if (content) {
+        block = g_new0 (CachedBlock, 1);
+        block->ref = 1;
+        block->data = content;
+        block->size = (guint32)len;
+        obj_cache_insert (block_cache, data->store_id, data->block_id,
+                          block, len);
+        cached_block_unref (block);
+    }
+
+    pthread_mutex_lock (&prefetch_lock);
+    g_hash_table_remove (prefetching, data->key);
+    pthread_mutex_unlock (&prefetch_lock);
+
+    g_free (data);
+}
+
+static void
+prefetch_block (SeafileSession *seaf, const char *store_id, int version,
+                const char *block_id)
+{
+    PrefetchData *data;
+    char *key;
+
+    if (obj_cache_contains (block_cache, store_id, block_id))
+        return;
+
+    key = g_strconcat (store_id, "/", block_id, NULL);
+
+    pthread_mutex_lock (&prefetch_lock);
+    if (g_hash_table_lookup (prefetching, key)) {
+        pthread_mutex_unlock (&prefetch_lock);
+        g_free (key);
+        return;
+    }
+    g_hash_table_insert (prefetching, key, GINT_TO_POINTER(1));
+    pthread_mutex_unlock (&prefetch_lock);
+
+    data = g_new0 (PrefetchData, 1);
+    data->key = key;
+    g_strlcpy (data->store_id, store_id, sizeof(data->store_id));
+    g_strlcpy (data->block_id, block_id, sizeof(data->block_id));
+
+    if (seaf_block_manager_read_block_async (seaf->block_mgr,
+                                             store_id, version, block_id,
+                                             prefetch_done, data) < 0) {
+        pthread_mutex_lock (&prefetch_lock);
+        g_hash_table_remove (prefetching, key);
+        pthread_mutex_unlock (&prefetch_lock);
+        g_free (data);
+    }
+}
+
+FuseFile *
+fuse_file_new (const char *store_id, int version, Seafile *file)
+{
+    FuseFile *ff = g_new0 (FuseFile, 1);
+    BlockOffsets *bo;
+
+    g_strlcpy (ff->store_id, store_id, sizeof(ff->store_id));
+    ff->version = version;
+    ff->file = file;
+    seafile_ref (file);
+
+    pthread_mutex_init (&ff->lock, NULL);
+    bo = obj_cache_lookup (offset_cache, store_id, file->file_id);
+    if (bo && bo->n == file->n_blocks + 1) {
+        ff->offsets = bo->offsets;
+        ff->n_offsets = bo->n;
+        bo->offsets = NULL;
+    } else {
+        ff->offsets = g_new0 (gint64, file->n_blocks + 1);
+        ff->n_offsets = 1;
+    }
+    if (bo)
+        block_offsets_free (bo);
+
+    return ff;
+}
+
+void
+fuse_file_free (FuseFile *ff)
+{
+    if (!ff)
+        return;
+
+    seafile_unref (ff->file);
+    pthread_mutex_destroy (&ff->lock);
+    g_free (ff->offsets);
+    g_free (ff);
+}
+
+/*
+ * Find the block that has @offset. Block sizes are only known from the
+ * blocks themselves, so the start offsets are learned as far as they're
+ * needed, in batches of stats run in parallel, and kept for the whole
+ * file once known. Call with ff->lock held.
+ *
+ * Returns the block index, n_blocks if @offset is beyond the file, or -1
+ * on error.
+ */
+static int
+find_block (SeafileSession *seaf, FuseFile *ff, gint64 offset)
+{
+    Seafile *file = ff->file;
+    guint32 sizes[STAT_BATCH];
+    BlockOffsets bo;
+    int lo, hi, mid, i, j, n;
+
+    while (ff->n_offsets <= file->n_blocks &&
+           ff->offsets[ff->n_offsets - 1] <= offset) {
+        i = ff->n_offsets - 1;
+        n = MIN (STAT_BATCH, file->n_blocks - i);
+
+        if (seaf_block_manager_stat_blocks (seaf->block_mgr,
+                                            ff->store_id, ff->version,
+                                            (const char **)&file->blk_sha1s[i],
+                                            n, sizes) < 0)
+            return -1;
+
+        for (j = 0; j < n; ++j)
+            ff->offsets[i + j + 1] = ff->offsets[i + j] + sizes[j];
+        ff->n_offsets += n;
+
+        if (ff->n_offsets == file->n_blocks + 1) {
+            bo.n = ff->n_offsets;
+            bo.offsets = ff->offsets;
+            obj_cache_insert (offset_cache, ff->store_id, file->file_id,
+                              &bo, bo.n * sizeof(gint64));
         }
+    }
+
+    /* Last block starting at or before @offset. */
+    lo = 0;
+    hi = ff->n_offsets - 1;
+    while (lo < hi) {
+        mid = (lo + hi + 1) / 2;
+        if (ff->offsets[mid] <= offset)
+            lo = mid;
+        else
+            hi = mid - 1;
+    }
+
+    return lo;
+}
+
+static void
+read_ahead (SeafileSession *seaf, FuseFile *ff, int i)
+{
+    Seafile *file = ff->file;
+    int end = MIN (i + read_ahead_blocks, file->n_blocks - 1);
+    int j;
+
+    for (j = MAX (i, ff->read_ahead_end) + 1; j <= end; ++j)
+        prefetch_block (seaf, ff->store_id, ff->version, file->blk_sha1s[j]);
+
+    if (end > ff->read_ahead_end)
+        ff->read_ahead_end = end;
+}
+
+int
+fuse_file_read (SeafileSession *seaf, FuseFile *ff,
+                char *buf, size_t size, off_t offset)
+{
+    Seafile *file = ff->file;
+    CachedBlock *block;
+    gint64 off;
+    size_t nleft, n;
+    int i;
 
-        off += bmd->size;
-        g_free (bmd);
+    pthread_mutex_lock (&ff->lock);
+
+    i = find_block (seaf, ff, offset);
+    if (i < 0) {
+        pthread_mutex_unlock (&ff->lock);
+        return -EIO;
     }
 
     /* beyond the file size */
-    if (i == file->n_blocks)
+    if (i == file->n_blocks) {
+        pthread_mutex_unlock (&ff->lock);
         return 0;
+    }
+
+    if (read_ahead_blocks > 0 && offset == ff->next_offset)
+        read_ahead (seaf, ff, i);
+
+    off = ff->offsets[i];
+    pthread_mutex_unlock (&ff->lock);
 
     nleft = size;
-    ptr = buf;
     while (nleft > 0 && i < file->n_blocks) {
-        blkid = file->blk_sha1s[i];
-
-        handle = seaf_block_manager_open_block(seaf->block_mgr,
-                                               store_id, version,
-                                               blkid, BLOCK_READ);
-        if (!handle) {
-            seaf_warning ("Failed to open block %s.\n", blkid);
+        block = get_block (seaf, ff->store_id, ff->version, file->blk_sha1s[i]);
+        if (!block)
             return -EIO;
-        }
 
         /* trim the offset in a block */
-        if (offset > off) {
-            char *tmp = (char *)malloc(sizeof(char) * (offset - off));
-            if (!tmp)
-                return -ENOMEM;
-
-            n = seaf_block_manager_read_block(seaf->block_mgr, handle,
-                                              tmp, offset-off);
-            if (n != offset - off) {
-                seaf_warning ("Failed to read block %s.\n", blkid);
-                free (tmp);
-                goto out;
-            }
-
-            off += n;
-            free(tmp);
-        }
-
-        if ((n = seaf_block_manager_read_block(seaf->block_mgr,
-                                               handle, ptr, nleft)) < 0) {
-            seaf_warning ("Failed to read block %s.\n", blkid);
-            goto out;
+        if (offset < off + block->size) {
+            n = MIN (nleft, off + block->size - offset);
+            memcpy (buf, block->data + (offset - off), n);
+            buf += n;
+            offset += n;
+            nleft -= n;
         }
 
-        nleft -= n;
-        ptr += n;
-        off += n;
+        off += block->size;
         ++i;
-
-        /* At this point we should have read all the content of the block or
-         * have read up to @size bytes. So it's safe to close the block.
-         */
-        seaf_block_manager_close_block(seaf->block_mgr, handle);
-        seaf_block_manager_block_handle_free (seaf->block_mgr, handle);
+        cached_block_unref (block);
     }
 
-    return size - nleft;
+    pthread_mutex_lock (&ff->lock);
+    ff->next_offset = offset;
+    pthread_mutex_unlock (&ff->lock);
 
-out:
-    if (handle) {
-        seaf_block_manager_close_block(seaf->block_mgr, handle);
-        seaf_block_manager_block_handle_free (seaf->block_mgr, handle);
-    }
-    return ret;
+    return size - nleft;
 }
@@ -0,0 +1,195 @@
+#include "common.h"
+
+#include <pthread.h>
+
+#include "log.h"
+#include "utils.h"
+
+#include "fuse-cache.h"
+
+#define DEFAULT_CACHE_TTL 10    /* seconds */
+#define MAX_CACHED_ENTRIES 100000
+
+typedef struct CacheEntry {
+    gint64 expire_time;
+    struct stat st;
+    char **names;
+    char *str;
+} CacheEntry;
+
+static GHashTable *cache;
+static pthread_mutex_t cache_lock = PTHREAD_MUTEX_INITIALIZER;
+static int cache_ttl;
+
+static void
+cache_entry_free (CacheEntry *entry)
+{
+    g_strfreev (entry->names);
+    g_free (entry->str);
+    g_free (entry);
+}
+
+void
+fuse_cache_init (SeafileSession *seaf)
+{
+    GError *error = NULL;
+    int ttl;
+
+    /*
+     * [fuse]
+     * cache_ttl = 10   # seconds, 0 to disable
+     */
+    ttl = g_key_file_get_integer (seaf->config, "fuse", "cache_ttl", &error);
+    if (error) {
+        ttl = DEFAULT_CACHE_TTL;
+        g_clear_error (&error);
+    }
+    cache_ttl = MAX (ttl, 0);
+
+    cache = g_hash_table_new_full (g_str_hash, g_str_equal,
+                                   g_free, (GDestroyNotify)cache_entry_free);
+}
+
+int
+fuse_cache_get_ttl ()
+{
+    return cache_ttl;
+}
+
+/* Call with cache_lock held. */
+static CacheEntry *
+lookup_entry (const char *key)
+{
+    CacheEntry *entry;
+
+    if (!cache || cache_ttl == 0)
+        return NULL;
+
+    entry = g_hash_table_lookup (cache, key);
+    if (entry && entry->expire_time <= (gint64)time(NULL)) {
+        g_hash_table_remove (cache, key);
+        entry = NULL;
+    }
+
+    return entry;
+}
+
+static gboolean
+entry_expired (gpointer key, gpointer value, gpointer user_data)
+{
+    CacheEntry *entry = value;
+    gint64 *now = user_data;
+
+    return entry->expire_time <= *now;
+}
+
+/* Call with cache_lock held. Takes over @entry. */
+static void
+insert_entry (const char *key, CacheEntry *entry)
+{
+    gint64 now = (gint64)time(NULL);
+
+    if (!cache || cache_ttl == 0) {
+        cache_entry_free (entry);
+        return;
+    }
+
+    if (g_hash_table_size (cache) >= MAX_CACHED_ENTRIES) {
+        g_hash_table_foreach_remove (cache, entry_expired, &now);
+        if (g_hash_table_size (cache) >= MAX_CACHED_ENTRIES) {
+            cache_entry_free (entry);
+            return;
+        }
+    }
+
+    entry->expire_time = now + cache_ttl;
+    g_hash_table_replace (cache, g_strdup(key), entry);
+}
+
+gboolean
+fuse_cache_lookup_stat (const char *key, struct stat *st)
+{
+    CacheEntry *entry;
+    gboolean found = FALSE;
+
+    pthread_mutex_lock (&cache_lock);
+    entry = lookup_entry (key);
+    if (entry) {
+        memcpy (st, &entry->st, sizeof(struct stat));
+        found = TRUE;
+    }
+    pthread_mutex_unlock (&cache_lock);
+
+    return found;
+}
+
+void
+fuse_cache_insert_stat (const char *key, const struct stat *st)
+{
+    CacheEntry *entry = g_new0 (CacheEntry, 1);
+
+    memcpy (&entry->st, st, sizeof(struct stat));
+
+    pthread_mutex_lock (&cache_lock);
+    insert_entry (key, entry);
+    pthread_mutex_unlock (&cache_lock);
+}
+
+char **
+fuse_cache_lookup_names (const char *key)
+{
+    CacheEntry *entry;
+    char **names = NULL;
+
+    pthread_mutex_lock (&cache_lock);
+    entry = lookup_entry (key);
+    if (entry)
+        names = g_strdupv (entry->names);
+    pthread_mutex_unlock (&cache_lock);
+
+    return names;
+}
+
+void
+fuse_cache_insert_names (const char *key, char **names)
+{
+    CacheEntry *entry = g_new0 (CacheEntry, 1);
+
+    entry->names = g_strdupv (names);
+
+    pthread_mutex_lock (&cache_lock);
+    insert_entry (key, entry);
+    pthread_mutex_unlock (&cache_lock);
+}
+
+char *
+fuse_cache_lookup_head (const char *repo_id)
+{
+    CacheEntry *entry;
+    char *key = g_strconcat ("head/", repo_id, NULL);
+    char *commit_id = NULL;
+
+    pthread_mutex_lock (&cache_lock);
+    entry = lookup_entry (key);
+    if (entry)
+        commit_id = g_strdup (entry->str);
+    pthread_mutex_unlock (&cache_lock);
+
+    g_free (key);
+    return commit_id;
+}
+
+void
+fuse_cache_insert_head (const char *repo_id, const char *commit_id)
+{
+    CacheEntry *entry = g_new0 (CacheEntry, 1);
+    char *key = g_strconcat ("head/", repo_id, NULL);
+
+    entry->str = g_strdup (commit_id);
+
+    pthread_mutex_lock (&cache_lock);
+    insert_entry (key, entry);
+    pthread_mutex_unlock (&cache_lock);
+
+    g_free (key);
+}
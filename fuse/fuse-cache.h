@@ -0,0 +1,45 @@
+#ifndef FUSE_CACHE_H
+#define FUSE_CACHE_H
+
+#include <sys/stat.h>
+#include <glib.h>
+
+#include "seafile-session.h"
+
+/*
+ * Results of getattr and readdir, kept for [fuse] cache_ttl seconds so
+ * that walking a tree doesn't ask ccnet and the DB again for each entry.
+ *
+ * Lookups inside a library are keyed by the head commit of the library,
+ * so only the head itself can get out of date within the TTL.
+ */
+
+void
+fuse_cache_init (SeafileSession *seaf);
+
+/* The TTL in seconds, 0 if caching is disabled. */
+int
+fuse_cache_get_ttl ();
+
+gboolean
+fuse_cache_lookup_stat (const char *key, struct stat *st);
+
+void
+fuse_cache_insert_stat (const char *key, const struct stat *st);
+
+/* Returns a copy of the cached names, free it with g_strfreev(). */
+char **
+fuse_cache_lookup_names (const char *key);
+
+/* @names is copied. */
+void
+fuse_cache_insert_names (const char *key, char **names);
+
+/* Returns the cached head commit of @repo_id, or NULL. */
+char *
+fuse_cache_lookup_head (const char *repo_id);
+
+void
+fuse_cache_insert_head (const char *repo_id, const char *commit_id);
+
+#endif
@@ -15,11 +15,13 @@
 
 #include "seaf-fuse.h"
 #include "seafile-session.h"
+#include "fuse-cache.h"
 
-static CcnetEmailUser *get_user_from_ccnet (SearpcClient *client, const char *user)
+static CcnetEmailUser *get_user_from_ccnet (SearpcClient *client, const char *user,
+                                            GError **error)
 {
     return (CcnetEmailUser *)searpc_client_call__object (client,
-                                       "get_emailuser", CCNET_TYPE_EMAIL_USER, NULL,
+                                       "get_emailuser", CCNET_TYPE_EMAIL_USER, error,
                                        1, "string", user);
 }
 
@@ -36,27 +38,43 @@ static int getattr_user(SeafileSession *seaf, const char *user, struct stat *stb
 {
     SearpcClient *client;
     CcnetEmailUser *emailuser;
+    GError *error = NULL;
+    char *key;
 
-    client = ccnet_create_pooled_rpc_client (seaf->client_pool,
-                                             NULL,
-                                             "ccnet-threaded-rpcserver");
+    key = g_strconcat ("user/", user, NULL);
+    if (fuse_cache_lookup_stat (key, stbuf)) {
+        g_free (key);
+        return 0;
+    }
+
+    client = seafile_session_get_rpc_client (seaf);
     if (!client) {
         seaf_warning ("Failed to alloc rpc client.\n");
+        g_free (key);
         return -ENOMEM;
     }
 
-    emailuser = get_user_from_ccnet (client, user);
+    emailuser = get_user_from_ccnet (client, user, &error);
+    if (error) {
+        seaf_warning ("Failed to get user %s: %s.\n", user, error->message);
+        g_clear_error (&error);
+        seafile_session_drop_rpc_client (seaf);
+        g_free (key);
+        return -EIO;
+    }
     if (!emailuser) {
-        ccnet_rpc_client_free (client);
+        g_free (key);
         return -ENOENT;
     }
     g_object_unref (emailuser);
-    ccnet_rpc_client_free (client);
 
     stbuf->st_mode = S_IFDIR | 0755;
     stbuf->st_nlink = 2;
     stbuf->st_size = 4096;
 
+    fuse_cache_insert_stat (key, stbuf);
+    g_free (key);
+
     return 0;
 }
 
@@ -69,8 +87,21 @@ static int getattr_repo(SeafileSession *seaf,
     SeafCommit *commit = NULL;
     guint32 mode = 0;
     char *id = NULL;
+    char *head, *key = NULL;
     int ret = 0;
 
+    head = fuse_cache_lookup_head (repo_id);
+    if (head) {
+        key = g_strconcat ("stat/", head, "/", repo_path, NULL);
+        g_free (head);
+        if (fuse_cache_lookup_stat (key, stbuf)) {
+            g_free (key);
+            return 0;
+        }
+        g_free (key);
+        key = NULL;
+    }
+
     repo = seaf_repo_manager_get_repo(seaf->repo_mgr, repo_id);
     if (!repo) {
         seaf_warning ("Failed to get repo %s.\n", repo_id);
@@ -150,10 +181,16 @@ static int getattr_repo(SeafileSession *seaf,
         seaf_dirent_free (dirent);
         seafile_unref (file);
     } else {
-        return -ENOENT;
+        ret = -ENOENT;
+        goto out;
     }
 
+    fuse_cache_insert_head (repo_id, branch->commit_id);
+    key = g_strconcat ("stat/", branch->commit_id, "/", repo_path, NULL);
+    fuse_cache_insert_stat (key, stbuf);
+
 out:
+    g_free (key);
     g_free (id);
     seaf_repo_unref (repo);
     seaf_commit_unref (commit);
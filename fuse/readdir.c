@@ -15,6 +15,7 @@
 
 #include "seaf-fuse.h"
 #include "seafile-session.h"
+#include "fuse-cache.h"
 
 static char *replace_slash (const char *repo_name)
 {
@@ -28,20 +29,44 @@ static char *replace_slash (const char *repo_name)
     return ret;
 }
 
-static GList *get_users_from_ccnet (SearpcClient *client, const char *source)
+static GList *get_users_from_ccnet (SearpcClient *client, const char *source,
+                                    GError **error)
 {
     return searpc_client_call__objlist (client,
-                                        "get_emailusers", CCNET_TYPE_EMAIL_USER, NULL,
+                                        "get_emailusers", CCNET_TYPE_EMAIL_USER, error,
                                         3, "string", source, "int", -1, "int", -1);
 }
 
-static CcnetEmailUser *get_user_from_ccnet (SearpcClient *client, const char *user)
+static CcnetEmailUser *get_user_from_ccnet (SearpcClient *client, const char *user,
+                                            GError **error)
 {
     return (CcnetEmailUser *)searpc_client_call__object (client,
-                                       "get_emailuser", CCNET_TYPE_EMAIL_USER, NULL,
+                                       "get_emailuser", CCNET_TYPE_EMAIL_USER, error,
                                        1, "string", user);
 }
 
+static void fill_names (void *buf, fuse_fill_dir_t filler, char **names)
+{
+    char **p;
+
+    for (p = names; *p; ++p)
+        filler (buf, *p, NULL, 0);
+}
+
+/* Fill in and cache the names in @array, which is freed. */
+static void fill_and_cache_names (void *buf, fuse_fill_dir_t filler,
+                                  const char *key, GPtrArray *array)
+{
+    char **names;
+
+    g_ptr_array_add (array, NULL);
+    names = (char **)g_ptr_array_free (array, FALSE);
+
+    fill_names (buf, filler, names);
+    fuse_cache_insert_names (key, names);
+    g_strfreev (names);
+}
+
 static int readdir_root(SeafileSession *seaf,
                         void *buf, fuse_fill_dir_t filler, off_t offset,
                         struct fuse_file_info *info)
@@ -51,11 +76,19 @@ static int readdir_root(SeafileSession *seaf,
     CcnetEmailUser *user;
     const char *email;
     GHashTable *user_hash;
+    GPtrArray *names;
+    GError *error = NULL;
+    char **cached;
     int dummy;
 
-    client = ccnet_create_pooled_rpc_client (seaf->client_pool,
-                                             NULL,
-                                             "ccnet-threaded-rpcserver");
+    cached = fuse_cache_lookup_names ("users");
+    if (cached) {
+        fill_names (buf, filler, cached);
+        g_strfreev (cached);
+        return 0;
+    }
+
+    client = seafile_session_get_rpc_client (seaf);
     if (!client) {
         seaf_warning ("Failed to alloc rpc client.\n");
         return -ENOMEM;
@@ -63,7 +96,9 @@ static int readdir_root(SeafileSession *seaf,
 
     user_hash = g_hash_table_new_full (g_str_hash, g_str_equal, g_free, NULL);
 
-    users = get_users_from_ccnet (client, "DB");
+    users = get_users_from_ccnet (client, "DB", &error);
+    if (error)
+        goto rpc_error;
     for (p = users; p; p = p->next) {
         user = p->data;
         email = ccnet_email_user_get_email (user);
@@ -72,7 +107,9 @@ static int readdir_root(SeafileSession *seaf,
     }
     g_list_free (users);
 
-    users = get_users_from_ccnet (client, "LDAP");
+    users = get_users_from_ccnet (client, "LDAP", &error);
+    if (error)
+        goto rpc_error;
     for (p = users; p; p = p->next) {
         user = p->data;
         email = ccnet_email_user_get_email (user);
@@ -81,17 +118,25 @@ static int readdir_root(SeafileSession *seaf,
     }
     g_list_free (users);
 
+    names = g_ptr_array_new ();
     users = g_hash_table_get_keys (user_hash);
     for (p = users; p; p = p->next) {
         email = p->data;
-        filler (buf, email, NULL, 0);
+        g_ptr_array_add (names, g_strdup(email));
     }
     g_list_free (users);
+    fill_and_cache_names (buf, filler, "users", names);
 
     g_hash_table_destroy (user_hash);
-    ccnet_rpc_client_free (client);
 
     return 0;
+
+rpc_error:
+    seaf_warning ("Failed to get users: %s.\n", error->message);
+    g_clear_error (&error);
+    seafile_session_drop_rpc_client (seaf);
+    g_hash_table_destroy (user_hash);
+    return -EIO;
 }
 
 static int readdir_user(SeafileSession *seaf, const char *user,
@@ -102,27 +147,44 @@ static int readdir_user(SeafileSession *seaf, const char *user,
     CcnetEmailUser *emailuser;
     GList *list = NULL, *p;
     GString *name;
+    GPtrArray *names;
+    GError *error = NULL;
+    char **cached;
+    char *key;
+
+    key = g_strconcat ("repos/", user, NULL);
+    cached = fuse_cache_lookup_names (key);
+    if (cached) {
+        fill_names (buf, filler, cached);
+        g_strfreev (cached);
+        g_free (key);
+        return 0;
+    }
 
-    client = ccnet_create_pooled_rpc_client (seaf->client_pool,
-                                             NULL,
-                                             "ccnet-threaded-rpcserver");
+    client = seafile_session_get_rpc_client (seaf);
     if (!client) {
         seaf_warning ("Failed to alloc rpc client.\n");
+        g_free (key);
         return -ENOMEM;
     }
 
-    emailuser = get_user_from_ccnet (client, user);
+    emailuser = get_user_from_ccnet (client, user, &error);
+    if (error) {
+        seaf_warning ("Failed to get user %s: %s.\n", user, error->message);
+        g_clear_error (&error);
+        seafile_session_drop_rpc_client (seaf);
+        g_free (key);
+        return -EIO;
+    }
     if (!emailuser) {
-        ccnet_rpc_client_free (client);
+        g_free (key);
         return -ENOENT;
     }
     g_object_unref (emailuser);
-    ccnet_rpc_client_free (client);
 
     list = seaf_repo_manager_get_repos_by_owner (seaf->repo_mgr, user);
-    if (!list)
-        return 0;
 
+    names = g_ptr_array_new ();
     for (p = list; p; p = p->next) {
         SeafRepo *repo = (SeafRepo *)p->data;
 
@@ -134,6 +196,7 @@ static int readdir_user(SeafileSession *seaf, const char *user,
 
         // Don't list encrypted repo
         if (repo->encrypted) {
+            seaf_repo_unref (repo);
             continue;
         }
 
@@ -141,14 +204,15 @@ static int readdir_user(SeafileSession *seaf, const char *user,
 
         name = g_string_new ("");
         g_string_printf (name, "%s_%s", repo->id, clean_repo_name);
-        filler(buf, name->str, NULL, 0);
-        g_string_free (name, TRUE);
+        g_ptr_array_add (names, g_string_free (name, FALSE));
         g_free (clean_repo_name);
 
         seaf_repo_unref (repo);
     }
 
     g_list_free (list);
+    fill_and_cache_names (buf, filler, key, names);
+    g_free (key);
 
     return 0;
 }
@@ -163,8 +227,25 @@ static int readdir_repo(SeafileSession *seaf,
     SeafCommit *commit = NULL;
     SeafDir *dir = NULL;
     GList *l;
+    GPtrArray *names;
+    char **cached;
+    char *head, *key = NULL;
     int ret = 0;
 
+    head = fuse_cache_lookup_head (repo_id);
+    if (head) {
+        key = g_strconcat ("dir/", head, "/", repo_path, NULL);
+        g_free (head);
+        cached = fuse_cache_lookup_names (key);
+        g_free (key);
+        key = NULL;
+        if (cached) {
+            fill_names (buf, filler, cached);
+            g_strfreev (cached);
+            return 0;
+        }
+    }
+
     repo = seaf_repo_manager_get_repo(seaf->repo_mgr, repo_id);
     if (!repo) {
         seaf_warning ("Failed to get repo %s.\n", repo_id);
@@ -192,13 +273,19 @@ static int readdir_repo(SeafileSession *seaf,
         goto out;
     }
 
+    names = g_ptr_array_new ();
     for (l = dir->entries; l; l = l->next) {
         SeafDirent *seaf_dent = (SeafDirent *) l->data;
         /* FIXME: maybe we need to return stbuf */
-        filler(buf, seaf_dent->name, NULL, 0);
+        g_ptr_array_add (names, g_strdup(seaf_dent->name));
     }
 
+    fuse_cache_insert_head (repo_id, branch->commit_id);
+    key = g_strconcat ("dir/", branch->commit_id, "/", repo_path, NULL);
+    fill_and_cache_names (buf, filler, key, names);
+
 out:
+    g_free (key);
     seaf_repo_unref (repo);
     seaf_commit_unref (commit);
     seaf_dir_free (dir);
@@ -17,6 +17,7 @@
 #include "utils.h"
 
 #include "seaf-fuse.h"
+#include "fuse-cache.h"
 
 CcnetClient *ccnet_client = NULL;
 SeafileSession *seaf = NULL;
@@ -99,20 +100,19 @@ static int seaf_fuse_readdir(const char *path, void *buf,
     return do_readdir(seaf, path, buf, filler, offset, info);
 }
 
-static int seaf_fuse_open(const char *path, struct fuse_file_info *info)
+/* Look up the file at @path in the head of its repo. */
+static int lookup_file (const char *path, FuseFile **ret_ff)
 {
     int n_parts;
     char *user, *repo_id, *repo_path;
     SeafRepo *repo = NULL;
     SeafBranch *branch = NULL;
     SeafCommit *commit = NULL;
+    Seafile *file = NULL;
     guint32 mode = 0;
+    char *id = NULL;
     int ret = 0;
 
-    /* Now we only support read-only mode */
-    if ((info->flags & 3) != O_RDONLY)
-        return -EACCES;
-
     if (parse_fuse_path (path, &n_parts, &user, &repo_id, &repo_path) < 0) {
         seaf_warning ("Invalid input path %s.\n", path);
         return -ENOENT;
@@ -142,105 +142,88 @@ static int seaf_fuse_open(const char *path, struct fuse_file_info *info)
         goto out;
     }
 
-    char *id = seaf_fs_manager_path_to_obj_id(seaf->fs_mgr,
-                                              repo->store_id, repo->version,
-                                              commit->root_id,
-                                              repo_path, &mode, NULL);
+    id = seaf_fs_manager_path_to_obj_id(seaf->fs_mgr,
+                                        repo->store_id, repo->version,
+                                        commit->root_id,
+                                        repo_path, &mode, NULL);
     if (!id) {
         seaf_warning ("Path %s doesn't exist in repo %s.\n", repo_path, repo_id);
         ret = -ENOENT;
         goto out;
     }
-    g_free (id);
 
-    if (!S_ISREG(mode))
-        return -EACCES;
+    if (!S_ISREG(mode)) {
+        ret = -EACCES;
+        goto out;
+    }
+
+    file = seaf_fs_manager_get_seafile(seaf->fs_mgr,
+                                       repo->store_id, repo->version, id);
+    if (!file) {
+        ret = -ENOENT;
+        goto out;
+    }
+
+    *ret_ff = fuse_file_new (repo->store_id, repo->version, file);
+    seafile_unref (file);
 
 out:
     g_free (user);
     g_free (repo_id);
     g_free (repo_path);
+    g_free (id);
     seaf_repo_unref (repo);
     seaf_commit_unref (commit);
     return ret;
 }
 
-static int seaf_fuse_read(const char *path, char *buf, size_t size,
-                          off_t offset, struct fuse_file_info *info)
+static int seaf_fuse_open(const char *path, struct fuse_file_info *info)
 {
-    int n_parts;
-    char *user, *repo_id, *repo_path;
-    SeafRepo *repo = NULL;
-    SeafBranch *branch = NULL;
-    SeafCommit *commit = NULL;
-    Seafile *file = NULL;
-    char *file_id = NULL;
-    int ret = 0;
+    FuseFile *ff = NULL;
+    int ret;
 
     /* Now we only support read-only mode */
     if ((info->flags & 3) != O_RDONLY)
         return -EACCES;
 
-    if (parse_fuse_path (path, &n_parts, &user, &repo_id, &repo_path) < 0) {
-        seaf_warning ("Invalid input path %s.\n", path);
-        return -ENOENT;
-    }
-
-    if (n_parts != 2 && n_parts != 3) {
-        seaf_warning ("Invalid input path for open: %s.\n", path);
-        ret = -EACCES;
-        goto out;
-    }
+    /* The file is resolved once here, not on every read. */
+    ret = lookup_file (path, &ff);
+    if (ret < 0)
+        return ret;
 
-    repo = seaf_repo_manager_get_repo(seaf->repo_mgr, repo_id);
-    if (!repo) {
-        seaf_warning ("Failed to get repo %s.\n", repo_id);
-        ret = -ENOENT;
-        goto out;
-    }
+    info->fh = (uint64_t)(uintptr_t)ff;
+    return 0;
+}
 
-    branch = repo->head;
-    commit = seaf_commit_manager_get_commit(seaf->commit_mgr,
-                                            repo->id,
-                                            repo->version,
-                                            branch->commit_id);
-    if (!commit) {
-        seaf_warning ("Failed to get commit %.8s.\n", branch->commit_id);
-        ret = -ENOENT;
-        goto out;
-    }
+static int seaf_fuse_read(const char *path, char *buf, size_t size,
+                          off_t offset, struct fuse_file_info *info)
+{
+    FuseFile *ff = (FuseFile *)(uintptr_t)info->fh;
+    int ret;
 
-    file_id = seaf_fs_manager_get_seafile_id_by_path(seaf->fs_mgr,
-                                                     repo->store_id, repo->version,
-                                                     commit->root_id,
-                                                     repo_path, NULL);
-    if (!file_id) {
-        seaf_warning ("Path %s doesn't exist in repo %s.\n", repo_path, repo_id);
-        ret = -ENOENT;
-        goto out;
-    }
+    /* Now we only support read-only mode */
+    if ((info->flags & 3) != O_RDONLY)
+        return -EACCES;
 
-    file = seaf_fs_manager_get_seafile(seaf->fs_mgr,
-                                       repo->store_id, repo->version, file_id);
-    if (!file) {
-        ret = -ENOENT;
-        goto out;
-    }
+    if (ff)
+        return fuse_file_read (seaf, ff, buf, size, offset);
 
-    ret = read_file(seaf, repo->store_id, repo->version,
-                    file, buf, size, offset, info);
-    seafile_unref (file);
+    ret = lookup_file (path, &ff);
+    if (ret < 0)
+        return ret;
 
-out:
-    g_free (user);
-    g_free (repo_id);
-    g_free (repo_path);
-    g_free (file_id);
-    seaf_repo_unref (repo);
-    seaf_commit_unref (commit);
+    ret = fuse_file_read (seaf, ff, buf, size, offset);
+    fuse_file_free (ff);
     return ret;
 }
 
+static int seaf_fuse_release(const char *path, struct fuse_file_info *info)
+{
+    fuse_file_free ((FuseFile *)(uintptr_t)info->fh);
+    info->fh = 0;
+    return 0;
+}
+
 struct options {
     char *config_dir;
     char *seafile_dir;
@@ -274,6 +257,7 @@ static struct fuse_operations seaf_fuse_ops = {
     .readdir = seaf_fuse_readdir,
     .open    = seaf_fuse_open,
     .read    = seaf_fuse_read,
+    .release = seaf_fuse_release,
 };
 
 int main(int argc, char *argv[])
@@ -294,7 +278,12 @@ int main(int argc, char *argv[])
         exit(1);
     }
 
+#if !GLIB_CHECK_VERSION(2, 35, 0)
     g_type_init();
+#endif
+#if !GLIB_CHECK_VERSION(2,32,0)
+    g_thread_init (NULL);
+#endif
 
     config_dir = options.config_dir ? : DEFAULT_CONFIG_DIR;
     config_dir = ccnet_expand_path (config_dir);
@@ -336,12 +325,24 @@ int main(int argc, char *argv[])
         exit(1);
     }
 
+    fuse_block_cache_init (seaf);
+    fuse_cache_init (seaf);
+
     seaf->client_pool = ccnet_client_pool_new(config_dir);
     if (!seaf->client_pool) {
         seaf_warning("Failed to creat client pool\n");
         exit(1);
     }
 
+    /* Let the kernel cache attributes and lookups for as long as we do. */
+    if (fuse_cache_get_ttl () > 0) {
+        char *opt = g_strdup_printf ("-oattr_timeout=%d,entry_timeout=%d",
+                                     fuse_cache_get_ttl (),
+                                     fuse_cache_get_ttl ());
+        fuse_opt_add_arg (&args, opt);
+        g_free (opt);
+    }
+
     ret = fuse_main(args.argc, args.argv, &seaf_fuse_ops, NULL);
     fuse_opt_free_args(&args);
     return ret;
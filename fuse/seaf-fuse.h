@@ -14,9 +14,18 @@ fuse_get_dirent_by_path (SeafFSManager *mgr,
                          const char *path);
 
 /* file.c */
-int read_file(SeafileSession *seaf, const char *store_id, int version,
-              Seafile *file, char *buf, size_t size,
-              off_t offset, struct fuse_file_info *info);
+
+/* A file opened for read, kept in fuse_file_info->fh. */
+typedef struct FuseFile FuseFile;
+
+void fuse_block_cache_init (SeafileSession *seaf);
+
+FuseFile *fuse_file_new (const char *store_id, int version, Seafile *file);
+
+void fuse_file_free (FuseFile *ff);
+
+int fuse_file_read (SeafileSession *seaf, FuseFile *ff,
+                    char *buf, size_t size, off_t offset);
 
 /* getattr.c */
 int do_getattr(SeafileSession *seaf, const char *path, struct stat *stbuf);
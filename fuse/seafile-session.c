@@ -3,6 +3,7 @@
 #include <sys/types.h>
 #include <sys/stat.h>
 #include <unistd.h>
+#include <pthread.h>
 
 #include <ccnet.h>
 #include <utils.h>
@@ -11,6 +12,13 @@
 #include "seafile-session.h"
 #include "seaf-utils.h"
 
+static pthread_key_t rpc_client_key;
+
+static void
+free_rpc_client (void *client)
+{
+    ccnet_rpc_client_free ((SearpcClient *)client);
+}
 
 SeafileSession *
 seafile_session_new(const char *seafile_dir,
@@ -90,6 +98,9 @@ onerror:
 int
 seafile_session_init (SeafileSession *session)
 {
+    if (pthread_key_create (&rpc_client_key, free_rpc_client) != 0)
+        return -1;
+
     if (seaf_commit_manager_init (session->commit_mgr) < 0)
         return -1;
 
@@ -110,3 +121,35 @@ seafile_session_start (SeafileSession *session)
 {
     return 0;
 }
+
+SearpcClient *
+seafile_session_get_rpc_client (SeafileSession *session)
+{
+    SearpcClient *client;
+
+    client = pthread_getspecific (rpc_client_key);
+    if (client)
+        return client;
+
+    client = ccnet_create_pooled_rpc_client (session->client_pool,
+                                             NULL,
+                                             "ccnet-threaded-rpcserver");
+    if (!client)
+        return NULL;
+
+    pthread_setspecific (rpc_client_key, client);
+    return client;
+}
+
+void
+seafile_session_drop_rpc_client (SeafileSession *session)
+{
+    SearpcClient *client;
+
+    client = pthread_getspecific (rpc_client_key);
+    if (!client)
+        return;
+
+    pthread_setspecific (rpc_client_key, NULL);
+    ccnet_rpc_client_free (client);
+}
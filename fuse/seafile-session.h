@@ -13,6 +13,7 @@
 #include "repo-mgr.h"
 
 struct _CcnetClient;
+struct _SearpcClient;
 
 typedef struct _SeafileSession SeafileSession;
 
@@ -48,4 +49,18 @@ seafile_session_init (SeafileSession *session);
 int
 seafile_session_start (SeafileSession *session);
 
+/*
+ * The ccnet RPC client of the calling thread. FUSE runs operations on
+ * many threads at once, so each thread takes a connection from the
+ * client pool the first time and keeps it until it exits.
+ */
+struct _SearpcClient *
+seafile_session_get_rpc_client (SeafileSession *session);
+
+/* Give the client of the calling thread back after an RPC error, so
+ * that the next call makes a new one.
+ */
+void
+seafile_session_drop_rpc_client (SeafileSession *session);
+
 #endif
@@ -19,6 +19,15 @@ seafile_get_session_info (GError **error);
  */
 GList* seafile_get_repo_list (int start, int limit, GError **error);
 
+/**
+ * seafile_get_repo_list_after:
+ *
+ * Returns up to @limit repos with ids after @after_repo_id, in id order.
+ */
+GList *
+seafile_get_repo_list_after (const char *after_repo_id, int limit,
+                             GError **error);
+
 gint64
 seafile_count_repos (GError **error);
 
@@ -29,6 +38,10 @@ seafile_count_repos (GError **error);
  */
 GList* seafile_get_trash_repo_list(int start, int limit, GError **error);
 
+GList *
+seafile_get_trash_repo_list_after (const char *after_repo_id, int limit,
+                                   GError **error);
+
 int
 seafile_del_repo_from_trash (const char *repo_id, GError **error);
 
@@ -125,6 +138,13 @@ seafile_remove_repo_tokens_by_account (const char *server_addr, const char *emai
 int
 seafile_set_repo_token (const char *repo_id, const char *token, GError **error);
 
+/*
+ * Check out @path, a file or a folder, before the other files of the
+ * current or next download of the repo.
+ */
+int
+seafile_prioritize_download (const char *repo_id, const char *path, GError **error);
+
 int
 seafile_get_download_rate(GError **error);
 
@@ -217,6 +237,34 @@ seafile_get_path_sync_status (const char *repo_id,
                               int is_dir,
                               GError **error);
 
+/**
+ * seafile_get_dir_sync_status:
+ * Get the sync status of all children of a dir at once.
+ *
+ * Returns: a JSON object {"version": N, "children": {name: status}}.
+ * Children not listed have status "none".
+ */
+char *
+seafile_get_dir_sync_status (const char *repo_id,
+                             const char *dir,
+                             GError **error);
+
+/**
+ * seafile_get_sync_status_version:
+ * Returns: a number that changes whenever a sync status in the repo
+ * changes, to tell if statuses got before are still current.
+ */
+int
+seafile_get_sync_status_version (const char *repo_id, GError **error);
+
+/**
+ * seafile_get_wt_monitor_stats:
+ * Returns: a JSON object keyed by the ids of watched repos, with the
+ * overflows of their worktree watches and the number of queued events.
+ */
+char *
+seafile_get_wt_monitor_stats (GError **error);
+
 /**
  * seafile_list_dir:
  * List a directory.
@@ -228,6 +276,19 @@ seafile_get_path_sync_status (const char *repo_id,
 GList * seafile_list_dir (const char *repo_id,
                           const char *dir_id, int offset, int limit, GError **error);
 
+/**
+ * seafile_list_dir_page:
+ * List a page of a directory, for directories too large to list at once.
+ * Only the page is loaded where the directory format allows.
+ *
+ * Returns: a list of dirents, in descending order of names.
+ *
+ * @limit: if limit <= 0, all dirents start from @offset will be returned.
+ */
+GList * seafile_list_dir_page (const char *repo_id,
+                               const char *dir_id, int offset, int limit,
+                               GError **error);
+
 /**
  * seafile_list_file:
  * List the blocks of a file.
@@ -841,6 +902,16 @@ seafile_list_dir_with_perm (const char *repo_id,
                             int limit,
                             GError **error);
 
+/* Like seafile_list_dir_page(), with the permission of @user on each dirent. */
+GList *
+seafile_list_dir_page_with_perm (const char *repo_id,
+                                 const char *path,
+                                 const char *dir_id,
+                                 const char *user,
+                                 int offset,
+                                 int limit,
+                                 GError **error);
+
 int
 seafile_set_inner_pub_repo (const char *repo_id,
                             const char *permission,
@@ -903,6 +974,68 @@ seafile_get_virtual_repo (const char *origin_repo,
 char *
 seafile_get_system_default_repo_id (GError **error);
 
+/**
+ * Return hit/miss counters of the fs object caches, as a JSON object
+ * with "dirs" and "files" members.
+ */
+char *
+seafile_get_fs_cache_stats (GError **error);
+
+/**
+ * Return the counters of the [block_cache] block cache as a JSON object.
+ */
+char *
+seafile_get_block_cache_stats (GError **error);
+
+/**
+ * Return the operation counts and latencies of the object and block
+ * stores as a JSON object, keyed by "<store>:<backend>" and operation.
+ */
+char *
+seafile_get_io_stats (GError **error);
+
+/**
+ * Return the estimated memory held by the caches and other long-lived
+ * structures as a JSON object, with entries, limits and evictions.
+ */
+char *
+seafile_get_memory_stats (GError **error);
+
+/**
+ * Return the count, errors, total and max time of each SQL statement,
+ * and the time spent waiting for DB connections, as a JSON object.
+ */
+char *
+seafile_get_db_query_stats (GError **error);
+
+/**
+ * Return the live load of the server as a JSON object: queue depths of
+ * the thread pools, DB pool usage, cache hit ratios, pending size
+ * computations and virtual repo merges, open block transfers, and the
+ * background jobs of each category.
+ */
+char *
+seafile_get_server_metrics (GError **error);
+
+/**
+ * Run a JSON array of searpc calls, ["func_name", args...], in one
+ * request. With @parallel set the calls are run at the same time, so
+ * they must not depend on each other.
+ *
+ * Return a JSON object with the result of each call in "results", in
+ * order, and the time the calls waited for a thread in "queue_wait_usec".
+ */
+char *
+seafile_batch_rpc (const char *calls, int parallel, GError **error);
+
+/*
+ * @repo_ids is a JSON list. Return a JSON object mapping the id of each
+ * existing repo to its name, owner, head commit, size, last modified
+ * time, version and whether it's encrypted.
+ */
+char *
+seafile_get_repos_info_by_ids (const char *repo_ids, GError **error);
+
 /* Clean trash */
 
 int
@@ -5,6 +5,7 @@
 #include <string.h>
 #include <openssl/sha.h>
 #include <assert.h>
+#include <math.h>
 
 #include "bloom-filter.h"
 
@@ -174,3 +175,230 @@ int bloom_test(Bloom *bloom, const char *s)
 
     return 1;
 }
+
+/* Split block Bloom filter */
+
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+#define BBLOOM_X86 1
+#include <immintrin.h>
+#endif
+
+#define BLOCK_WORDS 8
+#define BLOCK_BITS (BLOCK_WORDS * 32)
+#define BLOCK_ALIGN 64
+
+/* Blocks prefetched ahead in a batch. */
+#define PREFETCH_AHEAD 8
+
+/* Odd constants mapping a 32-bit hash to a bit of each word. */
+static const uint32_t bbloom_salts[BLOCK_WORDS] = {
+    0x47b6137bU, 0x44974d91U, 0x8824ad5bU, 0xa2b7289dU,
+    0x705495c7U, 0x2df1424bU, 0x9efc4947U, 0x5c6bfb31U,
+};
+
+static int bbloom_avx2 = -1;
+
+BlockedBloom *
+bbloom_create (uint64_t n_bits)
+{
+    BlockedBloom *bloom;
+    uint64_t n_blocks = (n_bits + BLOCK_BITS - 1) / BLOCK_BITS;
+    uintptr_t p;
+
+    if (n_blocks == 0)
+        n_blocks = 1;
+    /* Blocks are picked from 32 bits of the id. */
+    if (n_blocks > ((uint64_t)1 << 32))
+        return NULL;
+
+    if ( !(bloom = calloc (1, sizeof(BlockedBloom))) ) return NULL;
+    bloom->mem = calloc (1, n_blocks * BLOCK_BITS / 8 + BLOCK_ALIGN);
+    if (!bloom->mem) {
+        free (bloom);
+        return NULL;
+    }
+
+    p = ((uintptr_t)bloom->mem + BLOCK_ALIGN - 1) & ~(uintptr_t)(BLOCK_ALIGN - 1);
+    bloom->blocks = (uint32_t *)p;
+    bloom->n_blocks = (size_t)n_blocks;
+
+    return bloom;
+}
+
+void
+bbloom_destroy (BlockedBloom *bloom)
+{
+    if (!bloom)
+        return;
+    free (bloom->mem);
+    free (bloom);
+}
+
+/*
+ * Bytes 4-7 of the id pick the block and bytes 8-11 the bits. Byte 0
+ * is left alone, since callers may already partition ids by it.
+ */
+static inline uint32_t *
+block_of (BlockedBloom *bloom, const unsigned char *id, uint32_t *hash)
+{
+    uint32_t h_block, h_bits;
+
+    memcpy (&h_block, id + 4, 4);
+    memcpy (&h_bits, id + 8, 4);
+    *hash = h_bits;
+
+    return bloom->blocks +
+        (size_t)(((uint64_t)h_block * bloom->n_blocks) >> 32) * BLOCK_WORDS;
+}
+
+void
+bbloom_add (BlockedBloom *bloom, const unsigned char *id)
+{
+    uint32_t hash, *block;
+    int i;
+
+    block = block_of (bloom, id, &hash);
+    for (i = 0; i < BLOCK_WORDS; ++i)
+        block[i] |= (uint32_t)1 << ((hash * bbloom_salts[i]) >> 27);
+}
+
+static inline int
+test_block (const uint32_t *block, uint32_t hash)
+{
+    int i;
+
+    for (i = 0; i < BLOCK_WORDS; ++i)
+        if (!(block[i] & ((uint32_t)1 << ((hash * bbloom_salts[i]) >> 27))))
+            return 0;
+    return 1;
+}
+
+int
+bbloom_test (BlockedBloom *bloom, const unsigned char *id)
+{
+    uint32_t hash, *block;
+
+    block = block_of (bloom, id, &hash);
+    return test_block (block, hash);
+}
+
+#ifdef BBLOOM_X86
+
+__attribute__ ((target ("avx2")))
+static void
+test_batch_avx2 (uint32_t **blocks, const uint32_t *hashes, int n, int *results)
+{
+    const __m256i salts = _mm256_loadu_si256 ((const __m256i *)bbloom_salts);
+    const __m256i ones = _mm256_set1_epi32 (1);
+    __m256i bits, mask, block;
+    int i;
+
+    for (i = 0; i < n; ++i) {
+        bits = _mm256_mullo_epi32 (_mm256_set1_epi32 ((int)hashes[i]), salts);
+        mask = _mm256_sllv_epi32 (ones, _mm256_srli_epi32 (bits, 27));
+        block = _mm256_load_si256 ((const __m256i *)blocks[i]);
+        /* Set if every bit of the mask is in the block. */
+        results[i] = _mm256_testc_si256 (block, mask);
+    }
+}
+
+#endif  /* BBLOOM_X86 */
+
+void
+bbloom_test_batch (BlockedBloom *bloom, const unsigned char *ids,
+                   int n, int *results)
+{
+    uint32_t *blocks[PREFETCH_AHEAD * 4];
+    uint32_t hashes[PREFETCH_AHEAD * 4];
+    int i, j, chunk;
+
+    if (bbloom_avx2 < 0) {
+#ifdef BBLOOM_X86
+        bbloom_avx2 = __builtin_cpu_supports ("avx2") ? 1 : 0;
+#else
+        bbloom_avx2 = 0;
+#endif
+    }
+
+    /* Locate and prefetch the blocks of a chunk, then test them. */
+    for (i = 0; i < n; i += chunk) {
+        chunk = n - i;
+        if (chunk > PREFETCH_AHEAD * 4)
+            chunk = PREFETCH_AHEAD * 4;
+
+        for (j = 0; j < chunk; ++j) {
+            blocks[j] = block_of (bloom, ids + (size_t)(i + j) * 20, &hashes[j]);
+#ifdef __GNUC__
+            __builtin_prefetch (blocks[j], 0, 0);
+#endif
+        }
+
+#ifdef BBLOOM_X86
+        if (bbloom_avx2) {
+            test_batch_avx2 (blocks, hashes, chunk, results + i);
+            continue;
+        }
+#endif
+        for (j = 0; j < chunk; ++j)
+            results[i + j] = test_block (blocks[j], hashes[j]);
+    }
+}
+
+uint64_t
+bbloom_size (BlockedBloom *bloom)
+{
+    return (uint64_t)bloom->n_blocks * BLOCK_BITS / 8;
+}
+
+/*
+ * The ids in a block follow a Poisson distribution with a mean of
+ * @ids_per_block. With i ids in a block, each word has a bit set with
+ * probability 1 - (31/32)^i, and a false positive needs all 8 of them.
+ */
+static double
+fp_rate_for_load (double ids_per_block)
+{
+    double log_p, sum = 0, spread;
+    long i, lo, hi;
+
+    if (ids_per_block <= 0)
+        return 0;
+
+    /* Only the terms within a few deviations of the mean count. */
+    spread = 12 * sqrt (ids_per_block) + 12;
+    lo = (long)(ids_per_block - spread);
+    hi = (long)(ids_per_block + spread);
+    if (lo < 0)
+        lo = 0;
+
+    for (i = lo; i <= hi; ++i) {
+        log_p = i * log (ids_per_block) - ids_per_block - lgamma (i + 1.0);
+        sum += exp (log_p) * pow (1 - pow (31.0 / 32, i), BLOCK_WORDS);
+    }
+
+    return sum;
+}
+
+double
+bbloom_false_positive_rate (BlockedBloom *bloom, uint64_t n_ids)
+{
+    return fp_rate_for_load ((double)n_ids / bloom->n_blocks);
+}
+
+double
+bbloom_bits_per_id (double fp_rate)
+{
+    double lo = 1, hi = 64, mid;
+    int i;
+
+    /* The rate falls as the bits per id grow. */
+    for (i = 0; i < 40; ++i) {
+        mid = (lo + hi) / 2;
+        if (fp_rate_for_load (BLOCK_BITS / mid) > fp_rate)
+            lo = mid;
+        else
+            hi = mid;
+    }
+
+    return hi;
+}
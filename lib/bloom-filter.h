@@ -4,6 +4,7 @@
 #define __BLOOM_H__
 
 #include <stdlib.h>
+#include <stdint.h>
 
 typedef struct {
     size_t          asize;
@@ -20,4 +21,42 @@ int bloom_add (Bloom *bloom, const char *s);
 int bloom_remove (Bloom *bloom, const char *s);
 int bloom_test (Bloom *bloom, const char *s);
 
+/*
+ * Split block Bloom filter over raw 20-byte object ids.
+ *
+ * The filter is an array of 256-bit blocks, each in one cache line. An
+ * id picks a block and sets one bit in each of its eight 32-bit words,
+ * so a lookup touches a single cache line instead of k random ones. The
+ * bits are taken straight from the id, which is already a SHA1.
+ *
+ * It needs about 10% more bits than a plain Bloom filter for the same
+ * false positive rate. There's no removal.
+ */
+typedef struct {
+    uint32_t       *blocks;
+    size_t          n_blocks;
+    void           *mem;        /* unaligned allocation of @blocks */
+} BlockedBloom;
+
+/* @n_bits is rounded up to whole blocks. */
+BlockedBloom *bbloom_create (uint64_t n_bits);
+void bbloom_destroy (BlockedBloom *bloom);
+void bbloom_add (BlockedBloom *bloom, const unsigned char *id);
+int bbloom_test (BlockedBloom *bloom, const unsigned char *id);
+
+/* Test @n ids stored back to back in @ids. The blocks are prefetched
+ * ahead of the tests, and tested with AVX2 where the CPU has it.
+ */
+void bbloom_test_batch (BlockedBloom *bloom, const unsigned char *ids,
+                        int n, int *results);
+
+/* Memory used by the bits, in bytes. */
+uint64_t bbloom_size (BlockedBloom *bloom);
+
+/* Expected false positive rate with @n_ids added. */
+double bbloom_false_positive_rate (BlockedBloom *bloom, uint64_t n_ids);
+
+/* Bits per id that give a false positive rate of @fp_rate. */
+double bbloom_bits_per_id (double fp_rate);
+
 #endif
@@ -3,6 +3,8 @@ namespace Seafile {
 public class CopyTask : Object {
        public int64 done { set; get; }
        public int64 total { set; get; }
+       public int64 done_bytes { set; get; }
+       public int64 total_bytes { set; get; }
        public bool canceled { set; get; }
        public bool failed { set; get; }
        public bool successful { set; get; }
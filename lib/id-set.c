@@ -0,0 +1,157 @@
+/* -*- Mode: C; tab-width: 4; indent-tabs-mode: nil; c-basic-offset: 4 -*- */
+
+#include <string.h>
+
+#include "utils.h"
+#include "id-set.h"
+
+#define ID_LEN 20
+#define INITIAL_BITS 6
+
+static const unsigned char zero_id[ID_LEN];
+
+IdSet *
+id_set_new (void)
+{
+    IdSet *set = g_new0 (IdSet, 1);
+    int i;
+
+    /* Ids are sha1s, but some come from clients. A hash of the whole id
+     * with random seeds keeps crafted ids from piling up in one part of
+     * the table.
+     */
+    for (i = 0; i < 4; ++i)
+        set->seeds[i] = ((guint64)g_random_int () << 32) | g_random_int ();
+
+    return set;
+}
+
+void
+id_set_free (IdSet *set)
+{
+    if (!set)
+        return;
+
+    g_free (set->keys);
+    g_free (set);
+}
+
+static inline guint
+slot_of (IdSet *set, const unsigned char *id)
+{
+    guint64 w0, w1;
+    guint32 w2;
+    guint64 h;
+
+    memcpy (&w0, id, 8);
+    memcpy (&w1, id + 8, 8);
+    memcpy (&w2, id + 16, 4);
+
+    /* Multilinear hash of the three words, taking the high bits. */
+    h = set->seeds[0] + w0 * set->seeds[1] + w1 * set->seeds[2] +
+        (guint64)w2 * set->seeds[3];
+    return (guint)(h >> set->shift);
+}
+
+static inline gboolean
+slot_empty (const unsigned char *key)
+{
+    return memcmp (key, zero_id, ID_LEN) == 0;
+}
+
+static unsigned char *
+lookup (IdSet *set, const unsigned char *id)
+{
+    guint i = slot_of (set, id);
+    unsigned char *key;
+
+    while (1) {
+        key = set->keys + (gsize)i * ID_LEN;
+        if (slot_empty (key) || memcmp (key, id, ID_LEN) == 0)
+            return key;
+        i = (i + 1) & (set->cap - 1);
+    }
+}
+
+static void
+grow (IdSet *set)
+{
+    unsigned char *old = set->keys, *key;
+    guint old_cap = set->cap, i;
+
+    if (old_cap) {
+        set->cap = old_cap * 2;
+        --set->shift;
+    } else {
+        set->cap = 1 << INITIAL_BITS;
+        set->shift = 64 - INITIAL_BITS;
+    }
+    set->keys = g_malloc0 ((gsize)set->cap * ID_LEN);
+
+    for (i = 0; i < old_cap; ++i) {
+        key = old + (gsize)i * ID_LEN;
+        if (!slot_empty (key))
+            memcpy (lookup (set, key), key, ID_LEN);
+    }
+
+    g_free (old);
+}
+
+gboolean
+id_set_add_raw (IdSet *set, const unsigned char *id)
+{
+    unsigned char *key;
+
+    if (slot_empty (id)) {
+        if (set->has_zero)
+            return FALSE;
+        set->has_zero = TRUE;
+        ++set->n_ids;
+        return TRUE;
+    }
+
+    /* Keep the load under 3/4. */
+    if ((gsize)(set->n_ids + 1) * 4 > (gsize)set->cap * 3)
+        grow (set);
+
+    key = lookup (set, id);
+    if (!slot_empty (key))
+        return FALSE;
+
+    memcpy (key, id, ID_LEN);
+    ++set->n_ids;
+    return TRUE;
+}
+
+gboolean
+id_set_contains_raw (IdSet *set, const unsigned char *id)
+{
+    if (slot_empty (id))
+        return set->has_zero;
+    if (set->cap == 0)
+        return FALSE;
+
+    return !slot_empty (lookup (set, id));
+}
+
+int
+id_set_add (IdSet *set, const char *id)
+{
+    unsigned char raw[ID_LEN];
+
+    if (hex_to_rawdata (id, raw, ID_LEN) < 0)
+        return -1;
+
+    return id_set_add_raw (set, raw) ? 1 : 0;
+}
+
+gboolean
+id_set_contains (IdSet *set, const char *id)
+{
+    unsigned char raw[ID_LEN];
+
+    if (hex_to_rawdata (id, raw, ID_LEN) < 0)
+        return FALSE;
+
+    return id_set_contains_raw (set, raw);
+}
@@ -0,0 +1,55 @@
+/* -*- Mode: C; tab-width: 4; indent-tabs-mode: nil; c-basic-offset: 4 -*- */
+
+#ifndef ID_SET_H
+#define ID_SET_H
+
+#include <glib.h>
+
+/*
+ * A set of object ids, for the sets that grow to millions of ids (GC,
+ * block lists, transfers). Ids are kept as raw 20-byte keys in one open
+ * addressed table, so an id takes about 30 bytes instead of the string,
+ * node and key of a GHashTable.
+ *
+ * Not thread-safe.
+ */
+
+typedef struct IdSet {
+    unsigned char *keys;        /* @cap slots of 20 bytes */
+    guint cap;
+    guint n_ids;
+    guint64 seeds[4];           /* of the hash, random per set */
+    int shift;                  /* 64 - log2(@cap) */
+    /* The all-zero id marks empty slots, so it's kept aside. */
+    gboolean has_zero;
+} IdSet;
+
+IdSet *
+id_set_new (void);
+
+void
+id_set_free (IdSet *set);
+
+/* Returns TRUE if @id was not in the set before. */
+gboolean
+id_set_add_raw (IdSet *set, const unsigned char *id);
+
+gboolean
+id_set_contains_raw (IdSet *set, const unsigned char *id);
+
+/* Same for hex ids. Returns 1 if @id was added, 0 if it was in the set,
+ * or -1 if it's not a valid id.
+ */
+int
+id_set_add (IdSet *set, const char *id);
+
+gboolean
+id_set_contains (IdSet *set, const char *id);
+
+static inline guint
+id_set_size (IdSet *set)
+{
+    return set->n_ids;
+}
+
+#endif
@@ -0,0 +1,384 @@
+/* -*- Mode: C; tab-width: 4; indent-tabs-mode: nil; c-basic-offset: 4 -*- */
+
+#include <string.h>
+
+#include "json-scan.h"
+
+/* Containers nested deeper than this are not skipped. */
+#define MAX_SKIP_DEPTH 64
+
+void
+json_scan_init (JsonScan *scan, const char *data, gsize len)
+{
+    scan->p = data;
+    scan->end = data + len;
+    scan->need_comma = FALSE;
+}
+
+static inline void
+skip_space (JsonScan *scan)
+{
+    while (scan->p < scan->end &&
+           (*scan->p == ' ' || *scan->p == '\n' ||
+            *scan->p == '\r' || *scan->p == '\t'))
+        ++scan->p;
+}
+
+/* Skip white space and return the next char, or 0 at the end. */
+static inline char
+peek (JsonScan *scan)
+{
+    skip_space (scan);
+    return (scan->p < scan->end) ? *scan->p : 0;
+}
+
+int
+json_scan_enter_object (JsonScan *scan)
+{
+    if (peek (scan) != '{')
+        return -1;
+    ++scan->p;
+    scan->need_comma = FALSE;
+    return 0;
+}
+
+int
+json_scan_enter_array (JsonScan *scan)
+{
+    if (peek (scan) != '[')
+        return -1;
+    ++scan->p;
+    scan->need_comma = FALSE;
+    return 0;
+}
+
+/* Consumes the separator before the next item of a container, or its
+ * end. Returns 1 if an item follows, 0 at the end.
+ */
+static int
+next_item (JsonScan *scan, char close)
+{
+    char c = peek (scan);
+
+    if (c == close) {
+        ++scan->p;
+        scan->need_comma = TRUE;
+        return 0;
+    }
+
+    if (scan->need_comma) {
+        if (c != ',')
+            return -1;
+        ++scan->p;
+        /* No trailing comma. */
+        c = peek (scan);
+        if (c == close || c == 0)
+            return -1;
+    } else if (c == 0) {
+        return -1;
+    }
+
+    return 1;
+}
+
+static int
+scan_string (JsonScan *scan, JsonScanStr *str)
+{
+    const char *p, *start;
+    unsigned char c;
+
+    if (peek (scan) != '"')
+        return -1;
+
+    start = p = scan->p + 1;
+    str->escaped = FALSE;
+    while (p < scan->end) {
+        c = (unsigned char)*p;
+        if (c == '"')
+            break;
+        if (c < 0x20)
+            return -1;
+        if (c == '\\') {
+            str->escaped = TRUE;
+            /* The escape is checked when the string is copied. */
+            if (++p == scan->end)
+                return -1;
+        }
+        ++p;
+    }
+    if (p == scan->end)
+        return -1;
+
+    /* Escapes are ASCII, so the raw string can be checked as a whole. */
+    if (!g_utf8_validate (start, p - start, NULL))
+        return -1;
+
+    str->s = start;
+    str->len = p - start;
+    scan->p = p + 1;
+    scan->need_comma = TRUE;
+    return 0;
+}
+
+int
+json_scan_next_member (JsonScan *scan, JsonScanStr *key)
+{
+    int rc = next_item (scan, '}');
+
+    if (rc <= 0)
+        return rc;
+
+    if (scan_string (scan, key) < 0 || peek (scan) != ':')
+        return -1;
+    ++scan->p;
+    scan->need_comma = FALSE;
+
+    return 1;
+}
+
+int
+json_scan_next_element (JsonScan *scan)
+{
+    return next_item (scan, ']');
+}
+
+int
+json_scan_string (JsonScan *scan, JsonScanStr *str)
+{
+    return scan_string (scan, str);
+}
+
+int
+json_scan_int (JsonScan *scan, gint64 *value)
+{
+    const char *p;
+    gboolean negative = FALSE;
+    guint64 v = 0, limit;
+    int digit;
+
+    peek (scan);
+    p = scan->p;
+
+    if (p < scan->end && *p == '-') {
+        negative = TRUE;
+        ++p;
+    }
+    if (p == scan->end || !g_ascii_isdigit (*p))
+        return -1;
+    /* No leading zeros. */
+    if (*p == '0' && p + 1 < scan->end && g_ascii_isdigit (p[1]))
+        return -1;
+
+    limit = negative ? (guint64)G_MAXINT64 + 1 : (guint64)G_MAXINT64;
+    while (p < scan->end && g_ascii_isdigit (*p)) {
+        digit = *p - '0';
+        if (v > (limit - digit) / 10)
+            return -1;
+        v = v * 10 + digit;
+        ++p;
+    }
+
+    /* Reals are not integers. */
+    if (p < scan->end && (*p == '.' || *p == 'e' || *p == 'E'))
+        return -1;
+
+    *value = negative ? (gint64)(0 - v) : (gint64)v;
+    scan->p = p;
+    scan->need_comma = TRUE;
+    return 0;
+}
+
+static gboolean
+scan_literal (JsonScan *scan, const char *literal, int len)
+{
+    if (scan->end - scan->p < len || memcmp (scan->p, literal, len) != 0)
+        return FALSE;
+    scan->p += len;
+    scan->need_comma = TRUE;
+    return TRUE;
+}
+
+gboolean
+json_scan_null (JsonScan *scan)
+{
+    if (peek (scan) != 'n')
+        return FALSE;
+    return scan_literal (scan, "null", 4);
+}
+
+static int
+skip_scalar (JsonScan *scan)
+{
+    JsonScanStr str;
+    const char *p;
+
+    switch (peek (scan)) {
+    case '"':
+        return scan_string (scan, &str);
+    case 't':
+        return scan_literal (scan, "true", 4) ? 0 : -1;
+    case 'f':
+        return scan_literal (scan, "false", 5) ? 0 : -1;
+    case 'n':
+        return scan_literal (scan, "null", 4) ? 0 : -1;
+    default:
+        /* Any number. */
+        p = scan->p;
+        while (p < scan->end &&
+               (g_ascii_isdigit (*p) || *p == '-' || *p == '+' ||
+                *p == '.' || *p == 'e' || *p == 'E'))
+            ++p;
+        if (p == scan->p)
+            return -1;
+        scan->p = p;
+        scan->need_comma = TRUE;
+        return 0;
+    }
+}
+
+int
+json_scan_skip (JsonScan *scan)
+{
+    char closes[MAX_SKIP_DEPTH];
+    int depth = 0, rc;
+    JsonScanStr key;
+    char c;
+
+    do {
+        c = peek (scan);
+        if (c == '{' || c == '[') {
+            if (depth == MAX_SKIP_DEPTH)
+                return -1;
+            closes[depth++] = (c == '{') ? '}' : ']';
+            ++scan->p;
+            scan->need_comma = FALSE;
+        } else if (skip_scalar (scan) < 0) {
+            return -1;
+        }
+
+        /* Close the containers that end here, and move to the next
+         * value of the innermost open one.
+         */
+        while (depth > 0) {
+            if (closes[depth - 1] == '}')
+                rc = json_scan_next_member (scan, &key);
+            else
+                rc = json_scan_next_element (scan);
+            if (rc < 0)
+                return -1;
+            if (rc > 0)
+                break;
+            --depth;
+        }
+    } while (depth > 0);
+
+    return 0;
+}
+
+int
+json_scan_finish (JsonScan *scan)
+{
+    /* Some objects are saved with a nul byte at the end. */
+    while (peek (scan) == '\0' && scan->p < scan->end)
+        ++scan->p;
+
+    return (scan->p == scan->end) ? 0 : -1;
+}
+
+static int
+hex4 (const char *p)
+{
+    int i, v = 0, d;
+
+    for (i = 0; i < 4; ++i) {
+        d = g_ascii_xdigit_value (p[i]);
+        if (d < 0)
+            return -1;
+        v = (v << 4) | d;
+    }
+    return v;
+}
+
+int
+json_scan_str_copy (const JsonScanStr *str, char *buf)
+{
+    const char *p = str->s, *end = str->s + str->len;
+    char *out = buf;
+    int ch, lo;
+
+    if (!str->escaped) {
+        memcpy (buf, str->s, str->len);
+        buf[str->len] = '\0';
+        return str->len;
+    }
+
+    while (p < end) {
+        if (*p != '\\') {
+            *out++ = *p++;
+            continue;
+        }
+
+        /* The scanner made sure a char follows the backslash. */
+        ++p;
+        switch (*p++) {
+        case '"': *out++ = '"'; break;
+        case '\\': *out++ = '\\'; break;
+        case '/': *out++ = '/'; break;
+        case 'b': *out++ = '\b'; break;
+        case 'f': *out++ = '\f'; break;
+        case 'n': *out++ = '\n'; break;
+        case 'r': *out++ = '\r'; break;
+        case 't': *out++ = '\t'; break;
+        case 'u':
+            if (end - p < 4 || (ch = hex4 (p)) < 0)
+                return -1;
+            p += 4;
+            if (ch >= 0xD800 && ch <= 0xDBFF) {
+                /* A surrogate pair takes 12 chars for 4 bytes. */
+                if (end - p < 6 || p[0] != '\\' || p[1] != 'u' ||
+                    (lo = hex4 (p + 2)) < 0xDC00 || lo > 0xDFFF)
+                    return -1;
+                p += 6;
+                ch = 0x10000 + ((ch - 0xD800) << 10) + (lo - 0xDC00);
+            } else if (ch >= 0xDC00 && ch <= 0xDFFF) {
+                return -1;
+            }
+            /* Like jansson, nul chars are not allowed in strings. */
+            if (ch == 0)
+                return -1;
+            out += g_unichar_to_utf8 ((gunichar)ch, out);
+            break;
+        default:
+            return -1;
+        }
+    }
+
+    *out = '\0';
+    return out - buf;
+}
+
+char *
+json_scan_str_dup (const JsonScanStr *str)
+{
+    char *buf = g_malloc (str->len + 1);
+
+    if (json_scan_str_copy (str, buf) < 0) {
+        g_free (buf);
+        return NULL;
+    }
+    return buf;
+}
+
+gboolean
+json_scan_str_equal (const JsonScanStr *str, const char *s)
+{
+    char buf[64];
+    int len;
+
+    if (!str->escaped)
+        return (strlen (s) == str->len && memcmp (str->s, s, str->len) == 0);
+
+    if (str->len >= sizeof(buf) || (len = json_scan_str_copy (str, buf)) < 0)
+        return FALSE;
+    return (strlen (s) == len && memcmp (buf, s, len) == 0);
+}
@@ -0,0 +1,107 @@
+/* -*- Mode: C; tab-width: 4; indent-tabs-mode: nil; c-basic-offset: 4 -*- */
+
+#ifndef JSON_SCAN_H
+#define JSON_SCAN_H
+
+#include <glib.h>
+
+/*
+ * A pull parser reading JSON straight from a buffer, for the objects
+ * parsed in bulk (commits, dirs and files). Nothing is allocated while
+ * scanning: strings are returned as spans of the buffer, and callers
+ * copy the fields they keep into their own structs.
+ *
+ * Only integers are supported as numbers. Anything the scanner doesn't
+ * handle is reported as an error, so callers can fall back to jansson,
+ * which then also reports the actual error.
+ *
+ *     json_scan_init (&scan, data, len);
+ *     if (json_scan_enter_object (&scan) < 0)
+ *         goto error;
+ *     while ((rc = json_scan_next_member (&scan, &key)) > 0) {
+ *         if (json_scan_str_equal (&key, "size"))
+ *             rc = json_scan_int (&scan, &size);
+ *         else
+ *             rc = json_scan_skip (&scan);
+ *         if (rc < 0)
+ *             goto error;
+ *     }
+ *     if (rc < 0 || json_scan_finish (&scan) < 0)
+ *         goto error;
+ */
+
+typedef struct JsonScan {
+    const char *p;
+    const char *end;
+    /* A value was just read, so a comma or the end of the container
+     * comes next.
+     */
+    gboolean need_comma;
+} JsonScan;
+
+typedef struct JsonScanStr {
+    /* Between the quotes, still escaped if @escaped is set. */
+    const char *s;
+    int len;
+    gboolean escaped;
+} JsonScanStr;
+
+void
+json_scan_init (JsonScan *scan, const char *data, gsize len);
+
+/* Returns -1 if the next value is not an object. */
+int
+json_scan_enter_object (JsonScan *scan);
+
+/*
+ * Reads the key of the next member, up to its value. Returns 1 if a
+ * member was read, 0 at the end of the object, or -1 on error.
+ */
+int
+json_scan_next_member (JsonScan *scan, JsonScanStr *key);
+
+/* Returns -1 if the next value is not an array. */
+int
+json_scan_enter_array (JsonScan *scan);
+
+/* Returns 1 if the array has another element, 0 at its end, or -1 on
+ * error.
+ */
+int
+json_scan_next_element (JsonScan *scan);
+
+/* Returns -1 if the next value is not a string. */
+int
+json_scan_string (JsonScan *scan, JsonScanStr *str);
+
+/* Returns -1 if the next value is not an integer. */
+int
+json_scan_int (JsonScan *scan, gint64 *value);
+
+/* Consumes the next value if it's null. */
+gboolean
+json_scan_null (JsonScan *scan);
+
+/* Skip the next value, of any type. */
+int
+json_scan_skip (JsonScan *scan);
+
+/* Returns -1 if anything but white space is left after the value. */
+int
+json_scan_finish (JsonScan *scan);
+
+/*
+ * Unescape @str into @buf, which must hold at least @str->len + 1 bytes.
+ * Returns the length of the string, or -1 if it has a bad escape.
+ */
+int
+json_scan_str_copy (const JsonScanStr *str, char *buf);
+
+/* Returns NULL if the string has a bad escape. */
+char *
+json_scan_str_dup (const JsonScanStr *str);
+
+gboolean
+json_scan_str_equal (const JsonScanStr *str, const char *s);
+
+#endif
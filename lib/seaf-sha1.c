@@ -0,0 +1,483 @@
+/* -*- Mode: C; tab-width: 4; indent-tabs-mode: nil; c-basic-offset: 4 -*- */
+
+#include <string.h>
+#include <stdint.h>
+#include <glib.h>
+
+#include "seaf-sha1.h"
+
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+#define SEAF_SHA1_X86 1
+#include <cpuid.h>
+#include <immintrin.h>
+#endif
+
+enum {
+    IMPL_UNKNOWN = 0,
+    IMPL_OPENSSL,
+    IMPL_SHANI,
+};
+
+/* Resolved once, on first use. Only read through get_impl(). */
+static gsize impl_resolved = 0;
+static int sha1_impl = IMPL_UNKNOWN;
+static int sha1_multi_avx2 = -1;
+
+static const uint32_t sha1_iv[5] = {
+    0x67452301, 0xefcdab89, 0x98badcfe, 0x10325476, 0xc3d2e1f0
+};
+
+static inline uint32_t
+load_be32 (const unsigned char *p)
+{
+    return ((uint32_t)p[0] << 24) | ((uint32_t)p[1] << 16) |
+        ((uint32_t)p[2] << 8) | (uint32_t)p[3];
+}
+
+static inline void
+store_be32 (unsigned char *p, uint32_t v)
+{
+    p[0] = v >> 24;
+    p[1] = v >> 16;
+    p[2] = v >> 8;
+    p[3] = v;
+}
+
+/* Build the padded tail of a @len byte message whose last @tail bytes
+ * are at @data. Returns the number of 64-byte blocks written to @pad.
+ */
+static int
+sha1_pad (unsigned char pad[128], const unsigned char *data,
+          size_t tail, uint64_t len)
+{
+    int n_pad = (tail < 56) ? 1 : 2;
+    uint64_t bits = len << 3;
+
+    memset (pad, 0, 128);
+    memcpy (pad, data, tail);
+    pad[tail] = 0x80;
+    store_be32 (pad + n_pad * 64 - 8, (uint32_t)(bits >> 32));
+    store_be32 (pad + n_pad * 64 - 4, (uint32_t)bits);
+
+    return n_pad;
+}
+
+#ifdef SEAF_SHA1_X86
+
+static void
+cpu_features (int *has_shani, int *has_avx2)
+{
+    unsigned int eax, ebx, ecx, edx;
+    int ssse3, sse41, osxsave;
+
+    *has_shani = 0;
+    *has_avx2 = 0;
+
+    if (!__get_cpuid (1, &eax, &ebx, &ecx, &edx))
+        return;
+    ssse3 = (ecx >> 9) & 1;
+    sse41 = (ecx >> 19) & 1;
+    osxsave = (ecx >> 27) & 1;
+
+    if (__get_cpuid_max (0, NULL) < 7)
+        return;
+    __cpuid_count (7, 0, eax, ebx, ecx, edx);
+
+    *has_shani = ((ebx >> 29) & 1) && ssse3 && sse41;
+
+    /* AVX2 also needs the OS to save the YMM registers. */
+    if (((ebx >> 5) & 1) && osxsave) {
+        uint32_t xcr0_lo, xcr0_hi;
+        __asm__ ("xgetbv" : "=a" (xcr0_lo), "=d" (xcr0_hi) : "c" (0));
+        *has_avx2 = (xcr0_lo & 0x6) == 0x6;
+    }
+}
+
+/*
+ * SHA-NI block function. Processes @n_blocks 64-byte blocks.
+ */
+
+#define SHANI_LOAD(i)                                                   \
+    M[i] = _mm_shuffle_epi8 (                                           \
+        _mm_loadu_si128 ((const __m128i *)(data + 16 * (i))), bswap)
+
+/* Four rounds with message schedule for round group @g (rounds 4g..4g+3).
+ * E_cur holds E for this group, and E_next receives it for the next one.
+ */
+#define SHANI_GROUP(g, E_cur, E_next)                                   \
+    do {                                                                \
+        if ((g) == 0)                                                   \
+            E_cur = _mm_add_epi32 (E_cur, M[0]);                        \
+        else                                                            \
+            E_cur = _mm_sha1nexte_epu32 (E_cur, M[(g) & 3]);            \
+        E_next = abcd;                                                  \
+        if ((g) >= 3 && (g) <= 18)                                      \
+            M[((g) + 1) & 3] = _mm_sha1msg2_epu32 (M[((g) + 1) & 3],    \
+                                                   M[(g) & 3]);         \
+        abcd = _mm_sha1rnds4_epu32 (abcd, E_cur, (g) / 5);              \
+        if ((g) >= 1 && (g) <= 16)                                      \
+            M[((g) + 3) & 3] = _mm_sha1msg1_epu32 (M[((g) + 3) & 3],    \
+                                                   M[(g) & 3]);         \
+        if ((g) >= 2 && (g) <= 17)                                      \
+            M[((g) + 2) & 3] = _mm_xor_si128 (M[((g) + 2) & 3],         \
+                                              M[(g) & 3]);              \
+    } while (0)
+
+__attribute__ ((target ("sha,sse4.1,ssse3")))
+static void
+sha1_compress_shani (uint32_t h[5], const unsigned char *data, size_t n_blocks)
+{
+    const __m128i bswap = _mm_set_epi64x (0x0001020304050607ULL,
+                                          0x08090a0b0c0d0e0fULL);
+    __m128i abcd, abcd_save, e0, e0_save, e1;
+    __m128i M[4];
+
+    abcd = _mm_shuffle_epi32 (_mm_loadu_si128 ((const __m128i *)h), 0x1B);
+    e0 = _mm_set_epi32 (h[4], 0, 0, 0);
+
+    while (n_blocks--) {
+        abcd_save = abcd;
+        e0_save = e0;
+
+        SHANI_LOAD (0);
+        SHANI_GROUP (0, e0, e1);
+        SHANI_LOAD (1);
+        SHANI_GROUP (1, e1, e0);
+        SHANI_LOAD (2);
+        SHANI_GROUP (2, e0, e1);
+        SHANI_LOAD (3);
+        SHANI_GROUP (3, e1, e0);
+        SHANI_GROUP (4, e0, e1);
+        SHANI_GROUP (5, e1, e0);
+        SHANI_GROUP (6, e0, e1);
+        SHANI_GROUP (7, e1, e0);
+        SHANI_GROUP (8, e0, e1);
+        SHANI_GROUP (9, e1, e0);
+        SHANI_GROUP (10, e0, e1);
+        SHANI_GROUP (11, e1, e0);
+        SHANI_GROUP (12, e0, e1);
+        SHANI_GROUP (13, e1, e0);
+        SHANI_GROUP (14, e0, e1);
+        SHANI_GROUP (15, e1, e0);
+        SHANI_GROUP (16, e0, e1);
+        SHANI_GROUP (17, e1, e0);
+        SHANI_GROUP (18, e0, e1);
+        SHANI_GROUP (19, e1, e0);
+
+        e0 = _mm_sha1nexte_epu32 (e0, e0_save);
+        abcd = _mm_add_epi32 (abcd, abcd_save);
+
+        data += 64;
+    }
+
+    abcd = _mm_shuffle_epi32 (abcd, 0x1B);
+    _mm_storeu_si128 ((__m128i *)h, abcd);
+    h[4] = _mm_extract_epi32 (e0, 3);
+}
+
+/*
+ * 8-lane SHA1 block function. Each lane hashes one block of its own
+ * message; state is kept transposed, st[i][lane].
+ */
+
+#define MB_LANES 8
+
+typedef uint32_t v8u32 __attribute__ ((vector_size (32)));
+
+#define V8(x) ((v8u32){ (x), (x), (x), (x), (x), (x), (x), (x) })
+#define ROL8(x, n) (((x) << (n)) | ((x) >> (32 - (n))))
+
+__attribute__ ((target ("avx2")))
+static void
+sha1_compress_x8 (uint32_t st[5][MB_LANES],
+                  const unsigned char *blocks[MB_LANES])
+{
+    v8u32 w[16];
+    v8u32 a, b, c, d, e, f, k, tmp;
+    int t, l;
+
+    for (t = 0; t < 16; ++t)
+        for (l = 0; l < MB_LANES; ++l)
+            w[t][l] = load_be32 (blocks[l] + 4 * t);
+
+    memcpy (&a, st[0], sizeof(a));
+    memcpy (&b, st[1], sizeof(b));
+    memcpy (&c, st[2], sizeof(c));
+    memcpy (&d, st[3], sizeof(d));
+    memcpy (&e, st[4], sizeof(e));
+
+#define X8_ROUND(t, F, K)                                               \
+    do {                                                                \
+        if ((t) >= 16) {                                                \
+            tmp = w[((t) - 3) & 15] ^ w[((t) - 8) & 15] ^               \
+                w[((t) - 14) & 15] ^ w[(t) & 15];                       \
+            w[(t) & 15] = ROL8 (tmp, 1);                                \
+        }                                                               \
+        f = (F);                                                        \
+        tmp = ROL8 (a, 5) + f + e + (K) + w[(t) & 15];                  \
+        e = d;                                                          \
+        d = c;                                                          \
+        c = ROL8 (b, 30);                                               \
+        b = a;                                                          \
+        a = tmp;                                                        \
+    } while (0)
+
+    /* One loop per round function keeps the loop bodies branch free. */
+    k = V8 (0x5a827999);
+    for (t = 0; t < 20; ++t)
+        X8_ROUND (t, d ^ (b & (c ^ d)), k);
+    k = V8 (0x6ed9eba1);
+    for (t = 20; t < 40; ++t)
+        X8_ROUND (t, b ^ c ^ d, k);
+    k = V8 (0x8f1bbcdc);
+    for (t = 40; t < 60; ++t)
+        X8_ROUND (t, (b & c) | (d & (b | c)), k);
+    k = V8 (0xca62c1d6);
+    for (t = 60; t < 80; ++t)
+        X8_ROUND (t, b ^ c ^ d, k);
+
+#undef X8_ROUND
+
+    for (l = 0; l < MB_LANES; ++l) {
+        st[0][l] += a[l];
+        st[1][l] += b[l];
+        st[2][l] += c[l];
+        st[3][l] += d[l];
+        st[4][l] += e[l];
+    }
+}
+
+typedef struct MBLane {
+    int index;                  /* buffer being hashed, -1 if idle */
+    const unsigned char *data;  /* next full block of the buffer */
+    size_t n_blocks;            /* full blocks left */
+    unsigned char pad[128];
+    int n_pad;
+    int pad_pos;
+} MBLane;
+
+static void
+lane_load (MBLane *lane, uint32_t st[5][MB_LANES], int l,
+           int index, const unsigned char *data, size_t len)
+{
+    size_t tail = len & 63;
+    int i;
+
+    lane->index = index;
+    lane->data = data;
+    lane->n_blocks = len >> 6;
+    lane->n_pad = sha1_pad (lane->pad, data + (len - tail), tail, len);
+    lane->pad_pos = 0;
+
+    for (i = 0; i < 5; ++i)
+        st[i][l] = sha1_iv[i];
+}
+
+static const unsigned char *
+lane_next_block (MBLane *lane)
+{
+    const unsigned char *p;
+
+    if (lane->n_blocks > 0) {
+        p = lane->data;
+        lane->data += 64;
+        --lane->n_blocks;
+        return p;
+    }
+    if (lane->pad_pos < lane->n_pad)
+        return lane->pad + 64 * lane->pad_pos++;
+    return NULL;
+}
+
+static void
+sha1_multi_x8 (int n, const void * const *data, const size_t *lens,
+               unsigned char *mds)
+{
+    static const unsigned char zero_block[64];
+    uint32_t st[5][MB_LANES];
+    const unsigned char *blocks[MB_LANES];
+    MBLane lanes[MB_LANES];
+    int next = 0, active, l, i;
+
+    /* Buffers are handed to lanes as they become free, so lanes keep
+     * busy even when buffer sizes differ.
+     */
+    for (l = 0; l < MB_LANES; ++l)
+        lanes[l].index = -1;
+
+    while (1) {
+        active = 0;
+        for (l = 0; l < MB_LANES; ++l) {
+            MBLane *lane = &lanes[l];
+
+            blocks[l] = NULL;
+            if (lane->index >= 0)
+                blocks[l] = lane_next_block (lane);
+
+            if (!blocks[l] && lane->index >= 0) {
+                for (i = 0; i < 5; ++i)
+                    store_be32 (mds + lane->index * 20 + i * 4, st[i][l]);
+                lane->index = -1;
+            }
+
+            if (!blocks[l] && next < n) {
+                lane_load (lane, st, l, next, data[next], lens[next]);
+                ++next;
+                blocks[l] = lane_next_block (lane);
+            }
+
+            if (blocks[l])
+                ++active;
+            else
+                blocks[l] = zero_block;
+        }
+
+        if (active == 0)
+            break;
+
+        sha1_compress_x8 (st, blocks);
+    }
+}
+
+#endif  /* SEAF_SHA1_X86 */
+
+static void
+resolve_impl (void)
+{
+    int has_shani = 0, has_avx2 = 0;
+
+#ifdef SEAF_SHA1_X86
+    cpu_features (&has_shani, &has_avx2);
+#endif
+
+    sha1_multi_avx2 = has_avx2;
+    sha1_impl = has_shani ? IMPL_SHANI : IMPL_OPENSSL;
+}
+
+/* Also makes sha1_multi_avx2 safe to read. */
+static inline int
+get_impl ()
+{
+    if (g_once_init_enter (&impl_resolved)) {
+        resolve_impl ();
+        g_once_init_leave (&impl_resolved, 1);
+    }
+    return sha1_impl;
+}
+
+void
+seaf_sha1_init (SeafSHA1Ctx *ctx)
+{
+    if (get_impl () == IMPL_OPENSSL) {
+        SHA1_Init (&ctx->u.ossl);
+        return;
+    }
+
+    memcpy (ctx->u.own.h, sha1_iv, sizeof(sha1_iv));
+    ctx->u.own.len = 0;
+    ctx->u.own.buf_len = 0;
+}
+
+void
+seaf_sha1_update (SeafSHA1Ctx *ctx, const void *data, size_t len)
+{
+#ifdef SEAF_SHA1_X86
+    const unsigned char *p = data;
+    size_t n;
+
+    if (get_impl () == IMPL_OPENSSL) {
+        SHA1_Update (&ctx->u.ossl, data, len);
+        return;
+    }
+
+    ctx->u.own.len += len;
+
+    if (ctx->u.own.buf_len > 0) {
+        n = 64 - ctx->u.own.buf_len;
+        if (n > len)
+            n = len;
+        memcpy (ctx->u.own.buf + ctx->u.own.buf_len, p, n);
+        ctx->u.own.buf_len += n;
+        p += n;
+        len -= n;
+        if (ctx->u.own.buf_len < 64)
+            return;
+        sha1_compress_shani (ctx->u.own.h, ctx->u.own.buf, 1);
+        ctx->u.own.buf_len = 0;
+    }
+
+    if (len >= 64) {
+        sha1_compress_shani (ctx->u.own.h, p, len >> 6);
+        p += len & ~(size_t)63;
+        len &= 63;
+    }
+
+    if (len > 0) {
+        memcpy (ctx->u.own.buf, p, len);
+        ctx->u.own.buf_len = len;
+    }
+#else
+    SHA1_Update (&ctx->u.ossl, data, len);
+#endif
+}
+
+void
+seaf_sha1_final (unsigned char *md, SeafSHA1Ctx *ctx)
+{
+#ifdef SEAF_SHA1_X86
+    unsigned char pad[128];
+    int n_pad, i;
+
+    if (get_impl () == IMPL_OPENSSL) {
+        SHA1_Final (md, &ctx->u.ossl);
+        return;
+    }
+
+    n_pad = sha1_pad (pad, ctx->u.own.buf, ctx->u.own.buf_len, ctx->u.own.len);
+    sha1_compress_shani (ctx->u.own.h, pad, n_pad);
+
+    for (i = 0; i < 5; ++i)
+        store_be32 (md + i * 4, ctx->u.own.h[i]);
+#else
+    SHA1_Final (md, &ctx->u.ossl);
+#endif
+}
+
+void
+seaf_sha1 (const void *data, size_t len, unsigned char *md)
+{
+    SeafSHA1Ctx ctx;
+
+    seaf_sha1_init (&ctx);
+    seaf_sha1_update (&ctx, data, len);
+    seaf_sha1_final (md, &ctx);
+}
+
+void
+seaf_sha1_multi (int n, const void * const *data, const size_t *lens,
+                 unsigned char *mds)
+{
+    int i;
+
+    /* SHA-NI on one buffer beats eight AVX2 lanes. */
+#ifdef SEAF_SHA1_X86
+    if (get_impl () != IMPL_SHANI && sha1_multi_avx2 && n > 1) {
+        sha1_multi_x8 (n, data, lens, mds);
+        return;
+    }
+#endif
+
+    for (i = 0; i < n; ++i)
+        seaf_sha1 (data[i], lens[i], mds + i * 20);
+}
+
+const char *
+seaf_sha1_implementation ()
+{
+    switch (get_impl ()) {
+    case IMPL_SHANI:
+        return "sha-ni";
+    default:
+        return sha1_multi_avx2 ? "openssl (avx2 multi-buffer)" : "openssl";
+    }
+}
@@ -0,0 +1,57 @@
+/* -*- Mode: C; tab-width: 4; indent-tabs-mode: nil; c-basic-offset: 4 -*- */
+
+#ifndef SEAF_SHA1_H
+#define SEAF_SHA1_H
+
+#include <stdint.h>
+#include <stddef.h>
+
+#include <openssl/sha.h>
+
+/*
+ * SHA1 with runtime CPU dispatch.
+ *
+ * On x86 CPUs with the SHA extensions, blocks are hashed with SHA-NI.
+ * Otherwise OpenSSL is used. The digest is the same either way, so these
+ * can replace SHA1_Init/SHA1_Update/SHA1_Final anywhere.
+ */
+
+typedef struct SeafSHA1Ctx {
+    union {
+        SHA_CTX ossl;
+        struct {
+            uint32_t h[5];
+            uint64_t len;
+            unsigned char buf[64];
+            unsigned int buf_len;
+        } own;
+    } u;
+} SeafSHA1Ctx;
+
+void
+seaf_sha1_init (SeafSHA1Ctx *ctx);
+
+void
+seaf_sha1_update (SeafSHA1Ctx *ctx, const void *data, size_t len);
+
+void
+seaf_sha1_final (unsigned char *md, SeafSHA1Ctx *ctx);
+
+/* One-shot digest of @len bytes at @data into the 20 bytes at @md. */
+void
+seaf_sha1 (const void *data, size_t len, unsigned char *md);
+
+/*
+ * Hash @n independent buffers. The digest of @data[i] is written to
+ * @mds + i * 20. Without SHA-NI, up to 8 buffers are hashed at once in
+ * AVX2 lanes. Meant for batch users that verify many blocks or objects.
+ */
+void
+seaf_sha1_multi (int n, const void * const *data, const size_t *lens,
+                 unsigned char *mds);
+
+/* Name of the implementation in use, for logging. */
+const char *
+seaf_sha1_implementation ();
+
+#endif
@@ -28,6 +28,10 @@ public class Task : Object {
 
 	public int rate { get; set; }
 
+	public string current_file { get; set; } // being checked out
+
+	public string stats { get; set; } // phase times and counts, in JSON
+
 	public int64 _rsize;		// the size remain
 	public int64  rsize{
 		get { return _rsize; }
@@ -41,6 +41,7 @@
 
 #include <string.h>
 #include <openssl/sha.h>
+#include "seaf-sha1.h"
 #include <openssl/hmac.h>
 #include <openssl/evp.h>
 #include <openssl/bio.h>
@@ -56,6 +57,14 @@
 
 #include <zlib.h>
 
+#if defined(__SSE2__)
+#define SEAF_HEX_SSE2 1
+#include <emmintrin.h>
+#elif defined(__aarch64__) && defined(__ARM_NEON)
+#define SEAF_HEX_NEON 1
+#include <arm_neon.h>
+#endif
+
 extern int inet_pton(int af, const char *src, void *dst);
 
 
@@ -69,13 +78,150 @@ timeval_from_msec (uint64_t milliseconds)
     return ret;
 }
 
+/*
+ * Ids are converted 16 bytes at a time where the baseline instruction
+ * set has 16-byte vectors: SSE2 on x86-64 and NEON on AArch64. Nothing
+ * needs runtime detection. The tail is done byte by byte.
+ */
+
+#ifdef SEAF_HEX_SSE2
+
+/* Nibbles to lower case hex digits. */
+static inline __m128i
+nibbles_to_hex (__m128i n)
+{
+    __m128i letters = _mm_and_si128 (_mm_cmpgt_epi8 (n, _mm_set1_epi8 (9)),
+                                     _mm_set1_epi8 ('a' - '0' - 10));
+
+    return _mm_add_epi8 (_mm_add_epi8 (n, _mm_set1_epi8 ('0')), letters);
+}
+
+static void
+rawdata_to_hex_16 (const unsigned char *rawdata, char *hex_str)
+{
+    __m128i raw = _mm_loadu_si128 ((const __m128i *)rawdata);
+    __m128i mask = _mm_set1_epi8 (0x0f);
+    __m128i hi = nibbles_to_hex (_mm_and_si128 (_mm_srli_epi16 (raw, 4), mask));
+    __m128i lo = nibbles_to_hex (_mm_and_si128 (raw, mask));
+
+    _mm_storeu_si128 ((__m128i *)hex_str, _mm_unpacklo_epi8 (hi, lo));
+    _mm_storeu_si128 ((__m128i *)(hex_str + 16), _mm_unpackhi_epi8 (hi, lo));
+}
+
+/* Hex digits of either case to nibbles. Sets @valid to 0 if a char is
+ * not a hex digit.
+ */
+static inline __m128i
+hex_to_nibbles (__m128i c, int *valid)
+{
+    __m128i digit = _mm_sub_epi8 (c, _mm_set1_epi8 ('0'));
+    __m128i letter = _mm_sub_epi8 (_mm_or_si128 (c, _mm_set1_epi8 (0x20)),
+                                   _mm_set1_epi8 ('a'));
+    /* Unsigned compares, x <= max iff min(x, max) == x. */
+    __m128i is_digit = _mm_cmpeq_epi8 (_mm_min_epu8 (digit, _mm_set1_epi8 (9)),
+                                       digit);
+    __m128i is_letter = _mm_cmpeq_epi8 (_mm_min_epu8 (letter, _mm_set1_epi8 (5)),
+                                        letter);
+
+    if (_mm_movemask_epi8 (_mm_or_si128 (is_digit, is_letter)) != 0xffff)
+        *valid = 0;
+
+    return _mm_or_si128 (_mm_and_si128 (is_digit, digit),
+                         _mm_and_si128 (is_letter,
+                                        _mm_add_epi8 (letter, _mm_set1_epi8 (10))));
+}
+
+/* Returns -1 if a char is not a hex digit. */
+static int
+hex_to_rawdata_16 (const char *hex_str, unsigned char *rawdata)
+{
+    int valid = 1;
+    __m128i n0 = hex_to_nibbles (_mm_loadu_si128 ((const __m128i *)hex_str),
+                                 &valid);
+    __m128i n1 = hex_to_nibbles (_mm_loadu_si128 ((const __m128i *)(hex_str + 16)),
+                                 &valid);
+    __m128i mask = _mm_set1_epi16 (0x00f0);
+
+    if (!valid)
+        return -1;
+
+    /* Each 16-bit lane holds the high nibble in its low byte and the
+     * low nibble in its high byte.
+     */
+    n0 = _mm_or_si128 (_mm_and_si128 (_mm_slli_epi16 (n0, 4), mask),
+                       _mm_srli_epi16 (n0, 8));
+    n1 = _mm_or_si128 (_mm_and_si128 (_mm_slli_epi16 (n1, 4), mask),
+                       _mm_srli_epi16 (n1, 8));
+    _mm_storeu_si128 ((__m128i *)rawdata, _mm_packus_epi16 (n0, n1));
+    return 0;
+}
+
+#endif  /* SEAF_HEX_SSE2 */
+
+#ifdef SEAF_HEX_NEON
+
+static void
+rawdata_to_hex_16 (const unsigned char *rawdata, char *hex_str)
+{
+    static const uint8_t digits[16] = {
+        '0', '1', '2', '3', '4', '5', '6', '7',
+        '8', '9', 'a', 'b', 'c', 'd', 'e', 'f'
+    };
+    uint8x16_t table = vld1q_u8 (digits);
+    uint8x16_t raw = vld1q_u8 (rawdata);
+    uint8x16x2_t out;
+
+    out.val[0] = vqtbl1q_u8 (table, vshrq_n_u8 (raw, 4));
+    out.val[1] = vqtbl1q_u8 (table, vandq_u8 (raw, vdupq_n_u8 (0x0f)));
+    vst2q_u8 ((uint8_t *)hex_str, out);
+}
+
+static inline uint8x16_t
+hex_to_nibbles (uint8x16_t c, uint8x16_t *valid)
+{
+    uint8x16_t digit = vsubq_u8 (c, vdupq_n_u8 ('0'));
+    uint8x16_t letter = vsubq_u8 (vorrq_u8 (c, vdupq_n_u8 (0x20)),
+                                  vdupq_n_u8 ('a'));
+    uint8x16_t is_digit = vcleq_u8 (digit, vdupq_n_u8 (9));
+    uint8x16_t is_letter = vcleq_u8 (letter, vdupq_n_u8 (5));
+
+    *valid = vandq_u8 (*valid, vorrq_u8 (is_digit, is_letter));
+    return vbslq_u8 (is_digit, digit, vaddq_u8 (letter, vdupq_n_u8 (10)));
+}
+
+static int
+hex_to_rawdata_16 (const char *hex_str, unsigned char *rawdata)
+{
+    /* Splits the high and low nibble digits. */
+    uint8x16x2_t c = vld2q_u8 ((const uint8_t *)hex_str);
+    uint8x16_t valid = vdupq_n_u8 (0xff);
+    uint8x16_t hi = hex_to_nibbles (c.val[0], &valid);
+    uint8x16_t lo = hex_to_nibbles (c.val[1], &valid);
+
+    if (vminvq_u8 (valid) == 0)
+        return -1;
+
+    vst1q_u8 (rawdata, vorrq_u8 (vshlq_n_u8 (hi, 4), lo));
+    return 0;
+}
+
+#endif  /* SEAF_HEX_NEON */
+
 void
 rawdata_to_hex (const unsigned char *rawdata, char *hex_str, int n_bytes)
 {
     static const char hex[] = "0123456789abcdef";
-    int i;
+    int i = 0;
 
-    for (i = 0; i < n_bytes; i++) {
+#if defined(SEAF_HEX_SSE2) || defined(SEAF_HEX_NEON)
+    for (; i + 16 <= n_bytes; i += 16) {
+        rawdata_to_hex_16 (rawdata, hex_str);
+        rawdata += 16;
+        hex_str += 32;
+    }
+#endif
+
+    for (; i < n_bytes; i++) {
         unsigned int val = *rawdata++;
         *hex_str++ = hex[val >> 4];
         *hex_str++ = hex[val & 0xf];
@@ -97,8 +243,23 @@ static unsigned hexval(char c)
 int
 hex_to_rawdata (const char *hex_str, unsigned char *rawdata, int n_bytes)
 {
-    int i;
-    for (i = 0; i < n_bytes; i++) {
+    int i = 0;
+
+#if defined(SEAF_HEX_SSE2) || defined(SEAF_HEX_NEON)
+    /* Chunks are only read from a string known to be long enough. A
+     * shorter one fails at its nul in the loop below.
+     */
+    if (n_bytes >= 16 && strnlen (hex_str, 2 * n_bytes) == (size_t)(2 * n_bytes)) {
+        for (; i + 16 <= n_bytes; i += 16) {
+            if (hex_to_rawdata_16 (hex_str, rawdata) < 0)
+                return -1;
+            rawdata += 16;
+            hex_str += 32;
+        }
+    }
+#endif
+
+    for (; i < n_bytes; i++) {
         unsigned int val = (hexval(hex_str[0]) << 4) | hexval(hex_str[1]);
         if (val & ~0xff)
             return -1;
@@ -979,16 +1140,27 @@ ccnet_expand_path (const char *src)
 
 
 int
-calculate_sha1 (unsigned char *sha1, const char *msg, int len)
+get_cpu_count ()
 {
-    SHA_CTX c;
+#ifdef WIN32
+    SYSTEM_INFO info;
+
+    GetSystemInfo (&info);
+    return info.dwNumberOfProcessors > 0 ? (int)info.dwNumberOfProcessors : 1;
+#else
+    long n = sysconf (_SC_NPROCESSORS_ONLN);
 
+    return n > 0 ? (int)n : 1;
+#endif
+}
+
+int
+calculate_sha1 (unsigned char *sha1, const char *msg, int len)
+{
     if (len < 0)
         len = strlen(msg);
 
-    SHA1_Init(&c);
-    SHA1_Update(&c, msg, len);    
-	SHA1_Final(sha1, &c);
+    seaf_sha1 (msg, len, sha1);
     return 0;
 }
 
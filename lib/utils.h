@@ -333,6 +333,9 @@ gboolean process_is_running(const char *name);
 /* count how much instance of a program is running  */
 int count_process (const char *process_name_in);
 
+/* Number of online processors, at least 1. */
+int get_cpu_count ();
+
 #ifdef WIN32
 int win32_kill_process (const char *process_name_in);
 int win32_spawn_process (char *cmd, char *wd);
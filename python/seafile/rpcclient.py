@@ -161,6 +161,22 @@ class SeafileRpcClient(ccnet.RpcClientBase):
         pass
     is_auto_sync_enabled = seafile_is_auto_sync_enabled
 
+    # JSON of {"version": N, "children": {name: status}}
+    @searpc_func("string", ["string", "string"])
+    def seafile_get_dir_sync_status(repo_id, dir):
+        pass
+    get_dir_sync_status = seafile_get_dir_sync_status
+
+    @searpc_func("int", ["string"])
+    def seafile_get_sync_status_version(repo_id):
+        pass
+    get_sync_status_version = seafile_get_sync_status_version
+
+    @searpc_func("string", [])
+    def seafile_get_wt_monitor_stats():
+        pass
+    get_wt_monitor_stats = seafile_get_wt_monitor_stats
+
     ###### Property Management #########
 
     @searpc_func("int", ["string", "string"])
@@ -198,6 +214,11 @@ class SeafileRpcClient(ccnet.RpcClientBase):
         pass
     set_repo_token = seafile_set_repo_token
 
+    @searpc_func("int", ["string", "string"])
+    def seafile_prioritize_download(repo_id, path):
+        pass
+    prioritize_download = seafile_prioritize_download
+
     @searpc_func("string", ["string"])
     def seafile_get_repo_token(repo_id):
         pass
@@ -336,6 +357,10 @@ class SeafServerThreadedRpcClient(ccnet.RpcClientBase):
         pass
     get_repo_list = seafile_get_repo_list
 
+    @searpc_func("objlist", ["string", "int"])
+    def get_repo_list_after(after_repo_id, limit):
+        pass
+
     @searpc_func("int64", [])
     def seafile_count_repos():
         pass
@@ -460,6 +485,15 @@ class SeafServerThreadedRpcClient(ccnet.RpcClientBase):
     def list_dir_with_perm(repo_id, dir_path, dir_id, user, offset, limit):
         pass
 
+    @searpc_func("objlist", ["string", "string", "int", "int"])
+    def seafile_list_dir_page(repo_id, dir_id, offset, limit):
+        pass
+    list_dir_page = seafile_list_dir_page
+
+    @searpc_func("objlist", ["string", "string", "string", "string", "int", "int"])
+    def list_dir_page_with_perm(repo_id, dir_path, dir_id, user, offset, limit):
+        pass
+
     @searpc_func("int64", ["string", "int", "string"])
     def seafile_get_file_size(store_id, version, file_id):
         pass
@@ -851,6 +885,46 @@ class SeafServerThreadedRpcClient(ccnet.RpcClientBase):
     def get_system_default_repo_id():
         pass
 
+    # fs object cache
+    @searpc_func("string", [])
+    def get_fs_cache_stats():
+        pass
+
+    # block cache
+    @searpc_func("string", [])
+    def get_block_cache_stats():
+        pass
+
+    # object and block store latencies
+    @searpc_func("string", [])
+    def get_io_stats():
+        pass
+
+    # memory held by caches and long-lived structures
+    @searpc_func("string", [])
+    def get_memory_stats():
+        pass
+
+    # count and time of each sql statement, db pool waits
+    @searpc_func("string", [])
+    def get_db_query_stats():
+        pass
+
+    # thread pools, db pool, caches and schedulers
+    @searpc_func("string", [])
+    def get_server_metrics():
+        pass
+
+    # calls is a json list of [func_name, args...]
+    @searpc_func("string", ["string", "int"])
+    def batch_rpc(calls, parallel):
+        pass
+
+    # repo_ids is a json list
+    @searpc_func("string", ["string"])
+    def get_repos_info_by_ids(repo_ids):
+        pass
+
     # Change password
     @searpc_func("int", ["string", "string", "string", "string"])
     def seafile_change_repo_passwd(repo_id, old_passwd, new_passwd, user):
@@ -867,6 +941,10 @@ class SeafServerThreadedRpcClient(ccnet.RpcClientBase):
     def get_trash_repo_list(start, limit):
         pass
 
+    @searpc_func("objlist", ["string", "int"])
+    def get_trash_repo_list_after(after_repo_id, limit):
+        pass
+
     @searpc_func("int", ["string"])
     def del_repo_from_trash(repo_id):
         pass
@@ -1,3 +1,6 @@
+import json
+
+from pysearpc import SearpcError
 
 from service import ccnet_rpc, monitor_rpc, seafserv_rpc, \
     seafserv_threaded_rpc, ccnet_threaded_rpc
@@ -60,6 +63,16 @@ class SeafileAPI(object):
     def get_repo_list(self, start, limit):
         return seafserv_threaded_rpc.get_repo_list(start, limit)
 
+    def get_repo_list_after(self, after_repo_id, limit):
+        """
+        Return up to `limit` repos with ids after `after_repo_id`, in id
+        order. Pass None for the first page, then the id of the last repo
+        of the previous page. Unlike get_repo_list(), deep pages are as
+        fast as the first one.
+        """
+        return seafserv_threaded_rpc.get_repo_list_after(after_repo_id or '',
+                                                         limit)
+
     def count_repos(self):
         return seafserv_threaded_rpc.count_repos()
 
@@ -190,6 +203,48 @@ class SeafileAPI(object):
         dir_id = seafserv_threaded_rpc.get_dir_id_by_path(repo_id, path)
         return seafserv_threaded_rpc.list_dir(repo_id, dir_id, offset, limit)
 
+    def list_dir_page_by_dir_id(self, repo_id, dir_id, offset=-1, limit=-1):
+        """
+        List a page of a dir, in descending order of names. Unlike
+        list_dir_by_dir_id(), only the page is loaded where possible.
+        """
+        return seafserv_threaded_rpc.list_dir_page(repo_id, dir_id, offset, limit)
+
+    def batch_rpc(self, calls, parallel=True):
+        """
+        Run several calls of the seafile server in one request. calls is
+        a list of (func_name, args) tuples, func_name being the name the
+        function is registered with, e.g. ('list_dir', [repo_id, dir_id,
+        -1, -1]). Calls are run in parallel unless parallel is False, in
+        which case they are run in order.
+
+        Return the list of results, raw JSON values, with a SearpcError in
+        place of the result of each failed call.
+        """
+        fcalls = [[fname] + list(args) for fname, args in calls]
+        ret = json.loads(seafserv_threaded_rpc.batch_rpc(json.dumps(fcalls),
+                                                         1 if parallel else 0))
+        results = []
+        for r in ret['results']:
+            if 'err_code' in r:
+                results.append(SearpcError(r.get('err_msg', '')))
+            else:
+                results.append(r.get('ret'))
+        return results
+
+    def get_repos_info_by_ids(self, repo_ids):
+        """
+        Look up many repos in one call, e.g. for the admin pages.
+
+        Return a dict of repo_id -> dict with the keys name, owner,
+        head_commit_id, size, last_modified, version and encrypted.
+        Repos that don't exist are left out.
+        """
+        if not repo_ids:
+            return {}
+        return json.loads(seafserv_threaded_rpc.get_repos_info_by_ids(
+            json.dumps(list(repo_ids))))
+
     def list_dir_by_commit_and_path(self, repo_id,
                                     commit_id, path, offset=-1, limit=-1):
         dir_id = seafserv_threaded_rpc.get_dirid_by_path(repo_id, commit_id, path)
@@ -392,6 +447,10 @@ class SeafileAPI(object):
     def get_trash_repo_list(self, start, limit):
         return seafserv_threaded_rpc.get_trash_repo_list(start, limit)
 
+    def get_trash_repo_list_after(self, after_repo_id, limit):
+        return seafserv_threaded_rpc.get_trash_repo_list_after(
+            after_repo_id or '', limit)
+
     def del_repo_from_trash(self, repo_id):
         return seafserv_threaded_rpc.del_repo_from_trash(repo_id)
 
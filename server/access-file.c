@@ -16,6 +16,8 @@
 #include <sys/stat.h>
 #include <sys/types.h>
 #include <fcntl.h>
+#include <unistd.h>
+#include <pthread.h>
 
 #include <ccnet.h>
 
@@ -27,10 +29,20 @@
 #include "seafile-session.h"
 #include "access-file.h"
 #include "pack-dir.h"
+#include "zip-cache.h"
+#include "dec-block-cache.h"
+#include "http-metrics.h"
 
 #define FILE_TYPE_MAP_DEFAULT_LEN 1
 #define BUFFER_SIZE 1024 * 64
 
+/* Ranges accepted in one request. */
+#define MAX_RANGES 32
+/* Files whose block offsets are kept for range requests. */
+#define MAX_CACHED_OFFSETS 1024
+/* Zip data packed each time the connection's output drains. */
+#define DIR_DATA_BATCH (256 * 1024)
+
 struct file_type_map {
     char *suffix;
     char *type;
@@ -42,6 +54,8 @@ typedef struct SendBlockData {
     BlockHandle *handle;
     uint32_t bsize;
     uint32_t remain;
+    /* The whole block was queued by file, wait for it to drain. */
+    gboolean queued;
 
     char store_id[37];
     int repo_version;
@@ -52,15 +66,67 @@ typedef struct SendBlockData {
     void *saved_cb_arg;
 } SendBlockData;
 
+typedef void (*BlockStreamResume) (void *data);
+
+/*
+ * Reads the blocks of a file for sending, one block ahead of the one
+ * being sent. The reads run on io scheduler threads, so a slow disk
+ * doesn't hold up the other connections of this event loop, and take
+ * turns with the reads of other users. Finished reads are signalled
+ * through a pipe watched by the loop.
+ */
+typedef struct BlockStream {
+    /* Held by the request and by the read in flight. */
+    gint refcnt;
+
+    Seafile *file;
+    char store_id[37];
+    int version;
+
+    /* Whom the reads are scheduled for. */
+    char *user;
+    char repo_id[37];
+    IoClass io_class;
+    /* The block being read. */
+    int read_idx;
+
+    int fds[2];
+    struct event *ev;
+
+    /* The block being sent. */
+    int idx;
+    char *cur;
+    size_t cur_len;
+    size_t cur_off;
+    /* Where to start in the first block. */
+    size_t skip;
+
+    /* The block after @cur. Written by the worker until the pipe fires. */
+    char *next;
+    size_t next_len;
+    gboolean next_ready;
+    gboolean failed;
+
+    /* Waiting for @next. @resume is called once it's there. */
+    gboolean waiting;
+    BlockStreamResume resume;
+    void *resume_data;
+} BlockStream;
+
 typedef struct SendfileData {
     evhtp_request_t *req;
     Seafile *file;
     SeafileCrypt *crypt;
     gboolean enc_init;
     EVP_CIPHER_CTX ctx;
-    BlockHandle *handle;
-    size_t remain;
-    int idx;
+    BlockStream *stream;
+
+    /* Decrypted blocks are looked up in and copied to the cache. */
+    char repo_id[37];
+    char key_fp[41];
+    DecBlock *cached;           /* cached block being sent */
+    size_t cached_off;
+    GString *dec_copy;          /* decrypted so far of the current block */
 
     char store_id[37];
     int repo_version;
@@ -71,17 +137,35 @@ typedef struct SendfileData {
     void *saved_cb_arg;
 } SendfileData;
 
+typedef struct FileRange {
+    guint64 start;
+    guint64 end;
+} FileRange;
+
 typedef struct SendFileRangeData {
     evhtp_request_t *req;
     Seafile *file;
-    BlockHandle *handle;
-    int blk_idx;
-    guint64 start_off;
+    BlockStream *stream;
+    /* Left to send of the current range. */
     guint64 range_remain;
 
+    /* Start offsets of the blocks, and the file size at the end. */
+    guint64 *blk_offsets;
+    GArray *ranges;             /* FileRange */
+    guint cur_range;
+    char *content_type;
+    /* Set if there are several ranges, sent as multipart/byteranges. */
+    char *boundary;
+    gboolean part_header_pending;
+
     char store_id[37];
     int repo_version;
 
+    /* For the io scheduler. */
+    char *user;
+    char repo_id[37];
+    IoClass io_class;
+
     bufferevent_data_cb saved_read_cb;
     bufferevent_data_cb saved_write_cb;
     bufferevent_event_cb saved_event_cb;
@@ -90,10 +174,11 @@ typedef struct SendFileRangeData {
 
 typedef struct SendDirData {
     evhtp_request_t *req;
-    size_t remain;
 
-    int zipfd;
-    char *zipfile;
+    PackDirStream *stream;
+    SeafileCrypt *crypt;
+    struct evbuffer *buf;
+    ZipCacheWriter *cache;      /* copy of the archive for the zip cache */
 
     bufferevent_data_cb saved_read_cb;
     bufferevent_data_cb saved_write_cb;
@@ -105,6 +190,13 @@ typedef struct SendDirData {
 
 extern SeafileSession *seaf;
 
+/* file id -> block offsets, see get_block_offsets(). */
+static GHashTable *offsets_cache;
+static GQueue *offsets_cache_order;
+static pthread_mutex_t offsets_cache_lock = PTHREAD_MUTEX_INITIALIZER;
+
+static void file_range_resume (void *ctx);
+
 static struct file_type_map ftmap[] = {
     { "txt", "text/plain" },
     { "html", "text/html" },
@@ -128,6 +220,177 @@ static struct file_type_map ftmap[] = {
     { NULL, NULL },
 };
 
+static void
+block_stream_unref (BlockStream *stream)
+{
+    if (!g_atomic_int_dec_and_test (&stream->refcnt))
+        return;
+
+    close (stream->fds[0]);
+    close (stream->fds[1]);
+    g_free (stream->cur);
+    g_free (stream->next);
+    seafile_unref (stream->file);
+    g_free (stream->user);
+    g_free (stream);
+}
+
+/* Runs on an io scheduler thread. */
+static gint64
+stream_read_block (void *vstream)
+{
+    BlockStream *stream = vstream;
+    char *content = NULL;
+    size_t len = 0;
+
+    if (seaf_block_manager_read_block_content (seaf->block_mgr,
+                                               stream->store_id,
+                                               stream->version,
+                                               stream->file->blk_sha1s[stream->read_idx],
+                                               &content, &len) < 0) {
+        content = NULL;
+        len = 0;
+    }
+
+    stream->next = content;
+    stream->next_len = len;
+
+    if (writen (stream->fds[1], "", 1) != 1)
+        seaf_warning ("Failed to signal block read: %s.\n", strerror(errno));
+
+    block_stream_unref (stream);
+    return len;
+}
+
+static int
+block_stream_read (BlockStream *stream, int idx)
+{
+    g_atomic_int_inc (&stream->refcnt);
+
+    stream->read_idx = idx;
+    if (io_scheduler_submit (seaf->io_sched, stream->user, stream->repo_id,
+                             stream->io_class, stream_read_block, stream) < 0) {
+        /* The request still holds a reference. */
+        g_atomic_int_add (&stream->refcnt, -1);
+        return -1;
+    }
+
+    return 0;
+}
+
+static void
+on_stream_read_ready (evutil_socket_t fd, short events, void *arg)
+{
+    BlockStream *stream = arg;
+    char c;
+
+    if (read (fd, &c, 1) != 1)
+        return;
+
+    if (stream->next)
+        stream->next_ready = TRUE;
+    else
+        stream->failed = TRUE;
+
+    if (stream->waiting) {
+        stream->waiting = FALSE;
+        /* May free the stream. */
+        stream->resume (stream->resume_data);
+    }
+}
+
+static BlockStream *
+block_stream_new (struct bufferevent *bev,
+                  const char *store_id, int version, Seafile *file,
+                  const char *user, const char *repo_id, IoClass io_class,
+                  int start_idx, size_t start_off,
+                  BlockStreamResume resume, void *resume_data)
+{
+    BlockStream *stream = g_new0 (BlockStream, 1);
+
+    if (pipe (stream->fds) < 0) {
+        seaf_warning ("Failed to create pipe: %s.\n", strerror(errno));
+        g_free (stream);
+        return NULL;
+    }
+
+    stream->refcnt = 1;
+    seafile_ref (file);
+    stream->file = file;
+    memcpy (stream->store_id, store_id, 36);
+    stream->version = version;
+    stream->user = g_strdup (user);
+    memcpy (stream->repo_id, repo_id, 36);
+    stream->io_class = io_class;
+    stream->idx = start_idx;
+    stream->skip = start_off;
+    stream->resume = resume;
+    stream->resume_data = resume_data;
+
+    stream->ev = event_new (bufferevent_get_base (bev), stream->fds[0],
+                            EV_READ | EV_PERSIST, on_stream_read_ready, stream);
+    event_add (stream->ev, NULL);
+
+    if (block_stream_read (stream, start_idx) < 0) {
+        event_free (stream->ev);
+        block_stream_unref (stream);
+        return NULL;
+    }
+
+    return stream;
+}
+
+static void
+block_stream_free (BlockStream *stream)
+{
+    if (!stream)
+        return;
+
+    /* A read still in flight drops the last reference. */
+    event_free (stream->ev);
+    block_stream_unref (stream);
+}
+
+/*
+ * Move on to the next block once the current one is sent.
+ *
+ * Returns: 1 if there is a new current block, 0 if it's still being read
+ * (resume is called when it's ready), -1 on error.
+ */
+static int
+block_stream_next_block (BlockStream *stream)
+{
+    if (stream->cur) {
+        g_free (stream->cur);
+        stream->cur = NULL;
+        ++stream->idx;
+    }
+
+    if (stream->idx >= stream->file->n_blocks || stream->failed) {
+        seaf_warning ("Failed to read block %d of file %s.\n",
+                      stream->idx, stream->file->file_id);
+        return -1;
+    }
+
+    if (!stream->next_ready) {
+        stream->waiting = TRUE;
+        return 0;
+    }
+
+    stream->cur = stream->next;
+    stream->cur_len = stream->next_len;
+    stream->cur_off = MIN (stream->skip, stream->cur_len);
+    stream->skip = 0;
+    stream->next = NULL;
+    stream->next_ready = FALSE;
+
+    if (stream->idx + 1 < stream->file->n_blocks &&
+        block_stream_read (stream, stream->idx + 1) < 0)
+        stream->failed = TRUE;
+
+    return 1;
+}
+
 static void
 free_sendblock_data (SendBlockData *data)
 {
@@ -143,14 +406,17 @@ free_sendblock_data (SendBlockData *data)
 static void
 free_sendfile_data (SendfileData *data)
 {
-    if (data->handle) {
-        seaf_block_manager_close_block(seaf->block_mgr, data->handle);
-        seaf_block_manager_block_handle_free(seaf->block_mgr, data->handle);
-    }
+    block_stream_free (data->stream);
 
     if (data->enc_init)
         EVP_CIPHER_CTX_cleanup (&data->ctx);
 
+    dec_block_unref (data->cached);
+    if (data->dec_copy) {
+        memset (data->dec_copy->str, 0, data->dec_copy->len);
+        g_string_free (data->dec_copy, TRUE);
+    }
+
     seafile_unref (data->file);
     g_free (data->crypt);
     g_free (data);
@@ -159,25 +425,48 @@ free_sendfile_data (SendfileData *data)
 static void
 free_send_file_range_data (SendFileRangeData *data)
 {
-    if (data->handle) {
-        seaf_block_manager_close_block(seaf->block_mgr, data->handle);
-        seaf_block_manager_block_handle_free(seaf->block_mgr, data->handle);
-    }
+    block_stream_free (data->stream);
 
     seafile_unref (data->file);
+    g_free (data->blk_offsets);
+    g_array_free (data->ranges, TRUE);
+    g_free (data->content_type);
+    g_free (data->boundary);
+    g_free (data->user);
     g_free (data);
 }
 
 static void
 free_senddir_data (SendDirData *data)
 {
-    close (data->zipfd);
-    g_unlink (data->zipfile);
-
-    g_free (data->zipfile);
+    pack_dir_stream_free (data->stream);
+    g_free (data->crypt);
+    evbuffer_free (data->buf);
+    zip_cache_writer_free (data->cache);
     g_free (data);
 }
 
+/* Copy the packed data in data->buf to the zip cache, if it's cached. */
+static void
+copy_to_zip_cache (SendDirData *data, int rc)
+{
+    struct evbuffer_iovec *vec;
+    int n, i;
+
+    if (!data->cache)
+        return;
+
+    n = evbuffer_peek (data->buf, -1, NULL, NULL, 0);
+    vec = g_new (struct evbuffer_iovec, n);
+    evbuffer_peek (data->buf, -1, NULL, vec, n);
+    for (i = 0; i < n; ++i)
+        zip_cache_writer_write (data->cache, vec[i].iov_base, vec[i].iov_len);
+    g_free (vec);
+
+    if (rc == 1)
+        zip_cache_writer_commit (data->cache);
+}
+
 static void
 write_block_data_cb (struct bufferevent *bev, void *ctx)
 {
@@ -185,10 +474,14 @@ write_block_data_cb (struct bufferevent *bev, void *ctx)
     char *blk_id;
     BlockHandle *handle;
     char buf[1024 * 64];
-    int n;
+    guint32 fd_size;
+    int n, fd;
 
     blk_id = data->block_id;
 
+    if (data->queued)
+        goto done;
+
     if (!data->handle) {
         data->handle = seaf_block_manager_open_block(seaf->block_mgr,
                                                      data->store_id,
@@ -200,6 +493,23 @@ write_block_data_cb (struct bufferevent *bev, void *ctx)
         }
 
         data->remain = data->bsize;
+
+        /* Plain block files are sent by the kernel, without copying
+         * them through this buffer.
+         */
+        fd = seaf_block_manager_get_block_fd (seaf->block_mgr, data->handle,
+                                              &fd_size);
+        if (fd >= 0) {
+            if (fd_size == data->bsize &&
+                evbuffer_add_file (bufferevent_get_output (bev),
+                                   fd, 0, fd_size) == 0) {
+                data->remain = 0;
+                data->queued = TRUE;
+                http_metrics_add_bytes_out (HTTP_ROUTE_FILES, fd_size);
+                return;
+            }
+            close (fd);
+        }
     }
     handle = data->handle;
 
@@ -210,28 +520,32 @@ write_block_data_cb (struct bufferevent *bev, void *ctx)
         goto err;
     } else if (n == 0) {
         /* We've read up the data of this block, finish. */
-        seaf_block_manager_close_block (seaf->block_mgr, handle);
-        seaf_block_manager_block_handle_free (seaf->block_mgr, handle);
-        data->handle = NULL;
+        goto done;
+    }
 
-        /* Recover evhtp's callbacks */
-        bev->readcb = data->saved_read_cb;
-        bev->writecb = data->saved_write_cb;
-        bev->errorcb = data->saved_event_cb;
-        bev->cbarg = data->saved_cb_arg;
+    /* OK, we've got some data to send. */
+    http_metrics_add_bytes_out (HTTP_ROUTE_FILES, n);
+    bufferevent_write (bev, buf, n);
 
-        /* Resume reading incomming requests. */
-        evhtp_request_resume (data->req);
+    return;
 
-        evhtp_send_reply_end (data->req);
+done:
+    seaf_block_manager_close_block (seaf->block_mgr, data->handle);
+    seaf_block_manager_block_handle_free (seaf->block_mgr, data->handle);
+    data->handle = NULL;
 
-        free_sendblock_data (data);
-        return;
-    }
+    /* Recover evhtp's callbacks */
+    bev->readcb = data->saved_read_cb;
+    bev->writecb = data->saved_write_cb;
+    bev->errorcb = data->saved_event_cb;
+    bev->cbarg = data->saved_cb_arg;
 
-    /* OK, we've got some data to send. */
-    bufferevent_write (bev, buf, n);
+    /* Resume reading incomming requests. */
+    evhtp_request_resume (data->req);
 
+    evhtp_send_reply_end (data->req);
+
+    free_sendblock_data (data);
     return;
 
 err:
@@ -244,33 +558,70 @@ static void
 write_data_cb (struct bufferevent *bev, void *ctx)
 {
     SendfileData *data = ctx;
+    BlockStream *stream = data->stream;
     char *blk_id;
-    BlockHandle *handle;
-    char buf[1024 * 64];
-    int n;
+    char *buf;
+    int n, ret;
+    gboolean block_end;
 
 next:
-    blk_id = data->file->blk_sha1s[data->idx];
+    if (data->cached) {
+        if (data->cached_off < data->cached->content->len) {
+            buf = data->cached->content->str + data->cached_off;
+            n = MIN (BUFFER_SIZE, data->cached->content->len - data->cached_off);
+            data->cached_off += n;
+
+            http_metrics_add_bytes_out (HTTP_ROUTE_FILES, n);
+            bufferevent_write (bev, buf, n);
+            return;
+        }
+        dec_block_unref (data->cached);
+        data->cached = NULL;
+    }
 
-    if (!data->handle) {
-        data->handle = seaf_block_manager_open_block(seaf->block_mgr,
-                                                     data->store_id,
-                                                     data->repo_version,
-                                                     blk_id, BLOCK_READ);
-        if (!data->handle) {
-            seaf_warning ("Failed to open block %s\n", blk_id);
-            goto err;
+    if (!stream->cur || stream->cur_off == stream->cur_len) {
+        if (stream->cur) {
+            /* We've sent all data of this block, finish or try next block. */
+            if (data->enc_init) {
+                EVP_CIPHER_CTX_cleanup (&data->ctx);
+                data->enc_init = FALSE;
+            }
+
+            if (stream->idx == data->file->n_blocks - 1) {
+                /* Recover evhtp's callbacks */
+                bev->readcb = data->saved_read_cb;
+                bev->writecb = data->saved_write_cb;
+                bev->errorcb = data->saved_event_cb;
+                bev->cbarg = data->saved_cb_arg;
+
+                /* Resume reading incomming requests. */
+                evhtp_request_resume (data->req);
+
+                evhtp_send_reply_end (data->req);
+
+                free_sendfile_data (data);
+                return;
+            }
         }
 
-        BlockMetadata *bmd;
-        bmd = seaf_block_manager_stat_block_by_handle (seaf->block_mgr,
-                                                       data->handle);
-        if (!bmd)
+        ret = block_stream_next_block (stream);
+        if (ret < 0)
             goto err;
-        data->remain = bmd->size;
-        g_free (bmd);
+        if (ret == 0)
+            /* sendfile_resume() gets us back here. */
+            return;
 
         if (data->crypt) {
+            blk_id = data->file->blk_sha1s[stream->idx];
+            data->cached = dec_block_cache_lookup (data->repo_id, data->key_fp,
+                                                   blk_id);
+            if (data->cached) {
+                /* Skip the encrypted block. */
+                data->cached_off = 0;
+                stream->cur_off = stream->cur_len;
+                goto next;
+            }
+
             if (seafile_decrypt_init (&data->ctx,
                                       data->crypt->version,
                                       (unsigned char *)data->crypt->key,
@@ -279,45 +630,20 @@ next:
                 goto err;
             }
             data->enc_init = TRUE;
-        }
-    }
-    handle = data->handle;
 
-    n = seaf_block_manager_read_block(seaf->block_mgr, handle, buf, sizeof(buf));
-    data->remain -= n;
-    if (n < 0) {
-        seaf_warning ("Error when reading from block %s.\n", blk_id);
-        goto err;
-    } else if (n == 0) {
-        /* We've read up the data of this block, finish or try next block. */
-        seaf_block_manager_close_block (seaf->block_mgr, handle);
-        seaf_block_manager_block_handle_free (seaf->block_mgr, handle);
-        data->handle = NULL;
-        if (data->crypt != NULL) {
-            EVP_CIPHER_CTX_cleanup (&data->ctx);
-            data->enc_init = FALSE;
+            if (dec_block_cache_enabled ())
+                data->dec_copy = g_string_sized_new (stream->cur_len);
         }
 
-        if (data->idx == data->file->n_blocks - 1) {
-            /* Recover evhtp's callbacks */
-            bev->readcb = data->saved_read_cb;
-            bev->writecb = data->saved_write_cb;
-            bev->errorcb = data->saved_event_cb;
-            bev->cbarg = data->saved_cb_arg;
-
-            /* Resume reading incomming requests. */
-            evhtp_request_resume (data->req);
-
-            evhtp_send_reply_end (data->req);
-
-            free_sendfile_data (data);
-            return;
-        }
-
-        ++(data->idx);
         goto next;
     }
 
+    blk_id = data->file->blk_sha1s[stream->idx];
+    buf = stream->cur + stream->cur_off;
+    n = MIN (BUFFER_SIZE, stream->cur_len - stream->cur_off);
+    stream->cur_off += n;
+    block_end = (stream->cur_off == stream->cur_len);
+
     /* OK, we've got some data to send. */
     if (data->crypt != NULL) {
         char *dec_out;
@@ -330,11 +656,11 @@ next:
             goto err;
         }
 
-        int ret = EVP_DecryptUpdate (&data->ctx,
-                                     (unsigned char *)dec_out,
-                                     &dec_out_len,
-                                     (unsigned char *)buf,
-                                     n);
+        ret = EVP_DecryptUpdate (&data->ctx,
+                                 (unsigned char *)dec_out,
+                                 &dec_out_len,
+                                 (unsigned char *)buf,
+                                 n);
         if (ret == 0) {
             seaf_warning ("Decrypt block %s failed.\n", blk_id);
             g_free (dec_out);
@@ -344,10 +670,12 @@ next:
         tmp_buf = evbuffer_new ();
 
         evbuffer_add (tmp_buf, dec_out, dec_out_len);
+        if (data->dec_copy)
+            g_string_append_len (data->dec_copy, dec_out, dec_out_len);
 
         /* If it's the last piece of a block, call decrypt_final()
          * to decrypt the possible partial block. */
-        if (data->remain == 0) {
+        if (block_end) {
             ret = EVP_DecryptFinal_ex (&data->ctx,
                                        (unsigned char *)dec_out,
                                        &dec_out_len);
@@ -358,7 +686,17 @@ next:
                 goto err;
             }
             evbuffer_add (tmp_buf, dec_out, dec_out_len);
+
+            if (data->dec_copy) {
+                g_string_append_len (data->dec_copy, dec_out, dec_out_len);
+                dec_block_cache_insert (data->repo_id, data->key_fp, blk_id,
+                                        data->dec_copy);
+                data->dec_copy = NULL;
+            }
         }
+        http_metrics_add_bytes_out (HTTP_ROUTE_FILES,
+                                    evbuffer_get_length (tmp_buf));
+
         /* This may call write_data_cb() recursively (by libevent_openssl).
          * SendfileData struct may be free'd in the recursive calls.
          * So don't use "data" variable after here.
@@ -368,6 +706,7 @@ next:
         evbuffer_free (tmp_buf);
         g_free (dec_out);
     } else {
+        http_metrics_add_bytes_out (HTTP_ROUTE_FILES, n);
         bufferevent_write (bev, buf, n);
     }
 
@@ -379,38 +718,58 @@ err:
     return;
 }
 
+static void
+sendfile_resume (void *ctx)
+{
+    SendfileData *data = ctx;
+
+    write_data_cb (evhtp_request_get_bev (data->req), data);
+}
+
+/*
+ * Called whenever the connection's output is drained, so the archive is
+ * packed only as fast as the client takes it.
+ */
 static void
 write_dir_data_cb (struct bufferevent *bev, void *ctx)
 {
     SendDirData *data = ctx;
-    char buf[64 * 1024];
-    int n;
+    int rc;
 
-    n = readn (data->zipfd, buf, sizeof(buf));
-    if (n < 0) {
-        seaf_warning ("failed to read zipfile %s\n", data->zipfile);
+    rc = pack_dir_stream_read (data->stream, data->buf, DIR_DATA_BATCH);
+    if (rc < 0) {
+        /* The status is out already. Cut the response short, so the
+         * client sees it as incomplete.
+         */
         evhtp_connection_free (evhtp_request_get_connection (data->req));
         free_senddir_data (data);
-    } else if (n > 0) {
-        bufferevent_write (bev, buf, n);
-        data->remain -= n;
+        return;
+    }
 
-        if (data->remain == 0) {
-            /* Recover evhtp's callbacks */
-            bev->readcb = data->saved_read_cb;
-            bev->writecb = data->saved_write_cb;
-            bev->errorcb = data->saved_event_cb;
-            bev->cbarg = data->saved_cb_arg;
+    copy_to_zip_cache (data, rc);
 
-            /* Resume reading incomming requests. */
-            evhtp_request_resume (data->req);
+    if (evbuffer_get_length (data->buf) > 0) {
+        http_metrics_add_bytes_out (HTTP_ROUTE_FILES,
+                                    evbuffer_get_length (data->buf));
+        evhtp_send_reply_chunk (data->req, data->buf);
+        evbuffer_drain (data->buf, evbuffer_get_length (data->buf));
+    }
 
-            evhtp_send_reply_end (data->req);
+    if (rc == 0)
+        return;
 
-            free_senddir_data (data);
-            return;
-        }
-    }
+    /* Recover evhtp's callbacks */
+    bev->readcb = data->saved_read_cb;
+    bev->writecb = data->saved_write_cb;
+    bev->errorcb = data->saved_event_cb;
+    bev->cbarg = data->saved_cb_arg;
+
+    /* Resume reading incomming requests. */
+    evhtp_request_resume (data->req);
+
+    evhtp_send_reply_chunk_end (data->req);
+
+    free_senddir_data (data);
 }
 
 static void
@@ -511,10 +870,17 @@ test_firefox (evhtp_request_t *req)
     }
 }
 
+/* Views are shown to a waiting user, downloads are bulk transfers. */
+static IoClass
+io_class_of_op (const char *operation)
+{
+    return (strcmp (operation, "view") == 0) ? IO_CLASS_INTERACTIVE : IO_CLASS_BULK;
+}
+
 static int
 do_file(evhtp_request_t *req, SeafRepo *repo, const char *file_id,
         const char *filename, const char *operation,
-        SeafileCryptKey *crypt_key)
+        SeafileCryptKey *crypt_key, const char *user)
 {
     Seafile *file;
     char *type = NULL;
@@ -604,14 +970,28 @@ do_file(evhtp_request_t *req, SeafRepo *repo, const char *file_id,
     data->req = req;
     data->file = file;
     data->crypt = crypt;
+    if (crypt) {
+        memcpy (data->repo_id, repo->id, 36);
+        dec_block_cache_key_fingerprint (crypt, data->key_fp);
+    }
 
     memcpy (data->store_id, repo->store_id, 36);
     data->repo_version = repo->version;
 
+    struct bufferevent *bev = evhtp_request_get_bev (req);
+
+    /* Start reading the first block while the headers go out. */
+    data->stream = block_stream_new (bev, repo->store_id, repo->version, file,
+                                     user, repo->id, io_class_of_op (operation),
+                                     0, 0, sendfile_resume, data);
+    if (!data->stream) {
+        free_sendfile_data (data);
+        return -1;
+    }
+
     /* We need to overwrite evhtp's callback functions to
      * write file data piece by piece.
      */
-    struct bufferevent *bev = evhtp_request_get_bev (req);
     data->saved_read_cb = bev->readcb;
     data->saved_write_cb = bev->writecb;
     data->saved_event_cb = bev->errorcb;
@@ -632,68 +1012,122 @@ do_file(evhtp_request_t *req, SeafRepo *repo, const char *file_id,
     return 0;
 }
 
-// get block handle for range start
-static BlockHandle *
-get_start_block_handle (const char *store_id, int version, Seafile *file,
-                        guint64 start, int *blk_idx)
+/*
+ * Start offsets of the blocks of @file, followed by the file size. Sizes
+ * come from stat'ing the blocks, so they're cached by file id: players
+ * and viewers send many range requests for the same file.
+ */
+static guint64 *
+get_block_offsets (const char *store_id, int version, Seafile *file)
 {
-    BlockHandle *handle = NULL;
     BlockMetadata *bmd;
-    char *blkid;
-    guint64 tolsize = 0;
-    int i = 0;
+    guint64 *offsets, *cached;
+    char *key;
+    int i;
 
-    for (; i < file->n_blocks; i++) {
-        blkid = file->blk_sha1s[i];
+    pthread_mutex_lock (&offsets_cache_lock);
+    cached = g_hash_table_lookup (offsets_cache, file->file_id);
+    if (cached) {
+        offsets = g_memdup (cached, (file->n_blocks + 1) * sizeof(guint64));
+        pthread_mutex_unlock (&offsets_cache_lock);
+        return offsets;
+    }
+    pthread_mutex_unlock (&offsets_cache_lock);
 
+    offsets = g_new (guint64, file->n_blocks + 1);
+    offsets[0] = 0;
+    for (i = 0; i < file->n_blocks; i++) {
         bmd = seaf_block_manager_stat_block(seaf->block_mgr, store_id,
-                                            version, blkid);
-        if (!bmd)
+                                            version, file->blk_sha1s[i]);
+        if (!bmd) {
+            seaf_warning ("Failed to stat block %s.\n", file->blk_sha1s[i]);
+            g_free (offsets);
             return NULL;
-
-        if (start < tolsize + bmd->size) {
-            g_free (bmd);
-            break;
         }
-        tolsize += bmd->size;
+        offsets[i + 1] = offsets[i] + bmd->size;
         g_free (bmd);
     }
 
+    pthread_mutex_lock (&offsets_cache_lock);
+    if (!g_hash_table_lookup (offsets_cache, file->file_id)) {
+        /* Drop the oldest file once the cache is full. */
+        if (g_queue_get_length (offsets_cache_order) >= MAX_CACHED_OFFSETS) {
+            key = g_queue_pop_head (offsets_cache_order);
+            g_hash_table_remove (offsets_cache, key);
+        }
+        key = g_strdup (file->file_id);
+        g_hash_table_insert (offsets_cache, key,
+                             g_memdup (offsets,
+                                       (file->n_blocks + 1) * sizeof(guint64)));
+        g_queue_push_tail (offsets_cache_order, key);
+    }
+    pthread_mutex_unlock (&offsets_cache_lock);
+
+    return offsets;
+}
+
+// find the block containing the range start, and the offset in it
+static int
+get_start_block (Seafile *file, guint64 *offsets,
+                 guint64 start, int *blk_idx, size_t *blk_off)
+{
+    int lo = 0, hi = file->n_blocks, mid;
+
     /* beyond the file size */
-    if (i == file->n_blocks)
-        return NULL;
+    if (start >= offsets[file->n_blocks])
+        return -1;
 
-    handle = seaf_block_manager_open_block(seaf->block_mgr,
-                                           store_id, version,
-                                           blkid, BLOCK_READ);
-    if (!handle) {
-        seaf_warning ("Failed to open block %s.\n", blkid);
-        return NULL;
+    /* The last block starting at or before @start. */
+    while (hi - lo > 1) {
+        mid = lo + (hi - lo) / 2;
+        if (offsets[mid] <= start)
+            lo = mid;
+        else
+            hi = mid;
     }
 
-    /* trim the offset in a block */
-    if (start > tolsize) {
-        char *tmp = (char *)malloc(sizeof(*tmp) * (start - tolsize));
-        if (!tmp)
-            goto err;
+    *blk_idx = lo;
+    *blk_off = start - offsets[lo];
+    return 0;
+}
 
-        int n = seaf_block_manager_read_block(seaf->block_mgr, handle,
-                                              tmp, start-tolsize);
-        if (n != start-tolsize) {
-            seaf_warning ("Failed to read block %s.\n", blkid);
-            free (tmp);
-            goto err;
-        }
-        free (tmp);
-    }
+static char *
+format_part_header (SendFileRangeData *data, FileRange *range)
+{
+    return g_strdup_printf ("\r\n--%s\r\n"
+                            "Content-Type: %s\r\n"
+                            "Content-Range: bytes %"G_GUINT64_FORMAT"-%"G_GUINT64_FORMAT
+                            "/%"G_GUINT64_FORMAT"\r\n\r\n",
+                            data->boundary, data->content_type,
+                            range->start, range->end, data->file->file_size);
+}
+
+/* Start sending the range data->cur_range. */
+static int
+start_range_part (struct bufferevent *bev, SendFileRangeData *data)
+{
+    FileRange *range = &g_array_index (data->ranges, FileRange, data->cur_range);
+    int blk_idx;
+    size_t blk_off;
+
+    if (get_start_block (data->file, data->blk_offsets, range->start,
+                         &blk_idx, &blk_off) < 0)
+        return -1;
 
-    *blk_idx = i;
-    return handle;
+    /* Each part reads ahead from its own start. */
+    block_stream_free (data->stream);
+    data->stream = block_stream_new (bev, data->store_id, data->repo_version,
+                                     data->file, data->user, data->repo_id,
+                                     data->io_class, blk_idx, blk_off,
+                                     file_range_resume, data);
+    if (!data->stream)
+        return -1;
 
-err:
-    seaf_block_manager_close_block(seaf->block_mgr, handle);
-    seaf_block_manager_block_handle_free (seaf->block_mgr, handle);
-    return NULL;
+    data->range_remain = range->end - range->start + 1;
+    /* Multipart responses send a header before every part. */
+    data->part_header_pending = (data->boundary != NULL);
+
+    return 0;
 }
 
 static void
@@ -717,50 +1151,48 @@ static void
 write_file_range_cb (struct bufferevent *bev, void *ctx)
 {
     SendFileRangeData *data = ctx;
-    char *blk_id;
-    char buf[BUFFER_SIZE];
-    int bsize;
-    int n;
-
-    if (data->blk_idx == -1) {
-        // start to send block
-        data->handle = get_start_block_handle (data->store_id, data->repo_version,
-                                               data->file, data->start_off,
-                                               &data->blk_idx);
-        if (!data->handle)
-            goto err;
+    BlockStream *stream = data->stream;
+    char *buf;
+    int n, ret;
+
+    if (data->part_header_pending) {
+        buf = format_part_header (data, &g_array_index (data->ranges, FileRange,
+                                                        data->cur_range));
+        bufferevent_write (bev, buf, strlen(buf));
+        g_free (buf);
+        data->part_header_pending = FALSE;
     }
 
-next:
-    blk_id = data->file->blk_sha1s[data->blk_idx];
-
-    if (!data->handle) {
-        data->handle = seaf_block_manager_open_block(seaf->block_mgr,
-                                                     data->store_id,
-                                                     data->repo_version,
-                                                     blk_id, BLOCK_READ);
-        if (!data->handle) {
-            seaf_warning ("Failed to open block %s\n", blk_id);
+    while (!stream->cur || stream->cur_off == stream->cur_len) {
+        ret = block_stream_next_block (stream);
+        if (ret < 0)
             goto err;
-        }
+        if (ret == 0)
+            /* file_range_resume() gets us back here. */
+            return;
     }
 
-    bsize = data->range_remain < BUFFER_SIZE ? data->range_remain : BUFFER_SIZE;
-    n = seaf_block_manager_read_block(seaf->block_mgr, data->handle, buf, bsize);
+    buf = stream->cur + stream->cur_off;
+    n = MIN (BUFFER_SIZE, stream->cur_len - stream->cur_off);
+    if (n > data->range_remain)
+        n = data->range_remain;
+    stream->cur_off += n;
     data->range_remain -= n;
-    if (n < 0) {
-        seaf_warning ("Error when reading from block %s.\n", blk_id);
-        goto err;
-    } else if (n == 0) {
-        seaf_block_manager_close_block (seaf->block_mgr, data->handle);
-        seaf_block_manager_block_handle_free (seaf->block_mgr, data->handle);
-        data->handle = NULL;
-        ++data->blk_idx;
-        goto next;
-    }
 
+    http_metrics_add_bytes_out (HTTP_ROUTE_FILES, n);
     bufferevent_write (bev, buf, n);
     if (data->range_remain == 0) {
+        if (++data->cur_range < data->ranges->len) {
+            if (start_range_part (bev, data) < 0)
+                goto err;
+            return;
+        }
+
+        if (data->boundary) {
+            buf = g_strdup_printf ("\r\n--%s--\r\n", data->boundary);
+            bufferevent_write (bev, buf, strlen(buf));
+            g_free (buf);
+        }
         finish_file_range_request (bev, data);
     }
 
@@ -771,16 +1203,23 @@ err:
     free_send_file_range_data (data);
 }
 
-// parse range offset, only support single range (-num, num-num, num-)
+static void
+file_range_resume (void *ctx)
+{
+    SendFileRangeData *data = ctx;
+
+    write_file_range_cb (evhtp_request_get_bev (data->req), data);
+}
+
+// parse one range spec (-num, num-num, num-)
 static gboolean
-parse_range_val (const char *byte_ranges, guint64 *pstart, guint64 *pend,
+parse_range_val (const char *range, guint64 *pstart, guint64 *pend,
                  guint64 fsize)
 {
-    char *minus;
+    const char *minus;
     char *end_ptr;
     gboolean error = FALSE;
-    char *ranges_dup = g_strdup (strchr(byte_ranges, '=') + 1);
-    char *tmp = ranges_dup;
+    const char *tmp = range;
     guint64 start;
     guint64 end;
 
@@ -821,8 +1260,6 @@ parse_range_val (const char *byte_ranges, guint64 *pstart, guint64 *pend,
         }
     }
 
-    g_free (ranges_dup);
-
     if (error)
         return FALSE;
 
@@ -843,6 +1280,44 @@ parse_range_val (const char *byte_ranges, guint64 *pstart, guint64 *pend,
     return TRUE;
 }
 
+/*
+ * Parse the comma separated ranges of a Range header. Returns NULL if any
+ * of them is invalid, or there are more than MAX_RANGES.
+ */
+static GArray *
+parse_ranges (const char *byte_ranges, guint64 fsize)
+{
+    const char *eq = strchr (byte_ranges, '=');
+    GArray *ranges;
+    char **specs;
+    FileRange range;
+    guint i, n;
+
+    if (!eq)
+        return NULL;
+
+    specs = g_strsplit (eq + 1, ",", 0);
+    n = g_strv_length (specs);
+    if (n == 0 || n > MAX_RANGES) {
+        g_strfreev (specs);
+        return NULL;
+    }
+
+    ranges = g_array_sized_new (FALSE, FALSE, sizeof(FileRange), n);
+    for (i = 0; i < n; ++i) {
+        if (!parse_range_val (g_strstrip (specs[i]),
+                              &range.start, &range.end, fsize)) {
+            g_array_free (ranges, TRUE);
+            g_strfreev (specs);
+            return NULL;
+        }
+        g_array_append_val (ranges, range);
+    }
+
+    g_strfreev (specs);
+    return ranges;
+}
+
 static void
 set_resp_disposition (evhtp_request_t *req, const char *operation,
                       const char *filename)
@@ -872,14 +1347,36 @@ set_resp_disposition (evhtp_request_t *req, const char *operation,
     g_free (cont_filename);
 }
 
+/* Length of a multipart/byteranges body for @data->ranges. */
+static guint64
+multipart_length (SendFileRangeData *data)
+{
+    FileRange *range;
+    char *header;
+    guint64 len = 0;
+    guint i;
+
+    for (i = 0; i < data->ranges->len; ++i) {
+        range = &g_array_index (data->ranges, FileRange, i);
+        header = format_part_header (data, range);
+        len += strlen(header) + range->end - range->start + 1;
+        g_free (header);
+    }
+
+    /* The closing "\r\n--boundary--\r\n". */
+    return len + strlen(data->boundary) + 8;
+}
+
 static int
 do_file_range (evhtp_request_t *req, SeafRepo *repo, const char *file_id,
-               const char *filename, const char *operation, const char *byte_ranges)
+               const char *filename, const char *operation, const char *byte_ranges,
+               const char *user)
 {
     Seafile *file;
     SendFileRangeData *data = NULL;
-    guint64 start;
-    guint64 end;
+    GArray *ranges;
+    FileRange *range;
+    guint64 content_len;
 
     file = seaf_fs_manager_get_seafile(seaf->fs_mgr,
                                        repo->store_id, repo->version, file_id);
@@ -893,9 +1390,10 @@ do_file_range (evhtp_request_t *req, SeafRepo *repo, const char *file_id,
         return 0;
     }
 
-    if (!parse_range_val (byte_ranges, &start, &end, file->file_size)) {
-        seafile_unref (file);
+    ranges = parse_ranges (byte_ranges, file->file_size);
+    if (!ranges) {
         char *con_range = g_strdup_printf ("bytes */%"G_GUINT64_FORMAT, file->file_size);
+        seafile_unref (file);
         evhtp_headers_add_header (req->headers_out,
                                   evhtp_header_new("Content-Range", con_range,
                                                    0, 1));
@@ -904,57 +1402,82 @@ do_file_range (evhtp_request_t *req, SeafRepo *repo, const char *file_id,
         return 0;
     }
 
+    data = g_new0 (SendFileRangeData, 1);
+    data->req = req;
+    data->file = file;
+    data->ranges = ranges;
+
+    memcpy (data->store_id, repo->store_id, 36);
+    data->repo_version = repo->version;
+    data->user = g_strdup (user);
+    memcpy (data->repo_id, repo->id, 36);
+    data->io_class = io_class_of_op (operation);
+
+    data->blk_offsets = get_block_offsets (repo->store_id, repo->version, file);
+    if (!data->blk_offsets) {
+        free_send_file_range_data (data);
+        return -1;
+    }
+
     evhtp_headers_add_header (req->headers_out,
                               evhtp_header_new ("Accept-Ranges", "bytes", 0, 0));
 
-    char *content_type = NULL;
     char *type = parse_content_type (filename);
     if (type != NULL) {
         if (strstr(type, "text")) {
-            content_type = g_strjoin("; ", type, "charset=gbk", NULL);
+            data->content_type = g_strjoin("; ", type, "charset=gbk", NULL);
         } else {
-            content_type = g_strdup (type);
+            data->content_type = g_strdup (type);
         }
     } else {
-        content_type = g_strdup ("application/octet-stream");
+        data->content_type = g_strdup ("application/octet-stream");
     }
 
-    evhtp_headers_add_header (req->headers_out,
-                              evhtp_header_new ("Content-Type", content_type, 0, 1));
-    g_free (content_type);
+    if (ranges->len == 1) {
+        range = &g_array_index (ranges, FileRange, 0);
+        content_len = range->end - range->start + 1;
+
+        evhtp_headers_add_header (req->headers_out,
+                                  evhtp_header_new ("Content-Type",
+                                                    data->content_type, 0, 1));
+
+        char *con_range = g_strdup_printf ("%s %"G_GUINT64_FORMAT"-%"G_GUINT64_FORMAT
+                                           "/%"G_GUINT64_FORMAT, "bytes",
+                                           range->start, range->end,
+                                           file->file_size);
+        evhtp_headers_add_header (req->headers_out,
+                                  evhtp_header_new ("Content-Range", con_range, 0, 1));
+        g_free (con_range);
+    } else {
+        data->boundary = g_strdup_printf ("%08x%08x", g_random_int (),
+                                          g_random_int ());
+        content_len = multipart_length (data);
+
+        char *multipart_type = g_strdup_printf ("multipart/byteranges; boundary=%s",
+                                                data->boundary);
+        evhtp_headers_add_header (req->headers_out,
+                                  evhtp_header_new ("Content-Type",
+                                                    multipart_type, 0, 1));
+        g_free (multipart_type);
+    }
 
-    char *con_len = g_strdup_printf ("%"G_GUINT64_FORMAT, end-start+1);
+    char *con_len = g_strdup_printf ("%"G_GUINT64_FORMAT, content_len);
     evhtp_headers_add_header (req->headers_out,
                               evhtp_header_new("Content-Length", con_len, 0, 1));
     g_free (con_len);
 
-    char *con_range = g_strdup_printf ("%s %"G_GUINT64_FORMAT"-%"G_GUINT64_FORMAT
-                                       "/%"G_GUINT64_FORMAT, "bytes",
-                                       start, end, file->file_size);
-    evhtp_headers_add_header (req->headers_out,
-                              evhtp_header_new ("Content-Range", con_range, 0, 1));
-    g_free (con_range);
-
     set_resp_disposition (req, operation, filename);
 
-    data = g_new0 (SendFileRangeData, 1);
-    if (!data) {
-        seafile_unref (file);
+    struct bufferevent *bev = evhtp_request_get_bev (req);
+
+    if (start_range_part (bev, data) < 0) {
+        free_send_file_range_data (data);
         return -1;
     }
-    data->req = req;
-    data->file = file;
-    data->blk_idx = -1;
-    data->start_off = start;
-    data->range_remain = end-start+1;
-
-    memcpy (data->store_id, repo->store_id, 36);
-    data->repo_version = repo->version;
 
     /* We need to overwrite evhtp's callback functions to
      * write file data piece by piece.
      */
-    struct bufferevent *bev = evhtp_request_get_bev (req);
     data->saved_read_cb = bev->readcb;
     data->saved_write_cb = bev->writecb;
     data->saved_event_cb = bev->errorcb;
@@ -977,20 +1500,61 @@ do_file_range (evhtp_request_t *req, SeafRepo *repo, const char *file_id,
     return 0;
 }
 
+static void
+set_dir_headers (evhtp_request_t *req, const char *filename)
+{
+    char cont_filename[SEAF_PATH_MAX];
+
+    evhtp_headers_add_header(req->headers_out,
+                evhtp_header_new("Content-Type", "application/zip", 1, 1));
+
+    if (test_firefox (req)) {
+        snprintf(cont_filename, SEAF_PATH_MAX,
+                 "attachment;filename*=\"utf8\' \'%s.zip\"", filename);
+    } else {
+        snprintf(cont_filename, SEAF_PATH_MAX,
+                 "attachment;filename=\"%s.zip\"", filename);
+    }
+
+    evhtp_headers_add_header(req->headers_out,
+            evhtp_header_new("Content-Disposition", cont_filename, 1, 1));
+}
+
+/* Send the archive cached for @key, letting the kernel copy it. */
+static int
+send_cached_zip (evhtp_request_t *req, const char *key, const char *filename)
+{
+    gint64 size;
+    int fd;
+
+    fd = zip_cache_open (key, &size);
+    if (fd < 0)
+        return -1;
+
+    if (evbuffer_add_file (req->buffer_out, fd, 0, size) < 0) {
+        close (fd);
+        return -1;
+    }
+
+    set_dir_headers (req, filename);
+    http_metrics_add_bytes_out (HTTP_ROUTE_FILES, size);
+    evhtp_send_reply (req, EVHTP_RES_OK);
+
+    return 0;
+}
+
 static int
 do_dir (evhtp_request_t *req, SeafRepo *repo, const char *dir_id,
         const char *filename, const char *operation,
         SeafileCryptKey *crypt_key)
 {
-    char *zipfile = NULL;
     char *filename_escaped = NULL;
-    char cont_filename[SEAF_PATH_MAX];
-    char file_size[255];
-    SeafStat st;
+    char *cache_key = NULL;
     char *key_hex, *iv_hex;
     unsigned char enc_key[32], enc_iv[16];
     SeafileCrypt *crypt = NULL;
-    int zipfd = 0;
+    SendDirData *data = NULL;
+    int rc;
     int ret = 0;
     gint64 dir_size = 0;
 
@@ -1004,7 +1568,6 @@ do_dir (evhtp_request_t *req, SeafRepo *repo, const char *dir_id,
         goto out;
     }
 
-    /* Let's zip the directory first */
     filename_escaped = g_uri_unescape_string (filename, NULL);
     if (!filename_escaped) {
         seaf_warning ("failed to unescape string %s\n", filename);
@@ -1027,51 +1590,54 @@ do_dir (evhtp_request_t *req, SeafRepo *repo, const char *dir_id,
         g_free (iv_hex);
     }
 
-    zipfile = pack_dir (repo->store_id, repo->version,
-                        filename_escaped, dir_id, crypt, test_windows(req));
-    if (!zipfile) {
-        ret = -1;
-        goto out;
+    /* The archive of an encrypted repo would be plain text on disk. */
+    if (!crypt && zip_cache_enabled ()) {
+        cache_key = zip_cache_make_key (dir_id, filename_escaped,
+                                        test_windows(req) ?
+                                        seaf->http_server->windows_encoding :
+                                        NULL);
+        if (send_cached_zip (req, cache_key, filename) == 0)
+            goto out;
     }
 
-    /* OK, the dir is zipped */
-    evhtp_headers_add_header(req->headers_out,
-                evhtp_header_new("Content-Type", "application/zip", 1, 1));
-
-    if (seaf_stat(zipfile, &st) < 0) {
+    /* The dir is zipped while it's sent, so the size of the archive
+     * isn't known up front and it goes out in chunked encoding.
+     */
+    data = g_new0 (SendDirData, 1);
+    data->req = req;
+    data->crypt = crypt;
+    data->buf = evbuffer_new ();
+    if (cache_key)
+        data->cache = zip_cache_writer_new (cache_key);
+    data->stream = pack_dir_stream_new (repo->store_id, repo->version,
+                                        filename_escaped, dir_id, crypt,
+                                        test_windows(req));
+    if (!data->stream) {
         ret = -1;
         goto out;
     }
 
-    snprintf (file_size, sizeof(file_size), "%"G_GUINT64_FORMAT"", st.st_size);
-    evhtp_headers_add_header (req->headers_out,
-            evhtp_header_new("Content-Length", file_size, 1, 1));
-
-    if (test_firefox (req)) {
-        snprintf(cont_filename, SEAF_PATH_MAX,
-                 "attachment;filename*=\"utf8\' \'%s.zip\"", filename);
-    } else {
-        snprintf(cont_filename, SEAF_PATH_MAX,
-                 "attachment;filename=\"%s.zip\"", filename);
+    /* Pack the first batch before replying, so that a missing object
+     * early on can still be reported by the status.
+     */
+    rc = pack_dir_stream_read (data->stream, data->buf, DIR_DATA_BATCH);
+    if (rc < 0) {
+        ret = -1;
+        goto out;
     }
+    copy_to_zip_cache (data, rc);
 
-    evhtp_headers_add_header(req->headers_out,
-            evhtp_header_new("Content-Disposition", cont_filename, 1, 1));
+    set_dir_headers (req, filename);
 
-    zipfd = g_open (zipfile, O_RDONLY | O_BINARY, 0);
-    if (zipfd < 0) {
-        seaf_warning ("failed to open zipfile %s\n", zipfile);
-        ret = -1;
+    if (rc == 1) {
+        /* Small enough to go out at once. */
+        http_metrics_add_bytes_out (HTTP_ROUTE_FILES,
+                                    evbuffer_get_length (data->buf));
+        evbuffer_add_buffer (req->buffer_out, data->buf);
+        evhtp_send_reply (req, EVHTP_RES_OK);
         goto out;
     }
 
-    SendDirData *data;
-    data = g_new0 (SendDirData, 1);
-    data->req = req;
-    data->zipfd = zipfd;
-    data->zipfile = zipfile;
-    data->remain = st.st_size;
-
     /* We need to overwrite evhtp's callback functions to
      * write file data piece by piece.
      */
@@ -1090,25 +1656,131 @@ do_dir (evhtp_request_t *req, SeafRepo *repo, const char *dir_id,
      */
     evhtp_request_pause (req);
 
-    /* Kick start data transfer by sending out http headers. */
-    evhtp_send_reply_start(req, EVHTP_RES_OK);
+    evhtp_send_reply_chunk_start (req, EVHTP_RES_OK);
+    http_metrics_add_bytes_out (HTTP_ROUTE_FILES,
+                                evbuffer_get_length (data->buf));
+    evhtp_send_reply_chunk (req, data->buf);
+    evbuffer_drain (data->buf, evbuffer_get_length (data->buf));
+    data = NULL;
 
 out:
     g_free (filename_escaped);
-    if (ret < 0) {
-        if (zipfile != NULL) {
-            g_unlink (zipfile);
-            g_free (zipfile);
-        }
+    g_free (cache_key);
+    if (data)
+        free_senddir_data (data);
+    else if (ret < 0)
+        g_free (crypt);
 
-        if (zipfd > 0) {
-            close (zipfd);
+    return ret;
+}
+
+/*
+ * Conditional requests.
+ *
+ * The content behind an access URL is pinned by the object id in the
+ * token: a file or dir id, or a block id, all content hashes. So the id
+ * is the validator, and the content can be cached for as long as anyone
+ * likes.
+ */
+
+#define CACHE_MAX_AGE "31536000"
+
+/* Skip the weakness marker, which doesn't matter for GET. */
+static const char *
+opaque_tag (const char *tag)
+{
+    return (strncmp (tag, "W/", 2) == 0) ? tag + 2 : tag;
+}
+
+/* Whether the If-None-Match value @header lists @etag. */
+static gboolean
+etag_matches (const char *header, const char *etag)
+{
+    char **tags;
+    char *tag;
+    gboolean ret = FALSE;
+    int i;
+
+    tags = g_strsplit (header, ",", 0);
+    for (i = 0; tags[i] != NULL; ++i) {
+        tag = g_strstrip (tags[i]);
+        if (strcmp (tag, "*") == 0 ||
+            strcmp (opaque_tag (tag), opaque_tag (etag)) == 0) {
+            ret = TRUE;
+            break;
         }
     }
+    g_strfreev (tags);
 
     return ret;
 }
 
+/* Whether the copy the client already has is current. */
+static gboolean
+client_copy_current (evhtp_request_t *req, const char *etag)
+{
+    const char *if_none_match;
+
+    if_none_match = evhtp_kv_find (req->headers_in, "If-None-Match");
+    if (if_none_match)
+        return etag_matches (if_none_match, etag);
+
+    /* Whatever the client got from this URL is still current. */
+    return evhtp_kv_find (req->headers_in, "If-Modified-Since") != NULL;
+}
+
+/*
+ * Decrypted content of encrypted repos is only cached by the client,
+ * not by proxies on the way.
+ */
+static void
+set_cache_headers (evhtp_request_t *req, const char *etag, gboolean private)
+{
+    char http_date[256];
+    time_t now = time(NULL);
+
+    evhtp_headers_add_header (req->headers_out,
+                              evhtp_header_new ("ETag", etag, 1, 1));
+
+    /* Set Last-Modified header if the client gets this file
+     * for the first time. So that the client will set
+     * If-Modified-Since header the next time it gets the same
+     * file.
+     */
+#ifndef WIN32
+    strftime (http_date, sizeof(http_date), "%a, %d %b %Y %T GMT",
+              gmtime(&now));
+#else
+    strftime (http_date, sizeof(http_date), "%a, %d %b %Y %H:%M:%S GMT",
+              gmtime(&now));
+#endif
+    evhtp_headers_add_header (req->headers_out,
+                              evhtp_header_new ("Last-Modified", http_date, 1, 1));
+
+    evhtp_headers_add_header (req->headers_out,
+                              evhtp_header_new ("Cache-Control",
+                                                private ?
+                                                "private, max-age=" CACHE_MAX_AGE ", immutable" :
+                                                "public, max-age=" CACHE_MAX_AGE ", immutable",
+                                                1, 1));
+}
+
+/*
+ * Set the caching headers for the object named by @etag, and answer
+ * with 304 if the client has it already. Returns TRUE if it answered.
+ */
+static gboolean
+handle_conditional (evhtp_request_t *req, const char *etag, gboolean private)
+{
+    set_cache_headers (req, etag, private);
+
+    if (!client_copy_current (req, etag))
+        return FALSE;
+
+    evhtp_send_reply (req, EVHTP_RES_NOTMOD);
+    return TRUE;
+}
+
 static void
 access_cb(evhtp_request_t *req, void *arg)
 {
@@ -1121,6 +1793,8 @@ access_cb(evhtp_request_t *req, void *arg)
     const char *operation = NULL;
     const char *user = NULL;
     const char *byte_ranges = NULL;
+    const char *if_range = NULL;
+    char etag[64];
 
     GError *err = NULL;
     SeafileCryptKey *key = NULL;
@@ -1155,35 +1829,6 @@ access_cb(evhtp_request_t *req, void *arg)
         goto bad_req;
     }
 
-    if (evhtp_kv_find (req->headers_in, "If-Modified-Since") != NULL) {
-        evhtp_send_reply (req, EVHTP_RES_NOTMOD);
-        goto success;
-    } else {
-        char http_date[256];
-        evhtp_kv_t *kv;
-        time_t now = time(NULL);
-
-        /* Set Last-Modified header if the client gets this file
-         * for the first time. So that the client will set
-         * If-Modified-Since header the next time it gets the same
-         * file.
-         */
-#ifndef WIN32
-        strftime (http_date, sizeof(http_date), "%a, %d %b %Y %T GMT",
-                  gmtime(&now));
-#else
-        strftime (http_date, sizeof(http_date), "%a, %d %b %Y %H:%M:%S GMT",
-                  gmtime(&now));
-#endif
-        kv = evhtp_kv_new ("Last-Modified", http_date, 1, 1);
-        evhtp_kvs_add_kv (req->headers_out, kv);
-
-        kv = evhtp_kv_new ("Cache-Control", "max-age=3600", 1, 1);
-        evhtp_kvs_add_kv (req->headers_out, kv);
-    }
-
-    byte_ranges = evhtp_kv_find (req->headers_in, "Range");
-
     repo = seaf_repo_manager_get_repo(seaf->repo_mgr, repo_id);
     if (!repo) {
         error = "Bad repo id\n";
@@ -1206,6 +1851,24 @@ access_cb(evhtp_request_t *req, void *arg)
         goto bad_req;
     }
 
+    /* A zip of the same dir may differ in its timestamps, so the tag of
+     * a dir is weak.
+     */
+    if (strcmp(operation, "download-dir") == 0)
+        snprintf (etag, sizeof(etag), "W/\"%s\"", id);
+    else
+        snprintf (etag, sizeof(etag), "\"%s\"", id);
+    if (handle_conditional (req, etag, repo->encrypted))
+        goto success;
+
+    byte_ranges = evhtp_kv_find (req->headers_in, "Range");
+    /* Only serve a part of the file if it's part of the copy the client
+     * has; otherwise send the whole new file.
+     */
+    if_range = evhtp_kv_find (req->headers_in, "If-Range");
+    if (byte_ranges && if_range && strcmp (if_range, etag) != 0)
+        byte_ranges = NULL;
+
     if (strcmp(operation, "download-dir") == 0) {
         if (do_dir(req, repo, id, filename, operation, key) < 0) {
             error = "Internal server error\n";
@@ -1213,11 +1876,12 @@ access_cb(evhtp_request_t *req, void *arg)
         }
 
     } else if (!repo->encrypted && byte_ranges) {
-        if (do_file_range (req, repo, id, filename, operation, byte_ranges) < 0) {
+        if (do_file_range (req, repo, id, filename, operation, byte_ranges,
+                           user) < 0) {
             error = "Internal server error\n";
             goto bad_req;
         }
-    } else if (do_file(req, repo, id, filename, operation, key) < 0) {
+    } else if (do_file(req, repo, id, filename, operation, key, user) < 0) {
         error = "Internal server error\n";
         goto bad_req;
     }
@@ -1349,6 +2013,7 @@ access_blks_cb(evhtp_request_t *req, void *arg)
 
     char *repo_role = NULL;
     SeafileWebAccess *webaccess = NULL;
+    char etag[64];
 
     /* Skip the first '/'. */
     char **parts = g_strsplit (req->uri->path->full + 1, "/", 0);
@@ -1367,33 +2032,6 @@ access_blks_cb(evhtp_request_t *req, void *arg)
         goto bad_req;
     }
 
-    if (evhtp_kv_find (req->headers_in, "If-Modified-Since") != NULL) {
-        evhtp_send_reply (req, EVHTP_RES_NOTMOD);
-        goto success;
-    } else {
-        char http_date[256];
-        evhtp_kv_t *kv;
-        time_t now = time(NULL);
-
-        /* Set Last-Modified header if the client gets this file
-         * for the first time. So that the client will set
-         * If-Modified-Since header the next time it gets the same
-         * file.
-         */
-#ifndef WIN32
-        strftime (http_date, sizeof(http_date), "%a, %d %b %Y %T GMT",
-                  gmtime(&now));
-#else
-        strftime (http_date, sizeof(http_date), "%a, %d %b %Y %H:%M:%S GMT",
-                  gmtime(&now));
-#endif
-        kv = evhtp_kv_new ("Last-Modified", http_date, 1, 1);
-        evhtp_kvs_add_kv (req->headers_out, kv);
-
-        kv = evhtp_kv_new ("Cache-Control", "max-age=3600", 1, 1);
-        evhtp_kvs_add_kv (req->headers_out, kv);
-    }
-
     repo_id = seafile_web_access_get_repo_id (webaccess);
     id = seafile_web_access_get_obj_id (webaccess);
     operation = seafile_web_access_get_op (webaccess);
@@ -1411,6 +2049,14 @@ access_blks_cb(evhtp_request_t *req, void *arg)
     }
 
     if (strcmp(operation, "downloadblks") == 0) {
+        if (strlen (blkid) != 40) {
+            error = "Invalid block id\n";
+            goto bad_req;
+        }
+        snprintf (etag, sizeof(etag), "\"%s\"", blkid);
+        if (handle_conditional (req, etag, FALSE))
+            goto success;
+
         if (do_block(req, repo, id, blkid) < 0) {
             error = "Internal server error\n";
             goto bad_req;
@@ -1441,7 +2087,19 @@ bad_req:
 int
 access_file_init (evhtp_t *htp)
 {
-    evhtp_set_regex_cb (htp, "^/files/.*", access_cb, NULL);
+    offsets_cache = g_hash_table_new_full (g_str_hash, g_str_equal,
+                                           g_free, g_free);
+    offsets_cache_order = g_queue_new ();
+
+    char *zip_cache_dir = g_build_filename (seaf->http_server->http_temp_dir,
+                                            "zip-cache", NULL);
+    zip_cache_init (zip_cache_dir, seaf->http_server->zip_cache_size);
+    g_free (zip_cache_dir);
+
+    dec_block_cache_init (seaf->http_server->dec_block_cache_size);
+
+    http_metrics_set_regex_cb (htp, "^/files/.*", access_cb, NULL,
+                               HTTP_ROUTE_FILES);
     /* evhtp_set_regex_cb (htp, "^/blks/.*", access_blks_cb, NULL); */
 
     return 0;
@@ -0,0 +1,303 @@
+/* -*- Mode: C; tab-width: 4; indent-tabs-mode: nil; c-basic-offset: 4 -*- */
+
+#include "common.h"
+
+#include <pthread.h>
+#include <ccnet/cevent.h>
+
+#include "seafile-session.h"
+#include "bg-job-mgr.h"
+#include "log.h"
+
+#define DEFAULT_BG_THREADS 8
+
+typedef struct BgJob {
+    gint64 id;
+    BgJobCategory category;
+    BgJobFunc func;
+    BgJobDoneFunc done;
+    void *data;
+    void *result;
+    gint64 queued_time;
+    gboolean running;
+    gboolean cancelled;
+} BgJob;
+
+typedef struct CategoryState {
+    GQueue *queue;
+    int n_running;
+    int limit;
+    gint64 n_finished;
+    gint64 n_cancelled;
+    gint64 total_wait_usec;
+    gint64 max_wait_usec;
+} CategoryState;
+
+typedef struct BgJobManagerPriv {
+    pthread_mutex_t lock;
+    pthread_cond_t cond;
+    CategoryState cats[N_BG_JOB_CATEGORIES];
+    /* id -> queued or running job */
+    GHashTable *jobs;
+    gint64 next_id;
+
+    guint32 done_ev_id;
+} BgJobManagerPriv;
+
+static const char *category_names[N_BG_JOB_CATEGORIES] = {
+    "interactive",
+    "merge",
+    "size",
+    "index",
+    "prune",
+};
+
+/* The job run by the current worker thread. */
+static pthread_key_t current_job_key;
+
+const char *
+bg_job_category_name (BgJobCategory category)
+{
+    return category_names[category];
+}
+
+static int
+default_limit (BgJobCategory category, int n_threads)
+{
+    switch (category) {
+    case BG_JOB_INTERACTIVE:
+        return n_threads;
+    case BG_JOB_MERGE:
+    case BG_JOB_SIZE:
+        return MAX (n_threads / 2, 1);
+    case BG_JOB_PRUNE:
+        return 1;
+    default:
+        return MAX (n_threads / 4, 1);
+    }
+}
+
+BgJobManager *
+bg_job_manager_new (SeafileSession *session)
+{
+    BgJobManager *mgr = g_new0 (BgJobManager, 1);
+    BgJobManagerPriv *priv = g_new0 (BgJobManagerPriv, 1);
+    int i, n;
+
+    mgr->seaf = session;
+    mgr->priv = priv;
+
+    /*
+     * [thread pool size]
+     * background = 8
+     */
+    n = g_key_file_get_integer (session->config,
+                                "thread pool size", "background", NULL);
+    mgr->n_threads = (n > 0) ? n : DEFAULT_BG_THREADS;
+
+    /*
+     * [background jobs]
+     * size = 4
+     */
+    for (i = 0; i < N_BG_JOB_CATEGORIES; ++i) {
+        priv->cats[i].queue = g_queue_new ();
+        n = g_key_file_get_integer (session->config, "background jobs",
+                                    category_names[i], NULL);
+        priv->cats[i].limit = (n > 0) ? MIN (n, mgr->n_threads) :
+            default_limit (i, mgr->n_threads);
+    }
+
+    pthread_mutex_init (&priv->lock, NULL);
+    pthread_cond_init (&priv->cond, NULL);
+    priv->jobs = g_hash_table_new (g_int64_hash, g_int64_equal);
+    priv->next_id = 1;
+
+    pthread_key_create (&current_job_key, NULL);
+
+    return mgr;
+}
+
+static void
+on_job_done (CEvent *event, void *vmgr)
+{
+    BgJob *job = event->data;
+
+    job->done (job->result);
+    g_free (job);
+}
+
+static void
+finish_job (BgJobManager *mgr, BgJob *job)
+{
+    if (job->done)
+        cevent_manager_add_event (mgr->seaf->ev_mgr, mgr->priv->done_ev_id, job);
+    else
+        g_free (job);
+}
+
+/* Returns the first job of the highest priority category that is under
+ * its limit. Called with the lock held.
+ */
+static BgJob *
+pick_job (BgJobManagerPriv *priv)
+{
+    CategoryState *cat;
+    int i;
+
+    for (i = 0; i < N_BG_JOB_CATEGORIES; ++i) {
+        cat = &priv->cats[i];
+        if (cat->n_running < cat->limit && !g_queue_is_empty (cat->queue))
+            return g_queue_pop_head (cat->queue);
+    }
+    return NULL;
+}
+
+static void *
+worker_thread (void *vmgr)
+{
+    BgJobManager *mgr = vmgr;
+    BgJobManagerPriv *priv = mgr->priv;
+    CategoryState *cat;
+    BgJob *job;
+    gint64 wait;
+
+    while (1) {
+        pthread_mutex_lock (&priv->lock);
+        while (!(job = pick_job (priv)))
+            pthread_cond_wait (&priv->cond, &priv->lock);
+
+        cat = &priv->cats[job->category];
+        wait = g_get_monotonic_time () - job->queued_time;
+        ++cat->n_running;
+        cat->total_wait_usec += wait;
+        cat->max_wait_usec = MAX (cat->max_wait_usec, wait);
+        job->running = TRUE;
+        pthread_mutex_unlock (&priv->lock);
+
+        pthread_setspecific (current_job_key, job);
+        job->result = job->func (job->data);
+        pthread_setspecific (current_job_key, NULL);
+
+        pthread_mutex_lock (&priv->lock);
+        --cat->n_running;
+        ++cat->n_finished;
+        g_hash_table_remove (priv->jobs, &job->id);
+        /* A slot of this category is free, which may unblock any worker. */
+        pthread_cond_broadcast (&priv->cond);
+        pthread_mutex_unlock (&priv->lock);
+
+        finish_job (mgr, job);
+    }
+
+    return NULL;
+}
+
+int
+bg_job_manager_start (BgJobManager *mgr)
+{
+    pthread_attr_t attr;
+    pthread_t tid;
+    int i;
+
+    mgr->priv->done_ev_id = cevent_manager_register (mgr->seaf->ev_mgr,
+                                                     on_job_done, mgr);
+
+    pthread_attr_init (&attr);
+    pthread_attr_setdetachstate (&attr, PTHREAD_CREATE_DETACHED);
+    for (i = 0; i < mgr->n_threads; ++i) {
+        if (pthread_create (&tid, &attr, worker_thread, mgr) != 0) {
+            seaf_warning ("Failed to start background job thread.\n");
+            pthread_attr_destroy (&attr);
+            return -1;
+        }
+    }
+    pthread_attr_destroy (&attr);
+
+    return 0;
+}
+
+gint64
+bg_job_manager_schedule (BgJobManager *mgr, BgJobCategory category,
+                         BgJobFunc func, BgJobDoneFunc done, void *data)
+{
+    BgJobManagerPriv *priv = mgr->priv;
+    BgJob *job;
+    gint64 id;
+
+    if (category < 0 || category >= N_BG_JOB_CATEGORIES || !func)
+        return -1;
+
+    job = g_new0 (BgJob, 1);
+    job->category = category;
+    job->func = func;
+    job->done = done;
+    job->data = data;
+    job->queued_time = g_get_monotonic_time ();
+
+    pthread_mutex_lock (&priv->lock);
+    id = job->id = priv->next_id++;
+    g_hash_table_insert (priv->jobs, &job->id, job);
+    g_queue_push_tail (priv->cats[category].queue, job);
+    pthread_cond_signal (&priv->cond);
+    pthread_mutex_unlock (&priv->lock);
+
+    return id;
+}
+
+int
+bg_job_manager_cancel (BgJobManager *mgr, gint64 job_id)
+{
+    BgJobManagerPriv *priv = mgr->priv;
+    BgJob *job;
+
+    pthread_mutex_lock (&priv->lock);
+
+    job = g_hash_table_lookup (priv->jobs, &job_id);
+    if (!job) {
+        pthread_mutex_unlock (&priv->lock);
+        return -1;
+    }
+
+    job->cancelled = TRUE;
+    ++priv->cats[job->category].n_cancelled;
+    if (job->running) {
+        pthread_mutex_unlock (&priv->lock);
+        return 0;
+    }
+
+    g_queue_remove (priv->cats[job->category].queue, job);
+    g_hash_table_remove (priv->jobs, &job->id);
+
+    pthread_mutex_unlock (&priv->lock);
+
+    job->result = job->data;
+    finish_job (mgr, job);
+    return 0;
+}
+
+gboolean
+bg_job_cancelled (void)
+{
+    BgJob *job = pthread_getspecific (current_job_key);
+
+    /* Only set by another thread, a stale read just stops a bit later. */
+    return job && job->cancelled;
+}
+
+void
+bg_job_manager_get_stats (BgJobManager *mgr, BgJobCategory category,
+                          BgJobStats *stats)
+{
+    BgJobManagerPriv *priv = mgr->priv;
+    CategoryState *cat = &priv->cats[category];
+
+    pthread_mutex_lock (&priv->lock);
+    stats->n_queued = g_queue_get_length (cat->queue);
+    stats->n_running = cat->n_running;
+    stats->limit = cat->limit;
+    stats->n_finished = cat->n_finished;
+    stats->n_cancelled = cat->n_cancelled;
+    stats->total_wait_usec = cat->total_wait_usec;
+    stats->max_wait_usec = cat->max_wait_usec;
+    pthread_mutex_unlock (&priv->lock);
+}
@@ -0,0 +1,82 @@
+#ifndef BG_JOB_MGR_H
+#define BG_JOB_MGR_H
+
+#include <glib.h>
+
+struct _SeafileSession;
+
+/*
+ * Background jobs of the server, run on one bounded set of threads.
+ *
+ * Every job belongs to a category. Categories are served in the order
+ * below, so that jobs someone is waiting for go ahead of the long
+ * housekeeping ones, and each category runs at most its limit of jobs
+ * at once, so that a burst of one kind can't take all the threads.
+ */
+typedef enum BgJobCategory {
+    BG_JOB_INTERACTIVE = 0,     /* a user is waiting for it */
+    BG_JOB_MERGE,               /* virtual repo merges */
+    BG_JOB_SIZE,                /* repo size computation */
+    BG_JOB_INDEX,               /* file revision indexing */
+    BG_JOB_PRUNE,               /* history pruning */
+    N_BG_JOB_CATEGORIES,
+} BgJobCategory;
+
+/* Same as the ccnet job manager: @func runs in a worker thread and its
+ * return value is passed to @done, which runs in the main thread.
+ */
+typedef void *(*BgJobFunc) (void *data);
+typedef void (*BgJobDoneFunc) (void *result);
+
+struct BgJobManagerPriv;
+
+typedef struct BgJobManager {
+    struct _SeafileSession *seaf;
+
+    int n_threads;
+
+    struct BgJobManagerPriv *priv;
+} BgJobManager;
+
+BgJobManager *
+bg_job_manager_new (struct _SeafileSession *session);
+
+int
+bg_job_manager_start (BgJobManager *mgr);
+
+/* Returns the id of the job, or -1 on error. */
+gint64
+bg_job_manager_schedule (BgJobManager *mgr, BgJobCategory category,
+                         BgJobFunc func, BgJobDoneFunc done, void *data);
+
+/*
+ * A queued job is dropped and @done is called with its data, so jobs
+ * returning their data need no special handling. A running job is only
+ * flagged, it stops early if it checks bg_job_cancelled().
+ * Returns -1 if the job is already finished.
+ */
+int
+bg_job_manager_cancel (BgJobManager *mgr, gint64 job_id);
+
+/* Whether the job running in the calling thread was cancelled. */
+gboolean
+bg_job_cancelled (void);
+
+typedef struct BgJobStats {
+    int n_queued;
+    int n_running;
+    int limit;
+    gint64 n_finished;
+    gint64 n_cancelled;
+    gint64 total_wait_usec;     /* time queued of the started jobs */
+    gint64 max_wait_usec;
+} BgJobStats;
+
+const char *
+bg_job_category_name (BgJobCategory category);
+
+void
+bg_job_manager_get_stats (BgJobManager *mgr, BgJobCategory category,
+                          BgJobStats *stats);
+
+#endif
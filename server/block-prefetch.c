@@ -0,0 +1,247 @@
+/* -*- Mode: C; tab-width: 4; indent-tabs-mode: nil; c-basic-offset: 4 -*- */
+
+#include "common.h"
+
+#include <pthread.h>
+
+#include "seafile-session.h"
+#include "block-prefetch.h"
+#include "log.h"
+
+#define DEFAULT_PREFETCH_THREADS 2
+#define DEFAULT_SESSION_MB 64
+/* Files hinted for a session that aren't done yet. */
+#define MAX_SESSION_JOBS 1000
+/* Sessions idle for this long are forgotten. */
+#define SESSION_IDLE_USEC (60 * G_USEC_PER_SEC)
+#define SWEEP_INTERVAL_USEC (10 * G_USEC_PER_SEC)
+
+typedef struct PrefetchSession {
+    char *token;
+    /* Bytes hinted that the session hasn't read yet. */
+    gint64 ahead;
+    int n_jobs;
+    gint64 last_active;
+} PrefetchSession;
+
+typedef struct PrefetchJob {
+    PrefetchSession *session;
+    char store_id[37];
+    char obj_id[41];
+} PrefetchJob;
+
+typedef struct BlockPrefetcherPriv {
+    pthread_mutex_t lock;
+    /* token -> PrefetchSession */
+    GHashTable *sessions;
+    gint64 last_sweep;
+    GThreadPool *pool;
+} BlockPrefetcherPriv;
+
+static void
+session_free (PrefetchSession *s)
+{
+    g_free (s->token);
+    g_free (s);
+}
+
+static void
+sweep_sessions (BlockPrefetcherPriv *priv, gint64 now)
+{
+    GHashTableIter iter;
+    gpointer value;
+    PrefetchSession *s;
+
+    if (now - priv->last_sweep < SWEEP_INTERVAL_USEC)
+        return;
+    priv->last_sweep = now;
+
+    g_hash_table_iter_init (&iter, priv->sessions);
+    while (g_hash_table_iter_next (&iter, NULL, &value)) {
+        s = value;
+        if (s->n_jobs == 0 && now - s->last_active > SESSION_IDLE_USEC)
+            g_hash_table_iter_remove (&iter);
+    }
+}
+
+static gboolean
+session_has_room (BlockPrefetcher *pf, PrefetchSession *s)
+{
+    gboolean ret;
+
+    pthread_mutex_lock (&pf->priv->lock);
+    ret = (s->ahead < pf->session_bytes);
+    pthread_mutex_unlock (&pf->priv->lock);
+
+    return ret;
+}
+
+static void
+prefetch_file (BlockPrefetcher *pf, PrefetchJob *job, Seafile *file)
+{
+    gint64 size;
+    guint32 i;
+
+    for (i = 0; i < file->n_blocks; ++i) {
+        if (!session_has_room (pf, job->session))
+            break;
+
+        size = seaf_block_manager_prefetch_block (seaf->block_mgr, job->store_id,
+                                                  1, file->blk_sha1s[i]);
+        if (size <= 0)
+            continue;
+
+        pthread_mutex_lock (&pf->priv->lock);
+        job->session->ahead += size;
+        pthread_mutex_unlock (&pf->priv->lock);
+    }
+}
+
+static void
+prefetch_thread (gpointer data, gpointer user_data)
+{
+    PrefetchJob *job = data;
+    BlockPrefetcher *pf = user_data;
+    SeafFSObject *obj = NULL;
+    void *raw;
+    int len;
+
+    if (!session_has_room (pf, job->session))
+        goto out;
+
+    /* Just sent to the client, so the object is cheap to read again. */
+    if (seaf_obj_store_read_obj (seaf->fs_mgr->obj_store, job->store_id, 1,
+                                 job->obj_id, &raw, &len) < 0)
+        goto out;
+    obj = seaf_fs_object_from_data (job->obj_id, raw, len, TRUE);
+    g_free (raw);
+
+    if (obj && obj->type == SEAF_METADATA_TYPE_FILE)
+        prefetch_file (pf, job, (Seafile *)obj);
+    seaf_fs_object_free (obj);
+
+out:
+    pthread_mutex_lock (&pf->priv->lock);
+    --job->session->n_jobs;
+    job->session->last_active = get_current_time ();
+    pthread_mutex_unlock (&pf->priv->lock);
+
+    g_free (job);
+}
+
+BlockPrefetcher *
+block_prefetcher_new (SeafileSession *session)
+{
+    BlockPrefetcher *pf = g_new0 (BlockPrefetcher, 1);
+    BlockPrefetcherPriv *priv = g_new0 (BlockPrefetcherPriv, 1);
+    GKeyFile *config = session->config;
+    int n;
+
+    pf->seaf = session;
+    pf->priv = priv;
+
+    if (g_key_file_has_key (config, "block prefetch", "enabled", NULL))
+        pf->enabled = g_key_file_get_boolean (config, "block prefetch",
+                                              "enabled", NULL);
+    else
+        pf->enabled = TRUE;
+
+    n = g_key_file_get_integer (config, "block prefetch", "threads", NULL);
+    pf->n_threads = (n > 0) ? n : DEFAULT_PREFETCH_THREADS;
+
+    n = g_key_file_get_integer (config, "block prefetch", "session_mb", NULL);
+    pf->session_bytes = (gint64)((n > 0) ? n : DEFAULT_SESSION_MB) << 20;
+
+    pthread_mutex_init (&priv->lock, NULL);
+    priv->sessions = g_hash_table_new_full (g_str_hash, g_str_equal,
+                                            NULL, (GDestroyNotify)session_free);
+
+    return pf;
+}
+
+int
+block_prefetcher_start (BlockPrefetcher *pf)
+{
+    GError *error = NULL;
+
+    if (!pf->enabled)
+        return 0;
+
+    /* Backends that can't read ahead, like S3 without a block cache. */
+    if (!pf->seaf->block_mgr->backend->prefetch) {
+        seaf_message ("Block backend can't prefetch, block prefetch disabled.\n");
+        pf->enabled = FALSE;
+        return 0;
+    }
+
+    pf->priv->pool = g_thread_pool_new (prefetch_thread, pf, pf->n_threads,
+                                        FALSE, &error);
+    if (!pf->priv->pool) {
+        seaf_warning ("Failed to start block prefetch threads: %s.\n",
+                      error->message);
+        g_clear_error (&error);
+        return -1;
+    }
+
+    return 0;
+}
+
+void
+block_prefetcher_add_objects (BlockPrefetcher *pf,
+                              const char *token,
+                              const char *store_id,
+                              char **obj_ids, int n)
+{
+    BlockPrefetcherPriv *priv = pf->priv;
+    PrefetchSession *s;
+    PrefetchJob *job;
+    gint64 now = get_current_time ();
+    int i;
+
+    if (!pf->enabled || !token || n <= 0)
+        return;
+
+    pthread_mutex_lock (&priv->lock);
+
+    sweep_sessions (priv, now);
+
+    s = g_hash_table_lookup (priv->sessions, token);
+    if (!s) {
+        s = g_new0 (PrefetchSession, 1);
+        s->token = g_strdup (token);
+        g_hash_table_insert (priv->sessions, s->token, s);
+    }
+    s->last_active = now;
+
+    for (i = 0; i < n && s->ahead < pf->session_bytes &&
+             s->n_jobs < MAX_SESSION_JOBS; ++i) {
+        job = g_new0 (PrefetchJob, 1);
+        job->session = s;
+        memcpy (job->store_id, store_id, 36);
+        memcpy (job->obj_id, obj_ids[i], 40);
+        ++s->n_jobs;
+        g_thread_pool_push (priv->pool, job, NULL);
+    }
+
+    pthread_mutex_unlock (&priv->lock);
+}
+
+void
+block_prefetcher_blocks_read (BlockPrefetcher *pf,
+                              const char *token,
+                              gint64 bytes)
+{
+    BlockPrefetcherPriv *priv = pf->priv;
+    PrefetchSession *s;
+
+    if (!pf->enabled || !token)
+        return;
+
+    pthread_mutex_lock (&priv->lock);
+    s = g_hash_table_lookup (priv->sessions, token);
+    if (s) {
+        s->ahead = MAX (s->ahead - bytes, 0);
+        s->last_active = get_current_time ();
+    }
+    pthread_mutex_unlock (&priv->lock);
+}
@@ -0,0 +1,59 @@
+#ifndef BLOCK_PREFETCH_H
+#define BLOCK_PREFETCH_H
+
+#include <glib.h>
+
+struct _SeafileSession;
+
+/*
+ * Read-ahead of the blocks a client is about to download. The files in
+ * the fs objects sent to a client are the ones whose blocks it asks for
+ * next, so once they're sent, their blocks are hinted to the block
+ * backend in the background: into the page cache, or into the block
+ * cache if there's one in front of a slower backend.
+ *
+ * Each download session, keyed by its repo token, can only be ahead of
+ * the blocks it has read by so many bytes. Files beyond that are dropped,
+ * hints are never worth waiting for.
+ *
+ * [block prefetch]
+ * enabled = true
+ * threads = 2
+ * # MB read ahead of a session's downloads
+ * session_mb = 64
+ */
+struct BlockPrefetcherPriv;
+
+typedef struct BlockPrefetcher {
+    struct _SeafileSession *seaf;
+
+    gboolean enabled;
+    int n_threads;
+    gint64 session_bytes;
+
+    struct BlockPrefetcherPriv *priv;
+} BlockPrefetcher;
+
+BlockPrefetcher *
+block_prefetcher_new (struct _SeafileSession *session);
+
+int
+block_prefetcher_start (BlockPrefetcher *pf);
+
+/*
+ * Hint the blocks of the files among the fs objects @obj_ids, which were
+ * just sent for the download session @token. Dir objects are skipped.
+ */
+void
+block_prefetcher_add_objects (BlockPrefetcher *pf,
+                              const char *token,
+                              const char *store_id,
+                              char **obj_ids, int n);
+
+/* @token read @bytes of blocks, which may have been hinted. */
+void
+block_prefetcher_blocks_read (BlockPrefetcher *pf,
+                              const char *token,
+                              gint64 bytes);
+
+#endif
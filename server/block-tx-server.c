@@ -4,14 +4,13 @@
 
 #include "net.h"
 
-#ifndef WIN32
-#include <sys/select.h>
-#endif
+#include <pthread.h>
+
+#include <event2/event.h>
 #include <event2/buffer.h>
 #include <event2/util.h>
 
 #include <ccnet.h>
-#include <ccnet/job-mgr.h>
 
 #include "seafile-session.h"
 #include "block-tx-server.h"
@@ -47,6 +46,12 @@ struct _BlockTxServer {
 
     gboolean break_loop;
 
+    /* Version 3: number of the next frame sent. */
+    guint64 send_seq;
+
+    struct TxLoop *loop;
+    struct event *read_ev;
+
     int version;
 
     char store_id[37];
@@ -74,6 +79,19 @@ send_handshake_response (BlockTxServer *server, int status)
     return 0;
 }
 
+/* Prepare @ctx for the next frame sent to the client. */
+static void
+init_send_ctx (BlockTxServer *server, EVP_CIPHER_CTX *ctx)
+{
+    if (server->version == 1)
+        blocktx_encrypt_init (ctx, server->key, server->iv);
+    else if (server->version == 2)
+        blocktx_encrypt_init (ctx, server->key_v2, server->iv_v2);
+    else
+        blocktx_gcm_encrypt_init (ctx, server->key_v2, server->iv_v2,
+                                  BLOCKTX_DIR_TO_CLIENT, server->send_seq++);
+}
+
 static void
 init_frame_parser (BlockTxServer *server)
 {
@@ -82,12 +100,13 @@ init_frame_parser (BlockTxServer *server)
     if (server->version == 1) {
         memcpy (parser->key, server->key, ENC_BLOCK_SIZE);
         memcpy (parser->iv, server->iv, ENC_BLOCK_SIZE);
-    } else if (server->version == 2) {
+    } else {
         memcpy (parser->key_v2, server->key_v2, ENC_KEY_SIZE);
         memcpy (parser->iv_v2, server->iv_v2, ENC_BLOCK_SIZE);
     }
 
     parser->version = server->version;
+    parser->recv_dir = BLOCKTX_DIR_TO_SERVER;
     parser->cbarg = server;
 }
 
@@ -124,7 +143,7 @@ process_session_key (BlockTxServer *server, unsigned char *enc_session_key)
 
     if (server->version == 1)
         blocktx_generate_encrypt_key (session_key, len, server->key, server->iv);
-    else if (server->version == 2)
+    else
         blocktx_generate_encrypt_key (session_key, len, server->key_v2, server->iv_v2);
 
     init_frame_parser (server);
@@ -158,7 +177,7 @@ handle_handshake_request (BlockTxServer *server)
 
         req.version = ntohl (req.version);
         server->version = MIN (req.version, BLOCK_PROTOCOL_VERSION);
-        if (server->version != 1 && server->version != 2) {
+        if (server->version < 1 || server->version > 3) {
             seaf_warning ("Bad block protocol version %d.\n", server->version);
             send_handshake_response (server, STATUS_VERSION_MISMATCH);
             return -1;
@@ -210,12 +229,9 @@ send_auth_response (BlockTxServer *server, int status)
 
     rsp.status = htonl (status);
 
-    if (server->version == 1)
-        blocktx_encrypt_init (&ctx, server->key, server->iv);
-    else if (server->version == 2)
-        blocktx_encrypt_init (&ctx, server->key_v2, server->iv_v2);
+    init_send_ctx (server, &ctx);
 
-    if (send_encrypted_data_frame_begin (server->data_fd, sizeof(rsp)) < 0) {
+    if (send_encrypted_data_frame_begin (&ctx, server->data_fd, sizeof(rsp)) < 0) {
         seaf_warning ("Send auth response: failed to begin.\n");
         ret = -1;
         goto out;
@@ -313,12 +329,9 @@ send_block_response_header (BlockTxServer *server, int status)
 
     header.status = htonl (status);
 
-    if (server->version == 1)
-        blocktx_encrypt_init (&ctx, server->key, server->iv);
-    else if (server->version == 2)
-        blocktx_encrypt_init (&ctx, server->key_v2, server->iv_v2);
+    init_send_ctx (server, &ctx);
 
-    if (send_encrypted_data_frame_begin (server->data_fd, sizeof(header)) < 0) {
+    if (send_encrypted_data_frame_begin (&ctx, server->data_fd, sizeof(header)) < 0) {
         seaf_warning ("Send block response header %s: failed to begin.\n",
                       server->curr_block_id);
         ret = -1;
@@ -436,7 +449,7 @@ handle_block_header (BlockTxServer *server)
 
 /* Block content */
 
-#define SEND_BUFFER_SIZE 4096
+#define SEND_BUFFER_SIZE (64 << 10)
 
 static int
 send_encrypted_block (BlockTxServer *server,
@@ -447,14 +460,11 @@ send_encrypted_block (BlockTxServer *server,
     int n, remain;
     int ret = 0;
     EVP_CIPHER_CTX ctx;
-    char send_buf[SEND_BUFFER_SIZE];
+    char *send_buf = g_malloc (SEND_BUFFER_SIZE);
 
-    if (server->version == 1)
-        blocktx_encrypt_init (&ctx, server->key, server->iv);
-    else if (server->version == 2)
-        blocktx_encrypt_init (&ctx, server->key_v2, server->iv_v2);
+    init_send_ctx (server, &ctx);
 
-    if (send_encrypted_data_frame_begin (server->data_fd, size) < 0) {
+    if (send_encrypted_data_frame_begin (&ctx, server->data_fd, size) < 0) {
         seaf_warning ("Send block %s: failed to begin.\n", block_id);
         ret = -1;
         goto out;
@@ -490,6 +500,7 @@ send_encrypted_block (BlockTxServer *server,
 
 out:
     EVP_CIPHER_CTX_cleanup (&ctx);
+    g_free (send_buf);
     return ret;
 }
 
@@ -568,6 +579,7 @@ static void
 recv_data_cb (BlockTxServer *server)
 {
     int ret = 0;
+    size_t len;
 
     /* Let evbuffer determine how much data can be read. */
     int n = evbuffer_read (server->recv_buf, server->data_fd, -1);
@@ -582,119 +594,292 @@ recv_data_cb (BlockTxServer *server)
         return;
     }
 
-    switch (server->recv_state) {
-    case RECV_STATE_HANDSHAKE:
-        ret = handle_handshake_request (server);
-        break;
-    case RECV_STATE_AUTH:
-        ret = handle_auth_request (server);
-        break;
-    case RECV_STATE_HEADER:
-        ret = handle_block_header (server);
-        if (ret < 0)
+    /*
+     * Clients of version 3 send the next requests before the responses
+     * to the earlier ones arrive, so handle all the frames received, as
+     * long as they make progress.
+     */
+    do {
+        len = evbuffer_get_length (server->recv_buf);
+
+        switch (server->recv_state) {
+        case RECV_STATE_HANDSHAKE:
+            ret = handle_handshake_request (server);
             break;
+        case RECV_STATE_AUTH:
+            ret = handle_auth_request (server);
+            break;
+        case RECV_STATE_HEADER:
+            ret = handle_block_header (server);
+            if (ret < 0)
+                break;
 
-        if (server->recv_state == RECV_STATE_CONTENT &&
-            server->command == REQUEST_COMMAND_PUT)
-            ret = handle_block_content (server);
+            if (server->recv_state == RECV_STATE_CONTENT &&
+                server->command == REQUEST_COMMAND_PUT)
+                ret = handle_block_content (server);
 
-        break;
-    case RECV_STATE_CONTENT:
-        ret = handle_block_content (server);
-        break;
-    }
+            break;
+        case RECV_STATE_CONTENT:
+            ret = handle_block_content (server);
+            break;
+        }
+    } while (ret == 0 && !server->break_loop &&
+             evbuffer_get_length (server->recv_buf) > 0 &&
+             evbuffer_get_length (server->recv_buf) < len);
 
     if (ret < 0)
         server->break_loop = TRUE;
 }
 
+/*
+ * Connections are served by a few event loop threads, each waiting on
+ * many connections. Once a request is readable, the connection leaves
+ * its loop and is handled by one of a bounded pool of workers, since
+ * handling it reads or writes a block and sends the reply with blocking
+ * I/O. The worker hands it back to its loop afterwards.
+ *
+ * A connection is only touched by its loop thread or by one worker at a
+ * time, and is only freed by its loop thread, so it needs no lock. The
+ * events of a loop are only used from that loop's thread too; other
+ * threads queue connections to it through a socket pair.
+ */
+
 #define BLOCKTX_TIMEOUT 30
 
+#define DEFAULT_LOOP_THREADS 4
+#define DEFAULT_WORKER_THREADS 16
+
+typedef struct TxLoop {
+    struct event_base *evbase;
+    evutil_socket_t notify_fds[2];
+    struct event *notify_ev;
+    pthread_t thread;
+} TxLoop;
+
+static TxLoop *loops;
+static int n_loops;
+static guint next_loop;
+static GThreadPool *workers;
+static gint n_conns;
+
+static void
+free_server (BlockTxServer *server)
+{
+    if (server->read_ev)
+        event_free (server->read_ev);
+
+    if (server->block) {
+        seaf_block_manager_close_block (seaf->block_mgr, server->block);
+        seaf_block_manager_block_handle_free (seaf->block_mgr, server->block);
+    }
+
+    if (server->parser.enc_init)
+        EVP_CIPHER_CTX_cleanup (&server->parser.ctx);
+
+    evbuffer_free (server->recv_buf);
+    evutil_closesocket (server->data_fd);
+
+    g_free (server);
+    g_atomic_int_add (&n_conns, -1);
+}
+
+/* Hand @server back to its loop, to be waited on or freed there. */
+static void
+return_to_loop (BlockTxServer *server)
+{
+    if (sendn (server->loop->notify_fds[1], &server, sizeof(server)) < 0) {
+        /* The loop is gone, nothing waits on the connection any more. */
+        seaf_warning ("Failed to notify block tx loop.\n");
+    }
+}
+
+static void
+worker_thread (gpointer data, gpointer user_data)
+{
+    BlockTxServer *server = data;
+
+    recv_data_cb (server);
+
+    return_to_loop (server);
+}
+
+static void
+conn_event_cb (evutil_socket_t fd, short what, void *arg)
+{
+    BlockTxServer *server = arg;
+    GError *error = NULL;
+
+    if (what & EV_TIMEOUT) {
+        seaf_warning ("Recv block timeout.\n");
+        free_server (server);
+        return;
+    }
+
+    g_thread_pool_push (workers, server, &error);
+    if (error) {
+        seaf_warning ("Failed to queue block tx request: %s.\n", error->message);
+        g_clear_error (&error);
+        free_server (server);
+    }
+}
+
 static void
-server_thread_loop (BlockTxServer *server)
+notify_cb (evutil_socket_t fd, short what, void *arg)
 {
-    fd_set fds;
+    TxLoop *loop = arg;
+    BlockTxServer *servers[64];
     struct timeval tv = { BLOCKTX_TIMEOUT, 0 };
-    int rc;
+    int n, i;
 
-    while (1) {
-        FD_ZERO (&fds);
-        FD_SET (server->data_fd, &fds);
-        tv.tv_sec = BLOCKTX_TIMEOUT;
-        tv.tv_usec = 0;
+    /* Pointers are written whole, so they are read whole. */
+    n = recv (fd, (char *)servers, sizeof(servers), 0);
+    if (n <= 0)
+        return;
 
-        rc = select (server->data_fd + 1, &fds, NULL, NULL, &tv);
-        if (rc < 0 && errno == EINTR) {
-            continue;
-        } else if (rc < 0) {
-            seaf_warning ("select error: %s.\n", strerror(errno));
-            break;
-        }
+    for (i = 0; i < n / (int)sizeof(BlockTxServer *); ++i) {
+        BlockTxServer *server = servers[i];
 
-        if (rc == 0) {
-            seaf_warning ("Recv block timeout.\n");
-            break;
+        if (server->break_loop) {
+            free_server (server);
+            continue;
         }
 
-        if (FD_ISSET (server->data_fd, &fds)) {
-            recv_data_cb (server);
-            if (server->break_loop)
-                break;
-        }
+        if (!server->read_ev)
+            server->read_ev = event_new (loop->evbase, server->data_fd,
+                                         EV_READ, conn_event_cb, server);
+        event_add (server->read_ev, &tv);
     }
 }
 
 static void *
-block_tx_server_thread (void *vdata)
+loop_thread (void *vloop)
 {
-    BlockTxServer *server = vdata;
+    TxLoop *loop = vloop;
 
-    server->recv_buf = evbuffer_new ();
+    event_base_dispatch (loop->evbase);
+    seaf_warning ("Block tx loop exited.\n");
 
-    server_thread_loop (server);
+    return NULL;
+}
 
-    if (server->block) {
-        seaf_block_manager_close_block (seaf->block_mgr, server->block);
-        seaf_block_manager_block_handle_free (seaf->block_mgr, server->block);
+static int
+start_loop (TxLoop *loop)
+{
+#ifndef WIN32
+    int family = AF_UNIX;
+#else
+    int family = AF_INET;
+#endif
+
+    loop->evbase = event_base_new ();
+    if (!loop->evbase)
+        return -1;
+
+    if (evutil_socketpair (family, SOCK_STREAM, 0, loop->notify_fds) < 0) {
+        seaf_warning ("Failed to create block tx notify socket.\n");
+        return -1;
     }
 
-    if (server->parser.enc_init)
-        EVP_CIPHER_CTX_cleanup (&server->parser.ctx);
+    loop->notify_ev = event_new (loop->evbase, loop->notify_fds[0],
+                                 EV_READ | EV_PERSIST, notify_cb, loop);
+    event_add (loop->notify_ev, NULL);
 
-    evbuffer_free (server->recv_buf);
-    evutil_closesocket (server->data_fd);
+    if (pthread_create (&loop->thread, NULL, loop_thread, loop) != 0) {
+        seaf_warning ("Failed to start block tx loop thread.\n");
+        return -1;
+    }
 
-    return vdata;
+    return 0;
 }
 
-static void
-block_tx_server_thread_done (void *vdata)
+/* Called from the main thread only, when the first connection comes. */
+static int
+init_block_tx_loops ()
 {
-    BlockTxServer *server = vdata;
+    GError *error = NULL;
+    int n_workers, i;
+
+    /*
+     * [network]
+     * block_tx_loop_threads = 4
+     * block_tx_worker_threads = 16
+     */
+    n_loops = g_key_file_get_integer (seaf->config, "network",
+                                      "block_tx_loop_threads", &error);
+    if (error || n_loops <= 0) {
+        n_loops = DEFAULT_LOOP_THREADS;
+        g_clear_error (&error);
+    }
 
-    g_free (server);
+    n_workers = g_key_file_get_integer (seaf->config, "network",
+                                        "block_tx_worker_threads", &error);
+    if (error || n_workers <= 0) {
+        n_workers = DEFAULT_WORKER_THREADS;
+        g_clear_error (&error);
+    }
+
+    workers = g_thread_pool_new (worker_thread, NULL, n_workers, FALSE, &error);
+    if (error) {
+        seaf_warning ("Failed to start block tx workers: %s.\n", error->message);
+        g_clear_error (&error);
+        return -1;
+    }
+
+    loops = g_new0 (TxLoop, n_loops);
+    for (i = 0; i < n_loops; ++i) {
+        if (start_loop (&loops[i]) < 0) {
+            /* Use the loops already running. */
+            n_loops = i;
+            break;
+        }
+    }
+
+    return n_loops > 0 ? 0 : -1;
 }
 
 int
 block_tx_server_start (evutil_socket_t data_fd)
 {
-    BlockTxServer *server = g_new0 (BlockTxServer, 1);
-    int ret = 0;
+    static gboolean inited = FALSE;
+    BlockTxServer *server;
+
+    if (!inited) {
+        if (init_block_tx_loops () < 0) {
+            seaf_warning ("Failed to start block tx loops.\n");
+            return -1;
+        }
+        inited = TRUE;
+    }
 
     int val = 1;
     ev_socklen_t optlen = sizeof(int);
     setsockopt (data_fd, IPPROTO_TCP, TCP_NODELAY, (char *)&val, optlen);
 
+    server = g_new0 (BlockTxServer, 1);
     server->data_fd = data_fd;
+    server->recv_buf = evbuffer_new ();
+    server->loop = &loops[next_loop++ % n_loops];
 
-    ret = ccnet_job_manager_schedule_job (seaf->job_mgr,
-                                          block_tx_server_thread,
-                                          block_tx_server_thread_done,
-                                          server);
-    if (ret < 0) {
-        seaf_warning ("Failed to start block tx server thread.\n");
+    if (sendn (server->loop->notify_fds[1], &server, sizeof(server)) < 0) {
+        seaf_warning ("Failed to start block tx server.\n");
+        evbuffer_free (server->recv_buf);
+        g_free (server);
         return -1;
     }
+    g_atomic_int_inc (&n_conns);
 
     return 0;
 }
+
+void
+block_tx_server_get_stats (BlockTxServerStats *stats)
+{
+    stats->n_conns = g_atomic_int_get (&n_conns);
+    if (workers) {
+        stats->n_queued = g_thread_pool_unprocessed (workers);
+        stats->n_threads = g_thread_pool_get_num_threads (workers);
+    } else {
+        stats->n_queued = 0;
+        stats->n_threads = 0;
+    }
+}
@@ -6,4 +6,13 @@
 int
 block_tx_server_start (evutil_socket_t data_fd);
 
+typedef struct BlockTxServerStats {
+    int n_conns;                /* open block tx connections */
+    int n_queued;               /* requests waiting for a worker */
+    int n_threads;              /* workers busy */
+} BlockTxServerStats;
+
+void
+block_tx_server_get_stats (BlockTxServerStats *stats);
+
 #endif
@@ -0,0 +1,263 @@
+/* -*- Mode: C; tab-width: 4; indent-tabs-mode: nil; c-basic-offset: 4 -*- */
+
+#include "common.h"
+
+#include <pthread.h>
+
+#include "seafile-session.h"
+#include "cache-warmer.h"
+#include "log.h"
+
+#define DEFAULT_SNAPSHOT_INTERVAL 600
+#define DEFAULT_MAX_KEYS 20000
+#define DEFAULT_RATE 200
+
+/*
+ * Snapshot file. Text, one object per line: its type, 'c' for a commit,
+ * 'd' for a dir or 'f' for a file, a space and its cache key
+ * "<store_id>/<obj_id>". The first line is SNAPSHOT_MAGIC. Objects are
+ * loaded back in file order, so the ones everything else depends on,
+ * and the most recently used of each type, come first.
+ */
+#define SNAPSHOT_MAGIC "SCW1"
+
+typedef struct CacheWarmerPriv {
+    char *path;
+    /* Snapshots are written from the warmer thread and on shutdown. */
+    pthread_mutex_t save_lock;
+} CacheWarmerPriv;
+
+static int
+get_config_int (GKeyFile *config, const char *key, int def)
+{
+    GError *error = NULL;
+    int v;
+
+    v = g_key_file_get_integer (config, "cache warmer", key, &error);
+    if (error) {
+        g_clear_error (&error);
+        return def;
+    }
+    return v;
+}
+
+CacheWarmer *
+cache_warmer_new (SeafileSession *session)
+{
+    CacheWarmer *warmer = g_new0 (CacheWarmer, 1);
+    CacheWarmerPriv *priv = g_new0 (CacheWarmerPriv, 1);
+    GKeyFile *config = session->config;
+
+    warmer->seaf = session;
+    warmer->priv = priv;
+
+    warmer->enabled = g_key_file_get_boolean (config, "cache warmer",
+                                              "enabled", NULL);
+    warmer->snapshot_interval = get_config_int (config, "snapshot_interval",
+                                                DEFAULT_SNAPSHOT_INTERVAL);
+    warmer->max_keys = get_config_int (config, "max_keys", DEFAULT_MAX_KEYS);
+    if (warmer->max_keys <= 0)
+        warmer->max_keys = DEFAULT_MAX_KEYS;
+    warmer->rate = get_config_int (config, "rate", DEFAULT_RATE);
+    if (warmer->rate <= 0)
+        warmer->rate = DEFAULT_RATE;
+
+    priv->path = g_build_filename (session->seaf_dir, "cache-snapshot", NULL);
+    pthread_mutex_init (&priv->save_lock, NULL);
+
+    return warmer;
+}
+
+static void
+add_keys (GString *buf, char type, GPtrArray *keys)
+{
+    guint i;
+
+    if (!keys)
+        return;
+
+    for (i = 0; i < keys->len; ++i)
+        g_string_append_printf (buf, "%c %s\n", type,
+                                (char *)g_ptr_array_index (keys, i));
+    g_ptr_array_free (keys, TRUE);
+}
+
+int
+cache_warmer_save_snapshot (CacheWarmer *warmer)
+{
+    CacheWarmerPriv *priv = warmer->priv;
+    SeafileSession *session = warmer->seaf;
+    GString *buf;
+    GError *error = NULL;
+    int ret = 0;
+
+    if (!warmer->enabled || session->sync_worker)
+        return 0;
+
+    buf = g_string_new (SNAPSHOT_MAGIC "\n");
+    add_keys (buf, 'c', seaf_commit_manager_get_hot_keys (session->commit_mgr,
+                                                          warmer->max_keys));
+    add_keys (buf, 'd', seaf_fs_manager_get_hot_keys (session->fs_mgr,
+                                                      SEAF_METADATA_TYPE_DIR,
+                                                      warmer->max_keys));
+    add_keys (buf, 'f', seaf_fs_manager_get_hot_keys (session->fs_mgr,
+                                                      SEAF_METADATA_TYPE_FILE,
+                                                      warmer->max_keys));
+
+    pthread_mutex_lock (&priv->save_lock);
+    if (!g_file_set_contents (priv->path, buf->str, buf->len, &error)) {
+        seaf_warning ("Failed to save cache snapshot %s: %s.\n",
+                      priv->path, error->message);
+        g_clear_error (&error);
+        ret = -1;
+    }
+    pthread_mutex_unlock (&priv->save_lock);
+
+    g_string_free (buf, TRUE);
+    return ret;
+}
+
+/* Parse "<store_id>/<obj_id>" in @key, which is modified. */
+static gboolean
+parse_key (char *key, char **store_id, char **obj_id)
+{
+    unsigned char sha1[20];
+
+    if (strlen (key) != 36 + 1 + 40 || key[36] != '/')
+        return FALSE;
+
+    key[36] = '\0';
+    *store_id = key;
+    *obj_id = key + 37;
+
+    /* Ids end up in storage paths, only accept hex. */
+    return (is_uuid_valid (*store_id) && hex_to_sha1 (*obj_id, sha1) == 0);
+}
+
+/* Load one object into its cache. Returns TRUE if it's there now. */
+static gboolean
+warm_object (SeafileSession *session, char type,
+             const char *store_id, const char *obj_id)
+{
+    SeafCommit *commit;
+    SeafDir *dir;
+    Seafile *file;
+
+    /* Objects may have been removed by GC since the snapshot. */
+    switch (type) {
+    case 'c':
+        if (!seaf_commit_manager_commit_exists (session->commit_mgr,
+                                                store_id, 1, obj_id))
+            return FALSE;
+        commit = seaf_commit_manager_get_commit (session->commit_mgr,
+                                                 store_id, 1, obj_id);
+        if (!commit)
+            return FALSE;
+        seaf_commit_unref (commit);
+        return TRUE;
+    case 'd':
+        if (!seaf_fs_manager_object_exists (session->fs_mgr,
+                                            store_id, 1, obj_id))
+            return FALSE;
+        dir = seaf_fs_manager_get_seafdir (session->fs_mgr,
+                                           store_id, 1, obj_id);
+        if (!dir)
+            return FALSE;
+        seaf_dir_free (dir);
+        return TRUE;
+    case 'f':
+        if (!seaf_fs_manager_object_exists (session->fs_mgr,
+                                            store_id, 1, obj_id))
+            return FALSE;
+        file = seaf_fs_manager_get_seafile (session->fs_mgr,
+                                            store_id, 1, obj_id);
+        if (!file)
+            return FALSE;
+        seafile_unref (file);
+        return TRUE;
+    default:
+        return FALSE;
+    }
+}
+
+static void
+warm_caches (CacheWarmer *warmer)
+{
+    char *contents = NULL;
+    char **lines = NULL;
+    char *store_id, *obj_id;
+    gint64 start = get_current_time ();
+    gulong pause = G_USEC_PER_SEC / warmer->rate;
+    int i, n_lines = 0, n_warmed = 0;
+
+    if (!g_file_get_contents (warmer->priv->path, &contents, NULL, NULL))
+        return;
+
+    lines = g_strsplit (contents, "\n", -1);
+    g_free (contents);
+
+    if (!lines[0] || strcmp (lines[0], SNAPSHOT_MAGIC) != 0) {
+        seaf_warning ("Unknown cache snapshot %s, ignored.\n",
+                      warmer->priv->path);
+        goto out;
+    }
+
+    for (i = 1; lines[i] != NULL; ++i) {
+        if (strlen (lines[i]) < 2 || lines[i][1] != ' ' ||
+            !parse_key (lines[i] + 2, &store_id, &obj_id))
+            continue;
+
+        ++n_lines;
+        if (warm_object (warmer->seaf, lines[i][0], store_id, obj_id))
+            ++n_warmed;
+        g_usleep (pause);
+    }
+
+    seaf_message ("Loaded %d of %d objects of the cache snapshot in %"
+                  G_GINT64_FORMAT "s.\n", n_warmed, n_lines,
+                  (get_current_time () - start) / G_USEC_PER_SEC);
+
+out:
+    g_strfreev (lines);
+}
+
+static void *
+warmer_thread (void *vdata)
+{
+    CacheWarmer *warmer = vdata;
+
+    warm_caches (warmer);
+
+    if (warmer->seaf->sync_worker || warmer->snapshot_interval <= 0)
+        return NULL;
+
+    while (1) {
+        g_usleep ((gulong)warmer->snapshot_interval * G_USEC_PER_SEC);
+        cache_warmer_save_snapshot (warmer);
+    }
+
+    return NULL;
+}
+
+int
+cache_warmer_start (CacheWarmer *warmer)
+{
+    pthread_attr_t attr;
+    pthread_t tid;
+    int rc;
+
+    if (!warmer->enabled)
+        return 0;
+
+    pthread_attr_init (&attr);
+    pthread_attr_setdetachstate (&attr, PTHREAD_CREATE_DETACHED);
+    rc = pthread_create (&tid, &attr, warmer_thread, warmer);
+    pthread_attr_destroy (&attr);
+    if (rc != 0) {
+        seaf_warning ("Failed to start cache warmer thread: %s.\n",
+                      strerror (rc));
+        return -1;
+    }
+
+    return 0;
+}
@@ -0,0 +1,49 @@
+#ifndef CACHE_WARMER_H
+#define CACHE_WARMER_H
+
+#include <glib.h>
+
+struct _SeafileSession;
+
+/*
+ * Keeps the object caches warm across restarts. The keys of the most
+ * recently used commits, dirs and files in the caches are saved in
+ * "<seafile dir>/cache-snapshot", every so often and on shutdown. After
+ * a restart, a background thread loads those objects back into the
+ * caches, at a limited rate so it doesn't compete with requests.
+ *
+ * Only content-addressed objects are saved, never tokens or other
+ * secrets. The caches of repos, permissions and tokens expire in seconds
+ * anyway. Sync workers warm up from the snapshot of the master, but
+ * don't write it.
+ *
+ * [cache warmer]
+ * enabled = false
+ * snapshot_interval = 600   # seconds between snapshots, 0 for shutdown only
+ * max_keys = 20000          # per cache
+ * rate = 200                # objects loaded per second
+ */
+struct CacheWarmerPriv;
+
+typedef struct CacheWarmer {
+    struct _SeafileSession *seaf;
+
+    gboolean enabled;
+    int snapshot_interval;
+    int max_keys;
+    int rate;
+
+    struct CacheWarmerPriv *priv;
+} CacheWarmer;
+
+CacheWarmer *
+cache_warmer_new (struct _SeafileSession *session);
+
+int
+cache_warmer_start (CacheWarmer *warmer);
+
+/* Save the keys in the caches now. Returns 0 on success. */
+int
+cache_warmer_save_snapshot (CacheWarmer *warmer);
+
+#endif
@@ -0,0 +1,330 @@
+/* -*- Mode: C; tab-width: 4; indent-tabs-mode: nil; c-basic-offset: 4 -*- */
+
+#include "common.h"
+
+#include <pthread.h>
+#include <curl/curl.h>
+
+#include "seafile-session.h"
+#include "cluster-mgr.h"
+#include "log.h"
+
+/* Points of each node on the ring, to even out the share of repos. */
+#define POINTS_PER_NODE 160
+
+#define FORWARD_CONNECT_TIMEOUT 5L
+/* Merges on the owner can take a while. */
+#define FORWARD_TIMEOUT 300L
+
+typedef struct RingPoint {
+    guint32 hash;
+    ClusterNode *node;
+} RingPoint;
+
+typedef struct SeafClusterManagerPriv {
+    GList *nodes;
+    /* Sorted by hash. Never changed after startup. */
+    RingPoint *ring;
+    int n_points;
+
+    pthread_mutex_t stats_lock;
+    gint64 n_forwarded;
+    gint64 n_forward_errors;
+} SeafClusterManagerPriv;
+
+static pthread_once_t curl_init_once = PTHREAD_ONCE_INIT;
+
+static void
+init_curl (void)
+{
+    curl_global_init (CURL_GLOBAL_ALL);
+}
+
+static guint32
+ring_hash (const char *key)
+{
+    GChecksum *checksum = g_checksum_new (G_CHECKSUM_MD5);
+    guint8 digest[16];
+    gsize len = sizeof(digest);
+
+    g_checksum_update (checksum, (const guchar *)key, strlen(key));
+    g_checksum_get_digest (checksum, digest, &len);
+    g_checksum_free (checksum);
+
+    return ((guint32)digest[0] << 24) | ((guint32)digest[1] << 16) |
+        ((guint32)digest[2] << 8) | (guint32)digest[3];
+}
+
+static int
+compare_points (const void *a, const void *b)
+{
+    const RingPoint *pa = a, *pb = b;
+
+    if (pa->hash != pb->hash)
+        return pa->hash < pb->hash ? -1 : 1;
+    /* Same order on every node, even on collisions. */
+    return strcmp (pa->node->id, pb->node->id);
+}
+
+static void
+build_ring (SeafClusterManagerPriv *priv)
+{
+    ClusterNode *node;
+    GList *ptr;
+    char key[512];
+    int i, n = 0;
+
+    priv->n_points = g_list_length (priv->nodes) * POINTS_PER_NODE;
+    priv->ring = g_new0 (RingPoint, priv->n_points);
+
+    for (ptr = priv->nodes; ptr; ptr = ptr->next) {
+        node = ptr->data;
+        for (i = 0; i < POINTS_PER_NODE; ++i) {
+            snprintf (key, sizeof(key), "%s#%d", node->id, i);
+            priv->ring[n].hash = ring_hash (key);
+            priv->ring[n].node = node;
+            ++n;
+        }
+    }
+
+    qsort (priv->ring, priv->n_points, sizeof(RingPoint), compare_points);
+}
+
+static ClusterNode *
+parse_node (const char *str)
+{
+    ClusterNode *node;
+    char **pieces = g_strsplit (str, "=", 2);
+    char *url;
+
+    if (g_strv_length (pieces) != 2 || *g_strstrip(pieces[0]) == '\0') {
+        g_strfreev (pieces);
+        return NULL;
+    }
+
+    url = g_strstrip (pieces[1]);
+    if (!g_str_has_prefix (url, "http://") && !g_str_has_prefix (url, "https://")) {
+        g_strfreev (pieces);
+        return NULL;
+    }
+
+    node = g_new0 (ClusterNode, 1);
+    node->id = g_strdup (pieces[0]);
+    /* Request paths are appended to it. */
+    node->url = g_strdup (url);
+    if (g_str_has_suffix (node->url, "/"))
+        node->url[strlen(node->url) - 1] = '\0';
+
+    g_strfreev (pieces);
+    return node;
+}
+
+static int
+load_nodes (SeafClusterManager *mgr, GKeyFile *config)
+{
+    SeafClusterManagerPriv *priv = mgr->priv;
+    char *self_id = NULL;
+    char **nodes = NULL;
+    ClusterNode *node;
+    gsize n_nodes, i;
+    GList *ptr;
+    int ret = -1;
+
+    self_id = g_key_file_get_string (config, "cluster", "node_id", NULL);
+    if (!self_id) {
+        seaf_warning ("[cluster] node_id is not set.\n");
+        goto out;
+    }
+    g_strstrip (self_id);
+
+    nodes = g_key_file_get_string_list (config, "cluster", "nodes",
+                                        &n_nodes, NULL);
+    if (!nodes || n_nodes == 0) {
+        seaf_warning ("[cluster] nodes is not set.\n");
+        goto out;
+    }
+
+    for (i = 0; i < n_nodes; ++i) {
+        node = parse_node (nodes[i]);
+        if (!node) {
+            seaf_warning ("[cluster] Invalid node %s, should be id=url.\n",
+                          nodes[i]);
+            goto out;
+        }
+        for (ptr = priv->nodes; ptr; ptr = ptr->next) {
+            if (strcmp (((ClusterNode *)ptr->data)->id, node->id) == 0) {
+                seaf_warning ("[cluster] Node %s is listed twice.\n", node->id);
+                g_free (node->id);
+                g_free (node->url);
+                g_free (node);
+                goto out;
+            }
+        }
+        priv->nodes = g_list_append (priv->nodes, node);
+        if (strcmp (node->id, self_id) == 0)
+            mgr->self = node;
+    }
+
+    if (!mgr->self) {
+        seaf_warning ("[cluster] This node %s is not in the nodes list.\n",
+                      self_id);
+        goto out;
+    }
+
+    ret = 0;
+
+out:
+    g_free (self_id);
+    g_strfreev (nodes);
+    return ret;
+}
+
+SeafClusterManager *
+seaf_cluster_manager_new (SeafileSession *session)
+{
+    SeafClusterManager *mgr = g_new0 (SeafClusterManager, 1);
+    SeafClusterManagerPriv *priv = g_new0 (SeafClusterManagerPriv, 1);
+
+    mgr->seaf = session;
+    mgr->priv = priv;
+    pthread_mutex_init (&priv->stats_lock, NULL);
+
+    mgr->enabled = g_key_file_get_boolean (session->config, "cluster",
+                                           "enabled", NULL);
+    if (!mgr->enabled)
+        return mgr;
+
+    if (load_nodes (mgr, session->config) < 0)
+        return NULL;
+
+    build_ring (priv);
+
+    pthread_once (&curl_init_once, init_curl);
+
+    seaf_message ("[cluster] Node %s of %u.\n", mgr->self->id,
+                  g_list_length (priv->nodes));
+
+    return mgr;
+}
+
+const ClusterNode *
+seaf_cluster_manager_get_repo_node (SeafClusterManager *mgr,
+                                    const char *repo_id)
+{
+    SeafClusterManagerPriv *priv = mgr->priv;
+    guint32 hash;
+    int lo, hi, mid;
+
+    if (!mgr->enabled)
+        return NULL;
+
+    hash = ring_hash (repo_id);
+
+    /* The first point at or after the hash, wrapping around. */
+    lo = 0;
+    hi = priv->n_points;
+    while (lo < hi) {
+        mid = lo + (hi - lo) / 2;
+        if (priv->ring[mid].hash < hash)
+            lo = mid + 1;
+        else
+            hi = mid;
+    }
+    if (lo == priv->n_points)
+        lo = 0;
+
+    return priv->ring[lo].node;
+}
+
+gboolean
+seaf_cluster_manager_is_local_repo (SeafClusterManager *mgr,
+                                    const char *repo_id)
+{
+    const ClusterNode *node = seaf_cluster_manager_get_repo_node (mgr, repo_id);
+
+    return !node || node == mgr->self;
+}
+
+static size_t
+discard_body (char *ptr, size_t size, size_t nmemb, void *userdata)
+{
+    return size * nmemb;
+}
+
+int
+seaf_cluster_manager_forward_branch_update (SeafClusterManager *mgr,
+                                            const ClusterNode *node,
+                                            const char *repo_id,
+                                            const char *token,
+                                            const char *new_commit_id)
+{
+    SeafClusterManagerPriv *priv = mgr->priv;
+    CURL *curl;
+    struct curl_slist *headers = NULL;
+    char *url = NULL, *header;
+    CURLcode rc;
+    long status = 0;
+    int ret = -1;
+
+    curl = curl_easy_init ();
+    if (!curl) {
+        seaf_warning ("[cluster] Failed to init curl.\n");
+        goto out;
+    }
+
+    url = g_strdup_printf ("%s/repo/%s/commit/HEAD?head=%s",
+                           node->url, repo_id, new_commit_id);
+
+    header = g_strdup_printf ("Seafile-Repo-Token: %s", token);
+    headers = curl_slist_append (headers, header);
+    g_free (header);
+    header = g_strdup_printf (CLUSTER_FORWARDED_HEADER": %s", mgr->self->id);
+    headers = curl_slist_append (headers, header);
+    g_free (header);
+
+    curl_easy_setopt (curl, CURLOPT_URL, url);
+    curl_easy_setopt (curl, CURLOPT_CUSTOMREQUEST, "PUT");
+    curl_easy_setopt (curl, CURLOPT_HTTPHEADER, headers);
+    curl_easy_setopt (curl, CURLOPT_NOSIGNAL, 1L);
+    curl_easy_setopt (curl, CURLOPT_CONNECTTIMEOUT, FORWARD_CONNECT_TIMEOUT);
+    curl_easy_setopt (curl, CURLOPT_TIMEOUT, FORWARD_TIMEOUT);
+    curl_easy_setopt (curl, CURLOPT_WRITEFUNCTION, discard_body);
+
+    rc = curl_easy_perform (curl);
+    if (rc != CURLE_OK) {
+        seaf_warning ("[cluster] Failed to forward branch update of repo %.8s "
+                      "to node %s: %s.\n",
+                      repo_id, node->id, curl_easy_strerror (rc));
+        goto out;
+    }
+
+    curl_easy_getinfo (curl, CURLINFO_RESPONSE_CODE, &status);
+    ret = (int)status;
+
+out:
+    pthread_mutex_lock (&priv->stats_lock);
+    if (ret > 0)
+        ++priv->n_forwarded;
+    else
+        ++priv->n_forward_errors;
+    pthread_mutex_unlock (&priv->stats_lock);
+
+    if (curl)
+        curl_easy_cleanup (curl);
+    curl_slist_free_all (headers);
+    g_free (url);
+    return ret;
+}
+
+void
+seaf_cluster_manager_get_stats (SeafClusterManager *mgr, ClusterStats *stats)
+{
+    SeafClusterManagerPriv *priv = mgr->priv;
+
+    stats->n_nodes = g_list_length (priv->nodes);
+
+    pthread_mutex_lock (&priv->stats_lock);
+    stats->n_forwarded = priv->n_forwarded;
+    stats->n_forward_errors = priv->n_forward_errors;
+    pthread_mutex_unlock (&priv->stats_lock);
+}
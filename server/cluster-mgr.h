@@ -0,0 +1,77 @@
+#ifndef CLUSTER_MGR_H
+#define CLUSTER_MGR_H
+
+#include <glib.h>
+
+struct _SeafileSession;
+
+/*
+ * Cluster mode: several seaf-server nodes share the DB and the object
+ * storage, and each repo is owned by one of them, chosen by consistent
+ * hashing of the repo id. Any node can serve the sync requests of a
+ * repo, but branch updates are forwarded to its owner, so that pushes
+ * to a repo are serialized by the owner's per-repo lock instead of
+ * racing on the branch CAS of several nodes.
+ *
+ * [cluster]
+ * enabled = true
+ * node_id = node1
+ * # Fileserver URL of every node, the same list on all of them.
+ * nodes = node1=http://10.0.0.1:8082;node2=http://10.0.0.2:8082
+ */
+
+/* Set on forwarded requests, which are never forwarded again. */
+#define CLUSTER_FORWARDED_HEADER "Seafile-Cluster-Forwarded"
+
+typedef struct ClusterNode {
+    char *id;
+    char *url;
+} ClusterNode;
+
+struct SeafClusterManagerPriv;
+
+typedef struct SeafClusterManager {
+    struct _SeafileSession *seaf;
+
+    gboolean enabled;
+    ClusterNode *self;
+
+    struct SeafClusterManagerPriv *priv;
+} SeafClusterManager;
+
+/* Returns NULL if the cluster config is invalid. */
+SeafClusterManager *
+seaf_cluster_manager_new (struct _SeafileSession *session);
+
+/* The owner of @repo_id, or NULL if cluster mode is disabled. */
+const ClusterNode *
+seaf_cluster_manager_get_repo_node (SeafClusterManager *mgr,
+                                    const char *repo_id);
+
+/* Whether @repo_id is owned by this node. TRUE if cluster mode is disabled. */
+gboolean
+seaf_cluster_manager_is_local_repo (SeafClusterManager *mgr,
+                                    const char *repo_id);
+
+/*
+ * Send the branch update of @repo_id to @node, with the client's sync
+ * @token. Returns the HTTP status of the owner, or -1 if it couldn't
+ * be reached.
+ */
+int
+seaf_cluster_manager_forward_branch_update (SeafClusterManager *mgr,
+                                            const ClusterNode *node,
+                                            const char *repo_id,
+                                            const char *token,
+                                            const char *new_commit_id);
+
+typedef struct ClusterStats {
+    int n_nodes;
+    gint64 n_forwarded;
+    gint64 n_forward_errors;    /* owner unreachable, updated locally */
+} ClusterStats;
+
+void
+seaf_cluster_manager_get_stats (SeafClusterManager *mgr, ClusterStats *stats);
+
+#endif
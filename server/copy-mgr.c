@@ -16,11 +16,27 @@
 #include "log.h"
 
 #define DEFAULT_MAX_THREADS 50
+#define DEFAULT_BLOCK_COPY_THREADS 4
+#define DEFAULT_MAX_BLOCK_COPIES 32
+/* Blocks queued ahead of the copying threads. */
+#define MAX_QUEUED_BLOCKS 1024
 
 struct _SeafCopyManagerPriv {
     GHashTable *copy_tasks;
     pthread_mutex_t lock;
     CcnetJobManager *job_mgr;
+
+    /* Tasks waiting for a job thread, queued by modifier. The next job
+     * takes a task of the user at the head of @users, so that one user's
+     * batch of copies doesn't hold up everyone else's.
+     */
+    GHashTable *pending;
+    GQueue *users;
+
+    int block_copy_threads;
+    /* Slots for blocks being copied by all tasks. */
+    int free_block_copies;
+    pthread_cond_t block_copy_cond;
 };
 
 static void
@@ -42,6 +58,23 @@ seaf_copy_manager_new (struct _SeafileSession *session)
                                                    g_free,
                                                    (GDestroyNotify)copy_task_free);
     pthread_mutex_init (&mgr->priv->lock, NULL);
+    mgr->priv->pending = g_hash_table_new_full (g_str_hash, g_str_equal,
+                                                g_free, NULL);
+    mgr->priv->users = g_queue_new ();
+    pthread_cond_init (&mgr->priv->block_copy_cond, NULL);
+
+    mgr->priv->block_copy_threads = g_key_file_get_integer (session->config,
+                                                            "web_copy",
+                                                            "block_copy_threads",
+                                                            NULL);
+    if (mgr->priv->block_copy_threads <= 0)
+        mgr->priv->block_copy_threads = DEFAULT_BLOCK_COPY_THREADS;
+    mgr->priv->free_block_copies = g_key_file_get_integer (session->config,
+                                                           "web_copy",
+                                                           "max_block_copies",
+                                                           NULL);
+    if (mgr->priv->free_block_copies <= 0)
+        mgr->priv->free_block_copies = DEFAULT_MAX_BLOCK_COPIES;
 
     mgr->max_files = g_key_file_get_int64 (session->config,
                                            "web_copy", "max_files", NULL);
@@ -75,6 +108,8 @@ seaf_copy_manager_get_task (SeafCopyManager *mgr,
     if (task) {
         t = seafile_copy_task_new ();
         g_object_set (t, "done", task->done, "total", task->total,
+                      "done_bytes", task->done_bytes,
+                      "total_bytes", task->total_bytes,
                       "canceled", task->canceled, "failed", task->failed,
                       "successful", task->successful,
                       NULL);
@@ -99,16 +134,70 @@ struct CopyThreadData {
 };
 typedef struct CopyThreadData CopyThreadData;
 
+static void
+queue_task (SeafCopyManagerPriv *priv, CopyThreadData *data)
+{
+    const char *user = data->modifier ? data->modifier : "";
+    GQueue *tasks;
+
+    pthread_mutex_lock (&priv->lock);
+
+    tasks = g_hash_table_lookup (priv->pending, user);
+    if (!tasks) {
+        tasks = g_queue_new ();
+        g_hash_table_insert (priv->pending, g_strdup(user), tasks);
+        g_queue_push_tail (priv->users, g_strdup(user));
+    }
+    g_queue_push_tail (tasks, data);
+
+    pthread_mutex_unlock (&priv->lock);
+}
+
+/* Take the oldest task of the next user in turn. */
+static CopyThreadData *
+next_task (SeafCopyManagerPriv *priv)
+{
+    CopyThreadData *data = NULL;
+    GQueue *tasks;
+    char *user;
+
+    pthread_mutex_lock (&priv->lock);
+
+    user = g_queue_pop_head (priv->users);
+    if (!user)
+        goto out;
+
+    tasks = g_hash_table_lookup (priv->pending, user);
+    data = g_queue_pop_head (tasks);
+    if (g_queue_is_empty (tasks)) {
+        g_hash_table_remove (priv->pending, user);
+        g_queue_free (tasks);
+        g_free (user);
+    } else {
+        g_queue_push_tail (priv->users, user);
+    }
+
+out:
+    pthread_mutex_unlock (&priv->lock);
+    return data;
+}
+
+/* Each job runs whichever task is next, not the one it was scheduled for. */
 static void *
-copy_thread (void *vdata)
+copy_thread (void *vmgr)
 {
-    CopyThreadData *data = vdata;
+    SeafCopyManager *mgr = vmgr;
+    CopyThreadData *data;
+
+    data = next_task (mgr->priv);
+    if (!data)
+        return NULL;
 
     data->func (data->src_repo_id, data->src_path, data->src_filename,
                 data->dst_repo_id, data->dst_path, data->dst_filename,
                 data->modifier, data->task);
 
-    return vdata;
+    return data;
 }
 
 static void
@@ -116,6 +205,9 @@ copy_done (void *vdata)
 {
     CopyThreadData *data = vdata;
 
+    if (!data)
+        return;
+
     g_free (data->src_path);
     g_free (data->src_filename);
     g_free (data->dst_path);
@@ -134,6 +226,7 @@ seaf_copy_manager_add_task (SeafCopyManager *mgr,
                             const char *dst_filename,
                             const char *modifier,
                             gint64 total_files,
+                            gint64 total_bytes,
                             CopyTaskFunc function,
                             gboolean need_progress)
 {
@@ -147,6 +240,7 @@ seaf_copy_manager_add_task (SeafCopyManager *mgr,
         task = g_new0 (CopyTask, 1);
         memcpy (task->task_id, task_id, 36);
         task->total = total_files;
+        task->total_bytes = total_bytes;
 
         pthread_mutex_lock (&priv->lock);
         g_hash_table_insert (priv->copy_tasks, g_strdup(task_id), task);
@@ -165,10 +259,12 @@ seaf_copy_manager_add_task (SeafCopyManager *mgr,
     data->task = task;
     data->func = function;
 
+    queue_task (priv, data);
+
     ccnet_job_manager_schedule_job (mgr->priv->job_mgr,
                                     copy_thread,
                                     copy_done,
-                                    data);
+                                    mgr);
     return task_id;
 }
 
@@ -192,3 +288,210 @@ seaf_copy_manager_cancel_task (SeafCopyManager *mgr, const char *task_id)
 
     return 0;
 }
+
+struct BlockCopy {
+    SeafCopyManager *mgr;
+    char *src_store_id;
+    int src_version;
+    char *dst_store_id;
+    int dst_version;
+    CopyTask *task;
+
+    pthread_mutex_t lock;
+    pthread_cond_t cond;
+    /* BlockCopyItem's */
+    GQueue *queue;
+    gboolean finished;
+    gboolean error;
+
+    pthread_t *threads;
+    int n_threads;
+};
+
+typedef struct BlockCopyItem {
+    char block_id[41];
+    gint64 bytes;
+} BlockCopyItem;
+
+static gboolean
+block_copy_stopped (BlockCopy *copy)
+{
+    return (copy->error ||
+            (copy->task && g_atomic_int_get (&copy->task->canceled)));
+}
+
+static int
+copy_one_block (BlockCopy *copy, BlockCopyItem *item)
+{
+    SeafCopyManagerPriv *priv = copy->mgr->priv;
+    int ret;
+
+    pthread_mutex_lock (&priv->lock);
+    while (priv->free_block_copies == 0)
+        pthread_cond_wait (&priv->block_copy_cond, &priv->lock);
+    --(priv->free_block_copies);
+    pthread_mutex_unlock (&priv->lock);
+
+    ret = seaf_block_manager_copy_block (seaf->block_mgr,
+                                         copy->src_store_id, copy->src_version,
+                                         copy->dst_store_id, copy->dst_version,
+                                         item->block_id);
+
+    pthread_mutex_lock (&priv->lock);
+    ++(priv->free_block_copies);
+    pthread_cond_signal (&priv->block_copy_cond);
+    pthread_mutex_unlock (&priv->lock);
+
+    if (ret < 0) {
+        seaf_warning ("Failed to copy block %s from store %s to %s.\n",
+                      item->block_id, copy->src_store_id, copy->dst_store_id);
+        return -1;
+    }
+
+    return 0;
+}
+
+static void *
+block_copy_thread (void *vdata)
+{
+    BlockCopy *copy = vdata;
+    BlockCopyItem *item;
+    int ret;
+
+    while (1) {
+        pthread_mutex_lock (&copy->lock);
+        while (g_queue_is_empty (copy->queue) && !copy->finished &&
+               !block_copy_stopped (copy))
+            pthread_cond_wait (&copy->cond, &copy->lock);
+        item = g_queue_pop_head (copy->queue);
+        /* Wake up the producer waiting for space. */
+        pthread_cond_broadcast (&copy->cond);
+        pthread_mutex_unlock (&copy->lock);
+
+        if (!item)
+            break;
+
+        if (block_copy_stopped (copy)) {
+            g_free (item);
+            continue;
+        }
+
+        ret = copy_one_block (copy, item);
+
+        pthread_mutex_lock (&copy->lock);
+        if (ret < 0) {
+            copy->error = TRUE;
+            pthread_cond_broadcast (&copy->cond);
+        } else if (copy->task) {
+            copy->task->done_bytes += item->bytes;
+        }
+        pthread_mutex_unlock (&copy->lock);
+
+        g_free (item);
+    }
+
+    return NULL;
+}
+
+BlockCopy *
+seaf_copy_manager_start_block_copy (SeafCopyManager *mgr,
+                                    const char *src_store_id, int src_version,
+                                    const char *dst_store_id, int dst_version,
+                                    CopyTask *task)
+{
+    BlockCopy *copy = g_new0 (BlockCopy, 1);
+    int i;
+
+    copy->mgr = mgr;
+    copy->src_store_id = g_strdup (src_store_id);
+    copy->src_version = src_version;
+    copy->dst_store_id = g_strdup (dst_store_id);
+    copy->dst_version = dst_version;
+    copy->task = task;
+    pthread_mutex_init (&copy->lock, NULL);
+    pthread_cond_init (&copy->cond, NULL);
+    copy->queue = g_queue_new ();
+
+    copy->threads = g_new0 (pthread_t, mgr->priv->block_copy_threads);
+    for (i = 0; i < mgr->priv->block_copy_threads; ++i) {
+        if (pthread_create (&copy->threads[i], NULL,
+                            block_copy_thread, copy) != 0) {
+            seaf_warning ("Failed to start block copy thread.\n");
+            break;
+        }
+        ++(copy->n_threads);
+    }
+
+    return copy;
+}
+
+int
+seaf_block_copy_add (BlockCopy *copy, const char *block_id, gint64 bytes)
+{
+    BlockCopyItem item, *queued;
+    int ret = 0;
+
+    memcpy (item.block_id, block_id, 40);
+    item.block_id[40] = '\0';
+    item.bytes = bytes;
+
+    /* Copy in the caller's thread if none could be started. */
+    if (copy->n_threads == 0) {
+        if (block_copy_stopped (copy))
+            return -1;
+        if (copy_one_block (copy, &item) < 0) {
+            copy->error = TRUE;
+            return -1;
+        }
+        if (copy->task)
+            copy->task->done_bytes += bytes;
+        return 0;
+    }
+
+    pthread_mutex_lock (&copy->lock);
+
+    while (g_queue_get_length (copy->queue) >= MAX_QUEUED_BLOCKS &&
+           !block_copy_stopped (copy))
+        pthread_cond_wait (&copy->cond, &copy->lock);
+
+    if (block_copy_stopped (copy)) {
+        ret = -1;
+        goto out;
+    }
+
+    queued = g_new (BlockCopyItem, 1);
+    memcpy (queued, &item, sizeof(item));
+    g_queue_push_tail (copy->queue, queued);
+    pthread_cond_signal (&copy->cond);
+
+out:
+    pthread_mutex_unlock (&copy->lock);
+    return ret;
+}
+
+int
+seaf_block_copy_finish (BlockCopy *copy)
+{
+    int i, ret;
+
+    pthread_mutex_lock (&copy->lock);
+    copy->finished = TRUE;
+    pthread_cond_broadcast (&copy->cond);
+    pthread_mutex_unlock (&copy->lock);
+
+    for (i = 0; i < copy->n_threads; ++i)
+        pthread_join (copy->threads[i], NULL);
+
+    ret = block_copy_stopped (copy) ? -1 : 0;
+
+    /* Drained by the threads. */
+    g_queue_free (copy->queue);
+    pthread_mutex_destroy (&copy->lock);
+    pthread_cond_destroy (&copy->cond);
+    g_free (copy->threads);
+    g_free (copy->src_store_id);
+    g_free (copy->dst_store_id);
+    g_free (copy);
+
+    return ret;
+}
@@ -19,8 +19,12 @@ typedef struct _SeafCopyManagerPriv SeafCopyManagerPriv;
 
 struct CopyTask {
     char task_id[37];
+    /* Files copied and to copy. */
     gint64 done;
     gint64 total;
+    /* Bytes copied and to copy. */
+    gint64 done_bytes;
+    gint64 total_bytes;
     gint canceled;
     gboolean failed;
     gboolean successful;
@@ -47,6 +51,7 @@ seaf_copy_manager_add_task (SeafCopyManager *mgr,
                             const char *dst_filename,
                             const char *modifier,
                             gint64 total_files,
+                            gint64 total_bytes,
                             CopyTaskFunc function,
                             gboolean need_progress);
 
@@ -57,4 +62,31 @@ seaf_copy_manager_get_task (SeafCopyManager *mgr,
 int
 seaf_copy_manager_cancel_task (SeafCopyManager *mgr, const char *task_id);
 
+/*
+ * Blocks of a copy are copied by a few threads of their own while the fs
+ * objects are saved. The number of blocks copied at the same time by all
+ * copies is limited by [web_copy] max_block_copies.
+ */
+typedef struct BlockCopy BlockCopy;
+
+/* @task may be NULL for a copy without progress. */
+BlockCopy *
+seaf_copy_manager_start_block_copy (SeafCopyManager *mgr,
+                                    const char *src_store_id, int src_version,
+                                    const char *dst_store_id, int dst_version,
+                                    CopyTask *task);
+
+/*
+ * Queue a block of @bytes to copy. Returns -1 if the copy has failed or
+ * been canceled.
+ */
+int
+seaf_block_copy_add (BlockCopy *copy, const char *block_id, gint64 bytes);
+
+/* Wait for the queued blocks to be copied and free @copy.
+ * Returns -1 if any block failed to copy.
+ */
+int
+seaf_block_copy_finish (BlockCopy *copy);
+
 #endif
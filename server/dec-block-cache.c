@@ -0,0 +1,119 @@
+#include "common.h"
+
+#include "log.h"
+
+#include "seaf-sha1.h"
+#include "utils.h"
+#include "obj-cache.h"
+
+#include "dec-block-cache.h"
+
+static ObjCache *cache;
+
+static gpointer
+dec_block_ref (gpointer value)
+{
+    DecBlock *block = value;
+
+    g_atomic_int_inc (&block->ref);
+    return block;
+}
+
+void
+dec_block_unref (DecBlock *block)
+{
+    if (!block)
+        return;
+
+    if (g_atomic_int_dec_and_test (&block->ref)) {
+        /* It's plain text of an encrypted repo. */
+        memset (block->content->str, 0, block->content->len);
+        g_string_free (block->content, TRUE);
+        g_free (block);
+    }
+}
+
+void
+dec_block_cache_init (gint64 max_size)
+{
+    if (max_size <= 0)
+        return;
+
+    cache = obj_cache_new ((guint64)max_size, dec_block_ref,
+                           (GDestroyNotify)dec_block_unref);
+    mem_stats_register ("dec_block_cache", obj_cache_get_mem_stats, cache);
+}
+
+gboolean
+dec_block_cache_enabled ()
+{
+    return cache != NULL;
+}
+
+void
+dec_block_cache_key_fingerprint (SeafileCrypt *crypt, char *fp)
+{
+    unsigned char buf[4 + 32 + 16];
+    unsigned char sha1[20];
+
+    memcpy (buf, &crypt->version, 4);
+    memcpy (buf + 4, crypt->key, 32);
+    memcpy (buf + 36, crypt->iv, 16);
+    seaf_sha1 (buf, sizeof(buf), sha1);
+    rawdata_to_hex (sha1, fp, 20);
+
+    memset (buf, 0, sizeof(buf));
+}
+
+/* Blocks are cached as "<key fp>/<block id>" in the store of the repo. */
+static char *
+block_key (const char *key_fp, const char *block_id)
+{
+    return g_strconcat (key_fp, "/", block_id, NULL);
+}
+
+DecBlock *
+dec_block_cache_lookup (const char *repo_id, const char *key_fp,
+                        const char *block_id)
+{
+    DecBlock *block;
+    char *key;
+
+    if (!cache)
+        return NULL;
+
+    key = block_key (key_fp, block_id);
+    block = obj_cache_lookup (cache, repo_id, key);
+    g_free (key);
+
+    return block;
+}
+
+void
+dec_block_cache_insert (const char *repo_id, const char *key_fp,
+                        const char *block_id, GString *content)
+{
+    DecBlock *block;
+    char *key;
+
+    block = g_new0 (DecBlock, 1);
+    block->ref = 1;
+    block->content = content;
+
+    if (cache) {
+        key = block_key (key_fp, block_id);
+        obj_cache_insert (cache, repo_id, key, block, content->len);
+        g_free (key);
+    }
+
+    dec_block_unref (block);
+}
+
+void
+dec_block_cache_drop_repo (const char *repo_id)
+{
+    if (!cache)
+        return;
+
+    obj_cache_remove_store (cache, repo_id);
+}
@@ -0,0 +1,49 @@
+#ifndef DEC_BLOCK_CACHE_H
+#define DEC_BLOCK_CACHE_H
+
+#include <glib.h>
+
+#include "seafile-crypt.h"
+
+/*
+ * Decrypted blocks of encrypted repos, kept in memory within a size
+ * budget, so repeated downloads of a file don't decrypt it again.
+ *
+ * Blocks are keyed on a fingerprint of the key they were decrypted with,
+ * and the blocks of a repo are dropped as soon as a password of the repo
+ * is no longer cached by the passwd manager.
+ */
+
+typedef struct DecBlock {
+    gint ref;
+    GString *content;
+} DecBlock;
+
+/* A @max_size of 0 or less disables the cache. */
+void
+dec_block_cache_init (gint64 max_size);
+
+gboolean
+dec_block_cache_enabled ();
+
+/* Fingerprint of @crypt, as 40 hex chars. */
+void
+dec_block_cache_key_fingerprint (SeafileCrypt *crypt, char *fp);
+
+/* Returns a new reference to the cached block, or NULL. */
+DecBlock *
+dec_block_cache_lookup (const char *repo_id, const char *key_fp,
+                        const char *block_id);
+
+/* Cache @content, which is taken over by the cache. */
+void
+dec_block_cache_insert (const char *repo_id, const char *key_fp,
+                        const char *block_id, GString *content);
+
+void
+dec_block_cache_drop_repo (const char *repo_id);
+
+void
+dec_block_unref (DecBlock *block);
+
+#endif
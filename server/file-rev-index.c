@@ -0,0 +1,973 @@
+#include "common.h"
+
+#include <ccnet/timer.h>
+#include <pthread.h>
+
+#include "seafile-session.h"
+#include "seafile-object.h"
+#include "file-rev-index.h"
+#include "diff-simple.h"
+#include "log.h"
+
+/*
+ * Tables:
+ *
+ *   FileRevision:  one row per revision of a path, keyed by the sha1 of
+ *                  the path, since paths are too long to index.
+ *   FileRevCommit: the commits indexed. A commit is only indexed after
+ *                  its parents, so the commits reachable from an indexed
+ *                  commit are all indexed.
+ *   FileRevHead:   the head the repo was last indexed up to.
+ *   FileRevTrash:  the topmost entries deleted by the commits that delete
+ *                  files or dirs, with the parent they can be restored from.
+ *   FileRevTrashStart: the time deleted entries are indexed from. Commits
+ *                  indexed before the trash was indexed aren't indexed
+ *                  again, so older deletions are only found in the history.
+ */
+
+typedef struct FileRevIndexPriv {
+    gboolean enabled;
+
+    pthread_mutex_t q_lock;
+    GQueue *job_queue;
+    /* Repos in the queue, so that a busy repo is only queued once. */
+    GHashTable *queued;
+    gboolean running;
+
+    CcnetTimer *sched_timer;
+} FileRevIndexPriv;
+
+typedef struct IndexJob {
+    FileRevIndex *index;
+    char repo_id[37];
+} IndexJob;
+
+#define SCHEDULER_INTV 1000    /* 1s */
+
+static int
+schedule_pulse (void *vindex);
+static void *
+index_repo (void *vjob);
+static void
+index_repo_done (void *vjob);
+
+FileRevIndex *
+file_rev_index_new (SeafileSession *session)
+{
+    FileRevIndex *index = g_new0 (FileRevIndex, 1);
+    GError *error = NULL;
+
+    index->seaf = session;
+    index->priv = g_new0 (FileRevIndexPriv, 1);
+
+    /*
+     * [library]
+     * file_revision_index = true
+     */
+    index->priv->enabled = g_key_file_get_boolean (session->config, "library",
+                                                   "file_revision_index",
+                                                   &error);
+    if (error) {
+        index->priv->enabled = TRUE;
+        g_clear_error (&error);
+    }
+
+    pthread_mutex_init (&index->priv->q_lock, NULL);
+    index->priv->job_queue = g_queue_new ();
+    index->priv->queued = g_hash_table_new_full (g_str_hash, g_str_equal,
+                                                 g_free, NULL);
+
+    return index;
+}
+
+static int
+create_tables (SeafDB *db)
+{
+    char *sql;
+
+    switch (seaf_db_type (db)) {
+    case SEAF_DB_TYPE_MYSQL:
+        sql = "CREATE TABLE IF NOT EXISTS FileRevision ("
+            "repo_id CHAR(37), path_hash CHAR(41), commit_id CHAR(41), "
+            "file_id CHAR(41), file_size BIGINT, ctime BIGINT, "
+            "old_path TEXT, old_parent_id CHAR(41), "
+            "PRIMARY KEY (repo_id, path_hash, commit_id))"
+            "ENGINE=INNODB";
+        if (seaf_db_query (db, sql) < 0)
+            return -1;
+
+        sql = "CREATE TABLE IF NOT EXISTS FileRevCommit ("
+            "repo_id CHAR(37), commit_id CHAR(41), "
+            "PRIMARY KEY (repo_id, commit_id))"
+            "ENGINE=INNODB";
+        if (seaf_db_query (db, sql) < 0)
+            return -1;
+
+        sql = "CREATE TABLE IF NOT EXISTS FileRevHead ("
+            "repo_id CHAR(37) PRIMARY KEY, head_id CHAR(41))"
+            "ENGINE=INNODB";
+        if (seaf_db_query (db, sql) < 0)
+            return -1;
+
+        sql = "CREATE TABLE IF NOT EXISTS FileRevTrash ("
+            "id BIGINT NOT NULL PRIMARY KEY AUTO_INCREMENT, "
+            "repo_id CHAR(37), basedir TEXT, obj_name TEXT, obj_id CHAR(41), "
+            "mode INTEGER, file_size BIGINT, commit_id CHAR(41), "
+            "delete_time BIGINT, INDEX (repo_id, delete_time))"
+            "ENGINE=INNODB";
+        if (seaf_db_query (db, sql) < 0)
+            return -1;
+
+        sql = "CREATE TABLE IF NOT EXISTS FileRevTrashStart ("
+            "repo_id CHAR(37) PRIMARY KEY, start_time BIGINT)"
+            "ENGINE=INNODB";
+        if (seaf_db_query (db, sql) < 0)
+            return -1;
+        break;
+    case SEAF_DB_TYPE_PGSQL:
+    case SEAF_DB_TYPE_SQLITE:
+        sql = "CREATE TABLE IF NOT EXISTS FileRevision ("
+            "repo_id CHAR(36), path_hash CHAR(40), commit_id CHAR(40), "
+            "file_id CHAR(40), file_size BIGINT, ctime BIGINT, "
+            "old_path TEXT, old_parent_id CHAR(40), "
+            "PRIMARY KEY (repo_id, path_hash, commit_id))";
+        if (seaf_db_query (db, sql) < 0)
+            return -1;
+
+        sql = "CREATE TABLE IF NOT EXISTS FileRevCommit ("
+            "repo_id CHAR(36), commit_id CHAR(40), "
+            "PRIMARY KEY (repo_id, commit_id))";
+        if (seaf_db_query (db, sql) < 0)
+            return -1;
+
+        sql = "CREATE TABLE IF NOT EXISTS FileRevHead ("
+            "repo_id CHAR(36) PRIMARY KEY, head_id CHAR(40))";
+        if (seaf_db_query (db, sql) < 0)
+            return -1;
+
+        sql = "CREATE TABLE IF NOT EXISTS FileRevTrash ("
+            "repo_id CHAR(36), basedir TEXT, obj_name TEXT, obj_id CHAR(40), "
+            "mode INTEGER, file_size BIGINT, commit_id CHAR(40), "
+            "delete_time BIGINT)";
+        if (seaf_db_query (db, sql) < 0)
+            return -1;
+
+        sql = "CREATE TABLE IF NOT EXISTS FileRevTrashStart ("
+            "repo_id CHAR(36) PRIMARY KEY, start_time BIGINT)";
+        if (seaf_db_query (db, sql) < 0)
+            return -1;
+
+        if (seaf_db_type (db) == SEAF_DB_TYPE_SQLITE) {
+            sql = "CREATE INDEX IF NOT EXISTS filerevtrash_repo_time_idx "
+                "ON FileRevTrash (repo_id, delete_time)";
+            if (seaf_db_query (db, sql) < 0)
+                return -1;
+        } else if (!pgsql_index_exists (db, "filerevtrash_repo_time_idx")) {
+            sql = "CREATE INDEX filerevtrash_repo_time_idx "
+                "ON FileRevTrash (repo_id, delete_time)";
+            if (seaf_db_query (db, sql) < 0)
+                return -1;
+        }
+        break;
+    default:
+        g_return_val_if_reached (-1);
+    }
+
+    return 0;
+}
+
+int
+file_rev_index_start (FileRevIndex *index)
+{
+    if (!index->priv->enabled)
+        return 0;
+
+    if (create_tables (index->seaf->db) < 0) {
+        seaf_warning ("Failed to create file revision index tables.\n");
+        return -1;
+    }
+
+    index->priv->sched_timer = ccnet_timer_new (schedule_pulse, index,
+                                                SCHEDULER_INTV);
+    return 0;
+}
+
+void
+schedule_file_rev_indexing (FileRevIndex *index, const char *repo_id)
+{
+    FileRevIndexPriv *priv = index->priv;
+    IndexJob *job;
+
+    if (!priv->enabled)
+        return;
+
+    pthread_mutex_lock (&priv->q_lock);
+
+    if (!g_hash_table_lookup (priv->queued, repo_id)) {
+        job = g_new0 (IndexJob, 1);
+        job->index = index;
+        memcpy (job->repo_id, repo_id, 36);
+        g_queue_push_tail (priv->job_queue, job);
+        g_hash_table_insert (priv->queued, g_strdup(repo_id), job);
+    }
+
+    pthread_mutex_unlock (&priv->q_lock);
+}
+
+static int
+schedule_pulse (void *vindex)
+{
+    FileRevIndex *index = vindex;
+    FileRevIndexPriv *priv = index->priv;
+    IndexJob *job;
+
+    if (priv->running)
+        return 1;
+
+    pthread_mutex_lock (&priv->q_lock);
+    job = g_queue_pop_head (priv->job_queue);
+    /* Commits landing from now on need another run. */
+    if (job)
+        g_hash_table_remove (priv->queued, job->repo_id);
+    pthread_mutex_unlock (&priv->q_lock);
+
+    if (!job)
+        return 1;
+
+    if (bg_job_manager_schedule (index->seaf->bg_job_mgr, BG_JOB_INDEX,
+                                 index_repo, index_repo_done,
+                                 job) < 0) {
+        seaf_warning ("Failed to start file revision index job.\n");
+        schedule_file_rev_indexing (index, job->repo_id);
+        g_free (job);
+        return 1;
+    }
+    priv->running = TRUE;
+
+    return 1;
+}
+
+static char *
+path_hash (const char *path)
+{
+    while (*path == '/')
+        ++path;
+    return g_compute_checksum_for_string (G_CHECKSUM_SHA1, path, -1);
+}
+
+/* Indexing. */
+
+typedef struct RevEntry {
+    char *path;
+    char file_id[41];
+    gint64 file_size;
+    /* Not present in any parent. */
+    gboolean added;
+} RevEntry;
+
+typedef struct DeletedFile {
+    char *path;
+    const char *parent_id;
+} DeletedFile;
+
+typedef struct TrashEntry {
+    /* Starts and ends with '/'. */
+    char *basedir;
+    char *name;
+    char obj_id[41];
+    guint32 mode;
+    gint64 size;
+    const char *parent_id;
+} TrashEntry;
+
+typedef struct RevDiffData {
+    const char *parent_ids[2];
+    GList *revs;
+    /* file id -> DeletedFile, to find the files added by a move. */
+    GHashTable *deleted;
+
+    /* Set for the commits that delete files or dirs. */
+    gboolean record_trash;
+    GList *trash;
+    /* The dirs deleted from each parent so far, as "path/". Only the
+     * topmost deleted entry goes to the trash.
+     */
+    GHashTable *deleted_dirs[2];
+} RevDiffData;
+
+static void
+rev_entry_free (RevEntry *rev)
+{
+    g_free (rev->path);
+    g_free (rev);
+}
+
+static void
+deleted_file_free (DeletedFile *df)
+{
+    g_free (df->path);
+    g_free (df);
+}
+
+static void
+trash_entry_free (TrashEntry *e)
+{
+    g_free (e->basedir);
+    g_free (e->name);
+    g_free (e);
+}
+
+static void
+add_trash_entry (RevDiffData *data, int i, const char *basedir,
+                 SeafDirent *dent)
+{
+    TrashEntry *e;
+
+    if (g_hash_table_lookup (data->deleted_dirs[i - 1], basedir))
+        return;
+
+    e = g_new0 (TrashEntry, 1);
+    e->basedir = g_strconcat ("/", basedir, NULL);
+    e->name = g_strdup (dent->name);
+    memcpy (e->obj_id, dent->id, 40);
+    e->mode = dent->mode;
+    if (S_ISREG(dent->mode))
+        e->size = dent->size;
+    e->parent_id = data->parent_ids[i - 1];
+    data->trash = g_list_prepend (data->trash, e);
+}
+
+static int
+rev_diff_files (int n, const char *basedir, SeafDirent *files[], void *vdata)
+{
+    RevDiffData *data = vdata;
+    SeafDirent *file = files[0];
+    DeletedFile *df;
+    RevEntry *rev;
+    gboolean added = TRUE;
+    int i;
+
+    if (!file) {
+        if (data->record_trash) {
+            for (i = 1; i < n; ++i) {
+                if (files[i])
+                    add_trash_entry (data, i, basedir, files[i]);
+            }
+        }
+
+        for (i = 1; i < n; ++i) {
+            if (!files[i] || strcmp (files[i]->id, EMPTY_SHA1) == 0 ||
+                g_hash_table_lookup (data->deleted, files[i]->id))
+                continue;
+            df = g_new0 (DeletedFile, 1);
+            df->path = g_strconcat (basedir, files[i]->name, NULL);
+            df->parent_id = data->parent_ids[i - 1];
+            g_hash_table_insert (data->deleted, g_strdup(files[i]->id), df);
+            break;
+        }
+        return 0;
+    }
+
+    for (i = 1; i < n; ++i) {
+        if (!files[i])
+            continue;
+        /* Taken as is from this parent. */
+        if (strcmp (files[i]->id, file->id) == 0)
+            return 0;
+        added = FALSE;
+    }
+
+    rev = g_new0 (RevEntry, 1);
+    rev->path = g_strconcat (basedir, file->name, NULL);
+    memcpy (rev->file_id, file->id, 40);
+    rev->file_size = file->size;
+    rev->added = added;
+    data->revs = g_list_prepend (data->revs, rev);
+
+    return 0;
+}
+
+static int
+rev_diff_dirs (int n, const char *basedir, SeafDirent *dirs[], void *vdata,
+               gboolean *recurse)
+{
+    RevDiffData *data = vdata;
+    char *path;
+    int i;
+
+    if (data->record_trash && !dirs[0]) {
+        for (i = 1; i < n; ++i) {
+            if (!dirs[i])
+                continue;
+            add_trash_entry (data, i, basedir, dirs[i]);
+            path = g_strconcat (basedir, dirs[i]->name, "/", NULL);
+            g_hash_table_replace (data->deleted_dirs[i - 1], path, path);
+        }
+    }
+
+    /* Nothing under a dir taken as is from a parent of a merge is a
+     * revision of the merge.
+     */
+    *recurse = TRUE;
+    if (dirs[0]) {
+        for (i = 1; i < n; ++i) {
+            if (dirs[i] && strcmp (dirs[i]->id, dirs[0]->id) == 0) {
+                *recurse = FALSE;
+                break;
+            }
+        }
+    }
+
+    return 0;
+}
+
+static int
+save_revisions (SeafDB *db, SeafRepo *repo, SeafCommit *commit,
+                RevDiffData *data)
+{
+    SeafDBTrans *trans;
+    SeafDBBatch *batch;
+    RevEntry *rev;
+    DeletedFile *df;
+    TrashEntry *e;
+    GList *ptr;
+    char *hash;
+    int ret = 0;
+
+    trans = seaf_db_begin_transaction (db);
+    if (!trans)
+        return -1;
+
+    batch = seaf_db_batch_new (db, trans,
+                               "INSERT INTO FileRevision (repo_id, path_hash, "
+                               "commit_id, file_id, file_size, ctime, old_path, "
+                               "old_parent_id) VALUES", NULL, 8);
+    if (!batch) {
+        ret = -1;
+        goto out;
+    }
+
+    for (ptr = data->revs; ptr && ret == 0; ptr = ptr->next) {
+        rev = ptr->data;
+        df = rev->added ? g_hash_table_lookup (data->deleted, rev->file_id) : NULL;
+        hash = path_hash (rev->path);
+        ret = seaf_db_batch_add_row (batch,
+                                     "string", repo->id,
+                                     "string", hash,
+                                     "string", commit->commit_id,
+                                     "string", rev->file_id,
+                                     "int64", rev->file_size,
+                                     "int64", (gint64)commit->ctime,
+                                     "string", df ? df->path : NULL,
+                                     "string", df ? df->parent_id : NULL);
+        g_free (hash);
+    }
+    if (seaf_db_batch_finish (batch) < 0)
+        ret = -1;
+    if (ret < 0)
+        goto out;
+
+    if (data->trash) {
+        batch = seaf_db_batch_new (db, trans,
+                                   "INSERT INTO FileRevTrash (repo_id, basedir, "
+                                   "obj_name, obj_id, mode, file_size, commit_id, "
+                                   "delete_time) VALUES", NULL, 8);
+        if (!batch) {
+            ret = -1;
+            goto out;
+        }
+
+        for (ptr = data->trash; ptr && ret == 0; ptr = ptr->next) {
+            e = ptr->data;
+            ret = seaf_db_batch_add_row (batch,
+                                         "string", repo->id,
+                                         "string", e->basedir,
+                                         "string", e->name,
+                                         "string", e->obj_id,
+                                         "int", (int)e->mode,
+                                         "int64", e->size,
+                                         "string", e->parent_id,
+                                         "int64", (gint64)commit->ctime);
+        }
+        if (seaf_db_batch_finish (batch) < 0)
+            ret = -1;
+        if (ret < 0)
+            goto out;
+    }
+
+    ret = seaf_db_trans_query (trans, "INSERT INTO FileRevCommit VALUES (?, ?)",
+                               2, "string", repo->id,
+                               "string", commit->commit_id);
+    if (ret < 0)
+        goto out;
+
+    ret = seaf_db_commit (trans);
+
+out:
+    if (ret < 0)
+        seaf_db_rollback (trans);
+    seaf_db_trans_close (trans);
+    return ret;
+}
+
+static gboolean
+is_delete_commit (SeafCommit *commit)
+{
+    return (strstr (commit->desc, PREFIX_DEL_FILE) != NULL ||
+            strstr (commit->desc, PREFIX_DEL_DIR) != NULL ||
+            strstr (commit->desc, PREFIX_DEL_DIRS) != NULL);
+}
+
+static int
+index_commit (FileRevIndex *index, SeafRepo *repo, SeafCommit *commit)
+{
+    SeafCommit *parent = NULL, *parent2 = NULL;
+    const char *roots[3];
+    RevDiffData data;
+    DiffOptions opts;
+    int n = 1;
+    int ret = 0;
+
+    memset (&data, 0, sizeof(data));
+    data.deleted = g_hash_table_new_full (g_str_hash, g_str_equal, g_free,
+                                          (GDestroyNotify)deleted_file_free);
+    data.deleted_dirs[0] = g_hash_table_new_full (g_str_hash, g_str_equal,
+                                                  g_free, NULL);
+    data.deleted_dirs[1] = g_hash_table_new_full (g_str_hash, g_str_equal,
+                                                  g_free, NULL);
+
+    /* Parents may be missing where the history is truncated. The commit
+     * is compared to an empty tree then, like an initial commit.
+     */
+    roots[0] = commit->root_id;
+    if (commit->parent_id)
+        parent = seaf_commit_manager_get_commit (index->seaf->commit_mgr,
+                                                 repo->id, repo->version,
+                                                 commit->parent_id);
+    if (commit->second_parent_id)
+        parent2 = seaf_commit_manager_get_commit (index->seaf->commit_mgr,
+                                                  repo->id, repo->version,
+                                                  commit->second_parent_id);
+    if (parent) {
+        data.parent_ids[n - 1] = parent->commit_id;
+        roots[n++] = parent->root_id;
+    }
+    if (parent2) {
+        data.parent_ids[n - 1] = parent2->commit_id;
+        roots[n++] = parent2->root_id;
+    }
+    if (n == 1)
+        roots[n++] = EMPTY_SHA1;
+    else
+        data.record_trash = is_delete_commit (commit);
+
+    memset (&opts, 0, sizeof(opts));
+    memcpy (opts.store_id, repo->store_id, 36);
+    opts.version = repo->version;
+    opts.file_cb = rev_diff_files;
+    opts.dir_cb = rev_diff_dirs;
+    opts.data = &data;
+
+    if (diff_trees (n, roots, &opts) < 0) {
+        seaf_warning ("Failed to diff commit %s of repo %.8s.\n",
+                      commit->commit_id, repo->id);
+        ret = -1;
+        goto out;
+    }
+
+    ret = save_revisions (index->seaf->db, repo, commit, &data);
+    if (ret < 0)
+        seaf_warning ("Failed to save file revisions of commit %s.\n",
+                      commit->commit_id);
+
+out:
+    seaf_commit_unref (parent);
+    seaf_commit_unref (parent2);
+    g_list_free_full (data.revs, (GDestroyNotify)rev_entry_free);
+    g_list_free_full (data.trash, (GDestroyNotify)trash_entry_free);
+    g_hash_table_destroy (data.deleted);
+    g_hash_table_destroy (data.deleted_dirs[0]);
+    g_hash_table_destroy (data.deleted_dirs[1]);
+    return ret;
+}
+
+typedef struct CollectCommitsData {
+    SeafDB *db;
+    const char *repo_id;
+    /* All the commits indexed so far, if the repo has no indexed head.
+     * Otherwise only a few new commits are expected, and each is
+     * looked up in the db.
+     */
+    GHashTable *indexed;
+    /* Ids of the commits to index, oldest first. */
+    GList *commit_ids;
+} CollectCommitsData;
+
+static gboolean
+collect_unindexed_commit (SeafCommit *commit, void *vdata, gboolean *stop)
+{
+    CollectCommitsData *data = vdata;
+    gboolean indexed, db_err = FALSE;
+
+    if (data->indexed)
+        indexed = (g_hash_table_lookup (data->indexed, commit->commit_id) != NULL);
+    else
+        indexed = seaf_db_statement_exists (data->db,
+                                            "SELECT 1 FROM FileRevCommit WHERE "
+                                            "repo_id=? AND commit_id=?",
+                                            &db_err, 2, "string", data->repo_id,
+                                            "string", commit->commit_id);
+    if (db_err)
+        return FALSE;
+
+    if (indexed) {
+        *stop = TRUE;
+        return TRUE;
+    }
+
+    data->commit_ids = g_list_prepend (data->commit_ids,
+                                       g_strdup(commit->commit_id));
+    return TRUE;
+}
+
+static gboolean
+collect_indexed_commit (SeafDBRow *row, void *data)
+{
+    GHashTable *indexed = data;
+    char *commit_id = g_strdup (seaf_db_row_get_column_text (row, 0));
+
+    g_hash_table_replace (indexed, commit_id, commit_id);
+    return TRUE;
+}
+
+static int
+set_indexed_head (SeafDB *db, const char *repo_id, const char *head_id)
+{
+    gboolean exists, err;
+
+    if (seaf_db_type(db) == SEAF_DB_TYPE_PGSQL) {
+        exists = seaf_db_statement_exists (db,
+                                           "SELECT repo_id FROM FileRevHead "
+                                           "WHERE repo_id=?",
+                                           &err, 1, "string", repo_id);
+        if (err)
+            return -1;
+
+        if (exists)
+            return seaf_db_statement_query (db,
+                                            "UPDATE FileRevHead SET head_id=? "
+                                            "WHERE repo_id=?",
+                                            2, "string", head_id,
+                                            "string", repo_id);
+        return seaf_db_statement_query (db,
+                                        "INSERT INTO FileRevHead VALUES (?, ?)",
+                                        2, "string", repo_id,
+                                        "string", head_id);
+    }
+
+    return seaf_db_statement_query (db, "REPLACE INTO FileRevHead VALUES (?, ?)",
+                                    2, "string", repo_id, "string", head_id);
+}
+
+/*
+ * Start indexing the trash of a repo from now, unless no commit is
+ * indexed yet and it's indexed from the first commit.
+ */
+static int
+set_trash_start (SeafDB *db, const char *repo_id, gboolean has_indexed)
+{
+    gboolean exists, err;
+    gint64 start_time = has_indexed ? (gint64)time(NULL) : 0;
+
+    exists = seaf_db_statement_exists (db,
+                                       "SELECT repo_id FROM FileRevTrashStart "
+                                       "WHERE repo_id=?",
+                                       &err, 1, "string", repo_id);
+    if (err)
+        return -1;
+    if (exists)
+        return 0;
+
+    return seaf_db_statement_query (db,
+                                    "INSERT INTO FileRevTrashStart VALUES (?, ?)",
+                                    2, "string", repo_id, "int64", start_time);
+}
+
+static void *
+index_repo (void *vjob)
+{
+    IndexJob *job = vjob;
+    FileRevIndex *index = job->index;
+    SeafDB *db = index->seaf->db;
+    SeafRepo *repo;
+    SeafCommit *commit;
+    CollectCommitsData data;
+    char *indexed_head = NULL;
+    char head_id[41];
+    GList *ptr;
+
+    memset (&data, 0, sizeof(data));
+
+    repo = seaf_repo_manager_get_repo (index->seaf->repo_mgr, job->repo_id);
+    if (!repo)
+        return vjob;
+
+    /* Version 0 dirents don't record file sizes. */
+    if (repo->version == 0)
+        goto out;
+
+    memcpy (head_id, repo->head->commit_id, 41);
+    indexed_head = seaf_db_statement_get_string (db,
+                                                 "SELECT head_id FROM FileRevHead "
+                                                 "WHERE repo_id=?",
+                                                 1, "string", repo->id);
+    if (g_strcmp0 (indexed_head, head_id) == 0)
+        goto out;
+
+    data.db = db;
+    data.repo_id = repo->id;
+    if (!indexed_head) {
+        data.indexed = g_hash_table_new_full (g_str_hash, g_str_equal,
+                                              g_free, NULL);
+        if (seaf_db_statement_foreach_row (db,
+                                           "SELECT commit_id FROM FileRevCommit "
+                                           "WHERE repo_id=?",
+                                           collect_indexed_commit, data.indexed,
+                                           1, "string", repo->id) < 0)
+            goto out;
+    }
+
+    if (set_trash_start (db, repo->id,
+                         indexed_head != NULL ||
+                         g_hash_table_size (data.indexed) > 0) < 0)
+        goto out;
+
+    if (!seaf_commit_manager_traverse_commit_tree_truncated (index->seaf->commit_mgr,
+                                                             repo->id,
+                                                             repo->version,
+                                                             head_id,
+                                                             collect_unindexed_commit,
+                                                             &data, FALSE)) {
+        seaf_warning ("Failed to find unindexed commits of repo %.8s.\n",
+                      repo->id);
+        goto out;
+    }
+
+    for (ptr = data.commit_ids; ptr; ptr = ptr->next) {
+        /* Indexed commits are kept, the next run goes on from there. */
+        if (bg_job_cancelled ())
+            goto out;
+        commit = seaf_commit_manager_get_commit (index->seaf->commit_mgr,
+                                                 repo->id, repo->version,
+                                                 ptr->data);
+        if (!commit) {
+            seaf_warning ("Failed to get commit %s.\n", (char *)ptr->data);
+            goto out;
+        }
+        if (index_commit (index, repo, commit) < 0) {
+            seaf_commit_unref (commit);
+            goto out;
+        }
+        seaf_commit_unref (commit);
+    }
+
+    if (set_indexed_head (db, repo->id, head_id) < 0)
+        seaf_warning ("Failed to set indexed head of repo %.8s.\n", repo->id);
+
+out:
+    seaf_repo_unref (repo);
+    g_free (indexed_head);
+    if (data.indexed)
+        g_hash_table_destroy (data.indexed);
+    string_list_free (data.commit_ids);
+    return vjob;
+}
+
+static void
+index_repo_done (void *vjob)
+{
+    IndexJob *job = vjob;
+
+    job->index->priv->running = FALSE;
+    g_free (job);
+}
+
+/* Lookup. */
+
+static gboolean
+collect_revision (SeafDBRow *row, void *data)
+{
+    GList **revisions = data;
+    FileRevision *rev = g_new0 (FileRevision, 1);
+    const char *s;
+
+    g_strlcpy (rev->commit_id, seaf_db_row_get_column_text (row, 0), 41);
+    g_strlcpy (rev->file_id, seaf_db_row_get_column_text (row, 1), 41);
+    rev->file_size = seaf_db_row_get_column_int64 (row, 2);
+    rev->ctime = seaf_db_row_get_column_int64 (row, 3);
+    s = seaf_db_row_get_column_text (row, 4);
+    if (s) {
+        rev->old_path = g_strdup (s);
+        g_strlcpy (rev->old_parent_id, seaf_db_row_get_column_text (row, 5), 41);
+    }
+
+    *revisions = g_list_prepend (*revisions, rev);
+    return TRUE;
+}
+
+int
+file_rev_index_get_revisions (FileRevIndex *index,
+                              const char *repo_id,
+                              const char *head_id,
+                              const char *path,
+                              gint64 before,
+                              GList **revisions)
+{
+    SeafDB *db = index->seaf->db;
+    char *indexed_head, *hash;
+    int rc;
+
+    *revisions = NULL;
+
+    if (!index->priv->enabled)
+        return -1;
+
+    indexed_head = seaf_db_statement_get_string (db,
+                                                 "SELECT head_id FROM FileRevHead "
+                                                 "WHERE repo_id=?",
+                                                 1, "string", repo_id);
+    if (g_strcmp0 (indexed_head, head_id) != 0) {
+        g_free (indexed_head);
+        schedule_file_rev_indexing (index, repo_id);
+        return -1;
+    }
+    g_free (indexed_head);
+
+    hash = path_hash (path);
+    if (before > 0)
+        rc = seaf_db_statement_foreach_row (db,
+                                            "SELECT commit_id, file_id, file_size, "
+                                            "ctime, old_path, old_parent_id "
+                                            "FROM FileRevision WHERE repo_id=? "
+                                            "AND path_hash=? AND ctime<? "
+                                            "ORDER BY ctime",
+                                            collect_revision, revisions,
+                                            3, "string", repo_id, "string", hash,
+                                            "int64", before);
+    else
+        rc = seaf_db_statement_foreach_row (db,
+                                            "SELECT commit_id, file_id, file_size, "
+                                            "ctime, old_path, old_parent_id "
+                                            "FROM FileRevision WHERE repo_id=? "
+                                            "AND path_hash=? ORDER BY ctime",
+                                            collect_revision, revisions,
+                                            2, "string", repo_id, "string", hash);
+    g_free (hash);
+
+    if (rc < 0) {
+        g_list_free_full (*revisions, (GDestroyNotify)file_revision_free);
+        *revisions = NULL;
+        return -1;
+    }
+
+    return 0;
+}
+
+void
+file_revision_free (FileRevision *rev)
+{
+    g_free (rev->old_path);
+    g_free (rev);
+}
+
+static gboolean
+collect_trash_entry (SeafDBRow *row, void *data)
+{
+    GList **entries = data;
+    SeafileDeletedEntry *entry;
+
+    entry = g_object_new (SEAFILE_TYPE_DELETED_ENTRY,
+                          "basedir", seaf_db_row_get_column_text (row, 0),
+                          "obj_name", seaf_db_row_get_column_text (row, 1),
+                          "obj_id", seaf_db_row_get_column_text (row, 2),
+                          "mode", seaf_db_row_get_column_int (row, 3),
+                          "file_size", seaf_db_row_get_column_int64 (row, 4),
+                          "commit_id", seaf_db_row_get_column_text (row, 5),
+                          "delete_time",
+                          (int)seaf_db_row_get_column_int64 (row, 6),
+                          NULL);
+
+    *entries = g_list_prepend (*entries, entry);
+    return TRUE;
+}
+
+int
+file_rev_index_get_deleted_entries (FileRevIndex *index,
+                                    const char *repo_id,
+                                    const char *head_id,
+                                    gint64 after,
+                                    GList **entries)
+{
+    SeafDB *db = index->seaf->db;
+    char *indexed_head;
+    gint64 start_time;
+
+    *entries = NULL;
+
+    if (!index->priv->enabled)
+        return -1;
+
+    indexed_head = seaf_db_statement_get_string (db,
+                                                 "SELECT head_id FROM FileRevHead "
+                                                 "WHERE repo_id=?",
+                                                 1, "string", repo_id);
+    if (g_strcmp0 (indexed_head, head_id) != 0) {
+        g_free (indexed_head);
+        schedule_file_rev_indexing (index, repo_id);
+        return -1;
+    }
+    g_free (indexed_head);
+
+    start_time = seaf_db_statement_get_int64 (db,
+                                              "SELECT start_time FROM "
+                                              "FileRevTrashStart WHERE repo_id=?",
+                                              1, "string", repo_id);
+    if (start_time < 0 || (start_time > 0 && after < start_time))
+        return -1;
+
+    /* Oldest first, so that the list ends up newest first. */
+    if (seaf_db_statement_foreach_row (db,
+                                       "SELECT basedir, obj_name, obj_id, mode, "
+                                       "file_size, commit_id, delete_time "
+                                       "FROM FileRevTrash WHERE repo_id=? "
+                                       "AND delete_time>? ORDER BY delete_time",
+                                       collect_trash_entry, entries,
+                                       2, "string", repo_id,
+                                       "int64", after) < 0) {
+        g_list_free_full (*entries, g_object_unref);
+        *entries = NULL;
+        return -1;
+    }
+
+    return 0;
+}
+
+void
+file_rev_index_remove_repo (FileRevIndex *index, const char *repo_id)
+{
+    SeafDB *db = index->seaf->db;
+
+    if (!index->priv->enabled)
+        return;
+
+    seaf_db_statement_query (db, "DELETE FROM FileRevision WHERE repo_id=?",
+                             1, "string", repo_id);
+    seaf_db_statement_query (db, "DELETE FROM FileRevCommit WHERE repo_id=?",
+                             1, "string", repo_id);
+    seaf_db_statement_query (db, "DELETE FROM FileRevHead WHERE repo_id=?",
+                             1, "string", repo_id);
+    seaf_db_statement_query (db, "DELETE FROM FileRevTrash WHERE repo_id=?",
+                             1, "string", repo_id);
+    seaf_db_statement_query (db, "DELETE FROM FileRevTrashStart WHERE repo_id=?",
+                             1, "string", repo_id);
+}
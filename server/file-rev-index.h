@@ -0,0 +1,84 @@
+#ifndef FILE_REV_INDEX_H
+#define FILE_REV_INDEX_H
+
+#include <glib.h>
+
+/*
+ * Index of the revisions of every file path in a repo, so that file
+ * history doesn't have to walk the commit history.
+ *
+ * A revision is a commit where the file differs from the file at the
+ * same path in all the parents of the commit. Commits are indexed in the
+ * background after a branch update, and the index is only used while
+ * it's indexed up to the head the history is asked for.
+ */
+
+struct _SeafileSession;
+
+struct FileRevIndexPriv;
+
+typedef struct FileRevIndex {
+    struct _SeafileSession *seaf;
+
+    struct FileRevIndexPriv *priv;
+} FileRevIndex;
+
+typedef struct FileRevision {
+    char commit_id[41];
+    char file_id[41];
+    gint64 file_size;
+    gint64 ctime;
+    /* Set if the file was moved here from @old_path, which is in the
+     * parent commit @old_parent_id.
+     */
+    char *old_path;
+    char old_parent_id[41];
+} FileRevision;
+
+FileRevIndex *
+file_rev_index_new (struct _SeafileSession *session);
+
+int
+file_rev_index_start (FileRevIndex *index);
+
+/* Index the commits of @repo_id up to its current head. */
+void
+schedule_file_rev_indexing (FileRevIndex *index, const char *repo_id);
+
+/*
+ * Get the revisions of @path in commits older than @before, or all of
+ * them if @before is 0, newest first.
+ *
+ * Returns -1 if the repo isn't indexed up to @head_id, and schedules its
+ * indexing.
+ */
+int
+file_rev_index_get_revisions (FileRevIndex *index,
+                              const char *repo_id,
+                              const char *head_id,
+                              const char *path,
+                              gint64 before,
+                              GList **revisions);
+
+void
+file_revision_free (FileRevision *rev);
+
+/*
+ * Get the entries deleted after @after as SeafileDeletedEntry objects,
+ * newest first. The same path may be deleted more than once.
+ *
+ * Returns -1 if the repo isn't indexed up to @head_id, or its trash isn't
+ * indexed back to @after.
+ */
+int
+file_rev_index_get_deleted_entries (FileRevIndex *index,
+                                    const char *repo_id,
+                                    const char *head_id,
+                                    gint64 after,
+                                    GList **entries);
+
+/* Remove the index of a repo that's deleted for good. */
+void
+file_rev_index_remove_repo (FileRevIndex *index, const char *repo_id);
+
+#endif
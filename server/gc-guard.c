@@ -0,0 +1,171 @@
+/* -*- Mode: C; tab-width: 4; indent-tabs-mode: nil; c-basic-offset: 4 -*- */
+
+#include "common.h"
+
+#include <pthread.h>
+
+#include "seafile-session.h"
+#include "gc-guard.h"
+
+#define DEBUG_FLAG SEAFILE_DEBUG_OTHER
+#include "log.h"
+
+/*
+ * The stores registered in GCOnlineRun, polled at most every
+ * POLL_INTERVAL seconds rather than queried for each block. An online
+ * GC waits far longer than that before traversing a store it registered.
+ */
+#define POLL_INTERVAL 1
+
+static pthread_mutex_t collected_lock = PTHREAD_MUTEX_INITIALIZER;
+static GHashTable *collected;
+static gint64 last_poll;
+
+static int
+create_tables (SeafDB *db)
+{
+    char *sql;
+
+    switch (seaf_db_type (db)) {
+    case SEAF_DB_TYPE_MYSQL:
+        sql = "CREATE TABLE IF NOT EXISTS GCOnlineRun ("
+            "store_id CHAR(37) PRIMARY KEY, start_time BIGINT)"
+            "ENGINE=INNODB";
+        if (seaf_db_query (db, sql) < 0)
+            return -1;
+
+        sql = "CREATE TABLE IF NOT EXISTS GCRecentBlocks ("
+            "id BIGINT NOT NULL PRIMARY KEY AUTO_INCREMENT, "
+            "store_id CHAR(37), block_id CHAR(41), record_time BIGINT, "
+            "INDEX (store_id, record_time))"
+            "ENGINE=INNODB";
+        if (seaf_db_query (db, sql) < 0)
+            return -1;
+        break;
+    case SEAF_DB_TYPE_SQLITE:
+    case SEAF_DB_TYPE_PGSQL:
+        sql = "CREATE TABLE IF NOT EXISTS GCOnlineRun ("
+            "store_id CHAR(36) PRIMARY KEY, start_time BIGINT)";
+        if (seaf_db_query (db, sql) < 0)
+            return -1;
+
+        sql = "CREATE TABLE IF NOT EXISTS GCRecentBlocks ("
+            "store_id CHAR(36), block_id CHAR(40), record_time BIGINT)";
+        if (seaf_db_query (db, sql) < 0)
+            return -1;
+
+        if (seaf_db_type (db) == SEAF_DB_TYPE_SQLITE) {
+            sql = "CREATE INDEX IF NOT EXISTS gcrecentblocks_store_time_idx "
+                "ON GCRecentBlocks (store_id, record_time)";
+            if (seaf_db_query (db, sql) < 0)
+                return -1;
+        } else if (!pgsql_index_exists (db, "gcrecentblocks_store_time_idx")) {
+            sql = "CREATE INDEX gcrecentblocks_store_time_idx "
+                "ON GCRecentBlocks (store_id, record_time)";
+            if (seaf_db_query (db, sql) < 0)
+                return -1;
+        }
+        break;
+    default:
+        g_return_val_if_reached (-1);
+    }
+
+    return 0;
+}
+
+static gboolean
+add_store (SeafDBRow *row, void *data)
+{
+    GHashTable *stores = data;
+
+    g_hash_table_add (stores, g_strdup (seaf_db_row_get_column_text (row, 0)));
+    return TRUE;
+}
+
+/* Returns 1 if an online GC collects @store_id, 0 if not, -1 on errors. */
+static int
+is_collected (const char *store_id)
+{
+    GHashTable *stores;
+    gint64 now = (gint64)time(NULL);
+    int ret;
+
+    pthread_mutex_lock (&collected_lock);
+
+    if (!collected || now - last_poll >= POLL_INTERVAL) {
+        stores = g_hash_table_new_full (g_str_hash, g_str_equal, g_free, NULL);
+        if (seaf_db_foreach_selected_row (seaf->db,
+                                          "SELECT store_id FROM GCOnlineRun",
+                                          add_store, stores) < 0) {
+            g_hash_table_destroy (stores);
+            pthread_mutex_unlock (&collected_lock);
+            return -1;
+        }
+        if (collected)
+            g_hash_table_destroy (collected);
+        collected = stores;
+        last_poll = now;
+    }
+
+    ret = g_hash_table_contains (collected, store_id) ? 1 : 0;
+
+    pthread_mutex_unlock (&collected_lock);
+    return ret;
+}
+
+int
+gc_guard_record_blocks (const char *store_id,
+                        const char **block_ids,
+                        int n_blocks)
+{
+    SeafDBBatch *batch;
+    gint64 now;
+    int i, ret = 0;
+
+    if (n_blocks <= 0)
+        return 0;
+
+    ret = is_collected (store_id);
+    if (ret <= 0)
+        return ret;
+    ret = 0;
+
+    now = (gint64)time(NULL);
+    batch = seaf_db_batch_new (seaf->db, NULL,
+                               "INSERT INTO GCRecentBlocks (store_id, block_id, "
+                               "record_time) VALUES", NULL, 3);
+    if (!batch)
+        return -1;
+
+    for (i = 0; i < n_blocks && ret == 0; ++i)
+        ret = seaf_db_batch_add_row (batch,
+                                     "string", store_id,
+                                     "string", block_ids[i],
+                                     "int64", now);
+
+    if (seaf_db_batch_finish (batch) < 0)
+        ret = -1;
+
+    if (ret < 0)
+        seaf_warning ("Failed to record blocks of store %.8s for online GC.\n",
+                      store_id);
+    return ret;
+}
+
+/* A block that can't be recorded fails the write, GC could remove it. */
+static int
+on_block_committed (const char *store_id, const char *block_id)
+{
+    return gc_guard_record_blocks (store_id, &block_id, 1);
+}
+
+int
+gc_guard_start (SeafileSession *session)
+{
+    if (create_tables (session->db) < 0)
+        return -1;
+
+    seaf_block_manager_set_commit_hook (session->block_mgr, on_block_committed);
+
+    return 0;
+}
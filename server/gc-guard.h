@@ -0,0 +1,31 @@
+#ifndef GC_GUARD_H
+#define GC_GUARD_H
+
+/*
+ * Lets seafserv-gc collect stores while the server is running.
+ *
+ * An online GC registers the stores it collects in GCOnlineRun, and
+ * waits a grace period before traversing them, so that uploads in
+ * flight when it starts are committed by then. While a store is
+ * registered, the server records in GCRecentBlocks the blocks written
+ * to it, the existing blocks that uploads skip writing and the blocks
+ * reported to clients as already there. GC never removes a recorded
+ * block. A block that can't be recorded fails its write.
+ */
+
+struct _SeafileSession;
+
+int
+gc_guard_start (struct _SeafileSession *session);
+
+/*
+ * Record @block_ids of @store_id if an online GC collects the store.
+ * Returns -1 if they may not be recorded, then they mustn't be
+ * reported as existing.
+ */
+int
+gc_guard_record_blocks (const char *store_id,
+                        const char **block_ids,
+                        int n_blocks);
+
+#endif
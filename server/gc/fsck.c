@@ -1,6 +1,7 @@
 #include "common.h"
 
 #include <fcntl.h>
+#include <pthread.h>
 
 #include "seafile-session.h"
 #include "log.h"
@@ -8,10 +9,44 @@
 
 #include "fsck.h"
 
+/*
+ * A run, shared by the workers, which check one repo each.
+ *
+ * Progress is appended to the checkpoint file "fsck-checkpoint" in the
+ * seafile dir, which is removed once the run completes:
+ *
+ *     repo <repo_id> <head_id> <root_id, or - if not clean>
+ *     dir <store_id> <dir_id>
+ *
+ * A "dir" line is a subtree found clean. It's only written for the top
+ * levels of the tree, since there may be millions of dirs. The root
+ * ids of the repos found clean are kept in "fsck-clean" across runs.
+ */
+typedef struct FsckRun {
+    pthread_mutex_t lock;
+    GList *repo_ids;
+    gboolean repair;
+
+    FILE *checkpoint;
+
+    /* From the checkpoint of an interrupted run, if resumed. */
+    GHashTable *done_repos;     /* repo_id -> "head_id root_id" */
+    GHashTable *done_dirs;      /* "store_id/dir_id" */
+
+    /* Repo roots found clean by the last runs, repo_id -> root_id. */
+    GHashTable *clean_roots;
+    /* Only check the parts of the trees changed since they were clean. */
+    gboolean since;
+} FsckRun;
+
+/* Dirs below this depth aren't checkpointed. */
+#define CHECKPOINT_DIR_DEPTH 3
+
 typedef struct FsckData {
     gboolean repair;
     SeafRepo *repo;
-    GHashTable *existing_blocks;
+    IdSet *existing_blocks;
+    FsckRun *run;
 } FsckData;
 
 typedef enum VerifyType {
@@ -64,11 +99,13 @@ check_blocks (const char *file_id, FsckData *fsck_data, gboolean *io_error)
 {
     Seafile *seafile;
     int i;
-    char *block_id;
+    const char *block_id;
     int ret = 0;
-    int dummy;
+    const char **block_ids = NULL;
+    gboolean *valid = NULL;
+    int n_check = 0;
+    gboolean missing = FALSE;
 
-    gboolean ok = TRUE;
     SeafRepo *repo = fsck_data->repo;
     const char *store_id = repo->store_id;
     int version = repo->version;
@@ -76,57 +113,146 @@ check_blocks (const char *file_id, FsckData *fsck_data, gboolean *io_error)
     seafile = seaf_fs_manager_get_seafile (seaf->fs_mgr, store_id,
                                            version, file_id);
 
+    /* Collect the blocks not checked yet, up to the first missing one,
+     * so that they can be verified in a batch.
+     */
+    block_ids = g_new0 (const char *, seafile->n_blocks);
     for (i = 0; i < seafile->n_blocks; ++i) {
         block_id = seafile->blk_sha1s[i];
 
-        if (g_hash_table_lookup (fsck_data->existing_blocks, block_id))
+        if (id_set_contains (fsck_data->existing_blocks, block_id))
             continue;
 
         if (!seaf_block_manager_block_exists (seaf->block_mgr,
                                               store_id, version,
                                               block_id)) {
             seaf_warning ("Block %s is missing.\n", block_id);
-            ret = -1;
+            missing = TRUE;
             break;
         }
 
-        // check block integrity, if not remove it
-        ok = seaf_block_manager_verify_block (seaf->block_mgr,
-                                              store_id, version,
-                                              block_id, io_error);
-        if (!ok) {
-            if (*io_error) {
-                ret = -1;
-                break;
+        block_ids[n_check++] = block_id;
+    }
+
+    if (n_check == 0)
+        goto out;
+
+    // check block integrity, if not remove it
+    valid = g_new0 (gboolean, n_check);
+    if (seaf_block_manager_verify_blocks (seaf->block_mgr,
+                                          store_id, version,
+                                          block_ids, n_check, valid) < 0) {
+        *io_error = TRUE;
+        ret = -1;
+        goto out;
+    }
+
+    for (i = 0; i < n_check; ++i) {
+        block_id = block_ids[i];
+
+        if (!valid[i]) {
+            if (fsck_data->repair) {
+                seaf_message ("Block %s is corrupted, remove it.\n", block_id);
+                seaf_block_manager_remove_block (seaf->block_mgr,
+                                                 store_id, version,
+                                                 block_id);
             } else {
-                if (fsck_data->repair) {
-                    seaf_message ("Block %s is corrupted, remove it.\n", block_id);
-                    seaf_block_manager_remove_block (seaf->block_mgr,
-                                                     store_id, version,
-                                                     block_id);
-                } else {
-                    seaf_message ("Block %s is corrupted.\n", block_id);
-                }
-                ret = -1;
-                break;
+                seaf_message ("Block %s is corrupted.\n", block_id);
             }
+            ret = -1;
+            break;
         }
 
-        g_hash_table_insert (fsck_data->existing_blocks, g_strdup(block_id), &dummy);
+        id_set_add (fsck_data->existing_blocks, block_id);
     }
 
+out:
+    if (missing)
+        ret = -1;
+    g_free (block_ids);
+    g_free (valid);
     seafile_unref (seafile);
 
     return ret;
 }
 
+static gboolean
+dir_checked (FsckRun *run, const char *store_id, const char *dir_id)
+{
+    char key[80];
+
+    if (!run->done_dirs)
+        return FALSE;
+
+    snprintf (key, sizeof(key), "%s/%s", store_id, dir_id);
+    return g_hash_table_lookup (run->done_dirs, key) != NULL;
+}
+
+static void
+checkpoint_dir (FsckRun *run, const char *store_id, const char *dir_id)
+{
+    pthread_mutex_lock (&run->lock);
+    if (run->checkpoint) {
+        fprintf (run->checkpoint, "dir %s %s\n", store_id, dir_id);
+        fflush (run->checkpoint);
+    }
+    pthread_mutex_unlock (&run->lock);
+}
+
+static int
+path_depth (const char *path)
+{
+    int depth = 0;
+
+    for (; *path; ++path) {
+        if (*path == '/')
+            ++depth;
+    }
+    return depth;
+}
+
+/* Names of the entries of @old_id, the dir at the same path in the root
+ * last found clean, to their ids and modes.
+ */
+static GHashTable *
+load_old_entries (SeafFSManager *mgr, const char *store_id, int version,
+                  const char *old_id)
+{
+    SeafDir *old_dir;
+    GHashTable *entries;
+    GList *p;
+    SeafDirent *dent;
+
+    old_dir = seaf_fs_manager_get_seafdir (mgr, store_id, version, old_id);
+    if (!old_dir)
+        return NULL;
+
+    entries = g_hash_table_new_full (g_str_hash, g_str_equal,
+                                     g_free, (GDestroyNotify)seaf_dirent_free);
+    for (p = old_dir->entries; p; p = p->next) {
+        dent = p->data;
+        g_hash_table_replace (entries, g_strdup (dent->name),
+                              seaf_dirent_dup (dent));
+    }
+    seaf_dir_free (old_dir);
+
+    return entries;
+}
+
+/*
+ * @old_id is the dir at the same path in the root last found clean, for
+ * --since, or NULL. Entries that didn't change from it aren't checked.
+ */
 static char*
-fsck_check_dir_recursive (const char *id, const char *parent_dir, FsckData *fsck_data)
+fsck_check_dir_recursive (const char *id, const char *old_id,
+                          const char *parent_dir, FsckData *fsck_data)
 {
     SeafDir *dir;
     SeafDir *new_dir;
     GList *p;
     SeafDirent *seaf_dent;
+    SeafDirent *old_dent;
+    GHashTable *old_entries = NULL;
     char *dir_id = NULL;
     char *path = NULL;
     gboolean io_error = FALSE;
@@ -136,13 +262,30 @@ fsck_check_dir_recursive (const char *id, const char *parent_dir, FsckData *fsck
     int version = fsck_data->repo->version;
     gboolean is_corrupted = FALSE;
 
+    if ((old_id && strcmp (old_id, id) == 0) ||
+        dir_checked (fsck_data->run, store_id, id))
+        return g_strdup (id);
+
     dir = seaf_fs_manager_get_seafdir (mgr, store_id, version, id);
 
+    if (old_id)
+        old_entries = load_old_entries (mgr, store_id, version, old_id);
+
     for (p = dir->entries; p; p = p->next) {
         seaf_dent = p->data;
         io_error = FALSE;
 
+        old_dent = NULL;
+        if (old_entries) {
+            old_dent = g_hash_table_lookup (old_entries, seaf_dent->name);
+            if (old_dent && old_dent->mode != seaf_dent->mode)
+                old_dent = NULL;
+        }
+
         if (S_ISREG(seaf_dent->mode)) {
+            if (old_dent && strcmp (old_dent->id, seaf_dent->id) == 0)
+                continue;
+
             path = g_strdup_printf ("%s%s", parent_dir, seaf_dent->name);
             if (!path) {
                 seaf_warning ("Out of memory, stop to run fsck for repo %.8s.\n",
@@ -188,6 +331,8 @@ fsck_check_dir_recursive (const char *id, const char *parent_dir, FsckData *fsck
             }
             g_free (path);
         } else if (S_ISDIR(seaf_dent->mode)) {
+            if (old_dent && strcmp (old_dent->id, seaf_dent->id) == 0)
+                continue;
             path = g_strdup_printf ("%s%s/", parent_dir, seaf_dent->name);
             if (!path) {
                 seaf_warning ("Out of memory, stop to run fsck for repo %.8s.\n",
@@ -212,7 +357,9 @@ fsck_check_dir_recursive (const char *id, const char *parent_dir, FsckData *fsck
                 // dir corrupted, set it empty
                 memcpy (seaf_dent->id, EMPTY_SHA1, 40);
             } else {
-               dir_id = fsck_check_dir_recursive (seaf_dent->id, path, fsck_data);
+               dir_id = fsck_check_dir_recursive (seaf_dent->id,
+                                                  old_dent ? old_dent->id : NULL,
+                                                  path, fsck_data);
                if (dir_id == NULL) {
                    // IO error
                    g_free (path);
@@ -239,10 +386,14 @@ fsck_check_dir_recursive (const char *id, const char *parent_dir, FsckData *fsck
         dir->entries = NULL;
     } else {
         dir_id = g_strdup (dir->dir_id);
+        if (path_depth (parent_dir) <= CHECKPOINT_DIR_DEPTH)
+            checkpoint_dir (fsck_data->run, store_id, dir_id);
     }
 
 out:
     seaf_dir_free (dir);
+    if (old_entries)
+        g_hash_table_destroy (old_entries);
 
     if (io_error) {
         seaf_message ("IO error, stop to run fsck for repo %.8s.\n",
@@ -399,14 +550,34 @@ out:
     return repo;
 }
 
+static void
+checkpoint_repo (FsckRun *run, const char *repo_id, const char *head_id,
+                 const char *clean_root)
+{
+    pthread_mutex_lock (&run->lock);
+    if (run->checkpoint) {
+        fprintf (run->checkpoint, "repo %s %s %s\n",
+                 repo_id, head_id, clean_root ? clean_root : "-");
+        fflush (run->checkpoint);
+    }
+    if (clean_root)
+        g_hash_table_replace (run->clean_roots,
+                              g_strdup (repo_id), g_strdup (clean_root));
+    else
+        g_hash_table_remove (run->clean_roots, repo_id);
+    pthread_mutex_unlock (&run->lock);
+}
+
 /*
  * check and recover repo, for corrupted file or folder set it empty
  */
 static void
-check_and_recover_repo (SeafRepo *repo, gboolean reset, gboolean repair)
+check_and_recover_repo (SeafRepo *repo, gboolean reset, gboolean repair,
+                        FsckRun *run)
 {
     FsckData fsck_data;
     SeafCommit *rep_commit;
+    const char *old_root = NULL;
 
     seaf_message ("Checking file system integrity of repo %s(%.8s)...\n",
                   repo->name, repo->id);
@@ -417,13 +588,32 @@ check_and_recover_repo (SeafRepo *repo, gboolean reset, gboolean repair)
     memset (&fsck_data, 0, sizeof(fsck_data));
     fsck_data.repair = repair;
     fsck_data.repo = repo;
-    fsck_data.existing_blocks = g_hash_table_new_full (g_str_hash, g_str_equal,
-                                                       g_free, NULL);
+    fsck_data.existing_blocks = id_set_new ();
+    fsck_data.run = run;
+
+    /* Only this worker changes the entry of the repo. */
+    if (run->since && !reset) {
+        pthread_mutex_lock (&run->lock);
+        old_root = g_hash_table_lookup (run->clean_roots, repo->id);
+        pthread_mutex_unlock (&run->lock);
+        if (old_root && strcmp (old_root, rep_commit->root_id) == 0)
+            seaf_message ("Repo %.8s is unchanged since it was last clean.\n",
+                          repo->id);
+    }
 
-    char *root_id = fsck_check_dir_recursive (rep_commit->root_id, "/", &fsck_data);
-    g_hash_table_destroy (fsck_data.existing_blocks);
-    if (root_id == NULL)
+    char *root_id = fsck_check_dir_recursive (rep_commit->root_id, old_root,
+                                              "/", &fsck_data);
+    id_set_free (fsck_data.existing_blocks);
+    if (root_id == NULL) {
+        seaf_commit_unref (rep_commit);
         return;
+    }
+
+    /* Before a repair moves the head. */
+    if (!reset && strcmp (root_id, rep_commit->root_id) == 0)
+        checkpoint_repo (run, repo->id, repo->head->commit_id, root_id);
+    else
+        checkpoint_repo (run, repo->id, repo->head->commit_id, NULL);
 
     if (repair) {
         if (strcmp (root_id, rep_commit->root_id) != 0) {
@@ -520,85 +710,275 @@ enable_sync_repos (GList *repo_id_list)
     }
 }
 
+/* Whether the interrupted run being resumed checked @repo at its head. */
+static gboolean
+repo_checked (FsckRun *run, SeafRepo *repo)
+{
+    const char *done;
+
+    if (!run->done_repos)
+        return FALSE;
+
+    done = g_hash_table_lookup (run->done_repos, repo->id);
+    return done && strncmp (done, repo->head->commit_id, 40) == 0;
+}
+
 static void
-repair_repos (GList *repo_id_list, gboolean repair)
+fsck_repo (FsckRun *run, const char *repo_id)
 {
-    GList *ptr;
-    char *repo_id;
     SeafRepo *repo;
     gboolean exists;
     gboolean reset;
     gboolean io_error;
+    gboolean repair = run->repair;
 
-    for (ptr = repo_id_list; ptr; ptr = ptr->next) {
-        reset = FALSE;
-        repo_id = ptr->data;
+    reset = FALSE;
 
-        seaf_message ("Running fsck for repo %s.\n", repo_id);
+    seaf_message ("Running fsck for repo %s.\n", repo_id);
 
-        if (!is_uuid_valid (repo_id)) {
-            seaf_warning ("Invalid repo id %s.\n", repo_id);
-            goto next;
-        }
+    if (!is_uuid_valid (repo_id)) {
+        seaf_warning ("Invalid repo id %s.\n", repo_id);
+        goto next;
+    }
 
-        exists = seaf_repo_manager_repo_exists (seaf->repo_mgr, repo_id);
-        if (!exists) {
-            seaf_warning ("Repo %.8s doesn't exist.\n", repo_id);
-            goto next;
-        }
+    exists = seaf_repo_manager_repo_exists (seaf->repo_mgr, repo_id);
+    if (!exists) {
+        seaf_warning ("Repo %.8s doesn't exist.\n", repo_id);
+        goto next;
+    }
 
-        repo = seaf_repo_manager_get_repo (seaf->repo_mgr, repo_id);
+    repo = seaf_repo_manager_get_repo (seaf->repo_mgr, repo_id);
 
+    if (!repo) {
+        seaf_message ("Repo %.8s HEAD commit is corrupted, "
+                      "need to restore to an old version.\n", repo_id);
+        repo = get_available_repo (repo_id, repair);
         if (!repo) {
-            seaf_message ("Repo %.8s HEAD commit is corrupted, "
-                          "need to restore to an old version.\n", repo_id);
-            repo = get_available_repo (repo_id, repair);
-            if (!repo) {
+            goto next;
+        }
+        reset = TRUE;
+    } else {
+        SeafCommit *commit = seaf_commit_manager_get_commit (seaf->commit_mgr, repo->id,
+                                                             repo->version,
+                                                             repo->head->commit_id);
+        io_error = FALSE;
+        if (!fsck_verify_seafobj (repo->store_id, repo->version,
+                                  commit->root_id,  &io_error,
+                                  VERIFY_DIR, repair)) {
+            if (io_error) {
+                seaf_warning ("IO error, stop to run fsck for repo %s(%.8s).\n",
+                              repo->id, repo->name);
+                seaf_commit_unref (commit);
+                seaf_repo_unref (repo);
                 goto next;
-            }
-            reset = TRUE;
-        } else {
-            SeafCommit *commit = seaf_commit_manager_get_commit (seaf->commit_mgr, repo->id,
-                                                                 repo->version,
-                                                                 repo->head->commit_id);
-            io_error = FALSE;
-            if (!fsck_verify_seafobj (repo->store_id, repo->version,
-                                      commit->root_id,  &io_error,
-                                      VERIFY_DIR, repair)) {
-                if (io_error) {
-                    seaf_warning ("IO error, stop to run fsck for repo %s(%.8s).\n",
-                                  repo->id, repo->name);
-                    seaf_commit_unref (commit);
-                    seaf_repo_unref (repo);
-                    goto next;
-                } else {
-                    // root fs object is corrupted, get available commit
-                    seaf_message ("Repo %.8s HEAD commit is corrupted, "
-                                  "need to restore to an old version.\n", repo_id);
-                    seaf_commit_unref (commit);
-                    seaf_repo_unref (repo);
-                    repo = get_available_repo (repo_id, repair);
-                    if (!repo) {
-                        goto next;
-                    }
-                    reset = TRUE;
-                }
             } else {
-                // head commit is available
+                // root fs object is corrupted, get available commit
+                seaf_message ("Repo %.8s HEAD commit is corrupted, "
+                              "need to restore to an old version.\n", repo_id);
                 seaf_commit_unref (commit);
+                seaf_repo_unref (repo);
+                repo = get_available_repo (repo_id, repair);
+                if (!repo) {
+                    goto next;
+                }
+                reset = TRUE;
             }
+        } else {
+            // head commit is available
+            seaf_commit_unref (commit);
         }
+    }
 
-        check_and_recover_repo (repo, reset, repair);
-
+    if (!reset && repo_checked (run, repo)) {
+        seaf_message ("Repo %.8s was checked before the interruption.\n",
+                      repo_id);
         seaf_repo_unref (repo);
+        goto next;
+    }
+
+    check_and_recover_repo (repo, reset, repair, run);
+
+    seaf_repo_unref (repo);
 next:
-        seaf_message ("Fsck finished for repo %.8s.\n\n", repo_id);
+    seaf_message ("Fsck finished for repo %.8s.\n\n", repo_id);
+}
+
+static void *
+fsck_worker (void *vrun)
+{
+    FsckRun *run = vrun;
+    char *repo_id;
+
+    while (1) {
+        pthread_mutex_lock (&run->lock);
+        repo_id = NULL;
+        if (run->repo_ids) {
+            repo_id = run->repo_ids->data;
+            run->repo_ids = run->repo_ids->next;
+        }
+        pthread_mutex_unlock (&run->lock);
+
+        if (!repo_id)
+            break;
+
+        fsck_repo (run, repo_id);
+    }
+
+    return NULL;
+}
+
+static GHashTable *
+load_clean_roots (const char *path)
+{
+    GHashTable *roots = g_hash_table_new_full (g_str_hash, g_str_equal,
+                                               g_free, g_free);
+    char line[256];
+    char **parts;
+    FILE *fp;
+
+    fp = g_fopen (path, "r");
+    if (!fp)
+        return roots;
+
+    while (fgets (line, sizeof(line), fp)) {
+        g_strchomp (line);
+        parts = g_strsplit (line, " ", 0);
+        if (g_strv_length (parts) == 2)
+            g_hash_table_replace (roots, g_strdup(parts[0]), g_strdup(parts[1]));
+        g_strfreev (parts);
+    }
+    fclose (fp);
+
+    return roots;
+}
+
+static void
+save_clean_roots (GHashTable *roots, const char *path)
+{
+    char *tmp_path = g_strconcat (path, ".tmp", NULL);
+    GHashTableIter iter;
+    gpointer key, value;
+    FILE *fp;
+
+    fp = g_fopen (tmp_path, "w");
+    if (!fp) {
+        seaf_warning ("Failed to open %s: %s.\n", tmp_path, strerror(errno));
+        g_free (tmp_path);
+        return;
+    }
+
+    g_hash_table_iter_init (&iter, roots);
+    while (g_hash_table_iter_next (&iter, &key, &value))
+        fprintf (fp, "%s %s\n", (char *)key, (char *)value);
+
+    if (fclose (fp) != 0 || g_rename (tmp_path, path) < 0)
+        seaf_warning ("Failed to save %s: %s.\n", path, strerror(errno));
+    g_free (tmp_path);
+}
+
+/* Load the repos and dirs done by an interrupted run. */
+static void
+load_checkpoint (FsckRun *run, const char *path)
+{
+    char line[256];
+    char **parts;
+    FILE *fp;
+
+    run->done_repos = g_hash_table_new_full (g_str_hash, g_str_equal,
+                                             g_free, g_free);
+    run->done_dirs = g_hash_table_new_full (g_str_hash, g_str_equal,
+                                            g_free, NULL);
+
+    fp = g_fopen (path, "r");
+    if (!fp)
+        return;
+
+    while (fgets (line, sizeof(line), fp)) {
+        g_strchomp (line);
+        parts = g_strsplit (line, " ", 0);
+        if (g_strv_length (parts) == 4 && strcmp (parts[0], "repo") == 0) {
+            g_hash_table_replace (run->done_repos, g_strdup(parts[1]),
+                                  g_strdup_printf ("%s %s", parts[2], parts[3]));
+            /* The clean roots are saved at the end of a run. */
+            if (strcmp (parts[3], "-") != 0)
+                g_hash_table_replace (run->clean_roots, g_strdup(parts[1]),
+                                      g_strdup(parts[3]));
+            else
+                g_hash_table_remove (run->clean_roots, parts[1]);
+        } else if (g_strv_length (parts) == 3 && strcmp (parts[0], "dir") == 0) {
+            g_hash_table_replace (run->done_dirs,
+                                  g_strdup_printf ("%s/%s", parts[1], parts[2]),
+                                  GINT_TO_POINTER(1));
+        }
+        g_strfreev (parts);
     }
+    fclose (fp);
+
+    seaf_message ("Resuming fsck, %u repos were checked.\n",
+                  g_hash_table_size (run->done_repos));
+}
+
+static void
+repair_repos (GList *repo_id_list, gboolean repair, FsckOptions *options)
+{
+    FsckRun run;
+    char *checkpoint_path, *clean_path;
+    pthread_t *workers;
+    int n_workers = MAX (options->n_workers, 1);
+    int i, n_started;
+
+    checkpoint_path = g_build_filename (seaf->seaf_dir, "fsck-checkpoint", NULL);
+    clean_path = g_build_filename (seaf->seaf_dir, "fsck-clean", NULL);
+
+    memset (&run, 0, sizeof(run));
+    pthread_mutex_init (&run.lock, NULL);
+    run.repo_ids = repo_id_list;
+    run.repair = repair;
+    run.since = options->since;
+    run.clean_roots = load_clean_roots (clean_path);
+
+    if (options->resume)
+        load_checkpoint (&run, checkpoint_path);
+
+    run.checkpoint = g_fopen (checkpoint_path, options->resume ? "a" : "w");
+    if (!run.checkpoint)
+        seaf_warning ("Failed to open %s: %s. The progress won't be saved.\n",
+                      checkpoint_path, strerror(errno));
+
+    /* The current thread is a worker too. */
+    workers = g_new0 (pthread_t, n_workers);
+    for (n_started = 0; n_started < n_workers - 1; ++n_started) {
+        if (pthread_create (&workers[n_started], NULL, fsck_worker, &run) != 0) {
+            seaf_warning ("Failed to start fsck worker: %s.\n", strerror(errno));
+            break;
+        }
+    }
+    fsck_worker (&run);
+    for (i = 0; i < n_started; ++i)
+        pthread_join (workers[i], NULL);
+    g_free (workers);
+
+    save_clean_roots (run.clean_roots, clean_path);
+
+    /* All repos are done. */
+    if (run.checkpoint) {
+        fclose (run.checkpoint);
+        g_unlink (checkpoint_path);
+    }
+
+    g_hash_table_destroy (run.clean_roots);
+    if (run.done_repos)
+        g_hash_table_destroy (run.done_repos);
+    if (run.done_dirs)
+        g_hash_table_destroy (run.done_dirs);
+    pthread_mutex_destroy (&run.lock);
+    g_free (checkpoint_path);
+    g_free (clean_path);
 }
 
 int
-seaf_fsck (GList *repo_id_list, gboolean repair, gboolean esync)
+seaf_fsck (GList *repo_id_list, gboolean repair, gboolean esync,
+           FsckOptions *options)
 {
     if (!repo_id_list)
         repo_id_list = seaf_repo_manager_get_repo_id_list (seaf->repo_mgr);
@@ -606,7 +986,7 @@ seaf_fsck (GList *repo_id_list, gboolean repair, gboolean esync)
     if (esync) {
         enable_sync_repos (repo_id_list);
     } else {
-        repair_repos (repo_id_list, repair);
+        repair_repos (repo_id_list, repair, options);
     }
 
     while (repo_id_list) {
@@ -730,11 +1110,37 @@ out:
     return ret;
 }*/
 
+static int
+write_at (int fd, const char *buf, int len, gint64 offset)
+{
+#ifndef WIN32
+    ssize_t n;
+    int done = 0;
+
+    while (done < len) {
+        n = pwrite (fd, buf + done, len - done, (off_t)(offset + done));
+        if (n < 0) {
+            if (errno == EINTR)
+                continue;
+            return -1;
+        }
+        done += n;
+    }
+    return done;
+#else
+    if (lseek (fd, (off_t)offset, SEEK_SET) < 0)
+        return -1;
+    return writen (fd, buf, len);
+#endif
+}
+
+/* Write the block at @offset, and move @offset past it. */
 static gboolean
 write_nonenc_block_to_file (const char *repo_id,
                             int version,
                             const char *block_id,
                             int fd,
+                            gint64 *offset,
                             const char *path)
 {
     BlockHandle *handle;
@@ -759,12 +1165,13 @@ write_nonenc_block_to_file (const char *repo_id,
             break;
         }
 
-        if (writen (fd, buf, n) != n) {
+        if (write_at (fd, buf, n, *offset) != n) {
             seaf_warning ("Failed to write block %s to file %s.\n",
                           block_id, path);
             ret = FALSE;
             break;
         }
+        *offset += n;
     }
 
     seaf_block_manager_close_block (seaf->block_mgr, handle);
@@ -773,7 +1180,8 @@ write_nonenc_block_to_file (const char *repo_id,
     return ret;
 }
 
-static void
+/* Returns the bytes written, or -1 if the file isn't exported. */
+static gint64
 create_file (const char *repo_id,
              const char *file_id,
              const char *path)
@@ -784,11 +1192,12 @@ create_file (const char *repo_id,
     Seafile *seafile;
     gboolean ret = TRUE;
     int version = 1;
+    gint64 offset = 0;
 
     fd = g_open (path, O_CREAT | O_WRONLY | O_BINARY, 0666);
     if (fd < 0) {
         seaf_warning ("Open file %s failed: %s.\n", path, strerror (errno));
-        return;
+        return -1;
     }
 
     seafile = seaf_fs_manager_get_seafile (seaf->fs_mgr, repo_id,
@@ -798,11 +1207,17 @@ create_file (const char *repo_id,
         goto out;
     }
 
+#ifdef __linux__
+    /* Keep the file contiguous while other files are written. */
+    if (seafile->file_size > 0)
+        posix_fallocate (fd, 0, (off_t)seafile->file_size);
+#endif
+
     for (i = 0; i < seafile->n_blocks; ++i) {
         block_id = seafile->blk_sha1s[i];
 
         ret = write_nonenc_block_to_file (repo_id, version, block_id,
-                                          fd, path);
+                                          fd, &offset, path);
         if (!ret) {
             break;
         }
@@ -819,10 +1234,75 @@ out:
         seaf_message ("Export file %s.\n", path);
     }
     seafile_unref (seafile);
+
+    return ret ? offset : -1;
+}
+
+/* Files of the repo being exported are written by a pool of workers,
+ * while the dirs are created as they are traversed.
+ */
+typedef struct ExportRun {
+    const char *repo_id;
+    GThreadPool *pool;
+
+    pthread_mutex_t lock;
+    guint64 n_files;
+    guint64 n_failed;
+    guint64 bytes;
+    gint64 start_time;
+    gint64 last_report;
+} ExportRun;
+
+typedef struct ExportJob {
+    char *file_id;
+    char *path;
+} ExportJob;
+
+#define EXPORT_REPORT_INTERVAL 10   /* seconds */
+
+static void
+report_export_progress (ExportRun *run, gboolean finished)
+{
+    gint64 elapsed = MAX ((gint64)time(NULL) - run->start_time, 1);
+
+    seaf_message ("%s %"G_GUINT64_FORMAT" files (%"G_GUINT64_FORMAT" failed), "
+                  "%"G_GUINT64_FORMAT" MB of repo %.8s, %.1f MB/s.\n",
+                  finished ? "Exported" : "Exporting, done",
+                  run->n_files, run->n_failed, run->bytes >> 20,
+                  run->repo_id, (double)run->bytes / (1 << 20) / elapsed);
+}
+
+static void
+export_file_job (gpointer vjob, gpointer vrun)
+{
+    ExportJob *job = vjob;
+    ExportRun *run = vrun;
+    gint64 bytes;
+    gint64 now;
+
+    bytes = create_file (run->repo_id, job->file_id, job->path);
+
+    pthread_mutex_lock (&run->lock);
+    ++run->n_files;
+    if (bytes < 0)
+        ++run->n_failed;
+    else
+        run->bytes += bytes;
+
+    now = (gint64)time(NULL);
+    if (now - run->last_report >= EXPORT_REPORT_INTERVAL) {
+        run->last_report = now;
+        report_export_progress (run, FALSE);
+    }
+    pthread_mutex_unlock (&run->lock);
+
+    g_free (job->file_id);
+    g_free (job->path);
+    g_free (job);
 }
 
 static void
-export_repo_files_recursive (const char *repo_id,
+export_repo_files_recursive (ExportRun *run,
                              const char *id,
                              const char *parent_dir)
 {
@@ -830,8 +1310,10 @@ export_repo_files_recursive (const char *repo_id,
     GList *p;
     SeafDirent *seaf_dent;
     char *path;
+    ExportJob *job;
 
     SeafFSManager *mgr = seaf->fs_mgr;
+    const char *repo_id = run->repo_id;
     int version = 1;
 
     dir = seaf_fs_manager_get_seafdir (mgr, repo_id, version, id);
@@ -845,7 +1327,11 @@ export_repo_files_recursive (const char *repo_id,
 
         if (S_ISREG(seaf_dent->mode)) {
             // create file
-            create_file (repo_id, seaf_dent->id, path);
+            job = g_new0 (ExportJob, 1);
+            job->file_id = g_strdup (seaf_dent->id);
+            job->path = path;
+            g_thread_pool_push (run->pool, job, NULL);
+            continue;
         } else if (S_ISDIR(seaf_dent->mode)) {
             if (g_mkdir (path, 0777) < 0) {
                 seaf_warning ("Failed to mkdir %s: %s.\n", path,
@@ -856,7 +1342,7 @@ export_repo_files_recursive (const char *repo_id,
                 seaf_message ("Export dir %s.\n", path);
             }
 
-            export_repo_files_recursive (repo_id, seaf_dent->id, path);
+            export_repo_files_recursive (run, seaf_dent->id, path);
         }
         g_free (path);
     }
@@ -937,8 +1423,11 @@ get_available_commit (const char *repo_id)
 void
 export_repo_files (const char *repo_id,
                    const char *init_path,
-                   GHashTable *enc_repos)
+                   GHashTable *enc_repos,
+                   int n_workers)
 {
+    ExportRun run;
+
     SeafCommit *commit = get_available_commit (repo_id);
     if (!commit) {
         return;
@@ -966,7 +1455,19 @@ export_repo_files (const char *repo_id,
         return;
     }
 
-    export_repo_files_recursive (repo_id, commit->root_id, export_path);
+    memset (&run, 0, sizeof(run));
+    run.repo_id = repo_id;
+    pthread_mutex_init (&run.lock, NULL);
+    run.start_time = run.last_report = (gint64)time(NULL);
+    run.pool = g_thread_pool_new (export_file_job, &run,
+                                  MAX (n_workers, 1), FALSE, NULL);
+
+    export_repo_files_recursive (&run, commit->root_id, export_path);
+
+    /* Wait for the files still being written. */
+    g_thread_pool_free (run.pool, FALSE, TRUE);
+    report_export_progress (&run, TRUE);
+    pthread_mutex_destroy (&run.lock);
 
     seaf_message ("Finish exporting files for repo %.8s.\n\n", repo_id);
 
@@ -1009,7 +1510,8 @@ print_enc_repo (gpointer key, gpointer value, gpointer user_data)
 }
 
 void
-export_file (GList *repo_id_list, const char *seafile_dir, char *export_path)
+export_file (GList *repo_id_list, const char *seafile_dir, char *export_path,
+             int n_workers)
 {
     struct stat dir_st;
 
@@ -1051,7 +1553,7 @@ export_file (GList *repo_id_list, const char *seafile_dir, char *export_path)
             continue;
         }
 
-        export_repo_files (repo_id, export_path, enc_repos);
+        export_repo_files (repo_id, export_path, enc_repos, n_workers);
     }
 
     if (g_hash_table_size (enc_repos) > 0) {
@@ -1,9 +1,21 @@
 #ifndef SEAF_FSCK_H
 #define SEAF_FSCK_H
 
+typedef struct FsckOptions {
+    /* Repos checked at the same time. */
+    int n_workers;
+    /* Skip what the interrupted last run checked. */
+    gboolean resume;
+    /* Only check what changed since a repo was last found clean. */
+    gboolean since;
+} FsckOptions;
+
 int
-seaf_fsck (GList *repo_id_list, gboolean repair, gboolean esync);
+seaf_fsck (GList *repo_id_list, gboolean repair, gboolean esync,
+           FsckOptions *options);
 
-void export_file (GList *repo_id_list, const char *seafile_dir, char *export_path);
+/* Export the files of the repos, written by @n_workers threads. */
+void export_file (GList *repo_id_list, const char *seafile_dir, char *export_path,
+                  int n_workers);
 
 #endif
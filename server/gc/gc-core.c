@@ -2,56 +2,110 @@
 
 #include "common.h"
 
+#include <pthread.h>
+#include <jansson.h>
+
 #include "seafile-session.h"
-#include "bloom-filter.h"
+#include "gc-index.h"
+#include "gc-refcount.h"
 #include "gc-core.h"
 #include "utils.h"
 
 #define DEBUG_FLAG SEAFILE_DEBUG_OTHER
 #include "log.h"
 
-#define MAX_BF_SIZE (((size_t)1) << 29)   /* 64 MB */
+/* Block counts of the store being collected. */
+typedef struct GCStats {
+    /* Total number of blocks to be scanned. */
+    guint64 total_blocks;
+    guint64 removed_blocks;
+    guint64 reachable_blocks;
+    /* Garbage kept because the server recorded it during online GC. */
+    guint64 recent_blocks;
+    /* Garbage other stores still have, see [block_backend] dedup. */
+    guint64 shared_blocks;
+    /* The oldest ctime of the history kept by the truncate times, see
+     * traverse_commit().
+     */
+    gint64 next_expire;
+} GCStats;
+
+/*
+ * Limits the fs objects read and blocks removed per second, summed over
+ * all the stores collected at the same time.
+ */
+typedef struct IOThrottle {
+    pthread_mutex_t lock;
+    int ops_per_sec;            /* 0 for no limit */
+    gint64 window_start;
+    int ops;
+} IOThrottle;
+
+static IOThrottle io_throttle = { PTHREAD_MUTEX_INITIALIZER, 0, 0, 0 };
 
-/* Total number of blocks to be scanned. */
-static guint64 total_blocks;
-static guint64 removed_blocks;
-static guint64 reachable_blocks;
+static GCIndexMode index_mode = GC_INDEX_BLOOM;
+static double index_fp_rate = 0.01;
+
+static int full_scan = 0;
+
+/* Find live blocks from reference counts, see gc-refcount.h. */
+static int refcount_mode = 0;
+static int check_refcount = 0;
+
+/* Online GC, see server/gc-guard.h. */
+static int online_gc = 0;
+#define DEFAULT_ONLINE_GRACE_PERIOD 3600
 
 /*
- * The number of bits in the bloom filter is 4 times the number of all blocks.
- * Let m be the bits in the bf, n be the number of blocks to be added to the bf
- * (the number of live blocks), and k = 3 (closed to optimal for m/n = 4),
- * the probability of false-positive is
- *
- *     p = (1 - e^(-kn/m))^k = 0.15
- *
- * Because m = 4 * total_blocks >= 4 * (live blocks) = 4n, we should have p <= 0.15.
- * Put it another way, we'll clean up at least 85% dead blocks in each gc operation.
- * See http://en.wikipedia.org/wiki/Bloom_filter.
- *
- * Supose we have 8TB space, and the avg block size is 1MB, we'll have 8M blocks, then
- * the size of bf is (8M * 4)/8 = 4MB.
- *
- * If total_blocks is a small number (e.g. < 100), we should try to clean all dead blocks.
- * So we set the minimal size of the bf to 1KB.
+ * Estimate mode only indexes and scans the blocks under a sample of the
+ * 256 id prefixes. Block ids are uniform, so the sample scales up to
+ * the whole store.
  */
-static Bloom *
-alloc_gc_index ()
+static int estimate_mode = 0;
+static gboolean sample_prefixes[256];
+static int n_sample_prefixes = 0;
+#define DEFAULT_SAMPLE_PREFIXES 16
+
+/* Stores marked by the history pruner, which are unmarked once collected. */
+static int pruned_mode = 0;
+
+/* Commits older than this are packed after GC, 0 to keep them loose. */
+static int pack_commits_days = 0;
+#define DEFAULT_PACK_COMMITS_DAYS 30
+
+static void
+throttle_io ()
 {
-    size_t size;
+    gint64 now, wait;
 
-    size = (size_t) MAX(total_blocks << 2, 1 << 13);
-    size = MIN (size, MAX_BF_SIZE);
+    if (io_throttle.ops_per_sec <= 0)
+        return;
 
-    seaf_message ("GC index size is %u Byte.\n", (int)size >> 3);
+    pthread_mutex_lock (&io_throttle.lock);
+    while (1) {
+        now = get_current_time ();
+        if (now - io_throttle.window_start >= G_USEC_PER_SEC) {
+            io_throttle.window_start = now;
+            io_throttle.ops = 0;
+        }
+        if (io_throttle.ops < io_throttle.ops_per_sec)
+            break;
 
-    return bloom_create (size, 3, 0);
+        wait = io_throttle.window_start + G_USEC_PER_SEC - now;
+        pthread_mutex_unlock (&io_throttle.lock);
+        g_usleep (wait);
+        pthread_mutex_lock (&io_throttle.lock);
+    }
+    ++io_throttle.ops;
+    pthread_mutex_unlock (&io_throttle.lock);
 }
 
 typedef struct {
     SeafRepo *repo;
-    Bloom *index;
-    GHashTable *visited;
+    GCIndex *index;
+    FSVisitedSet *visited;
+    /* Protects index and the counters from the traverse threads. */
+    pthread_mutex_t lock;
 
     /* > 0: keep a period of history;
      * == 0: only keep data in head commit;
@@ -59,6 +113,7 @@ typedef struct {
      */
     gint64 truncate_time;
     gboolean traversed_head;
+    gint64 next_expire;
 
     int traversed_commits;
     gint64 traversed_blocks;
@@ -67,11 +122,21 @@ typedef struct {
     gint64 traversed_fs_objs;
 } GCData;
 
+static gboolean
+is_sampled (const char *block_id)
+{
+    unsigned char first;
+
+    if (hex_to_rawdata (block_id, &first, 1) < 0)
+        return FALSE;
+    return sample_prefixes[first];
+}
+
 static int
 add_blocks_to_index (SeafFSManager *mgr, GCData *data, const char *file_id)
 {
     SeafRepo *repo = data->repo;
-    Bloom *index = data->index;
+    GCIndex *index = data->index;
     Seafile *seafile;
     int i;
 
@@ -81,10 +146,14 @@ add_blocks_to_index (SeafFSManager *mgr, GCData *data, const char *file_id)
         return -1;
     }
 
+    pthread_mutex_lock (&data->lock);
     for (i = 0; i < seafile->n_blocks; ++i) {
-        bloom_add (index, seafile->blk_sha1s[i]);
         ++data->traversed_blocks;
+        if (estimate_mode && !is_sampled (seafile->blk_sha1s[i]))
+            continue;
+        gc_index_add (index, seafile->blk_sha1s[i]);
     }
+    pthread_mutex_unlock (&data->lock);
 
     seafile_unref (seafile);
 
@@ -102,17 +171,11 @@ fs_callback (SeafFSManager *mgr,
 {
     GCData *data = user_data;
 
-    if (data->visited != NULL) {
-        if (g_hash_table_lookup (data->visited, obj_id) != NULL) {
-            *stop = TRUE;
-            return TRUE;
-        }
-
-        char *key = g_strdup(obj_id);
-        g_hash_table_replace (data->visited, key, key);
-    }
+    throttle_io ();
 
+    pthread_mutex_lock (&data->lock);
     ++(data->traversed_fs_objs);
+    pthread_mutex_unlock (&data->lock);
 
     if (type == SEAF_METADATA_TYPE_FILE &&
         add_blocks_to_index (mgr, data, obj_id) < 0)
@@ -143,6 +206,13 @@ traverse_commit (SeafCommit *commit, void *vdata, gboolean *stop)
          */
         *stop = TRUE;
     }
+    else if (data->truncate_time > 0 && data->traversed_head)
+    {
+        /* Once truncate_time passes this commit, its parents are
+         * no longer traversed and their blocks may become garbage.
+         */
+        data->next_expire = MIN (data->next_expire, (gint64)commit->ctime);
+    }
 
     if (!data->traversed_head)
         data->traversed_head = TRUE;
@@ -154,11 +224,13 @@ traverse_commit (SeafCommit *commit, void *vdata, gboolean *stop)
 
     data->traversed_fs_objs = 0;
 
-    ret = seaf_fs_manager_traverse_tree (seaf->fs_mgr,
-                                         data->repo->store_id, data->repo->version,
-                                         commit->root_id,
-                                         fs_callback,
-                                         data, FALSE);
+    ret = seaf_fs_manager_traverse_tree_parallel (seaf->fs_mgr,
+                                                  data->repo->store_id,
+                                                  data->repo->version,
+                                                  commit->root_id,
+                                                  fs_callback,
+                                                  data, FALSE,
+                                                  data->visited);
     if (ret < 0)
         return FALSE;
 
@@ -169,8 +241,30 @@ traverse_commit (SeafCommit *commit, void *vdata, gboolean *stop)
     return TRUE;
 }
 
+/* The history GC doesn't keep can't be accessed after it. */
+static void
+set_valid_since (SeafRepo *repo, gint64 truncate_time)
+{
+    if (truncate_time > 0) {
+        seaf_repo_manager_set_repo_valid_since (repo->manager,
+                                                repo->id,
+                                                truncate_time);
+    } else if (truncate_time == 0) {
+        /* Only the head commit is valid after GC if no history is kept. */
+        SeafCommit *head = seaf_commit_manager_get_commit (seaf->commit_mgr,
+                                                           repo->id, repo->version,
+                                                           repo->head->commit_id);
+        if (head)
+            seaf_repo_manager_set_repo_valid_since (repo->manager,
+                                                    repo->id,
+                                                    head->ctime);
+        seaf_commit_unref (head);
+    }
+}
+
 static int
-populate_gc_index_for_repo (SeafRepo *repo, Bloom *index, int verbose)
+populate_gc_index_for_repo (SeafRepo *repo, GCIndex *index, GCStats *stats,
+                            int verbose)
 {
     GList *branches, *ptr;
     SeafBranch *branch;
@@ -191,28 +285,16 @@ populate_gc_index_for_repo (SeafRepo *repo, Bloom *index, int verbose)
     data = g_new0(GCData, 1);
     data->repo = repo;
     data->index = index;
-    data->visited = g_hash_table_new_full (g_str_hash, g_str_equal, g_free, NULL);
+    data->visited = fs_visited_set_new ();
+    pthread_mutex_init (&data->lock, NULL);
     data->verbose = verbose;
 
     gint64 truncate_time = seaf_repo_manager_get_repo_truncate_time (repo->manager,
                                                                      repo->id);
-    if (truncate_time > 0) {
-        seaf_repo_manager_set_repo_valid_since (repo->manager,
-                                                repo->id,
-                                                truncate_time);
-    } else if (truncate_time == 0) {
-        /* Only the head commit is valid after GC if no history is kept. */
-        SeafCommit *head = seaf_commit_manager_get_commit (seaf->commit_mgr,
-                                                           repo->id, repo->version,
-                                                           repo->head->commit_id);
-        if (head)
-            seaf_repo_manager_set_repo_valid_since (repo->manager,
-                                                    repo->id,
-                                                    head->ctime);
-        seaf_commit_unref (head);
-    }
+    set_valid_since (repo, truncate_time);
 
     data->truncate_time = truncate_time;
+    data->next_expire = G_MAXINT64;
 
     for (ptr = branches; ptr != NULL; ptr = ptr->next) {
         branch = ptr->data;
@@ -230,42 +312,191 @@ populate_gc_index_for_repo (SeafRepo *repo, Bloom *index, int verbose)
         }
     }
 
-    seaf_message ("Traversed %d commits, %"G_GINT64_FORMAT" blocks.\n",
-                  data->traversed_commits, data->traversed_blocks);
-    reachable_blocks += data->traversed_blocks;
+    seaf_message ("Traversed %d commits, %"G_GINT64_FORMAT" blocks of repo %.8s.\n",
+                  data->traversed_commits, data->traversed_blocks, repo->id);
+    stats->reachable_blocks += data->traversed_blocks;
+    stats->next_expire = MIN (stats->next_expire, data->next_expire);
 
     g_list_free (branches);
-    g_hash_table_destroy (data->visited);
+    fs_visited_set_free (data->visited);
+    pthread_mutex_destroy (&data->lock);
     g_free (data);
 
     return ret;
 }
 
 typedef struct {
-    Bloom *index;
+    GCIndex *index;
+    GCStats *stats;
     int dry_run;
+
+    /* Online GC only. Blocks recorded by the server since @recent_since. */
+    char *store_id;
+    IdSet *recent;
+    gint64 recent_since;
 } CheckBlocksData;
 
+static gboolean
+collect_recent_block (SeafDBRow *row, void *vdata)
+{
+    IdSet *recent = vdata;
+    const char *block_id = seaf_db_row_get_column_text (row, 0);
+
+    if (block_id)
+        id_set_add (recent, block_id);
+    return TRUE;
+}
+
+/*
+ * Read the blocks recorded since the last load. Rows of the second the
+ * last load ran in are read again, since more may have been added in it.
+ */
+static int
+load_recent_blocks (CheckBlocksData *data)
+{
+    gint64 now = (gint64)time(NULL);
+
+    if (seaf_db_statement_foreach_row (seaf->db,
+                                       "SELECT block_id FROM GCRecentBlocks "
+                                       "WHERE store_id=? AND record_time>=?",
+                                       collect_recent_block, data->recent,
+                                       2, "string", data->store_id,
+                                       "int64", data->recent_since) < 0) {
+        seaf_warning ("GC: Failed to load recent blocks of store %.8s.\n",
+                      data->store_id);
+        return -1;
+    }
+    data->recent_since = now;
+
+    return 0;
+}
+
 static gboolean
 check_block_liveness (const char *store_id, int version,
-                      const char *block_id, void *vdata)
+                      const char *block_id, gboolean live, void *vdata)
 {
     CheckBlocksData *data = vdata;
-    Bloom *index = data->index;
 
-    if (!bloom_test (index, block_id)) {
-        ++removed_blocks;
-        if (!data->dry_run)
+    if (!live) {
+        if (data->recent && id_set_contains (data->recent, block_id)) {
+            ++data->stats->recent_blocks;
+            return TRUE;
+        }
+        ++data->stats->removed_blocks;
+        if (seaf_block_manager_block_is_shared (seaf->block_mgr, store_id,
+                                                version, block_id))
+            ++data->stats->shared_blocks;
+        if (!data->dry_run) {
+            throttle_io ();
             seaf_block_manager_remove_block (seaf->block_mgr,
                                              store_id, version,
                                              block_id);
+        }
     }
 
     return TRUE;
 }
 
+static gboolean
+check_blocks_liveness (const char *store_id, int version,
+                       const char *prefix, char **block_ids, int n_blocks,
+                       void *vdata)
+{
+    CheckBlocksData *data = vdata;
+    gboolean *live;
+    int i;
+
+    /* Stop rather than remove blocks the server may have just claimed. */
+    if (data->recent && load_recent_blocks (data) < 0)
+        return FALSE;
+
+    live = g_new (gboolean, n_blocks);
+    gc_index_test_batch (data->index, block_ids, n_blocks, live);
+
+    for (i = 0; i < n_blocks; ++i)
+        check_block_liveness (store_id, version, block_ids[i], live[i], vdata);
+
+    g_free (live);
+    return TRUE;
+}
+
+/* The repos sharing the store of @repo, @repo first. */
 static int
-populate_gc_index_for_virtual_repos (SeafRepo *repo, Bloom *index, int verbose)
+get_store_repos (SeafRepo *repo, GList **repos)
+{
+    GList *vrepo_ids, *ptr;
+    SeafRepo *vrepo;
+    int ret = 0;
+
+    seaf_repo_ref (repo);
+    *repos = g_list_prepend (NULL, repo);
+
+    vrepo_ids = seaf_repo_manager_get_virtual_repo_ids_by_origin (seaf->repo_mgr,
+                                                                  repo->id);
+    for (ptr = vrepo_ids; ptr; ptr = ptr->next) {
+        vrepo = seaf_repo_manager_get_repo (seaf->repo_mgr, ptr->data);
+        if (!vrepo) {
+            seaf_warning ("Failed to get repo %s.\n", (char *)ptr->data);
+            ret = -1;
+            break;
+        }
+        *repos = g_list_append (*repos, vrepo);
+    }
+    string_list_free (vrepo_ids);
+
+    if (ret < 0) {
+        g_list_free_full (*repos, (GDestroyNotify)seaf_repo_unref);
+        *repos = NULL;
+    }
+    return ret;
+}
+
+/*
+ * Bring the reference counts of the store up to date, and add the
+ * blocks with references to the index. Only the commits added and
+ * expired since the last GC are diffed.
+ */
+static int
+populate_gc_index_from_refs (SeafRepo *repo, GCIndex *index, GCStats *stats)
+{
+    GList *repos, *ptr;
+    SeafRepo *r;
+    gint64 next_expire;
+    int ret;
+
+    seaf_message ("Updating reference counts of repo %.8s.\n", repo->id);
+
+    if (get_store_repos (repo, &repos) < 0)
+        return -1;
+
+    for (ptr = repos; ptr; ptr = ptr->next) {
+        r = ptr->data;
+        set_valid_since (r, seaf_repo_manager_get_repo_truncate_time (seaf->repo_mgr,
+                                                                      r->id));
+    }
+
+    ret = gc_refcount_update (repo->store_id, repo->version, repos,
+                              &next_expire);
+    if (ret < 0)
+        goto out;
+    stats->next_expire = MIN (stats->next_expire, next_expire);
+
+    ret = gc_refcount_load_blocks (repo->store_id, index,
+                                   &stats->reachable_blocks);
+    if (ret < 0)
+        goto out;
+
+    seaf_message ("%"G_GUINT64_FORMAT" blocks of repo %.8s are referenced.\n",
+                  stats->reachable_blocks, repo->id);
+
+out:
+    g_list_free_full (repos, (GDestroyNotify)seaf_repo_unref);
+    return ret;
+}
+
+static int
+populate_gc_index_for_virtual_repos (SeafRepo *repo, GCIndex *index,
+                                     GCStats *stats, int verbose)
 {
     GList *vrepo_ids = NULL, *ptr;
     char *repo_id;
@@ -283,7 +514,7 @@ populate_gc_index_for_virtual_repos (SeafRepo *repo, Bloom *index, int verbose)
             goto out;
         }
 
-        ret = populate_gc_index_for_repo (vrepo, index, verbose);
+        ret = populate_gc_index_for_repo (vrepo, index, stats, verbose);
         seaf_repo_unref (vrepo);
         if (ret < 0)
             goto out;
@@ -294,84 +525,477 @@ out:
     return ret;
 }
 
-int
+/*
+ * What the live blocks of a store were computed from in the last GC:
+ * the branch heads of the repo and its virtual repos, with how much
+ * history each keeps. Blocks only become garbage when a head moves,
+ * when truncate_time passes a kept commit, or when blocks are uploaded
+ * without being committed. If none of these happened, the store has
+ * nothing new to collect and is skipped.
+ */
+static gboolean
+add_repo_heads (const char *repo_id, GString *heads, gint64 *max_truncate)
+{
+    GList *branches, *ptr;
+    SeafBranch *branch;
+    GList *lines = NULL;
+    gint64 truncate_time;
+    const char *keep;
+
+    truncate_time = seaf_repo_manager_get_repo_truncate_time (seaf->repo_mgr,
+                                                             repo_id);
+    if (truncate_time > 0) {
+        keep = "period";
+        *max_truncate = MAX (*max_truncate, truncate_time);
+    } else if (truncate_time == 0) {
+        keep = "head";
+    } else {
+        keep = "all";
+    }
+
+    branches = seaf_branch_manager_get_branch_list (seaf->branch_mgr, repo_id);
+    if (!branches)
+        return FALSE;
+
+    for (ptr = branches; ptr; ptr = ptr->next) {
+        branch = ptr->data;
+        lines = g_list_prepend (lines,
+                                g_strdup_printf ("%s %s %s %s\n", repo_id,
+                                                 branch->name,
+                                                 branch->commit_id, keep));
+        seaf_branch_unref (branch);
+    }
+    g_list_free (branches);
+
+    lines = g_list_sort (lines, (GCompareFunc)strcmp);
+    for (ptr = lines; ptr; ptr = ptr->next)
+        g_string_append (heads, ptr->data);
+    string_list_free (lines);
+
+    return TRUE;
+}
+
+/* Returns the digest of the heads, or NULL on error. */
+static char *
+get_gc_heads (SeafRepo *repo, gint64 *max_truncate)
+{
+    GString *heads = g_string_new ("");
+    GList *vrepo_ids, *ptr;
+    char *digest = NULL;
+
+    *max_truncate = 0;
+
+    if (!add_repo_heads (repo->id, heads, max_truncate))
+        goto out;
+
+    vrepo_ids = seaf_repo_manager_get_virtual_repo_ids_by_origin (seaf->repo_mgr,
+                                                                  repo->id);
+    vrepo_ids = g_list_sort (vrepo_ids, (GCompareFunc)strcmp);
+    for (ptr = vrepo_ids; ptr; ptr = ptr->next) {
+        if (!add_repo_heads (ptr->data, heads, max_truncate)) {
+            string_list_free (vrepo_ids);
+            goto out;
+        }
+    }
+    string_list_free (vrepo_ids);
+
+    digest = g_compute_checksum_for_string (G_CHECKSUM_SHA1, heads->str, -1);
+
+out:
+    g_string_free (heads, TRUE);
+    return digest;
+}
+
+static gboolean
+gc_state_unchanged (SeafRepo *repo, const char *heads, gint64 max_truncate,
+                    guint64 total_blocks)
+{
+    char *saved_heads;
+    gint64 next_expire, saved_blocks;
+    gboolean ret = FALSE;
+
+    saved_heads = seaf_db_statement_get_string (seaf->db,
+                                                "SELECT heads FROM GCRepoState "
+                                                "WHERE repo_id=?",
+                                                1, "string", repo->id);
+    if (!saved_heads || strcmp (saved_heads, heads) != 0)
+        goto out;
+
+    next_expire = seaf_db_statement_get_int64 (seaf->db,
+                                               "SELECT next_expire FROM GCRepoState "
+                                               "WHERE repo_id=?",
+                                               1, "string", repo->id);
+    saved_blocks = seaf_db_statement_get_int64 (seaf->db,
+                                                "SELECT total_blocks FROM GCRepoState "
+                                                "WHERE repo_id=?",
+                                                1, "string", repo->id);
+    if (next_expire < 0 || saved_blocks < 0)
+        goto out;
+
+    ret = (max_truncate <= next_expire &&
+           (guint64)saved_blocks == total_blocks);
+
+out:
+    g_free (saved_heads);
+    return ret;
+}
+
+static void
+save_gc_state (SeafRepo *repo, const char *heads, gint64 next_expire,
+               guint64 total_blocks)
+{
+    gboolean exists, db_err = FALSE;
+    int rc;
+
+    if (seaf_db_type (seaf->db) == SEAF_DB_TYPE_PGSQL) {
+        exists = seaf_db_statement_exists (seaf->db,
+                                           "SELECT repo_id FROM GCRepoState "
+                                           "WHERE repo_id=?",
+                                           &db_err, 1, "string", repo->id);
+        if (db_err)
+            return;
+        if (exists)
+            rc = seaf_db_statement_query (seaf->db,
+                                          "UPDATE GCRepoState SET heads=?, "
+                                          "next_expire=?, total_blocks=? "
+                                          "WHERE repo_id=?",
+                                          4, "string", heads,
+                                          "int64", next_expire,
+                                          "int64", (gint64)total_blocks,
+                                          "string", repo->id);
+        else
+            rc = seaf_db_statement_query (seaf->db,
+                                          "INSERT INTO GCRepoState "
+                                          "(repo_id, heads, next_expire, "
+                                          "total_blocks) VALUES (?, ?, ?, ?)",
+                                          4, "string", repo->id,
+                                          "string", heads,
+                                          "int64", next_expire,
+                                          "int64", (gint64)total_blocks);
+    } else {
+        rc = seaf_db_statement_query (seaf->db,
+                                      "REPLACE INTO GCRepoState "
+                                      "(repo_id, heads, next_expire, "
+                                      "total_blocks) VALUES (?, ?, ?, ?)",
+                                      4, "string", repo->id,
+                                      "string", heads,
+                                      "int64", next_expire,
+                                      "int64", (gint64)total_blocks);
+    }
+
+    if (rc < 0)
+        seaf_warning ("GC: Failed to save GC state of repo %.8s.\n", repo->id);
+}
+
+static int
 gc_v1_repo (SeafRepo *repo, int dry_run, int verbose)
 {
-    Bloom *index;
+    GCIndex *index;
+    GCStats stats;
+    double fp_rate;
+    guint64 retained;
+    char *heads;
+    gint64 max_truncate;
     int ret;
 
-    total_blocks = seaf_block_manager_get_block_number (seaf->block_mgr,
-                                                        repo->store_id, repo->version);
-    removed_blocks = 0;
-    reachable_blocks = 0;
+    memset (&stats, 0, sizeof(stats));
+    stats.total_blocks = seaf_block_manager_get_block_number (seaf->block_mgr,
+                                                              repo->store_id,
+                                                              repo->version);
+
+    if (stats.total_blocks == 0) {
+        seaf_message ("No blocks in repo %.8s. Skip GC.\n\n", repo->id);
+        return 0;
+    }
 
-    if (total_blocks == 0) {
-        seaf_message ("No blocks. Skip GC.\n\n");
+    /* Read before traversing, so that a head moved during GC is seen
+     * as changed next time.
+     */
+    heads = get_gc_heads (repo, &max_truncate);
+    if (heads && !full_scan &&
+        gc_state_unchanged (repo, heads, max_truncate, stats.total_blocks)) {
+        seaf_message ("Repo %.8s is unchanged since last GC. Skip GC.\n\n",
+                      repo->id);
+        g_free (heads);
         return 0;
     }
+    stats.next_expire = G_MAXINT64;
 
-    seaf_message ("GC started. Total block number is %"G_GUINT64_FORMAT".\n", total_blocks);
+    seaf_message ("GC started for repo %.8s. Total block number is "
+                  "%"G_GUINT64_FORMAT".\n", repo->id, stats.total_blocks);
 
     /*
-     * Store the index of live blocks in bloom filter to save memory.
-     * Since bloom filters only have false-positive, we
+     * Unless it's exact, the index of live blocks is a bloom filter to
+     * save memory. Since bloom filters only have false-positive, we
      * may skip some garbage blocks, but we won't delete
      * blocks that are still alive.
      */
-    index = alloc_gc_index ();
+    index = gc_index_new (index_mode, stats.total_blocks, index_fp_rate);
     if (!index) {
         seaf_warning ("GC: Failed to allocate index.\n");
+        g_free (heads);
         return -1;
     }
 
-    seaf_message ("Populating index.\n");
+    if (refcount_mode) {
+        ret = populate_gc_index_from_refs (repo, index, &stats);
+        if (ret < 0)
+            goto out;
+    } else {
+        ret = populate_gc_index_for_repo (repo, index, &stats, verbose);
+        if (ret < 0)
+            goto out;
 
-    ret = populate_gc_index_for_repo (repo, index, verbose);
-    if (ret < 0)
-        goto out;
+        /* Since virtual repos share fs and block store with the origin repo,
+         * it's necessary to do GC for them together.
+         */
+        ret = populate_gc_index_for_virtual_repos (repo, index, &stats, verbose);
+        if (ret < 0)
+            goto out;
+    }
 
-    /* Since virtual repos share fs and block store with the origin repo,
-     * it's necessary to do GC for them together.
-     */
-    ret = populate_gc_index_for_virtual_repos (repo, index, verbose);
-    if (ret < 0)
-        goto out;
+    gc_index_finish (index);
+    seaf_message ("GC index size of repo %.8s is %"G_GUINT64_FORMAT" Byte.\n",
+                  repo->id, gc_index_size (index));
 
     if (!dry_run)
-        seaf_message ("Scanning and deleting unused blocks.\n");
+        seaf_message ("Scanning and deleting unused blocks of repo %.8s.\n",
+                      repo->id);
     else
-        seaf_message ("Scanning unused blocks.\n");
+        seaf_message ("Scanning unused blocks of repo %.8s.\n", repo->id);
 
     CheckBlocksData data;
     data.index = index;
+    data.stats = &stats;
     data.dry_run = dry_run;
-
-    ret = seaf_block_manager_foreach_block (seaf->block_mgr,
-                                            repo->store_id, repo->version,
-                                            check_block_liveness,
-                                            &data);
+    data.store_id = repo->store_id;
+    data.recent = NULL;
+    data.recent_since = 0;
+    if (online_gc)
+        data.recent = id_set_new ();
+
+    ret = seaf_block_manager_foreach_block_batch (seaf->block_mgr,
+                                                  repo->store_id, repo->version,
+                                                  NULL,
+                                                  check_blocks_liveness,
+                                                  &data);
+    id_set_free (data.recent);
     if (ret < 0) {
         seaf_warning ("GC: Failed to clean dead blocks.\n");
         goto out;
     }
 
-    ret = removed_blocks;
+    if (stats.recent_blocks > 0)
+        seaf_message ("%"G_GUINT64_FORMAT" unreachable blocks of repo %.8s "
+                      "are kept as they were uploaded during GC.\n",
+                      stats.recent_blocks, repo->id);
+
+    if (stats.shared_blocks > 0)
+        seaf_message ("%"G_GUINT64_FORMAT" of the unreachable blocks of repo %.8s "
+                      "are shared with other repos, their space is not freed.\n",
+                      stats.shared_blocks, repo->id);
+
+    /* Pack backends only mark removed blocks, reclaim their space now. */
+    if (!dry_run && stats.removed_blocks > 0 &&
+        seaf_block_manager_compact_store (seaf->block_mgr, repo->store_id) < 0)
+        seaf_warning ("GC: Failed to compact block store %.8s.\n",
+                      repo->store_id);
+
+    ret = stats.removed_blocks;
+
+    if (!dry_run && heads)
+        save_gc_state (repo, heads, stats.next_expire,
+                       stats.total_blocks - stats.removed_blocks);
 
     if (!dry_run)
-        seaf_message ("GC finished. %"G_GUINT64_FORMAT" blocks total, "
+        seaf_message ("GC finished for repo %.8s. %"G_GUINT64_FORMAT" blocks total, "
                       "about %"G_GUINT64_FORMAT" reachable blocks, "
                       "%"G_GUINT64_FORMAT" blocks are removed.\n",
-                      total_blocks, reachable_blocks, removed_blocks);
+                      repo->id, stats.total_blocks, stats.reachable_blocks,
+                      stats.removed_blocks);
     else
-        seaf_message ("GC finished. %"G_GUINT64_FORMAT" blocks total, "
+        seaf_message ("GC finished for repo %.8s. %"G_GUINT64_FORMAT" blocks total, "
                       "about %"G_GUINT64_FORMAT" reachable blocks, "
                       "%"G_GUINT64_FORMAT" blocks can be removed.\n",
-                      total_blocks, reachable_blocks, removed_blocks);
+                      repo->id, stats.total_blocks, stats.reachable_blocks,
+                      stats.removed_blocks);
+
+    /* Of the garbage, a fraction fp_rate tests as live and is kept. */
+    fp_rate = gc_index_false_positive_rate (index,
+                                            MIN (stats.reachable_blocks,
+                                                 stats.total_blocks));
+    retained = (guint64)(stats.removed_blocks * fp_rate / (1 - fp_rate));
+    if (retained > 0)
+        seaf_message ("About %"G_GUINT64_FORMAT" garbage blocks of repo %.8s "
+                      "are kept by index false positives (rate %.2f%%).\n",
+                      retained, repo->id, fp_rate * 100);
 
 out:
-    printf ("\n");
+    gc_index_free (index);
+    g_free (heads);
+    return ret;
+}
+
+typedef struct {
+    GCIndex *index;
+    const char *prefix;
+
+    guint64 reachable_blocks;
+    guint64 reachable_bytes;
+    guint64 unreachable_blocks;
+    guint64 unreachable_bytes;
+    guint64 failed_blocks;
+} EstimateData;
+
+/* Stat the blocks of one prefix, then stop the scan. */
+static gboolean
+estimate_prefix (const char *store_id, int version,
+                 const char *prefix, char **block_ids, int n_blocks,
+                 void *vdata)
+{
+    EstimateData *data = vdata;
+    BlockMetadata *md;
+    int i;
+
+    /* The sampled prefix has no blocks. */
+    if (strcmp (prefix, data->prefix) != 0)
+        return FALSE;
+
+    for (i = 0; i < n_blocks; ++i) {
+        throttle_io ();
+        md = seaf_block_manager_stat_block (seaf->block_mgr,
+                                            store_id, version, block_ids[i]);
+        if (!md) {
+            ++data->failed_blocks;
+            continue;
+        }
+
+        if (gc_index_test (data->index, block_ids[i])) {
+            ++data->reachable_blocks;
+            data->reachable_bytes += md->size;
+        } else {
+            ++data->unreachable_blocks;
+            data->unreachable_bytes += md->size;
+        }
+        g_free (md);
+    }
+
+    return FALSE;
+}
 
-    bloom_destroy (index);
+/*
+ * Estimate what GC would free in the store of @repo. The commits and fs
+ * objects are still all traversed, as any of them may refer to a sampled
+ * block, but only the sampled blocks are indexed and stat'ed.
+ */
+static json_t *
+estimate_repo (SeafRepo *repo, int verbose)
+{
+    GCIndex *index;
+    GCStats stats;
+    EstimateData data;
+    char prefix[3];
+    double scale;
+    json_t *object = NULL;
+    int i;
+
+    memset (&stats, 0, sizeof(stats));
+    stats.total_blocks = seaf_block_manager_get_block_number (seaf->block_mgr,
+                                                              repo->store_id,
+                                                              repo->version);
+    stats.next_expire = G_MAXINT64;
+
+    seaf_message ("Estimating GC of repo %.8s from %d of 256 block prefixes.\n",
+                  repo->id, n_sample_prefixes);
+
+    index = gc_index_new (GC_INDEX_EXACT, 0, 0);
+
+    if (populate_gc_index_for_repo (repo, index, &stats, verbose) < 0 ||
+        populate_gc_index_for_virtual_repos (repo, index, &stats, verbose) < 0)
+        goto out;
+    gc_index_finish (index);
+
+    memset (&data, 0, sizeof(data));
+    data.index = index;
+    data.prefix = prefix;
+    for (i = 0; i < 256; ++i) {
+        if (!sample_prefixes[i])
+            continue;
+        snprintf (prefix, sizeof(prefix), "%02x", i);
+        if (seaf_block_manager_foreach_block_batch (seaf->block_mgr,
+                                                    repo->store_id,
+                                                    repo->version,
+                                                    prefix,
+                                                    estimate_prefix,
+                                                    &data) < 0) {
+            seaf_warning ("GC: Failed to scan blocks of repo %.8s.\n",
+                          repo->id);
+            goto out;
+        }
+    }
+
+    if (data.failed_blocks > 0)
+        seaf_warning ("GC: Failed to stat %"G_GUINT64_FORMAT" blocks of "
+                      "repo %.8s.\n", data.failed_blocks, repo->id);
+
+    scale = 256.0 / n_sample_prefixes;
+    object = json_object ();
+    json_object_set_new (object, "repo_id", json_string (repo->id));
+    json_object_set_new (object, "sampled_prefixes",
+                         json_integer (n_sample_prefixes));
+    json_object_set_new (object, "total_blocks",
+                         json_integer ((json_int_t)stats.total_blocks));
+    json_object_set_new (object, "reachable_blocks",
+                         json_integer ((json_int_t)(data.reachable_blocks * scale)));
+    json_object_set_new (object, "reachable_bytes",
+                         json_integer ((json_int_t)(data.reachable_bytes * scale)));
+    json_object_set_new (object, "unreachable_blocks",
+                         json_integer ((json_int_t)(data.unreachable_blocks * scale)));
+    json_object_set_new (object, "unreachable_bytes",
+                         json_integer ((json_int_t)(data.unreachable_bytes * scale)));
+
+out:
+    gc_index_free (index);
+    return object;
+}
+
+static void
+pack_repo_commits (SeafRepo *repo)
+{
+    GList *repos, *ptr;
+    SeafRepo *r;
+    gint64 before = (gint64)time(NULL) - (gint64)pack_commits_days * 24 * 3600;
+
+    if (get_store_repos (repo, &repos) < 0)
+        return;
+
+    for (ptr = repos; ptr; ptr = ptr->next) {
+        r = ptr->data;
+        if (!r->head)
+            continue;
+        if (seaf_commit_manager_pack_commits (seaf->commit_mgr, r->id,
+                                              r->version,
+                                              r->head->commit_id,
+                                              before) < 0)
+            seaf_warning ("Failed to pack commits of repo %.8s.\n", r->id);
+    }
+    g_list_free_full (repos, (GDestroyNotify)seaf_repo_unref);
+}
+
+/* Returns the number of wrong counts, or -1 on error. */
+static int
+check_repo_refs (SeafRepo *repo, int dry_run)
+{
+    GList *repos;
+    int ret;
+
+    seaf_message ("Checking reference counts of repo %.8s.\n", repo->id);
+
+    if (get_store_repos (repo, &repos) < 0)
+        return -1;
+
+    ret = gc_refcount_verify (repo->store_id, repo->version, repos, !dry_run);
+    g_list_free_full (repos, (GDestroyNotify)seaf_repo_unref);
     return ret;
 }
 
@@ -396,63 +1020,428 @@ delete_garbaged_repos (int dry_run)
             }
         }
 
-        if (!dry_run)
+        if (!dry_run) {
             seaf_repo_manager_remove_garbage_repo (seaf->repo_mgr, repo_id);
+            seaf_db_statement_query (seaf->db,
+                                     "DELETE FROM GCRepoState WHERE repo_id=?",
+                                     1, "string", repo_id);
+            gc_refcount_remove_store (repo_id);
+        }
         g_free (repo_id);
     }
     g_list_free (del_repos);
 }
 
-int
-gc_core_run (GList *repo_id_list, int dry_run, int verbose)
+/*
+ * The repos left to collect, shared by the workers. Each non-virtual
+ * repo has its own store, and its virtual repos are collected with it,
+ * so no two workers touch the same store.
+ */
+typedef struct GCRunData {
+    pthread_mutex_t lock;
+    GList *repo_ids;
+    int dry_run;
+    int verbose;
+
+    GList *corrupt_repos;
+    GList *del_block_repos;
+    /* Estimate mode only. */
+    json_t *estimates;
+} GCRunData;
+
+/*
+ * Have the server record the blocks written to or claimed in the stores
+ * of @repo_ids from now on. Stores of virtual repos are their origins'.
+ */
+static int
+register_online_stores (GList *repo_ids)
 {
+    SeafDBBatch *batch;
+    gint64 now = (gint64)time(NULL);
     GList *ptr;
+    int ret = 0;
+
+    /* Left over by a GC that didn't finish. */
+    if (seaf_db_query (seaf->db, "DELETE FROM GCOnlineRun") < 0 ||
+        seaf_db_query (seaf->db, "DELETE FROM GCRecentBlocks") < 0)
+        return -1;
+
+    batch = seaf_db_batch_new (seaf->db, NULL,
+                               "INSERT INTO GCOnlineRun (store_id, start_time) "
+                               "VALUES", NULL, 2);
+    if (!batch)
+        return -1;
+
+    for (ptr = repo_ids; ptr && ret == 0; ptr = ptr->next)
+        ret = seaf_db_batch_add_row (batch,
+                                     "string", (char *)ptr->data,
+                                     "int64", now);
+
+    if (seaf_db_batch_finish (batch) < 0)
+        ret = -1;
+
+    return ret;
+}
+
+static void
+unregister_online_store (const char *store_id)
+{
+    seaf_db_statement_query (seaf->db,
+                             "DELETE FROM GCOnlineRun WHERE store_id=?",
+                             1, "string", store_id);
+    seaf_db_statement_query (seaf->db,
+                             "DELETE FROM GCRecentBlocks WHERE store_id=?",
+                             1, "string", store_id);
+}
+
+static gboolean
+collect_repo_id (SeafDBRow *row, void *data)
+{
+    GList **ids = data;
+
+    *ids = g_list_prepend (*ids, g_strdup (seaf_db_row_get_column_text (row, 0)));
+    return TRUE;
+}
+
+static GList *
+get_pruned_repo_ids ()
+{
+    GList *ids = NULL;
+
+    if (seaf_db_statement_foreach_row (seaf->db,
+                                       "SELECT repo_id FROM HistoryPruneCandidates",
+                                       collect_repo_id, &ids, 0) < 0) {
+        seaf_warning ("Failed to list pruned repos.\n");
+        string_list_free (ids);
+        return NULL;
+    }
+
+    return ids;
+}
+
+/* Marks made while the store was collected are kept for the next GC. */
+static void
+unmark_pruned_store (const char *store_id, gint64 gc_start)
+{
+    if (seaf_db_statement_query (seaf->db,
+                                 "DELETE FROM HistoryPruneCandidates "
+                                 "WHERE repo_id=? AND mark_time<=?",
+                                 2, "string", store_id, "int64", gc_start) < 0)
+        seaf_warning ("Failed to unmark pruned store %s.\n", store_id);
+}
+
+static void
+gc_one_repo (GCRunData *run, const char *repo_id)
+{
     SeafRepo *repo;
+    json_t *estimate;
+    gint64 gc_start;
+    int gc_ret;
+
+    repo = seaf_repo_manager_get_repo_ex (seaf->repo_mgr, repo_id);
+    if (!repo)
+        return;
+
+    if (repo->is_corrupted) {
+        seaf_message ("Repo %s is corrupted, skip GC.\n\n", repo->id);
+        pthread_mutex_lock (&run->lock);
+        run->corrupt_repos = g_list_prepend (run->corrupt_repos,
+                                             g_strdup(repo->id));
+        pthread_mutex_unlock (&run->lock);
+        seaf_repo_unref (repo);
+        return;
+    }
+
+    if (!repo->is_virtual && check_refcount) {
+        if (check_repo_refs (repo, run->dry_run) < 0) {
+            pthread_mutex_lock (&run->lock);
+            run->corrupt_repos = g_list_prepend (run->corrupt_repos,
+                                                 g_strdup(repo->id));
+            pthread_mutex_unlock (&run->lock);
+        }
+    } else if (!repo->is_virtual && estimate_mode) {
+        estimate = estimate_repo (repo, run->verbose);
+
+        pthread_mutex_lock (&run->lock);
+        if (!estimate)
+            run->corrupt_repos = g_list_prepend (run->corrupt_repos,
+                                                 g_strdup(repo->id));
+        else
+            json_array_append_new (run->estimates, estimate);
+        pthread_mutex_unlock (&run->lock);
+    } else if (!repo->is_virtual) {
+        seaf_message ("GC version %d repo %s(%s)\n",
+                      repo->version, repo->name, repo->id);
+        gc_start = (gint64)time(NULL);
+        gc_ret = gc_v1_repo (repo, run->dry_run, run->verbose);
+
+        if (gc_ret >= 0 && !run->dry_run && pack_commits_days > 0)
+            pack_repo_commits (repo);
+
+        if (gc_ret >= 0 && !run->dry_run && pruned_mode)
+            unmark_pruned_store (repo->store_id, gc_start);
+
+        pthread_mutex_lock (&run->lock);
+        if (gc_ret < 0) {
+            run->corrupt_repos = g_list_prepend (run->corrupt_repos,
+                                                 g_strdup(repo->id));
+        } else if (run->dry_run && gc_ret) {
+            run->del_block_repos = g_list_prepend (run->del_block_repos,
+                                                   g_strdup(repo->id));
+        }
+        pthread_mutex_unlock (&run->lock);
+
+        if (online_gc)
+            unregister_online_store (repo->store_id);
+    }
+    seaf_repo_unref (repo);
+}
+
+static void *
+gc_worker (void *vrun)
+{
+    GCRunData *run = vrun;
+    char *repo_id;
+
+    while (1) {
+        pthread_mutex_lock (&run->lock);
+        repo_id = NULL;
+        if (run->repo_ids) {
+            repo_id = run->repo_ids->data;
+            run->repo_ids = g_list_delete_link (run->repo_ids, run->repo_ids);
+        }
+        pthread_mutex_unlock (&run->lock);
+
+        if (!repo_id)
+            break;
+
+        gc_one_repo (run, repo_id);
+        g_free (repo_id);
+    }
+
+    return NULL;
+}
+
+static void
+load_index_config ()
+{
+    char *mode;
+    double rate;
+    GError *error = NULL;
+
+    /*
+     * [gc]
+     * index = bloom | scalable | exact
+     * false_positive_rate = 0.01   # for the scalable index
+     */
+    mode = g_key_file_get_string (seaf->config, "gc", "index", NULL);
+    if (g_strcmp0 (mode, "exact") == 0)
+        index_mode = GC_INDEX_EXACT;
+    else if (g_strcmp0 (mode, "scalable") == 0)
+        index_mode = GC_INDEX_SCALABLE;
+    else if (mode && g_strcmp0 (mode, "bloom") != 0)
+        seaf_warning ("Unknown GC index %s, using bloom.\n", mode);
+    g_free (mode);
+
+    rate = g_key_file_get_double (seaf->config, "gc", "false_positive_rate",
+                                  &error);
+    if (!error && rate > 0 && rate < 1)
+        index_fp_rate = rate;
+    g_clear_error (&error);
+}
+
+static void
+load_sample_config ()
+{
+    int n, i;
+    GError *error = NULL;
+
+    /*
+     * [gc]
+     * estimate_sample_prefixes = 16   # of 256, for seafserv-gc --estimate
+     */
+    n = g_key_file_get_integer (seaf->config, "gc", "estimate_sample_prefixes",
+                                &error);
+    if (error || n <= 0 || n > 256) {
+        n = DEFAULT_SAMPLE_PREFIXES;
+        g_clear_error (&error);
+    }
+
+    /* Spread over the id space. */
+    memset (sample_prefixes, 0, sizeof(sample_prefixes));
+    for (i = 0; i < n; ++i)
+        sample_prefixes[i * 256 / n] = TRUE;
+    n_sample_prefixes = n;
+}
+
+static void
+load_pack_config ()
+{
+    int days;
+    GError *error = NULL;
+
+    /*
+     * [gc]
+     * pack_commits_after_days = 30   # 0 to keep all commits loose
+     */
+    days = g_key_file_get_integer (seaf->config, "gc",
+                                   "pack_commits_after_days", &error);
+    if (error) {
+        days = DEFAULT_PACK_COMMITS_DAYS;
+        g_clear_error (&error);
+    }
+    pack_commits_days = MAX (days, 0);
+}
+
+/*
+ * With [block_backend] dedup, report the space saved by shared blocks.
+ * After collecting all stores, the pool entries no store has any more
+ * are removed too.
+ */
+static void
+report_dedup_pool (gboolean keep_orphans)
+{
+    BlockDedupStats stats;
+
+    if (seaf_block_manager_scan_dedup_pool (seaf->block_mgr, !keep_orphans,
+                                            &stats) < 0)
+        return;
+
+    seaf_message ("%"G_GUINT64_FORMAT" blocks in the dedup pool, "
+                  "%"G_GUINT64_FORMAT" shared by several repos, saving "
+                  "%"G_GUINT64_FORMAT" MB.\n",
+                  stats.pool_blocks, stats.shared_blocks,
+                  stats.saved_bytes >> 20);
+    if (stats.orphans_removed > 0)
+        seaf_message ("%"G_GUINT64_FORMAT" unused blocks are removed "
+                      "from the dedup pool.\n", stats.orphans_removed);
+}
+
+int
+gc_core_run (GList *repo_id_list, int dry_run, int verbose,
+             GCOptions *options)
+{
+    GList *ptr;
     GList *corrupt_repos = NULL;
     GList *del_block_repos = NULL;
     gboolean del_garbage = FALSE;
-    int gc_ret;
     char *repo_id;
-
-    if (repo_id_list == NULL) {
+    GCRunData run;
+    pthread_t *workers;
+    int n_workers;
+    char *report;
+    int grace_period;
+    GError *error = NULL;
+    int i, n_started;
+
+    pruned_mode = options->pruned;
+    if (repo_id_list == NULL && pruned_mode) {
+        repo_id_list = get_pruned_repo_ids ();
+        if (!repo_id_list) {
+            seaf_message ("No pruned repos to collect.\n");
+            return 0;
+        }
+    } else if (repo_id_list == NULL) {
         repo_id_list = seaf_repo_manager_get_repo_id_list (seaf->repo_mgr);
         del_garbage = TRUE;
     }
 
-    for (ptr = repo_id_list; ptr; ptr = ptr->next) {
-        repo = seaf_repo_manager_get_repo_ex (seaf->repo_mgr, (const gchar *)ptr->data);
+    io_throttle.ops_per_sec = options->io_limit;
+    full_scan = options->full;
+    online_gc = options->online;
+    estimate_mode = options->estimate;
+    refcount_mode = options->refcount;
+    check_refcount = options->check_refcount;
+    load_index_config ();
+    load_pack_config ();
+
+    /* Nothing is removed, or recorded as collected. */
+    if (estimate_mode) {
+        load_sample_config ();
+        dry_run = 1;
+        online_gc = 0;
+        del_garbage = FALSE;
+    }
 
-        g_free (ptr->data);
+    /* Only the counts are fixed, unless it's a dry run. */
+    if (check_refcount) {
+        online_gc = 0;
+        del_garbage = FALSE;
+    }
 
-        if (!repo)
-            continue;
+    if (online_gc) {
+        if (register_online_stores (repo_id_list) < 0) {
+            seaf_warning ("Failed to register stores for online GC.\n");
+            string_list_free (repo_id_list);
+            return -1;
+        }
 
-        if (repo->is_corrupted) {
-            corrupt_repos = g_list_prepend (corrupt_repos, g_strdup(repo->id));
-            seaf_message ("Repo %s is corrupted, skip GC.\n\n", repo->id);
-            continue;
+        /* Uploads that started before the registration, and may commit
+         * blocks the server didn't record, should be done by the time
+         * their repos are traversed.
+         */
+        grace_period = g_key_file_get_integer (seaf->config, "gc",
+                                               "online_grace_period", &error);
+        if (error) {
+            grace_period = DEFAULT_ONLINE_GRACE_PERIOD;
+            g_clear_error (&error);
+        }
+        if (grace_period > 0) {
+            seaf_message ("Waiting %d seconds for uploads in progress.\n",
+                          grace_period);
+            g_usleep ((gulong)grace_period * G_USEC_PER_SEC);
         }
+    }
 
-        if (!repo->is_virtual) {
-            seaf_message ("GC version %d repo %s(%s)\n",
-                          repo->version, repo->name, repo->id);
-            gc_ret = gc_v1_repo (repo, dry_run, verbose);
-            if (gc_ret < 0) {
-                corrupt_repos = g_list_prepend (corrupt_repos, g_strdup(repo->id));
-            } else if (dry_run && gc_ret) {
-                del_block_repos = g_list_prepend (del_block_repos, g_strdup(repo->id));
-            }
+    memset (&run, 0, sizeof(run));
+    pthread_mutex_init (&run.lock, NULL);
+    run.repo_ids = repo_id_list;
+    run.dry_run = dry_run;
+    run.verbose = verbose;
+    if (estimate_mode)
+        run.estimates = json_array ();
+
+    n_workers = MAX (options->n_workers, 1);
+
+    /* The current thread is a worker too. */
+    workers = g_new0 (pthread_t, n_workers);
+    for (n_started = 0; n_started < n_workers - 1; ++n_started) {
+        if (pthread_create (&workers[n_started], NULL, gc_worker, &run) != 0) {
+            seaf_warning ("Failed to start GC worker: %s.\n", strerror(errno));
+            break;
         }
-        seaf_repo_unref (repo);
     }
-    g_list_free (repo_id_list);
+    gc_worker (&run);
+    for (i = 0; i < n_started; ++i)
+        pthread_join (workers[i], NULL);
+    g_free (workers);
+
+    pthread_mutex_destroy (&run.lock);
+    corrupt_repos = run.corrupt_repos;
+    del_block_repos = run.del_block_repos;
+
+    if (online_gc) {
+        seaf_db_query (seaf->db, "DELETE FROM GCOnlineRun");
+        seaf_db_query (seaf->db, "DELETE FROM GCRecentBlocks");
+    }
 
     if (del_garbage) {
         delete_garbaged_repos (dry_run);
     }
 
+    if (!estimate_mode && !check_refcount)
+        report_dedup_pool (dry_run || !del_garbage);
+
     seaf_message ("=== GC is finished ===\n");
 
+    /* The last line of the output, after the log messages. */
+    if (run.estimates) {
+        report = json_dumps (run.estimates, JSON_COMPACT);
+        printf ("%s\n", report);
+        free (report);
+        json_decref (run.estimates);
+    }
+
     if (corrupt_repos) {
         seaf_message ("The following repos are corrupted. "
                       "You can run seaf-fsck to fix them.\n");
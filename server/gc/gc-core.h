@@ -1,7 +1,42 @@
 #ifndef GC_CORE_H
 #define GC_CORE_H
 
-int gc_core_run (GList *repo_id_list, int dry_run, int verbose);
+typedef struct GCOptions {
+    /* Stores collected at the same time. */
+    int n_workers;
+    /* Fs objects read and blocks removed per second over all threads,
+     * 0 for no limit.
+     */
+    int io_limit;
+    /* Also collect repos unchanged since their last GC. */
+    gboolean full;
+    /* The server may keep running, see server/gc-guard.h. */
+    gboolean online;
+    /* Only print a JSON estimate of the space GC would free per store,
+     * from a sample of the blocks, as the last line of the output.
+     */
+    gboolean estimate;
+    /* Find live blocks from the block reference counts, which are
+     * updated with the commits added and expired since the last GC,
+     * see gc-refcount.h.
+     */
+    gboolean refcount;
+    /* Only count the references from scratch and fix the saved counts,
+     * or just report them in a dry run.
+     */
+    gboolean check_refcount;
+    /* Only collect the stores whose history the server pruned since
+     * their last GC, see server/history-pruner.h.
+     */
+    gboolean pruned;
+} GCOptions;
+
+/*
+ * Collect the stores of the repos in @repo_id_list, or of all repos if
+ * it's NULL and the pruned option is not set.
+ */
+int gc_core_run (GList *repo_id_list, int dry_run, int verbose,
+                 GCOptions *options);
 
 void
 delete_garbaged_repos (int dry_run);
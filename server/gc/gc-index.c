@@ -0,0 +1,294 @@
+/* -*- Mode: C; tab-width: 4; indent-tabs-mode: nil; c-basic-offset: 4 -*- */
+
+#include "common.h"
+
+#include <math.h>
+
+#include "bloom-filter.h"
+#include "gc-index.h"
+#include "utils.h"
+
+#define DEBUG_FLAG SEAFILE_DEBUG_OTHER
+#include "log.h"
+
+#define MAX_BF_SIZE (((guint64)1) << 29)   /* 64 MB */
+#define MIN_BF_SIZE (1 << 13)
+#define BF_BITS_PER_BLOCK 6
+#define MAX_PARTS 256
+
+/* Ids tested at once by gc_index_test_batch(). */
+#define TEST_BATCH 256
+
+#define DEDUP_MIN_IDS 4096
+
+/* Raw ids of live blocks with the same first byte, sorted up to
+ * @n_sorted. Ids are appended unsorted and deduplicated once they
+ * double, so repeated blocks don't take up more than twice the space.
+ */
+typedef struct IdBucket {
+    unsigned char *ids;
+    gsize n;
+    gsize cap;
+    gsize n_sorted;
+} IdBucket;
+
+struct GCIndex {
+    GCIndexMode mode;
+
+    /* Bloom modes. */
+    BlockedBloom *bloom;
+
+    /* Exact mode. */
+    IdBucket *buckets;
+};
+
+/*
+ * The number of bits in the bloom filter is 6 times the number of all blocks.
+ * Let n be the number of blocks added to the bf (the number of live blocks).
+ * The filter is a blocked one (see bloom-filter.h), which needs a few more
+ * bits than a plain one: with m/n = 6 the probability of false-positive is
+ *
+ *     p = 0.10
+ *
+ * Because m = 6 * total_blocks >= 6 * (live blocks) = 6n, we should have p <= 0.10.
+ * Put it another way, we'll clean up at least 90% dead blocks in each gc operation.
+ *
+ * Supose we have 8TB space, and the avg block size is 1MB, we'll have 8M blocks, then
+ * the size of bf is (8M * 6)/8 = 6MB.
+ *
+ * If total_blocks is a small number (e.g. < 100), we should try to clean all dead blocks.
+ * So we set the minimal size of the bf to 1KB.
+ */
+static int
+alloc_bloom (GCIndex *index, guint64 total_blocks)
+{
+    guint64 size;
+
+    size = MAX (total_blocks * BF_BITS_PER_BLOCK, MIN_BF_SIZE);
+    size = MIN (size, MAX_BF_SIZE);
+
+    index->bloom = bbloom_create (size);
+
+    return index->bloom ? 0 : -1;
+}
+
+/* Sized for @fp_rate at any store size, since each lookup touches one
+ * cache line however large the filter is.
+ */
+static int
+alloc_scalable_bloom (GCIndex *index, guint64 total_blocks, double fp_rate)
+{
+    guint64 total_bits;
+
+    if (fp_rate <= 0 || fp_rate >= 1)
+        fp_rate = 0.01;
+
+    total_bits = (guint64)ceil (bbloom_bits_per_id (fp_rate) * total_blocks);
+    total_bits = MAX (total_bits, MIN_BF_SIZE);
+
+    index->bloom = bbloom_create (total_bits);
+
+    return index->bloom ? 0 : -1;
+}
+
+GCIndex *
+gc_index_new (GCIndexMode mode, guint64 total_blocks, double fp_rate)
+{
+    GCIndex *index = g_new0 (GCIndex, 1);
+    int ret = 0;
+
+    index->mode = mode;
+
+    switch (mode) {
+    case GC_INDEX_BLOOM:
+        ret = alloc_bloom (index, total_blocks);
+        break;
+    case GC_INDEX_SCALABLE:
+        ret = alloc_scalable_bloom (index, total_blocks, fp_rate);
+        break;
+    case GC_INDEX_EXACT:
+        index->buckets = g_new0 (IdBucket, MAX_PARTS);
+        break;
+    }
+
+    if (ret < 0) {
+        gc_index_free (index);
+        return NULL;
+    }
+
+    return index;
+}
+
+void
+gc_index_free (GCIndex *index)
+{
+    int i;
+
+    if (!index)
+        return;
+
+    bbloom_destroy (index->bloom);
+
+    if (index->buckets) {
+        for (i = 0; i < MAX_PARTS; ++i)
+            g_free (index->buckets[i].ids);
+        g_free (index->buckets);
+    }
+
+    g_free (index);
+}
+
+static int
+compare_ids (const void *a, const void *b)
+{
+    return memcmp (a, b, 20);
+}
+
+static void
+sort_bucket (IdBucket *bucket)
+{
+    gsize i, n = 0;
+
+    if (bucket->n_sorted == bucket->n)
+        return;
+
+    qsort (bucket->ids, bucket->n, 20, compare_ids);
+    for (i = 0; i < bucket->n; ++i) {
+        if (n > 0 && memcmp (bucket->ids + (n - 1) * 20,
+                             bucket->ids + i * 20, 20) == 0)
+            continue;
+        if (n != i)
+            memcpy (bucket->ids + n * 20, bucket->ids + i * 20, 20);
+        ++n;
+    }
+    bucket->n = bucket->n_sorted = n;
+}
+
+static void
+add_exact (GCIndex *index, const char *block_id)
+{
+    unsigned char raw[20];
+    IdBucket *bucket;
+
+    if (hex_to_rawdata (block_id, raw, 20) < 0) {
+        seaf_warning ("Invalid block id %s.\n", block_id);
+        return;
+    }
+
+    bucket = &index->buckets[raw[0]];
+    if (bucket->n == bucket->cap) {
+        if (bucket->n >= DEDUP_MIN_IDS && bucket->n >= 2 * bucket->n_sorted) {
+            sort_bucket (bucket);
+            if (bucket->n < bucket->cap)
+                goto add;
+        }
+        bucket->cap = MAX (bucket->cap * 2, 64);
+        bucket->ids = g_realloc (bucket->ids, bucket->cap * 20);
+    }
+
+add:
+    memcpy (bucket->ids + bucket->n * 20, raw, 20);
+    ++bucket->n;
+}
+
+void
+gc_index_add (GCIndex *index, const char *block_id)
+{
+    unsigned char raw[20];
+
+    if (index->mode == GC_INDEX_EXACT) {
+        add_exact (index, block_id);
+        return;
+    }
+
+    if (hex_to_rawdata (block_id, raw, 20) < 0) {
+        seaf_warning ("Invalid block id %s.\n", block_id);
+        return;
+    }
+    bbloom_add (index->bloom, raw);
+}
+
+void
+gc_index_finish (GCIndex *index)
+{
+    int i;
+
+    if (index->mode != GC_INDEX_EXACT)
+        return;
+
+    for (i = 0; i < MAX_PARTS; ++i)
+        sort_bucket (&index->buckets[i]);
+}
+
+gboolean
+gc_index_test (GCIndex *index, const char *block_id)
+{
+    unsigned char raw[20];
+    IdBucket *bucket;
+
+    /* Keep what can't be looked up. */
+    if (hex_to_rawdata (block_id, raw, 20) < 0)
+        return TRUE;
+
+    if (index->mode != GC_INDEX_EXACT)
+        return bbloom_test (index->bloom, raw);
+
+    bucket = &index->buckets[raw[0]];
+    return bsearch (raw, bucket->ids, bucket->n, 20, compare_ids) != NULL;
+}
+
+void
+gc_index_test_batch (GCIndex *index, char **block_ids, int n_blocks,
+                     gboolean *live)
+{
+    unsigned char raw[TEST_BATCH * 20];
+    int pos[TEST_BATCH], results[TEST_BATCH];
+    int i, j, n;
+
+    if (index->mode == GC_INDEX_EXACT) {
+        for (i = 0; i < n_blocks; ++i)
+            live[i] = gc_index_test (index, block_ids[i]);
+        return;
+    }
+
+    for (i = 0; i < n_blocks; ) {
+        /* Bad ids are kept and left out of the batch. */
+        for (n = 0; i < n_blocks && n < TEST_BATCH; ++i) {
+            if (hex_to_rawdata (block_ids[i], raw + n * 20, 20) < 0) {
+                live[i] = TRUE;
+                continue;
+            }
+            pos[n++] = i;
+        }
+
+        bbloom_test_batch (index->bloom, raw, n, results);
+        for (j = 0; j < n; ++j)
+            live[pos[j]] = results[j];
+    }
+}
+
+guint64
+gc_index_size (GCIndex *index)
+{
+    guint64 size = 0;
+    int i;
+
+    if (index->bloom)
+        size += bbloom_size (index->bloom);
+
+    if (index->buckets) {
+        for (i = 0; i < MAX_PARTS; ++i)
+            size += index->buckets[i].cap * 20;
+    }
+
+    return size;
+}
+
+double
+gc_index_false_positive_rate (GCIndex *index, guint64 n_live)
+{
+    if (index->mode == GC_INDEX_EXACT)
+        return 0;
+
+    return bbloom_false_positive_rate (index->bloom, n_live);
+}
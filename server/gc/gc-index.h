@@ -0,0 +1,64 @@
+#ifndef GC_INDEX_H
+#define GC_INDEX_H
+
+#include <glib.h>
+
+/*
+ * The set of live blocks GC finds in a store.
+ *
+ * GC_INDEX_BLOOM:     a Bloom filter of 6 bits per block, capped at 64MB.
+ *                     Large stores keep more garbage.
+ * GC_INDEX_SCALABLE:  a Bloom filter sized to keep a given false positive
+ *                     rate at any store size.
+ *
+ * The Bloom modes use blocked filters, so a lookup costs one cache miss.
+ * GC_INDEX_EXACT:     the raw ids of the live blocks, 20 bytes each.
+ *                     No garbage is kept.
+ */
+typedef enum GCIndexMode {
+    GC_INDEX_BLOOM,
+    GC_INDEX_SCALABLE,
+    GC_INDEX_EXACT,
+} GCIndexMode;
+
+typedef struct GCIndex GCIndex;
+
+/*
+ * @total_blocks is the number of blocks in the store, an upper bound of
+ * the live blocks. @fp_rate is only used by GC_INDEX_SCALABLE.
+ */
+GCIndex *
+gc_index_new (GCIndexMode mode, guint64 total_blocks, double fp_rate);
+
+void
+gc_index_free (GCIndex *index);
+
+/* Not thread safe. */
+void
+gc_index_add (GCIndex *index, const char *block_id);
+
+/* Called after all live blocks are added, before testing. */
+void
+gc_index_finish (GCIndex *index);
+
+gboolean
+gc_index_test (GCIndex *index, const char *block_id);
+
+/* Test @n_blocks ids at once, setting @live for each. Faster than
+ * testing them one by one for the Bloom modes.
+ */
+void
+gc_index_test_batch (GCIndex *index, char **block_ids, int n_blocks,
+                     gboolean *live);
+
+/* Memory used by the index, in bytes. */
+guint64
+gc_index_size (GCIndex *index);
+
+/* Estimated chance that a garbage block tests as live, with @n_live
+ * blocks added.
+ */
+double
+gc_index_false_positive_rate (GCIndex *index, guint64 n_live);
+
+#endif
@@ -0,0 +1,869 @@
+/* -*- Mode: C; tab-width: 4; indent-tabs-mode: nil; c-basic-offset: 4 -*- */
+
+#include "common.h"
+
+#include "seafile-session.h"
+#include "diff-simple.h"
+#include "gc-refcount.h"
+#include "utils.h"
+
+#define DEBUG_FLAG SEAFILE_DEBUG_OTHER
+#include "log.h"
+
+/* The commits of a repo counted now. */
+typedef struct RepoCommits {
+    char *repo_id;
+    /* Ids of the saved commits to forget. */
+    GList *removed;
+    /* commit id -> is_root, of the commits to save */
+    GHashTable *saved;
+} RepoCommits;
+
+typedef struct RefcountData {
+    const char *store_id;
+    int version;
+    /* Count from scratch rather than from the saved counts. */
+    gboolean rebuild;
+
+    /* file id -> change of its references */
+    GHashTable *file_deltas;
+    /* id -> new count, of the files and blocks whose counts change */
+    GHashTable *file_refs;
+    GHashTable *block_refs;
+
+    GList *repo_commits;
+    gint64 next_expire;
+} RefcountData;
+
+static void
+repo_commits_free (RepoCommits *rc)
+{
+    g_free (rc->repo_id);
+    string_list_free (rc->removed);
+    g_hash_table_destroy (rc->saved);
+    g_free (rc);
+}
+
+static GHashTable *
+counts_new ()
+{
+    return g_hash_table_new_full (g_str_hash, g_str_equal, g_free, NULL);
+}
+
+static int
+get_count (GHashTable *counts, const char *id)
+{
+    return GPOINTER_TO_INT (g_hash_table_lookup (counts, id));
+}
+
+static void
+add_count (GHashTable *counts, const char *id, int delta)
+{
+    g_hash_table_replace (counts, g_strdup (id),
+                          GINT_TO_POINTER (get_count (counts, id) + delta));
+}
+
+static RefcountData *
+refcount_data_new (const char *store_id, int version, gboolean rebuild)
+{
+    RefcountData *data = g_new0 (RefcountData, 1);
+
+    data->store_id = store_id;
+    data->version = version;
+    data->rebuild = rebuild;
+    data->file_deltas = counts_new ();
+    data->file_refs = counts_new ();
+    data->block_refs = counts_new ();
+    data->next_expire = G_MAXINT64;
+
+    return data;
+}
+
+static void
+refcount_data_free (RefcountData *data)
+{
+    g_hash_table_destroy (data->file_deltas);
+    g_hash_table_destroy (data->file_refs);
+    g_hash_table_destroy (data->block_refs);
+    g_list_free_full (data->repo_commits, (GDestroyNotify)repo_commits_free);
+    g_free (data);
+}
+
+typedef struct {
+    GHashTable *deltas;
+    int delta;
+} CommitRefsData;
+
+static int
+commit_refs_files (int n, const char *basedir, SeafDirent *files[], void *vdata)
+{
+    CommitRefsData *data = vdata;
+
+    if (!files[0] || strcmp (files[0]->id, EMPTY_SHA1) == 0)
+        return 0;
+    /* Only the mode changed. */
+    if (files[1] && strcmp (files[0]->id, files[1]->id) == 0)
+        return 0;
+
+    add_count (data->deltas, files[0]->id, data->delta);
+    return 0;
+}
+
+static int
+commit_refs_dirs (int n, const char *basedir, SeafDirent *dirs[], void *vdata,
+                  gboolean *recurse)
+{
+    /* The commit adds nothing under a dir it doesn't have. */
+    *recurse = (dirs[0] != NULL);
+    return 0;
+}
+
+/* Add @delta to the references of the files @commit refers to. */
+static int
+add_commit_refs (RefcountData *data, const char *repo_id, SeafCommit *commit,
+                 gboolean is_root, int delta)
+{
+    SeafCommit *parent = NULL;
+    const char *roots[2];
+    CommitRefsData crd;
+    DiffOptions opts;
+    int ret = 0;
+
+    roots[0] = commit->root_id;
+    roots[1] = EMPTY_SHA1;
+    if (!is_root) {
+        parent = seaf_commit_manager_get_commit (seaf->commit_mgr,
+                                                 repo_id, data->version,
+                                                 commit->parent_id);
+        if (!parent) {
+            seaf_warning ("Failed to find commit %s of repo %.8s.\n",
+                          commit->parent_id, repo_id);
+            return -1;
+        }
+        roots[1] = parent->root_id;
+    }
+
+    if (strcmp (roots[0], roots[1]) == 0)
+        goto out;
+
+    crd.deltas = data->file_deltas;
+    crd.delta = delta;
+
+    memset (&opts, 0, sizeof(opts));
+    memcpy (opts.store_id, data->store_id, 36);
+    opts.version = data->version;
+    opts.file_cb = commit_refs_files;
+    opts.dir_cb = commit_refs_dirs;
+    opts.data = &crd;
+
+    ret = diff_trees (2, roots, &opts);
+    if (ret < 0)
+        seaf_warning ("Failed to diff commit %s of repo %.8s.\n",
+                      commit->commit_id, repo_id);
+
+out:
+    seaf_commit_unref (parent);
+    return ret;
+}
+
+typedef struct {
+    /* commit id -> SeafCommit */
+    GHashTable *kept;
+    gint64 truncate_time;
+    gboolean traversed_head;
+    gint64 next_expire;
+} KeptCommitsData;
+
+/* Keeps the same commits as traverse_commit() in gc-core.c. */
+static gboolean
+collect_kept_commit (SeafCommit *commit, void *vdata, gboolean *stop)
+{
+    KeptCommitsData *data = vdata;
+
+    if (data->truncate_time == 0) {
+        *stop = TRUE;
+    } else if (data->truncate_time > 0 &&
+               (gint64)(commit->ctime) < data->truncate_time &&
+               data->traversed_head) {
+        *stop = TRUE;
+    } else if (data->truncate_time > 0 && data->traversed_head) {
+        data->next_expire = MIN (data->next_expire, (gint64)commit->ctime);
+    }
+
+    data->traversed_head = TRUE;
+
+    seaf_commit_ref (commit);
+    g_hash_table_replace (data->kept, g_strdup (commit->commit_id), commit);
+
+    return TRUE;
+}
+
+static GHashTable *
+collect_kept_commits (RefcountData *data, SeafRepo *repo)
+{
+    GList *branches, *ptr;
+    SeafBranch *branch;
+    KeptCommitsData kd;
+    gboolean res = TRUE;
+
+    branches = seaf_branch_manager_get_branch_list (seaf->branch_mgr, repo->id);
+    if (branches == NULL) {
+        seaf_warning ("[GC] Failed to get branch list of repo %s.\n", repo->id);
+        return NULL;
+    }
+
+    kd.kept = g_hash_table_new_full (g_str_hash, g_str_equal, g_free,
+                                     (GDestroyNotify)seaf_commit_unref);
+    kd.truncate_time = seaf_repo_manager_get_repo_truncate_time (seaf->repo_mgr,
+                                                                 repo->id);
+    kd.traversed_head = FALSE;
+    kd.next_expire = G_MAXINT64;
+
+    for (ptr = branches; ptr; ptr = ptr->next) {
+        branch = ptr->data;
+        if (res)
+            res = seaf_commit_manager_traverse_commit_tree (seaf->commit_mgr,
+                                                            repo->id,
+                                                            repo->version,
+                                                            branch->commit_id,
+                                                            collect_kept_commit,
+                                                            &kd, FALSE);
+        seaf_branch_unref (branch);
+    }
+    g_list_free (branches);
+
+    if (!res) {
+        g_hash_table_destroy (kd.kept);
+        return NULL;
+    }
+
+    data->next_expire = MIN (data->next_expire, kd.next_expire);
+    return kd.kept;
+}
+
+/*
+ * Count the references of the commits of @repo_id added to @kept, or
+ * whose first parent expired, and take back those of the commits no
+ * longer kept. @kept is NULL if the repo is gone, and @saved is NULL if
+ * nothing of the repo is saved.
+ */
+static int
+count_repo_commits (RefcountData *data, const char *repo_id,
+                    GHashTable *kept, GHashTable *saved)
+{
+    RepoCommits *rc;
+    GHashTableIter iter;
+    gpointer key, value;
+    SeafCommit *commit;
+    gboolean is_root, was_root;
+    int ret = 0;
+
+    rc = g_new0 (RepoCommits, 1);
+    rc->repo_id = g_strdup (repo_id);
+    rc->saved = g_hash_table_new_full (g_str_hash, g_str_equal, g_free, NULL);
+    data->repo_commits = g_list_prepend (data->repo_commits, rc);
+
+    if (kept) {
+        g_hash_table_iter_init (&iter, kept);
+        while (ret == 0 && g_hash_table_iter_next (&iter, &key, &value)) {
+            commit = value;
+            is_root = (!commit->parent_id ||
+                       !g_hash_table_lookup (kept, commit->parent_id));
+
+            if (saved && g_hash_table_lookup_extended (saved, key, NULL, &value)) {
+                was_root = GPOINTER_TO_INT (value);
+                if (was_root == is_root)
+                    continue;
+                ret = add_commit_refs (data, repo_id, commit, was_root, -1);
+                if (ret < 0)
+                    break;
+                rc->removed = g_list_prepend (rc->removed, g_strdup (key));
+            }
+
+            ret = add_commit_refs (data, repo_id, commit, is_root, 1);
+            g_hash_table_replace (rc->saved, g_strdup (key),
+                                  GINT_TO_POINTER (is_root));
+        }
+    }
+
+    if (ret == 0 && saved) {
+        g_hash_table_iter_init (&iter, saved);
+        while (ret == 0 && g_hash_table_iter_next (&iter, &key, &value)) {
+            if (kept && g_hash_table_lookup (kept, key))
+                continue;
+
+            commit = seaf_commit_manager_get_commit (seaf->commit_mgr,
+                                                     repo_id, data->version,
+                                                     key);
+            if (!commit) {
+                seaf_warning ("Failed to find commit %s of repo %.8s.\n",
+                              (char *)key, repo_id);
+                ret = -1;
+                break;
+            }
+            ret = add_commit_refs (data, repo_id, commit,
+                                   GPOINTER_TO_INT (value), -1);
+            seaf_commit_unref (commit);
+            rc->removed = g_list_prepend (rc->removed, g_strdup (key));
+        }
+    }
+
+    return ret;
+}
+
+static gboolean
+collect_saved_commit (SeafDBRow *row, void *vdata)
+{
+    GHashTable *saved = vdata;
+    const char *repo_id = seaf_db_row_get_column_text (row, 0);
+    const char *commit_id = seaf_db_row_get_column_text (row, 1);
+    int is_root = seaf_db_row_get_column_int (row, 2);
+    GHashTable *commits;
+
+    commits = g_hash_table_lookup (saved, repo_id);
+    if (!commits) {
+        commits = g_hash_table_new_full (g_str_hash, g_str_equal, g_free, NULL);
+        g_hash_table_insert (saved, g_strdup (repo_id), commits);
+    }
+    g_hash_table_replace (commits, g_strdup (commit_id),
+                          GINT_TO_POINTER (is_root != 0));
+
+    return TRUE;
+}
+
+/* Returns repo id -> (commit id -> is_root), or NULL on error. */
+static GHashTable *
+load_saved_commits (const char *store_id)
+{
+    GHashTable *saved;
+
+    saved = g_hash_table_new_full (g_str_hash, g_str_equal, g_free,
+                                   (GDestroyNotify)g_hash_table_destroy);
+    if (seaf_db_statement_foreach_row (seaf->db,
+                                       "SELECT repo_id, commit_id, is_root "
+                                       "FROM GCRefCommit WHERE store_id=?",
+                                       collect_saved_commit, saved,
+                                       1, "string", store_id) < 0) {
+        g_hash_table_destroy (saved);
+        return NULL;
+    }
+
+    return saved;
+}
+
+static gboolean
+collect_count (SeafDBRow *row, void *vdata)
+{
+    GHashTable *counts = vdata;
+    const char *id = seaf_db_row_get_column_text (row, 0);
+    int refs = seaf_db_row_get_column_int (row, 1);
+
+    g_hash_table_replace (counts, g_strdup (id), GINT_TO_POINTER (refs));
+    return TRUE;
+}
+
+/* Load the saved counts of @ids in @table, or all of them if @all. */
+static int
+load_saved_counts (const char *table, const char *column,
+                   const char *store_id, GList *ids, gboolean all,
+                   GHashTable *counts)
+{
+    char *sql;
+    int ret;
+
+    if (all) {
+        sql = g_strdup_printf ("SELECT %s, refs FROM %s WHERE store_id=?",
+                               column, table);
+        ret = seaf_db_statement_foreach_row (seaf->db, sql,
+                                             collect_count, counts,
+                                             1, "string", store_id);
+    } else {
+        sql = g_strdup_printf ("SELECT %s, refs FROM %s WHERE store_id=? "
+                               "AND %s IN (%%s)", column, table, column);
+        ret = seaf_db_statement_foreach_row_in (seaf->db, sql, ids,
+                                                collect_count, counts,
+                                                1, "string", store_id);
+    }
+    g_free (sql);
+
+    if (ret < 0) {
+        seaf_warning ("Failed to load reference counts of store %.8s.\n",
+                      store_id);
+        return -1;
+    }
+    return 0;
+}
+
+/*
+ * Apply @deltas to the saved counts of @table, which are loaded into
+ * @saved, and put the results in @refs. Returns -1 if a count goes
+ * below 0, which means the saved counts are wrong.
+ */
+static int
+apply_deltas (RefcountData *data, const char *table, const char *column,
+              GHashTable *deltas, GHashTable *saved, GHashTable *refs)
+{
+    GHashTableIter iter;
+    gpointer key, value;
+    GList *ids = NULL;
+    int old_refs, new_refs;
+    int ret = 0;
+
+    g_hash_table_iter_init (&iter, deltas);
+    while (g_hash_table_iter_next (&iter, &key, &value)) {
+        if (GPOINTER_TO_INT (value) != 0)
+            ids = g_list_prepend (ids, key);
+    }
+
+    if (ids && !data->rebuild &&
+        load_saved_counts (table, column, data->store_id, ids, FALSE,
+                           saved) < 0) {
+        ret = -1;
+        goto out;
+    }
+
+    g_hash_table_iter_init (&iter, deltas);
+    while (g_hash_table_iter_next (&iter, &key, &value)) {
+        if (GPOINTER_TO_INT (value) == 0)
+            continue;
+
+        old_refs = get_count (saved, key);
+        new_refs = old_refs + GPOINTER_TO_INT (value);
+        if (new_refs < 0) {
+            seaf_warning ("Reference count of %s in store %.8s is below 0. "
+                          "Run seafserv-gc --check-refcount to repair it.\n",
+                          (char *)key, data->store_id);
+            ret = -1;
+            goto out;
+        }
+        g_hash_table_replace (refs, g_strdup (key),
+                              GINT_TO_POINTER (new_refs));
+    }
+
+out:
+    g_list_free (ids);
+    return ret;
+}
+
+/* Count the blocks of the files that gained their first reference or
+ * lost their last one.
+ */
+static int
+resolve_counts (RefcountData *data)
+{
+    GHashTable *block_deltas = counts_new ();
+    GHashTable *old_refs = counts_new ();
+    GHashTable *old_block_refs = counts_new ();
+    GHashTableIter iter;
+    gpointer key, value;
+    Seafile *seafile;
+    gboolean had_refs, has_refs;
+    int i, ret = 0;
+
+    ret = apply_deltas (data, "GCFileRef", "file_id", data->file_deltas,
+                        old_refs, data->file_refs);
+    if (ret < 0)
+        goto out;
+
+    g_hash_table_iter_init (&iter, data->file_refs);
+    while (g_hash_table_iter_next (&iter, &key, &value)) {
+        had_refs = (get_count (old_refs, key) > 0);
+        has_refs = (GPOINTER_TO_INT (value) > 0);
+        if (had_refs == has_refs)
+            continue;
+
+        seafile = seaf_fs_manager_get_seafile (seaf->fs_mgr, data->store_id,
+                                               data->version, key);
+        if (!seafile) {
+            seaf_warning ("Failed to find file %s.\n", (char *)key);
+            ret = -1;
+            goto out;
+        }
+        for (i = 0; i < seafile->n_blocks; ++i)
+            add_count (block_deltas, seafile->blk_sha1s[i], has_refs ? 1 : -1);
+        seafile_unref (seafile);
+    }
+
+    ret = apply_deltas (data, "GCBlockRef", "block_id", block_deltas,
+                        old_block_refs, data->block_refs);
+
+out:
+    g_hash_table_destroy (old_refs);
+    g_hash_table_destroy (old_block_refs);
+    g_hash_table_destroy (block_deltas);
+    return ret;
+}
+
+static int
+count_store (RefcountData *data, GList *repos)
+{
+    GHashTable *saved = NULL, *kept;
+    GHashTableIter iter;
+    gpointer key, value;
+    GList *ptr;
+    SeafRepo *repo;
+    int ret = 0;
+
+    if (!data->rebuild) {
+        saved = load_saved_commits (data->store_id);
+        if (!saved)
+            return -1;
+    }
+
+    for (ptr = repos; ptr && ret == 0; ptr = ptr->next) {
+        repo = ptr->data;
+        kept = collect_kept_commits (data, repo);
+        if (!kept) {
+            ret = -1;
+            break;
+        }
+        ret = count_repo_commits (data, repo->id, kept,
+                                  saved ? g_hash_table_lookup (saved, repo->id) : NULL);
+        g_hash_table_destroy (kept);
+        if (saved)
+            g_hash_table_remove (saved, repo->id);
+    }
+
+    /* Virtual repos deleted since. */
+    if (ret == 0 && saved) {
+        g_hash_table_iter_init (&iter, saved);
+        while (ret == 0 && g_hash_table_iter_next (&iter, &key, &value))
+            ret = count_repo_commits (data, key, NULL, value);
+    }
+
+    if (ret == 0)
+        ret = resolve_counts (data);
+
+    if (saved)
+        g_hash_table_destroy (saved);
+    return ret;
+}
+
+static int
+save_counts (SeafDBTrans *trans, RefcountData *data, const char *table,
+             const char *column, GHashTable *refs)
+{
+    SeafDBBatch *batch;
+    GHashTableIter iter;
+    gpointer key, value;
+    GList *ids;
+    char *sql;
+    int ret = 0;
+
+    if (!data->rebuild && g_hash_table_size (refs) > 0) {
+        ids = g_hash_table_get_keys (refs);
+        sql = g_strdup_printf ("DELETE FROM %s WHERE store_id=? AND %s IN (%%s)",
+                               table, column);
+        ret = seaf_db_statement_query_in (seaf->db, trans, sql, ids,
+                                          1, "string", data->store_id);
+        g_free (sql);
+        g_list_free (ids);
+        if (ret < 0)
+            return -1;
+    }
+
+    sql = g_strdup_printf ("INSERT INTO %s (store_id, %s, refs) VALUES",
+                           table, column);
+    batch = seaf_db_batch_new (seaf->db, trans, sql, NULL, 3);
+    g_free (sql);
+    if (!batch)
+        return -1;
+
+    g_hash_table_iter_init (&iter, refs);
+    while (ret == 0 && g_hash_table_iter_next (&iter, &key, &value)) {
+        if (GPOINTER_TO_INT (value) == 0)
+            continue;
+        ret = seaf_db_batch_add_row (batch,
+                                     "string", data->store_id,
+                                     "string", (char *)key,
+                                     "int", GPOINTER_TO_INT (value));
+    }
+
+    if (seaf_db_batch_finish (batch) < 0)
+        ret = -1;
+    return ret;
+}
+
+static int
+save_commits (SeafDBTrans *trans, RefcountData *data)
+{
+    SeafDBBatch *batch;
+    RepoCommits *rc;
+    GHashTableIter iter;
+    gpointer key, value;
+    GList *ptr;
+    int ret = 0;
+
+    for (ptr = data->repo_commits; ptr && ret == 0; ptr = ptr->next) {
+        rc = ptr->data;
+        if (!data->rebuild && rc->removed)
+            ret = seaf_db_statement_query_in (seaf->db, trans,
+                                              "DELETE FROM GCRefCommit WHERE "
+                                              "repo_id=? AND commit_id IN (%s)",
+                                              rc->removed,
+                                              1, "string", rc->repo_id);
+    }
+    if (ret < 0)
+        return -1;
+
+    batch = seaf_db_batch_new (seaf->db, trans,
+                               "INSERT INTO GCRefCommit (store_id, repo_id, "
+                               "commit_id, is_root) VALUES", NULL, 4);
+    if (!batch)
+        return -1;
+
+    for (ptr = data->repo_commits; ptr && ret == 0; ptr = ptr->next) {
+        rc = ptr->data;
+        g_hash_table_iter_init (&iter, rc->saved);
+        while (ret == 0 && g_hash_table_iter_next (&iter, &key, &value))
+            ret = seaf_db_batch_add_row (batch,
+                                         "string", data->store_id,
+                                         "string", rc->repo_id,
+                                         "string", (char *)key,
+                                         "int", GPOINTER_TO_INT (value));
+    }
+
+    if (seaf_db_batch_finish (batch) < 0)
+        ret = -1;
+    return ret;
+}
+
+static int
+save_refs (RefcountData *data)
+{
+    SeafDBTrans *trans;
+    int ret = 0;
+
+    trans = seaf_db_begin_transaction (seaf->db);
+    if (!trans)
+        return -1;
+
+    if (data->rebuild) {
+        if (seaf_db_trans_query (trans, "DELETE FROM GCRefCommit WHERE store_id=?",
+                                 1, "string", data->store_id) < 0 ||
+            seaf_db_trans_query (trans, "DELETE FROM GCFileRef WHERE store_id=?",
+                                 1, "string", data->store_id) < 0 ||
+            seaf_db_trans_query (trans, "DELETE FROM GCBlockRef WHERE store_id=?",
+                                 1, "string", data->store_id) < 0) {
+            ret = -1;
+            goto out;
+        }
+    }
+
+    ret = save_counts (trans, data, "GCFileRef", "file_id", data->file_refs);
+    if (ret < 0)
+        goto out;
+
+    ret = save_counts (trans, data, "GCBlockRef", "block_id", data->block_refs);
+    if (ret < 0)
+        goto out;
+
+    ret = save_commits (trans, data);
+    if (ret < 0)
+        goto out;
+
+    ret = seaf_db_commit (trans);
+
+out:
+    if (ret < 0) {
+        seaf_warning ("Failed to save reference counts of store %.8s.\n",
+                      data->store_id);
+        seaf_db_rollback (trans);
+    }
+    seaf_db_trans_close (trans);
+    return ret;
+}
+
+int
+gc_refcount_update (const char *store_id, int version, GList *repos,
+                    gint64 *next_expire)
+{
+    RefcountData *data;
+    int ret;
+
+    data = refcount_data_new (store_id, version, FALSE);
+
+    ret = count_store (data, repos);
+    if (ret == 0)
+        ret = save_refs (data);
+
+    *next_expire = data->next_expire;
+    refcount_data_free (data);
+    return ret;
+}
+
+typedef struct {
+    GCIndex *index;
+    guint64 n_blocks;
+} LoadBlocksData;
+
+static gboolean
+add_live_block (SeafDBRow *row, void *vdata)
+{
+    LoadBlocksData *data = vdata;
+
+    gc_index_add (data->index, seaf_db_row_get_column_text (row, 0));
+    ++data->n_blocks;
+    return TRUE;
+}
+
+int
+gc_refcount_load_blocks (const char *store_id, GCIndex *index,
+                         guint64 *n_blocks)
+{
+    LoadBlocksData data;
+
+    data.index = index;
+    data.n_blocks = 0;
+
+    if (seaf_db_statement_foreach_row (seaf->db,
+                                       "SELECT block_id FROM GCBlockRef "
+                                       "WHERE store_id=? AND refs>0",
+                                       add_live_block, &data,
+                                       1, "string", store_id) < 0) {
+        seaf_warning ("Failed to load referenced blocks of store %.8s.\n",
+                      store_id);
+        return -1;
+    }
+
+    *n_blocks = data.n_blocks;
+    return 0;
+}
+
+/* Number of ids whose counts differ, missing ones being 0. */
+static int
+count_differences (GHashTable *counts, GHashTable *saved)
+{
+    GHashTableIter iter;
+    gpointer key, value;
+    int n = 0;
+
+    g_hash_table_iter_init (&iter, counts);
+    while (g_hash_table_iter_next (&iter, &key, &value)) {
+        if (GPOINTER_TO_INT (value) != get_count (saved, key))
+            ++n;
+    }
+
+    g_hash_table_iter_init (&iter, saved);
+    while (g_hash_table_iter_next (&iter, &key, &value)) {
+        if (GPOINTER_TO_INT (value) != 0 &&
+            !g_hash_table_lookup_extended (counts, key, NULL, NULL))
+            ++n;
+    }
+
+    return n;
+}
+
+static int
+count_commit_differences (RefcountData *data, GHashTable *saved)
+{
+    RepoCommits *rc;
+    GHashTable *commits;
+    GHashTableIter iter;
+    gpointer key, value, saved_value;
+    GList *ptr;
+    int n = 0;
+
+    for (ptr = data->repo_commits; ptr; ptr = ptr->next) {
+        rc = ptr->data;
+        commits = g_hash_table_lookup (saved, rc->repo_id);
+
+        g_hash_table_iter_init (&iter, rc->saved);
+        while (g_hash_table_iter_next (&iter, &key, &value)) {
+            if (!commits ||
+                !g_hash_table_lookup_extended (commits, key, NULL, &saved_value) ||
+                saved_value != value)
+                ++n;
+        }
+
+        if (!commits)
+            continue;
+        g_hash_table_iter_init (&iter, commits);
+        while (g_hash_table_iter_next (&iter, &key, &value)) {
+            if (!g_hash_table_lookup_extended (rc->saved, key, NULL, NULL))
+                ++n;
+        }
+    }
+
+    /* Saved commits of repos that are gone. */
+    g_hash_table_iter_init (&iter, saved);
+    while (g_hash_table_iter_next (&iter, &key, &value)) {
+        for (ptr = data->repo_commits; ptr; ptr = ptr->next) {
+            rc = ptr->data;
+            if (strcmp (rc->repo_id, key) == 0)
+                break;
+        }
+        if (!ptr)
+            n += g_hash_table_size (value);
+    }
+
+    return n;
+}
+
+int
+gc_refcount_verify (const char *store_id, int version, GList *repos,
+                    gboolean repair)
+{
+    RefcountData *data;
+    GHashTable *saved_files = NULL, *saved_blocks = NULL, *saved_commits = NULL;
+    int wrong_files, wrong_blocks, wrong_commits;
+    int ret = -1;
+
+    data = refcount_data_new (store_id, version, TRUE);
+    if (count_store (data, repos) < 0)
+        goto out;
+
+    saved_files = counts_new ();
+    saved_blocks = counts_new ();
+    saved_commits = load_saved_commits (store_id);
+    if (!saved_commits ||
+        load_saved_counts ("GCFileRef", "file_id", store_id, NULL, TRUE,
+                           saved_files) < 0 ||
+        load_saved_counts ("GCBlockRef", "block_id", store_id, NULL, TRUE,
+                           saved_blocks) < 0)
+        goto out;
+
+    wrong_files = count_differences (data->file_refs, saved_files);
+    wrong_blocks = count_differences (data->block_refs, saved_blocks);
+    wrong_commits = count_commit_differences (data, saved_commits);
+
+    seaf_message ("Store %.8s: %u files and %u blocks are referenced. "
+                  "%d file counts, %d block counts and %d commit records "
+                  "are wrong.\n", store_id,
+                  g_hash_table_size (data->file_refs),
+                  g_hash_table_size (data->block_refs),
+                  wrong_files, wrong_blocks, wrong_commits);
+
+    ret = wrong_files + wrong_blocks + wrong_commits;
+    if (ret > 0 && repair) {
+        if (save_refs (data) < 0)
+            ret = -1;
+        else
+            seaf_message ("Reference counts of store %.8s are rebuilt.\n",
+                          store_id);
+    }
+
+out:
+    if (saved_files)
+        g_hash_table_destroy (saved_files);
+    if (saved_blocks)
+        g_hash_table_destroy (saved_blocks);
+    if (saved_commits)
+        g_hash_table_destroy (saved_commits);
+    refcount_data_free (data);
+    return ret;
+}
+
+void
+gc_refcount_remove_store (const char *store_id)
+{
+    seaf_db_statement_query (seaf->db,
+                             "DELETE FROM GCRefCommit WHERE store_id=?",
+                             1, "string", store_id);
+    seaf_db_statement_query (seaf->db,
+                             "DELETE FROM GCFileRef WHERE store_id=?",
+                             1, "string", store_id);
+    seaf_db_statement_query (seaf->db,
+                             "DELETE FROM GCBlockRef WHERE store_id=?",
+                             1, "string", store_id);
+}
@@ -0,0 +1,50 @@
+#ifndef GC_REFCOUNT_H
+#define GC_REFCOUNT_H
+
+#include <glib.h>
+
+#include "gc-index.h"
+
+/*
+ * Reference counts of the file objects and blocks of a store, so that
+ * GC doesn't have to traverse all the kept history of a repo each time.
+ *
+ * A kept commit refers to the files it adds at a path, compared to its
+ * first parent. A commit whose first parent isn't kept any more, called
+ * a root, refers to all its files. So a file is referred to as long as
+ * any kept commit has it. A block is referred to by each file with
+ * references that has it.
+ *
+ * The counts are brought up to date with the commits kept now before
+ * each GC, so only the commits added and expired since are diffed.
+ */
+
+/*
+ * Update the counts of store @store_id from the commits kept by its
+ * @repos, the origin repo and its virtual repos. @next_expire is set to
+ * the oldest ctime of the kept history, see traverse_commit() in
+ * gc-core.c.
+ */
+int
+gc_refcount_update (const char *store_id, int version, GList *repos,
+                    gint64 *next_expire);
+
+/* Add the blocks with references to @index. */
+int
+gc_refcount_load_blocks (const char *store_id, GCIndex *index,
+                         guint64 *n_blocks);
+
+/*
+ * Count the references of the store from scratch and compare them to
+ * the saved ones. If @repair is set, the saved counts are replaced.
+ *
+ * Returns the number of wrong counts, or -1 on error.
+ */
+int
+gc_refcount_verify (const char *store_id, int version, GList *repos,
+                    gboolean repair);
+
+void
+gc_refcount_remove_store (const char *store_id);
+
+#endif
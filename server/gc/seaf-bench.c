@@ -0,0 +1,949 @@
+/* -*- Mode: C; tab-width: 4; indent-tabs-mode: nil; c-basic-offset: 4 -*- */
+
+/*
+ * seaf-bench writes a synthetic repo history into a new store and times
+ * the core operations on it: tree traversal, diff, merge, GC marking,
+ * directory listing and block I/O. The results are printed as JSON on
+ * the last line of the output, so that runs of different builds can be
+ * compared. The store is removed afterwards unless -k is given.
+ */
+
+#include "common.h"
+#include "log.h"
+
+#include <sys/stat.h>
+#include <getopt.h>
+#include <pthread.h>
+#include <jansson.h>
+
+#include <ccnet.h>
+
+#include "seafile-session.h"
+#include "diff-simple.h"
+#include "merge-new.h"
+#include "gc-index.h"
+
+#include "utils.h"
+
+#define MAX_FILE_BLOCKS 4
+#define BENCH_MTIME 1400000000
+#define BENCH_MODIFIER "bench@seafile.com"
+#define STD_FILE_MODE (S_IFREG | 0644)
+
+static char *config_dir = NULL;
+static char *seafile_dir = NULL;
+
+CcnetClient *ccnet_client;
+SeafileSession *seaf;
+
+typedef struct BenchParams {
+    int depth;                  /* levels of sub dirs under the root */
+    int fanout;                 /* sub dirs per dir */
+    int files;                  /* files per dir */
+    int history;                /* commits */
+    int changes;                /* files changed per commit */
+    int iterations;             /* runs of each benchmark */
+    int n_blocks;               /* blocks written and read */
+    int block_size;
+    int version;                /* repo version */
+    gboolean keep;
+} BenchParams;
+
+static BenchParams params = {
+    .depth = 3,
+    .fanout = 8,
+    .files = 16,
+    .history = 20,
+    .changes = 8,
+    .iterations = 3,
+    .n_blocks = 256,
+    .block_size = 1 << 20,
+    .version = CURRENT_REPO_VERSION,
+    .keep = FALSE,
+};
+
+/* The synthetic repo, a dir tree kept in memory. Names are implied by
+ * the positions, "dir-0001" and "file-0001.dat".
+ */
+typedef struct BenchDir {
+    char id[41];
+    gboolean dirty;
+    char (*files)[41];
+    gint64 *sizes;
+    int n_subdirs;
+    struct BenchDir **subdirs;
+} BenchDir;
+
+static char store_id[37];
+static GRand *rnd;
+static guint32 file_seq;
+static gint64 n_file_objs;
+static gint64 n_dir_objs;
+static gint64 n_commits;
+
+/* first and last commit of the history */
+static char first_root[41];
+static char head_root[41];
+static char head_commit[41];
+/* two branches off the head, changing different files */
+static char local_root[41];
+static char local_commit[41];
+static char remote_root[41];
+static char remote_commit[41];
+
+static GPtrArray *dir_paths;
+static char **block_ids;
+static char *block_buf;
+
+static const char *short_opts = "hvc:d:D:F:n:H:m:i:b:s:V:k";
+static const struct option long_opts[] = {
+    { "help", no_argument, NULL, 'h', },
+    { "version", no_argument, NULL, 'v', },
+    { "config-file", required_argument, NULL, 'c', },
+    { "seafdir", required_argument, NULL, 'd', },
+    { "depth", required_argument, NULL, 'D', },
+    { "fanout", required_argument, NULL, 'F', },
+    { "files", required_argument, NULL, 'n', },
+    { "history", required_argument, NULL, 'H', },
+    { "changes", required_argument, NULL, 'm', },
+    { "iterations", required_argument, NULL, 'i', },
+    { "blocks", required_argument, NULL, 'b', },
+    { "block-size", required_argument, NULL, 's', },
+    { "repo-version", required_argument, NULL, 'V', },
+    { "keep", no_argument, NULL, 'k', },
+    { NULL, 0, NULL, 0, },
+};
+
+static void usage ()
+{
+    fprintf (stderr,
+             "usage: seaf-bench [-c config_dir] [-d seafile_dir]\n"
+             "Additional options:\n"
+             "-D, --depth <n>: levels of sub dirs, default 3\n"
+             "-F, --fanout <n>: sub dirs per dir, default 8\n"
+             "-n, --files <n>: files per dir, at least 2, default 16\n"
+             "-H, --history <n>: commits, default 20\n"
+             "-m, --changes <n>: files changed per commit, default 8\n"
+             "-i, --iterations <n>: runs of each benchmark, default 3\n"
+             "-b, --blocks <n>: blocks written and read, default 256\n"
+             "-s, --block-size <KB>: default 1024\n"
+             "-V, --repo-version <1|2>: default 1\n"
+             "-k, --keep: don't remove the synthetic store\n");
+}
+
+static int
+new_file (char *file_id, gint64 *size)
+{
+    CDCFileDescriptor cdc;
+    Seafile file;
+    guint8 sha1s[MAX_FILE_BLOCKS * 20];
+    char hex[MAX_FILE_BLOCKS][41];
+    char *blk_sha1s[MAX_FILE_BLOCKS];
+    guint8 file_sha1[20];
+    char buf[128];
+    int n_blocks, i;
+
+    n_blocks = g_rand_int_range (rnd, 1, MAX_FILE_BLOCKS + 1);
+    for (i = 0; i < n_blocks; ++i) {
+        snprintf (buf, sizeof(buf), "%s-%u-%d", store_id, file_seq, i);
+        calculate_sha1 (&sha1s[i * 20], buf, strlen(buf));
+        rawdata_to_hex (&sha1s[i * 20], hex[i], 20);
+        blk_sha1s[i] = hex[i];
+    }
+    ++file_seq;
+
+    memset (&cdc, 0, sizeof(cdc));
+    cdc.file_size = (guint64)n_blocks * params.block_size;
+    cdc.block_nr = n_blocks;
+    cdc.blk_sha1s = sha1s;
+    seaf_fs_manager_calculate_seafile_id_json (params.version, &cdc, file_sha1);
+
+    memset (&file, 0, sizeof(file));
+    file.version = seafile_version_from_repo_version (params.version);
+    rawdata_to_hex (file_sha1, file.file_id, 20);
+    file.file_size = cdc.file_size;
+    file.n_blocks = n_blocks;
+    file.blk_sha1s = blk_sha1s;
+
+    if (seafile_save (seaf->fs_mgr, store_id, params.version, &file) < 0) {
+        seaf_warning ("Failed to save file %s.\n", file.file_id);
+        return -1;
+    }
+    ++n_file_objs;
+
+    memcpy (file_id, file.file_id, 41);
+    *size = file.file_size;
+    return 0;
+}
+
+static void
+bench_dir_free (BenchDir *dir)
+{
+    int i;
+
+    if (!dir)
+        return;
+
+    for (i = 0; i < dir->n_subdirs; ++i)
+        bench_dir_free (dir->subdirs[i]);
+    g_free (dir->subdirs);
+    g_free (dir->files);
+    g_free (dir->sizes);
+    g_free (dir);
+}
+
+static BenchDir *
+bench_dir_new (int depth, const char *path)
+{
+    BenchDir *dir = g_new0 (BenchDir, 1);
+    char *sub_path;
+    int i;
+
+    dir->dirty = TRUE;
+    dir->files = g_malloc (params.files * sizeof(*dir->files));
+    dir->sizes = g_new (gint64, params.files);
+    for (i = 0; i < params.files; ++i) {
+        if (new_file (dir->files[i], &dir->sizes[i]) < 0)
+            goto error;
+    }
+
+    g_ptr_array_add (dir_paths, g_strdup (path));
+
+    if (depth == 0)
+        return dir;
+
+    dir->subdirs = g_new0 (BenchDir *, params.fanout);
+    for (i = 0; i < params.fanout; ++i) {
+        sub_path = g_strdup_printf ("%s/dir-%04d",
+                                    strcmp (path, "/") == 0 ? "" : path, i);
+        dir->subdirs[i] = bench_dir_new (depth - 1, sub_path);
+        g_free (sub_path);
+        if (!dir->subdirs[i])
+            goto error;
+        ++dir->n_subdirs;
+    }
+
+    return dir;
+
+error:
+    bench_dir_free (dir);
+    return NULL;
+}
+
+static BenchDir *
+bench_dir_copy (BenchDir *dir)
+{
+    BenchDir *copy = g_new0 (BenchDir, 1);
+    int i;
+
+    memcpy (copy->id, dir->id, 41);
+    copy->dirty = dir->dirty;
+    copy->files = g_memdup (dir->files, params.files * sizeof(*dir->files));
+    copy->sizes = g_memdup (dir->sizes, params.files * sizeof(gint64));
+    copy->n_subdirs = dir->n_subdirs;
+    if (dir->n_subdirs > 0)
+        copy->subdirs = g_new0 (BenchDir *, dir->n_subdirs);
+    for (i = 0; i < dir->n_subdirs; ++i)
+        copy->subdirs[i] = bench_dir_copy (dir->subdirs[i]);
+
+    return copy;
+}
+
+static gint
+compare_dirents (gconstpointer a, gconstpointer b)
+{
+    const SeafDirent *denta = a, *dentb = b;
+
+    return strcmp (dentb->name, denta->name);
+}
+
+/* Save the changed dirs, bottom up. */
+static int
+save_dir (BenchDir *dir)
+{
+    int dir_version = dir_version_from_repo_version (params.version);
+    GList *entries = NULL;
+    SeafDir *seafdir;
+    char name[64];
+    int i, ret;
+
+    if (!dir->dirty)
+        return 0;
+
+    for (i = 0; i < dir->n_subdirs; ++i) {
+        if (save_dir (dir->subdirs[i]) < 0)
+            return -1;
+    }
+
+    for (i = 0; i < dir->n_subdirs; ++i) {
+        snprintf (name, sizeof(name), "dir-%04d", i);
+        entries = g_list_prepend (entries,
+                                  seaf_dirent_new (dir_version,
+                                                   dir->subdirs[i]->id,
+                                                   S_IFDIR, name,
+                                                   BENCH_MTIME, NULL, 0));
+    }
+
+    for (i = 0; i < params.files; ++i) {
+        snprintf (name, sizeof(name), "file-%04d.dat", i);
+        entries = g_list_prepend (entries,
+                                  seaf_dirent_new (dir_version,
+                                                   dir->files[i],
+                                                   STD_FILE_MODE, name,
+                                                   BENCH_MTIME, BENCH_MODIFIER,
+                                                   dir->sizes[i]));
+    }
+
+    entries = g_list_sort (entries, compare_dirents);
+    seafdir = seaf_dir_new (NULL, entries, dir_version);
+
+    ret = seaf_dir_save (seaf->fs_mgr, store_id, params.version, seafdir);
+    if (ret < 0)
+        seaf_warning ("Failed to save dir %s.\n", seafdir->dir_id);
+    else {
+        memcpy (dir->id, seafdir->dir_id, 41);
+        dir->dirty = FALSE;
+        ++n_dir_objs;
+    }
+
+    seaf_dir_free (seafdir);
+    return ret;
+}
+
+enum {
+    ANY_FILE,
+    FIRST_HALF,
+    SECOND_HALF,
+};
+
+/* Change a file of a random dir, in the given half of its files. */
+static int
+modify_random_file (BenchDir *root, int part)
+{
+    BenchDir *dir = root;
+    int half = params.files / 2;
+    int r, i;
+
+    dir->dirty = TRUE;
+    while (dir->n_subdirs > 0) {
+        r = g_rand_int_range (rnd, 0, dir->n_subdirs + 1);
+        if (r == dir->n_subdirs)
+            break;
+        dir = dir->subdirs[r];
+        dir->dirty = TRUE;
+    }
+
+    if (part == FIRST_HALF)
+        i = g_rand_int_range (rnd, 0, half);
+    else if (part == SECOND_HALF)
+        i = g_rand_int_range (rnd, half, params.files);
+    else
+        i = g_rand_int_range (rnd, 0, params.files);
+
+    return new_file (dir->files[i], &dir->sizes[i]);
+}
+
+static int
+modify_and_save (BenchDir *root, int part)
+{
+    int i;
+
+    for (i = 0; i < params.changes; ++i) {
+        if (modify_random_file (root, part) < 0)
+            return -1;
+    }
+
+    return save_dir (root);
+}
+
+static int
+add_commit (const char *root_id, const char *parent_id, char *commit_id)
+{
+    SeafCommit *commit;
+    char *desc;
+    int ret;
+
+    desc = g_strdup_printf ("seaf-bench commit %"G_GINT64_FORMAT, n_commits);
+    commit = seaf_commit_new (NULL, store_id, root_id,
+                              BENCH_MODIFIER, EMPTY_SHA1, desc,
+                              BENCH_MTIME + n_commits);
+    g_free (desc);
+
+    if (parent_id)
+        commit->parent_id = g_strdup (parent_id);
+    commit->repo_name = g_strdup ("seaf-bench");
+    commit->repo_desc = g_strdup ("");
+    commit->version = params.version;
+
+    ret = seaf_commit_manager_add_commit (seaf->commit_mgr, commit);
+    if (ret < 0)
+        seaf_warning ("Failed to add commit %s.\n", commit->commit_id);
+    else {
+        memcpy (commit_id, commit->commit_id, 41);
+        ++n_commits;
+    }
+
+    seaf_commit_unref (commit);
+    return ret;
+}
+
+static int
+generate_repo ()
+{
+    BenchDir *root, *remote = NULL;
+    char parent[41];
+    int i, ret = -1;
+
+    root = bench_dir_new (params.depth, "/");
+    if (!root || save_dir (root) < 0)
+        goto out;
+    if (add_commit (root->id, NULL, head_commit) < 0)
+        goto out;
+    memcpy (first_root, root->id, 41);
+
+    for (i = 1; i < params.history; ++i) {
+        memcpy (parent, head_commit, 41);
+        if (modify_and_save (root, ANY_FILE) < 0 ||
+            add_commit (root->id, parent, head_commit) < 0)
+            goto out;
+    }
+    memcpy (head_root, root->id, 41);
+
+    remote = bench_dir_copy (root);
+
+    if (modify_and_save (root, FIRST_HALF) < 0 ||
+        add_commit (root->id, head_commit, local_commit) < 0)
+        goto out;
+    memcpy (local_root, root->id, 41);
+
+    if (modify_and_save (remote, SECOND_HALF) < 0 ||
+        add_commit (remote->id, head_commit, remote_commit) < 0)
+        goto out;
+    memcpy (remote_root, remote->id, 41);
+
+    ret = 0;
+
+out:
+    bench_dir_free (root);
+    bench_dir_free (remote);
+    return ret;
+}
+
+static int
+generate_blocks ()
+{
+    unsigned char sha1[20];
+    int i;
+
+    block_buf = g_malloc (params.block_size);
+    for (i = 0; i < params.block_size; ++i)
+        block_buf[i] = (char)g_rand_int (rnd);
+
+    block_ids = g_new0 (char *, params.n_blocks + 1);
+    for (i = 0; i < params.n_blocks; ++i) {
+        /* Blocks only differ in their first bytes. */
+        memcpy (block_buf, &i, sizeof(i));
+        calculate_sha1 (sha1, block_buf, params.block_size);
+        block_ids[i] = g_new0 (char, 41);
+        rawdata_to_hex (sha1, block_ids[i], 20);
+    }
+
+    return 0;
+}
+
+static gboolean
+count_fs_obj (SeafFSManager *mgr, const char *repo_id, int version,
+              const char *obj_id, int type, void *user_data, gboolean *stop)
+{
+    gint64 *count = user_data;
+
+    ++(*count);
+    return TRUE;
+}
+
+static int
+bench_traverse (gint64 *count)
+{
+    return seaf_fs_manager_traverse_tree (seaf->fs_mgr, store_id,
+                                          params.version, head_root,
+                                          count_fs_obj, count, FALSE);
+}
+
+static int
+bench_diff (gint64 *count)
+{
+    GList *results = NULL, *ptr;
+
+    if (diff_commit_roots (store_id, params.version, first_root, head_root,
+                           &results, FALSE) < 0)
+        return -1;
+
+    for (ptr = results; ptr; ptr = ptr->next) {
+        ++(*count);
+        diff_entry_free ((DiffEntry *)ptr->data);
+    }
+    g_list_free (results);
+
+    return 0;
+}
+
+static int
+bench_merge (gint64 *count)
+{
+    MergeOptions opt;
+    const char *roots[3];
+
+    memset (&opt, 0, sizeof(opt));
+    opt.n_ways = 3;
+    memcpy (opt.remote_repo_id, store_id, 36);
+    memcpy (opt.remote_head, remote_commit, 40);
+    opt.do_merge = TRUE;
+    opt.parallel = TRUE;
+
+    roots[0] = head_root;
+    roots[1] = local_root;
+    roots[2] = remote_root;
+
+    if (seaf_merge_trees (store_id, params.version, 3, roots, &opt) < 0)
+        return -1;
+
+    if (opt.conflict)
+        seaf_warning ("Unexpected conflict in merge.\n");
+
+    *count = opt.visit_dirs;
+    return 0;
+}
+
+typedef struct MarkData {
+    GCIndex *index;
+    FSVisitedSet *visited;
+    pthread_mutex_t lock;
+    gint64 n_blocks;
+    gboolean error;
+} MarkData;
+
+static gboolean
+mark_fs_obj (SeafFSManager *mgr, const char *repo_id, int version,
+             const char *obj_id, int type, void *user_data, gboolean *stop)
+{
+    MarkData *data = user_data;
+    Seafile *file;
+    int i;
+
+    if (type != SEAF_METADATA_TYPE_FILE)
+        return TRUE;
+
+    file = seaf_fs_manager_get_seafile (mgr, repo_id, version, obj_id);
+    if (!file) {
+        seaf_warning ("Failed to find file %s.\n", obj_id);
+        return FALSE;
+    }
+
+    pthread_mutex_lock (&data->lock);
+    for (i = 0; i < file->n_blocks; ++i) {
+        gc_index_add (data->index, file->blk_sha1s[i]);
+        ++data->n_blocks;
+    }
+    pthread_mutex_unlock (&data->lock);
+
+    seafile_unref (file);
+    return TRUE;
+}
+
+static gboolean
+mark_commit (SeafCommit *commit, void *vdata, gboolean *stop)
+{
+    MarkData *data = vdata;
+
+    if (seaf_fs_manager_traverse_tree_parallel (seaf->fs_mgr, store_id,
+                                                params.version,
+                                                commit->root_id,
+                                                mark_fs_obj, data, FALSE,
+                                                data->visited) < 0) {
+        data->error = TRUE;
+        return FALSE;
+    }
+
+    return TRUE;
+}
+
+/* The mark phase of GC over the whole history, see gc-core.c. */
+static int
+bench_gc_mark (gint64 *count)
+{
+    MarkData data;
+    int ret = 0;
+
+    memset (&data, 0, sizeof(data));
+    data.index = gc_index_new (GC_INDEX_BLOOM,
+                               (guint64)file_seq * MAX_FILE_BLOCKS, 0);
+    data.visited = fs_visited_set_new ();
+    pthread_mutex_init (&data.lock, NULL);
+
+    if (!seaf_commit_manager_traverse_commit_tree (seaf->commit_mgr,
+                                                   store_id, params.version,
+                                                   local_commit,
+                                                   mark_commit, &data,
+                                                   FALSE) ||
+        data.error)
+        ret = -1;
+
+    gc_index_finish (data.index);
+    *count = data.n_blocks;
+
+    pthread_mutex_destroy (&data.lock);
+    fs_visited_set_free (data.visited);
+    gc_index_free (data.index);
+    return ret;
+}
+
+static int
+bench_list (gint64 *count)
+{
+    SeafDir *dir;
+    GError *error = NULL;
+    int i;
+
+    for (i = 0; i < dir_paths->len; ++i) {
+        dir = seaf_fs_manager_get_seafdir_by_path (seaf->fs_mgr, store_id,
+                                                   params.version, head_root,
+                                                   g_ptr_array_index (dir_paths, i),
+                                                   &error);
+        if (!dir) {
+            seaf_warning ("Failed to list %s.\n",
+                          (char *)g_ptr_array_index (dir_paths, i));
+            g_clear_error (&error);
+            return -1;
+        }
+        *count += g_list_length (dir->entries);
+        seaf_dir_free (dir);
+    }
+
+    return 0;
+}
+
+static int
+bench_block_write (gint64 *count)
+{
+    BlockHandle *handle;
+    int i, ret;
+
+    for (i = 0; i < params.n_blocks; ++i) {
+        memcpy (block_buf, &i, sizeof(i));
+
+        handle = seaf_block_manager_open_block (seaf->block_mgr, store_id,
+                                                params.version, block_ids[i],
+                                                BLOCK_WRITE);
+        if (!handle) {
+            seaf_warning ("Failed to open block %s.\n", block_ids[i]);
+            return -1;
+        }
+
+        ret = 0;
+        if (seaf_block_manager_write_block (seaf->block_mgr, handle,
+                                            block_buf,
+                                            params.block_size) != params.block_size ||
+            seaf_block_manager_close_block (seaf->block_mgr, handle) < 0 ||
+            seaf_block_manager_commit_block (seaf->block_mgr, handle) < 0) {
+            seaf_warning ("Failed to write block %s.\n", block_ids[i]);
+            ret = -1;
+        }
+        seaf_block_manager_block_handle_free (seaf->block_mgr, handle);
+        if (ret < 0)
+            return -1;
+
+        *count += params.block_size;
+    }
+
+    return 0;
+}
+
+static int
+bench_block_read (gint64 *count)
+{
+    BlockHandle *handle;
+    int i, n;
+
+    for (i = 0; i < params.n_blocks; ++i) {
+        handle = seaf_block_manager_open_block (seaf->block_mgr, store_id,
+                                                params.version, block_ids[i],
+                                                BLOCK_READ);
+        if (!handle) {
+            seaf_warning ("Failed to open block %s.\n", block_ids[i]);
+            return -1;
+        }
+
+        while ((n = seaf_block_manager_read_block (seaf->block_mgr, handle,
+                                                   block_buf,
+                                                   params.block_size)) > 0)
+            *count += n;
+
+        seaf_block_manager_close_block (seaf->block_mgr, handle);
+        seaf_block_manager_block_handle_free (seaf->block_mgr, handle);
+        if (n < 0) {
+            seaf_warning ("Failed to read block %s.\n", block_ids[i]);
+            return -1;
+        }
+    }
+
+    return 0;
+}
+
+typedef int (*BenchFunc) (gint64 *count);
+
+/*
+ * Run @func params.iterations times and add the time of the first and
+ * the fastest run to @results. The first run may find less in caches.
+ */
+static int
+run_bench (json_t *results, const char *name, BenchFunc func,
+           const char *count_name)
+{
+    gint64 start, elapsed, first = 0, best = 0, count = 0;
+    json_t *object;
+    int i;
+
+    for (i = 0; i < params.iterations; ++i) {
+        count = 0;
+        start = get_current_time ();
+        if (func (&count) < 0) {
+            seaf_warning ("Benchmark %s failed.\n", name);
+            return -1;
+        }
+        elapsed = get_current_time () - start;
+
+        if (i == 0)
+            first = best = elapsed;
+        else if (elapsed < best)
+            best = elapsed;
+    }
+
+    seaf_message ("%s: %.3f ms, best of %d runs.\n",
+                  name, best / 1000.0, params.iterations);
+
+    object = json_object ();
+    json_object_set_new (object, "first_ms", json_real (first / 1000.0));
+    json_object_set_new (object, "best_ms", json_real (best / 1000.0));
+    json_object_set_new (object, count_name, json_integer (count));
+    json_object_set_new (results, name, object);
+
+    return 0;
+}
+
+static gboolean
+collect_obj_id (const char *repo_id, int version,
+                const char *obj_id, void *user_data)
+{
+    GList **ids = user_data;
+
+    *ids = g_list_prepend (*ids, g_strdup (obj_id));
+    return TRUE;
+}
+
+static void
+remove_objects (struct SeafObjStore *obj_store)
+{
+    GList *ids = NULL, *ptr;
+
+    seaf_obj_store_foreach_obj (obj_store, store_id, params.version,
+                                collect_obj_id, &ids);
+    for (ptr = ids; ptr; ptr = ptr->next)
+        seaf_obj_store_delete_obj (obj_store, store_id, params.version,
+                                   ptr->data);
+    string_list_free (ids);
+}
+
+static void
+remove_store ()
+{
+    seaf_message ("Removing store %s.\n", store_id);
+
+    remove_objects (seaf->fs_mgr->obj_store);
+    remove_objects (seaf->commit_mgr->obj_store);
+    seaf_block_manager_remove_store (seaf->block_mgr, store_id);
+}
+
+static json_t *
+params_to_json ()
+{
+    json_t *object = json_object ();
+
+    json_object_set_new (object, "depth", json_integer (params.depth));
+    json_object_set_new (object, "fanout", json_integer (params.fanout));
+    json_object_set_new (object, "files", json_integer (params.files));
+    json_object_set_new (object, "history", json_integer (params.history));
+    json_object_set_new (object, "changes", json_integer (params.changes));
+    json_object_set_new (object, "iterations", json_integer (params.iterations));
+    json_object_set_new (object, "blocks", json_integer (params.n_blocks));
+    json_object_set_new (object, "block_size", json_integer (params.block_size));
+    json_object_set_new (object, "repo_version", json_integer (params.version));
+
+    return object;
+}
+
+static int
+run_benchmarks ()
+{
+    json_t *output, *results, *objects;
+    gint64 start, gen_time;
+    char *json;
+    int ret = -1;
+
+    output = json_object ();
+    results = json_object ();
+
+    seaf_message ("Generating store %s.\n", store_id);
+
+    start = get_current_time ();
+    if (generate_repo () < 0) {
+        seaf_warning ("Failed to generate repo.\n");
+        goto out;
+    }
+    gen_time = get_current_time () - start;
+
+    generate_blocks ();
+
+    if (run_bench (results, "traverse", bench_traverse, "objects") < 0 ||
+        run_bench (results, "diff", bench_diff, "entries") < 0 ||
+        run_bench (results, "merge", bench_merge, "visited_dirs") < 0 ||
+        run_bench (results, "gc_mark", bench_gc_mark, "blocks") < 0 ||
+        run_bench (results, "list", bench_list, "entries") < 0 ||
+        run_bench (results, "block_write", bench_block_write, "bytes") < 0 ||
+        run_bench (results, "block_read", bench_block_read, "bytes") < 0)
+        goto out;
+
+    objects = json_object ();
+    json_object_set_new (objects, "files", json_integer (n_file_objs));
+    json_object_set_new (objects, "dirs", json_integer (n_dir_objs));
+    json_object_set_new (objects, "commits", json_integer (n_commits));
+
+    json_object_set_new (output, "store_id", json_string (store_id));
+    json_object_set_new (output, "params", params_to_json ());
+    json_object_set_new (output, "objects", objects);
+    json_object_set_new (output, "generate_ms", json_real (gen_time / 1000.0));
+    json_object_set_new (output, "results", results);
+    results = NULL;
+
+    json = json_dumps (output, JSON_SORT_KEYS);
+    printf ("%s\n", json);
+    free (json);
+
+    ret = 0;
+
+out:
+    if (results)
+        json_decref (results);
+    json_decref (output);
+    return ret;
+}
+
+int
+main(int argc, char *argv[])
+{
+    int c;
+    int ret;
+
+    config_dir = DEFAULT_CONFIG_DIR;
+
+    while ((c = getopt_long(argc, argv,
+                short_opts, long_opts, NULL)) != EOF) {
+        switch (c) {
+        case 'h':
+            usage();
+            exit(0);
+        case 'v':
+            exit(-1);
+            break;
+        case 'c':
+            config_dir = strdup(optarg);
+            break;
+        case 'd':
+            seafile_dir = strdup(optarg);
+            break;
+        case 'D':
+            params.depth = atoi(optarg);
+            break;
+        case 'F':
+            params.fanout = atoi(optarg);
+            break;
+        case 'n':
+            params.files = atoi(optarg);
+            break;
+        case 'H':
+            params.history = atoi(optarg);
+            break;
+        case 'm':
+            params.changes = atoi(optarg);
+            break;
+        case 'i':
+            params.iterations = atoi(optarg);
+            break;
+        case 'b':
+            params.n_blocks = atoi(optarg);
+            break;
+        case 's':
+            params.block_size = atoi(optarg) << 10;
+            break;
+        case 'V':
+            params.version = atoi(optarg);
+            break;
+        case 'k':
+            params.keep = TRUE;
+            break;
+        default:
+            usage();
+            exit(-1);
+        }
+    }
+
+    if (params.depth < 0 || params.fanout < 1 || params.files < 2 ||
+        params.history < 1 || params.changes < 1 || params.iterations < 1 ||
+        params.n_blocks < 0 || params.block_size <= 0 ||
+        params.version < 1 || params.version > BINARY_FS_REPO_VERSION) {
+        usage();
+        exit(-1);
+    }
+
+#if !GLIB_CHECK_VERSION(2, 35, 0)
+    g_type_init();
+#endif
+
+    if (seafile_log_init ("-", "info", "debug") < 0) {
+        seaf_warning ("Failed to init log.\n");
+        exit (1);
+    }
+
+    ccnet_client = ccnet_client_new();
+    if ((ccnet_client_load_confdir(ccnet_client, config_dir)) < 0) {
+        seaf_warning ("Read config dir error\n");
+        return -1;
+    }
+
+    if (seafile_dir == NULL)
+        seafile_dir = g_build_filename (config_dir, "seafile-data", NULL);
+
+    seaf = seafile_session_new(seafile_dir, ccnet_client);
+    if (!seaf) {
+        seaf_warning ("Failed to create seafile session.\n");
+        exit (1);
+    }
+
+    /* Use the caches the fileserver uses. */
+    if (seaf_commit_manager_init (seaf->commit_mgr) < 0 ||
+        seaf_fs_manager_init (seaf->fs_mgr) < 0) {
+        seaf_warning ("Failed to init managers.\n");
+        exit (1);
+    }
+
+    gen_uuid_inplace (store_id);
+    /* The same parameters give the same trees. */
+    rnd = g_rand_new_with_seed (0);
+    dir_paths = g_ptr_array_new ();
+
+    ret = run_benchmarks ();
+
+    if (!params.keep)
+        remove_store ();
+
+    return ret < 0 ? 1 : 0;
+}
@@ -16,7 +16,7 @@ static char *seafile_dir = NULL;
 CcnetClient *ccnet_client;
 SeafileSession *seaf;
 
-static const char *short_opts = "hvc:d:reE:";
+static const char *short_opts = "hvc:d:reE:t:Rs";
 static const struct option long_opts[] = {
     { "help", no_argument, NULL, 'h', },
     { "version", no_argument, NULL, 'v', },
@@ -25,13 +25,22 @@ static const struct option long_opts[] = {
     { "export", required_argument, NULL, 'E', },
     { "config-file", required_argument, NULL, 'c', },
     { "seafdir", required_argument, NULL, 'd', },
+    { "threads", required_argument, NULL, 't', },
+    { "resume", no_argument, NULL, 'R', },
+    { "since", no_argument, NULL, 's', },
+    { NULL, 0, NULL, 0, },
 };
 
 static void usage ()
 {
     fprintf (stderr,
              "usage: seaf-fsck [-r] [-e] [-E exported_path] [-c config_dir] [-d seafile_dir] "
-             "[repo_id_1 [repo_id_2 ...]]\n");
+             "[repo_id_1 [repo_id_2 ...]]\n"
+             "Additional options:\n"
+             "-t, --threads <n>: check n repos, or export n files, "
+             "at the same time, default 1\n"
+             "-R, --resume: skip what an interrupted run has checked\n"
+             "-s, --since: only check what changed since the last clean run\n");
 }
 
 #ifdef WIN32
@@ -67,12 +76,15 @@ main(int argc, char *argv[])
     gboolean repair = FALSE;
     gboolean esync = FALSE;
     char *export_path = NULL;
+    FsckOptions options;
 
 #ifdef WIN32
     argv = get_argv_utf8 (&argc);
 #endif
 
     config_dir = DEFAULT_CONFIG_DIR;
+    memset (&options, 0, sizeof(options));
+    options.n_workers = 1;
 
     while ((c = getopt_long(argc, argv,
                 short_opts, long_opts, NULL)) != EOF) {
@@ -98,6 +110,15 @@ main(int argc, char *argv[])
         case 'd':
             seafile_dir = strdup(optarg);
             break;
+        case 't':
+            options.n_workers = atoi(optarg);
+            break;
+        case 'R':
+            options.resume = TRUE;
+            break;
+        case 's':
+            options.since = TRUE;
+            break;
         default:
             usage();
             exit(-1);
@@ -134,9 +155,10 @@ main(int argc, char *argv[])
         repo_id_list = g_list_append (repo_id_list, g_strdup(argv[i]));
 
     if (export_path) {
-        export_file (repo_id_list, seafile_dir, export_path);
+        export_file (repo_id_list, seafile_dir, export_path,
+                     options.n_workers);
     } else {
-        seaf_fsck (repo_id_list, repair, esync);
+        seaf_fsck (repo_id_list, repair, esync, &options);
     }
 
     return 0;
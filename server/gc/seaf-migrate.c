@@ -4,6 +4,7 @@
 #include "log.h"
 
 #include <getopt.h>
+#include <pthread.h>
 
 #include <ccnet.h>
 
@@ -17,21 +18,33 @@ static char *seafile_dir = NULL;
 CcnetClient *ccnet_client;
 SeafileSession *seaf;
 
-static const char *short_opts = "hvc:d:VDi";
+static const char *short_opts = "hvc:d:t:b:";
 static const struct option long_opts[] = {
     { "help", no_argument, NULL, 'h', },
     { "version", no_argument, NULL, 'v', },
     { "config-file", required_argument, NULL, 'c', },
     { "seafdir", required_argument, NULL, 'd', },
+    { "threads", required_argument, NULL, 't', },
+    { "block-threads", required_argument, NULL, 'b', },
+    { NULL, 0, NULL, 0, },
 };
 
+static int n_repo_workers = 1;
+static int n_block_workers = 4;
+
 static int
 migrate_v0_repos_to_v1_layout ();
 
 static void usage ()
 {
     fprintf (stderr,
-             "usage: seaf-migrate [-c config_dir] [-d seafile_dir]\n");
+             "usage: seaf-migrate [-c config_dir] [-d seafile_dir]\n"
+             "Additional options:\n"
+             "-t, --threads <n>: migrate n repos at the same time, default 1\n"
+             "-b, --block-threads <n>: copy the blocks of a repo in n threads, "
+             "default 4\n"
+             "Migrated repos are listed in migrate-journal in the seafile dir, "
+             "and skipped\nby later runs until their heads change.\n");
 }
 
 static void
@@ -101,6 +114,12 @@ main(int argc, char *argv[])
         case 'd':
             seafile_dir = strdup(optarg);
             break;
+        case 't':
+            n_repo_workers = MAX (atoi(optarg), 1);
+            break;
+        case 'b':
+            n_block_workers = MAX (atoi(optarg), 1);
+            break;
         default:
             usage();
             exit(-1);
@@ -140,7 +159,7 @@ main(int argc, char *argv[])
 
 typedef struct {
     SeafRepo *repo;
-    GHashTable *visited;
+    FSVisitedSet *visited;
 
     /* > 0: keep a period of history;
      * == 0: only keep data in head commit;
@@ -149,6 +168,10 @@ typedef struct {
     gint64 truncate_time;
     gboolean traversed_head;
     gboolean stop_copy_blocks;
+
+    /* Copies the blocks of the files found by the traversal. */
+    GThreadPool *block_pool;
+    gint block_error;
 } MigrationData;
 
 static int
@@ -182,6 +205,19 @@ migrate_file_blocks (SeafFSManager *mgr, MigrationData *data, const char *file_i
     return 0;
 }
 
+static void
+copy_blocks_job (gpointer vfile_id, gpointer vdata)
+{
+    char *file_id = vfile_id;
+    MigrationData *data = vdata;
+
+    if (!g_atomic_int_get (&data->block_error) &&
+        migrate_file_blocks (seaf->fs_mgr, data, file_id) < 0)
+        g_atomic_int_set (&data->block_error, 1);
+
+    g_free (file_id);
+}
+
 static gboolean
 fs_callback (SeafFSManager *mgr,
              const char *store_id,
@@ -194,16 +230,6 @@ fs_callback (SeafFSManager *mgr,
     MigrationData *data = user_data;
     SeafRepo *repo = data->repo;
 
-    if (data->visited != NULL) {
-        if (g_hash_table_lookup (data->visited, obj_id) != NULL) {
-            *stop = TRUE;
-            return TRUE;
-        }
-
-        char *key = g_strdup(obj_id);
-        g_hash_table_replace (data->visited, key, key);
-    }
-
     if (seaf_obj_store_copy_obj (seaf->fs_mgr->obj_store,
                                  repo->store_id, repo->version,
                                  repo->store_id, 1,
@@ -215,10 +241,12 @@ fs_callback (SeafFSManager *mgr,
     if (data->stop_copy_blocks)
         return TRUE;
 
-    if (type == SEAF_METADATA_TYPE_FILE &&
-        migrate_file_blocks (mgr, data, obj_id) < 0)
+    if (g_atomic_int_get (&data->block_error))
         return FALSE;
 
+    if (type == SEAF_METADATA_TYPE_FILE)
+        g_thread_pool_push (data->block_pool, g_strdup (obj_id), NULL);
+
     return TRUE;
 }
 
@@ -246,11 +274,13 @@ traverse_commit (SeafCommit *commit, void *vdata, gboolean *stop)
         return FALSE;
     }
 
-    ret = seaf_fs_manager_traverse_tree (seaf->fs_mgr,
-                                         data->repo->store_id, data->repo->version,
-                                         commit->root_id,
-                                         fs_callback,
-                                         data, FALSE);
+    ret = seaf_fs_manager_traverse_tree_parallel (seaf->fs_mgr,
+                                                  data->repo->store_id,
+                                                  data->repo->version,
+                                                  commit->root_id,
+                                                  fs_callback,
+                                                  data, FALSE,
+                                                  data->visited);
     if (ret < 0)
         return FALSE;
 
@@ -272,12 +302,15 @@ migrate_repo (SeafRepo *repo)
 
     data = g_new0(MigrationData, 1);
     data->repo = repo;
-    data->visited = g_hash_table_new_full (g_str_hash, g_str_equal, g_free, NULL);
+    data->visited = fs_visited_set_new ();
 
     gint64 truncate_time = seaf_repo_manager_get_repo_truncate_time (repo->manager,
                                                                      repo->id);
     data->truncate_time = truncate_time;
 
+    data->block_pool = g_thread_pool_new (copy_blocks_job, data,
+                                          n_block_workers, FALSE, NULL);
+
     gboolean res = seaf_commit_manager_traverse_commit_tree (seaf->commit_mgr,
                                                              repo->id,
                                                              repo->version,
@@ -285,32 +318,147 @@ migrate_repo (SeafRepo *repo)
                                                              traverse_commit,
                                                              data,
                                                              FALSE);
-    if (!res) {
+    /* Wait for the blocks still being copied. */
+    g_thread_pool_free (data->block_pool, FALSE, TRUE);
+
+    if (!res || g_atomic_int_get (&data->block_error)) {
         seaf_warning ("Migration of repo %s is not completed.\n", repo->id);
         ret = -1;
     }
 
-    g_hash_table_destroy (data->visited);
+    fs_visited_set_free (data->visited);
     g_free (data);
 
     return ret;
 }
 
+/*
+ * The repos left to migrate, shared by the workers. The journal lists
+ * "<repo_id> <head_id>" of the repos migrated completely, so that an
+ * interrupted migration can be run again without copying them again.
+ */
+typedef struct MigrationRun {
+    pthread_mutex_t lock;
+    GList *repos;
+    FILE *journal;
+    GHashTable *migrated;       /* repo_id -> head_id */
+} MigrationRun;
+
+static GHashTable *
+load_journal (const char *path)
+{
+    GHashTable *migrated = g_hash_table_new_full (g_str_hash, g_str_equal,
+                                                  g_free, g_free);
+    char line[256];
+    char **parts;
+    FILE *fp;
+
+    fp = g_fopen (path, "r");
+    if (!fp)
+        return migrated;
+
+    while (fgets (line, sizeof(line), fp)) {
+        g_strchomp (line);
+        parts = g_strsplit (line, " ", 0);
+        if (g_strv_length (parts) == 2)
+            g_hash_table_replace (migrated, g_strdup(parts[0]),
+                                  g_strdup(parts[1]));
+        g_strfreev (parts);
+    }
+    fclose (fp);
+
+    return migrated;
+}
+
+static void *
+migration_worker (void *vrun)
+{
+    MigrationRun *run = vrun;
+    SeafRepo *repo;
+    const char *head_id;
+
+    while (1) {
+        pthread_mutex_lock (&run->lock);
+        repo = NULL;
+        if (run->repos) {
+            repo = run->repos->data;
+            run->repos = g_list_delete_link (run->repos, run->repos);
+        }
+        pthread_mutex_unlock (&run->lock);
+
+        if (!repo)
+            break;
+
+        /* Only read by the workers. */
+        head_id = g_hash_table_lookup (run->migrated, repo->id);
+        if (head_id && strcmp (head_id, repo->head->commit_id) == 0) {
+            seaf_message ("Repo %.8s is already migrated.\n", repo->id);
+        } else if (migrate_repo (repo) == 0 && run->journal) {
+            pthread_mutex_lock (&run->lock);
+            fprintf (run->journal, "%s %s\n",
+                     repo->id, repo->head->commit_id);
+            fflush (run->journal);
+            pthread_mutex_unlock (&run->lock);
+        }
+
+        seaf_repo_unref (repo);
+    }
+
+    return NULL;
+}
+
 static int
 migrate_v0_repos_to_v1_layout ()
 {
     GList *repos = NULL, *ptr;
     SeafRepo *repo;
     gboolean error = FALSE;
+    MigrationRun run;
+    char *journal_path;
+    pthread_t *workers;
+    int i, n_started;
+
+    memset (&run, 0, sizeof(run));
+    pthread_mutex_init (&run.lock, NULL);
 
     repos = seaf_repo_manager_get_repo_list (seaf->repo_mgr, -1, -1, &error);
     for (ptr = repos; ptr; ptr = ptr->next) {
         repo = ptr->data;
         if (!repo->is_corrupted && repo->version == 0)
-            migrate_repo (repo);
-        seaf_repo_unref (repo);
+            run.repos = g_list_prepend (run.repos, repo);
+        else
+            seaf_repo_unref (repo);
     }
     g_list_free (repos);
+    run.repos = g_list_reverse (run.repos);
+
+    journal_path = g_build_filename (seaf->seaf_dir, "migrate-journal", NULL);
+    run.migrated = load_journal (journal_path);
+    run.journal = g_fopen (journal_path, "a");
+    if (!run.journal)
+        seaf_warning ("Failed to open %s: %s. The progress won't be saved.\n",
+                      journal_path, strerror(errno));
+
+    /* The current thread is a worker too. */
+    workers = g_new0 (pthread_t, n_repo_workers);
+    for (n_started = 0; n_started < n_repo_workers - 1; ++n_started) {
+        if (pthread_create (&workers[n_started], NULL,
+                            migration_worker, &run) != 0) {
+            seaf_warning ("Failed to start migration worker: %s.\n",
+                          strerror(errno));
+            break;
+        }
+    }
+    migration_worker (&run);
+    for (i = 0; i < n_started; ++i)
+        pthread_join (workers[i], NULL);
+    g_free (workers);
+
+    if (run.journal)
+        fclose (run.journal);
+    g_hash_table_destroy (run.migrated);
+    pthread_mutex_destroy (&run.lock);
+    g_free (journal_path);
 
     return 0;
 }
@@ -17,7 +17,7 @@ static char *seafile_dir = NULL;
 CcnetClient *ccnet_client;
 SeafileSession *seaf;
 
-static const char *short_opts = "hvc:d:VDr";
+static const char *short_opts = "hvc:d:VDrt:l:FOeRCkP";
 static const struct option long_opts[] = {
     { "help", no_argument, NULL, 'h', },
     { "version", no_argument, NULL, 'v', },
@@ -26,6 +26,16 @@ static const struct option long_opts[] = {
     { "verbose", no_argument, NULL, 'V' },
     { "dry-run", no_argument, NULL, 'D' },
     { "rm-deleted", no_argument, NULL, 'r' },
+    { "threads", required_argument, NULL, 't' },
+    { "io-limit", required_argument, NULL, 'l' },
+    { "full", no_argument, NULL, 'F' },
+    { "online", no_argument, NULL, 'O' },
+    { "estimate", no_argument, NULL, 'e' },
+    { "refcount", no_argument, NULL, 'R' },
+    { "check-refcount", no_argument, NULL, 'C' },
+    { "verify", no_argument, NULL, 'k' },
+    { "pruned", no_argument, NULL, 'P' },
+    { NULL, 0, NULL, 0, },
 };
 
 static void usage ()
@@ -36,7 +46,21 @@ static void usage ()
              "Additional options:\n"
              "-r, --rm-deleted: remove garbaged repos\n"
              "-D, --dry-run: report blocks that can be remove, but not remove them\n"
-             "-V, --verbose: verbose output messages\n");
+             "-V, --verbose: verbose output messages\n"
+             "-t, --threads <n>: collect or verify n repos at the same time, default 1\n"
+             "-l, --io-limit <n>: read or remove at most n objects per second\n"
+             "-F, --full: also collect repos unchanged since last GC\n"
+             "-O, --online: collect while the server is running\n"
+             "-e, --estimate: print the space GC would free as JSON, "
+             "from a sample of the blocks\n"
+             "-R, --refcount: find garbage from block reference counts "
+             "instead of traversing all history\n"
+             "-C, --check-refcount: recount block references from scratch "
+             "and fix wrong counts, only report them with -D\n"
+             "-k, --verify: only check that the blocks of the kept history "
+             "exist\n"
+             "-P, --pruned: only collect repos whose history the server "
+             "pruned since their last GC\n");
 }
 
 static void
@@ -87,6 +111,8 @@ main(int argc, char *argv[])
     int verbose = 0;
     int dry_run = 0;
     int rm_garbage = 0;
+    int verify = 0;
+    GCOptions options;
 
 #ifdef WIN32
     argv = get_argv_utf8 (&argc);
@@ -94,6 +120,9 @@ main(int argc, char *argv[])
 
     config_dir = DEFAULT_CONFIG_DIR;
 
+    memset (&options, 0, sizeof(options));
+    options.n_workers = 1;
+
     while ((c = getopt_long(argc, argv,
                 short_opts, long_opts, NULL)) != EOF) {
         switch (c) {
@@ -118,6 +147,33 @@ main(int argc, char *argv[])
         case 'r':
             rm_garbage = 1;
             break;
+        case 't':
+            options.n_workers = atoi(optarg);
+            break;
+        case 'l':
+            options.io_limit = atoi(optarg);
+            break;
+        case 'F':
+            options.full = TRUE;
+            break;
+        case 'O':
+            options.online = TRUE;
+            break;
+        case 'e':
+            options.estimate = TRUE;
+            break;
+        case 'R':
+            options.refcount = TRUE;
+            break;
+        case 'C':
+            options.check_refcount = TRUE;
+            break;
+        case 'k':
+            verify = 1;
+            break;
+        case 'P':
+            options.pruned = TRUE;
+            break;
         default:
             usage();
             exit(-1);
@@ -160,7 +216,10 @@ main(int argc, char *argv[])
     for (i = optind; i < argc; i++)
         repo_id_list = g_list_append (repo_id_list, g_strdup(argv[i]));
 
-    gc_core_run (repo_id_list, dry_run, verbose);
+    if (verify)
+        return verify_repos (repo_id_list, options.n_workers) < 0 ? 1 : 0;
+
+    gc_core_run (repo_id_list, dry_run, verbose, &options);
 
     return 0;
 }
@@ -1,17 +1,83 @@
+#include "common.h"
+
+#include <pthread.h>
+
 #include "seafile-session.h"
+#include "utils.h"
 #include "log.h"
 
+/* Block ids checked by one call to the backend. */
+#define CHECK_BATCH_SIZE 256
+
 typedef struct VerifyData {
     SeafRepo *repo;
     gint64 truncate_time;
     gboolean traversed_head;
+    /* Files already checked in another commit are skipped. */
+    FSVisitedSet *visited;
+
+    /* Protects the fields below from the traverse threads. */
+    pthread_mutex_t lock;
+    GPtrArray *pending;
+    gint64 checked_blocks;
+    gint64 missing_blocks;
+    gboolean error;
 } VerifyData;
 
+static void
+free_ids (GPtrArray *ids)
+{
+    guint i;
+
+    for (i = 0; i < ids->len; ++i)
+        g_free (g_ptr_array_index (ids, i));
+    g_ptr_array_free (ids, TRUE);
+}
+
+static void
+check_batch (VerifyData *data, GPtrArray *ids)
+{
+    SeafRepo *repo = data->repo;
+    gboolean *exists;
+    gint64 missing = 0;
+    gboolean error = FALSE;
+    guint i;
+
+    exists = g_new0 (gboolean, ids->len);
+    if (seaf_block_manager_blocks_exist (seaf->block_mgr,
+                                         repo->store_id,
+                                         repo->version,
+                                         (const char **)ids->pdata,
+                                         ids->len,
+                                         exists) < 0) {
+        seaf_warning ("Failed to check blocks of repo %.8s.\n", repo->id);
+        error = TRUE;
+    } else {
+        for (i = 0; i < ids->len; ++i) {
+            if (!exists[i]) {
+                seaf_message ("Block %s is missing.\n",
+                              (char *)g_ptr_array_index (ids, i));
+                ++missing;
+            }
+        }
+    }
+    g_free (exists);
+
+    pthread_mutex_lock (&data->lock);
+    data->checked_blocks += ids->len;
+    data->missing_blocks += missing;
+    if (error)
+        data->error = TRUE;
+    pthread_mutex_unlock (&data->lock);
+}
+
+/* Queue the blocks of a file, and check them once a batch is full. */
 static int
 check_blocks (VerifyData *data, const char *file_id)
 {
     SeafRepo *repo = data->repo;
     Seafile *seafile;
+    GPtrArray *batch;
     int i;
 
     seafile = seaf_fs_manager_get_seafile (seaf->fs_mgr,
@@ -24,11 +90,20 @@ check_blocks (VerifyData *data, const char *file_id)
     }
 
     for (i = 0; i < seafile->n_blocks; ++i) {
-        if (!seaf_block_manager_block_exists (seaf->block_mgr,
-                                              repo->store_id,
-                                              repo->version,
-                                              seafile->blk_sha1s[i]))
-            g_message ("Block %s is missing.\n", seafile->blk_sha1s[i]);
+        batch = NULL;
+
+        pthread_mutex_lock (&data->lock);
+        g_ptr_array_add (data->pending, g_strdup (seafile->blk_sha1s[i]));
+        if (data->pending->len >= CHECK_BATCH_SIZE) {
+            batch = data->pending;
+            data->pending = g_ptr_array_new ();
+        }
+        pthread_mutex_unlock (&data->lock);
+
+        if (batch) {
+            check_batch (data, batch);
+            free_ids (batch);
+        }
     }
 
     seafile_unref (seafile);
@@ -76,12 +151,13 @@ traverse_commit (SeafCommit *commit, void *vdata, gboolean *stop)
     if (!data->traversed_head)
         data->traversed_head = TRUE;
 
-    ret = seaf_fs_manager_traverse_tree (seaf->fs_mgr,
-                                         repo->store_id,
-                                         repo->version,
-                                         commit->root_id,
-                                         fs_callback,
-                                         vdata, FALSE);
+    ret = seaf_fs_manager_traverse_tree_parallel (seaf->fs_mgr,
+                                                  repo->store_id,
+                                                  repo->version,
+                                                  commit->root_id,
+                                                  fs_callback,
+                                                  vdata, FALSE,
+                                                  data->visited);
     if (ret < 0)
         return FALSE;
 
@@ -95,6 +171,7 @@ verify_repo (SeafRepo *repo)
     SeafBranch *branch;
     int ret = 0;
     VerifyData data = {0};
+    gint64 start = get_current_time ();
 
     data.repo = repo;
     data.truncate_time = seaf_repo_manager_get_repo_truncate_time (repo->manager,
@@ -106,55 +183,133 @@ verify_repo (SeafRepo *repo)
         return -1;
     }
 
+    data.visited = fs_visited_set_new ();
+    data.pending = g_ptr_array_new ();
+    pthread_mutex_init (&data.lock, NULL);
+
     for (ptr = branches; ptr != NULL; ptr = ptr->next) {
         branch = ptr->data;
-        gboolean res = seaf_commit_manager_traverse_commit_tree (seaf->commit_mgr,
-                                                                 repo->id,
-                                                                 repo->version,
-                                                                 branch->commit_id,
-                                                                 traverse_commit,
-                                                                 &data, FALSE);
+        gboolean res = TRUE;
+        if (ret == 0)
+            res = seaf_commit_manager_traverse_commit_tree (seaf->commit_mgr,
+                                                            repo->id,
+                                                            repo->version,
+                                                            branch->commit_id,
+                                                            traverse_commit,
+                                                            &data, FALSE);
         seaf_branch_unref (branch);
-        if (!res) {
+        if (!res)
             ret = -1;
-            break;
-        }
     }
 
     g_list_free (branches);
 
+    if (data.pending->len > 0)
+        check_batch (&data, data.pending);
+    if (data.error)
+        ret = -1;
+
+    seaf_message ("Verified repo %.8s in %.1f seconds. "
+                  "%"G_GINT64_FORMAT" blocks checked, "
+                  "%"G_GINT64_FORMAT" missing.%s\n",
+                  repo->id,
+                  (get_current_time () - start) / (double)G_USEC_PER_SEC,
+                  data.checked_blocks, data.missing_blocks,
+                  ret < 0 ? " Failed to check all blocks." : "");
+
+    free_ids (data.pending);
+    pthread_mutex_destroy (&data.lock);
+    fs_visited_set_free (data.visited);
+
     return ret;
 }
 
-int
-verify_repos (GList *repo_id_list)
-{
-    if (repo_id_list == NULL)
-        repo_id_list = seaf_repo_manager_get_repo_id_list (seaf->repo_mgr);
+/* The repos left to verify, shared by the workers. */
+typedef struct VerifyRun {
+    pthread_mutex_t lock;
+    GList *repo_ids;
+    int n_failed;
+} VerifyRun;
 
-    GList *ptr;
+static void *
+verify_worker (void *vrun)
+{
+    VerifyRun *run = vrun;
+    char *repo_id;
     SeafRepo *repo;
-    int ret = 0;
+    int ret;
 
-    for (ptr = repo_id_list; ptr != NULL; ptr = ptr->next) {
-        repo = seaf_repo_manager_get_repo_ex (seaf->repo_mgr, (const gchar *)ptr->data);
+    while (1) {
+        pthread_mutex_lock (&run->lock);
+        repo_id = NULL;
+        if (run->repo_ids) {
+            repo_id = run->repo_ids->data;
+            run->repo_ids = g_list_delete_link (run->repo_ids, run->repo_ids);
+        }
+        pthread_mutex_unlock (&run->lock);
 
-        g_free (ptr->data);
+        if (!repo_id)
+            break;
 
+        repo = seaf_repo_manager_get_repo_ex (seaf->repo_mgr, repo_id);
+        g_free (repo_id);
         if (!repo)
             continue;
 
         if (repo->is_corrupted) {
-           seaf_warning ("Repo %s is corrupted.\n", repo->id);
+            seaf_warning ("Repo %s is corrupted.\n", repo->id);
+            ret = 0;
         } else {
             ret = verify_repo (repo);
-            seaf_repo_unref (repo);
-            if (ret < 0)
-                break;
+        }
+        seaf_repo_unref (repo);
+
+        if (ret < 0) {
+            pthread_mutex_lock (&run->lock);
+            ++run->n_failed;
+            pthread_mutex_unlock (&run->lock);
         }
     }
 
-    g_list_free (repo_id_list);
+    return NULL;
+}
 
-    return ret;
+int
+verify_repos (GList *repo_id_list, int n_workers)
+{
+    VerifyRun run;
+    pthread_t *workers;
+    int i, n_started;
+
+    if (repo_id_list == NULL)
+        repo_id_list = seaf_repo_manager_get_repo_id_list (seaf->repo_mgr);
+
+    memset (&run, 0, sizeof(run));
+    pthread_mutex_init (&run.lock, NULL);
+    run.repo_ids = repo_id_list;
+
+    n_workers = MAX (n_workers, 1);
+
+    /* The current thread is a worker too. */
+    workers = g_new0 (pthread_t, n_workers);
+    for (n_started = 0; n_started < n_workers - 1; ++n_started) {
+        if (pthread_create (&workers[n_started], NULL, verify_worker, &run) != 0) {
+            seaf_warning ("Failed to start verify worker: %s.\n",
+                          strerror(errno));
+            break;
+        }
+    }
+    verify_worker (&run);
+    for (i = 0; i < n_started; ++i)
+        pthread_join (workers[i], NULL);
+    g_free (workers);
+
+    pthread_mutex_destroy (&run.lock);
+
+    if (run.n_failed > 0) {
+        seaf_warning ("Failed to verify %d repos.\n", run.n_failed);
+        return -1;
+    }
+
+    return 0;
 }
@@ -1,6 +1,9 @@
 #ifndef GC_VERIFY_H
 #define GC_VERIFY_H
 
-int verify_repos (GList *repo_id_list);
+/* Check that the blocks of the history kept by the repos exist,
+ * verifying @n_workers repos at the same time.
+ */
+int verify_repos (GList *repo_id_list, int n_workers);
 
 #endif
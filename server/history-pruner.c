@@ -0,0 +1,306 @@
+/* -*- Mode: C; tab-width: 4; indent-tabs-mode: nil; c-basic-offset: 4 -*- */
+
+#include "common.h"
+
+#include <ccnet/timer.h>
+#include <pthread.h>
+
+#include "seafile-session.h"
+#include "history-pruner.h"
+#include "log.h"
+
+#define PULSE_INTERVAL 10000    /* 10s, between batches of a pass */
+#define DEFAULT_PRUNE_INTERVAL 3600
+/* Repos handled by one background job. */
+#define PRUNE_BATCH_SIZE 200
+
+typedef struct HistoryPrunerPriv {
+    int interval;
+
+    /* Only changed in the main thread. */
+    gboolean job_running;
+    gboolean in_pass;
+    char cursor[37];            /* last repo of the previous batch */
+    gint64 next_pass;
+
+    pthread_mutex_t stats_lock;
+    gint64 n_passes;
+    gint64 n_pruned;
+
+    CcnetTimer *timer;
+} HistoryPrunerPriv;
+
+typedef struct PruneJob {
+    HistoryPruner *pruner;
+    char cursor[37];
+    gboolean finished;
+} PruneJob;
+
+HistoryPruner *
+history_pruner_new (SeafileSession *session)
+{
+    HistoryPruner *pruner = g_new0 (HistoryPruner, 1);
+    HistoryPrunerPriv *priv = g_new0 (HistoryPrunerPriv, 1);
+    GError *error = NULL;
+
+    pruner->seaf = session;
+    pruner->priv = priv;
+
+    priv->interval = g_key_file_get_integer (session->config, "history",
+                                             "prune_interval", &error);
+    if (error) {
+        priv->interval = DEFAULT_PRUNE_INTERVAL;
+        g_clear_error (&error);
+    }
+
+    pthread_mutex_init (&priv->stats_lock, NULL);
+
+    return pruner;
+}
+
+static int
+create_candidates_table (SeafDB *db)
+{
+    char *sql;
+
+    switch (seaf_db_type (db)) {
+    case SEAF_DB_TYPE_MYSQL:
+        sql = "CREATE TABLE IF NOT EXISTS HistoryPruneCandidates ("
+            "repo_id CHAR(37) PRIMARY KEY, valid_since BIGINT, "
+            "mark_time BIGINT) ENGINE=INNODB";
+        break;
+    case SEAF_DB_TYPE_SQLITE:
+    case SEAF_DB_TYPE_PGSQL:
+        sql = "CREATE TABLE IF NOT EXISTS HistoryPruneCandidates ("
+            "repo_id CHAR(36) PRIMARY KEY, valid_since BIGINT, "
+            "mark_time BIGINT)";
+        break;
+    default:
+        g_return_val_if_reached (-1);
+    }
+
+    return seaf_db_query (db, sql);
+}
+
+/* The store has history GC hasn't collected yet. */
+static int
+mark_candidate (SeafDB *db, const char *store_id, gint64 valid_since)
+{
+    gint64 now = (gint64)time(NULL);
+    gboolean exists, err;
+
+    if (seaf_db_type (db) == SEAF_DB_TYPE_PGSQL) {
+        exists = seaf_db_statement_exists (db,
+                                           "SELECT repo_id FROM HistoryPruneCandidates "
+                                           "WHERE repo_id=?",
+                                           &err, 1, "string", store_id);
+        if (err)
+            return -1;
+        if (exists)
+            return seaf_db_statement_query (db,
+                                            "UPDATE HistoryPruneCandidates SET "
+                                            "valid_since=?, mark_time=? "
+                                            "WHERE repo_id=?",
+                                            3, "int64", valid_since,
+                                            "int64", now, "string", store_id);
+        return seaf_db_statement_query (db,
+                                        "INSERT INTO HistoryPruneCandidates "
+                                        "VALUES (?, ?, ?)",
+                                        3, "string", store_id,
+                                        "int64", valid_since, "int64", now);
+    }
+
+    return seaf_db_statement_query (db,
+                                    "REPLACE INTO HistoryPruneCandidates "
+                                    "VALUES (?, ?, ?)",
+                                    3, "string", store_id,
+                                    "int64", valid_since, "int64", now);
+}
+
+/* Returns 1 if valid-since was advanced, 0 if not, -1 on error. */
+static int
+prune_repo (HistoryPruner *pruner, const char *repo_id)
+{
+    SeafRepoManager *mgr = pruner->seaf->repo_mgr;
+    SeafRepo *repo;
+    SeafCommit *head;
+    gint64 truncate_time, valid_since, old;
+    int ret = 0;
+
+    truncate_time = seaf_repo_manager_get_repo_truncate_time (mgr, repo_id);
+    if (truncate_time < 0)
+        return 0;
+
+    repo = seaf_repo_manager_get_repo (mgr, repo_id);
+    if (!repo)
+        return 0;
+
+    if (truncate_time > 0) {
+        valid_since = truncate_time;
+    } else {
+        /* Only the head commit is kept. */
+        head = seaf_commit_manager_get_commit (pruner->seaf->commit_mgr,
+                                               repo->id, repo->version,
+                                               repo->head->commit_id);
+        if (!head) {
+            seaf_warning ("[history pruner] Failed to get head of repo %.8s.\n",
+                          repo->id);
+            ret = -1;
+            goto out;
+        }
+        valid_since = head->ctime;
+        seaf_commit_unref (head);
+    }
+
+    old = seaf_repo_manager_get_repo_valid_since (mgr, repo_id);
+    if (valid_since <= old)
+        goto out;
+
+    if (seaf_repo_manager_set_repo_valid_since (mgr, repo_id, valid_since) < 0 ||
+        mark_candidate (pruner->seaf->db, repo->store_id, valid_since) < 0) {
+        seaf_warning ("[history pruner] Failed to prune history of repo %.8s.\n",
+                      repo->id);
+        ret = -1;
+        goto out;
+    }
+    ret = 1;
+
+out:
+    seaf_repo_unref (repo);
+    return ret;
+}
+
+static gboolean
+collect_repo_id (SeafDBRow *row, void *data)
+{
+    GList **ids = data;
+
+    *ids = g_list_prepend (*ids, g_strdup (seaf_db_row_get_column_text (row, 0)));
+    return TRUE;
+}
+
+static void *
+prune_batch (void *vjob)
+{
+    PruneJob *job = vjob;
+    HistoryPruner *pruner = job->pruner;
+    HistoryPrunerPriv *priv = pruner->priv;
+    GList *ids = NULL, *ptr;
+    int n = 0, n_pruned = 0;
+
+    if (seaf_db_statement_foreach_row (pruner->seaf->db,
+                                       "SELECT repo_id FROM Repo WHERE repo_id>? "
+                                       "ORDER BY repo_id LIMIT ?",
+                                       collect_repo_id, &ids,
+                                       2, "string", job->cursor,
+                                       "int", PRUNE_BATCH_SIZE) < 0) {
+        seaf_warning ("[history pruner] Failed to list repos.\n");
+        /* Retried from the same repo on the next pulse. */
+        return vjob;
+    }
+    ids = g_list_reverse (ids);
+
+    for (ptr = ids; ptr; ptr = ptr->next) {
+        if (bg_job_cancelled ())
+            break;
+        /* In cluster mode, each node prunes the repos it owns. */
+        if (seaf_cluster_manager_is_local_repo (pruner->seaf->cluster_mgr,
+                                                ptr->data) &&
+            prune_repo (pruner, ptr->data) > 0)
+            ++n_pruned;
+        g_strlcpy (job->cursor, ptr->data, sizeof(job->cursor));
+        ++n;
+    }
+    job->finished = (ptr == NULL && n < PRUNE_BATCH_SIZE);
+
+    string_list_free (ids);
+
+    pthread_mutex_lock (&priv->stats_lock);
+    priv->n_pruned += n_pruned;
+    if (job->finished)
+        ++priv->n_passes;
+    pthread_mutex_unlock (&priv->stats_lock);
+
+    return vjob;
+}
+
+static void
+prune_batch_done (void *vjob)
+{
+    PruneJob *job = vjob;
+    HistoryPrunerPriv *priv = job->pruner->priv;
+
+    priv->job_running = FALSE;
+    if (job->finished) {
+        priv->in_pass = FALSE;
+        priv->cursor[0] = '\0';
+        priv->next_pass = (gint64)time(NULL) + priv->interval;
+    } else {
+        memcpy (priv->cursor, job->cursor, sizeof(priv->cursor));
+    }
+
+    g_free (job);
+}
+
+static int
+prune_pulse (void *vpruner)
+{
+    HistoryPruner *pruner = vpruner;
+    HistoryPrunerPriv *priv = pruner->priv;
+    PruneJob *job;
+
+    if (priv->job_running)
+        return 1;
+    if (!priv->in_pass && (gint64)time(NULL) < priv->next_pass)
+        return 1;
+
+    job = g_new0 (PruneJob, 1);
+    job->pruner = pruner;
+    memcpy (job->cursor, priv->cursor, sizeof(job->cursor));
+
+    if (bg_job_manager_schedule (pruner->seaf->bg_job_mgr, BG_JOB_PRUNE,
+                                 prune_batch, prune_batch_done, job) < 0) {
+        seaf_warning ("[history pruner] Failed to start prune job.\n");
+        g_free (job);
+        return 1;
+    }
+    priv->job_running = TRUE;
+    priv->in_pass = TRUE;
+
+    return 1;
+}
+
+int
+history_pruner_start (HistoryPruner *pruner)
+{
+    HistoryPrunerPriv *priv = pruner->priv;
+
+    if (priv->interval <= 0)
+        return 0;
+
+    if (create_candidates_table (pruner->seaf->db) < 0) {
+        seaf_warning ("[history pruner] Failed to create "
+                      "HistoryPruneCandidates table.\n");
+        return -1;
+    }
+
+    /* The first pass starts after the server has settled. */
+    priv->next_pass = (gint64)time(NULL) + PULSE_INTERVAL / 1000;
+    priv->timer = ccnet_timer_new (prune_pulse, pruner, PULSE_INTERVAL);
+
+    return 0;
+}
+
+void
+history_pruner_get_stats (HistoryPruner *pruner, HistoryPrunerStats *stats)
+{
+    HistoryPrunerPriv *priv = pruner->priv;
+
+    /* A stale read of the flag is fine. */
+    stats->running = priv->in_pass;
+
+    pthread_mutex_lock (&priv->stats_lock);
+    stats->n_passes = priv->n_passes;
+    stats->n_pruned = priv->n_pruned;
+    pthread_mutex_unlock (&priv->stats_lock);
+}
@@ -0,0 +1,41 @@
+#ifndef HISTORY_PRUNER_H
+#define HISTORY_PRUNER_H
+
+#include <glib.h>
+
+struct _SeafileSession;
+
+struct HistoryPrunerPriv;
+
+/*
+ * Advances the valid-since time of the repos that keep limited history
+ * as it passes, instead of waiting for the next GC to do it. History
+ * walks stop at valid-since, so they don't go through expired commits
+ * that are still stored, and the stores whose history expired are
+ * recorded in HistoryPruneCandidates for "seafserv-gc --pruned".
+ *
+ * [history]
+ * prune_interval = 3600   # seconds between passes over all repos, 0 to disable
+ */
+typedef struct HistoryPruner {
+    struct _SeafileSession *seaf;
+
+    struct HistoryPrunerPriv *priv;
+} HistoryPruner;
+
+HistoryPruner *
+history_pruner_new (struct _SeafileSession *session);
+
+int
+history_pruner_start (HistoryPruner *pruner);
+
+typedef struct HistoryPrunerStats {
+    gboolean running;
+    gint64 n_passes;
+    gint64 n_pruned;            /* valid-since advances */
+} HistoryPrunerStats;
+
+void
+history_pruner_get_stats (HistoryPruner *pruner, HistoryPrunerStats *stats);
+
+#endif
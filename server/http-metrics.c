@@ -0,0 +1,324 @@
+#include "common.h"
+
+#include <pthread.h>
+
+#if defined(__FreeBSD__) || defined(__NetBSD__) || defined(__OpenBSD__)
+#include <event2/event.h>
+#include <event2/bufferevent.h>
+#else
+#include <event.h>
+#endif
+
+#include <evhtp.h>
+
+#include "utils.h"
+#include "log.h"
+#include "http-metrics.h"
+
+/* Upper bounds of the histogram buckets, in microseconds. */
+static const gint64 bucket_bounds[] = {
+    100, 250, 500,
+    1000, 2500, 5000,
+    10000, 25000, 50000,
+    100000, 250000, 500000,
+    1000000, 2500000, 5000000,
+    10000000,
+};
+#define N_BUCKETS G_N_ELEMENTS(bucket_bounds)
+
+static const char *route_names[N_HTTP_ROUTES] = {
+    "protocol-version",
+    "permission-check",
+    "quota-check",
+    "head-commit",
+    "head-commits-multi",
+    "head-commits-watch",
+    "commit",
+    "fs-id-list",
+    "block",
+    "check-fs",
+    "check-blocks",
+    "block-filter",
+    "recv-fs",
+    "pack-fs",
+    "pack-blocks",
+    "recv-blocks",
+    "files",
+    "other",
+};
+
+static const char *phase_names[N_HTTP_PHASES] = {
+    "token",
+    "permission",
+    "db",
+    "obj_io",
+    "block_io",
+    "job",
+    "handler",
+};
+
+typedef struct Histogram {
+    gint64 buckets[N_BUCKETS + 1]; /* the last one is +Inf */
+    gint64 sum;                    /* microseconds */
+    gint64 count;
+} Histogram;
+
+typedef struct RouteMetrics {
+    gint64 requests;
+    gint64 bytes_in;
+    gint64 bytes_out;
+    Histogram phases[N_HTTP_PHASES];
+} RouteMetrics;
+
+/*
+ * Only the owning thread writes to it. When the thread exits it's put on
+ * the free list for the next new thread, so its counts are never lost
+ * and short-lived threads don't make the list grow.
+ */
+typedef struct ThreadMetrics {
+    HttpRoute route;
+    RouteMetrics routes[N_HTTP_ROUTES];
+} ThreadMetrics;
+
+static pthread_once_t metrics_once = PTHREAD_ONCE_INIT;
+static pthread_key_t metrics_key;
+
+static GList *all_metrics;      /* every ThreadMetrics ever created */
+static GList *free_metrics;     /* those whose thread has exited */
+static pthread_mutex_t metrics_lock = PTHREAD_MUTEX_INITIALIZER;
+
+static void
+release_thread_metrics (void *data)
+{
+    pthread_mutex_lock (&metrics_lock);
+    free_metrics = g_list_prepend (free_metrics, data);
+    pthread_mutex_unlock (&metrics_lock);
+}
+
+static void
+create_key (void)
+{
+    pthread_key_create (&metrics_key, release_thread_metrics);
+}
+
+static ThreadMetrics *
+get_thread_metrics (void)
+{
+    ThreadMetrics *metrics;
+
+    pthread_once (&metrics_once, create_key);
+
+    metrics = pthread_getspecific (metrics_key);
+    if (metrics)
+        return metrics;
+
+    /* Only taken once per thread. */
+    pthread_mutex_lock (&metrics_lock);
+    if (free_metrics) {
+        metrics = free_metrics->data;
+        free_metrics = g_list_delete_link (free_metrics, free_metrics);
+    } else {
+        metrics = g_new0 (ThreadMetrics, 1);
+        all_metrics = g_list_prepend (all_metrics, metrics);
+    }
+    pthread_mutex_unlock (&metrics_lock);
+
+    metrics->route = HTTP_ROUTE_OTHER;
+    pthread_setspecific (metrics_key, metrics);
+
+    return metrics;
+}
+
+void
+http_metrics_set_route (HttpRoute route)
+{
+    get_thread_metrics()->route = route;
+}
+
+HttpRoute
+http_metrics_get_route (void)
+{
+    return get_thread_metrics()->route;
+}
+
+void
+http_metrics_observe (HttpPhase phase, gint64 start)
+{
+    ThreadMetrics *metrics = get_thread_metrics ();
+    Histogram *hist = &metrics->routes[metrics->route].phases[phase];
+    gint64 elapsed = get_current_time () - start;
+    int i;
+
+    if (elapsed < 0)
+        elapsed = 0;
+
+    for (i = 0; i < N_BUCKETS; ++i) {
+        if (elapsed <= bucket_bounds[i])
+            break;
+    }
+    ++hist->buckets[i];
+    hist->sum += elapsed;
+    ++hist->count;
+}
+
+void
+http_metrics_add_request (HttpRoute route, gint64 bytes_in)
+{
+    RouteMetrics *metrics = &get_thread_metrics()->routes[route];
+
+    ++metrics->requests;
+    metrics->bytes_in += bytes_in;
+}
+
+void
+http_metrics_add_bytes_out (HttpRoute route, gint64 bytes)
+{
+    get_thread_metrics()->routes[route].bytes_out += bytes;
+}
+
+typedef struct MeteredCb {
+    evhtp_callback_cb cb;
+    void *arg;
+    HttpRoute route;
+} MeteredCb;
+
+/*
+ * What the callback writes to the connection is counted as sent. Replies
+ * streamed from write callbacks count the rest themselves.
+ */
+static void
+metered_cb (evhtp_request_t *req, void *arg)
+{
+    MeteredCb *metered = arg;
+    struct evbuffer *output = bufferevent_get_output (evhtp_request_get_bev (req));
+    gint64 bytes_in = evbuffer_get_length (req->buffer_in);
+    size_t out_len = evbuffer_get_length (output);
+    gint64 start = get_current_time ();
+
+    http_metrics_set_route (metered->route);
+
+    metered->cb (req, metered->arg);
+
+    http_metrics_observe (HTTP_PHASE_HANDLER, start);
+    http_metrics_add_request (metered->route, bytes_in);
+    http_metrics_add_bytes_out (metered->route,
+                                (gint64)evbuffer_get_length (output) - out_len);
+    http_metrics_set_route (HTTP_ROUTE_OTHER);
+}
+
+static MeteredCb *
+metered_cb_new (evhtp_callback_cb cb, void *arg, HttpRoute route)
+{
+    MeteredCb *metered = g_new0 (MeteredCb, 1);
+
+    metered->cb = cb;
+    metered->arg = arg;
+    metered->route = route;
+
+    return metered;
+}
+
+evhtp_callback_t *
+http_metrics_set_cb (evhtp_t *htp, const char *path,
+                     evhtp_callback_cb cb, void *arg, HttpRoute route)
+{
+    return evhtp_set_cb (htp, path, metered_cb,
+                         metered_cb_new (cb, arg, route));
+}
+
+evhtp_callback_t *
+http_metrics_set_regex_cb (evhtp_t *htp, const char *pattern,
+                           evhtp_callback_cb cb, void *arg, HttpRoute route)
+{
+    return evhtp_set_regex_cb (htp, pattern, metered_cb,
+                               metered_cb_new (cb, arg, route));
+}
+
+static void
+dump_counter (GString *out, RouteMetrics *total, const char *name,
+              const char *help, size_t offset)
+{
+    int i;
+
+    g_string_append_printf (out, "# HELP %s %s\n# TYPE %s counter\n",
+                            name, help, name);
+    for (i = 0; i < N_HTTP_ROUTES; ++i)
+        g_string_append_printf (out, "%s{route=\"%s\"} %"G_GINT64_FORMAT"\n",
+                                name, route_names[i],
+                                *(gint64 *)((char *)&total[i] + offset));
+}
+
+char *
+http_metrics_dump (void)
+{
+    RouteMetrics total[N_HTTP_ROUTES];
+    ThreadMetrics *metrics;
+    RouteMetrics *src, *dst;
+    Histogram *hist;
+    GString *out;
+    GList *ptr;
+    gint64 cumulative;
+    int i, j, k;
+
+    memset (total, 0, sizeof(total));
+
+    pthread_mutex_lock (&metrics_lock);
+    for (ptr = all_metrics; ptr; ptr = ptr->next) {
+        metrics = ptr->data;
+        for (i = 0; i < N_HTTP_ROUTES; ++i) {
+            src = &metrics->routes[i];
+            dst = &total[i];
+            dst->requests += src->requests;
+            dst->bytes_in += src->bytes_in;
+            dst->bytes_out += src->bytes_out;
+            for (j = 0; j < N_HTTP_PHASES; ++j) {
+                for (k = 0; k <= N_BUCKETS; ++k)
+                    dst->phases[j].buckets[k] += src->phases[j].buckets[k];
+                dst->phases[j].sum += src->phases[j].sum;
+                dst->phases[j].count += src->phases[j].count;
+            }
+        }
+    }
+    pthread_mutex_unlock (&metrics_lock);
+
+    out = g_string_new (NULL);
+
+    dump_counter (out, total, "seafile_http_requests_total",
+                  "Requests handled.",
+                  G_STRUCT_OFFSET(RouteMetrics, requests));
+    dump_counter (out, total, "seafile_http_received_bytes_total",
+                  "Request body bytes received.",
+                  G_STRUCT_OFFSET(RouteMetrics, bytes_in));
+    dump_counter (out, total, "seafile_http_sent_bytes_total",
+                  "Response bytes sent.",
+                  G_STRUCT_OFFSET(RouteMetrics, bytes_out));
+
+    g_string_append (out,
+                     "# HELP seafile_http_phase_seconds Time spent in each phase of a request.\n"
+                     "# TYPE seafile_http_phase_seconds histogram\n");
+    for (i = 0; i < N_HTTP_ROUTES; ++i) {
+        for (j = 0; j < N_HTTP_PHASES; ++j) {
+            hist = &total[i].phases[j];
+            if (hist->count == 0)
+                continue;
+
+            cumulative = 0;
+            for (k = 0; k < N_BUCKETS; ++k) {
+                cumulative += hist->buckets[k];
+                g_string_append_printf (out,
+                                        "seafile_http_phase_seconds_bucket{route=\"%s\",phase=\"%s\",le=\"%g\"} %"G_GINT64_FORMAT"\n",
+                                        route_names[i], phase_names[j],
+                                        bucket_bounds[k] / 1e6, cumulative);
+            }
+            g_string_append_printf (out,
+                                    "seafile_http_phase_seconds_bucket{route=\"%s\",phase=\"%s\",le=\"+Inf\"} %"G_GINT64_FORMAT"\n"
+                                    "seafile_http_phase_seconds_sum{route=\"%s\",phase=\"%s\"} %.6f\n"
+                                    "seafile_http_phase_seconds_count{route=\"%s\",phase=\"%s\"} %"G_GINT64_FORMAT"\n",
+                                    route_names[i], phase_names[j], hist->count,
+                                    route_names[i], phase_names[j], hist->sum / 1e6,
+                                    route_names[i], phase_names[j], hist->count);
+        }
+    }
+
+    return g_string_free (out, FALSE);
+}
@@ -0,0 +1,80 @@
+#ifndef HTTP_METRICS_H
+#define HTTP_METRICS_H
+
+#include <glib.h>
+
+/*
+ * Request counters and latency histograms of the sync and file servers.
+ *
+ * Each thread updates its own copy of the counters without locking;
+ * http_metrics_dump() adds up the copies of all threads when the
+ * metrics are scraped, so a scrape may see a request half counted.
+ */
+
+typedef enum HttpRoute {
+    HTTP_ROUTE_PROTOCOL,
+    HTTP_ROUTE_PERM_CHECK,
+    HTTP_ROUTE_QUOTA_CHECK,
+    HTTP_ROUTE_HEAD_COMMIT,
+    HTTP_ROUTE_HEAD_COMMITS_MULTI,
+    HTTP_ROUTE_HEAD_COMMITS_WATCH,
+    HTTP_ROUTE_COMMIT,
+    HTTP_ROUTE_FS_ID_LIST,
+    HTTP_ROUTE_BLOCK,
+    HTTP_ROUTE_CHECK_FS,
+    HTTP_ROUTE_CHECK_BLOCKS,
+    HTTP_ROUTE_BLOCK_FILTER,
+    HTTP_ROUTE_RECV_FS,
+    HTTP_ROUTE_PACK_FS,
+    HTTP_ROUTE_PACK_BLOCKS,
+    HTTP_ROUTE_RECV_BLOCKS,
+    HTTP_ROUTE_FILES,
+    HTTP_ROUTE_OTHER,
+    N_HTTP_ROUTES
+} HttpRoute;
+
+typedef enum HttpPhase {
+    HTTP_PHASE_TOKEN,           /* token validation */
+    HTTP_PHASE_PERM,            /* permission check */
+    HTTP_PHASE_DB,
+    HTTP_PHASE_OBJ_IO,          /* fs and commit objects */
+    HTTP_PHASE_BLOCK_IO,
+    HTTP_PHASE_JOB,             /* on the job pool, including the wait */
+    HTTP_PHASE_HANDLER,         /* the request callback itself */
+    N_HTTP_PHASES
+} HttpPhase;
+
+/* Set the route that the phases observed by this thread are counted in. */
+void
+http_metrics_set_route (HttpRoute route);
+
+HttpRoute
+http_metrics_get_route (void);
+
+/* Count the time since @start, from get_current_time(), in @phase. */
+void
+http_metrics_observe (HttpPhase phase, gint64 start);
+
+void
+http_metrics_add_request (HttpRoute route, gint64 bytes_in);
+
+void
+http_metrics_add_bytes_out (HttpRoute route, gint64 bytes);
+
+/*
+ * Like evhtp_set_cb() and evhtp_set_regex_cb(), counting the requests and
+ * the time spent in @cb under @route. evhtp.h must be included first.
+ */
+evhtp_callback_t *
+http_metrics_set_cb (evhtp_t *htp, const char *path,
+                     evhtp_callback_cb cb, void *arg, HttpRoute route);
+
+evhtp_callback_t *
+http_metrics_set_regex_cb (evhtp_t *htp, const char *pattern,
+                           evhtp_callback_cb cb, void *arg, HttpRoute route);
+
+/* The metrics of all threads in the Prometheus text format. */
+char *
+http_metrics_dump (void);
+
+#endif
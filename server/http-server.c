@@ -5,6 +5,9 @@
 #include <jansson.h>
 #include <locale.h>
 #include <sys/types.h>
+#include <sys/socket.h>
+#include <netdb.h>
+#include <fcntl.h>
 
 #if defined(__FreeBSD__) || defined(__NetBSD__) || defined(__OpenBSD__)
 #include <event2/event.h>
@@ -25,45 +28,125 @@
 #include "access-file.h"
 #include "upload-file.h"
 #include "fileserver-config.h"
+#include "http-metrics.h"
+#include "io-stats.h"
+#include "mem-stats.h"
+#include "gc-guard.h"
 
 #include "http-status-codes.h"
 
 #define DEFAULT_BIND_HOST "0.0.0.0"
 #define DEFAULT_BIND_PORT 8082
+#define DEFAULT_SYNC_WORKER_PORT 8083
 #define DEFAULT_THREADS 50
+#define DEFAULT_BLOCKING_THREADS 10
 #define DEFAULT_MAX_DOWNLOAD_DIR_SIZE 100 * ((gint64)1 << 20) /* 100MB */
+#define DEFAULT_MAX_PACK_FS_SIZE ((gint64)1 << 20) /* 1MB */
+#define DEFAULT_ZIP_CACHE_SIZE ((gint64)1 << 30) /* 1GB */
+/* Blocks over 1/64 of this, 4MB by default, are never cached. */
+#define DEFAULT_DEC_BLOCK_CACHE_SIZE ((gint64)256 << 20) /* 256MB */
 
 #define HOST "host"
 #define PORT "port"
 
 #define INIT_INFO "If you see this page, Seafile HTTP syncing component works."
-#define PROTO_VERSION "{\"version\": 1}"
+/* Version 2 adds pack-blocks, version 3 recv-blocks, version 4
+ * head-commits-multi, version 7 head-commits-watch.
+ */
+#define PROTO_VERSION "{\"version\": 7}"
 
 #define CLEANING_INTERVAL_SEC 300	/* 5 minutes */
 #define TOKEN_EXPIRE_TIME 7200	    /* 2 hours */
+/*
+ * Deleted tokens are only invalidated in the cache of the process that
+ * deleted them: the master, of its sync workers, or one cluster node.
+ * The others only cache tokens for a second.
+ */
+#define SHARED_TOKEN_EXPIRE_TIME 1
 #define PERM_EXPIRE_TIME 7200       /* 2 hours */
 #define VIRINFO_EXPIRE_TIME 7200       /* 2 hours */
+#define FS_ID_LIST_EXPIRE_TIME 300  /* 5 minutes */
+#define FS_ID_LIST_CACHE_SIZE 64
+#define MAX_CACHED_FS_ID_LIST_LEN (1 << 20) /* 1MB */
+#define DEFAULT_CACHE_MAX_ENTRIES 100000
+
+/*
+ * The caches looked up by every request are split into shards, each with
+ * its own lock, so that the evhtp threads rarely wait for each other.
+ */
+#define CACHE_SHARDS 16
+
+typedef struct CacheShard {
+    GHashTable *table;
+    gint64 bytes;               /* of the entries, see CacheSizeFunc */
+    gint64 evictions;
+    pthread_mutex_t lock;
+} CacheShard;
+
+/* Estimated memory held by an entry. */
+typedef gint64 (*CacheSizeFunc) (const char *key, gpointer value);
+
+/*
+ * Entries are added and removed with cache_shard_insert() and
+ * cache_shard_remove(), which keep the byte counts. When a shard is full,
+ * expired entries are dropped first, then any others.
+ */
+typedef struct ShardedCache {
+    CacheShard shards[CACHE_SHARDS];
+    CacheSizeFunc size_func;
+    GHRFunc is_expire;
+    int shard_max_entries;      /* 0 for no limit */
+} ShardedCache;
 
 struct _HttpServer {
     evbase_t *evbase;
     evhtp_t *evhtp;
     pthread_t thread_id;
 
-    GHashTable *token_cache;
-    pthread_mutex_t token_cache_lock; /* token -> username */
+    ShardedCache token_cache;   /* token -> username */
+    ShardedCache perm_cache;    /* repo_id:username -> permission */
+    ShardedCache vir_repo_info_cache;
+    int reap_shard;             /* next shard to remove expired entries from */
 
-    GHashTable *perm_cache;
-    pthread_mutex_t perm_cache_lock; /* repo_id:username -> permission */
+    /* repo_id:server_head:client_head -> FsIdListInfo */
+    GHashTable *fs_id_list_cache;
+    pthread_mutex_t fs_id_list_cache_lock;
+    pthread_cond_t fs_id_list_cache_cond;
 
-    GHashTable *vir_repo_info_cache;
-    pthread_mutex_t vir_repo_info_cache_lock;
-
-    uint32_t cevent_id;         /* Used for sending activity events. */
 
     event_t *reap_timer;
+
+    /* Runs the slow parts of requests, see http_job_start(). */
+    GThreadPool *job_pool;
+    /* Checks the ids of uploaded fs objects, see recv_fs_job(). */
+    GThreadPool *verify_pool;
+
+    /* repo_id -> RepoUpdateLock */
+    GHashTable *repo_update_locks;
+    pthread_mutex_t repo_update_locks_lock;
+
+    BranchUpdateStats update_stats;
+    pthread_mutex_t update_stats_lock;
+
+    /* Big blocks being uploaded in parts, see put_block_part(). */
+    char *partial_blocks_dir;
+    pthread_mutex_t partial_blocks_lock;
+
+    /* repo_id -> RepoUpdate, see seaf_http_server_notify_repo_update(). */
+    GHashTable *repo_updates;
+    gint64 last_update_seq;
+    gint64 forgotten_seq;       /* updates before this aren't known */
+    /* repo_id -> GPtrArray of parked HeadWatch. */
+    GHashTable *head_watchers;
+    pthread_mutex_t repo_updates_lock;
 };
 typedef struct _HttpServer HttpServer;
 
+typedef struct RepoUpdate {
+    gint64 seq;
+    gint64 time;
+} RepoUpdate;
+
 typedef struct TokenInfo {
     char *repo_id;
     char *email;
@@ -80,6 +163,12 @@ typedef struct VirRepoInfo {
     gint64 expire_time;
 } VirRepoInfo;
 
+/* The fs objects a client needs to go from one commit to another. */
+typedef struct FsIdListInfo {
+    char *json;                 /* NULL while being calculated */
+    gint64 expire_time;
+} FsIdListInfo;
+
 typedef struct FsHdr {
     char obj_id[40];
     guint32 obj_size;
@@ -91,6 +180,7 @@ typedef enum CheckExistType {
 } CheckExistType;
 
 const char *GET_PROTO_PATH = "/protocol-version";
+const char *GET_METRICS_PATH = "/metrics";
 const char *OP_PERM_CHECK_REGEX = "^/repo/[\\da-z]{8}-[\\da-z]{4}-[\\da-z]{4}-[\\da-z]{4}-[\\da-z]{12}/permission-check/.*";
 const char *GET_CHECK_QUOTA_REGEX = "^/repo/[\\da-z]{8}-[\\da-z]{4}-[\\da-z]{4}-[\\da-z]{4}-[\\da-z]{12}/quota-check/.*";
 const char *HEAD_COMMIT_OPER_REGEX = "^/repo/[\\da-z]{8}-[\\da-z]{4}-[\\da-z]{4}-[\\da-z]{4}-[\\da-z]{12}/commit/HEAD";
@@ -100,8 +190,13 @@ const char *GET_FS_OBJ_ID_REGEX = "^/repo/[\\da-z]{8}-[\\da-z]{4}-[\\da-z]{4}-[\
 const char *BLOCK_OPER_REGEX = "^/repo/[\\da-z]{8}-[\\da-z]{4}-[\\da-z]{4}-[\\da-z]{4}-[\\da-z]{12}/block/[\\da-z]{40}";
 const char *POST_CHECK_FS_REGEX = "^/repo/[\\da-z]{8}-[\\da-z]{4}-[\\da-z]{4}-[\\da-z]{4}-[\\da-z]{12}/check-fs";
 const char *POST_CHECK_BLOCK_REGEX = "^/repo/[\\da-z]{8}-[\\da-z]{4}-[\\da-z]{4}-[\\da-z]{4}-[\\da-z]{12}/check-blocks";
+const char *GET_BLOCK_FILTER_REGEX = "^/repo/[\\da-z]{8}-[\\da-z]{4}-[\\da-z]{4}-[\\da-z]{4}-[\\da-z]{12}/block-filter";
 const char *POST_RECV_FS_REGEX = "^/repo/[\\da-z]{8}-[\\da-z]{4}-[\\da-z]{4}-[\\da-z]{4}-[\\da-z]{12}/recv-fs";
 const char *POST_PACK_FS_REGEX = "^/repo/[\\da-z]{8}-[\\da-z]{4}-[\\da-z]{4}-[\\da-z]{4}-[\\da-z]{12}/pack-fs";
+const char *POST_PACK_BLOCKS_REGEX = "^/repo/[\\da-z]{8}-[\\da-z]{4}-[\\da-z]{4}-[\\da-z]{4}-[\\da-z]{12}/pack-blocks";
+const char *POST_RECV_BLOCKS_REGEX = "^/repo/[\\da-z]{8}-[\\da-z]{4}-[\\da-z]{4}-[\\da-z]{4}-[\\da-z]{12}/recv-blocks";
+const char *POST_HEAD_COMMITS_MULTI_REGEX = "^/repo/head-commits-multi";
+const char *POST_HEAD_COMMITS_WATCH_REGEX = "^/repo/head-commits-watch";
 
 static void
 load_http_config (HttpServerStruct *htp_server, SeafileSession *session)
@@ -111,6 +206,10 @@ load_http_config (HttpServerStruct *htp_server, SeafileSession *session)
     int port = 0;
     int max_upload_size_mb;
     int max_download_dir_size_mb;
+    int max_pack_fs_size_mb;
+    int zip_cache_size_mb;
+    int dec_block_cache_size_mb;
+    int threads;
     char *encoding;
 
     host = fileserver_config_get_string (session->config, HOST, &error);
@@ -141,6 +240,15 @@ load_http_config (HttpServerStruct *htp_server, SeafileSession *session)
         g_clear_error (&error);
     }
 
+    port = fileserver_config_get_integer (session->config, "sync_worker_port",
+                                          &error);
+    if (error || port <= 0) {
+        htp_server->sync_worker_port = DEFAULT_SYNC_WORKER_PORT;
+        g_clear_error (&error);
+    } else {
+        htp_server->sync_worker_port = port;
+    }
+
     max_upload_size_mb = fileserver_config_get_integer (session->config,
                                                  "max_upload_size",
                                                  &error);
@@ -167,6 +275,80 @@ load_http_config (HttpServerStruct *htp_server, SeafileSession *session)
             htp_server->max_download_dir_size = max_download_dir_size_mb * ((gint64)1 << 20);
     }
 
+    max_pack_fs_size_mb = fileserver_config_get_integer (session->config,
+                                                  "max_pack_fs_size",
+                                                  &error);
+    if (error) {
+        htp_server->max_pack_fs_size = DEFAULT_MAX_PACK_FS_SIZE;
+        g_clear_error (&error);
+    } else {
+        if (max_pack_fs_size_mb <= 0)
+            htp_server->max_pack_fs_size = DEFAULT_MAX_PACK_FS_SIZE;
+        else
+            htp_server->max_pack_fs_size = max_pack_fs_size_mb * ((gint64)1 << 20);
+    }
+
+    zip_cache_size_mb = fileserver_config_get_integer (session->config,
+                                                       "zip_cache_size",
+                                                       &error);
+    if (error) {
+        htp_server->zip_cache_size = DEFAULT_ZIP_CACHE_SIZE;
+        g_clear_error (&error);
+    } else {
+        if (zip_cache_size_mb <= 0)
+            htp_server->zip_cache_size = 0; /* no cache */
+        else
+            htp_server->zip_cache_size = zip_cache_size_mb * ((gint64)1 << 20);
+    }
+
+    dec_block_cache_size_mb = fileserver_config_get_integer (session->config,
+                                                             "decrypted_block_cache_size",
+                                                             &error);
+    if (error) {
+        htp_server->dec_block_cache_size = DEFAULT_DEC_BLOCK_CACHE_SIZE;
+        g_clear_error (&error);
+    } else {
+        if (dec_block_cache_size_mb <= 0)
+            htp_server->dec_block_cache_size = 0; /* no cache */
+        else
+            htp_server->dec_block_cache_size =
+                dec_block_cache_size_mb * ((gint64)1 << 20);
+    }
+
+    threads = fileserver_config_get_integer (session->config,
+                                             "worker_threads", &error);
+    if (error || threads <= 0) {
+        htp_server->worker_threads = DEFAULT_THREADS;
+        g_clear_error (&error);
+    } else {
+        htp_server->worker_threads = threads;
+    }
+
+    threads = fileserver_config_get_integer (session->config,
+                                             "blocking_threads", &error);
+    if (error || threads <= 0) {
+        htp_server->blocking_threads = DEFAULT_BLOCKING_THREADS;
+        g_clear_error (&error);
+    } else {
+        htp_server->blocking_threads = threads;
+    }
+
+    htp_server->enable_metrics = fileserver_config_get_boolean (session->config,
+                                                                "enable_metrics",
+                                                                &error);
+    if (error) {
+        htp_server->enable_metrics = FALSE;
+        g_clear_error (&error);
+    }
+
+    htp_server->streaming_upload = fileserver_config_get_boolean (session->config,
+                                                                  "streaming_upload",
+                                                                  &error);
+    if (error) {
+        htp_server->streaming_upload = TRUE;
+        g_clear_error (&error);
+    }
+
     encoding = g_key_file_get_string (session->config,
                                       "zip", "windows_encoding",
                                       &error);
@@ -178,66 +360,244 @@ load_http_config (HttpServerStruct *htp_server, SeafileSession *session)
     }
 }
 
+/*
+ * [fileserver]
+ * token_cache_max_entries = 100000   # 0 for no limit
+ * perm_cache_max_entries = 100000
+ * vir_repo_info_cache_max_entries = 100000
+ */
 static int
-validate_token (HttpServer *htp_server, evhtp_request_t *req,
-                const char *repo_id, char **username,
-                gboolean skip_cache)
+get_cache_max_entries (GKeyFile *config, char *key)
 {
-    char *email = NULL;
-    TokenInfo *token_info;
+    GError *error = NULL;
+    int n;
 
-    const char *token = evhtp_kv_find (req->headers_in, "Seafile-Repo-Token");
-    if (token == NULL) {
-        evhtp_send_reply (req, EVHTP_RES_BADREQ);
-        return EVHTP_RES_BADREQ;
+    n = fileserver_config_get_integer (config, key, &error);
+    if (error) {
+        g_clear_error (&error);
+        return DEFAULT_CACHE_MAX_ENTRIES;
+    }
+    return MAX (n, 0);
+}
+
+static void
+sharded_cache_init (ShardedCache *cache, GDestroyNotify value_free,
+                    CacheSizeFunc size_func, GHRFunc is_expire,
+                    int max_entries)
+{
+    int i;
+
+    cache->size_func = size_func;
+    cache->is_expire = is_expire;
+    if (max_entries > 0)
+        cache->shard_max_entries = MAX (max_entries / CACHE_SHARDS, 1);
+
+    for (i = 0; i < CACHE_SHARDS; ++i) {
+        cache->shards[i].table = g_hash_table_new_full (g_str_hash, g_str_equal,
+                                                        g_free, value_free);
+        pthread_mutex_init (&cache->shards[i].lock, NULL);
+    }
+}
+
+static void
+sharded_cache_get_mem_stats (gpointer data, MemStats *stats)
+{
+    ShardedCache *cache = data;
+    CacheShard *shard;
+    int i;
+
+    stats->max_entries = (gint64)cache->shard_max_entries * CACHE_SHARDS;
+
+    for (i = 0; i < CACHE_SHARDS; ++i) {
+        shard = &cache->shards[i];
+        pthread_mutex_lock (&shard->lock);
+        stats->entries += g_hash_table_size (shard->table);
+        stats->bytes += shard->bytes;
+        stats->evictions += shard->evictions;
+        pthread_mutex_unlock (&shard->lock);
+    }
+}
+
+/* Returns the shard of @key, locked. */
+static CacheShard *
+lock_cache_shard (ShardedCache *cache, const char *key)
+{
+    guint h = g_str_hash (key);
+    CacheShard *shard;
+
+    /* Use the high bits, the table uses the low ones. */
+    shard = &cache->shards[(h >> 24) % CACHE_SHARDS];
+    pthread_mutex_lock (&shard->lock);
+    return shard;
+}
+
+typedef struct ReapData {
+    ShardedCache *cache;
+    CacheShard *shard;
+} ReapData;
+
+static gboolean
+reap_entry (gpointer key, gpointer value, gpointer user_data)
+{
+    ReapData *data = user_data;
+
+    if (!data->cache->is_expire (key, value, NULL))
+        return FALSE;
+
+    data->shard->bytes -= data->cache->size_func (key, value);
+    return TRUE;
+}
+
+/* Call with the shard locked. */
+static void
+reap_locked_shard (ShardedCache *cache, CacheShard *shard)
+{
+    ReapData data;
+
+    data.cache = cache;
+    data.shard = shard;
+    g_hash_table_foreach_remove (shard->table, reap_entry, &data);
+}
+
+static void
+reap_cache_shard (ShardedCache *cache, int i)
+{
+    pthread_mutex_lock (&cache->shards[i].lock);
+    reap_locked_shard (cache, &cache->shards[i]);
+    pthread_mutex_unlock (&cache->shards[i].lock);
+}
+
+/* Make room for one more entry in a full shard. */
+static void
+evict_from_shard (ShardedCache *cache, CacheShard *shard)
+{
+    GHashTableIter iter;
+    gpointer key, value;
+
+    reap_locked_shard (cache, shard);
+
+    g_hash_table_iter_init (&iter, shard->table);
+    while (g_hash_table_size (shard->table) >= cache->shard_max_entries &&
+           g_hash_table_iter_next (&iter, &key, &value)) {
+        shard->bytes -= cache->size_func (key, value);
+        g_hash_table_iter_remove (&iter);
+        ++shard->evictions;
     }
+}
+
+/* Insert @value under @key, taking both. Call with the shard locked. */
+static void
+cache_shard_insert (ShardedCache *cache, CacheShard *shard,
+                    char *key, gpointer value)
+{
+    gpointer old = g_hash_table_lookup (shard->table, key);
+
+    if (old)
+        shard->bytes -= cache->size_func (key, old);
+    else if (cache->shard_max_entries > 0 &&
+             g_hash_table_size (shard->table) >= cache->shard_max_entries)
+        evict_from_shard (cache, shard);
+
+    shard->bytes += cache->size_func (key, value);
+    g_hash_table_insert (shard->table, key, value);
+}
+
+/* Call with the shard locked. */
+static void
+cache_shard_remove (ShardedCache *cache, CacheShard *shard, const char *key)
+{
+    gpointer value = g_hash_table_lookup (shard->table, key);
+
+    if (!value)
+        return;
+
+    shard->bytes -= cache->size_func (key, value);
+    g_hash_table_remove (shard->table, key);
+}
+
+static int
+check_token (HttpServer *htp_server, const char *repo_id, const char *token,
+             char **username, gboolean skip_cache)
+{
+    char *email = NULL;
+    TokenInfo *token_info;
+    CacheShard *shard;
 
     if (!skip_cache) {
-        pthread_mutex_lock (&htp_server->token_cache_lock);
+        shard = lock_cache_shard (&htp_server->token_cache, token);
 
-        token_info = g_hash_table_lookup (htp_server->token_cache, token);
-        if (token_info) {
+        token_info = g_hash_table_lookup (shard->table, token);
+        if (token_info && token_info->expire_time > (gint64)time(NULL) &&
+            strcmp (token_info->repo_id, repo_id) == 0) {
             if (username)
                 *username = g_strdup(token_info->email);
-            pthread_mutex_unlock (&htp_server->token_cache_lock);
+            pthread_mutex_unlock (&shard->lock);
             return EVHTP_RES_OK;
         }
 
-        pthread_mutex_unlock (&htp_server->token_cache_lock);
+        pthread_mutex_unlock (&shard->lock);
     }
 
     email = seaf_repo_manager_get_email_by_token (seaf->repo_mgr,
                                                   repo_id, token);
     if (email == NULL) {
-        pthread_mutex_lock (&htp_server->token_cache_lock);
-        g_hash_table_remove (htp_server->token_cache, token);
-        pthread_mutex_unlock (&htp_server->token_cache_lock);
+        shard = lock_cache_shard (&htp_server->token_cache, token);
+        cache_shard_remove (&htp_server->token_cache, shard, token);
+        pthread_mutex_unlock (&shard->lock);
         return EVHTP_RES_FORBIDDEN;
     }
 
     token_info = g_new0 (TokenInfo, 1);
     token_info->repo_id = g_strdup (repo_id);
-    token_info->expire_time = (gint64)time(NULL) + TOKEN_EXPIRE_TIME;
+    token_info->expire_time = (gint64)time(NULL) +
+        ((seaf->sync_worker || seaf->cluster_mgr->enabled) ?
+         SHARED_TOKEN_EXPIRE_TIME : TOKEN_EXPIRE_TIME);
     token_info->email = email;
 
-    pthread_mutex_lock (&htp_server->token_cache_lock);
-    g_hash_table_insert (htp_server->token_cache, g_strdup (token), token_info);
-    pthread_mutex_unlock (&htp_server->token_cache_lock);
+    shard = lock_cache_shard (&htp_server->token_cache, token);
+    cache_shard_insert (&htp_server->token_cache, shard,
+                        g_strdup (token), token_info);
+    pthread_mutex_unlock (&shard->lock);
 
     if (username)
         *username = g_strdup(email);
     return EVHTP_RES_OK;
 }
 
-static PermInfo *
+static int
+validate_token (HttpServer *htp_server, evhtp_request_t *req,
+                const char *repo_id, char **username,
+                gboolean skip_cache)
+{
+    gint64 start = get_current_time ();
+    int status;
+
+    const char *token = evhtp_kv_find (req->headers_in, "Seafile-Repo-Token");
+    if (token == NULL) {
+        evhtp_send_reply (req, EVHTP_RES_BADREQ);
+        return EVHTP_RES_BADREQ;
+    }
+
+    status = check_token (htp_server, repo_id, token, username, skip_cache);
+    http_metrics_observe (HTTP_PHASE_TOKEN, start);
+
+    return status;
+}
+
+/* Returns a copy of the cached permission, or NULL. */
+static char *
 lookup_perm_cache (HttpServer *htp_server, const char *repo_id, const char *username)
 {
-    PermInfo *ret = NULL;
+    PermInfo *perm_info;
+    CacheShard *shard;
+    char *ret = NULL;
     char *key = g_strdup_printf ("%s:%s", repo_id, username);
 
-    pthread_mutex_lock (&htp_server->perm_cache_lock);
-    ret = g_hash_table_lookup (htp_server->perm_cache, key);
-    pthread_mutex_unlock (&htp_server->perm_cache_lock);
+    shard = lock_cache_shard (&htp_server->perm_cache, key);
+    perm_info = g_hash_table_lookup (shard->table, key);
+    if (perm_info && perm_info->expire_time > (gint64)time(NULL))
+        ret = g_strdup (perm_info->perm);
+    pthread_mutex_unlock (&shard->lock);
     g_free (key);
 
     return ret;
@@ -249,10 +609,11 @@ insert_perm_cache (HttpServer *htp_server,
                    PermInfo *perm)
 {
     char *key = g_strdup_printf ("%s:%s", repo_id, username);
+    CacheShard *shard;
 
-    pthread_mutex_lock (&htp_server->perm_cache_lock);
-    g_hash_table_insert (htp_server->perm_cache, key, perm);
-    pthread_mutex_unlock (&htp_server->perm_cache_lock);
+    shard = lock_cache_shard (&htp_server->perm_cache, key);
+    cache_shard_insert (&htp_server->perm_cache, shard, key, perm);
+    pthread_mutex_unlock (&shard->lock);
 }
 
 static void
@@ -260,41 +621,51 @@ remove_perm_cache (HttpServer *htp_server,
                    const char *repo_id, const char *username)
 {
     char *key = g_strdup_printf ("%s:%s", repo_id, username);
+    CacheShard *shard;
 
-    pthread_mutex_lock (&htp_server->perm_cache_lock);
-    g_hash_table_remove (htp_server->perm_cache, key);
-    pthread_mutex_unlock (&htp_server->perm_cache_lock);
+    shard = lock_cache_shard (&htp_server->perm_cache, key);
+    cache_shard_remove (&htp_server->perm_cache, shard, key);
+    pthread_mutex_unlock (&shard->lock);
 
     g_free (key);
 }
 
 static int
-check_permission (HttpServer *htp_server, const char *repo_id, const char *username,
-                  const char *op, gboolean skip_cache)
+check_repo_permission (HttpServer *htp_server, const char *repo_id,
+                       const char *username, const char *op,
+                       gboolean skip_cache)
 {
     PermInfo *perm_info = NULL;
+    char *cached = NULL;
+    int status;
 
     if (!skip_cache)
-        perm_info = lookup_perm_cache (htp_server, repo_id, username);
+        cached = lookup_perm_cache (htp_server, repo_id, username);
 
-    if (perm_info) {
-        if (strcmp(perm_info->perm, "r") == 0 && strcmp(op, "upload") == 0)
-            return EVHTP_RES_FORBIDDEN;
-        return EVHTP_RES_OK;
+    if (cached) {
+        if (strcmp(cached, "r") == 0 && strcmp(op, "upload") == 0)
+            status = EVHTP_RES_FORBIDDEN;
+        else
+            status = EVHTP_RES_OK;
+        g_free (cached);
+        return status;
     }
 
     char *perm = seaf_repo_manager_check_permission (seaf->repo_mgr,
                                                      repo_id, username, NULL);
     if (perm) {
+        if ((strcmp (perm, "r") == 0 && strcmp (op, "upload") == 0))
+            status = EVHTP_RES_FORBIDDEN;
+        else
+            status = EVHTP_RES_OK;
+
         perm_info = g_new0 (PermInfo, 1);
         /* Take the reference of perm. */
         perm_info->perm = perm;
         perm_info->expire_time = (gint64)time(NULL) + PERM_EXPIRE_TIME;
         insert_perm_cache (htp_server, repo_id, username, perm_info);
 
-        if ((strcmp (perm, "r") == 0 && strcmp (op, "upload") == 0))
-            return EVHTP_RES_FORBIDDEN;
-        return EVHTP_RES_OK;
+        return status;
     }
 
     /* Invalidate cache if perm not found in db. */
@@ -302,6 +673,20 @@ check_permission (HttpServer *htp_server, const char *repo_id, const char *usern
     return EVHTP_RES_FORBIDDEN;
 }
 
+static int
+check_permission (HttpServer *htp_server, const char *repo_id, const char *username,
+                  const char *op, gboolean skip_cache)
+{
+    gint64 start = get_current_time ();
+    int status;
+
+    status = check_repo_permission (htp_server, repo_id, username, op,
+                                    skip_cache);
+    http_metrics_observe (HTTP_PHASE_PERM, start);
+
+    return status;
+}
+
 static gboolean
 get_vir_repo_info (SeafDBRow *row, void *data)
 {
@@ -331,9 +716,10 @@ get_store_id_from_vir_repo_info_cache (HttpServer *htp_server, const char *repo_
 {
     char *store_id = NULL;
     VirRepoInfo *vinfo = NULL;
+    CacheShard *shard;
 
-    pthread_mutex_lock (&htp_server->vir_repo_info_cache_lock);
-    vinfo = g_hash_table_lookup (htp_server->vir_repo_info_cache, repo_id);
+    shard = lock_cache_shard (&htp_server->vir_repo_info_cache, repo_id);
+    vinfo = g_hash_table_lookup (shard->table, repo_id);
 
     if (vinfo) {
         if (vinfo->store_id)
@@ -344,7 +730,7 @@ get_store_id_from_vir_repo_info_cache (HttpServer *htp_server, const char *repo_
         vinfo->expire_time = time (NULL) + VIRINFO_EXPIRE_TIME;
     }
 
-    pthread_mutex_unlock (&htp_server->vir_repo_info_cache_lock);
+    pthread_mutex_unlock (&shard->lock);
 
     return store_id;
 }
@@ -353,9 +739,12 @@ static void
 add_vir_info_to_cache (HttpServer *htp_server, const char *repo_id,
                        VirRepoInfo *vinfo)
 {
-    pthread_mutex_lock (&htp_server->vir_repo_info_cache_lock);
-    g_hash_table_insert (htp_server->vir_repo_info_cache, g_strdup (repo_id), vinfo);
-    pthread_mutex_unlock (&htp_server->vir_repo_info_cache_lock);
+    CacheShard *shard;
+
+    shard = lock_cache_shard (&htp_server->vir_repo_info_cache, repo_id);
+    cache_shard_insert (&htp_server->vir_repo_info_cache, shard,
+                        g_strdup (repo_id), vinfo);
+    pthread_mutex_unlock (&shard->lock);
 }
 
 static char *
@@ -369,8 +758,10 @@ get_repo_store_id (HttpServer *htp_server, const char *repo_id)
 
     VirRepoInfo *vinfo = NULL;
     char *sql = "SELECT repo_id, origin_repo FROM VirtualRepo where repo_id = ?";
+    gint64 start = get_current_time ();
     int n_row = seaf_db_statement_foreach_row (seaf->db, sql, get_vir_repo_info,
                                                &vinfo, 1, "string", repo_id);
+    http_metrics_observe (HTTP_PHASE_DB, start);
     if (n_row < 0) {
         // db error, return NULL
         return NULL;
@@ -401,66 +792,23 @@ default_cb (evhtp_request_t *req, void *arg)
     evhtp_send_reply (req, EVHTP_RES_OK);
 }
 
-typedef struct {
-    char *etype;
-    char *user;
-    char *ip;
-    char repo_id[37];
-    char *path;
-    char *client_name;
-} RepoEventData;
-
-static void
-free_repo_event_data (RepoEventData *data)
-{
-    if (!data)
-        return;
-
-    g_free (data->etype);
-    g_free (data->user);
-    g_free (data->ip);
-    g_free (data->path);
-    g_free (data->client_name);
-    g_free (data);
-}
-
-static void
-publish_repo_event (CEvent *event, void *data)
-{
-    RepoEventData *rdata = event->data;
-
-    GString *buf = g_string_new (NULL);
-    g_string_printf (buf, "%s\t%s\t%s\t%s\t%s\t%s",
-                     rdata->etype, rdata->user, rdata->ip,
-                     rdata->client_name ? rdata->client_name : "",
-                     rdata->repo_id, rdata->path ? rdata->path : "/");
-
-    seaf_mq_manager_publish_event (seaf->mq_mgr, buf->str);
-
-    g_string_free (buf, TRUE);
-    free_repo_event_data (rdata);
-}
-
+/* Repeated operations are sent once per flush of the mq manager. */
 static void
 on_repo_oper (HttpServer *htp_server, const char *etype,
               const char *repo_id, char *user, char *ip, char *client_name)
 {
-    RepoEventData *rdata = g_new0 (RepoEventData, 1);
     SeafVirtRepo *vinfo = seaf_repo_manager_get_virtual_repo_info (seaf->repo_mgr,
                                                                    repo_id);
+    GString *buf = g_string_new (NULL);
 
-    if (vinfo) {
-        memcpy (rdata->repo_id, vinfo->origin_repo_id, 36);
-        rdata->path = g_strdup(vinfo->path);
-    } else
-        memcpy (rdata->repo_id, repo_id, 36);
-    rdata->etype = g_strdup (etype);
-    rdata->user = g_strdup (user);
-    rdata->ip = g_strdup (ip);
-    rdata->client_name = g_strdup(client_name);
+    g_string_printf (buf, "%s\t%s\t%s\t%s\t%.36s\t%s",
+                     etype, user, ip, client_name ? client_name : "",
+                     vinfo ? vinfo->origin_repo_id : repo_id,
+                     vinfo ? vinfo->path : "/");
 
-    cevent_manager_add_event (seaf->ev_mgr, htp_server->cevent_id, rdata);
+    seaf_mq_manager_publish_event (seaf->mq_mgr, buf->str);
 
+    g_string_free (buf, TRUE);
     if (vinfo) {
         g_free (vinfo->path);
         g_free (vinfo);
@@ -595,6 +943,233 @@ get_protocol_cb (evhtp_request_t *req, void *arg)
     evhtp_send_reply (req, EVHTP_RES_OK);
 }
 
+static void
+dump_size_sched_metrics (GString *out)
+{
+    SizeSchedulerStats stats;
+
+    size_scheduler_get_stats (seaf->size_sched, &stats);
+
+    g_string_append_printf (out,
+                            "# HELP seafile_size_sched_queued_jobs Repo size computations waiting to run.\n"
+                            "# TYPE seafile_size_sched_queued_jobs gauge\n"
+                            "seafile_size_sched_queued_jobs{priority=\"near_quota\"} %d\n"
+                            "seafile_size_sched_queued_jobs{priority=\"normal\"} %d\n"
+                            "# HELP seafile_size_sched_running_jobs Repo size computations running.\n"
+                            "# TYPE seafile_size_sched_running_jobs gauge\n"
+                            "seafile_size_sched_running_jobs %d\n"
+                            "# HELP seafile_size_sched_finished_jobs_total Repo size computations finished.\n"
+                            "# TYPE seafile_size_sched_finished_jobs_total counter\n"
+                            "seafile_size_sched_finished_jobs_total %"G_GINT64_FORMAT"\n",
+                            stats.n_urgent, stats.n_queued, stats.n_running,
+                            stats.n_finished);
+}
+
+static void
+get_metrics_cb (evhtp_request_t *req, void *arg)
+{
+    char *metrics = http_metrics_dump ();
+    GString *out = g_string_new (metrics);
+
+    g_free (metrics);
+    dump_size_sched_metrics (out);
+
+    metrics = io_stats_dump ();
+    g_string_append (out, metrics);
+    g_free (metrics);
+
+    metrics = mem_stats_dump ();
+    g_string_append (out, metrics);
+    g_free (metrics);
+
+    evhtp_headers_add_header (req->headers_out,
+                              evhtp_header_new ("Content-Type",
+                                                "text/plain; version=0.0.4", 1, 1));
+    evbuffer_add (req->buffer_out, out->str, out->len);
+    evhtp_send_reply (req, EVHTP_RES_OK);
+
+    g_string_free (out, TRUE);
+}
+
+/*
+ * The slow part of a request, run on the job pool so that merges and
+ * diffs don't hold up the other connections of an evhtp thread. @run
+ * must not touch the request, which may be gone by the time it returns;
+ * it sets the reply, which is sent from the request's own thread.
+ */
+typedef struct HttpJob HttpJob;
+typedef void (*HttpJobFunc) (HttpJob *job);
+
+struct HttpJob {
+    HttpJobFunc run;
+    void *data;
+    GDestroyNotify free_data;
+
+    /* Set by @run. */
+    int rsp_status;
+    char *rsp_body;
+
+    /* The route of the request, for the metrics. */
+    HttpRoute route;
+    gint64 start_time;
+
+    /* NULL once the connection is closed. */
+    evhtp_request_t *req;
+    int fds[2];
+    struct event *ev;
+
+    bufferevent_data_cb saved_read_cb;
+    bufferevent_data_cb saved_write_cb;
+    bufferevent_event_cb saved_event_cb;
+    void *saved_cb_arg;
+};
+
+static void
+http_job_free (HttpJob *job)
+{
+    if (job->ev)
+        event_free (job->ev);
+    close (job->fds[0]);
+    close (job->fds[1]);
+    if (job->free_data)
+        job->free_data (job->data);
+    g_free (job->rsp_body);
+    g_free (job);
+}
+
+static void
+http_job_thread (gpointer data, gpointer user_data)
+{
+    HttpJob *job = data;
+
+    http_metrics_set_route (job->route);
+    job->run (job);
+    http_metrics_observe (HTTP_PHASE_JOB, job->start_time);
+    http_metrics_set_route (HTTP_ROUTE_OTHER);
+
+    if (writen (job->fds[1], "", 1) != 1)
+        seaf_warning ("Failed to signal http job: %s.\n", strerror(errno));
+}
+
+static void
+http_job_done (evutil_socket_t fd, short events, void *arg)
+{
+    HttpJob *job = arg;
+    evhtp_request_t *req = job->req;
+    char c;
+
+    if (read (fd, &c, 1) != 1)
+        return;
+
+    if (req) {
+        struct bufferevent *bev = evhtp_request_get_bev (req);
+        struct evbuffer *output = bufferevent_get_output (bev);
+        size_t out_len;
+
+        /* Recover evhtp's callbacks */
+        bufferevent_setcb (bev, job->saved_read_cb, job->saved_write_cb,
+                           job->saved_event_cb, job->saved_cb_arg);
+
+        /* Resume reading incomming requests. */
+        evhtp_request_resume (req);
+
+        out_len = evbuffer_get_length (output);
+        if (job->rsp_body)
+            evbuffer_add (req->buffer_out, job->rsp_body, strlen (job->rsp_body));
+        evhtp_send_reply (req, job->rsp_status);
+        http_metrics_add_bytes_out (job->route,
+                                    (gint64)evbuffer_get_length (output) - out_len);
+    }
+
+    http_job_free (job);
+}
+
+static void
+http_job_event_cb (struct bufferevent *bev, short events, void *ctx)
+{
+    HttpJob *job = ctx;
+
+    /* The job keeps running, its result is dropped. */
+    job->req = NULL;
+    job->saved_event_cb (bev, events, job->saved_cb_arg);
+}
+
+/*
+ * Run @run on the job pool and reply to @req with its result. Takes
+ * @data, which is freed with @free_data. If no job can be started the
+ * request gets a 500 right away.
+ */
+static void
+http_job_start (HttpServer *htp_server, evhtp_request_t *req,
+                HttpJobFunc run, void *data, GDestroyNotify free_data)
+{
+    struct bufferevent *bev = evhtp_request_get_bev (req);
+    HttpJob *job = g_new0 (HttpJob, 1);
+
+    job->run = run;
+    job->data = data;
+    job->free_data = free_data;
+    job->rsp_status = EVHTP_RES_SERVERR;
+    job->route = http_metrics_get_route ();
+    job->start_time = get_current_time ();
+    job->req = req;
+
+    if (pipe (job->fds) < 0) {
+        seaf_warning ("Failed to create pipe: %s.\n", strerror(errno));
+        if (free_data)
+            free_data (data);
+        g_free (job);
+        evhtp_send_reply (req, EVHTP_RES_SERVERR);
+        return;
+    }
+
+    job->ev = event_new (bufferevent_get_base (bev), job->fds[0],
+                         EV_READ | EV_PERSIST, http_job_done, job);
+    event_add (job->ev, NULL);
+
+    bufferevent_getcb (bev, &job->saved_read_cb, &job->saved_write_cb,
+                       &job->saved_event_cb, &job->saved_cb_arg);
+    bufferevent_setcb (bev, NULL, NULL, http_job_event_cb, job);
+
+    /* Block any new request from this connection before finish
+     * handling this request.
+     */
+    evhtp_request_pause (req);
+
+    g_thread_pool_push (htp_server->job_pool, job, NULL);
+}
+
+typedef struct QuotaCheckData {
+    char *repo_id;
+    gint64 delta;
+} QuotaCheckData;
+
+static void
+free_quota_check_data (gpointer p)
+{
+    QuotaCheckData *data = p;
+
+    g_free (data->repo_id);
+    g_free (data);
+}
+
+static void
+check_quota_job (HttpJob *job)
+{
+    QuotaCheckData *data = job->data;
+
+    int ret = seaf_quota_manager_check_quota_with_delta (seaf->quota_mgr,
+                                                         data->repo_id,
+                                                         data->delta);
+    if (ret < 0) {
+        job->rsp_status = EVHTP_RES_SERVERR;
+    } else if (ret == 0) {
+        job->rsp_status = EVHTP_RES_OK;
+    } else {
+        job->rsp_status = SEAF_HTTP_RES_NOQUOTA;
+    }
+}
+
 static void
 get_check_quota_cb (evhtp_request_t *req, void *arg)
 {
@@ -627,32 +1202,16 @@ get_check_quota_cb (evhtp_request_t *req, void *arg)
         goto out;
     }
 
-    int ret = seaf_quota_manager_check_quota_with_delta (seaf->quota_mgr,
-                                                         repo_id, delta_num);
-    if (ret < 0) {
-        evhtp_send_reply (req, EVHTP_RES_SERVERR);
-    } else if (ret == 0) {
-        evhtp_send_reply (req, EVHTP_RES_OK);
-    } else {
-        evhtp_send_reply (req, SEAF_HTTP_RES_NOQUOTA);
-    }
+    QuotaCheckData *data = g_new0 (QuotaCheckData, 1);
+    data->repo_id = g_strdup (repo_id);
+    data->delta = delta_num;
+    http_job_start (htp_server, req, check_quota_job,
+                    data, free_quota_check_data);
 
 out:
     g_strfreev (parts);
 }
 
-static gboolean
-get_branch (SeafDBRow *row, void *vid)
-{
-    char *ret = vid;
-    const char *commit_id;
-
-    commit_id = seaf_db_row_get_column_text (row, 0);
-    memcpy (ret, commit_id, 41);
-
-    return FALSE;
-}
-
 static void
 get_head_commit_cb (evhtp_request_t *req, void *arg)
 {
@@ -667,14 +1226,9 @@ get_head_commit_cb (evhtp_request_t *req, void *arg)
     }
 
     char commit_id[41];
-    char *sql;
-
-    commit_id[0] = 0;
 
-    sql = "SELECT commit_id FROM Branch WHERE name='master' AND repo_id=?";
-    if (seaf_db_statement_foreach_row (seaf->db, sql,
-                                       get_branch, commit_id,
-                                       1, "string", repo_id) < 0) {
+    if (seaf_branch_manager_get_head_id (seaf->branch_mgr, repo_id,
+                                         "master", commit_id) < 0) {
         seaf_warning ("DB error when get branch master.\n");
         evbuffer_add_printf (req->buffer_out,
                              "{\"is_corrupted\": 1}");
@@ -696,32 +1250,695 @@ out:
     g_strfreev (parts);
 }
 
+/* Most repos asked for in one head-commits-multi request. */
+#define MAX_HEAD_COMMITS_MULTI 1000
+/* Repo ids per query of head-commits-multi. */
+#define HEAD_COMMITS_BATCH 100
+
+typedef struct HeadCommitsData {
+    HttpServer *htp_server;
+    json_t *repos;              /* [{"repo_id": ..., "token": ...}] */
+} HeadCommitsData;
+
+static void
+free_head_commits_data (gpointer p)
+{
+    HeadCommitsData *data = p;
+
+    json_decref (data->repos);
+    g_free (data);
+}
+
+static gboolean
+collect_head_commit (SeafDBRow *row, void *data)
+{
+    json_t *heads = data;
+    const char *repo_id = seaf_db_row_get_column_text (row, 0);
+    const char *commit_id = seaf_db_row_get_column_text (row, 1);
+
+    if (repo_id && commit_id)
+        json_object_set_new (heads, repo_id, json_string (commit_id));
+
+    return TRUE;
+}
+
+static int
+query_head_commits (GString *sql, json_t *heads)
+{
+    gint64 start = get_current_time ();
+    int ret = 0;
+
+    g_string_append_c (sql, ')');
+    if (seaf_db_foreach_selected_row (seaf->db, sql->str,
+                                      collect_head_commit, heads) < 0) {
+        seaf_warning ("DB error when get master branches.\n");
+        ret = -1;
+    }
+    http_metrics_observe (HTTP_PHASE_DB, start);
+
+    return ret;
+}
+
+/*
+ * Look up the master branches of all repos with a valid token, a batch
+ * of repos per query. Repos missing from the reply have to be checked
+ * with commit/HEAD, which tells a deleted or corrupted repo apart.
+ */
+static void
+head_commits_job (HttpJob *job)
+{
+    HeadCommitsData *data = job->data;
+    json_t *heads = json_object ();
+    json_t *repo;
+    const char *repo_id, *token;
+    GString *sql = g_string_new (NULL);
+    size_t i, n = json_array_size (data->repos);
+    int n_ids = 0, status;
+    gint64 start;
+    char *rsp;
+
+    for (i = 0; i < n; ++i) {
+        repo = json_array_get (data->repos, i);
+        repo_id = json_string_value (json_object_get (repo, "repo_id"));
+        token = json_string_value (json_object_get (repo, "token"));
+        /* Ids are put into the query, only accept uuids. */
+        if (!repo_id || !token || !is_uuid_valid (repo_id))
+            continue;
+
+        start = get_current_time ();
+        status = check_token (data->htp_server, repo_id, token, NULL, FALSE);
+        http_metrics_observe (HTTP_PHASE_TOKEN, start);
+        if (status != EVHTP_RES_OK)
+            continue;
+
+        if (n_ids == 0)
+            g_string_assign (sql, "SELECT repo_id, commit_id FROM Branch "
+                             "WHERE name='master' AND repo_id IN (");
+        else
+            g_string_append_c (sql, ',');
+        g_string_append_printf (sql, "'%s'", repo_id);
+
+        if (++n_ids == HEAD_COMMITS_BATCH) {
+            if (query_head_commits (sql, heads) < 0)
+                goto out;
+            n_ids = 0;
+        }
+    }
+
+    if (n_ids > 0 && query_head_commits (sql, heads) < 0)
+        goto out;
+
+    rsp = json_dumps (heads, JSON_COMPACT);
+    job->rsp_body = g_strdup (rsp);
+    free (rsp);
+    job->rsp_status = EVHTP_RES_OK;
+
+out:
+    g_string_free (sql, TRUE);
+    json_decref (heads);
+}
+
+/*
+ * Heads of many repos at once, for clients that sync a lot of them. The
+ * body is a JSON array of {"repo_id", "token"} objects, the reply maps
+ * repo ids to head commit ids.
+ */
+static void
+post_head_commits_multi_cb (evhtp_request_t *req, void *arg)
+{
+    HttpServer *htp_server = arg;
+    json_t *repos;
+    json_error_t jerror;
+    HeadCommitsData *data;
+
+    size_t len = evbuffer_get_length (req->buffer_in);
+    if (len == 0) {
+        evhtp_send_reply (req, EVHTP_RES_BADREQ);
+        return;
+    }
+
+    char *body = g_new0 (char, len);
+    evbuffer_remove (req->buffer_in, body, len);
+
+    repos = json_loadb (body, len, 0, &jerror);
+    g_free (body);
+    if (!repos || !json_is_array (repos) ||
+        json_array_size (repos) > MAX_HEAD_COMMITS_MULTI) {
+        if (!repos)
+            seaf_warning ("Failed to parse head-commits-multi request: %s.\n",
+                          jerror.text);
+        if (repos)
+            json_decref (repos);
+        evhtp_send_reply (req, EVHTP_RES_BADREQ);
+        return;
+    }
+
+    data = g_new0 (HeadCommitsData, 1);
+    data->htp_server = htp_server;
+    data->repos = repos;
+
+    http_job_start (htp_server, req, head_commits_job,
+                    data, free_head_commits_data);
+}
+
+/*
+ * Long polls for head changes, so that clients learn about them without
+ * asking for the heads of all their repos every sync interval.
+ *
+ * The body is {"cursor": ..., "repos": [{"repo_id", "token"}]}. The reply
+ * is {"cursor": ..., "repos": [repo ids]}, with the repos updated after
+ * the cursor. It's sent as soon as there are some, or with none after
+ * HEAD_WATCH_TIMEOUT. The client sends the new cursor with the next
+ * request. Without a cursor the reply is sent right away; if the cursor
+ * is older than the updates this process knows of, all the repos are in
+ * the reply.
+ *
+ * Only updates made by this process are seen, other servers of a cluster
+ * are left to the polling.
+ */
+#define HEAD_WATCH_TIMEOUT 40   /* seconds, below client and proxy timeouts */
+/* How long updates are remembered. */
+#define REPO_UPDATE_KEEP_TIME 600
+
+/*
+ * Parked watches are woken by seaf_http_server_notify_repo_update(), which
+ * runs on any thread. Each evhtp thread has a pipe to be woken through,
+ * and a list of its watches to check, filled under repo_updates_lock.
+ */
+typedef struct WatchThread {
+    int pipe_fds[2];
+    struct event *wake_event;
+    GPtrArray *woken;           /* HeadWatch */
+    HttpServer *htp_server;
+} WatchThread;
+
+typedef struct HeadWatch {
+    HttpServer *htp_server;
+    WatchThread *thread;
+    evhtp_request_t *req;
+    GPtrArray *repo_ids;
+    gint64 cursor;
+    struct event *timer;
+    /* In htp_server->head_watchers, and in thread->woken if woken. */
+    gboolean registered;
+    gboolean woken;
+
+    bufferevent_data_cb saved_read_cb;
+    bufferevent_data_cb saved_write_cb;
+    bufferevent_event_cb saved_event_cb;
+    void *saved_cb_arg;
+} HeadWatch;
+
+static pthread_key_t watch_thread_key;
+static pthread_once_t watch_thread_once = PTHREAD_ONCE_INIT;
+
+/* Called with repo_updates_lock held. */
+static void
+unregister_head_watch (HeadWatch *watch)
+{
+    HttpServer *htp_server = watch->htp_server;
+    GPtrArray *watchers;
+    guint i;
+
+    for (i = 0; i < watch->repo_ids->len; ++i) {
+        const char *repo_id = g_ptr_array_index (watch->repo_ids, i);
+        watchers = g_hash_table_lookup (htp_server->head_watchers, repo_id);
+        if (!watchers)
+            continue;
+        g_ptr_array_remove_fast (watchers, watch);
+        if (watchers->len == 0)
+            g_hash_table_remove (htp_server->head_watchers, repo_id);
+    }
+    if (watch->woken)
+        g_ptr_array_remove_fast (watch->thread->woken, watch);
+
+    watch->registered = FALSE;
+    watch->woken = FALSE;
+}
+
+static void
+head_watch_free (HeadWatch *watch)
+{
+    if (watch->registered) {
+        pthread_mutex_lock (&watch->htp_server->repo_updates_lock);
+        unregister_head_watch (watch);
+        pthread_mutex_unlock (&watch->htp_server->repo_updates_lock);
+    }
+    if (watch->timer)
+        event_free (watch->timer);
+    g_ptr_array_foreach (watch->repo_ids, (GFunc)g_free, NULL);
+    g_ptr_array_free (watch->repo_ids, TRUE);
+    g_free (watch);
+}
+
+/* Called with repo_updates_lock held. */
+static gint64
+collect_repo_updates_locked (HeadWatch *watch, json_t *updated)
+{
+    HttpServer *htp_server = watch->htp_server;
+    RepoUpdate *update;
+    const char *repo_id;
+    guint i;
+
+    for (i = 0; i < watch->repo_ids->len; ++i) {
+        repo_id = g_ptr_array_index (watch->repo_ids, i);
+        update = g_hash_table_lookup (htp_server->repo_updates, repo_id);
+        if (watch->cursor < htp_server->forgotten_seq ||
+            (update && update->seq > watch->cursor))
+            json_array_append_new (updated, json_string (repo_id));
+    }
+
+    return MAX (htp_server->last_update_seq, watch->cursor);
+}
+
+/*
+ * Add the watched repos updated after the cursor to @updated. Returns
+ * the cursor for the next request.
+ */
+static gint64
+collect_repo_updates (HeadWatch *watch, json_t *updated)
+{
+    HttpServer *htp_server = watch->htp_server;
+    gint64 cursor;
+
+    pthread_mutex_lock (&htp_server->repo_updates_lock);
+    cursor = collect_repo_updates_locked (watch, updated);
+    pthread_mutex_unlock (&htp_server->repo_updates_lock);
+
+    return cursor;
+}
+
+static void
+send_head_watch_reply (evhtp_request_t *req, gint64 cursor, json_t *updated)
+{
+    json_t *object = json_object ();
+    char *rsp;
+
+    json_object_set_new (object, "cursor", json_integer (cursor));
+    json_object_set (object, "repos", updated);
+
+    rsp = json_dumps (object, JSON_COMPACT);
+    evbuffer_add (req->buffer_out, rsp, strlen (rsp));
+    evhtp_send_reply (req, EVHTP_RES_OK);
+
+    free (rsp);
+    json_decref (object);
+}
+
+/* Reply if a watched repo was updated, or with none once @timed_out. */
+static void
+head_watch_check (HeadWatch *watch, gboolean timed_out)
+{
+    evhtp_request_t *req = watch->req;
+    struct bufferevent *bev = evhtp_request_get_bev (req);
+    json_t *updated = json_array ();
+    gint64 cursor;
+
+    cursor = collect_repo_updates (watch, updated);
+    if (json_array_size (updated) == 0 && !timed_out) {
+        json_decref (updated);
+        return;
+    }
+
+    bufferevent_setcb (bev, watch->saved_read_cb, watch->saved_write_cb,
+                       watch->saved_event_cb, watch->saved_cb_arg);
+
+    evhtp_request_resume (req);
+
+    send_head_watch_reply (req, cursor, updated);
+
+    json_decref (updated);
+    head_watch_free (watch);
+}
+
+static void
+head_watch_timeout (evutil_socket_t fd, short events, void *arg)
+{
+    head_watch_check (arg, TRUE);
+}
+
+static void
+watch_thread_wake (evutil_socket_t fd, short events, void *arg)
+{
+    WatchThread *thread = arg;
+    HttpServer *htp_server = thread->htp_server;
+    GPtrArray *woken;
+    HeadWatch *watch;
+    char buf[64];
+    guint i;
+
+    while (read (thread->pipe_fds[0], buf, sizeof(buf)) > 0)
+        ;
+
+    pthread_mutex_lock (&htp_server->repo_updates_lock);
+    woken = thread->woken;
+    thread->woken = g_ptr_array_new ();
+    for (i = 0; i < woken->len; ++i) {
+        watch = g_ptr_array_index (woken, i);
+        watch->woken = FALSE;
+    }
+    pthread_mutex_unlock (&htp_server->repo_updates_lock);
+
+    /* Watches are only freed on this thread, so they are all alive. */
+    for (i = 0; i < woken->len; ++i)
+        head_watch_check (g_ptr_array_index (woken, i), FALSE);
+
+    g_ptr_array_free (woken, TRUE);
+}
+
+static void
+watch_thread_key_init ()
+{
+    pthread_key_create (&watch_thread_key, NULL);
+}
+
+/* The WatchThread of the calling evhtp thread, set up on first use. */
+static WatchThread *
+get_watch_thread (HttpServer *htp_server, struct event_base *base)
+{
+    WatchThread *thread;
+
+    pthread_once (&watch_thread_once, watch_thread_key_init);
+
+    thread = pthread_getspecific (watch_thread_key);
+    if (thread)
+        return thread;
+
+    thread = g_new0 (WatchThread, 1);
+    if (pipe (thread->pipe_fds) < 0) {
+        seaf_warning ("Failed to create pipe: %s.\n", strerror(errno));
+        g_free (thread);
+        return NULL;
+    }
+    evutil_make_socket_nonblocking (thread->pipe_fds[0]);
+    evutil_make_socket_nonblocking (thread->pipe_fds[1]);
+
+    thread->htp_server = htp_server;
+    thread->woken = g_ptr_array_new ();
+    thread->wake_event = event_new (base, thread->pipe_fds[0],
+                                    EV_READ | EV_PERSIST,
+                                    watch_thread_wake, thread);
+    event_add (thread->wake_event, NULL);
+
+    pthread_setspecific (watch_thread_key, thread);
+    return thread;
+}
+
+/* Called with repo_updates_lock held. */
+static void
+wake_repo_watchers (HttpServer *htp_server, const char *repo_id)
+{
+    GPtrArray *watchers, *threads;
+    HeadWatch *watch;
+    WatchThread *thread;
+    guint i;
+
+    watchers = g_hash_table_lookup (htp_server->head_watchers, repo_id);
+    if (!watchers)
+        return;
+
+    threads = g_ptr_array_new ();
+    for (i = 0; i < watchers->len; ++i) {
+        watch = g_ptr_array_index (watchers, i);
+        if (watch->woken)
+            continue;
+        watch->woken = TRUE;
+        if (watch->thread->woken->len == 0)
+            g_ptr_array_add (threads, watch->thread);
+        g_ptr_array_add (watch->thread->woken, watch);
+    }
+
+    /* A full pipe already has a wake up pending. */
+    for (i = 0; i < threads->len; ++i) {
+        thread = g_ptr_array_index (threads, i);
+        if (write (thread->pipe_fds[1], "w", 1) < 0 && errno != EAGAIN)
+            seaf_warning ("Failed to wake http thread: %s.\n", strerror(errno));
+    }
+    g_ptr_array_free (threads, TRUE);
+}
+
+static void
+head_watch_event_cb (struct bufferevent *bev, short events, void *ctx)
+{
+    HeadWatch *watch = ctx;
+    bufferevent_event_cb event_cb = watch->saved_event_cb;
+    void *cb_arg = watch->saved_cb_arg;
+
+    /* The client is gone, stop waiting for it. */
+    head_watch_free (watch);
+    event_cb (bev, events, cb_arg);
+}
+
+/*
+ * Park the request until a watched repo is updated. Replies right away
+ * if one was updated since the check of the caller.
+ */
+static void
+head_watch_start (HeadWatch *watch)
+{
+    HttpServer *htp_server = watch->htp_server;
+    evhtp_request_t *req = watch->req;
+    struct bufferevent *bev = evhtp_request_get_bev (req);
+    struct event_base *base = bufferevent_get_base (bev);
+    json_t *updated;
+    GPtrArray *watchers;
+    struct timeval tv;
+    gint64 cursor;
+    guint i;
+
+    watch->thread = get_watch_thread (htp_server, base);
+
+    updated = json_array ();
+    pthread_mutex_lock (&htp_server->repo_updates_lock);
+    cursor = collect_repo_updates_locked (watch, updated);
+    if (json_array_size (updated) == 0 && watch->thread) {
+        for (i = 0; i < watch->repo_ids->len; ++i) {
+            const char *repo_id = g_ptr_array_index (watch->repo_ids, i);
+            watchers = g_hash_table_lookup (htp_server->head_watchers, repo_id);
+            if (!watchers) {
+                watchers = g_ptr_array_new ();
+                g_hash_table_insert (htp_server->head_watchers,
+                                     g_strdup (repo_id), watchers);
+            }
+            g_ptr_array_add (watchers, watch);
+        }
+        watch->registered = TRUE;
+    }
+    pthread_mutex_unlock (&htp_server->repo_updates_lock);
+
+    /* Updated meanwhile, or the thread can't be woken: let the client
+     * come back.
+     */
+    if (!watch->registered) {
+        send_head_watch_reply (req, cursor, updated);
+        json_decref (updated);
+        head_watch_free (watch);
+        return;
+    }
+    json_decref (updated);
+
+    tv.tv_sec = HEAD_WATCH_TIMEOUT;
+    tv.tv_usec = 0;
+    watch->timer = evtimer_new (base, head_watch_timeout, watch);
+    evtimer_add (watch->timer, &tv);
+
+    bufferevent_getcb (bev, &watch->saved_read_cb, &watch->saved_write_cb,
+                       &watch->saved_event_cb, &watch->saved_cb_arg);
+    bufferevent_setcb (bev, NULL, NULL, head_watch_event_cb, watch);
+
+    evhtp_request_pause (req);
+}
+
+static void
+post_head_commits_watch_cb (evhtp_request_t *req, void *arg)
+{
+    HttpServer *htp_server = arg;
+    json_t *body_json, *repos, *repo, *cursor, *updated;
+    json_error_t jerror;
+    const char *repo_id, *token;
+    HeadWatch *watch;
+    size_t i;
+    gint64 start;
+    int status;
+
+    size_t len = evbuffer_get_length (req->buffer_in);
+    if (len == 0) {
+        evhtp_send_reply (req, EVHTP_RES_BADREQ);
+        return;
+    }
+
+    char *body = g_new0 (char, len);
+    evbuffer_remove (req->buffer_in, body, len);
+
+    body_json = json_loadb (body, len, 0, &jerror);
+    g_free (body);
+    if (!body_json) {
+        seaf_warning ("Failed to parse head-commits-watch request: %s.\n",
+                      jerror.text);
+        evhtp_send_reply (req, EVHTP_RES_BADREQ);
+        return;
+    }
+
+    repos = json_object_get (body_json, "repos");
+    cursor = json_object_get (body_json, "cursor");
+    if (!repos || !json_is_array (repos) ||
+        json_array_size (repos) > MAX_HEAD_COMMITS_MULTI ||
+        (cursor && !json_is_integer (cursor))) {
+        json_decref (body_json);
+        evhtp_send_reply (req, EVHTP_RES_BADREQ);
+        return;
+    }
+
+    watch = g_new0 (HeadWatch, 1);
+    watch->htp_server = htp_server;
+    watch->req = req;
+    watch->repo_ids = g_ptr_array_new ();
+
+    /* Repos with a bad token are silently left out, like in head-commits-multi. */
+    for (i = 0; i < json_array_size (repos); ++i) {
+        repo = json_array_get (repos, i);
+        repo_id = json_string_value (json_object_get (repo, "repo_id"));
+        token = json_string_value (json_object_get (repo, "token"));
+        if (!repo_id || !token || !is_uuid_valid (repo_id))
+            continue;
+
+        start = get_current_time ();
+        status = check_token (htp_server, repo_id, token, NULL, FALSE);
+        http_metrics_observe (HTTP_PHASE_TOKEN, start);
+        if (status != EVHTP_RES_OK)
+            continue;
+
+        g_ptr_array_add (watch->repo_ids, g_strdup (repo_id));
+    }
+
+    updated = json_array ();
+
+    if (!cursor) {
+        pthread_mutex_lock (&htp_server->repo_updates_lock);
+        watch->cursor = htp_server->last_update_seq;
+        pthread_mutex_unlock (&htp_server->repo_updates_lock);
+
+        send_head_watch_reply (req, watch->cursor, updated);
+        head_watch_free (watch);
+        goto out;
+    }
+
+    watch->cursor = json_integer_value (cursor);
+    watch->cursor = collect_repo_updates (watch, updated);
+    if (json_array_size (updated) > 0) {
+        send_head_watch_reply (req, watch->cursor, updated);
+        head_watch_free (watch);
+        goto out;
+    }
+
+    head_watch_start (watch);
+
+out:
+    json_decref (updated);
+    json_decref (body_json);
+}
+
+static gboolean
+is_repo_update_old (gpointer key, gpointer value, gpointer user_data)
+{
+    RepoUpdate *update = value;
+    HttpServer *htp_server = user_data;
+
+    if (update->time > (gint64)time(NULL) - REPO_UPDATE_KEEP_TIME)
+        return FALSE;
+
+    htp_server->forgotten_seq = MAX (htp_server->forgotten_seq, update->seq);
+    return TRUE;
+}
+
+static void
+forget_old_repo_updates (HttpServer *htp_server)
+{
+    pthread_mutex_lock (&htp_server->repo_updates_lock);
+    g_hash_table_foreach_remove (htp_server->repo_updates,
+                                 is_repo_update_old, htp_server);
+    pthread_mutex_unlock (&htp_server->repo_updates_lock);
+}
+
 static char *
 gen_merge_description (SeafRepo *repo,
                        const char *merged_root,
                        const char *p1_root,
                        const char *p2_root)
 {
-    GList *p;
-    GList *results = NULL;
+    DiffResults *results = diff_results_new ();
     char *desc;
 
-    diff_merge_roots (repo->store_id, repo->version,
-                      merged_root, p1_root, p2_root, &results, TRUE);
+    diff_merge_roots_array (repo->store_id, repo->version,
+                            merged_root, p1_root, p2_root, results, TRUE);
 
-    desc = diff_results_to_description (results);
+    desc = diff_results_array_to_description (results);
 
-    for (p = results; p; p = p->next) {
-        DiffEntry *de = p->data;
-        diff_entry_free (de);
-    }
-    g_list_free (results);
+    diff_results_free (results);
 
     return desc;
 }
 
+/*
+ * Pushes to one repo are applied one at a time, so that they don't
+ * redo each other's merges on every failed branch update.
+ */
+typedef struct RepoUpdateLock {
+    pthread_mutex_t lock;
+    int refcnt;
+} RepoUpdateLock;
+
+static RepoUpdateLock *
+lock_repo_update (HttpServer *htp_server, const char *repo_id)
+{
+    RepoUpdateLock *ulock;
+
+    pthread_mutex_lock (&htp_server->repo_update_locks_lock);
+    ulock = g_hash_table_lookup (htp_server->repo_update_locks, repo_id);
+    if (!ulock) {
+        ulock = g_new0 (RepoUpdateLock, 1);
+        pthread_mutex_init (&ulock->lock, NULL);
+        g_hash_table_insert (htp_server->repo_update_locks,
+                             g_strdup (repo_id), ulock);
+    }
+    ++ulock->refcnt;
+    pthread_mutex_unlock (&htp_server->repo_update_locks_lock);
+
+    pthread_mutex_lock (&ulock->lock);
+    return ulock;
+}
+
+static void
+unlock_repo_update (HttpServer *htp_server, const char *repo_id,
+                    RepoUpdateLock *ulock)
+{
+    pthread_mutex_unlock (&ulock->lock);
+
+    pthread_mutex_lock (&htp_server->repo_update_locks_lock);
+    if (--ulock->refcnt == 0) {
+        g_hash_table_remove (htp_server->repo_update_locks, repo_id);
+        pthread_mutex_destroy (&ulock->lock);
+        g_free (ulock);
+    }
+    pthread_mutex_unlock (&htp_server->repo_update_locks_lock);
+}
+
+static void
+add_branch_update_stats (HttpServer *htp_server, gboolean merged,
+                         int retries, gint64 merge_time)
+{
+    pthread_mutex_lock (&htp_server->update_stats_lock);
+    ++htp_server->update_stats.updates;
+    if (merged)
+        ++htp_server->update_stats.merges;
+    htp_server->update_stats.retries += retries;
+    htp_server->update_stats.merge_time += merge_time;
+    pthread_mutex_unlock (&htp_server->update_stats_lock);
+}
+
 static int
-fast_forward_or_merge (const char *repo_id,
+fast_forward_or_merge (HttpServer *htp_server,
+                       const char *repo_id,
                        SeafCommit *base,
                        SeafCommit *new_commit)
 {
@@ -729,9 +1946,16 @@ fast_forward_or_merge (const char *repo_id,
 
     SeafRepo *repo = NULL;
     SeafCommit *current_head = NULL, *merged_commit = NULL;
+    RepoUpdateLock *ulock;
+    /* Result of a merge whose branch update failed. */
+    char *last_head_root = NULL, *last_merged_root = NULL;
+    gboolean merged = FALSE;
+    gint64 merge_time = 0, start;
     int retry_cnt = 0;
     int ret = 0;
 
+    ulock = lock_repo_update (htp_server, repo_id);
+
     repo = seaf_repo_manager_get_repo (seaf->repo_mgr, repo_id);
     if (!repo) {
         seaf_warning ("Repo %s doesn't exist.\n", repo_id);
@@ -760,16 +1984,29 @@ retry:
         memcpy (opt.remote_repo_id, repo_id, 36);
         memcpy (opt.remote_head, new_commit->commit_id, 40);
         opt.do_merge = TRUE;
+        opt.parallel = TRUE;
+
+        if (last_merged_root) {
+            /* Only apply what changed since the last attempt to the
+             * tree merged then.
+             */
+            roots[0] = last_head_root;
+            roots[1] = current_head->root_id;
+            roots[2] = last_merged_root;
+        } else {
+            roots[0] = base->root_id; /* base */
+            roots[1] = current_head->root_id; /* head */
+            roots[2] = new_commit->root_id;      /* remote */
+        }
 
-        roots[0] = base->root_id; /* base */
-        roots[1] = current_head->root_id; /* head */
-        roots[2] = new_commit->root_id;      /* remote */
-
+        start = get_current_time ();
         if (seaf_merge_trees (repo->store_id, repo->version, 3, roots, &opt) < 0) {
             seaf_warning ("Failed to merge.\n");
             ret = -1;
             goto out;
         }
+        merge_time += get_current_time () - start;
+        merged = TRUE;
 
         if (!opt.conflict)
             desc = g_strdup("Auto merge by system");
@@ -811,6 +2048,14 @@ retry:
                                                    repo->head,
                                                    current_head->commit_id) < 0)
     {
+        /* The head was moved by someone else, e.g. a web upload. */
+        if (merged_commit != new_commit) {
+            g_free (last_head_root);
+            g_free (last_merged_root);
+            last_head_root = g_strdup (current_head->root_id);
+            last_merged_root = g_strdup (merged_commit->root_id);
+        }
+
         seaf_repo_unref (repo);
         repo = NULL;
         seaf_commit_unref (current_head);
@@ -838,48 +2083,93 @@ retry:
     }
 
 out:
+    unlock_repo_update (htp_server, repo_id, ulock);
+
+    add_branch_update_stats (htp_server, merged, retry_cnt, merge_time);
+    if (merged)
+        seaf_debug ("Merged push to repo %.8s in %"G_GINT64_FORMAT" ms, "
+                    "%d retries.\n", repo_id, merge_time / 1000, retry_cnt);
+
+    g_free (last_head_root);
+    g_free (last_merged_root);
     seaf_commit_unref (current_head);
     seaf_commit_unref (merged_commit);
     seaf_repo_unref (repo);
     return ret;
 }
 
+typedef struct UpdateBranchData {
+    HttpServer *htp_server;
+    char *repo_id;
+    char *new_commit_id;
+    char *token;
+    /* Forwarded by another node of the cluster. */
+    gboolean forwarded;
+} UpdateBranchData;
+
 static void
-put_update_branch_cb (evhtp_request_t *req, void *arg)
+free_update_branch_data (gpointer p)
 {
-    HttpServer *htp_server = arg;
-    char **parts;
-    char *repo_id;
-    char *username = NULL;
-    SeafRepo *repo = NULL;
-    SeafCommit *new_commit = NULL, *base = NULL;
+    UpdateBranchData *data = p;
 
-    const char *new_commit_id = evhtp_kv_find (req->uri->query, "head");
-    if (new_commit_id == NULL || strlen (new_commit_id) != 40) {
-        evhtp_send_reply (req, EVHTP_RES_BADREQ);
-        return;
-    }
+    g_free (data->repo_id);
+    g_free (data->new_commit_id);
+    g_free (data->token);
+    g_free (data);
+}
 
-    parts = g_strsplit (req->uri->path->full + 1, "/", 0);
-    repo_id = parts[1];
+/*
+ * In cluster mode, updates are applied by the owner of the repo, where
+ * they are serialized by the repo update lock. If the owner can't be
+ * reached, they are applied here, which is still safe thanks to the
+ * test-and-set of the branch in the DB.
+ *
+ * Returns TRUE if the update was done by the owner.
+ */
+static gboolean
+forward_branch_update (HttpJob *job, UpdateBranchData *data)
+{
+    SeafClusterManager *cluster_mgr = seaf->cluster_mgr;
+    const ClusterNode *node;
+    int status;
 
-    int token_status = validate_token (htp_server, req, repo_id, &username, FALSE);
-    if (token_status != EVHTP_RES_OK) {
-        evhtp_send_reply (req, token_status);
-        goto out;
-    }
+    if (data->forwarded)
+        return FALSE;
 
-    int perm_status = check_permission (htp_server, repo_id, username,
-                                        "upload", FALSE);
-    if (perm_status == EVHTP_RES_FORBIDDEN) {
-        evhtp_send_reply (req, EVHTP_RES_FORBIDDEN);
-        goto out;
+    node = seaf_cluster_manager_get_repo_node (cluster_mgr, data->repo_id);
+    if (!node || node == cluster_mgr->self)
+        return FALSE;
+
+    status = seaf_cluster_manager_forward_branch_update (cluster_mgr, node,
+                                                         data->repo_id,
+                                                         data->token,
+                                                         data->new_commit_id);
+    if (status < 0) {
+        seaf_warning ("Updating branch of repo %.8s here instead of on node %s.\n",
+                      data->repo_id, node->id);
+        return FALSE;
     }
 
+    job->rsp_status = status;
+    return TRUE;
+}
+
+static void
+update_branch_job (HttpJob *job)
+{
+    UpdateBranchData *data = job->data;
+    const char *repo_id = data->repo_id;
+    const char *new_commit_id = data->new_commit_id;
+    SeafRepo *repo = NULL;
+    SeafCommit *new_commit = NULL, *base = NULL;
+
+    if (forward_branch_update (job, data))
+        return;
+
     repo = seaf_repo_manager_get_repo (seaf->repo_mgr, repo_id);
     if (!repo) {
         seaf_warning ("Repo %s is missing or corrupted.\n", repo_id);
-        evhtp_send_reply (req, EVHTP_RES_SERVERR);
+        job->rsp_status = EVHTP_RES_SERVERR;
         goto out;
     }
 
@@ -890,7 +2180,7 @@ put_update_branch_cb (evhtp_request_t *req, void *arg)
     if (!new_commit) {
         seaf_warning ("Failed to get commit %s for repo %s.\n",
                       new_commit_id, repo->id);
-        evhtp_send_reply (req, EVHTP_RES_SERVERR);
+        job->rsp_status = EVHTP_RES_SERVERR;
         goto out;
     }
 
@@ -900,19 +2190,19 @@ put_update_branch_cb (evhtp_request_t *req, void *arg)
     if (!base) {
         seaf_warning ("Failed to get commit %s for repo %s.\n",
                       new_commit->parent_id, repo->id);
-        evhtp_send_reply (req, EVHTP_RES_SERVERR);
+        job->rsp_status = EVHTP_RES_SERVERR;
         goto out;
     }
 
     if (seaf_quota_manager_check_quota (seaf->quota_mgr, repo_id) < 0) {
         seaf_warning ("Quota is full for repo %s.\n", repo->id);
-        evhtp_send_reply (req, SEAF_HTTP_RES_NOQUOTA);
+        job->rsp_status = SEAF_HTTP_RES_NOQUOTA;
         goto out;
     }
 
-    if (fast_forward_or_merge (repo_id, base, new_commit) < 0) {
+    if (fast_forward_or_merge (data->htp_server, repo_id, base, new_commit) < 0) {
         seaf_warning ("Fast forward merge is failed.\n");
-        evhtp_send_reply (req, EVHTP_RES_SERVERR);
+        job->rsp_status = EVHTP_RES_SERVERR;
         goto out;
     }
 
@@ -921,12 +2211,55 @@ put_update_branch_cb (evhtp_request_t *req, void *arg)
 
     schedule_repo_size_computation (seaf->size_sched, repo_id);
 
-    evhtp_send_reply (req, EVHTP_RES_OK);
+    job->rsp_status = EVHTP_RES_OK;
 
 out:
     seaf_repo_unref (repo);
     seaf_commit_unref (new_commit);
     seaf_commit_unref (base);
+}
+
+static void
+put_update_branch_cb (evhtp_request_t *req, void *arg)
+{
+    HttpServer *htp_server = arg;
+    char **parts;
+    char *repo_id;
+    char *username = NULL;
+
+    const char *new_commit_id = evhtp_kv_find (req->uri->query, "head");
+    if (new_commit_id == NULL || strlen (new_commit_id) != 40) {
+        evhtp_send_reply (req, EVHTP_RES_BADREQ);
+        return;
+    }
+
+    parts = g_strsplit (req->uri->path->full + 1, "/", 0);
+    repo_id = parts[1];
+
+    int token_status = validate_token (htp_server, req, repo_id, &username, FALSE);
+    if (token_status != EVHTP_RES_OK) {
+        evhtp_send_reply (req, token_status);
+        goto out;
+    }
+
+    int perm_status = check_permission (htp_server, repo_id, username,
+                                        "upload", FALSE);
+    if (perm_status == EVHTP_RES_FORBIDDEN) {
+        evhtp_send_reply (req, EVHTP_RES_FORBIDDEN);
+        goto out;
+    }
+
+    UpdateBranchData *data = g_new0 (UpdateBranchData, 1);
+    data->htp_server = htp_server;
+    data->repo_id = g_strdup (repo_id);
+    data->new_commit_id = g_strdup (new_commit_id);
+    data->token = g_strdup (evhtp_kv_find (req->headers_in, "Seafile-Repo-Token"));
+    data->forwarded = (evhtp_kv_find (req->headers_in,
+                                      CLUSTER_FORWARDED_HEADER) != NULL);
+    http_job_start (htp_server, req, update_branch_job,
+                    data, free_update_branch_data);
+
+out:
     g_free (username);
     g_strfreev (parts);
 }
@@ -960,8 +2293,10 @@ get_commit_info_cb (evhtp_request_t *req, void *arg)
     char *data = NULL;
     int len;
 
+    gint64 start = get_current_time ();
     int ret = seaf_obj_store_read_obj (seaf->commit_mgr->obj_store, repo_id, 1,
                                        commit_id, (void **)&data, &len);
+    http_metrics_observe (HTTP_PHASE_OBJ_IO, start);
     if (ret < 0) {
         seaf_warning ("Get commit info failed: commit %s is missing.\n", commit_id);
         evhtp_send_reply (req, EVHTP_RES_NOTFOUND);
@@ -1023,7 +2358,10 @@ put_commit_cb (evhtp_request_t *req, void *arg)
         goto out;
     }
 
-    if (seaf_commit_manager_add_commit (seaf->commit_mgr, commit) < 0) {
+    gint64 start = get_current_time ();
+    int rc = seaf_commit_manager_add_commit (seaf->commit_mgr, commit);
+    http_metrics_observe (HTTP_PHASE_OBJ_IO, start);
+    if (rc < 0) {
         evhtp_send_reply (req, EVHTP_RES_SERVERR);
     } else {
         evhtp_send_reply (req, EVHTP_RES_OK);
@@ -1145,13 +2483,155 @@ out:
     return ret;
 }
 
+static char *
+calculate_fs_id_list_json (SeafRepo *repo,
+                           const char *server_head,
+                           const char *client_head)
+{
+    GList *list = NULL, *ptr;
+    json_t *obj_array;
+    char *obj_list, *ret;
+    gint64 start = get_current_time ();
+    int rc;
+
+    rc = calculate_send_object_list (repo, server_head, client_head, &list);
+    http_metrics_observe (HTTP_PHASE_OBJ_IO, start);
+    if (rc < 0)
+        return NULL;
+
+    obj_array = json_array ();
+
+    for (ptr = list; ptr; ptr = ptr->next) {
+        json_array_append_new (obj_array, json_string (ptr->data));
+        g_free (ptr->data);
+    }
+    g_list_free (list);
+
+    obj_list = json_dumps (obj_array, JSON_COMPACT);
+    ret = g_strdup (obj_list);
+
+    free (obj_list);
+    json_decref (obj_array);
+    return ret;
+}
+
+/*
+ * Many clients of a shared library ask for the same commit pair after a
+ * push. Keep the answer for a while, and let concurrent requests for a
+ * pair wait for the one calculating it.
+ */
+static char *
+get_fs_id_list_json (HttpServer *htp_server,
+                     SeafRepo *repo,
+                     const char *server_head,
+                     const char *client_head)
+{
+    FsIdListInfo *info;
+    char *key, *json = NULL;
+    gboolean waited = FALSE;
+
+    key = g_strconcat (repo->id, ":", server_head, ":",
+                       client_head ? client_head : "", NULL);
+
+    pthread_mutex_lock (&htp_server->fs_id_list_cache_lock);
+
+    while (1) {
+        info = g_hash_table_lookup (htp_server->fs_id_list_cache, key);
+        if (!info)
+            break;
+        if (!info->json) {
+            pthread_cond_wait (&htp_server->fs_id_list_cache_cond,
+                               &htp_server->fs_id_list_cache_lock);
+            waited = TRUE;
+            continue;
+        }
+        /* A result we waited for is fresh, even if it's not kept. */
+        if (waited || info->expire_time > (gint64)time(NULL)) {
+            json = g_strdup (info->json);
+            pthread_mutex_unlock (&htp_server->fs_id_list_cache_lock);
+            g_free (key);
+            return json;
+        }
+        g_hash_table_remove (htp_server->fs_id_list_cache, key);
+        break;
+    }
+
+    if (g_hash_table_size (htp_server->fs_id_list_cache) >= FS_ID_LIST_CACHE_SIZE) {
+        pthread_mutex_unlock (&htp_server->fs_id_list_cache_lock);
+        g_free (key);
+        return calculate_fs_id_list_json (repo, server_head, client_head);
+    }
+
+    info = g_new0 (FsIdListInfo, 1);
+    info->expire_time = G_MAXINT64;
+    g_hash_table_insert (htp_server->fs_id_list_cache, key, info);
+
+    pthread_mutex_unlock (&htp_server->fs_id_list_cache_lock);
+
+    json = calculate_fs_id_list_json (repo, server_head, client_head);
+
+    pthread_mutex_lock (&htp_server->fs_id_list_cache_lock);
+    if (!json) {
+        /* Waiters will try on their own. */
+        g_hash_table_remove (htp_server->fs_id_list_cache, key);
+    } else {
+        info->json = g_strdup (json);
+        /* Big lists are only shared with the current waiters. */
+        if (strlen (json) > MAX_CACHED_FS_ID_LIST_LEN)
+            info->expire_time = (gint64)time(NULL);
+        else
+            info->expire_time = (gint64)time(NULL) + FS_ID_LIST_EXPIRE_TIME;
+    }
+    pthread_cond_broadcast (&htp_server->fs_id_list_cache_cond);
+    pthread_mutex_unlock (&htp_server->fs_id_list_cache_lock);
+
+    return json;
+}
+
+typedef struct FsIdListData {
+    HttpServer *htp_server;
+    char *repo_id;
+    char *server_head;
+    char *client_head;
+} FsIdListData;
+
+static void
+free_fs_id_list_data (gpointer p)
+{
+    FsIdListData *data = p;
+
+    g_free (data->repo_id);
+    g_free (data->server_head);
+    g_free (data->client_head);
+    g_free (data);
+}
+
+static void
+fs_id_list_job (HttpJob *job)
+{
+    FsIdListData *data = job->data;
+    SeafRepo *repo;
+
+    repo = seaf_repo_manager_get_repo (seaf->repo_mgr, data->repo_id);
+    if (!repo) {
+        seaf_warning ("Failed to find repo %.8s.\n", data->repo_id);
+        job->rsp_status = EVHTP_RES_SERVERR;
+        return;
+    }
+
+    job->rsp_body = get_fs_id_list_json (data->htp_server, repo,
+                                         data->server_head, data->client_head);
+    job->rsp_status = job->rsp_body ? EVHTP_RES_OK : EVHTP_RES_SERVERR;
+
+    seaf_repo_unref (repo);
+}
+
 static void
 get_fs_obj_id_cb (evhtp_request_t *req, void *arg)
 {
     HttpServer *htp_server = arg;
     char **parts;
     char *repo_id;
-    SeafRepo *repo = NULL;
 
     const char *server_head = evhtp_kv_find (req->uri->query, "server-head");
     if (server_head == NULL || strlen (server_head) != 40) {
@@ -1172,38 +2652,43 @@ get_fs_obj_id_cb (evhtp_request_t *req, void *arg)
     }
 
     const char *client_head = evhtp_kv_find (req->uri->query, "client-head");
-    GList *list = NULL, *ptr;
 
-    repo = seaf_repo_manager_get_repo (seaf->repo_mgr, repo_id);
-    if (!repo) {
-        seaf_warning ("Failed to find repo %.8s.\n", repo_id);
-        evhtp_send_reply (req, EVHTP_RES_SERVERR);
-        goto out;
-    }
+    FsIdListData *data = g_new0 (FsIdListData, 1);
+    data->htp_server = htp_server;
+    data->repo_id = g_strdup (repo_id);
+    data->server_head = g_strdup (server_head);
+    data->client_head = g_strdup (client_head);
+    http_job_start (htp_server, req, fs_id_list_job,
+                    data, free_fs_id_list_data);
 
-    if (calculate_send_object_list (repo, server_head, client_head, &list) < 0) {
-        evhtp_send_reply (req, EVHTP_RES_SERVERR);
-        goto out;
-    }
+out:
+    g_strfreev (parts);
+}
 
-    json_t *obj_array = json_array ();
+/* Only "bytes=N-", which is what clients send. Returns -1 otherwise. */
+static gint64
+parse_block_range (const char *range)
+{
+    const char *p;
+    char *end;
+    gint64 offset;
 
-    for (ptr = list; ptr; ptr = ptr->next) {
-        json_array_append_new (obj_array, json_string (ptr->data));
-        g_free (ptr->data);
-    }
-    g_list_free (list);
+    if (strncmp (range, "bytes=", 6) != 0)
+        return -1;
+    p = range + 6;
 
-    char *obj_list = json_dumps (obj_array, JSON_COMPACT);
-    evbuffer_add (req->buffer_out, obj_list, strlen (obj_list));
-    evhtp_send_reply (req, EVHTP_RES_OK);
+    offset = g_ascii_strtoll (p, &end, 10);
+    if (end == p || offset < 0 || strcmp (end, "-") != 0)
+        return -1;
 
-    g_free (obj_list);
-    json_decref (obj_array);
+    return offset;
+}
 
-out:
-    g_strfreev (parts);
-    seaf_repo_unref (repo);
+/* Cleanup of block content added by reference, @extra is the buffer. */
+static void
+free_block_content (const void *data, size_t datalen, void *extra)
+{
+    g_free (extra);
 }
 
 static void
@@ -1212,14 +2697,18 @@ get_block_cb (evhtp_request_t *req, void *arg)
     const char *repo_id = NULL;
     char *block_id = NULL;
     char *store_id = NULL;
+    char *username = NULL;
     HttpServer *htp_server = arg;
     BlockMetadata *blk_meta = NULL;
+    IoTicket *ticket = NULL;
+    gint64 io_bytes = 0;
+    char *token = g_strdup (evhtp_kv_find (req->headers_in, "Seafile-Repo-Token"));
 
     char **parts = g_strsplit (req->uri->path->full + 1, "/", 0);
     repo_id = parts[1];
     block_id = parts[3];
 
-    int token_status = validate_token (htp_server, req, repo_id, NULL, FALSE);
+    int token_status = validate_token (htp_server, req, repo_id, &username, FALSE);
     if (token_status != EVHTP_RES_OK) {
         evhtp_send_reply (req, token_status);
         goto out;
@@ -1231,6 +2720,7 @@ get_block_cb (evhtp_request_t *req, void *arg)
         goto out;
     }
 
+    gint64 start = get_current_time ();
     blk_meta = seaf_block_manager_stat_block (seaf->block_mgr,
                                               store_id, 1, block_id);
     if (blk_meta == NULL) {
@@ -1238,6 +2728,30 @@ get_block_cb (evhtp_request_t *req, void *arg)
         goto out;
     }
 
+    /* Clients resume interrupted downloads with a range; anything else
+     * gets the whole block.
+     */
+    int status = EVHTP_RES_OK;
+    gint64 offset = 0;
+    const char *range = evhtp_kv_find (req->headers_in, "Range");
+    if (range)
+        offset = parse_block_range (range);
+    if (offset > 0 && offset < blk_meta->size) {
+        char *con_range = g_strdup_printf ("bytes %"G_GINT64_FORMAT"-%u/%u",
+                                           offset, blk_meta->size - 1,
+                                           blk_meta->size);
+        evhtp_headers_add_header (req->headers_out,
+                                  evhtp_header_new ("Content-Range", con_range,
+                                                    0, 1));
+        g_free (con_range);
+        status = EVHTP_RES_PARTIAL;
+    } else {
+        offset = 0;
+    }
+
+    ticket = io_scheduler_begin (seaf->io_sched, username, repo_id,
+                                 IO_CLASS_BULK);
+
     BlockHandle *blk_handle = NULL;
     blk_handle = seaf_block_manager_open_block(seaf->block_mgr,
                                                store_id, 1, block_id, BLOCK_READ);
@@ -1247,6 +2761,19 @@ get_block_cb (evhtp_request_t *req, void *arg)
         goto out;
     }
 
+    /* Let the kernel send plain block files (sendfile or mmap). */
+    guint32 fd_size;
+    int fd = seaf_block_manager_get_block_fd (seaf->block_mgr, blk_handle,
+                                              &fd_size);
+    if (fd >= 0) {
+        if (evbuffer_add_file (req->buffer_out, fd, offset, fd_size - offset) == 0) {
+            io_bytes = fd_size - offset;
+            evhtp_send_reply (req, status);
+            goto free_handle;
+        }
+        close (fd);
+    }
+
     void *block_con = g_new0 (char, blk_meta->size);
     if (!block_con) {
         evhtp_send_reply (req, EVHTP_RES_SERVERR);
@@ -1259,141 +2786,363 @@ get_block_cb (evhtp_request_t *req, void *arg)
     if (rsize != blk_meta->size) {
         seaf_warning ("Failed to read block %.8s:%s.\n", store_id, block_id);
         evhtp_send_reply (req, EVHTP_RES_SERVERR);
+        g_free (block_con);
+    } else if (evbuffer_add_reference (req->buffer_out,
+                                       (char *)block_con + offset,
+                                       blk_meta->size - offset,
+                                       free_block_content, block_con) < 0) {
+        evhtp_send_reply (req, EVHTP_RES_SERVERR);
+        g_free (block_con);
     } else {
-        evbuffer_add (req->buffer_out, block_con, blk_meta->size);
-        evhtp_send_reply (req, EVHTP_RES_OK);
+        /* The buffer is freed once the content is sent. */
+        io_bytes = blk_meta->size;
+        evhtp_send_reply (req, status);
     }
-    g_free (block_con);
 
 free_handle:
     seaf_block_manager_close_block (seaf->block_mgr, blk_handle);
     seaf_block_manager_block_handle_free (seaf->block_mgr, blk_handle);
+    http_metrics_observe (HTTP_PHASE_BLOCK_IO, start);
 
 out:
+    io_scheduler_end (seaf->io_sched, ticket, io_bytes);
+    if (io_bytes > 0)
+        block_prefetcher_blocks_read (seaf->block_prefetcher, token, io_bytes);
+    g_free (token);
     g_free (blk_meta);
     g_free (store_id);
+    g_free (username);
     g_strfreev (parts);
 }
 
-static void
-put_send_block_cb (evhtp_request_t *req, void *arg)
+static int
+write_block (const char *store_id, const char *block_id,
+             const void *content, int len)
 {
-    const char *repo_id = NULL;
-    char *block_id = NULL;
-    char *store_id = NULL;
-    char *username = NULL;
-    HttpServer *htp_server = arg;
-    char **parts = NULL;
-    void *blk_con = NULL;
-
-    parts = g_strsplit (req->uri->path->full + 1, "/", 0);
-    repo_id = parts[1];
-    block_id = parts[3];
-
-    int token_status = validate_token (htp_server, req, repo_id, &username, FALSE);
-    if (token_status != EVHTP_RES_OK) {
-        evhtp_send_reply (req, token_status);
-        goto out;
-    }
-
-    int perm_status = check_permission (htp_server, repo_id, username,
-                                        "upload", FALSE);
-    if (perm_status == EVHTP_RES_FORBIDDEN) {
-        evhtp_send_reply (req, EVHTP_RES_FORBIDDEN);
-        goto out;
-    }
-
-    store_id = get_repo_store_id (htp_server, repo_id);
-    if (!store_id) {
-        evhtp_send_reply (req, EVHTP_RES_SERVERR);
-        goto out;
-    }
-
-    int blk_len = evbuffer_get_length (req->buffer_in);
-    if (blk_len == 0) {
-        evhtp_send_reply (req, EVHTP_RES_BADREQ);
-        goto out;
-    }
-
-    blk_con = g_new0 (char, blk_len);
-    if (!blk_con) {
-        evhtp_send_reply (req, EVHTP_RES_SERVERR);
-        goto out;
-    }
-
-    evbuffer_remove (req->buffer_in, blk_con, blk_len);
-
     BlockHandle *blk_handle = NULL;
     blk_handle = seaf_block_manager_open_block (seaf->block_mgr,
                                                 store_id, 1, block_id, BLOCK_WRITE);
     if (blk_handle == NULL) {
         seaf_warning ("Failed to open block %.8s:%s.\n", store_id, block_id);
-        evhtp_send_reply (req, EVHTP_RES_SERVERR);
-        goto out;
+        return -1;
     }
 
     if (seaf_block_manager_write_block (seaf->block_mgr, blk_handle,
-                                        blk_con, blk_len) != blk_len) {
+                                        content, len) != len) {
         seaf_warning ("Failed to write block %.8s:%s.\n", store_id, block_id);
-        evhtp_send_reply (req, EVHTP_RES_SERVERR);
         seaf_block_manager_close_block (seaf->block_mgr, blk_handle);
         seaf_block_manager_block_handle_free (seaf->block_mgr, blk_handle);
-        goto out;
+        return -1;
     }
 
     if (seaf_block_manager_close_block (seaf->block_mgr, blk_handle) < 0) {
         seaf_warning ("Failed to close block %.8s:%s.\n", store_id, block_id);
-        evhtp_send_reply (req, EVHTP_RES_SERVERR);
         seaf_block_manager_block_handle_free (seaf->block_mgr, blk_handle);
-        goto out;
+        return -1;
     }
 
     if (seaf_block_manager_commit_block (seaf->block_mgr,
                                          blk_handle) < 0) {
         seaf_warning ("Failed to commit block %.8s:%s.\n", store_id, block_id);
-        evhtp_send_reply (req, EVHTP_RES_SERVERR);
         seaf_block_manager_block_handle_free (seaf->block_mgr, blk_handle);
-        goto out;
+        return -1;
     }
 
     seaf_block_manager_block_handle_free (seaf->block_mgr, blk_handle);
+    return 0;
+}
 
-    evhtp_send_reply (req, EVHTP_RES_OK);
+static int
+store_block (const char *store_id, const char *block_id,
+             const void *content, int len,
+             const char *user, const char *repo_id)
+{
+    IoTicket *ticket;
+    gint64 start;
+    int ret;
 
-out:
-    g_free (username);
-    g_free (store_id);
-    g_strfreev (parts);
-    g_free (blk_con);
+    ticket = io_scheduler_begin (seaf->io_sched, user, repo_id, IO_CLASS_BULK);
+
+    start = get_current_time ();
+    ret = write_block (store_id, block_id, content, len);
+    http_metrics_observe (HTTP_PHASE_BLOCK_IO, start);
+
+    io_scheduler_end (seaf->io_sched, ticket, (ret < 0) ? 0 : len);
+
+    return ret;
 }
 
+/* Blocks uploaded in parts, by clients from protocol version 5 on. */
+#define MAX_PARTIAL_BLOCK_SIZE (64 << 20) /* 64MB */
+#define PARTIAL_BLOCK_EXPIRE_TIME 86400   /* 1 day */
+
 static void
-block_oper_cb (evhtp_request_t *req, void *arg)
+reply_block_offset (evhtp_request_t *req, gint64 offset, int status)
 {
-    htp_method req_method = evhtp_request_get_method (req);
+    char buf[32];
+    int len;
 
-    if (req_method == htp_method_GET) {
-        get_block_cb (req, arg);
-    } else if (req_method == htp_method_PUT) {
-        put_send_block_cb (req, arg);
-    }
+    len = snprintf (buf, sizeof(buf), "%"G_GINT64_FORMAT, offset);
+    evbuffer_add (req->buffer_out, buf, len);
+    evhtp_send_reply (req, status);
 }
 
+/*
+ * Append the part of a block starting at @offset to its temp file. Once
+ * all @size bytes are there, the block is checked against its id and
+ * stored. The reply is the number of bytes received so far, with 409 if
+ * @offset isn't that, so a client whose upload was cut off goes on from
+ * the last part the server got.
+ */
 static void
-post_check_exist_cb (evhtp_request_t *req, void *arg, CheckExistType type)
+put_block_part (evhtp_request_t *req, HttpServer *htp_server,
+                const char *store_id, const char *block_id,
+                gint64 offset, gint64 size,
+                const char *user, const char *repo_id)
 {
-    HttpServer *htp_server = arg;
-    char **parts = g_strsplit (req->uri->path->full + 1, "/", 0);
-    char *repo_id = parts[1];
-    char *store_id = NULL;
-
-    int token_status = validate_token (htp_server, req, repo_id, NULL, FALSE);
-    if (token_status != EVHTP_RES_OK) {
-        evhtp_send_reply (req, token_status);
-        goto out;
+    int len = evbuffer_get_length (req->buffer_in);
+    char *path = NULL;
+    char *content = NULL;
+    gsize content_len;
+    int fd = -1;
+    SeafStat st;
+    gint64 received;
+    unsigned char sha1[20];
+    char sha1_hex[41];
+
+    if (offset < 0 || size <= 0 || size > MAX_PARTIAL_BLOCK_SIZE ||
+        len == 0 || offset + len > size ||
+        strlen (block_id) != 40 || hex_to_sha1 (block_id, sha1) < 0) {
+        evhtp_send_reply (req, EVHTP_RES_BADREQ);
+        return;
     }
 
-    store_id = get_repo_store_id (htp_server, repo_id);
+    if (checkdir_with_mkdir (htp_server->partial_blocks_dir) < 0) {
+        seaf_warning ("Failed to create dir %s.\n", htp_server->partial_blocks_dir);
+        evhtp_send_reply (req, EVHTP_RES_SERVERR);
+        return;
+    }
+    path = g_strdup_printf ("%s/%s-%s", htp_server->partial_blocks_dir,
+                            store_id, block_id);
+
+    pthread_mutex_lock (&htp_server->partial_blocks_lock);
+
+    if (offset == 0)
+        fd = g_open (path, O_WRONLY | O_CREAT | O_TRUNC | O_BINARY, 0644);
+    else
+        fd = g_open (path, O_WRONLY | O_BINARY, 0);
+    if (fd < 0) {
+        pthread_mutex_unlock (&htp_server->partial_blocks_lock);
+        if (errno != ENOENT) {
+            seaf_warning ("Failed to open %s: %s.\n", path, strerror(errno));
+            evhtp_send_reply (req, EVHTP_RES_SERVERR);
+        } else if (seaf_block_manager_block_exists (seaf->block_mgr, store_id, 1,
+                                                    block_id)) {
+            /* The reply for the last part was lost. */
+            reply_block_offset (req, size, EVHTP_RES_OK);
+        } else {
+            reply_block_offset (req, 0, EVHTP_RES_CONFLICT);
+        }
+        goto out;
+    }
+
+    if (seaf_fstat (fd, &st) < 0) {
+        seaf_warning ("Failed to stat %s: %s.\n", path, strerror(errno));
+        pthread_mutex_unlock (&htp_server->partial_blocks_lock);
+        evhtp_send_reply (req, EVHTP_RES_SERVERR);
+        goto out;
+    }
+    received = st.st_size;
+    if (received != offset) {
+        pthread_mutex_unlock (&htp_server->partial_blocks_lock);
+        reply_block_offset (req, received, EVHTP_RES_CONFLICT);
+        goto out;
+    }
+
+    content = g_malloc (len);
+    evbuffer_remove (req->buffer_in, content, len);
+    if (lseek (fd, offset, SEEK_SET) < 0 || writen (fd, content, len) != len) {
+        seaf_warning ("Failed to write %s: %s.\n", path, strerror(errno));
+        if (ftruncate (fd, offset) < 0)
+            seaf_util_unlink (path);
+        pthread_mutex_unlock (&htp_server->partial_blocks_lock);
+        evhtp_send_reply (req, EVHTP_RES_SERVERR);
+        goto out;
+    }
+    received = offset + len;
+    close (fd);
+    fd = -1;
+
+    pthread_mutex_unlock (&htp_server->partial_blocks_lock);
+
+    if (received < size) {
+        reply_block_offset (req, received, EVHTP_RES_OK);
+        goto out;
+    }
+
+    g_free (content);
+    content = NULL;
+    if (!g_file_get_contents (path, &content, &content_len, NULL)) {
+        seaf_warning ("Failed to read %s.\n", path);
+        seaf_util_unlink (path);
+        evhtp_send_reply (req, EVHTP_RES_SERVERR);
+        goto out;
+    }
+
+    /* Parts may come from different connections, check the result. */
+    calculate_sha1 (sha1, content, content_len);
+    rawdata_to_hex (sha1, sha1_hex, 20);
+    if (content_len != size || strcmp (sha1_hex, block_id) != 0) {
+        seaf_warning ("Parts of block %.8s:%s don't match its id.\n",
+                      store_id, block_id);
+        seaf_util_unlink (path);
+        evhtp_send_reply (req, EVHTP_RES_BADREQ);
+        goto out;
+    }
+
+    /* Start over on failure rather than leave a complete temp file. */
+    if (store_block (store_id, block_id, content, content_len,
+                     user, repo_id) < 0) {
+        seaf_util_unlink (path);
+        evhtp_send_reply (req, EVHTP_RES_SERVERR);
+        goto out;
+    }
+    seaf_util_unlink (path);
+
+    reply_block_offset (req, received, EVHTP_RES_OK);
+
+out:
+    if (fd >= 0)
+        close (fd);
+    g_free (content);
+    g_free (path);
+}
+
+/* Remove the temp files of block uploads that were given up. */
+static void
+remove_expired_partial_blocks (HttpServer *htp_server)
+{
+    GDir *dir;
+    const char *name;
+    char *path;
+    SeafStat st;
+    gint64 now = (gint64)time(NULL);
+
+    dir = g_dir_open (htp_server->partial_blocks_dir, 0, NULL);
+    if (!dir)
+        return;
+
+    while ((name = g_dir_read_name (dir)) != NULL) {
+        path = g_build_filename (htp_server->partial_blocks_dir, name, NULL);
+        if (seaf_stat (path, &st) == 0 &&
+            now - st.st_mtime > PARTIAL_BLOCK_EXPIRE_TIME)
+            seaf_util_unlink (path);
+        g_free (path);
+    }
+
+    g_dir_close (dir);
+}
+
+static void
+put_send_block_cb (evhtp_request_t *req, void *arg)
+{
+    const char *repo_id = NULL;
+    char *block_id = NULL;
+    char *store_id = NULL;
+    char *username = NULL;
+    HttpServer *htp_server = arg;
+    char **parts = NULL;
+    void *blk_con = NULL;
+
+    parts = g_strsplit (req->uri->path->full + 1, "/", 0);
+    repo_id = parts[1];
+    block_id = parts[3];
+
+    int token_status = validate_token (htp_server, req, repo_id, &username, FALSE);
+    if (token_status != EVHTP_RES_OK) {
+        evhtp_send_reply (req, token_status);
+        goto out;
+    }
+
+    int perm_status = check_permission (htp_server, repo_id, username,
+                                        "upload", FALSE);
+    if (perm_status == EVHTP_RES_FORBIDDEN) {
+        evhtp_send_reply (req, EVHTP_RES_FORBIDDEN);
+        goto out;
+    }
+
+    store_id = get_repo_store_id (htp_server, repo_id);
+    if (!store_id) {
+        evhtp_send_reply (req, EVHTP_RES_SERVERR);
+        goto out;
+    }
+
+    const char *offset = evhtp_kv_find (req->uri->query, "offset");
+    const char *size = evhtp_kv_find (req->uri->query, "size");
+    if (offset && size) {
+        put_block_part (req, htp_server, store_id, block_id,
+                        g_ascii_strtoll (offset, NULL, 10),
+                        g_ascii_strtoll (size, NULL, 10),
+                        username, repo_id);
+        goto out;
+    }
+
+    int blk_len = evbuffer_get_length (req->buffer_in);
+    if (blk_len == 0) {
+        evhtp_send_reply (req, EVHTP_RES_BADREQ);
+        goto out;
+    }
+
+    blk_con = g_new0 (char, blk_len);
+    if (!blk_con) {
+        evhtp_send_reply (req, EVHTP_RES_SERVERR);
+        goto out;
+    }
+
+    evbuffer_remove (req->buffer_in, blk_con, blk_len);
+
+    if (store_block (store_id, block_id, blk_con, blk_len,
+                     username, repo_id) < 0) {
+        evhtp_send_reply (req, EVHTP_RES_SERVERR);
+        goto out;
+    }
+
+    evhtp_send_reply (req, EVHTP_RES_OK);
+
+out:
+    g_free (username);
+    g_free (store_id);
+    g_strfreev (parts);
+    g_free (blk_con);
+}
+
+static void
+block_oper_cb (evhtp_request_t *req, void *arg)
+{
+    htp_method req_method = evhtp_request_get_method (req);
+
+    if (req_method == htp_method_GET) {
+        get_block_cb (req, arg);
+    } else if (req_method == htp_method_PUT) {
+        put_send_block_cb (req, arg);
+    }
+}
+
+static void
+post_check_exist_cb (evhtp_request_t *req, void *arg, CheckExistType type)
+{
+    HttpServer *htp_server = arg;
+    char **parts = g_strsplit (req->uri->path->full + 1, "/", 0);
+    char *repo_id = parts[1];
+    char *store_id = NULL;
+
+    int token_status = validate_token (htp_server, req, repo_id, NULL, FALSE);
+    if (token_status != EVHTP_RES_OK) {
+        evhtp_send_reply (req, token_status);
+        goto out;
+    }
+
+    store_id = get_repo_store_id (htp_server, repo_id);
     if (!store_id) {
         evhtp_send_reply (req, EVHTP_RES_SERVERR);
         goto out;
@@ -1423,66 +3172,748 @@ post_check_exist_cb (evhtp_request_t *req, void *arg, CheckExistType type)
     }
 
     json_t *obj = NULL;
-    gboolean ret = TRUE;
     const char *obj_id = NULL;
     int index = 0;
 
     int array_size = json_array_size (obj_array);
     json_t *needed_objs = json_array();
 
+    /* Check all ids in one go, so that remote backends can send the
+     * requests concurrently.
+     */
+    const char **ids = g_new0 (const char *, array_size);
+    json_t **objs = g_new0 (json_t *, array_size);
+    gboolean *exists = g_new0 (gboolean, array_size);
+    int n_ids = 0;
+
     for (; index < array_size; ++index) {
         obj = json_array_get (obj_array, index);
         obj_id = json_string_value (obj);
-        if (strlen (obj_id) != 40)
+        if (!obj_id || strlen (obj_id) != 40)
             continue;
+        objs[n_ids] = obj;
+        ids[n_ids++] = obj_id;
+    }
 
+    if (n_ids > 0) {
+        gint64 start = get_current_time ();
         if (type == CHECK_FS_EXIST) {
-            ret = seaf_fs_manager_object_exists (seaf->fs_mgr, store_id, 1,
-                                                 obj_id);
+            seaf_fs_manager_objects_exist (seaf->fs_mgr, store_id, 1,
+                                           ids, n_ids, exists);
+            http_metrics_observe (HTTP_PHASE_OBJ_IO, start);
         } else if (type == CHECK_BLOCK_EXIST) {
-            ret = seaf_block_manager_block_exists (seaf->block_mgr, store_id, 1,
-                                                   obj_id);
+            seaf_block_manager_blocks_exist (seaf->block_mgr, store_id, 1,
+                                             ids, n_ids, exists);
+            http_metrics_observe (HTTP_PHASE_BLOCK_IO, start);
+        }
+    }
+
+    /* The client will commit existing blocks without sending them, so
+     * an online GC must keep them. Ask for them if that can't be
+     * recorded.
+     */
+    if (type == CHECK_BLOCK_EXIST) {
+        const char **found = g_new0 (const char *, n_ids + 1);
+        int n_found = 0;
+
+        for (index = 0; index < n_ids; ++index) {
+            if (exists[index])
+                found[n_found++] = ids[index];
+        }
+        if (gc_guard_record_blocks (store_id, found, n_found) < 0)
+            memset (exists, 0, n_ids * sizeof(gboolean));
+        g_free (found);
+    }
+
+    for (index = 0; index < n_ids; ++index) {
+        if (!exists[index]) {
+            json_array_append (needed_objs, objs[index]);
+        }
+    }
+
+    g_free (ids);
+    g_free (objs);
+    g_free (exists);
+
+    char *ret_array = json_dumps (needed_objs, JSON_COMPACT);
+    evbuffer_add (req->buffer_out, ret_array, strlen (ret_array));
+    evhtp_send_reply (req, EVHTP_RES_OK);
+
+    g_free (ret_array);
+    json_decref (needed_objs);
+    json_decref (obj_array);
+
+out:
+    g_free (store_id);
+    g_strfreev (parts);
+}
+
+static void
+post_check_fs_cb (evhtp_request_t *req, void *arg)
+{
+   post_check_exist_cb (req, arg, CHECK_FS_EXIST);
+}
+
+static void
+post_check_block_cb (evhtp_request_t *req, void *arg)
+{
+   post_check_exist_cb (req, arg, CHECK_BLOCK_EXIST);
+}
+
+/* Bigger filters cost more to send than the checks they save. */
+#define MAX_BLOCK_FILTER_SIZE (16 * 1024 * 1024)
+
+/*
+ * Reply with the bloom filter of the blocks in the repo's store:
+ *
+ *   magic "SBF1", n_hashes (8 bits), hash word size in bytes (8 bits),
+ *   1 if the words are big endian (8 bits), 0 (8 bits),
+ *   n_bits (64 bits, big endian), the bits
+ *
+ * A block the filter doesn't contain is definitely not on the server, so
+ * the client can send it without asking. 404 while the filter is built.
+ */
+static void
+get_block_filter_cb (evhtp_request_t *req, void *arg)
+{
+    HttpServer *htp_server = arg;
+    char **parts = g_strsplit (req->uri->path->full + 1, "/", 0);
+    char *repo_id = parts[1];
+    char *store_id = NULL;
+    unsigned char *bits = NULL;
+    guint64 n_bits;
+    int n_hashes;
+    unsigned char hdr[16];
+    int i;
+
+    int token_status = validate_token (htp_server, req, repo_id, NULL, FALSE);
+    if (token_status != EVHTP_RES_OK) {
+        evhtp_send_reply (req, token_status);
+        goto out;
+    }
+
+    store_id = get_repo_store_id (htp_server, repo_id);
+    if (!store_id) {
+        evhtp_send_reply (req, EVHTP_RES_SERVERR);
+        goto out;
+    }
+
+    if (seaf_block_manager_export_exists_filter (seaf->block_mgr, store_id, 1,
+                                                 &bits, &n_bits, &n_hashes) < 0 ||
+        n_bits / 8 > MAX_BLOCK_FILTER_SIZE) {
+        evhtp_send_reply (req, EVHTP_RES_NOTFOUND);
+        goto out;
+    }
+
+    memcpy (hdr, "SBF1", 4);
+    hdr[4] = n_hashes;
+    hdr[5] = sizeof(size_t);
+    hdr[6] = (G_BYTE_ORDER == G_BIG_ENDIAN);
+    hdr[7] = 0;
+    for (i = 0; i < 8; ++i)
+        hdr[8 + i] = n_bits >> (56 - 8 * i);
+
+    evbuffer_add (req->buffer_out, hdr, sizeof(hdr));
+    evbuffer_add (req->buffer_out, bits, (n_bits + 7) / 8);
+    evhtp_send_reply (req, EVHTP_RES_OK);
+
+out:
+    g_free (bits);
+    g_free (store_id);
+    g_strfreev (parts);
+}
+
+/* Objects verified by one task of the verify pool. */
+#define VERIFY_CHUNK_OBJS 64
+
+typedef struct RecvFSData RecvFSData;
+
+typedef struct VerifyChunk {
+    RecvFSData *data;
+    int start;
+    int n;
+} VerifyChunk;
+
+struct RecvFSData {
+    char store_id[37];
+    char repo_id[37];
+    char *user;
+    struct evbuffer *buf;
+    GThreadPool *verify_pool;
+
+    /* Parsed from @buf. */
+    char **ids;
+    void **objs;
+    int *lens;
+    gboolean *valid;
+    int n_objs;
+
+    pthread_mutex_t lock;
+    pthread_cond_t cond;
+    int n_pending;
+};
+
+static void
+free_recv_fs_data (gpointer p)
+{
+    RecvFSData *data = p;
+    int i;
+
+    for (i = 0; i < data->n_objs; ++i) {
+        g_free (data->ids[i]);
+        g_free (data->objs[i]);
+    }
+    g_free (data->ids);
+    g_free (data->objs);
+    g_free (data->lens);
+    g_free (data->valid);
+    evbuffer_free (data->buf);
+    g_free (data->user);
+    pthread_mutex_destroy (&data->lock);
+    pthread_cond_destroy (&data->cond);
+    g_free (data);
+}
+
+/* Split the body into objects, each one after its FsHdr. */
+static int
+parse_recv_fs (RecvFSData *data)
+{
+    struct evbuffer *buf = data->buf;
+    GPtrArray *ids = g_ptr_array_new ();
+    GPtrArray *objs = g_ptr_array_new ();
+    GArray *lens = g_array_new (FALSE, FALSE, sizeof(int));
+    FsHdr hdr;
+    guint32 size;
+    char *id, *obj;
+    int obj_len;
+    int ret = 0;
+
+    while (evbuffer_get_length (buf) > 0) {
+        if (evbuffer_get_length (buf) < sizeof(FsHdr)) {
+            ret = -1;
+            break;
+        }
+        evbuffer_remove (buf, &hdr, sizeof(FsHdr));
+        size = ntohl (hdr.obj_size);
+        if (evbuffer_get_length (buf) < size) {
+            ret = -1;
+            break;
+        }
+
+        id = g_strndup (hdr.obj_id, 40);
+        obj = g_malloc (size);
+        evbuffer_remove (buf, obj, size);
+        g_ptr_array_add (ids, id);
+        g_ptr_array_add (objs, obj);
+        obj_len = size;
+        g_array_append_val (lens, obj_len);
+    }
+
+    data->n_objs = ids->len;
+    data->ids = (char **)g_ptr_array_free (ids, FALSE);
+    data->objs = g_ptr_array_free (objs, FALSE);
+    data->lens = (int *)g_array_free (lens, FALSE);
+    data->valid = g_new0 (gboolean, data->n_objs);
+
+    return ret;
+}
+
+static void
+verify_fs_objs (RecvFSData *data, int start, int n)
+{
+    int i;
+
+    for (i = start; i < start + n; ++i)
+        data->valid[i] = seaf_fs_manager_verify_object_data (1, data->ids[i],
+                                                             data->objs[i],
+                                                             data->lens[i]);
+}
+
+static void
+verify_chunk_thread (gpointer vchunk, gpointer user_data)
+{
+    VerifyChunk *chunk = vchunk;
+    RecvFSData *data = chunk->data;
+
+    verify_fs_objs (data, chunk->start, chunk->n);
+
+    pthread_mutex_lock (&data->lock);
+    if (--data->n_pending == 0)
+        pthread_cond_signal (&data->cond);
+    pthread_mutex_unlock (&data->lock);
+}
+
+/*
+ * Decompressing and hashing dominate for many small objects, so the
+ * chunks are checked on all cores while this thread waits.
+ */
+static void
+verify_recv_fs (RecvFSData *data)
+{
+    int n_chunks = (data->n_objs + VERIFY_CHUNK_OBJS - 1) / VERIFY_CHUNK_OBJS;
+    VerifyChunk *chunks;
+    int i;
+
+    if (n_chunks <= 1 || !data->verify_pool) {
+        verify_fs_objs (data, 0, data->n_objs);
+        return;
+    }
+
+    chunks = g_new0 (VerifyChunk, n_chunks);
+    data->n_pending = n_chunks;
+    for (i = 0; i < n_chunks; ++i) {
+        chunks[i].data = data;
+        chunks[i].start = i * VERIFY_CHUNK_OBJS;
+        chunks[i].n = MIN (VERIFY_CHUNK_OBJS, data->n_objs - chunks[i].start);
+        /* If no thread can be started, the chunk waits for a running one. */
+        g_thread_pool_push (data->verify_pool, &chunks[i], NULL);
+    }
+
+    pthread_mutex_lock (&data->lock);
+    while (data->n_pending > 0)
+        pthread_cond_wait (&data->cond, &data->lock);
+    pthread_mutex_unlock (&data->lock);
+
+    g_free (chunks);
+}
+
+/*
+ * Store the objects of a recv-fs request. All of them are checked before
+ * any is written, then they are written and synced as one batch.
+ */
+static void
+recv_fs_job (HttpJob *job)
+{
+    RecvFSData *data = job->data;
+    gint64 start;
+    int i;
+
+    if (parse_recv_fs (data) < 0) {
+        seaf_warning ("Bad fs object content format from %.8s:%s.\n",
+                      data->repo_id, data->user);
+        job->rsp_status = EVHTP_RES_BADREQ;
+        return;
+    }
+
+    verify_recv_fs (data);
+    for (i = 0; i < data->n_objs; ++i) {
+        if (!data->valid[i]) {
+            seaf_warning ("Fs object %s from %.8s:%s is corrupted.\n",
+                          data->ids[i], data->repo_id, data->user);
+            job->rsp_status = EVHTP_RES_BADREQ;
+            return;
         }
+    }
+
+    start = get_current_time ();
+    if (seaf_obj_store_write_objs (seaf->fs_mgr->obj_store, data->store_id, 1,
+                                   (const char **)data->ids, data->objs,
+                                   data->lens, data->n_objs) < 0) {
+        seaf_warning ("Failed to write fs objects of repo %.8s.\n",
+                      data->repo_id);
+        job->rsp_status = EVHTP_RES_SERVERR;
+        return;
+    }
+    http_metrics_observe (HTTP_PHASE_OBJ_IO, start);
+
+    job->rsp_status = EVHTP_RES_OK;
+}
+
+static void
+post_recv_fs_cb (evhtp_request_t *req, void *arg)
+{
+    HttpServer *htp_server = arg;
+    char **parts = g_strsplit (req->uri->path->full + 1, "/", 0);
+    const char *repo_id = parts[1];
+    char *store_id = NULL;
+    char *username = NULL;
+
+    int token_status = validate_token (htp_server, req, repo_id, &username, FALSE);
+    if (token_status != EVHTP_RES_OK) {
+        evhtp_send_reply (req, token_status);
+        goto out;
+    }
+
+    int perm_status = check_permission (htp_server, repo_id, username,
+                                        "upload", FALSE);
+    if (perm_status == EVHTP_RES_FORBIDDEN) {
+        evhtp_send_reply (req, EVHTP_RES_FORBIDDEN);
+        goto out;
+    }
+
+    store_id = get_repo_store_id (htp_server, repo_id);
+    if (!store_id) {
+        evhtp_send_reply (req, EVHTP_RES_SERVERR);
+        goto out;
+    }
+
+    size_t len = evbuffer_get_length (req->buffer_in);
+    if (len < sizeof(FsHdr)) {
+        evhtp_send_reply (req, EVHTP_RES_BADREQ);
+        goto out;
+    }
+
+    RecvFSData *data = g_new0 (RecvFSData, 1);
+    memcpy (data->store_id, store_id, 36);
+    memcpy (data->repo_id, repo_id, 36);
+    data->user = g_strdup (username);
+    data->buf = evbuffer_new ();
+    /* Moves the chains, it doesn't copy the content. */
+    evbuffer_remove_buffer (req->buffer_in, data->buf, len);
+    data->verify_pool = htp_server->verify_pool;
+    pthread_mutex_init (&data->lock, NULL);
+    pthread_cond_init (&data->cond, NULL);
+
+    http_job_start (htp_server, req, recv_fs_job, data, free_recv_fs_data);
+
+out:
+    g_free (store_id);
+    g_free (username);
+    g_strfreev (parts);
+}
+
+/* Objects read and sent as one chunk of a pack-fs response. */
+#define PACK_FS_BATCH 50
+
+/*
+ * A pack-fs response, sent in chunks as the output buffer drains, so
+ * that only one batch of objects is in memory at a time.
+ */
+typedef struct PackFSData {
+    evhtp_request_t *req;
+    char store_id[37];
+    char *token;                /* the download session, for prefetch */
+    char **ids;
+    int n_ids;
+    int next;
+
+    struct evbuffer *buf;
+    gint64 total_size;
+    gboolean error;
+
+    bufferevent_data_cb saved_read_cb;
+    bufferevent_data_cb saved_write_cb;
+    bufferevent_event_cb saved_event_cb;
+    void *saved_cb_arg;
+} PackFSData;
+
+static void
+free_pack_fs_data (PackFSData *pack)
+{
+    g_free (pack->token);
+    g_strfreev (pack->ids);
+    evbuffer_free (pack->buf);
+    g_free (pack);
+}
+
+static gboolean
+pack_fs_obj (const char *obj_id, void *data, int len, void *user_data)
+{
+    PackFSData *pack = user_data;
+    int data_len_net;
+
+    if (!data) {
+        seaf_warning ("Failed to read seafile object %s.\n", obj_id);
+        pack->error = TRUE;
+        return FALSE;
+    }
+
+    evbuffer_add (pack->buf, obj_id, 40);
+    data_len_net = htonl (len);
+    evbuffer_add (pack->buf, &data_len_net, 4);
+    evbuffer_add (pack->buf, data, len);
+
+    ++pack->next;
+    pack->total_size += len;
+
+    return (pack->total_size < seaf->http_server->max_pack_fs_size);
+}
+
+static gboolean
+pack_fs_done (PackFSData *pack)
+{
+    return (pack->next >= pack->n_ids ||
+            pack->total_size >= seaf->http_server->max_pack_fs_size);
+}
+
+/* Read the next batch of objects into pack->buf. */
+static int
+pack_fs_batch (PackFSData *pack)
+{
+    int n = MIN (pack->n_ids - pack->next, PACK_FS_BATCH);
+    int first = pack->next;
+    gint64 start = get_current_time ();
+
+    seaf_obj_store_read_objs (seaf->fs_mgr->obj_store, pack->store_id, 1,
+                              (const char **)pack->ids + pack->next, n,
+                              pack_fs_obj, pack);
+    http_metrics_observe (HTTP_PHASE_OBJ_IO, start);
+
+    if (pack->error)
+        return -1;
+
+    /* The client asks for the blocks of these files next. */
+    block_prefetcher_add_objects (seaf->block_prefetcher, pack->token,
+                                  pack->store_id, pack->ids + first,
+                                  pack->next - first);
+    return 0;
+}
+
+static void
+pack_fs_write_cb (struct bufferevent *bev, void *ctx)
+{
+    PackFSData *pack = ctx;
+
+    if (!pack_fs_done (pack)) {
+        http_metrics_set_route (HTTP_ROUTE_PACK_FS);
+        if (pack_fs_batch (pack) < 0) {
+            http_metrics_set_route (HTTP_ROUTE_OTHER);
+            /* The status is out already. Cut the response short, so the
+             * client sees it as incomplete.
+             */
+            evhtp_connection_free (evhtp_request_get_connection (pack->req));
+            free_pack_fs_data (pack);
+            return;
+        }
+        http_metrics_set_route (HTTP_ROUTE_OTHER);
+        http_metrics_add_bytes_out (HTTP_ROUTE_PACK_FS,
+                                    evbuffer_get_length (pack->buf));
+        evhtp_send_reply_chunk (pack->req, pack->buf);
+        evbuffer_drain (pack->buf, evbuffer_get_length (pack->buf));
+        return;
+    }
+
+    /* Recover evhtp's callbacks */
+    bufferevent_setcb (bev, pack->saved_read_cb, pack->saved_write_cb,
+                       pack->saved_event_cb, pack->saved_cb_arg);
+
+    /* Resume reading incomming requests. */
+    evhtp_request_resume (pack->req);
+
+    evhtp_send_reply_chunk_end (pack->req);
+
+    free_pack_fs_data (pack);
+}
+
+static void
+pack_fs_event_cb (struct bufferevent *bev, short events, void *ctx)
+{
+    PackFSData *pack = ctx;
+
+    pack->saved_event_cb (bev, events, pack->saved_cb_arg);
+
+    free_pack_fs_data (pack);
+}
+
+static void
+post_pack_fs_cb (evhtp_request_t *req, void *arg)
+{
+    HttpServer *htp_server = arg;
+    char **parts = g_strsplit (req->uri->path->full + 1, "/", 0);
+    const char *repo_id = parts[1];
+    char *store_id = NULL;
+
+    int token_status = validate_token (htp_server, req, repo_id, NULL, FALSE);
+    if (token_status != EVHTP_RES_OK) {
+        evhtp_send_reply (req, token_status);
+        goto out;
+    }
+
+    store_id = get_repo_store_id (htp_server, repo_id);
+    if (!store_id) {
+        evhtp_send_reply (req, EVHTP_RES_SERVERR);
+        goto out;
+    }
+
+    int fs_id_list_len = evbuffer_get_length (req->buffer_in);
+    if (fs_id_list_len == 0) {
+        evhtp_send_reply (req, EVHTP_RES_BADREQ);
+        goto out;
+    }
+
+    char *fs_id_list = g_new0 (char, fs_id_list_len);
+    if (!fs_id_list) {
+        evhtp_send_reply (req, EVHTP_RES_SERVERR);
+        goto out;
+    }
+
+    json_error_t jerror;
+    evbuffer_remove (req->buffer_in, fs_id_list, fs_id_list_len);
+    json_t *fs_id_array = json_loadb (fs_id_list, fs_id_list_len, 0, &jerror);
+
+    g_free (fs_id_list);
+
+    if (!fs_id_array) {
+        seaf_warning ("dump fs obj_id from json failed, error: %s\n", jerror.text);
+        evhtp_send_reply (req, EVHTP_RES_BADREQ);
+        goto out;
+    }
+
+    json_t *obj = NULL;
+    const char *obj_id = NULL;
+    int index = 0;
+
+    int array_size = json_array_size (fs_id_array);
+    char **ids = g_new0 (char *, array_size + 1);
+
+    for (; index < array_size; ++index) {
+        obj = json_array_get (fs_id_array, index);
+        obj_id = json_string_value (obj);
+
+        if (!obj_id || strlen (obj_id) != 40) {
+            seaf_warning ("Invalid fs id %s.\n", obj_id);
+            evhtp_send_reply (req, EVHTP_RES_BADREQ);
+            g_strfreev (ids);
+            json_decref (fs_id_array);
+            goto out;
+        }
+        ids[index] = g_strdup (obj_id);
+    }
+    json_decref (fs_id_array);
+
+    PackFSData *pack = g_new0 (PackFSData, 1);
+    pack->req = req;
+    memcpy (pack->store_id, store_id, 36);
+    pack->token = g_strdup (evhtp_kv_find (req->headers_in, "Seafile-Repo-Token"));
+    pack->ids = ids;
+    pack->n_ids = array_size;
+    pack->buf = evbuffer_new ();
+
+    /* Read the first batch before replying, so that a missing object
+     * can still be reported by the status.
+     */
+    if (pack_fs_batch (pack) < 0) {
+        evhtp_send_reply (req, EVHTP_RES_SERVERR);
+        free_pack_fs_data (pack);
+        goto out;
+    }
+
+    if (pack_fs_done (pack)) {
+        evbuffer_add_buffer (req->buffer_out, pack->buf);
+        evhtp_send_reply (req, EVHTP_RES_OK);
+        free_pack_fs_data (pack);
+        goto out;
+    }
+
+    /* Send the rest piece by piece from the write callback, like
+     * access-file does for file content.
+     */
+    struct bufferevent *bev = evhtp_request_get_bev (req);
+    bufferevent_getcb (bev, &pack->saved_read_cb, &pack->saved_write_cb,
+                       &pack->saved_event_cb, &pack->saved_cb_arg);
+    bufferevent_setcb (bev,
+                       NULL,
+                       pack_fs_write_cb,
+                       pack_fs_event_cb,
+                       pack);
+    /* Block any new request from this connection before finish
+     * handling this request.
+     */
+    evhtp_request_pause (req);
+
+    evhtp_send_reply_chunk_start (req, EVHTP_RES_OK);
+    evhtp_send_reply_chunk (req, pack->buf);
+    evbuffer_drain (pack->buf, evbuffer_get_length (pack->buf));
+
+out:
+    g_free (store_id);
+    g_strfreev (parts);
+}
+
+#define MAX_BLOCK_PACK_SIZE (4 << 20) /* 4MB */
+
+static int
+pack_block (const char *store_id, const char *block_id, struct evbuffer *buf,
+            const char *user, const char *repo_id)
+{
+    BlockMetadata *blk_meta;
+    BlockHandle *handle;
+    IoTicket *ticket;
+    char *content;
+    guint32 len_net, fd_size;
+    gint64 start = get_current_time ();
+    int fd, ret = -1;
+
+    blk_meta = seaf_block_manager_stat_block (seaf->block_mgr,
+                                              store_id, 1, block_id);
+    if (!blk_meta) {
+        seaf_warning ("Failed to stat block %.8s:%s.\n", store_id, block_id);
+        return -1;
+    }
+
+    ticket = io_scheduler_begin (seaf->io_sched, user, repo_id, IO_CLASS_BULK);
+
+    handle = seaf_block_manager_open_block (seaf->block_mgr,
+                                            store_id, 1, block_id, BLOCK_READ);
+    if (!handle) {
+        seaf_warning ("Failed to open block %.8s:%s.\n", store_id, block_id);
+        io_scheduler_end (seaf->io_sched, ticket, 0);
+        g_free (blk_meta);
+        return -1;
+    }
 
-        if (!ret) {
-            json_array_append (needed_objs, obj);
+    /* Let the kernel send plain block files, like get_block_cb. */
+    fd = seaf_block_manager_get_block_fd (seaf->block_mgr, handle, &fd_size);
+    if (fd >= 0) {
+        if (fd_size == blk_meta->size) {
+            evbuffer_add (buf, block_id, 40);
+            len_net = htonl (blk_meta->size);
+            evbuffer_add (buf, &len_net, 4);
+            if (evbuffer_add_file (buf, fd, 0, fd_size) == 0) {
+                ret = blk_meta->size;
+                goto out;
+            }
+            /* The header is already in, callers drop the whole buffer. */
+            seaf_warning ("Failed to add block %.8s:%s.\n", store_id, block_id);
         }
+        close (fd);
+        goto out;
     }
 
-    char *ret_array = json_dumps (needed_objs, JSON_COMPACT);
-    evbuffer_add (req->buffer_out, ret_array, strlen (ret_array));
-    evhtp_send_reply (req, EVHTP_RES_OK);
+    content = g_new (char, blk_meta->size);
+    if (seaf_block_manager_read_block (seaf->block_mgr, handle,
+                                       content, blk_meta->size) != blk_meta->size) {
+        seaf_warning ("Failed to read block %.8s:%s.\n", store_id, block_id);
+        g_free (content);
+        goto out;
+    }
 
-    g_free (ret_array);
-    json_decref (needed_objs);
-    json_decref (obj_array);
+    evbuffer_add (buf, block_id, 40);
+    len_net = htonl (blk_meta->size);
+    evbuffer_add (buf, &len_net, 4);
+    /* The buffer is freed once the content is sent. */
+    if (evbuffer_add_reference (buf, content, blk_meta->size,
+                                free_block_content, content) < 0) {
+        g_free (content);
+        goto out;
+    }
+    ret = blk_meta->size;
 
 out:
-    g_free (store_id);
-    g_strfreev (parts);
-}
-
-static void
-post_check_fs_cb (evhtp_request_t *req, void *arg)
-{
-   post_check_exist_cb (req, arg, CHECK_FS_EXIST);
-}
-
-static void
-post_check_block_cb (evhtp_request_t *req, void *arg)
-{
-   post_check_exist_cb (req, arg, CHECK_BLOCK_EXIST);
+    seaf_block_manager_close_block (seaf->block_mgr, handle);
+    seaf_block_manager_block_handle_free (seaf->block_mgr, handle);
+    io_scheduler_end (seaf->io_sched, ticket, (ret < 0) ? 0 : ret);
+    g_free (blk_meta);
+    http_metrics_observe (HTTP_PHASE_BLOCK_IO, start);
+    return ret;
 }
 
+/*
+ * Serve several blocks in one response, framed like pack-fs: block id
+ * (40 bytes), size (32, network order), content. Blocks are added until
+ * the response reaches MAX_BLOCK_PACK_SIZE; the client asks again for
+ * the ones left out.
+ */
 static void
-post_recv_fs_cb (evhtp_request_t *req, void *arg)
+post_pack_blocks_cb (evhtp_request_t *req, void *arg)
 {
     HttpServer *htp_server = arg;
     char **parts = g_strsplit (req->uri->path->full + 1, "/", 0);
     const char *repo_id = parts[1];
     char *store_id = NULL;
     char *username = NULL;
-    FsHdr *hdr = NULL;
+    json_t *block_id_array = NULL;
+    int total_size = 0, size;
 
     int token_status = validate_token (htp_server, req, repo_id, &username, FALSE);
     if (token_status != EVHTP_RES_OK) {
@@ -1490,170 +3921,198 @@ post_recv_fs_cb (evhtp_request_t *req, void *arg)
         goto out;
     }
 
-    int perm_status = check_permission (htp_server, repo_id, username,
-                                        "upload", FALSE);
-    if (perm_status == EVHTP_RES_FORBIDDEN) {
-        evhtp_send_reply (req, EVHTP_RES_FORBIDDEN);
-        goto out;
-    }
-
     store_id = get_repo_store_id (htp_server, repo_id);
     if (!store_id) {
         evhtp_send_reply (req, EVHTP_RES_SERVERR);
         goto out;
     }
 
-    int fs_con_len = evbuffer_get_length (req->buffer_in);
-    if (fs_con_len < sizeof(FsHdr)) {
+    int list_len = evbuffer_get_length (req->buffer_in);
+    if (list_len == 0) {
         evhtp_send_reply (req, EVHTP_RES_BADREQ);
         goto out;
     }
 
-    hdr = g_new0 (FsHdr, 1);
-    if (!hdr) {
-        evhtp_send_reply (req, EVHTP_RES_SERVERR);
+    char *block_id_list = g_new0 (char, list_len);
+
+    json_error_t jerror;
+    evbuffer_remove (req->buffer_in, block_id_list, list_len);
+    block_id_array = json_loadb (block_id_list, list_len, 0, &jerror);
+
+    g_free (block_id_list);
+
+    if (!block_id_array) {
+        seaf_warning ("dump block ids from json failed, error: %s\n", jerror.text);
+        evhtp_send_reply (req, EVHTP_RES_BADREQ);
         goto out;
     }
 
-    char obj_id[41];
-    void *obj_con = NULL;
-    int con_len;
-
-    while (fs_con_len > 0) {
-        if (fs_con_len < sizeof(FsHdr)) {
-            seaf_warning ("Bad fs object content format from %.8s:%s.\n",
-                          repo_id, username);
+    int i, array_size = json_array_size (block_id_array);
+    const char *block_id;
+    unsigned char sha1[20];
+
+    for (i = 0; i < array_size; ++i) {
+        block_id = json_string_value (json_array_get (block_id_array, i));
+        /* Ids end up in storage paths, only accept hex. */
+        if (!block_id || strlen (block_id) != 40 ||
+            hex_to_sha1 (block_id, sha1) < 0) {
+            seaf_warning ("Invalid block id %s.\n", block_id);
+            evbuffer_drain (req->buffer_out, evbuffer_get_length (req->buffer_out));
             evhtp_send_reply (req, EVHTP_RES_BADREQ);
-            break;
+            goto out;
         }
 
-        evbuffer_remove (req->buffer_in, hdr, sizeof(FsHdr));
-        con_len = ntohl (hdr->obj_size);
-        memcpy (obj_id, hdr->obj_id, 40);
-        obj_id[40] = 0;
-
-        obj_con = g_new0 (char, con_len);
-        if (!obj_con) {
-            evhtp_send_reply (req, EVHTP_RES_SERVERR);
-            break;
-        }
-        evbuffer_remove (req->buffer_in, obj_con, con_len);
-
-        if (seaf_obj_store_write_obj (seaf->fs_mgr->obj_store,
-                                      store_id, 1, obj_id, obj_con,
-                                      con_len, FALSE) < 0) {
-            seaf_warning ("Failed to write fs object %.8s to disk.\n",
-                          obj_id);
-            g_free (obj_con);
+        size = pack_block (store_id, block_id, req->buffer_out,
+                           username, repo_id);
+        if (size < 0) {
+            evbuffer_drain (req->buffer_out, evbuffer_get_length (req->buffer_out));
             evhtp_send_reply (req, EVHTP_RES_SERVERR);
-            break;
+            goto out;
         }
 
-        fs_con_len -= (con_len + sizeof(FsHdr));
-        g_free (obj_con);
+        total_size += size;
+        if (total_size >= MAX_BLOCK_PACK_SIZE)
+            break;
     }
 
-    if (fs_con_len == 0) {
-        evhtp_send_reply (req, EVHTP_RES_OK);
-    }
+    block_prefetcher_blocks_read (seaf->block_prefetcher,
+                                  evhtp_kv_find (req->headers_in,
+                                                 "Seafile-Repo-Token"),
+                                  total_size);
+    evhtp_send_reply (req, EVHTP_RES_OK);
 
 out:
-    g_free (store_id);
-    g_free (hdr);
+    if (block_id_array)
+        json_decref (block_id_array);
     g_free (username);
+    g_free (store_id);
     g_strfreev (parts);
 }
 
-#define MAX_OBJECT_PACK_SIZE (1 << 20) /* 1MB */
+/* Largest body accepted by recv-blocks. */
+#define MAX_RECV_BLOCKS_SIZE (16 << 20) /* 16MB */
+
+typedef struct RecvBlocksData {
+    char store_id[37];
+    char repo_id[37];
+    char *user;
+    struct evbuffer *buf;
+} RecvBlocksData;
 
 static void
-post_pack_fs_cb (evhtp_request_t *req, void *arg)
+free_recv_blocks_data (gpointer p)
+{
+    RecvBlocksData *data = p;
+
+    evbuffer_free (data->buf);
+    g_free (data->user);
+    g_free (data);
+}
+
+/*
+ * Store the blocks of a recv-blocks request and reply with the ids of
+ * those that couldn't be stored, as a JSON array.
+ */
+static void
+recv_blocks_job (HttpJob *job)
+{
+    RecvBlocksData *data = job->data;
+    struct evbuffer *buf = data->buf;
+    json_t *failed = json_array ();
+    char block_id[41];
+    unsigned char sha1[20];
+    guint32 size_net, size;
+    char *content;
+    char *rsp;
+
+    block_id[40] = '\0';
+    while (evbuffer_get_length (buf) > 0) {
+        if (evbuffer_get_length (buf) < 44) {
+            seaf_warning ("Incomplete block pack for store %.8s.\n",
+                          data->store_id);
+            job->rsp_status = EVHTP_RES_BADREQ;
+            goto out;
+        }
+
+        evbuffer_remove (buf, block_id, 40);
+        evbuffer_remove (buf, &size_net, 4);
+        size = ntohl (size_net);
+
+        /* Ids end up in storage paths, only accept hex. */
+        if (hex_to_sha1 (block_id, sha1) < 0 ||
+            evbuffer_get_length (buf) < size) {
+            seaf_warning ("Bad block pack for store %.8s.\n", data->store_id);
+            job->rsp_status = EVHTP_RES_BADREQ;
+            goto out;
+        }
+
+        content = (char *)evbuffer_pullup (buf, size);
+        if (store_block (data->store_id, block_id, content, size,
+                         data->user, data->repo_id) < 0)
+            json_array_append_new (failed, json_string (block_id));
+        evbuffer_drain (buf, size);
+    }
+
+    rsp = json_dumps (failed, JSON_COMPACT);
+    job->rsp_body = g_strdup (rsp);
+    free (rsp);
+    job->rsp_status = EVHTP_RES_OK;
+
+out:
+    json_decref (failed);
+}
+
+/*
+ * Receive many blocks in one request, framed like pack-blocks. Blocks
+ * that fail are listed in the reply, the client sends them again.
+ */
+static void
+post_recv_blocks_cb (evhtp_request_t *req, void *arg)
 {
     HttpServer *htp_server = arg;
     char **parts = g_strsplit (req->uri->path->full + 1, "/", 0);
     const char *repo_id = parts[1];
     char *store_id = NULL;
+    char *username = NULL;
 
-    int token_status = validate_token (htp_server, req, repo_id, NULL, FALSE);
+    int token_status = validate_token (htp_server, req, repo_id, &username, FALSE);
     if (token_status != EVHTP_RES_OK) {
         evhtp_send_reply (req, token_status);
         goto out;
     }
 
-    store_id = get_repo_store_id (htp_server, repo_id);
-    if (!store_id) {
-        evhtp_send_reply (req, EVHTP_RES_SERVERR);
-        goto out;
-    }
-
-    int fs_id_list_len = evbuffer_get_length (req->buffer_in);
-    if (fs_id_list_len == 0) {
-        evhtp_send_reply (req, EVHTP_RES_BADREQ);
+    int perm_status = check_permission (htp_server, repo_id, username,
+                                        "upload", FALSE);
+    if (perm_status == EVHTP_RES_FORBIDDEN) {
+        evhtp_send_reply (req, EVHTP_RES_FORBIDDEN);
         goto out;
     }
 
-    char *fs_id_list = g_new0 (char, fs_id_list_len);
-    if (!fs_id_list) {
+    store_id = get_repo_store_id (htp_server, repo_id);
+    if (!store_id) {
         evhtp_send_reply (req, EVHTP_RES_SERVERR);
         goto out;
     }
 
-    json_error_t jerror;
-    evbuffer_remove (req->buffer_in, fs_id_list, fs_id_list_len);
-    json_t *fs_id_array = json_loadb (fs_id_list, fs_id_list_len, 0, &jerror);
-
-    g_free (fs_id_list);
-
-    if (!fs_id_array) {
-        seaf_warning ("dump fs obj_id from json failed, error: %s\n", jerror.text);
+    size_t len = evbuffer_get_length (req->buffer_in);
+    if (len == 0 || len > MAX_RECV_BLOCKS_SIZE) {
         evhtp_send_reply (req, EVHTP_RES_BADREQ);
         goto out;
     }
 
-    json_t *obj = NULL;
-    const char *obj_id = NULL;
-    int index = 0;
-    void *fs_data = NULL;
-    int data_len;
-    int data_len_net;
-    int total_size = 0;
-
-    int array_size = json_array_size (fs_id_array);
-
-    for (; index < array_size; ++index) {
-        obj = json_array_get (fs_id_array, index);
-        obj_id = json_string_value (obj);
-
-        if (strlen (obj_id) != 40) {
-            seaf_warning ("Invalid fs id %s.\n", obj_id);
-            evhtp_send_reply (req, EVHTP_RES_BADREQ);
-            json_decref (fs_id_array);
-            goto out;
-        }
-        if (seaf_obj_store_read_obj (seaf->fs_mgr->obj_store, store_id, 1,
-                                     obj_id, &fs_data, &data_len) < 0) {
-            seaf_warning ("Failed to read seafile object %s.\n", obj_id);
-            evhtp_send_reply (req, EVHTP_RES_SERVERR);
-            json_decref (fs_id_array);
-            goto out;
-        }
-
-        evbuffer_add (req->buffer_out, obj_id, 40);
-        data_len_net = htonl (data_len);
-        evbuffer_add (req->buffer_out, &data_len_net, 4);
-        evbuffer_add (req->buffer_out, fs_data, data_len);
-
-        total_size += data_len;
-        g_free (fs_data);
-
-        if (total_size >= MAX_OBJECT_PACK_SIZE)
-            break;
-    }
+    RecvBlocksData *data = g_new0 (RecvBlocksData, 1);
+    memcpy (data->store_id, store_id, 36);
+    memcpy (data->repo_id, repo_id, 36);
+    data->user = g_strdup (username);
+    data->buf = evbuffer_new ();
+    /* Moves the chains, it doesn't copy the content. */
+    evbuffer_remove_buffer (req->buffer_in, data->buf, len);
 
-    evhtp_send_reply (req, EVHTP_RES_OK);
+    http_job_start (htp_server, req, recv_blocks_job,
+                    data, free_recv_blocks_data);
 
-    json_decref (fs_id_array);
 out:
+    g_free (username);
     g_free (store_id);
     g_strfreev (parts);
 }
@@ -1663,49 +4122,84 @@ http_request_init (HttpServerStruct *server)
 {
     HttpServer *priv = server->priv;
 
-    evhtp_set_cb (priv->evhtp,
-                  GET_PROTO_PATH, get_protocol_cb,
-                  NULL);
+    if (server->enable_metrics)
+        evhtp_set_cb (priv->evhtp,
+                      GET_METRICS_PATH, get_metrics_cb,
+                      NULL);
 
-    evhtp_set_regex_cb (priv->evhtp,
-                        GET_CHECK_QUOTA_REGEX, get_check_quota_cb,
-                        priv);
+    http_metrics_set_cb (priv->evhtp,
+                         GET_PROTO_PATH, get_protocol_cb,
+                         NULL, HTTP_ROUTE_PROTOCOL);
 
-    evhtp_set_regex_cb (priv->evhtp,
-                        OP_PERM_CHECK_REGEX, get_check_permission_cb,
-                        priv);
+    http_metrics_set_regex_cb (priv->evhtp,
+                               GET_CHECK_QUOTA_REGEX, get_check_quota_cb,
+                               priv, HTTP_ROUTE_QUOTA_CHECK);
 
-    evhtp_set_regex_cb (priv->evhtp,
-                        HEAD_COMMIT_OPER_REGEX, head_commit_oper_cb,
-                        priv);
+    http_metrics_set_regex_cb (priv->evhtp,
+                               OP_PERM_CHECK_REGEX, get_check_permission_cb,
+                               priv, HTTP_ROUTE_PERM_CHECK);
 
-    evhtp_set_regex_cb (priv->evhtp,
-                        COMMIT_OPER_REGEX, commit_oper_cb,
-                        priv);
+    http_metrics_set_regex_cb (priv->evhtp,
+                               HEAD_COMMIT_OPER_REGEX, head_commit_oper_cb,
+                               priv, HTTP_ROUTE_HEAD_COMMIT);
 
-    evhtp_set_regex_cb (priv->evhtp,
-                        GET_FS_OBJ_ID_REGEX, get_fs_obj_id_cb,
-                        priv);
+    http_metrics_set_regex_cb (priv->evhtp,
+                               COMMIT_OPER_REGEX, commit_oper_cb,
+                               priv, HTTP_ROUTE_COMMIT);
 
-    evhtp_set_regex_cb (priv->evhtp,
-                        BLOCK_OPER_REGEX, block_oper_cb,
-                        priv);
+    http_metrics_set_regex_cb (priv->evhtp,
+                               GET_FS_OBJ_ID_REGEX, get_fs_obj_id_cb,
+                               priv, HTTP_ROUTE_FS_ID_LIST);
 
-    evhtp_set_regex_cb (priv->evhtp,
-                        POST_CHECK_FS_REGEX, post_check_fs_cb,
-                        priv);
+    http_metrics_set_regex_cb (priv->evhtp,
+                               BLOCK_OPER_REGEX, block_oper_cb,
+                               priv, HTTP_ROUTE_BLOCK);
 
-    evhtp_set_regex_cb (priv->evhtp,
-                        POST_CHECK_BLOCK_REGEX, post_check_block_cb,
-                        priv);
+    http_metrics_set_regex_cb (priv->evhtp,
+                               POST_CHECK_FS_REGEX, post_check_fs_cb,
+                               priv, HTTP_ROUTE_CHECK_FS);
 
-    evhtp_set_regex_cb (priv->evhtp,
-                        POST_RECV_FS_REGEX, post_recv_fs_cb,
-                        priv);
+    http_metrics_set_regex_cb (priv->evhtp,
+                               POST_CHECK_BLOCK_REGEX, post_check_block_cb,
+                               priv, HTTP_ROUTE_CHECK_BLOCKS);
 
-    evhtp_set_regex_cb (priv->evhtp,
-                        POST_PACK_FS_REGEX, post_pack_fs_cb,
-                        priv);
+    http_metrics_set_regex_cb (priv->evhtp,
+                               GET_BLOCK_FILTER_REGEX, get_block_filter_cb,
+                               priv, HTTP_ROUTE_BLOCK_FILTER);
+
+    http_metrics_set_regex_cb (priv->evhtp,
+                               POST_RECV_FS_REGEX, post_recv_fs_cb,
+                               priv, HTTP_ROUTE_RECV_FS);
+
+    http_metrics_set_regex_cb (priv->evhtp,
+                               POST_PACK_FS_REGEX, post_pack_fs_cb,
+                               priv, HTTP_ROUTE_PACK_FS);
+
+    http_metrics_set_regex_cb (priv->evhtp,
+                               POST_PACK_BLOCKS_REGEX, post_pack_blocks_cb,
+                               priv, HTTP_ROUTE_PACK_BLOCKS);
+
+    http_metrics_set_regex_cb (priv->evhtp,
+                               POST_RECV_BLOCKS_REGEX, post_recv_blocks_cb,
+                               priv, HTTP_ROUTE_RECV_BLOCKS);
+
+    http_metrics_set_regex_cb (priv->evhtp,
+                               POST_HEAD_COMMITS_MULTI_REGEX,
+                               post_head_commits_multi_cb,
+                               priv, HTTP_ROUTE_HEAD_COMMITS_MULTI);
+
+    /*
+     * Workers only see their own branch updates, so they can't serve
+     * head-commits-watch. Web access tokens and passwords of encrypted
+     * repos are only in the master's memory.
+     */
+    if (server->seaf_session->sync_worker)
+        return;
+
+    http_metrics_set_regex_cb (priv->evhtp,
+                               POST_HEAD_COMMITS_WATCH_REGEX,
+                               post_head_commits_watch_cb,
+                               priv, HTTP_ROUTE_HEAD_COMMITS_WATCH);
 
     /* Web access file */
     access_file_init (priv->evhtp);
@@ -1783,53 +4277,209 @@ free_vir_repo_info (gpointer data)
     g_free (vinfo);
 }
 
+static gint64
+token_cache_entry_size (const char *key, gpointer value)
+{
+    TokenInfo *token_info = value;
+
+    return strlen (key) + 1 + sizeof(TokenInfo) + 37 +
+        strlen (token_info->email) + 1 + MEM_STATS_HASH_ENTRY_SIZE;
+}
+
+static gint64
+perm_cache_entry_size (const char *key, gpointer value)
+{
+    PermInfo *perm_info = value;
+
+    return strlen (key) + 1 + sizeof(PermInfo) +
+        strlen (perm_info->perm) + 1 + MEM_STATS_HASH_ENTRY_SIZE;
+}
+
+static gint64
+vir_repo_info_entry_size (const char *key, gpointer value)
+{
+    VirRepoInfo *vinfo = value;
+
+    return strlen (key) + 1 + sizeof(VirRepoInfo) +
+        (vinfo->store_id ? 37 : 0) + MEM_STATS_HASH_ENTRY_SIZE;
+}
+
+static gboolean
+is_fs_id_list_expire (gpointer key, gpointer value, gpointer arg)
+{
+    FsIdListInfo *info = (FsIdListInfo *)value;
+
+    /* Entries being calculated never expire. */
+    if(info && info->expire_time <= (gint64)time(NULL)) {
+        return TRUE;
+    }
+
+    return FALSE;
+}
+
+static void
+free_fs_id_list_info (gpointer data)
+{
+    FsIdListInfo *info = data;
+
+    g_free (info->json);
+    g_free (info);
+}
+
+static void
+fs_id_list_cache_get_mem_stats (gpointer data, MemStats *stats)
+{
+    HttpServer *htp_server = data;
+    GHashTableIter iter;
+    gpointer key, value;
+    FsIdListInfo *info;
+
+    stats->max_entries = FS_ID_LIST_CACHE_SIZE;
+
+    pthread_mutex_lock (&htp_server->fs_id_list_cache_lock);
+    g_hash_table_iter_init (&iter, htp_server->fs_id_list_cache);
+    while (g_hash_table_iter_next (&iter, &key, &value)) {
+        info = value;
+        stats->bytes += strlen (key) + 1 + sizeof(FsIdListInfo) +
+            MEM_STATS_HASH_ENTRY_SIZE;
+        if (info->json)
+            stats->bytes += strlen (info->json) + 1;
+        ++stats->entries;
+    }
+    pthread_mutex_unlock (&htp_server->fs_id_list_cache_lock);
+}
+
+static void
+repo_updates_get_mem_stats (gpointer data, MemStats *stats)
+{
+    HttpServer *htp_server = data;
+
+    pthread_mutex_lock (&htp_server->repo_updates_lock);
+    stats->entries = g_hash_table_size (htp_server->repo_updates);
+    pthread_mutex_unlock (&htp_server->repo_updates_lock);
+
+    stats->bytes = stats->entries *
+        (37 + sizeof(RepoUpdate) + MEM_STATS_HASH_ENTRY_SIZE);
+}
+
 static void
 remove_expire_cache_cb (evutil_socket_t sock, short type, void *data)
 {
     HttpServer *htp_server = data;
+    int i = htp_server->reap_shard;
+
+    /* One shard per run keeps each lock held only briefly. */
+    reap_cache_shard (&htp_server->token_cache, i);
+    reap_cache_shard (&htp_server->perm_cache, i);
+    reap_cache_shard (&htp_server->vir_repo_info_cache, i);
+
+    htp_server->reap_shard = (i + 1) % CACHE_SHARDS;
+    if (htp_server->reap_shard != 0)
+        return;
 
-    pthread_mutex_lock (&htp_server->token_cache_lock);
-    g_hash_table_foreach_remove (htp_server->token_cache, is_token_expire, NULL);
-    pthread_mutex_unlock (&htp_server->token_cache_lock);
+    pthread_mutex_lock (&htp_server->fs_id_list_cache_lock);
+    g_hash_table_foreach_remove (htp_server->fs_id_list_cache,
+                                 is_fs_id_list_expire, NULL);
+    pthread_mutex_unlock (&htp_server->fs_id_list_cache_lock);
 
-    pthread_mutex_lock (&htp_server->perm_cache_lock);
-    g_hash_table_foreach_remove (htp_server->perm_cache, is_perm_expire, NULL);
-    pthread_mutex_unlock (&htp_server->perm_cache_lock);
+    remove_expired_partial_blocks (htp_server);
 
-    pthread_mutex_lock (&htp_server->vir_repo_info_cache_lock);
-    g_hash_table_foreach_remove (htp_server->vir_repo_info_cache,
-                                 is_vir_repo_info_expire, NULL);
-    pthread_mutex_unlock (&htp_server->vir_repo_info_cache_lock);
+    forget_old_repo_updates (htp_server);
 }
 
-static void *
-http_server_run (void *arg)
+#ifdef HAVE_EVHTP_ACCEPT_SOCKET
+/*
+ * All the sync workers listen on the same port, the kernel spreads the
+ * connections over them.
+ */
+static int
+bind_sync_worker_socket (HttpServerStruct *server)
 {
-    HttpServerStruct *server = arg;
     HttpServer *priv = server->priv;
+    struct addrinfo hints, *res = NULL;
+    char port[16];
+    evutil_socket_t fd = -1;
+    int on = 1;
+    int ret = -1;
+
+    memset (&hints, 0, sizeof(hints));
+    hints.ai_family = AF_UNSPEC;
+    hints.ai_socktype = SOCK_STREAM;
+    hints.ai_flags = AI_PASSIVE;
+    snprintf (port, sizeof(port), "%d", server->sync_worker_port);
+
+    if (getaddrinfo (server->bind_addr, port, &hints, &res) != 0) {
+        seaf_warning ("Failed to resolve %s.\n", server->bind_addr);
+        return -1;
+    }
+
+    fd = socket (res->ai_family, res->ai_socktype, res->ai_protocol);
+    if (fd < 0) {
+        seaf_warning ("Failed to create socket: %s.\n", strerror(errno));
+        goto out;
+    }
+
+    evutil_make_socket_nonblocking (fd);
+    evutil_make_socket_closeonexec (fd);
+    setsockopt (fd, SOL_SOCKET, SO_REUSEADDR, &on, sizeof(on));
+#ifdef SO_REUSEPORT
+    if (setsockopt (fd, SOL_SOCKET, SO_REUSEPORT, &on, sizeof(on)) < 0) {
+        seaf_warning ("Failed to set SO_REUSEPORT: %s.\n", strerror(errno));
+        goto out;
+    }
+#else
+    seaf_warning ("SO_REUSEPORT is not supported.\n");
+    goto out;
+#endif
 
-    priv->evbase = event_base_new();
-    priv->evhtp = evhtp_new(priv->evbase, NULL);
+    if (bind (fd, res->ai_addr, res->ai_addrlen) < 0) {
+        seaf_warning ("Failed to bind port %d: %s.\n",
+                      server->sync_worker_port, strerror(errno));
+        goto out;
+    }
 
-    if (evhtp_bind_socket(priv->evhtp,
-                          server->bind_addr,
-                          server->bind_port, 128) < 0) {
-        seaf_warning ("Could not bind socket: %s\n", strerror (errno));
-        exit(-1);
+    if (evhtp_accept_socket (priv->evhtp, fd, 128) < 0) {
+        seaf_warning ("Failed to listen on port %d.\n",
+                      server->sync_worker_port);
+        goto out;
     }
 
+    ret = 0;
+
+out:
+    if (ret < 0 && fd >= 0)
+        evutil_closesocket (fd);
+    freeaddrinfo (res);
+    return ret;
+}
+#else
+static int
+bind_sync_worker_socket (HttpServerStruct *server)
+{
+    seaf_warning ("Sync workers need evhtp_accept_socket() in libevhtp.\n");
+    return -1;
+}
+#endif
+
+static void *
+http_server_run (void *arg)
+{
+    HttpServerStruct *server = arg;
+    HttpServer *priv = server->priv;
+
     evhtp_set_gencb (priv->evhtp, default_cb, NULL);
 
     http_request_init (server);
 
-    evhtp_use_threads (priv->evhtp, NULL, DEFAULT_THREADS, NULL);
+    evhtp_use_threads (priv->evhtp, NULL, server->worker_threads, NULL);
 
+    /* Every shard is visited once per cleaning interval. */
     struct timeval tv;
-    tv.tv_sec = CLEANING_INTERVAL_SEC;
+    tv.tv_sec = CLEANING_INTERVAL_SEC / CACHE_SHARDS;
     tv.tv_usec = 0;
-    priv->reap_timer = evtimer_new (priv->evbase,
-                                    remove_expire_cache_cb,
-                                    priv);
+    priv->reap_timer = event_new (priv->evbase, -1, EV_PERSIST,
+                                  remove_expire_cache_cb,
+                                  priv);
     evtimer_add (priv->reap_timer, &tv);
 
     event_base_loop (priv->evbase, 0);
@@ -1848,20 +4498,59 @@ seaf_http_server_new (struct _SeafileSession *session)
 
     load_http_config (server, session);
 
-    priv->token_cache = g_hash_table_new_full (g_str_hash, g_str_equal,
-                                               g_free, token_cache_value_free);
-    pthread_mutex_init (&priv->token_cache_lock, NULL);
-
-    priv->perm_cache = g_hash_table_new_full (g_str_hash, g_str_equal,
-                                              g_free, perm_cache_value_free);
-    pthread_mutex_init (&priv->perm_cache_lock, NULL);
-
-    priv->vir_repo_info_cache = g_hash_table_new_full (g_str_hash, g_str_equal,
-                                                       g_free, free_vir_repo_info);
-    pthread_mutex_init (&priv->vir_repo_info_cache_lock, NULL);
+    sharded_cache_init (&priv->token_cache, token_cache_value_free,
+                        token_cache_entry_size, is_token_expire,
+                        get_cache_max_entries (session->config,
+                                               "token_cache_max_entries"));
+    sharded_cache_init (&priv->perm_cache, perm_cache_value_free,
+                        perm_cache_entry_size, is_perm_expire,
+                        get_cache_max_entries (session->config,
+                                               "perm_cache_max_entries"));
+    sharded_cache_init (&priv->vir_repo_info_cache, free_vir_repo_info,
+                        vir_repo_info_entry_size, is_vir_repo_info_expire,
+                        get_cache_max_entries (session->config,
+                                               "vir_repo_info_cache_max_entries"));
+
+    priv->job_pool = g_thread_pool_new (http_job_thread, NULL,
+                                        server->blocking_threads, FALSE, NULL);
+    priv->verify_pool = g_thread_pool_new (verify_chunk_thread, NULL,
+                                           get_cpu_count (), FALSE, NULL);
+
+    priv->repo_update_locks = g_hash_table_new_full (g_str_hash, g_str_equal,
+                                                     g_free, NULL);
+    pthread_mutex_init (&priv->repo_update_locks_lock, NULL);
+    pthread_mutex_init (&priv->update_stats_lock, NULL);
+
+    priv->fs_id_list_cache = g_hash_table_new_full (g_str_hash, g_str_equal,
+                                                    g_free, free_fs_id_list_info);
+    pthread_mutex_init (&priv->fs_id_list_cache_lock, NULL);
+    pthread_cond_init (&priv->fs_id_list_cache_cond, NULL);
 
     server->http_temp_dir = g_build_filename (session->seaf_dir, "httptemp", NULL);
 
+    priv->partial_blocks_dir = g_build_filename (server->http_temp_dir,
+                                                 "partial-blocks", NULL);
+    pthread_mutex_init (&priv->partial_blocks_lock, NULL);
+
+    priv->repo_updates = g_hash_table_new_full (g_str_hash, g_str_equal,
+                                                g_free, g_free);
+    priv->head_watchers = g_hash_table_new_full (g_str_hash, g_str_equal,
+                                                 g_free,
+                                                 (GDestroyNotify)g_ptr_array_unref);
+    /* Cursors of an earlier run of the server are older than this. */
+    priv->last_update_seq = priv->forgotten_seq = get_current_time ();
+    pthread_mutex_init (&priv->repo_updates_lock, NULL);
+
+    mem_stats_register ("http_token_cache", sharded_cache_get_mem_stats,
+                        &priv->token_cache);
+    mem_stats_register ("http_perm_cache", sharded_cache_get_mem_stats,
+                        &priv->perm_cache);
+    mem_stats_register ("vir_repo_info_cache", sharded_cache_get_mem_stats,
+                        &priv->vir_repo_info_cache);
+    mem_stats_register ("fs_id_list_cache", fs_id_list_cache_get_mem_stats,
+                        priv);
+    mem_stats_register ("repo_updates", repo_updates_get_mem_stats, priv);
+
     server->seaf_session = session;
     server->priv = priv;
 
@@ -1871,9 +4560,21 @@ seaf_http_server_new (struct _SeafileSession *session)
 int
 seaf_http_server_start (HttpServerStruct *server)
 {
-    server->priv->cevent_id = cevent_manager_register (seaf->ev_mgr,
-                                    (cevent_handler)publish_repo_event,
-                                                       NULL);
+   HttpServer *priv = server->priv;
+
+   priv->evbase = event_base_new();
+   priv->evhtp = evhtp_new(priv->evbase, NULL);
+
+   /* Bound here, so that the port accepts connections once this returns. */
+   if (server->seaf_session->sync_worker) {
+       if (bind_sync_worker_socket (server) < 0)
+           return -1;
+   } else if (evhtp_bind_socket(priv->evhtp,
+                                server->bind_addr,
+                                server->bind_port, 128) < 0) {
+       seaf_warning ("Could not bind socket: %s\n", strerror (errno));
+       return -1;
+   }
 
    int ret = pthread_create (&server->priv->thread_id, NULL, http_server_run, server);
    if (ret != 0)
@@ -1883,17 +4584,64 @@ seaf_http_server_start (HttpServerStruct *server)
    return 0;
 }
 
+void
+seaf_http_server_get_update_stats (HttpServerStruct *htp_server,
+                                   BranchUpdateStats *stats)
+{
+    HttpServer *priv = htp_server->priv;
+
+    pthread_mutex_lock (&priv->update_stats_lock);
+    *stats = priv->update_stats;
+    pthread_mutex_unlock (&priv->update_stats_lock);
+}
+
+void
+seaf_http_server_get_job_stats (HttpServerStruct *htp_server,
+                                int *n_queued, int *n_threads)
+{
+    HttpServer *priv = htp_server->priv;
+
+    *n_queued = g_thread_pool_unprocessed (priv->job_pool);
+    *n_threads = g_thread_pool_get_num_threads (priv->job_pool);
+}
+
+void
+seaf_http_server_notify_repo_update (HttpServerStruct *htp_server,
+                                     const char *repo_id)
+{
+    HttpServer *priv = htp_server->priv;
+    RepoUpdate *update;
+    gint64 now = get_current_time ();
+
+    pthread_mutex_lock (&priv->repo_updates_lock);
+
+    update = g_hash_table_lookup (priv->repo_updates, repo_id);
+    if (!update) {
+        update = g_new0 (RepoUpdate, 1);
+        g_hash_table_insert (priv->repo_updates, g_strdup (repo_id), update);
+    }
+    /* Sequence numbers are times, so that they grow across restarts. */
+    priv->last_update_seq = MAX (now, priv->last_update_seq + 1);
+    update->seq = priv->last_update_seq;
+    update->time = now / 1000000;
+
+    wake_repo_watchers (priv, repo_id);
+
+    pthread_mutex_unlock (&priv->repo_updates_lock);
+}
+
 int
 seaf_http_server_invalidate_tokens (HttpServerStruct *htp_server,
                                     const GList *tokens)
 {
     const GList *p;
+    CacheShard *shard;
 
-    pthread_mutex_lock (&htp_server->priv->token_cache_lock);
     for (p = tokens; p; p = p->next) {
         const char *token = (char *)p->data;
-        g_hash_table_remove (htp_server->priv->token_cache, token);
+        shard = lock_cache_shard (&htp_server->priv->token_cache, token);
+        cache_shard_remove (&htp_server->priv->token_cache, shard, token);
+        pthread_mutex_unlock (&shard->lock);
     }
-    pthread_mutex_unlock (&htp_server->priv->token_cache_lock);
     return 0;
 }
@@ -14,22 +14,55 @@ struct _HttpServerStruct {
 
     char *bind_addr;
     int bind_port;
+    int sync_worker_port;       /* shared by the sync workers */
     char *http_temp_dir;        /* temp dir for file upload */
     char *windows_encoding;
     gint64 max_upload_size;
     gint64 max_download_dir_size;
+    gint64 max_pack_fs_size;    /* per pack-fs response */
+    gint64 zip_cache_size;      /* disk budget for dir archives, 0 is off */
+    gint64 dec_block_cache_size; /* memory for decrypted blocks, 0 is off */
+    int worker_threads;         /* evhtp event loops */
+    int blocking_threads;       /* merges, diffs and quota checks */
+    gboolean enable_metrics;    /* serve /metrics */
+    gboolean streaming_upload;  /* index uploads without tmp files */
 };
 
 typedef struct _HttpServerStruct HttpServerStruct;
 
+/* Counters of the branch updates done by pushes. */
+typedef struct BranchUpdateStats {
+    gint64 updates;
+    gint64 merges;              /* updates that needed a merge */
+    gint64 retries;             /* failed test-and-set of the branch */
+    gint64 merge_time;          /* total, in microseconds */
+} BranchUpdateStats;
+
 HttpServerStruct *
 seaf_http_server_new (struct _SeafileSession *session);
 
 int
 seaf_http_server_start (HttpServerStruct *htp_server);
 
+/*
+ * Wake up the clients waiting in head-commits-watch for @repo_id. Can be
+ * called from any thread.
+ */
+void
+seaf_http_server_notify_repo_update (HttpServerStruct *htp_server,
+                                     const char *repo_id);
+
 int
 seaf_http_server_invalidate_tokens (HttpServerStruct *htp_server,
                                     const GList *tokens);
 
+void
+seaf_http_server_get_update_stats (HttpServerStruct *htp_server,
+                                   BranchUpdateStats *stats);
+
+/* Jobs waiting for the job pool and the threads running them. */
+void
+seaf_http_server_get_job_stats (HttpServerStruct *htp_server,
+                                int *n_queued, int *n_threads);
+
 #endif
@@ -0,0 +1,651 @@
+/* -*- Mode: C; tab-width: 4; indent-tabs-mode: nil; c-basic-offset: 4 -*- */
+
+#include "common.h"
+
+#include <pthread.h>
+#include <jansson.h>
+
+#include "seafile-session.h"
+#include "io-sched.h"
+#include "log.h"
+
+#define DEFAULT_IO_THREADS 8
+#define DEFAULT_INTERACTIVE_SHARE 4
+/* Bytes an operation is charged until its actual size is known. */
+#define ESTIMATED_OP_BYTES (1 << 20)
+/* Idle flows are dropped after this long. */
+#define FLOW_IDLE_USEC (60 * G_USEC_PER_SEC)
+/* Flows listed in the stats. */
+#define MAX_STATS_FLOWS 20
+
+static const char *class_names[N_IO_CLASSES] = {
+    "interactive",
+    "bulk",
+};
+
+/* Allows @rate per second, in bursts of up to one second's worth. */
+typedef struct TokenBucket {
+    double rate;                /* 0 is unlimited */
+    double tokens;
+    gint64 last;
+} TokenBucket;
+
+/*
+ * The operations of a user, or of a repo. Requests are only queued on
+ * their user's flow, a repo flow just enforces the caps of the repo.
+ */
+typedef struct IoFlow {
+    char *key;                  /* "u:<user>" or "r:<repo id>" */
+    int n_queued;
+    int n_running;
+    GQueue queues[N_IO_CLASSES];
+    /* Finish tag of the last request queued in each class, in bytes. */
+    double finish[N_IO_CLASSES];
+    TokenBucket bandwidth;
+    TokenBucket iops;
+    gint64 bytes;
+    gint64 last_active;
+} IoFlow;
+
+struct IoTicket {
+    IoFlow *flow;
+    IoFlow *repo_flow;          /* NULL if @flow is the repo's */
+    IoClass cls;
+    double start_tag;
+    gint64 queued_time;
+
+    /* Run by a scheduler thread, if set. */
+    IoJobFunc func;
+    void *data;
+
+    /* Otherwise the caller is waiting on @cond. */
+    pthread_cond_t *cond;
+    gboolean granted;
+};
+
+typedef struct IoClassStats {
+    int n_queued;
+    gint64 n_done;
+    gint64 bytes;
+    gint64 total_wait_usec;
+    gint64 max_wait_usec;
+} IoClassStats;
+
+typedef struct IoSchedulerPriv {
+    pthread_mutex_t lock;
+    /* Signalled when a job is granted, or the earliest time a capped
+     * flow may go changes.
+     */
+    pthread_cond_t work_cond;
+    gboolean started;
+
+    int interactive_share;
+    double user_bandwidth;      /* bytes per second */
+    double user_iops;
+    double repo_bandwidth;
+    double repo_iops;
+
+    /* key -> IoFlow */
+    GHashTable *flows;
+    /* Flows with requests queued in each class. */
+    GList *active[N_IO_CLASSES];
+    /* Start tag of the last request granted in each class. */
+    double vtime[N_IO_CLASSES];
+    /* Interactive requests granted in a row while bulk ones waited. */
+    int interactive_streak;
+
+    int n_running;
+    /* Granted jobs waiting for a thread. */
+    GQueue ready;
+    /* When a capped flow may go next, 0 if no flow is capped. */
+    gint64 next_eligible;
+    gint64 last_sweep;
+
+    IoClassStats stats[N_IO_CLASSES];
+    gint64 n_throttled;
+} IoSchedulerPriv;
+
+static double
+get_rate (GKeyFile *config, const char *key, double unit)
+{
+    int n = g_key_file_get_integer (config, "io scheduler", key, NULL);
+
+    return (n > 0) ? n * unit : 0;
+}
+
+IoScheduler *
+io_scheduler_new (SeafileSession *session)
+{
+    IoScheduler *sched = g_new0 (IoScheduler, 1);
+    IoSchedulerPriv *priv = g_new0 (IoSchedulerPriv, 1);
+    GKeyFile *config = session->config;
+    int n;
+
+    sched->seaf = session;
+    sched->priv = priv;
+
+    n = g_key_file_get_integer (config, "io scheduler", "threads", NULL);
+    sched->n_threads = (n > 0) ? n : DEFAULT_IO_THREADS;
+
+    n = g_key_file_get_integer (config, "io scheduler", "interactive_share", NULL);
+    priv->interactive_share = (n > 0) ? n : DEFAULT_INTERACTIVE_SHARE;
+
+    priv->user_bandwidth = get_rate (config, "user_bandwidth", 1024);
+    priv->user_iops = get_rate (config, "user_iops", 1);
+    priv->repo_bandwidth = get_rate (config, "repo_bandwidth", 1024);
+    priv->repo_iops = get_rate (config, "repo_iops", 1);
+
+    pthread_mutex_init (&priv->lock, NULL);
+    pthread_cond_init (&priv->work_cond, NULL);
+    priv->flows = g_hash_table_new (g_str_hash, g_str_equal);
+    g_queue_init (&priv->ready);
+
+    return sched;
+}
+
+/* Token buckets */
+
+static void
+bucket_init (TokenBucket *b, double rate, gint64 now)
+{
+    b->rate = rate;
+    b->tokens = rate;
+    b->last = now;
+}
+
+static void
+bucket_refill (TokenBucket *b, gint64 now)
+{
+    if (b->rate <= 0)
+        return;
+
+    b->tokens = MIN (b->rate,
+                     b->tokens + b->rate * (now - b->last) / G_USEC_PER_SEC);
+    b->last = now;
+}
+
+static void
+bucket_take (TokenBucket *b, double n, gint64 now)
+{
+    if (b->rate <= 0)
+        return;
+
+    bucket_refill (b, now);
+    /* May go below 0, the debt is paid before the next operation. */
+    b->tokens -= n;
+}
+
+/* Microseconds until the bucket has a token. */
+static gint64
+bucket_wait (TokenBucket *b, gint64 now)
+{
+    if (b->rate <= 0)
+        return 0;
+
+    bucket_refill (b, now);
+    if (b->tokens >= 1)
+        return 0;
+    return (gint64)((1 - b->tokens) * G_USEC_PER_SEC / b->rate) + 1;
+}
+
+/* Flows */
+
+static IoFlow *
+get_flow (IoSchedulerPriv *priv, char kind, const char *name, gint64 now)
+{
+    char *key = g_strdup_printf ("%c:%s", kind, name);
+    IoFlow *flow;
+    int i;
+
+    flow = g_hash_table_lookup (priv->flows, key);
+    if (flow) {
+        g_free (key);
+        return flow;
+    }
+
+    flow = g_new0 (IoFlow, 1);
+    flow->key = key;
+    for (i = 0; i < N_IO_CLASSES; ++i)
+        g_queue_init (&flow->queues[i]);
+    if (kind == 'u') {
+        bucket_init (&flow->bandwidth, priv->user_bandwidth, now);
+        bucket_init (&flow->iops, priv->user_iops, now);
+    } else {
+        bucket_init (&flow->bandwidth, priv->repo_bandwidth, now);
+        bucket_init (&flow->iops, priv->repo_iops, now);
+    }
+    flow->last_active = now;
+    g_hash_table_insert (priv->flows, flow->key, flow);
+
+    return flow;
+}
+
+static gint64
+flow_wait (IoFlow *flow, gint64 now)
+{
+    return MAX (bucket_wait (&flow->bandwidth, now),
+                bucket_wait (&flow->iops, now));
+}
+
+static gboolean
+flow_idle (IoFlow *flow, gint64 now)
+{
+    /* A flow in debt would get a fresh bucket if dropped. */
+    return (flow->n_queued == 0 && flow->n_running == 0 &&
+            now - flow->last_active > FLOW_IDLE_USEC &&
+            flow_wait (flow, now) == 0);
+}
+
+static void
+sweep_idle_flows (IoSchedulerPriv *priv, gint64 now)
+{
+    GHashTableIter iter;
+    gpointer key, value;
+    IoFlow *flow;
+
+    if (now - priv->last_sweep < FLOW_IDLE_USEC)
+        return;
+    priv->last_sweep = now;
+
+    g_hash_table_iter_init (&iter, priv->flows);
+    while (g_hash_table_iter_next (&iter, &key, &value)) {
+        flow = value;
+        if (flow_idle (flow, now)) {
+            g_hash_table_iter_remove (&iter);
+            g_free (flow->key);
+            g_free (flow);
+        }
+    }
+}
+
+/* Scheduling. Called with the lock held. */
+
+static IoTicket *
+new_request (IoSchedulerPriv *priv, const char *user, const char *repo_id,
+             IoClass cls)
+{
+    IoTicket *req = g_new0 (IoTicket, 1);
+    gint64 now = get_current_time ();
+
+    if (user) {
+        req->flow = get_flow (priv, 'u', user, now);
+        if (repo_id)
+            req->repo_flow = get_flow (priv, 'r', repo_id, now);
+    } else {
+        req->flow = get_flow (priv, 'r', repo_id ? repo_id : "", now);
+    }
+    req->cls = cls;
+    req->queued_time = now;
+
+    return req;
+}
+
+static void
+enqueue_request (IoSchedulerPriv *priv, IoTicket *req)
+{
+    IoFlow *flow = req->flow;
+    GQueue *queue = &flow->queues[req->cls];
+
+    /* Start-time fair queuing: a flow's requests follow each other, and
+     * an idle flow starts at the current virtual time.
+     */
+    req->start_tag = MAX (priv->vtime[req->cls], flow->finish[req->cls]);
+    flow->finish[req->cls] = req->start_tag + ESTIMATED_OP_BYTES;
+
+    if (g_queue_is_empty (queue))
+        priv->active[req->cls] = g_list_prepend (priv->active[req->cls], flow);
+    g_queue_push_tail (queue, req);
+
+    ++flow->n_queued;
+    if (req->repo_flow)
+        ++req->repo_flow->n_queued;
+    ++priv->stats[req->cls].n_queued;
+}
+
+static gint64
+request_wait (IoTicket *req, gint64 now)
+{
+    gint64 wait = flow_wait (req->flow, now);
+
+    if (req->repo_flow)
+        wait = MAX (wait, flow_wait (req->repo_flow, now));
+    return wait;
+}
+
+/* The request with the lowest start tag in @cls whose flows are under
+ * their caps.
+ */
+static IoTicket *
+pick_in_class (IoSchedulerPriv *priv, IoClass cls, gint64 now)
+{
+    IoTicket *best = NULL, *req;
+    GList *ptr;
+    gint64 wait;
+
+    for (ptr = priv->active[cls]; ptr; ptr = ptr->next) {
+        req = g_queue_peek_head (&((IoFlow *)ptr->data)->queues[cls]);
+        wait = request_wait (req, now);
+        if (wait > 0) {
+            if (priv->next_eligible == 0 || now + wait < priv->next_eligible)
+                priv->next_eligible = now + wait;
+            continue;
+        }
+        if (!best || req->start_tag < best->start_tag)
+            best = req;
+    }
+
+    return best;
+}
+
+static IoTicket *
+pick_request (IoSchedulerPriv *priv, gint64 now)
+{
+    IoTicket *interactive, *bulk;
+
+    priv->next_eligible = 0;
+    interactive = pick_in_class (priv, IO_CLASS_INTERACTIVE, now);
+    bulk = pick_in_class (priv, IO_CLASS_BULK, now);
+
+    if (interactive && bulk) {
+        if (priv->interactive_streak >= priv->interactive_share) {
+            priv->interactive_streak = 0;
+            return bulk;
+        }
+        ++priv->interactive_streak;
+        return interactive;
+    }
+
+    if (!interactive && !bulk && priv->next_eligible != 0)
+        ++priv->n_throttled;
+
+    return interactive ? interactive : bulk;
+}
+
+static void
+start_request (IoSchedulerPriv *priv, IoTicket *req, gint64 now)
+{
+    IoFlow *flow = req->flow;
+    IoClassStats *stats = &priv->stats[req->cls];
+    gint64 wait = now - req->queued_time;
+
+    g_queue_pop_head (&flow->queues[req->cls]);
+    if (g_queue_is_empty (&flow->queues[req->cls]))
+        priv->active[req->cls] = g_list_remove (priv->active[req->cls], flow);
+    priv->vtime[req->cls] = req->start_tag;
+
+    --flow->n_queued;
+    ++flow->n_running;
+    bucket_take (&flow->iops, 1, now);
+    if (req->repo_flow) {
+        --req->repo_flow->n_queued;
+        ++req->repo_flow->n_running;
+        bucket_take (&req->repo_flow->iops, 1, now);
+    }
+
+    --stats->n_queued;
+    stats->total_wait_usec += wait;
+    stats->max_wait_usec = MAX (stats->max_wait_usec, wait);
+    ++priv->n_running;
+}
+
+static void
+finish_request (IoSchedulerPriv *priv, IoTicket *req, gint64 bytes)
+{
+    IoFlow *flow = req->flow;
+    IoClassStats *stats = &priv->stats[req->cls];
+    gint64 now = get_current_time ();
+
+    if (bytes < 0)
+        bytes = 0;
+
+    /* Charge the flow for what the operation actually took. */
+    flow->finish[req->cls] += bytes - ESTIMATED_OP_BYTES;
+
+    --flow->n_running;
+    flow->bytes += bytes;
+    flow->last_active = now;
+    bucket_take (&flow->bandwidth, bytes, now);
+    if (req->repo_flow) {
+        --req->repo_flow->n_running;
+        req->repo_flow->bytes += bytes;
+        req->repo_flow->last_active = now;
+        bucket_take (&req->repo_flow->bandwidth, bytes, now);
+    }
+
+    ++stats->n_done;
+    stats->bytes += bytes;
+    --priv->n_running;
+}
+
+/* Grant requests while there are free slots. */
+static void
+dispatch (IoScheduler *sched)
+{
+    IoSchedulerPriv *priv = sched->priv;
+    gint64 now = get_current_time ();
+    gint64 next_eligible = priv->next_eligible;
+    IoTicket *req;
+
+    while (priv->n_running < sched->n_threads) {
+        req = pick_request (priv, now);
+        if (!req)
+            break;
+
+        start_request (priv, req, now);
+        if (req->func) {
+            g_queue_push_tail (&priv->ready, req);
+            pthread_cond_signal (&priv->work_cond);
+        } else {
+            req->granted = TRUE;
+            pthread_cond_signal (req->cond);
+        }
+    }
+
+    /* A thread waits for the next capped flow. */
+    if (priv->next_eligible != next_eligible)
+        pthread_cond_signal (&priv->work_cond);
+
+    sweep_idle_flows (priv, now);
+}
+
+static void *
+io_thread (void *vsched)
+{
+    IoScheduler *sched = vsched;
+    IoSchedulerPriv *priv = sched->priv;
+    IoTicket *req;
+    struct timespec ts;
+    gint64 bytes;
+
+    pthread_mutex_lock (&priv->lock);
+    while (1) {
+        req = g_queue_pop_head (&priv->ready);
+        if (req) {
+            pthread_mutex_unlock (&priv->lock);
+            bytes = req->func (req->data);
+            pthread_mutex_lock (&priv->lock);
+
+            finish_request (priv, req, bytes);
+            g_free (req);
+            dispatch (sched);
+            continue;
+        }
+
+        if (priv->next_eligible > 0) {
+            ts.tv_sec = priv->next_eligible / G_USEC_PER_SEC;
+            ts.tv_nsec = (priv->next_eligible % G_USEC_PER_SEC) * 1000;
+            pthread_cond_timedwait (&priv->work_cond, &priv->lock, &ts);
+        } else {
+            pthread_cond_wait (&priv->work_cond, &priv->lock);
+        }
+        dispatch (sched);
+    }
+
+    return NULL;
+}
+
+int
+io_scheduler_start (IoScheduler *sched)
+{
+    pthread_attr_t attr;
+    pthread_t tid;
+    int i;
+
+    pthread_attr_init (&attr);
+    pthread_attr_setdetachstate (&attr, PTHREAD_CREATE_DETACHED);
+    for (i = 0; i < sched->n_threads; ++i) {
+        if (pthread_create (&tid, &attr, io_thread, sched) != 0) {
+            seaf_warning ("Failed to start io scheduler thread.\n");
+            pthread_attr_destroy (&attr);
+            return -1;
+        }
+    }
+    pthread_attr_destroy (&attr);
+
+    sched->priv->started = TRUE;
+    return 0;
+}
+
+int
+io_scheduler_submit (IoScheduler *sched, const char *user, const char *repo_id,
+                     IoClass cls, IoJobFunc func, void *data)
+{
+    IoSchedulerPriv *priv = sched->priv;
+    IoTicket *req;
+
+    if (!priv->started || cls < 0 || cls >= N_IO_CLASSES || !func)
+        return -1;
+
+    pthread_mutex_lock (&priv->lock);
+    req = new_request (priv, user, repo_id, cls);
+    req->func = func;
+    req->data = data;
+    enqueue_request (priv, req);
+    dispatch (sched);
+    pthread_mutex_unlock (&priv->lock);
+
+    return 0;
+}
+
+IoTicket *
+io_scheduler_begin (IoScheduler *sched, const char *user, const char *repo_id,
+                    IoClass cls)
+{
+    IoSchedulerPriv *priv = sched->priv;
+    pthread_cond_t cond;
+    IoTicket *req;
+
+    /* Not scheduled, io_scheduler_end() ignores NULL. */
+    if (!priv->started || cls < 0 || cls >= N_IO_CLASSES)
+        return NULL;
+
+    pthread_cond_init (&cond, NULL);
+
+    pthread_mutex_lock (&priv->lock);
+    req = new_request (priv, user, repo_id, cls);
+    req->cond = &cond;
+    enqueue_request (priv, req);
+    dispatch (sched);
+    while (!req->granted)
+        pthread_cond_wait (&cond, &priv->lock);
+    req->cond = NULL;
+    pthread_mutex_unlock (&priv->lock);
+
+    pthread_cond_destroy (&cond);
+    return req;
+}
+
+void
+io_scheduler_end (IoScheduler *sched, IoTicket *ticket, gint64 bytes)
+{
+    IoSchedulerPriv *priv = sched->priv;
+
+    if (!ticket)
+        return;
+
+    pthread_mutex_lock (&priv->lock);
+    finish_request (priv, ticket, bytes);
+    dispatch (sched);
+    pthread_mutex_unlock (&priv->lock);
+
+    g_free (ticket);
+}
+
+/* Stats */
+
+static gint
+cmp_flow_load (gconstpointer a, gconstpointer b)
+{
+    const IoFlow *fa = *(IoFlow **)a, *fb = *(IoFlow **)b;
+    int la = fa->n_queued + fa->n_running, lb = fb->n_queued + fb->n_running;
+
+    if (la != lb)
+        return lb - la;
+    return (fb->bytes > fa->bytes) - (fb->bytes < fa->bytes);
+}
+
+char *
+io_scheduler_stats_to_json (IoScheduler *sched)
+{
+    IoSchedulerPriv *priv = sched->priv;
+    json_t *obj, *classes, *cls, *flows, *fobj;
+    GPtrArray *sorted;
+    GHashTableIter iter;
+    gpointer key, value;
+    IoClassStats *stats;
+    IoFlow *flow;
+    char *ret;
+    int i;
+
+    obj = json_object ();
+    classes = json_object ();
+    flows = json_array ();
+    sorted = g_ptr_array_new ();
+
+    pthread_mutex_lock (&priv->lock);
+
+    json_object_set_new (obj, "threads", json_integer (sched->n_threads));
+    json_object_set_new (obj, "running", json_integer (priv->n_running));
+    json_object_set_new (obj, "throttled", json_integer (priv->n_throttled));
+
+    for (i = 0; i < N_IO_CLASSES; ++i) {
+        stats = &priv->stats[i];
+        cls = json_object ();
+        json_object_set_new (cls, "queued", json_integer (stats->n_queued));
+        json_object_set_new (cls, "done", json_integer (stats->n_done));
+        json_object_set_new (cls, "bytes", json_integer (stats->bytes));
+        json_object_set_new (cls, "avg_queue_wait_usec",
+                             json_integer (stats->n_done ?
+                                           stats->total_wait_usec / stats->n_done : 0));
+        json_object_set_new (cls, "max_queue_wait_usec",
+                             json_integer (stats->max_wait_usec));
+        json_object_set_new (classes, class_names[i], cls);
+    }
+    json_object_set_new (obj, "classes", classes);
+
+    /* The flows with the most operations, then the most bytes. */
+    g_hash_table_iter_init (&iter, priv->flows);
+    while (g_hash_table_iter_next (&iter, &key, &value))
+        g_ptr_array_add (sorted, value);
+    g_ptr_array_sort (sorted, cmp_flow_load);
+
+    for (i = 0; i < sorted->len && i < MAX_STATS_FLOWS; ++i) {
+        flow = g_ptr_array_index (sorted, i);
+        fobj = json_object ();
+        json_object_set_new (fobj, flow->key[0] == 'u' ? "user" : "repo",
+                             json_string (flow->key + 2));
+        json_object_set_new (fobj, "queued", json_integer (flow->n_queued));
+        json_object_set_new (fobj, "running", json_integer (flow->n_running));
+        json_object_set_new (fobj, "bytes", json_integer (flow->bytes));
+        json_array_append_new (flows, fobj);
+    }
+
+    pthread_mutex_unlock (&priv->lock);
+
+    json_object_set_new (obj, "flows", flows);
+    g_ptr_array_free (sorted, TRUE);
+
+    ret = json_dumps (obj, JSON_COMPACT);
+    json_decref (obj);
+    return ret;
+}
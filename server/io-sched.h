@@ -0,0 +1,81 @@
+#ifndef IO_SCHEDULER_H
+#define IO_SCHEDULER_H
+
+#include <glib.h>
+
+struct _SeafileSession;
+
+/*
+ * Scheduler of the block reads and writes done for clients, so that a
+ * user downloading a large folder or running a sync script can't take
+ * all the disk bandwidth.
+ *
+ * Operations are queued by user, and users get their turns in the order
+ * of start-time fair queuing, by bytes transferred. Users and repos can
+ * be capped in bandwidth and operations per second. Interactive
+ * operations, web views and previews, go before bulk ones, except that
+ * bulk operations still get one turn out of every interactive_share + 1
+ * when both are waiting.
+ *
+ * [io scheduler]
+ * threads = 8
+ * interactive_share = 4
+ * # KB/s and operations/s, 0 is unlimited
+ * user_bandwidth = 0
+ * user_iops = 0
+ * repo_bandwidth = 0
+ * repo_iops = 0
+ */
+typedef enum IoClass {
+    IO_CLASS_INTERACTIVE = 0,
+    IO_CLASS_BULK,
+    N_IO_CLASSES,
+} IoClass;
+
+struct IoSchedulerPriv;
+
+typedef struct IoScheduler {
+    struct _SeafileSession *seaf;
+
+    /* Operations running at once, and threads for queued ones. */
+    int n_threads;
+
+    struct IoSchedulerPriv *priv;
+} IoScheduler;
+
+IoScheduler *
+io_scheduler_new (struct _SeafileSession *session);
+
+int
+io_scheduler_start (IoScheduler *sched);
+
+/* Runs on a scheduler thread, returns the number of bytes transferred. */
+typedef gint64 (*IoJobFunc) (void *data);
+
+/*
+ * Queue @func for @user on @repo_id, either can be NULL if unknown.
+ * Returns -1 if the scheduler isn't running.
+ */
+int
+io_scheduler_submit (IoScheduler *sched, const char *user, const char *repo_id,
+                     IoClass cls, IoJobFunc func, void *data);
+
+typedef struct IoTicket IoTicket;
+
+/*
+ * For operations done by the calling thread: waits for the turn of
+ * @user and returns a ticket, which must be passed to io_scheduler_end()
+ * once the operation is done.
+ */
+IoTicket *
+io_scheduler_begin (IoScheduler *sched, const char *user, const char *repo_id,
+                    IoClass cls);
+
+void
+io_scheduler_end (IoScheduler *sched, IoTicket *ticket, gint64 bytes);
+
+/* The current load, by class and by the busiest users and repos. */
+char *
+io_scheduler_stats_to_json (IoScheduler *sched);
+
+#endif
@@ -3,6 +3,12 @@
 #define DEBUG_FLAG SEAFILE_DEBUG_HTTP
 #include "log.h"
 
+#if defined(__FreeBSD__) || defined(__NetBSD__) || defined(__OpenBSD__)
+#include <event2/buffer.h>
+#else
+#include <event.h>
+#endif
+
 #include <ccnet.h>
 
 #include "seafile-object.h"
@@ -12,6 +18,7 @@
 #include "utils.h"
 
 #include "seafile-session.h"
+#include "pack-dir.h"
 
 #include <archive.h>
 #include <archive_entry.h>
@@ -23,16 +30,6 @@
 #endif
 
 
-typedef struct {
-    struct archive *a;
-    SeafileCrypt *crypt;
-    const char *top_dir_name;
-    gboolean is_windows;
-    time_t mtime;
-    char store_id[37];
-    int repo_version;
-} PackDirData;
-
 static char *
 do_iconv (char *fromcode, char *tocode, char *in)
 {
@@ -62,37 +59,137 @@ do_iconv (char *fromcode, char *tocode, char *in)
     return g_strndup(out, outlen);
 }
 
+/*
+ * The archive is produced on demand: pack_dir_stream_read() walks the dir
+ * tree from where the last call stopped and stops again once enough
+ * archive data is out. The walk is a stack of the dirs being listed, and
+ * at most one file being copied, block by block.
+ */
+
+typedef struct DirFrame {
+    SeafDir *dir;
+    GList *next;                /* next entry to archive */
+    char *path;                 /* relative to the top dir */
+} DirFrame;
+
+struct PackDirStream {
+    struct archive *a;
+    struct evbuffer *out;       /* where archive output goes, if reading */
+
+    SeafileCrypt *crypt;
+    char *top_dir_name;
+    gboolean is_windows;
+    time_t mtime;
+    char store_id[37];
+    int repo_version;
+
+    GQueue *dirs;               /* DirFrame, innermost at the head */
+
+    /* The file being copied. */
+    Seafile *file;
+    int blk_idx;
+    BlockHandle *handle;
+    char *blk_id;
+    uint32_t remain;            /* bytes left in the current block */
+    EVP_CIPHER_CTX ctx;
+    gboolean enc_init;
+
+    gboolean finished;
+};
+
+/* Extensions of files that are compressed already. Deflating them again
+ * takes CPU time and gains nothing, so they are stored as they are.
+ */
+static const char *compressed_exts[] = {
+    "7z", "apk", "avi", "bz2", "cab", "deb", "docx", "dmg", "epub", "flac",
+    "flv", "gif", "gz", "heic", "jar", "jpeg", "jpg", "m4a", "m4v", "mkv",
+    "mov", "mp3", "mp4", "odp", "ods", "odt", "ogg", "png", "pptx", "rar",
+    "rpm", "tgz", "webm", "webp", "xlsx", "xz", "zip", "zst", NULL
+};
+
+static gboolean
+is_compressed_file (const char *name)
+{
+    const char *dot = strrchr (name, '.');
+    int i;
+
+    if (!dot)
+        return FALSE;
+
+    for (i = 0; compressed_exts[i] != NULL; ++i)
+        if (g_ascii_strcasecmp (dot + 1, compressed_exts[i]) == 0)
+            return TRUE;
+    return FALSE;
+}
+
+static ssize_t
+archive_out_cb (struct archive *a, void *client_data,
+                const void *buffer, size_t length)
+{
+    PackDirStream *stream = client_data;
+
+    /* Trailer of an archive abandoned halfway, nobody reads it. */
+    if (!stream->out)
+        return (ssize_t)length;
+
+    if (evbuffer_add (stream->out, buffer, length) < 0) {
+        archive_set_error (a, ENOMEM, "Out of memory");
+        return -1;
+    }
+    return (ssize_t)length;
+}
+
+static void
+set_entry_compression (PackDirStream *stream, const char *name)
+{
+#if ARCHIVE_VERSION_NUMBER >= 3000000
+    const char *method = is_compressed_file (name) ? "store" : "deflate";
+
+    if (archive_write_set_format_option (stream->a, "zip", "compression",
+                                         method) != ARCHIVE_OK)
+        seaf_debug ("Failed to set zip compression: %s\n",
+                      archive_error_string(stream->a));
+#endif
+}
+
+static void
+close_current_block (PackDirStream *stream)
+{
+    if (stream->handle) {
+        seaf_block_manager_close_block (seaf->block_mgr, stream->handle);
+        seaf_block_manager_block_handle_free (seaf->block_mgr, stream->handle);
+        stream->handle = NULL;
+    }
+    if (stream->enc_init) {
+        EVP_CIPHER_CTX_cleanup (&stream->ctx);
+        stream->enc_init = FALSE;
+    }
+}
+
+static void
+close_current_file (PackDirStream *stream)
+{
+    close_current_block (stream);
+    if (stream->file) {
+        seafile_unref (stream->file);
+        stream->file = NULL;
+    }
+}
+
 static int
-add_file_to_archive (PackDirData *data,
-                     const char *parent_dir,
-                     SeafDirent *dent)
+start_file (PackDirStream *stream, const char *parent_dir, SeafDirent *dent)
 {
-    struct archive *a = data->a;
-    struct SeafileCrypt *crypt = data->crypt;
-    gboolean is_windows = data->is_windows;
-    const char *top_dir_name = data->top_dir_name;
-    
+    struct archive *a = stream->a;
     struct archive_entry *entry = NULL;
     Seafile *file = NULL;
     char *pathname = NULL;
-    char buf[64 * 1024];
-    int len = 0;
-    int n = 0;
-    int idx = 0;
-    BlockHandle *handle = NULL;
-    BlockMetadata *bmd = NULL;
-    char *blk_id = NULL;
-    uint32_t remain = 0;
-    EVP_CIPHER_CTX ctx;
-    gboolean enc_init = FALSE;
-    char *dec_out = NULL;
-    int dec_out_len = -1;
     int ret = 0;
 
-    pathname = g_build_filename (top_dir_name, parent_dir, dent->name, NULL);
+    pathname = g_build_filename (stream->top_dir_name, parent_dir,
+                                 dent->name, NULL);
 
     file = seaf_fs_manager_get_seafile (seaf->fs_mgr,
-                                        data->store_id, data->repo_version,
+                                        stream->store_id, stream->repo_version,
                                         dent->id);
     if (!file) {
         ret = -1;
@@ -102,7 +199,7 @@ add_file_to_archive (PackDirData *data,
     entry = archive_entry_new ();
 
     /* File name fixup for WinRAR */
-    if (is_windows && seaf->http_server->windows_encoding) {
+    if (stream->is_windows && seaf->http_server->windows_encoding) {
         char *win_file_name = do_iconv ("UTF-8",
                                         seaf->http_server->windows_encoding,
                                         pathname);
@@ -122,253 +219,301 @@ add_file_to_archive (PackDirData *data,
     /* FIXME: 0644 should be set when upload files in repo-mgr.c */
     archive_entry_set_mode (entry, dent->mode | 0644);
     archive_entry_set_size (entry, file->file_size);
-    archive_entry_set_mtime (entry, data->mtime, 0);
+    archive_entry_set_mtime (entry, stream->mtime, 0);
+
+    set_entry_compression (stream, dent->name);
 
-    n = archive_write_header (a, entry);
-    if (n != ARCHIVE_OK) {
+    if (archive_write_header (a, entry) != ARCHIVE_OK) {
         seaf_warning ("archive_write_header  error: %s\n", archive_error_string(a));
         ret = -1;
         goto out;
     }
 
-    /* Read data of this entry block by block */
-    while (idx < file->n_blocks) {
-        blk_id = file->blk_sha1s[idx];
-        handle = seaf_block_manager_open_block (seaf->block_mgr,
-                                                data->store_id,
-                                                data->repo_version,
-                                                blk_id, BLOCK_READ);
-        if (!handle) {
-            seaf_warning ("Failed to open block %s\n", blk_id);
-            ret = -1;
-            goto out;
-        }
+    stream->file = file;
+    file = NULL;
+    stream->blk_idx = 0;
 
-        bmd = seaf_block_manager_stat_block_by_handle (seaf->block_mgr,
-                                                       handle);
-        if (!bmd) {
-            seaf_warning ("Failed to stat block %s\n", blk_id);
-            ret = -1;
-            goto out;
-        }
-        remain = bmd->size;
-        g_free (bmd);
-
-        if (crypt) {
-            if (seafile_decrypt_init (&ctx, crypt->version,
-                                      crypt->key, crypt->iv) < 0) {
-                seaf_warning ("Failed to init decrypt.\n");
-                ret = -1;
-                goto out;
-            }
-            enc_init = TRUE;
+out:
+    g_free (pathname);
+    if (entry)
+        archive_entry_free (entry);
+    if (file)
+        seafile_unref (file);
+
+    return ret;
+}
+
+static int
+open_next_block (PackDirStream *stream)
+{
+    SeafileCrypt *crypt = stream->crypt;
+    BlockMetadata *bmd;
+
+    stream->blk_id = stream->file->blk_sha1s[stream->blk_idx];
+    stream->handle = seaf_block_manager_open_block (seaf->block_mgr,
+                                                    stream->store_id,
+                                                    stream->repo_version,
+                                                    stream->blk_id, BLOCK_READ);
+    if (!stream->handle) {
+        seaf_warning ("Failed to open block %s\n", stream->blk_id);
+        return -1;
+    }
+
+    bmd = seaf_block_manager_stat_block_by_handle (seaf->block_mgr,
+                                                   stream->handle);
+    if (!bmd) {
+        seaf_warning ("Failed to stat block %s\n", stream->blk_id);
+        return -1;
+    }
+    stream->remain = bmd->size;
+    g_free (bmd);
+
+    if (crypt) {
+        if (seafile_decrypt_init (&stream->ctx, crypt->version,
+                                  crypt->key, crypt->iv) < 0) {
+            seaf_warning ("Failed to init decrypt.\n");
+            return -1;
         }
+        stream->enc_init = TRUE;
+    }
 
-        while (remain != 0) {
-            n = seaf_block_manager_read_block (seaf->block_mgr, handle,
-                                               buf, sizeof(buf));
-            if (n <= 0) {
-                seaf_warning ("failed to read block %s\n", blk_id);
-                ret = -1;
-                goto out;
-            }
-            remain -= n;
-
-            /* OK, We're read some data of this block  */
-            if (crypt == NULL) {
-                /* not encrypted */
-                len = archive_write_data (a, buf, n);
-                if (len <= 0) {
-                    seaf_warning ("archive_write_data error: %s\n", archive_error_string(a));
-                    ret = -1;
-                    goto out;
-                }
+    return 0;
+}
 
-            } else {
-                /* an encrypted block */
-                dec_out = g_new (char, n + 16);
-                if (!dec_out) {
-                    seaf_warning ("Failed to alloc memory.\n");
-                    ret = -1;
-                    goto out;
-                }
+static int
+write_archive_data (PackDirStream *stream, const char *buf, int len)
+{
+    if (len > 0 && archive_write_data (stream->a, buf, len) <= 0) {
+        seaf_warning ("archive_write_data error: %s\n",
+                      archive_error_string(stream->a));
+        return -1;
+    }
+    return 0;
+}
 
-                int r = EVP_DecryptUpdate (&ctx,
-                                           (unsigned char *)dec_out,
-                                           &dec_out_len,
-                                           (unsigned char *)buf,
-                                           n);
-
-                /* EVP_DecryptUpdate returns 1 on success, 0 on failure */
-                if (r != 1) {
-                    seaf_warning ("Decrypt block %s failed.\n", blk_id);
-                    ret = -1;
-                    goto out;
-                }
+/* Copy the next piece of the current file into the archive. */
+static int
+copy_file_data (PackDirStream *stream)
+{
+    char buf[64 * 1024];
+    char dec_out[64 * 1024 + 16];
+    int dec_out_len = -1;
+    int n;
 
-                if (dec_out_len > 0) {
-                    len = archive_write_data (a, dec_out, dec_out_len);
-                    if (len <= 0) {
-                        seaf_warning ("archive_write_data error: %s\n", archive_error_string(a));
-                        ret = -1;
-                        goto out;
-                    }
-                }
+    if (!stream->handle) {
+        if (stream->blk_idx >= stream->file->n_blocks) {
+            close_current_file (stream);
+            return 0;
+        }
+        if (open_next_block (stream) < 0)
+            return -1;
+    }
 
-                /* If it's the last piece of a block, call decrypt_final()
-                 * to decrypt the possible partial block. */
-                if (remain == 0) {
-                    r = EVP_DecryptFinal_ex (&ctx,
-                                             (unsigned char *)dec_out,
-                                             &dec_out_len);
-                    if (r != 1) {
-                        seaf_warning ("Decrypt block %s failed.\n", blk_id);
-                        ret = -1;
-                        goto out;
-                    }
-
-                    if (dec_out_len != 0) {
-                        len = archive_write_data (a, dec_out, dec_out_len);
-                        if (len <= 0) {
-                            seaf_warning ("archive_write_data error: %s\n", archive_error_string(a));
-                            ret = -1;
-                            goto out;
-                        }
-                    }
+    if (stream->remain != 0) {
+        n = seaf_block_manager_read_block (seaf->block_mgr, stream->handle,
+                                           buf, sizeof(buf));
+        if (n <= 0) {
+            seaf_warning ("failed to read block %s\n", stream->blk_id);
+            return -1;
+        }
+        stream->remain -= n;
+
+        if (stream->crypt == NULL) {
+            if (write_archive_data (stream, buf, n) < 0)
+                return -1;
+        } else {
+            /* EVP_DecryptUpdate returns 1 on success, 0 on failure */
+            if (EVP_DecryptUpdate (&stream->ctx,
+                                   (unsigned char *)dec_out, &dec_out_len,
+                                   (unsigned char *)buf, n) != 1) {
+                seaf_warning ("Decrypt block %s failed.\n", stream->blk_id);
+                return -1;
+            }
+            if (write_archive_data (stream, dec_out, dec_out_len) < 0)
+                return -1;
+
+            /* If it's the last piece of a block, call decrypt_final()
+             * to decrypt the possible partial block. */
+            if (stream->remain == 0) {
+                if (EVP_DecryptFinal_ex (&stream->ctx,
+                                         (unsigned char *)dec_out,
+                                         &dec_out_len) != 1) {
+                    seaf_warning ("Decrypt block %s failed.\n", stream->blk_id);
+                    return -1;
                 }
-
-                g_free (dec_out);
-                dec_out = NULL;
+                if (write_archive_data (stream, dec_out, dec_out_len) < 0)
+                    return -1;
             }
         }
+    }
 
-        seaf_block_manager_close_block (seaf->block_mgr, handle);
-        seaf_block_manager_block_handle_free (seaf->block_mgr, handle);
-        handle = NULL;
-
+    if (stream->remain == 0) {
         /* turn to next block */
-        idx++;
+        close_current_block (stream);
+        stream->blk_idx++;
     }
 
-out:
-    g_free (pathname);
-    if (entry)
-        archive_entry_free (entry);
-    if (file)
-        seafile_unref (file);
-    if (handle) {
-        seaf_block_manager_close_block (seaf->block_mgr, handle);
-        seaf_block_manager_block_handle_free(seaf->block_mgr, handle);
+    return 0;
+}
+
+static void
+push_dir (PackDirStream *stream, const char *dir_id, const char *path)
+{
+    DirFrame *frame;
+    SeafDir *dir;
+
+    dir = seaf_fs_manager_get_seafdir (seaf->fs_mgr,
+                                       stream->store_id, stream->repo_version,
+                                       dir_id);
+    if (!dir) {
+        /* Leave it out, like a dir without entries. */
+        seaf_warning ("failed to get dir %s\n", dir_id);
+        return;
     }
-    if (crypt != NULL && enc_init)
-        EVP_CIPHER_CTX_cleanup (&ctx);
-    g_free (dec_out);
 
-    return ret;
+    frame = g_new0 (DirFrame, 1);
+    frame->dir = dir;
+    frame->next = dir->entries;
+    frame->path = g_strdup (path);
+    g_queue_push_head (stream->dirs, frame);
 }
 
+static void
+dir_frame_free (DirFrame *frame)
+{
+    seaf_dir_free (frame->dir);
+    g_free (frame->path);
+    g_free (frame);
+}
+
+/* Start on the next entry of the walk. Returns 1 when there is none. */
 static int
-archive_dir (PackDirData *data,
-             const char *root_id,
-             const char *dirpath)
-             
+next_entry (PackDirStream *stream)
 {
-    SeafDir *dir = NULL;
+    DirFrame *frame;
     SeafDirent *dent;
-    GList *ptr;
-    char *subpath = NULL;
-    int ret = 0;
+    char *subpath;
 
-    dir = seaf_fs_manager_get_seafdir (seaf->fs_mgr,
-                                       data->store_id, data->repo_version,
-                                       root_id);
-    if (!dir) {
-        seaf_warning ("failed to get dir %s\n", root_id);
-        goto out;
+    frame = g_queue_peek_head (stream->dirs);
+    if (!frame)
+        return 1;
+
+    if (!frame->next) {
+        dir_frame_free (g_queue_pop_head (stream->dirs));
+        return 0;
     }
 
-    for (ptr = dir->entries; ptr; ptr = ptr->next) {
-        dent = ptr->data;
-        if (S_ISREG(dent->mode)) {
-            ret = add_file_to_archive (data, dirpath, dent);
+    dent = frame->next->data;
+    frame->next = frame->next->next;
 
-        } else if (S_ISLNK(dent->mode)) {
-            if (archive_version_number() >= 3000001) {
-                /* Symlink in zip arhive is not supported in earlier version
-                 * of libarchive */
-                ret = add_file_to_archive (data, dirpath, dent);
-            }
+    if (S_ISREG(dent->mode)) {
+        return start_file (stream, frame->path, dent);
 
-        } else if (S_ISDIR(dent->mode)) {
-            subpath = g_build_filename (dirpath, dent->name, NULL);
-            ret = archive_dir (data, dent->id, subpath);
-            g_free (subpath);
+    } else if (S_ISLNK(dent->mode)) {
+        if (archive_version_number() >= 3000001) {
+            /* Symlink in zip arhive is not supported in earlier version
+             * of libarchive */
+            return start_file (stream, frame->path, dent);
         }
 
-        if (ret < 0) {
-            goto out;
-        }
+    } else if (S_ISDIR(dent->mode)) {
+        subpath = g_build_filename (frame->path, dent->name, NULL);
+        push_dir (stream, dent->id, subpath);
+        g_free (subpath);
     }
 
-out:
-    if (dir)
-        seaf_dir_free (dir);
-
-    return ret;
+    return 0;
 }
 
-char *pack_dir (const char *store_id,
-                int repo_version,
-                const char *dirname,
-                const char *root_id,
-                SeafileCrypt *crypt,
-                gboolean is_windows)
+PackDirStream *
+pack_dir_stream_new (const char *store_id,
+                     int repo_version,
+                     const char *dirname,
+                     const char *root_id,
+                     SeafileCrypt *crypt,
+                     gboolean is_windows)
 {
-    struct archive *a = NULL;
-    char *tmpfile_name = NULL ;
-    char *ret = NULL;
-    int fd = -1;
-    PackDirData *data = NULL;
-
-    fd = g_file_open_tmp ("seafile-XXXXXX.zip", &tmpfile_name, NULL);
-    if (fd < 0) {
-        goto out;
+    PackDirStream *stream = g_new0 (PackDirStream, 1);
+
+    stream->crypt = crypt;
+    stream->is_windows = is_windows;
+    stream->top_dir_name = g_strdup (dirname);
+    stream->mtime = time(NULL);
+    memcpy (stream->store_id, store_id, 36);
+    stream->repo_version = repo_version;
+    stream->dirs = g_queue_new ();
+
+    stream->a = archive_write_new ();
+    archive_write_set_compression_none (stream->a);
+    archive_write_set_format_zip (stream->a);
+    /* Hand every write to archive_out_cb right away, unpadded. */
+    archive_write_set_bytes_per_block (stream->a, 0);
+    if (archive_write_open (stream->a, stream, NULL,
+                            archive_out_cb, NULL) != ARCHIVE_OK) {
+        seaf_warning ("Failed to open zip archive: %s\n",
+                      archive_error_string(stream->a));
+        pack_dir_stream_free (stream);
+        return NULL;
     }
 
-    a = archive_write_new ();
-    archive_write_set_compression_none (a);
-    archive_write_set_format_zip (a);
-    archive_write_open_fd (a, fd);
-
-    data = g_new0 (PackDirData, 1);
-    data->crypt = crypt;
-    data->is_windows = is_windows;
-    data->a = a;
-    data->top_dir_name = dirname;
-    data->mtime = time(NULL);
-    memcpy (data->store_id, store_id, 36);
-    data->repo_version = repo_version;
-
-    if (archive_dir (data, root_id, "") < 0) {
-        g_debug ("failed to archive_dir\n");
-        goto out;
-    }
+    push_dir (stream, root_id, "");
 
-    if (archive_write_finish(a) < 0) {
-        goto out;
-    }
+    return stream;
+}
 
-    ret = g_strdup (tmpfile_name);
+int
+pack_dir_stream_read (PackDirStream *stream, struct evbuffer *out, size_t size)
+{
+    int rc = 0;
 
-out:
-    if (data) g_free (data);
-    if (fd > 0) close (fd);
-    
-    if (!ret && tmpfile_name) {
-        /* zip failed: remove tmp file */
-        g_unlink (tmpfile_name);
+    if (stream->finished)
+        return 1;
+
+    stream->out = out;
+
+    while (evbuffer_get_length (out) < size) {
+        if (stream->file) {
+            if (copy_file_data (stream) < 0) {
+                rc = -1;
+                break;
+            }
+            continue;
+        }
+
+        rc = next_entry (stream);
+        if (rc < 0)
+            break;
+        if (rc == 1) {
+            /* Writes the central directory. */
+            if (archive_write_close (stream->a) != ARCHIVE_OK) {
+                seaf_warning ("Failed to finish zip archive: %s\n",
+                              archive_error_string(stream->a));
+                rc = -1;
+                break;
+            }
+            stream->finished = TRUE;
+            break;
+        }
     }
-    g_free (tmpfile_name);
 
-    return ret;
+    stream->out = NULL;
+    return rc;
+}
+
+void
+pack_dir_stream_free (PackDirStream *stream)
+{
+    DirFrame *frame;
+
+    if (!stream)
+        return;
+
+    close_current_file (stream);
+    while ((frame = g_queue_pop_head (stream->dirs)) != NULL)
+        dir_frame_free (frame);
+    g_queue_free (stream->dirs);
+
+    archive_write_finish (stream->a);
+    g_free (stream->top_dir_name);
+    g_free (stream);
 }
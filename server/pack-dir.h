@@ -1,13 +1,32 @@
 #ifndef PACK_DIR_H
 #define PACK_DIR_H
 
-/* Pack a seafile directory to a zipped archive, saved in a temporary file.
-   Return the path of this temporary file.
+struct evbuffer;
+
+/*
+ * Pack a seafile directory to a zipped archive on the fly, without
+ * writing the archive anywhere. The caller pulls the archive out piece by
+ * piece, as fast as it can send it.
+ */
+typedef struct PackDirStream PackDirStream;
+
+PackDirStream *
+pack_dir_stream_new (const char *store_id,
+                     int repo_version,
+                     const char *dirname,
+                     const char *root_id,
+                     SeafileCrypt *crypt,
+                     gboolean is_windows);
+
+/*
+ * Append the next part of the archive to @out, until it holds at least
+ * @size bytes or the archive ends. Returns 1 once the whole archive is
+ * out, 0 if there is more, -1 on error.
  */
-char *pack_dir (const char *repo_id,
-                int repo_version,
-                const char *dirname,
-                const char *root_id,
-                SeafileCrypt *crypt,
-                gboolean is_windows);
+int
+pack_dir_stream_read (PackDirStream *stream, struct evbuffer *out, size_t size);
+
+void
+pack_dir_stream_free (PackDirStream *stream);
+
 #endif
@@ -8,6 +8,7 @@
 #include "seafile-object.h"
 #include "seafile-error.h"
 #include "seafile-crypt.h"
+#include "dec-block-cache.h"
 
 #include "utils.h"
 
@@ -158,6 +159,10 @@ seaf_passwd_manager_set_passwd (SeafPasswdManager *mgr,
 
     /* g_debug ("[passwd mgr] Set passwd for %s\n", hash_key->str); */
 
+    /* Blocks decrypted with a replaced key shouldn't outlive it. */
+    if (g_hash_table_lookup (mgr->priv->decrypt_keys, hash_key->str))
+        dec_block_cache_drop_repo (repo_id);
+
     g_hash_table_insert (mgr->priv->decrypt_keys,
                          g_string_free (hash_key, FALSE),
                          crypt_key);
@@ -176,7 +181,8 @@ seaf_passwd_manager_unset_passwd (SeafPasswdManager *mgr,
 
     hash_key = g_string_new (NULL);
     g_string_printf (hash_key, "%s.%s", repo_id, user);
-    g_hash_table_remove (mgr->priv->decrypt_keys, hash_key->str);
+    if (g_hash_table_remove (mgr->priv->decrypt_keys, hash_key->str))
+        dec_block_cache_drop_repo (repo_id);
     g_string_free (hash_key, TRUE);
 
     return 0;
@@ -274,13 +280,17 @@ reap_expired_passwd (void *vmgr)
     gpointer key, value;
     DecryptKey *crypt_key;
     guint64 now = (guint64)time(NULL);
+    char repo_id[37];
 
     g_hash_table_iter_init (&iter, mgr->priv->decrypt_keys);
     while (g_hash_table_iter_next (&iter, &key, &value)) {
         crypt_key = value;
         if (crypt_key->expire_time <= now) {
             /* g_debug ("[passwd mgr] Remove passwd for %s\n", (char *)key); */
+            /* Keys are "<repo_id>.<user>". */
+            g_strlcpy (repo_id, key, sizeof(repo_id));
             g_hash_table_iter_remove (&iter);
+            dec_block_cache_drop_repo (repo_id);
         }
     }
 
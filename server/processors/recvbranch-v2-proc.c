@@ -199,6 +199,7 @@ retry:
         memcpy (opt.remote_repo_id, repo_id, 36);
         memcpy (opt.remote_head, new_commit->commit_id, 40);
         opt.do_merge = TRUE;
+        opt.parallel = TRUE;
 
         roots[0] = base->root_id; /* base */
         roots[1] = current_head->root_id; /* head */
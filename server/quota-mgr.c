@@ -5,6 +5,8 @@
 #include "log.h"
 #include "utils.h"
 
+#include <pthread.h>
+
 #include <ccnet.h>
 #include <ccnet/ccnet-object.h>
 
@@ -12,6 +14,29 @@
 #include "seaf-db.h"
 #include "quota-mgr.h"
 
+#define DEFAULT_USAGE_CACHE_TTL 300 /* 5min */
+#define MAX_CACHED_USERS 100000
+
+/*
+ * Usage of each user, summed from RepoSize when first asked for, and
+ * then changed by the size deltas of the size scheduler. Entries expire
+ * so that sizes set by other servers sharing the db are seen too.
+ */
+typedef struct CachedUsage {
+    gint64 usage;
+    gint64 expire_time;
+} CachedUsage;
+
+typedef struct _SeafQuotaManagerPriv {
+    GHashTable *user_usage;
+    pthread_mutex_t usage_lock;
+    /* Bumped on every change, so that a sum racing with a change isn't
+     * cached.
+     */
+    guint64 usage_gen;
+    int usage_cache_ttl;
+} SeafQuotaManagerPriv;
+
 static gint64
 get_default_quota (GKeyFile *config)
 {
@@ -29,6 +54,8 @@ SeafQuotaManager *
 seaf_quota_manager_new (struct _SeafileSession *session)
 {
     SeafQuotaManager *mgr = g_new0 (SeafQuotaManager, 1);
+    GError *error = NULL;
+
     if (!mgr)
         return NULL;
     mgr->session = session;
@@ -38,6 +65,25 @@ seaf_quota_manager_new (struct _SeafileSession *session)
                                                     "quota", "calc_share_usage",
                                                     NULL);
 
+    mgr->priv = g_new0 (SeafQuotaManagerPriv, 1);
+
+    /*
+     * [quota]
+     * usage_cache_ttl = 300   # seconds, 0 to disable
+     */
+    mgr->priv->usage_cache_ttl = g_key_file_get_integer (session->config, "quota",
+                                                         "usage_cache_ttl",
+                                                         &error);
+    if (error) {
+        mgr->priv->usage_cache_ttl = DEFAULT_USAGE_CACHE_TTL;
+        g_clear_error (&error);
+    }
+    mgr->priv->usage_cache_ttl = MAX (mgr->priv->usage_cache_ttl, 0);
+
+    mgr->priv->user_usage = g_hash_table_new_full (g_str_hash, g_str_equal,
+                                                   g_free, g_free);
+    pthread_mutex_init (&mgr->priv->usage_lock, NULL);
+
     return mgr;
 }
 
@@ -437,8 +483,125 @@ get_total_size (SeafDBRow *row, void *vpsize)
     return TRUE;
 }
 
-gint64
-seaf_quota_manager_get_user_usage (SeafQuotaManager *mgr, const char *user)
+static gboolean
+lookup_cached_usage (SeafQuotaManagerPriv *priv, const char *user,
+                     gint64 *usage, guint64 *gen)
+{
+    CachedUsage *cached;
+    gboolean found = FALSE;
+
+    pthread_mutex_lock (&priv->usage_lock);
+
+    cached = g_hash_table_lookup (priv->user_usage, user);
+    if (cached) {
+        if (cached->expire_time > (gint64)time(NULL)) {
+            *usage = cached->usage;
+            found = TRUE;
+        } else {
+            g_hash_table_remove (priv->user_usage, user);
+        }
+    }
+    *gen = priv->usage_gen;
+
+    pthread_mutex_unlock (&priv->usage_lock);
+
+    return found;
+}
+
+static gboolean
+usage_expired (gpointer key, gpointer value, gpointer user_data)
+{
+    CachedUsage *cached = value;
+    gint64 *now = user_data;
+
+    return cached->expire_time <= *now;
+}
+
+static void
+cache_usage (SeafQuotaManagerPriv *priv, const char *user, gint64 usage,
+             guint64 gen)
+{
+    CachedUsage *cached;
+    gint64 now = (gint64)time(NULL);
+
+    pthread_mutex_lock (&priv->usage_lock);
+
+    if (gen != priv->usage_gen)
+        goto out;
+
+    if (g_hash_table_size (priv->user_usage) >= MAX_CACHED_USERS) {
+        g_hash_table_foreach_remove (priv->user_usage, usage_expired, &now);
+        if (g_hash_table_size (priv->user_usage) >= MAX_CACHED_USERS)
+            goto out;
+    }
+
+    cached = g_new0 (CachedUsage, 1);
+    cached->usage = usage;
+    cached->expire_time = now + priv->usage_cache_ttl;
+    g_hash_table_replace (priv->user_usage, g_strdup(user), cached);
+
+out:
+    pthread_mutex_unlock (&priv->usage_lock);
+}
+
+void
+seaf_quota_manager_add_repo_usage (SeafQuotaManager *mgr,
+                                   const char *repo_id,
+                                   gint64 delta)
+{
+    SeafQuotaManagerPriv *priv = mgr->priv;
+    SeafVirtRepo *vinfo;
+    CachedUsage *cached;
+    char *user;
+
+    if (priv->usage_cache_ttl == 0 || delta == 0)
+        return;
+
+    /* Virtual repos don't count in the usage. */
+    vinfo = seaf_repo_manager_get_virtual_repo_info (seaf->repo_mgr, repo_id);
+    if (vinfo) {
+        seaf_virtual_repo_info_free (vinfo);
+        return;
+    }
+
+    user = seaf_repo_manager_get_repo_owner (seaf->repo_mgr, repo_id);
+    if (!user)
+        return;
+
+    pthread_mutex_lock (&priv->usage_lock);
+    ++priv->usage_gen;
+    cached = g_hash_table_lookup (priv->user_usage, user);
+    if (cached)
+        cached->usage += delta;
+    pthread_mutex_unlock (&priv->usage_lock);
+
+    g_free (user);
+}
+
+void
+seaf_quota_manager_invalidate_user_usage (SeafQuotaManager *mgr,
+                                          const char *user)
+{
+    SeafQuotaManagerPriv *priv = mgr->priv;
+    char *lower;
+
+    if (!user)
+        return;
+
+    /* Owners are looked up in lower case. */
+    lower = g_ascii_strdown (user, -1);
+
+    pthread_mutex_lock (&priv->usage_lock);
+    ++priv->usage_gen;
+    g_hash_table_remove (priv->user_usage, user);
+    g_hash_table_remove (priv->user_usage, lower);
+    pthread_mutex_unlock (&priv->usage_lock);
+
+    g_free (lower);
+}
+
+static gint64
+sum_user_usage (SeafQuotaManager *mgr, const char *user)
 {
     char *sql;
     gint64 total = 0;
@@ -463,6 +626,25 @@ seaf_quota_manager_get_user_usage (SeafQuotaManager *mgr, const char *user)
     return total;
 }
 
+gint64
+seaf_quota_manager_get_user_usage (SeafQuotaManager *mgr, const char *user)
+{
+    gint64 usage;
+    guint64 gen = 0;
+
+    if (mgr->priv->usage_cache_ttl == 0)
+        return sum_user_usage (mgr, user);
+
+    if (lookup_cached_usage (mgr->priv, user, &usage, &gen))
+        return usage;
+
+    usage = sum_user_usage (mgr, user);
+    if (usage >= 0)
+        cache_usage (mgr->priv, user, usage, gen);
+
+    return usage;
+}
+
 static gint64
 repo_share_usage (const char *user, const char *repo_id)
 {
@@ -5,11 +5,15 @@
 
 #define INFINITE_QUOTA (gint64)-2
 
+struct _SeafQuotaManagerPriv;
+
 struct _SeafQuotaManager {
     struct _SeafileSession *session;
 
     gint64 default_quota;
     gboolean calc_share_usage;
+
+    struct _SeafQuotaManagerPriv *priv;
 };
 typedef struct _SeafQuotaManager SeafQuotaManager;
 
@@ -48,7 +52,19 @@ seaf_quota_manager_check_quota_with_delta (SeafQuotaManager *mgr,
                                            const char *repo_id,
                                            gint64 delta);
 
+/* Usage of a user is cached, and kept current by the calls below. */
 gint64
 seaf_quota_manager_get_user_usage (SeafQuotaManager *mgr, const char *user);
 
+/* The size of @repo_id changed by @delta. */
+void
+seaf_quota_manager_add_repo_usage (SeafQuotaManager *mgr,
+                                   const char *repo_id,
+                                   gint64 delta);
+
+/* The repos owned by @user changed. */
+void
+seaf_quota_manager_invalidate_user_usage (SeafQuotaManager *mgr,
+                                          const char *user);
+
 #endif
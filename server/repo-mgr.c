@@ -24,12 +24,17 @@
 #include "monitor-rpc-wrappers.h"
 
 #include "seaf-db.h"
+#include "mem-stats.h"
 
 #define REAP_TOKEN_INTERVAL 300 /* 5 mins */
 #define DECRYPTED_TOKEN_TTL 3600 /* 1 hour */
 #define SCAN_TRASH_DAYS 1 /* one day */
 #define TRASH_EXPIRE_DAYS 30 /* one month */
 
+/* Bounds how long changes made by other processes take to show. */
+#define DEFAULT_REPO_CACHE_TTL 10 /* seconds */
+#define MAX_CACHED_REPOS 10000
+
 typedef struct DecryptedToken {
     char *token;
     gint64 reap_time;
@@ -43,8 +48,27 @@ struct _SeafRepoManagerPriv {
 
     CcnetTimer *scan_trash_timer;
     gint64 trash_expire_interval;
+
+    /* Version of newly created repos. */
+    int new_repo_version;
+
+    /* repo_id -> CachedRepo */
+    GHashTable *repo_cache;
+    pthread_mutex_t repo_cache_lock;
+    /* Bumped on every invalidation, so that repos loaded before one
+     * aren't cached after it.
+     */
+    guint64 repo_cache_gen;
+    int repo_cache_ttl;
+    int repo_cache_max_entries;
+    gint64 repo_cache_evictions;
 };
 
+typedef struct CachedRepo {
+    SeafRepo *repo;
+    gint64 expire_time;
+} CachedRepo;
+
 static const char *ignore_table[] = {
     /* tmp files under Linux */
     "*~",
@@ -322,6 +346,95 @@ init_scan_trash_timer (SeafRepoManagerPriv *priv, GKeyFile *config)
                                               scan_days * 24 * 3600 * 1000);
 }
 
+static void
+cached_repo_free (CachedRepo *cached)
+{
+    seaf_repo_unref (cached->repo);
+    g_free (cached);
+}
+
+static void
+init_repo_cache (SeafRepoManagerPriv *priv, GKeyFile *config)
+{
+    GError *error = NULL;
+    int ttl, max_entries;
+
+    /*
+     * [library]
+     * repo_cache_ttl = 10   # seconds, 0 to disable
+     * repo_cache_max_entries = 10000
+     */
+    ttl = g_key_file_get_integer (config, "library", "repo_cache_ttl", &error);
+    if (error) {
+        ttl = DEFAULT_REPO_CACHE_TTL;
+        g_clear_error (&error);
+    }
+    priv->repo_cache_ttl = MAX (ttl, 0);
+
+    max_entries = g_key_file_get_integer (config, "library",
+                                          "repo_cache_max_entries", &error);
+    if (error || max_entries <= 0) {
+        max_entries = MAX_CACHED_REPOS;
+        g_clear_error (&error);
+    }
+    priv->repo_cache_max_entries = max_entries;
+
+    priv->repo_cache = g_hash_table_new_full (g_str_hash, g_str_equal,
+                                              g_free,
+                                              (GDestroyNotify)cached_repo_free);
+    pthread_mutex_init (&priv->repo_cache_lock, NULL);
+}
+
+static void
+repo_cache_get_mem_stats (gpointer data, MemStats *stats)
+{
+    SeafRepoManagerPriv *priv = data;
+    GHashTableIter iter;
+    gpointer key, value;
+    SeafRepo *repo;
+
+    pthread_mutex_lock (&priv->repo_cache_lock);
+
+    stats->max_entries = priv->repo_cache_max_entries;
+    stats->evictions = priv->repo_cache_evictions;
+
+    g_hash_table_iter_init (&iter, priv->repo_cache);
+    while (g_hash_table_iter_next (&iter, &key, &value)) {
+        repo = ((CachedRepo *)value)->repo;
+        stats->bytes += 37 + sizeof(CachedRepo) + sizeof(SeafRepo) +
+            MEM_STATS_HASH_ENTRY_SIZE;
+        if (repo->name)
+            stats->bytes += strlen (repo->name) + 1;
+        if (repo->desc)
+            stats->bytes += strlen (repo->desc) + 1;
+        ++stats->entries;
+    }
+
+    pthread_mutex_unlock (&priv->repo_cache_lock);
+}
+
+static int
+load_new_repo_version (GKeyFile *config)
+{
+    int version;
+    GError *error = NULL;
+
+    version = g_key_file_get_integer (config, "library", "repo_version",
+                                      &error);
+    if (error) {
+        g_clear_error (&error);
+        return CURRENT_REPO_VERSION;
+    }
+
+    if (version < CURRENT_REPO_VERSION || version > BINARY_FS_REPO_VERSION) {
+        seaf_warning ("Unsupported repo version %d, using %d.\n",
+                      version, CURRENT_REPO_VERSION);
+        return CURRENT_REPO_VERSION;
+    }
+
+    return version;
+}
+
 SeafRepoManager*
 seaf_repo_manager_new (SeafileSession *seaf)
 {
@@ -338,6 +451,10 @@ seaf_repo_manager_new (SeafileSession *seaf)
                                                    REAP_TOKEN_INTERVAL * 1000);
 
     init_scan_trash_timer (mgr->priv, seaf->config);
+    mgr->priv->new_repo_version = load_new_repo_version (seaf->config);
+    init_repo_cache (mgr->priv, seaf->config);
+    mem_stats_register ("repo_cache", repo_cache_get_mem_stats, mgr->priv);
+    seaf_repo_manager_init_perm_cache (mgr, seaf->config);
 
     /* ignore_patterns = g_new0 (GPatternSpec*, G_N_ELEMENTS(ignore_table)); */
     /* int i; */
@@ -510,6 +627,17 @@ remove_virtual_repo_ondisk (SeafRepoManager *mgr,
     seaf_db_statement_query (db, "DELETE FROM RepoUserToken WHERE repo_id = ?",
                              1, "string", repo_id);
 
+    seaf_db_statement_query (db, "DELETE FROM RepoInfo WHERE repo_id = ?",
+                             1, "string", repo_id);
+
+    seaf_db_statement_query (db, "DELETE FROM DirLastModified WHERE repo_id = ?",
+                             1, "string", repo_id);
+
+    file_rev_index_remove_repo (seaf->file_rev_index, repo_id);
+
+    seaf_repo_manager_invalidate_repo (mgr, repo_id);
+    seaf_repo_manager_invalidate_perm_cache (mgr);
+
     return 0;
 }
 
@@ -517,6 +645,8 @@ int
 seaf_repo_manager_del_repo (SeafRepoManager *mgr,
                             const char *repo_id)
 {
+    char *owner;
+
     if (add_deleted_repo_to_trash (mgr, repo_id) < 0)
         return -1;
 
@@ -524,11 +654,18 @@ seaf_repo_manager_del_repo (SeafRepoManager *mgr,
                                  1, "string", repo_id) < 0)
         return -1;
 
+    seaf_repo_manager_invalidate_repo (mgr, repo_id);
+
+    owner = seaf_repo_manager_get_repo_owner (mgr, repo_id);
+
     /* Repo branches are not removed at this point. */
 
     seaf_db_statement_query (mgr->seaf->db, "DELETE FROM RepoOwner WHERE repo_id = ?",
                              1, "string", repo_id);
 
+    seaf_quota_manager_invalidate_user_usage (seaf->quota_mgr, owner);
+    g_free (owner);
+
     seaf_db_statement_query (mgr->seaf->db, "DELETE FROM SharedRepo WHERE repo_id = ?",
                              1, "string", repo_id);
 
@@ -554,6 +691,8 @@ seaf_repo_manager_del_repo (SeafRepoManager *mgr,
                              "WHERE repo_id=? OR origin_repo=?",
                              2, "string", repo_id, "string", repo_id);
 
+    seaf_repo_manager_invalidate_perm_cache (mgr);
+
     return 0;
 }
 
@@ -605,16 +744,103 @@ get_repo_from_db (SeafRepoManager *mgr, const char *id, gboolean *db_err)
     return repo;
 }
 
+static SeafRepo *
+lookup_cached_repo (SeafRepoManagerPriv *priv, const char *id, guint64 *gen)
+{
+    CachedRepo *cached;
+    SeafRepo *repo = NULL;
+
+    pthread_mutex_lock (&priv->repo_cache_lock);
+
+    cached = g_hash_table_lookup (priv->repo_cache, id);
+    if (cached) {
+        if (cached->expire_time > (gint64)time(NULL)) {
+            repo = cached->repo;
+            seaf_repo_ref (repo);
+        } else {
+            g_hash_table_remove (priv->repo_cache, id);
+        }
+    }
+    *gen = priv->repo_cache_gen;
+
+    pthread_mutex_unlock (&priv->repo_cache_lock);
+
+    return repo;
+}
+
+static gboolean
+repo_expired (gpointer key, gpointer value, gpointer user_data)
+{
+    CachedRepo *cached = value;
+    gint64 *now = user_data;
+
+    return cached->expire_time <= *now;
+}
+
+static void
+cache_repo (SeafRepoManagerPriv *priv, SeafRepo *repo, guint64 gen)
+{
+    CachedRepo *cached;
+    GHashTableIter iter;
+    gint64 now = (gint64)time(NULL);
+
+    pthread_mutex_lock (&priv->repo_cache_lock);
+
+    /* The repo changed while it was being loaded. */
+    if (gen != priv->repo_cache_gen)
+        goto out;
+
+    if (g_hash_table_size (priv->repo_cache) >= priv->repo_cache_max_entries) {
+        g_hash_table_foreach_remove (priv->repo_cache, repo_expired, &now);
+
+        /* Still full, make room by dropping any repo. */
+        g_hash_table_iter_init (&iter, priv->repo_cache);
+        while (g_hash_table_size (priv->repo_cache) >=
+               priv->repo_cache_max_entries &&
+               g_hash_table_iter_next (&iter, NULL, NULL)) {
+            g_hash_table_iter_remove (&iter);
+            ++priv->repo_cache_evictions;
+        }
+    }
+
+    cached = g_new0 (CachedRepo, 1);
+    cached->repo = repo;
+    seaf_repo_ref (repo);
+    cached->expire_time = now + priv->repo_cache_ttl;
+    g_hash_table_replace (priv->repo_cache, g_strdup(repo->id), cached);
+
+out:
+    pthread_mutex_unlock (&priv->repo_cache_lock);
+}
+
+void
+seaf_repo_manager_invalidate_repo (SeafRepoManager *manager, const char *repo_id)
+{
+    SeafRepoManagerPriv *priv = manager->priv;
+
+    pthread_mutex_lock (&priv->repo_cache_lock);
+    ++priv->repo_cache_gen;
+    g_hash_table_remove (priv->repo_cache, repo_id);
+    pthread_mutex_unlock (&priv->repo_cache_lock);
+}
+
 SeafRepo*
 seaf_repo_manager_get_repo (SeafRepoManager *manager, const gchar *id)
 {
     int len = strlen(id);
     gboolean db_err = FALSE;
     SeafRepo *repo = NULL;
+    guint64 gen = 0;
 
     if (len >= 37)
         return NULL;
 
+    if (manager->priv->repo_cache_ttl > 0) {
+        repo = lookup_cached_repo (manager->priv, id, &gen);
+        if (repo)
+            return repo;
+    }
+
     repo = get_repo_from_db (manager, id, &db_err);
 
     if (repo) {
@@ -623,6 +849,8 @@ seaf_repo_manager_get_repo (SeafRepoManager *manager, const gchar *id)
             seaf_repo_unref (repo);
             return NULL;
         }
+        if (manager->priv->repo_cache_ttl > 0)
+            cache_repo (manager->priv, repo, gen);
     }
 
     return repo;
@@ -820,6 +1048,52 @@ create_tables_mysql (SeafRepoManager *mgr)
     if (seaf_db_query (db, sql) < 0)
         return -1;
 
+    sql = "CREATE TABLE IF NOT EXISTS RepoInfo ("
+        "repo_id CHAR(37) PRIMARY KEY, commit_id CHAR(41), "
+        "name VARCHAR(255), description TEXT, update_time BIGINT, "
+        "version INTEGER, is_encrypted INTEGER, enc_version INTEGER, "
+        "magic VARCHAR(65), random_key VARCHAR(97), root_id CHAR(41), "
+        "repaired INTEGER)"
+        "ENGINE=INNODB";
+    if (seaf_db_query (db, sql) < 0)
+        return -1;
+
+    sql = "CREATE TABLE IF NOT EXISTS DirLastModified ("
+        "repo_id CHAR(37), dir_id CHAR(41), info MEDIUMTEXT, "
+        "PRIMARY KEY (repo_id, dir_id))"
+        "ENGINE=INNODB";
+    if (seaf_db_query (db, sql) < 0)
+        return -1;
+
+    sql = "CREATE TABLE IF NOT EXISTS GCRepoState ("
+        "repo_id CHAR(37) PRIMARY KEY, heads CHAR(41), "
+        "next_expire BIGINT, total_blocks BIGINT)"
+        "ENGINE=INNODB";
+    if (seaf_db_query (db, sql) < 0)
+        return -1;
+
+    sql = "CREATE TABLE IF NOT EXISTS GCRefCommit ("
+        "store_id CHAR(37), repo_id CHAR(37), commit_id CHAR(41), "
+        "is_root INTEGER, PRIMARY KEY (repo_id, commit_id), "
+        "INDEX (store_id))"
+        "ENGINE=INNODB";
+    if (seaf_db_query (db, sql) < 0)
+        return -1;
+
+    sql = "CREATE TABLE IF NOT EXISTS GCFileRef ("
+        "store_id CHAR(37), file_id CHAR(41), refs INTEGER, "
+        "PRIMARY KEY (store_id, file_id))"
+        "ENGINE=INNODB";
+    if (seaf_db_query (db, sql) < 0)
+        return -1;
+
+    sql = "CREATE TABLE IF NOT EXISTS GCBlockRef ("
+        "store_id CHAR(37), block_id CHAR(41), refs INTEGER, "
+        "PRIMARY KEY (store_id, block_id))"
+        "ENGINE=INNODB";
+    if (seaf_db_query (db, sql) < 0)
+        return -1;
+
     sql = "CREATE TABLE IF NOT EXISTS RepoHistoryLimit ("
         "repo_id CHAR(37) PRIMARY KEY, days INTEGER)"
         "ENGINE=INNODB";
@@ -947,6 +1221,50 @@ create_tables_sqlite (SeafRepoManager *mgr)
     if (seaf_db_query (db, sql) < 0)
         return -1;
 
+    sql = "CREATE TABLE IF NOT EXISTS RepoInfo ("
+        "repo_id CHAR(37) PRIMARY KEY, commit_id CHAR(41), "
+        "name VARCHAR(255), description TEXT, update_time BIGINT, "
+        "version INTEGER, is_encrypted INTEGER, enc_version INTEGER, "
+        "magic VARCHAR(65), random_key VARCHAR(97), root_id CHAR(41), "
+        "repaired INTEGER)";
+    if (seaf_db_query (db, sql) < 0)
+        return -1;
+
+    sql = "CREATE TABLE IF NOT EXISTS DirLastModified ("
+        "repo_id CHAR(37), dir_id CHAR(41), info TEXT, "
+        "PRIMARY KEY (repo_id, dir_id))";
+    if (seaf_db_query (db, sql) < 0)
+        return -1;
+
+    sql = "CREATE TABLE IF NOT EXISTS GCRepoState ("
+        "repo_id CHAR(37) PRIMARY KEY, heads CHAR(41), "
+        "next_expire BIGINT, total_blocks BIGINT)";
+    if (seaf_db_query (db, sql) < 0)
+        return -1;
+
+    sql = "CREATE TABLE IF NOT EXISTS GCRefCommit ("
+        "store_id CHAR(37), repo_id CHAR(37), commit_id CHAR(41), "
+        "is_root INTEGER, PRIMARY KEY (repo_id, commit_id))";
+    if (seaf_db_query (db, sql) < 0)
+        return -1;
+
+    sql = "CREATE INDEX IF NOT EXISTS gcrefcommit_store_idx ON "
+        "GCRefCommit (store_id)";
+    if (seaf_db_query (db, sql) < 0)
+        return -1;
+
+    sql = "CREATE TABLE IF NOT EXISTS GCFileRef ("
+        "store_id CHAR(37), file_id CHAR(41), refs INTEGER, "
+        "PRIMARY KEY (store_id, file_id))";
+    if (seaf_db_query (db, sql) < 0)
+        return -1;
+
+    sql = "CREATE TABLE IF NOT EXISTS GCBlockRef ("
+        "store_id CHAR(37), block_id CHAR(41), refs INTEGER, "
+        "PRIMARY KEY (store_id, block_id))";
+    if (seaf_db_query (db, sql) < 0)
+        return -1;
+
     sql = "CREATE TABLE IF NOT EXISTS RepoHistoryLimit ("
         "repo_id CHAR(37) PRIMARY KEY, days INTEGER)";
     if (seaf_db_query (db, sql) < 0)
@@ -1074,6 +1392,51 @@ create_tables_pgsql (SeafRepoManager *mgr)
     if (seaf_db_query (db, sql) < 0)
         return -1;
 
+    sql = "CREATE TABLE IF NOT EXISTS RepoInfo ("
+        "repo_id CHAR(36) PRIMARY KEY, commit_id CHAR(40), "
+        "name VARCHAR(255), description TEXT, update_time BIGINT, "
+        "version INTEGER, is_encrypted INTEGER, enc_version INTEGER, "
+        "magic VARCHAR(64), random_key VARCHAR(96), root_id CHAR(40), "
+        "repaired INTEGER)";
+    if (seaf_db_query (db, sql) < 0)
+        return -1;
+
+    sql = "CREATE TABLE IF NOT EXISTS DirLastModified ("
+        "repo_id CHAR(36), dir_id CHAR(40), info TEXT, "
+        "PRIMARY KEY (repo_id, dir_id))";
+    if (seaf_db_query (db, sql) < 0)
+        return -1;
+
+    sql = "CREATE TABLE IF NOT EXISTS GCRepoState ("
+        "repo_id CHAR(36) PRIMARY KEY, heads CHAR(40), "
+        "next_expire BIGINT, total_blocks BIGINT)";
+    if (seaf_db_query (db, sql) < 0)
+        return -1;
+
+    sql = "CREATE TABLE IF NOT EXISTS GCRefCommit ("
+        "store_id CHAR(36), repo_id CHAR(36), commit_id CHAR(40), "
+        "is_root INTEGER, PRIMARY KEY (repo_id, commit_id))";
+    if (seaf_db_query (db, sql) < 0)
+        return -1;
+
+    if (!pgsql_index_exists (db, "gcrefcommit_store_idx")) {
+        sql = "CREATE INDEX gcrefcommit_store_idx ON GCRefCommit (store_id)";
+        if (seaf_db_query (db, sql) < 0)
+            return -1;
+    }
+
+    sql = "CREATE TABLE IF NOT EXISTS GCFileRef ("
+        "store_id CHAR(36), file_id CHAR(40), refs INTEGER, "
+        "PRIMARY KEY (store_id, file_id))";
+    if (seaf_db_query (db, sql) < 0)
+        return -1;
+
+    sql = "CREATE TABLE IF NOT EXISTS GCBlockRef ("
+        "store_id CHAR(36), block_id CHAR(40), refs INTEGER, "
+        "PRIMARY KEY (store_id, block_id))";
+    if (seaf_db_query (db, sql) < 0)
+        return -1;
+
     sql = "CREATE TABLE IF NOT EXISTS RepoHistoryLimit ("
         "repo_id CHAR(36) PRIMARY KEY, days INTEGER)";
     if (seaf_db_query (db, sql) < 0)
@@ -1445,9 +1808,6 @@ seaf_repo_manager_delete_repo_tokens_by_peer_id (SeafRepoManager *mgr,
     int ret = 0;
     const char *template;
     GList *token_list = NULL;
-    GString *token_list_str = g_string_new ("");
-    GString *sql = g_string_new ("");
-    GList *ptr;
     int rc = 0;
 
     template = "SELECT u.token "
@@ -1465,35 +1825,21 @@ seaf_repo_manager_delete_repo_tokens_by_peer_id (SeafRepoManager *mgr,
     if (rc == 0)
         goto out;
 
-    for (ptr = token_list; ptr; ptr = ptr->next) {
-        const char *token = (char *)ptr->data;
-        if (token_list_str->len == 0)
-            g_string_append_printf (token_list_str, "'%s'", token);
-        else
-            g_string_append_printf (token_list_str, ",'%s'", token);
-    }
-
-    /* Note that there is a size limit on sql query. In MySQL it's 1MB by default.
-     * Normally the token_list won't be that long.
-     */
-    g_string_printf (sql, "DELETE FROM RepoUserToken WHERE token in (%s)",
-                     token_list_str->str);
-    rc = seaf_db_statement_query (mgr->seaf->db, sql->str, 0);
+    rc = seaf_db_statement_query_in (mgr->seaf->db, NULL,
+                                     "DELETE FROM RepoUserToken WHERE token in (%s)",
+                                     token_list, 0);
     if (rc < 0) {
         g_set_error (error, SEAFILE_DOMAIN, SEAF_ERR_INTERNAL, "DB error");
         goto out;
     }
 
-    g_string_printf (sql, "DELETE FROM RepoTokenPeerInfo WHERE token in (%s)",
-                     token_list_str->str);
-    rc = seaf_db_statement_query (mgr->seaf->db, sql->str, 0);
+    rc = seaf_db_statement_query_in (mgr->seaf->db, NULL,
+                                     "DELETE FROM RepoTokenPeerInfo WHERE token in (%s)",
+                                     token_list, 0);
     if (rc < 0)
         g_set_error (error, SEAFILE_DOMAIN, SEAF_ERR_INTERNAL, "DB error");
 
 out:
-    g_string_free (token_list_str, TRUE);
-    g_string_free (sql, TRUE);
-
     if (rc < 0) {
         ret = -1;
         g_list_free_full (token_list, (GDestroyNotify)g_free);
@@ -1512,9 +1858,6 @@ seaf_repo_manager_delete_repo_tokens_by_email (SeafRepoManager *mgr,
     int ret = 0;
     const char *template;
     GList *token_list = NULL;
-    GList *ptr;
-    GString *token_list_str = g_string_new ("");
-    GString *sql = g_string_new ("");
     int rc;
 
     template = "SELECT u.token "
@@ -1532,28 +1875,17 @@ seaf_repo_manager_delete_repo_tokens_by_email (SeafRepoManager *mgr,
     if (rc == 0)
         goto out;
 
-    for (ptr = token_list; ptr; ptr = ptr->next) {
-        const char *token = (char *)ptr->data;
-        if (token_list_str->len == 0)
-            g_string_append_printf (token_list_str, "'%s'", token);
-        else
-            g_string_append_printf (token_list_str, ",'%s'", token);
-    }
-
-    /* Note that there is a size limit on sql query. In MySQL it's 1MB by default.
-     * Normally the token_list won't be that long.
-     */
-    g_string_printf (sql, "DELETE FROM RepoUserToken WHERE token in (%s)",
-                     token_list_str->str);
-    rc = seaf_db_statement_query (mgr->seaf->db, sql->str, 0);
+    rc = seaf_db_statement_query_in (mgr->seaf->db, NULL,
+                                     "DELETE FROM RepoUserToken WHERE token in (%s)",
+                                     token_list, 0);
     if (rc < 0) {
         g_set_error (error, SEAFILE_DOMAIN, SEAF_ERR_INTERNAL, "DB error");
         goto out;
     }
 
-    g_string_printf (sql, "DELETE FROM RepoTokenPeerInfo WHERE token in (%s)",
-                     token_list_str->str);
-    rc = seaf_db_statement_query (mgr->seaf->db, sql->str, 0);
+    rc = seaf_db_statement_query_in (mgr->seaf->db, NULL,
+                                     "DELETE FROM RepoTokenPeerInfo WHERE token in (%s)",
+                                     token_list, 0);
     if (rc < 0) {
         g_set_error (error, SEAFILE_DOMAIN, SEAF_ERR_INTERNAL, "DB error");
         goto out;
@@ -1562,8 +1894,6 @@ seaf_repo_manager_delete_repo_tokens_by_email (SeafRepoManager *mgr,
     seaf_http_server_invalidate_tokens (seaf->http_server, token_list);
 
 out:
-    g_string_free (token_list_str, TRUE);
-    g_string_free (sql, TRUE);
     g_list_free_full (token_list, (GDestroyNotify)g_free);
 
     if (rc < 0) {
@@ -1631,6 +1961,140 @@ seaf_repo_manager_get_repo_size (SeafRepoManager *mgr, const char *repo_id)
     return size;
 }
 
+static gboolean
+collect_summary_head (SeafDBRow *row, void *data)
+{
+    json_t *infos = data;
+    const char *repo_id = seaf_db_row_get_column_text (row, 0);
+    const char *commit_id = seaf_db_row_get_column_text (row, 1);
+    json_t *info;
+
+    if (!repo_id || !commit_id)
+        return TRUE;
+
+    info = json_object ();
+    json_object_set_new (info, "repo_id", json_string (repo_id));
+    json_object_set_new (info, "head_commit_id", json_string (commit_id));
+    json_object_set_new (info, "owner", json_null ());
+    json_object_set_new (info, "size", json_integer (0));
+    json_object_set_new (infos, repo_id, info);
+
+    return TRUE;
+}
+
+static void
+set_summary_fields (json_t *info, const char *name, gint64 mtime,
+                    int version, gboolean encrypted)
+{
+    json_object_set_new (info, "name", name ? json_string (name) : json_null ());
+    json_object_set_new (info, "last_modified", json_integer (mtime));
+    json_object_set_new (info, "version", json_integer (version));
+    json_object_set_new (info, "encrypted", json_boolean (encrypted));
+}
+
+static gboolean
+collect_summary_info (SeafDBRow *row, void *data)
+{
+    json_t *info = json_object_get (data, seaf_db_row_get_column_text (row, 0));
+    const char *commit_id = seaf_db_row_get_column_text (row, 1);
+
+    /* A stale row is replaced by the head commit below. */
+    if (!info ||
+        g_strcmp0 (commit_id,
+                   json_string_value (json_object_get (info, "head_commit_id"))) != 0)
+        return TRUE;
+
+    set_summary_fields (info, seaf_db_row_get_column_text (row, 2),
+                        seaf_db_row_get_column_int64 (row, 3),
+                        seaf_db_row_get_column_int (row, 4),
+                        seaf_db_row_get_column_int (row, 5));
+    return TRUE;
+}
+
+static gboolean
+collect_summary_owner (SeafDBRow *row, void *data)
+{
+    json_t *info = json_object_get (data, seaf_db_row_get_column_text (row, 0));
+    const char *owner = seaf_db_row_get_column_text (row, 1);
+
+    if (info && owner)
+        json_object_set_new (info, "owner", json_string (owner));
+    return TRUE;
+}
+
+static gboolean
+collect_summary_size (SeafDBRow *row, void *data)
+{
+    json_t *info = json_object_get (data, seaf_db_row_get_column_text (row, 0));
+
+    if (info)
+        json_object_set_new (info, "size",
+                             json_integer (seaf_db_row_get_column_int64 (row, 1)));
+    return TRUE;
+}
+
+json_t *
+seaf_repo_manager_get_repo_summaries (SeafRepoManager *mgr, GList *repo_ids)
+{
+    SeafDB *db = mgr->seaf->db;
+    json_t *infos = json_object ();
+    json_t *info;
+    const char *repo_id;
+    SeafCommit *head;
+    void *iter;
+
+    if (!repo_ids)
+        return infos;
+
+    if (seaf_db_statement_foreach_row_in (db,
+                                          "SELECT repo_id, commit_id FROM Branch "
+                                          "WHERE name='master' AND repo_id IN (%s)",
+                                          repo_ids, collect_summary_head,
+                                          infos, 0) < 0 ||
+        seaf_db_statement_foreach_row_in (db,
+                                          "SELECT repo_id, commit_id, name, "
+                                          "update_time, version, is_encrypted "
+                                          "FROM RepoInfo WHERE repo_id IN (%s)",
+                                          repo_ids, collect_summary_info,
+                                          infos, 0) < 0 ||
+        seaf_db_statement_foreach_row_in (db,
+                                          "SELECT repo_id, owner_id FROM RepoOwner "
+                                          "WHERE repo_id IN (%s)",
+                                          repo_ids, collect_summary_owner,
+                                          infos, 0) < 0 ||
+        seaf_db_statement_foreach_row_in (db,
+                                          "SELECT repo_id, size FROM RepoSize "
+                                          "WHERE repo_id IN (%s)",
+                                          repo_ids, collect_summary_size,
+                                          infos, 0) < 0) {
+        json_decref (infos);
+        return NULL;
+    }
+
+    /* Repos without an up to date RepoInfo row. */
+    for (iter = json_object_iter (infos); iter;
+         iter = json_object_iter_next (infos, iter)) {
+        info = json_object_iter_value (iter);
+        if (json_object_get (info, "name"))
+            continue;
+
+        repo_id = json_object_iter_key (iter);
+        head = seaf_commit_manager_get_commit_compatible (
+            mgr->seaf->commit_mgr, repo_id,
+            json_string_value (json_object_get (info, "head_commit_id")));
+        if (!head) {
+            seaf_warning ("Failed to get head commit of repo %.8s.\n", repo_id);
+            set_summary_fields (info, NULL, 0, 0, FALSE);
+            continue;
+        }
+        set_summary_fields (info, head->repo_name, head->ctime,
+                            head->version, head->encrypted);
+        seaf_commit_unref (head);
+    }
+
+    return infos;
+}
+
 int
 seaf_repo_manager_set_repo_history_limit (SeafRepoManager *mgr,
                                           const char *repo_id,
@@ -1785,6 +2249,12 @@ seaf_repo_manager_set_repo_owner (SeafRepoManager *mgr,
 {
     SeafDB *db = mgr->seaf->db;
     char sql[256];
+    char *old_owner;
+
+    old_owner = seaf_repo_manager_get_repo_owner (mgr, repo_id);
+    seaf_quota_manager_invalidate_user_usage (seaf->quota_mgr, old_owner);
+    g_free (old_owner);
+    seaf_quota_manager_invalidate_user_usage (seaf->quota_mgr, email);
 
     if (seaf_db_type(db) == SEAF_DB_TYPE_PGSQL) {
         gboolean err;
@@ -1808,6 +2278,8 @@ seaf_repo_manager_set_repo_owner (SeafRepoManager *mgr,
             return -1;
     }
 
+    seaf_repo_manager_invalidate_perm_cache (mgr);
+
     return 0;
 }
 
@@ -1956,6 +2428,76 @@ seaf_repo_manager_get_repo_list (SeafRepoManager *mgr, int start, int limit)
     return ret;
 }
 
+static gboolean
+collect_listed_repo (SeafDBRow *row, void *data)
+{
+    GList **p_list = data;
+    SeafileRepo *srepo;
+
+    const char *repo_id = seaf_db_row_get_column_text (row, 0);
+    const char *commit_id = seaf_db_row_get_column_text (row, 1);
+    const char *origin_repo_id = seaf_db_row_get_column_text (row, 2);
+    const char *origin_path = seaf_db_row_get_column_text (row, 3);
+    gint64 size = seaf_db_row_get_column_int64 (row, 4);
+
+    srepo = g_object_new (SEAFILE_TYPE_REPO,
+                          "repo_id", repo_id,
+                          "id", repo_id,
+                          "head_cmmt_id", commit_id,
+                          "is_virtual", (origin_repo_id != NULL),
+                          "size", size,
+                          NULL);
+    if (!srepo)
+        return TRUE;
+
+    if (origin_repo_id)
+        g_object_set (srepo, "store_id", origin_repo_id,
+                      "origin_repo_id", origin_repo_id,
+                      "origin_path", origin_path, NULL);
+    else
+        g_object_set (srepo, "store_id", repo_id, NULL);
+
+    *p_list = g_list_prepend (*p_list, srepo);
+
+    return TRUE;
+}
+
+GList *
+seaf_repo_manager_get_repo_list_after (SeafRepoManager *mgr,
+                                       const char *after_repo_id,
+                                       int limit,
+                                       GError **error)
+{
+    GList *repos = NULL;
+    int rc;
+
+    if (!after_repo_id)
+        after_repo_id = "";
+
+    rc = seaf_db_statement_foreach_row (mgr->seaf->db,
+                                        "SELECT r.repo_id, b.commit_id, "
+                                        "v.origin_repo, v.path, s.size "
+                                        "FROM Repo r JOIN Branch b ON "
+                                        "r.repo_id = b.repo_id AND b.name = 'master' "
+                                        "LEFT JOIN VirtualRepo v ON r.repo_id = v.repo_id "
+                                        "LEFT JOIN RepoSize s ON r.repo_id = s.repo_id "
+                                        "WHERE r.repo_id > ? "
+                                        "ORDER BY r.repo_id LIMIT ?",
+                                        collect_listed_repo, &repos,
+                                        2, "string", after_repo_id,
+                                        "int", limit);
+    if (rc < 0) {
+        g_list_free_full (repos, g_object_unref);
+        g_set_error (error, SEAFILE_DOMAIN, SEAF_ERR_GENERAL,
+                     "Failed to get repo list from db.");
+        return NULL;
+    }
+
+    seaf_fill_repo_obj_from_commit (&repos);
+
+    return g_list_reverse (repos);
+}
+
 gint64
 seaf_repo_manager_count_repos (SeafRepoManager *mgr, GError **error)
 {
@@ -2062,6 +2604,36 @@ seaf_repo_manager_get_trash_repo_list (SeafRepoManager *mgr,
     return trash_repos;
 }
 
+GList *
+seaf_repo_manager_get_trash_repo_list_after (SeafRepoManager *mgr,
+                                             const char *after_repo_id,
+                                             int limit,
+                                             GError **error)
+{
+    GList *trash_repos = NULL;
+    int rc;
+
+    if (!after_repo_id)
+        after_repo_id = "";
+
+    rc = seaf_db_statement_foreach_row (mgr->seaf->db,
+                                        "SELECT repo_id, repo_name, head_id, owner_id, "
+                                        "size, del_time FROM RepoTrash "
+                                        "WHERE repo_id > ? "
+                                        "ORDER BY repo_id LIMIT ?",
+                                        collect_trash_repo, &trash_repos,
+                                        2, "string", after_repo_id,
+                                        "int", limit);
+    if (rc < 0) {
+        g_list_free_full (trash_repos, g_object_unref);
+        g_set_error (error, SEAFILE_DOMAIN, SEAF_ERR_GENERAL,
+                     "Failed to get trashed repo from db.");
+        return NULL;
+    }
+
+    return g_list_reverse (trash_repos);
+}
+
 GList *
 seaf_repo_manager_get_trash_repos_by_owner (SeafRepoManager *mgr,
                                             const char *owner,
@@ -2139,6 +2711,16 @@ seaf_repo_manager_del_repo_from_trash (SeafRepoManager *mgr,
     }
     seaf_branch_list_free (branch_list);
 
+    seaf_db_statement_query (mgr->seaf->db,
+                             "DELETE FROM RepoInfo WHERE repo_id = ?",
+                             1, "string", repo_id);
+
+    seaf_db_statement_query (mgr->seaf->db,
+                             "DELETE FROM DirLastModified WHERE repo_id = ?",
+                             1, "string", repo_id);
+
+    file_rev_index_remove_repo (seaf->file_rev_index, repo_id);
+
     seaf_db_statement_query (mgr->seaf->db,
                              "DELETE FROM RepoTrash WHERE repo_id = ?",
                              1, "string", repo_id);
@@ -2265,6 +2847,12 @@ seaf_repo_manager_restore_repo_from_trash (SeafRepoManager *mgr,
 
     seaf_db_trans_close (trans);
 
+    if (ret == 0) {
+        seaf_quota_manager_invalidate_user_usage (seaf->quota_mgr,
+                                                  seafile_trash_repo_get_owner_id(repo));
+        seaf_repo_manager_invalidate_perm_cache (mgr);
+    }
+
 out:
     g_object_unref (repo);
     return ret;
@@ -2340,6 +2928,8 @@ seaf_repo_manager_add_group_repo (SeafRepoManager *mgr,
                                  "string", owner, "string", permission) < 0)
         return -1;
 
+    seaf_repo_manager_invalidate_perm_cache (mgr);
+
     return 0;
 }
 
@@ -2349,10 +2939,15 @@ seaf_repo_manager_del_group_repo (SeafRepoManager *mgr,
                                   int group_id,
                                   GError **error)
 {
-    return seaf_db_statement_query (mgr->seaf->db,
-                                    "DELETE FROM RepoGroup WHERE group_id=? "
-                                    "AND repo_id=?",
-                                    2, "int", group_id, "string", repo_id);
+    int rc;
+
+    rc = seaf_db_statement_query (mgr->seaf->db,
+                                  "DELETE FROM RepoGroup WHERE group_id=? "
+                                  "AND repo_id=?",
+                                  2, "int", group_id, "string", repo_id);
+    seaf_repo_manager_invalidate_perm_cache (mgr);
+
+    return rc;
 }
 
 static gboolean
@@ -2429,11 +3024,16 @@ seaf_repo_manager_set_group_repo_perm (SeafRepoManager *mgr,
                                        const char *permission,
                                        GError **error)
 {
-    return seaf_db_statement_query (mgr->seaf->db,
-                                    "UPDATE RepoGroup SET permission=? WHERE "
-                                    "repo_id=? AND group_id=?",
-                                    3, "string", permission, "string", repo_id,
-                                    "int", group_id);
+    int rc;
+
+    rc = seaf_db_statement_query (mgr->seaf->db,
+                                  "UPDATE RepoGroup SET permission=? WHERE "
+                                  "repo_id=? AND group_id=?",
+                                  3, "string", permission, "string", repo_id,
+                                  "int", group_id);
+    seaf_repo_manager_invalidate_perm_cache (mgr);
+
+    return rc;
 }
 
 static gboolean
@@ -2510,19 +3110,210 @@ get_group_repos_cb (SeafDBRow *row, void *data)
     return TRUE;
 }
 
+/*
+ * RepoInfo keeps the fields of the head commit shown in repo listings,
+ * so listings don't load the head commit of every repo. A row is only
+ * used while its commit_id is still the head of the repo. Otherwise the
+ * commit is loaded and the row rewritten, so rows can't go stale.
+ */
+typedef struct RepoInfo {
+    char commit_id[41];
+    char *name;
+    char *desc;
+    gint64 update_time;
+    int version;
+    gboolean encrypted;
+    int enc_version;
+    char *magic;
+    char *random_key;
+    char root_id[41];
+    gboolean repaired;
+} RepoInfo;
+
+static void
+repo_info_free (RepoInfo *info)
+{
+    g_free (info->name);
+    g_free (info->desc);
+    g_free (info->magic);
+    g_free (info->random_key);
+    g_free (info);
+}
+
+static int
+save_repo_info (SeafDB *db, const char *repo_id, SeafCommit *commit)
+{
+    gboolean exists, err;
+    const char *sql;
+
+    if (seaf_db_type(db) == SEAF_DB_TYPE_PGSQL) {
+        exists = seaf_db_statement_exists (db,
+                                           "SELECT repo_id FROM RepoInfo "
+                                           "WHERE repo_id=?",
+                                           &err, 1, "string", repo_id);
+        if (err)
+            return -1;
+
+        if (exists)
+            sql = "UPDATE RepoInfo SET commit_id=?, name=?, description=?, "
+                "update_time=?, version=?, is_encrypted=?, enc_version=?, "
+                "magic=?, random_key=?, root_id=?, repaired=? WHERE repo_id=?";
+        else
+            sql = "INSERT INTO RepoInfo (commit_id, name, description, "
+                "update_time, version, is_encrypted, enc_version, magic, "
+                "random_key, root_id, repaired, repo_id) "
+                "VALUES (?, ?, ?, ?, ?, ?, ?, ?, ?, ?, ?, ?)";
+    } else {
+        sql = "REPLACE INTO RepoInfo (commit_id, name, description, "
+            "update_time, version, is_encrypted, enc_version, magic, "
+            "random_key, root_id, repaired, repo_id) "
+            "VALUES (?, ?, ?, ?, ?, ?, ?, ?, ?, ?, ?, ?)";
+    }
+
+    return seaf_db_statement_query (db, sql, 12,
+                                    "string", commit->commit_id,
+                                    "string", commit->repo_name,
+                                    "string", commit->repo_desc,
+                                    "int64", (gint64)commit->ctime,
+                                    "int", commit->version,
+                                    "int", commit->encrypted,
+                                    "int", commit->enc_version,
+                                    "string", commit->magic,
+                                    "string", commit->random_key,
+                                    "string", commit->root_id,
+                                    "int", commit->repaired,
+                                    "string", repo_id);
+}
+
+int
+seaf_repo_manager_update_repo_info (SeafRepoManager *mgr,
+                                    const char *repo_id,
+                                    const char *head_commit_id)
+{
+    SeafCommit *commit;
+    int ret;
+
+    commit = seaf_commit_manager_get_commit_compatible (mgr->seaf->commit_mgr,
+                                                        repo_id, head_commit_id);
+    if (!commit)
+        return -1;
+
+    ret = save_repo_info (mgr->seaf->db, repo_id, commit);
+    seaf_commit_unref (commit);
+    return ret;
+}
+
+static char *
+dup_column_text (SeafDBRow *row, int idx)
+{
+    const char *s = seaf_db_row_get_column_text (row, idx);
+    return s ? g_strdup (s) : NULL;
+}
+
+static gboolean
+collect_repo_info (SeafDBRow *row, void *data)
+{
+    GHashTable *infos = data;
+    const char *repo_id, *commit_id, *root_id;
+    RepoInfo *info;
+
+    repo_id = seaf_db_row_get_column_text (row, 0);
+    commit_id = seaf_db_row_get_column_text (row, 1);
+    root_id = seaf_db_row_get_column_text (row, 10);
+    if (!repo_id || !commit_id || !root_id)
+        return TRUE;
+
+    info = g_new0 (RepoInfo, 1);
+    g_strlcpy (info->commit_id, commit_id, sizeof(info->commit_id));
+    info->name = dup_column_text (row, 2);
+    info->desc = dup_column_text (row, 3);
+    info->update_time = seaf_db_row_get_column_int64 (row, 4);
+    info->version = seaf_db_row_get_column_int (row, 5);
+    info->encrypted = seaf_db_row_get_column_int (row, 6);
+    info->enc_version = seaf_db_row_get_column_int (row, 7);
+    info->magic = dup_column_text (row, 8);
+    info->random_key = dup_column_text (row, 9);
+    g_strlcpy (info->root_id, root_id, sizeof(info->root_id));
+    info->repaired = seaf_db_row_get_column_int (row, 11);
+
+    g_hash_table_replace (infos, g_strdup(repo_id), info);
+
+    return TRUE;
+}
+
+/* Look up the RepoInfo rows of @repos with one query per 100 repos. */
+static GHashTable *
+load_repo_infos (GList *repos)
+{
+    GHashTable *infos;
+    GList *ids = NULL, *p;
+    char *repo_id;
+
+    infos = g_hash_table_new_full (g_str_hash, g_str_equal,
+                                   g_free, (GDestroyNotify)repo_info_free);
+
+    for (p = repos; p; p = p->next) {
+        g_object_get (p->data, "repo_id", &repo_id, NULL);
+        ids = g_list_prepend (ids, repo_id);
+    }
+
+    if (seaf_db_statement_foreach_row_in (seaf->db,
+                                          "SELECT repo_id, commit_id, name, "
+                                          "description, update_time, version, "
+                                          "is_encrypted, enc_version, magic, "
+                                          "random_key, root_id, repaired "
+                                          "FROM RepoInfo WHERE repo_id IN (%s)",
+                                          ids, collect_repo_info, infos, 0) < 0)
+        g_hash_table_remove_all (infos);
+
+    string_list_free (ids);
+    return infos;
+}
+
+static void
+set_repo_obj_fields (SeafileRepo *repo, const RepoInfo *info)
+{
+    g_object_set (repo, "name", info->name, "desc", info->desc,
+                  "encrypted", info->encrypted, "magic", info->magic,
+                  "enc_version", info->enc_version, "root", info->root_id,
+                  "version", info->version, "last_modify", info->update_time,
+                  "repo_name", info->name, "repo_desc", info->desc,
+                  "last_modified", info->update_time,
+                  "repaired", info->repaired, NULL);
+    if (info->encrypted && info->enc_version == 2)
+        g_object_set (repo, "random_key", info->random_key, NULL);
+}
+
 void
 seaf_fill_repo_obj_from_commit (GList **repos)
 {
     SeafileRepo *repo;
     SeafCommit *commit;
+    GHashTable *infos;
+    RepoInfo *info, tmp;
     char *repo_id;
     char *commit_id;
     GList *p = *repos;
     GList *next;
 
+    if (!p)
+        return;
+
+    infos = load_repo_infos (*repos);
+
     while (p) {
         repo = p->data;
         g_object_get (repo, "repo_id", &repo_id, "head_cmmt_id", &commit_id, NULL);
+
+        info = g_hash_table_lookup (infos, repo_id);
+        if (info && g_strcmp0 (info->commit_id, commit_id) == 0) {
+            set_repo_obj_fields (repo, info);
+            p = p->next;
+            g_free (repo_id);
+            g_free (commit_id);
+            continue;
+        }
+
         commit = seaf_commit_manager_get_commit_compatible (seaf->commit_mgr,
                                                             repo_id, commit_id);
         if (!commit) {
@@ -2531,21 +3322,30 @@ seaf_fill_repo_obj_from_commit (GList **repos)
             *repos = g_list_delete_link (*repos, p);
             p = next;
         } else {
-            g_object_set (repo, "name", commit->repo_name, "desc", commit->repo_desc,
-                          "encrypted", commit->encrypted, "magic", commit->magic,
-                          "enc_version", commit->enc_version, "root", commit->root_id,
-                          "version", commit->version, "last_modify", commit->ctime,
-                          "repo_name", commit->repo_name, "repo_desc", commit->repo_desc,
-                          "last_modified", commit->ctime, "repaired", commit->repaired, NULL);
-            if (commit->encrypted && commit->enc_version == 2)
-                g_object_set (repo, "random_key", commit->random_key, NULL);
+            memset (&tmp, 0, sizeof(tmp));
+            tmp.name = commit->repo_name;
+            tmp.desc = commit->repo_desc;
+            tmp.update_time = commit->ctime;
+            tmp.version = commit->version;
+            tmp.encrypted = commit->encrypted;
+            tmp.enc_version = commit->enc_version;
+            tmp.magic = commit->magic;
+            tmp.random_key = commit->random_key;
+            memcpy (tmp.root_id, commit->root_id, 41);
+            tmp.repaired = commit->repaired;
+            set_repo_obj_fields (repo, &tmp);
+
+            if (save_repo_info (seaf->db, repo_id, commit) < 0)
+                seaf_warning ("Failed to save repo info of %s.\n", repo_id);
 
             p = p->next;
+            seaf_commit_unref (commit);
         }
         g_free (repo_id);
         g_free (commit_id);
-        seaf_commit_unref (commit);
     }
+
+    g_hash_table_destroy (infos);
 }
 
 GList *
@@ -2665,6 +3465,8 @@ seaf_repo_manager_remove_group_repos (SeafRepoManager *mgr,
                                       2, "int", group_id, "string", owner);
     }
 
+    seaf_repo_manager_invalidate_perm_cache (mgr);
+
     return rc;
 }
 
@@ -2677,6 +3479,7 @@ seaf_repo_manager_set_inner_pub_repo (SeafRepoManager *mgr,
 {
     SeafDB *db = mgr->seaf->db;
     char sql[256];
+    int rc;
 
     if (seaf_db_type(db) == SEAF_DB_TYPE_PGSQL) {
         gboolean err;
@@ -2693,23 +3496,30 @@ seaf_repo_manager_set_inner_pub_repo (SeafRepoManager *mgr,
                      "('%s', '%s')", repo_id, permission);
         if (err)
             return -1;
-        return seaf_db_query (db, sql);
+        rc = seaf_db_query (db, sql);
     } else {
-        return seaf_db_statement_query (db,
-                                        "REPLACE INTO InnerPubRepo VALUES (?, ?)",
-                                        2, "string", repo_id, "string", permission);
+        rc = seaf_db_statement_query (db,
+                                      "REPLACE INTO InnerPubRepo VALUES (?, ?)",
+                                      2, "string", repo_id, "string", permission);
     }
 
-    return -1;
+    seaf_repo_manager_invalidate_perm_cache (mgr);
+
+    return rc;
 }
 
 int
 seaf_repo_manager_unset_inner_pub_repo (SeafRepoManager *mgr,
                                         const char *repo_id)
 {
-    return seaf_db_statement_query (mgr->seaf->db,
-                                    "DELETE FROM InnerPubRepo WHERE repo_id = ?",
-                                    1, "string", repo_id);
+    int rc;
+
+    rc = seaf_db_statement_query (mgr->seaf->db,
+                                  "DELETE FROM InnerPubRepo WHERE repo_id = ?",
+                                  1, "string", repo_id);
+    seaf_repo_manager_invalidate_perm_cache (mgr);
+
+    return rc;
 }
 
 gboolean
@@ -2909,7 +3719,7 @@ create_repo_common (SeafRepoManager *mgr,
         memcpy (repo->random_key, random_key, 96);
     }
 
-    repo->version = CURRENT_REPO_VERSION;
+    repo->version = mgr->priv->new_repo_version;
     memcpy (repo->store_id, repo_id, 36);
 
     commit = seaf_commit_new (NULL, repo->id,
@@ -3,6 +3,8 @@
 #ifndef SEAF_REPO_MGR_H
 #define SEAF_REPO_MGR_H
 
+#include <jansson.h>
+
 #include "seafile-object.h"
 #include "commit-mgr.h"
 #include "branch-mgr.h"
@@ -18,6 +20,11 @@
 #define REPO_REMOTE_HEAD      "remote-head"
 #define REPO_ENCRYPTED 0x1
 
+/* Descriptions of the commits that delete files or dirs. */
+#define PREFIX_DEL_FILE "Deleted \""
+#define PREFIX_DEL_DIR "Removed directory \""
+#define PREFIX_DEL_DIRS "Removed \""
+
 struct _SeafRepoManager;
 typedef struct _SeafRepo SeafRepo;
 
@@ -83,9 +90,18 @@ seaf_repo_set_head (SeafRepo *repo, SeafBranch *branch);
 void
 seaf_repo_from_commit (SeafRepo *repo, SeafCommit *commit);
 
+/* Fill in the head commit fields of @repos, mostly from the RepoInfo table.
+ * Repos whose head commit can't be loaded are removed from the list.
+ */
 void
 seaf_fill_repo_obj_from_commit (GList **repos);
 
+/* Save the listing fields of @head_commit_id to the RepoInfo table. */
+int
+seaf_repo_manager_update_repo_info (struct _SeafRepoManager *mgr,
+                                    const char *repo_id,
+                                    const char *head_commit_id);
+
 /* Update repo-related fields to commit. 
  */
 void
@@ -134,9 +150,18 @@ int
 seaf_repo_manager_del_virtual_repo (SeafRepoManager *mgr,
                                     const char *repo_id);
 
+/* Repos are cached for a few seconds and shared between callers, so
+ * the returned repo must not be modified.
+ */
 SeafRepo* 
 seaf_repo_manager_get_repo (SeafRepoManager *manager, const gchar *id);
 
+/* Drop the cached repo. Called whenever the branches, size or existence
+ * of a repo change.
+ */
+void
+seaf_repo_manager_invalidate_repo (SeafRepoManager *manager, const char *repo_id);
+
 /* Return repo object even if it's corrupted. */
 SeafRepo*
 seaf_repo_manager_get_repo_ex (SeafRepoManager *manager, const gchar *id);
@@ -147,6 +172,21 @@ seaf_repo_manager_repo_exists (SeafRepoManager *manager, const gchar *id);
 GList* 
 seaf_repo_manager_get_repo_list (SeafRepoManager *mgr, int start, int limit);
 
+/*
+ * Keyset pagination: up to @limit repos with ids after @after_repo_id
+ * (NULL or "" for the first page), in repo id order. Pass the id of the
+ * last repo of a page to get the next one. Pages are found through the
+ * primary key, so deep pages cost the same as the first.
+ *
+ * Returns SeafileRepo objects, filled from RepoInfo like the other
+ * listings.
+ */
+GList *
+seaf_repo_manager_get_repo_list_after (SeafRepoManager *mgr,
+                                       const char *after_repo_id,
+                                       int limit,
+                                       GError **error);
+
 gint64
 seaf_repo_manager_count_repos (SeafRepoManager *mgr, GError **error);
 
@@ -156,6 +196,13 @@ seaf_repo_manager_get_trash_repo_list (SeafRepoManager *mgr,
                                        int limit,
                                        GError **error);
 
+/* Like seaf_repo_manager_get_repo_list_after(), for trashed repos. */
+GList *
+seaf_repo_manager_get_trash_repo_list_after (SeafRepoManager *mgr,
+                                             const char *after_repo_id,
+                                             int limit,
+                                             GError **error);
+
 GList *
 seaf_repo_manager_get_trash_repos_by_owner (SeafRepoManager *mgr,
                                             const char *owner,
@@ -251,6 +298,14 @@ seaf_repo_manager_delete_repo_tokens_by_email (SeafRepoManager *mgr,
 gint64
 seaf_repo_manager_get_repo_size (SeafRepoManager *mgr, const char *repo_id);
 
+/*
+ * Look up the head, name, owner and size of many repos with a few
+ * queries. Returns a JSON object of repo_id -> summary, without the
+ * repos that don't exist, or NULL on error.
+ */
+json_t *
+seaf_repo_manager_get_repo_summaries (SeafRepoManager *mgr, GList *repo_ids);
+
 int
 seaf_repo_manager_set_repo_history_limit (SeafRepoManager *mgr,
                                           const char *repo_id,
@@ -324,6 +379,24 @@ seaf_repo_manager_post_multi_files (SeafRepoManager *mgr,
                                     char **new_ids,
                                     GError **error);
 
+/*
+ * Like seaf_repo_manager_post_multi_files(), for files already indexed
+ * into the repo's store, e.g. streamed in by an upload. @id_list holds
+ * the hex file ids and @size_list the sizes (gint64 *), in the order of
+ * @filenames.
+ */
+int
+seaf_repo_manager_post_indexed_files (SeafRepoManager *mgr,
+                                      const char *repo_id,
+                                      const char *parent_dir,
+                                      GList *filenames,
+                                      GList *id_list,
+                                      GList *size_list,
+                                      const char *user,
+                                      int replace_existed,
+                                      char **ret_json,
+                                      GError **error);
+
 int
 seaf_repo_manager_post_file_blocks (SeafRepoManager *mgr,
                                     const char *repo_id,
@@ -643,6 +716,24 @@ seaf_repo_manager_check_permission (SeafRepoManager *mgr,
                                     const char *user,
                                     GError **error);
 
+/*
+ * Check the permissions of @user on many repos with a few queries.
+ * Returns a table of repo_id -> permission for the repos @user can
+ * access, or NULL on error.
+ */
+GHashTable *
+seaf_repo_manager_check_permissions (SeafRepoManager *mgr,
+                                     GList *repo_ids,
+                                     const char *user,
+                                     GError **error);
+
+void
+seaf_repo_manager_init_perm_cache (SeafRepoManager *mgr, GKeyFile *config);
+
+/* Called whenever an owner or a share of any repo changes. */
+void
+seaf_repo_manager_invalidate_perm_cache (SeafRepoManager *mgr);
+
 GList *
 seaf_repo_manager_list_dir_with_perm (SeafRepoManager *mgr,
                                       const char *repo_id,
@@ -653,6 +744,17 @@ seaf_repo_manager_list_dir_with_perm (SeafRepoManager *mgr,
                                       int limit,
                                       GError **error);
 
+/* A page of the dir, see seaf_fs_manager_list_dirents(). */
+GList *
+seaf_repo_manager_list_dir_page_with_perm (SeafRepoManager *mgr,
+                                           const char *repo_id,
+                                           const char *dir_path,
+                                           const char *dir_id,
+                                           const char *user,
+                                           int offset,
+                                           int limit,
+                                           GError **error);
+
 /* Web access permission. */
 
 int
@@ -736,4 +838,8 @@ seaf_repo_manager_cleanup_virtual_repos (SeafRepoManager *mgr,
 int
 seaf_repo_manager_init_merge_scheduler ();
 
+/* Virtual repo merges waiting and running. */
+void
+seaf_repo_manager_get_merge_stats (int *n_queued, int *n_running);
+
 #endif
@@ -3,6 +3,7 @@
 #include "common.h"
 
 #include <glib/gstdio.h>
+#include <pthread.h>
 
 #include <jansson.h>
 #include <openssl/sha.h>
@@ -30,10 +31,6 @@
 
 #define INDEX_DIR "index"
 
-#define PREFIX_DEL_FILE "Deleted \""
-#define PREFIX_DEL_DIR "Removed directory \""
-#define PREFIX_DEL_DIRS "Removed \""
-
 gboolean
 should_ignore_file(const char *filename, void *data);
 
@@ -413,20 +410,15 @@ gen_merge_description (SeafRepo *repo,
                        const char *p1_root,
                        const char *p2_root)
 {
-    GList *p;
-    GList *results = NULL;
+    DiffResults *results = diff_results_new ();
     char *desc;
-    
-    diff_merge_roots (repo->store_id, repo->version,
-                      merged_root, p1_root, p2_root, &results, TRUE);
 
-    desc = diff_results_to_description (results);
+    diff_merge_roots_array (repo->store_id, repo->version,
+                            merged_root, p1_root, p2_root, results, TRUE);
 
-    for (p = results; p; p = p->next) {
-        DiffEntry *de = p->data;
-        diff_entry_free (de);
-    }
-    g_list_free (results);
+    desc = diff_results_array_to_description (results);
+
+    diff_results_free (results);
 
     return desc;
 }
@@ -492,6 +484,7 @@ retry:
         memcpy (opt.remote_repo_id, repo_id, 36);
         memcpy (opt.remote_head, new_commit->commit_id, 40);
         opt.do_merge = TRUE;
+        opt.parallel = TRUE;
 
         roots[0] = base->root_id; /* base */
         roots[1] = current_head->root_id; /* head */
@@ -594,6 +587,236 @@ update_repo_size(const char *repo_id)
     schedule_repo_size_computation (seaf->size_sched, repo_id);
 }
 
+/*
+ * Uploads into the same repo are committed in groups. While one upload
+ * is committing, the ones arriving for the repo queue up; when it's done,
+ * the next caller in line applies all queued uploads to one new root and
+ * commits that, instead of every upload making its own commit and racing
+ * the others for the branch. Uploads of different users go into separate
+ * commits, so their history is kept apart. Each caller gets its own
+ * result back.
+ */
+
+typedef struct PostJob {
+    const char *canon_path;
+    GList *filenames;
+    GList *id_list;
+    GList *size_list;
+    const char *user;
+    int replace_existed;
+    const char *desc;           /* if committed alone */
+
+    /* Results. */
+    GList *name_list;
+    int ret;
+    GError *error;
+    gboolean done;
+} PostJob;
+
+typedef struct RepoPostQueue {
+    GQueue *jobs;
+    gboolean committing;
+} RepoPostQueue;
+
+static GHashTable *post_queues;     /* repo id -> RepoPostQueue */
+static pthread_mutex_t post_queues_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t post_queues_cond = PTHREAD_COND_INITIALIZER;
+
+static char *
+do_post_multi_files (SeafRepo *repo,
+                     const char *root_id,
+                     const char *parent_dir,
+                     GList *filenames,
+                     GList *id_list,
+                     GList *size_list,
+                     const char *user,
+                     int replace_existed,
+                     GList **name_list);
+
+static void
+fail_post_job (PostJob *job, const GError *error)
+{
+    job->ret = -1;
+    if (!job->error)
+        job->error = g_error_copy (error);
+    string_list_free (job->name_list);
+    job->name_list = NULL;
+}
+
+/* Commit the jobs in @group, all from the same user, as one commit. */
+static void
+commit_post_group (const char *repo_id, GList *group)
+{
+    SeafRepo *repo = NULL;
+    SeafCommit *head_commit = NULL;
+    GList *ptr, *committed = NULL;
+    PostJob *job, *first = NULL;
+    char *root_id, *new_root;
+    guint n_files = 0;
+    GString *desc = g_string_new (NULL);
+    GError *error = NULL;
+
+    repo = seaf_repo_manager_get_repo (seaf->repo_mgr, repo_id);
+    if (repo)
+        head_commit = seaf_commit_manager_get_commit (seaf->commit_mgr,
+                                                      repo->id, repo->version,
+                                                      repo->head->commit_id);
+    if (!head_commit) {
+        seaf_warning ("Failed to get head commit of repo %s.\n", repo_id);
+        g_set_error (&error, SEAFILE_DOMAIN, SEAF_ERR_BAD_ARGS, "Invalid repo");
+        for (ptr = group; ptr; ptr = ptr->next)
+            fail_post_job (ptr->data, error);
+        goto out;
+    }
+
+    root_id = g_strdup (head_commit->root_id);
+    for (ptr = group; ptr; ptr = ptr->next) {
+        job = ptr->data;
+        new_root = do_post_multi_files (repo, root_id, job->canon_path,
+                                        job->filenames, job->id_list,
+                                        job->size_list, job->user,
+                                        job->replace_existed,
+                                        &job->name_list);
+        if (!new_root) {
+            seaf_warning ("[post file] Failed to put file.\n");
+            job->ret = -1;
+            g_set_error (&job->error, SEAFILE_DOMAIN, SEAF_ERR_INTERNAL,
+                         "Failed to put file");
+            string_list_free (job->name_list);
+            job->name_list = NULL;
+            continue;
+        }
+        g_free (root_id);
+        root_id = new_root;
+
+        if (!first)
+            first = job;
+        n_files += g_list_length (job->filenames);
+        committed = g_list_prepend (committed, job);
+    }
+
+    if (!committed) {
+        g_free (root_id);
+        goto out;
+    }
+
+    if (!committed->next)
+        g_string_assign (desc, first->desc);
+    else
+        g_string_printf (desc, "Added \"%s\" and %u more files.",
+                         (char *)(first->filenames->data), n_files - 1);
+
+    if (gen_new_commit (repo_id, head_commit, root_id,
+                        first->user, desc->str, NULL, &error) < 0) {
+        for (ptr = committed; ptr; ptr = ptr->next)
+            fail_post_job (ptr->data, error);
+    } else {
+        seaf_repo_manager_merge_virtual_repo (seaf->repo_mgr, repo_id, NULL);
+    }
+    g_free (root_id);
+
+out:
+    g_clear_error (&error);
+    g_list_free (committed);
+    g_string_free (desc, TRUE);
+    if (head_commit)
+        seaf_commit_unref (head_commit);
+    if (repo)
+        seaf_repo_unref (repo);
+}
+
+static void
+commit_post_jobs (const char *repo_id, GList *jobs)
+{
+    GList *group, *rest, *ptr, *next;
+    PostJob *job;
+    const char *user;
+
+    while (jobs) {
+        user = ((PostJob *)jobs->data)->user;
+        group = NULL;
+        rest = NULL;
+        for (ptr = jobs; ptr; ptr = next) {
+            next = ptr->next;
+            job = ptr->data;
+            if (g_strcmp0 (job->user, user) == 0)
+                group = g_list_prepend (group, job);
+            else
+                rest = g_list_prepend (rest, job);
+        }
+        g_list_free (jobs);
+
+        commit_post_group (repo_id, g_list_reverse (group));
+        g_list_free (group);
+
+        jobs = g_list_reverse (rest);
+    }
+}
+
+/*
+ * Queue @job for @repo_id and wait until it's committed, committing it
+ * and the jobs queued with it if nobody else is.
+ */
+static int
+run_post_job (const char *repo_id, PostJob *job)
+{
+    RepoPostQueue *queue;
+    GList *jobs, *ptr;
+    PostJob *queued;
+
+    pthread_mutex_lock (&post_queues_lock);
+
+    if (!post_queues)
+        post_queues = g_hash_table_new_full (g_str_hash, g_str_equal,
+                                             g_free, g_free);
+    queue = g_hash_table_lookup (post_queues, repo_id);
+    if (!queue) {
+        queue = g_new0 (RepoPostQueue, 1);
+        queue->jobs = g_queue_new ();
+        g_hash_table_insert (post_queues, g_strdup(repo_id), queue);
+    }
+    g_queue_push_tail (queue->jobs, job);
+
+    while (!job->done) {
+        if (queue->committing) {
+            pthread_cond_wait (&post_queues_cond, &post_queues_lock);
+            continue;
+        }
+
+        queue->committing = TRUE;
+        jobs = NULL;
+        while ((queued = g_queue_pop_head (queue->jobs)) != NULL)
+            jobs = g_list_prepend (jobs, queued);
+        jobs = g_list_reverse (jobs);
+        pthread_mutex_unlock (&post_queues_lock);
+
+        if (g_list_length (jobs) > 1)
+            seaf_debug ("Committing %u uploads to repo %.8s together.\n",
+                        g_list_length (jobs), repo_id);
+        commit_post_jobs (repo_id, g_list_copy (jobs));
+
+        pthread_mutex_lock (&post_queues_lock);
+        for (ptr = jobs; ptr; ptr = ptr->next)
+            ((PostJob *)ptr->data)->done = TRUE;
+        g_list_free (jobs);
+        queue->committing = FALSE;
+        pthread_cond_broadcast (&post_queues_cond);
+    }
+
+    /* The last one out drops the queue. Look it up again, it may be
+     * gone already if another caller committed this job.
+     */
+    queue = g_hash_table_lookup (post_queues, repo_id);
+    if (queue && !queue->committing && g_queue_is_empty (queue->jobs)) {
+        g_queue_free (queue->jobs);
+        g_hash_table_remove (post_queues, repo_id);
+    }
+
+    pthread_mutex_unlock (&post_queues_lock);
+
+    return job->ret;
+}
+
 int
 seaf_repo_manager_post_file (SeafRepoManager *mgr,
                              const char *repo_id,
@@ -604,16 +827,16 @@ seaf_repo_manager_post_file (SeafRepoManager *mgr,
                              GError **error)
 {
     SeafRepo *repo = NULL;
-    SeafCommit *head_commit = NULL;
     char *canon_path = NULL;
     unsigned char sha1[20];
     char buf[SEAF_PATH_MAX];
-    char *root_id = NULL;
     SeafileCrypt *crypt = NULL;
-    SeafDirent *new_dent = NULL;
     char hex[41];
+    PostJob job;
     int ret = 0;
 
+    memset (&job, 0, sizeof(job));
+
     if (g_access (temp_file_path, R_OK) != 0) {
         seaf_warning ("[post file] File %s doesn't exist or not readable.\n",
                       temp_file_path);
@@ -623,7 +846,6 @@ seaf_repo_manager_post_file (SeafRepoManager *mgr,
     }
 
     GET_REPO_OR_FAIL(repo, repo_id);
-    GET_COMMIT_OR_FAIL(head_commit, repo->id, repo->version, repo->head->commit_id);
 
     if (!canon_path)
         canon_path = get_canonical_path (parent_dir);
@@ -672,36 +894,26 @@ seaf_repo_manager_post_file (SeafRepoManager *mgr,
     }
 
     rawdata_to_hex(sha1, hex, 20);
-    new_dent = seaf_dirent_new (dir_version_from_repo_version (repo->version),
-                                hex, STD_FILE_MODE, file_name,
-                                (gint64)time(NULL), user, size);
-
-    root_id = do_post_file (repo,
-                            head_commit->root_id, canon_path, new_dent);
-    if (!root_id) {
-        seaf_warning ("[post file] Failed to put file.\n");
-        g_set_error (error, SEAFILE_DOMAIN, SEAF_ERR_GENERAL,
-                     "Failed to put file");
-        ret = -1;
-        goto out;
-    }
-
     snprintf(buf, SEAF_PATH_MAX, "Added \"%s\"", file_name);
-    if (gen_new_commit (repo_id, head_commit, root_id,
-                        user, buf, NULL, error) < 0) {
-        ret = -1;
-        goto out;
-    }
 
-    seaf_repo_manager_merge_virtual_repo (mgr, repo_id, NULL);
+    job.canon_path = canon_path;
+    job.filenames = g_list_prepend (NULL, (char *)file_name);
+    job.id_list = g_list_prepend (NULL, hex);
+    job.size_list = g_list_prepend (NULL, &size);
+    job.user = user;
+    job.desc = buf;
+
+    ret = run_post_job (repo->id, &job);
+    if (ret < 0)
+        g_propagate_error (error, job.error);
 
 out:
     if (repo)
         seaf_repo_unref (repo);
-    if (head_commit)
-        seaf_commit_unref(head_commit);
-    seaf_dirent_free (new_dent);
-    g_free (root_id);
+    g_list_free (job.filenames);
+    g_list_free (job.id_list);
+    g_list_free (job.size_list);
+    string_list_free (job.name_list);
     g_free (canon_path);
     g_free (crypt);
 
@@ -946,6 +1158,75 @@ format_json_ret (GList *name_list, GList *id_list, GList *size_list)
     return ret;
 }
 
+static int
+check_post_files_args (GList *filenames, const char *parent_dir, GError **error)
+{
+    GList *ptr;
+    char *filename;
+
+    for (ptr = filenames; ptr; ptr = ptr->next) {
+        filename = ptr->data;
+        if (should_ignore_file (filename, NULL)) {
+            seaf_warning ("[post files] Invalid filename %s.\n", filename);
+            g_set_error (error, SEAFILE_DOMAIN, POST_FILE_ERR_FILENAME,
+                         "%s", filename);
+            return -1;
+        }
+    }
+
+    if (strstr (parent_dir, "//") != NULL) {
+        seaf_warning ("[post file] parent_dir cantains // sequence.\n");
+        g_set_error (error, SEAFILE_DOMAIN, SEAF_ERR_BAD_ARGS,
+                     "Invalid parent dir");
+        return -1;
+    }
+
+    return 0;
+}
+
+/* Add the indexed files to parent dir and commit. */
+static int
+commit_posted_files (SeafRepo *repo,
+                     const char *canon_path,
+                     GList *filenames,
+                     GList *id_list,
+                     GList *size_list,
+                     const char *user,
+                     int replace_existed,
+                     char **ret_json,
+                     GError **error)
+{
+    GString *buf = g_string_new (NULL);
+    PostJob job;
+    int ret;
+
+    guint len = g_list_length (filenames);
+    if (len > 1)
+        g_string_printf (buf, "Added \"%s\" and %u more files.",
+                         (char *)(filenames->data), len - 1);
+    else
+        g_string_printf (buf, "Added \"%s\".", (char *)(filenames->data));
+
+    memset (&job, 0, sizeof(job));
+    job.canon_path = canon_path;
+    job.filenames = filenames;
+    job.id_list = id_list;
+    job.size_list = size_list;
+    job.user = user;
+    job.replace_existed = replace_existed;
+    job.desc = buf->str;
+
+    ret = run_post_job (repo->id, &job);
+    if (ret < 0)
+        g_propagate_error (error, job.error);
+    else if (ret_json)
+        *ret_json = format_json_ret (job.name_list, id_list, size_list);
+
+    string_list_free (job.name_list);
+    g_string_free (buf, TRUE);
+    return ret;
+}
+
 int
 seaf_repo_manager_post_multi_files (SeafRepoManager *mgr,
                                     const char *repo_id,
@@ -958,20 +1239,16 @@ seaf_repo_manager_post_multi_files (SeafRepoManager *mgr,
                                     GError **error)
 {
     SeafRepo *repo = NULL;
-    SeafCommit *head_commit = NULL;
     char *canon_path = NULL;
-    GList *filenames = NULL, *paths = NULL, *id_list = NULL, *name_list = NULL,
+    GList *filenames = NULL, *paths = NULL, *id_list = NULL,
         *size_list = NULL, *ptr;
-    char *filename, *path;
+    char *path;
     unsigned char sha1[20];
-    GString *buf = g_string_new (NULL);
-    char *root_id = NULL;
     SeafileCrypt *crypt = NULL;
     char hex[41];
     int ret = 0;
 
     GET_REPO_OR_FAIL(repo, repo_id);
-    GET_COMMIT_OR_FAIL(head_commit, repo->id, repo->version, repo->head->commit_id);
 
     canon_path = get_canonical_path (parent_dir);
 
@@ -986,21 +1263,7 @@ seaf_repo_manager_post_multi_files (SeafRepoManager *mgr,
     }
 
     /* Check inputs. */
-    for (ptr = filenames; ptr; ptr = ptr->next) {
-        filename = ptr->data;
-        if (should_ignore_file (filename, NULL)) {
-            seaf_warning ("[post files] Invalid filename %s.\n", filename);
-            g_set_error (error, SEAFILE_DOMAIN, POST_FILE_ERR_FILENAME,
-                         "%s", filename);
-            ret = -1;
-            goto out;
-        }
-    }
-
-    if (strstr (parent_dir, "//") != NULL) {
-        seaf_warning ("[post file] parent_dir cantains // sequence.\n");
-        g_set_error (error, SEAFILE_DOMAIN, SEAF_ERR_BAD_ARGS,
-                     "Invalid parent dir");
+    if (check_post_files_args (filenames, parent_dir, error) < 0) {
         ret = -1;
         goto out;
     }
@@ -1031,6 +1294,7 @@ seaf_repo_manager_post_multi_files (SeafRepoManager *mgr,
             seaf_warning ("failed to index blocks");
             g_set_error (error, SEAFILE_DOMAIN, SEAF_ERR_GENERAL,
                          "Failed to index blocks");
+            g_free (size);
             ret = -1;
             goto out;
         }
@@ -1042,52 +1306,69 @@ seaf_repo_manager_post_multi_files (SeafRepoManager *mgr,
     id_list = g_list_reverse (id_list);
     size_list = g_list_reverse (size_list);
 
-    /* Add the files to parent dir and commit. */
-    root_id = do_post_multi_files (repo, head_commit->root_id, canon_path,
-                                   filenames, id_list, size_list, user,
-                                   replace_existed, &name_list);
-    if (!root_id) {
-        seaf_warning ("[post file] Failed to put file.\n");
-        g_set_error (error, SEAFILE_DOMAIN, SEAF_ERR_INTERNAL,
-                     "Failed to put file");
+    ret = commit_posted_files (repo, canon_path,
+                               filenames, id_list, size_list, user,
+                               replace_existed, ret_json, error);
+
+out:
+    if (repo)
+        seaf_repo_unref (repo);
+    string_list_free (filenames);
+    string_list_free (paths);
+    string_list_free (id_list);
+    for (ptr = size_list; ptr; ptr = ptr->next)
+        g_free (ptr->data);
+    g_list_free (size_list);
+    g_free (canon_path);
+    g_free (crypt);
+
+    if (ret == 0)
+        update_repo_size(repo_id);
+
+    return ret;
+}
+
+int
+seaf_repo_manager_post_indexed_files (SeafRepoManager *mgr,
+                                      const char *repo_id,
+                                      const char *parent_dir,
+                                      GList *filenames,
+                                      GList *id_list,
+                                      GList *size_list,
+                                      const char *user,
+                                      int replace_existed,
+                                      char **ret_json,
+                                      GError **error)
+{
+    SeafRepo *repo = NULL;
+    char *canon_path = NULL;
+    int ret = 0;
+
+    GET_REPO_OR_FAIL(repo, repo_id);
+
+    canon_path = get_canonical_path (parent_dir);
+
+    if (!filenames || g_list_length (filenames) != g_list_length (id_list) ||
+        g_list_length (id_list) != g_list_length (size_list)) {
+        seaf_warning ("[post files] Invalid filenames or file ids.\n");
+        g_set_error (error, SEAFILE_DOMAIN, SEAF_ERR_BAD_ARGS, "Invalid files");
         ret = -1;
         goto out;
     }
 
-    guint len = g_list_length (filenames);
-    if (len > 1)
-        g_string_printf (buf, "Added \"%s\" and %u more files.",
-                         (char *)(filenames->data), len - 1);
-    else
-        g_string_printf (buf, "Added \"%s\".", (char *)(filenames->data));
-
-    if (gen_new_commit (repo_id, head_commit, root_id,
-                        user, buf->str, NULL, error) < 0) {
+    if (check_post_files_args (filenames, parent_dir, error) < 0) {
         ret = -1;
         goto out;
     }
 
-    seaf_repo_manager_merge_virtual_repo (mgr, repo_id, NULL);
-
-    if (ret_json)
-        *ret_json = format_json_ret (name_list, id_list, size_list);
+    ret = commit_posted_files (repo, canon_path,
+                               filenames, id_list, size_list, user,
+                               replace_existed, ret_json, error);
 
 out:
     if (repo)
         seaf_repo_unref (repo);
-    if (head_commit)
-        seaf_commit_unref(head_commit);
-    string_list_free (filenames);
-    string_list_free (paths);
-    string_list_free (id_list);
-    string_list_free (name_list);
-    for (ptr = size_list; ptr; ptr = ptr->next)
-        g_free (ptr->data);
-    g_list_free (size_list);
-    g_string_free (buf, TRUE);
-    g_free (root_id);
     g_free (canon_path);
-    g_free (crypt);
 
     if (ret == 0)
         update_repo_size(repo_id);
@@ -1488,7 +1769,7 @@ out:
 
 static char *
 copy_seafile (SeafRepo *src_repo, SeafRepo *dst_repo, const char *file_id,
-              CopyTask *task, guint64 *size)
+              CopyTask *task, BlockCopy *blocks, guint64 *size)
 {
     Seafile *file;
 
@@ -1515,21 +1796,16 @@ copy_seafile (SeafRepo *src_repo, SeafRepo *dst_repo, const char *file_id,
     }
 
     int i;
-    char *block_id;
+    gint64 bytes, counted = 0;
     for (i = 0; i < file->n_blocks; ++i) {
-        /* Check cancel before copying a block. */
-        if (task && g_atomic_int_get (&task->canceled)) {
-            seafile_unref (file);
-            return NULL;
-        }
+        /* Block sizes aren't kept in the file object, so progress counts
+         * an even share of the file size for each block.
+         */
+        bytes = file->file_size * (i + 1) / file->n_blocks - counted;
+        counted += bytes;
 
-        block_id = file->blk_sha1s[i];
-        if (seaf_block_manager_copy_block (seaf->block_mgr,
-                                           src_repo->store_id, src_repo->version,
-                                           dst_repo->store_id, dst_repo->version,
-                                           block_id) < 0) {
-            seaf_warning ("Failed to copy block %s from repo %s to %s.\n",
-                          block_id, src_repo->id, dst_repo->id);
+        /* Fails once the task is canceled. */
+        if (seaf_block_copy_add (blocks, file->blk_sha1s[i], bytes) < 0) {
             seafile_unref (file);
             return NULL;
         }
@@ -1548,10 +1824,10 @@ copy_seafile (SeafRepo *src_repo, SeafRepo *dst_repo, const char *file_id,
 static char *
 copy_recursive (SeafRepo *src_repo, SeafRepo *dst_repo,
                 const char *obj_id, guint32 mode, const char *modifier,
-                CopyTask *task, guint64 *size)
+                CopyTask *task, BlockCopy *blocks, guint64 *size)
 {
     if (S_ISREG(mode)) {
-        return copy_seafile (src_repo, dst_repo, obj_id, task, size);
+        return copy_seafile (src_repo, dst_repo, obj_id, task, blocks, size);
     } else if (S_ISDIR(mode)) {
         SeafDir *src_dir = NULL, *dst_dir = NULL;
         GList *dst_ents = NULL, *ptr;
@@ -1573,7 +1849,8 @@ copy_recursive (SeafRepo *src_repo, SeafRepo *dst_repo,
 
             guint64 new_size = 0;
             new_id = copy_recursive (src_repo, dst_repo,
-                                     dent->id, dent->mode, modifier, task, &new_size);
+                                     dent->id, dent->mode, modifier, task,
+                                     blocks, &new_size);
             if (!new_id) {
                 seaf_dir_free (src_dir);
                 return NULL;
@@ -1642,9 +1919,20 @@ cross_repo_copy (const char *src_repo_id,
     }
 
     guint64 new_size = 0;
+    BlockCopy *blocks = seaf_copy_manager_start_block_copy (seaf->copy_mgr,
+                                                            src_repo->store_id,
+                                                            src_repo->version,
+                                                            dst_repo->store_id,
+                                                            dst_repo->version,
+                                                            task);
     char *new_id = copy_recursive (src_repo, dst_repo,
                                    src_dent->id, src_dent->mode, modifier, task,
-                                   &new_size);
+                                   blocks, &new_size);
+    /* The fs objects are saved, but the blocks may still be copying. */
+    if (seaf_block_copy_finish (blocks) < 0) {
+        g_free (new_id);
+        new_id = NULL;
+    }
     if (!new_id) {
         ret = -1;
         goto out;
@@ -1689,21 +1977,21 @@ out:
     return ret;
 }
 
+/*
+ * Repos that keep their objects in the same store, such as a virtual repo
+ * and its origin or two virtual repos of the same origin. A dirent can be
+ * copied between them as is, without copying any fs object or block.
+ */
 static gboolean
-is_virtual_repo_and_origin (SeafRepo *repo1, SeafRepo *repo2)
+repos_share_store (SeafRepo *repo1, SeafRepo *repo2)
 {
-    if (repo1->virtual_info &&
-        strcmp (repo1->virtual_info->origin_repo_id, repo2->id) == 0)
-        return TRUE;
-    if (repo2->virtual_info &&
-        strcmp (repo2->virtual_info->origin_repo_id, repo1->id) == 0)
-        return TRUE;
-    return FALSE;
+    return (repo1->version == repo2->version &&
+            strcmp (repo1->store_id, repo2->store_id) == 0);
 }
 
 static gboolean
 check_file_count_and_size (SeafRepo *repo, SeafDirent *dent, gint64 total_files,
-                           GError **error)
+                           gint64 *total_bytes, GError **error)
 {
     if (seaf->copy_mgr->max_files > 0 &&
         total_files > seaf->copy_mgr->max_files) {
@@ -1712,7 +2000,8 @@ check_file_count_and_size (SeafRepo *repo, SeafDirent *dent, gint64 total_files,
         return FALSE;
     }
 
-    if (seaf->copy_mgr->max_size > 0) {
+    /* @total_bytes is set for progress, if not NULL. */
+    if (seaf->copy_mgr->max_size > 0 || total_bytes) {
         gint64 size = -1;
 
         if (S_ISREG(dent->mode)) {
@@ -1734,11 +2023,15 @@ check_file_count_and_size (SeafRepo *repo, SeafDirent *dent, gint64 total_files,
             return FALSE;
         }
 
-        if (size > seaf->copy_mgr->max_size) {
+        if (seaf->copy_mgr->max_size > 0 &&
+            size > seaf->copy_mgr->max_size) {
             g_set_error (error, SEAFILE_DOMAIN, SEAF_ERR_GENERAL,
                          "Folder or file size is too large");
             return FALSE;
         }
+
+        if (total_bytes)
+            *total_bytes = size;
     }
 
     return TRUE;
@@ -1811,7 +2104,7 @@ seaf_repo_manager_copy_file (SeafRepoManager *mgr,
     }
 
     if (strcmp (src_repo_id, dst_repo_id) == 0 ||
-        is_virtual_repo_and_origin (src_repo, dst_repo)) {
+        repos_share_store (src_repo, dst_repo)) {
 
         gint64 file_size = (src_dent->version > 0) ? src_dent->size : -1;
 
@@ -1852,7 +2145,10 @@ seaf_repo_manager_copy_file (SeafRepoManager *mgr,
             goto out;
         }
 
-        if (!check_file_count_and_size (src_repo, src_dent, total_files, error)) {
+        gint64 total_bytes = 0;
+        if (!check_file_count_and_size (src_repo, src_dent, total_files,
+                                        need_progress ? &total_bytes : NULL,
+                                        error)) {
             ret = -1;
             goto out;
         }
@@ -1866,6 +2162,7 @@ seaf_repo_manager_copy_file (SeafRepoManager *mgr,
                                               dst_filename,
                                               user,
                                               total_files,
+                                              total_bytes,
                                               cross_repo_copy,
                                               need_progress);
         if (need_progress && !task_id) {
@@ -2004,9 +2301,20 @@ cross_repo_move (const char *src_repo_id,
     }
 
     guint64 new_size = 0;
+    BlockCopy *blocks = seaf_copy_manager_start_block_copy (seaf->copy_mgr,
+                                                            src_repo->store_id,
+                                                            src_repo->version,
+                                                            dst_repo->store_id,
+                                                            dst_repo->version,
+                                                            task);
     char *new_id = copy_recursive (src_repo, dst_repo,
                                    src_dent->id, src_dent->mode, modifier, task,
-                                   &new_size);
+                                   blocks, &new_size);
+    /* The fs objects are saved, but the blocks may still be copying. */
+    if (seaf_block_copy_finish (blocks) < 0) {
+        g_free (new_id);
+        new_id = NULL;
+    }
     if (!new_id) {
         ret = -1;
         goto out;
@@ -2139,7 +2447,7 @@ seaf_repo_manager_move_file (SeafRepoManager *mgr,
     } else {
         /* move between different repos */
 
-        if (is_virtual_repo_and_origin (src_repo, dst_repo)) {
+        if (repos_share_store (src_repo, dst_repo)) {
             /* duplicate src dirent with new name */
             dst_dent = seaf_dirent_new (dir_version_from_repo_version(dst_repo->version),
                                         src_dent->id, src_dent->mode, dst_filename,
@@ -2186,7 +2494,10 @@ seaf_repo_manager_move_file (SeafRepoManager *mgr,
                 goto out;
             }
 
-            if (!check_file_count_and_size (src_repo, src_dent, total_files, error)) {
+            gint64 total_bytes = 0;
+            if (!check_file_count_and_size (src_repo, src_dent, total_files,
+                                            need_progress ? &total_bytes : NULL,
+                                            error)) {
                 ret = -1;
                 goto out;
             }
@@ -2200,6 +2511,7 @@ seaf_repo_manager_move_file (SeafRepoManager *mgr,
                                                   dst_filename,
                                                   user,
                                                   total_files,
+                                                  total_bytes,
                                                   cross_repo_move,
                                                   need_progress);
             if (need_progress && !task_id) {
@@ -2832,20 +3144,15 @@ gen_commit_description (SeafRepo *repo,
                         const char *root,
                         const char *parent_root)
 {
-    GList *p;
-    GList *results = NULL;
+    DiffResults *results = diff_results_new ();
     char *desc;
-    
-    diff_commit_roots (repo->store_id, repo->version,
-                       parent_root, root, &results, TRUE);
 
-    desc = diff_results_to_description (results);
+    diff_commit_roots_array (repo->store_id, repo->version,
+                             parent_root, root, results, TRUE);
 
-    for (p = results; p; p = p->next) {
-        DiffEntry *de = p->data;
-        diff_entry_free (de);
-    }
-    g_list_free (results);
+    desc = diff_results_array_to_description (results);
+
+    diff_results_free (results);
 
     return desc;
 }
@@ -4029,9 +4336,10 @@ detect_rename_revision (SeafRepo *repo,
                         char **parent_id,
                         char **old_path)
 {
-    GList *diff_res = NULL;
+    DiffResults *diff_res;
     SeafCommit *p1 = NULL;
-    int rc;
+    DiffEntry *de;
+    int rc, i;
     gboolean is_renamed = FALSE;
 
     while (*path == '/' && *path != 0)
@@ -4048,33 +4356,33 @@ detect_rename_revision (SeafRepo *repo,
         /* Don't fold diff results for directories. We need to know a file was
          * renamed when its parent folder was renamed.
          */
-        rc = diff_commits (p1, commit, &diff_res, FALSE);
+        diff_res = diff_results_new ();
+        rc = diff_commits_array (p1, commit, diff_res, FALSE);
         seaf_commit_unref (p1);
         if (rc < 0) {
             seaf_warning ("Failed to diff.\n");
+            diff_results_free (diff_res);
             return FALSE;
         }
     } else {
-        rc = diff_merge (commit, &diff_res, FALSE);
+        diff_res = diff_results_new ();
+        rc = diff_merge_array (commit, diff_res, FALSE);
         if (rc < 0) {
             seaf_warning ("Failed to diff merge.\n");
+            diff_results_free (diff_res);
             return FALSE;
         }
     }
 
-    GList *ptr;
-    DiffEntry *de;
-    for (ptr = diff_res; ptr; ptr = ptr->next) {
-        de = ptr->data;
+    for (i = diff_res->n_entries - 1; i >= 0; --i) {
+        de = &diff_res->entries[i];
         if (de->status == DIFF_STATUS_RENAMED && strcmp (de->new_name, path) == 0) {
             *old_path = g_strdup(de->name);
             is_renamed = TRUE;
             break;
         }
     }
-    for (ptr = diff_res; ptr; ptr = ptr->next)
-        diff_entry_free ((DiffEntry *)ptr->data);
-    g_list_free (diff_res);
+    diff_results_free (diff_res);
 
     if (!is_renamed)
         return FALSE;
@@ -4150,6 +4458,110 @@ convert_rpc_commit_list (GList *commit_list,
     return ret;
 }
 
+/*
+ * List the revisions of @path older than @before from the file revision
+ * index, stopping where collect_file_revisions() would stop the history
+ * walk. Sets @indexed to FALSE if the index isn't up to date with @head_id.
+ */
+static GList *
+list_indexed_file_revisions (SeafRepoManager *mgr,
+                             SeafRepo *repo,
+                             const char *head_id,
+                             const char *path,
+                             int max_revision,
+                             int show_days,
+                             gint64 before,
+                             gboolean *indexed,
+                             GError **error)
+{
+    GList *revisions = NULL;
+    GList *commit_list = NULL, *file_id_list = NULL, *file_size_list = NULL;
+    GList *ret = NULL, *old_revisions, *ptr;
+    CollectRevisionParam data = {0};
+    FileRevision *rev, *last_rev = NULL;
+    SeafCommit *commit;
+    gboolean old_indexed;
+    int show_time;
+
+    if (file_rev_index_get_revisions (seaf->file_rev_index, repo->id, head_id,
+                                      path, before, &revisions) < 0) {
+        *indexed = FALSE;
+        return NULL;
+    }
+    *indexed = TRUE;
+
+    data.max_revision = max_revision;
+    show_time = show_days > 0 ? time(NULL) - show_days*24*3600 : -1;
+    data.truncate_time = MAX (show_time,
+                              seaf_repo_manager_get_repo_truncate_time (mgr, repo->id));
+
+    for (ptr = revisions; ptr; ptr = ptr->next) {
+        rev = ptr->data;
+
+        if (data.got_latest && data.truncate_time == 0)
+            break;
+        if (data.got_latest && data.truncate_time > 0 &&
+            rev->ctime < data.truncate_time)
+            break;
+        if (data.max_revision > 0 && data.n_commits > data.max_revision)
+            break;
+
+        commit = seaf_commit_manager_get_commit (seaf->commit_mgr,
+                                                 repo->id, repo->version,
+                                                 rev->commit_id);
+        if (!commit) {
+            g_set_error (error, SEAFILE_DOMAIN, SEAF_ERR_GENERAL,
+                         "Faild to get commit %s", rev->commit_id);
+            goto out;
+        }
+        add_revision_info (&data, commit, rev->file_id, rev->file_size);
+        seaf_commit_unref (commit);
+
+        data.got_latest = TRUE;
+        last_rev = rev;
+    }
+
+    if (!last_rev)
+        goto out;
+
+    commit_list = g_list_reverse (data.wanted_commits);
+    file_id_list = g_list_reverse (data.file_id_list);
+    file_size_list = g_list_reverse (data.file_size_list);
+
+    ret = convert_rpc_commit_list (commit_list, file_id_list, file_size_list,
+                                   last_rev->old_path != NULL, last_rev->old_path);
+
+    if (last_rev->old_path) {
+        /* Get the revisions of the old path, from before it was moved. */
+        old_revisions = list_indexed_file_revisions (mgr, repo, head_id,
+                                                     last_rev->old_path,
+                                                     -1, show_days,
+                                                     last_rev->ctime,
+                                                     &old_indexed, error);
+        if (!old_indexed)
+            old_revisions = seaf_repo_manager_list_file_revisions (mgr, repo->id,
+                                                                   last_rev->old_parent_id,
+                                                                   last_rev->old_path,
+                                                                   -1, -1, show_days,
+                                                                   error);
+        ret = g_list_concat (ret, old_revisions);
+    }
+
+    g_clear_error (error);
+
+out:
+    for (ptr = commit_list; ptr; ptr = ptr->next)
+        seaf_commit_unref ((SeafCommit *)ptr->data);
+    g_list_free (commit_list);
+    string_list_free (file_id_list);
+    for (ptr = file_size_list; ptr; ptr = ptr->next)
+        g_free (ptr->data);
+    g_list_free (file_size_list);
+    g_list_free_full (revisions, (GDestroyNotify)file_revision_free);
+
+    return ret;
+}
+
 GList *
 seaf_repo_manager_list_file_revisions (SeafRepoManager *mgr,
                                        const char *repo_id,
@@ -4170,6 +4582,7 @@ seaf_repo_manager_list_file_revisions (SeafRepoManager *mgr,
     char *parent_id = NULL, *old_path = NULL;
     GList *old_revisions = NULL;
     int show_time;
+    gboolean indexed = FALSE;
 
     repo = seaf_repo_manager_get_repo (mgr, repo_id);
     if (!repo) {
@@ -4185,6 +4598,17 @@ seaf_repo_manager_list_file_revisions (SeafRepoManager *mgr,
     else
         head_id = start_commit_id;
 
+    /* The index can't tell how many commits a walk of @limit commits
+     * would reach, so only a walk can honor a limit.
+     */
+    if (limit <= 0 && strcmp (head_id, repo->head->commit_id) == 0) {
+        ret = list_indexed_file_revisions (mgr, repo, head_id, path,
+                                           max_revision, show_days, 0,
+                                           &indexed, error);
+        if (indexed)
+            goto out;
+    }
+
     data.path = path;
     data.error = error;
     data.max_revision = max_revision;
@@ -4268,6 +4692,7 @@ struct CalcFilesLastModifiedParam {
     GHashTable *last_modified_hash;
     GHashTable *current_file_id_hash;
     SeafCommit *current_commit;
+    int n_commits;
 };
 
 static gboolean
@@ -4303,6 +4728,7 @@ collect_files_last_modified (SeafCommit *commit, void *vdata, gboolean *stop)
     gboolean ret = TRUE;
 
     data->current_commit = commit;
+    ++data->n_commits;
     dir = seaf_fs_manager_get_seafdir_by_path (seaf->fs_mgr,
                                                data->repo->store_id,
                                                data->repo->version,
@@ -4363,6 +4789,158 @@ out:
     return ret;
 }
 
+/*
+ * The last modification times of the files in a dir are cached in
+ * DirLastModified by dir id, as a JSON object of file names to times.
+ * A dir id fixes the files in it, so the times computed once for a dir
+ * hold for every commit that has it.
+ */
+
+static GHashTable *
+load_files_last_modified (const char *repo_id, const char *dir_id)
+{
+    GHashTable *hash = NULL;
+    char *info;
+    json_t *object, *value;
+    json_error_t jerror;
+    void *iter;
+    gint64 *ctime;
+
+    info = seaf_db_statement_get_string (seaf->db,
+                                         "SELECT info FROM DirLastModified "
+                                         "WHERE repo_id=? AND dir_id=?",
+                                         2, "string", repo_id, "string", dir_id);
+    if (!info)
+        return NULL;
+
+    object = json_loadb (info, strlen(info), 0, &jerror);
+    g_free (info);
+    if (!object || !json_is_object (object)) {
+        seaf_warning ("Invalid last modified info of dir %s.\n", dir_id);
+        if (object)
+            json_decref (object);
+        return NULL;
+    }
+
+    hash = g_hash_table_new_full (g_str_hash, g_str_equal, g_free, g_free);
+    for (iter = json_object_iter (object); iter;
+         iter = json_object_iter_next (object, iter)) {
+        value = json_object_iter_value (iter);
+        ctime = g_new (gint64, 1);
+        *ctime = json_integer_value (value);
+        g_hash_table_insert (hash, g_strdup (json_object_iter_key (iter)), ctime);
+    }
+    json_decref (object);
+
+    return hash;
+}
+
+static void
+save_files_last_modified (const char *repo_id, const char *dir_id,
+                          GHashTable *hash)
+{
+    GHashTableIter iter;
+    gpointer key, value;
+    json_t *object;
+    char *info;
+    gboolean exists, err;
+
+    object = json_object ();
+    g_hash_table_iter_init (&iter, hash);
+    while (g_hash_table_iter_next (&iter, &key, &value))
+        json_object_set_new (object, key, json_integer (*(gint64 *)value));
+    info = json_dumps (object, JSON_COMPACT);
+    json_decref (object);
+
+    if (seaf_db_type(seaf->db) == SEAF_DB_TYPE_PGSQL) {
+        exists = seaf_db_statement_exists (seaf->db,
+                                           "SELECT 1 FROM DirLastModified "
+                                           "WHERE repo_id=? AND dir_id=?",
+                                           &err, 2, "string", repo_id,
+                                           "string", dir_id);
+        if (!err && !exists)
+            seaf_db_statement_query (seaf->db,
+                                     "INSERT INTO DirLastModified "
+                                     "VALUES (?, ?, ?)",
+                                     3, "string", repo_id, "string", dir_id,
+                                     "string", info);
+    } else {
+        seaf_db_statement_query (seaf->db,
+                                 "REPLACE INTO DirLastModified VALUES (?, ?, ?)",
+                                 3, "string", repo_id, "string", dir_id,
+                                 "string", info);
+    }
+
+    free (info);
+}
+
+/*
+ * If @dir only changed from the parent of @head, the files taken as is
+ * from the parent keep their times there, and the others are last
+ * modified in @head.
+ */
+static GHashTable *
+files_last_modified_from_parent (SeafRepo *repo, SeafCommit *head,
+                                 const char *parent_dir, SeafDir *dir)
+{
+    SeafCommit *parent;
+    SeafDir *parent_dir_obj;
+    GHashTable *parent_times, *parent_ids, *hash;
+    SeafDirent *dent;
+    GList *ptr;
+    gint64 *ctime, *old_ctime;
+    const char *old_id;
+
+    /* A merge may take files from either parent. */
+    if (!head->parent_id || head->second_parent_id)
+        return NULL;
+
+    parent = seaf_commit_manager_get_commit (seaf->commit_mgr,
+                                             repo->id, repo->version,
+                                             head->parent_id);
+    if (!parent)
+        return NULL;
+
+    parent_dir_obj = seaf_fs_manager_get_seafdir_by_path (seaf->fs_mgr,
+                                                          repo->store_id,
+                                                          repo->version,
+                                                          parent->root_id,
+                                                          parent_dir, NULL);
+    seaf_commit_unref (parent);
+    if (!parent_dir_obj)
+        return NULL;
+
+    parent_times = load_files_last_modified (repo->id, parent_dir_obj->dir_id);
+    if (!parent_times) {
+        seaf_dir_free (parent_dir_obj);
+        return NULL;
+    }
+
+    parent_ids = g_hash_table_new (g_str_hash, g_str_equal);
+    for (ptr = parent_dir_obj->entries; ptr; ptr = ptr->next) {
+        dent = ptr->data;
+        g_hash_table_insert (parent_ids, dent->name, dent->id);
+    }
+
+    hash = g_hash_table_new_full (g_str_hash, g_str_equal, g_free, g_free);
+    for (ptr = dir->entries; ptr; ptr = ptr->next) {
+        dent = ptr->data;
+        ctime = g_new (gint64, 1);
+        old_id = g_hash_table_lookup (parent_ids, dent->name);
+        old_ctime = g_hash_table_lookup (parent_times, dent->name);
+        if (old_id && old_ctime && strcmp (old_id, dent->id) == 0)
+            *ctime = *old_ctime;
+        else
+            *ctime = head->ctime;
+        g_hash_table_insert (hash, g_strdup(dent->name), ctime);
+    }
+
+    g_hash_table_destroy (parent_ids);
+    g_hash_table_destroy (parent_times);
+    seaf_dir_free (parent_dir_obj);
+    return hash;
+}
+
 /**
  * Give a directory, return the last modification timestamps of all the files
  * under this directory.
@@ -4371,6 +4949,9 @@ out:
  * tree. Give a commit, for each file, if the file id in that commit is
  * different than its current id, then this file is last modified in the
  * commit previous to that commit.
+ *
+ * The result is cached for the dir id, and is found from the cached result
+ * of the dir in the parent commit when there is one.
  */
 GList *
 seaf_repo_manager_calc_files_last_modified (SeafRepoManager *mgr,
@@ -4386,6 +4967,8 @@ seaf_repo_manager_calc_files_last_modified (SeafRepoManager *mgr,
     SeafDirent *dent = NULL; 
     CalcFilesLastModifiedParam data = {0};
     GList *ret_list = NULL;
+    GHashTableIter iter;
+    gpointer key, value;
 
     repo = seaf_repo_manager_get_repo (mgr, repo_id);
     if (!repo) {
@@ -4411,6 +4994,23 @@ seaf_repo_manager_calc_files_last_modified (SeafRepoManager *mgr,
         goto out;
     }
 
+    if (!dir->entries) {
+        /* An empty directory, no need to traverse */
+        goto out;
+    }
+
+    data.last_modified_hash = load_files_last_modified (repo->id, dir->dir_id);
+    if (data.last_modified_hash)
+        goto collect;
+
+    data.last_modified_hash = files_last_modified_from_parent (repo, head_commit,
+                                                               parent_dir, dir);
+    if (data.last_modified_hash) {
+        save_files_last_modified (repo->id, dir->dir_id,
+                                  data.last_modified_hash);
+        goto collect;
+    }
+
     data.repo = repo;
     
     /* A hash table of pattern (file_name, current_file_id) */
@@ -4434,11 +5034,6 @@ seaf_repo_manager_calc_files_last_modified (SeafRepoManager *mgr,
                              ctime);
     }
 
-    if (g_hash_table_size (data.current_file_id_hash) == 0) {
-        /* An empty directory, no need to traverse */
-        goto out;
-    }
-
     data.parent_dir = parent_dir;
     data.error = error;
 
@@ -4457,9 +5052,13 @@ seaf_repo_manager_calc_files_last_modified (SeafRepoManager *mgr,
         goto out;
     }
 
-    GHashTableIter iter;
-    gpointer key, value;
+    /* Files still unresolved when the limit is hit may be older. */
+    if (g_hash_table_size (data.current_file_id_hash) == 0 ||
+        limit <= 0 || data.n_commits < limit)
+        save_files_last_modified (repo->id, dir->dir_id,
+                                  data.last_modified_hash);
 
+collect:
     g_hash_table_iter_init (&iter, data.last_modified_hash);
     while (g_hash_table_iter_next (&iter, &key, &value)) {
         SeafileFileLastModifiedInfo *info;
@@ -4858,6 +5457,52 @@ filter_out_existing_entries (GHashTable *entries,
     return 0;
 }
 
+/*
+ * Collect the entries deleted under @path after @after from the trash
+ * index. Paths deleted more than once keep the newest deletion.
+ */
+static int
+get_indexed_deleted_entries (SeafRepo *repo,
+                             gint64 after,
+                             const char *path,
+                             GHashTable *entries)
+{
+    GList *list = NULL, *ptr;
+    SeafileDeletedEntry *entry;
+    const char *basedir;
+    char *entry_path;
+
+    if (file_rev_index_get_deleted_entries (seaf->file_rev_index, repo->id,
+                                            repo->head->commit_id, after,
+                                            &list) < 0)
+        return -1;
+
+    while (*path == '/')
+        ++path;
+
+    for (ptr = list; ptr; ptr = ptr->next) {
+        entry = ptr->data;
+        basedir = seafile_deleted_entry_get_basedir (entry);
+        if (!g_str_has_prefix (basedir + 1, path)) {
+            g_object_unref (entry);
+            continue;
+        }
+
+        entry_path = g_strconcat (basedir,
+                                  seafile_deleted_entry_get_obj_name (entry),
+                                  NULL);
+        if (g_hash_table_lookup (entries, entry_path) != NULL) {
+            g_free (entry_path);
+            g_object_unref (entry);
+            continue;
+        }
+        g_hash_table_insert (entries, entry_path, entry);
+    }
+    g_list_free (list);
+
+    return 0;
+}
+
 static gboolean
 hash_to_list (gpointer key, gpointer value, gpointer user_data)
 {
@@ -4912,7 +5557,9 @@ seaf_repo_manager_get_deleted_entries (SeafRepoManager *mgr,
         data.path = g_strdup ("/");
     }
 
-    if (!seaf_commit_manager_traverse_commit_tree (seaf->commit_mgr,
+    if (get_indexed_deleted_entries (repo, data.truncate_time,
+                                     data.path, entries) < 0 &&
+        !seaf_commit_manager_traverse_commit_tree (seaf->commit_mgr,
                                                    repo->id, repo->version,
                                                    repo->head->commit_id,
                                                    collect_deleted,
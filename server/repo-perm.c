@@ -2,6 +2,8 @@
 
 #include "common.h"
 
+#include <pthread.h>
+
 #include <ccnet.h>
 #include <ccnet/ccnet-object.h>
 #include "utils.h"
@@ -12,6 +14,200 @@
 #include "repo-mgr.h"
 
 #include "seafile-error.h"
+#include "mem-stats.h"
+
+#define DEFAULT_PERM_CACHE_TTL 10 /* seconds */
+#define MAX_CACHED_PERM_USERS 10000
+
+/*
+ * Permissions of a user on the repos checked lately. Group membership
+ * is kept by ccnet, so entries also expire after [library] perm_cache_ttl
+ * seconds.
+ */
+typedef struct UserPerms {
+    /* repo_id -> permission, "" for no access */
+    GHashTable *perms;
+    gint64 expire_time;
+} UserPerms;
+
+/* user -> UserPerms */
+static GHashTable *perm_cache;
+static pthread_mutex_t perm_cache_lock = PTHREAD_MUTEX_INITIALIZER;
+/* Bumped on every invalidation, see cache_repo() in repo-mgr.c. */
+static guint64 perm_cache_gen;
+static int perm_cache_ttl;
+static int perm_cache_max_users;
+static gint64 perm_cache_evictions;
+
+static void
+user_perms_free (UserPerms *up)
+{
+    g_hash_table_destroy (up->perms);
+    g_free (up);
+}
+
+static void
+perm_cache_get_mem_stats (gpointer data, MemStats *stats)
+{
+    GHashTableIter iter, perms_iter;
+    gpointer key, value, repo_id, perm;
+    UserPerms *up;
+
+    pthread_mutex_lock (&perm_cache_lock);
+
+    stats->max_entries = perm_cache_max_users;
+    stats->evictions = perm_cache_evictions;
+
+    g_hash_table_iter_init (&iter, perm_cache);
+    while (g_hash_table_iter_next (&iter, &key, &value)) {
+        up = value;
+        stats->bytes += strlen (key) + 1 + sizeof(UserPerms) +
+            MEM_STATS_HASH_ENTRY_SIZE;
+
+        g_hash_table_iter_init (&perms_iter, up->perms);
+        while (g_hash_table_iter_next (&perms_iter, &repo_id, &perm))
+            stats->bytes += 37 + strlen (perm) + 1 + MEM_STATS_HASH_ENTRY_SIZE;
+        ++stats->entries;
+    }
+
+    pthread_mutex_unlock (&perm_cache_lock);
+}
+
+void
+seaf_repo_manager_init_perm_cache (SeafRepoManager *mgr, GKeyFile *config)
+{
+    GError *error = NULL;
+    int ttl, max_users;
+
+    /*
+     * [library]
+     * perm_cache_ttl = 10   # seconds, 0 to disable
+     * perm_cache_max_users = 10000
+     */
+    ttl = g_key_file_get_integer (config, "library", "perm_cache_ttl", &error);
+    if (error) {
+        ttl = DEFAULT_PERM_CACHE_TTL;
+        g_clear_error (&error);
+    }
+    perm_cache_ttl = MAX (ttl, 0);
+
+    max_users = g_key_file_get_integer (config, "library",
+                                        "perm_cache_max_users", &error);
+    if (error || max_users <= 0) {
+        max_users = MAX_CACHED_PERM_USERS;
+        g_clear_error (&error);
+    }
+    perm_cache_max_users = max_users;
+
+    perm_cache = g_hash_table_new_full (g_str_hash, g_str_equal,
+                                        g_free,
+                                        (GDestroyNotify)user_perms_free);
+    mem_stats_register ("repo_perm_cache", perm_cache_get_mem_stats, NULL);
+}
+
+void
+seaf_repo_manager_invalidate_perm_cache (SeafRepoManager *mgr)
+{
+    if (!perm_cache)
+        return;
+
+    pthread_mutex_lock (&perm_cache_lock);
+    ++perm_cache_gen;
+    g_hash_table_remove_all (perm_cache);
+    pthread_mutex_unlock (&perm_cache_lock);
+}
+
+/* Must be called with the lock held. */
+static UserPerms *
+get_user_perms (const char *user, gint64 now)
+{
+    UserPerms *up;
+
+    up = g_hash_table_lookup (perm_cache, user);
+    if (up && up->expire_time <= now) {
+        g_hash_table_remove (perm_cache, user);
+        up = NULL;
+    }
+    return up;
+}
+
+/*
+ * Returns TRUE if the permission of @user on @repo_id is cached, and sets
+ * @perm to it or NULL for no access. @gen is set for cache_perms().
+ */
+static gboolean
+lookup_cached_perm (const char *user, const char *repo_id,
+                    char **perm, guint64 *gen)
+{
+    UserPerms *up;
+    const char *cached = NULL;
+
+    *perm = NULL;
+
+    pthread_mutex_lock (&perm_cache_lock);
+
+    up = get_user_perms (user, (gint64)time(NULL));
+    if (up)
+        cached = g_hash_table_lookup (up->perms, repo_id);
+    if (cached && *cached != '\0')
+        *perm = g_strdup (cached);
+    *gen = perm_cache_gen;
+
+    pthread_mutex_unlock (&perm_cache_lock);
+
+    return cached != NULL;
+}
+
+static gboolean
+user_perms_expired (gpointer key, gpointer value, gpointer user_data)
+{
+    UserPerms *up = value;
+    gint64 *now = user_data;
+
+    return up->expire_time <= *now;
+}
+
+static void
+cache_perm (const char *user, const char *repo_id, const char *perm,
+            guint64 gen)
+{
+    UserPerms *up;
+    GHashTableIter iter;
+    gint64 now = (gint64)time(NULL);
+
+    pthread_mutex_lock (&perm_cache_lock);
+
+    /* Shares changed while the permission was being checked. */
+    if (gen != perm_cache_gen)
+        goto out;
+
+    up = get_user_perms (user, now);
+    if (!up) {
+        if (g_hash_table_size (perm_cache) >= perm_cache_max_users) {
+            g_hash_table_foreach_remove (perm_cache, user_perms_expired, &now);
+
+            /* Still full, make room by dropping any user. */
+            g_hash_table_iter_init (&iter, perm_cache);
+            while (g_hash_table_size (perm_cache) >= perm_cache_max_users &&
+                   g_hash_table_iter_next (&iter, NULL, NULL)) {
+                g_hash_table_iter_remove (&iter);
+                ++perm_cache_evictions;
+            }
+        }
+
+        up = g_new0 (UserPerms, 1);
+        up->perms = g_hash_table_new_full (g_str_hash, g_str_equal,
+                                           g_free, g_free);
+        up->expire_time = now + perm_cache_ttl;
+        g_hash_table_replace (perm_cache, g_strdup(user), up);
+    }
+
+    g_hash_table_replace (up->perms, g_strdup(repo_id),
+                          g_strdup(perm ? perm : ""));
+
+out:
+    pthread_mutex_unlock (&perm_cache_lock);
+}
 
 /*
  * Permission priority: owner --> personal share --> group share --> public.
@@ -125,16 +321,11 @@ check_virtual_repo_permission (SeafRepoManager *mgr,
     return permission;
 }
 
-/*
- * Comprehensive repo access permission checker.
- *
- * Returns read/write permission.
- */
-char *
-seaf_repo_manager_check_permission (SeafRepoManager *mgr,
-                                    const char *repo_id,
-                                    const char *user,
-                                    GError **error)
+static char *
+check_permission (SeafRepoManager *mgr,
+                  const char *repo_id,
+                  const char *user,
+                  GError **error)
 {
     SeafVirtRepo *vinfo;
     char *owner = NULL;
@@ -163,6 +354,325 @@ out:
     return permission;
 }
 
+/*
+ * Comprehensive repo access permission checker.
+ *
+ * Returns read/write permission.
+ */
+char *
+seaf_repo_manager_check_permission (SeafRepoManager *mgr,
+                                    const char *repo_id,
+                                    const char *user,
+                                    GError **error)
+{
+    char *permission = NULL;
+    guint64 gen = 0;
+
+    if (perm_cache_ttl > 0 &&
+        lookup_cached_perm (user, repo_id, &permission, &gen))
+        return permission;
+
+    permission = check_permission (mgr, repo_id, user, error);
+
+    /* A failed check isn't told apart from no access here, so only
+     * cache granted permissions.
+     */
+    if (perm_cache_ttl > 0 && permission)
+        cache_perm (user, repo_id, permission, gen);
+
+    return permission;
+}
+
+/* Permissions looked up for a batch of repos. */
+typedef struct BatchPerms {
+    const char *user;
+    /* repo_id -> origin repo id */
+    GHashTable *origins;
+    /* repo_id -> owner */
+    GHashTable *owners;
+    /* repo_id -> permission, for each kind of share */
+    GHashTable *user_shares;
+    GHashTable *group_shares;
+    GHashTable *pub_shares;
+    /* group ids of the user */
+    GHashTable *groups;
+} BatchPerms;
+
+static gboolean
+collect_origin (SeafDBRow *row, void *data)
+{
+    BatchPerms *bp = data;
+
+    g_hash_table_replace (bp->origins,
+                          g_strdup (seaf_db_row_get_column_text (row, 0)),
+                          g_strdup (seaf_db_row_get_column_text (row, 1)));
+    return TRUE;
+}
+
+static gboolean
+collect_owner (SeafDBRow *row, void *data)
+{
+    BatchPerms *bp = data;
+
+    g_hash_table_replace (bp->owners,
+                          g_strdup (seaf_db_row_get_column_text (row, 0)),
+                          g_ascii_strdown (seaf_db_row_get_column_text (row, 1), -1));
+    return TRUE;
+}
+
+static gboolean
+collect_user_share (SeafDBRow *row, void *data)
+{
+    BatchPerms *bp = data;
+
+    g_hash_table_replace (bp->user_shares,
+                          g_strdup (seaf_db_row_get_column_text (row, 0)),
+                          g_strdup (seaf_db_row_get_column_text (row, 1)));
+    return TRUE;
+}
+
+static gboolean
+collect_group_share (SeafDBRow *row, void *data)
+{
+    BatchPerms *bp = data;
+    const char *repo_id = seaf_db_row_get_column_text (row, 0);
+    int group_id = seaf_db_row_get_column_int (row, 1);
+    const char *permission = seaf_db_row_get_column_text (row, 2);
+    const char *old;
+
+    if (!g_hash_table_lookup (bp->groups, GINT_TO_POINTER(group_id)))
+        return TRUE;
+
+    /* "rw" of any group overwrites "r" of the others. */
+    old = g_hash_table_lookup (bp->group_shares, repo_id);
+    if (g_strcmp0 (permission, "rw") == 0 ||
+        (g_strcmp0 (permission, "r") == 0 && !old))
+        g_hash_table_replace (bp->group_shares, g_strdup(repo_id),
+                              g_strdup(permission));
+    return TRUE;
+}
+
+static gboolean
+collect_pub_share (SeafDBRow *row, void *data)
+{
+    BatchPerms *bp = data;
+
+    g_hash_table_replace (bp->pub_shares,
+                          g_strdup (seaf_db_row_get_column_text (row, 0)),
+                          g_strdup (seaf_db_row_get_column_text (row, 1)));
+    return TRUE;
+}
+
+static int
+load_user_groups (BatchPerms *bp)
+{
+    SearpcClient *rpc_client;
+    GList *groups, *ptr;
+    int group_id;
+
+    rpc_client = ccnet_create_pooled_rpc_client (seaf->client_pool,
+                                                 NULL,
+                                                 "ccnet-threaded-rpcserver");
+    if (!rpc_client)
+        return -1;
+
+    groups = ccnet_get_groups_by_user (rpc_client, bp->user);
+
+    ccnet_rpc_client_free (rpc_client);
+
+    for (ptr = groups; ptr; ptr = ptr->next) {
+        g_object_get (ptr->data, "id", &group_id, NULL);
+        g_hash_table_insert (bp->groups, GINT_TO_POINTER(group_id),
+                             GINT_TO_POINTER(1));
+        g_object_unref (ptr->data);
+    }
+    g_list_free (groups);
+
+    return 0;
+}
+
+static int
+load_batch_perms (SeafRepoManager *mgr, BatchPerms *bp, GList *repo_ids)
+{
+    SeafDB *db = mgr->seaf->db;
+    GList *ids = NULL, *ptr;
+    GHashTableIter iter;
+    gpointer key, value;
+    int ret = 0;
+
+    if (seaf_db_statement_foreach_row_in (db,
+                                          "SELECT repo_id, origin_repo "
+                                          "FROM VirtualRepo WHERE repo_id IN (%s)",
+                                          repo_ids, collect_origin, bp, 0) < 0)
+        return -1;
+
+    /* The origins of virtual repos are checked too. */
+    ids = g_list_copy (repo_ids);
+    g_hash_table_iter_init (&iter, bp->origins);
+    while (g_hash_table_iter_next (&iter, &key, &value))
+        ids = g_list_prepend (ids, value);
+
+    if (seaf_db_statement_foreach_row_in (db,
+                                          "SELECT repo_id, owner_id "
+                                          "FROM RepoOwner WHERE repo_id IN (%s)",
+                                          ids, collect_owner, bp, 0) < 0 ||
+        seaf_db_statement_foreach_row_in (db,
+                                          "SELECT repo_id, permission "
+                                          "FROM SharedRepo WHERE to_email=? "
+                                          "AND repo_id IN (%s)",
+                                          ids, collect_user_share, bp,
+                                          1, "string", bp->user) < 0) {
+        ret = -1;
+        goto out;
+    }
+
+    /* Groups are only needed if some repo isn't owned by or shared to
+     * the user directly.
+     */
+    for (ptr = ids; ptr; ptr = ptr->next) {
+        if (g_strcmp0 (g_hash_table_lookup (bp->owners, ptr->data), bp->user) != 0 &&
+            !g_hash_table_lookup (bp->user_shares, ptr->data))
+            break;
+    }
+    if (!ptr)
+        goto out;
+
+    if (load_user_groups (bp) < 0) {
+        ret = -1;
+        goto out;
+    }
+
+    if (g_hash_table_size (bp->groups) > 0 &&
+        seaf_db_statement_foreach_row_in (db,
+                                          "SELECT repo_id, group_id, permission "
+                                          "FROM RepoGroup WHERE repo_id IN (%s)",
+                                          ids, collect_group_share, bp, 0) < 0) {
+        ret = -1;
+        goto out;
+    }
+
+    if (!mgr->seaf->cloud_mode &&
+        seaf_db_statement_foreach_row_in (db,
+                                          "SELECT repo_id, permission "
+                                          "FROM InnerPubRepo WHERE repo_id IN (%s)",
+                                          ids, collect_pub_share, bp, 0) < 0) {
+        ret = -1;
+        goto out;
+    }
+
+out:
+    g_list_free (ids);
+    return ret;
+}
+
+/* Same as check_repo_share_permission(), from the loaded shares. */
+static const char *
+batch_share_permission (BatchPerms *bp, const char *repo_id)
+{
+    const char *permission;
+
+    permission = g_hash_table_lookup (bp->user_shares, repo_id);
+    if (!permission)
+        permission = g_hash_table_lookup (bp->group_shares, repo_id);
+    if (!permission)
+        permission = g_hash_table_lookup (bp->pub_shares, repo_id);
+    return permission;
+}
+
+/* Same as check_permission(), from the loaded shares. */
+static const char *
+batch_permission (BatchPerms *bp, const char *repo_id)
+{
+    const char *origin, *owner, *permission;
+
+    origin = g_hash_table_lookup (bp->origins, repo_id);
+    if (origin) {
+        owner = g_hash_table_lookup (bp->owners, origin);
+        if (g_strcmp0 (owner, bp->user) == 0)
+            return "rw";
+        permission = batch_share_permission (bp, repo_id);
+        if (!permission)
+            permission = batch_share_permission (bp, origin);
+        return permission;
+    }
+
+    owner = g_hash_table_lookup (bp->owners, repo_id);
+    if (!owner)
+        return NULL;
+    if (strcmp (owner, bp->user) == 0)
+        return "rw";
+    return batch_share_permission (bp, repo_id);
+}
+
+GHashTable *
+seaf_repo_manager_check_permissions (SeafRepoManager *mgr,
+                                     GList *repo_ids,
+                                     const char *user,
+                                     GError **error)
+{
+    GHashTable *perms;
+    BatchPerms bp;
+    GList *missed = NULL, *ptr;
+    char *permission;
+    const char *repo_id;
+    guint64 gen = 0;
+
+    perms = g_hash_table_new_full (g_str_hash, g_str_equal, g_free, g_free);
+
+    for (ptr = repo_ids; ptr; ptr = ptr->next) {
+        repo_id = ptr->data;
+        if (perm_cache_ttl > 0 &&
+            lookup_cached_perm (user, repo_id, &permission, &gen)) {
+            if (permission)
+                g_hash_table_replace (perms, g_strdup(repo_id), permission);
+            continue;
+        }
+        missed = g_list_prepend (missed, (char *)repo_id);
+    }
+
+    if (!missed)
+        return perms;
+
+    memset (&bp, 0, sizeof(bp));
+    bp.user = user;
+    bp.origins = g_hash_table_new_full (g_str_hash, g_str_equal, g_free, g_free);
+    bp.owners = g_hash_table_new_full (g_str_hash, g_str_equal, g_free, g_free);
+    bp.user_shares = g_hash_table_new_full (g_str_hash, g_str_equal,
+                                            g_free, g_free);
+    bp.group_shares = g_hash_table_new_full (g_str_hash, g_str_equal,
+                                             g_free, g_free);
+    bp.pub_shares = g_hash_table_new_full (g_str_hash, g_str_equal,
+                                           g_free, g_free);
+    bp.groups = g_hash_table_new (g_direct_hash, g_direct_equal);
+
+    if (load_batch_perms (mgr, &bp, missed) < 0) {
+        g_set_error (error, SEAFILE_DOMAIN, SEAF_ERR_GENERAL,
+                     "Failed to check permissions");
+        g_hash_table_destroy (perms);
+        perms = NULL;
+        goto out;
+    }
+
+    for (ptr = missed; ptr; ptr = ptr->next) {
+        repo_id = ptr->data;
+        const char *perm = batch_permission (&bp, repo_id);
+        if (perm)
+            g_hash_table_replace (perms, g_strdup(repo_id), g_strdup(perm));
+        if (perm_cache_ttl > 0)
+            cache_perm (user, repo_id, perm, gen);
+    }
+
+out:
+    g_list_free (missed);
+    g_hash_table_destroy (bp.origins);
+    g_hash_table_destroy (bp.owners);
+    g_hash_table_destroy (bp.user_shares);
+    g_hash_table_destroy (bp.group_shares);
+    g_hash_table_destroy (bp.pub_shares);
+    g_hash_table_destroy (bp.groups);
+    return perms;
+}
+
 /*
  * Directories are always before files. Otherwise compare the names.
  */
@@ -262,3 +772,73 @@ seaf_repo_manager_list_dir_with_perm (SeafRepoManager *mgr,
     res = g_list_reverse (res);
     return res;
 }
+
+GList *
+seaf_repo_manager_list_dir_page_with_perm (SeafRepoManager *mgr,
+                                           const char *repo_id,
+                                           const char *dir_path,
+                                           const char *dir_id,
+                                           const char *user,
+                                           int offset,
+                                           int limit,
+                                           GError **error)
+{
+    SeafRepo *repo;
+    char *perm = NULL;
+    SeafDirent *dent;
+    SeafileDirent *d;
+    GList *dirents, *ptr;
+    GList *res = NULL;
+    GError *tmp_error = NULL;
+
+    if (!repo_id || !is_uuid_valid(repo_id) || dir_id == NULL || !user) {
+        g_set_error (error, SEAFILE_DOMAIN, SEAF_ERR_BAD_DIR_ID, "Bad dir id");
+        return NULL;
+    }
+
+    perm = seaf_repo_manager_check_permission (mgr, repo_id, user, error);
+    if (!perm) {
+        if (*error == NULL)
+            g_set_error (error, SEAFILE_DOMAIN, SEAF_ERR_BAD_ARGS, "Access denied");
+        return NULL;
+    }
+
+    repo = seaf_repo_manager_get_repo (seaf->repo_mgr, repo_id);
+    if (!repo) {
+        g_set_error (error, SEAFILE_DOMAIN, SEAF_ERR_BAD_ARGS, "Bad repo id");
+        g_free (perm);
+        return NULL;
+    }
+
+    dirents = seaf_fs_manager_list_dirents (seaf->fs_mgr,
+                                            repo->store_id, repo->version,
+                                            dir_id, offset,
+                                            limit > 0 ? limit : -1,
+                                            NULL, &tmp_error);
+    if (tmp_error) {
+        g_set_error (error, SEAFILE_DOMAIN, SEAF_ERR_BAD_DIR_ID, "Bad dir id");
+        g_clear_error (&tmp_error);
+        seaf_repo_unref (repo);
+        g_free (perm);
+        return NULL;
+    }
+
+    for (ptr = dirents; ptr; ptr = ptr->next) {
+        dent = ptr->data;
+        d = g_object_new (SEAFILE_TYPE_DIRENT,
+                          "obj_id", dent->id,
+                          "obj_name", dent->name,
+                          "mode", dent->mode,
+                          "version", dent->version,
+                          "mtime", dent->mtime,
+                          "size", dent->size,
+                          "permission", perm,
+                          NULL);
+        res = g_list_prepend (res, d);
+    }
+
+    g_list_free_full (dirents, (GDestroyNotify)seaf_dirent_free);
+    seaf_repo_unref (repo);
+    g_free (perm);
+    return g_list_reverse (res);
+}
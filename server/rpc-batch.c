@@ -0,0 +1,286 @@
+/* -*- Mode: C; tab-width: 4; indent-tabs-mode: nil; c-basic-offset: 4 -*- */
+
+#include "common.h"
+
+#include <pthread.h>
+#include <jansson.h>
+#include <searpc-server.h>
+
+#include "seafile-session.h"
+#include "seafile-error.h"
+#include "rpc-batch.h"
+#include "utils.h"
+#include "log.h"
+
+#define RPC_SERVICE "seafserv-threaded-rpcserver"
+#define BATCH_FUNC_NAME "batch_rpc"
+
+#define DEFAULT_BATCH_THREADS 16
+/* Larger lists are split by the caller. */
+#define MAX_BATCH_CALLS 256
+
+typedef struct RpcBatchPriv {
+    GThreadPool *pool;
+
+    pthread_mutex_t lock;
+    int n_running;
+    gint64 n_batches;
+    gint64 n_calls;
+    gint64 total_wait_usec;
+    gint64 max_wait_usec;
+} RpcBatchPriv;
+
+typedef struct BatchRun {
+    pthread_mutex_t lock;
+    pthread_cond_t cond;
+    int n_left;
+} BatchRun;
+
+typedef struct BatchCall {
+    RpcBatch *batch;
+    BatchRun *run;
+    char *fcall;
+    char *result;
+    gint64 push_time;
+    gint64 wait_usec;
+} BatchCall;
+
+static void
+batch_worker (gpointer vcall, gpointer vbatch);
+
+RpcBatch *
+rpc_batch_new (SeafileSession *session)
+{
+    RpcBatch *batch = g_new0 (RpcBatch, 1);
+    RpcBatchPriv *priv = g_new0 (RpcBatchPriv, 1);
+    GError *error = NULL;
+    int n_threads;
+
+    batch->seaf = session;
+    batch->priv = priv;
+
+    n_threads = g_key_file_get_integer (session->config,
+                                        "thread pool size", "batch",
+                                        NULL);
+    batch->n_threads = (n_threads > 0) ? n_threads : DEFAULT_BATCH_THREADS;
+
+    pthread_mutex_init (&priv->lock, NULL);
+
+    priv->pool = g_thread_pool_new (batch_worker, batch,
+                                    batch->n_threads, FALSE, &error);
+    if (error) {
+        seaf_warning ("Failed to start batch rpc workers: %s.\n",
+                      error->message);
+        g_clear_error (&error);
+        g_free (priv);
+        g_free (batch);
+        return NULL;
+    }
+
+    return batch;
+}
+
+static char *
+error_result (int code, const char *msg)
+{
+    json_t *object = json_pack ("{s:i,s:s}", "err_code", code, "err_msg", msg);
+    char *str = json_dumps (object, JSON_COMPACT);
+    char *ret = g_strdup (str);
+
+    free (str);
+    json_decref (object);
+    return ret;
+}
+
+static void
+call_function (BatchCall *call)
+{
+    gsize ret_len;
+
+    call->result = searpc_server_call_function (RPC_SERVICE, call->fcall,
+                                                strlen(call->fcall), &ret_len);
+    if (!call->result)
+        call->result = error_result (SEAF_ERR_GENERAL, "Internal error");
+}
+
+static void
+batch_worker (gpointer vcall, gpointer vbatch)
+{
+    BatchCall *call = vcall;
+    RpcBatchPriv *priv = ((RpcBatch *)vbatch)->priv;
+    BatchRun *run = call->run;
+
+    call->wait_usec = g_get_monotonic_time () - call->push_time;
+
+    pthread_mutex_lock (&priv->lock);
+    ++priv->n_running;
+    pthread_mutex_unlock (&priv->lock);
+
+    call_function (call);
+
+    pthread_mutex_lock (&priv->lock);
+    --priv->n_running;
+    pthread_mutex_unlock (&priv->lock);
+
+    pthread_mutex_lock (&run->lock);
+    if (--run->n_left == 0)
+        pthread_cond_signal (&run->cond);
+    pthread_mutex_unlock (&run->lock);
+}
+
+/* Returns the serialized call, or NULL with @result set if it can't be
+ * run. A batch never contains another one, which would hold a worker
+ * while waiting for the others.
+ */
+static char *
+prepare_call (json_t *fcall, char **result)
+{
+    const char *fname;
+    char *str, *ret;
+
+    if (!json_is_array (fcall) || json_array_size (fcall) == 0 ||
+        !json_is_string (json_array_get (fcall, 0))) {
+        *result = error_result (SEAF_ERR_BAD_ARGS, "Invalid call");
+        return NULL;
+    }
+
+    fname = json_string_value (json_array_get (fcall, 0));
+    if (strcmp (fname, BATCH_FUNC_NAME) == 0) {
+        *result = error_result (SEAF_ERR_BAD_ARGS, "Nested batch call");
+        return NULL;
+    }
+
+    str = json_dumps (fcall, JSON_COMPACT);
+    ret = g_strdup (str);
+    free (str);
+    return ret;
+}
+
+char *
+rpc_batch_run (RpcBatch *batch, const char *calls_str, gboolean parallel,
+               GError **error)
+{
+    RpcBatchPriv *priv = batch->priv;
+    json_t *calls = NULL, *output = NULL, *results, *result;
+    json_error_t jerror;
+    BatchCall *calls_arr = NULL;
+    BatchRun run;
+    gint64 start, max_wait = 0, total_wait = 0;
+    int n_calls = 0, i;
+    char *str, *ret = NULL;
+
+    calls = json_loadb (calls_str, strlen(calls_str), 0, &jerror);
+    if (!calls || !json_is_array (calls)) {
+        g_set_error (error, SEAFILE_DOMAIN, SEAF_ERR_BAD_ARGS,
+                     "Calls should be a JSON array");
+        goto out;
+    }
+
+    n_calls = json_array_size (calls);
+    if (n_calls > MAX_BATCH_CALLS) {
+        g_set_error (error, SEAFILE_DOMAIN, SEAF_ERR_BAD_ARGS,
+                     "Too many calls in a batch, max %d", MAX_BATCH_CALLS);
+        goto out;
+    }
+
+    start = g_get_monotonic_time ();
+
+    calls_arr = g_new0 (BatchCall, n_calls);
+    pthread_mutex_init (&run.lock, NULL);
+    pthread_cond_init (&run.cond, NULL);
+    run.n_left = 0;
+
+    for (i = 0; i < n_calls; ++i) {
+        BatchCall *call = &calls_arr[i];
+
+        call->batch = batch;
+        call->run = &run;
+        call->fcall = prepare_call (json_array_get (calls, i), &call->result);
+        if (!call->fcall)
+            continue;
+
+        if (!parallel || n_calls == 1) {
+            call_function (call);
+            continue;
+        }
+
+        pthread_mutex_lock (&run.lock);
+        ++run.n_left;
+        pthread_mutex_unlock (&run.lock);
+
+        call->push_time = g_get_monotonic_time ();
+        g_thread_pool_push (priv->pool, call, NULL);
+    }
+
+    pthread_mutex_lock (&run.lock);
+    while (run.n_left > 0)
+        pthread_cond_wait (&run.cond, &run.lock);
+    pthread_mutex_unlock (&run.lock);
+
+    pthread_mutex_destroy (&run.lock);
+    pthread_cond_destroy (&run.cond);
+
+    output = json_object ();
+    results = json_array ();
+    json_object_set_new (output, "results", results);
+
+    for (i = 0; i < n_calls; ++i) {
+        BatchCall *call = &calls_arr[i];
+
+        result = json_loads (call->result, 0, &jerror);
+        if (!result) {
+            seaf_warning ("Invalid result of batched rpc %s.\n", call->fcall);
+            result = json_pack ("{s:i,s:s}", "err_code", SEAF_ERR_GENERAL,
+                                "err_msg", "Internal error");
+        }
+        json_array_append_new (results, result);
+
+        total_wait += call->wait_usec;
+        max_wait = MAX (max_wait, call->wait_usec);
+    }
+
+    json_object_set_new (output, "queue_wait_usec", json_integer (max_wait));
+    json_object_set_new (output, "elapsed_usec",
+                         json_integer (g_get_monotonic_time () - start));
+
+    pthread_mutex_lock (&priv->lock);
+    ++priv->n_batches;
+    priv->n_calls += n_calls;
+    priv->total_wait_usec += total_wait;
+    priv->max_wait_usec = MAX (priv->max_wait_usec, max_wait);
+    pthread_mutex_unlock (&priv->lock);
+
+    str = json_dumps (output, JSON_COMPACT);
+    ret = g_strdup (str);
+    free (str);
+
+out:
+    if (calls_arr) {
+        for (i = 0; i < n_calls; ++i) {
+            g_free (calls_arr[i].fcall);
+            g_free (calls_arr[i].result);
+        }
+        g_free (calls_arr);
+    }
+    if (calls)
+        json_decref (calls);
+    if (output)
+        json_decref (output);
+    return ret;
+}
+
+void
+rpc_batch_get_stats (RpcBatch *batch, RpcBatchStats *stats)
+{
+    RpcBatchPriv *priv = batch->priv;
+
+    stats->n_queued = g_thread_pool_unprocessed (priv->pool);
+
+    pthread_mutex_lock (&priv->lock);
+    stats->n_running = priv->n_running;
+    stats->n_batches = priv->n_batches;
+    stats->n_calls = priv->n_calls;
+    stats->total_wait_usec = priv->total_wait_usec;
+    stats->max_wait_usec = priv->max_wait_usec;
+    pthread_mutex_unlock (&priv->lock);
+}
@@ -0,0 +1,51 @@
+#ifndef RPC_BATCH_H
+#define RPC_BATCH_H
+
+#include <glib.h>
+
+struct _SeafileSession;
+
+struct RpcBatchPriv;
+
+/*
+ * Runs a list of RPC calls in one request. Independent calls are run in
+ * parallel on a pool of its own, so that they never wait for a thread
+ * of the RPC pool the batch itself is running on.
+ */
+typedef struct RpcBatch {
+    struct _SeafileSession *seaf;
+
+    int n_threads;
+
+    struct RpcBatchPriv *priv;
+} RpcBatch;
+
+RpcBatch *
+rpc_batch_new (struct _SeafileSession *session);
+
+/*
+ * @calls is a JSON array of calls, each one a searpc call:
+ * ["func_name", arg1, arg2, ...].
+ *
+ * Returns a JSON object: "results" holds the searpc result of each call,
+ * in order, {"ret": ...} or {"err_code": ..., "err_msg": ...}.
+ * "queue_wait_usec" is the longest time a call waited for a thread and
+ * "elapsed_usec" the time of the whole batch.
+ */
+char *
+rpc_batch_run (RpcBatch *batch, const char *calls, gboolean parallel,
+               GError **error);
+
+typedef struct RpcBatchStats {
+    int n_queued;
+    int n_running;
+    gint64 n_batches;
+    gint64 n_calls;
+    gint64 total_wait_usec;     /* queue wait of all calls */
+    gint64 max_wait_usec;
+} RpcBatchStats;
+
+void
+rpc_batch_get_stats (RpcBatch *batch, RpcBatchStats *stats);
+
+#endif
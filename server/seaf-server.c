@@ -51,7 +51,7 @@ SearpcClient *async_ccnetrpc_client_t;
 
 char *pidfile = NULL;
 
-static const char *short_options = "hvc:d:l:fg:G:P:mCD:";
+static const char *short_options = "hvc:d:l:fg:G:P:mCD:w";
 static struct option long_options[] = {
     { "help", no_argument, NULL, 'h', },
     { "version", no_argument, NULL, 'v', },
@@ -65,6 +65,7 @@ static struct option long_options[] = {
     { "master", no_argument, NULL, 'm'},
     { "pidfile", required_argument, NULL, 'P' },
     { "cloud-mode", no_argument, NULL, 'C'},
+    { "sync-worker", no_argument, NULL, 'w'},
     { NULL, 0, NULL, 0, },
 };
 
@@ -142,6 +143,10 @@ static void start_rpc_service (CcnetClient *client, int cloud_mode)
                                      seafile_get_repo_list,
                                      "seafile_get_repo_list",
                                      searpc_signature_objlist__int_int());
+    searpc_server_register_function ("seafserv-threaded-rpcserver",
+                                     seafile_get_repo_list_after,
+                                     "get_repo_list_after",
+                                     searpc_signature_objlist__string_int());
     searpc_server_register_function ("seafserv-threaded-rpcserver",
                                      seafile_count_repos,
                                      "seafile_count_repos",
@@ -285,6 +290,16 @@ static void start_rpc_service (CcnetClient *client, int cloud_mode)
                                      "list_dir_with_perm",
                                      searpc_signature_objlist__string_string_string_string_int_int());
 
+    searpc_server_register_function ("seafserv-threaded-rpcserver",
+                                     seafile_list_dir_page,
+                                     "seafile_list_dir_page",
+                                     searpc_signature_objlist__string_string_int_int());
+
+    searpc_server_register_function ("seafserv-threaded-rpcserver",
+                                     seafile_list_dir_page_with_perm,
+                                     "list_dir_page_with_perm",
+                                     searpc_signature_objlist__string_string_string_string_int_int());
+
     searpc_server_register_function ("seafserv-threaded-rpcserver",
                                      seafile_list_file,
                                      "seafile_list_file",
@@ -616,11 +631,56 @@ static void start_rpc_service (CcnetClient *client, int cloud_mode)
                                      "get_system_default_repo_id",
                                      searpc_signature_string__void());
 
+    /* fs object cache */
+    searpc_server_register_function ("seafserv-threaded-rpcserver",
+                                     seafile_get_fs_cache_stats,
+                                     "get_fs_cache_stats",
+                                     searpc_signature_string__void());
+
+    searpc_server_register_function ("seafserv-threaded-rpcserver",
+                                     seafile_get_block_cache_stats,
+                                     "get_block_cache_stats",
+                                     searpc_signature_string__void());
+
+    searpc_server_register_function ("seafserv-threaded-rpcserver",
+                                     seafile_get_io_stats,
+                                     "get_io_stats",
+                                     searpc_signature_string__void());
+
+    searpc_server_register_function ("seafserv-threaded-rpcserver",
+                                     seafile_get_memory_stats,
+                                     "get_memory_stats",
+                                     searpc_signature_string__void());
+
+    searpc_server_register_function ("seafserv-threaded-rpcserver",
+                                     seafile_get_db_query_stats,
+                                     "get_db_query_stats",
+                                     searpc_signature_string__void());
+
+    searpc_server_register_function ("seafserv-threaded-rpcserver",
+                                     seafile_get_server_metrics,
+                                     "get_server_metrics",
+                                     searpc_signature_string__void());
+
+    searpc_server_register_function ("seafserv-threaded-rpcserver",
+                                     seafile_batch_rpc,
+                                     "batch_rpc",
+                                     searpc_signature_string__string_int());
+
+    searpc_server_register_function ("seafserv-threaded-rpcserver",
+                                     seafile_get_repos_info_by_ids,
+                                     "get_repos_info_by_ids",
+                                     searpc_signature_string__string());
+
     /* Trashed repos. */
     searpc_server_register_function ("seafserv-threaded-rpcserver",
                                      seafile_get_trash_repo_list,
                                      "get_trash_repo_list",
                                      searpc_signature_objlist__int_int());
+    searpc_server_register_function ("seafserv-threaded-rpcserver",
+                                     seafile_get_trash_repo_list_after,
+                                     "get_trash_repo_list_after",
+                                     searpc_signature_objlist__string_int());
     searpc_server_register_function ("seafserv-threaded-rpcserver",
                                      seafile_del_repo_from_trash,
                                      "del_repo_from_trash",
@@ -644,12 +704,19 @@ static void start_rpc_service (CcnetClient *client, int cloud_mode)
 }
 
 static struct event sigusr1;
+static struct event sigterm;
 
 static void sigusr1Handler (int fd, short event, void *user_data)
 {
     seafile_log_reopen ();
 }
 
+static void sigtermHandler (int fd, short event, void *user_data)
+{
+    /* The cache snapshot is saved on exit. */
+    exit (0);
+}
+
 static void
 set_signal_handlers (SeafileSession *session)
 {
@@ -659,6 +726,12 @@ set_signal_handlers (SeafileSession *session)
     /* design as reopen log */
     event_set(&sigusr1, SIGUSR1, EV_SIGNAL | EV_PERSIST, sigusr1Handler, NULL);
     event_add(&sigusr1, NULL);
+
+    /* Otherwise SIGTERM, which stops the server, skips atexit handlers. */
+    if (session->cache_warmer->enabled) {
+        event_set(&sigterm, SIGTERM, EV_SIGNAL, sigtermHandler, NULL);
+        event_add(&sigterm, NULL);
+    }
 #endif
 }
 
@@ -732,6 +805,31 @@ write_pidfile (const char *pidfile_path)
     return 0;
 }
 
+#ifndef WIN32
+/*
+ * seafile-controller waits for a byte on the fd in SEAFILE_READY_FD,
+ * which is sent once the ports are open.
+ */
+static void
+notify_controller_ready ()
+{
+    const char *env = g_getenv ("SEAFILE_READY_FD");
+    int fd;
+
+    if (!env)
+        return;
+
+    fd = atoi (env);
+    if (fd > 2) {
+        if (write (fd, "1", 1) < 0)
+            seaf_warning ("Failed to notify seafile-controller: %s.\n",
+                          strerror(errno));
+        close (fd);
+    }
+    g_unsetenv ("SEAFILE_READY_FD");
+}
+#endif
+
 static void
 load_history_config ()
 {
@@ -750,6 +848,9 @@ load_history_config ()
 static void
 on_seaf_server_exit(void)
 {
+    if (seaf && seaf->cache_warmer)
+        cache_warmer_save_snapshot (seaf->cache_warmer);
+
     if (pidfile)
         remove_pidfile (pidfile);
 }
@@ -794,6 +895,7 @@ main (int argc, char **argv)
     char *ccnet_debug_level_str = "info";
     char *seafile_debug_level_str = "debug";
     int cloud_mode = 0;
+    int sync_worker = 0;
 
 #ifdef WIN32
     argv = get_argv_utf8 (&argc);
@@ -838,6 +940,9 @@ main (int argc, char **argv)
         case 'C':
             cloud_mode = 1;
             break;
+        case 'w':
+            sync_worker = 1;
+            break;
         default:
             usage ();
             exit (1);
@@ -899,9 +1004,12 @@ main (int argc, char **argv)
     if (!client)
         exit (1);
 
-    register_processors (client);
+    /* Workers only serve the sync API, ccnet services stay in the master. */
+    if (!sync_worker) {
+        register_processors (client);
 
-    start_rpc_service (client, cloud_mode);
+        start_rpc_service (client, cloud_mode);
+    }
 
     create_sync_rpc_clients (config_dir);
     create_async_rpc_clients (client);
@@ -918,6 +1026,7 @@ main (int argc, char **argv)
     seaf->async_ccnetrpc_client_t = async_ccnetrpc_client_t;
     seaf->client_pool = ccnet_client_pool_new (config_dir);
     seaf->cloud_mode = cloud_mode;
+    seaf->sync_worker = sync_worker;
 
     load_history_config ();
 
@@ -941,8 +1050,16 @@ main (int argc, char **argv)
     }
     atexit (on_seaf_server_exit);
 
+#ifndef WIN32
+    notify_controller_ready ();
+#endif
+
+    if (seafile_session_start_background (seaf) < 0)
+        exit (1);
+
     /* Create a system default repo to contain the tutorial file. */
-    schedule_create_system_default_repo (seaf);
+    if (!sync_worker)
+        schedule_create_system_default_repo (seaf);
 
     ccnet_main (client);
 
@@ -20,6 +20,8 @@
 #include "utils.h"
 
 #include "seafile-session.h"
+#include "fileserver-config.h"
+#include "gc-guard.h"
 
 #include "monitor-rpc-wrappers.h"
 
@@ -138,12 +140,25 @@ seafile_session_new(const char *seafile_dir,
     if (!session->copy_mgr)
         goto onerror;
 
+    session->cluster_mgr = seaf_cluster_manager_new (session);
+    if (!session->cluster_mgr)
+        goto onerror;
+
     session->job_mgr = ccnet_job_manager_new (session->sync_thread_pool_size);
     ccnet_session->job_mgr = ccnet_job_manager_new (session->rpc_thread_pool_size);
 
     session->size_sched = size_scheduler_new (session);
+    session->io_sched = io_scheduler_new (session);
+    session->block_prefetcher = block_prefetcher_new (session);
+    session->cache_warmer = cache_warmer_new (session);
+    session->rpc_batch = rpc_batch_new (session);
+    if (!session->rpc_batch)
+        goto onerror;
+    session->file_rev_index = file_rev_index_new (session);
+    session->history_pruner = history_pruner_new (session);
 
     session->ev_mgr = cevent_manager_new ();
+    session->bg_job_mgr = bg_job_manager_new (session);
     if (!session->ev_mgr)
         goto onerror;
 
@@ -165,6 +180,48 @@ onerror:
     return NULL;    
 }
 
+gboolean
+seafile_session_shares_storage (SeafileSession *session)
+{
+    if (session->sync_worker || session->cluster_mgr->enabled)
+        return TRUE;
+
+    return (fileserver_config_get_integer (session->config,
+                                           "sync_workers", NULL) > 0);
+}
+
+/*
+ * [fileserver]
+ * exists_filter = false
+ *
+ * The filters learn about new blocks and fs objects from this process
+ * only, and a negative answer is trusted. They are off unless enabled,
+ * and always off when other processes write to the same storage.
+ */
+static int
+init_exists_filters (SeafileSession *session)
+{
+    gboolean enabled;
+
+    enabled = fileserver_config_get_boolean (session->config,
+                                             "exists_filter", NULL);
+    if (!enabled)
+        return 0;
+
+    if (seafile_session_shares_storage (session)) {
+        seaf_message ("Exists filters are disabled, other processes "
+                      "write to the same storage.\n");
+        return 0;
+    }
+
+    if (seaf_block_manager_enable_exists_filter (session->block_mgr) < 0)
+        return -1;
+    if (seaf_obj_store_enable_exists_filter (session->fs_mgr->obj_store) < 0)
+        return -1;
+
+    return 0;
+}
+
 int
 seafile_session_init (SeafileSession *session)
 {
@@ -174,6 +231,12 @@ seafile_session_init (SeafileSession *session)
     if (seaf_fs_manager_init (session->fs_mgr) < 0)
         return -1;
 
+    if (init_exists_filters (session) < 0)
+        return -1;
+
+    if (gc_guard_start (session) < 0)
+        return -1;
+
     if (seaf_branch_manager_init (session->branch_mgr) < 0)
         return -1;
 
@@ -198,6 +261,25 @@ seafile_session_start (SeafileSession *session)
         return -1;
     }
 
+    if (bg_job_manager_start (session->bg_job_mgr) < 0) {
+        seaf_warning ("Failed to start background job manager.\n");
+        return -1;
+    }
+
+    if (io_scheduler_start (session->io_sched) < 0) {
+        seaf_warning ("Failed to start io scheduler.\n");
+        return -1;
+    }
+
+    if (block_prefetcher_start (session->block_prefetcher) < 0) {
+        seaf_warning ("Failed to start block prefetcher.\n");
+        return -1;
+    }
+
+    /* The master seaf-server does the rest. */
+    if (session->sync_worker)
+        goto http;
+
     if (seaf_cs_manager_start (session->cs_mgr) < 0) {
         seaf_warning ("Failed to start chunk server manager.\n");
         return -1;
@@ -218,13 +300,36 @@ seafile_session_start (SeafileSession *session)
         return -1;
     }
 
+    if (seaf_listen_manager_start (session->listen_mgr) < 0) {
+        seaf_warning ("Failed to start listen manager.\n");
+        return -1;
+    }
+
+    if (seaf_copy_manager_start (session->copy_mgr) < 0) {
+        seaf_warning ("Failed to start copy manager.\n");
+        return -1;
+    }
+
+http:
     if (seaf_mq_manager_start (session->mq_mgr) < 0) {
         seaf_warning ("Failed to start mq manager.\n");
         return -1;
     }
 
-    if (seaf_listen_manager_start (session->listen_mgr) < 0) {
-        seaf_warning ("Failed to start listen manager.\n");
+    if (seaf_http_server_start (session->http_server) < 0) {
+        seaf_warning ("Failed to start http server thread.\n");
+        return -1;
+    }
+
+    return 0;
+}
+
+int
+seafile_session_start_background (SeafileSession *session)
+{
+    if (!session->sync_worker &&
+        history_pruner_start (session->history_pruner) < 0) {
+        seaf_warning ("Failed to start history pruner.\n");
         return -1;
     }
 
@@ -233,13 +338,13 @@ seafile_session_start (SeafileSession *session)
         return -1;
     }
 
-    if (seaf_copy_manager_start (session->copy_mgr) < 0) {
-        seaf_warning ("Failed to start copy manager.\n");
+    if (file_rev_index_start (session->file_rev_index) < 0) {
+        seaf_warning ("Failed to start file revision index.\n");
         return -1;
     }
 
-    if (seaf_http_server_start (session->http_server) < 0) {
-        seaf_warning ("Failed to start http server thread.\n");
+    if (cache_warmer_start (session->cache_warmer) < 0) {
+        seaf_warning ("Failed to start cache warmer.\n");
         return -1;
     }
 
@@ -390,7 +495,7 @@ schedule_create_system_default_repo (SeafileSession *session)
     if (seaf_db_query (session->db, sql) < 0)
         return;
 
-    ccnet_job_manager_schedule_job (session->job_mgr,
-                                    create_system_default_repo,
-                                    NULL, session);
+    bg_job_manager_schedule (session->bg_job_mgr, BG_JOB_INTERACTIVE,
+                             create_system_default_repo,
+                             NULL, session);
 }
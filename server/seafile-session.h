@@ -23,6 +23,14 @@
 #include "quota-mgr.h"
 #include "listen-mgr.h"
 #include "size-sched.h"
+#include "io-sched.h"
+#include "block-prefetch.h"
+#include "cache-warmer.h"
+#include "rpc-batch.h"
+#include "bg-job-mgr.h"
+#include "cluster-mgr.h"
+#include "history-pruner.h"
+#include "file-rev-index.h"
 #include "copy-mgr.h"
 
 #include "mq-mgr.h"
@@ -66,6 +74,7 @@ struct _SeafileSession {
     SeafQuotaManager    *quota_mgr;
     SeafListenManager   *listen_mgr;
     SeafCopyManager     *copy_mgr;
+    SeafClusterManager  *cluster_mgr;
     
     SeafWebAccessTokenManager	*web_at_mgr;
 
@@ -73,12 +82,22 @@ struct _SeafileSession {
 
     CEventManager       *ev_mgr;
     CcnetJobManager     *job_mgr;
+    BgJobManager        *bg_job_mgr;
 
     SizeScheduler       *size_sched;
+    IoScheduler         *io_sched;
+    BlockPrefetcher     *block_prefetcher;
+    CacheWarmer         *cache_warmer;
+    RpcBatch            *rpc_batch;
+    FileRevIndex        *file_rev_index;
+    HistoryPruner       *history_pruner;
 
     int                  is_master;
 
     int                  cloud_mode;
+    /* A fileserver worker serving only the sync API, started by
+     * seafile-controller with -w. */
+    int                  sync_worker;
     int                  keep_history_days;
 
     int                  rpc_thread_pool_size;
@@ -95,9 +114,22 @@ seafile_session_new(const char *seafile_dir,
 int
 seafile_session_init (SeafileSession *session);
 
+/*
+ * Whether other processes write to the same storage and DB: the sync
+ * workers and master of [fileserver] sync_workers, or the other nodes of
+ * a cluster. What a process caches about them may then be stale.
+ */
+gboolean
+seafile_session_shares_storage (SeafileSession *session);
+
+/* Starts the managers needed to serve requests, and opens the ports. */
 int
 seafile_session_start (SeafileSession *session);
 
+/* Starts the schedulers of background work, once requests are served. */
+int
+seafile_session_start_background (SeafileSession *session);
+
 char *
 seafile_session_get_tmp_file_path (SeafileSession *session,
                                    const char *basename,
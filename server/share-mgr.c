@@ -104,6 +104,8 @@ seaf_share_manager_add_share (SeafShareManager *mgr, const char *repo_id,
         goto out;
     }
 
+    seaf_repo_manager_invalidate_perm_cache (mgr->seaf->repo_mgr);
+
 out:
     g_free (from_email_l);
     g_free (to_email_l);
@@ -126,6 +128,7 @@ seaf_share_manager_set_permission (SeafShareManager *mgr, const char *repo_id,
     ret = seaf_db_statement_query (mgr->seaf->db, sql,
                                    4, "string", permission, "string", repo_id,
                                    "string", from_email_l, "string", to_email_l);
+    seaf_repo_manager_invalidate_perm_cache (mgr->seaf->repo_mgr);
 
     g_free (from_email_l);
     g_free (to_email_l);
@@ -317,6 +320,8 @@ seaf_share_manager_remove_share (SeafShareManager *mgr, const char *repo_id,
                        "string", to_email) < 0)
         return -1;
 
+    seaf_repo_manager_invalidate_perm_cache (mgr->seaf->repo_mgr);
+
     return 0;
 }
 
@@ -328,6 +333,8 @@ seaf_share_manager_remove_repo (SeafShareManager *mgr, const char *repo_id)
                        1, "string", repo_id) < 0)
         return -1;
 
+    seaf_repo_manager_invalidate_perm_cache (mgr->seaf->repo_mgr);
+
     return 0;
 }
 
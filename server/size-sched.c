@@ -5,11 +5,21 @@
 
 #include "seafile-session.h"
 #include "size-sched.h"
+#include "diff-simple.h"
 
 typedef struct SizeSchedulerPriv {
     pthread_mutex_t q_lock;
+    /* Repos whose owner is near the quota go first. */
+    GQueue *urgent_queue;
     GQueue *repo_size_job_queue;
+    /* repo id -> queued job, so that a repo is only queued once. */
+    GHashTable *pending;
+    /* Repos being computed. A repo is never computed by two jobs. */
+    GHashTable *running;
     int n_running_repo_size_jobs;
+    gint64 n_finished_jobs;
+
+    int n_workers;
 
     CcnetTimer *sched_timer;
 } SizeSchedulerPriv;
@@ -17,10 +27,13 @@ typedef struct SizeSchedulerPriv {
 typedef struct RepoSizeJob {
     SizeScheduler *sched;
     char repo_id[37];
+    gboolean urgent;
 } RepoSizeJob;
 
 #define SCHEDULER_INTV 1000    /* 1s */
-#define CONCURRENT_JOBS 1
+#define DEFAULT_WORKERS 4
+/* Owners using this much of their quota have their repos computed first. */
+#define NEAR_QUOTA_RATIO 0.9
 
 static int
 schedule_pulse (void *vscheduler);
@@ -47,7 +60,20 @@ size_scheduler_new (SeafileSession *session)
 
     pthread_mutex_init (&sched->priv->q_lock, NULL);
 
+    sched->priv->urgent_queue = g_queue_new ();
     sched->priv->repo_size_job_queue = g_queue_new ();
+    sched->priv->pending = g_hash_table_new (g_str_hash, g_str_equal);
+    sched->priv->running = g_hash_table_new_full (g_str_hash, g_str_equal,
+                                                  g_free, NULL);
+
+    /*
+     * [library]
+     * size_sched_workers = 4
+     */
+    sched->priv->n_workers = g_key_file_get_integer (session->config, "library",
+                                                     "size_sched_workers", NULL);
+    if (sched->priv->n_workers <= 0)
+        sched->priv->n_workers = DEFAULT_WORKERS;
 
     return sched;
 }
@@ -62,50 +88,147 @@ size_scheduler_start (SizeScheduler *scheduler)
     return 0;
 }
 
+/*
+ * Whether the owner of the repo uses most of the quota. The usage is
+ * from the sizes computed so far, which is what quota checks see too.
+ */
+static gboolean
+repo_near_quota (SizeScheduler *sched, const char *repo_id)
+{
+    SeafVirtRepo *vinfo;
+    const char *r_repo_id = repo_id;
+    char *user;
+    gint64 quota, usage;
+    gboolean ret = FALSE;
+
+    vinfo = seaf_repo_manager_get_virtual_repo_info (sched->seaf->repo_mgr,
+                                                     repo_id);
+    if (vinfo)
+        r_repo_id = vinfo->origin_repo_id;
+
+    user = seaf_repo_manager_get_repo_owner (sched->seaf->repo_mgr, r_repo_id);
+    if (!user)
+        goto out;
+
+    quota = seaf_quota_manager_get_user_quota (sched->seaf->quota_mgr, user);
+    if (quota <= 0)
+        goto out;
+
+    usage = seaf_quota_manager_get_user_usage (sched->seaf->quota_mgr, user);
+    ret = (usage >= quota * NEAR_QUOTA_RATIO);
+
+out:
+    seaf_virtual_repo_info_free (vinfo);
+    g_free (user);
+    return ret;
+}
+
 void
 schedule_repo_size_computation (SizeScheduler *scheduler, const char *repo_id)
 {
-    RepoSizeJob *job = g_new0(RepoSizeJob, 1);
+    SizeSchedulerPriv *priv = scheduler->priv;
+    RepoSizeJob *job;
+    gboolean pending, urgent;
+
+    /* A queued job computes the size at the head it finds when it runs. */
+    pthread_mutex_lock (&priv->q_lock);
+    pending = (g_hash_table_lookup (priv->pending, repo_id) != NULL);
+    pthread_mutex_unlock (&priv->q_lock);
+    if (pending)
+        return;
+
+    urgent = repo_near_quota (scheduler, repo_id);
+
+    pthread_mutex_lock (&priv->q_lock);
+    if (!g_hash_table_lookup (priv->pending, repo_id)) {
+        job = g_new0 (RepoSizeJob, 1);
+        job->sched = scheduler;
+        memcpy (job->repo_id, repo_id, 37);
+        job->urgent = urgent;
+        g_queue_push_tail (urgent ? priv->urgent_queue : priv->repo_size_job_queue,
+                           job);
+        g_hash_table_insert (priv->pending, job->repo_id, job);
+    }
+    pthread_mutex_unlock (&priv->q_lock);
+}
+
+static RepoSizeJob *
+pop_job (SizeSchedulerPriv *priv)
+{
+    RepoSizeJob *job;
 
-    job->sched = scheduler;
-    memcpy (job->repo_id, repo_id, 37);
+    job = g_queue_pop_head (priv->urgent_queue);
+    if (!job)
+        job = g_queue_pop_head (priv->repo_size_job_queue);
+    return job;
+}
 
-    pthread_mutex_lock (&scheduler->priv->q_lock);
-    g_queue_push_tail (scheduler->priv->repo_size_job_queue, job);
-    pthread_mutex_unlock (&scheduler->priv->q_lock);
+static void
+push_back_job (SizeSchedulerPriv *priv, RepoSizeJob *job)
+{
+    g_queue_push_head (job->urgent ? priv->urgent_queue : priv->repo_size_job_queue,
+                       job);
 }
 
 static int
 schedule_pulse (void *vscheduler)
 {
     SizeScheduler *sched = vscheduler;
+    SizeSchedulerPriv *priv = sched->priv;
     RepoSizeJob *job;
+    GList *busy = NULL, *ptr;
+    gint64 ret;
 
-    while (sched->priv->n_running_repo_size_jobs < CONCURRENT_JOBS) {
-        pthread_mutex_lock (&sched->priv->q_lock);
-        job = (RepoSizeJob *)g_queue_pop_head (sched->priv->repo_size_job_queue);
-        pthread_mutex_unlock (&sched->priv->q_lock);
+    pthread_mutex_lock (&priv->q_lock);
 
+    while (priv->n_running_repo_size_jobs < priv->n_workers) {
+        job = pop_job (priv);
         if (!job)
             break;
 
-        int ret = ccnet_job_manager_schedule_job (sched->seaf->job_mgr,
-                                                  compute_repo_size,
-                                                  compute_repo_size_done,
-                                                  job);
+        /* Wait for the running job of the same repo to finish. */
+        if (g_hash_table_lookup (priv->running, job->repo_id)) {
+            busy = g_list_prepend (busy, job);
+            continue;
+        }
+
+        ret = bg_job_manager_schedule (sched->seaf->bg_job_mgr, BG_JOB_SIZE,
+                                       compute_repo_size,
+                                       compute_repo_size_done,
+                                       job);
         if (ret < 0) {
             g_warning ("[scheduler] failed to start compute job.\n");
-            pthread_mutex_lock (&sched->priv->q_lock);
-            g_queue_push_head (sched->priv->repo_size_job_queue, job);
-            pthread_mutex_unlock (&sched->priv->q_lock);
+            push_back_job (priv, job);
             break;
         }
-        ++(sched->priv->n_running_repo_size_jobs);
+        g_hash_table_remove (priv->pending, job->repo_id);
+        g_hash_table_insert (priv->running, g_strdup(job->repo_id), job);
+        ++(priv->n_running_repo_size_jobs);
     }
 
+    /* Busy repos keep their place in the queue. */
+    for (ptr = busy; ptr; ptr = ptr->next)
+        push_back_job (priv, ptr->data);
+    g_list_free (busy);
+
+    pthread_mutex_unlock (&priv->q_lock);
+
     return 1;
 }
 
+void
+size_scheduler_get_stats (SizeScheduler *scheduler, SizeSchedulerStats *stats)
+{
+    SizeSchedulerPriv *priv = scheduler->priv;
+
+    pthread_mutex_lock (&priv->q_lock);
+    stats->n_urgent = g_queue_get_length (priv->urgent_queue);
+    stats->n_queued = g_queue_get_length (priv->repo_size_job_queue);
+    stats->n_running = priv->n_running_repo_size_jobs;
+    stats->n_finished = priv->n_finished_jobs;
+    pthread_mutex_unlock (&priv->q_lock);
+}
+
 static gboolean get_head_id (SeafDBRow *row, void *data)
 {
     char *head_id_out = data;
@@ -196,13 +319,155 @@ rollback:
     return ret;
 }
 
-static char *
-get_cached_head_id (SeafDB *db, const char *repo_id)
+typedef struct CachedSize {
+    char *head_id;
+    gint64 size;
+} CachedSize;
+
+static gboolean
+get_cached_size_cb (SeafDBRow *row, void *data)
+{
+    CachedSize *cached = data;
+
+    cached->head_id = g_strdup (seaf_db_row_get_column_text (row, 0));
+    cached->size = seaf_db_row_get_column_int64 (row, 1);
+
+    return FALSE;
+}
+
+/* Get the head id and size stored for the repo, both read at once. */
+static int
+get_cached_size (SeafDB *db, const char *repo_id, CachedSize *cached)
 {
     char *sql;
 
-    sql = "SELECT head_id FROM RepoSize WHERE repo_id=?";
-    return seaf_db_statement_get_string (db, sql, 1, "string", repo_id);
+    cached->head_id = NULL;
+    cached->size = -1;
+
+    sql = "SELECT head_id, size FROM RepoSize WHERE repo_id=?";
+    if (seaf_db_statement_foreach_row (db, sql, get_cached_size_cb, cached,
+                                       1, "string", repo_id) < 0)
+        return -1;
+    return 0;
+}
+
+typedef struct SizeDiffData {
+    const char *store_id;
+    int version;
+    gint64 delta;
+} SizeDiffData;
+
+static int
+size_diff_files (int n, const char *basedir, SeafDirent *files[], void *vdata)
+{
+    SizeDiffData *data = vdata;
+
+    if (files[0])
+        data->delta -= files[0]->size;
+    if (files[1])
+        data->delta += files[1]->size;
+
+    return 0;
+}
+
+static int
+size_diff_dirs (int n, const char *basedir, SeafDirent *dirs[], void *vdata,
+                gboolean *recurse)
+{
+    SizeDiffData *data = vdata;
+    gint64 size;
+    int i;
+
+    /* Only a dir present in both trees needs to be diffed. Sizes of
+     * added or removed dirs are looked up as a whole.
+     */
+    if (dirs[0] && dirs[1]) {
+        *recurse = TRUE;
+        return 0;
+    }
+
+    *recurse = FALSE;
+    i = dirs[0] ? 0 : 1;
+    size = seaf_fs_manager_get_fs_size (seaf->fs_mgr, data->store_id,
+                                        data->version, dirs[i]->id);
+    if (size < 0)
+        return -1;
+
+    if (i == 0)
+        data->delta -= size;
+    else
+        data->delta += size;
+
+    return 0;
+}
+
+/*
+ * Compute the size of @new_root from the size of @old_root by diffing
+ * the two trees, so only the changed paths are visited.
+ * Returns -1 if that's not possible.
+ */
+static gint64
+compute_size_incrementally (SeafRepo *repo,
+                            const char *old_root,
+                            gint64 old_size,
+                            const char *new_root)
+{
+    DiffOptions opts;
+    SizeDiffData data;
+    const char *trees[2];
+
+    /* Version 0 dirents don't record file sizes. */
+    if (repo->version == 0 || old_size < 0)
+        return -1;
+
+    memset (&data, 0, sizeof(data));
+    data.store_id = repo->store_id;
+    data.version = repo->version;
+
+    memset (&opts, 0, sizeof(opts));
+    memcpy (opts.store_id, repo->store_id, 36);
+    opts.version = repo->version;
+    opts.file_cb = size_diff_files;
+    opts.dir_cb = size_diff_dirs;
+    opts.data = &data;
+
+    trees[0] = old_root;
+    trees[1] = new_root;
+    if (diff_trees (2, trees, &opts) < 0)
+        return -1;
+
+    if (old_size + data.delta < 0)
+        return -1;
+    return old_size + data.delta;
+}
+
+static gint64
+compute_size (SizeScheduler *sched, SeafRepo *repo,
+              CachedSize *cached, SeafCommit *head)
+{
+    SeafCommit *old_head = NULL;
+    gint64 size = -1;
+
+    if (cached->head_id) {
+        old_head = seaf_commit_manager_get_commit (sched->seaf->commit_mgr,
+                                                   repo->id, repo->version,
+                                                   cached->head_id);
+    }
+
+    if (old_head) {
+        size = compute_size_incrementally (repo, old_head->root_id,
+                                           cached->size, head->root_id);
+        seaf_commit_unref (old_head);
+    }
+
+    /* Dir sizes are cached by the fs manager, so unchanged subtrees
+     * are not walked again either way.
+     */
+    if (size < 0)
+        size = seaf_fs_manager_get_fs_size (sched->seaf->fs_mgr,
+                                            repo->store_id, repo->version,
+                                            head->root_id);
+    return size;
 }
 
 static void*
@@ -212,7 +477,7 @@ compute_repo_size (void *vjob)
     SizeScheduler *sched = job->sched;
     SeafRepo *repo = NULL;
     SeafCommit *head = NULL;
-    char *cached_head_id = NULL;
+    CachedSize cached = { NULL, -1 };
     gint64 size = 0;
 
 retry:
@@ -222,8 +487,12 @@ retry:
         return vjob;
     }
 
-    cached_head_id = get_cached_head_id (sched->seaf->db, job->repo_id);
-    if (g_strcmp0 (cached_head_id, repo->head->commit_id) == 0)
+    if (get_cached_size (sched->seaf->db, job->repo_id, &cached) < 0) {
+        g_warning ("[scheduler] failed to get cached size of repo %s.\n",
+                   job->repo_id);
+        goto out;
+    }
+    if (g_strcmp0 (cached.head_id, repo->head->commit_id) == 0)
         goto out;
 
     head = seaf_commit_manager_get_commit (sched->seaf->commit_mgr,
@@ -235,9 +504,7 @@ retry:
         goto out;
     }
 
-    size = seaf_fs_manager_get_fs_size (sched->seaf->fs_mgr,
-                                        repo->store_id, repo->version,
-                                        head->root_id);
+    size = compute_size (sched, repo, &cached, head);
     if (size < 0) {
         g_warning ("[scheduler] Failed to compute size of repo %.8s.\n",
                    repo->id);
@@ -246,26 +513,31 @@ retry:
 
     int ret = set_repo_size (sched->seaf->db,
                              job->repo_id,
-                             cached_head_id,
+                             cached.head_id,
                              repo->head->commit_id,
                              size);
     if (ret == SET_SIZE_ERROR)
         g_warning ("[scheduler] failed to store repo size %s.\n", job->repo_id);
+    else if (ret == 0) {
+        seaf_repo_manager_invalidate_repo (sched->seaf->repo_mgr, job->repo_id);
+        seaf_quota_manager_add_repo_usage (sched->seaf->quota_mgr, job->repo_id,
+                                           cached.head_id ? size - cached.size : size);
+    }
     else if (ret == SET_SIZE_CONFLICT) {
         size = 0;
         seaf_repo_unref (repo);
         seaf_commit_unref (head);
-        g_free (cached_head_id);
+        g_free (cached.head_id);
         repo = NULL;
         head = NULL;
-        cached_head_id = NULL;
+        cached.head_id = NULL;
         goto retry;
     }
 
 out:
     seaf_repo_unref (repo);
     seaf_commit_unref (head);
-    g_free (cached_head_id);
+    g_free (cached.head_id);
 
     return vjob;
 }
@@ -274,6 +546,13 @@ static void
 compute_repo_size_done (void *vjob)
 {
     RepoSizeJob *job = vjob;
-    --(job->sched->priv->n_running_repo_size_jobs);
+    SizeSchedulerPriv *priv = job->sched->priv;
+
+    pthread_mutex_lock (&priv->q_lock);
+    g_hash_table_remove (priv->running, job->repo_id);
+    --(priv->n_running_repo_size_jobs);
+    ++(priv->n_finished_jobs);
+    pthread_mutex_unlock (&priv->q_lock);
+
     g_free (job);
 }
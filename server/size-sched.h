@@ -1,6 +1,8 @@
 #ifndef SIZE_SCHEDULER_H
 #define SIZE_SCHEDULER_H
 
+#include <glib.h>
+
 struct _SeafileSession;
 
 struct SizeSchedulerPriv;
@@ -17,7 +19,21 @@ size_scheduler_new (struct _SeafileSession *session);
 int
 size_scheduler_start (SizeScheduler *scheduler);
 
+/*
+ * Queue the size computation of @repo_id, unless it's already queued.
+ * Repos whose owner is near the quota are computed first.
+ */
 void
 schedule_repo_size_computation (SizeScheduler *scheduler, const char *repo_id);
 
+typedef struct SizeSchedulerStats {
+    int n_urgent;               /* queued, near quota */
+    int n_queued;               /* queued, the others */
+    int n_running;
+    gint64 n_finished;
+} SizeSchedulerStats;
+
+void
+size_scheduler_get_stats (SizeScheduler *scheduler, SizeSchedulerStats *stats);
+
 #endif
@@ -25,6 +25,7 @@
 #include "seafile-session.h"
 #include "upload-file.h"
 #include "http-status-codes.h"
+#include "mem-stats.h"
 
 enum RecvState {
     RECV_INIT,
@@ -43,9 +44,15 @@ enum UploadError {
     ERROR_INTERNAL,
 };
 
+/*
+ * Upload progress, shared by the upload and the polls for it.
+ * @uploaded is only changed by the upload and read with atomic builtins,
+ * since GLib has no 64-bit atomics.
+ */
 typedef struct Progress {
     gint64 uploaded;
     gint64 size;
+    int ref;
 } Progress;
 
 typedef struct RecvFSM {
@@ -67,6 +74,20 @@ typedef struct RecvFSM {
     int fd;
     GList *tmp_files;           /* tmp files for each uploading file */
 
+    /* Streaming mode: file data goes straight into the block store and
+     * no tmp files are written. The ids and sizes (gint64 *) of the
+     * indexed files are kept in the same order as filenames.
+     */
+    gboolean streaming;
+    char *store_id;
+    int repo_version;
+    SeafileCrypt *crypt;
+    gint64 size_hint;
+    SeafStreamIndexer *indexer;
+    GList *file_ids;
+    GList *file_sizes;
+    gint64 total_size;          /* of all files received so far */
+
     /* For upload progress. */
     char *progress_id;
     Progress *progress;
@@ -76,8 +97,100 @@ typedef struct RecvFSM {
 
 #define POST_FILE_ERR_FILENAME 401
 
-static GHashTable *upload_progress;
-static pthread_mutex_t pg_lock;
+/*
+ * Progress of the uploads with a progress id, spread over shards by the
+ * hash of the id. An upload is registered and removed once, and a poll
+ * only locks the shard of its id while taking a reference.
+ */
+#define PROGRESS_SHARDS 64
+
+typedef struct ProgressShard {
+    pthread_mutex_t lock;
+    GHashTable *progress;       /* progress id -> Progress */
+    gint64 bytes;               /* see progress_entry_size() */
+} ProgressShard;
+
+static ProgressShard progress_shards[PROGRESS_SHARDS];
+
+static inline ProgressShard *
+progress_shard (const char *progress_id)
+{
+    return &progress_shards[g_str_hash (progress_id) % PROGRESS_SHARDS];
+}
+
+static void
+progress_unref (Progress *progress)
+{
+    if (g_atomic_int_dec_and_test (&progress->ref))
+        g_free (progress);
+}
+
+static inline void
+progress_add_uploaded (Progress *progress, gint64 n)
+{
+    __sync_fetch_and_add (&progress->uploaded, n);
+}
+
+static inline gint64
+progress_get_uploaded (Progress *progress)
+{
+    return __sync_fetch_and_add (&progress->uploaded, 0);
+}
+
+static inline gint64
+progress_entry_size (const char *progress_id)
+{
+    return strlen (progress_id) + 1 + sizeof(Progress) +
+        MEM_STATS_HASH_ENTRY_SIZE;
+}
+
+/* Returns NULL if @progress_id is already taken. */
+static Progress *
+register_progress (const char *progress_id, gint64 size)
+{
+    ProgressShard *shard = progress_shard (progress_id);
+    Progress *progress = NULL;
+
+    pthread_mutex_lock (&shard->lock);
+    if (!g_hash_table_lookup (shard->progress, progress_id)) {
+        progress = g_new0 (Progress, 1);
+        progress->size = size;
+        /* One for the table, one for the upload. */
+        progress->ref = 2;
+        g_hash_table_insert (shard->progress, g_strdup(progress_id), progress);
+        shard->bytes += progress_entry_size (progress_id);
+    }
+    pthread_mutex_unlock (&shard->lock);
+
+    return progress;
+}
+
+static void
+unregister_progress (const char *progress_id)
+{
+    ProgressShard *shard = progress_shard (progress_id);
+
+    pthread_mutex_lock (&shard->lock);
+    if (g_hash_table_remove (shard->progress, progress_id))
+        shard->bytes -= progress_entry_size (progress_id);
+    pthread_mutex_unlock (&shard->lock);
+}
+
+/* Returns a new reference, so the progress outlives a finished upload. */
+static Progress *
+lookup_progress (const char *progress_id)
+{
+    ProgressShard *shard = progress_shard (progress_id);
+    Progress *progress;
+
+    pthread_mutex_lock (&shard->lock);
+    progress = g_hash_table_lookup (shard->progress, progress_id);
+    if (progress)
+        g_atomic_int_inc (&progress->ref);
+    pthread_mutex_unlock (&shard->lock);
+
+    return progress;
+}
 
 /* IE8 will set filename to the full path of the uploaded file.
  * So we need to strip out the basename from it.
@@ -218,6 +331,19 @@ redirect_to_success_page (evhtp_request_t *req,
     send_redirect_reply (req);
 }
 
+static gboolean
+check_upload_size (gint64 total_size, int *error_code)
+{
+    if (seaf->http_server->max_upload_size != -1 &&
+        total_size > seaf->http_server->max_upload_size) {
+        seaf_warning ("[upload] File size is too large.\n");
+        *error_code = ERROR_SIZE;
+        return FALSE;
+    }
+
+    return TRUE;
+}
+
 static gboolean
 check_tmp_file_list (GList *tmp_files, int *error_code)
 {
@@ -238,14 +364,15 @@ check_tmp_file_list (GList *tmp_files, int *error_code)
         total_size += (gint64)st.st_size;
     }
 
-    if (seaf->http_server->max_upload_size != -1 &&
-        total_size > seaf->http_server->max_upload_size) {
-        seaf_warning ("[upload] File size is too large.\n");
-        *error_code = ERROR_SIZE;
-        return FALSE;
-    }
+    return check_upload_size (total_size, error_code);
+}
 
-    return TRUE;
+static gboolean
+check_uploaded_files (RecvFSM *fsm, int *error_code)
+{
+    if (fsm->streaming)
+        return check_upload_size (fsm->total_size, error_code);
+    return check_tmp_file_list (fsm->files, error_code);
 }
 
 static char *
@@ -272,6 +399,43 @@ file_list_to_json (GList *files)
     return ret;
 }
 
+/* Add the uploaded files to @parent_dir, whether streamed or in tmp files. */
+static int
+post_uploaded_files (RecvFSM *fsm, const char *parent_dir, int replace,
+                     char **ret_json, GError **error)
+{
+    char *filenames_json, *tmp_files_json;
+    int rc;
+
+    if (fsm->streaming)
+        return seaf_repo_manager_post_indexed_files (seaf->repo_mgr,
+                                                     fsm->repo_id,
+                                                     parent_dir,
+                                                     fsm->filenames,
+                                                     fsm->file_ids,
+                                                     fsm->file_sizes,
+                                                     fsm->user,
+                                                     replace,
+                                                     ret_json,
+                                                     error);
+
+    filenames_json = file_list_to_json (fsm->filenames);
+    tmp_files_json = file_list_to_json (fsm->files);
+
+    rc = seaf_repo_manager_post_multi_files (seaf->repo_mgr,
+                                             fsm->repo_id,
+                                             parent_dir,
+                                             filenames_json,
+                                             tmp_files_json,
+                                             fsm->user,
+                                             replace,
+                                             ret_json,
+                                             error);
+    g_free (filenames_json);
+    g_free (tmp_files_json);
+    return rc;
+}
+
 static void
 upload_cb(evhtp_request_t *req, void *arg)
 {
@@ -280,7 +444,6 @@ upload_cb(evhtp_request_t *req, void *arg)
     GError *error = NULL;
     int error_code = ERROR_INTERNAL;
     char *err_file = NULL;
-    char *filenames_json, *tmp_files_json;
 
     /* After upload_headers_cb() returns an error, libevhtp may still
      * receive data from the web browser and call into this cb.
@@ -289,7 +452,7 @@ upload_cb(evhtp_request_t *req, void *arg)
     if (!fsm || fsm->state == RECV_ERROR)
         return;
 
-    if (!fsm->files) {
+    if (!fsm->filenames) {
         seaf_warning ("[upload] No file uploaded.\n");
         send_error_reply (req, EVHTP_RES_BADREQ, "No file.\n");
         return;
@@ -302,7 +465,7 @@ upload_cb(evhtp_request_t *req, void *arg)
         return;
     }
 
-    if (!check_tmp_file_list (fsm->files, &error_code))
+    if (!check_uploaded_files (fsm, &error_code))
         goto error;
 
     if (seaf_quota_manager_check_quota (seaf->quota_mgr, fsm->repo_id) < 0) {
@@ -310,20 +473,7 @@ upload_cb(evhtp_request_t *req, void *arg)
         goto error;
     }
 
-    filenames_json = file_list_to_json (fsm->filenames);
-    tmp_files_json = file_list_to_json (fsm->files);
-
-    int rc = seaf_repo_manager_post_multi_files (seaf->repo_mgr,
-                                                 fsm->repo_id,
-                                                 parent_dir,
-                                                 filenames_json,
-                                                 tmp_files_json,
-                                                 fsm->user,
-                                                 0,
-                                                 NULL,
-                                                 &error);
-    g_free (filenames_json);
-    g_free (tmp_files_json);
+    int rc = post_uploaded_files (fsm, parent_dir, 0, NULL, &error);
     if (rc < 0) {
         if (error) {
             if (error->code == POST_FILE_ERR_FILENAME) {
@@ -381,7 +531,6 @@ upload_api_cb(evhtp_request_t *req, void *arg)
     char *parent_dir, *replace_str;
     GError *error = NULL;
     int error_code = ERROR_INTERNAL;
-    char *filenames_json, *tmp_files_json;
     int replace = 0;
 
     /* After upload_headers_cb() returns an error, libevhtp may still
@@ -391,7 +540,7 @@ upload_api_cb(evhtp_request_t *req, void *arg)
     if (!fsm || fsm->state == RECV_ERROR)
         return;
 
-    if (!fsm->files) {
+    if (!fsm->filenames) {
         seaf_warning ("[upload] No file uploaded.\n");
         send_error_reply (req, EVHTP_RES_BADREQ, "No file.\n");
         return;
@@ -413,7 +562,7 @@ upload_api_cb(evhtp_request_t *req, void *arg)
         return;
     }
 
-    if (!check_tmp_file_list (fsm->files, &error_code))
+    if (!check_uploaded_files (fsm, &error_code))
         goto error;
 
     if (seaf_quota_manager_check_quota (seaf->quota_mgr, fsm->repo_id) < 0) {
@@ -421,21 +570,8 @@ upload_api_cb(evhtp_request_t *req, void *arg)
         goto error;
     }
 
-    filenames_json = file_list_to_json (fsm->filenames);
-    tmp_files_json = file_list_to_json (fsm->files);
-
     char *ret_json = NULL;
-    int rc = seaf_repo_manager_post_multi_files (seaf->repo_mgr,
-                                                 fsm->repo_id,
-                                                 parent_dir,
-                                                 filenames_json,
-                                                 tmp_files_json,
-                                                 fsm->user,
-                                                 replace,
-                                                 &ret_json,
-                                                 &error);
-    g_free (filenames_json);
-    g_free (tmp_files_json);
+    int rc = post_uploaded_files (fsm, parent_dir, replace, &ret_json, &error);
     if (rc < 0) {
         if (error) {
             if (error->code == POST_FILE_ERR_FILENAME) {
@@ -698,7 +834,6 @@ upload_ajax_cb(evhtp_request_t *req, void *arg)
     char *parent_dir;
     GError *error = NULL;
     int error_code = ERROR_INTERNAL;
-    char *filenames_json, *tmp_files_json;
 
     evhtp_headers_add_header (req->headers_out,
                               evhtp_header_new("Access-Control-Allow-Headers",
@@ -729,7 +864,7 @@ upload_ajax_cb(evhtp_request_t *req, void *arg)
     if (!fsm || fsm->state == RECV_ERROR)
         return;
 
-    if (!fsm->files) {
+    if (!fsm->filenames) {
         seaf_warning ("[upload] No file uploaded.\n");
         send_error_reply (req, EVHTP_RES_BADREQ, "No file.\n");
         return;
@@ -742,7 +877,7 @@ upload_ajax_cb(evhtp_request_t *req, void *arg)
         return;
     }
 
-    if (!check_tmp_file_list (fsm->files, &error_code))
+    if (!check_uploaded_files (fsm, &error_code))
         goto error;
 
     if (seaf_quota_manager_check_quota (seaf->quota_mgr, fsm->repo_id) < 0) {
@@ -750,21 +885,8 @@ upload_ajax_cb(evhtp_request_t *req, void *arg)
         goto error;
     }
 
-    filenames_json = file_list_to_json (fsm->filenames);
-    tmp_files_json = file_list_to_json (fsm->files);
-
     char *ret_json = NULL;
-    int rc = seaf_repo_manager_post_multi_files (seaf->repo_mgr,
-                                                 fsm->repo_id,
-                                                 parent_dir,
-                                                 filenames_json,
-                                                 tmp_files_json,
-                                                 fsm->user,
-                                                 0,
-                                                 &ret_json,
-                                                 &error);
-    g_free (filenames_json);
-    g_free (tmp_files_json);
+    int rc = post_uploaded_files (fsm, parent_dir, 0, &ret_json, &error);
     if (rc < 0) {
         if (error) {
             if (error->code == POST_FILE_ERR_FILENAME) {
@@ -1356,14 +1478,19 @@ upload_finish_cb (evhtp_request_t *req, void *arg)
     string_list_free (fsm->filenames);
     string_list_free (fsm->files);
 
+    g_free (fsm->store_id);
+    g_free (fsm->crypt);
+    seaf_stream_indexer_free (fsm->indexer);
+    string_list_free (fsm->file_ids);
+    for (ptr = fsm->file_sizes; ptr; ptr = ptr->next)
+        g_free (ptr->data);
+    g_list_free (fsm->file_sizes);
+
     evbuffer_free (fsm->line);
 
     if (fsm->progress_id) {
-        pthread_mutex_lock (&pg_lock);
-        g_hash_table_remove (upload_progress, fsm->progress_id);
-        pthread_mutex_unlock (&pg_lock);
-
-        /* fsm->progress has been free'd by g_hash_table_remove(). */
+        unregister_progress (fsm->progress_id);
+        progress_unref (fsm->progress);
         g_free (fsm->progress_id);
     }
 
@@ -1470,6 +1597,25 @@ open_temp_file (RecvFSM *fsm)
     return 0;
 }
 
+static int
+open_file_indexer (RecvFSM *fsm)
+{
+    fsm->indexer = seaf_stream_indexer_new (seaf->fs_mgr,
+                                            fsm->store_id,
+                                            fsm->repo_version,
+                                            fsm->size_hint,
+                                            fsm->crypt);
+    return fsm->indexer ? 0 : -1;
+}
+
+static int
+open_uploaded_file (RecvFSM *fsm)
+{
+    if (fsm->streaming)
+        return open_file_indexer (fsm);
+    return open_temp_file (fsm);
+}
+
 static evhtp_res
 recv_form_field (RecvFSM *fsm, gboolean *no_line)
 {
@@ -1501,19 +1647,87 @@ recv_form_field (RecvFSM *fsm, gboolean *no_line)
     return EVHTP_RES_OK;
 }
 
-static void
+static int
+add_indexed_file (RecvFSM *fsm)
+{
+    unsigned char sha1[20];
+    char hex[41];
+    gint64 *size;
+    int ret = 0;
+
+    /* The indexer is dropped once the upload is too large. */
+    if (!fsm->indexer)
+        return 0;
+
+    size = g_new (gint64, 1);
+    if (seaf_stream_indexer_finish (fsm->indexer, sha1, size) < 0) {
+        seaf_warning ("[upload] Failed to index uploaded file.\n");
+        g_free (size);
+        ret = -1;
+        goto out;
+    }
+
+    rawdata_to_hex (sha1, hex, 20);
+    fsm->file_ids = g_list_prepend (fsm->file_ids, g_strdup(hex));
+    fsm->file_sizes = g_list_prepend (fsm->file_sizes, size);
+
+out:
+    seaf_stream_indexer_free (fsm->indexer);
+    fsm->indexer = NULL;
+    return ret;
+}
+
+static int
 add_uploaded_file (RecvFSM *fsm)
 {
+    if (fsm->streaming) {
+        if (add_indexed_file (fsm) < 0)
+            return -1;
+    } else {
+        fsm->files = g_list_prepend (fsm->files, g_strdup(fsm->tmp_file));
+        g_free (fsm->tmp_file);
+        close (fsm->fd);
+        fsm->tmp_file = NULL;
+    }
+
     fsm->filenames = g_list_prepend (fsm->filenames,
                                      get_basename(fsm->file_name));
-    fsm->files = g_list_prepend (fsm->files, g_strdup(fsm->tmp_file));
-
     g_free (fsm->file_name);
-    g_free (fsm->tmp_file);
-    close (fsm->fd);
     fsm->file_name = NULL;
-    fsm->tmp_file = NULL;
     fsm->recved_crlf = FALSE;
+
+    return 0;
+}
+
+static int
+write_file_data (RecvFSM *fsm, const char *buf, size_t len)
+{
+    if (!fsm->streaming) {
+        if (writen (fsm->fd, buf, len) < 0) {
+            seaf_warning ("[upload] Failed to write temp file: %s.\n",
+                          strerror(errno));
+            return -1;
+        }
+        return 0;
+    }
+
+    fsm->total_size += len;
+    if (!fsm->indexer)
+        return 0;
+
+    /* Stop storing blocks for an upload that is going to be refused. */
+    if (seaf->http_server->max_upload_size != -1 &&
+        fsm->total_size > seaf->http_server->max_upload_size) {
+        seaf_stream_indexer_free (fsm->indexer);
+        fsm->indexer = NULL;
+        return 0;
+    }
+
+    if (seaf_stream_indexer_feed (fsm->indexer, buf, len) < 0) {
+        seaf_warning ("[upload] Failed to index uploaded data.\n");
+        return -1;
+    }
+    return 0;
 }
 
 static evhtp_res
@@ -1535,19 +1749,14 @@ recv_file_data (RecvFSM *fsm, gboolean *no_line)
             seaf_debug ("[upload] recv file data %d bytes.\n",
                      evbuffer_get_length(fsm->line));
             if (fsm->recved_crlf) {
-                if (writen (fsm->fd, "\r\n", 2) < 0) {
-                    seaf_warning ("[upload] Failed to write temp file: %s.\n",
-                               strerror(errno));
+                if (write_file_data (fsm, "\r\n", 2) < 0)
                     return EVHTP_RES_SERVERR;
-                }
             }
 
             size_t size = evbuffer_get_length (fsm->line);
             char *buf = g_new (char, size);
             evbuffer_remove (fsm->line, buf, size);
-            if (writen (fsm->fd, buf, size) < 0) {
-                seaf_warning ("[upload] Failed to write temp file: %s.\n",
-                           strerror(errno));
+            if (write_file_data (fsm, buf, size) < 0) {
                 g_free (buf);
                 return EVHTP_RES_SERVERR;
             }
@@ -1558,7 +1767,10 @@ recv_file_data (RecvFSM *fsm, gboolean *no_line)
     } else if (strstr (line, fsm->boundary) != NULL) {
         seaf_debug ("[upload] file data ends.\n");
 
-        add_uploaded_file (fsm);
+        if (add_uploaded_file (fsm) < 0) {
+            free (line);
+            return EVHTP_RES_SERVERR;
+        }
 
         g_free (fsm->input_name);
         fsm->input_name = NULL;
@@ -1567,15 +1779,12 @@ recv_file_data (RecvFSM *fsm, gboolean *no_line)
     } else {
         seaf_debug ("[upload] recv file data %d bytes.\n", len + 2);
         if (fsm->recved_crlf) {
-            if (writen (fsm->fd, "\r\n", 2) < 0) {
-                seaf_warning ("[upload] Failed to write temp file: %s.\n",
-                           strerror(errno));
+            if (write_file_data (fsm, "\r\n", 2) < 0) {
+                free (line);
                 return EVHTP_RES_SERVERR;
             }
         }
-        if (writen (fsm->fd, line, len) < 0) {
-            seaf_warning ("[upload] Failed to write temp file: %s.\n",
-                       strerror(errno));
+        if (write_file_data (fsm, line, len) < 0) {
             free (line);
             return EVHTP_RES_SERVERR;
         }
@@ -1614,10 +1823,12 @@ upload_read_cb (evhtp_request_t *req, evbuf_t *buf, void *arg)
 
     /* Update upload progress. */
     if (fsm->progress) {
-        fsm->progress->uploaded += (gint64)evbuffer_get_length(buf);
+        progress_add_uploaded (fsm->progress,
+                               (gint64)evbuffer_get_length(buf));
 
         seaf_debug ("progress: %lld/%lld\n",
-                    fsm->progress->uploaded, fsm->progress->size);
+                    progress_get_uploaded (fsm->progress),
+                    fsm->progress->size);
     }
 
     evbuffer_add_buffer (fsm->line, buf);
@@ -1653,7 +1864,7 @@ upload_read_cb (evhtp_request_t *req, evbuf_t *buf, void *arg)
                     /* Read an blank line, headers end. */
                     free (line);
                     if (g_strcmp0 (fsm->input_name, "file") == 0) {
-                        if (open_temp_file (fsm) < 0) {
+                        if (open_uploaded_file (fsm) < 0) {
                             seaf_warning ("[upload] Failed open temp file.\n");
                             res = EVHTP_RES_SERVERR;
                             goto out;
@@ -1820,6 +2031,57 @@ get_progress_info (evhtp_request_t *req,
     return 0;
 }
 
+/*
+ * Stream the files of a new-file upload straight into the repo's store.
+ * Updates and block uploads still go through tmp files. Encrypted repos
+ * without a password set are left to fail in post_multi_files, as before.
+ */
+static void
+setup_streaming (RecvFSM *fsm, const char *url_op, evhtp_headers_t *hdr)
+{
+    SeafRepo *repo;
+    const char *content_len_str;
+    unsigned char key[32], iv[16];
+
+    if (!seaf->http_server->streaming_upload)
+        return;
+
+    if (strcmp (url_op, "upload") != 0 &&
+        strcmp (url_op, "upload-api") != 0 &&
+        strcmp (url_op, "upload-aj") != 0)
+        return;
+
+    /* The body holds all files of the request, so it bounds the size of
+     * each. Files that may be large enough for a bigger block size are
+     * indexed from tmp files, once their size is known.
+     */
+    content_len_str = evhtp_kv_find (hdr, "Content-Length");
+    if (!content_len_str)
+        return;
+    fsm->size_hint = strtoll (content_len_str, NULL, 10);
+    if (!seaf_stream_indexer_supports_size (fsm->size_hint))
+        return;
+
+    repo = seaf_repo_manager_get_repo (seaf->repo_mgr, fsm->repo_id);
+    if (!repo)
+        return;
+
+    if (repo->encrypted) {
+        if (seaf_passwd_manager_get_decrypt_key_raw (seaf->passwd_mgr,
+                                                     repo->id, fsm->user,
+                                                     key, iv) < 0)
+            goto out;
+        fsm->crypt = seafile_crypt_new (repo->enc_version, key, iv);
+    }
+
+    fsm->store_id = g_strdup (repo->store_id);
+    fsm->repo_version = repo->version;
+    fsm->streaming = TRUE;
+
+out:
+    seaf_repo_unref (repo);
+}
+
 static evhtp_res
 upload_headers_cb (evhtp_request_t *req, evhtp_headers_t *hdr, void *arg)
 {
@@ -1865,13 +2127,11 @@ upload_headers_cb (evhtp_request_t *req, evhtp_headers_t *hdr, void *arg)
         goto err;
 
     if (progress_id != NULL) {
-        pthread_mutex_lock (&pg_lock);
-        if (g_hash_table_lookup (upload_progress, progress_id)) {
-            pthread_mutex_unlock (&pg_lock);
+        progress = register_progress (progress_id, content_len);
+        if (!progress) {
             err_msg = "Duplicate progress id.\n";
             goto err;
         }
-        pthread_mutex_unlock (&pg_lock);
     }
 
     fsm = g_new0 (RecvFSM, 1);
@@ -1882,15 +2142,11 @@ upload_headers_cb (evhtp_request_t *req, evhtp_headers_t *hdr, void *arg)
     fsm->form_kvs = g_hash_table_new_full (g_str_hash, g_str_equal,
                                            g_free, g_free);
 
+    setup_streaming (fsm, url_op, hdr);
+
     if (progress_id != NULL) {
-        progress = g_new0 (Progress, 1);
-        progress->size = content_len;
         fsm->progress_id = progress_id;
         fsm->progress = progress;
-
-        pthread_mutex_lock (&pg_lock);
-        g_hash_table_insert (upload_progress, g_strdup(progress_id), progress);
-        pthread_mutex_unlock (&pg_lock);
     }
 
     /* Set up per-request hooks, so that we can read file data piece by piece. */
@@ -1943,9 +2199,7 @@ upload_progress_cb(evhtp_request_t *req, void *arg)
         return;
     }
 
-    pthread_mutex_lock (&pg_lock);
-    progress = g_hash_table_lookup (upload_progress, progress_id);
-    pthread_mutex_unlock (&pg_lock);
+    progress = lookup_progress (progress_id);
 
     if (!progress) {
         /* seaf_warning ("[get pg] No progress found for %s.\n", progress_id); */
@@ -1957,7 +2211,9 @@ upload_progress_cb(evhtp_request_t *req, void *arg)
     buf = g_string_new (NULL);
     g_string_append_printf (buf,
                             "%s({\"uploaded\": %"G_GINT64_FORMAT", \"length\": %"G_GINT64_FORMAT"});",
-                            callback, progress->uploaded, progress->size);
+                            callback, progress_get_uploaded (progress),
+                            progress->size);
+    progress_unref (progress);
     evbuffer_add (req->buffer_out, buf->str, buf->len);
 
     seaf_debug ("JSONP: %s\n", buf->str);
@@ -1966,10 +2222,26 @@ upload_progress_cb(evhtp_request_t *req, void *arg)
     g_string_free (buf, TRUE);
 }
 
+static void
+progress_get_mem_stats (gpointer data, MemStats *stats)
+{
+    ProgressShard *shard;
+    int i;
+
+    for (i = 0; i < PROGRESS_SHARDS; ++i) {
+        shard = &progress_shards[i];
+        pthread_mutex_lock (&shard->lock);
+        stats->entries += g_hash_table_size (shard->progress);
+        stats->bytes += shard->bytes;
+        pthread_mutex_unlock (&shard->lock);
+    }
+}
+
 int
 upload_file_init (evhtp_t *htp, const char *http_temp_dir)
 {
     evhtp_callback_t *cb;
+    int i;
 
     if (g_mkdir_with_parents (http_temp_dir, 0777) < 0) {
         seaf_warning ("Failed to create temp file dir %s.\n",
@@ -2010,9 +2282,13 @@ upload_file_init (evhtp_t *htp, const char *http_temp_dir)
 
     evhtp_set_regex_cb (htp, "^/upload_progress.*", upload_progress_cb, NULL);
 
-    upload_progress = g_hash_table_new_full (g_str_hash, g_str_equal,
-                                             g_free, g_free);
-    pthread_mutex_init (&pg_lock, NULL);
+    for (i = 0; i < PROGRESS_SHARDS; ++i) {
+        pthread_mutex_init (&progress_shards[i].lock, NULL);
+        progress_shards[i].progress =
+            g_hash_table_new_full (g_str_hash, g_str_equal,
+                                   g_free, (GDestroyNotify)progress_unref);
+    }
+    mem_stats_register ("upload_progress", progress_get_mem_stats, NULL);
 
     return 0;
 }
@@ -8,7 +8,6 @@
 #include "log.h"
 
 #include <ccnet.h>
-#include <ccnet/job-mgr.h>
 #include <pthread.h>
 
 #include "seafile-session.h"
@@ -35,7 +34,6 @@ typedef struct MergeScheduler {
     pthread_mutex_t q_lock;
     GQueue *queue;
     GHashTable *running;
-    CcnetJobManager *tpool;
     CcnetTimer *timer;
 } MergeScheduler;
 
@@ -481,13 +479,196 @@ set_virtual_repo_base_commit_path (const char *vrepo_id, const char *base_commit
                              "string", vrepo_id);
 }
 
+typedef struct TouchedData {
+    /* path -> GList of the ids of the virtual repos there */
+    GHashTable *paths;
+    /* The dirs above the paths. */
+    GHashTable *ancestors;
+    /* Ids of the virtual repos whose dirs changed. */
+    GHashTable *touched;
+} TouchedData;
+
+static int
+touched_diff_files (int n, const char *basedir, SeafDirent *files[], void *vdata)
+{
+    return 0;
+}
+
+static int
+touched_diff_dirs (int n, const char *basedir, SeafDirent *dirs[], void *vdata,
+                   gboolean *recurse)
+{
+    TouchedData *data = vdata;
+    SeafDirent *dent = dirs[0] ? dirs[0] : dirs[1];
+    GList *ptr;
+    char *path;
+
+    path = g_strconcat ("/", basedir, dent->name, NULL);
+
+    for (ptr = g_hash_table_lookup (data->paths, path); ptr; ptr = ptr->next)
+        g_hash_table_replace (data->touched, g_strdup (ptr->data), ptr->data);
+
+    /* Only follow the way down to the virtual repos. */
+    *recurse = (g_hash_table_lookup (data->ancestors, path) != NULL);
+
+    g_free (path);
+    return 0;
+}
+
+static void
+add_touched_path (TouchedData *data, SeafVirtRepo *vinfo)
+{
+    GList *ids;
+    char *p;
+
+    ids = g_hash_table_lookup (data->paths, vinfo->path);
+    ids = g_list_prepend (ids, vinfo->repo_id);
+    g_hash_table_replace (data->paths, g_strdup (vinfo->path), ids);
+
+    for (p = strchr (vinfo->path + 1, '/'); p; p = strchr (p + 1, '/'))
+        g_hash_table_replace (data->ancestors,
+                              g_strndup (vinfo->path, p - vinfo->path),
+                              GINT_TO_POINTER(1));
+}
+
+static void
+mark_all_touched (GList *vinfos, GHashTable *touched)
+{
+    SeafVirtRepo *vinfo;
+    GList *ptr;
+
+    for (ptr = vinfos; ptr; ptr = ptr->next) {
+        vinfo = ptr->data;
+        g_hash_table_replace (touched, g_strdup (vinfo->repo_id), vinfo->repo_id);
+    }
+}
+
+/*
+ * Add the virtual repos in @vinfos, which share @base_id as their base
+ * commit, to @touched if their dirs in @head_root differ from those in
+ * the base. The diff only descends along the paths of the virtual repos.
+ */
+static void
+find_touched_since_base (SeafRepo *repo, const char *head_root,
+                         const char *base_id, GList *vinfos,
+                         GHashTable *touched)
+{
+    SeafCommit *base;
+    TouchedData data;
+    DiffOptions opts;
+    const char *roots[2];
+    SeafVirtRepo *vinfo;
+    GList *ptr;
+
+    base = seaf_commit_manager_get_commit (seaf->commit_mgr,
+                                           repo->id, repo->version, base_id);
+    if (!base) {
+        /* Let the merge task report it. */
+        mark_all_touched (vinfos, touched);
+        return;
+    }
+
+    if (strcmp (base->root_id, head_root) == 0) {
+        seaf_commit_unref (base);
+        return;
+    }
+
+    data.paths = g_hash_table_new_full (g_str_hash, g_str_equal, g_free,
+                                        (GDestroyNotify)g_list_free);
+    data.ancestors = g_hash_table_new_full (g_str_hash, g_str_equal,
+                                            g_free, NULL);
+    data.touched = touched;
+
+    for (ptr = vinfos; ptr; ptr = ptr->next) {
+        vinfo = ptr->data;
+        if (strcmp (vinfo->path, "/") == 0)
+            g_hash_table_replace (touched, g_strdup (vinfo->repo_id),
+                                  vinfo->repo_id);
+        else
+            add_touched_path (&data, vinfo);
+    }
+
+    roots[0] = head_root;
+    roots[1] = base->root_id;
+
+    memset (&opts, 0, sizeof(opts));
+    memcpy (opts.store_id, repo->store_id, 36);
+    opts.version = repo->version;
+    opts.file_cb = touched_diff_files;
+    opts.dir_cb = touched_diff_dirs;
+    opts.data = &data;
+
+    if (diff_trees (2, roots, &opts) < 0) {
+        seaf_warning ("Failed to diff commit %.8s of repo %.8s.\n",
+                      base_id, repo->id);
+        mark_all_touched (vinfos, touched);
+    }
+
+    g_hash_table_destroy (data.paths);
+    g_hash_table_destroy (data.ancestors);
+    seaf_commit_unref (base);
+}
+
+/*
+ * Returns the ids of the virtual repos whose dirs in the origin changed
+ * since their base commits, or NULL if they can't be found.
+ */
+static GHashTable *
+get_touched_virtual_repos (SeafRepoManager *mgr, const char *repo_id,
+                           GList *vinfos)
+{
+    SeafRepo *repo;
+    SeafCommit *head = NULL;
+    GHashTable *bases, *touched = NULL;
+    GHashTableIter iter;
+    gpointer key, value;
+    SeafVirtRepo *vinfo;
+    GList *ptr;
+
+    repo = seaf_repo_manager_get_repo (mgr, repo_id);
+    if (!repo)
+        return NULL;
+
+    head = seaf_commit_manager_get_commit (seaf->commit_mgr,
+                                           repo->id, repo->version,
+                                           repo->head->commit_id);
+    if (!head) {
+        seaf_warning ("Failed to get commit %.8s.\n", repo->head->commit_id);
+        goto out;
+    }
+
+    /* Virtual repos merged at the same time share their base. */
+    bases = g_hash_table_new_full (g_str_hash, g_str_equal, NULL,
+                                   (GDestroyNotify)g_list_free);
+    for (ptr = vinfos; ptr; ptr = ptr->next) {
+        vinfo = ptr->data;
+        value = g_hash_table_lookup (bases, vinfo->base_commit);
+        g_hash_table_steal (bases, vinfo->base_commit);
+        g_hash_table_insert (bases, vinfo->base_commit,
+                             g_list_prepend (value, vinfo));
+    }
+
+    touched = g_hash_table_new_full (g_str_hash, g_str_equal, g_free, NULL);
+    g_hash_table_iter_init (&iter, bases);
+    while (g_hash_table_iter_next (&iter, &key, &value))
+        find_touched_since_base (repo, head->root_id, key, value, touched);
+
+    g_hash_table_destroy (bases);
+
+out:
+    seaf_commit_unref (head);
+    seaf_repo_unref (repo);
+    return touched;
+}
+
 int
 seaf_repo_manager_merge_virtual_repo (SeafRepoManager *mgr,
                                       const char *repo_id,
                                       const char *exclude_repo)
 {
-    GList *vrepos = NULL, *ptr;
-    char *vrepo_id;
+    GList *vinfos = NULL, *ptr;
+    SeafVirtRepo *vinfo;
+    GHashTable *touched;
     int ret = 0;
 
     if (seaf_repo_manager_is_virtual_repo (mgr, repo_id)) {
@@ -495,17 +676,26 @@ seaf_repo_manager_merge_virtual_repo (SeafRepoManager *mgr,
         return 0;
     }
 
-    vrepos = seaf_repo_manager_get_virtual_repo_ids_by_origin (mgr, repo_id);
-    for (ptr = vrepos; ptr; ptr = ptr->next) {
-        vrepo_id = ptr->data;
+    vinfos = seaf_repo_manager_get_virtual_info_by_origin (mgr, repo_id);
+    if (!vinfos)
+        return 0;
+
+    /* Only merge the virtual repos whose dirs the origin changed. Those
+     * changed themselves are queued by their own updates.
+     */
+    touched = get_touched_virtual_repos (mgr, repo_id, vinfos);
 
-        if (g_strcmp0 (exclude_repo, vrepo_id) == 0)
-            continue;
+    for (ptr = vinfos; ptr; ptr = ptr->next) {
+        vinfo = ptr->data;
 
-        add_merge_task (vrepo_id);
+        if (g_strcmp0 (exclude_repo, vinfo->repo_id) != 0 &&
+            (!touched || g_hash_table_lookup (touched, vinfo->repo_id)))
+            add_merge_task (vinfo->repo_id);
     }
 
-    string_list_free (vrepos);
+    if (touched)
+        g_hash_table_destroy (touched);
+    g_list_free_full (vinfos, (GDestroyNotify)seaf_virtual_repo_info_free);
     return ret;
 }
 
@@ -519,8 +709,9 @@ handle_missing_virtual_repo (SeafRepoManager *mgr,
 {
     SeafCommit *parent = NULL;
     char *old_dir_id = NULL;
-    GList *diff_res = NULL, *ptr;
+    DiffResults *diff_res = NULL;
     DiffEntry *de;
+    int i;
 
     parent = seaf_commit_manager_get_commit (seaf->commit_mgr,
                                              head->repo_id, head->version,
@@ -530,10 +721,12 @@ handle_missing_virtual_repo (SeafRepoManager *mgr,
         return;
     }
 
-    int rc = diff_commits (parent, head, &diff_res, TRUE);
+    diff_res = diff_results_new ();
+    int rc = diff_commits_array (parent, head, diff_res, TRUE);
     if (rc < 0) {
         seaf_warning ("Failed to diff commit %s to %s.\n",
                       parent->commit_id, head->commit_id);
+        diff_results_free (diff_res);
         seaf_commit_unref (parent);
         return;
     }
@@ -562,14 +755,16 @@ handle_missing_virtual_repo (SeafRepoManager *mgr,
             goto out;
         }
 
-        char de_id[41];
+        unsigned char old_dir_sha1[20];
         char *new_path;
 
-        for (ptr = diff_res; ptr; ptr = ptr->next) {
-            de = ptr->data;
+        hex_to_rawdata (old_dir_id, old_dir_sha1, 20);
+
+        /* Backwards, to find the same entry as in the diff list. */
+        for (i = diff_res->n_entries - 1; i >= 0; --i) {
+            de = &diff_res->entries[i];
             if (de->status == DIFF_STATUS_DIR_ADDED) {
-                rawdata_to_hex (de->sha1, de_id, 20);
-                if (strcmp (de_id, old_dir_id) == 0) {
+                if (memcmp (de->sha1, old_dir_sha1, 20) == 0) {
                     if (sub_path != NULL)
                         new_path = g_strconcat ("/", de->name, "/", sub_path, NULL);
                     else
@@ -608,9 +803,7 @@ out:
     g_free (par_path);
     g_free (sub_path);
 
-    for (ptr = diff_res; ptr; ptr = ptr->next)
-        diff_entry_free ((DiffEntry *)ptr->data);
-    g_list_free (diff_res);
+    diff_results_free (diff_res);
 
     seaf_commit_unref (parent);
 }
@@ -756,6 +949,15 @@ static void *merge_virtual_repo (void *vtask)
     if (strcmp (root, orig_root) == 0) {
         /* Nothing to merge. */
         seaf_debug ("Nothing to merge.\n");
+
+        /* The dirs are the same, so the origin head can serve as the
+         * base. Otherwise the origin keeps differing from the base and
+         * the repo is queued again on every origin update.
+         */
+        if (strcmp (base_root, orig_root) != 0)
+            set_virtual_repo_base_commit_path (repo->id,
+                                               orig_repo->head->commit_id,
+                                               vinfo->path);
     } else if (strcmp (base_root, root) == 0) {
         /* Origin changed, virtual repo not changed. */
         seaf_debug ("Origin changed, virtual repo not changed.\n");
@@ -813,6 +1015,7 @@ static void *merge_virtual_repo (void *vtask)
         memcpy (opt.remote_repo_id, repo_id, 36);
         memcpy (opt.remote_head, head->commit_id, 40);
         opt.do_merge = TRUE;
+        opt.parallel = TRUE;
 
         roots[0] = base_root; /* base */
         roots[1] = orig_root; /* head */
@@ -907,10 +1110,11 @@ schedule_merge_tasks (void *vscheduler)
             break;
 
         if (!g_hash_table_lookup (scheduler->running, task->repo_id)) {
-            int ret = ccnet_job_manager_schedule_job (scheduler->tpool,
-                                                      merge_virtual_repo,
-                                                      merge_virtual_repo_done,
-                                                      task);
+            gint64 ret = bg_job_manager_schedule (seaf->bg_job_mgr,
+                                                  BG_JOB_MERGE,
+                                                  merge_virtual_repo,
+                                                  merge_virtual_repo_done,
+                                                  task);
             if (ret < 0) {
                 g_queue_push_tail (scheduler->queue, task);
                 break;
@@ -963,6 +1167,22 @@ add_merge_task (const char *repo_id)
     pthread_mutex_unlock (&scheduler->q_lock);
 }
 
+void
+seaf_repo_manager_get_merge_stats (int *n_queued, int *n_running)
+{
+    if (!scheduler) {
+        *n_queued = *n_running = 0;
+        return;
+    }
+
+    pthread_mutex_lock (&scheduler->q_lock);
+    *n_queued = g_queue_get_length (scheduler->queue);
+    pthread_mutex_unlock (&scheduler->q_lock);
+
+    /* Only changed in the main thread, reading the size is fine. */
+    *n_running = g_hash_table_size (scheduler->running);
+}
+
 int
 seaf_repo_manager_init_merge_scheduler ()
 {
@@ -976,7 +1196,6 @@ seaf_repo_manager_init_merge_scheduler ()
     scheduler->running = g_hash_table_new_full (g_str_hash, g_str_equal,
                                                 g_free, g_free);
 
-    scheduler->tpool = ccnet_job_manager_new (MAX_RUNNING_TASKS);
     scheduler->timer = ccnet_timer_new (schedule_merge_tasks,
                                         scheduler,
                                         SCHEDULE_INTERVAL);
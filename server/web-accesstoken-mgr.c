@@ -13,14 +13,37 @@
 
 #include "log.h"
 
-#define CLEANING_INTERVAL_MSEC 1000*300	/* 5 minutes */
+#define CLEANING_INTERVAL_MSEC 1000*60	/* 1 minute */
 #define TOKEN_EXPIRE_TIME 3600	        /* 1 hour */
 #define TOKEN_LEN 36
 
-struct WebATPriv {
+/*
+ * Tokens are spread over shards, each with its own lock. The shard of a
+ * token is the value of its first hex digit, which is set to the shard
+ * of its access info when the token is made, so both lookups land in the
+ * same shard.
+ *
+ * All tokens live for TOKEN_EXPIRE_TIME, so they expire in the order they
+ * are made. Each shard queues its tokens in that order, and cleaning only
+ * pops the expired ones from the head instead of scanning the tables.
+ */
+#define N_SHARDS 16
+
+typedef struct ExpireEntry {
+    char token[TOKEN_LEN + 1];
+    char *key;
+    long expire_time;
+} ExpireEntry;
+
+typedef struct TokenShard {
     GHashTable		*access_token_hash; /* token -> access info */
     GHashTable      *access_info_hash;  /* access info -> token */
+    GQueue          *expire_queue;      /* ExpireEntry, oldest first */
     pthread_mutex_t lock;
+} TokenShard;
+
+struct WebATPriv {
+    TokenShard shards[N_SHARDS];
 
     gboolean cluster_mode;
     struct ObjCache *cache;
@@ -56,65 +79,92 @@ free_access_info (AccessInfo *info)
     g_free (info);
 }
 
+static void
+free_expire_entry (ExpireEntry *entry)
+{
+    g_free (entry->key);
+    g_free (entry);
+}
+
 SeafWebAccessTokenManager*
 seaf_web_at_manager_new (SeafileSession *session)
 {
     SeafWebAccessTokenManager *mgr = g_new0 (SeafWebAccessTokenManager, 1);
+    TokenShard *shard;
+    int i;
 
     mgr->seaf = session;
 
     mgr->priv = g_new0(WebATPriv, 1);
-    mgr->priv->access_token_hash = g_hash_table_new_full (g_str_hash, g_str_equal,
-                                                    g_free,
-                                                    (GDestroyNotify)free_access_info);
-    mgr->priv->access_info_hash = g_hash_table_new_full (g_str_hash, g_str_equal,
-                                                   g_free, g_free);
-    pthread_mutex_init (&mgr->priv->lock, NULL);
+    for (i = 0; i < N_SHARDS; ++i) {
+        shard = &mgr->priv->shards[i];
+        shard->access_token_hash = g_hash_table_new_full (g_str_hash, g_str_equal,
+                                                          g_free,
+                                                          (GDestroyNotify)free_access_info);
+        shard->access_info_hash = g_hash_table_new_full (g_str_hash, g_str_equal,
+                                                         g_free, g_free);
+        shard->expire_queue = g_queue_new ();
+        pthread_mutex_init (&shard->lock, NULL);
+    }
 
     return mgr;
 }
 
-static gboolean
-remove_expire_info (gpointer key, gpointer value, gpointer user_data)
+static inline TokenShard *
+shard_of_key (SeafWebAccessTokenManager *mgr, const char *key)
 {
-    AccessInfo *info = (AccessInfo *)value;
-    long now = *((long*)user_data);
+    return &mgr->priv->shards[g_str_hash (key) % N_SHARDS];
+}
 
-    if (info && now >= info->expire_time) {
-        return TRUE;
-    }
+static inline TokenShard *
+shard_of_token (SeafWebAccessTokenManager *mgr, const char *token)
+{
+    int n = g_ascii_xdigit_value (token[0]);
 
-    return FALSE;
+    return n < 0 ? NULL : &mgr->priv->shards[n % N_SHARDS];
 }
 
-static gboolean
-remove_expire_token (gpointer key, gpointer value, gpointer user_data)
+/* Drop the tokens that expired by @now. Called with the shard locked. */
+static void
+expire_tokens (TokenShard *shard, long now)
 {
-    AccessToken *token = (AccessToken *)value;
-    long now = *((long*)user_data);
+    ExpireEntry *entry;
+    AccessInfo *info;
+    AccessToken *token;
 
-    if (token && now >= token->expire_time) {
-        return TRUE;
-    }
+    while ((entry = g_queue_peek_head (shard->expire_queue)) != NULL &&
+           now >= entry->expire_time) {
+        g_queue_pop_head (shard->expire_queue);
+
+        /* One-time tokens may be gone already. */
+        info = g_hash_table_lookup (shard->access_token_hash, entry->token);
+        if (info && info->expire_time == entry->expire_time)
+            g_hash_table_remove (shard->access_token_hash, entry->token);
 
-    return FALSE;
+        /* The info may have been given a newer token since. */
+        token = g_hash_table_lookup (shard->access_info_hash, entry->key);
+        if (token && strcmp (token->token, entry->token) == 0)
+            g_hash_table_remove (shard->access_info_hash, entry->key);
+
+        free_expire_entry (entry);
+    }
 }
 
 static int
 clean_pulse (void *vmanager)
 {
     SeafWebAccessTokenManager *manager = vmanager;
+    TokenShard *shard;
     long now = (long)time(NULL);
+    int i;
 
-    pthread_mutex_lock (&manager->priv->lock);
-
-    g_hash_table_foreach_remove (manager->priv->access_token_hash,
-                                 remove_expire_info, &now);
-    g_hash_table_foreach_remove (manager->priv->access_info_hash,
-                                 remove_expire_token, &now);
+    for (i = 0; i < N_SHARDS; ++i) {
+        shard = &manager->priv->shards[i];
+        pthread_mutex_lock (&shard->lock);
+        expire_tokens (shard, now);
+        pthread_mutex_unlock (&shard->lock);
+    }
 
-    pthread_mutex_unlock (&manager->priv->lock);
-    
     return TRUE;
 }
 
@@ -127,13 +177,15 @@ seaf_web_at_manager_start (SeafWebAccessTokenManager *mgr)
 }
 
 static char *
-gen_new_token (GHashTable *token_hash)
+gen_new_token (GHashTable *token_hash, int shard_idx)
 {
+    static const char hex[] = "0123456789abcdef";
     char uuid[37];
     char *token;
 
     while (1) {
         gen_uuid_inplace (uuid);
+        uuid[0] = hex[shard_idx];
         token = g_strndup(uuid, TOKEN_LEN);
 
         /* Make sure the new token doesn't conflict with an existing one. */
@@ -153,11 +205,14 @@ seaf_web_at_manager_get_access_token (SeafWebAccessTokenManager *mgr,
                                       int use_onetime)
 {
     GString *key;
+    TokenShard *shard;
     AccessToken *token;
     AccessInfo *info;
+    ExpireEntry *entry;
     long now = (long)time(NULL);
     long expire;
     char *t;
+    char *ret;
 
     if (strcmp(op, "view") != 0 &&
         strcmp(op, "download") != 0 &&
@@ -173,21 +228,24 @@ seaf_web_at_manager_get_access_token (SeafWebAccessTokenManager *mgr,
     key = g_string_new (NULL);
     g_string_printf (key, "%s %s %s %s", repo_id, obj_id, op, username);
 
-    pthread_mutex_lock (&mgr->priv->lock);
+    shard = shard_of_key (mgr, key->str);
 
-    token = g_hash_table_lookup (mgr->priv->access_info_hash, key->str);
+    pthread_mutex_lock (&shard->lock);
+
+    token = g_hash_table_lookup (shard->access_info_hash, key->str);
     /* To avoid returning an almost expired token, we returns token
      * that has at least 1 minute "life time".
      */
     if (!token || token->expire_time - now <= 60) {
-        t = gen_new_token (mgr->priv->access_token_hash);
+        t = gen_new_token (shard->access_token_hash,
+                           shard - mgr->priv->shards);
         expire = now + TOKEN_EXPIRE_TIME;
 
         token = g_new0 (AccessToken, 1);
         memcpy (token->token, t, TOKEN_LEN);
         token->expire_time = expire;
 
-        g_hash_table_insert (mgr->priv->access_info_hash, g_strdup(key->str), token);
+        g_hash_table_insert (shard->access_info_hash, g_strdup(key->str), token);
 
         info = g_new0 (AccessInfo, 1);
         info->repo_id = g_strdup (repo_id);
@@ -199,56 +257,60 @@ seaf_web_at_manager_get_access_token (SeafWebAccessTokenManager *mgr,
             info->use_onetime = TRUE;
         }
 
-        g_hash_table_insert (mgr->priv->access_token_hash, g_strdup(t), info);
+        g_hash_table_insert (shard->access_token_hash, g_strdup(t), info);
+
+        entry = g_new0 (ExpireEntry, 1);
+        memcpy (entry->token, t, TOKEN_LEN);
+        entry->key = g_strdup (key->str);
+        entry->expire_time = expire;
+        g_queue_push_tail (shard->expire_queue, entry);
 
         g_free (t);
     }
 
-    pthread_mutex_unlock (&mgr->priv->lock);
+    ret = g_strdup(token->token);
+
+    pthread_mutex_unlock (&shard->lock);
 
     g_string_free (key, TRUE);
-    return g_strdup(token->token);
+    return ret;
 }
 
 SeafileWebAccess *
 seaf_web_at_manager_query_access_token (SeafWebAccessTokenManager *mgr,
                                         const char *token)
 {
-    SeafileWebAccess *webaccess;
+    SeafileWebAccess *webaccess = NULL;
+    TokenShard *shard;
     AccessInfo *info;
+    long now = (long)time(NULL);
 
-    pthread_mutex_lock (&mgr->priv->lock);
-    info = g_hash_table_lookup (mgr->priv->access_token_hash, token);
-    pthread_mutex_unlock (&mgr->priv->lock);
-
-    if (info != NULL) {
-        long expire_time = info->expire_time;
-        long now = (long)time(NULL);        
-
-        if (now - expire_time >= 0) {
-            return NULL;
-        } else {
-            webaccess = g_object_new (SEAFILE_TYPE_WEB_ACCESS,
-                                      "repo_id", info->repo_id,
-                                      "obj_id", info->obj_id,
-                                      "op", info->op,
-                                      "username", info->username,
-                                      NULL);
-
-            if (info->use_onetime) {
-                pthread_mutex_lock (&mgr->priv->lock);
-                char *key = g_strdup_printf ("%s %s %s %s",
-                                             info->repo_id, info->obj_id,
-                                             info->op, info->username);
-                g_hash_table_remove (mgr->priv->access_info_hash, key);
-                g_hash_table_remove (mgr->priv->access_token_hash, token);
-                g_free (key);
-                pthread_mutex_unlock (&mgr->priv->lock);
-            }
-
-            return webaccess;
+    shard = shard_of_token (mgr, token);
+    if (!shard)
+        return NULL;
+
+    pthread_mutex_lock (&shard->lock);
+
+    info = g_hash_table_lookup (shard->access_token_hash, token);
+    if (info != NULL && now - info->expire_time < 0) {
+        webaccess = g_object_new (SEAFILE_TYPE_WEB_ACCESS,
+                                  "repo_id", info->repo_id,
+                                  "obj_id", info->obj_id,
+                                  "op", info->op,
+                                  "username", info->username,
+                                  NULL);
+
+        if (info->use_onetime) {
+            char *key = g_strdup_printf ("%s %s %s %s",
+                                         info->repo_id, info->obj_id,
+                                         info->op, info->username);
+            g_hash_table_remove (shard->access_info_hash, key);
+            g_hash_table_remove (shard->access_token_hash, token);
+            g_free (key);
         }
     }
 
-    return NULL;
+    pthread_mutex_unlock (&shard->lock);
+
+    return webaccess;
 }
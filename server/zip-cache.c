@@ -0,0 +1,361 @@
+#include "common.h"
+
+#define DEBUG_FLAG SEAFILE_DEBUG_HTTP
+#include "log.h"
+
+#include <fcntl.h>
+#include <utime.h>
+#include <pthread.h>
+
+#include "utils.h"
+
+#include "zip-cache.h"
+
+#define ZIP_SUFFIX ".zip"
+
+typedef struct CachedZip {
+    char *key;
+    gint64 size;
+    GList *link;                /* in lru */
+} CachedZip;
+
+struct ZipCacheWriter {
+    char *key;
+    char *tmp_path;
+    int fd;
+    gint64 size;
+    gboolean failed;
+};
+
+static char *cache_dir;
+static gint64 max_cache_size;
+static gint64 total_size;
+static GHashTable *zips;        /* key -> CachedZip */
+static GQueue *lru;             /* CachedZip, most recently used at the head */
+static pthread_mutex_t cache_lock = PTHREAD_MUTEX_INITIALIZER;
+
+static char *
+zip_path (const char *key)
+{
+    return g_strdup_printf ("%s/%s%s", cache_dir, key, ZIP_SUFFIX);
+}
+
+static void
+cached_zip_free (CachedZip *zip)
+{
+    g_free (zip->key);
+    g_free (zip);
+}
+
+/* Drop @zip from the cache and delete its file. Needs cache_lock.
+ * Archives being sent stay readable until their fd is closed.
+ */
+static void
+remove_zip (CachedZip *zip)
+{
+    char *path = zip_path (zip->key);
+
+    if (g_unlink (path) < 0 && errno != ENOENT)
+        seaf_warning ("Failed to remove cached zip %s: %s.\n",
+                      path, strerror(errno));
+    g_free (path);
+
+    total_size -= zip->size;
+    g_queue_delete_link (lru, zip->link);
+    g_hash_table_remove (zips, zip->key);
+}
+
+static void
+evict_zips ()
+{
+    CachedZip *zip;
+
+    while (total_size > max_cache_size &&
+           (zip = g_queue_peek_tail (lru)) != NULL) {
+        seaf_debug ("Evict cached zip %s.\n", zip->key);
+        remove_zip (zip);
+    }
+}
+
+static void
+add_zip (const char *key, gint64 size)
+{
+    CachedZip *zip;
+
+    /* Packed by two requests at once, the file is the newer one now. */
+    zip = g_hash_table_lookup (zips, key);
+    if (zip) {
+        total_size += size - zip->size;
+        zip->size = size;
+        g_queue_unlink (lru, zip->link);
+        g_queue_push_head_link (lru, zip->link);
+        return;
+    }
+
+    zip = g_new0 (CachedZip, 1);
+    zip->key = g_strdup (key);
+    zip->size = size;
+    g_queue_push_head (lru, zip);
+    zip->link = g_queue_peek_head_link (lru);
+    g_hash_table_insert (zips, zip->key, zip);
+    total_size += size;
+}
+
+typedef struct LoadedZip {
+    char *key;
+    gint64 size;
+    gint64 mtime;
+} LoadedZip;
+
+static gint
+cmp_loaded_zip (gconstpointer a, gconstpointer b)
+{
+    const LoadedZip *za = a, *zb = b;
+
+    if (za->mtime == zb->mtime)
+        return 0;
+    return za->mtime < zb->mtime ? -1 : 1;
+}
+
+/* Pick up the archives cached before a restart. Hits touch the files,
+ * so their mtimes give back the LRU order.
+ */
+static void
+load_cached_zips ()
+{
+    GDir *dir;
+    const char *name;
+    char *path;
+    SeafStat st;
+    GList *loaded = NULL, *ptr;
+    LoadedZip *lz;
+    int len;
+
+    dir = g_dir_open (cache_dir, 0, NULL);
+    if (!dir)
+        return;
+
+    while ((name = g_dir_read_name (dir)) != NULL) {
+        path = g_build_filename (cache_dir, name, NULL);
+        len = strlen (name);
+
+        if (len != 40 + (int)strlen(ZIP_SUFFIX) ||
+            !g_str_has_suffix (name, ZIP_SUFFIX) ||
+            seaf_stat (path, &st) < 0) {
+            /* Left over by an archive that was never committed. */
+            g_unlink (path);
+            g_free (path);
+            continue;
+        }
+
+        lz = g_new0 (LoadedZip, 1);
+        lz->key = g_strndup (name, 40);
+        lz->size = (gint64)st.st_size;
+        lz->mtime = (gint64)st.st_mtime;
+        loaded = g_list_prepend (loaded, lz);
+        g_free (path);
+    }
+    g_dir_close (dir);
+
+    /* Oldest first, so the most recent end up at the head. */
+    loaded = g_list_sort (loaded, cmp_loaded_zip);
+    for (ptr = loaded; ptr; ptr = ptr->next) {
+        lz = ptr->data;
+        add_zip (lz->key, lz->size);
+        g_free (lz->key);
+        g_free (lz);
+    }
+    g_list_free (loaded);
+
+    evict_zips ();
+}
+
+int
+zip_cache_init (const char *dir, gint64 max_size)
+{
+    if (max_size <= 0)
+        return 0;
+
+    if (checkdir_with_mkdir (dir) < 0) {
+        seaf_warning ("Failed to create zip cache dir %s.\n", dir);
+        return -1;
+    }
+
+    cache_dir = g_strdup (dir);
+    max_cache_size = max_size;
+    zips = g_hash_table_new_full (g_str_hash, g_str_equal,
+                                  NULL, (GDestroyNotify)cached_zip_free);
+    lru = g_queue_new ();
+
+    load_cached_zips ();
+
+    return 0;
+}
+
+gboolean
+zip_cache_enabled ()
+{
+    return cache_dir != NULL;
+}
+
+char *
+zip_cache_make_key (const char *dir_id, const char *dirname,
+                    const char *encoding)
+{
+    GChecksum *checksum = g_checksum_new (G_CHECKSUM_SHA1);
+    char *key;
+
+    /* The NULs keep the fields apart. */
+    g_checksum_update (checksum, (const guchar *)dir_id, strlen(dir_id) + 1);
+    g_checksum_update (checksum, (const guchar *)dirname, strlen(dirname) + 1);
+    if (encoding)
+        g_checksum_update (checksum, (const guchar *)encoding, strlen(encoding));
+
+    key = g_strdup (g_checksum_get_string (checksum));
+    g_checksum_free (checksum);
+
+    return key;
+}
+
+int
+zip_cache_open (const char *key, gint64 *size)
+{
+    CachedZip *zip;
+    char *path;
+    int fd = -1;
+
+    if (!cache_dir)
+        return -1;
+
+    pthread_mutex_lock (&cache_lock);
+
+    zip = g_hash_table_lookup (zips, key);
+    if (!zip)
+        goto out;
+
+    path = zip_path (key);
+    fd = g_open (path, O_RDONLY | O_BINARY, 0);
+    if (fd < 0) {
+        seaf_warning ("Failed to open cached zip %s: %s.\n",
+                      path, strerror(errno));
+        remove_zip (zip);
+        g_free (path);
+        goto out;
+    }
+    utime (path, NULL);
+    g_free (path);
+
+    *size = zip->size;
+    g_queue_unlink (lru, zip->link);
+    g_queue_push_head_link (lru, zip->link);
+
+out:
+    pthread_mutex_unlock (&cache_lock);
+    return fd;
+}
+
+ZipCacheWriter *
+zip_cache_writer_new (const char *key)
+{
+    ZipCacheWriter *writer;
+    char *tmp_path;
+    int fd;
+
+    if (!cache_dir)
+        return NULL;
+
+    tmp_path = g_strdup_printf ("%s/%s.XXXXXX", cache_dir, key);
+    fd = g_mkstemp (tmp_path);
+    if (fd < 0) {
+        seaf_warning ("Failed to create temp file in zip cache: %s.\n",
+                      strerror(errno));
+        g_free (tmp_path);
+        return NULL;
+    }
+
+    writer = g_new0 (ZipCacheWriter, 1);
+    writer->key = g_strdup (key);
+    writer->tmp_path = tmp_path;
+    writer->fd = fd;
+
+    return writer;
+}
+
+static void
+writer_fail (ZipCacheWriter *writer)
+{
+    writer->failed = TRUE;
+    close (writer->fd);
+    writer->fd = -1;
+    g_unlink (writer->tmp_path);
+}
+
+void
+zip_cache_writer_write (ZipCacheWriter *writer, const void *buf, size_t len)
+{
+    if (writer->failed)
+        return;
+
+    writer->size += len;
+    if (writer->size > max_cache_size) {
+        seaf_debug ("Zip %s is larger than the zip cache.\n", writer->key);
+        writer_fail (writer);
+        return;
+    }
+
+    if (writen (writer->fd, buf, len) < 0) {
+        seaf_warning ("Failed to write zip cache file %s: %s.\n",
+                      writer->tmp_path, strerror(errno));
+        writer_fail (writer);
+    }
+}
+
+int
+zip_cache_writer_commit (ZipCacheWriter *writer)
+{
+    char *path;
+    int ret = 0;
+
+    if (writer->failed)
+        return -1;
+
+    if (close (writer->fd) < 0) {
+        writer->fd = -1;
+        writer_fail (writer);
+        return -1;
+    }
+    writer->fd = -1;
+
+    path = zip_path (writer->key);
+
+    pthread_mutex_lock (&cache_lock);
+    if (g_rename (writer->tmp_path, path) < 0) {
+        seaf_warning ("Failed to rename %s to %s: %s.\n",
+                      writer->tmp_path, path, strerror(errno));
+        g_unlink (writer->tmp_path);
+        ret = -1;
+    } else {
+        add_zip (writer->key, writer->size);
+        evict_zips ();
+    }
+    pthread_mutex_unlock (&cache_lock);
+
+    /* Nothing left to clean up. */
+    writer->failed = TRUE;
+    g_free (path);
+    return ret;
+}
+
+void
+zip_cache_writer_free (ZipCacheWriter *writer)
+{
+    if (!writer)
+        return;
+
+    if (!writer->failed)
+        writer_fail (writer);
+
+    g_free (writer->key);
+    g_free (writer->tmp_path);
+    g_free (writer);
+}
@@ -0,0 +1,51 @@
+#ifndef ZIP_CACHE_H
+#define ZIP_CACHE_H
+
+#include <glib.h>
+
+/*
+ * Zip archives of downloaded dirs, kept on disk within a size budget and
+ * evicted least recently used first. Dir ids are content hashes, so an
+ * archive never goes stale; it's only keyed on what else shapes it.
+ */
+
+/* A @max_size of 0 or less disables the cache. */
+int
+zip_cache_init (const char *cache_dir, gint64 max_size);
+
+gboolean
+zip_cache_enabled ();
+
+/*
+ * The key of the archive of @dir_id with @dirname as its top dir.
+ * @encoding is the encoding of the file names, NULL for UTF-8.
+ */
+char *
+zip_cache_make_key (const char *dir_id, const char *dirname,
+                    const char *encoding);
+
+/* Open the archive cached for @key. Returns -1 if there is none. */
+int
+zip_cache_open (const char *key, gint64 *size);
+
+/*
+ * Write an archive into the cache while it's generated. It only shows
+ * up in the cache once committed. Freeing an uncommitted writer drops
+ * what was written.
+ */
+typedef struct ZipCacheWriter ZipCacheWriter;
+
+ZipCacheWriter *
+zip_cache_writer_new (const char *key);
+
+/* Write errors and archives over the budget just stop the caching. */
+void
+zip_cache_writer_write (ZipCacheWriter *writer, const void *buf, size_t len);
+
+int
+zip_cache_writer_commit (ZipCacheWriter *writer);
+
+void
+zip_cache_writer_free (ZipCacheWriter *writer);
+
+#endif
@@ -0,0 +1,428 @@
+/* -*- Mode: C; tab-width: 4; indent-tabs-mode: nil; c-basic-offset: 4 -*- */
+
+/*
+ * Chunking and block write benchmark.
+ *
+ * For every corpus, chunker and encryption setting, reports chunking
+ * throughput, the chunk size histogram, and how many bytes are still
+ * deduplicated after a few small edits to the data.
+ *
+ * Corpora are files given on the command line, or synthetic data. Data is
+ * loaded into memory first and fed through the CDC stream interface, so
+ * disk speed doesn't affect the numbers. Blocks are hashed (and encrypted)
+ * like seafile_write_chunk() does, but not written.
+ *
+ * One JSON object is printed per result line, to be collected by scripts.
+ */
+
+#include <unistd.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <getopt.h>
+
+#include <glib.h>
+
+#include "cdc/cdc.h"
+#include "seafile-crypt.h"
+#include "seaf-sha1.h"
+
+#define HISTOGRAM_BUCKETS 16
+
+/* Number of small edits applied for the dedup measurement. */
+#define N_EDITS 16
+
+typedef struct BenchStat {
+    GArray *sizes;              /* chunk sizes, in order */
+    GHashTable *ids;            /* hex block ids, if collected */
+    GHashTable *ref;            /* block ids of the unedited data */
+    guint64 total;
+    guint64 shared;             /* bytes in blocks also in @ref */
+} BenchStat;
+
+static BenchStat *cur_stat = NULL;
+
+static int
+bench_write_chunk (const char *repo_id,
+                   int version,
+                   CDCDescriptor *chunk_descr,
+                   struct SeafileCrypt *crypt,
+                   uint8_t *checksum,
+                   gboolean write_data)
+{
+    char *enc_buf = NULL;
+    int enc_len;
+    char hex[41];
+
+    if (crypt != NULL && chunk_descr->len) {
+        if (seafile_encrypt (&enc_buf, &enc_len,
+                             chunk_descr->block_buf, chunk_descr->len,
+                             crypt) < 0)
+            return -1;
+        seaf_sha1 (enc_buf, enc_len, checksum);
+        g_free (enc_buf);
+    } else {
+        seaf_sha1 (chunk_descr->block_buf, chunk_descr->len, checksum);
+    }
+
+    g_array_append_val (cur_stat->sizes, chunk_descr->len);
+    cur_stat->total += chunk_descr->len;
+    if (cur_stat->ids || cur_stat->ref) {
+        rawdata_to_hex (checksum, hex, 20);
+        if (cur_stat->ids)
+            g_hash_table_add (cur_stat->ids, g_strdup (hex));
+        if (cur_stat->ref && g_hash_table_contains (cur_stat->ref, hex))
+            cur_stat->shared += chunk_descr->len;
+    }
+
+    return 0;
+}
+
+/* Chunk @len bytes at @data. Returns the elapsed time in seconds,
+ * or a negative value on error.
+ */
+static double
+chunk_buffer (const char *data, size_t len, int algorithm,
+              SeafileCrypt *crypt, BenchStat *stat)
+{
+    CDCFileDescriptor file_descr;
+    CDCStream *stream;
+    gint64 start;
+    double elapsed = -1;
+
+    memset (&file_descr, 0, sizeof(file_descr));
+    file_descr.write_block = bench_write_chunk;
+    file_descr.algorithm = algorithm;
+
+    cur_stat = stat;
+    start = g_get_monotonic_time ();
+
+    stream = cdc_stream_new (&file_descr, len, crypt, FALSE);
+    if (!stream)
+        return -1;
+    if (cdc_stream_feed (stream, data, len) < 0 ||
+        cdc_stream_finish (stream) < 0)
+        goto out;
+
+    elapsed = (g_get_monotonic_time () - start) / 1000000.0;
+
+out:
+    cdc_stream_free (stream);
+    free (file_descr.blk_sha1s);
+    return elapsed;
+}
+
+static void
+bench_stat_init (BenchStat *stat, gboolean collect_ids)
+{
+    memset (stat, 0, sizeof(BenchStat));
+    stat->sizes = g_array_new (FALSE, FALSE, sizeof(uint32_t));
+    stat->ids = collect_ids ?
+        g_hash_table_new_full (g_str_hash, g_str_equal, g_free, NULL) : NULL;
+}
+
+static void
+bench_stat_clear (BenchStat *stat)
+{
+    g_array_free (stat->sizes, TRUE);
+    if (stat->ids)
+        g_hash_table_destroy (stat->ids);
+}
+
+/* Copy of @data with N_EDITS small inserts, deletes and overwrites at
+ * random offsets.
+ */
+static char *
+make_edited (const char *data, size_t len, size_t *out_len, GRand *rand)
+{
+    GByteArray *out = g_byte_array_sized_new (len + N_EDITS * 64);
+    size_t offsets[N_EDITS];
+    size_t pos = 0, n;
+    guint8 junk[64];
+    int i, j, op;
+
+    for (i = 0; i < N_EDITS; ++i)
+        offsets[i] = len ? g_rand_int_range (rand, 0, (gint32)MIN(len, G_MAXINT32)) : 0;
+    for (i = 1; i < N_EDITS; ++i)
+        for (j = i; j > 0 && offsets[j - 1] > offsets[j]; --j) {
+            size_t tmp = offsets[j];
+            offsets[j] = offsets[j - 1];
+            offsets[j - 1] = tmp;
+        }
+
+    for (i = 0; i < N_EDITS; ++i) {
+        if (offsets[i] < pos)
+            continue;
+        g_byte_array_append (out, (guint8 *)data + pos, offsets[i] - pos);
+        pos = offsets[i];
+
+        n = g_rand_int_range (rand, 1, sizeof(junk) + 1);
+        for (j = 0; j < n; ++j)
+            junk[j] = g_rand_int (rand) & 0xff;
+
+        op = g_rand_int_range (rand, 0, 3);
+        if (op == 0) {
+            /* insert */
+            g_byte_array_append (out, junk, n);
+        } else if (op == 1) {
+            /* delete */
+            pos = MIN (pos + n, len);
+        } else {
+            /* overwrite */
+            n = MIN (n, len - pos);
+            g_byte_array_append (out, junk, n);
+            pos += n;
+        }
+    }
+    g_byte_array_append (out, (guint8 *)data + pos, len - pos);
+
+    *out_len = out->len;
+    return (char *)g_byte_array_free (out, FALSE);
+}
+
+static void
+print_result (const char *corpus, size_t len, const char *algo_name,
+              gboolean encrypted, double best, BenchStat *stat,
+              double dedup)
+{
+    guint64 buckets[HISTOGRAM_BUCKETS] = {0};
+    uint32_t bucket_sz = (BLOCK_MAX_SZ + HISTOGRAM_BUCKETS - 1) / HISTOGRAM_BUCKETS;
+    uint32_t sz, min_sz = G_MAXUINT32, max_sz = 0;
+    char *name = g_strescape (corpus, NULL);
+    guint i;
+
+    for (i = 0; i < stat->sizes->len; ++i) {
+        sz = g_array_index (stat->sizes, uint32_t, i);
+        buckets[MIN (sz / bucket_sz, HISTOGRAM_BUCKETS - 1)]++;
+        min_sz = MIN (min_sz, sz);
+        max_sz = MAX (max_sz, sz);
+    }
+    if (stat->sizes->len == 0)
+        min_sz = 0;
+
+    printf ("{\"corpus\": \"%s\", \"bytes\": %" G_GUINT64_FORMAT ", "
+            "\"chunker\": \"%s\", \"encrypted\": %s, "
+            "\"mb_per_sec\": %.1f, \"chunks\": %u, "
+            "\"min_size\": %u, \"max_size\": %u, \"avg_size\": %" G_GUINT64_FORMAT ", "
+            "\"dedup_after_edits\": %.4f, "
+            "\"histogram_bucket_size\": %u, \"histogram\": [",
+            name, (guint64)len, algo_name, encrypted ? "true" : "false",
+            best > 0 ? len / best / (1024 * 1024) : 0.0,
+            stat->sizes->len, min_sz, max_sz,
+            stat->sizes->len ? (guint64)len / stat->sizes->len : 0,
+            dedup, bucket_sz);
+    for (i = 0; i < HISTOGRAM_BUCKETS; ++i)
+        printf ("%s%" G_GUINT64_FORMAT, i ? ", " : "", buckets[i]);
+    printf ("]}\n");
+    fflush (stdout);
+
+    g_free (name);
+}
+
+static int
+bench_corpus (const char *corpus, const char *data, size_t len,
+              int algorithm, const char *algo_name,
+              SeafileCrypt *crypt, int repeats)
+{
+    BenchStat stat, edited_stat;
+    char *edited;
+    size_t edited_len;
+    double t, best = -1;
+    double dedup;
+    GRand *rand;
+    int i;
+
+    /* Throughput, best of @repeats runs. */
+    for (i = 0; i < repeats; ++i) {
+        bench_stat_init (&stat, FALSE);
+        t = chunk_buffer (data, len, algorithm, crypt, &stat);
+        bench_stat_clear (&stat);
+        if (t < 0) {
+            fprintf (stderr, "failed to chunk %s.\n", corpus);
+            return -1;
+        }
+        if (best < 0 || t < best)
+            best = t;
+    }
+
+    /* Sizes and dedup, from one more run that also collects block ids. */
+    bench_stat_init (&stat, TRUE);
+    bench_stat_init (&edited_stat, FALSE);
+    edited_stat.ref = stat.ids;
+
+    rand = g_rand_new_with_seed (1);
+    edited = make_edited (data, len, &edited_len, rand);
+    g_rand_free (rand);
+
+    if (chunk_buffer (data, len, algorithm, crypt, &stat) < 0 ||
+        chunk_buffer (edited, edited_len, algorithm, crypt, &edited_stat) < 0) {
+        fprintf (stderr, "failed to chunk %s.\n", corpus);
+        g_free (edited);
+        bench_stat_clear (&stat);
+        bench_stat_clear (&edited_stat);
+        return -1;
+    }
+    /* Share of the edited data that is in blocks the original has. */
+    dedup = edited_stat.total ?
+        (double)edited_stat.shared / edited_stat.total : 1.0;
+
+    print_result (corpus, len, algo_name, crypt != NULL, best, &stat, dedup);
+
+    g_free (edited);
+    bench_stat_clear (&stat);
+    bench_stat_clear (&edited_stat);
+    return 0;
+}
+
+/* Incompressible data. */
+static char *
+gen_random (size_t len)
+{
+    GRand *rand = g_rand_new_with_seed (0x5eaf);
+    guint32 *buf = g_malloc (len + sizeof(guint32));
+    size_t i;
+
+    for (i = 0; i < len / sizeof(guint32) + 1; ++i)
+        buf[i] = g_rand_int (rand);
+    g_rand_free (rand);
+    return (char *)buf;
+}
+
+/* Text-like data: random words from a small vocabulary. */
+static char *
+gen_text (size_t len)
+{
+    static const char *words[] = {
+        "the", "seafile", "block", "commit", "repo", "of", "and", "to",
+        "library", "sync", "file", "server", "client", "a", "in", "data",
+        "<w:p>", "</w:p>", "<w:r>", "</w:r>", "INFO", "WARN", "2014-01-01",
+    };
+    GRand *rand = g_rand_new_with_seed (0x5eaf);
+    char *buf = g_malloc (len);
+    size_t pos = 0, n;
+    const char *w;
+
+    while (pos < len) {
+        w = words[g_rand_int_range (rand, 0, G_N_ELEMENTS(words))];
+        n = MIN (strlen (w), len - pos);
+        memcpy (buf + pos, w, n);
+        pos += n;
+        if (pos < len)
+            buf[pos++] = (g_rand_int_range (rand, 0, 12) == 0) ? '\n' : ' ';
+    }
+    g_rand_free (rand);
+    return buf;
+}
+
+static const struct {
+    const char *name;
+    int algorithm;
+} chunkers[] = {
+    { "rabin", CDC_ALGO_RABIN },
+    { "fastcdc", CDC_ALGO_FASTCDC },
+};
+
+static const char *chunker = "all";
+static const char *enc_mode = "all";
+static int repeats = 3;
+static SeafileCrypt *bench_crypt = NULL;
+
+/* Run every selected chunker and encryption setting on one corpus. */
+static int
+bench_all (const char *corpus, const char *data, size_t len)
+{
+    int c, e;
+    int ret = 0;
+
+    for (c = 0; c < G_N_ELEMENTS(chunkers); ++c) {
+        if (strcmp (chunker, "all") != 0 &&
+            strcmp (chunker, chunkers[c].name) != 0)
+            continue;
+        for (e = 0; e < 2; ++e) {
+            if ((e == 0 && strcmp (enc_mode, "encrypted") == 0) ||
+                (e == 1 && strcmp (enc_mode, "plain") == 0))
+                continue;
+            if (bench_corpus (corpus, data, len,
+                              chunkers[c].algorithm, chunkers[c].name,
+                              e ? bench_crypt : NULL, repeats) < 0)
+                ret = -1;
+        }
+    }
+
+    return ret;
+}
+
+static void
+usage (const char *prog)
+{
+    fprintf (stderr,
+             "usage: %s [-c rabin|fastcdc|all] [-e plain|encrypted|all]\n"
+             "       [-s SYNTHETIC_MB] [-r REPEATS] [FILE...]\n"
+             "Without FILE, synthetic random and text corpora are used.\n",
+             prog);
+}
+
+int main (int argc, char *argv[])
+{
+    size_t synthetic_sz = 64 * 1024 * 1024;
+    unsigned char key[32], iv[16];
+    char *data;
+    gsize len;
+    GError *error = NULL;
+    int c, i;
+    int ret = 0;
+
+    while ((c = getopt (argc, argv, "c:e:s:r:h")) != -1) {
+        switch (c) {
+        case 'c':
+            chunker = optarg;
+            break;
+        case 'e':
+            enc_mode = optarg;
+            break;
+        case 's':
+            synthetic_sz = (size_t)atoi (optarg) * 1024 * 1024;
+            break;
+        case 'r':
+            repeats = MAX (atoi (optarg), 1);
+            break;
+        default:
+            usage (argv[0]);
+            exit (1);
+        }
+    }
+
+    cdc_init ();
+
+    memset (key, 0x5e, sizeof(key));
+    memset (iv, 0xaf, sizeof(iv));
+    bench_crypt = seafile_crypt_new (2, key, iv);
+
+    if (optind == argc) {
+        data = gen_random (synthetic_sz);
+        if (bench_all ("synthetic-random", data, synthetic_sz) < 0)
+            ret = 1;
+        g_free (data);
+
+        data = gen_text (synthetic_sz);
+        if (bench_all ("synthetic-text", data, synthetic_sz) < 0)
+            ret = 1;
+        g_free (data);
+    }
+
+    for (i = optind; i < argc; ++i) {
+        if (!g_file_get_contents (argv[i], &data, &len, &error)) {
+            fprintf (stderr, "failed to read %s: %s.\n",
+                     argv[i], error->message);
+            g_clear_error (&error);
+            ret = 1;
+            continue;
+        }
+        if (bench_all (argv[i], data, len) < 0)
+            ret = 1;
+        g_free (data);
+    }
+
+    g_free (bench_crypt);
+    return ret;
+}
@@ -0,0 +1,323 @@
+/* -*- Mode: C; tab-width: 4; indent-tabs-mode: nil; c-basic-offset: 4 -*- */
+
+/*
+ * Block encryption and key derivation benchmark.
+ *
+ * For every encryption version and block size, reports encryption and
+ * decryption throughput through seafile_encrypt/seafile_decrypt, which
+ * allocate the output, and through seafile_encrypt_to_buf and
+ * seafile_decrypt_to_buf, which reuse the caller's buffer and the cipher
+ * context of the thread. The buffer functions are also run on several
+ * threads at once, as the chunk pipeline and block decryption do.
+ *
+ * Each thread processes the same amount of data, so "mb_per_sec_per_core"
+ * stays flat as long as the work scales.
+ *
+ * Key derivation is reported as derivations per second for every version.
+ *
+ * One JSON object is printed per result line, to be collected by scripts.
+ */
+
+#include <unistd.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <getopt.h>
+#include <pthread.h>
+
+#include <glib.h>
+
+#include "seafile-crypt.h"
+#include "utils.h"
+
+#define PASSWD "this_is_user_passwd"
+
+/* Key derivation is repeated for at least this long. */
+#define MIN_DERIVE_USEC 1000000
+
+typedef struct BenchJob {
+    const char *api;            /* "alloc" or "to_buf" */
+    gboolean encrypt;
+    SeafileCrypt *crypt;
+    const char *input;
+    int in_len;
+    gint64 bytes;               /* to process per thread */
+    int ret;
+} BenchJob;
+
+static void *
+bench_thread (void *vjob)
+{
+    BenchJob *job = vjob;
+    gboolean to_buf = (strcmp (job->api, "to_buf") == 0);
+    char *buf = NULL, *out;
+    int out_len;
+    gint64 done;
+    int ret;
+
+    if (to_buf)
+        buf = g_malloc (seafile_encrypted_len (job->in_len));
+
+    for (done = 0; done < job->bytes; done += job->in_len) {
+        if (to_buf) {
+            if (job->encrypt)
+                ret = seafile_encrypt_to_buf (buf, &out_len, job->input,
+                                              job->in_len, job->crypt);
+            else
+                ret = seafile_decrypt_to_buf (buf, &out_len, job->input,
+                                              job->in_len, job->crypt);
+        } else {
+            if (job->encrypt)
+                ret = seafile_encrypt (&out, &out_len, job->input,
+                                       job->in_len, job->crypt);
+            else
+                ret = seafile_decrypt (&out, &out_len, job->input,
+                                       job->in_len, job->crypt);
+            if (ret == 0)
+                g_free (out);
+        }
+        if (ret < 0) {
+            job->ret = -1;
+            break;
+        }
+    }
+
+    g_free (buf);
+    return NULL;
+}
+
+/* Run @n_threads copies of @job. Returns the elapsed time in seconds,
+ * or a negative value on error.
+ */
+static double
+run_jobs (BenchJob *job, int n_threads)
+{
+    pthread_t *threads = g_new0 (pthread_t, n_threads);
+    BenchJob *jobs = g_new0 (BenchJob, n_threads);
+    gint64 start;
+    double elapsed = -1;
+    int i, started = 0;
+
+    start = g_get_monotonic_time ();
+
+    for (i = 0; i < n_threads; ++i) {
+        jobs[i] = *job;
+        if (pthread_create (&threads[i], NULL, bench_thread, &jobs[i]) != 0) {
+            fprintf (stderr, "failed to start thread.\n");
+            break;
+        }
+        ++started;
+    }
+    for (i = 0; i < started; ++i)
+        pthread_join (threads[i], NULL);
+
+    if (started == n_threads) {
+        elapsed = (g_get_monotonic_time () - start) / 1000000.0;
+        for (i = 0; i < n_threads; ++i)
+            if (jobs[i].ret < 0)
+                elapsed = -1;
+    }
+
+    g_free (threads);
+    g_free (jobs);
+    return elapsed;
+}
+
+static int repeats = 3;
+static gint64 bytes_per_run = 256 * 1024 * 1024;
+
+static int
+bench_blocks (int version, SeafileCrypt *crypt, int block_size,
+              const char *api, gboolean encrypt, int n_threads,
+              const char *plain, const char *cipher, int cipher_len)
+{
+    BenchJob job;
+    double t, best = -1;
+    double mb;
+    int i;
+
+    memset (&job, 0, sizeof(job));
+    job.api = api;
+    job.encrypt = encrypt;
+    job.crypt = crypt;
+    job.input = encrypt ? plain : cipher;
+    job.in_len = encrypt ? block_size : cipher_len;
+    job.bytes = MAX (bytes_per_run, job.in_len);
+
+    for (i = 0; i < repeats; ++i) {
+        t = run_jobs (&job, n_threads);
+        if (t < 0) {
+            fprintf (stderr, "failed to %s %d byte blocks.\n",
+                     encrypt ? "encrypt" : "decrypt", block_size);
+            return -1;
+        }
+        if (best < 0 || t < best)
+            best = t;
+    }
+
+    /* Bytes actually processed, rounded up to whole blocks. */
+    mb = (double)((job.bytes + job.in_len - 1) / job.in_len) * job.in_len
+        * n_threads / (1024 * 1024);
+    printf ("{\"op\": \"%s\", \"api\": \"%s\", \"enc_version\": %d, "
+            "\"block_size\": %d, \"threads\": %d, "
+            "\"mb_per_sec\": %.1f, \"mb_per_sec_per_core\": %.1f}\n",
+            encrypt ? "encrypt" : "decrypt", api, version,
+            block_size, n_threads,
+            best > 0 ? mb / best : 0.0,
+            best > 0 ? mb / best / n_threads : 0.0);
+    fflush (stdout);
+
+    return 0;
+}
+
+static int
+bench_version (int version, GArray *block_sizes, GArray *thread_counts)
+{
+    unsigned char key[32], iv[16];
+    SeafileCrypt *crypt;
+    GRand *rand;
+    char *plain, *cipher;
+    int cipher_len;
+    int max_size = 0;
+    int b, t, i;
+    int ret = 0;
+
+    seafile_derive_key (PASSWD, strlen(PASSWD), version, key, iv);
+    crypt = seafile_crypt_new (version, key, iv);
+
+    for (b = 0; b < block_sizes->len; ++b)
+        max_size = MAX (max_size, g_array_index (block_sizes, int, b));
+
+    rand = g_rand_new_with_seed (0x5eaf);
+    plain = g_malloc (max_size);
+    for (i = 0; i < max_size; ++i)
+        plain[i] = g_rand_int (rand) & 0xff;
+    g_rand_free (rand);
+
+    for (b = 0; b < block_sizes->len; ++b) {
+        int block_size = g_array_index (block_sizes, int, b);
+
+        if (seafile_encrypt (&cipher, &cipher_len, plain, block_size, crypt) < 0) {
+            fprintf (stderr, "failed to encrypt %d byte block.\n", block_size);
+            ret = -1;
+            continue;
+        }
+
+        if (bench_blocks (version, crypt, block_size, "alloc", TRUE, 1,
+                          plain, cipher, cipher_len) < 0 ||
+            bench_blocks (version, crypt, block_size, "alloc", FALSE, 1,
+                          plain, cipher, cipher_len) < 0)
+            ret = -1;
+
+        for (t = 0; t < thread_counts->len; ++t) {
+            int n_threads = g_array_index (thread_counts, int, t);
+            if (bench_blocks (version, crypt, block_size, "to_buf", TRUE,
+                              n_threads, plain, cipher, cipher_len) < 0 ||
+                bench_blocks (version, crypt, block_size, "to_buf", FALSE,
+                              n_threads, plain, cipher, cipher_len) < 0)
+                ret = -1;
+        }
+
+        g_free (cipher);
+    }
+
+    g_free (plain);
+    g_free (crypt);
+    return ret;
+}
+
+static void
+bench_derive_key (int version)
+{
+    unsigned char key[32], iv[16];
+    gint64 start, elapsed;
+    int n = 0;
+
+    start = g_get_monotonic_time ();
+    do {
+        seafile_derive_key (PASSWD, strlen(PASSWD), version, key, iv);
+        ++n;
+        elapsed = g_get_monotonic_time () - start;
+    } while (elapsed < MIN_DERIVE_USEC);
+
+    printf ("{\"op\": \"derive_key\", \"enc_version\": %d, "
+            "\"calls\": %d, \"ms_per_call\": %.3f, \"calls_per_sec\": %.1f}\n",
+            version, n, elapsed / 1000.0 / n, n * 1000000.0 / elapsed);
+    fflush (stdout);
+}
+
+static void
+usage (const char *prog)
+{
+    fprintf (stderr,
+             "usage: %s [-v 1|2|all] [-b BLOCK_KB]... [-j MAX_THREADS]\n"
+             "       [-s MB_PER_THREAD] [-r REPEATS] [-K]\n"
+             "Default block sizes are 4, 64, 1024 and 8192 KB. Threads go\n"
+             "from 1 to MAX_THREADS (the number of CPUs) in powers of 2.\n"
+             "-K skips the key derivation benchmark.\n",
+             prog);
+}
+
+int main (int argc, char *argv[])
+{
+    GArray *block_sizes = g_array_new (FALSE, FALSE, sizeof(int));
+    GArray *thread_counts = g_array_new (FALSE, FALSE, sizeof(int));
+    int defaults[] = { 4 << 10, 64 << 10, 1 << 20, 8 << 20 };
+    const char *versions = "all";
+    gboolean derive = TRUE;
+    int max_threads = get_cpu_count ();
+    int c, n, v;
+    int ret = 0;
+
+    while ((c = getopt (argc, argv, "v:b:j:s:r:Kh")) != -1) {
+        switch (c) {
+        case 'v':
+            versions = optarg;
+            break;
+        case 'b':
+            n = atoi (optarg) * 1024;
+            if (n <= 0) {
+                usage (argv[0]);
+                exit (1);
+            }
+            g_array_append_val (block_sizes, n);
+            break;
+        case 'j':
+            max_threads = atoi (optarg);
+            break;
+        case 's':
+            bytes_per_run = (gint64)MAX (atoi (optarg), 1) * 1024 * 1024;
+            break;
+        case 'r':
+            repeats = MAX (atoi (optarg), 1);
+            break;
+        case 'K':
+            derive = FALSE;
+            break;
+        default:
+            usage (argv[0]);
+            exit (1);
+        }
+    }
+
+    if (block_sizes->len == 0)
+        g_array_append_vals (block_sizes, defaults, G_N_ELEMENTS(defaults));
+
+    max_threads = MAX (max_threads, 1);
+    for (n = 1; n < max_threads; n *= 2)
+        g_array_append_val (thread_counts, n);
+    g_array_append_val (thread_counts, max_threads);
+
+    for (v = 1; v <= 2; ++v) {
+        if (strcmp (versions, "all") != 0 && atoi (versions) != v)
+            continue;
+        if (bench_version (v, block_sizes, thread_counts) < 0)
+            ret = 1;
+        if (derive)
+            bench_derive_key (v);
+    }
+
+    g_array_free (block_sizes, TRUE);
+    g_array_free (thread_counts, TRUE);
+    return ret;
+}
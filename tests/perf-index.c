@@ -0,0 +1,553 @@
+/* -*- Mode: C; tab-width: 4; indent-tabs-mode: nil; c-basic-offset: 4 -*- */
+
+/*
+ * Index and cache-tree performance test.
+ *
+ * For every index size, builds an index of synthetic entries, writes and
+ * reads it back, looks names up, inserts entries into existing dirs,
+ * renames and removes dirs, and builds cache trees before and after the
+ * edits, the way a commit does. After the edits, the tree is built both
+ * from the dir ids kept in the index and from scratch, which must give
+ * the same root. The edits are then appended to the index file, which is
+ * read back and must give that root too. Every phase is timed.
+ *
+ * One JSON object is printed per phase. With -w the times are also saved
+ * as a baseline; with -b the run fails if a phase got slower than the
+ * baseline by more than the tolerance. Baselines are only meaningful on
+ * the machine they were recorded on.
+ */
+
+#include <unistd.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <getopt.h>
+
+#include <glib.h>
+
+#include "index.h"
+#include "cache-tree.h"
+#include "seaf-sha1.h"
+#include "utils.h"
+
+/* Layout of the synthetic tree: t%05d/s%03d/f%03d.txt */
+#define FILES_PER_DIR 50
+#define SUBDIRS_PER_DIR 100
+
+/* Dirs renamed and removed, each. */
+#define N_DIR_EDITS 100
+
+#define MAX_LOOKUPS 200000
+
+/* Slowdowns smaller than this are taken as noise. */
+#define MIN_REGRESSION_MS 20.0
+
+#define DEFAULT_TOLERANCE 25
+
+#define MODIFIER "perf@seafile.com"
+
+typedef struct PhaseResult {
+    int entries;
+    char *phase;
+    double ms;
+} PhaseResult;
+
+static GList *results = NULL;
+static GHashTable *baseline = NULL;
+static int tolerance = DEFAULT_TOLERANCE;
+static int n_regressions = 0;
+
+static char *
+baseline_key (int entries, const char *phase)
+{
+    return g_strdup_printf ("%d %s", entries, phase);
+}
+
+static void
+report (int entries, const char *phase, gint64 start, int ops)
+{
+    double ms = (g_get_monotonic_time () - start) / 1000.0;
+    PhaseResult *res;
+    double *base = NULL;
+    char *key;
+
+    printf ("{\"entries\": %d, \"phase\": \"%s\", \"ms\": %.1f, "
+            "\"ops\": %d, \"ops_per_sec\": %.0f}\n",
+            entries, phase, ms, ops, ms > 0 ? ops / ms * 1000 : 0.0);
+    fflush (stdout);
+
+    res = g_new0 (PhaseResult, 1);
+    res->entries = entries;
+    res->phase = g_strdup (phase);
+    res->ms = ms;
+    results = g_list_prepend (results, res);
+
+    if (!baseline)
+        return;
+
+    key = baseline_key (entries, phase);
+    base = g_hash_table_lookup (baseline, key);
+    g_free (key);
+    if (base && ms > *base * (100 + tolerance) / 100 &&
+        ms - *base > MIN_REGRESSION_MS) {
+        fprintf (stderr, "REGRESSION: %s with %d entries took %.1f ms, "
+                 "baseline %.1f ms.\n", phase, entries, ms, *base);
+        ++n_regressions;
+    }
+}
+
+/* Baseline lines are "ENTRIES PHASE MS". */
+static int
+load_baseline (const char *path)
+{
+    FILE *fp;
+    char phase[64];
+    int entries;
+    double ms;
+
+    fp = fopen (path, "r");
+    if (!fp) {
+        fprintf (stderr, "failed to open baseline %s.\n", path);
+        return -1;
+    }
+
+    baseline = g_hash_table_new_full (g_str_hash, g_str_equal, g_free, g_free);
+    while (fscanf (fp, "%d %63s %lf", &entries, phase, &ms) == 3) {
+        double *value = g_new (double, 1);
+        *value = ms;
+        g_hash_table_replace (baseline, baseline_key (entries, phase), value);
+    }
+
+    fclose (fp);
+    return 0;
+}
+
+static int
+save_baseline (const char *path)
+{
+    FILE *fp;
+    GList *ptr;
+    PhaseResult *res;
+
+    fp = fopen (path, "w");
+    if (!fp) {
+        fprintf (stderr, "failed to write baseline %s.\n", path);
+        return -1;
+    }
+
+    results = g_list_reverse (results);
+    for (ptr = results; ptr; ptr = ptr->next) {
+        res = ptr->data;
+        fprintf (fp, "%d %s %.1f\n", res->entries, res->phase, res->ms);
+    }
+
+    fclose (fp);
+    return 0;
+}
+
+static void
+file_path (GString *buf, int i)
+{
+    int dir = i / FILES_PER_DIR;
+
+    g_string_printf (buf, "t%05d/s%03d/f%03d.txt",
+                     dir / SUBDIRS_PER_DIR, dir % SUBDIRS_PER_DIR,
+                     i % FILES_PER_DIR);
+}
+
+static void
+dir_path (GString *buf, int dir)
+{
+    g_string_printf (buf, "t%05d/s%03d",
+                     dir / SUBDIRS_PER_DIR, dir % SUBDIRS_PER_DIR);
+}
+
+static struct cache_entry *
+new_entry (const char *path, int seq)
+{
+    unsigned char sha1[20];
+    struct cache_entry *ce;
+
+    seaf_sha1 (&seq, sizeof(seq), sha1);
+    ce = make_cache_entry (S_IFREG | 0644, sha1, path, NULL, 0, 0);
+    ce->ce_mtime.sec = 1400000000 + seq;
+    ce->ce_ctime.sec = ce->ce_mtime.sec;
+    ce->ce_size = seq;
+    ce->modifier = g_strdup (MODIFIER);
+    return ce;
+}
+
+/*
+ * Like commit_trees_cb(), but only hashes the names and ids of the
+ * entries of a level, without creating dir objects.
+ */
+static int
+perf_commit_cb (const char *repo_id, int version,
+                const char *worktree,
+                struct cache_tree *it, struct cache_entry **cache,
+                int entries, const char *base, int baselen)
+{
+    SeafSHA1Ctx ctx;
+    struct cache_entry *ce;
+    struct cache_tree_sub *sub;
+    const char *path, *slash;
+    int pathlen, entlen;
+    int i;
+
+    seaf_sha1_init (&ctx);
+
+    for (i = 0; i < entries; i++) {
+        ce = cache[i];
+        if (ce->ce_flags & CE_REMOVE)
+            continue;
+
+        path = ce->name;
+        pathlen = ce_namelen(ce);
+        if (pathlen <= baselen || memcmp(base, path, baselen))
+            break;
+
+        slash = strchr(path + baselen, '/');
+        if (slash) {
+            entlen = slash - (path + baselen);
+            sub = cache_tree_find_subtree(it, path + baselen, entlen, 0);
+            g_return_val_if_fail (sub != NULL, -1);
+            i += sub->cache_tree->entry_count - 1;
+
+            seaf_sha1_update (&ctx, path + baselen, entlen);
+            seaf_sha1_update (&ctx, sub->cache_tree->sha1, 20);
+        } else {
+            seaf_sha1_update (&ctx, path + baselen, pathlen - baselen);
+            seaf_sha1_update (&ctx, ce->sha1, 20);
+        }
+    }
+
+    seaf_sha1_final (it->sha1, &ctx);
+    return 0;
+}
+
+/* With @prime, only the dirs changed since the last build are built. */
+static int
+build_cache_tree (struct index_state *istate, int n, const char *phase,
+                  gboolean prime, unsigned char *root_sha1)
+{
+    struct cache_tree *it;
+    gint64 start;
+
+    start = g_get_monotonic_time ();
+    it = cache_tree ();
+    if (prime)
+        cache_tree_prime (it, istate, 1);
+    if (cache_tree_update (NULL, 1, NULL, it,
+                           istate->cache, istate->cache_nr,
+                           0, 0, perf_commit_cb) < 0) {
+        fprintf (stderr, "failed to build cache tree.\n");
+        cache_tree_free (&it);
+        return -1;
+    }
+    cache_tree_record_ids (it, istate);
+    if (root_sha1)
+        memcpy (root_sha1, it->sha1, 20);
+    cache_tree_free (&it);
+    report (n, phase, start, istate->cache_nr);
+
+    return 0;
+}
+
+/* Like update_index(), the file read may still be mapped. */
+static int
+save_index (struct index_state *istate, const char *path)
+{
+    char *shadow = g_strconcat (path, ".shadow", NULL);
+    int fd;
+    int ret = -1;
+
+    fd = seaf_util_create (shadow, O_RDWR | O_CREAT | O_TRUNC | O_BINARY, 0666);
+    if (fd < 0) {
+        fprintf (stderr, "failed to create %s.\n", shadow);
+        goto out;
+    }
+    if (write_index (istate, fd) < 0) {
+        fprintf (stderr, "failed to write %s.\n", shadow);
+        close (fd);
+        goto out;
+    }
+    close (fd);
+
+    if (seaf_util_rename (shadow, path) < 0) {
+        fprintf (stderr, "failed to rename %s.\n", shadow);
+        goto out;
+    }
+    ret = 0;
+
+out:
+    g_free (shadow);
+    return ret;
+}
+
+/* Whether any entry is at or under @path. */
+static gboolean
+has_prefix (struct index_state *istate, const char *path)
+{
+    int len = strlen (path);
+    int pos = index_name_pos (istate, path, len);
+
+    if (pos >= 0)
+        return TRUE;
+    pos = -pos - 1;
+    return (pos < istate->cache_nr &&
+            strncmp (istate->cache[pos]->name, path, len) == 0 &&
+            istate->cache[pos]->name[len] == '/');
+}
+
+static int
+perf_index (int n, const char *dir)
+{
+    struct index_state istate, appended;
+    struct cache_entry *ce;
+    char *index_path, *missing;
+    GString *path = g_string_new (NULL);
+    GString *dst = g_string_new (NULL);
+    GRand *rand = g_rand_new_with_seed (0x5eaf);
+    int n_dirs = (n + FILES_PER_DIR - 1) / FILES_PER_DIR;
+    int n_edits = MIN (N_DIR_EDITS, n_dirs / 2);
+    int step = n_edits ? n_dirs / n_edits : 0;
+    int n_lookups = MIN (n, MAX_LOOKUPS);
+    int n_inserts = n / 100;
+    gboolean not_found;
+    unsigned char primed_sha1[20], full_sha1[20], appended_sha1[20];
+    gint64 start;
+    int i, k, rc;
+    int ret = -1;
+
+    index_path = g_build_filename (dir, "perf-index", NULL);
+    seaf_util_unlink (index_path);
+
+    memset (&istate, 0, sizeof(istate));
+    memset (&appended, 0, sizeof(appended));
+    /* A missing index file gives an empty index. */
+    if (read_index_from (&istate, index_path, 1) < 0)
+        goto out;
+
+    /* Entries come in path order, as when a worktree is scanned. */
+    start = g_get_monotonic_time ();
+    for (i = 0; i < n; ++i) {
+        file_path (path, i);
+        if (add_index_entry (&istate, new_entry (path->str, i),
+                             ADD_CACHE_OK_TO_ADD) < 0) {
+            fprintf (stderr, "failed to add %s.\n", path->str);
+            goto out;
+        }
+    }
+    report (n, "add", start, n);
+
+    if (build_cache_tree (&istate, n, "cache_tree", FALSE, NULL) < 0)
+        goto out;
+
+    start = g_get_monotonic_time ();
+    if (save_index (&istate, index_path) < 0)
+        goto out;
+    report (n, "write", start, n);
+
+    discard_index (&istate);
+    memset (&istate, 0, sizeof(istate));
+
+    start = g_get_monotonic_time ();
+    if (read_index_from (&istate, index_path, 1) < 0 || istate.cache_nr != n) {
+        fprintf (stderr, "failed to read back %s.\n", index_path);
+        goto out;
+    }
+    report (n, "read", start, n);
+
+    /* Half the names exist, half are missing from existing dirs. */
+    start = g_get_monotonic_time ();
+    for (k = 0; k < n_lookups; ++k) {
+        i = g_rand_int_range (rand, 0, n);
+        file_path (path, i);
+        if (k % 2 == 0) {
+            ce = index_name_exists (&istate, path->str, path->len, 0);
+            if (!ce || strcmp (ce->name, path->str) != 0) {
+                fprintf (stderr, "lookup of %s failed.\n", path->str);
+                goto out;
+            }
+        } else {
+            missing = path->str + path->len - strlen ("f000.txt");
+            *missing = 'x';
+            if (index_name_exists (&istate, path->str, path->len, 0) != NULL) {
+                fprintf (stderr, "found missing %s.\n", path->str);
+                goto out;
+            }
+        }
+    }
+    report (n, "lookup", start, n_lookups);
+
+    /* New files in random dirs, which moves the entries after them. */
+    start = g_get_monotonic_time ();
+    for (k = 0; k < n_inserts; ++k) {
+        dir_path (path, g_rand_int_range (rand, 0, n_dirs));
+        g_string_append_printf (path, "/g%06d.txt", k);
+        if (add_index_entry (&istate, new_entry (path->str, n + k),
+                             ADD_CACHE_OK_TO_ADD) < 0) {
+            fprintf (stderr, "failed to add %s.\n", path->str);
+            goto out;
+        }
+    }
+    report (n, "insert", start, n_inserts);
+
+    start = g_get_monotonic_time ();
+    for (k = 0; k < n_edits; ++k) {
+        dir_path (path, k * step);
+        g_string_printf (dst, "t%05d/r%03d",
+                         (k * step) / SUBDIRS_PER_DIR, (k * step) % SUBDIRS_PER_DIR);
+        if (rename_index_entries (&istate, path->str, dst->str,
+                                  &not_found, NULL, NULL) < 0 || not_found) {
+            fprintf (stderr, "failed to rename %s.\n", path->str);
+            goto out;
+        }
+    }
+    report (n, "rename", start, n_edits);
+
+    start = g_get_monotonic_time ();
+    for (k = 0; k < n_edits; ++k) {
+        dir_path (path, k * step + step / 2);
+        if (remove_from_index_with_prefix (&istate, path->str, &not_found) < 0 ||
+            not_found) {
+            fprintf (stderr, "failed to remove %s.\n", path->str);
+            goto out;
+        }
+    }
+    report (n, "remove", start, n_edits);
+
+    for (k = 0; k < n_edits; ++k) {
+        dir_path (path, k * step);
+        if (has_prefix (&istate, path->str)) {
+            fprintf (stderr, "%s still in index after rename.\n", path->str);
+            goto out;
+        }
+        dir_path (path, k * step + step / 2);
+        if (has_prefix (&istate, path->str)) {
+            fprintf (stderr, "%s still in index after remove.\n", path->str);
+            goto out;
+        }
+    }
+
+    /* From the ids read back with the index, then from scratch. */
+    if (build_cache_tree (&istate, n, "cache_tree_primed", TRUE, primed_sha1) < 0 ||
+        build_cache_tree (&istate, n, "cache_tree_after_edit", FALSE, full_sha1) < 0)
+        goto out;
+    if (memcmp (primed_sha1, full_sha1, 20) != 0) {
+        fprintf (stderr, "primed cache tree differs from a full build.\n");
+        goto out;
+    }
+
+    /* As update_index() does, a full write when there is too much to append. */
+    start = g_get_monotonic_time ();
+    rc = append_index (&istate, index_path);
+    if (rc < 0 || (rc > 0 && save_index (&istate, index_path) < 0)) {
+        fprintf (stderr, "failed to append to %s.\n", index_path);
+        goto out;
+    }
+    report (n, "append_after_edit", start, istate.cache_nr);
+
+    start = g_get_monotonic_time ();
+    if (read_index_from (&appended, index_path, 1) < 0 ||
+        appended.cache_nr != istate.cache_nr) {
+        fprintf (stderr, "failed to read back %s after append.\n", index_path);
+        goto out;
+    }
+    report (n, "read_after_append", start, appended.cache_nr);
+
+    if (build_cache_tree (&appended, n, "cache_tree_after_append", TRUE,
+                          appended_sha1) < 0)
+        goto out;
+    if (memcmp (appended_sha1, full_sha1, 20) != 0) {
+        fprintf (stderr, "index read back after append differs.\n");
+        goto out;
+    }
+
+    start = g_get_monotonic_time ();
+    if (save_index (&istate, index_path) < 0)
+        goto out;
+    report (n, "write_after_edit", start, istate.cache_nr);
+
+    ret = 0;
+
+out:
+    discard_index (&istate);
+    discard_index (&appended);
+    seaf_util_unlink (index_path);
+    g_free (index_path);
+    g_string_free (path, TRUE);
+    g_string_free (dst, TRUE);
+    g_rand_free (rand);
+    return ret;
+}
+
+static void
+usage (const char *prog)
+{
+    fprintf (stderr,
+             "usage: %s [-n ENTRIES]... [-b BASELINE] [-w BASELINE]\n"
+             "       [-t TOLERANCE_PERCENT] [-d DIR]\n"
+             "Default sizes are 100000, 500000 and 2000000 entries.\n",
+             prog);
+}
+
+int main (int argc, char *argv[])
+{
+    GArray *sizes = g_array_new (FALSE, FALSE, sizeof(int));
+    const char *baseline_in = NULL, *baseline_out = NULL;
+    const char *dir = g_get_tmp_dir ();
+    int defaults[] = { 100000, 500000, 2000000 };
+    int c, i, n;
+    int ret = 0;
+
+    while ((c = getopt (argc, argv, "n:b:w:t:d:h")) != -1) {
+        switch (c) {
+        case 'n':
+            n = atoi (optarg);
+            if (n <= 0) {
+                usage (argv[0]);
+                exit (1);
+            }
+            g_array_append_val (sizes, n);
+            break;
+        case 'b':
+            baseline_in = optarg;
+            break;
+        case 'w':
+            baseline_out = optarg;
+            break;
+        case 't':
+            tolerance = MAX (atoi (optarg), 0);
+            break;
+        case 'd':
+            dir = optarg;
+            break;
+        default:
+            usage (argv[0]);
+            exit (1);
+        }
+    }
+
+    if (sizes->len == 0)
+        g_array_append_vals (sizes, defaults, G_N_ELEMENTS(defaults));
+
+    if (baseline_in && load_baseline (baseline_in) < 0)
+        exit (1);
+
+    for (i = 0; i < sizes->len; ++i) {
+        if (perf_index (g_array_index (sizes, int, i), dir) < 0)
+            ret = 1;
+    }
+
+    if (baseline_out && save_baseline (baseline_out) < 0)
+        ret = 1;
+
+    if (n_regressions > 0) {
+        fprintf (stderr, "%d phases slower than the baseline.\n", n_regressions);
+        ret = 1;
+    }
+
+    g_array_free (sizes, TRUE);
+    return ret;
+}
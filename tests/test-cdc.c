@@ -101,24 +101,90 @@ int test_write_chunk (const char *repo_id,
     return ret;
 }
 
+/* Chunk the file again through the streaming interface, in pieces of
+ * varying size, and check that the result is the same.
+ */
+static int
+test_stream (const char *filename, CDCFileDescriptor *expected)
+{
+    CDCFileDescriptor file_descr;
+    CDCStream *stream;
+    char buf[100000];
+    int fd, n, piece = 1;
+    int ret = 0;
+
+    fd = g_open (filename, O_RDONLY | O_BINARY, 0);
+    if (fd < 0) {
+        perror ("open");
+        return -1;
+    }
+
+    memset (&file_descr, 0, sizeof (file_descr));
+    file_descr.write_block = test_write_chunk;
+    file_descr.algorithm = expected->algorithm;
+    stream = cdc_stream_new (&file_descr, 0, NULL, TRUE);
+    if (!stream) {
+        close (fd);
+        return -1;
+    }
+
+    while ((n = read (fd, buf, piece)) > 0) {
+        if (cdc_stream_feed (stream, buf, n) < 0) {
+            ret = -1;
+            goto out;
+        }
+        piece = (piece * 7 + 13) % sizeof(buf) + 1;
+    }
+    if (n < 0 || cdc_stream_finish (stream) < 0) {
+        ret = -1;
+        goto out;
+    }
+
+    if (file_descr.block_nr != expected->block_nr ||
+        memcmp (file_descr.blk_sha1s, expected->blk_sha1s,
+                expected->block_nr * CHECKSUM_LENGTH) != 0 ||
+        memcmp (file_descr.file_sum, expected->file_sum,
+                CHECKSUM_LENGTH) != 0) {
+        fprintf (stderr, "stream chunks differ from file chunks.\n");
+        ret = -1;
+    }
+
+out:
+    cdc_stream_free (stream);
+    free (file_descr.blk_sha1s);
+    close (fd);
+    return ret;
+}
+
 int main (int argc, char *argv[])
 {
     char *src_filename = NULL;
     int ret = 0, fd_src;
+    int algorithm = CDC_ALGO_RABIN;
     CDCFileDescriptor file_descr;
 
     if (argc < 3) {
-        fprintf(stderr, "%s SOURCE DEST \n", argv[0]);
+        fprintf(stderr, "%s SOURCE DEST [rabin|fastcdc]\n", argv[0]);
         exit(0);
     } else {
         src_filename = argv[1];
         dest_dir = argv[2];
     }
 
+    if (argc > 3) {
+        if (strcmp (argv[3], "fastcdc") == 0)
+            algorithm = CDC_ALGO_FASTCDC;
+        else if (strcmp (argv[3], "rabin") != 0) {
+            fprintf (stderr, "unknown chunking algorithm %s.\n", argv[3]);
+            exit(1);
+        }
+    }
+
     cdc_init ();
     
     memset (&file_descr, 0, sizeof (file_descr));
     file_descr.write_block = test_write_chunk;
+    file_descr.algorithm = algorithm;
     ret = filename_chunk_cdc (src_filename, &file_descr, NULL, TRUE);
     if (ret == -1) {
         fprintf(stderr, "file chunk failed\n");
@@ -131,6 +197,12 @@ int main (int argc, char *argv[])
         exit(1);
     }
 
+    ret = test_stream (src_filename, &file_descr);
+    if (ret < 0) {
+        fprintf (stderr, "stream test failed.\n");
+        exit(1);
+    }
+
     printf ("test passed.\n");
     return 0;
 }